@@ -0,0 +1,102 @@
+include(CMakeParseArguments)
+include(cc_library)
+
+# triton_aot_library()
+# CMake function to AOT compile a triton kernel into a C library that embeds
+# the cubin, one dispatcher per dtype. The kernel is compiled at configure
+# time, like the generated marlin kernels, so the generated files are known
+# when the library is defined.
+#
+# Parameters:
+# NAME: name of target
+# KERNEL: the python file of the kernel
+# KERNEL_NAME: the name of the triton.jit function
+# DTYPES: the dtypes to compile for, e.g. fp16 bf16 fp32
+# SIGNATURES: the signatures to compile for each dtype, "{dtype}" is replaced
+#   with the dtype. all signatures of a dtype share one dispatcher.
+# GRID: the launch grid, in terms of the kernel arguments
+# NUM_WARPS: number of warps of the kernel
+# NUM_STAGES: number of pipeline stages of the kernel
+# DEPS: List of other libraries to be linked in to the library
+#
+# triton_aot_library(
+#   NAME
+#     add.triton
+#   KERNEL
+#     kernel.py
+#   KERNEL_NAME
+#     add_kernel
+#   DTYPES
+#     fp16 fp32
+#   SIGNATURES
+#     "*{dtype}, *{dtype}, *{dtype}, i32, 16"
+#   GRID
+#     "(n_elements + 15) / 16, 1, 1"
+# )
+# generates add_kernel_{dtype}.h with load_add_kernel_{dtype}(),
+# unload_add_kernel_{dtype}() and add_kernel_{dtype}_default().
+#
+function(triton_aot_library)
+  if(NOT BUILD_TRITON_KERNELS)
+    return()
+  endif()
+
+  cmake_parse_arguments(
+    TRITON_LIB # prefix
+    "" # options
+    "NAME;KERNEL;KERNEL_NAME;GRID;NUM_WARPS;NUM_STAGES" # one value args
+    "DTYPES;SIGNATURES;DEPS" # multi value args
+    ${ARGN}
+  )
+
+  if(NOT TRITON_LIB_NUM_WARPS)
+    set(TRITON_LIB_NUM_WARPS 4)
+  endif()
+  if(NOT TRITON_LIB_NUM_STAGES)
+    set(TRITON_LIB_NUM_STAGES 3)
+  endif()
+
+  # copy the kernel to binary dir in order to force re-configuration when
+  # the kernel changes
+  set(_KERNEL ${CMAKE_CURRENT_SOURCE_DIR}/${TRITON_LIB_KERNEL})
+  set(_OUT_DIR ${CMAKE_CURRENT_BINARY_DIR}/${TRITON_LIB_NAME})
+  configure_file(${_KERNEL} ${_OUT_DIR}/${TRITON_LIB_KERNEL} COPYONLY)
+
+  set(_SIGNATURE_ARGS "")
+  foreach(signature IN LISTS TRITON_LIB_SIGNATURES)
+    list(APPEND _SIGNATURE_ARGS --signature "${signature}")
+  endforeach()
+
+  execute_process(
+    COMMAND ${Python_EXECUTABLE} ${TRITON_AOT_COMPILE_SCRIPT}
+      --kernel ${_KERNEL}
+      --kernel-name ${TRITON_LIB_KERNEL_NAME}
+      --dtypes ${TRITON_LIB_DTYPES}
+      ${_SIGNATURE_ARGS}
+      --grid "${TRITON_LIB_GRID}"
+      --num-warps ${TRITON_LIB_NUM_WARPS}
+      --num-stages ${TRITON_LIB_NUM_STAGES}
+      --out-dir ${_OUT_DIR}/aot
+    RESULT_VARIABLE _RESULT
+  )
+  if(NOT _RESULT EQUAL 0)
+    message(FATAL_ERROR
+      "Failed to compile triton kernel ${TRITON_LIB_KERNEL_NAME}")
+  endif()
+
+  file(GLOB_RECURSE _AOT_HEADERS ${_OUT_DIR}/aot/*.h)
+  file(GLOB_RECURSE _AOT_SOURCES ${_OUT_DIR}/aot/*.c)
+
+  cc_library(
+    NAME
+      ${TRITON_LIB_NAME}
+    HDRS
+      ${_AOT_HEADERS}
+    SRCS
+      ${_AOT_SOURCES}
+    DEPS
+      ${TRITON_LIB_DEPS}
+      CUDA::driver
+  )
+  target_include_directories(${TRITON_LIB_NAME} PUBLIC ${_OUT_DIR}/aot)
+endfunction()
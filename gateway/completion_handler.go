@@ -5,10 +5,8 @@ import (
 	"io"
 	"net/http"
 
-	"github.com/golang/glog"
 	"github.com/grpc-ecosystem/grpc-gateway/v2/utilities"
 
-	"google.golang.org/grpc"
 	"google.golang.org/grpc/codes"
 	"google.golang.org/grpc/status"
 	"google.golang.org/protobuf/proto"
@@ -19,19 +17,23 @@ import (
 	gw "github.com/grpc-ecosystem/grpc-gateway/v2/runtime"
 )
 
-func SendCompleteRequest(ctx context.Context, marshaler gw.Marshaler, client scalellm.CompletionClient, req *http.Request) (scalellm.Completion_CompleteClient, bool, error) {
+// SendCompleteRequest forwards the request to the backend picked by its
+// prefix, release should be called once the response is consumed.
+func SendCompleteRequest(ctx context.Context, marshaler gw.Marshaler, router *Router, req *http.Request) (scalellm.Completion_CompleteClient, bool, func(), error) {
 	var protoReq scalellm.CompletionRequest
 	newReader, berr := utilities.IOReaderFactory(req.Body)
 	if berr != nil {
-		return nil, false, status.Errorf(codes.InvalidArgument, "%v", berr)
+		return nil, false, nil, status.Errorf(codes.InvalidArgument, "%v", berr)
 	}
 	if err := marshaler.NewDecoder(newReader()).Decode(&protoReq); err != nil && err != io.EOF {
-		return nil, false, status.Errorf(codes.InvalidArgument, "%v", err)
+		return nil, false, nil, status.Errorf(codes.InvalidArgument, "%v", err)
 	}
 
-	stream, err := client.Complete(ctx, &protoReq)
+	backend, release := router.Acquire(protoReq.GetModel(), router.CompletionKey(&protoReq))
+	stream, err := backend.completion.Complete(ctx, &protoReq)
 	if err != nil {
-		return nil, false, err
+		release()
+		return nil, false, nil, err
 	}
 
 	var nCompletions uint32 = 1
@@ -40,43 +42,22 @@ func SendCompleteRequest(ctx context.Context, marshaler gw.Marshaler, client sca
 	}
 	// results cannot be streamed when best_of != n
 	isStream := protoReq.Stream != nil && *protoReq.Stream && (protoReq.BestOf == nil || *protoReq.BestOf == nCompletions)
-	return stream, isStream, nil
+	return stream, isStream, release, nil
 
 }
 
-func RegisterCompletionHandlerClient(ctx context.Context, handler *HttpHandler, client scalellm.CompletionClient) error {
+func RegisterCompletionHandler(ctx context.Context, handler *HttpHandler, router *Router) error {
 
 	handler.Handle("POST", "/v1/completions", func(w http.ResponseWriter, req *http.Request) {
 		ctx, cancel := context.WithCancel(req.Context())
 		defer cancel()
-		resp, isStream, err := SendCompleteRequest(ctx, handler.marshaler, client, req)
+		resp, isStream, release, err := SendCompleteRequest(ctx, handler.marshaler, router, req)
 		if err != nil {
 			DefaultErrorHandler(ctx, handler.marshaler, w, req, err)
 			return
 		}
+		defer release()
 		ForwardResponseStream(ctx, handler.marshaler, w, req, isStream, func() (proto.Message, error) { return resp.Recv() })
 	})
 	return nil
 }
-
-func RegisterCompletionHandlerFromEndpoint(ctx context.Context, httpServer *HttpHandler, endpoint string, opts []grpc.DialOption) (err error) {
-	conn, err := grpc.DialContext(ctx, endpoint, opts...)
-	if err != nil {
-		return err
-	}
-	defer func() {
-		if err != nil {
-			if cerr := conn.Close(); cerr != nil {
-				glog.Errorf("Failed to close conn to %s: %v", endpoint, cerr)
-			}
-			return
-		}
-		go func() {
-			<-ctx.Done()
-			if cerr := conn.Close(); cerr != nil {
-				glog.Errorf("Failed to close conn to %s: %v", endpoint, cerr)
-			}
-		}()
-	}()
-	return RegisterCompletionHandlerClient(ctx, httpServer, scalellm.NewCompletionClient(conn))
-}
@@ -4,6 +4,8 @@ import (
 	"context"
 	"flag"
 	"net/http"
+	"strings"
+	"time"
 
 	"github.com/golang/glog"
 	"google.golang.org/grpc"
@@ -14,9 +16,14 @@ import (
 
 var (
 	// command-line options:
-	// gRPC server endpoint
-	grpcServerEndpoint = flag.String("grpc-server", "127.0.0.1:8888", "gRPC server endpoint")
-	httpServerEndpoint = flag.String("http-server", "0.0.0.0:8080", "HTTP server endpoint")
+	// gRPC server endpoints, requests are routed among them by prompt prefix
+	grpcServerEndpoint   = flag.String("grpc-server", "127.0.0.1:8888", "comma separated gRPC server endpoints")
+	httpServerEndpoint   = flag.String("http-server", "0.0.0.0:8080", "HTTP server endpoint")
+	routingPrefixLen     = flag.Int("routing-prefix-len", 256, "number of leading prompt bytes to route requests by, requests sharing them go to the same gRPC server to reuse its prefix cache")
+	routingLoadFactor    = flag.Float64("routing-load-factor", 1.25, "max ratio of the in flight requests of a gRPC server to the average before requests overflow to the next one")
+	loadReportInterval   = flag.Duration("load-report-interval", 100*time.Millisecond, "interval of the load reports streamed from the gRPC servers, 0 to route by in flight requests only")
+	routingTTFTPromptLen = flag.Int("routing-ttft-prompt-len", 512, "prompt length in tokens the gRPC servers estimate the time to first token for in their load reports")
+	routingTTFTSlack     = flag.Duration("routing-ttft-slack", 200*time.Millisecond, "slack over routing-load-factor times the least estimated time to first token before requests overflow to the next gRPC server")
 )
 
 func run() error {
@@ -29,23 +36,28 @@ func run() error {
 	handler := NewHttpHandler(&gw.JSONPb{})
 	// TODO: add TLS credentials
 	opts := []grpc.DialOption{grpc.WithTransportCredentials(insecure.NewCredentials())}
+	router, err := NewRouter(ctx, strings.Split(*grpcServerEndpoint, ","), opts, *routingPrefixLen, *routingLoadFactor, *loadReportInterval, *routingTTFTPromptLen, *routingTTFTSlack)
+	if err != nil {
+		glog.Error("Failed to connect to grpc servers ", err)
+		return err
+	}
+	glog.Info("Register grpc servers at ", *grpcServerEndpoint)
 	// register completion handler
-	err := RegisterCompletionHandlerFromEndpoint(ctx, handler, *grpcServerEndpoint, opts)
+	err = RegisterCompletionHandler(ctx, handler, router)
 	if err != nil {
-		glog.Error("Failed to register completion handler from endpoint ", err)
+		glog.Error("Failed to register completion handler ", err)
 		return err
 	}
-	glog.Info("Register grpc server at ", *grpcServerEndpoint)
 	// register chat handler
-	err = RegisterChatHandlerFromEndpoint(ctx, handler, *grpcServerEndpoint, opts)
+	err = RegisterChatHandler(ctx, handler, router)
 	if err != nil {
-		glog.Error("Failed to register chat handler from endpoint ", err)
+		glog.Error("Failed to register chat handler ", err)
 		return err
 	}
 	// register models handler
-	err = RegisterModelsHandlerFromEndpoint(ctx, handler, *grpcServerEndpoint, opts)
+	err = RegisterModelsHandler(ctx, handler, router)
 	if err != nil {
-		glog.Error("Failed to register models handler from endpoint ", err)
+		glog.Error("Failed to register models handler ", err)
 		return err
 	}
 
@@ -5,10 +5,8 @@ import (
 	"io"
 	"net/http"
 
-	"github.com/golang/glog"
 	"github.com/grpc-ecosystem/grpc-gateway/v2/utilities"
 
-	"google.golang.org/grpc"
 	"google.golang.org/grpc/codes"
 	"google.golang.org/grpc/status"
 
@@ -18,7 +16,7 @@ import (
 	gw "github.com/grpc-ecosystem/grpc-gateway/v2/runtime"
 )
 
-func SendModelsRequest(ctx context.Context, marshaler gw.Marshaler, client scalellm.ModelsClient, req *http.Request) (*scalellm.ListResponse, error) {
+func SendModelsRequest(ctx context.Context, marshaler gw.Marshaler, router *Router, req *http.Request) (*scalellm.ListResponse, error) {
 	// TODO: add support for path parameters
 	var protoReq scalellm.ListRequest
 	newReader, berr := utilities.IOReaderFactory(req.Body)
@@ -29,7 +27,10 @@ func SendModelsRequest(ctx context.Context, marshaler gw.Marshaler, client scale
 		return nil, status.Errorf(codes.InvalidArgument, "%v", err)
 	}
 
-	resp, err := client.List(ctx, &protoReq)
+	// all backends serve the same models
+	backend, release := router.Acquire("", "")
+	defer release()
+	resp, err := backend.models.List(ctx, &protoReq)
 	if err != nil {
 		return nil, err
 	}
@@ -37,12 +38,12 @@ func SendModelsRequest(ctx context.Context, marshaler gw.Marshaler, client scale
 
 }
 
-func RegisterModelsHandlerClient(ctx context.Context, handler *HttpHandler, client scalellm.ModelsClient) error {
+func RegisterModelsHandler(ctx context.Context, handler *HttpHandler, router *Router) error {
 
 	handler.Handle("GET", "/v1/models", func(w http.ResponseWriter, req *http.Request) {
 		ctx, cancel := context.WithCancel(req.Context())
 		defer cancel()
-		resp, err := SendModelsRequest(ctx, handler.marshaler, client, req)
+		resp, err := SendModelsRequest(ctx, handler.marshaler, router, req)
 		if err != nil {
 			DefaultErrorHandler(ctx, handler.marshaler, w, req, err)
 			return
@@ -51,25 +52,3 @@ func RegisterModelsHandlerClient(ctx context.Context, handler *HttpHandler, clie
 	})
 	return nil
 }
-
-func RegisterModelsHandlerFromEndpoint(ctx context.Context, httpServer *HttpHandler, endpoint string, opts []grpc.DialOption) (err error) {
-	conn, err := grpc.DialContext(ctx, endpoint, opts...)
-	if err != nil {
-		return err
-	}
-	defer func() {
-		if err != nil {
-			if cerr := conn.Close(); cerr != nil {
-				glog.Errorf("Failed to close conn to %s: %v", endpoint, cerr)
-			}
-			return
-		}
-		go func() {
-			<-ctx.Done()
-			if cerr := conn.Close(); cerr != nil {
-				glog.Errorf("Failed to close conn to %s: %v", endpoint, cerr)
-			}
-		}()
-	}()
-	return RegisterModelsHandlerClient(ctx, httpServer, scalellm.NewModelsClient(conn))
-}
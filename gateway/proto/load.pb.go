@@ -0,0 +1,376 @@
+// Code generated by protoc-gen-go. DO NOT EDIT.
+// versions:
+// 	protoc-gen-go v1.31.0
+// 	protoc        v3.21.12
+// source: load.proto
+
+package scalellm
+
+import (
+	protoreflect "google.golang.org/protobuf/reflect/protoreflect"
+	protoimpl "google.golang.org/protobuf/runtime/protoimpl"
+	reflect "reflect"
+	sync "sync"
+)
+
+const (
+	// Verify that this generated code is sufficiently up-to-date.
+	_ = protoimpl.EnforceVersion(20 - protoimpl.MinVersion)
+	// Verify that runtime/protoimpl is sufficiently up-to-date.
+	_ = protoimpl.EnforceVersion(protoimpl.MaxVersion - 20)
+)
+
+type LoadReportRequest struct {
+	state         protoimpl.MessageState
+	sizeCache     protoimpl.SizeCache
+	unknownFields protoimpl.UnknownFields
+
+	// The interval between the reports in milliseconds, defaults to 100.
+	IntervalMs uint32 `protobuf:"varint,1,opt,name=interval_ms,json=intervalMs,proto3" json:"interval_ms,omitempty"`
+	// The prompt length in tokens to estimate the time to first token for.
+	PromptLen uint32 `protobuf:"varint,2,opt,name=prompt_len,json=promptLen,proto3" json:"prompt_len,omitempty"`
+}
+
+func (x *LoadReportRequest) Reset() {
+	*x = LoadReportRequest{}
+	if protoimpl.UnsafeEnabled {
+		mi := &file_load_proto_msgTypes[0]
+		ms := protoimpl.X.MessageStateOf(protoimpl.Pointer(x))
+		ms.StoreMessageInfo(mi)
+	}
+}
+
+func (x *LoadReportRequest) String() string {
+	return protoimpl.X.MessageStringOf(x)
+}
+
+func (*LoadReportRequest) ProtoMessage() {}
+
+func (x *LoadReportRequest) ProtoReflect() protoreflect.Message {
+	mi := &file_load_proto_msgTypes[0]
+	if protoimpl.UnsafeEnabled && x != nil {
+		ms := protoimpl.X.MessageStateOf(protoimpl.Pointer(x))
+		if ms.LoadMessageInfo() == nil {
+			ms.StoreMessageInfo(mi)
+		}
+		return ms
+	}
+	return mi.MessageOf(x)
+}
+
+// Deprecated: Use LoadReportRequest.ProtoReflect.Descriptor instead.
+func (*LoadReportRequest) Descriptor() ([]byte, []int) {
+	return file_load_proto_rawDescGZIP(), []int{0}
+}
+
+func (x *LoadReportRequest) GetIntervalMs() uint32 {
+	if x != nil {
+		return x.IntervalMs
+	}
+	return 0
+}
+
+func (x *LoadReportRequest) GetPromptLen() uint32 {
+	if x != nil {
+		return x.PromptLen
+	}
+	return 0
+}
+
+type ModelLoad struct {
+	state         protoimpl.MessageState
+	sizeCache     protoimpl.SizeCache
+	unknownFields protoimpl.UnknownFields
+
+	// The model identifier.
+	Model string `protobuf:"bytes,1,opt,name=model,proto3" json:"model,omitempty"`
+	// The number of requests waiting to be scheduled.
+	NumWaitingRequests uint32 `protobuf:"varint,2,opt,name=num_waiting_requests,json=numWaitingRequests,proto3" json:"num_waiting_requests,omitempty"`
+	// The number of requests running in the last step.
+	NumRunningRequests uint32 `protobuf:"varint,3,opt,name=num_running_requests,json=numRunningRequests,proto3" json:"num_running_requests,omitempty"`
+	// The number of tokens of the running requests.
+	NumRunningTokens uint64 `protobuf:"varint,4,opt,name=num_running_tokens,json=numRunningTokens,proto3" json:"num_running_tokens,omitempty"`
+	// The prompt tokens of the waiting requests to be prefilled.
+	NumWaitingTokens uint64 `protobuf:"varint,5,opt,name=num_waiting_tokens,json=numWaitingTokens,proto3" json:"num_waiting_tokens,omitempty"`
+	// The ratio of the free kv cache blocks in [0, 1].
+	KvCacheFreeRatio float32 `protobuf:"fixed32,6,opt,name=kv_cache_free_ratio,json=kvCacheFreeRatio,proto3" json:"kv_cache_free_ratio,omitempty"`
+	// The estimated time to first token in milliseconds for a new request
+	// with prompt_len tokens, 0 if there is no estimate yet.
+	EstimatedTtftMs float32 `protobuf:"fixed32,7,opt,name=estimated_ttft_ms,json=estimatedTtftMs,proto3" json:"estimated_ttft_ms,omitempty"`
+	// Whether the model refuses new requests.
+	Draining bool `protobuf:"varint,8,opt,name=draining,proto3" json:"draining,omitempty"`
+}
+
+func (x *ModelLoad) Reset() {
+	*x = ModelLoad{}
+	if protoimpl.UnsafeEnabled {
+		mi := &file_load_proto_msgTypes[1]
+		ms := protoimpl.X.MessageStateOf(protoimpl.Pointer(x))
+		ms.StoreMessageInfo(mi)
+	}
+}
+
+func (x *ModelLoad) String() string {
+	return protoimpl.X.MessageStringOf(x)
+}
+
+func (*ModelLoad) ProtoMessage() {}
+
+func (x *ModelLoad) ProtoReflect() protoreflect.Message {
+	mi := &file_load_proto_msgTypes[1]
+	if protoimpl.UnsafeEnabled && x != nil {
+		ms := protoimpl.X.MessageStateOf(protoimpl.Pointer(x))
+		if ms.LoadMessageInfo() == nil {
+			ms.StoreMessageInfo(mi)
+		}
+		return ms
+	}
+	return mi.MessageOf(x)
+}
+
+// Deprecated: Use ModelLoad.ProtoReflect.Descriptor instead.
+func (*ModelLoad) Descriptor() ([]byte, []int) {
+	return file_load_proto_rawDescGZIP(), []int{1}
+}
+
+func (x *ModelLoad) GetModel() string {
+	if x != nil {
+		return x.Model
+	}
+	return ""
+}
+
+func (x *ModelLoad) GetNumWaitingRequests() uint32 {
+	if x != nil {
+		return x.NumWaitingRequests
+	}
+	return 0
+}
+
+func (x *ModelLoad) GetNumRunningRequests() uint32 {
+	if x != nil {
+		return x.NumRunningRequests
+	}
+	return 0
+}
+
+func (x *ModelLoad) GetNumRunningTokens() uint64 {
+	if x != nil {
+		return x.NumRunningTokens
+	}
+	return 0
+}
+
+func (x *ModelLoad) GetNumWaitingTokens() uint64 {
+	if x != nil {
+		return x.NumWaitingTokens
+	}
+	return 0
+}
+
+func (x *ModelLoad) GetKvCacheFreeRatio() float32 {
+	if x != nil {
+		return x.KvCacheFreeRatio
+	}
+	return 0
+}
+
+func (x *ModelLoad) GetEstimatedTtftMs() float32 {
+	if x != nil {
+		return x.EstimatedTtftMs
+	}
+	return 0
+}
+
+func (x *ModelLoad) GetDraining() bool {
+	if x != nil {
+		return x.Draining
+	}
+	return false
+}
+
+type LoadReport struct {
+	state         protoimpl.MessageState
+	sizeCache     protoimpl.SizeCache
+	unknownFields protoimpl.UnknownFields
+
+	// The load of each model served.
+	Models []*ModelLoad `protobuf:"bytes,1,rep,name=models,proto3" json:"models,omitempty"`
+}
+
+func (x *LoadReport) Reset() {
+	*x = LoadReport{}
+	if protoimpl.UnsafeEnabled {
+		mi := &file_load_proto_msgTypes[2]
+		ms := protoimpl.X.MessageStateOf(protoimpl.Pointer(x))
+		ms.StoreMessageInfo(mi)
+	}
+}
+
+func (x *LoadReport) String() string {
+	return protoimpl.X.MessageStringOf(x)
+}
+
+func (*LoadReport) ProtoMessage() {}
+
+func (x *LoadReport) ProtoReflect() protoreflect.Message {
+	mi := &file_load_proto_msgTypes[2]
+	if protoimpl.UnsafeEnabled && x != nil {
+		ms := protoimpl.X.MessageStateOf(protoimpl.Pointer(x))
+		if ms.LoadMessageInfo() == nil {
+			ms.StoreMessageInfo(mi)
+		}
+		return ms
+	}
+	return mi.MessageOf(x)
+}
+
+// Deprecated: Use LoadReport.ProtoReflect.Descriptor instead.
+func (*LoadReport) Descriptor() ([]byte, []int) {
+	return file_load_proto_rawDescGZIP(), []int{2}
+}
+
+func (x *LoadReport) GetModels() []*ModelLoad {
+	if x != nil {
+		return x.Models
+	}
+	return nil
+}
+
+var File_load_proto protoreflect.FileDescriptor
+
+var file_load_proto_rawDesc = []byte{
+	0x0a, 0x0a, 0x6c, 0x6f, 0x61, 0x64, 0x2e, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x12, 0x09, 0x6c, 0x6c,
+	0x6d, 0x2e, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x22, 0x53, 0x0a, 0x11, 0x4c, 0x6f, 0x61, 0x64, 0x52,
+	0x65, 0x70, 0x6f, 0x72, 0x74, 0x52, 0x65, 0x71, 0x75, 0x65, 0x73, 0x74, 0x12, 0x1f, 0x0a, 0x0b,
+	0x69, 0x6e, 0x74, 0x65, 0x72, 0x76, 0x61, 0x6c, 0x5f, 0x6d, 0x73, 0x18, 0x01, 0x20, 0x01, 0x28,
+	0x0d, 0x52, 0x0a, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x76, 0x61, 0x6c, 0x4d, 0x73, 0x12, 0x1d, 0x0a,
+	0x0a, 0x70, 0x72, 0x6f, 0x6d, 0x70, 0x74, 0x5f, 0x6c, 0x65, 0x6e, 0x18, 0x02, 0x20, 0x01, 0x28,
+	0x0d, 0x52, 0x09, 0x70, 0x72, 0x6f, 0x6d, 0x70, 0x74, 0x4c, 0x65, 0x6e, 0x22, 0xd8, 0x02, 0x0a,
+	0x09, 0x4d, 0x6f, 0x64, 0x65, 0x6c, 0x4c, 0x6f, 0x61, 0x64, 0x12, 0x14, 0x0a, 0x05, 0x6d, 0x6f,
+	0x64, 0x65, 0x6c, 0x18, 0x01, 0x20, 0x01, 0x28, 0x09, 0x52, 0x05, 0x6d, 0x6f, 0x64, 0x65, 0x6c,
+	0x12, 0x30, 0x0a, 0x14, 0x6e, 0x75, 0x6d, 0x5f, 0x77, 0x61, 0x69, 0x74, 0x69, 0x6e, 0x67, 0x5f,
+	0x72, 0x65, 0x71, 0x75, 0x65, 0x73, 0x74, 0x73, 0x18, 0x02, 0x20, 0x01, 0x28, 0x0d, 0x52, 0x12,
+	0x6e, 0x75, 0x6d, 0x57, 0x61, 0x69, 0x74, 0x69, 0x6e, 0x67, 0x52, 0x65, 0x71, 0x75, 0x65, 0x73,
+	0x74, 0x73, 0x12, 0x30, 0x0a, 0x14, 0x6e, 0x75, 0x6d, 0x5f, 0x72, 0x75, 0x6e, 0x6e, 0x69, 0x6e,
+	0x67, 0x5f, 0x72, 0x65, 0x71, 0x75, 0x65, 0x73, 0x74, 0x73, 0x18, 0x03, 0x20, 0x01, 0x28, 0x0d,
+	0x52, 0x12, 0x6e, 0x75, 0x6d, 0x52, 0x75, 0x6e, 0x6e, 0x69, 0x6e, 0x67, 0x52, 0x65, 0x71, 0x75,
+	0x65, 0x73, 0x74, 0x73, 0x12, 0x2c, 0x0a, 0x12, 0x6e, 0x75, 0x6d, 0x5f, 0x72, 0x75, 0x6e, 0x6e,
+	0x69, 0x6e, 0x67, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x73, 0x18, 0x04, 0x20, 0x01, 0x28, 0x04,
+	0x52, 0x10, 0x6e, 0x75, 0x6d, 0x52, 0x75, 0x6e, 0x6e, 0x69, 0x6e, 0x67, 0x54, 0x6f, 0x6b, 0x65,
+	0x6e, 0x73, 0x12, 0x2c, 0x0a, 0x12, 0x6e, 0x75, 0x6d, 0x5f, 0x77, 0x61, 0x69, 0x74, 0x69, 0x6e,
+	0x67, 0x5f, 0x74, 0x6f, 0x6b, 0x65, 0x6e, 0x73, 0x18, 0x05, 0x20, 0x01, 0x28, 0x04, 0x52, 0x10,
+	0x6e, 0x75, 0x6d, 0x57, 0x61, 0x69, 0x74, 0x69, 0x6e, 0x67, 0x54, 0x6f, 0x6b, 0x65, 0x6e, 0x73,
+	0x12, 0x2d, 0x0a, 0x13, 0x6b, 0x76, 0x5f, 0x63, 0x61, 0x63, 0x68, 0x65, 0x5f, 0x66, 0x72, 0x65,
+	0x65, 0x5f, 0x72, 0x61, 0x74, 0x69, 0x6f, 0x18, 0x06, 0x20, 0x01, 0x28, 0x02, 0x52, 0x10, 0x6b,
+	0x76, 0x43, 0x61, 0x63, 0x68, 0x65, 0x46, 0x72, 0x65, 0x65, 0x52, 0x61, 0x74, 0x69, 0x6f, 0x12,
+	0x2a, 0x0a, 0x11, 0x65, 0x73, 0x74, 0x69, 0x6d, 0x61, 0x74, 0x65, 0x64, 0x5f, 0x74, 0x74, 0x66,
+	0x74, 0x5f, 0x6d, 0x73, 0x18, 0x07, 0x20, 0x01, 0x28, 0x02, 0x52, 0x0f, 0x65, 0x73, 0x74, 0x69,
+	0x6d, 0x61, 0x74, 0x65, 0x64, 0x54, 0x74, 0x66, 0x74, 0x4d, 0x73, 0x12, 0x1a, 0x0a, 0x08, 0x64,
+	0x72, 0x61, 0x69, 0x6e, 0x69, 0x6e, 0x67, 0x18, 0x08, 0x20, 0x01, 0x28, 0x08, 0x52, 0x08, 0x64,
+	0x72, 0x61, 0x69, 0x6e, 0x69, 0x6e, 0x67, 0x22, 0x3a, 0x0a, 0x0a, 0x4c, 0x6f, 0x61, 0x64, 0x52,
+	0x65, 0x70, 0x6f, 0x72, 0x74, 0x12, 0x2c, 0x0a, 0x06, 0x6d, 0x6f, 0x64, 0x65, 0x6c, 0x73, 0x18,
+	0x01, 0x20, 0x03, 0x28, 0x0b, 0x32, 0x14, 0x2e, 0x6c, 0x6c, 0x6d, 0x2e, 0x70, 0x72, 0x6f, 0x74,
+	0x6f, 0x2e, 0x4d, 0x6f, 0x64, 0x65, 0x6c, 0x4c, 0x6f, 0x61, 0x64, 0x52, 0x06, 0x6d, 0x6f, 0x64,
+	0x65, 0x6c, 0x73, 0x32, 0x48, 0x0a, 0x04, 0x4c, 0x6f, 0x61, 0x64, 0x12, 0x40, 0x0a, 0x05, 0x57,
+	0x61, 0x74, 0x63, 0x68, 0x12, 0x1c, 0x2e, 0x6c, 0x6c, 0x6d, 0x2e, 0x70, 0x72, 0x6f, 0x74, 0x6f,
+	0x2e, 0x4c, 0x6f, 0x61, 0x64, 0x52, 0x65, 0x70, 0x6f, 0x72, 0x74, 0x52, 0x65, 0x71, 0x75, 0x65,
+	0x73, 0x74, 0x1a, 0x15, 0x2e, 0x6c, 0x6c, 0x6d, 0x2e, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x2e, 0x4c,
+	0x6f, 0x61, 0x64, 0x52, 0x65, 0x70, 0x6f, 0x72, 0x74, 0x22, 0x00, 0x30, 0x01, 0x42, 0x2a, 0x5a,
+	0x28, 0x67, 0x69, 0x74, 0x68, 0x75, 0x62, 0x2e, 0x63, 0x6f, 0x6d, 0x2f, 0x76, 0x65, 0x63, 0x74,
+	0x6f, 0x72, 0x63, 0x68, 0x2d, 0x61, 0x69, 0x2f, 0x73, 0x63, 0x61, 0x6c, 0x65, 0x6c, 0x6c, 0x6d,
+	0x3b, 0x73, 0x63, 0x61, 0x6c, 0x65, 0x6c, 0x6c, 0x6d, 0x62, 0x06, 0x70, 0x72, 0x6f, 0x74, 0x6f,
+	0x33,
+}
+
+var (
+	file_load_proto_rawDescOnce sync.Once
+	file_load_proto_rawDescData = file_load_proto_rawDesc
+)
+
+func file_load_proto_rawDescGZIP() []byte {
+	file_load_proto_rawDescOnce.Do(func() {
+		file_load_proto_rawDescData = protoimpl.X.CompressGZIP(file_load_proto_rawDescData)
+	})
+	return file_load_proto_rawDescData
+}
+
+var file_load_proto_msgTypes = make([]protoimpl.MessageInfo, 3)
+var file_load_proto_goTypes = []interface{}{
+	(*LoadReportRequest)(nil), // 0: llm.proto.LoadReportRequest
+	(*ModelLoad)(nil),         // 1: llm.proto.ModelLoad
+	(*LoadReport)(nil),        // 2: llm.proto.LoadReport
+}
+var file_load_proto_depIdxs = []int32{
+	1, // 0: llm.proto.LoadReport.models:type_name -> llm.proto.ModelLoad
+	0, // 1: llm.proto.Load.Watch:input_type -> llm.proto.LoadReportRequest
+	2, // 2: llm.proto.Load.Watch:output_type -> llm.proto.LoadReport
+	2, // [2:3] is the sub-list for method output_type
+	1, // [1:2] is the sub-list for method input_type
+	1, // [1:1] is the sub-list for extension type_name
+	1, // [1:1] is the sub-list for extension extendee
+	0, // [0:1] is the sub-list for field type_name
+}
+
+func init() { file_load_proto_init() }
+func file_load_proto_init() {
+	if File_load_proto != nil {
+		return
+	}
+	if !protoimpl.UnsafeEnabled {
+		file_load_proto_msgTypes[0].Exporter = func(v interface{}, i int) interface{} {
+			switch v := v.(*LoadReportRequest); i {
+			case 0:
+				return &v.state
+			case 1:
+				return &v.sizeCache
+			case 2:
+				return &v.unknownFields
+			default:
+				return nil
+			}
+		}
+		file_load_proto_msgTypes[1].Exporter = func(v interface{}, i int) interface{} {
+			switch v := v.(*ModelLoad); i {
+			case 0:
+				return &v.state
+			case 1:
+				return &v.sizeCache
+			case 2:
+				return &v.unknownFields
+			default:
+				return nil
+			}
+		}
+		file_load_proto_msgTypes[2].Exporter = func(v interface{}, i int) interface{} {
+			switch v := v.(*LoadReport); i {
+			case 0:
+				return &v.state
+			case 1:
+				return &v.sizeCache
+			case 2:
+				return &v.unknownFields
+			default:
+				return nil
+			}
+		}
+	}
+	type x struct{}
+	out := protoimpl.TypeBuilder{
+		File: protoimpl.DescBuilder{
+			GoPackagePath: reflect.TypeOf(x{}).PkgPath(),
+			RawDescriptor: file_load_proto_rawDesc,
+			NumEnums:      0,
+			NumMessages:   3,
+			NumExtensions: 0,
+			NumServices:   1,
+		},
+		GoTypes:           file_load_proto_goTypes,
+		DependencyIndexes: file_load_proto_depIdxs,
+		MessageInfos:      file_load_proto_msgTypes,
+	}.Build()
+	File_load_proto = out.File
+	file_load_proto_rawDesc = nil
+	file_load_proto_goTypes = nil
+	file_load_proto_depIdxs = nil
+}
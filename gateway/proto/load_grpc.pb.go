@@ -0,0 +1,140 @@
+// Code generated by protoc-gen-go-grpc. DO NOT EDIT.
+// versions:
+// - protoc-gen-go-grpc v1.3.0
+// - protoc             v3.21.12
+// source: load.proto
+
+package scalellm
+
+import (
+	context "context"
+	grpc "google.golang.org/grpc"
+	codes "google.golang.org/grpc/codes"
+	status "google.golang.org/grpc/status"
+)
+
+// This is a compile-time assertion to ensure that this generated file
+// is compatible with the grpc package it is being compiled against.
+// Requires gRPC-Go v1.32.0 or later.
+const _ = grpc.SupportPackageIsVersion7
+
+const (
+	Load_Watch_FullMethodName = "/llm.proto.Load/Watch"
+)
+
+// LoadClient is the client API for Load service.
+//
+// For semantics around ctx use and closing/ending streaming RPCs, please refer to https://pkg.go.dev/google.golang.org/grpc/?tab=doc#ClientConn.NewStream.
+type LoadClient interface {
+	// Streams the load of the models periodically, e.g. for load aware
+	// routing, until the client cancels.
+	Watch(ctx context.Context, in *LoadReportRequest, opts ...grpc.CallOption) (Load_WatchClient, error)
+}
+
+type loadClient struct {
+	cc grpc.ClientConnInterface
+}
+
+func NewLoadClient(cc grpc.ClientConnInterface) LoadClient {
+	return &loadClient{cc}
+}
+
+func (c *loadClient) Watch(ctx context.Context, in *LoadReportRequest, opts ...grpc.CallOption) (Load_WatchClient, error) {
+	stream, err := c.cc.NewStream(ctx, &Load_ServiceDesc.Streams[0], Load_Watch_FullMethodName, opts...)
+	if err != nil {
+		return nil, err
+	}
+	x := &loadWatchClient{stream}
+	if err := x.ClientStream.SendMsg(in); err != nil {
+		return nil, err
+	}
+	if err := x.ClientStream.CloseSend(); err != nil {
+		return nil, err
+	}
+	return x, nil
+}
+
+type Load_WatchClient interface {
+	Recv() (*LoadReport, error)
+	grpc.ClientStream
+}
+
+type loadWatchClient struct {
+	grpc.ClientStream
+}
+
+func (x *loadWatchClient) Recv() (*LoadReport, error) {
+	m := new(LoadReport)
+	if err := x.ClientStream.RecvMsg(m); err != nil {
+		return nil, err
+	}
+	return m, nil
+}
+
+// LoadServer is the server API for Load service.
+// All implementations must embed UnimplementedLoadServer
+// for forward compatibility
+type LoadServer interface {
+	// Streams the load of the models periodically, e.g. for load aware
+	// routing, until the client cancels.
+	Watch(*LoadReportRequest, Load_WatchServer) error
+	mustEmbedUnimplementedLoadServer()
+}
+
+// UnimplementedLoadServer must be embedded to have forward compatible implementations.
+type UnimplementedLoadServer struct {
+}
+
+func (UnimplementedLoadServer) Watch(*LoadReportRequest, Load_WatchServer) error {
+	return status.Errorf(codes.Unimplemented, "method Watch not implemented")
+}
+func (UnimplementedLoadServer) mustEmbedUnimplementedLoadServer() {}
+
+// UnsafeLoadServer may be embedded to opt out of forward compatibility for this service.
+// Use of this interface is not recommended, as added methods to LoadServer will
+// result in compilation errors.
+type UnsafeLoadServer interface {
+	mustEmbedUnimplementedLoadServer()
+}
+
+func RegisterLoadServer(s grpc.ServiceRegistrar, srv LoadServer) {
+	s.RegisterService(&Load_ServiceDesc, srv)
+}
+
+func _Load_Watch_Handler(srv interface{}, stream grpc.ServerStream) error {
+	m := new(LoadReportRequest)
+	if err := stream.RecvMsg(m); err != nil {
+		return err
+	}
+	return srv.(LoadServer).Watch(m, &loadWatchServer{stream})
+}
+
+type Load_WatchServer interface {
+	Send(*LoadReport) error
+	grpc.ServerStream
+}
+
+type loadWatchServer struct {
+	grpc.ServerStream
+}
+
+func (x *loadWatchServer) Send(m *LoadReport) error {
+	return x.ServerStream.SendMsg(m)
+}
+
+// Load_ServiceDesc is the grpc.ServiceDesc for Load service.
+// It's only intended for direct use with grpc.RegisterService,
+// and not to be introspected or modified (even as a copy)
+var Load_ServiceDesc = grpc.ServiceDesc{
+	ServiceName: "llm.proto.Load",
+	HandlerType: (*LoadServer)(nil),
+	Methods:     []grpc.MethodDesc{},
+	Streams: []grpc.StreamDesc{
+		{
+			StreamName:    "Watch",
+			Handler:       _Load_Watch_Handler,
+			ServerStreams: true,
+		},
+	},
+	Metadata: "load.proto",
+}
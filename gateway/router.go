@@ -0,0 +1,291 @@
+package main
+
+import (
+	"context"
+	"errors"
+	"hash/fnv"
+	"math"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/golang/glog"
+	"google.golang.org/grpc"
+	"google.golang.org/grpc/codes"
+	"google.golang.org/grpc/status"
+
+	// importing generated stubs
+	scalellm "gateway/proto"
+)
+
+// number of points of each backend on the hash ring
+const virtualNodesPerBackend = 100
+
+// wait before watching the load of a backend again after an error
+const loadWatchRetryInterval = 5 * time.Second
+
+var errNoBackends = errors.New("no grpc server endpoints")
+
+// Backend is a replica of the grpc server.
+type Backend struct {
+	endpoint   string
+	chat       scalellm.ChatClient
+	completion scalellm.CompletionClient
+	models     scalellm.ModelsClient
+	load       scalellm.LoadClient
+
+	// number of forwarded requests that are not finished yet
+	inflight int
+
+	// the latest load reported by the backend, nil if unknown
+	report *scalellm.LoadReport
+}
+
+// estimatedTTFT returns the time to first token in milliseconds the backend
+// estimated for the model in its latest load report, 0 if unknown and
+// infinity if the backend is draining.
+func (b *Backend) estimatedTTFT(model string) float64 {
+	for _, load := range b.report.GetModels() {
+		// the first model is the default one
+		if model == "" || load.GetModel() == model {
+			if load.GetDraining() {
+				return math.Inf(1)
+			}
+			return float64(load.GetEstimatedTtftMs())
+		}
+	}
+	return 0
+}
+
+type ringNode struct {
+	hash    uint64
+	backend *Backend
+}
+
+// Router routes requests sharing a prompt prefix to the same backend, so
+// that the prefix is only cached by one replica instead of all of them. It
+// uses consistent hashing with bounded loads: a request goes to the first
+// backend on the ring after the hash of its prefix whose in flight requests
+// are below loadFactor times the average. With the load reports streamed by
+// the backends, the backends whose estimated time to first token exceeds
+// loadFactor times the least one plus ttftSlack are skipped as well, so that
+// the queues of the replicas stay balanced when the prompts are uneven.
+type Router struct {
+	mu       sync.Mutex
+	backends []*Backend
+
+	// points of the backends sorted by hash
+	ring []ringNode
+
+	// total number of in flight requests
+	inflight int
+
+	// number of leading bytes of the prompt to hash
+	prefixLen int
+
+	// max ratio of the in flight requests of a backend to the average
+	loadFactor float64
+
+	// slack in milliseconds over loadFactor times the least estimated time
+	// to first token among the backends
+	ttftSlack float64
+}
+
+// NewRouter dials the endpoints and builds the hash ring. The load of the
+// backends is watched every loadReportInterval with the time to first token
+// estimated for prompts of ttftPromptLen tokens, a zero interval disables
+// the load reports. The connections are closed when the context is done.
+func NewRouter(ctx context.Context, endpoints []string, opts []grpc.DialOption, prefixLen int, loadFactor float64, loadReportInterval time.Duration, ttftPromptLen int, ttftSlack time.Duration) (router *Router, err error) {
+	router = &Router{
+		prefixLen:  prefixLen,
+		loadFactor: math.Max(loadFactor, 1.0),
+		ttftSlack:  float64(ttftSlack.Milliseconds()),
+	}
+	var conns []*grpc.ClientConn
+	defer func() {
+		if err != nil {
+			for _, conn := range conns {
+				if cerr := conn.Close(); cerr != nil {
+					glog.Errorf("Failed to close conn to %s: %v", conn.Target(), cerr)
+				}
+			}
+			return
+		}
+		go func() {
+			<-ctx.Done()
+			for _, conn := range conns {
+				if cerr := conn.Close(); cerr != nil {
+					glog.Errorf("Failed to close conn to %s: %v", conn.Target(), cerr)
+				}
+			}
+		}()
+	}()
+
+	for _, endpoint := range endpoints {
+		endpoint = strings.TrimSpace(endpoint)
+		if endpoint == "" {
+			continue
+		}
+		conn, err := grpc.DialContext(ctx, endpoint, opts...)
+		if err != nil {
+			return nil, err
+		}
+		conns = append(conns, conn)
+		backend := &Backend{
+			endpoint:   endpoint,
+			chat:       scalellm.NewChatClient(conn),
+			completion: scalellm.NewCompletionClient(conn),
+			models:     scalellm.NewModelsClient(conn),
+			load:       scalellm.NewLoadClient(conn),
+		}
+		router.backends = append(router.backends, backend)
+		for i := 0; i < virtualNodesPerBackend; i++ {
+			router.ring = append(router.ring, ringNode{
+				hash:    hashString(endpoint + "#" + strconv.Itoa(i)),
+				backend: backend,
+			})
+		}
+	}
+	if len(router.backends) == 0 {
+		return nil, errNoBackends
+	}
+	sort.Slice(router.ring, func(i, j int) bool {
+		return router.ring[i].hash < router.ring[j].hash
+	})
+	if loadReportInterval > 0 {
+		req := &scalellm.LoadReportRequest{
+			IntervalMs: uint32(loadReportInterval.Milliseconds()),
+			PromptLen:  uint32(ttftPromptLen),
+		}
+		for _, backend := range router.backends {
+			go router.watchLoad(ctx, backend, req)
+		}
+	}
+	return router, nil
+}
+
+// watchLoad keeps the latest load report of the backend until the context is
+// done, watching again after errors. The report is dropped while the stream
+// is broken, so the backend is routed by its in flight requests only.
+func (r *Router) watchLoad(ctx context.Context, backend *Backend, req *scalellm.LoadReportRequest) {
+	for {
+		stream, err := backend.load.Watch(ctx, req)
+		for err == nil {
+			var report *scalellm.LoadReport
+			if report, err = stream.Recv(); err == nil {
+				r.mu.Lock()
+				backend.report = report
+				r.mu.Unlock()
+			}
+		}
+		r.mu.Lock()
+		backend.report = nil
+		r.mu.Unlock()
+
+		if ctx.Err() != nil {
+			return
+		}
+		if status.Code(err) == codes.Unimplemented {
+			glog.Infof("Load reports are not supported by %s", backend.endpoint)
+			return
+		}
+		glog.Warningf("Failed to watch the load of %s: %v", backend.endpoint, err)
+		select {
+		case <-ctx.Done():
+			return
+		case <-time.After(loadWatchRetryInterval):
+		}
+	}
+}
+
+// Acquire picks the backend of the model for the routing key and counts the
+// request as in flight on it until release is called.
+func (r *Router) Acquire(model, key string) (backend *Backend, release func()) {
+	h := hashString(key)
+
+	r.mu.Lock()
+	defer r.mu.Unlock()
+
+	// the total in flight requests are below capacity * len(backends), so at
+	// least one backend has room.
+	capacity := int(math.Ceil(r.loadFactor * float64(r.inflight+1) / float64(len(r.backends))))
+	maxTTFT := math.Inf(1)
+	if minTTFT := r.minTTFT(model); !math.IsInf(minTTFT, 1) {
+		maxTTFT = r.loadFactor*minTTFT + r.ttftSlack
+	}
+	start := sort.Search(len(r.ring), func(i int) bool { return r.ring[i].hash >= h })
+	for i := 0; i < len(r.ring) && backend == nil; i++ {
+		node := r.ring[(start+i)%len(r.ring)]
+		if node.backend.inflight < capacity && node.backend.estimatedTTFT(model) <= maxTTFT {
+			backend = node.backend
+		}
+	}
+	// the backends within the ttft bound are all at capacity
+	for i := 0; i < len(r.ring) && backend == nil; i++ {
+		node := r.ring[(start+i)%len(r.ring)]
+		if node.backend.inflight < capacity {
+			backend = node.backend
+		}
+	}
+	backend.inflight++
+	r.inflight++
+
+	var once sync.Once
+	release = func() {
+		once.Do(func() {
+			r.mu.Lock()
+			defer r.mu.Unlock()
+			backend.inflight--
+			r.inflight--
+		})
+	}
+	return backend, release
+}
+
+// minTTFT returns the least estimated time to first token of the model among
+// the backends, infinity if all of them are draining. r.mu must be held.
+func (r *Router) minTTFT(model string) float64 {
+	minTTFT := math.Inf(1)
+	for _, backend := range r.backends {
+		minTTFT = math.Min(minTTFT, backend.estimatedTTFT(model))
+	}
+	return minTTFT
+}
+
+// ChatKey returns the routing key of a chat request: the model and the
+// leading bytes of its messages.
+func (r *Router) ChatKey(req *scalellm.ChatRequest) string {
+	var b strings.Builder
+	b.WriteString(req.GetModel())
+	for _, message := range req.GetMessages() {
+		if b.Len() >= r.prefixLen {
+			break
+		}
+		b.WriteString("\x00")
+		b.WriteString(message.GetRole())
+		b.WriteString("\x00")
+		b.WriteString(message.GetContent())
+	}
+	return truncate(b.String(), len(req.GetModel())+r.prefixLen)
+}
+
+// CompletionKey returns the routing key of a completion request: the model
+// and the leading bytes of its prompt.
+func (r *Router) CompletionKey(req *scalellm.CompletionRequest) string {
+	return req.GetModel() + "\x00" + truncate(req.GetPrompt(), r.prefixLen)
+}
+
+func truncate(s string, n int) string {
+	if len(s) > n {
+		return s[:n]
+	}
+	return s
+}
+
+func hashString(s string) uint64 {
+	h := fnv.New64a()
+	h.Write([]byte(s))
+	return h.Sum64()
+}
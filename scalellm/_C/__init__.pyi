@@ -1,12 +1,17 @@
-from scalellm._C.llm_handler import LLMHandler, Message, Priority
+from scalellm._C.llm_handler import (BatchOutput, Image, LLMHandler,
+                                     Message, Priority)
 from scalellm._C.output import (LogProb, LogProbData, RequestOutput,
                                 SequenceOutput, Status, StatusCode, Usage)
 from scalellm._C.sampling_params import SamplingParams
+from scalellm._C.stream_bridge import BridgeStream, StreamBridge
 
 # Defined in scalellm/csrc/module.cpp
 def get_metrics() -> str: ...
 
 __all__ = [
+    "BatchOutput",
+    "BridgeStream",
+    "Image",
     "Message",
     "LogProb",
     "LogProbData",
@@ -15,6 +20,7 @@ __all__ = [
     "SamplingParams",
     "SequenceOutput",
     "Status",
+    "StreamBridge",
     "StatusCode",
     "Usage",
     "LLMHandler",
@@ -1,15 +1,26 @@
 from enum import Enum
-from typing import Callable, List, Optional
+from typing import Callable, List, Optional, Union
 
-from scalellm._C.output import RequestOutput
+import numpy as np
+
+from scalellm._C.output import RequestOutput, Status
 from scalellm._C.sampling_params import SamplingParams
+from scalellm._C.stream_bridge import BridgeStream
 
 # Defined in csrc/llm_handler.cpp
+class Image:
+    def __init__(self, data: bytes, width: int, height: int) -> None: ...
+    def __repr__(self) -> str: ...
+    data: bytes
+    width: int
+    height: int
+
 class Message:
     def __init__(self, role: str, content: str) -> None: ...
     def __repr__(self) -> str: ...
     role: str
     content: str
+    images: List[Image]
 
 class Priority(Enum):
     DEFAULT: Priority = ...
@@ -25,6 +36,25 @@ class BatchFuture:
     def wait(self) -> None: ...
     def get(self) -> List[bool]: ...
 
+class BatchOutput:
+    def __init__(self) -> None: ...
+    def __len__(self) -> int: ...
+    def __repr__(self) -> str: ...
+    # the sequences of prompt i are in [offsets[i], offsets[i + 1])
+    offsets: List[int]
+    texts: List[str]
+    token_ids: List[List[int]]
+    token_logprobs: List[List[float]]
+    finish_reasons: List[Optional[str]]
+    statuses: List[Status]
+    num_prompt_tokens: List[int]
+    num_generated_tokens: List[int]
+    # zero-copy views over token_ids and token_logprobs of each sequence
+    @property
+    def token_ids_arrays(self) -> List[np.ndarray]: ...
+    @property
+    def token_logprobs_arrays(self) -> List[np.ndarray]: ...
+
 class LLMHandler:
     class Options:
         def __init__(self) -> None: ...
@@ -33,18 +63,51 @@ class LLMHandler:
         devices: Optional[str]
         draft_model_path: Optional[str]
         draft_devices: Optional[str]
+        decode_devices: Optional[str]
         block_size: int
+        large_block_size: int
         max_cache_size: int
+        host_cache_size: int
+        resizable_cache_size: int
         max_memory_utilization: float
         enable_prefix_cache: bool
+        kv_cache_dtype: str
         enable_cuda_graph: bool
         cuda_graph_max_seq_len: int
         cuda_graph_batch_sizes: Optional[List[int]]
         draft_cuda_graph_batch_sizes: Optional[List[int]]
+        cuda_graph_num_tokens: Optional[List[int]]
         max_tokens_per_batch: int
         max_seqs_per_batch: int
+        target_step_time_ms: int
+        min_tokens_per_batch: int
         num_speculative_tokens: int
+        speculative_tree_width: int
+        speculative_proposer: str
+        ngram_max_size: int
+        enable_adaptive_speculation: bool
+        speculative_min_acceptance: float
+        speculative_max_batch_size: int
+        num_decode_steps: int
+        enable_fused_sampling: bool
+        enable_pivot_sampling: bool
+        cascade_min_prefix_len: int
+        scheduling_policy: str
+        sjf_aging_tokens_per_second: float
+        tenant_weights: str
+        max_tenant_kv_cache_share: float
+        swap_bandwidth_gbps: float
+        max_compaction_blocks_per_step: int
+        ttft_slo_ms: int
+        itl_slo_ms: int
+        prefix_admission_window: int
+        max_admission_skips: int
+        wait_for_inflight_prefix: bool
         num_handling_threads: int
+        num_response_threads: int
+        num_encode_threads: int
+        prompt_cache_tokens: int
+        max_cached_grammars: int
 
     def __init__(self, options: Options) -> None: ...
     def __repr__(self) -> str: ...
@@ -54,7 +117,7 @@ class LLMHandler:
         sp: SamplingParams,
         priority: Priority,
         stream: bool,
-        callback: Callable[[RequestOutput], bool],
+        callback: Union[BridgeStream, Callable[[RequestOutput], bool]],
     ) -> Future: ...
     def schedule_chat_async(
         self,
@@ -62,7 +125,7 @@ class LLMHandler:
         sp: SamplingParams,
         priority: Priority,
         stream: bool,
-        callback: Callable[[RequestOutput], bool],
+        callback: Union[BridgeStream, Callable[[RequestOutput], bool]],
     ) -> Future: ...
     def schedule_batch_async(
         self,
@@ -80,9 +143,17 @@ class LLMHandler:
         stream: bool,
         callback: Callable[[int, RequestOutput], bool],
     ) -> BatchFuture: ...
+    def generate_batch(
+        self, prompts: List[str], sps: List[SamplingParams]
+    ) -> BatchOutput: ...
     def start(self) -> None: ...
     def stop(self) -> None: ...
     def run_until_complete(self) -> None: ...
+    def warmup(self) -> None: ...
+    def drain(self, timeout_s: float) -> bool: ...
+    def export_kv_cache(self, token_ids: List[int], quantize: bool) -> bytes: ...
+    def import_kv_cache(self, buffer: bytes) -> int: ...
+    def resize_kv_cache(self, n_blocks: int) -> bool: ...
     def reset(self) -> None: ...
     # helper functions
     def apply_chat_template(self, messages: List[Message]) -> Optional[str]: ...
@@ -1,6 +1,8 @@
 from enum import Enum
 from typing import List, Optional
 
+import numpy as np
+
 # Defined in csrc/output.cpp
 class Usage:
     def __init__(self) -> None: ...
@@ -34,6 +36,18 @@ class SequenceOutput:
     token_ids: List[int]
     finish_reason: Optional[str]
     logprobs: Optional[List[LogProb]]
+    # logprobs of token_ids, only set when not detokenized. NaN if not available.
+    token_logprobs: List[float]
+    # the l2 normalized embedding of the prompt, only set for pooling requests.
+    embedding: List[float]
+    # zero-copy views over token_ids, token_logprobs and embedding, e.g. for
+    # torch.from_numpy
+    @property
+    def token_ids_array(self) -> np.ndarray: ...
+    @property
+    def token_logprobs_array(self) -> np.ndarray: ...
+    @property
+    def embedding_array(self) -> np.ndarray: ...
 
 class RequestOutput:
     def __init__(self) -> None: ...
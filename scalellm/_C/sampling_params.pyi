@@ -1,4 +1,4 @@
-from typing import List, Optional
+from typing import Dict, List, Optional
 
 # Defined in csrc/sampling_params.cpp
 class SamplingParams:
@@ -20,12 +20,16 @@ class SamplingParams:
         ignore_eos: bool = False,
         stop: Optional[List[str]] = None,
         stop_token_ids: Optional[List[int]] = None,
+        detokenize: bool = True,
     ) -> None: ...
     def __repr__(self) -> str: ...
     # number of tokens to generate. truncted to model's max context length.
     max_tokens: int
     # number of sequences to generate for each prompt.
     n: int
+    # number of beams to search the n best sequences with, between [0, 10].
+    # the sampling parameters are ignored. default = 0 to sample the sequences.
+    beam_width: int
     # whether to include the original prompt in the completion response.
     echo: bool
     # frequency penalty to reduce the likelihood of generating the same word multiple times. values between [0.0, 2.0].
@@ -53,3 +57,27 @@ class SamplingParams:
     stop: Optional[List[str]]
     # the list of token ids to stop generating further tokens.
     stop_token_ids: Optional[List[int]]
+    # the bias added to the logits of the token ids, between [-100, 100].
+    logit_bias: Optional[Dict[int, float]]
+    # the only token ids that can be generated. default = all tokens.
+    allowed_token_ids: Optional[List[int]]
+    # the seed of the random numbers to sample with. default = unseeded.
+    seed: Optional[int]
+    # whether to decode the output tokens into text. default = true.
+    # when false, only token ids and logprobs are returned, see SequenceOutput.
+    detokenize: bool
+    # truncate a prompt exceeding the context instead of rejecting it, keeping
+    # the first n tokens and the most recent tokens. default = -1 to disable.
+    truncate_prompt_keep_first: int
+    # the tenant to account the request to under the wfq scheduling policy.
+    # default = "" for the default tenant.
+    tenant: str
+    # constrain the output to the json following the json schema.
+    json_schema: Optional[str]
+    # constrain the output to a json object, the json mode. default = false.
+    json_object: bool
+    # constrain the output to the text matching the regular expression.
+    regex: Optional[str]
+    # pool the last hidden states of the prompt into an embedding instead of
+    # generating: "mean" or "last". default = "" to generate.
+    pooling: str
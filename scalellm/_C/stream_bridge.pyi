@@ -0,0 +1,22 @@
+from typing import List, Tuple
+
+from scalellm._C.output import RequestOutput
+
+# Defined in csrc/stream_bridge.cpp
+class BridgeStream:
+    @property
+    def id(self) -> int: ...
+    # cancel the request at its next output
+    def cancel(self) -> None: ...
+    @property
+    def cancelled(self) -> bool: ...
+    def __repr__(self) -> str: ...
+
+class StreamBridge:
+    def __init__(self) -> None: ...
+    # the eventfd signaled when outputs are pushed
+    def fileno(self) -> int: ...
+    # create the stream of a new request
+    def open(self) -> BridgeStream: ...
+    # pop the outputs pushed so far, grouped by stream id
+    def drain(self) -> List[Tuple[int, List[RequestOutput]]]: ...
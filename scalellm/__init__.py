@@ -9,14 +9,17 @@ try:
 except ImportError:
     pass
 
-from scalellm._C import (LLMHandler, LogProb, LogProbData, Message, Priority,
-                         RequestOutput, SamplingParams, SequenceOutput, Status,
-                         StatusCode, Usage, get_metrics)
+from scalellm._C import (BatchOutput, Image, LLMHandler, LogProb,
+                         LogProbData, Message, Priority, RequestOutput,
+                         SamplingParams, SequenceOutput, Status, StatusCode,
+                         Usage, get_metrics)
 from scalellm.errors import ValidationError
 from scalellm.llm import LLM
 from scalellm.llm_engine import AsyncLLMEngine, OutputAsyncStream, OutputStream
 
 __all__ = [
+    "BatchOutput",
+    "Image",
     "Message",
     "LLM",
     "LogProb",
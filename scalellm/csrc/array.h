@@ -0,0 +1,29 @@
+#pragma once
+
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+
+#include <vector>
+
+namespace llm::csrc {
+
+// a numpy array viewing the data of the vector without copying, the owner
+// holding the vector is kept alive as long as the array.
+template <typename T>
+pybind11::array_t<T> as_array(const std::vector<T>& data,
+                              const pybind11::handle& owner) {
+  return pybind11::array_t<T>({data.size()}, {sizeof(T)}, data.data(), owner);
+}
+
+// numpy arrays viewing the vectors without copying, see as_array()
+template <typename T>
+pybind11::list as_arrays(const std::vector<std::vector<T>>& data,
+                         const pybind11::handle& owner) {
+  pybind11::list arrays(data.size());
+  for (size_t i = 0; i < data.size(); ++i) {
+    arrays[i] = as_array(data[i], owner);
+  }
+  return arrays;
+}
+
+}  // namespace llm::csrc
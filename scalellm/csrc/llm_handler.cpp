@@ -5,17 +5,38 @@
 #include <pybind11/stl.h>
 #include <pybind11/stl_bind.h>
 
+#include "array.h"
+#include "stream_bridge.h"
+
 namespace llm::csrc {
 namespace py = pybind11;
 using namespace pybind11::literals;
 
 void init_llm_handler(py::module_& m) {
+  py::class_<Image>(m, "Image")
+      .def(py::init([](py::bytes data, int32_t width, int32_t height) {
+             return Image{std::string(data), width, height};
+           }),
+           py::arg("data"),
+           py::arg("width"),
+           py::arg("height"))
+      .def_property(
+          "data",
+          [](const Image& self) { return py::bytes(self.data); },
+          [](Image& self, py::bytes data) { self.data = std::string(data); })
+      .def_readwrite("width", &Image::width)
+      .def_readwrite("height", &Image::height)
+      .def("__repr__", [](const Image& self) {
+        return "Image({}x{})"_s.format(self.width, self.height);
+      });
+
   py::class_<Message>(m, "Message")
       .def(py::init<const std::string&, const std::string&>(),
            py::arg("role"),
            py::arg("content"))
       .def_readwrite("role", &Message::role)
       .def_readwrite("content", &Message::content)
+      .def_readwrite("images", &Message::images)
       .def("__repr__", [](const Message& self) {
         return "Message({}: {!r})"_s.format(self.role, self.content);
       });
@@ -39,21 +60,116 @@ void init_llm_handler(py::module_& m) {
       .def("wait", &BatchFuture::wait, py::call_guard<py::gil_scoped_release>())
       .def("get", &BatchFuture::get, py::call_guard<py::gil_scoped_release>());
 
+  py::class_<BatchOutput>(m, "BatchOutput")
+      .def(py::init())
+      .def_readwrite("offsets", &BatchOutput::offsets)
+      .def_readwrite("texts", &BatchOutput::texts)
+      .def_readwrite("token_ids", &BatchOutput::token_ids)
+      .def_readwrite("token_logprobs", &BatchOutput::token_logprobs)
+      .def_readwrite("finish_reasons", &BatchOutput::finish_reasons)
+      // zero-copy views over the token ids and logprobs of each sequence
+      .def_property_readonly("token_ids_arrays",
+                             [](py::object self) {
+                               const auto& output =
+                                   self.cast<const BatchOutput&>();
+                               return as_arrays(output.token_ids, self);
+                             })
+      .def_property_readonly("token_logprobs_arrays",
+                             [](py::object self) {
+                               const auto& output =
+                                   self.cast<const BatchOutput&>();
+                               return as_arrays(output.token_logprobs, self);
+                             })
+      .def_readwrite("statuses", &BatchOutput::statuses)
+      .def_readwrite("num_prompt_tokens", &BatchOutput::num_prompt_tokens)
+      .def_readwrite("num_generated_tokens",
+                     &BatchOutput::num_generated_tokens)
+      .def("__len__",
+           [](const BatchOutput& self) { return self.statuses.size(); })
+      .def("__repr__", [](const BatchOutput& self) {
+        return "BatchOutput(num_prompts={}, num_sequences={})"_s.format(
+            self.statuses.size(), self.texts.size());
+      });
+
   auto llm_handler =
       py::class_<LLMHandler>(m, "LLMHandler")
           .def(py::init<const LLMHandler::Options&>(), py::arg("options"))
-          .def("schedule_async",
-               &LLMHandler::schedule_async,
-               py::call_guard<py::gil_scoped_release>())
-          .def("schedule_chat_async",
-               &LLMHandler::schedule_chat_async,
-               py::call_guard<py::gil_scoped_release>())
+          // the outputs are pushed to the stream bridge without the gil
+          .def(
+              "schedule_async",
+              [](LLMHandler& self,
+                 std::string prompt,
+                 SamplingParams sp,
+                 Priority priority,
+                 bool stream,
+                 std::shared_ptr<BridgeStream> output_stream) {
+                return self.schedule_async(
+                    std::move(prompt),
+                    std::move(sp),
+                    priority,
+                    stream,
+                    [output_stream](RequestOutput output) {
+                      return output_stream->push(std::move(output));
+                    });
+              },
+              py::call_guard<py::gil_scoped_release>())
+          .def(
+              "schedule_async",
+              [](LLMHandler& self,
+                 std::string prompt,
+                 SamplingParams sp,
+                 Priority priority,
+                 bool stream,
+                 OutputCallback callback) {
+                return self.schedule_async(std::move(prompt),
+                                           std::move(sp),
+                                           priority,
+                                           stream,
+                                           std::move(callback));
+              },
+              py::call_guard<py::gil_scoped_release>())
+          .def(
+              "schedule_chat_async",
+              [](LLMHandler& self,
+                 std::vector<Message> messages,
+                 SamplingParams sp,
+                 Priority priority,
+                 bool stream,
+                 std::shared_ptr<BridgeStream> output_stream) {
+                return self.schedule_chat_async(
+                    std::move(messages),
+                    std::move(sp),
+                    priority,
+                    stream,
+                    [output_stream](RequestOutput output) {
+                      return output_stream->push(std::move(output));
+                    });
+              },
+              py::call_guard<py::gil_scoped_release>())
+          .def(
+              "schedule_chat_async",
+              [](LLMHandler& self,
+                 std::vector<Message> messages,
+                 SamplingParams sp,
+                 Priority priority,
+                 bool stream,
+                 OutputCallback callback) {
+                return self.schedule_chat_async(std::move(messages),
+                                                std::move(sp),
+                                                priority,
+                                                stream,
+                                                std::move(callback));
+              },
+              py::call_guard<py::gil_scoped_release>())
           .def("schedule_batch_async",
                &LLMHandler::schedule_batch_async,
                py::call_guard<py::gil_scoped_release>())
           .def("schedule_chat_batch_async",
                &LLMHandler::schedule_chat_batch_async,
                py::call_guard<py::gil_scoped_release>())
+          .def("generate_batch",
+               &LLMHandler::generate_batch,
+               py::call_guard<py::gil_scoped_release>())
           .def("start",
                &LLMHandler::start,
                py::call_guard<py::gil_scoped_release>())
@@ -63,6 +179,32 @@ void init_llm_handler(py::module_& m) {
           .def("run_until_complete",
                &LLMHandler::run_until_complete,
                py::call_guard<py::gil_scoped_release>())
+          .def("warmup",
+               &LLMHandler::warmup,
+               py::call_guard<py::gil_scoped_release>())
+          .def(
+              "drain",
+              [](LLMHandler& self, double timeout_s) {
+                return self.drain(absl::Seconds(timeout_s));
+              },
+              py::call_guard<py::gil_scoped_release>())
+          .def("export_kv_cache",
+               [](LLMHandler& self,
+                  const std::vector<int32_t>& token_ids,
+                  bool quantize) {
+                 std::string buffer;
+                 {
+                   py::gil_scoped_release release;
+                   buffer = self.export_kv_cache(token_ids, quantize);
+                 }
+                 return py::bytes(buffer);
+               })
+          .def("import_kv_cache",
+               &LLMHandler::import_kv_cache,
+               py::call_guard<py::gil_scoped_release>())
+          .def("resize_kv_cache",
+               &LLMHandler::resize_kv_cache,
+               py::call_guard<py::gil_scoped_release>())
           .def("apply_chat_template",
                &LLMHandler::apply_chat_template,
                py::call_guard<py::gil_scoped_release>())
@@ -87,12 +229,19 @@ void init_llm_handler(py::module_& m) {
       .def_readwrite("draft_model_path",
                      &LLMHandler::Options::draft_model_path_)
       .def_readwrite("draft_devices", &LLMHandler::Options::draft_devices_)
+      .def_readwrite("decode_devices", &LLMHandler::Options::decode_devices_)
       .def_readwrite("block_size", &LLMHandler::Options::block_size_)
+      .def_readwrite("large_block_size",
+                     &LLMHandler::Options::large_block_size_)
       .def_readwrite("max_cache_size", &LLMHandler::Options::max_cache_size_)
+      .def_readwrite("host_cache_size", &LLMHandler::Options::host_cache_size_)
+      .def_readwrite("resizable_cache_size",
+                     &LLMHandler::Options::resizable_cache_size_)
       .def_readwrite("max_memory_utilization",
                      &LLMHandler::Options::max_memory_utilization_)
       .def_readwrite("enable_prefix_cache",
                      &LLMHandler::Options::enable_prefix_cache_)
+      .def_readwrite("kv_cache_dtype", &LLMHandler::Options::kv_cache_dtype_)
       .def_readwrite("enable_cuda_graph",
                      &LLMHandler::Options::enable_cuda_graph_)
       .def_readwrite("cuda_graph_max_seq_len",
@@ -101,38 +250,188 @@ void init_llm_handler(py::module_& m) {
                      &LLMHandler::Options::cuda_graph_batch_sizes_)
       .def_readwrite("draft_cuda_graph_batch_sizes",
                      &LLMHandler::Options::draft_cuda_graph_batch_sizes_)
+      .def_readwrite("cuda_graph_num_tokens",
+                     &LLMHandler::Options::cuda_graph_num_tokens_)
+      .def_readwrite("piecewise_cuda_graph_num_tokens",
+                     &LLMHandler::Options::piecewise_cuda_graph_num_tokens_)
       .def_readwrite("max_tokens_per_batch",
                      &LLMHandler::Options::max_tokens_per_batch_)
       .def_readwrite("max_seqs_per_batch",
                      &LLMHandler::Options::max_seqs_per_batch_)
+      .def_readwrite("target_step_time_ms",
+                     &LLMHandler::Options::target_step_time_ms_)
+      .def_readwrite("min_tokens_per_batch",
+                     &LLMHandler::Options::min_tokens_per_batch_)
       .def_readwrite("num_speculative_tokens",
                      &LLMHandler::Options::num_speculative_tokens_)
+      .def_readwrite("speculative_tree_width",
+                     &LLMHandler::Options::speculative_tree_width_)
+      .def_readwrite("speculative_proposer",
+                     &LLMHandler::Options::speculative_proposer_)
+      .def_readwrite("ngram_max_size", &LLMHandler::Options::ngram_max_size_)
+      .def_readwrite("enable_adaptive_speculation",
+                     &LLMHandler::Options::enable_adaptive_speculation_)
+      .def_readwrite("speculative_min_acceptance",
+                     &LLMHandler::Options::speculative_min_acceptance_)
+      .def_readwrite("speculative_max_batch_size",
+                     &LLMHandler::Options::speculative_max_batch_size_)
+      .def_readwrite("num_decode_steps",
+                     &LLMHandler::Options::num_decode_steps_)
+      .def_readwrite("enable_fused_sampling",
+                     &LLMHandler::Options::enable_fused_sampling_)
+      .def_readwrite("enable_pivot_sampling",
+                     &LLMHandler::Options::enable_pivot_sampling_)
+      .def_readwrite("cascade_min_prefix_len",
+                     &LLMHandler::Options::cascade_min_prefix_len_)
+      .def_readwrite("scheduling_policy",
+                     &LLMHandler::Options::scheduling_policy_)
+      .def_readwrite("sjf_aging_tokens_per_second",
+                     &LLMHandler::Options::sjf_aging_tokens_per_second_)
+      .def_readwrite("tenant_weights", &LLMHandler::Options::tenant_weights_)
+      .def_readwrite("max_tenant_kv_cache_share",
+                     &LLMHandler::Options::max_tenant_kv_cache_share_)
+      .def_readwrite("swap_bandwidth_gbps",
+                     &LLMHandler::Options::swap_bandwidth_gbps_)
+      .def_readwrite("max_compaction_blocks_per_step",
+                     &LLMHandler::Options::max_compaction_blocks_per_step_)
+      .def_readwrite("ttft_slo_ms", &LLMHandler::Options::ttft_slo_ms_)
+      .def_readwrite("itl_slo_ms", &LLMHandler::Options::itl_slo_ms_)
+      .def_readwrite("prefix_admission_window",
+                     &LLMHandler::Options::prefix_admission_window_)
+      .def_readwrite("max_admission_skips",
+                     &LLMHandler::Options::max_admission_skips_)
+      .def_readwrite("wait_for_inflight_prefix",
+                     &LLMHandler::Options::wait_for_inflight_prefix_)
+      .def_readwrite("high_priority_reserved_tokens",
+                     &LLMHandler::Options::high_priority_reserved_tokens_)
+      .def_readwrite("high_priority_reserved_seqs",
+                     &LLMHandler::Options::high_priority_reserved_seqs_)
       .def_readwrite("num_handling_threads",
                      &LLMHandler::Options::num_handling_threads_)
+      .def_readwrite("num_response_threads",
+                     &LLMHandler::Options::num_response_threads_)
+      .def_readwrite("num_encode_threads",
+                     &LLMHandler::Options::num_encode_threads_)
+      .def_readwrite("prompt_cache_tokens",
+                     &LLMHandler::Options::prompt_cache_tokens_)
+      .def_readwrite("response_cache_size",
+                     &LLMHandler::Options::response_cache_size_)
+      .def_readwrite("response_cache_ttl_seconds",
+                     &LLMHandler::Options::response_cache_ttl_seconds_)
+      .def_readwrite("max_cached_grammars",
+                     &LLMHandler::Options::max_cached_grammars_)
+      .def_readwrite("scheduler_cpus", &LLMHandler::Options::scheduler_cpus_)
+      .def_readwrite("handler_cpus", &LLMHandler::Options::handler_cpus_)
+      .def_readwrite("numa_affinity", &LLMHandler::Options::numa_affinity_)
+      .def_readwrite("enable_activation_pool",
+                     &LLMHandler::Options::enable_activation_pool_)
+      .def_readwrite("enable_warmup", &LLMHandler::Options::enable_warmup_)
+      .def_readwrite("max_estimated_ttft_ms",
+                     &LLMHandler::Options::max_estimated_ttft_ms_)
+      .def_readwrite("clamp_max_tokens_to_kv_cache",
+                     &LLMHandler::Options::clamp_max_tokens_to_kv_cache_)
       .def("__repr__", [](const LLMHandler::Options& self) {
         return "Options(model_path={}, devices={}, draft_model_path={}, "
-               "draft_devices={}, block_size={}, max_cache_size={}, "
-               "max_memory_utilization={}, enable_prefix_cache={}, "
+               "draft_devices={}, decode_devices={}, block_size={}, "
+               "large_block_size={}, "
+               "max_cache_size={}, "
+               "host_cache_size={}, resizable_cache_size={}, "
+               "max_memory_utilization={}, "
+               "enable_prefix_cache={}, kv_cache_dtype={}, "
                "enable_cuda_graph={}, cuda_graph_max_seq_len={}, "
                "cuda_graph_batch_sizes={}, draft_cuda_graph_batch_sizes={}, "
+               "cuda_graph_num_tokens={}, "
+               "piecewise_cuda_graph_num_tokens={}, "
                "max_tokens_per_batch={}, max_seqs_per_batch={}, "
-               "num_speculative_tokens={}, num_handling_threads={})"_s.format(
+               "target_step_time_ms={}, min_tokens_per_batch={}, "
+               "num_speculative_tokens={}, "
+               "speculative_tree_width={}, "
+               "speculative_proposer={}, "
+               "ngram_max_size={}, "
+               "enable_adaptive_speculation={}, "
+               "speculative_min_acceptance={}, "
+               "speculative_max_batch_size={}, "
+               "num_decode_steps={}, "
+               "enable_fused_sampling={}, "
+               "enable_pivot_sampling={}, "
+               "cascade_min_prefix_len={}, scheduling_policy={}, "
+               "sjf_aging_tokens_per_second={}, tenant_weights={}, "
+               "max_tenant_kv_cache_share={}, "
+               "swap_bandwidth_gbps={}, max_compaction_blocks_per_step={}, "
+               "ttft_slo_ms={}, itl_slo_ms={}, "
+               "prefix_admission_window={}, max_admission_skips={}, "
+               "wait_for_inflight_prefix={}, "
+               "high_priority_reserved_tokens={}, "
+               "high_priority_reserved_seqs={}, "
+               "num_handling_threads={}, num_response_threads={}, "
+               "num_encode_threads={}, prompt_cache_tokens={}, "
+               "response_cache_size={}, response_cache_ttl_seconds={}, "
+               "max_cached_grammars={}, scheduler_cpus={}, "
+               "handler_cpus={}, numa_affinity={}, "
+               "enable_activation_pool={}, enable_warmup={}, "
+               "max_estimated_ttft_ms={}, "
+               "clamp_max_tokens_to_kv_cache={})"_s.format(
                    self.model_path_,
                    self.devices_,
                    self.draft_model_path_,
                    self.draft_devices_,
+                   self.decode_devices_,
                    self.block_size_,
+                   self.large_block_size_,
                    self.max_cache_size_,
+                   self.host_cache_size_,
+                   self.resizable_cache_size_,
                    self.max_memory_utilization_,
                    self.enable_prefix_cache_,
+                   self.kv_cache_dtype_,
                    self.enable_cuda_graph_,
                    self.cuda_graph_max_seq_len_,
                    self.cuda_graph_batch_sizes_,
                    self.draft_cuda_graph_batch_sizes_,
+                   self.cuda_graph_num_tokens_,
+                   self.piecewise_cuda_graph_num_tokens_,
                    self.max_tokens_per_batch_,
                    self.max_seqs_per_batch_,
+                   self.target_step_time_ms_,
+                   self.min_tokens_per_batch_,
                    self.num_speculative_tokens_,
-                   self.num_handling_threads_);
+                   self.speculative_tree_width_,
+                   self.speculative_proposer_,
+                   self.ngram_max_size_,
+                   self.enable_adaptive_speculation_,
+                   self.speculative_min_acceptance_,
+                   self.speculative_max_batch_size_,
+                   self.num_decode_steps_,
+                   self.enable_fused_sampling_,
+                   self.enable_pivot_sampling_,
+                   self.cascade_min_prefix_len_,
+                   self.scheduling_policy_,
+                   self.sjf_aging_tokens_per_second_,
+                   self.tenant_weights_,
+                   self.max_tenant_kv_cache_share_,
+                   self.swap_bandwidth_gbps_,
+                   self.max_compaction_blocks_per_step_,
+                   self.ttft_slo_ms_,
+                   self.itl_slo_ms_,
+                   self.prefix_admission_window_,
+                   self.max_admission_skips_,
+                   self.wait_for_inflight_prefix_,
+                   self.high_priority_reserved_tokens_,
+                   self.high_priority_reserved_seqs_,
+                   self.num_handling_threads_,
+                   self.num_response_threads_,
+                   self.num_encode_threads_,
+                   self.prompt_cache_tokens_,
+                   self.response_cache_size_,
+                   self.response_cache_ttl_seconds_,
+                   self.max_cached_grammars_,
+                   self.scheduler_cpus_,
+                   self.handler_cpus_,
+                   self.numa_affinity_,
+                   self.enable_activation_pool_,
+                   self.enable_warmup_,
+                   self.max_estimated_ttft_ms_,
+                   self.clamp_max_tokens_to_kv_cache_);
       });
 }
 
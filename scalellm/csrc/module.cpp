@@ -11,6 +11,7 @@ namespace py = pybind11;
 extern void init_sampling_params(py::module_& m);
 extern void init_output(py::module_& m);
 extern void init_llm_handler(py::module_& m);
+extern void init_stream_bridge(py::module_& m);
 extern void init_kernels(py::module_& m);
 
 // NOLINTNEXTLINE
@@ -26,6 +27,7 @@ PYBIND11_MODULE(PY_MODULE_NAME, m) {
 
   init_sampling_params(m);
   init_output(m);
+  init_stream_bridge(m);
   init_llm_handler(m);
 
   py::module_ kernels =
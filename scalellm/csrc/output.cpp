@@ -3,6 +3,7 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
+#include "array.h"
 #include "request/status.h"
 
 namespace llm::csrc {
@@ -79,6 +80,27 @@ void init_output(py::module_& m) {
       .def_readwrite("token_ids", &SequenceOutput::token_ids)
       .def_readwrite("finish_reason", &SequenceOutput::finish_reason)
       .def_readwrite("logprobs", &SequenceOutput::logprobs)
+      .def_readwrite("token_logprobs", &SequenceOutput::token_logprobs)
+      .def_readwrite("embedding", &SequenceOutput::embedding)
+      // zero-copy views over the token ids, logprobs and embedding
+      .def_property_readonly("token_ids_array",
+                             [](py::object self) {
+                               const auto& output =
+                                   self.cast<const SequenceOutput&>();
+                               return as_array(output.token_ids, self);
+                             })
+      .def_property_readonly("token_logprobs_array",
+                             [](py::object self) {
+                               const auto& output =
+                                   self.cast<const SequenceOutput&>();
+                               return as_array(output.token_logprobs, self);
+                             })
+      .def_property_readonly("embedding_array",
+                             [](py::object self) {
+                               const auto& output =
+                                   self.cast<const SequenceOutput&>();
+                               return as_array(output.embedding, self);
+                             })
       .def("__repr__", [](const SequenceOutput& self) {
         return "SequenceOutput({}: {!r})"_s.format(self.index, self.text);
       });
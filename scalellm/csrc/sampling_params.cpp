@@ -25,7 +25,8 @@ void init_sampling_params(py::module_& m) {
                     bool,                    /*skip_special_tokens*/
                     bool,                    /*ignore_eos*/
                     std::optional<std::vector<std::string>>, /*stop*/
-                    std::optional<std::vector<int32_t>>>(),  /*stop_token_ids*/
+                    std::optional<std::vector<int32_t>>,     /*stop_token_ids*/
+                    bool>(),                                 /*detokenize*/
            py::arg("max_tokens") = 16,
            py::arg("n") = 1,
            py::arg("best_of") = std::nullopt,
@@ -41,10 +42,12 @@ void init_sampling_params(py::module_& m) {
            py::arg("skip_special_tokens") = true,
            py::arg("ignore_eos") = false,
            py::arg("stop") = std::nullopt,
-           py::arg("stop_token_ids") = std::nullopt)
+           py::arg("stop_token_ids") = std::nullopt,
+           py::arg("detokenize") = true)
       .def_readwrite("max_tokens", &SamplingParams::max_tokens)
       .def_readwrite("n", &SamplingParams::n)
       .def_readwrite("best_of", &SamplingParams::best_of)
+      .def_readwrite("beam_width", &SamplingParams::beam_width)
       .def_readwrite("echo", &SamplingParams::echo)
       .def_readwrite("frequency_penalty", &SamplingParams::frequency_penalty)
       .def_readwrite("presence_penalty", &SamplingParams::presence_penalty)
@@ -59,12 +62,24 @@ void init_sampling_params(py::module_& m) {
       .def_readwrite("ignore_eos", &SamplingParams::ignore_eos)
       .def_readwrite("stop", &SamplingParams::stop)
       .def_readwrite("stop_token_ids", &SamplingParams::stop_token_ids)
+      .def_readwrite("logit_bias", &SamplingParams::logit_bias)
+      .def_readwrite("allowed_token_ids", &SamplingParams::allowed_token_ids)
+      .def_readwrite("seed", &SamplingParams::seed)
+      .def_readwrite("detokenize", &SamplingParams::detokenize)
+      .def_readwrite("truncate_prompt_keep_first",
+                     &SamplingParams::truncate_prompt_keep_first)
+      .def_readwrite("tenant", &SamplingParams::tenant)
+      .def_readwrite("json_schema", &SamplingParams::json_schema)
+      .def_readwrite("json_object", &SamplingParams::json_object)
+      .def_readwrite("regex", &SamplingParams::regex)
+      .def_readwrite("pooling", &SamplingParams::pooling)
       .def("__repr__", [](const SamplingParams& self) {
         return "SamplingParams(max_tokens={}, n={}, best_of={}, echo={}, "
                "frequency_penalty={}, presence_penalty={}, "
                "repetition_penalty={}, temperature={}, top_p={}, top_k={}, "
                "logprobs={}, top_logprobs={}, skip_special_tokens={}, "
-               "ignore_eos={}, stop={}, stop_token_ids={})"_s.format(
+               "ignore_eos={}, stop={}, stop_token_ids={}, "
+               "detokenize={})"_s.format(
                    self.max_tokens,
                    self.n,
                    self.best_of,
@@ -80,7 +95,8 @@ void init_sampling_params(py::module_& m) {
                    self.skip_special_tokens,
                    self.ignore_eos,
                    self.stop,
-                   self.stop_token_ids);
+                   self.stop_token_ids,
+                   self.detokenize);
       });
 }
 
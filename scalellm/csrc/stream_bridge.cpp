@@ -0,0 +1,94 @@
+#include "stream_bridge.h"
+
+#include <glog/logging.h>
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace llm::csrc {
+namespace py = pybind11;
+
+bool BridgeStream::push(RequestOutput output) {
+  if (cancelled()) {
+    return false;
+  }
+  // the request is done after an error
+  const bool ok = !output.status.has_value() || output.status->ok();
+  bridge_->push(id_, std::move(output));
+  return ok && !cancelled();
+}
+
+StreamBridge::StreamBridge() {
+  fd_ = eventfd(/*initval=*/0, EFD_NONBLOCK | EFD_CLOEXEC);
+  PCHECK(fd_ >= 0) << "Failed to create eventfd";
+}
+
+StreamBridge::~StreamBridge() { close(fd_); }
+
+std::shared_ptr<BridgeStream> StreamBridge::open() {
+  return std::make_shared<BridgeStream>(shared_from_this(), next_id_++);
+}
+
+void StreamBridge::push(int64_t id, RequestOutput output) {
+  queue_.enqueue({id, std::move(output)});
+  // only the first output since the last drain wakes the loop
+  if (!signaled_.exchange(true)) {
+    const uint64_t one = 1;
+    if (write(fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      LOG(ERROR) << "Failed to write eventfd: " << strerror(errno);
+    }
+  }
+}
+
+std::vector<std::pair<int64_t, std::vector<RequestOutput>>>
+StreamBridge::drain() {
+  // clear the eventfd before the flag, a push racing with the drain at worst
+  // wakes the loop once more for nothing.
+  uint64_t count = 0;
+  if (read(fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    LOG(ERROR) << "Failed to read eventfd: " << strerror(errno);
+  }
+  signaled_.store(false);
+
+  std::vector<std::pair<int64_t, std::vector<RequestOutput>>> outputs;
+  // stream id -> index in outputs
+  std::unordered_map<int64_t, size_t> index;
+  std::pair<int64_t, RequestOutput> item;
+  while (queue_.try_dequeue(item)) {
+    auto [it, inserted] = index.try_emplace(item.first, outputs.size());
+    if (inserted) {
+      outputs.emplace_back(item.first, std::vector<RequestOutput>{});
+    }
+    outputs[it->second].second.push_back(std::move(item.second));
+  }
+  return outputs;
+}
+
+void init_stream_bridge(py::module_& m) {
+  py::class_<BridgeStream, std::shared_ptr<BridgeStream>>(m, "BridgeStream")
+      .def_property_readonly("id", &BridgeStream::id)
+      .def("cancel", &BridgeStream::cancel)
+      .def_property_readonly("cancelled", &BridgeStream::cancelled)
+      .def("__repr__", [](const BridgeStream& self) {
+        return "BridgeStream(id=" + std::to_string(self.id()) + ")";
+      });
+
+  py::class_<StreamBridge, std::shared_ptr<StreamBridge>>(m, "StreamBridge")
+      .def(py::init<>())
+      .def("fileno", &StreamBridge::fd)
+      .def("open", &StreamBridge::open)
+      // builds the python objects of the outputs, with the gil
+      .def("drain", &StreamBridge::drain);
+}
+
+}  // namespace llm::csrc
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <folly/concurrency/UnboundedQueue.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "request/output.h"
+
+namespace llm::csrc {
+
+class StreamBridge;
+
+// The native end of a streamed request, its outputs are pushed to the bridge
+// on the response threads without taking the GIL.
+class BridgeStream final {
+ public:
+  BridgeStream(std::shared_ptr<StreamBridge> bridge, int64_t id)
+      : bridge_(std::move(bridge)), id_(id) {}
+
+  // the output callback of the request, returns false to cancel the request
+  // once the stream is cancelled or an error is pushed.
+  bool push(RequestOutput output);
+
+  // cancel the request at its next output, called by the event loop.
+  void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+
+  bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+  int64_t id() const { return id_; }
+
+ private:
+  std::shared_ptr<StreamBridge> bridge_;
+
+  int64_t id_ = 0;
+
+  std::atomic<bool> cancelled_{false};
+};
+
+// Hands the outputs of the streamed requests from the response threads to an
+// asyncio event loop. The outputs are pushed into a lock-free queue and an
+// eventfd wakes the loop, which is registered with loop.add_reader() and
+// drains the outputs of all requests in one batch, so that the response
+// threads never contend with the loop for the GIL. The wakeups are coalesced
+// until the loop drains the queue.
+class StreamBridge final : public std::enable_shared_from_this<StreamBridge> {
+ public:
+  StreamBridge();
+
+  ~StreamBridge();
+
+  // disable copy, move and assign
+  StreamBridge(const StreamBridge&) = delete;
+  StreamBridge(StreamBridge&&) = delete;
+  StreamBridge& operator=(const StreamBridge&) = delete;
+  StreamBridge& operator=(StreamBridge&&) = delete;
+
+  // the eventfd to watch for readability
+  int fd() const { return fd_; }
+
+  // create the stream of a new request
+  std::shared_ptr<BridgeStream> open();
+
+  // called by the streams on the response threads
+  void push(int64_t id, RequestOutput output);
+
+  // clear the eventfd and pop the outputs pushed so far, grouped by stream
+  // in the order the streams first appear, each in the order pushed.
+  std::vector<std::pair<int64_t, std::vector<RequestOutput>>> drain();
+
+ private:
+  int fd_ = -1;
+
+  std::atomic<int64_t> next_id_{0};
+
+  // whether the eventfd is written and not cleared by drain() yet
+  std::atomic<bool> signaled_{false};
+
+  // multiple producers, the response threads, and a single consumer, the
+  // event loop
+  folly::UMPSCQueue<std::pair<int64_t, RequestOutput>, /*MayBlock=*/false>
+      queue_;
+};
+
+}  // namespace llm::csrc
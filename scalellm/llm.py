@@ -1,8 +1,8 @@
 import os
 from typing import List, Optional, Union
 
-from scalellm._C import (LLMHandler, Message, Priority, RequestOutput,
-                         SamplingParams)
+from scalellm._C import (BatchOutput, LLMHandler, Message, Priority,
+                         RequestOutput, SamplingParams)
 from scalellm.downloader import download_hf_model
 from scalellm.errors import ValidationError
 
@@ -19,18 +19,52 @@ class LLM:
         convert_to_safetensors: bool = False,
         devices: Optional[str] = None,
         draft_devices: Optional[str] = None,
+        decode_devices: Optional[str] = None,
         block_size: int = 8,
+        large_block_size: int = 0,  # 0 means large blocks are disabled
         max_cache_size: int = 0, # 0 means that cache size is caculated by available memory
+        host_cache_size: int = 0,  # 0 means that swapping to host memory is disabled
+        resizable_cache_size: int = 0,  # 0 means that the kv cache has a fixed size
         max_memory_utilization: float = 0.9,
         enable_prefix_cache: bool = True,
+        kv_cache_dtype: str = "auto",  # auto, int8 or fp8
         enable_cuda_graph: bool = True,
         cuda_graph_max_seq_len: int = 2048,
         cuda_graph_batch_sizes: Optional[List[int]] = None,
         draft_cuda_graph_batch_sizes: Optional[List[int]] = None,
+        cuda_graph_num_tokens: Optional[List[int]] = None,
+        piecewise_cuda_graph_num_tokens: Optional[List[int]] = None,
         max_tokens_per_batch: int = 409600,  # a big number to disable chunked prefill
         max_seqs_per_batch: int = 2048,  # a big number for better throughput
+        target_step_time_ms: int = 0,  # 0 to keep max_tokens_per_batch fixed
+        min_tokens_per_batch: int = 64,
         num_speculative_tokens: int = 0,
+        speculative_tree_width: int = 1,
+        speculative_proposer: str = "draft",  # draft, ngram or medusa
+        ngram_max_size: int = 3,
+        enable_adaptive_speculation: bool = False,
+        speculative_min_acceptance: float = 0.3,
+        speculative_max_batch_size: int = 0,
+        num_decode_steps: int = 1,
+        enable_fused_sampling: bool = False,
+        enable_pivot_sampling: bool = False,
+        cascade_min_prefix_len: int = 0,
+        scheduling_policy: str = "fcfs",  # fcfs, slo, wfq or sjf
+        sjf_aging_tokens_per_second: float = 50.0,
+        tenant_weights: str = "",  # comma separated tenant=weight pairs
+        max_tenant_kv_cache_share: float = 1.0,
+        swap_bandwidth_gbps: float = 16.0,  # 0 means always swap if possible
+        max_compaction_blocks_per_step: int = 0,  # 0 means disabled
+        ttft_slo_ms: int = 0,  # 0 means no target
+        itl_slo_ms: int = 0,  # 0 means no target
+        prefix_admission_window: int = 0,  # 0 means queue order
+        max_admission_skips: int = 8,
+        wait_for_inflight_prefix: bool = True,
         num_handling_threads: int = 4,
+        num_response_threads: int = 4,
+        num_encode_threads: int = 8,
+        prompt_cache_tokens: int = 1024 * 1024,
+        max_cached_grammars: int = 64,  # 0 means disabled
     ) -> None:
         # download hf model if it does not exist
         self._model = model
@@ -59,18 +93,52 @@ class LLM:
         options.devices = devices
         options.draft_model_path = draft_model_path
         options.draft_devices = draft_devices
+        options.decode_devices = decode_devices
         options.block_size = block_size
+        options.large_block_size = large_block_size
         options.max_cache_size = max_cache_size
+        options.host_cache_size = host_cache_size
+        options.resizable_cache_size = resizable_cache_size
         options.max_memory_utilization = max_memory_utilization
         options.enable_prefix_cache = enable_prefix_cache
+        options.kv_cache_dtype = kv_cache_dtype
         options.enable_cuda_graph = enable_cuda_graph
         options.cuda_graph_max_seq_len = cuda_graph_max_seq_len
         options.cuda_graph_batch_sizes = cuda_graph_batch_sizes
         options.draft_cuda_graph_batch_sizes = draft_cuda_graph_batch_sizes
+        options.cuda_graph_num_tokens = cuda_graph_num_tokens
+        options.piecewise_cuda_graph_num_tokens = piecewise_cuda_graph_num_tokens
         options.max_tokens_per_batch = max_tokens_per_batch
         options.max_seqs_per_batch = max_seqs_per_batch
+        options.target_step_time_ms = target_step_time_ms
+        options.min_tokens_per_batch = min_tokens_per_batch
         options.num_speculative_tokens = num_speculative_tokens
+        options.speculative_tree_width = speculative_tree_width
+        options.speculative_proposer = speculative_proposer
+        options.ngram_max_size = ngram_max_size
+        options.enable_adaptive_speculation = enable_adaptive_speculation
+        options.speculative_min_acceptance = speculative_min_acceptance
+        options.speculative_max_batch_size = speculative_max_batch_size
+        options.num_decode_steps = num_decode_steps
+        options.enable_fused_sampling = enable_fused_sampling
+        options.enable_pivot_sampling = enable_pivot_sampling
+        options.cascade_min_prefix_len = cascade_min_prefix_len
+        options.scheduling_policy = scheduling_policy
+        options.sjf_aging_tokens_per_second = sjf_aging_tokens_per_second
+        options.tenant_weights = tenant_weights
+        options.max_tenant_kv_cache_share = max_tenant_kv_cache_share
+        options.swap_bandwidth_gbps = swap_bandwidth_gbps
+        options.max_compaction_blocks_per_step = max_compaction_blocks_per_step
+        options.ttft_slo_ms = ttft_slo_ms
+        options.itl_slo_ms = itl_slo_ms
+        options.prefix_admission_window = prefix_admission_window
+        options.max_admission_skips = max_admission_skips
+        options.wait_for_inflight_prefix = wait_for_inflight_prefix
         options.num_handling_threads = num_handling_threads
+        options.num_response_threads = num_response_threads
+        options.num_encode_threads = num_encode_threads
+        options.prompt_cache_tokens = prompt_cache_tokens
+        options.max_cached_grammars = max_cached_grammars
         # create the LLM handler
         self._handler = LLMHandler(options)
 
@@ -121,6 +189,55 @@ class LLM:
             output.prompt = prompts[index]
         return outputs
 
+    def generate_batch(
+        self,
+        prompts: List[str],
+        sampling_params: Optional[Union[SamplingParams, List[SamplingParams]]] = None,
+    ) -> BatchOutput:
+        """Generate for a large batch of prompts offline, optimized for throughput.
+
+        Unlike generate, the prompts are sorted by length and fed without
+        streaming, and the outputs come back in columns. Failed prompts are
+        reported in the statuses instead of raising an exception.
+        """
+        # use default sampling parameters if not provided
+        if sampling_params is None:
+            sampling_params = SamplingParams()
+        if isinstance(sampling_params, SamplingParams):
+            sampling_params = [sampling_params]
+
+        if len(sampling_params) != len(prompts) and len(sampling_params) != 1:
+            raise ValueError("The number of prompts and sampling parameters must match")
+
+        return self._handler.generate_batch(prompts, sampling_params)
+
+    def export_kv_cache(self, prompt: Union[str, List[int]], quantize: bool = False) -> bytes:
+        """Export the kv cache of the longest cached prefix of the prompt.
+
+        The buffer can be imported by another LLM of the same model with
+        import_kv_cache, e.g. to resume a multi-turn session there without
+        prefilling its history again. The kv cache is quantized to int8 if
+        quantize is True. Empty if nothing is cached.
+        """
+        token_ids = self.encode(prompt) if isinstance(prompt, str) else prompt
+        return self._handler.export_kv_cache(token_ids, quantize)
+
+    def import_kv_cache(self, buffer: bytes) -> int:
+        """Import a buffer from export_kv_cache into the prefix cache.
+
+        Returns the number of newly cached tokens.
+        """
+        return self._handler.import_kv_cache(buffer)
+
+    def resize_kv_cache(self, n_blocks: int) -> bool:
+        """Grow or shrink the kv cache pool to n_blocks blocks per device.
+
+        Only supported with a resizable_cache_size. A shrink waits for the
+        sequences holding the blocks at the end to finish. Returns False if
+        the kv cache is not resizable or the device is out of memory.
+        """
+        return self._handler.resize_kv_cache(n_blocks)
+
     def apply_chat_template(self, messages: List[Message]) -> Optional[str]:
         return self._handler.apply_chat_template(messages)
 
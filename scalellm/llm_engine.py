@@ -1,10 +1,11 @@
 import asyncio
 import os
 import queue
+import weakref
 from typing import List, Optional
 
-from scalellm._C import (LLMHandler, Message, Priority, RequestOutput,
-                         SamplingParams)
+from scalellm._C import (BridgeStream, LLMHandler, Message, Priority,
+                         RequestOutput, SamplingParams, StreamBridge)
 from scalellm.downloader import download_hf_model
 from scalellm.errors import ValidationError
 
@@ -52,35 +53,38 @@ class OutputStream:
 
 class OutputAsyncStream:
     """A stream of RequestOutput objects, which can be used to
-    send responses to the client asynchronously."""
+    send responses to the client asynchronously. The outputs are pushed
+    into a native stream by the response threads without the GIL, and
+    delivered on the event loop by a StreamDispatcher."""
 
-    def __init__(self) -> None:
+    def __init__(
+        self, native_stream: BridgeStream, prompt: Optional[str] = None
+    ) -> None:
         # asyncio.Queue is used to store the items in the stream, not thread-safe
         self._queue = asyncio.Queue()
-        # event loop used to schedule callbacks from other threads
-        self._loop = asyncio.get_running_loop()
-        assert self._loop is not None
+        self._native_stream = native_stream
+        # the prompt to attach to the outputs, if any
+        self._prompt = prompt
         self._cancelled = False
 
-    def _put_nowait(self, item):
-        # put item into asyncio.queue in a thread-safe way
-        self._loop.call_soon_threadsafe(self._queue.put_nowait, item)
-
-    # put item into the stream
-    # None to indicate the end of the stream
+    # put item into the stream, called on the event loop
     def put(self, item: RequestOutput) -> bool:
         # if the stream is cancelled, return False
         if self._cancelled:
             return False
 
         if item.status is not None and not item.status.ok:
-            self._put_nowait(ValidationError(item.status.code, item.status.message))
+            self._queue.put_nowait(
+                ValidationError(item.status.code, item.status.message)
+            )
             return False
 
+        if self._prompt is not None:
+            item.prompt = self._prompt
         # put the item into the queue
-        self._put_nowait(item)
+        self._queue.put_nowait(item)
         if item.finished:
-            self._put_nowait(StopAsyncIteration())
+            self._queue.put_nowait(StopAsyncIteration())
         return True
 
     # report an error to the stream, rerais as an exception
@@ -88,11 +92,17 @@ class OutputAsyncStream:
         self._queue.put_nowait(Exception(error))
         return True
 
-    # cancel the stream
+    # cancel the stream, the request is cancelled at its next output
     def cancel(self) -> None:
         self._cancelled = True
+        self._native_stream.cancel()
         self._queue.put_nowait(StopAsyncIteration())
 
+    # the native stream the outputs are pushed into
+    @property
+    def native_stream(self) -> BridgeStream:
+        return self._native_stream
+
     def __aiter__(self):
         return self
 
@@ -105,6 +115,44 @@ class OutputAsyncStream:
         return item
 
 
+class StreamDispatcher:
+    """Delivers the outputs of the streams of a StreamBridge on an event
+    loop. The bridge signals its eventfd when outputs are pushed, and the
+    loop drains the outputs of all streams in one batch, so that the response
+    threads never take the GIL."""
+
+    def __init__(self, loop: asyncio.AbstractEventLoop) -> None:
+        self.loop = loop
+        self._bridge = StreamBridge()
+        # stream id -> stream, the outputs of the dropped streams are ignored
+        self._streams = weakref.WeakValueDictionary()
+        self.loop.add_reader(self._bridge.fileno(), self._drain)
+
+    # create a stream for a new request
+    def open(self, prompt: Optional[str] = None) -> OutputAsyncStream:
+        native_stream = self._bridge.open()
+        stream = OutputAsyncStream(native_stream, prompt)
+        self._streams[native_stream.id] = stream
+        return stream
+
+    def _drain(self) -> None:
+        for stream_id, outputs in self._bridge.drain():
+            stream = self._streams.get(stream_id)
+            if stream is None:
+                continue
+            for output in outputs:
+                if not stream.put(output) or output.finished:
+                    del self._streams[stream_id]
+                    break
+
+    # stop watching the bridge
+    def close(self) -> None:
+        if not self.loop.is_closed():
+            self.loop.call_soon_threadsafe(
+                self.loop.remove_reader, self._bridge.fileno()
+            )
+
+
 class AsyncLLMEngine:
     def __init__(
         self,
@@ -117,18 +165,63 @@ class AsyncLLMEngine:
         convert_to_safetensors: bool = False,
         devices: Optional[str] = None,
         draft_devices: Optional[str] = None,
+        decode_devices: Optional[str] = None,
         block_size: int = 8,
+        large_block_size: int = 0,  # 0 means large blocks are disabled
         max_cache_size: int = 0,  # 0 means that cache size is caculated by available memory
+        host_cache_size: int = 0,  # 0 means that swapping to host memory is disabled
+        resizable_cache_size: int = 0,  # 0 means that the kv cache has a fixed size
         max_memory_utilization: float = 0.9,
         enable_prefix_cache: bool = True,
+        kv_cache_dtype: str = "auto",  # auto, int8 or fp8
         enable_cuda_graph: bool = True,
         cuda_graph_max_seq_len: int = 2048,
         cuda_graph_batch_sizes: Optional[List[int]] = None,
         draft_cuda_graph_batch_sizes: Optional[List[int]] = None,
+        cuda_graph_num_tokens: Optional[List[int]] = None,
+        piecewise_cuda_graph_num_tokens: Optional[List[int]] = None,
         max_tokens_per_batch: int = 512,
         max_seqs_per_batch: int = 128,
+        target_step_time_ms: int = 0,  # 0 to keep max_tokens_per_batch fixed
+        min_tokens_per_batch: int = 64,
         num_speculative_tokens: int = 0,
+        speculative_tree_width: int = 1,
+        speculative_proposer: str = "draft",  # draft, ngram or medusa
+        ngram_max_size: int = 3,
+        enable_adaptive_speculation: bool = False,
+        speculative_min_acceptance: float = 0.3,
+        speculative_max_batch_size: int = 0,
+        num_decode_steps: int = 1,
+        enable_fused_sampling: bool = False,
+        enable_pivot_sampling: bool = False,
+        cascade_min_prefix_len: int = 0,
+        scheduling_policy: str = "fcfs",  # fcfs, slo, wfq or sjf
+        sjf_aging_tokens_per_second: float = 50.0,
+        tenant_weights: str = "",  # comma separated tenant=weight pairs
+        max_tenant_kv_cache_share: float = 1.0,
+        swap_bandwidth_gbps: float = 16.0,  # 0 means always swap if possible
+        max_compaction_blocks_per_step: int = 0,  # 0 means disabled
+        ttft_slo_ms: int = 0,  # 0 means no target
+        itl_slo_ms: int = 0,  # 0 means no target
+        prefix_admission_window: int = 0,  # 0 means queue order
+        max_admission_skips: int = 8,
+        wait_for_inflight_prefix: bool = True,
+        high_priority_reserved_tokens: int = 0,
+        high_priority_reserved_seqs: int = 0,
         num_handling_threads: int = 4,
+        num_response_threads: int = 4,
+        num_encode_threads: int = 8,
+        prompt_cache_tokens: int = 1024 * 1024,
+        response_cache_size: int = 0,  # 0 means disabled
+        response_cache_ttl_seconds: int = 60,
+        max_cached_grammars: int = 64,  # 0 means disabled
+        scheduler_cpus: str = "",
+        handler_cpus: str = "",
+        numa_affinity: bool = False,
+        enable_activation_pool: bool = False,
+        enable_warmup: bool = False,
+        max_estimated_ttft_ms: int = 0,  # 0 means disabled
+        clamp_max_tokens_to_kv_cache: bool = False,
     ) -> None:
         self._model = model
         self._draft_model = draft_model
@@ -157,20 +250,76 @@ class AsyncLLMEngine:
         options.devices = devices
         options.draft_model_path = draft_model_path
         options.draft_devices = draft_devices
+        options.decode_devices = decode_devices
         options.block_size = block_size
+        options.large_block_size = large_block_size
         options.max_cache_size = max_cache_size
+        options.host_cache_size = host_cache_size
+        options.resizable_cache_size = resizable_cache_size
         options.max_memory_utilization = max_memory_utilization
         options.enable_prefix_cache = enable_prefix_cache
+        options.kv_cache_dtype = kv_cache_dtype
         options.enable_cuda_graph = enable_cuda_graph
         options.cuda_graph_max_seq_len = cuda_graph_max_seq_len
         options.cuda_graph_batch_sizes = cuda_graph_batch_sizes
         options.draft_cuda_graph_batch_sizes = draft_cuda_graph_batch_sizes
+        options.cuda_graph_num_tokens = cuda_graph_num_tokens
+        options.piecewise_cuda_graph_num_tokens = piecewise_cuda_graph_num_tokens
         options.max_tokens_per_batch = max_tokens_per_batch
         options.max_seqs_per_batch = max_seqs_per_batch
+        options.target_step_time_ms = target_step_time_ms
+        options.min_tokens_per_batch = min_tokens_per_batch
         options.num_speculative_tokens = num_speculative_tokens
+        options.speculative_tree_width = speculative_tree_width
+        options.speculative_proposer = speculative_proposer
+        options.ngram_max_size = ngram_max_size
+        options.enable_adaptive_speculation = enable_adaptive_speculation
+        options.speculative_min_acceptance = speculative_min_acceptance
+        options.speculative_max_batch_size = speculative_max_batch_size
+        options.num_decode_steps = num_decode_steps
+        options.enable_fused_sampling = enable_fused_sampling
+        options.enable_pivot_sampling = enable_pivot_sampling
+        options.cascade_min_prefix_len = cascade_min_prefix_len
+        options.scheduling_policy = scheduling_policy
+        options.sjf_aging_tokens_per_second = sjf_aging_tokens_per_second
+        options.tenant_weights = tenant_weights
+        options.max_tenant_kv_cache_share = max_tenant_kv_cache_share
+        options.swap_bandwidth_gbps = swap_bandwidth_gbps
+        options.max_compaction_blocks_per_step = max_compaction_blocks_per_step
+        options.ttft_slo_ms = ttft_slo_ms
+        options.itl_slo_ms = itl_slo_ms
+        options.prefix_admission_window = prefix_admission_window
+        options.max_admission_skips = max_admission_skips
+        options.wait_for_inflight_prefix = wait_for_inflight_prefix
+        options.high_priority_reserved_tokens = high_priority_reserved_tokens
+        options.high_priority_reserved_seqs = high_priority_reserved_seqs
         options.num_handling_threads = num_handling_threads
+        options.num_response_threads = num_response_threads
+        options.num_encode_threads = num_encode_threads
+        options.prompt_cache_tokens = prompt_cache_tokens
+        options.response_cache_size = response_cache_size
+        options.response_cache_ttl_seconds = response_cache_ttl_seconds
+        options.max_cached_grammars = max_cached_grammars
+        options.scheduler_cpus = scheduler_cpus
+        options.handler_cpus = handler_cpus
+        options.numa_affinity = numa_affinity
+        options.enable_activation_pool = enable_activation_pool
+        options.enable_warmup = enable_warmup
+        options.max_estimated_ttft_ms = max_estimated_ttft_ms
+        options.clamp_max_tokens_to_kv_cache = clamp_max_tokens_to_kv_cache
         # create the LLM handler
         self._handler = LLMHandler(options)
+        # delivers the outputs of the async streams, created on first use
+        self._dispatcher: Optional[StreamDispatcher] = None
+
+    # the dispatcher of the running event loop
+    def _get_dispatcher(self) -> StreamDispatcher:
+        loop = asyncio.get_running_loop()
+        if self._dispatcher is None or self._dispatcher.loop is not loop:
+            if self._dispatcher is not None:
+                self._dispatcher.close()
+            self._dispatcher = StreamDispatcher(loop)
+        return self._dispatcher
 
     # schedule a request to the engine, and return a stream to receive output
     async def schedule_async(
@@ -180,16 +329,15 @@ class AsyncLLMEngine:
         priority: Priority = Priority.NORMAL,
         stream: bool = False,
     ) -> OutputAsyncStream:
-        output_stream = OutputAsyncStream()
-
-        def callback(output: RequestOutput) -> bool:
-            output.prompt = prompt
-            return output_stream.put(output)
-
+        output_stream = self._get_dispatcher().open(prompt)
         # use default sampling parameters if not provided
         sampling_params = sampling_params or SamplingParams()
         self._handler.schedule_async(
-            prompt, sampling_params, priority, stream, callback
+            prompt,
+            sampling_params,
+            priority,
+            stream,
+            output_stream.native_stream,
         )
         return output_stream
 
@@ -200,15 +348,15 @@ class AsyncLLMEngine:
         priority: Priority = Priority.NORMAL,
         stream: bool = False,
     ) -> OutputAsyncStream:
-        output_stream = OutputAsyncStream()
-
-        def callback(output: RequestOutput) -> bool:
-            return output_stream.put(output)
-
+        output_stream = self._get_dispatcher().open()
         # use default sampling parameters if not provided
         sampling_params = sampling_params or SamplingParams()
         self._handler.schedule_chat_async(
-            messages, sampling_params, priority, stream, callback
+            messages,
+            sampling_params,
+            priority,
+            stream,
+            output_stream.native_stream,
         )
         return output_stream
 
@@ -259,6 +407,20 @@ class AsyncLLMEngine:
     def stop(self) -> None:
         return self._handler.stop()
 
+    # refuse new requests and wait for the running ones to finish, blocking.
+    # returns False on timeout.
+    def drain(self, timeout_s: float = 30.0) -> bool:
+        return self._handler.drain(timeout_s)
+
+    def export_kv_cache(self, token_ids: List[int], quantize: bool = False) -> bytes:
+        return self._handler.export_kv_cache(token_ids, quantize)
+
+    def import_kv_cache(self, buffer: bytes) -> int:
+        return self._handler.import_kv_cache(buffer)
+
+    def resize_kv_cache(self, n_blocks: int) -> bool:
+        return self._handler.resize_kv_cache(n_blocks)
+
     def apply_chat_template(self, messages: List[Message]) -> Optional[str]:
         return self._handler.apply_chat_template(messages)
 
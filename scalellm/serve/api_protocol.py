@@ -1,6 +1,6 @@
 # Adapted from https://github.com/lm-sys/FastChat
 import time
-from typing import Dict, List, Literal, Optional, Union
+from typing import Any, Dict, List, Literal, Optional, Union
 
 import shortuuid
 from pydantic import BaseModel, Field
@@ -69,6 +69,20 @@ class ChatCompletionMessage(BaseModel):
 class StreamOptions(BaseModel):
     include_usage: Optional[bool]
 
+class JsonSchemaFormat(BaseModel):
+    name: Optional[str] = None
+    description: Optional[str] = None
+    # alias to avoid shadowing BaseModel.schema
+    json_schema: Optional[Dict[str, Any]] = Field(None, alias="schema")
+    strict: Optional[bool] = None
+
+
+class ResponseFormat(BaseModel):
+    # text, json_object or json_schema
+    type: Literal["text", "json_object", "json_schema"]
+    json_schema: Optional[JsonSchemaFormat] = None
+
+
 class ChatCompletionRequest(BaseModel):
     model: str
     messages: List[ChatCompletionMessage]
@@ -85,12 +99,22 @@ class ChatCompletionRequest(BaseModel):
     top_k: Optional[int] = -1
     logprobs: Optional[bool] = False
     top_logprobs: Optional[int] = Field(0, ge=0, le=20)
-    # user: Optional[str] = None
+    user: Optional[str] = None
     skip_special_tokens: Optional[bool] = True
     ignore_eos: Optional[bool] = False
     stop: Optional[Union[str, List[str]]] = None
     stop_token_ids: Optional[List[int]] = None
-    # seed: Optional[int] = None
+    # token id (as string) to bias between [-100, 100]
+    logit_bias: Optional[Dict[str, float]] = None
+    # the only token ids that can be generated
+    allowed_token_ids: Optional[List[int]] = None
+    response_format: Optional[ResponseFormat] = None
+    # constrain the output to the regular expression
+    regex: Optional[str] = None
+    # the number of beams to search the n best outputs with, not streamed
+    beam_width: Optional[int] = Field(None, ge=0, le=10)
+    # the seed of the random numbers to sample with
+    seed: Optional[int] = Field(None, ge=0, lt=2**64)
 
 
 class ChatMessage(BaseModel):
@@ -153,12 +177,22 @@ class CompletionRequest(BaseModel):
     repetition_penalty: Optional[float] = 1.0
     top_p: Optional[float] = 1.0
     top_k: Optional[int] = -1
-    # user: Optional[str] = None
+    user: Optional[str] = None
     skip_special_tokens: Optional[bool] = True
     ignore_eos: Optional[bool] = False
     stop: Optional[Union[str, List[str]]] = None
     stop_token_ids: Optional[List[int]] = None
-    # seed: Optional[int] = None
+    # token id (as string) to bias between [-100, 100]
+    logit_bias: Optional[Dict[str, float]] = None
+    # the only token ids that can be generated
+    allowed_token_ids: Optional[List[int]] = None
+    response_format: Optional[ResponseFormat] = None
+    # constrain the output to the regular expression
+    regex: Optional[str] = None
+    # the number of beams to search the n best outputs with, not streamed
+    beam_width: Optional[int] = Field(None, ge=0, le=10)
+    # the seed of the random numbers to sample with
+    seed: Optional[int] = Field(None, ge=0, lt=2**64)
 
 
 class CompletionLogProbs(BaseModel):
@@ -199,3 +233,25 @@ class CompletionStreamResponse(BaseModel):
     model: str
     choices: List[CompletionResponseStreamChoice]
     usage: Optional[UsageInfo] = None
+
+
+class EmbeddingRequest(BaseModel):
+    model: str
+    input: Union[str, List[str]]
+    priority: Optional[Literal["default", "low", "normal", "high"]] = None
+    # how the last hidden states of the input tokens are pooled
+    pooling: Optional[Literal["mean", "last"]] = "last"
+    user: Optional[str] = None
+
+
+class EmbeddingData(BaseModel):
+    index: int
+    object: str = "embedding"
+    embedding: List[float]
+
+
+class EmbeddingResponse(BaseModel):
+    object: str = "list"
+    model: str
+    data: List[EmbeddingData]
+    usage: Optional[UsageInfo] = None
@@ -2,6 +2,7 @@
 
 - Chat Completions. (Reference: https://platform.openai.com/docs/api-reference/chat)
 - Completions. (Reference: https://platform.openai.com/docs/api-reference/completions)
+- Embeddings. (Reference: https://platform.openai.com/docs/api-reference/embeddings)
 
 Usage:
 python3 -m scalellm.serve.api_server
@@ -18,12 +19,14 @@ from fastapi.responses import JSONResponse, Response
 
 from scalellm import AsyncLLMEngine, ValidationError, get_metrics
 from scalellm.serve.api_protocol import (ChatCompletionRequest,
-                                         CompletionRequest, ErrorResponse,
-                                         ModelCard, ModelList, ModelPermission)
+                                         CompletionRequest, EmbeddingRequest,
+                                         ErrorResponse, ModelCard, ModelList,
+                                         ModelPermission)
 from scalellm.serve.chat_handler import (generate_chat_response,
                                          generate_chat_stream_response)
 from scalellm.serve.completion_handler import (
     generate_completion_response, generate_completion_stream_response)
+from scalellm.serve.embedding_handler import generate_embedding_response
 from scalellm.serve.server_args import parse_args
 
 app = fastapi.FastAPI()
@@ -79,7 +82,8 @@ async def create_chat_completion(request: ChatCompletionRequest):
     if error_response is not None:
         return error_response
 
-    if request.stream:
+    # results cannot be streamed with beam search
+    if request.stream and not request.beam_width:
         return await generate_chat_stream_response(request, llm_engine)
     return await generate_chat_response(request, llm_engine)
 
@@ -91,9 +95,11 @@ async def create_completion(request: CompletionRequest):
     if error_response is not None:
         return error_response
 
-    # results cannot be streamed when best_of != n
-    stream = request.stream and (
-        request.best_of is None or request.n == request.best_of
+    # results cannot be streamed when best_of != n or with beam search
+    stream = (
+        request.stream
+        and (request.best_of is None or request.n == request.best_of)
+        and not request.beam_width
     )
 
     if stream:
@@ -101,6 +107,15 @@ async def create_completion(request: CompletionRequest):
     return await generate_completion_response(request, llm_engine)
 
 
+@app.post("/v1/embeddings")
+async def create_embedding(request: EmbeddingRequest):
+    """Creates the embeddings of the inputs"""
+    error_response = check_model(request)
+    if error_response is not None:
+        return error_response
+    return await generate_embedding_response(request, llm_engine)
+
+
 def parse_batch_sizes(batch_sizes_str):
     if batch_sizes_str is None:
         return None
@@ -129,22 +144,69 @@ if __name__ == "__main__":
         draft_model=args.draft_model,
         draft_revision=args.draft_revision,
         draft_devices=args.draft_devices,
+        decode_devices=args.decode_devices,
         cache_dir=args.cache_dir,
         convert_to_safetensors=args.convert_to_safetensors,
         block_size=args.block_size,
+        large_block_size=args.large_block_size,
         max_cache_size=args.max_cache_size,
+        host_cache_size=args.host_cache_size,
+        resizable_cache_size=args.resizable_cache_size,
         max_memory_utilization=args.max_memory_utilization,
         enable_prefix_cache=args.enable_prefix_cache,
+        kv_cache_dtype=args.kv_cache_dtype,
         enable_cuda_graph=args.enable_cuda_graph,
         cuda_graph_max_seq_len=args.cuda_graph_max_seq_len,
         cuda_graph_batch_sizes=parse_batch_sizes(args.cuda_graph_batch_sizes),
         draft_cuda_graph_batch_sizes=parse_batch_sizes(
             args.draft_cuda_graph_batch_sizes
         ),
+        cuda_graph_num_tokens=parse_batch_sizes(args.cuda_graph_num_tokens),
+        piecewise_cuda_graph_num_tokens=parse_batch_sizes(
+            args.piecewise_cuda_graph_num_tokens
+        ),
         max_tokens_per_batch=args.max_tokens_per_batch,
         max_seqs_per_batch=args.max_seqs_per_batch,
+        target_step_time_ms=args.target_step_time_ms,
+        min_tokens_per_batch=args.min_tokens_per_batch,
         num_speculative_tokens=args.num_speculative_tokens,
+        speculative_tree_width=args.speculative_tree_width,
+        speculative_proposer=args.speculative_proposer,
+        ngram_max_size=args.ngram_max_size,
+        enable_adaptive_speculation=args.enable_adaptive_speculation,
+        speculative_min_acceptance=args.speculative_min_acceptance,
+        speculative_max_batch_size=args.speculative_max_batch_size,
+        num_decode_steps=args.num_decode_steps,
+        enable_fused_sampling=args.enable_fused_sampling,
+        enable_pivot_sampling=args.enable_pivot_sampling,
+        cascade_min_prefix_len=args.cascade_min_prefix_len,
+        scheduling_policy=args.scheduling_policy,
+        sjf_aging_tokens_per_second=args.sjf_aging_tokens_per_second,
+        tenant_weights=args.tenant_weights,
+        max_tenant_kv_cache_share=args.max_tenant_kv_cache_share,
+        swap_bandwidth_gbps=args.swap_bandwidth_gbps,
+        max_compaction_blocks_per_step=args.max_compaction_blocks_per_step,
+        ttft_slo_ms=args.ttft_slo_ms,
+        itl_slo_ms=args.itl_slo_ms,
+        prefix_admission_window=args.prefix_admission_window,
+        max_admission_skips=args.max_admission_skips,
+        wait_for_inflight_prefix=args.wait_for_inflight_prefix,
+        high_priority_reserved_tokens=args.high_priority_reserved_tokens,
+        high_priority_reserved_seqs=args.high_priority_reserved_seqs,
         num_handling_threads=args.num_handling_threads,
+        num_response_threads=args.num_response_threads,
+        num_encode_threads=args.num_encode_threads,
+        prompt_cache_tokens=args.prompt_cache_tokens,
+        response_cache_size=args.response_cache_size,
+        response_cache_ttl_seconds=args.response_cache_ttl_seconds,
+        max_cached_grammars=args.max_cached_grammars,
+        scheduler_cpus=args.scheduler_cpus,
+        handler_cpus=args.handler_cpus,
+        numa_affinity=args.numa_affinity,
+        enable_activation_pool=args.enable_activation_pool,
+        enable_warmup=args.enable_warmup,
+        max_estimated_ttft_ms=args.max_estimated_ttft_ms,
+        clamp_max_tokens_to_kv_cache=args.clamp_max_tokens_to_kv_cache,
     )
 
     try:
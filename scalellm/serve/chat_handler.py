@@ -16,7 +16,8 @@ from scalellm.serve.api_protocol import (ChatCompletionLogProb,
                                          ChatCompletionStreamResponse,
                                          ChatMessage, DeltaMessage)
 from scalellm.serve.common import (get_printable_token, jsonify_model,
-                                   to_api_usage, to_priority)
+                                   set_response_format, to_api_usage,
+                                   to_priority)
 from scalellm.serve.streaming_response import SafeStreamingResponse
 
 
@@ -24,6 +25,8 @@ def to_sampling_params(request: ChatCompletionRequest) -> SamplingParams:
     sp = SamplingParams()
     sp.max_tokens = request.max_tokens
     sp.n = request.n
+    if request.beam_width:
+        sp.beam_width = request.beam_width
     # no echo for chat completion
     sp.echo = False
     sp.frequency_penalty = request.frequency_penalty
@@ -38,6 +41,13 @@ def to_sampling_params(request: ChatCompletionRequest) -> SamplingParams:
     sp.stop = request.stop
     sp.ignore_eos = request.ignore_eos
     sp.stop_token_ids = request.stop_token_ids
+    if request.logit_bias:
+        sp.logit_bias = {int(k): v for k, v in request.logit_bias.items()}
+    sp.allowed_token_ids = request.allowed_token_ids
+    sp.seed = request.seed
+    if request.user:
+        sp.tenant = request.user
+    set_response_format(sp, request.response_format, request.regex)
     return sp
 
 
@@ -1,9 +1,10 @@
+import json
 from typing import Optional
 
 from pydantic import BaseModel
 
-from scalellm import Priority, Usage
-from scalellm.serve.api_protocol import UsageInfo
+from scalellm import Priority, SamplingParams, Usage
+from scalellm.serve.api_protocol import ResponseFormat, UsageInfo
 
 
 def jsonify_model(obj: BaseModel):
@@ -39,3 +40,23 @@ def to_api_usage(usage: Optional[Usage]) -> Optional[UsageInfo]:
         total_tokens=usage.num_total_tokens,
         completion_tokens=usage.num_generated_tokens,
     )
+
+
+def set_response_format(
+    sp: SamplingParams,
+    response_format: Optional[ResponseFormat],
+    regex: Optional[str],
+) -> None:
+    if regex is not None:
+        sp.regex = regex
+    if response_format is None or response_format.type == "text":
+        return
+    if response_format.type == "json_object":
+        sp.json_object = True
+        return
+    json_schema = response_format.json_schema
+    if json_schema is None or json_schema.json_schema is None:
+        # no schema to follow, fall back to the json mode
+        sp.json_object = True
+        return
+    sp.json_schema = json.dumps(json_schema.json_schema)
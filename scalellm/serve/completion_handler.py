@@ -10,7 +10,8 @@ from scalellm.serve.api_protocol import (CompletionLogProbs, CompletionRequest,
                                          CompletionResponseStreamChoice,
                                          CompletionStreamResponse)
 from scalellm.serve.common import (get_printable_token, jsonify_model,
-                                   to_api_usage, to_priority)
+                                   set_response_format, to_api_usage,
+                                   to_priority)
 from scalellm.serve.streaming_response import SafeStreamingResponse
 
 
@@ -18,6 +19,8 @@ def to_sampling_params(request: CompletionRequest) -> SamplingParams:
     sp = SamplingParams()
     sp.max_tokens = request.max_tokens
     sp.n = request.n
+    if request.beam_width:
+        sp.beam_width = request.beam_width
     sp.best_of = request.best_of
     sp.echo = request.echo
     sp.frequency_penalty = request.frequency_penalty
@@ -33,6 +36,13 @@ def to_sampling_params(request: CompletionRequest) -> SamplingParams:
     sp.stop = request.stop
     sp.ignore_eos = request.ignore_eos
     sp.stop_token_ids = request.stop_token_ids
+    if request.logit_bias:
+        sp.logit_bias = {int(k): v for k, v in request.logit_bias.items()}
+    sp.allowed_token_ids = request.allowed_token_ids
+    sp.seed = request.seed
+    if request.user:
+        sp.tenant = request.user
+    set_response_format(sp, request.response_format, request.regex)
     return sp
 
 
@@ -87,7 +97,8 @@ async def generate_completion_response(
     # only one output is expected for non-streaming request
     output = await output_stream.__anext__()
     choices = []
-    prompt_len = len(request.prompt)
+    # the prompt is part of the text when echoed back
+    prompt_len = 0 if request.echo else len(request.prompt)
     for seq_output in output.outputs:
         choices.append(
             CompletionResponseChoice(
@@ -129,7 +140,7 @@ async def generate_completion_stream_response(
     include_usage = request.stream_options and request.stream_options.include_usage
 
     async def generate_stream_content():
-        prompt_len = len(request.prompt)
+        prompt_len = 0 if request.echo else len(request.prompt)
         offsets = {}
         usage = None
         async for output in output_stream:
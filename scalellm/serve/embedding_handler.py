@@ -0,0 +1,54 @@
+import asyncio
+from typing import List
+
+from scalellm import AsyncLLMEngine, SamplingParams
+from scalellm.serve.api_protocol import (EmbeddingData, EmbeddingRequest,
+                                         EmbeddingResponse, UsageInfo)
+from scalellm.serve.common import to_priority
+
+
+def to_sampling_params(request: EmbeddingRequest) -> SamplingParams:
+    sp = SamplingParams()
+    sp.pooling = request.pooling or "last"
+    if request.user:
+        sp.tenant = request.user
+    return sp
+
+
+async def generate_embedding_response(
+    request: EmbeddingRequest, engine: AsyncLLMEngine
+) -> EmbeddingResponse:
+    inputs: List[str] = (
+        [request.input] if isinstance(request.input, str) else request.input
+    )
+    sampling_params = to_sampling_params(request)
+    priority = to_priority(request.priority)
+
+    async def embed(text: str):
+        output_stream = await engine.schedule_async(
+            text,
+            sampling_params=sampling_params,
+            priority=priority,
+            stream=False,
+        )
+        # only one output is expected for non-streaming request
+        return await output_stream.__anext__()
+
+    # the inputs are scheduled together to be batched by the engine
+    outputs = await asyncio.gather(*[embed(text) for text in inputs])
+    data, num_prompt_tokens = [], 0
+    for index, output in enumerate(outputs):
+        data.append(
+            EmbeddingData(index=index, embedding=output.outputs[0].embedding)
+        )
+        if output.usage:
+            num_prompt_tokens += output.usage.num_prompt_tokens
+    return EmbeddingResponse(
+        model=request.model,
+        data=data,
+        usage=UsageInfo(
+            prompt_tokens=num_prompt_tokens,
+            total_tokens=num_prompt_tokens,
+            completion_tokens=0,
+        ),
+    )
@@ -44,18 +44,42 @@ def parse_args():
     parser.add_argument(
         "--draft_devices", type=str, default="auto", help="Draft devices to use."
     )
+    parser.add_argument(
+        "--decode_devices",
+        type=str,
+        default=None,
+        help="Devices of a second engine to run the decodes on, with the kv cache pulled from the prefill engine.",
+    )
     parser.add_argument(
         "--block_size",
         type=int,
         default=8,
         help="Number of slots per kv cache block, must be a power of 2. Default is 8.",
     )
+    parser.add_argument(
+        "--large_block_size",
+        type=int,
+        default=0,
+        help="Number of slots per large block of consecutive kv cache blocks allocated to long prompts, a power of 2 multiple of block_size. 0 to disable.",
+    )
     parser.add_argument(
         "--max_cache_size",
         type=int,
         default=0,
         help="Max gpu memory size for kv cache. Default is 0, which means cache size is caculated by available memory.",
     )
+    parser.add_argument(
+        "--host_cache_size",
+        type=int,
+        default=0,
+        help="Host memory size for swapping out kv cache of preempted requests. Default is 0, which means swapping is disabled.",
+    )
+    parser.add_argument(
+        "--resizable_cache_size",
+        type=int,
+        default=0,
+        help="Max gpu memory size to grow the kv cache to at runtime. Default is 0, which means the kv cache has a fixed size.",
+    )
     parser.add_argument(
         "--max_memory_utilization",
         type=float,
@@ -68,6 +92,12 @@ def parse_args():
         default=True,
         help="Enable prefix cache.",
     )
+    parser.add_argument(
+        "--kv_cache_dtype",
+        type=str,
+        default="auto",
+        help="Data type of kv cache, e.g. auto, int8 or fp8. Default is auto, which means the same data type as the model.",
+    )
     parser.add_argument(
         "--enable_cuda_graph",
         type=lambda s: s.lower() in ["true", "t", "yes", "1"],
@@ -92,6 +122,18 @@ def parse_args():
         default=None,
         help="Batch sizes to capture for draft CUDA graph. Values are a list of integers separated by comma. (e.g., 1,2,4,8,16,32,64,128)",
     )
+    parser.add_argument(
+        "--cuda_graph_num_tokens",
+        type=str,
+        default=None,
+        help="Numbers of tokens to capture CUDA graphs for batches with prefill, e.g. chunked prefill. Values are a list of integers separated by comma. (e.g., 256,512)",
+    )
+    parser.add_argument(
+        "--piecewise_cuda_graph_num_tokens",
+        type=str,
+        default=None,
+        help="Token-count buckets to capture piecewise CUDA graphs for batches without a captured CUDA graph, with the attention running eagerly. Captured at first use. Values are a list of integers separated by comma. (e.g., 256,512,1024)",
+    )
     parser.add_argument(
         "--max_tokens_per_batch",
         type=int,
@@ -104,18 +146,246 @@ def parse_args():
         default=128,
         help="Max number of sequences per batch.",
     )
+    parser.add_argument(
+        "--target_step_time_ms",
+        type=int,
+        default=0,
+        help="Target step time in milliseconds to tune the tokens per batch for online, between min_tokens_per_batch and max_tokens_per_batch. 0 to keep max_tokens_per_batch fixed.",
+    )
+    parser.add_argument(
+        "--min_tokens_per_batch",
+        type=int,
+        default=64,
+        help="Lower bound of the tokens per batch tuned for the target step time.",
+    )
     parser.add_argument(
         "--num_speculative_tokens",
         type=int,
         default=0,
         help="Number of speculative tokens.",
     )
+    parser.add_argument(
+        "--speculative_tree_width",
+        type=int,
+        default=1,
+        help="Number of candidates per speculative position, 1 means a single chain.",
+    )
+    parser.add_argument(
+        "--speculative_proposer",
+        type=str,
+        default="draft",
+        help="The source of speculative tokens: draft model, n-gram prompt lookup or medusa heads from the draft model path.",
+    )
+    parser.add_argument(
+        "--ngram_max_size",
+        type=int,
+        default=3,
+        help="The max n-gram size matched by the ngram proposer.",
+    )
+    parser.add_argument(
+        "--enable_adaptive_speculation",
+        type=lambda s: s.lower() in ["true", "t", "yes", "1"],
+        default=False,
+        help="Adapt the number of speculative tokens to the acceptance rate.",
+    )
+    parser.add_argument(
+        "--speculative_min_acceptance",
+        type=float,
+        default=0.3,
+        help="Min acceptance probability of the last adaptive speculative token.",
+    )
+    parser.add_argument(
+        "--speculative_max_batch_size",
+        type=int,
+        default=0,
+        help="Turn off speculation at this many decoding sequences, 0 means never.",
+    )
+    parser.add_argument(
+        "--num_decode_steps",
+        type=int,
+        default=1,
+        help="Number of decode steps to run on device per scheduler step.",
+    )
+    parser.add_argument(
+        "--enable_fused_sampling",
+        type=lambda s: s.lower() in ["true", "t", "yes", "1"],
+        default=False,
+        help="Enable the fused sampling kernel.",
+    )
+    parser.add_argument(
+        "--enable_pivot_sampling",
+        type=lambda s: s.lower() in ["true", "t", "yes", "1"],
+        default=False,
+        help="Apply top_k and top_p with pivot search instead of sorting.",
+    )
+    parser.add_argument(
+        "--cascade_min_prefix_len",
+        type=int,
+        default=0,
+        help="Min shared prefix length to use cascade attention, 0 to disable.",
+    )
+    parser.add_argument(
+        "--scheduling_policy",
+        type=str,
+        default="fcfs",
+        help="Scheduling policy, e.g. fcfs, slo, wfq or sjf. slo schedules requests by deadline and sizes prefill chunks to meet the inter token latency target. wfq shares the capacity fairly among tenants. sjf schedules requests by their predicted output length and reserves blocks for it.",
+    )
+    parser.add_argument(
+        "--sjf_aging_tokens_per_second",
+        type=float,
+        default=50.0,
+        help="Predicted output tokens a waiting request is credited per second under the sjf policy, so that long requests are not starved.",
+    )
+    parser.add_argument(
+        "--tenant_weights",
+        type=str,
+        default="",
+        help="Comma separated tenant=weight pairs for the wfq policy, tenants not listed have a weight of 1.",
+    )
+    parser.add_argument(
+        "--max_tenant_kv_cache_share",
+        type=float,
+        default=1.0,
+        help="Max fraction of the kv cache a tenant can hold under the wfq policy before its new requests wait.",
+    )
+    parser.add_argument(
+        "--swap_bandwidth_gbps",
+        type=float,
+        default=16.0,
+        help="Host to device bandwidth in GB/s to weigh swapping preempted requests against recomputing them, 0 to always swap when possible.",
+    )
+    parser.add_argument(
+        "--max_compaction_blocks_per_step",
+        type=int,
+        default=0,
+        help="Max number of kv cache blocks copied per decode step to move the blocks of running sequences into consecutive blocks, 0 to disable.",
+    )
+    parser.add_argument(
+        "--ttft_slo_ms",
+        type=int,
+        default=0,
+        help="Time to first token target in milliseconds, 0 means no target.",
+    )
+    parser.add_argument(
+        "--itl_slo_ms",
+        type=int,
+        default=0,
+        help="Inter token latency target in milliseconds, 0 means no target.",
+    )
+    parser.add_argument(
+        "--prefix_admission_window",
+        type=int,
+        default=0,
+        help="Number of waiting requests to pick from by their cached prefix length, 0 or 1 to admit requests in the queue order.",
+    )
+    parser.add_argument(
+        "--max_admission_skips",
+        type=int,
+        default=8,
+        help="Max number of times a waiting request can be passed over by the prefix aware admission.",
+    )
+    parser.add_argument(
+        "--wait_for_inflight_prefix",
+        type=lambda s: s.lower() in ["true", "t", "yes", "1"],
+        default=True,
+        help="Hold new requests sharing a prompt prefix with a running prefill until the prefix is cached instead of computing it again.",
+    )
+    parser.add_argument(
+        "--high_priority_reserved_tokens",
+        type=int,
+        default=0,
+        help="Tokens per step kept for high priority requests, the normal and low priority requests share the rest. 0 to share all.",
+    )
+    parser.add_argument(
+        "--high_priority_reserved_seqs",
+        type=int,
+        default=0,
+        help="Sequences per step kept for high priority requests, the normal and low priority requests share the rest. 0 to share all.",
+    )
     parser.add_argument(
         "--num_handling_threads",
         type=int,
         default=4,
         help="Number of handling threads.",
     )
+    parser.add_argument(
+        "--num_response_threads",
+        type=int,
+        default=4,
+        help="Number of threads to detokenize and send responses.",
+    )
+    parser.add_argument(
+        "--num_encode_threads",
+        type=int,
+        default=8,
+        help="Number of threads to encode long prompts in parallel, 0 to disable.",
+    )
+    parser.add_argument(
+        "--prompt_cache_tokens",
+        type=int,
+        default=1024 * 1024,
+        help="Max number of prompt token ids to cache for prompts sharing long prefixes, 0 to disable.",
+    )
+    parser.add_argument(
+        "--response_cache_size",
+        type=int,
+        default=0,
+        help="Max number of outputs of deterministic requests to cache for repeated requests, 0 to disable.",
+    )
+    parser.add_argument(
+        "--response_cache_ttl_seconds",
+        type=int,
+        default=60,
+        help="Seconds a cached output of a deterministic request is served for.",
+    )
+    parser.add_argument(
+        "--max_cached_grammars",
+        type=int,
+        default=64,
+        help="Max number of compiled grammars to cache for constrained decoding, 0 to disable constrained decoding.",
+    )
+    parser.add_argument(
+        "--scheduler_cpus",
+        type=str,
+        default="",
+        help="Cpus to pin the scheduler threads to, e.g. 0-1. Empty to float freely.",
+    )
+    parser.add_argument(
+        "--handler_cpus",
+        type=str,
+        default="",
+        help="Cpus to pin the request handling and response threads to. Defaults to all cpus but --scheduler_cpus if set.",
+    )
+    parser.add_argument(
+        "--numa_affinity",
+        type=lambda s: s.lower() in ["true", "t", "yes", "1"],
+        default=False,
+        help="Pin the threads of each gpu worker to the cpus of the numa node of the gpu.",
+    )
+    parser.add_argument(
+        "--enable_activation_pool",
+        type=lambda s: s.lower() in ["true", "t", "yes", "1"],
+        default=False,
+        help="Reserve a memory pool for the activations of eager forward passes at startup, sized by --max_tokens_per_batch.",
+    )
+    parser.add_argument(
+        "--enable_warmup",
+        type=lambda s: s.lower() in ["true", "t", "yes", "1"],
+        default=False,
+        help="Run synthetic requests of the prefill lengths, decode batch sizes and sampling configs before serving.",
+    )
+    parser.add_argument(
+        "--max_estimated_ttft_ms",
+        type=int,
+        default=0,
+        help="Refuse the requests whose estimated time to first token is over it in milliseconds as unavailable, instead of queueing them. 0 to disable.",
+    )
+    parser.add_argument(
+        "--clamp_max_tokens_to_kv_cache",
+        type=lambda s: s.lower() in ["true", "t", "yes", "1"],
+        default=False,
+        help="Clamp the max tokens of the requests to the kv cache headroom left after the waiting requests.",
+    )
     parser.add_argument("--ssl-keyfile",
                         type=str, 
                         default=None,
@@ -0,0 +1,171 @@
+// Times the attention backends on the batch shape buckets of a model and
+// writes the fastest backend of each bucket into the table read by
+// --attention_backend_table.
+//
+// Example:
+//   attention_backend_benchmark --n_heads=32 --n_kv_heads=8 --head_dim=128 \
+//     --output=/tmp/attention_backends.txt
+
+#include <ATen/cuda/CUDAContext.h>
+#include <ATen/cuda/CUDAEvent.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#include "layers/attention/attention_backend_table.h"
+#include "layers/attention/flash_infer_handler.h"
+#include "layers/attention/scale_attn_handler.h"
+#include "memory/kv_cache.h"
+#include "models/parameters.h"
+
+using namespace llm;
+
+DEFINE_string(output, "", "file to write the attention backends to");
+
+DEFINE_int64(n_heads, 32, "number of query heads on each device");
+
+DEFINE_int64(n_kv_heads, 8, "number of kv heads on each device");
+
+DEFINE_int64(head_dim, 128, "head dim");
+
+DEFINE_int64(block_size, 16, "slots per block");
+
+DEFINE_int64(n_layers, 32, "number of layers sharing the flashinfer plan");
+
+DEFINE_int64(max_tokens, 16384, "max number of kv tokens of a batch");
+
+DEFINE_int32(iters, 20, "number of timed runs of each backend");
+
+namespace {
+// a batch of sequences with the same lengths and random kv cache
+struct Batch {
+  KVCache kv_cache;
+  torch::Tensor query;
+  InputParameters params;
+};
+
+Batch make_batch(int64_t batch_size, int64_t q_len, int64_t kv_len) {
+  const auto options = torch::dtype(torch::kHalf).device(torch::kCUDA);
+  const int64_t block_size = FLAGS_block_size;
+  const int64_t n_blocks_per_seq = (kv_len + block_size - 1) / block_size;
+  // block 0 is reserved
+  const int64_t n_blocks = batch_size * n_blocks_per_seq + 1;
+
+  std::vector<int32_t> q_cu_lens = {0};
+  std::vector<int32_t> kv_cu_lens = {0};
+  std::vector<int32_t> block_tables;
+  std::vector<int32_t> cu_block_lens = {0};
+  for (int64_t i = 0; i < batch_size; ++i) {
+    q_cu_lens.push_back(q_cu_lens.back() + q_len);
+    kv_cu_lens.push_back(kv_cu_lens.back() + kv_len);
+    for (int64_t j = 0; j < n_blocks_per_seq; ++j) {
+      const auto id = static_cast<int32_t>(block_tables.size() + 1);
+      block_tables.push_back(id * block_size);
+    }
+    cu_block_lens.push_back(static_cast<int32_t>(block_tables.size()));
+  }
+
+  Batch batch{
+      KVCache(n_blocks, block_size, FLAGS_n_kv_heads, FLAGS_head_dim, options),
+      torch::randn({batch_size * q_len, FLAGS_n_heads, FLAGS_head_dim},
+                   options),
+      InputParameters()};
+  auto [key_cache, value_cache] = batch.kv_cache.get_kv_cache();
+  key_cache.normal_();
+  value_cache.normal_();
+
+  const auto int_options = torch::dtype(torch::kInt).device(torch::kCUDA);
+  auto& params = batch.params;
+  params.num_sequences = static_cast<int32_t>(batch_size);
+  params.q_max_seq_len = static_cast<int32_t>(q_len);
+  params.kv_max_seq_len = static_cast<int32_t>(kv_len);
+  params.q_cu_seq_lens = torch::tensor(q_cu_lens, int_options);
+  params.kv_cu_seq_lens = torch::tensor(kv_cu_lens, int_options);
+  params.block_tables = torch::tensor(block_tables, int_options);
+  params.cu_block_lens = torch::tensor(cu_block_lens, int_options);
+  return batch;
+}
+
+// mean milliseconds of fn over the timed runs
+float time_ms(const std::function<void()>& fn) {
+  // warm up
+  fn();
+  at::cuda::CUDAEvent start(cudaEventDefault);
+  at::cuda::CUDAEvent stop(cudaEventDefault);
+  const auto stream = at::cuda::getCurrentCUDAStream();
+  start.record(stream);
+  for (int i = 0; i < FLAGS_iters; ++i) {
+    fn();
+  }
+  stop.record(stream);
+  stop.synchronize();
+  return start.elapsed_time(stop) / FLAGS_iters;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  CHECK(torch::cuda::is_available()) << "CUDA is not available";
+  CHECK_EQ(FLAGS_n_heads % FLAGS_n_kv_heads, 0);
+
+  const float sm_scale = 1.0f / std::sqrt(static_cast<float>(FLAGS_head_dim));
+  ScaleAttnHandler scale_attn(sm_scale, /*logits_soft_cap=*/0, std::nullopt);
+  FlashInferHandler flash_infer(sm_scale, /*logits_soft_cap=*/0, std::nullopt);
+  FlashInferPlan plan(torch::Device(torch::kCUDA));
+
+  auto& table = AttentionBackendTable::get_instance();
+  const int64_t group_size = FLAGS_n_heads / FLAGS_n_kv_heads;
+  // one representative query length of each phase
+  for (const int64_t q_len : {1, 4, 512}) {
+    for (int64_t batch_size = 1; batch_size <= 256; batch_size *= 4) {
+      for (int64_t kv_len = std::max<int64_t>(q_len, 1024);
+           batch_size * kv_len <= FLAGS_max_tokens;
+           kv_len *= 4) {
+        auto batch = make_batch(batch_size, q_len, kv_len);
+        torch::Tensor output = torch::empty_like(batch.query);
+
+        const float scale_attn_ms = time_ms([&] {
+          scale_attn.batch_decode(
+              batch.query, batch.kv_cache, batch.params, -1, output);
+        });
+        // the plan is shared by the layers of a forward pass
+        const float plan_ms = time_ms([&] {
+          plan.plan(
+              batch.params, FLAGS_n_heads, batch.kv_cache, torch::kHalf);
+        });
+        FlashInferPlan::set_current(&plan);
+        const float flash_infer_ms = time_ms([&] {
+          flash_infer.batch_decode(
+              batch.query, batch.kv_cache, batch.params, -1, output);
+        });
+        FlashInferPlan::set_current(nullptr);
+        const float flash_infer_total_ms =
+            flash_infer_ms + plan_ms / FLAGS_n_layers;
+
+        const auto key = AttentionBackendTable::make_key(
+            FLAGS_head_dim, group_size, q_len, batch_size, kv_len);
+        const auto backend = flash_infer_total_ms < scale_attn_ms
+                                 ? AttentionBackend::kFlashInfer
+                                 : AttentionBackend::kScaleAttn;
+        table.insert(key, backend);
+        std::cout << key << ": scale_attn " << scale_attn_ms
+                  << " ms, flash_infer " << flash_infer_total_ms << " ms -> "
+                  << to_string(backend) << std::endl;
+      }
+    }
+  }
+
+  if (!FLAGS_output.empty()) {
+    CHECK(table.save(FLAGS_output)) << "Failed to write " << FLAGS_output;
+    std::cout << "Saved " << table.size() << " entries to " << FLAGS_output
+              << std::endl;
+  }
+  return 0;
+}
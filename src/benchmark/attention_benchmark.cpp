@@ -1,30 +1,172 @@
+#include <absl/random/random.h>
 #include <benchmark/benchmark.h>
+#include <c10/core/ScalarType.h>
+#include <cuda_runtime.h>
+#include <torch/torch.h>
 
+#include <cmath>
+#include <vector>
 
-static void BM_varlen_masked_self_attention(benchmark::State& state) {
-  // Perform setup here
+#include "kernels/attention/attn_api.h"
 
-  for (auto _ : state) {
-    // Call the implementation function
+using namespace llm;
+
+// Benchmark paged_kv_varlen_mha with prefill and decode shapes.
+// args: dtype, batch_size, q_len, kv_len, n_kv_heads, group_size, block_size
+// for each sequence, q_len new tokens attend to kv_len tokens in the cache,
+// q_len = 1 for decode and q_len = kv_len for prefill.
+static void BM_paged_kv_varlen_mha(benchmark::State& state) {
+  // skip if no gpu
+  if (!torch::cuda::is_available()) {
+    state.SkipWithMessage("CUDA is not available");
+    return;
   }
-}
 
-static void BM_single_query_masked_self_attention(benchmark::State& state) {
   // Perform setup here
+  const auto dtype = static_cast<torch::ScalarType>(state.range(0));
+  const int64_t batch_size = state.range(1);
+  const int64_t q_len = state.range(2);
+  const int64_t kv_len = state.range(3);
+  const int64_t n_kv_heads = state.range(4);
+  const int64_t n_heads = n_kv_heads * state.range(5);
+  const int64_t block_size = state.range(6);
+  const int64_t head_dim = 128;
+  if (q_len > kv_len) {
+    state.SkipWithMessage("q_len should not be larger than kv_len");
+    return;
+  }
+
+  const auto options = torch::dtype(dtype).device(torch::kCUDA);
+  const int64_t n_blocks_per_seq = (kv_len + block_size - 1) / block_size;
+  const int64_t total_blocks = batch_size * n_blocks_per_seq + 1;
+
+  // assign blocks for each sequence randomly, block 0 is reserved
+  std::vector<int32_t> block_table_vec;
+  std::vector<int32_t> block_cu_lens_vec = {0};
+  std::vector<int32_t> q_cu_lens_vec = {0};
+  std::vector<int32_t> kv_cu_lens_vec = {0};
+  absl::BitGen gen;
+  for (int64_t i = 0; i < batch_size; ++i) {
+    q_cu_lens_vec.push_back(q_cu_lens_vec.back() + q_len);
+    kv_cu_lens_vec.push_back(kv_cu_lens_vec.back() + kv_len);
+    for (int64_t j = 0; j < n_blocks_per_seq; ++j) {
+      const int32_t id = absl::Uniform<int32_t>(
+          absl::IntervalClosedOpen, gen, 1, total_blocks);
+      // put first slot id of each block into block_table
+      block_table_vec.push_back(id * block_size);
+    }
+    block_cu_lens_vec.push_back(block_table_vec.size());
+  }
+
+  const int64_t n_q_tokens = batch_size * q_len;
+  const int64_t n_slots = total_blocks * block_size;
+  auto query = torch::randn({n_q_tokens, n_heads, head_dim}, options);
+  auto key_cache = torch::randn({n_slots, n_kv_heads, head_dim}, options);
+  auto value_cache = torch::randn({n_slots, n_kv_heads, head_dim}, options);
+  auto out = torch::empty_like(query);
+
+  const auto int_options = torch::dtype(torch::kInt).device(torch::kCUDA);
+  auto q_cu_lens = torch::tensor(q_cu_lens_vec, int_options);
+  auto kv_cu_lens = torch::tensor(kv_cu_lens_vec, int_options);
+  auto block_table = torch::tensor(block_table_vec, int_options);
+  auto block_cu_lens = torch::tensor(block_cu_lens_vec, int_options);
+  const float sm_scale = 1.0 / std::sqrt(head_dim);
+
+  cudaEvent_t start, stop;
+  cudaEventCreate(&start);
+  cudaEventCreate(&stop);
 
   for (auto _ : state) {
-    // Call the implementation function
+    // Start measuring time
+    cudaEventRecord(start);
+
+    // Launch the CUDA kernel
+    paged_kv_varlen_mha(out,
+                        query,
+                        key_cache,
+                        value_cache,
+                        q_cu_lens,
+                        kv_cu_lens,
+                        block_table,
+                        block_cu_lens,
+                        /*alibi_slopes=*/std::nullopt,
+                        block_size,
+                        q_len,
+                        kv_len,
+                        sm_scale,
+                        /*logits_soft_cap=*/0.0,
+                        /*sliding_window=*/-1);
+    // don't optimize out the output
+    benchmark::DoNotOptimize(out);
+
+    // Stop measuring time and calculate the elapsed time
+    cudaEventRecord(stop);
+    cudaEventSynchronize(stop);
+    state.PauseTiming();
+
+    // Update the benchmark state with the measured time
+    float milliseconds = 0;
+    cudaEventElapsedTime(&milliseconds, start, stop);
+    state.SetIterationTime(milliseconds / 1000);
+    state.ResumeTiming();
   }
+
+  cudaEventDestroy(start);
+  cudaEventDestroy(stop);
+
+  // bytes of query, output and the kv cache read by the kernel
+  const int64_t elem_size = torch::elementSize(dtype);
+  const int64_t bytes = (2 * n_q_tokens * n_heads * head_dim +
+                         2 * batch_size * kv_len * n_kv_heads * head_dim) *
+                        elem_size;
+  state.SetBytesProcessed(state.iterations() * bytes);
+
+  // query token i attends to kv_len - q_len + i + 1 tokens with causal mask
+  const double n_pairs =
+      batch_size * (q_len * (kv_len - q_len) + q_len * (q_len + 1) / 2.0);
+  // 2 flops for each multiply-add of both qk and pv
+  const double flops = 4.0 * n_pairs * n_heads * head_dim;
+  state.counters["TFLOPs"] = benchmark::Counter(
+      flops * 1e-12, benchmark::Counter::kIsIterationInvariantRate);
+  state.SetLabel(torch::toString(dtype));
 }
 
 // Register functions as benchmarks
-BENCHMARK(BM_varlen_masked_self_attention)
-    ->ArgNames({"dim", "cuda", "slow"})
-    ->Args({/*dim=*/32, /*device=cpu*/ 0, /*slow=*/0})
-    ->Args({/*dim=*/32, /*device=cuda*/ 1, /*slow=*/0})
-    ->Args({/*dim=*/32, /*device=cuda*/ 1, /*slow=*/1});
-
-BENCHMARK(BM_single_query_masked_self_attention)
-    ->ArgNames({"dim", "cuda"})
-    ->Args({/*dim=*/32, /*device=cpu*/ 0})
-    ->Args({/*dim=*/32, /*device=cuda*/ 1});
+const std::vector<int64_t> dtypes = {static_cast<int64_t>(torch::kHalf),
+                                     static_cast<int64_t>(torch::kBFloat16)};
+
+// decode: one query token per sequence
+BENCHMARK(BM_paged_kv_varlen_mha)
+    ->ArgNames({"dtype",
+                "batch",
+                "q_len",
+                "kv_len",
+                "n_kv_heads",
+                "group",
+                "block_size"})
+    ->ArgsProduct({dtypes,
+                   {1, 16, 64, 256},
+                   {1},
+                   {1024, 4096, 16384},
+                   {8},
+                   {1, 4, 8},
+                   {8, 16, 64}})
+    ->UseManualTime();
+
+// prefill: the whole sequence with causal mask
+BENCHMARK(BM_paged_kv_varlen_mha)
+    ->ArgNames({"dtype",
+                "batch",
+                "q_len",
+                "kv_len",
+                "n_kv_heads",
+                "group",
+                "block_size"})
+    ->ArgsProduct({dtypes,
+                   {1, 8},
+                   {512, 2048, 8192},
+                   {8192},
+                   {8},
+                   {1, 4, 8},
+                   {8, 16, 64}})
+    ->UseManualTime();
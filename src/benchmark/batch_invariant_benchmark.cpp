@@ -0,0 +1,166 @@
+#include <benchmark/benchmark.h>
+#include <c10/core/ScalarType.h>
+#include <cuda_runtime.h>
+#include <torch/torch.h>
+
+#include <cmath>
+#include <functional>
+#include <optional>
+#include <vector>
+
+#include "kernels/attention/attn_api.h"
+#include "kernels/gemm/gemm_api.h"
+
+using namespace llm;
+
+namespace {
+// time fn with cuda events for each iteration of the state
+void run_with_cuda_events(benchmark::State& state,
+                          const std::function<void()>& fn) {
+  cudaEvent_t start, stop;
+  cudaEventCreate(&start);
+  cudaEventCreate(&stop);
+  for (auto _ : state) {
+    cudaEventRecord(start);
+    fn();
+    cudaEventRecord(stop);
+    cudaEventSynchronize(stop);
+    state.PauseTiming();
+    float milliseconds = 0;
+    cudaEventElapsedTime(&milliseconds, start, stop);
+    state.SetIterationTime(milliseconds / 1000);
+    state.ResumeTiming();
+  }
+  cudaEventDestroy(start);
+  cudaEventDestroy(stop);
+}
+}  // namespace
+
+// The cost of the batch invariant mode in decode attention, where the kv
+// splits are disabled for small batches with long context.
+// args: invariant, batch_size, kv_len
+static void BM_batch_invariant_decode_mha(benchmark::State& state) {
+  // skip if no gpu
+  if (!torch::cuda::is_available()) {
+    state.SkipWithMessage("CUDA is not available");
+    return;
+  }
+
+  const bool invariant = state.range(0) != 0;
+  const int64_t batch_size = state.range(1);
+  const int64_t kv_len = state.range(2);
+  const int64_t n_kv_heads = 8;
+  const int64_t n_heads = 32;
+  const int64_t head_dim = 128;
+  const int64_t block_size = 16;
+
+  // contiguous blocks for each sequence, block 0 is reserved
+  const int64_t n_blocks_per_seq = (kv_len + block_size - 1) / block_size;
+  std::vector<int32_t> block_table_vec;
+  std::vector<int32_t> block_cu_lens_vec = {0};
+  std::vector<int32_t> q_cu_lens_vec = {0};
+  std::vector<int32_t> kv_cu_lens_vec = {0};
+  for (int64_t i = 0; i < batch_size; ++i) {
+    q_cu_lens_vec.push_back(q_cu_lens_vec.back() + 1);
+    kv_cu_lens_vec.push_back(kv_cu_lens_vec.back() + kv_len);
+    for (int64_t j = 0; j < n_blocks_per_seq; ++j) {
+      const int32_t id = 1 + static_cast<int32_t>(block_table_vec.size());
+      block_table_vec.push_back(id * block_size);
+    }
+    block_cu_lens_vec.push_back(block_table_vec.size());
+  }
+
+  const auto options = torch::dtype(torch::kHalf).device(torch::kCUDA);
+  const int64_t n_slots = (block_table_vec.size() + 1) * block_size;
+  auto query = torch::randn({batch_size, n_heads, head_dim}, options);
+  auto key_cache = torch::randn({n_slots, n_kv_heads, head_dim}, options);
+  auto value_cache = torch::randn({n_slots, n_kv_heads, head_dim}, options);
+  auto out = torch::empty_like(query);
+
+  const auto int_options = torch::dtype(torch::kInt).device(torch::kCUDA);
+  auto q_cu_lens = torch::tensor(q_cu_lens_vec, int_options);
+  auto kv_cu_lens = torch::tensor(kv_cu_lens_vec, int_options);
+  auto block_table = torch::tensor(block_table_vec, int_options);
+  auto block_cu_lens = torch::tensor(block_cu_lens_vec, int_options);
+  const float sm_scale = 1.0 / std::sqrt(head_dim);
+
+  const bool saved = FLAGS_batch_invariant;
+  FLAGS_batch_invariant = invariant;
+  run_with_cuda_events(state, [&] {
+    paged_kv_varlen_mha(out,
+                        query,
+                        key_cache,
+                        value_cache,
+                        q_cu_lens,
+                        kv_cu_lens,
+                        block_table,
+                        block_cu_lens,
+                        /*alibi_slopes=*/std::nullopt,
+                        block_size,
+                        /*max_q_len=*/1,
+                        kv_len,
+                        sm_scale,
+                        /*logits_soft_cap=*/0.0,
+                        /*sliding_window=*/-1);
+    benchmark::DoNotOptimize(out);
+  });
+  FLAGS_batch_invariant = saved;
+
+  // bytes of the kv cache read by the kernel
+  const int64_t bytes = 2 * batch_size * kv_len * n_kv_heads * head_dim *
+                        torch::elementSize(torch::kHalf);
+  state.SetBytesProcessed(state.iterations() * bytes);
+}
+
+// The cost of the batch invariant mode in dense linear layers, the gemm with
+// fixed tiles in place of the algorithms picked by cublaslt for each shape.
+// args: invariant, m, n, k
+static void BM_batch_invariant_linear(benchmark::State& state) {
+  // skip if no gpu
+  if (!torch::cuda::is_available()) {
+    state.SkipWithMessage("CUDA is not available");
+    return;
+  }
+
+  const bool invariant = state.range(0) != 0;
+  const int64_t m = state.range(1);
+  const int64_t n = state.range(2);
+  const int64_t k = state.range(3);
+
+  const auto options = torch::dtype(torch::kHalf).device(torch::kCUDA);
+  auto input = torch::randn({m, k}, options);
+  auto weight = torch::randn({n, k}, options);
+  if (invariant ? !can_use_softcap_gemm(input, weight)
+                : !can_use_cublaslt_gemm(input, weight)) {
+    state.SkipWithMessage("gemm is not supported");
+    return;
+  }
+
+  run_with_cuda_events(state, [&] {
+    auto out = invariant ? softcap_gemm(input,
+                                        weight,
+                                        /*soft_cap=*/0,
+                                        /*out_dtype=*/torch::kHalf)
+                         : cublaslt_gemm(input,
+                                         weight,
+                                         /*bias=*/std::nullopt,
+                                         EpilogueAct::kNone);
+    benchmark::DoNotOptimize(out);
+  });
+
+  // 2 flops for each multiply-add
+  const double flops = 2.0 * m * n * k;
+  state.counters["TFLOPs"] = benchmark::Counter(
+      flops * 1e-12, benchmark::Counter::kIsIterationInvariantRate);
+}
+
+BENCHMARK(BM_batch_invariant_decode_mha)
+    ->ArgNames({"invariant", "batch", "kv_len"})
+    ->ArgsProduct({{0, 1}, {1, 4, 16, 64}, {4096, 32768}})
+    ->UseManualTime();
+
+// small m for decode and large m for prefill of a 8b model
+BENCHMARK(BM_batch_invariant_linear)
+    ->ArgNames({"invariant", "m", "n", "k"})
+    ->ArgsProduct({{0, 1}, {1, 16, 128, 4096}, {4096, 14336}, {4096}})
+    ->UseManualTime();
@@ -0,0 +1,110 @@
+#include <benchmark/benchmark.h>
+#include <c10/core/ScalarType.h>
+#include <cuda_runtime.h>
+#include <torch/torch.h>
+
+#include <string>
+
+#include "memory/kv_cache.h"
+
+using namespace llm;
+
+// Benchmark writing new keys and values into the slots of the kv cache,
+// either random slots or contiguous runs in shuffled blocks like a prefill.
+// args: dtype, n_tokens, n_kv_heads, head_dim, block_size, cuda kernel,
+// contiguous runs
+static void BM_set_kv_cache(benchmark::State& state) {
+  // skip if no gpu
+  if (!torch::cuda::is_available()) {
+    state.SkipWithMessage("CUDA is not available");
+    return;
+  }
+
+  // Perform setup here
+  const auto dtype = static_cast<torch::ScalarType>(state.range(0));
+  const int64_t n_tokens = state.range(1);
+  const int64_t n_kv_heads = state.range(2);
+  const int64_t head_dim = state.range(3);
+  const int64_t block_size = state.range(4);
+  const bool use_cuda_kernel = state.range(5) != 0;
+  const bool contiguous = state.range(6) != 0;
+  const int64_t n_blocks = 4096;
+
+  const auto options = torch::dtype(dtype).device(torch::kCUDA);
+  KVCache kv_cache(n_blocks, block_size, n_kv_heads, head_dim, options);
+
+  const auto int_options = torch::dtype(torch::kInt).device(torch::kCUDA);
+  torch::Tensor slot_ids;
+  if (contiguous) {
+    // the slots of shuffled blocks in order
+    auto blocks = torch::randperm(n_blocks, int_options);
+    auto offsets = torch::arange(block_size, int_options);
+    slot_ids = (blocks.unsqueeze(1) * block_size + offsets)
+                   .flatten()
+                   .slice(/*dim=*/0, /*start=*/0, /*end=*/n_tokens);
+  } else {
+    // distinct random slots for the new tokens
+    slot_ids = torch::randperm(n_blocks * block_size, int_options)
+                   .slice(/*dim=*/0, /*start=*/0, /*end=*/n_tokens);
+  }
+  auto keys = torch::randn({n_tokens, n_kv_heads, head_dim}, options);
+  auto values = torch::randn({n_tokens, n_kv_heads, head_dim}, options);
+
+  cudaEvent_t start, stop;
+  cudaEventCreate(&start);
+  cudaEventCreate(&stop);
+
+  for (auto _ : state) {
+    // Start measuring time
+    cudaEventRecord(start);
+
+    if (use_cuda_kernel) {
+      kv_cache.set_kv_cache_cuda(slot_ids, keys, values);
+    } else {
+      kv_cache.set_kv_cache_slow(slot_ids, keys, values);
+    }
+
+    // Stop measuring time and calculate the elapsed time
+    cudaEventRecord(stop);
+    cudaEventSynchronize(stop);
+    state.PauseTiming();
+
+    // Update the benchmark state with the measured time
+    float milliseconds = 0;
+    cudaEventElapsedTime(&milliseconds, start, stop);
+    state.SetIterationTime(milliseconds / 1000);
+    state.ResumeTiming();
+  }
+
+  cudaEventDestroy(start);
+  cudaEventDestroy(stop);
+
+  // keys and values are read once and written once
+  const int64_t bytes =
+      4 * n_tokens * n_kv_heads * head_dim * torch::elementSize(dtype);
+  state.SetBytesProcessed(state.iterations() * bytes);
+  state.SetLabel(std::string(use_cuda_kernel ? "cuda " : "slow ") +
+                 (contiguous ? "contiguous " : "random ") +
+                 torch::toString(dtype));
+}
+
+// Register functions as benchmarks
+const std::vector<int64_t> kv_dtypes = {static_cast<int64_t>(torch::kHalf),
+                                        static_cast<int64_t>(torch::kBFloat16)};
+
+BENCHMARK(BM_set_kv_cache)
+    ->ArgNames({"dtype",
+                "n_tokens",
+                "n_kv_heads",
+                "head_dim",
+                "block_size",
+                "cuda",
+                "contiguous"})
+    ->ArgsProduct({kv_dtypes,
+                   {1, 64, 512, 4096},
+                   {1, 8, 32},
+                   {64, 128},
+                   {8, 16, 64},
+                   {0, 1},
+                   {0, 1}})
+    ->UseManualTime();
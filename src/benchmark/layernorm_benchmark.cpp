@@ -9,6 +9,22 @@
 using namespace llm;
 using namespace llm::detail;
 
+namespace {
+const char* to_string(kernel::NormImpl impl) {
+  switch (impl) {
+    case kernel::NormImpl::kAuto:
+      return "auto";
+    case kernel::NormImpl::kScalar:
+      return "scalar";
+    case kernel::NormImpl::kWarpPerRow:
+      return "warp_per_row";
+    case kernel::NormImpl::kBlockPerRow:
+      return "block_per_row";
+  }
+  return "unknown";
+}
+}  // namespace
+
 static void BM_rms_norm(benchmark::State& state,
                           const torch::Device& device) {
   // skip if no gpu
@@ -76,10 +92,11 @@ static void BM_rms_norm_kernel(benchmark::State& state) {
   auto activation_func = kernel::rms_norm;
   int64_t dim_0 = state.range(1);
   int64_t dim_1 = state.range(2);
+  auto impl = static_cast<kernel::NormImpl>(state.range(3));
 
   auto output = torch::rand({dim_0, dim_1}, torch::dtype(dtype).device(torch::kCUDA));
   auto input = torch::rand({dim_0, dim_1}, torch::dtype(dtype).device(torch::kCUDA));
-  auto weight = torch::ones({dim_0, dim_1}, torch::dtype(dtype).device(torch::kCUDA));
+  auto weight = torch::ones({dim_1}, torch::dtype(dtype).device(torch::kCUDA));
   float epsilon = 1e-5;
 
   cudaEvent_t start, stop;
@@ -91,7 +108,7 @@ static void BM_rms_norm_kernel(benchmark::State& state) {
     cudaEventRecord(start);
 
     // Launch the CUDA kernel
-    activation_func(output, input, weight, epsilon);
+    activation_func(output, input, weight, epsilon, impl);
     // don't optimize out the output
     benchmark::DoNotOptimize(output);
 
@@ -110,7 +127,8 @@ static void BM_rms_norm_kernel(benchmark::State& state) {
   cudaEventDestroy(start);
   cudaEventDestroy(stop);
 
-  state.SetLabel(activation + " " + torch::toString(dtype));
+  state.SetLabel(activation + " " + torch::toString(dtype) + " " +
+                 to_string(impl));
 }
 
 static void BM_layer_norm_kernel(benchmark::State& state) {
@@ -126,6 +144,7 @@ static void BM_layer_norm_kernel(benchmark::State& state) {
   auto activation_func = kernel::layer_norm;
   int64_t dim_0 = state.range(1);
   int64_t dim_1 = state.range(2);
+  auto impl = static_cast<kernel::NormImpl>(state.range(3));
 
   auto output = torch::rand({dim_0, dim_1}, torch::dtype(dtype).device(torch::kCUDA));
   auto input = torch::rand({dim_0, dim_1}, torch::dtype(dtype).device(torch::kCUDA));
@@ -143,7 +162,7 @@ static void BM_layer_norm_kernel(benchmark::State& state) {
     cudaEventRecord(start);
 
     // Launch the CUDA kernel
-    activation_func(output, input, weight, bias, epsilon);
+    activation_func(output, input, weight, bias, epsilon, impl);
     // don't optimize out the output
     benchmark::DoNotOptimize(output);
 
@@ -162,7 +181,8 @@ static void BM_layer_norm_kernel(benchmark::State& state) {
   cudaEventDestroy(start);
   cudaEventDestroy(stop);
 
-  state.SetLabel(activation + " " + torch::toString(dtype));
+  state.SetLabel(activation + " " + torch::toString(dtype) + " " +
+                 to_string(impl));
 }
 
 // Register functions as benchmarks
@@ -170,12 +190,26 @@ const std::vector<int64_t> dtypes = {static_cast<int64_t>(torch::kFloat),
                                      static_cast<int64_t>(torch::kHalf),
                                      static_cast<int64_t>(torch::kBFloat16)};
 
-// benchmark for kernels
+const std::vector<int64_t> norm_impls = {
+    static_cast<int64_t>(kernel::NormImpl::kScalar),
+    static_cast<int64_t>(kernel::NormImpl::kWarpPerRow),
+    static_cast<int64_t>(kernel::NormImpl::kBlockPerRow)};
+
+// benchmark for kernels: compare the scalar and vectorized kernels for decode
+// and prefill token counts over the common hidden sizes
 BENCHMARK(BM_rms_norm_kernel)
-    ->ArgsProduct({dtypes, {4096, 1000}, {20560, 1024}});
+    ->ArgsProduct({dtypes,
+                   {1, 16, 256, 4096},
+                   {2048, 4096, 5120, 8192, 16384},
+                   norm_impls})
+    ->UseManualTime();
 
 BENCHMARK(BM_layer_norm_kernel)
-    ->ArgsProduct({dtypes, {4096, 1000}, {20560, 1024}});
+    ->ArgsProduct({dtypes,
+                   {1, 16, 256, 4096},
+                   {2048, 4096, 5120, 8192, 16384},
+                   norm_impls})
+    ->UseManualTime();
 
 // benchmark for gpus
 BENCHMARK_CAPTURE(BM_rms_norm, "gpu", torch::kCUDA)
@@ -0,0 +1,359 @@
+// Times the forward pass of each registered model with random weights, so
+// that the models and the quantized linear backends can be compared without
+// downloading checkpoints. The model args come from the defaults of the args
+// loaders, i.e. the sizes of a real checkpoint, or from
+// <config_dir>/<model_type>.json, with the layers cut to --num_layers. Each
+// model runs the prefill and decode sweeps in eager mode and with cuda graphs,
+// and reports the tokens/s and the time of the components of the decoder
+// layers.
+//
+// Example:
+//   model_benchmark --model_types=llama,qwen2 --num_layers=4 \
+//     --quant_method=fp8 --decode_batch_sizes=1,8,64
+
+#include <ATen/cuda/CUDAContext.h>
+#include <ATen/cuda/CUDAEvent.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_split.h>
+#include <c10/cuda/CUDACachingAllocator.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common/json_reader.h"
+#include "engine/model_runner.h"
+#include "layers/layer_profiler.h"
+#include "memory/kv_cache.h"
+#include "models/causal_lm.h"
+#include "models/model_args.h"
+#include "models/model_registry.h"
+#include "models/parameters.h"
+#include "quantization/quant_args.h"
+
+using namespace llm;
+
+DEFINE_string(model_types,
+              "",
+              "comma separated model types to run, empty for all registered");
+
+DEFINE_string(config_dir,
+              "",
+              "directory of the <model_type>.json configs, the defaults of "
+              "the args loaders are used for the missing ones");
+
+DEFINE_int64(num_layers,
+             2,
+             "number of decoder layers to build, 0 to keep the config's");
+
+DEFINE_string(dtype, "float16", "dtype of the model, float16 or bfloat16");
+
+DEFINE_string(prefill_lens,
+              "128,512,2048",
+              "comma separated prompt lengths of the prefill sweep, one "
+              "sequence each");
+
+DEFINE_string(decode_batch_sizes,
+              "1,8,32,128",
+              "comma separated batch sizes of the decode sweep");
+
+DEFINE_int64(decode_kv_len, 1024, "kv length of each decoding sequence");
+
+DEFINE_int64(block_size, 16, "slots per block");
+
+DEFINE_int32(iters, 10, "number of timed runs of each shape");
+
+DEFINE_string(quant_method,
+              "",
+              "quantize the linear layers, e.g. fp8, awq or gptq, with "
+              "random weights. empty for none");
+
+DEFINE_int64(bits, 4, "bits of the quantized weights of awq and gptq");
+
+DEFINE_int64(group_size, 128, "group size of the quantized weights");
+
+DEFINE_bool(cuda_graph, true, "also time the forward passes with cuda graphs");
+
+namespace {
+std::vector<int64_t> parse_sizes(const std::string& sizes_str) {
+  std::vector<int64_t> sizes;
+  for (const auto& size_str :
+       absl::StrSplit(sizes_str, ',', absl::SkipEmpty())) {
+    int64_t size = 0;
+    CHECK(absl::SimpleAtoi(size_str, &size) && size > 0)
+        << "Invalid size: " << size_str;
+    sizes.push_back(size);
+  }
+  return sizes;
+}
+
+// mean milliseconds of fn over the timed runs
+float time_ms(const std::function<void()>& fn) {
+  // warm up, e.g. capture the piecewise graphs at their first use
+  fn();
+  at::cuda::CUDAEvent start(cudaEventDefault);
+  at::cuda::CUDAEvent stop(cudaEventDefault);
+  const auto stream = at::cuda::getCurrentCUDAStream();
+  start.record(stream);
+  for (int i = 0; i < FLAGS_iters; ++i) {
+    fn();
+  }
+  stop.record(stream);
+  stop.synchronize();
+  return start.elapsed_time(stop) / FLAGS_iters;
+}
+
+// fill the weights of the model with random values in place. the scales of
+// the quantized weights are kept small so that the activations stay finite
+// for a few layers, the timing does not depend on the values otherwise.
+void fill_random_weights(CausalLM* model) {
+  torch::NoGradGuard no_grad;
+  for (auto& [name, weight] : model->named_weights()) {
+    // the act order indices and the lora slots keep their initial values
+    if (!weight.defined() || weight.numel() == 0 ||
+        name.find("g_idx") != std::string::npos ||
+        name.find("lora_") != std::string::npos) {
+      continue;
+    }
+    if (torch::isFloatingType(weight.scalar_type())) {
+      const bool is_scale = name.find("scale") != std::string::npos;
+      // generated in float for the dtypes without random kernels, e.g. fp8
+      auto values = torch::randn(weight.sizes(),
+                                 weight.options().dtype(torch::kFloat32));
+      weight.copy_(is_scale ? values.abs_() * 1e-3 : values * 0.02);
+    } else {
+      // packed or int8 weights, any bits will do
+      weight.random_();
+    }
+  }
+}
+
+// a batch of sequences with the same lengths
+struct Batch {
+  torch::Tensor tokens;
+  torch::Tensor positions;
+  InputParameters params;
+};
+
+Batch make_batch(int64_t batch_size,
+                 int64_t q_len,
+                 int64_t kv_len,
+                 int64_t vocab_size,
+                 const torch::Device& device) {
+  const int64_t block_size = FLAGS_block_size;
+  const int64_t n_blocks_per_seq = (kv_len + block_size - 1) / block_size;
+
+  std::vector<int32_t> positions;
+  std::vector<int32_t> q_cu_lens = {0};
+  std::vector<int32_t> kv_cu_lens = {0};
+  std::vector<int32_t> new_cache_slots;
+  std::vector<int32_t> block_tables;
+  std::vector<int32_t> cu_block_lens = {0};
+  for (int64_t i = 0; i < batch_size; ++i) {
+    q_cu_lens.push_back(q_cu_lens.back() + q_len);
+    kv_cu_lens.push_back(kv_cu_lens.back() + kv_len);
+    // block 0 is reserved
+    const auto first_block = static_cast<int32_t>(block_tables.size() + 1);
+    for (int64_t j = 0; j < n_blocks_per_seq; ++j) {
+      const auto id = static_cast<int32_t>(block_tables.size() + 1);
+      block_tables.push_back(id * block_size);
+    }
+    cu_block_lens.push_back(static_cast<int32_t>(block_tables.size()));
+    for (int64_t pos = kv_len - q_len; pos < kv_len; ++pos) {
+      positions.push_back(static_cast<int32_t>(pos));
+      new_cache_slots.push_back(
+          static_cast<int32_t>(first_block * block_size + pos));
+    }
+  }
+
+  const auto int_options = torch::dtype(torch::kInt).device(device);
+  Batch batch;
+  batch.tokens =
+      torch::randint(vocab_size, {batch_size * q_len}, int_options);
+  batch.positions = torch::tensor(positions, int_options);
+  auto& params = batch.params;
+  params.num_sequences = static_cast<int32_t>(batch_size);
+  params.q_max_seq_len = static_cast<int32_t>(q_len);
+  params.kv_max_seq_len = static_cast<int32_t>(kv_len);
+  params.q_cu_seq_lens = torch::tensor(q_cu_lens, int_options);
+  params.kv_cu_seq_lens = torch::tensor(kv_cu_lens, int_options);
+  params.new_cache_slots = torch::tensor(new_cache_slots, int_options);
+  params.block_tables = torch::tensor(block_tables, int_options);
+  params.cu_block_lens = torch::tensor(cu_block_lens, int_options);
+  return batch;
+}
+
+// run a profiled forward pass and print the milliseconds of each component
+// of a decoder layer, averaged over the layers
+void print_layer_breakdown(ModelRunner& runner,
+                           const Batch& batch,
+                           std::vector<KVCache>& kv_caches,
+                           int64_t n_layers) {
+  const int32_t interval = FLAGS_layer_profile_interval;
+  FLAGS_layer_profile_interval = 1;
+  runner.forward(batch.tokens, batch.positions, kv_caches, batch.params);
+  FLAGS_layer_profile_interval = interval;
+
+  std::cout << "    per layer:";
+  for (const auto& [component, seconds] :
+       runner.layer_profiler().last_step_seconds()) {
+    std::cout << " " << component << " " << std::fixed
+              << std::setprecision(3) << seconds * 1000 / n_layers << " ms";
+  }
+  std::cout << std::endl;
+}
+
+void run_model(const std::string& name,
+               const std::vector<int64_t>& prefill_lens,
+               const std::vector<int64_t>& decode_batch_sizes) {
+  JsonReader reader;
+  const auto config_path =
+      std::filesystem::path(FLAGS_config_dir) / (name + ".json");
+  if (!FLAGS_config_dir.empty() && !reader.parse(config_path.string())) {
+    LOG(WARNING) << "Using the default args of " << name << ", failed to "
+                 << "parse " << config_path;
+  }
+  ModelArgs args;
+  ModelRegistry::get_model_args_loader(name)(reader, &args);
+  if (FLAGS_num_layers > 0) {
+    args.n_layers() = std::min(args.n_layers(), FLAGS_num_layers);
+  }
+  QuantArgs quant_args;
+  if (!FLAGS_quant_method.empty()) {
+    quant_args.quant_method() = FLAGS_quant_method;
+    quant_args.bits() = FLAGS_bits;
+    quant_args.group_size() = FLAGS_group_size;
+    // fp8 quantizes the dense weights at load
+    quant_args.weight_only() = FLAGS_quant_method == "fp8";
+  }
+
+  const torch::Device device(torch::kCUDA, 0);
+  const auto dtype =
+      FLAGS_dtype == "bfloat16" ? torch::kBFloat16 : torch::kHalf;
+  const auto options = torch::dtype(dtype).device(device);
+  ParallelArgs parallel_args(/*rank=*/0, /*world_size=*/1, nullptr);
+  // registered by name, the loaders may rename the model type, e.g. llama3
+  auto model = ModelRegistry::get_causallm_factory(name)(
+      args, quant_args, parallel_args, options);
+  fill_random_weights(model.get());
+
+  const int64_t n_kv_heads = args.n_kv_heads().value_or(args.n_heads());
+  auto blocks_of = [](int64_t len) {
+    return (len + FLAGS_block_size - 1) / FLAGS_block_size;
+  };
+  int64_t max_blocks = 0;
+  for (const int64_t len : prefill_lens) {
+    max_blocks = std::max(max_blocks, blocks_of(len));
+  }
+  for (const int64_t batch_size : decode_batch_sizes) {
+    max_blocks =
+        std::max(max_blocks, batch_size * blocks_of(FLAGS_decode_kv_len));
+  }
+  // block 0 is reserved
+  const int64_t n_blocks = max_blocks + 1;
+  std::vector<KVCache> kv_caches;
+  kv_caches.reserve(args.n_layers());
+  for (int64_t i = 0; i < args.n_layers(); ++i) {
+    kv_caches.emplace_back(
+        n_blocks, FLAGS_block_size, n_kv_heads, args.head_dim(), options);
+  }
+
+  ModelRunner::Options runner_options;
+  runner_options.block_size(FLAGS_block_size)
+      .model_type(args.model_type())
+      .n_local_heads(args.n_heads());
+  ModelRunner eager_runner(model.get(), device, runner_options);
+
+  std::vector<uint32_t> graph_batch_sizes(decode_batch_sizes.begin(),
+                                          decode_batch_sizes.end());
+  std::vector<uint32_t> graph_num_tokens(prefill_lens.begin(),
+                                         prefill_lens.end());
+  runner_options.cuda_graph_max_seq_len(FLAGS_decode_kv_len)
+      .cuda_graph_batch_sizes(graph_batch_sizes)
+      .piecewise_cuda_graph_num_tokens(graph_num_tokens);
+  std::unique_ptr<ModelRunner> graph_runner;
+  if (FLAGS_cuda_graph) {
+    graph_runner =
+        std::make_unique<ModelRunner>(model.get(), device, runner_options);
+    for (const uint32_t batch_size : graph_batch_sizes) {
+      graph_runner->capture_cuda_graphs(batch_size, kv_caches);
+    }
+  }
+
+  std::cout << name << " (" << args.model_type() << "): " << args.n_layers()
+            << " layers, hidden_size " << args.hidden_size() << ", heads "
+            << args.n_heads() << "/" << n_kv_heads << ", vocab "
+            << args.vocab_size() << std::endl;
+  auto run = [&](const char* phase, int64_t batch_size, int64_t len,
+                 const Batch& batch) {
+    const int64_t n_tokens = batch.tokens.size(/*dim=*/0);
+    auto time_runner = [&](ModelRunner& runner) {
+      return time_ms([&] {
+        runner.forward(batch.tokens, batch.positions, kv_caches, batch.params);
+      });
+    };
+    const float eager_ms = time_runner(eager_runner);
+    std::cout << "  " << phase << " batch_size " << batch_size << " len "
+              << len << ": eager " << std::fixed << std::setprecision(3)
+              << eager_ms << " ms " << std::setprecision(0)
+              << n_tokens * 1000.0 / eager_ms << " tokens/s";
+    if (graph_runner != nullptr) {
+      const float graph_ms = time_runner(*graph_runner);
+      std::cout << ", cuda graph " << std::setprecision(3) << graph_ms
+                << " ms " << std::setprecision(0)
+                << n_tokens * 1000.0 / graph_ms << " tokens/s";
+    }
+    std::cout << std::endl;
+    print_layer_breakdown(eager_runner, batch, kv_caches, args.n_layers());
+  };
+
+  for (const int64_t len : prefill_lens) {
+    const auto batch = make_batch(
+        /*batch_size=*/1, len, len, args.vocab_size(), device);
+    run("prefill", 1, len, batch);
+  }
+  for (const int64_t batch_size : decode_batch_sizes) {
+    const auto batch = make_batch(batch_size,
+                                  /*q_len=*/1,
+                                  FLAGS_decode_kv_len,
+                                  args.vocab_size(),
+                                  device);
+    run("decode", batch_size, FLAGS_decode_kv_len, batch);
+  }
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  CHECK(torch::cuda::is_available()) << "CUDA is not available";
+  CHECK_GT(FLAGS_iters, 0);
+
+  std::vector<std::string> names =
+      absl::StrSplit(FLAGS_model_types, ',', absl::SkipEmpty());
+  if (names.empty()) {
+    names = ModelRegistry::get_registered_models();
+  }
+  const auto prefill_lens = parse_sizes(FLAGS_prefill_lens);
+  const auto decode_batch_sizes = parse_sizes(FLAGS_decode_batch_sizes);
+  for (const auto& name : names) {
+    if (ModelRegistry::get_causallm_factory(name) == nullptr ||
+        ModelRegistry::get_model_args_loader(name) == nullptr) {
+      LOG(ERROR) << "Unknown model type: " << name;
+      continue;
+    }
+    run_model(name, prefill_lens, decode_batch_sizes);
+    // release the weights and the kv caches of the model
+    c10::cuda::CUDACachingAllocator::emptyCache();
+  }
+  return 0;
+}
@@ -0,0 +1,100 @@
+#include <benchmark/benchmark.h>
+#include <c10/core/ScalarType.h>
+#include <cuda_runtime.h>
+#include <torch/torch.h>
+
+#include "sampling/logits_processor.h"
+#include "sampling/sampler.h"
+
+using namespace llm;
+
+// top_k and top_p settings for the benchmark
+const std::vector<std::tuple<std::string, int64_t, float>> filters = {
+    {"top_k", 50, 1.0},
+    {"top_p", 0, 0.9},
+    {"top_k_top_p", 50, 0.9},
+};
+
+// state.range(0): 0 for sorting based filtering, 1 for pivot search
+static void BM_top_k_top_p_sampling(benchmark::State& state) {
+  // skip if no gpu
+  if (!torch::cuda::is_available()) {
+    state.SkipWithMessage("CUDA is not available");
+    return;
+  }
+
+  // Perform setup here
+  const bool pivot = state.range(0) == 1;
+  auto [filter, k, p] = filters[state.range(1)];
+  const int64_t batch_size = state.range(2);
+  const int64_t vocab_size = state.range(3);
+  const auto device = torch::kCUDA;
+  const auto logits = torch::randn({batch_size, vocab_size},
+                                   torch::dtype(torch::kHalf).device(device));
+  const auto do_sample =
+      torch::ones({batch_size}, torch::dtype(torch::kBool).device(device));
+  torch::Tensor top_k;
+  torch::Tensor top_p;
+  if (k > 0) {
+    top_k = torch::full(
+        {batch_size}, k, torch::dtype(torch::kLong).device(device));
+  }
+  if (p < 1.0) {
+    top_p = torch::full({batch_size}, p, logits.options());
+  }
+
+  std::unique_ptr<LogitsProcessor> processor;
+  std::unique_ptr<Sampler> sampler;
+  if (pivot) {
+    sampler = std::make_unique<Sampler>(do_sample,
+                                        /*logprobs=*/false,
+                                        /*max_top_logprobs=*/0,
+                                        top_k,
+                                        top_p);
+  } else {
+    processor = std::make_unique<TopKTopPLogitsProcessor>(top_k, top_p);
+    sampler = std::make_unique<Sampler>(do_sample,
+                                        /*logprobs=*/false,
+                                        /*max_top_logprobs=*/0);
+  }
+
+  cudaEvent_t start, stop;
+  cudaEventCreate(&start);
+  cudaEventCreate(&stop);
+
+  for (auto _ : state) {
+    // Start measuring time
+    cudaEventRecord(start);
+
+    auto filtered_logits = logits;
+    if (processor != nullptr) {
+      filtered_logits = processor->forward(logits,
+                                           torch::Tensor(),
+                                           torch::Tensor(),
+                                           torch::Tensor());
+    }
+    auto output = sampler->forward(filtered_logits);
+    // don't optimize out the output
+    benchmark::DoNotOptimize(output);
+
+    // Stop measuring time and calculate the elapsed time
+    cudaEventRecord(stop);
+    cudaEventSynchronize(stop);
+    state.PauseTiming();
+
+    // Update the benchmark state with the measured time
+    float milliseconds = 0;
+    cudaEventElapsedTime(&milliseconds, start, stop);
+    state.SetIterationTime(milliseconds / 1000);
+    state.ResumeTiming();
+  }
+
+  cudaEventDestroy(start);
+  cudaEventDestroy(stop);
+
+  state.SetLabel(std::string(pivot ? "pivot " : "sort ") + filter);
+}
+
+// benchmark sorting based filtering against pivot search
+BENCHMARK(BM_top_k_top_p_sampling)
+    ->ArgsProduct({{0, 1}, {0, 1, 2}, {1, 16, 128}, {32000, 152064}});
@@ -0,0 +1,438 @@
+// An end-to-end serving benchmark that drives LLMHandler directly with
+// synthetic poisson arrivals or requests replayed from a jsonl trace, and
+// reports the throughput and the TTFT, ITL and E2E latency percentiles.
+//
+// Example:
+//   serving_benchmark --model_path=/models/llama3-8b --request_rate=4 \
+//     --num_requests=512 --prompt_len=1024 --output_len=256
+//
+// Each line of the trace file is a json object with optional fields:
+//   {"timestamp": 0.25, "prompt": "...", "prompt_len": 512, "output_len": 64}
+// timestamp is the arrival time in seconds, a prompt of prompt_len words is
+// generated if prompt is missing, and missing fields fall back to the flags.
+
+#include <absl/strings/str_format.h>
+#include <absl/synchronization/blocking_counter.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+#include <folly/init/Init.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <nlohmann/json.hpp>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "handlers/llm_handler.h"
+#include "handlers/sampling_params.h"
+
+using namespace llm;
+
+static constexpr int64_t GB = int64_t(1024) * 1024 * 1024;
+
+// engine flags
+DEFINE_string(model_path, "", "hf model path to the model file.");
+
+DEFINE_string(device,
+              "cuda",
+              "Device to run the model on, e.g. cpu, cuda:0, cuda:0,cuda:1, or "
+              "auto to use all available gpus.");
+
+DEFINE_string(draft_model_path, "", "draft hf model path to the model file.");
+
+DEFINE_string(draft_device,
+              "cuda",
+              "Device to run the draft model on, e.g. cpu, cuda:0, "
+              "cuda:0,cuda:1, or auto to use all available gpus.");
+
+DEFINE_int32(block_size, 8, "slots per block, value must be power of 2");
+
+DEFINE_int64(max_cache_size, 10 * GB, "max cache size in bytes, default 10GB");
+
+DEFINE_double(max_memory_utilization,
+              0.9,
+              "maximum memory utilization allowed, default 0.9");
+
+DEFINE_bool(enable_prefix_cache,
+            true,
+            "enable the prefix cache for the block manager");
+
+DEFINE_bool(enable_cuda_graph,
+            true,
+            "Enable CUDA Graph to optimize model execution.");
+
+DEFINE_int32(max_tokens_per_batch, 512, "max number of tokens per batch");
+
+DEFINE_int32(max_seqs_per_batch, 128, "max number of sequences per batch");
+
+DEFINE_int32(num_speculative_tokens, 0, "number of speculative tokens");
+
+DEFINE_int32(num_decode_steps,
+             1,
+             "number of decode steps to run on device per scheduler step");
+
+DEFINE_string(scheduling_policy,
+              "fcfs",
+              "scheduling policy, e.g. fcfs, slo, wfq, sjf.");
+
+// workload flags
+DEFINE_string(trace_file,
+              "",
+              "jsonl file of requests to replay, synthetic requests are sent "
+              "if empty.");
+
+DEFINE_int32(num_requests, 256, "number of synthetic requests to send");
+
+DEFINE_double(request_rate,
+              0,
+              "poisson arrival rate in requests per second for requests "
+              "without timestamps, 0 to send all of them at once.");
+
+DEFINE_int32(prompt_len, 512, "number of words in generated prompts");
+
+DEFINE_int32(output_len, 128, "number of tokens to generate per request");
+
+DEFINE_double(len_range_ratio,
+              0.0,
+              "lengths are drawn uniformly from [len * (1 - ratio), len * (1 "
+              "+ ratio)] instead of being fixed.");
+
+DEFINE_bool(stream, true, "stream outputs to measure the ttft and itl");
+
+DEFINE_int32(seed, 0, "seed for the arrivals and the generated prompts");
+
+DEFINE_string(output_json, "", "file to write the results as json");
+
+namespace {
+
+struct BenchmarkRequest {
+  // arrival time in seconds since the start of the benchmark
+  double arrival_time = 0;
+  std::string prompt;
+  uint32_t output_len = 0;
+};
+
+struct RequestStats {
+  absl::Time send_time;
+  absl::Time first_token_time;
+  absl::Time last_token_time;
+  absl::Time finish_time;
+  size_t num_prompt_tokens = 0;
+  size_t num_output_tokens = 0;
+  // latency of each output token after the first one, in seconds
+  std::vector<double> itls;
+  bool ok = true;
+};
+
+class WorkloadGenerator {
+ public:
+  explicit WorkloadGenerator(uint32_t seed) : rng_(seed) {}
+
+  uint32_t sample_len(int32_t len) {
+    const double ratio = std::clamp(FLAGS_len_range_ratio, 0.0, 1.0);
+    std::uniform_real_distribution<double> dist(len * (1 - ratio),
+                                                len * (1 + ratio));
+    return std::max<uint32_t>(1, static_cast<uint32_t>(dist(rng_)));
+  }
+
+  // random common words, mostly one token each, to avoid prefix cache hits
+  std::string generate_prompt(uint32_t num_words) {
+    static const char* const kWords[] = {
+        "the",    "model",  "serves", "tokens", "with",   "low",
+        "latency", "and",   "high",   "throughput", "for", "every",
+        "request", "in",    "a",      "batch",  "of",     "many",
+        "users",  "who",    "ask",    "about",  "time",   "space",
+        "light",  "water",  "music",  "history", "science", "art"};
+    constexpr size_t kNumWords = sizeof(kWords) / sizeof(kWords[0]);
+    std::uniform_int_distribution<size_t> dist(0, kNumWords - 1);
+    std::string prompt;
+    for (uint32_t i = 0; i < num_words; ++i) {
+      if (i > 0) {
+        prompt += ' ';
+      }
+      prompt += kWords[dist(rng_)];
+    }
+    return prompt;
+  }
+
+  // time to the next poisson arrival in seconds
+  double next_interval() {
+    if (FLAGS_request_rate <= 0) {
+      return 0;
+    }
+    std::exponential_distribution<double> dist(FLAGS_request_rate);
+    return dist(rng_);
+  }
+
+ private:
+  std::mt19937 rng_;
+};
+
+std::vector<BenchmarkRequest> synthetic_workload(WorkloadGenerator* gen) {
+  std::vector<BenchmarkRequest> requests(FLAGS_num_requests);
+  double arrival_time = 0;
+  for (auto& request : requests) {
+    request.arrival_time = arrival_time;
+    request.prompt = gen->generate_prompt(gen->sample_len(FLAGS_prompt_len));
+    request.output_len = gen->sample_len(FLAGS_output_len);
+    arrival_time += gen->next_interval();
+  }
+  return requests;
+}
+
+std::vector<BenchmarkRequest> load_trace(const std::string& path,
+                                         WorkloadGenerator* gen) {
+  std::ifstream file(path);
+  CHECK(file.is_open()) << "Failed to open trace file " << path;
+
+  std::vector<BenchmarkRequest> requests;
+  std::optional<double> first_timestamp;
+  double arrival_time = 0;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    const auto json = nlohmann::json::parse(line);
+    BenchmarkRequest request;
+    if (json.contains("timestamp")) {
+      // replay the arrivals relative to the first request
+      const double timestamp = json["timestamp"].get<double>();
+      if (!first_timestamp.has_value()) {
+        first_timestamp = timestamp;
+      }
+      arrival_time = timestamp - first_timestamp.value();
+    }
+    request.arrival_time = arrival_time;
+    if (json.contains("prompt")) {
+      request.prompt = json["prompt"].get<std::string>();
+    } else {
+      const int32_t prompt_len =
+          json.value("prompt_len", FLAGS_prompt_len);
+      request.prompt = gen->generate_prompt(gen->sample_len(prompt_len));
+    }
+    request.output_len =
+        json.contains("output_len")
+            ? json["output_len"].get<uint32_t>()
+            : gen->sample_len(FLAGS_output_len);
+    if (!json.contains("timestamp")) {
+      arrival_time += gen->next_interval();
+    }
+    requests.push_back(std::move(request));
+  }
+  // send requests in the order of arrivals
+  std::stable_sort(requests.begin(),
+                   requests.end(),
+                   [](const auto& a, const auto& b) {
+                     return a.arrival_time < b.arrival_time;
+                   });
+  return requests;
+}
+
+struct Summary {
+  double mean = 0;
+  double p50 = 0;
+  double p90 = 0;
+  double p99 = 0;
+};
+
+Summary summarize(std::vector<double> values) {
+  Summary summary;
+  if (values.empty()) {
+    return summary;
+  }
+  std::sort(values.begin(), values.end());
+  auto percentile = [&](double p) {
+    const size_t idx = static_cast<size_t>(p * (values.size() - 1) + 0.5);
+    return values[idx];
+  };
+  summary.mean =
+      std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+  summary.p50 = percentile(0.5);
+  summary.p90 = percentile(0.9);
+  summary.p99 = percentile(0.99);
+  return summary;
+}
+
+nlohmann::json to_json(const Summary& summary) {
+  return {{"mean", summary.mean},
+          {"p50", summary.p50},
+          {"p90", summary.p90},
+          {"p99", summary.p99}};
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  // glog and gflags will be initialized in folly::init
+  folly::Init init(&argc, &argv);
+
+  WorkloadGenerator gen(FLAGS_seed);
+  const auto requests = FLAGS_trace_file.empty()
+                            ? synthetic_workload(&gen)
+                            : load_trace(FLAGS_trace_file, &gen);
+  CHECK(!requests.empty()) << "No requests to send";
+
+  LLMHandler::Options options;
+  options.model_path(FLAGS_model_path)
+      .devices(FLAGS_device)
+      .draft_model_path(FLAGS_draft_model_path)
+      .draft_devices(FLAGS_draft_device)
+      .block_size(FLAGS_block_size)
+      .max_cache_size(FLAGS_max_cache_size)
+      .max_memory_utilization(FLAGS_max_memory_utilization)
+      .enable_prefix_cache(FLAGS_enable_prefix_cache)
+      .enable_cuda_graph(FLAGS_enable_cuda_graph)
+      .max_tokens_per_batch(FLAGS_max_tokens_per_batch)
+      .max_seqs_per_batch(FLAGS_max_seqs_per_batch)
+      .num_speculative_tokens(FLAGS_num_speculative_tokens)
+      .num_decode_steps(FLAGS_num_decode_steps)
+      .scheduling_policy(FLAGS_scheduling_policy);
+  LLMHandler handler(options);
+  handler.start();
+
+  std::vector<RequestStats> stats(requests.size());
+  absl::BlockingCounter counter(static_cast<int>(requests.size()));
+
+  LOG(INFO) << "Sending " << requests.size() << " requests";
+  const absl::Time start_time = absl::Now();
+  for (size_t i = 0; i < requests.size(); ++i) {
+    const auto& request = requests[i];
+    const absl::Time arrival =
+        start_time + absl::Seconds(request.arrival_time);
+    const absl::Time now = absl::Now();
+    if (arrival > now) {
+      absl::SleepFor(arrival - now);
+    }
+
+    SamplingParams sp;
+    sp.max_tokens = request.output_len;
+    sp.ignore_eos = true;
+    sp.temperature = 0;
+
+    RequestStats* request_stats = &stats[i];
+    request_stats->send_time = absl::Now();
+    // outputs of a request are handled in order on one response thread
+    handler.schedule_async(
+        request.prompt,
+        std::move(sp),
+        Priority::NORMAL,
+        FLAGS_stream,
+        [request_stats, &counter](const RequestOutput& output) {
+          const absl::Time now = absl::Now();
+          size_t num_tokens = 0;
+          for (const auto& seq_output : output.outputs) {
+            num_tokens += seq_output.token_ids.size();
+          }
+          if (num_tokens > 0) {
+            if (request_stats->num_output_tokens == 0) {
+              request_stats->first_token_time = now;
+            } else {
+              // spread the latency over the tokens of the delta
+              const double itl =
+                  absl::ToDoubleSeconds(now - request_stats->last_token_time) /
+                  num_tokens;
+              request_stats->itls.insert(
+                  request_stats->itls.end(), num_tokens, itl);
+            }
+            request_stats->last_token_time = now;
+            request_stats->num_output_tokens += num_tokens;
+          }
+          if (output.usage.has_value()) {
+            request_stats->num_prompt_tokens = output.usage->num_prompt_tokens;
+            request_stats->num_output_tokens =
+                output.usage->num_generated_tokens;
+          }
+
+          const bool failed =
+              output.status.has_value() && !output.status->ok();
+          if (failed) {
+            LOG(ERROR) << "Request failed: " << output.status->message();
+            request_stats->ok = false;
+          }
+          if (output.finished || failed) {
+            request_stats->finish_time = now;
+            counter.DecrementCount();
+          }
+          return true;
+        });
+  }
+  counter.Wait();
+  const double duration = absl::ToDoubleSeconds(absl::Now() - start_time);
+  handler.stop();
+
+  // aggregate the metrics of successful requests
+  size_t num_ok = 0;
+  size_t num_prompt_tokens = 0;
+  size_t num_output_tokens = 0;
+  std::vector<double> ttfts;
+  std::vector<double> itls;
+  std::vector<double> e2es;
+  for (const auto& s : stats) {
+    if (!s.ok) {
+      continue;
+    }
+    ++num_ok;
+    num_prompt_tokens += s.num_prompt_tokens;
+    num_output_tokens += s.num_output_tokens;
+    if (FLAGS_stream && s.first_token_time > s.send_time) {
+      ttfts.push_back(absl::ToDoubleMilliseconds(s.first_token_time -
+                                                 s.send_time));
+    }
+    for (const double itl : s.itls) {
+      itls.push_back(itl * 1000);
+    }
+    e2es.push_back(absl::ToDoubleSeconds(s.finish_time - s.send_time));
+  }
+
+  const Summary ttft = summarize(std::move(ttfts));
+  const Summary itl = summarize(std::move(itls));
+  const Summary e2e = summarize(std::move(e2es));
+
+  std::cout << absl::StrFormat(
+      "Requests: %d succeeded, %d failed in %.2f s\n"
+      "Throughput: %.2f requests/s, %.2f output tokens/s, %.2f tokens/s\n",
+      num_ok,
+      stats.size() - num_ok,
+      duration,
+      num_ok / duration,
+      num_output_tokens / duration,
+      (num_prompt_tokens + num_output_tokens) / duration);
+  auto print = [](const char* name, const Summary& s) {
+    std::cout << absl::StrFormat(
+        "%-9s mean %10.2f  p50 %10.2f  p90 %10.2f  p99 %10.2f\n",
+        name,
+        s.mean,
+        s.p50,
+        s.p90,
+        s.p99);
+  };
+  print("TTFT(ms)", ttft);
+  print("ITL(ms)", itl);
+  print("E2E(s)", e2e);
+
+  if (!FLAGS_output_json.empty()) {
+    nlohmann::json result = {
+        {"num_requests", stats.size()},
+        {"num_succeeded", num_ok},
+        {"duration_s", duration},
+        {"request_throughput", num_ok / duration},
+        {"output_token_throughput", num_output_tokens / duration},
+        {"total_token_throughput",
+         (num_prompt_tokens + num_output_tokens) / duration},
+        {"ttft_ms", to_json(ttft)},
+        {"itl_ms", to_json(itl)},
+        {"e2e_s", to_json(e2e)},
+    };
+    std::ofstream file(FLAGS_output_json);
+    file << result.dump(2) << std::endl;
+  }
+  return 0;
+}
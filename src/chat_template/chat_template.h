@@ -1,10 +1,20 @@
 #pragma once
+#include <cstdint>
 #include <optional>
 #include <string>
 #include <vector>
 
 namespace llm {
 
+// An image of a message, marked by a placeholder in the content, see
+// ImageProcessor.
+struct Image {
+  // the pixels in row major order, 3 bytes (r, g, b) for each
+  std::string data;
+  int32_t width = 0;
+  int32_t height = 0;
+};
+
 struct Message {
   Message() = default;
   Message(const std::string& role, const std::string& content)
@@ -12,6 +22,9 @@ struct Message {
 
   std::string role;
   std::string content;
+
+  // the images of the message, only for the vision-language models
+  std::vector<Image> images;
 };
 using ChatMessages = std::vector<Message>;
 
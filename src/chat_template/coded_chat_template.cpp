@@ -57,4 +57,16 @@ std::optional<std::string> CodedChatTemplate::apply(
   return get_prompt(system_message, msgs);
 }
 
+size_t CodedChatTemplate::prompt_capacity(
+    const std::string_view& system_message,
+    const std::vector<std::string_view>& messages) {
+  // enough for the role tags of all supported templates
+  constexpr size_t kTagBytes = 64;
+  size_t capacity = system_message.size() + 2 * kTagBytes;
+  for (const auto& message : messages) {
+    capacity += message.size() + kTagBytes;
+  }
+  return capacity;
+}
+
 }  // namespace llm
\ No newline at end of file
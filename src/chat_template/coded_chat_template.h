@@ -2,6 +2,8 @@
 
 #include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include "chat_template.h"
 
@@ -18,6 +20,12 @@ class CodedChatTemplate : public ChatTemplate {
   virtual std::optional<std::string> get_prompt(
       const std::string_view& system_message,
       const std::vector<std::string_view>& messages) const = 0;
+
+ protected:
+  // bytes to reserve for the prompt to build it without reallocation: the
+  // size of all messages plus room for the tags around each of them.
+  static size_t prompt_capacity(const std::string_view& system_message,
+                                const std::vector<std::string_view>& messages);
 };
 
 }  // namespace llm
\ No newline at end of file
@@ -2,9 +2,11 @@
 
 #include <absl/strings/ascii.h>
 
+#include <memory>
 #include <optional>
-#include <sstream>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 namespace llm {
@@ -18,14 +20,17 @@ std::optional<std::string> Llama2ChatTemplate::get_prompt(
     return std::nullopt;
   }
 
-  std::stringstream ss;
+  std::string prompt;
+  prompt.reserve(prompt_capacity(system_message, messages));
   // start with system message
   // N.B. tokenizer would add <s> to the beginning of the prompt
   if (!system_message.empty()) {
-    ss << "[INST] <<SYS>>\n" << system_message << "\n<</SYS>>\n\n";
+    prompt += "[INST] <<SYS>>\n";
+    prompt += system_message;
+    prompt += "\n<</SYS>>\n\n";
   } else {
     // no system message
-    ss << "[INST] ";
+    prompt += "[INST] ";
   }
 
   // then user and assistant message pairs (u/a/u/a/u...)
@@ -33,14 +38,17 @@ std::optional<std::string> Llama2ChatTemplate::get_prompt(
     const char* role = i % 2 == 0 ? "[INST] " : "[/INST] ";
     const char* seps = i % 2 == 0 ? " " : " </s><s>";
     if (i == 0) {
-      ss << messages[i] << " ";
+      prompt += messages[i];
+      prompt += " ";
     } else {
-      ss << role << messages[i] << seps;
+      prompt += role;
+      prompt += messages[i];
+      prompt += seps;
     }
   }
   // end with assistant message
-  ss << "[/INST]";
-  return ss.str();
+  prompt += "[/INST]";
+  return prompt;
 }
 
 // generate prompt from ChatTemplate
@@ -54,17 +62,22 @@ std::optional<std::string> Llama3ChatTemplate::get_prompt(
     return std::nullopt;
   }
 
-  std::stringstream ss;
-  auto add_header = [&ss](const std::string_view& role) {
-    ss << "<|start_header_id|>" << role << "<|end_header_id|>\n\n";
+  std::string prompt;
+  prompt.reserve(prompt_capacity(system_message, messages));
+  auto add_header = [&prompt](const std::string_view& role) {
+    prompt += "<|start_header_id|>";
+    prompt += role;
+    prompt += "<|end_header_id|>\n\n";
   };
-  auto add_message = [&ss](const std::string_view& message) {
+  auto add_message = [&prompt](const std::string_view& message) {
     // strip leading/trailing whitespaces
-    ss << absl::StripAsciiWhitespace({message.data(), message.size()})
-       << "<|eot_id|>";
+    const auto stripped =
+        absl::StripAsciiWhitespace({message.data(), message.size()});
+    prompt.append(stripped.data(), stripped.size());
+    prompt += "<|eot_id|>";
   };
 
-  ss << "<|begin_of_text|>";
+  prompt += "<|begin_of_text|>";
   // start with system message
   if (!system_message.empty()) {
     add_header("system");
@@ -79,7 +92,99 @@ std::optional<std::string> Llama3ChatTemplate::get_prompt(
   }
   // end with assistant message
   add_header("assistant");
-  return ss.str();
+  return prompt;
 }
 
-}  // namespace llm
\ No newline at end of file
+ChatMLChatTemplate::ChatMLChatTemplate(std::string default_system_message)
+    : default_system_message_(std::move(default_system_message)) {}
+
+std::optional<std::string> ChatMLChatTemplate::get_prompt(
+    const std::string_view& system_message,
+    const std::vector<std::string_view>& messages) const {
+  // at least one user message
+  if (messages.size() % 2 == 0) {
+    return std::nullopt;
+  }
+
+  std::string prompt;
+  prompt.reserve(prompt_capacity(system_message, messages) +
+                 default_system_message_.size());
+  auto add_message = [&prompt](const std::string_view& role,
+                               const std::string_view& message) {
+    prompt += "<|im_start|>";
+    prompt += role;
+    prompt += "\n";
+    prompt += message;
+    prompt += "<|im_end|>\n";
+  };
+
+  // start with system message
+  if (!system_message.empty()) {
+    add_message("system", system_message);
+  } else if (!default_system_message_.empty()) {
+    add_message("system", default_system_message_);
+  }
+
+  // then user and assistant message pairs (u/a/u/a/u...)
+  for (size_t i = 0; i < messages.size(); ++i) {
+    const char* role = i % 2 == 0 ? "user" : "assistant";
+    add_message(role, messages[i]);
+  }
+  // end with assistant message
+  prompt += "<|im_start|>assistant\n";
+  return prompt;
+}
+
+namespace {
+bool contains(const std::string& str, const std::string_view& sub) {
+  return str.find(sub) != std::string::npos;
+}
+
+// returns the default system message of a chatml template, which is rendered
+// as a literal string if there is no system message, e.g. qwen2.5.
+std::optional<std::string> chatml_default_system_message(
+    const std::string& jinja_template) {
+  // the newline is escaped in the string literals of the template
+  for (const std::string_view header :
+       {"<|im_start|>system\\n", "<|im_start|>system\n"}) {
+    size_t pos = 0;
+    while ((pos = jinja_template.find(header, pos)) != std::string::npos) {
+      pos += header.size();
+      const size_t end = jinja_template.find("<|im_end|>", pos);
+      if (end == std::string::npos) {
+        break;
+      }
+      const auto message = jinja_template.substr(pos, end - pos);
+      // skip the ones rendered from the messages
+      if (message.find_first_of("{}'\"+\\") == std::string::npos) {
+        return message;
+      }
+    }
+  }
+  return std::nullopt;
+}
+}  // namespace
+
+std::unique_ptr<CodedChatTemplate> create_coded_chat_template(
+    const std::string& jinja_template) {
+  if (contains(jinja_template, "<|start_header_id|>") &&
+      contains(jinja_template, "<|eot_id|>")) {
+    // llama 3.1 and later add extra content into the system message
+    if (contains(jinja_template, "Knowledge Date")) {
+      return nullptr;
+    }
+    return std::make_unique<Llama3ChatTemplate>();
+  }
+  if (contains(jinja_template, "<|im_start|>") &&
+      contains(jinja_template, "<|im_end|>")) {
+    return std::make_unique<ChatMLChatTemplate>(
+        chatml_default_system_message(jinja_template).value_or(""));
+  }
+  if (contains(jinja_template, "[INST]") &&
+      contains(jinja_template, "<<SYS>>")) {
+    return std::make_unique<Llama2ChatTemplate>();
+  }
+  return nullptr;
+}
+
+}  // namespace llm
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
 #include <optional>
 #include <string>
 #include <vector>
@@ -26,4 +27,26 @@ class Llama3ChatTemplate final : public CodedChatTemplate {
       const std::vector<std::string_view>& messages) const override;
 };
 
+// dialog conversation in chatml format, e.g. qwen and yi models
+// <|im_start|>{role}\n{message}<|im_end|>\n
+class ChatMLChatTemplate final : public CodedChatTemplate {
+ public:
+  // default_system_message: the system message used if there is none
+  explicit ChatMLChatTemplate(std::string default_system_message = "");
+
+  // generate prompt from dialogs
+  std::optional<std::string> get_prompt(
+      const std::string_view& system_message,
+      const std::vector<std::string_view>& messages) const override;
+
+ private:
+  std::string default_system_message_;
+};
+
+// returns the coded chat template that renders the same prompts as the jinja
+// chat template from the tokenizer config if it is of a known family, e.g.
+// llama3 or chatml, otherwise nullptr.
+std::unique_ptr<CodedChatTemplate> create_coded_chat_template(
+    const std::string& jinja_template);
+
 }  // namespace llm
\ No newline at end of file
@@ -0,0 +1,84 @@
+#include "common_chat_template.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace llm {
+
+TEST(CommonChatTemplateTest, ChatML) {
+  ChatMLChatTemplate chat_template;
+  const ChatMessages messages = {{"system", "you are a helpful assistant."},
+                                 {"user", "hi"},
+                                 {"assistant", "what i can do for you?"},
+                                 {"user", "how are you?"}};
+  // clang-format off
+  const std::string expected =
+    "<|im_start|>system\n"
+    "you are a helpful assistant.<|im_end|>\n"
+    "<|im_start|>user\n"
+    "hi<|im_end|>\n"
+    "<|im_start|>assistant\n"
+    "what i can do for you?<|im_end|>\n"
+    "<|im_start|>user\n"
+    "how are you?<|im_end|>\n"
+    "<|im_start|>assistant\n";
+  // clang-format on
+  EXPECT_EQ(chat_template.apply(messages), expected);
+
+  // no user message
+  EXPECT_FALSE(chat_template.apply({{"system", "hi"}}).has_value());
+}
+
+TEST(CommonChatTemplateTest, CreateCodedChatTemplate) {
+  // clang-format off
+  const std::string yi_template =
+      "{% if add_generation_prompt is undefined %}{% set add_generation_prompt = false %}{% endif %}"
+      "{% for message in messages %}"
+        "{{'<|im_start|>' + message['role'] + '\\n' + message['content'] + '<|im_end|>' + '\\n'}}"
+      "{% endfor %}"
+      "{% if add_generation_prompt %}{{ '<|im_start|>assistant\\n' }}{% endif %}";
+  const std::string qwen_template =
+      "{% for message in messages %}"
+        "{% if loop.first and messages[0]['role'] != 'system' %}"
+          "{{ '<|im_start|>system\\nYou are a helpful assistant.<|im_end|>\\n' }}"
+        "{% endif %}"
+        "{{'<|im_start|>' + message['role'] + '\\n' + message['content'] + '<|im_end|>' + '\\n'}}"
+      "{% endfor %}"
+      "{% if add_generation_prompt %}{{ '<|im_start|>assistant\\n' }}{% endif %}";
+  const std::string llama3_template =
+      "{% set loop_messages = messages %}"
+      "{% for message in loop_messages %}"
+        "{% set content = '<|start_header_id|>' + message['role'] + '<|end_header_id|>\\n\\n'+ message['content'] | trim + '<|eot_id|>' %}"
+        "{% if loop.index0 == 0 %}{% set content = bos_token + content %}{% endif %}"
+        "{{ content }}"
+      "{% endfor %}"
+      "{% if add_generation_prompt %}{{ '<|start_header_id|>assistant<|end_header_id|>\\n\\n' }}{% endif %}";
+  const std::string open_chat_template =
+      "{{ bos_token }}{% for message in messages %}"
+        "{{ 'GPT4 Correct ' + message['role'] + ': ' + message['content'] + '<|end_of_turn|>'}}"
+      "{% endfor %}";
+  // clang-format on
+  const ChatMessages messages = {{"user", "hi"}};
+
+  auto yi = create_coded_chat_template(yi_template);
+  ASSERT_NE(yi, nullptr);
+  EXPECT_EQ(yi->apply(messages),
+            "<|im_start|>user\nhi<|im_end|>\n<|im_start|>assistant\n");
+
+  auto qwen = create_coded_chat_template(qwen_template);
+  ASSERT_NE(qwen, nullptr);
+  EXPECT_EQ(qwen->apply(messages),
+            "<|im_start|>system\nYou are a helpful assistant.<|im_end|>\n"
+            "<|im_start|>user\nhi<|im_end|>\n<|im_start|>assistant\n");
+
+  auto llama3 = create_coded_chat_template(llama3_template);
+  ASSERT_NE(llama3, nullptr);
+  EXPECT_EQ(llama3->apply(messages),
+            "<|begin_of_text|><|start_header_id|>user<|end_header_id|>\n\n"
+            "hi<|eot_id|><|start_header_id|>assistant<|end_header_id|>\n\n");
+
+  EXPECT_EQ(create_coded_chat_template(open_chat_template), nullptr);
+}
+
+}  // namespace llm
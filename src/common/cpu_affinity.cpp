@@ -0,0 +1,138 @@
+#include "cpu_affinity.h"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_split.h>
+#include <glog/logging.h>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace llm {
+namespace {
+// read the first line of the file, empty if not readable
+std::string read_line(const std::string& path) {
+  std::ifstream file(path);
+  std::string line;
+  if (file.is_open()) {
+    std::getline(file, line);
+  }
+  return line;
+}
+
+#if defined(__linux__)
+bool set_affinity(pthread_t thread, const std::vector<int32_t>& cpus) {
+  if (cpus.empty()) {
+    return true;
+  }
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (const int32_t cpu : cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &cpu_set);
+    }
+  }
+  const int ret = pthread_setaffinity_np(thread, sizeof(cpu_set), &cpu_set);
+  if (ret != 0) {
+    LOG(WARNING) << "Failed to set thread affinity, error: " << ret;
+    return false;
+  }
+  return true;
+}
+#endif
+}  // namespace
+
+std::vector<int32_t> parse_cpu_list(const std::string& cpu_list) {
+  std::vector<int32_t> cpus;
+  for (const auto range : absl::StrSplit(absl::StripAsciiWhitespace(cpu_list),
+                                         ',',
+                                         absl::SkipWhitespace())) {
+    const std::vector<std::string> bounds = absl::StrSplit(range, '-');
+    int32_t first = 0;
+    int32_t last = 0;
+    if (bounds.size() > 2 ||
+        !absl::SimpleAtoi(bounds.front(), &first) ||
+        !absl::SimpleAtoi(bounds.back(), &last) || first < 0 ||
+        last < first) {
+      LOG(ERROR) << "Invalid cpu list: " << cpu_list;
+      return {};
+    }
+    for (int32_t cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  return cpus;
+}
+
+std::vector<int32_t> online_cpus() {
+  auto cpus = parse_cpu_list(read_line("/sys/devices/system/cpu/online"));
+  if (cpus.empty()) {
+    const int32_t n_cpus =
+        static_cast<int32_t>(std::thread::hardware_concurrency());
+    for (int32_t cpu = 0; cpu < n_cpus; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+std::vector<int32_t> numa_node_cpus(int32_t node) {
+  if (node < 0) {
+    return {};
+  }
+  return parse_cpu_list(read_line("/sys/devices/system/node/node" +
+                                  std::to_string(node) + "/cpulist"));
+}
+
+int32_t pci_device_numa_node(const std::string& pci_bus_id) {
+  const std::string line = read_line("/sys/bus/pci/devices/" +
+                                     absl::AsciiStrToLower(pci_bus_id) +
+                                     "/numa_node");
+  int32_t node = -1;
+  if (!absl::SimpleAtoi(line, &node)) {
+    return -1;
+  }
+  return node;
+}
+
+std::vector<int32_t> exclude_cpus(const std::vector<int32_t>& cpus,
+                                  const std::vector<int32_t>& excluded) {
+  std::vector<int32_t> result;
+  std::set_difference(cpus.begin(),
+                      cpus.end(),
+                      excluded.begin(),
+                      excluded.end(),
+                      std::back_inserter(result));
+  return result;
+}
+
+bool set_thread_affinity(std::thread& thread,
+                         const std::vector<int32_t>& cpus) {
+#if defined(__linux__)
+  return set_affinity(thread.native_handle(), cpus);
+#else
+  return cpus.empty();
+#endif
+}
+
+bool set_current_thread_affinity(const std::vector<int32_t>& cpus) {
+#if defined(__linux__)
+  return set_affinity(pthread_self(), cpus);
+#else
+  return cpus.empty();
+#endif
+}
+
+}  // namespace llm
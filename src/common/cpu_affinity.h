@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace llm {
+
+// parse a cpu list in the format of taskset and sysfs, e.g. "0-3,8,10-11",
+// into sorted unique cpu ids. returns empty for an empty or invalid list.
+std::vector<int32_t> parse_cpu_list(const std::string& cpu_list);
+
+// the online cpus of the host
+std::vector<int32_t> online_cpus();
+
+// the cpus of the numa node, empty if unknown
+std::vector<int32_t> numa_node_cpus(int32_t node);
+
+// the numa node of the pci device, e.g. "0000:3b:00.0", -1 if unknown
+int32_t pci_device_numa_node(const std::string& pci_bus_id);
+
+// the cpus in cpus but not in excluded, both sorted
+std::vector<int32_t> exclude_cpus(const std::vector<int32_t>& cpus,
+                                  const std::vector<int32_t>& excluded);
+
+// restrict the thread to run on the cpus, no-op for empty cpus. returns false
+// if the affinity can't be set, e.g. on platforms without affinity support.
+bool set_thread_affinity(std::thread& thread,
+                         const std::vector<int32_t>& cpus);
+bool set_current_thread_affinity(const std::vector<int32_t>& cpus);
+
+}  // namespace llm
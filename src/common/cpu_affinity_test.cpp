@@ -0,0 +1,33 @@
+#include "cpu_affinity.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace llm {
+
+TEST(CpuAffinityTest, ParseCpuList) {
+  EXPECT_EQ(parse_cpu_list("0-3,8,10-11"),
+            std::vector<int32_t>({0, 1, 2, 3, 8, 10, 11}));
+  // sorted and deduplicated, with a trailing newline as in sysfs
+  EXPECT_EQ(parse_cpu_list("5,1-2,2\n"), std::vector<int32_t>({1, 2, 5}));
+  EXPECT_TRUE(parse_cpu_list("").empty());
+  EXPECT_TRUE(parse_cpu_list("3-1").empty());
+  EXPECT_TRUE(parse_cpu_list("0-1-2").empty());
+  EXPECT_TRUE(parse_cpu_list("a").empty());
+}
+
+TEST(CpuAffinityTest, ExcludeCpus) {
+  EXPECT_EQ(exclude_cpus({0, 1, 2, 3}, {1, 3, 5}),
+            std::vector<int32_t>({0, 2}));
+  EXPECT_EQ(exclude_cpus({0, 1}, {}), std::vector<int32_t>({0, 1}));
+}
+
+TEST(CpuAffinityTest, SetCurrentThreadAffinity) {
+  // no-op for empty cpus
+  EXPECT_TRUE(set_current_thread_affinity({}));
+  EXPECT_FALSE(online_cpus().empty());
+}
+
+}  // namespace llm
@@ -4,9 +4,17 @@
 #include <nlohmann/json.hpp>
 #include <optional>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 namespace llm {
+namespace detail {
+template <typename T>
+struct is_vector : std::false_type {};
+
+template <typename T, typename A>
+struct is_vector<std::vector<T, A>> : std::true_type {};
+}  // namespace detail
 
 // an thin wrapper around nlohmann/json to read json files.
 // it supports read keys with dot notation from json.
@@ -60,8 +68,12 @@ class JsonReader {
       }
     }
 
-    if (data.is_null() || data.is_structured()) {
-      // cannot convert null or structured data to T
+    if (data.is_null()) {
+      return std::nullopt;
+    }
+    if (data.is_structured() &&
+        !(detail::is_vector<T>::value && data.is_array())) {
+      // cannot convert structured data to T other than arrays to vectors
       return std::nullopt;
     }
     return data.get<T>();
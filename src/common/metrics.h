@@ -8,9 +8,13 @@
 #include <prometheus/registry.h>
 #include <prometheus/text_serializer.h>
 
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include "macros.h"
+#include "sharded_metrics.h"
 #include "timer.h"
 
 namespace llm {
@@ -35,10 +39,20 @@ class Metrics final {
     return instance;
   }
 
-  // get the metrics string
+  // get the metrics string, the sharded metrics are aggregated here
   std::string GetString() const {
+    auto families = registry_.Collect();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const auto& family : counter_families_) {
+        families.push_back(family->Collect());
+      }
+      for (const auto& family : histogram_families_) {
+        families.push_back(family->Collect());
+      }
+    }
     prometheus::TextSerializer serializer;
-    return serializer.Serialize(registry_.Collect());
+    return serializer.Serialize(families);
   }
 
   // helper functions to define metrics
@@ -47,17 +61,23 @@ class Metrics final {
     return prometheus::BuildGauge().Name(name).Help(desc).Register(registry_);
   }
 
-  prometheus::Family<prometheus::Counter>& BuildCounter(
-      const std::string& name,
-      const std::string& desc) {
-    return prometheus::BuildCounter().Name(name).Help(desc).Register(registry_);
+  // counters and histograms are updated on hot paths, they are sharded by
+  // threads to avoid contention on shared atomics and mutexes.
+  ShardedFamily<ShardedCounter>& BuildCounter(const std::string& name,
+                                              const std::string& desc) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    counter_families_.push_back(std::make_unique<ShardedFamily<ShardedCounter>>(
+        name, desc, prometheus::MetricType::Counter));
+    return *counter_families_.back();
   }
 
-  prometheus::Family<prometheus::Histogram>& BuildHistogram(
-      const std::string& name,
-      const std::string& desc) {
-    return prometheus::BuildHistogram().Name(name).Help(desc).Register(
-        registry_);
+  ShardedFamily<ShardedHistogram>& BuildHistogram(const std::string& name,
+                                                  const std::string& desc) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    histogram_families_.push_back(
+        std::make_unique<ShardedFamily<ShardedHistogram>>(
+            name, desc, prometheus::MetricType::Histogram));
+    return *histogram_families_.back();
   }
 
  private:
@@ -65,11 +85,17 @@ class Metrics final {
   ~Metrics() = default;
 
   prometheus::Registry registry_;
+
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<ShardedFamily<ShardedCounter>>>
+      counter_families_;
+  std::vector<std::unique_ptr<ShardedFamily<ShardedHistogram>>>
+      histogram_families_;
 };
 
 class AutoCounter final {
  public:
-  AutoCounter(prometheus::Counter& counter) : counter_(counter) {}
+  AutoCounter(ShardedCounter& counter) : counter_(counter) {}
 
   ~AutoCounter() {
     // increment the counter
@@ -78,7 +104,7 @@ class AutoCounter final {
 
  private:
   // NOLINTNEXTLINE
-  prometheus::Counter& counter_;
+  ShardedCounter& counter_;
 
   // the timer
   Timer timer_;
@@ -155,20 +181,21 @@ class AutoCounter final {
   extern prometheus::Family<prometheus::Gauge>& name##_family;
 
 // declare counter
-#define DECLARE_COUNTER(name) extern prometheus::Counter& COUNTER_##name;
+#define DECLARE_COUNTER(name) extern llm::ShardedCounter& COUNTER_##name;
 
 #define DECLARE_COUNTER_INSTANCE(alias) \
-  extern prometheus::Counter& COUNTER_##alias;
+  extern llm::ShardedCounter& COUNTER_##alias;
 
 #define DECLARE_COUNTER_FAMILY(name) \
-  extern prometheus::Family<prometheus::Counter>& name##_family;
+  extern llm::ShardedFamily<llm::ShardedCounter>& name##_family;
 
 // declare histogram
-#define DECLARE_HISTOGRAM(name) extern prometheus::Histogram& HISTOGRAM_##name;
+#define DECLARE_HISTOGRAM(name) \
+  extern llm::ShardedHistogram& HISTOGRAM_##name;
 
 #define DECLARE_HISTOGRAM_INSTANCE(alias) \
-  extern prometheus::Histogram& HISTOGRAM_##alias;
+  extern llm::ShardedHistogram& HISTOGRAM_##alias;
 
 #define DECLARE_HISTOGRAM_FAMILY(name) \
-  extern prometheus::Family<prometheus::Histogram>& name##_family;
+  extern llm::ShardedFamily<llm::ShardedHistogram>& name##_family;
 // NOLINTEND(bugprone-macro-parentheses)
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace llm {
+
+// a bounded lock-free queue that supports multiple producers and multiple
+// consumers concurrently. the queue is a ring buffer of cells, each with a
+// sequence number telling whether the cell is ready to be written or read in
+// the current lap. (Dmitry Vyukov's bounded mpmc queue)
+template <typename T>
+class MPMCQueue final {
+ public:
+  // capacity is rounded up to a power of 2
+  explicit MPMCQueue(size_t capacity) {
+    CHECK_GT(capacity, 0);
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mask_ = size - 1;
+    cells_ = std::make_unique<Cell[]>(size);
+    for (size_t i = 0; i < size; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // disable copy/move constructor and assignment
+  MPMCQueue(const MPMCQueue&) = delete;
+  MPMCQueue& operator=(const MPMCQueue&) = delete;
+  MPMCQueue(MPMCQueue&&) = delete;
+  MPMCQueue& operator=(MPMCQueue&&) = delete;
+
+  // push an element to the queue, returns false if the queue is full.
+  // value is left untouched if not pushed.
+  template <typename U>
+  bool try_push(U&& value) {
+    Cell* cell = nullptr;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[pos & mask_];
+      const size_t seq = cell->sequence.load(std::memory_order_acquire);
+      const auto diff =
+          static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        // the cell is free in this lap, try to claim it
+        if (enqueue_pos_.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // the cell is not read yet in the last lap
+        return false;
+      } else {
+        // claimed by another producer
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = std::forward<U>(value);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // pop an element from the queue, returns false if the queue is empty.
+  bool try_pop(T* value) {
+    Cell* cell = nullptr;
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[pos & mask_];
+      const size_t seq = cell->sequence.load(std::memory_order_acquire);
+      const auto diff =
+          static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        // the cell is written in this lap, try to claim it
+        if (dequeue_pos_.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // the cell is not written yet
+        return false;
+      } else {
+        // claimed by another consumer
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    *value = std::move(cell->value);
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  // return true if the queue looks empty, the result may be stale when
+  // other threads are pushing or popping concurrently.
+  bool empty() const {
+    return enqueue_pos_.load(std::memory_order_acquire) ==
+           dequeue_pos_.load(std::memory_order_acquire);
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence{0};
+    T value;
+  };
+
+  std::unique_ptr<Cell[]> cells_;
+
+  size_t mask_ = 0;
+
+  // keep the positions on separate cache lines to avoid false sharing
+  alignas(64) std::atomic<size_t> enqueue_pos_{0};
+  alignas(64) std::atomic<size_t> dequeue_pos_{0};
+};
+
+}  // namespace llm
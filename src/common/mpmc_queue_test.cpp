@@ -0,0 +1,75 @@
+#include "mpmc_queue.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace llm {
+
+TEST(MPMCQueueTest, PushPop) {
+  MPMCQueue<int> queue(3);
+  EXPECT_EQ(queue.capacity(), 4);
+  EXPECT_TRUE(queue.empty());
+
+  int value = 0;
+  EXPECT_FALSE(queue.try_pop(&value));
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_TRUE(queue.try_push(i));
+  }
+  // full
+  EXPECT_FALSE(queue.try_push(4));
+  EXPECT_FALSE(queue.empty());
+
+  // fifo order
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_TRUE(queue.try_pop(&value));
+    EXPECT_EQ(value, i);
+  }
+  EXPECT_TRUE(queue.empty());
+
+  // wrap around
+  EXPECT_TRUE(queue.try_push(5));
+  ASSERT_TRUE(queue.try_pop(&value));
+  EXPECT_EQ(value, 5);
+}
+
+TEST(MPMCQueueTest, MultipleProducersConsumers) {
+  const int num_threads = 4;
+  const int num_values = 10000;
+  MPMCQueue<int> queue(64);
+
+  std::atomic<int64_t> sum = 0;
+  std::atomic<int> num_popped = 0;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    // producer
+    threads.emplace_back([&queue, t]() {
+      for (int i = t; i < num_values; i += num_threads) {
+        while (!queue.try_push(i)) {
+          std::this_thread::yield();
+        }
+      }
+    });
+    // consumer
+    threads.emplace_back([&]() {
+      int value = 0;
+      while (num_popped.load() < num_values) {
+        if (queue.try_pop(&value)) {
+          sum += value;
+          ++num_popped;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(num_popped.load(), num_values);
+  EXPECT_EQ(sum.load(), int64_t(num_values) * (num_values - 1) / 2);
+}
+
+}  // namespace llm
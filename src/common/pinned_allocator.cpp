@@ -0,0 +1,273 @@
+#include "pinned_allocator.h"
+
+#include <ATen/cuda/CUDAEvent.h>
+#include <c10/cuda/CUDAFunctions.h>
+#include <c10/cuda/CUDAGuard.h>
+#include <cuda_runtime.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "cpu_affinity.h"
+
+DEFINE_bool(numa_pinned_memory,
+            true,
+            "place the pinned host memory of each gpu, e.g. the staging "
+            "buffers and the host kv cache, on the numa node of the gpu");
+
+namespace llm {
+namespace {
+constexpr int64_t kMinBlockSize = 4096;
+// the blocks of at least the size, e.g. the host kv cache, are rounded to
+// the huge page size instead of a power of 2
+constexpr int64_t kLargeBlockSize = int64_t{64} << 20;
+constexpr int64_t kLargeBlockRounding = int64_t{2} << 20;
+
+#if defined(__linux__)
+// prefer the pages of the range on the numa node, returns false on failure
+bool bind_to_numa_node(void* ptr, int64_t size, int32_t node) {
+  // MPOL_PREFERRED of linux/mempolicy.h, falls back to other nodes when the
+  // node is out of memory
+  constexpr int kMpolPreferred = 1;
+  constexpr size_t kBitsPerWord = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> mask(node / kBitsPerWord + 1, 0);
+  mask[node / kBitsPerWord] |= 1UL << (node % kBitsPerWord);
+  return syscall(SYS_mbind,
+                 ptr,
+                 static_cast<unsigned long>(size),
+                 kMpolPreferred,
+                 mask.data(),
+                 mask.size() * kBitsPerWord + 1,
+                 /*flags=*/0) == 0;
+}
+#endif
+}  // namespace
+
+int32_t device_numa_node(const torch::Device& device) {
+  if (!device.is_cuda()) {
+    return -1;
+  }
+  char pci_bus_id[32] = {0};
+  const auto err =
+      cudaDeviceGetPCIBusId(pci_bus_id, sizeof(pci_bus_id), device.index());
+  return err == cudaSuccess ? pci_device_numa_node(pci_bus_id) : -1;
+}
+
+PinnedAllocator& PinnedAllocator::get(const torch::Device& device) {
+  CHECK(device.is_cuda())
+      << "pinned memory is only allocated for cuda devices, got " << device;
+  const c10::DeviceIndex index =
+      device.has_index() ? device.index() : c10::cuda::current_device();
+  static std::mutex mutex;
+  static std::unordered_map<c10::DeviceIndex, PinnedAllocator*> allocators;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto& allocator = allocators[index];
+  if (allocator == nullptr) {
+    // never freed, the tensors may outlive the static objects
+    allocator = new PinnedAllocator(torch::Device(torch::kCUDA, index));
+  }
+  return *allocator;
+}
+
+PinnedAllocator::PinnedAllocator(const torch::Device& device)
+    : device_(device) {
+  CHECK(device.is_cuda() && device.has_index())
+      << "pinned memory is only allocated for cuda devices, got " << device;
+#if defined(__linux__)
+  if (FLAGS_numa_pinned_memory) {
+    numa_node_ = device_numa_node(device);
+  }
+#endif
+}
+
+PinnedAllocator::~PinnedAllocator() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& [ptr, block] : blocks_) {
+    for (auto& event : block->events) {
+      event.synchronize();
+    }
+    unmap(ptr, block->size);
+  }
+}
+
+int64_t PinnedAllocator::block_size_for(int64_t n_bytes) {
+  if (n_bytes <= kMinBlockSize) {
+    return kMinBlockSize;
+  }
+  if (n_bytes >= kLargeBlockSize) {
+    return (n_bytes + kLargeBlockRounding - 1) / kLargeBlockRounding *
+           kLargeBlockRounding;
+  }
+  int64_t size = kMinBlockSize;
+  while (size < n_bytes) {
+    size *= 2;
+  }
+  return size;
+}
+
+torch::Tensor PinnedAllocator::empty(int64_t n_bytes) {
+  CHECK_GE(n_bytes, 0);
+  const int64_t size = block_size_for(n_bytes);
+  Block* block = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    process_events();
+    auto it = free_blocks_.find(size);
+    if (it != free_blocks_.end() && !it->second.empty()) {
+      block = it->second.back();
+      it->second.pop_back();
+      ++stats_.num_cache_hits;
+      stats_.allocated_bytes += size;
+    }
+  }
+  if (block == nullptr) {
+    // register the memory without holding the lock
+    void* ptr = map(size);
+    auto owned = std::make_unique<Block>();
+    owned->owner = this;
+    owned->ptr = ptr;
+    owned->size = size;
+    block = owned.get();
+    std::lock_guard<std::mutex> lock(mutex_);
+    blocks_.emplace(ptr, std::move(owned));
+    stats_.reserved_bytes += size;
+    stats_.allocated_bytes += size;
+    ++stats_.num_allocs;
+  }
+
+  at::DataPtr data_ptr(
+      block->ptr, block, &PinnedAllocator::release, torch::Device(torch::kCPU));
+  c10::Storage storage(c10::Storage::use_byte_size_t(),
+                       n_bytes,
+                       std::move(data_ptr),
+                       /*allocator=*/nullptr,
+                       /*resizable=*/false);
+  auto tensor = torch::empty({0}, torch::dtype(torch::kUInt8));
+  tensor.set_(storage, /*storage_offset=*/0, {n_bytes}, {1});
+  return tensor;
+}
+
+torch::Tensor PinnedAllocator::empty(torch::IntArrayRef sizes,
+                                     torch::ScalarType dtype) {
+  int64_t numel = 1;
+  for (const int64_t size : sizes) {
+    numel *= size;
+  }
+  return empty(numel * static_cast<int64_t>(c10::elementSize(dtype)))
+      .view(dtype)
+      .view(sizes);
+}
+
+void PinnedAllocator::record_stream(const torch::Tensor& tensor,
+                                    const c10::cuda::CUDAStream& stream) {
+  if (!tensor.defined() || !tensor.has_storage()) {
+    return;
+  }
+  const auto& data_ptr = tensor.storage().data_ptr();
+  if (data_ptr.get_deleter() != &PinnedAllocator::release) {
+    return;
+  }
+  auto* block = static_cast<Block*>(data_ptr.get_context());
+  at::cuda::CUDAEvent event;
+  event.record(stream);
+  std::lock_guard<std::mutex> lock(block->owner->mutex_);
+  block->events.push_back(std::move(event));
+}
+
+void PinnedAllocator::release(void* ctx) {
+  auto* block = static_cast<Block*>(ctx);
+  auto* owner = block->owner;
+  std::lock_guard<std::mutex> lock(owner->mutex_);
+  owner->stats_.allocated_bytes -= block->size;
+  if (block->events.empty()) {
+    owner->free_blocks_[block->size].push_back(block);
+  } else {
+    owner->pending_blocks_.push_back(block);
+  }
+}
+
+void PinnedAllocator::process_events() {
+  size_t n_pending = 0;
+  for (auto* block : pending_blocks_) {
+    auto& events = block->events;
+    while (!events.empty() && events.back().query()) {
+      events.pop_back();
+    }
+    if (events.empty()) {
+      free_blocks_[block->size].push_back(block);
+    } else {
+      pending_blocks_[n_pending++] = block;
+    }
+  }
+  pending_blocks_.resize(n_pending);
+}
+
+void PinnedAllocator::empty_cache() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  process_events();
+  for (auto& [size, blocks] : free_blocks_) {
+    for (auto* block : blocks) {
+      stats_.reserved_bytes -= block->size;
+      void* ptr = block->ptr;
+      unmap(ptr, block->size);
+      blocks_.erase(ptr);
+    }
+  }
+  free_blocks_.clear();
+}
+
+PinnedAllocator::Stats PinnedAllocator::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+void* PinnedAllocator::map(int64_t size) {
+  c10::cuda::CUDAGuard device_guard(device_);
+#if defined(__linux__)
+  void* ptr = mmap(nullptr,
+                   size,
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS,
+                   /*fd=*/-1,
+                   /*offset=*/0);
+  CHECK(ptr != MAP_FAILED) << "Failed to map " << size << " bytes";
+  // the pages are faulted in on the node by the registration
+  if (numa_node_ >= 0 && !bind_to_numa_node(ptr, size, numa_node_)) {
+    LOG(WARNING) << "Failed to place pinned memory on numa node "
+                 << numa_node_;
+  }
+  const auto err = cudaHostRegister(ptr, size, cudaHostRegisterPortable);
+  CHECK(err == cudaSuccess) << "Failed to pin " << size
+                            << " bytes: " << cudaGetErrorString(err);
+#else
+  void* ptr = nullptr;
+  const auto err = cudaHostAlloc(&ptr, size, cudaHostAllocPortable);
+  CHECK(err == cudaSuccess) << "Failed to allocate " << size
+                            << " pinned bytes: " << cudaGetErrorString(err);
+#endif
+  return ptr;
+}
+
+void PinnedAllocator::unmap(void* ptr, int64_t size) {
+#if defined(__linux__)
+  cudaHostUnregister(ptr);
+  munmap(ptr, size);
+#else
+  cudaFreeHost(ptr);
+#endif
+}
+
+}  // namespace llm
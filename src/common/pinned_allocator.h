@@ -0,0 +1,120 @@
+#pragma once
+
+#include <ATen/cuda/CUDAEvent.h>
+#include <c10/cuda/CUDAStream.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace llm {
+
+// the numa node of the cuda device, -1 if unknown
+int32_t device_numa_node(const torch::Device& device);
+
+// Caching allocator of page-locked host memory for the staging buffers of the
+// copies between host and a cuda device, e.g. the model inputs, the sampled
+// outputs, the host kv cache and the weights being loaded. The memory is
+// placed on the numa node of the device before it is registered with cuda,
+// so that the copies neither go through the driver's own staging nor cross
+// the socket interconnect. The blocks are cached in size classes, and a
+// released block is reused once the copies recorded by record_stream() are
+// done, e.g. the ones issued by safe_to_async(). Thread safe.
+class PinnedAllocator final {
+ public:
+  struct Stats {
+    // bytes of the blocks held by tensors
+    int64_t allocated_bytes = 0;
+
+    // bytes of all blocks, in use or cached
+    int64_t reserved_bytes = 0;
+
+    // number of allocations served by the cached blocks
+    int64_t num_cache_hits = 0;
+
+    // number of blocks allocated from the system
+    int64_t num_allocs = 0;
+  };
+
+  // the allocator of the cuda device, the current one if without index.
+  // created on first use and kept for the lifetime of the process.
+  static PinnedAllocator& get(const torch::Device& device);
+
+  // the tensors allocated should be released before the allocator.
+  explicit PinnedAllocator(const torch::Device& device);
+
+  ~PinnedAllocator();
+
+  // disable copy, move and assign
+  PinnedAllocator(const PinnedAllocator&) = delete;
+  PinnedAllocator(PinnedAllocator&&) = delete;
+  PinnedAllocator& operator=(const PinnedAllocator&) = delete;
+  PinnedAllocator& operator=(PinnedAllocator&&) = delete;
+
+  // allocate an uninitialized 1-D uint8 tensor of n_bytes
+  torch::Tensor empty(int64_t n_bytes);
+
+  // allocate an uninitialized contiguous tensor
+  torch::Tensor empty(torch::IntArrayRef sizes, torch::ScalarType dtype);
+
+  // the block of the tensor is not reused until the work enqueued on the
+  // stream so far is done, call it after issuing an asynchronous copy from
+  // or to the tensor. no-op for the tensors of other allocators.
+  static void record_stream(const torch::Tensor& tensor,
+                            const c10::cuda::CUDAStream& stream);
+
+  // free the cached blocks not in use
+  void empty_cache();
+
+  Stats stats() const;
+
+  // the numa node the memory is placed on, -1 if not placed
+  int32_t numa_node() const { return numa_node_; }
+
+  const torch::Device& device() const { return device_; }
+
+  // the size of the block for an allocation of n_bytes. the small sizes are
+  // rounded up to a power of 2, the large ones to a multiple of 2MB.
+  static int64_t block_size_for(int64_t n_bytes);
+
+ private:
+  struct Block {
+    PinnedAllocator* owner = nullptr;
+    void* ptr = nullptr;
+    int64_t size = 0;
+    // recorded after the copies in flight, see record_stream()
+    std::vector<at::cuda::CUDAEvent> events;
+  };
+
+  // the deleter of the data pointers of the tensors
+  static void release(void* ctx);
+
+  // move the released blocks whose copies are done to the free lists
+  void process_events();
+
+  // allocate and free the page-locked memory of a block
+  void* map(int64_t size);
+  void unmap(void* ptr, int64_t size);
+
+  torch::Device device_;
+
+  int32_t numa_node_ = -1;
+
+  mutable std::mutex mutex_;
+
+  // all blocks, in use or cached
+  std::unordered_map<void*, std::unique_ptr<Block>> blocks_;
+
+  // block size -> the cached blocks ready for reuse
+  std::unordered_map<int64_t, std::vector<Block*>> free_blocks_;
+
+  // the released blocks waiting for their copies
+  std::vector<Block*> pending_blocks_;
+
+  Stats stats_;
+};
+
+}  // namespace llm
@@ -0,0 +1,56 @@
+#include "pinned_allocator.h"
+
+#include <c10/cuda/CUDAStream.h>
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+namespace llm {
+
+TEST(PinnedAllocatorTest, BlockSize) {
+  EXPECT_EQ(PinnedAllocator::block_size_for(0), 4096);
+  EXPECT_EQ(PinnedAllocator::block_size_for(4097), 8192);
+  EXPECT_EQ(PinnedAllocator::block_size_for(3 << 20), 4 << 20);
+  // large blocks are rounded to a multiple of 2MB
+  EXPECT_EQ(PinnedAllocator::block_size_for((64 << 20) + 1), 66 << 20);
+}
+
+TEST(PinnedAllocatorTest, Reuse) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  PinnedAllocator allocator(torch::Device(torch::kCUDA, 0));
+  auto tensor = allocator.empty({16, 8}, torch::kFloat32);
+  EXPECT_EQ(tensor.sizes(), torch::IntArrayRef({16, 8}));
+  EXPECT_TRUE(tensor.is_pinned());
+  const void* ptr = tensor.data_ptr();
+  auto stats = allocator.stats();
+  EXPECT_EQ(stats.num_allocs, 1);
+  EXPECT_EQ(stats.allocated_bytes, 4096);
+
+  // reused by the allocations of the same size class once released
+  tensor = torch::Tensor();
+  EXPECT_EQ(allocator.stats().allocated_bytes, 0);
+  tensor = allocator.empty(1000);
+  EXPECT_EQ(tensor.data_ptr(), ptr);
+  EXPECT_EQ(allocator.stats().num_cache_hits, 1);
+
+  // not reused until the recorded copy is done
+  auto stream = c10::cuda::getStreamFromPool(/*isHighPriority=*/false, 0);
+  auto device_tensor =
+      torch::empty({1000}, torch::dtype(torch::kUInt8).device(torch::kCUDA));
+  {
+    c10::cuda::CUDAStreamGuard stream_guard(stream);
+    device_tensor.copy_(tensor, /*non_blocking=*/true);
+    PinnedAllocator::record_stream(tensor, stream);
+  }
+  tensor = torch::Tensor();
+  stream.synchronize();
+  tensor = allocator.empty(4096);
+  EXPECT_EQ(tensor.data_ptr(), ptr);
+
+  tensor = torch::Tensor();
+  allocator.empty_cache();
+  EXPECT_EQ(allocator.stats().reserved_bytes, 0);
+}
+
+}  // namespace llm
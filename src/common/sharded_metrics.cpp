@@ -0,0 +1,114 @@
+#include "sharded_metrics.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace llm {
+namespace {
+
+uint64_t to_bits(double value) {
+  uint64_t bits = 0;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+double from_bits(uint64_t bits) {
+  double value = 0;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+}  // namespace
+
+size_t metric_shard_index() {
+  static std::atomic<size_t> next_index{0};
+  thread_local const size_t index =
+      next_index.fetch_add(1, std::memory_order_relaxed) % kNumMetricShards;
+  return index;
+}
+
+void ShardedCounter::Increment(double value) {
+  // uncontended unless more threads than shards
+  auto& shard_value = shards_[metric_shard_index()].value;
+  double current = shard_value.load(std::memory_order_relaxed);
+  while (!shard_value.compare_exchange_weak(
+      current, current + value, std::memory_order_relaxed)) {
+  }
+}
+
+double ShardedCounter::Value() const {
+  double value = 0.0;
+  for (const auto& shard : shards_) {
+    value += shard.value.load(std::memory_order_relaxed);
+  }
+  return value;
+}
+
+void ShardedCounter::Collect(prometheus::ClientMetric* metric) const {
+  metric->counter.value = Value();
+}
+
+ShardedHistogram::ShardedHistogram(BucketBoundaries bucket_boundaries)
+    : bucket_boundaries_(std::move(bucket_boundaries)) {
+  CHECK(std::is_sorted(bucket_boundaries_.begin(), bucket_boundaries_.end()))
+      << "Bucket boundaries should be in ascending order";
+  // the sum, the buckets and the +Inf bucket
+  const size_t n_words = bucket_boundaries_.size() + 2;
+  lines_per_shard_ = (n_words + 7) / 8;
+  lines_ = std::make_unique<CacheLine[]>(lines_per_shard_ * kNumMetricShards);
+  for (size_t i = 0; i < lines_per_shard_ * kNumMetricShards; ++i) {
+    for (auto& word : lines_[i].words) {
+      word.store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+void ShardedHistogram::Observe(double value) {
+  const size_t shard = metric_shard_index();
+  // the first bucket with upper bound >= value
+  const size_t bucket =
+      std::lower_bound(
+          bucket_boundaries_.begin(), bucket_boundaries_.end(), value) -
+      bucket_boundaries_.begin();
+  word(shard, bucket + 1).fetch_add(1, std::memory_order_relaxed);
+
+  auto& sum = word(shard, 0);
+  uint64_t current = sum.load(std::memory_order_relaxed);
+  while (!sum.compare_exchange_weak(current,
+                                    to_bits(from_bits(current) + value),
+                                    std::memory_order_relaxed)) {
+  }
+}
+
+void ShardedHistogram::Collect(prometheus::ClientMetric* metric) const {
+  const size_t n_buckets = bucket_boundaries_.size() + 1;
+  std::vector<uint64_t> counts(n_buckets, 0);
+  double sum = 0.0;
+  for (size_t shard = 0; shard < kNumMetricShards; ++shard) {
+    sum += from_bits(word(shard, 0).load(std::memory_order_relaxed));
+    for (size_t i = 0; i < n_buckets; ++i) {
+      counts[i] += word(shard, i + 1).load(std::memory_order_relaxed);
+    }
+  }
+
+  auto& histogram = metric->histogram;
+  histogram.bucket.clear();
+  histogram.bucket.reserve(n_buckets);
+  uint64_t cumulative_count = 0;
+  for (size_t i = 0; i < n_buckets; ++i) {
+    cumulative_count += counts[i];
+    prometheus::ClientMetric::Bucket bucket;
+    bucket.cumulative_count = cumulative_count;
+    bucket.upper_bound = i < bucket_boundaries_.size()
+                             ? bucket_boundaries_[i]
+                             : std::numeric_limits<double>::infinity();
+    histogram.bucket.push_back(bucket);
+  }
+  histogram.sample_count = cumulative_count;
+  histogram.sample_sum = sum;
+}
+
+}  // namespace llm
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <prometheus/client_metric.h>
+#include <prometheus/labels.h>
+#include <prometheus/metric_family.h>
+#include <prometheus/metric_type.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llm {
+
+// number of shards of each sharded metric. threads are assigned to shards
+// round robin, so that up to kNumMetricShards threads never share a shard.
+inline constexpr size_t kNumMetricShards = 16;
+
+// the shard of the calling thread
+size_t metric_shard_index();
+
+// A counter sharded by threads: increments only touch the cache line of the
+// calling thread's shard, and the shards are summed up when collected. Unlike
+// prometheus::Counter, hot paths on different threads never contend.
+class ShardedCounter final {
+ public:
+  ShardedCounter() = default;
+
+  void Increment(double value = 1.0);
+
+  // the sum of all shards
+  double Value() const;
+
+  void Collect(prometheus::ClientMetric* metric) const;
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<double> value{0.0};
+  };
+  Shard shards_[kNumMetricShards];
+};
+
+// A histogram sharded by threads, see ShardedCounter. The counts of the
+// buckets are not cumulative until collected.
+class ShardedHistogram final {
+ public:
+  using BucketBoundaries = std::vector<double>;
+
+  explicit ShardedHistogram(BucketBoundaries bucket_boundaries);
+
+  void Observe(double value);
+
+  void Collect(prometheus::ClientMetric* metric) const;
+
+ private:
+  struct alignas(64) CacheLine {
+    std::atomic<uint64_t> words[8];
+  };
+
+  // the words of a shard: the bits of the sum as a double followed by the
+  // counts of the buckets, the last bucket for +Inf.
+  std::atomic<uint64_t>& word(size_t shard, size_t idx) const {
+    return lines_[shard * lines_per_shard_ + idx / 8].words[idx % 8];
+  }
+
+  BucketBoundaries bucket_boundaries_;
+
+  // each shard starts at its own cache line
+  size_t lines_per_shard_ = 0;
+  std::unique_ptr<CacheLine[]> lines_;
+};
+
+// A family of sharded metrics with the same name and different labels,
+// mirroring prometheus::Family.
+template <typename T>
+class ShardedFamily final {
+ public:
+  ShardedFamily(std::string name,
+                std::string help,
+                prometheus::MetricType type)
+      : name_(std::move(name)), help_(std::move(help)), type_(type) {}
+
+  // add a metric with the labels, or return the existing one
+  template <typename... Args>
+  T& Add(const prometheus::Labels& labels, Args&&... args) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& metric = metrics_[labels];
+    if (metric == nullptr) {
+      metric = std::make_unique<T>(std::forward<Args>(args)...);
+    }
+    return *metric;
+  }
+
+  prometheus::MetricFamily Collect() const {
+    prometheus::MetricFamily family;
+    family.name = name_;
+    family.help = help_;
+    family.type = type_;
+    std::lock_guard<std::mutex> lock(mutex_);
+    family.metric.reserve(metrics_.size());
+    for (const auto& [labels, metric] : metrics_) {
+      prometheus::ClientMetric client_metric;
+      for (const auto& [name, value] : labels) {
+        client_metric.label.push_back({name, value});
+      }
+      metric->Collect(&client_metric);
+      family.metric.push_back(std::move(client_metric));
+    }
+    return family;
+  }
+
+ private:
+  std::string name_;
+  std::string help_;
+  prometheus::MetricType type_;
+
+  mutable std::mutex mutex_;
+  std::map<prometheus::Labels, std::unique_ptr<T>> metrics_;
+};
+
+}  // namespace llm
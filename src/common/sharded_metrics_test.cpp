@@ -0,0 +1,79 @@
+#include "sharded_metrics.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <thread>
+#include <vector>
+
+namespace llm {
+
+TEST(ShardedMetricsTest, Counter) {
+  ShardedCounter counter;
+  constexpr int kNumThreads = 2 * kNumMetricShards;
+  constexpr int kNumIncrements = 10000;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&counter]() {
+      for (int j = 0; j < kNumIncrements; ++j) {
+        counter.Increment();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(counter.Value(), kNumThreads * kNumIncrements);
+
+  prometheus::ClientMetric metric;
+  counter.Collect(&metric);
+  EXPECT_EQ(metric.counter.value, kNumThreads * kNumIncrements);
+}
+
+TEST(ShardedMetricsTest, Histogram) {
+  ShardedHistogram histogram({1.0, 2.0, 5.0});
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&histogram]() {
+      // one value for each bucket, values on boundaries are inclusive
+      for (double value : {0.5, 1.0, 2.0, 3.0, 10.0}) {
+        histogram.Observe(value);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  prometheus::ClientMetric metric;
+  histogram.Collect(&metric);
+  const auto& result = metric.histogram;
+  EXPECT_EQ(result.sample_count, 20);
+  EXPECT_DOUBLE_EQ(result.sample_sum, 4 * 16.5);
+  ASSERT_EQ(result.bucket.size(), 4);
+  const std::vector<uint64_t> cumulative_counts = {8, 12, 16, 20};
+  for (size_t i = 0; i < result.bucket.size(); ++i) {
+    EXPECT_EQ(result.bucket[i].cumulative_count, cumulative_counts[i]);
+  }
+  EXPECT_EQ(result.bucket[2].upper_bound, 5.0);
+  EXPECT_TRUE(std::isinf(result.bucket[3].upper_bound));
+}
+
+TEST(ShardedMetricsTest, Family) {
+  ShardedFamily<ShardedCounter> family(
+      "requests_total", "Total requests", prometheus::MetricType::Counter);
+  auto& a = family.Add({{"type", "a"}});
+  auto& b = family.Add({{"type", "b"}});
+  EXPECT_EQ(&family.Add({{"type", "a"}}), &a);
+  a.Increment(2);
+  b.Increment();
+
+  const auto collected = family.Collect();
+  EXPECT_EQ(collected.name, "requests_total");
+  ASSERT_EQ(collected.metric.size(), 2);
+  EXPECT_EQ(collected.metric[0].label[0].value, "a");
+  EXPECT_EQ(collected.metric[0].counter.value, 2);
+  EXPECT_EQ(collected.metric[1].counter.value, 1);
+}
+
+}  // namespace llm
@@ -0,0 +1,102 @@
+#include "sharded_threadpool.h"
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <thread>
+
+#include "cpu_affinity.h"
+
+namespace llm {
+namespace {
+// number of times to check the queue before sleeping, tasks tend to arrive in
+// bursts, e.g. once per scheduler step.
+constexpr int kSpinIters = 64;
+}  // namespace
+
+ShardedThreadPool::ShardedThreadPool(size_t num_shards,
+                                     size_t queue_capacity) {
+  CHECK_GT(num_shards, 0);
+  // one slot of the queue is always left empty
+  CHECK_GT(queue_capacity, 1);
+  shards_.reserve(num_shards);
+  for (size_t i = 0; i < num_shards; ++i) {
+    shards_.push_back(std::make_unique<Shard>(queue_capacity));
+  }
+  for (auto& shard : shards_) {
+    shard->thread = std::thread([this, shard = shard.get()]() {
+      internal_loop(shard);
+    });
+  }
+}
+
+ShardedThreadPool::~ShardedThreadPool() {
+  // push nullptr to the queues to signal threads to exit
+  for (auto& shard : shards_) {
+    push(shard.get(), nullptr);
+  }
+  // wait for all threads to finish
+  for (auto& shard : shards_) {
+    shard->thread.join();
+  }
+}
+
+bool ShardedThreadPool::set_affinity(const std::vector<int32_t>& cpus) {
+  bool ok = true;
+  for (auto& shard : shards_) {
+    ok = set_thread_affinity(shard->thread, cpus) && ok;
+  }
+  return ok;
+}
+
+void ShardedThreadPool::schedule(size_t shard, Runnable runnable) {
+  if (runnable == nullptr) {
+    return;
+  }
+  CHECK_LT(shard, shards_.size());
+  push(shards_[shard].get(), std::move(runnable));
+}
+
+void ShardedThreadPool::push(Shard* shard, Runnable runnable) {
+  // wait for the thread to catch up if the queue is full
+  while (!shard->queue.write(std::move(runnable))) {
+    std::this_thread::yield();
+  }
+  // pairs with the fence in internal_loop: either the thread sees the new
+  // task before sleeping, or it is seen waiting here and gets woken up.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (shard->waiting.load(std::memory_order_relaxed)) {
+    absl::MutexLock lock(&shard->mutex);
+    shard->cv.Signal();
+  }
+}
+
+void ShardedThreadPool::internal_loop(Shard* shard) {
+  int spins = 0;
+  while (true) {
+    Runnable runnable;
+    if (!shard->queue.read(runnable)) {
+      if (++spins < kSpinIters) {
+        std::this_thread::yield();
+        continue;
+      }
+      spins = 0;
+      absl::MutexLock lock(&shard->mutex);
+      shard->waiting.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      while (shard->queue.isEmpty()) {
+        shard->cv.Wait(&shard->mutex);
+      }
+      shard->waiting.store(false, std::memory_order_relaxed);
+      continue;
+    }
+    spins = 0;
+    if (runnable == nullptr) {
+      // nullptr is a signal to exit
+      break;
+    }
+    runnable();
+  }
+}
+
+}  // namespace llm
@@ -0,0 +1,66 @@
+#pragma once
+#include <absl/synchronization/mutex.h>
+#include <folly/Function.h>
+#include <folly/ProducerConsumerQueue.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace llm {
+
+// A pool of threads, each running the tasks of its own shard in the order
+// they are scheduled. Tasks are handed off to the shards through lock-free
+// single producer single consumer queues, so all tasks must be scheduled from
+// the same thread.
+class ShardedThreadPool final {
+ public:
+  // a runnable is an object intended to be executed by the threadpool
+  // it must be invokable with no arguments and return void.
+  using Runnable = folly::Function<void()>;
+
+  // queue_capacity: max number of pending tasks of each shard, schedule()
+  // waits for the shard to catch up when its queue is full.
+  explicit ShardedThreadPool(size_t num_shards, size_t queue_capacity = 4096);
+
+  // disable copy/move constructor and assignment
+  ShardedThreadPool(const ShardedThreadPool&) = delete;
+  ShardedThreadPool& operator=(const ShardedThreadPool&) = delete;
+  ShardedThreadPool(ShardedThreadPool&&) = delete;
+  ShardedThreadPool& operator=(ShardedThreadPool&&) = delete;
+
+  // destructor
+  ~ShardedThreadPool();
+
+  // schedule a runnable to be executed by the thread of the shard
+  void schedule(size_t shard, Runnable runnable);
+
+  size_t num_shards() const { return shards_.size(); }
+
+  // restrict all threads to run on the cpus, see set_thread_affinity
+  bool set_affinity(const std::vector<int32_t>& cpus);
+
+ private:
+  struct Shard {
+    explicit Shard(size_t capacity) : queue(capacity) {}
+
+    folly::ProducerConsumerQueue<Runnable> queue;
+
+    // whether the thread is sleeping or about to sleep on the condvar
+    std::atomic<bool> waiting{false};
+    absl::Mutex mutex;
+    absl::CondVar cv;
+
+    std::thread thread;
+  };
+
+  void push(Shard* shard, Runnable runnable);
+
+  void internal_loop(Shard* shard);
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+}  // namespace llm
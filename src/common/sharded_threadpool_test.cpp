@@ -0,0 +1,49 @@
+#include "sharded_threadpool.h"
+
+#include <absl/synchronization/blocking_counter.h>
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+namespace llm {
+
+TEST(ShardedThreadPoolTest, ScheduleEmptyTask) {
+  ShardedThreadPool threadpool(2);
+  threadpool.schedule(0, nullptr);
+}
+
+TEST(ShardedThreadPoolTest, TasksRunInOrderPerShard) {
+  const size_t num_shards = 3;
+  const size_t num_tasks = 1000;
+  // a small queue to exercise waiting on full queues
+  ShardedThreadPool threadpool(num_shards, /*queue_capacity=*/8);
+  EXPECT_EQ(threadpool.num_shards(), num_shards);
+
+  std::vector<std::vector<size_t>> completed_tasks(num_shards);
+  std::vector<std::thread::id> thread_ids(num_shards);
+  absl::BlockingCounter counter(num_tasks);
+  for (size_t i = 0; i < num_tasks; ++i) {
+    const size_t shard = i % num_shards;
+    threadpool.schedule(shard, [&, shard, i]() {
+      if (completed_tasks[shard].empty()) {
+        thread_ids[shard] = std::this_thread::get_id();
+      }
+      // each shard is run by a single thread
+      EXPECT_EQ(thread_ids[shard], std::this_thread::get_id());
+      completed_tasks[shard].push_back(i);
+      counter.DecrementCount();
+    });
+  }
+  counter.Wait();
+
+  for (size_t shard = 0; shard < num_shards; ++shard) {
+    const auto& tasks = completed_tasks[shard];
+    ASSERT_EQ(tasks.size(), (num_tasks + num_shards - 1 - shard) / num_shards);
+    for (size_t j = 0; j < tasks.size(); ++j) {
+      EXPECT_EQ(tasks[j], j * num_shards + shard);
+    }
+  }
+}
+
+}  // namespace llm
@@ -1,11 +1,16 @@
 #pragma once
 
 #include <c10/core/TensorOptions.h>
+#include <c10/cuda/CUDAStream.h>
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include <cstdint>
+#include <utility>
 #include <vector>
 
+#include "pinned_allocator.h"
+
 namespace llm {
 
 template <typename T>
@@ -26,9 +31,96 @@ inline torch::Tensor create_2d_tensor(const std::vector<std::vector<T>>& vec,
   return tensor;
 };
 
+// Maps the host tensors within a host buffer to the views of its copy on
+// device while the guard is alive on the thread, so that safe_to_async()
+// doesn't copy them one by one, e.g. the model inputs of a step uploaded
+// once and broadcast to the tensor parallel workers.
+class DeviceBufferGuard final {
+ public:
+  // no-op if either buffer is undefined. the buffers are 1-D uint8 tensors
+  // of the same size.
+  DeviceBufferGuard(torch::Tensor host_buffer, torch::Tensor device_buffer)
+      : prev_(current()) {
+    current() = {std::move(host_buffer), std::move(device_buffer)};
+  }
+
+  ~DeviceBufferGuard() { current() = std::move(prev_); }
+
+  DeviceBufferGuard(const DeviceBufferGuard&) = delete;
+  DeviceBufferGuard& operator=(const DeviceBufferGuard&) = delete;
+
+  // the view of the device buffer with the layout of the host tensor,
+  // undefined if the tensor is not within the host buffer or the buffer is
+  // not on the device.
+  static torch::Tensor map(const torch::Tensor& t,
+                           const torch::Device& device) {
+    const auto& buffers = current();
+    if (!buffers.host.defined() || !buffers.device.defined() ||
+        buffers.device.device() != device || !t.device().is_cpu() ||
+        t.numel() == 0) {
+      return {};
+    }
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    const auto base = reinterpret_cast<uintptr_t>(buffers.host.data_ptr());
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    const auto data = reinterpret_cast<uintptr_t>(t.data_ptr());
+    const int64_t elem_size = t.element_size();
+    int64_t max_offset = 0;
+    for (int64_t i = 0; i < t.dim(); ++i) {
+      if (t.stride(i) < 0) {
+        return {};
+      }
+      max_offset += (t.size(i) - 1) * t.stride(i);
+    }
+    if (data < base || (data - base) % elem_size != 0 ||
+        data - base + (max_offset + 1) * elem_size > buffers.host.numel()) {
+      return {};
+    }
+    const auto offset = static_cast<int64_t>((data - base) / elem_size);
+    return buffers.device.view(t.scalar_type())
+        .as_strided(t.sizes(), t.strides(), offset);
+  }
+
+ private:
+  struct Buffers {
+    torch::Tensor host;
+    torch::Tensor device;
+  };
+
+  static Buffers& current() {
+    thread_local Buffers buffers;
+    return buffers;
+  }
+
+  // the buffers of the enclosing guard
+  Buffers prev_;
+};
+
 inline torch::Tensor safe_to(const torch::Tensor& t,
                              const torch::TensorOptions& options) {
   return t.defined() ? t.to(options) : t;
 };
 
+// copy the tensor without blocking the host. host tensors are staged into
+// pinned memory first so that the copy to cuda device is truly asynchronous,
+// and the pinned blocks of PinnedAllocator are kept until the copy is done.
+inline torch::Tensor safe_to_async(const torch::Tensor& t,
+                                   const torch::TensorOptions& options) {
+  if (!t.defined()) {
+    return t;
+  }
+  if (auto mapped = DeviceBufferGuard::map(t, options.device());
+      mapped.defined()) {
+    return mapped.to(options, /*non_blocking=*/true);
+  }
+  if (t.device().is_cpu() && options.device().is_cuda()) {
+    const auto pinned = t.is_pinned() ? t : t.pin_memory();
+    auto copied = pinned.to(options, /*non_blocking=*/true);
+    PinnedAllocator::record_stream(
+        pinned, c10::cuda::getCurrentCUDAStream(options.device().index()));
+    return copied;
+  }
+  return t.to(options, /*non_blocking=*/true);
+};
+
 }  // namespace llm
\ No newline at end of file
@@ -1,20 +1,48 @@
 #include "threadpool.h"
 
+#include <glog/logging.h>
+
+#include <atomic>
 #include <thread>
 
-#include "concurrent_queue.h"
+#include "cpu_affinity.h"
+#include "mpmc_queue.h"
 
 namespace llm {
-ThreadPool::ThreadPool(size_t num_threads) {
+namespace {
+// number of times to look for runnables before parking
+constexpr int kSpinIters = 64;
+
+// the threadpool and the index of the current thread
+thread_local const ThreadPool* t_pool = nullptr;
+thread_local size_t t_index = 0;
+}  // namespace
+
+ThreadPool::ThreadPool(size_t num_threads, size_t queue_capacity) {
+  CHECK_GT(num_threads, 0);
+  queues_.reserve(num_threads);
+  for (size_t i = 0; i < num_threads; ++i) {
+    queues_.push_back(std::make_unique<MPMCQueue<Runnable>>(queue_capacity));
+  }
   for (size_t i = 0; i < num_threads; ++i) {
-    threads_.emplace_back([this]() { internal_loop(); });
+    threads_.emplace_back([this, i]() { internal_loop(i); });
   }
 }
 
+bool ThreadPool::set_affinity(const std::vector<int32_t>& cpus) {
+  bool ok = true;
+  for (auto& thread : threads_) {
+    ok = set_thread_affinity(thread, cpus) && ok;
+  }
+  return ok;
+}
+
 ThreadPool::~ThreadPool() {
-  // push nullptr to the queue to signal threads to exit
-  for (size_t i = 0; i < threads_.size(); ++i) {
-    queue_.push(nullptr);
+  // signal threads to exit once all queues are drained
+  stop_.store(true, std::memory_order_release);
+  {
+    absl::MutexLock lock(&mutex_);
+    cv_.SignalAll();
   }
   // wait for all threads to finish
   for (auto& thread : threads_) {
@@ -22,22 +50,87 @@ ThreadPool::~ThreadPool() {
   }
 }
 
+size_t ThreadPool::current_thread_index() { return t_index; }
+
 // schedule a runnable to be executed
 void ThreadPool::schedule(Runnable runnable) {
   if (runnable == nullptr) {
     return;
   }
-  queue_.push(std::move(runnable));
+  // runnables scheduled from a thread of the pool go to its own queue
+  size_t index = t_pool == this
+                     ? t_index
+                     : next_queue_.fetch_add(1, std::memory_order_relaxed);
+  for (size_t i = 0;; ++i) {
+    if (queues_[(index + i) % queues_.size()]->try_push(std::move(runnable))) {
+      break;
+    }
+    // wait for the threads to catch up if all queues are full
+    if ((i + 1) % queues_.size() == 0) {
+      std::this_thread::yield();
+    }
+  }
+
+  // pairs with the fence in internal_loop: either the parking thread sees
+  // the new runnable, or it is seen waiting here and gets woken up.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (num_waiting_.load(std::memory_order_relaxed) > 0) {
+    absl::MutexLock lock(&mutex_);
+    cv_.Signal();
+  }
+}
+
+bool ThreadPool::try_get(size_t index, Runnable* runnable) {
+  for (size_t i = 0; i < queues_.size(); ++i) {
+    if (queues_[(index + i) % queues_.size()]->try_pop(runnable)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ThreadPool::has_pending() const {
+  for (const auto& queue : queues_) {
+    if (!queue->empty()) {
+      return true;
+    }
+  }
+  return false;
 }
 
-void ThreadPool::internal_loop() {
+void ThreadPool::internal_loop(size_t index) {
+  t_pool = this;
+  t_index = index;
+
+  int spins = 0;
   while (true) {
-    Runnable runnable = queue_.pop();
-    if (runnable == nullptr) {
-      // nullptr is a signal to exit
+    Runnable runnable;
+    if (try_get(index, &runnable)) {
+      spins = 0;
+      runnable();
+      continue;
+    }
+    if (stop_.load(std::memory_order_acquire)) {
+      // all runnables are scheduled before stopping, look once more
+      if (try_get(index, &runnable)) {
+        runnable();
+        continue;
+      }
       break;
     }
-    runnable();
+    if (++spins < kSpinIters) {
+      std::this_thread::yield();
+      continue;
+    }
+    spins = 0;
+
+    absl::MutexLock lock(&mutex_);
+    num_waiting_.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!has_pending() && !stop_.load(std::memory_order_relaxed)) {
+      cv_.Wait(&mutex_);
+    }
+    num_waiting_.fetch_sub(1, std::memory_order_relaxed);
   }
 }
 
@@ -1,11 +1,21 @@
 #pragma once
+#include <absl/synchronization/mutex.h>
 #include <folly/Function.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
 #include <thread>
+#include <vector>
 
-#include "concurrent_queue.h"
+#include "mpmc_queue.h"
 
 namespace llm {
 
+// A pool of threads running scheduled runnables. Each thread has its own
+// lock-free queue, runnables are spread over the queues round robin, and idle
+// threads steal from the queues of the others. Threads spin for a while
+// before parking when there is nothing to run.
 class ThreadPool final {
  public:
   // a runnable is an object intended to be executed by the threadpool
@@ -21,19 +31,49 @@ class ThreadPool final {
   ThreadPool(ThreadPool&&) = delete;
   ThreadPool& operator=(ThreadPool&&) = delete;
 
-  explicit ThreadPool(size_t num_threads);
+  // queue_capacity: max number of pending runnables of each thread, schedule
+  // waits for the threads to catch up when all queues are full.
+  explicit ThreadPool(size_t num_threads, size_t queue_capacity = 4096);
 
-  // destructor
+  // destructor, runs all scheduled runnables before returning
   ~ThreadPool();
 
   // schedule a runnable to be executed
   void schedule(Runnable runnable);
 
+  size_t size() const { return threads_.size(); }
+
+  // restrict all threads to run on the cpus, see set_thread_affinity
+  bool set_affinity(const std::vector<int32_t>& cpus);
+
+  // the index of the calling thread in its threadpool, in [0, size())
+  // only valid when called from a runnable.
+  static size_t current_thread_index();
+
+  // whether any runnable is waiting in the queues
+  bool has_pending() const;
+
  private:
-  void internal_loop();
+  void internal_loop(size_t index);
+
+  // get a runnable from the queue of the thread, or steal one from the others
+  bool try_get(size_t index, Runnable* runnable);
 
   std::vector<std::thread> threads_;
-  ConcurrentQueue<Runnable> queue_;
+
+  // queue of each thread
+  std::vector<std::unique_ptr<MPMCQueue<Runnable>>> queues_;
+
+  // the queue to push the next runnable scheduled from outside of the pool
+  std::atomic<size_t> next_queue_{0};
+
+  // number of threads parking or about to park
+  std::atomic<size_t> num_waiting_{0};
+
+  std::atomic<bool> stop_{false};
+
+  absl::Mutex mutex_;
+  absl::CondVar cv_;
 };
 
 }  // namespace llm
@@ -72,4 +72,43 @@ TEST(ThreadPoolTest, MultipleThreads) {
   EXPECT_EQ(counter, 10);
 }
 
+TEST(ThreadPoolTest, ThreadIndex) {
+  const size_t num_threads = 4;
+  ThreadPool threadpool(num_threads);
+  EXPECT_EQ(threadpool.size(), num_threads);
+
+  const int num_tasks = 100;
+  std::atomic_int counter = 0;
+  std::atomic_bool valid = true;
+  absl::Notification notification;
+  for (int i = 0; i < num_tasks; ++i) {
+    threadpool.schedule([&]() {
+      if (ThreadPool::current_thread_index() >= num_threads) {
+        valid = false;
+      }
+      // schedule a nested task from a thread of the pool
+      threadpool.schedule([&]() {
+        if (++counter == num_tasks) {
+          notification.Notify();
+        }
+      });
+    });
+  }
+
+  EXPECT_TRUE(notification.WaitForNotificationWithTimeout(absl::Seconds(10)));
+  EXPECT_TRUE(valid);
+  EXPECT_EQ(counter, num_tasks);
+}
+
+TEST(ThreadPoolTest, RunPendingTasksOnDestruction) {
+  std::atomic_int counter = 0;
+  {
+    ThreadPool threadpool(2, /*queue_capacity=*/4);
+    for (int i = 0; i < 100; ++i) {
+      threadpool.schedule([&counter]() { counter++; });
+    }
+  }
+  EXPECT_EQ(counter, 100);
+}
+
 }  // namespace llm
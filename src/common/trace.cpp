@@ -0,0 +1,122 @@
+#include "trace.h"
+
+#include <absl/time/clock.h>
+#include <gflags/gflags.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <nlohmann/json.hpp>
+
+#if __has_include(<nvtx3/nvToolsExt.h>)
+#include <nvtx3/nvToolsExt.h>
+#define LLM_HAS_NVTX 1
+#endif
+
+DEFINE_bool(enable_nvtx,
+            false,
+            "Push nvtx ranges for engine steps and decoder layers.");
+
+DEFINE_int32(trace_buffer_size,
+             16384,
+             "Number of recent step events kept in memory and dumped as a "
+             "chrome trace by the /trace endpoint, 0 to disable.");
+
+namespace llm {
+
+Tracer::Tracer(int32_t capacity) : events_(std::max(capacity, 0)) {}
+
+uint32_t Tracer::thread_id() {
+  static std::atomic<uint32_t> next_id{0};
+  thread_local const uint32_t id = next_id.fetch_add(1);
+  return id;
+}
+
+void Tracer::record(const TraceEvent& event) {
+  if (events_.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  events_[num_recorded_ % events_.size()] = event;
+  ++num_recorded_;
+}
+
+std::vector<TraceEvent> Tracer::events() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<TraceEvent> events;
+  if (num_recorded_ <= events_.size()) {
+    events.assign(events_.begin(), events_.begin() + num_recorded_);
+    return events;
+  }
+  // the oldest event is at the next slot to overwrite
+  const size_t head = num_recorded_ % events_.size();
+  events.reserve(events_.size());
+  events.insert(events.end(), events_.begin() + head, events_.end());
+  events.insert(events.end(), events_.begin(), events_.begin() + head);
+  return events;
+}
+
+std::string Tracer::to_chrome_trace() const {
+  const auto pid = static_cast<int64_t>(::getpid());
+  auto trace_events = nlohmann::json::array();
+  for (const auto& event : events()) {
+    nlohmann::json json = {{"name", event.name},
+                           {"cat", "engine"},
+                           {"ph", "X"},
+                           {"ts", event.start_us},
+                           {"dur", event.duration_us},
+                           {"pid", pid},
+                           {"tid", event.tid}};
+    if (event.arg_name != nullptr) {
+      json["args"] = {{event.arg_name, event.arg_value}};
+    }
+    trace_events.push_back(std::move(json));
+  }
+  nlohmann::json trace = {{"traceEvents", std::move(trace_events)},
+                          {"displayTimeUnit", "ms"}};
+  return trace.dump();
+}
+
+NvtxScope::NvtxScope(const char* name) {
+#ifdef LLM_HAS_NVTX
+  if (FLAGS_enable_nvtx) {
+    nvtxRangePushA(name);
+    pushed_ = true;
+  }
+#endif
+}
+
+void NvtxScope::end() {
+#ifdef LLM_HAS_NVTX
+  if (pushed_) {
+    nvtxRangePop();
+  }
+#endif
+  pushed_ = false;
+}
+
+TraceScope::TraceScope(const char* name) : nvtx_scope_(name) {
+  if (Tracer::Instance().enabled()) {
+    event_.name = name;
+    start_ = absl::Now();
+    recording_ = true;
+  }
+}
+
+void TraceScope::end() {
+  if (ended_) {
+    return;
+  }
+  ended_ = true;
+  nvtx_scope_.end();
+  if (!recording_) {
+    return;
+  }
+  const absl::Time now = absl::Now();
+  event_.tid = Tracer::thread_id();
+  event_.start_us = absl::ToUnixMicros(start_);
+  event_.duration_us = absl::ToInt64Microseconds(now - start_);
+  Tracer::Instance().record(event_);
+}
+
+}  // namespace llm
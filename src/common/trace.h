@@ -0,0 +1,133 @@
+#pragma once
+
+#include <absl/time/time.h>
+#include <gflags/gflags_declare.h>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "macros.h"
+
+// push nvtx ranges for the engine steps and the decoder layers, so that they
+// show up in the timeline of nsys.
+DECLARE_bool(enable_nvtx);
+
+// number of step events kept in memory for the trace dump, 0 to disable.
+DECLARE_int32(trace_buffer_size);
+
+namespace llm {
+
+struct TraceEvent {
+  // static name of the event
+  const char* name = nullptr;
+
+  // id of the thread recording the event
+  uint32_t tid = 0;
+
+  // start time and duration in microseconds
+  int64_t start_us = 0;
+  int64_t duration_us = 0;
+
+  // optional argument of the event, e.g. the number of tokens
+  const char* arg_name = nullptr;
+  int64_t arg_value = 0;
+};
+
+// A ring buffer of the latest step events of the engine, which can be dumped
+// as a chrome trace to see what happened in slow steps. Events are recorded
+// by a few threads at the granularity of engine steps, so a mutex is cheap
+// enough.
+class Tracer final {
+ public:
+  // a singleton class, the capacity is read from FLAGS_trace_buffer_size.
+  static Tracer& Instance() {
+    static Tracer instance(FLAGS_trace_buffer_size);
+    return instance;
+  }
+
+  bool enabled() const { return !events_.empty(); }
+
+  void record(const TraceEvent& event);
+
+  // the events in the buffer, oldest first
+  std::vector<TraceEvent> events() const;
+
+  // dump the events in the chrome trace event format, which can be loaded
+  // by chrome://tracing or perfetto.
+  std::string to_chrome_trace() const;
+
+  // a small id of the calling thread
+  static uint32_t thread_id();
+
+ private:
+  explicit Tracer(int32_t capacity);
+
+  mutable std::mutex mutex_;
+
+  // fixed size ring buffer
+  std::vector<TraceEvent> events_;
+
+  // the total number of recorded events
+  size_t num_recorded_ = 0;
+};
+
+// Marks a scope as a nvtx range if FLAGS_enable_nvtx is set.
+class NvtxScope final {
+ public:
+  explicit NvtxScope(const char* name);
+
+  ~NvtxScope() { end(); }
+
+  NvtxScope(const NvtxScope&) = delete;
+  NvtxScope& operator=(const NvtxScope&) = delete;
+
+  // pop the range before leaving the scope, no-op if already popped
+  void end();
+
+ private:
+  bool pushed_ = false;
+};
+
+// Records the scope as an event of the tracer and marks it as a nvtx range.
+class TraceScope final {
+ public:
+  explicit TraceScope(const char* name);
+
+  ~TraceScope() { end(); }
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+  // attach an argument shown with the event
+  void set_arg(const char* name, int64_t value) {
+    event_.arg_name = name;
+    event_.arg_value = value;
+  }
+
+  // skip recording the event, e.g. for steps without work
+  void discard() { recording_ = false; }
+
+  // end the scope before leaving it, no-op if already ended
+  void end();
+
+ private:
+  NvtxScope nvtx_scope_;
+
+  TraceEvent event_;
+
+  absl::Time start_;
+
+  bool recording_ = false;
+
+  bool ended_ = false;
+};
+
+}  // namespace llm
+
+// example: TRACE_SCOPE("prepare_model_input");
+#define TRACE_SCOPE(name) llm::TraceScope LLM_ANON_VAR(trace_scope_)(name);
+
+// nvtx only, for fine-grained scopes such as decoder layers
+#define NVTX_SCOPE(name) llm::NvtxScope LLM_ANON_VAR(nvtx_scope_)(name);
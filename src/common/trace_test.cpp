@@ -0,0 +1,50 @@
+#include "trace.h"
+
+#include <gtest/gtest.h>
+
+#include <nlohmann/json.hpp>
+
+namespace llm {
+
+TEST(TraceTest, RingBuffer) {
+  Tracer& tracer = Tracer::Instance();
+  ASSERT_TRUE(tracer.enabled());
+  const size_t capacity = FLAGS_trace_buffer_size;
+
+  // fill the buffer with more events than it can hold
+  for (size_t i = 0; i < capacity + 3; ++i) {
+    TraceEvent event;
+    event.name = "event";
+    event.start_us = static_cast<int64_t>(i);
+    tracer.record(event);
+  }
+  const auto events = tracer.events();
+  ASSERT_EQ(events.size(), capacity);
+  // only the latest events are kept, oldest first
+  for (size_t i = 0; i < events.size(); ++i) {
+    EXPECT_EQ(events[i].start_us, static_cast<int64_t>(i + 3));
+  }
+}
+
+TEST(TraceTest, ChromeTrace) {
+  {
+    TraceScope scope("traced");
+    scope.set_arg("num_tokens", 42);
+  }
+  {
+    TraceScope scope("discarded");
+    scope.discard();
+  }
+
+  const auto trace = nlohmann::json::parse(Tracer::Instance().to_chrome_trace());
+  const auto& events = trace["traceEvents"];
+  ASSERT_FALSE(events.empty());
+  const auto& last = events.back();
+  EXPECT_EQ(last["name"], "traced");
+  EXPECT_EQ(last["ph"], "X");
+  EXPECT_GE(last["dur"].get<int64_t>(), 0);
+  EXPECT_EQ(last["args"]["num_tokens"], 42);
+  EXPECT_EQ(last["tid"], Tracer::thread_id());
+}
+
+}  // namespace llm
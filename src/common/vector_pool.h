@@ -0,0 +1,74 @@
+#pragma once
+
+#include <absl/synchronization/mutex.h>
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace llm {
+
+// a thread-safe free list of vector buffers, to reuse the large buffers that
+// are reserved upfront and released together, e.g. the token buffers of the
+// sequences, instead of returning them to the allocator. the pooled buffers
+// are bounded by their total bytes.
+template <typename T>
+class VectorPool final {
+ public:
+  explicit VectorPool(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+  // disable copy/move constructor and assignment
+  VectorPool(const VectorPool&) = delete;
+  VectorPool& operator=(const VectorPool&) = delete;
+  VectorPool(VectorPool&&) = delete;
+  VectorPool& operator=(VectorPool&&) = delete;
+
+  // get a vector of value-initialized elements, backed by the most recently
+  // released buffer if any.
+  std::vector<T> acquire(size_t size) {
+    std::vector<T> vec;
+    {
+      absl::MutexLock lock(&mu_);
+      if (!buffers_.empty()) {
+        vec = std::move(buffers_.back());
+        buffers_.pop_back();
+        pooled_bytes_ -= vec.capacity() * sizeof(T);
+      }
+    }
+    vec.assign(size, T());
+    return vec;
+  }
+
+  // take the buffer of the vector into the pool unless the pool is full,
+  // the vector is left empty.
+  void release(std::vector<T>&& vec) {
+    const size_t bytes = vec.capacity() * sizeof(T);
+    if (bytes == 0) {
+      return;
+    }
+    vec.clear();
+    std::vector<T> buffer = std::move(vec);
+    absl::MutexLock lock(&mu_);
+    if (pooled_bytes_ + bytes <= max_bytes_) {
+      pooled_bytes_ += bytes;
+      buffers_.push_back(std::move(buffer));
+    }
+  }
+
+  size_t num_pooled() const {
+    absl::MutexLock lock(&mu_);
+    return buffers_.size();
+  }
+
+ private:
+  const size_t max_bytes_;
+
+  mutable absl::Mutex mu_;
+
+  std::vector<std::vector<T>> buffers_ ABSL_GUARDED_BY(mu_);
+
+  // total capacity of the pooled buffers in bytes
+  size_t pooled_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+}  // namespace llm
@@ -0,0 +1,40 @@
+#include "vector_pool.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace llm {
+
+TEST(VectorPoolTest, Reuse) {
+  VectorPool<int32_t> pool(/*max_bytes=*/1024);
+  auto vec = pool.acquire(/*size=*/100);
+  EXPECT_EQ(vec, std::vector<int32_t>(100, 0));
+  vec[10] = 1;
+  const int32_t* data = vec.data();
+  pool.release(std::move(vec));
+  EXPECT_TRUE(vec.empty());
+  EXPECT_EQ(pool.num_pooled(), 1);
+
+  // the buffer is reused with the elements reset
+  auto reused = pool.acquire(/*size=*/50);
+  EXPECT_EQ(reused.data(), data);
+  EXPECT_EQ(reused, std::vector<int32_t>(50, 0));
+  EXPECT_EQ(pool.num_pooled(), 0);
+}
+
+TEST(VectorPoolTest, MaxBytes) {
+  VectorPool<int32_t> pool(/*max_bytes=*/1024);
+  auto vec1 = pool.acquire(/*size=*/200);
+  auto vec2 = pool.acquire(/*size=*/200);
+  pool.release(std::move(vec1));
+  // the buffers exceeding the max bytes are freed
+  pool.release(std::move(vec2));
+  EXPECT_EQ(pool.num_pooled(), 1);
+  // empty vectors are not pooled
+  pool.release(std::vector<int32_t>());
+  EXPECT_EQ(pool.num_pooled(), 1);
+}
+
+}  // namespace llm
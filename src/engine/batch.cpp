@@ -3,11 +3,17 @@
 #include <c10/core/DeviceType.h>
 #include <torch/torch.h>
 
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
 #include <vector>
 
 #include "common/metrics.h"
+#include "common/pinned_allocator.h"
 #include "common/slice.h"
 #include "common/tensor_helper.h"
+#include "common/trace.h"
 #include "models/parameters.h"
 #include "request/sequence.h"
 #include "sampling/parameters.h"
@@ -31,6 +37,288 @@ void pad_2d_vector(std::vector<std::vector<T>>& vec, T pad_value) {
   }
 }
 
+// build the host tensor from the arena if provided
+template <typename T>
+torch::Tensor to_tensor(const std::vector<T>& vec,
+                        torch::ScalarType dtype,
+                        HostArena* arena) {
+  return arena != nullptr ? arena->tensor(vec, dtype)
+                          : torch::tensor(vec, dtype);
+}
+
+// the seed of the random numbers of a sequence, so that the sequences of a
+// request draw different numbers from the seed of the request
+int64_t sequence_seed(uint64_t seed, size_t index) {
+  // splitmix64 of the seed and the index of the sequence
+  uint64_t z = seed + (index + 1) * 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return static_cast<int64_t>(z ^ (z >> 31));
+}
+
+// host copy of the sampled outputs, laid out as struct of arrays so that the
+// tokens are read with plain pointer arithmetic. all outputs are packed into
+// one byte buffer on device and copied to pinned memory at once, instead of
+// one copy per output and one indexing op per token.
+struct HostSampleOutput {
+  explicit HostSampleOutput(const SampleOutput& output) {
+    const auto& sampled = output.next_tokens;
+    CHECK(sampled.defined());
+    num_seqs = sampled.size(0);
+    multi_step = sampled.dim() > 1;
+    num_steps = multi_step ? sampled.size(1) : 1;
+    // the top tokens are only used along with the logprobs
+    const bool has_logprobs = output.logprobs.defined();
+    const bool has_top_tokens = has_logprobs &&
+                                output.top_tokens.defined() &&
+                                output.top_logprobs.defined();
+    topk = has_top_tokens ? output.top_tokens.size(-1) : 0;
+
+    // 8-byte columns first to keep every column aligned
+    std::vector<torch::Tensor> columns = {sampled.to(torch::kLong)};
+    if (has_top_tokens) {
+      columns.push_back(output.top_tokens.to(torch::kLong));
+    }
+    if (has_logprobs) {
+      columns.push_back(output.logprobs.to(torch::kFloat32));
+    }
+    if (has_top_tokens) {
+      columns.push_back(output.top_logprobs.to(torch::kFloat32));
+    }
+    std::vector<torch::Tensor> bytes;
+    bytes.reserve(columns.size());
+    for (const auto& column : columns) {
+      bytes.push_back(column.contiguous().view(-1).view(torch::kUInt8));
+    }
+    auto packed = torch::cat(bytes);
+    if (packed.is_cuda()) {
+      buffer = PinnedAllocator::get(packed.device()).empty(packed.numel());
+      buffer.copy_(packed);
+    } else {
+      buffer = std::move(packed);
+    }
+
+    const auto* data = buffer.const_data_ptr<uint8_t>();
+    const int64_t n_tokens = num_seqs * num_steps;
+    next_tokens = reinterpret_cast<const int64_t*>(data);
+    data += n_tokens * sizeof(int64_t);
+    if (has_top_tokens) {
+      top_tokens = reinterpret_cast<const int64_t*>(data);
+      data += n_tokens * topk * sizeof(int64_t);
+    }
+    if (has_logprobs) {
+      logprobs = reinterpret_cast<const float*>(data);
+      data += n_tokens * sizeof(float);
+    }
+    if (has_top_tokens) {
+      top_logprobs = reinterpret_cast<const float*>(data);
+    }
+  }
+
+  // the token sampled for the sequence at the step, valid as long as the
+  // output is alive
+  Token token(int64_t seq_idx, int64_t step) const {
+    const int64_t idx = seq_idx * num_steps + step;
+    Token result(next_tokens[idx]);
+    if (logprobs != nullptr) {
+      result.logprob = logprobs[idx];
+      if (top_tokens != nullptr) {
+        const size_t k = static_cast<size_t>(topk);
+        result.top_tokens = {top_tokens + idx * topk, k};
+        result.top_logprobs = {top_logprobs + idx * topk, k};
+      }
+    }
+    return result;
+  }
+
+  // the host buffer backing all columns
+  torch::Tensor buffer;
+
+  // [num_seqs, num_steps]
+  const int64_t* next_tokens = nullptr;
+  // [num_seqs, num_steps], nullptr if not requested
+  const float* logprobs = nullptr;
+  // [num_seqs, num_steps, topk], nullptr if not requested
+  const int64_t* top_tokens = nullptr;
+  const float* top_logprobs = nullptr;
+
+  int64_t num_seqs = 0;
+  int64_t num_steps = 1;
+  int64_t topk = 0;
+  // whether the tokens are [num_seqs, num_steps] instead of [num_seqs]
+  bool multi_step = false;
+};
+
+// group consecutive sequences sharing leading kv cache blocks for cascade
+// attention. only the full blocks before the first new token of each sequence
+// are shared, so that all query tokens of a group attend to the whole prefix.
+void set_prefix_groups(const std::vector<Sequence*>& sequences,
+                       const std::vector<int32_t>& q_cu_seq_lens,
+                       const std::vector<int32_t>& kv_cu_seq_lens,
+                       const std::vector<int32_t>& cu_block_lens,
+                       uint32_t min_prefix_len,
+                       HostArena* arena,
+                       InputParameters* input_params) {
+  const size_t n_seqs = sequences.size();
+  // number of full blocks before the first new token
+  auto num_cached_blocks = [&](size_t i) {
+    const auto& blocks = sequences[i]->blocks();
+    const int32_t q_len = q_cu_seq_lens[i + 1] - q_cu_seq_lens[i];
+    const int32_t kv_len = kv_cu_seq_lens[i + 1] - kv_cu_seq_lens[i];
+    return blocks.empty()
+               ? 0
+               : static_cast<uint32_t>(kv_len - q_len) / blocks[0].size();
+  };
+  // number of leading blocks shared by two sequences
+  auto num_common_blocks = [&](size_t i, size_t j, uint32_t max_blocks) {
+    const auto& lhs = sequences[i]->blocks();
+    const auto& rhs = sequences[j]->blocks();
+    uint32_t n = 0;
+    while (n < max_blocks && lhs[n].id() == rhs[n].id()) {
+      ++n;
+    }
+    return n;
+  };
+
+  // (first sequence, number of shared blocks) of each group
+  std::vector<std::pair<size_t, uint32_t>> groups;
+  bool has_shared_prefix = false;
+  for (size_t i = 0; i < n_seqs;) {
+    const size_t begin = i;
+    uint32_t n_shared = num_cached_blocks(begin);
+    for (++i; i < n_seqs; ++i) {
+      const uint32_t n_common = num_common_blocks(
+          begin, i, std::min<uint32_t>(n_shared, num_cached_blocks(i)));
+      const auto block_size = sequences[i]->blocks()[0].size();
+      if (n_common == 0 || n_common * block_size < min_prefix_len) {
+        break;
+      }
+      n_shared = n_common;
+    }
+    // no need to share the prefix within one sequence
+    if (i - begin == 1) {
+      n_shared = 0;
+    }
+    has_shared_prefix |= n_shared > 0;
+    groups.emplace_back(begin, n_shared);
+  }
+  if (!has_shared_prefix) {
+    return;
+  }
+
+  std::vector<int32_t> prefix_q_cu_seq_lens = {0};
+  std::vector<int32_t> prefix_kv_cu_seq_lens = {0};
+  std::vector<int32_t> prefix_cu_block_lens;
+  std::vector<int32_t> suffix_kv_cu_seq_lens = {0};
+  std::vector<int32_t> suffix_cu_block_lens;
+  int32_t prefix_q_max_seq_len = 0;
+  int32_t prefix_kv_max_seq_len = 0;
+  int32_t suffix_kv_max_seq_len = 0;
+  for (size_t g = 0; g < groups.size(); ++g) {
+    const auto [begin, n_shared] = groups[g];
+    const size_t end = g + 1 < groups.size() ? groups[g + 1].first : n_seqs;
+    const int32_t prefix_len =
+        static_cast<int32_t>(n_shared * sequences[begin]->blocks()[0].size());
+    const int32_t q_len = q_cu_seq_lens[end] - q_cu_seq_lens[begin];
+    prefix_q_cu_seq_lens.push_back(q_cu_seq_lens[end]);
+    prefix_kv_cu_seq_lens.push_back(prefix_kv_cu_seq_lens.back() + prefix_len);
+    prefix_cu_block_lens.push_back(cu_block_lens[begin]);
+    prefix_q_max_seq_len = std::max(prefix_q_max_seq_len, q_len);
+    prefix_kv_max_seq_len = std::max(prefix_kv_max_seq_len, prefix_len);
+    for (size_t i = begin; i < end; ++i) {
+      const int32_t kv_len =
+          kv_cu_seq_lens[i + 1] - kv_cu_seq_lens[i] - prefix_len;
+      suffix_kv_cu_seq_lens.push_back(suffix_kv_cu_seq_lens.back() + kv_len);
+      suffix_cu_block_lens.push_back(cu_block_lens[i] +
+                                     static_cast<int32_t>(n_shared));
+      suffix_kv_max_seq_len = std::max(suffix_kv_max_seq_len, kv_len);
+    }
+  }
+  // keep the total size as the last entry
+  prefix_cu_block_lens.push_back(cu_block_lens[n_seqs]);
+  suffix_cu_block_lens.push_back(cu_block_lens[n_seqs]);
+
+  input_params->num_prefix_groups = static_cast<int32_t>(groups.size());
+  input_params->prefix_q_cu_seq_lens =
+      to_tensor(prefix_q_cu_seq_lens, torch::kInt, arena);
+  input_params->prefix_kv_cu_seq_lens =
+      to_tensor(prefix_kv_cu_seq_lens, torch::kInt, arena);
+  input_params->prefix_cu_block_lens =
+      to_tensor(prefix_cu_block_lens, torch::kInt, arena);
+  input_params->prefix_q_max_seq_len = prefix_q_max_seq_len;
+  input_params->prefix_kv_max_seq_len = prefix_kv_max_seq_len;
+  input_params->suffix_kv_cu_seq_lens =
+      to_tensor(suffix_kv_cu_seq_lens, torch::kInt, arena);
+  input_params->suffix_cu_block_lens =
+      to_tensor(suffix_cu_block_lens, torch::kInt, arena);
+  input_params->suffix_kv_max_seq_len = suffix_kv_max_seq_len;
+}
+
+// gather the precomputed bitmasks of the grammar states into [n_rows,
+// n_words], rows without a sequence allow all tokens. the host tensor is
+// pinned so that the copy to device overlaps with the forward pass.
+torch::Tensor create_token_bitmask(
+    const std::vector<const Sequence*>& sequences,
+    HostArena* arena) {
+  size_t n_words = 0;
+  for (const auto* sequence : sequences) {
+    if (sequence != nullptr) {
+      n_words = sequence->grammar()->num_words();
+      break;
+    }
+  }
+  CHECK_GT(n_words, 0) << "no sequence is constrained by a grammar";
+
+  const int64_t n_rows = static_cast<int64_t>(sequences.size());
+  torch::Tensor bitmask;
+  if (arena != nullptr) {
+    bitmask = arena->empty(n_rows * static_cast<int64_t>(n_words), torch::kInt)
+                  .view({n_rows, static_cast<int64_t>(n_words)});
+  } else {
+    const auto options = torch::TensorOptions()
+                             .dtype(torch::kInt)
+                             .pinned_memory(torch::cuda::is_available());
+    bitmask = torch::empty({n_rows, static_cast<int64_t>(n_words)}, options);
+  }
+  int32_t* data = bitmask.data_ptr<int32_t>();
+  for (const auto* sequence : sequences) {
+    if (sequence != nullptr) {
+      sequence->token_bitmask(data, n_words);
+    } else {
+      std::fill(data, data + n_words, -1);
+    }
+    data += n_words;
+  }
+  return bitmask;
+}
+
+// assign the rows of the persistent token counts to the selected tokens and
+// send the rows to upload, only if any sequence has penalties.
+void set_token_counts(const std::vector<const Sequence*>& sequences,
+                      uint32_t num_decode_steps,
+                      TokenCounts* token_counts,
+                      HostArena* arena,
+                      ModelInput* model_inputs) {
+  std::vector<int32_t> rows;
+  std::vector<int32_t> updates;
+  std::vector<int32_t> resets;
+  token_counts->update(sequences, num_decode_steps, &rows, &updates, &resets);
+  if (std::all_of(rows.begin(), rows.end(), [](int32_t r) { return r == 0; })) {
+    return;
+  }
+  model_inputs->token_count_rows = to_tensor(rows, torch::kInt, arena);
+  if (!resets.empty()) {
+    model_inputs->token_count_resets =
+        to_tensor(resets, torch::kInt, arena).view({-1, 2});
+  }
+  if (!updates.empty()) {
+    model_inputs->token_count_updates =
+        to_tensor(updates, torch::kInt, arena).view({-1, 4});
+  }
+  model_inputs->token_count_num_rows = token_counts->num_rows();
+  model_inputs->token_count_width = token_counts->width();
+}
+
 }  // namespace
 
 Batch::Batch(Sequence* sequence) { add(sequence); }
@@ -58,6 +346,7 @@ void Batch::add(const std::vector<Sequence*>& sequences) {
 }
 
 void Batch::set_engine_type(EngineType engine_type) {
+  engine_type_ = engine_type;
   // set engine type for all sequences in the batch
   for (auto* sequence : sequences_) {
     sequence->set_engine_type(engine_type);
@@ -66,26 +355,216 @@ void Batch::set_engine_type(EngineType engine_type) {
   std::fill(budget_used_.begin(), budget_used_.end(), 0);
 }
 
+void Batch::set_swap_blocks(std::vector<int32_t> swap_out_blocks,
+                            std::vector<int32_t> swap_in_blocks) {
+  CHECK(swap_out_blocks.size() % 2 == 0 && swap_in_blocks.size() % 2 == 0)
+      << "swap blocks should be [src_block_id, dst_block_id] pairs";
+  swap_out_blocks_ = std::move(swap_out_blocks);
+  swap_in_blocks_ = std::move(swap_in_blocks);
+}
+
+void Batch::set_copy_blocks(std::vector<int32_t> copy_blocks) {
+  CHECK(copy_blocks.size() % 2 == 0)
+      << "copy blocks should be [src_block_id, dst_block_id] pairs";
+  copy_blocks_ = std::move(copy_blocks);
+}
+
+void Batch::set_shared_blocks(std::vector<int32_t> shared_out_blocks,
+                              std::vector<int32_t> shared_in_blocks) {
+  CHECK(shared_out_blocks.size() % 2 == 0 && shared_in_blocks.size() % 2 == 0)
+      << "shared blocks should be [src_block_id, dst_block_id] pairs";
+  shared_out_blocks_ = std::move(shared_out_blocks);
+  shared_in_blocks_ = std::move(shared_in_blocks);
+}
+
+void Batch::set_tree_leaves(std::vector<std::vector<int32_t>> tree_leaves,
+                            uint32_t n_leaves_per_depth) {
+  CHECK_EQ(tree_leaves.size(), sequences_.size())
+      << "tree leaves should be set for each sequence";
+  CHECK_GT(n_leaves_per_depth, 0);
+  tree_leaves_ = std::move(tree_leaves);
+  n_leaves_per_depth_ = n_leaves_per_depth;
+}
+
+void Batch::set_skip_sampling(bool skip_sampling) {
+  skip_sampling_ = skip_sampling;
+}
+
+void Batch::set_select_all_tokens(bool select_all_tokens) {
+  select_all_tokens_ = select_all_tokens;
+}
+
+void Batch::set_lora_slots(std::vector<int32_t> lora_slots) {
+  lora_slots_ = std::move(lora_slots);
+}
+
+std::vector<Batch> Batch::split(size_t n_batches) const {
+  CHECK_GT(n_batches, 0);
+  CHECK(tree_leaves_.empty()) << "token tree can't be split";
+  n_batches = std::min(n_batches, sequences_.size());
+
+  std::vector<Batch> batches(n_batches);
+  // spread the remainder over the leading batches
+  const size_t n_seqs_per_batch = sequences_.size() / n_batches;
+  const size_t remainder = sequences_.size() % n_batches;
+  size_t seq_idx = 0;
+  for (size_t i = 0; i < n_batches; ++i) {
+    auto& batch = batches[i];
+    const size_t n_seqs = n_seqs_per_batch + (i < remainder ? 1 : 0);
+    for (size_t j = 0; j < n_seqs; ++j, ++seq_idx) {
+      batch.add(sequences_[seq_idx], token_budgets_[seq_idx]);
+    }
+    copy_options_to(&batch);
+  }
+  if (!batches.empty()) {
+    batches[0].swap_out_blocks_ = swap_out_blocks_;
+    batches[0].swap_in_blocks_ = swap_in_blocks_;
+    batches[0].copy_blocks_ = copy_blocks_;
+    batches[0].shared_out_blocks_ = shared_out_blocks_;
+    batches[0].shared_in_blocks_ = shared_in_blocks_;
+  }
+  return batches;
+}
+
+bool Batch::split_decode_prefill(Batch* decode, Batch* prefill) const {
+  CHECK(decode != nullptr && prefill != nullptr);
+  // the prefill stream is not ordered after the block swaps and copies
+  if (!tree_leaves_.empty() || !swap_out_blocks_.empty() ||
+      !swap_in_blocks_.empty() || !copy_blocks_.empty() ||
+      !shared_out_blocks_.empty() || !shared_in_blocks_.empty()) {
+    return false;
+  }
+  decode->clear();
+  prefill->clear();
+  for (size_t i = 0; i < sequences_.size(); ++i) {
+    auto* batch = sequences_[i]->is_prefill_stage() ? prefill : decode;
+    batch->add(sequences_[i], token_budgets_[i]);
+  }
+  if (decode->empty() || prefill->empty()) {
+    return false;
+  }
+  copy_options_to(decode);
+  copy_options_to(prefill);
+  return true;
+}
+
+void Batch::stable_sort(const std::function<int32_t(const Sequence&)>& key) {
+  CHECK(tree_leaves_.empty()) << "can't reorder the sequences of a token tree";
+  std::vector<size_t> order(sequences_.size());
+  std::vector<int32_t> keys(sequences_.size());
+  for (size_t i = 0; i < sequences_.size(); ++i) {
+    order[i] = i;
+    keys[i] = key(*sequences_[i]);
+  }
+  std::stable_sort(order.begin(), order.end(), [&keys](size_t a, size_t b) {
+    return keys[a] < keys[b];
+  });
+
+  std::vector<Sequence*> sequences;
+  std::vector<uint32_t> token_budgets;
+  std::vector<uint32_t> budget_used;
+  sequences.reserve(order.size());
+  token_budgets.reserve(order.size());
+  budget_used.reserve(order.size());
+  for (const size_t i : order) {
+    sequences.push_back(sequences_[i]);
+    token_budgets.push_back(token_budgets_[i]);
+    budget_used.push_back(budget_used_[i]);
+  }
+  sequences_ = std::move(sequences);
+  token_budgets_ = std::move(token_budgets);
+  budget_used_ = std::move(budget_used);
+}
+
+void Batch::copy_options_to(Batch* batch) const {
+  batch->engine_type_ = engine_type_;
+  batch->skip_sampling_ = skip_sampling_;
+  batch->select_all_tokens_ = select_all_tokens_;
+  batch->lora_slots_ = lora_slots_;
+}
+
 void Batch::clear() {
   sequences_.clear();
   token_budgets_.clear();
   budget_used_.clear();
+  swap_out_blocks_.clear();
+  swap_in_blocks_.clear();
+  copy_blocks_.clear();
+  shared_out_blocks_.clear();
+  shared_in_blocks_.clear();
+  tree_leaves_.clear();
+  engine_type_ = EngineType::LLM;
+  skip_sampling_ = false;
+  select_all_tokens_ = false;
+  lora_slots_.clear();
+  scored_prompts_.clear();
+  pooled_prompts_.clear();
+  observed_prompts_.clear();
 }
 
 // prepare inputs for the batch
 // NOLINTNEXTLINE
 ModelInput Batch::prepare_model_input(uint32_t num_decoding_tokens,
-                                      uint32_t min_decoding_bach_size) {
+                                      uint32_t min_decoding_bach_size,
+                                      BlockTables* block_tables_cache,
+                                      uint32_t num_decode_steps,
+                                      uint32_t min_cascade_prefix_len,
+                                      TokenCounts* token_counts_cache,
+                                      HostArena* arena) {
+  TRACE_SCOPE("prepare_model_input");
   // flatten the token ids and positions
   std::vector<int32_t> flatten_tokens_vec;
   std::vector<int32_t> flatten_positions_vec;
+  // lora adapter slot of each token
+  std::vector<int32_t> lora_slots_vec;
+  bool has_lora = false;
 
   // sleceted tokens to return logits, including generated tokens and last
   // prompt token
   std::vector<const SamplingParameter*> sampling_params;
+  // the sequence of each selected token whose next token is constrained by a
+  // grammar, nullptr for the unconstrained ones
+  std::vector<const Sequence*> constrained_sequences;
+  bool has_grammar = false;
+  // the seed of each selected token and the position of the token sampled
+  // from it, -1 for the unseeded sequences
+  std::vector<int64_t> rng_seeds;
+  std::vector<int64_t> rng_offsets;
+  bool has_seed = false;
+  const auto add_rng = [&](const Sequence* sequence, int64_t position) {
+    const auto& seed = sequence->sampling_param()->seed;
+    rng_seeds.push_back(
+        seed.has_value() ? sequence_seed(*seed, sequence->index()) : 0);
+    rng_offsets.push_back(seed.has_value() ? position : -1);
+    has_seed = has_seed || seed.has_value();
+  };
   std::vector<int32_t> selected_token_idxes;
   // track the last token of selected tokens for sampling
   std::vector<int32_t> sample_idxes;
+  // prompt tokens whose logits score the next prompt token
+  std::vector<int32_t> scored_token_idxes;
+  std::vector<int64_t> scored_token_ids;
+  scored_prompts_.clear();
+  // prompt tokens whose hidden states are pooled into embeddings
+  std::vector<int32_t> pooled_token_idxes;
+  std::vector<int64_t> pooled_embedding_idxes;
+  pooled_prompts_.clear();
+  // the last prompt tokens and the kv cache slots of the observed sequences
+  std::vector<std::vector<int32_t>> kv_score_q_idxes;
+  std::vector<std::vector<int32_t>> kv_score_slots;
+  observed_prompts_.clear();
+  // the new tokens and the device and host blocks of the sequences whose
+  // leading blocks are offloaded, see BlockManager::offload_blocks_for()
+  std::vector<std::vector<int32_t>> offload_q_idxes;
+  std::vector<std::vector<int32_t>> offload_device_blocks;
+  std::vector<std::vector<int32_t>> offload_host_blocks;
+  std::vector<int32_t> offload_kv_lens;
+  // the images not in the kv cache yet, and the rows of their embeddings
+  // taken by the new image tokens, see ModelInput::image_token_rows
+  std::vector<uint64_t> image_hashes;
+  std::vector<torch::Tensor> image_pixel_values;
+  std::unordered_map<uint64_t, int32_t> image_idxes;
+  std::vector<int32_t> image_token_rows;
 
   // track the unique token ids and counts in the batch
   std::vector<std::vector<int64_t>> unique_token_ids_vec;
@@ -100,12 +579,29 @@ ModelInput Batch::prepare_model_input(uint32_t num_decoding_tokens,
   std::vector<int32_t> new_token_slot_ids;
   std::vector<int32_t> block_tables;
   std::vector<int32_t> cu_block_lens = {0};
+  // sequences with tokens to process
+  std::vector<Sequence*> scheduled_sequences;
+  // stop conditions for multi-step decoding
+  std::vector<std::vector<int32_t>> stop_token_ids_vec;
+  std::vector<int32_t> num_remaining_tokens_vec;
+  // attention mask among new tokens, only used for tree speculative decoding
+  const bool has_tree = !tree_leaves_.empty();
+  // the tree leaves are verified with the draft tokens
+  const bool select_all_tokens = select_all_tokens_ || has_tree;
+  // only the last token of each sequence is selected, whose token counts are
+  // the counts of all tokens in the sequence, kept on device across steps.
+  const bool persistent_token_counts =
+      token_counts_cache != nullptr && !select_all_tokens;
+  std::vector<const Sequence*> token_count_sequences;
+  std::vector<int64_t> tree_mask_vec;
   const int32_t num_sequences = static_cast<int32_t>(sequences_.size());
   for (int32_t i = 0; i < num_sequences; ++i) {
     auto* sequence = sequences_[i];
     const auto token_ids = sequence->token_ids();
     const uint32_t n_tokens = token_ids.size();
     const uint32_t n_kv_cache_tokens = sequence->num_kv_cache_tokens();
+    // the kv cache of the evicted tokens is not attended to
+    const uint32_t n_evicted_tokens = sequence->num_evicted_tokens();
 
     const uint32_t remaining_token_budget = token_budgets_[i] - budget_used_[i];
     if (remaining_token_budget == 0) {
@@ -119,8 +615,13 @@ ModelInput Batch::prepare_model_input(uint32_t num_decoding_tokens,
 
     const uint32_t seq_len = q_seq_len + n_kv_cache_tokens;
 
+    // tree leaves are processed after the draft tokens in the sequence
+    const std::vector<int32_t> empty_leaves;
+    const auto& leaves = has_tree ? tree_leaves_[i] : empty_leaves;
+    const uint32_t n_leaves = leaves.size();
+
     // check if the sequence has enough cache slots
-    CHECK_GE(sequence->kv_cache_capacity(), seq_len);
+    CHECK_GE(sequence->kv_cache_capacity(), seq_len + n_leaves);
 
     // at least one token to process otherwise the sequence should be finished.
     CHECK_GT(q_seq_len, 0) << "at least one token should be processed. "
@@ -133,59 +634,218 @@ ModelInput Batch::prepare_model_input(uint32_t num_decoding_tokens,
     // update budget used
     budget_used_[i] += q_seq_len;
 
+    const uint32_t n_prompt_tokens = sequence->num_prompt_tokens();
+    if (num_decode_steps > 1) {
+      // run multiple steps only if all sequences are decoding one token
+      // without a grammar or beam search, which are advanced on host after
+      // each token.
+      // the slots of the following steps are looked up by positions, which
+      // don't match the kv cache after eviction.
+      if (q_seq_len == 1 && n_kv_cache_tokens >= n_prompt_tokens &&
+          sequence->grammar() == nullptr && sequence->beam_width() == 0 &&
+          n_evicted_tokens == 0) {
+        // limited by the kv cache slots reserved by the scheduler
+        const uint32_t max_steps = sequence->kv_cache_capacity() - seq_len + 1;
+        num_decode_steps = std::min(num_decode_steps, max_steps);
+
+        // the draft tokens are proposed in full without stopping early, the
+        // target model settles where the sequence stops.
+        if (engine_type_ != EngineType::SSM) {
+          const auto* stopping_criteria = sequence->stopping_criteria();
+          auto& stop_token_ids = stop_token_ids_vec.emplace_back(
+              stopping_criteria->stop_token_ids.begin(),
+              stopping_criteria->stop_token_ids.end());
+          if (!stopping_criteria->ignore_eos) {
+            stop_token_ids.push_back(stopping_criteria->eos_token_id);
+          }
+          const size_t max_tokens = stopping_criteria->max_tokens;
+          const size_t n_generated_tokens = sequence->num_generated_tokens();
+          num_remaining_tokens_vec.push_back(
+              max_tokens > n_generated_tokens
+                  ? static_cast<int32_t>(max_tokens - n_generated_tokens)
+                  : std::numeric_limits<int32_t>::max());
+        }
+      } else {
+        num_decode_steps = 1;
+      }
+    }
+
     // update sequence length
-    max_seq_len = std::max(max_seq_len, seq_len);
-    q_max_seq_len = std::max(q_max_seq_len, q_seq_len);
-    cu_seq_lens.push_back(cu_seq_lens.back() + seq_len);
-    q_cu_seq_lens.push_back(q_cu_seq_lens.back() + q_seq_len);
+    const uint32_t kv_seq_len = seq_len - n_evicted_tokens;
+    max_seq_len = std::max(max_seq_len, kv_seq_len + n_leaves);
+    q_max_seq_len = std::max(q_max_seq_len, q_seq_len + n_leaves);
+    cu_seq_lens.push_back(cu_seq_lens.back() + kv_seq_len + n_leaves);
+    q_cu_seq_lens.push_back(q_cu_seq_lens.back() + q_seq_len + n_leaves);
 
     // pack the token ids and positions into one-dimensional tensors
     // and select tokens for sampling the next token
-    const uint32_t n_prompt_tokens = sequence->num_prompt_tokens();
+    // the tokens are only counted for the penalties
+    const bool count_tokens = !persistent_token_counts &&
+                              sequence->sampling_param()->has_penalties();
     std::unordered_map<int32_t, int32_t> adjusted_token_to_count_map;
-    for (uint32_t j = n_kv_cache_tokens; j < seq_len; ++j) {
-      // skip prompt tokens except the last one
-      if (j + 1 < n_prompt_tokens) {
-        continue;
+    if (count_tokens) {
+      for (uint32_t j = n_kv_cache_tokens; j < seq_len; ++j) {
+        // skip prompt tokens except the last one
+        if (j + 1 < n_prompt_tokens) {
+          continue;
+        }
+        ++adjusted_token_to_count_map[token_ids[j]];
+      }
+    }
+
+    // observe the attention of the last prompt tokens over the kv cache
+    // once the prompt is processed, see BlockManager::evict_kv_blocks_for()
+    const size_t observation_window = sequence->kv_observation_window();
+    if (observation_window > 0 && engine_type_ == EngineType::LLM &&
+        n_evicted_tokens == 0 && n_leaves == 0 &&
+        n_kv_cache_tokens < n_prompt_tokens && seq_len >= n_prompt_tokens) {
+      const uint32_t n_observed =
+          std::min<uint32_t>(observation_window, q_seq_len);
+      const int32_t last_idx =
+          static_cast<int32_t>(flatten_tokens_vec.size() + q_seq_len - 1);
+      auto& q_idxes = kv_score_q_idxes.emplace_back();
+      for (int32_t k = static_cast<int32_t>(n_observed) - 1; k >= 0; --k) {
+        q_idxes.push_back(last_idx - k);
+      }
+      kv_score_slots.push_back(sequence->kv_cache_slots(0, seq_len));
+      observed_prompts_.push_back({sequence, seq_len});
+    }
+
+    // the offloaded tokens are attended on host and merged into the output
+    if (const auto host_blocks = sequence->offloaded_blocks();
+        !host_blocks.empty()) {
+      CHECK_EQ(n_leaves, 0) << "tree leaves with offloaded blocks";
+      auto& q_idxes = offload_q_idxes.emplace_back();
+      const auto first_idx = static_cast<int32_t>(flatten_tokens_vec.size());
+      for (uint32_t k = 0; k < q_seq_len; ++k) {
+        q_idxes.push_back(first_idx + static_cast<int32_t>(k));
+      }
+      auto& device_ids = offload_device_blocks.emplace_back();
+      for (const auto& block : sequence->blocks()) {
+        device_ids.push_back(block.id());
+      }
+      auto& host_ids = offload_host_blocks.emplace_back();
+      for (const auto& block : host_blocks) {
+        host_ids.push_back(block.id());
+      }
+      offload_kv_lens.push_back(static_cast<int32_t>(kv_seq_len));
+    }
+
+    // the image tokens take the embeddings of the vision encoder. the images
+    // beyond the chunk of a prefill are listed as well, so that they are
+    // encoded ahead of the chunks that use them.
+    if (const auto* images = sequence->images(); images != nullptr) {
+      const auto first_idx = static_cast<int32_t>(flatten_tokens_vec.size());
+      for (const auto& image : *images) {
+        const size_t end = image.token_offset + image.num_tokens;
+        if (end <= n_kv_cache_tokens) {
+          // already in the kv cache
+          continue;
+        }
+        const auto [it, inserted] = image_idxes.try_emplace(
+            image.hash, static_cast<int32_t>(image_hashes.size()));
+        if (inserted) {
+          image_hashes.push_back(image.hash);
+          image_pixel_values.push_back(image.pixel_values);
+        }
+        const size_t start =
+            std::max<size_t>(image.token_offset, n_kv_cache_tokens);
+        for (size_t j = start; j < std::min<size_t>(end, seq_len); ++j) {
+          image_token_rows.push_back(
+              first_idx + static_cast<int32_t>(j - n_kv_cache_tokens));
+          image_token_rows.push_back(it->second);
+          image_token_rows.push_back(
+              static_cast<int32_t>(j - image.token_offset));
+        }
       }
-      ++adjusted_token_to_count_map[token_ids[j]];
     }
 
+    // index of the first selected token of the sequence
+    const size_t selected_base = unique_token_ids_vec.size();
     bool has_selected_token = false;
+    const bool score_prompt =
+        !skip_sampling_ && sequence->needs_prompt_logprobs();
+    const size_t scored_base = scored_token_idxes.size();
+    // embeddings are pooled from the prompt without sampling
+    const bool is_embedding = sequence->is_embedding();
+    const bool mean_pooling = sequence->pooling() == PoolingType::MEAN;
+    const size_t pooled_base = pooled_token_idxes.size();
     for (uint32_t j = n_kv_cache_tokens; j < seq_len; ++j) {
       flatten_tokens_vec.push_back(token_ids[j]);
       flatten_positions_vec.push_back(static_cast<int32_t>(j));
+      if (has_tree) {
+        // draft tokens keep the causal mask
+        tree_mask_vec.push_back(-1);
+      }
+
+      // score the next prompt token with the logits of the token
+      if (score_prompt && j + 1 < n_prompt_tokens) {
+        scored_token_idxes.push_back(flatten_tokens_vec.size() - 1);
+        scored_token_ids.push_back(token_ids[j + 1]);
+      }
+
+      if (is_embedding) {
+        if (mean_pooling || j + 1 == n_prompt_tokens) {
+          pooled_token_idxes.push_back(flatten_tokens_vec.size() - 1);
+          pooled_embedding_idxes.push_back(
+              static_cast<int64_t>(pooled_prompts_.size()));
+        }
+        continue;
+      }
 
       // skip prompt tokens except the last one
-      if (j + 1 < n_prompt_tokens) {
+      if (skip_sampling_ || j + 1 < n_prompt_tokens) {
         continue;
       }
 
       // adjust token count for current token
-      --adjusted_token_to_count_map[token_ids[j]];
+      if (count_tokens) {
+        --adjusted_token_to_count_map[token_ids[j]];
+      }
+
+      // no logits for the tokens before the last one, e.g. the generated
+      // tokens recomputed after preemption or caught up by the draft model.
+      if (!select_all_tokens && j != seq_len - 1) {
+        continue;
+      }
 
       // select tokens for sampling the next token
       selected_token_idxes.push_back(flatten_tokens_vec.size() - 1);
       sampling_params.push_back(sequence->sampling_param());
+      add_rng(sequence, j + 1);
+      // the grammar state is only known after the last token
+      const bool constrained =
+          sequence->grammar() != nullptr && j == seq_len - 1;
+      constrained_sequences.push_back(constrained ? sequence : nullptr);
+      has_grammar = has_grammar || constrained;
 
       // add token id and count for sampling
-      const auto& seq_token_counts = sequence->token_to_count_map();
-      const auto unique_tokens = seq_token_counts.size();
-
-      auto& ids = unique_token_ids_vec.emplace_back();
-      auto& counts = unique_token_counts_vec.emplace_back();
-      ids.reserve(unique_tokens);
-      counts.reserve(unique_tokens);
-      for (const auto& [token_id, count] : seq_token_counts) {
-        const auto it = adjusted_token_to_count_map.find(token_id);
-        const auto adjust_count =
-            it != adjusted_token_to_count_map.end() ? it->second : 0;
-        if (count > adjust_count) {
-          ids.push_back(token_id);
-          counts.push_back(count - adjust_count);
+      if (persistent_token_counts) {
+        token_count_sequences.push_back(sequence);
+      } else if (!count_tokens) {
+        // no penalties, no tokens to count
+        unique_token_ids_vec.emplace_back();
+        unique_token_counts_vec.emplace_back();
+        unique_token_lens_vec.push_back(0);
+      } else {
+        const auto& seq_token_counts = sequence->token_to_count_map();
+        const auto unique_tokens = seq_token_counts.size();
+
+        auto& ids = unique_token_ids_vec.emplace_back();
+        auto& counts = unique_token_counts_vec.emplace_back();
+        ids.reserve(unique_tokens);
+        counts.reserve(unique_tokens);
+        for (const auto& [token_id, count] : seq_token_counts) {
+          const auto it = adjusted_token_to_count_map.find(token_id);
+          const auto adjust_count =
+              it != adjusted_token_to_count_map.end() ? it->second : 0;
+          if (count > adjust_count) {
+            ids.push_back(token_id);
+            counts.push_back(count - adjust_count);
+          }
         }
+        unique_token_lens_vec.push_back(static_cast<int32_t>(ids.size()));
       }
-      unique_token_lens_vec.push_back(static_cast<int32_t>(ids.size()));
 
       // sample last token in the sequence
       if (j == seq_len - 1) {
@@ -194,15 +854,90 @@ ModelInput Batch::prepare_model_input(uint32_t num_decoding_tokens,
       }
     }
 
+    if (pooled_token_idxes.size() > pooled_base) {
+      const size_t n_pooled = pooled_token_idxes.size() - pooled_base;
+      pooled_prompts_.push_back({sequence, seq_len - n_pooled, seq_len});
+    }
+
+    if (scored_token_idxes.size() > scored_base) {
+      scored_prompts_.push_back(
+          {sequence,
+           n_kv_cache_tokens + 1,
+           scored_token_idxes.size() - scored_base});
+    }
+
+    if (n_leaves > 0) {
+      // the leaf at depth d replaces the d-th draft token, it attends to the
+      // tokens before the draft token and itself.
+      CHECK_GE(n_kv_cache_tokens, n_prompt_tokens)
+          << "tree leaves are only supported for decoding sequences";
+      CHECK_EQ(n_leaves % n_leaves_per_depth_, 0)
+          << "tree leaves should be [n_draft_tokens, n_leaves_per_depth]";
+      const uint32_t n_draft_tokens = n_leaves / n_leaves_per_depth_;
+      CHECK_GT(q_seq_len, n_draft_tokens);
+      CHECK_LE(q_seq_len + n_leaves, 64) << "too many tokens in the tree";
+      // index of the last accepted token in the new tokens
+      const uint32_t root_idx = q_seq_len - n_draft_tokens - 1;
+      for (uint32_t k = 0; k < n_leaves; ++k) {
+        const uint32_t depth = k / n_leaves_per_depth_ + 1;
+        const uint32_t parent_idx = root_idx + depth - 1;
+        const uint32_t new_idx = q_seq_len + k;
+        const int32_t leaf = leaves[k];
+        flatten_tokens_vec.push_back(leaf);
+        flatten_positions_vec.push_back(
+            static_cast<int32_t>(n_kv_cache_tokens + parent_idx + 1));
+        const uint64_t bits = ((uint64_t(1) << (parent_idx + 1)) - 1) |
+                              (uint64_t(1) << new_idx);
+        tree_mask_vec.push_back(static_cast<int64_t>(bits));
+
+        // select the leaf to sample the token after it
+        selected_token_idxes.push_back(flatten_tokens_vec.size() - 1);
+        sampling_params.push_back(sequence->sampling_param());
+        add_rng(sequence, flatten_positions_vec.back() + 1);
+        constrained_sequences.push_back(nullptr);
+
+        // same token counts as the parent plus the leaf itself
+        auto ids = unique_token_ids_vec[selected_base + parent_idx];
+        auto counts = unique_token_counts_vec[selected_base + parent_idx];
+        const auto it = std::find(ids.begin(), ids.end(), leaf);
+        if (it != ids.end()) {
+          ++counts[it - ids.begin()];
+        } else {
+          ids.push_back(leaf);
+          counts.push_back(1);
+        }
+        unique_token_lens_vec.push_back(static_cast<int32_t>(ids.size()));
+        unique_token_ids_vec.push_back(std::move(ids));
+        unique_token_counts_vec.push_back(std::move(counts));
+      }
+    }
+
+    // all tokens of the sequence run with the adapter of the sequence
+    int32_t lora_slot = -1;
+    if (const int32_t lora_id = sequence->lora_id(); lora_id >= 0) {
+      CHECK_LT(lora_id, lora_slots_.size()) << "lora slots are not set";
+      lora_slot = lora_slots_[lora_id];
+      CHECK_GE(lora_slot, 0) << "lora adapter " << lora_id << " has no slot";
+      has_lora = true;
+    }
+    lora_slots_vec.resize(flatten_tokens_vec.size(), lora_slot);
+
     // commit kv cache to advance kv_cache pos in sequence
     sequence->commit_kv_cache(/*size=*/q_seq_len);
 
     // assign slot ids for new tokens [n_tokens_in_kvcache, total_tokens)
+    // leaves are written after the draft tokens and recomputed once accepted
     const auto blocks = sequence->blocks();
-    const auto slot_ids = sequence->kv_cache_slots(n_kv_cache_tokens, seq_len);
+    const auto slot_ids =
+        sequence->kv_cache_slots(n_kv_cache_tokens, seq_len + n_leaves);
     new_token_slot_ids.insert(
         new_token_slot_ids.end(), slot_ids.begin(), slot_ids.end());
 
+    scheduled_sequences.push_back(sequence);
+    if (block_tables_cache != nullptr) {
+      // block tables are updated incrementally after the loop
+      continue;
+    }
     for (const auto& block : blocks) {
       // put first slot id of each block into block_table
       block_tables.push_back(block.id() * block.size());
@@ -217,6 +952,7 @@ ModelInput Batch::prepare_model_input(uint32_t num_decoding_tokens,
 
   // padding the batch to the minimum decoding batch size for cuda graph
   // TODO: move the logic to a better place
+  bool padded = false;
   if (num_sequences < min_decoding_bach_size) {
     const uint32_t n_tokens = flatten_tokens_vec.size();
     // kv_cache is not empty in decoding phase
@@ -224,6 +960,7 @@ ModelInput Batch::prepare_model_input(uint32_t num_decoding_tokens,
         q_max_seq_len == num_decoding_tokens &&
         n_tokens == num_sequences * num_decoding_tokens;
     if (same_num_decoding_tokens) {
+      padded = true;
       // add padding tokens to the batch
       for (int32_t i = num_sequences; i < min_decoding_bach_size; ++i) {
         for (int32_t k = 0; k < num_decoding_tokens; ++k) {
@@ -231,6 +968,9 @@ ModelInput Batch::prepare_model_input(uint32_t num_decoding_tokens,
           flatten_positions_vec.push_back(0);
           new_token_slot_ids.push_back(0);
           block_tables.push_back(0);
+          if (has_tree) {
+            tree_mask_vec.push_back(-1);
+          }
         }
         cu_seq_lens.push_back(cu_seq_lens.back() + num_decoding_tokens);
         q_cu_seq_lens.push_back(q_cu_seq_lens.back() + num_decoding_tokens);
@@ -240,19 +980,114 @@ ModelInput Batch::prepare_model_input(uint32_t num_decoding_tokens,
   }
 
   ModelInput model_inputs;
-  model_inputs.token_ids = torch::tensor(flatten_tokens_vec, torch::kInt);
-  model_inputs.positions = torch::tensor(flatten_positions_vec, torch::kInt);
+  model_inputs.token_ids = to_tensor(flatten_tokens_vec, torch::kInt, arena);
+  model_inputs.positions = to_tensor(flatten_positions_vec, torch::kInt, arena);
+  if (has_lora) {
+    // padding tokens run without adapter
+    lora_slots_vec.resize(flatten_tokens_vec.size(), -1);
+    model_inputs.lora_slots = to_tensor(lora_slots_vec, torch::kInt, arena);
+  }
+  if (!image_hashes.empty()) {
+    model_inputs.image_hashes = std::move(image_hashes);
+    model_inputs.image_pixel_values = std::move(image_pixel_values);
+    model_inputs.image_token_rows =
+        to_tensor(image_token_rows, torch::kInt, arena).view({-1, 3});
+  }
 
   auto& input_params = model_inputs.input_params;
   input_params.num_sequences = num_sequences;
   input_params.kv_max_seq_len = max_seq_len;
   input_params.q_max_seq_len = q_max_seq_len;
-  input_params.kv_cu_seq_lens = torch::tensor(cu_seq_lens, torch::kInt);
-  input_params.q_cu_seq_lens = torch::tensor(q_cu_seq_lens, torch::kInt);
-  input_params.new_cache_slots = torch::tensor(new_token_slot_ids, torch::kInt);
+  input_params.kv_cu_seq_lens = to_tensor(cu_seq_lens, torch::kInt, arena);
+  input_params.q_cu_seq_lens = to_tensor(q_cu_seq_lens, torch::kInt, arena);
+  input_params.new_cache_slots =
+      to_tensor(new_token_slot_ids, torch::kInt, arena);
+  if (has_tree) {
+    input_params.tree_mask = to_tensor(tree_mask_vec, torch::kLong, arena);
+    // the leaves are only verified once
+    tree_leaves_.clear();
+  }
+
+  if (block_tables_cache != nullptr) {
+    // only send the blocks appended since last step, and point each sequence
+    // to its row. padding sequences point to the reserved empty row 0.
+    std::vector<int32_t> rows;
+    std::vector<int32_t> updates;
+    block_tables_cache->update(scheduled_sequences, &rows, &updates);
+    const int64_t width = block_tables_cache->width();
+    const size_t n_seqs = cu_seq_lens.size() - 1;
+    cu_block_lens.clear();
+    cu_block_lens.reserve(n_seqs + 1);
+    for (size_t i = 0; i < n_seqs; ++i) {
+      const int32_t row = i < rows.size() ? rows[i] : 0;
+      cu_block_lens.push_back(static_cast<int32_t>(row * width));
+    }
+    cu_block_lens.push_back(
+        static_cast<int32_t>(block_tables_cache->num_rows() * width));
+    input_params.cu_block_lens = to_tensor(cu_block_lens, torch::kInt, arena);
+    if (!updates.empty()) {
+      model_inputs.block_table_updates =
+          to_tensor(updates, torch::kInt, arena).view({-1, 3});
+    }
+    model_inputs.block_table_rows = block_tables_cache->num_rows();
+    model_inputs.block_table_width = width;
+    input_params.block_table_width = static_cast<int32_t>(width);
+  } else {
+    input_params.block_tables = to_tensor(block_tables, torch::kInt, arena);
+    input_params.cu_block_lens = to_tensor(cu_block_lens, torch::kInt, arena);
+  }
+
+  // cascade attention is not used for padded batches or multi-step decoding,
+  // which advances the kv lengths on device.
+  if (min_cascade_prefix_len > 0 && !padded && num_decode_steps == 1) {
+    set_prefix_groups(scheduled_sequences,
+                      q_cu_seq_lens,
+                      cu_seq_lens,
+                      cu_block_lens,
+                      min_cascade_prefix_len,
+                      arena,
+                      &input_params);
+  }
+
+  if (num_decode_steps > 1 && engine_type_ == EngineType::SSM) {
+    // the probs of the draft tokens are needed for the validation
+    model_inputs.num_decode_steps = num_decode_steps;
+    model_inputs.return_probs = true;
+  } else if (num_decode_steps > 1) {
+    model_inputs.num_decode_steps = num_decode_steps;
+    pad_2d_vector(stop_token_ids_vec, /*pad_value=*/-1);
+    model_inputs.stop_token_ids = create_2d_tensor(stop_token_ids_vec,
+                                                   torch::kInt);
+    model_inputs.num_remaining_tokens =
+        to_tensor(num_remaining_tokens_vec, torch::kInt, arena);
+  }
 
-  input_params.block_tables = torch::tensor(block_tables, torch::kInt);
-  input_params.cu_block_lens = torch::tensor(cu_block_lens, torch::kInt);
+  // only issue the block copies once for the batch
+  if (!swap_out_blocks_.empty()) {
+    model_inputs.swap_out_blocks =
+        to_tensor(swap_out_blocks_, torch::kInt, arena).view({-1, 2});
+    swap_out_blocks_.clear();
+  }
+  if (!swap_in_blocks_.empty()) {
+    model_inputs.swap_in_blocks =
+        to_tensor(swap_in_blocks_, torch::kInt, arena).view({-1, 2});
+    swap_in_blocks_.clear();
+  }
+  if (!copy_blocks_.empty()) {
+    model_inputs.copy_blocks =
+        to_tensor(copy_blocks_, torch::kInt, arena).view({-1, 2});
+    copy_blocks_.clear();
+  }
+  if (!shared_out_blocks_.empty()) {
+    model_inputs.shared_out_blocks =
+        to_tensor(shared_out_blocks_, torch::kInt, arena).view({-1, 2});
+    shared_out_blocks_.clear();
+  }
+  if (!shared_in_blocks_.empty()) {
+    model_inputs.shared_in_blocks =
+        to_tensor(shared_in_blocks_, torch::kInt, arena).view({-1, 2});
+    shared_in_blocks_.clear();
+  }
 
   CHECK_EQ(sampling_params.size(), selected_token_idxes.size());
   if (!selected_token_idxes.empty()) {
@@ -264,108 +1099,210 @@ ModelInput Batch::prepare_model_input(uint32_t num_decoding_tokens,
                                       unique_token_ids_vec,
                                       unique_token_counts_vec,
                                       unique_token_lens_vec);
+    if (has_grammar) {
+      model_inputs.sampling_params.token_bitmask =
+          create_token_bitmask(constrained_sequences, arena);
+    }
+    if (has_seed) {
+      model_inputs.sampling_params.rng_seeds =
+          to_tensor(rng_seeds, torch::kLong, arena);
+      model_inputs.sampling_params.rng_offsets =
+          to_tensor(rng_offsets, torch::kLong, arena);
+    }
+    if (persistent_token_counts) {
+      set_token_counts(token_count_sequences,
+                       num_decode_steps,
+                       token_counts_cache,
+                       arena,
+                       &model_inputs);
+    } else if (token_counts_cache != nullptr) {
+      // the rows are not updated with the tokens sampled by this step
+      token_counts_cache->clear();
+    }
+  }
+  if (!scored_token_idxes.empty()) {
+    model_inputs.sampling_params.scored_token_idxes =
+        to_tensor(scored_token_idxes, torch::kInt, arena);
+    model_inputs.sampling_params.scored_token_ids =
+        to_tensor(scored_token_ids, torch::kLong, arena);
+  }
+  if (!observed_prompts_.empty()) {
+    // padded in front for the observed tokens, and behind for the kv cache
+    size_t window = 0;
+    for (const auto& q_idxes : kv_score_q_idxes) {
+      window = std::max(window, q_idxes.size());
+    }
+    for (auto& q_idxes : kv_score_q_idxes) {
+      q_idxes.insert(q_idxes.begin(), window - q_idxes.size(), -1);
+    }
+    pad_2d_vector(kv_score_slots, /*pad_value=*/-1);
+    input_params.kv_score_q_idxes =
+        create_2d_tensor(kv_score_q_idxes, torch::kInt);
+    input_params.kv_score_slots = create_2d_tensor(kv_score_slots, torch::kInt);
+  }
+  if (!offload_kv_lens.empty()) {
+    pad_2d_vector(offload_q_idxes, /*pad_value=*/-1);
+    pad_2d_vector(offload_device_blocks, /*pad_value=*/-1);
+    pad_2d_vector(offload_host_blocks, /*pad_value=*/-1);
+    input_params.offload_q_idxes =
+        create_2d_tensor(offload_q_idxes, torch::kInt);
+    input_params.offload_device_blocks =
+        create_2d_tensor(offload_device_blocks, torch::kInt);
+    input_params.offload_host_blocks =
+        create_2d_tensor(offload_host_blocks, torch::kInt);
+    input_params.offload_kv_lens =
+        to_tensor(offload_kv_lens, torch::kInt, arena);
+  }
+  if (!pooled_token_idxes.empty()) {
+    model_inputs.sampling_params.pooled_token_idxes =
+        to_tensor(pooled_token_idxes, torch::kInt, arena);
+    model_inputs.sampling_params.pooled_embedding_idxes =
+        to_tensor(pooled_embedding_idxes, torch::kLong, arena);
+    model_inputs.sampling_params.num_embeddings =
+        static_cast<int64_t>(pooled_prompts_.size());
   }
 
   return model_inputs;
 }
 
 void Batch::process_sample_output(const SampleOutput& sample_output) {
-  // [num_seq] LongTensor
-  const auto& next_tokens = safe_to(sample_output.next_tokens, torch::kCPU);
-  // it is possible that the model output is empty for prefill sequences
-  if (next_tokens.defined()) {
-    // [num_seq] FloatTensor
-    const auto& logprobs = safe_to(sample_output.logprobs, torch::kCPU);
-    // [num_seq, topk] LongTensor
-    const auto& top_tokens = safe_to(sample_output.top_tokens, torch::kCPU);
-    // [num_seq, topk] FloatTensor
-    const auto& top_logprobs = safe_to(sample_output.top_logprobs, torch::kCPU);
-
-    const int64_t num_seqs = next_tokens.size(0);
-    int64_t output_idx = 0;
-    for (auto* seq : sequences_) {
-      if (seq->is_prefill_stage()) {
-        // no sampling for prefill sequences
-        continue;
+  TRACE_SCOPE("process_sample_output");
+  if (!scored_prompts_.empty()) {
+    // [num_scored_tokens] FloatTensor
+    auto scored_logprobs = safe_to(sample_output.scored_logprobs, torch::kCPU);
+    CHECK(scored_logprobs.defined()) << "no logprobs for the scored prompts";
+    scored_logprobs = scored_logprobs.to(torch::kFloat32).contiguous();
+    const auto* data = scored_logprobs.data_ptr<float>();
+    size_t offset = 0;
+    for (const auto& scored : scored_prompts_) {
+      scored.sequence->set_prompt_logprobs(
+          scored.start, Slice<float>(data + offset, scored.count));
+      offset += scored.count;
+    }
+    CHECK_EQ(offset, scored_logprobs.numel());
+    scored_prompts_.clear();
+  }
+  if (!pooled_prompts_.empty()) {
+    // [num_embeddings, hidden_size] FloatTensor
+    auto pooled = safe_to(sample_output.pooled_hidden_states, torch::kCPU);
+    CHECK(pooled.defined()) << "no hidden states for the embeddings";
+    CHECK_EQ(pooled.size(0), pooled_prompts_.size());
+    pooled = pooled.to(torch::kFloat32).contiguous();
+    const auto* data = pooled.data_ptr<float>();
+    const size_t hidden_size = pooled.size(1);
+    for (size_t i = 0; i < pooled_prompts_.size(); ++i) {
+      const auto& prompt = pooled_prompts_[i];
+      prompt.sequence->add_pooled_hidden_states(
+          prompt.start,
+          prompt.end,
+          Slice<float>(data + i * hidden_size, hidden_size));
+    }
+    pooled_prompts_.clear();
+  }
+  if (!observed_prompts_.empty()) {
+    // [n_observed, max_kv_len] FloatTensor
+    auto kv_scores = safe_to(sample_output.kv_scores, torch::kCPU);
+    if (kv_scores.defined()) {
+      CHECK_EQ(kv_scores.size(0), observed_prompts_.size());
+      kv_scores = kv_scores.to(torch::kFloat32).contiguous();
+      const auto* data = kv_scores.data_ptr<float>();
+      const size_t max_kv_len = kv_scores.size(1);
+      for (size_t i = 0; i < observed_prompts_.size(); ++i) {
+        const auto& prompt = observed_prompts_[i];
+        const size_t block_size = prompt.sequence->blocks()[0].size();
+        // sum the scores of the tokens of each block
+        std::vector<float> block_scores(
+            (prompt.kv_len + block_size - 1) / block_size, 0.0f);
+        for (size_t k = 0; k < prompt.kv_len; ++k) {
+          block_scores[k / block_size] += data[i * max_kv_len + k];
+        }
+        prompt.sequence->set_kv_block_scores(std::move(block_scores));
       }
-      CHECK_LT(output_idx, num_seqs);
-
-      const auto curr_idx = output_idx++;
-      const auto token = build_token(
-          curr_idx, next_tokens, logprobs, top_tokens, top_logprobs);
+    }
+    observed_prompts_.clear();
+  }
 
+  // it is possible that the model output is empty for prefill sequences
+  if (!sample_output.next_tokens.defined()) {
+    return;
+  }
+  const HostSampleOutput output(sample_output);
+  int64_t output_idx = 0;
+  for (auto* seq : sequences_) {
+    if (seq->is_prefill_stage() || seq->is_embedding()) {
+      // no sampling for prefill sequences and embeddings
+      continue;
+    }
+    CHECK_LT(output_idx, output.num_seqs);
+    const auto curr_idx = output_idx++;
+    if (!output.multi_step) {
       // add the next token to sequence
-      seq->append_token(token);
+      seq->append_token(output.token(curr_idx, /*step=*/0));
+      continue;
+    }
+
+    // multi-step decoding: [num_seq, num_steps]
+    size_t num_appended = 0;
+    for (int64_t j = 0; j < output.num_steps; ++j) {
+      // discard tokens generated after the sequence finishes, the draft
+      // tokens are kept for the validation.
+      if (seq->is_finished() && engine_type_ != EngineType::SSM) {
+        break;
+      }
+      seq->append_token(output.token(curr_idx, j));
+      ++num_appended;
+    }
+    // the kv cache holds all generated tokens except the last one
+    if (num_appended > 1) {
+      seq->commit_kv_cache(/*size=*/num_appended - 1);
     }
-    CHECK_EQ(output_idx, num_seqs);
   }
+  CHECK_EQ(output_idx, output.num_seqs);
 }
 
-void Batch::process_validate_output(const SampleOutput& sample_output) {
-  // [num_seq, num_tokens] LongTensor
-  const auto& next_tokens = safe_to(sample_output.next_tokens, torch::kCPU);
+void Batch::process_validate_output(const SampleOutput& sample_output,
+                                    const torch::Tensor& tree_bonus_token_ids) {
   // it is possible that the model output is empty for prefill sequences
-  if (next_tokens.defined()) {
-    // [num_seq, num_tokens] FloatTensor
-    const auto& logprobs = safe_to(sample_output.logprobs, torch::kCPU);
-    // [num_seq, num_tokens, topk] LongTensor
-    const auto& top_tokens = safe_to(sample_output.top_tokens, torch::kCPU);
-    // [num_seq, num_tokens, topk] FloatTensor
-    const auto& top_logprobs = safe_to(sample_output.top_logprobs, torch::kCPU);
-    const int64_t num_seqs = next_tokens.size(0);
-    int64_t output_idx = 0;
-    for (auto* seq : sequences_) {
-      if (seq->is_prefill_stage()) {
-        // no sampling for prefill sequences
-        continue;
-      }
-      CHECK_LT(output_idx, num_seqs);
-      const auto curr_idx = output_idx++;
-      const auto curr_next_tokens = next_tokens[curr_idx];
-      const auto curr_logprobs =
-          logprobs.defined() ? logprobs[curr_idx] : logprobs;
-      const auto curr_top_tokens =
-          top_tokens.defined() ? top_tokens[curr_idx] : top_tokens;
-      const auto curr_top_logprobs =
-          top_logprobs.defined() ? top_logprobs[curr_idx] : top_logprobs;
-
-      const int64_t num_tokens = curr_next_tokens.size(0);
-      std::vector<Token> tokens;
-      tokens.reserve(num_tokens);
-      for (int64_t i = 0; i < num_tokens; ++i) {
-        const auto token = build_token(i,
-                                       curr_next_tokens,
-                                       curr_logprobs,
-                                       curr_top_tokens,
-                                       curr_top_logprobs);
-        tokens.push_back(token);
-      }
+  if (!sample_output.next_tokens.defined()) {
+    return;
+  }
+  // [num_seq, num_tokens]
+  const HostSampleOutput output(sample_output);
+  // [num_seq] LongTensor
+  torch::Tensor tree_bonus_tokens;
+  if (tree_bonus_token_ids.defined()) {
+    tree_bonus_tokens =
+        tree_bonus_token_ids.to(torch::kCPU, torch::kLong).contiguous();
+  }
+  std::vector<Token> tokens;
+  int64_t output_idx = 0;
+  for (auto* seq : sequences_) {
+    if (seq->is_prefill_stage()) {
+      // no sampling for prefill sequences
+      continue;
+    }
+    CHECK_LT(output_idx, output.num_seqs);
+    const auto curr_idx = output_idx++;
 
-      // validate the draft tokens with accepted tokens
-      auto num_accepted_tokens = seq->validate_tokens(tokens);
-      COUNTER_ADD(num_accepted_tokens_total, num_accepted_tokens);
+    tokens.clear();
+    for (int64_t i = 0; i < output.num_steps; ++i) {
+      tokens.push_back(output.token(curr_idx, i));
     }
-    CHECK_EQ(output_idx, num_seqs);
-  }
-}
 
-Token Batch::build_token(int64_t index,
-                         torch::Tensor token_ids,
-                         torch::Tensor logprobs,
-                         torch::Tensor top_tokens,
-                         torch::Tensor top_logprobs) {
-  Token token(token_ids[index].item<int64_t>());
-  if (logprobs.defined()) {
-    token.logprob = logprobs[index].item<float>();
-    if (top_tokens.defined() && top_logprobs.defined()) {
-      auto topk_tokens = top_tokens[index];
-      auto topk_logprobs = top_logprobs[index];
-      const size_t size = topk_tokens.numel();
-      token.top_tokens = {topk_tokens.const_data_ptr<int64_t>(), size};
-      token.top_logprobs = {topk_logprobs.const_data_ptr<float>(), size};
-    }
-  }
-  return token;
+    // validate the draft tokens with accepted tokens
+    auto num_accepted_tokens = seq->validate_tokens(tokens);
+    if (tree_bonus_tokens.defined()) {
+      // the last accepted token matches a tree leaf, append the token
+      // sampled after the leaf. the kv cache of the leaf is recomputed.
+      const int64_t bonus = tree_bonus_tokens.data_ptr<int64_t>()[curr_idx];
+      if (bonus >= 0 && !seq->is_finished()) {
+        seq->append_token(bonus);
+        ++num_accepted_tokens;
+      }
+    }
+    COUNTER_ADD(num_accepted_tokens_total, num_accepted_tokens);
+  }
+  CHECK_EQ(output_idx, output.num_seqs);
 }
 
 }  // namespace llm
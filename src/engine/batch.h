@@ -2,11 +2,16 @@
 
 #include <torch/torch.h>
 
+#include <cstdint>
+#include <functional>
 #include <limits>
 #include <vector>
 
+#include "block_tables.h"
+#include "host_arena.h"
 #include "parameters.h"
 #include "request/sequence.h"
+#include "token_counts.h"
 
 namespace llm {
 
@@ -36,6 +41,9 @@ class Batch {
   size_t size() const { return sequences_.size(); }
   bool empty() const { return sequences_.empty(); }
 
+  // max number of tokens to process for the i-th sequence
+  uint32_t token_budget(size_t i) const { return token_budgets_[i]; }
+
   // clear the batch for reuse
   void clear();
   void reset() { clear(); }
@@ -43,26 +51,100 @@ class Batch {
   // index operator
   // TODO: remove this operator once refactoring is done
   Sequence* operator[](size_t i) { return sequences_[i]; }
+  const Sequence* operator[](size_t i) const { return sequences_[i]; }
 
   // prepare inputs for the batch, a stateful operation
+  // block_tables: persistent block tables to update incrementally, the full
+  // block tables are built for each batch if not provided.
+  // num_decode_steps: max number of decode steps to run on device, only used
+  // when all sequences are decoding and have kv cache slots reserved.
+  // min_cascade_prefix_len: min number of kv tokens shared by consecutive
+  // sequences to group them for cascade attention, 0 to disable.
+  // token_counts: persistent token counts for the penalties, the unique tokens
+  // of each sequence are built for each batch if not provided.
+  // host_arena: per-step arena for the host tensors, allocated one by one if
+  // not provided.
   ModelInput prepare_model_input(uint32_t num_decoding_tokens,
-                                 uint32_t min_decoding_bach_size);
+                                 uint32_t min_decoding_bach_size,
+                                 BlockTables* block_tables = nullptr,
+                                 uint32_t num_decode_steps = 1,
+                                 uint32_t min_cascade_prefix_len = 0,
+                                 TokenCounts* token_counts = nullptr,
+                                 HostArena* host_arena = nullptr);
 
   // process the sample output for each sequence
+  // for multi-step decoding, tokens are [num_seq, num_steps] and the tokens
+  // generated after the sequence finishes are discarded, except for the
+  // draft tokens.
   void process_sample_output(const SampleOutput& sample_output);
 
   // process the accepted output for each sequence
-  void process_validate_output(const SampleOutput& sample_output);
-
-  // set the engine type for the batch
+  // tree_bonus_token_ids: [num_seq] LongTensor, the token sampled after the
+  // accepted tree leaf, -1 if no leaf is accepted. undefined if not used.
+  void process_validate_output(const SampleOutput& sample_output,
+                               const torch::Tensor& tree_bonus_token_ids = {});
+
+  // set the engine type for the batch. the tokens sampled for the ssm engine
+  // are draft tokens: multi-step decoding runs all steps without stopping at
+  // the end of sequences and keeps the probs of each step.
   void set_engine_type(EngineType engine_type);
 
+  // set kv cache blocks to swap before running the model, flattened as
+  // [src_block_id, dst_block_id] pairs.
+  void set_swap_blocks(std::vector<int32_t> swap_out_blocks,
+                       std::vector<int32_t> swap_in_blocks);
+
+  // set device kv cache blocks to copy before running the model, flattened
+  // as [src_block_id, dst_block_id] pairs.
+  void set_copy_blocks(std::vector<int32_t> copy_blocks);
+
+  // set kv cache blocks to copy to and from the pool shared with other
+  // processes before running the model, flattened as [device_block_id, slot]
+  // and [slot, device_block_id] pairs.
+  void set_shared_blocks(std::vector<int32_t> shared_out_blocks,
+                         std::vector<int32_t> shared_in_blocks);
+
+  // set leaves of the token tree to verify with the draft tokens, each leaf
+  // is an alternative of the draft token at its depth and is appended after
+  // the draft tokens, which are the last tokens of the sequence. for each
+  // sequence, the leaves are flattened as [n_draft_tokens, n_leaves_per_depth],
+  // empty if no leaves.
+  void set_tree_leaves(std::vector<std::vector<int32_t>> tree_leaves,
+                       uint32_t n_leaves_per_depth);
+
+  // only fill the kv cache without sampling any token, e.g. to keep the kv
+  // cache of the draft model in sync while speculation is off.
+  void set_skip_sampling(bool skip_sampling);
+
+  // select all tokens after the prompt for the logits, e.g. to verify the
+  // draft tokens of speculative decoding. only the last token of each
+  // sequence is selected for sampling otherwise.
+  void set_select_all_tokens(bool select_all_tokens);
+
+  // set the device slots of the lora adapters, indexed by the lora id of the
+  // sequences, -1 if the adapter is not on devices.
+  void set_lora_slots(std::vector<int32_t> lora_slots);
+
+  // split the sequences into at most n_batches micro-batches of consecutive
+  // sequences with their token budgets, e.g. to keep pipeline stages busy.
+  // the pending kv cache block swaps and copies go with the first one.
+  std::vector<Batch> split(size_t n_batches) const;
+
+  // split the decoding sequences from the ones in the prefill stage, e.g. to
+  // run them concurrently on separate streams. returns false if the batch is
+  // not mixed, has a token tree or pending kv cache block swaps and copies.
+  bool split_decode_prefill(Batch* decode, Batch* prefill) const;
+
+  // reorder the sequences with their token budgets by the key of each
+  // sequence, keeping the order of the sequences with equal keys, e.g. to
+  // group the sequences of each data parallel attention group. should be
+  // called before the inputs are prepared, without a token tree.
+  void stable_sort(const std::function<int32_t(const Sequence&)>& key);
+
  private:
-  static Token build_token(int64_t index,
-                           torch::Tensor token_ids,
-                           torch::Tensor logprobs,
-                           torch::Tensor top_tokens,
-                           torch::Tensor top_logprobs);
+  // copy the options of the batch except the sequences and the blocks
+  void copy_options_to(Batch* batch) const;
+
   // sequences in the batch
   std::vector<Sequence*> sequences_;
 
@@ -72,6 +154,60 @@ class Batch {
 
   // number of used budget for each sequence
   std::vector<uint32_t> budget_used_;
+
+  // pending kv cache block copies between device and host
+  std::vector<int32_t> swap_out_blocks_;
+  std::vector<int32_t> swap_in_blocks_;
+
+  // pending kv cache block copies on device
+  std::vector<int32_t> copy_blocks_;
+
+  // pending kv cache block copies to and from the shared pool
+  std::vector<int32_t> shared_out_blocks_;
+  std::vector<int32_t> shared_in_blocks_;
+
+  // pending tree leaves for each sequence
+  std::vector<std::vector<int32_t>> tree_leaves_;
+  uint32_t n_leaves_per_depth_ = 0;
+
+  // the engine to run the batch
+  EngineType engine_type_ = EngineType::LLM;
+
+  // whether to skip sampling for the next model input
+  bool skip_sampling_ = false;
+
+  // whether to select all tokens after the prompt for the next model input
+  bool select_all_tokens_ = false;
+
+  // device slots of the lora adapters indexed by lora id
+  std::vector<int32_t> lora_slots_;
+
+  // the prompt tokens scored by the last model input of each sequence
+  struct ScoredPrompt {
+    Sequence* sequence = nullptr;
+    // the index of the first scored prompt token
+    size_t start = 0;
+    // the number of scored prompt tokens
+    size_t count = 0;
+  };
+  std::vector<ScoredPrompt> scored_prompts_;
+
+  // the prompt tokens [start, end) pooled into the embedding of each sequence
+  // by the last model input
+  struct PooledPrompt {
+    Sequence* sequence = nullptr;
+    size_t start = 0;
+    size_t end = 0;
+  };
+  std::vector<PooledPrompt> pooled_prompts_;
+
+  // the sequences whose attention over the first kv_len tokens of the kv
+  // cache is observed by the last model input
+  struct ObservedPrompt {
+    Sequence* sequence = nullptr;
+    size_t kv_len = 0;
+  };
+  std::vector<ObservedPrompt> observed_prompts_;
 };
 
 }  // namespace llm
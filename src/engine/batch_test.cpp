@@ -4,11 +4,17 @@
 #include <gtest/gtest.h>
 
 #include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
 
+#include "grammar/token_grammar.h"
 #include "memory/block.h"
 #include "memory/block_allocator.h"
+#include "request/image_input.h"
 #include "request/stopping_criteria.h"
 #include "sampling/parameters.h"
+#include "utils.h"
 
 namespace llm {
 
@@ -136,4 +142,563 @@ TEST(BatchTest, Basic) {
   // clang-format on
 }
 
+TEST(BatchTest, MultiStepDecode) {
+  const int32_t n_blocks = 20;
+  const int32_t block_size = 4;
+
+  BlockAllocator allocator(n_blocks, block_size);
+  // reserve block 0
+  auto block_0 = allocator.allocate();
+
+  Sequence::Options options;
+  options.stopping_criteria.max_tokens = 20;
+  options.stopping_criteria.eos_token_id = 300;
+  const size_t capacity = 100;
+
+  // sequence in prefill phase
+  Sequence seq1(/*token_ids=*/{1, 3, 5, 7, 5, 4, 3, 2, 1}, capacity, options);
+  seq1.append_blocks(allocator.allocate(3));  // [1, 2, 3]
+
+  // seq in decode phase with slots for 9 decode steps
+  Sequence seq2(/*token_ids=*/{2, 4, 6, 8, 6, 4, 2}, capacity, options);
+  seq2.append_blocks(allocator.allocate(4));  // [4, 5, 6, 7]
+  seq2.commit_kv_cache(/*size=*/7);
+  seq2.append_token(100);
+
+  // seq in decode phase with slots for 5 decode steps
+  Sequence seq3(
+      /*token_ids=*/{1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19},
+      capacity,
+      options);
+  seq3.append_blocks(allocator.allocate(5));  // [8, 9, 10, 11, 12]
+  seq3.commit_kv_cache(/*size=*/15);
+  seq3.append_token(200);
+
+  // single step for batches with prefill sequences
+  Batch prefill_batch({&seq1});
+  ModelInput model_input =
+      prefill_batch.prepare_model_input(/*num_decoding_tokens=*/1,
+                                        /*min_decoding_bach_size=*/0,
+                                        /*block_tables=*/nullptr,
+                                        /*num_decode_steps=*/4);
+  EXPECT_EQ(model_input.num_decode_steps, 1);
+  EXPECT_FALSE(model_input.stop_token_ids.defined());
+
+  Batch batch({&seq2, &seq3});
+  model_input = batch.prepare_model_input(/*num_decoding_tokens=*/1,
+                                          /*min_decoding_bach_size=*/0,
+                                          /*block_tables=*/nullptr,
+                                          /*num_decode_steps=*/8);
+  // limited by the kv cache slots of seq3
+  EXPECT_EQ(model_input.num_decode_steps, 5);
+  EXPECT_TRUE(
+      equal(model_input.stop_token_ids, std::vector<int32_t>{300, 300}));
+  EXPECT_TRUE(
+      equal(model_input.num_remaining_tokens, std::vector<int32_t>{19, 19}));
+
+  // seq3 stops at the eos token, the following tokens are discarded
+  SampleOutput sample_output;
+  sample_output.next_tokens = torch::tensor(
+      {{101, 102, 103, 104, 105}, {201, 300, 202, 203, 204}}, torch::kLong);
+  batch.process_sample_output(sample_output);
+
+  EXPECT_EQ(seq2.num_tokens(), 13);
+  EXPECT_EQ(seq2.num_kv_cache_tokens(), 12);
+  EXPECT_FALSE(seq2.is_finished());
+  EXPECT_EQ(seq3.num_tokens(), 18);
+  EXPECT_EQ(seq3.num_kv_cache_tokens(), 17);
+  EXPECT_TRUE(seq3.is_finished());
+}
+
+TEST(BatchTest, MultiStepDraft) {
+  const int32_t block_size = 4;
+  BlockAllocator allocator(/*n_blocks=*/10, block_size);
+  // reserve block 0
+  auto block_0 = allocator.allocate();
+
+  Sequence::Options options;
+  options.stopping_criteria.max_tokens = 20;
+  options.stopping_criteria.eos_token_id = 300;
+
+  // seq in decode phase with slots for 4 decode steps
+  Sequence seq(/*token_ids=*/{2, 4, 6, 8, 6}, /*capacity=*/100, options);
+  seq.append_blocks(allocator.allocate(2));  // [1, 2]
+  for (auto engine_type : {EngineType::LLM, EngineType::SSM}) {
+    seq.set_engine_type(engine_type);
+    seq.commit_kv_cache(/*size=*/5);
+  }
+  seq.append_token(100);
+
+  Batch batch({&seq});
+  batch.set_engine_type(EngineType::SSM);
+  ModelInput model_input =
+      batch.prepare_model_input(/*num_decoding_tokens=*/1,
+                                /*min_decoding_bach_size=*/0,
+                                /*block_tables=*/nullptr,
+                                /*num_decode_steps=*/8);
+  // the draft tokens run all steps with the probs
+  EXPECT_EQ(model_input.num_decode_steps, 3);
+  EXPECT_TRUE(model_input.return_probs);
+  EXPECT_FALSE(model_input.stop_token_ids.defined());
+  EXPECT_FALSE(model_input.num_remaining_tokens.defined());
+
+  // the draft tokens after the eos token are kept
+  SampleOutput sample_output;
+  sample_output.next_tokens = torch::tensor({{300, 101, 102}}, torch::kLong);
+  batch.process_sample_output(sample_output);
+  EXPECT_EQ(seq.num_tokens(), 9);
+  EXPECT_EQ(seq.num_kv_cache_tokens(EngineType::SSM), 8);
+  EXPECT_EQ(seq.num_kv_cache_tokens(EngineType::LLM), 5);
+}
+
+TEST(BatchTest, SampleOutputLogprobs) {
+  Sequence::Options options;
+  options.stopping_criteria.max_tokens = 20;
+  options.sampling_param.logprobs = true;
+  options.sampling_param.top_logprobs = 2;
+  Sequence seq1(/*token_ids=*/{1, 2, 3}, /*capacity=*/100, options);
+  Sequence seq2(/*token_ids=*/{4, 5}, /*capacity=*/100, options);
+  for (auto* seq : {&seq1, &seq2}) {
+    seq->append_block({/*id=*/0, /*size=*/16});
+    seq->commit_kv_cache(seq->num_tokens());
+  }
+
+  Batch batch({&seq1, &seq2});
+  SampleOutput sample_output;
+  sample_output.next_tokens = torch::tensor({10, 20}, torch::kLong);
+  sample_output.logprobs = torch::tensor({-0.5, -1.5}, torch::kFloat32);
+  sample_output.top_tokens =
+      torch::tensor({{10, 11}, {20, 21}}, torch::kLong);
+  sample_output.top_logprobs =
+      torch::tensor({{-0.5, -2.0}, {-1.5, -2.5}}, torch::kFloat32);
+  batch.process_sample_output(sample_output);
+
+  const Token token1 = seq1.last_token();
+  EXPECT_EQ(token1.id, 10);
+  EXPECT_EQ(token1.logprob, -0.5f);
+  EXPECT_EQ(std::vector<int64_t>(token1.top_tokens),
+            std::vector<int64_t>({10, 11}));
+  EXPECT_EQ(std::vector<float>(token1.top_logprobs),
+            std::vector<float>({-0.5f, -2.0f}));
+
+  const Token token2 = seq2.last_token();
+  EXPECT_EQ(token2.id, 20);
+  EXPECT_EQ(token2.logprob, -1.5f);
+  EXPECT_EQ(std::vector<int64_t>(token2.top_tokens),
+            std::vector<int64_t>({20, 21}));
+  EXPECT_EQ(std::vector<float>(token2.top_logprobs),
+            std::vector<float>({-1.5f, -2.5f}));
+}
+
+TEST(BatchTest, TreeLeaves) {
+  const int32_t n_blocks = 20;
+  const int32_t block_size = 4;
+
+  BlockAllocator allocator(n_blocks, block_size);
+  // reserve block 0
+  auto block_0 = allocator.allocate();
+
+  Sequence::Options options;
+  options.stopping_criteria.max_tokens = 20;
+  const size_t capacity = 100;
+
+  // seq in decode phase with two draft tokens
+  Sequence seq(/*token_ids=*/{2, 4, 6, 8, 6, 4, 2}, capacity, options);
+  seq.append_blocks(allocator.allocate(3));  // [1, 2, 3]
+  seq.commit_kv_cache(/*size=*/7);
+  seq.append_token(100);
+  seq.append_token(101);
+  seq.append_token(102);
+
+  // one leaf per depth
+  Batch batch({&seq});
+  batch.set_tree_leaves({{201, 202}}, /*n_leaves_per_depth=*/1);
+  ModelInput model_input = batch.prepare_model_input(
+      /*num_decoding_tokens=*/1, /*min_decoding_bach_size=*/0);
+  // leaves are not committed into kv cache
+  EXPECT_EQ(seq.num_kv_cache_tokens(), 10);
+
+  // clang-format off
+  EXPECT_TRUE(equal(model_input.token_ids,
+                    std::vector<int32_t>{100, 101, 102, 201, 202}));
+  EXPECT_TRUE(equal(model_input.positions,
+                    std::vector<int32_t>{7, 8, 9, 8, 9}));
+  const InputParameters& input_params = model_input.input_params;
+  EXPECT_TRUE(equal(input_params.q_cu_seq_lens, std::vector<int32_t>{0, 5}));
+  EXPECT_TRUE(equal(input_params.kv_cu_seq_lens, std::vector<int32_t>{0, 12}));
+  EXPECT_TRUE(equal(input_params.new_cache_slots,
+                    std::vector<int32_t>{11, 12, 13, 14, 15}));
+  // leaf at depth 1: [100, 201], leaf at depth 2: [100, 101, 202]
+  EXPECT_TRUE(equal(input_params.tree_mask,
+                    std::vector<int64_t>{-1, -1, -1, 0b01001, 0b10011}));
+  // clang-format on
+
+  const auto& sampling_params = model_input.sampling_params;
+  EXPECT_TRUE(equal(sampling_params.selected_token_idxes,
+                    std::vector<int32_t>{0, 1, 2, 3, 4}));
+  EXPECT_TRUE(equal(sampling_params.sample_idxes, std::vector<int32_t>{2}));
+
+  // the bonus token from the target model
+  seq.append_token(103);
+
+  // 102 is rejected and resampled as 202 which matches the leaf at depth 2
+  SampleOutput sample_output;
+  sample_output.next_tokens = torch::tensor({{101, 202, -1}}, torch::kLong);
+  batch.process_validate_output(sample_output,
+                                torch::tensor({400}, torch::kLong));
+  EXPECT_EQ(seq.num_tokens(), 11);
+  EXPECT_EQ(seq.token_ids().back(), 400);
+  EXPECT_EQ(seq.token_ids()[9], 202);
+  // the kv cache of the leaf is recomputed
+  EXPECT_EQ(seq.num_kv_cache_tokens(), 9);
+}
+
+TEST(BatchTest, SkipSampling) {
+  BlockAllocator allocator(/*num_blocks=*/20, /*block_size=*/4);
+  // reserve block 0
+  auto block_0 = allocator.allocate();
+
+  Sequence::Options options;
+  options.stopping_criteria.max_tokens = 20;
+  // seq in decode phase
+  Sequence seq(/*token_ids=*/{2, 4, 6, 8, 6, 4, 2}, /*capacity=*/100, options);
+  seq.append_blocks(allocator.allocate(2));
+  seq.commit_kv_cache(/*size=*/7);
+  seq.append_token(100);
+
+  Batch batch({&seq});
+  batch.set_skip_sampling(true);
+  ModelInput model_input = batch.prepare_model_input(
+      /*num_decoding_tokens=*/1, /*min_decoding_bach_size=*/0);
+
+  // the kv cache is filled without sampling
+  EXPECT_EQ(seq.num_kv_cache_tokens(), 8);
+  EXPECT_TRUE(equal(model_input.token_ids, std::vector<int32_t>{100}));
+  EXPECT_FALSE(model_input.sampling_params.selected_token_idxes.defined());
+}
+
+TEST(BatchTest, SelectSampledTokens) {
+  BlockAllocator allocator(/*num_blocks=*/20, /*block_size=*/4);
+  // reserve block 0
+  auto block_0 = allocator.allocate();
+
+  Sequence::Options options;
+  options.sampling_param.frequency_penalty = 0.1;
+  options.stopping_criteria.max_tokens = 20;
+  // generated tokens are recomputed with the prompt, e.g. after preemption
+  Sequence seq(/*token_ids=*/{2, 4, 6, 8}, /*capacity=*/100, options);
+  seq.append_blocks(allocator.allocate(2));
+  seq.commit_kv_cache(/*size=*/4);
+  seq.append_token(100);
+  seq.commit_kv_cache(/*size=*/1);
+  seq.append_token(4);
+  seq.commit_kv_cache(/*size=*/1);
+  seq.append_token(101);
+  seq.release_blocks();
+  seq.append_blocks(allocator.allocate(2));
+
+  Batch batch({&seq});
+  ModelInput model_input = batch.prepare_model_input(
+      /*num_decoding_tokens=*/1, /*min_decoding_bach_size=*/0);
+  EXPECT_TRUE(equal(model_input.token_ids,
+                    std::vector<int32_t>{2, 4, 6, 8, 100, 4, 101}));
+
+  // only the last token is selected, with the counts of all tokens
+  const auto& sampling_params = model_input.sampling_params;
+  EXPECT_TRUE(equal(sampling_params.selected_token_idxes,
+                    std::vector<int32_t>{6}));
+  EXPECT_TRUE(equal(sampling_params.sample_idxes, std::vector<int32_t>{0}));
+  EXPECT_TRUE(equal(sampling_params.unique_token_ids_lens,
+                    std::vector<int32_t>{6}));
+}
+
+TEST(BatchTest, TokenBitmask) {
+  BlockAllocator allocator(/*num_blocks=*/20, /*block_size=*/4);
+  // reserve block 0
+  auto block_0 = allocator.allocate();
+
+  // tokens: 0 "a", 1 "b", 2 eos, padded to 40 logits
+  auto vocab = std::make_shared<const TokenVocab>(
+      std::vector<std::string>{"a", "b", ""}, /*vocab_size=*/40);
+  auto dfa = RegexDFA::compile("ab", /*error=*/nullptr);
+  ASSERT_NE(dfa, nullptr);
+
+  Sequence::Options options;
+  options.stopping_criteria.max_tokens = 20;
+  options.stopping_criteria.eos_token_id = 2;
+  // unconstrained sequence in decode phase
+  Sequence seq1(/*token_ids=*/{2, 4, 6}, /*capacity=*/100, options);
+  seq1.append_blocks(allocator.allocate(1));
+  seq1.commit_kv_cache(/*size=*/3);
+  seq1.append_token(7);
+  // constrained sequence in decode phase
+  options.grammar = std::make_shared<const TokenGrammar>(std::move(dfa), vocab);
+  Sequence seq2(/*token_ids=*/{3, 5}, /*capacity=*/100, options);
+  seq2.append_blocks(allocator.allocate(1));
+  seq2.commit_kv_cache(/*size=*/2);
+  seq2.append_token(0);
+
+  Batch batch({&seq1, &seq2});
+  ModelInput model_input = batch.prepare_model_input(
+      /*num_decoding_tokens=*/1,
+      /*min_decoding_bach_size=*/0,
+      /*block_tables_cache=*/nullptr,
+      /*num_decode_steps=*/4);
+
+  // constrained sequences run a single step
+  EXPECT_EQ(model_input.num_decode_steps, 1);
+  const auto& bitmask = model_input.sampling_params.token_bitmask;
+  ASSERT_TRUE(bitmask.defined());
+  EXPECT_TRUE(equal(bitmask, std::vector<int32_t>{-1, -1, 0b10, 0}));
+
+  // the unconstrained batch has no bitmask
+  Batch unconstrained({&seq1});
+  model_input = unconstrained.prepare_model_input(
+      /*num_decoding_tokens=*/1, /*min_decoding_bach_size=*/0);
+  EXPECT_FALSE(model_input.sampling_params.token_bitmask.defined());
+}
+
+TEST(BatchTest, CascadePrefixGroups) {
+  BlockAllocator allocator(/*num_blocks=*/20, /*block_size=*/4);
+  // reserve block 0
+  auto block_0 = allocator.allocate();
+  // blocks [1, 2] are shared by seq1 and seq2
+  const auto shared_blocks = allocator.allocate(2);
+
+  Sequence::Options options;
+  options.stopping_criteria.max_tokens = 20;
+  const size_t capacity = 100;
+  // seq in decode phase
+  Sequence seq1(/*token_ids=*/{1, 2, 3, 4, 5, 6, 7, 8, 9}, capacity, options);
+  seq1.set_shared_blocks(std::vector<Block>(shared_blocks));
+  seq1.append_blocks(allocator.allocate(1));  // [1, 2, 3]
+  seq1.commit_kv_cache(/*size=*/1);
+  seq1.append_token(100);
+  // seq in prefill phase
+  Sequence seq2(/*token_ids=*/{1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12},
+                capacity,
+                options);
+  seq2.set_shared_blocks(std::vector<Block>(shared_blocks));
+  seq2.append_blocks(allocator.allocate(1));  // [1, 2, 4]
+  // seq in decode phase without shared blocks
+  Sequence seq3(/*token_ids=*/{2, 4, 6, 8, 6, 4}, capacity, options);
+  seq3.append_blocks(allocator.allocate(2));  // [5, 6]
+  seq3.commit_kv_cache(/*size=*/6);
+  seq3.append_token(200);
+
+  Batch batch({&seq1, &seq2, &seq3});
+  ModelInput model_input =
+      batch.prepare_model_input(/*num_decoding_tokens=*/1,
+                                /*min_decoding_bach_size=*/0,
+                                /*block_tables=*/nullptr,
+                                /*num_decode_steps=*/1,
+                                /*min_cascade_prefix_len=*/8);
+
+  const InputParameters& input_params = model_input.input_params;
+  EXPECT_TRUE(
+      equal(input_params.q_cu_seq_lens, std::vector<int32_t>{0, 1, 5, 6}));
+  EXPECT_TRUE(
+      equal(input_params.kv_cu_seq_lens, std::vector<int32_t>{0, 10, 22, 29}));
+  EXPECT_TRUE(
+      equal(input_params.cu_block_lens, std::vector<int32_t>{0, 3, 6, 8}));
+
+  // group 0: seq1 and seq2 sharing 8 tokens, group 1: seq3
+  EXPECT_EQ(input_params.num_prefix_groups, 2);
+  EXPECT_TRUE(equal(input_params.prefix_q_cu_seq_lens,
+                    std::vector<int32_t>{0, 5, 6}));
+  EXPECT_TRUE(equal(input_params.prefix_kv_cu_seq_lens,
+                    std::vector<int32_t>{0, 8, 8}));
+  EXPECT_TRUE(equal(input_params.prefix_cu_block_lens,
+                    std::vector<int32_t>{0, 6, 8}));
+  EXPECT_EQ(input_params.prefix_q_max_seq_len, 5);
+  EXPECT_EQ(input_params.prefix_kv_max_seq_len, 8);
+
+  // the suffix starts after the shared blocks
+  EXPECT_TRUE(equal(input_params.suffix_kv_cu_seq_lens,
+                    std::vector<int32_t>{0, 2, 6, 13}));
+  EXPECT_TRUE(equal(input_params.suffix_cu_block_lens,
+                    std::vector<int32_t>{2, 5, 6, 8}));
+  EXPECT_EQ(input_params.suffix_kv_max_seq_len, 7);
+}
+
+TEST(BatchTest, Split) {
+  BlockAllocator allocator(/*num_blocks=*/20, /*block_size=*/4);
+  // reserve block 0
+  auto block_0 = allocator.allocate();
+
+  Sequence::Options options;
+  options.stopping_criteria.max_tokens = 20;
+  // seqs in decode phase
+  std::vector<std::unique_ptr<Sequence>> seqs;
+  for (int32_t i = 0; i < 3; ++i) {
+    seqs.push_back(std::make_unique<Sequence>(
+        /*token_ids=*/std::vector<int32_t>{2, 4, 6, 8, 6, 4, 2},
+        /*capacity=*/100,
+        options));
+    seqs.back()->append_blocks(allocator.allocate(2));
+    seqs.back()->commit_kv_cache(/*size=*/7);
+    seqs.back()->append_token(100 + i);
+  }
+
+  Batch batch({seqs[0].get(), seqs[1].get(), seqs[2].get()});
+  batch.set_copy_blocks({1, 7});
+  auto micro_batches = batch.split(/*n_batches=*/2);
+  ASSERT_EQ(micro_batches.size(), 2);
+  EXPECT_EQ(micro_batches[0].size(), 2);
+  EXPECT_EQ(micro_batches[1].size(), 1);
+  EXPECT_EQ(micro_batches[1][0], seqs[2].get());
+
+  // the block copies go with the first micro-batch
+  ModelInput input0 = micro_batches[0].prepare_model_input(
+      /*num_decoding_tokens=*/1, /*min_decoding_bach_size=*/0);
+  ModelInput input1 = micro_batches[1].prepare_model_input(
+      /*num_decoding_tokens=*/1, /*min_decoding_bach_size=*/0);
+  EXPECT_TRUE(equal(input0.token_ids, std::vector<int32_t>{100, 101}));
+  EXPECT_TRUE(equal(input1.token_ids, std::vector<int32_t>{102}));
+  EXPECT_TRUE(input0.copy_blocks.defined());
+  EXPECT_FALSE(input1.copy_blocks.defined());
+
+  // no more micro-batches than sequences
+  EXPECT_EQ(batch.split(/*n_batches=*/8).size(), 3);
+}
+
+TEST(BatchTest, AttentionGroups) {
+  // two data parallel attention groups of 10 blocks, each reserves its first
+  // block for padding
+  BlockAllocator group0(/*num_blocks=*/10, /*block_size=*/4);
+  BlockAllocator group1(/*num_blocks=*/10,
+                        /*block_size=*/4,
+                        /*blocks_per_large_block=*/1,
+                        /*max_blocks=*/0,
+                        /*first_block_id=*/10);
+  auto padding0 = group0.allocate();
+  auto padding1 = group1.allocate();
+  EXPECT_EQ(padding1.id(), 10);
+
+  Sequence::Options options;
+  options.stopping_criteria.max_tokens = 20;
+  // seqs in decode phase, in groups 1, 0 and 1
+  std::vector<std::unique_ptr<Sequence>> seqs;
+  for (int32_t i = 0; i < 3; ++i) {
+    seqs.push_back(std::make_unique<Sequence>(
+        /*token_ids=*/std::vector<int32_t>{2, 4, 6, 8, 6, 4, 2},
+        /*capacity=*/100,
+        options));
+    auto& allocator = i == 1 ? group0 : group1;
+    seqs.back()->append_blocks(allocator.allocate(2));
+    seqs.back()->commit_kv_cache(/*size=*/7);
+    seqs.back()->append_token(100 + i);
+  }
+
+  Batch batch({seqs[0].get(), seqs[1].get(), seqs[2].get()});
+  batch.stable_sort([](const Sequence& sequence) {
+    return sequence.blocks()[0].id() / 10;
+  });
+  EXPECT_EQ(batch[0], seqs[1].get());
+  EXPECT_EQ(batch[1], seqs[0].get());
+  EXPECT_EQ(batch[2], seqs[2].get());
+
+  const int32_t copy_src = seqs[0]->blocks()[1].id();
+  batch.set_copy_blocks({copy_src, copy_src + 1});
+  ModelInput input = batch.prepare_model_input(
+      /*num_decoding_tokens=*/1, /*min_decoding_bach_size=*/0);
+  EXPECT_TRUE(equal(input.token_ids, std::vector<int32_t>{101, 100, 102}));
+
+  split_model_input_for_attention_groups(
+      /*n_groups=*/2, /*n_blocks_per_group=*/10, /*block_size=*/4, &input);
+  ASSERT_EQ(input.dp_input_params.size(), 2);
+  // the local block ids of the kv cache of each group
+  auto local_ids = [](const Sequence& sequence, int32_t first_block) {
+    std::vector<int32_t> ids;
+    for (const auto& block : sequence.blocks()) {
+      ids.push_back(block.id() - first_block);
+    }
+    return ids;
+  };
+  const auto& params0 = input.dp_input_params[0];
+  EXPECT_EQ(params0.num_sequences, 1);
+  EXPECT_EQ(params0.dp_token_offset, 0);
+  EXPECT_EQ(params0.dp_num_tokens, 1);
+  EXPECT_TRUE(equal(params0.q_cu_seq_lens, std::vector<int32_t>{0, 1}));
+  EXPECT_TRUE(equal(params0.kv_cu_seq_lens, std::vector<int32_t>{0, 8}));
+  EXPECT_TRUE(equal(params0.block_tables, local_ids(*seqs[1], 0)));
+  EXPECT_TRUE(equal(params0.new_cache_slots,
+                    std::vector<int32_t>{seqs[1]->blocks()[1].id() * 4 + 3}));
+
+  const auto& params1 = input.dp_input_params[1];
+  EXPECT_EQ(params1.num_sequences, 2);
+  EXPECT_EQ(params1.dp_token_offset, 1);
+  EXPECT_EQ(params1.dp_num_tokens, 2);
+  EXPECT_EQ(params1.q_max_seq_len, 1);
+  EXPECT_EQ(params1.kv_max_seq_len, 8);
+  EXPECT_TRUE(equal(params1.q_cu_seq_lens, std::vector<int32_t>{0, 1, 2}));
+  EXPECT_TRUE(equal(params1.kv_cu_seq_lens, std::vector<int32_t>{0, 8, 16}));
+  EXPECT_TRUE(equal(params1.cu_block_lens, std::vector<int32_t>{0, 2, 4}));
+  auto block_ids = local_ids(*seqs[0], 10);
+  const auto block_ids2 = local_ids(*seqs[2], 10);
+  block_ids.insert(block_ids.end(), block_ids2.begin(), block_ids2.end());
+  EXPECT_TRUE(equal(params1.block_tables, block_ids));
+  EXPECT_TRUE(equal(params1.new_cache_slots,
+                    std::vector<int32_t>{(block_ids[1] * 4) + 3,
+                                         (block_ids[3] * 4) + 3}));
+
+  // the block copies go with their group
+  ASSERT_EQ(input.dp_copy_blocks.size(), 2);
+  EXPECT_FALSE(input.dp_copy_blocks[0].defined());
+  EXPECT_TRUE(equal(input.dp_copy_blocks[1],
+                    std::vector<int32_t>{copy_src - 10, copy_src - 9}));
+}
+
+TEST(BatchTest, ImageTokens) {
+  BlockAllocator allocator(/*num_blocks=*/20, /*block_size=*/4);
+  // reserve block 0
+  auto block_0 = allocator.allocate();
+
+  // two images of 3 tokens each, shared by both sequences
+  Sequence::Options options;
+  options.stopping_criteria.max_tokens = 20;
+  options.images = std::make_shared<const std::vector<ImageInput>>(
+      std::vector<ImageInput>{
+          {torch::zeros({3, 2, 2}), /*hash=*/11, /*offset=*/1, /*n=*/3},
+          {torch::ones({3, 2, 2}), /*hash=*/22, /*offset=*/5, /*n=*/3}});
+  const std::vector<int32_t> token_ids = {1, 9, 9, 9, 2, 9, 9, 9, 3};
+  Sequence seq1(token_ids, /*capacity=*/100, options);
+  seq1.append_blocks(allocator.allocate(3));
+  Sequence seq2(token_ids, /*capacity=*/100, options);
+  seq2.append_blocks(allocator.allocate(3));
+
+  // the first chunks take the rows of the first image, the second image is
+  // listed once to be encoded ahead
+  Batch batch;
+  batch.add(&seq1, /*token_budget=*/4);
+  batch.add(&seq2, /*token_budget=*/4);
+  ModelInput model_input = batch.prepare_model_input(
+      /*num_decoding_tokens=*/1, /*min_decoding_bach_size=*/0);
+  EXPECT_EQ(model_input.image_hashes, (std::vector<uint64_t>{11, 22}));
+  ASSERT_EQ(model_input.image_pixel_values.size(), 2);
+  EXPECT_TRUE(
+      torch::equal(model_input.image_pixel_values[1], torch::ones({3, 2, 2})));
+  // clang-format off
+  EXPECT_TRUE(equal(model_input.image_token_rows, std::vector<int32_t>{
+      /*seq1*/ 1, 0, 0,  2, 0, 1,  3, 0, 2,
+      /*seq2*/ 5, 0, 0,  6, 0, 1,  7, 0, 2}));
+  // clang-format on
+
+  // the first image is in the kv cache
+  Batch next_batch({&seq1});
+  model_input = next_batch.prepare_model_input(
+      /*num_decoding_tokens=*/1, /*min_decoding_bach_size=*/0);
+  EXPECT_EQ(model_input.image_hashes, (std::vector<uint64_t>{22}));
+  EXPECT_TRUE(equal(model_input.image_token_rows,
+                    std::vector<int32_t>{1, 0, 0, 2, 0, 1, 3, 0, 2}));
+
+  // no images once the prompt is processed
+  seq1.append_token(100);
+  Batch decode_batch({&seq1});
+  model_input = decode_batch.prepare_model_input(
+      /*num_decoding_tokens=*/1, /*min_decoding_bach_size=*/0);
+  EXPECT_TRUE(model_input.image_hashes.empty());
+  EXPECT_FALSE(model_input.image_token_rows.defined());
+}
+
 }  // namespace llm
@@ -0,0 +1,89 @@
+#include "block_tables.h"
+
+#include <absl/container/flat_hash_map.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "request/sequence.h"
+
+namespace llm {
+
+BlockTables::BlockTables(int64_t width) : width_(width) {
+  CHECK_GT(width_, 0);
+  // reserve row 0 for padding
+  rows_.emplace_back();
+}
+
+void BlockTables::update(const std::vector<Sequence*>& sequences,
+                         std::vector<int32_t>* rows,
+                         std::vector<int32_t>* updates) {
+  CHECK(rows != nullptr && updates != nullptr);
+  rows->clear();
+  rows->reserve(sequences.size());
+
+  // release rows of sequences that are not in the batch
+  absl::flat_hash_map<int64_t, int32_t> sequence_to_row;
+  sequence_to_row.reserve(sequences.size());
+  for (const Sequence* sequence : sequences) {
+    const auto it = sequence_to_row_.find(sequence->id());
+    if (it != sequence_to_row_.end()) {
+      sequence_to_row.emplace(it->first, it->second);
+      sequence_to_row_.erase(it);
+    }
+  }
+  for (const auto& [sequence_id, row_id] : sequence_to_row_) {
+    rows_[row_id] = Row{};
+    free_rows_.push_back(row_id);
+  }
+  // prefer lower rows to keep the table compact
+  std::sort(free_rows_.begin(), free_rows_.end(), std::greater<>());
+  sequence_to_row_ = std::move(sequence_to_row);
+
+  for (const Sequence* sequence : sequences) {
+    const auto blocks = sequence->blocks();
+    CHECK_LE(blocks.size(), width_) << "too many blocks for the block table";
+
+    int32_t row_id = 0;
+    const auto it = sequence_to_row_.find(sequence->id());
+    if (it != sequence_to_row_.end()) {
+      row_id = it->second;
+    } else {
+      // assign a new row for the sequence
+      if (free_rows_.empty()) {
+        row_id = static_cast<int32_t>(rows_.size());
+        rows_.emplace_back();
+      } else {
+        row_id = free_rows_.back();
+        free_rows_.pop_back();
+      }
+      sequence_to_row_[sequence->id()] = row_id;
+      rows_[row_id].sequence_id = sequence->id();
+    }
+    rows->push_back(row_id);
+
+    Row& row = rows_[row_id];
+    // blocks are only appended while the sequence keeps running, re-upload
+    // the whole row if blocks have been released, evicted or reallocated.
+    if (blocks.size() < row.num_blocks ||
+        sequence->num_evicted_tokens() != row.num_evicted_tokens ||
+        (!blocks.empty() && blocks[0].id() != row.first_block_id)) {
+      row.num_blocks = 0;
+    }
+    for (size_t col = row.num_blocks; col < blocks.size(); ++col) {
+      const auto& block = blocks[col];
+      updates->push_back(row_id);
+      updates->push_back(static_cast<int32_t>(col));
+      // put first slot id of each block into block table
+      updates->push_back(block.id() * block.size());
+    }
+    row.first_block_id = blocks.empty() ? -1 : blocks[0].id();
+    row.num_blocks = blocks.size();
+    row.num_evicted_tokens = sequence->num_evicted_tokens();
+  }
+}
+
+}  // namespace llm
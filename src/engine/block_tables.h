@@ -0,0 +1,63 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "request/sequence.h"
+
+namespace llm {
+
+// Host side bookkeeping for block tables that persist on device across steps.
+// Each running sequence is assigned a row of a [n_rows, width] table, and only
+// blocks appended since the last step are sent to the device. Row 0 is
+// reserved for padding sequences and is never written.
+class BlockTables final {
+ public:
+  // width: max number of blocks per sequence
+  explicit BlockTables(int64_t width);
+
+  // assign rows to the sequences in the batch and collect the updates.
+  // rows of sequences that are not in the batch are released.
+  // rows: [n_seqs] row id for each sequence
+  // updates: flattened [row, col, value] triples to write into the table,
+  // where value is the first slot id of the block.
+  void update(const std::vector<Sequence*>& sequences,
+              std::vector<int32_t>* rows,
+              std::vector<int32_t>* updates);
+
+  // the number of rows needed on device, including the padding row
+  int64_t num_rows() const { return static_cast<int64_t>(rows_.size()); }
+
+  int64_t width() const { return width_; }
+
+ private:
+  struct Row {
+    // id of the sequence owning the row, -1 if the row is free
+    int64_t sequence_id = -1;
+
+    // first block id uploaded, used to detect reallocated blocks
+    int32_t first_block_id = -1;
+
+    // number of blocks uploaded
+    size_t num_blocks = 0;
+
+    // number of evicted tokens when uploaded, used to detect evicted blocks
+    size_t num_evicted_tokens = 0;
+  };
+
+  // max number of blocks per sequence
+  int64_t width_ = 0;
+
+  // map from sequence id to row id
+  absl::flat_hash_map<int64_t, int32_t> sequence_to_row_;
+
+  // all rows, including the padding row
+  std::vector<Row> rows_;
+
+  // free row ids
+  std::vector<int32_t> free_rows_;
+};
+
+}  // namespace llm
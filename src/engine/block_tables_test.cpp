@@ -0,0 +1,85 @@
+#include "block_tables.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "memory/block_allocator.h"
+
+namespace llm {
+
+TEST(BlockTablesTest, IncrementalUpdate) {
+  const int32_t block_size = 4;
+  BlockAllocator allocator(/*num_blocks=*/20, block_size);
+  // reserve block 0
+  auto block_0 = allocator.allocate();
+
+  Sequence::Options options;
+  Sequence seq1(/*token_ids=*/{1, 2, 3, 4, 5}, /*capacity=*/100, options);
+  seq1.append_blocks(allocator.allocate(2));  // [1, 2]
+  Sequence seq2(/*token_ids=*/{1, 2, 3}, /*capacity=*/100, options);
+  seq2.append_blocks(allocator.allocate(1));  // [3]
+
+  BlockTables block_tables(/*width=*/8);
+  std::vector<int32_t> rows;
+  std::vector<int32_t> updates;
+  block_tables.update({&seq1, &seq2}, &rows, &updates);
+  // row 0 is reserved for padding
+  EXPECT_EQ(rows, std::vector<int32_t>({1, 2}));
+  EXPECT_EQ(block_tables.num_rows(), 3);
+  // clang-format off
+  EXPECT_EQ(updates, std::vector<int32_t>({
+      1, 0, 1 * block_size,
+      1, 1, 2 * block_size,
+      2, 0, 3 * block_size}));
+  // clang-format on
+
+  // no changes, no updates
+  updates.clear();
+  block_tables.update({&seq1, &seq2}, &rows, &updates);
+  EXPECT_EQ(rows, std::vector<int32_t>({1, 2}));
+  EXPECT_TRUE(updates.empty());
+
+  // only the appended block is sent
+  seq2.append_blocks(allocator.allocate(1));  // [3, 4]
+  updates.clear();
+  block_tables.update({&seq1, &seq2}, &rows, &updates);
+  EXPECT_EQ(updates, std::vector<int32_t>({2, 1, 4 * block_size}));
+
+  // seq1 leaves the batch, its row is reused by seq3
+  Sequence seq3(/*token_ids=*/{1, 2}, /*capacity=*/100, options);
+  seq3.append_blocks(allocator.allocate(1));  // [5]
+  updates.clear();
+  block_tables.update({&seq2, &seq3}, &rows, &updates);
+  EXPECT_EQ(rows, std::vector<int32_t>({2, 1}));
+  EXPECT_EQ(updates, std::vector<int32_t>({1, 0, 5 * block_size}));
+  EXPECT_EQ(block_tables.num_rows(), 3);
+}
+
+TEST(BlockTablesTest, ReallocatedBlocks) {
+  const int32_t block_size = 4;
+  BlockAllocator allocator(/*num_blocks=*/20, block_size);
+  auto block_0 = allocator.allocate();
+
+  Sequence::Options options;
+  Sequence seq(/*token_ids=*/{1, 2, 3, 4, 5}, /*capacity=*/100, options);
+  seq.append_blocks(allocator.allocate(2));  // [1, 2]
+
+  BlockTables block_tables(/*width=*/8);
+  std::vector<int32_t> rows;
+  std::vector<int32_t> updates;
+  block_tables.update({&seq}, &rows, &updates);
+
+  // release and reallocate blocks, the whole row is sent again
+  auto blocks = allocator.allocate(2);  // [3, 4]
+  seq.release_blocks();
+  seq.append_blocks(blocks);
+  updates.clear();
+  block_tables.update({&seq}, &rows, &updates);
+  EXPECT_EQ(rows, std::vector<int32_t>({1}));
+  EXPECT_EQ(updates,
+            std::vector<int32_t>({1, 0, 3 * block_size, 1, 1, 4 * block_size}));
+}
+
+}  // namespace llm
@@ -0,0 +1,73 @@
+#include "encoder_cache.h"
+
+#include <glog/logging.h>
+
+#include <cstdint>
+#include <optional>
+#include <utility>
+
+namespace llm {
+namespace {
+int64_t bytes_of(const torch::Tensor& tensor) {
+  return tensor.defined()
+             ? tensor.numel() * static_cast<int64_t>(tensor.element_size())
+             : 0;
+}
+}  // namespace
+
+EncoderCache::EncoderCache(int64_t max_bytes) : max_bytes_(max_bytes) {
+  CHECK_GE(max_bytes, 0) << "Max bytes should not be negative";
+}
+
+std::optional<EncoderCache::Entry> EncoderCache::get(uint64_t hash) {
+  absl::MutexLock lock(&mu_);
+  auto it = nodes_.find(hash);
+  if (it == nodes_.end()) {
+    return std::nullopt;
+  }
+  // move the image to the back of the lru list
+  lru_.splice(lru_.end(), lru_, it->second.lru_it);
+  return it->second.entry;
+}
+
+void EncoderCache::put(uint64_t hash, Entry entry) {
+  const int64_t n_bytes = bytes_of(entry.embeddings);
+  absl::MutexLock lock(&mu_);
+  auto it = nodes_.find(hash);
+  if (it != nodes_.end()) {
+    num_bytes_ -= bytes_of(it->second.entry.embeddings);
+    lru_.erase(it->second.lru_it);
+    nodes_.erase(it);
+  }
+  if (n_bytes > max_bytes_) {
+    return;
+  }
+
+  Node& node = nodes_[hash];
+  node.entry = std::move(entry);
+  node.lru_it = lru_.insert(lru_.end(), hash);
+  num_bytes_ += n_bytes;
+  evict();
+}
+
+size_t EncoderCache::size() const {
+  absl::MutexLock lock(&mu_);
+  return nodes_.size();
+}
+
+int64_t EncoderCache::num_bytes() const {
+  absl::MutexLock lock(&mu_);
+  return num_bytes_;
+}
+
+void EncoderCache::evict() {
+  while (num_bytes_ > max_bytes_ && !lru_.empty()) {
+    auto it = nodes_.find(lru_.front());
+    DCHECK(it != nodes_.end());
+    num_bytes_ -= bytes_of(it->second.entry.embeddings);
+    nodes_.erase(it);
+    lru_.pop_front();
+  }
+}
+
+}  // namespace llm
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <ATen/cuda/CUDAEvent.h>
+#include <absl/synchronization/mutex.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+
+namespace llm {
+
+// A cache of the vision encoder outputs on device, keyed by the hash of the
+// image, so that an image shared by requests or kept across the turns of a
+// conversation is only encoded once. The embeddings of an image are encoded
+// on a side stream, the event recorded behind them is waited for by the
+// compute stream before the embeddings are used. Bounded by the bytes of the
+// embeddings, the least recently used images are evicted first. Thread safe.
+class EncoderCache final {
+ public:
+  struct Entry {
+    // [num_image_tokens, hidden_size]
+    torch::Tensor embeddings;
+    // recorded on the encoder stream once the embeddings are written, null
+    // for the embeddings computed on the compute stream
+    std::shared_ptr<at::cuda::CUDAEvent> ready;
+  };
+
+  // max_bytes: max number of bytes of the cached embeddings
+  explicit EncoderCache(int64_t max_bytes);
+
+  // disable copy, move and assign
+  EncoderCache(const EncoderCache&) = delete;
+  EncoderCache(EncoderCache&&) = delete;
+  EncoderCache& operator=(const EncoderCache&) = delete;
+  EncoderCache& operator=(EncoderCache&&) = delete;
+
+  // find the embeddings of the image, std::nullopt if not cached
+  std::optional<Entry> get(uint64_t hash);
+
+  // cache the embeddings of the image, replacing the cached ones if any.
+  // embeddings larger than max_bytes are not cached.
+  void put(uint64_t hash, Entry entry);
+
+  // get the number of cached images and their bytes
+  size_t size() const;
+  int64_t num_bytes() const;
+
+ private:
+  struct Node {
+    Entry entry;
+    // position in the lru list
+    std::list<uint64_t>::iterator lru_it;
+  };
+
+  // evict least recently used images until within max_bytes_
+  void evict() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  mutable absl::Mutex mu_;
+
+  // image hash -> node
+  std::unordered_map<uint64_t, Node> nodes_ ABSL_GUARDED_BY(mu_);
+
+  // image hashes sorted by the last access time, front is least recently used
+  std::list<uint64_t> lru_ ABSL_GUARDED_BY(mu_);
+
+  // the number of bytes of the cached embeddings
+  int64_t num_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+
+  int64_t max_bytes_ = 0;
+};
+
+}  // namespace llm
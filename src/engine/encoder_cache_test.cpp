@@ -0,0 +1,59 @@
+#include "encoder_cache.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+namespace llm {
+
+namespace {
+EncoderCache::Entry make_entry(int64_t n_tokens, float value) {
+  // 4 floats per token, 16 bytes
+  return {torch::full({n_tokens, 4}, value), /*ready=*/nullptr};
+}
+}  // namespace
+
+TEST(EncoderCacheTest, GetAndPut) {
+  EncoderCache cache(/*max_bytes=*/1024);
+  EXPECT_FALSE(cache.get(1).has_value());
+
+  cache.put(1, make_entry(/*n_tokens=*/2, 1.0f));
+  cache.put(2, make_entry(/*n_tokens=*/3, 2.0f));
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_EQ(cache.num_bytes(), 5 * 16);
+
+  const auto entry = cache.get(2);
+  ASSERT_TRUE(entry.has_value());
+  EXPECT_TRUE(torch::equal(entry->embeddings, torch::full({3, 4}, 2.0f)));
+
+  // replace the cached embeddings
+  cache.put(2, make_entry(/*n_tokens=*/1, 3.0f));
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_EQ(cache.num_bytes(), 3 * 16);
+  EXPECT_TRUE(
+      torch::equal(cache.get(2)->embeddings, torch::full({1, 4}, 3.0f)));
+}
+
+TEST(EncoderCacheTest, Evict) {
+  EncoderCache cache(/*max_bytes=*/4 * 16);
+  cache.put(1, make_entry(/*n_tokens=*/2, 1.0f));
+  cache.put(2, make_entry(/*n_tokens=*/2, 2.0f));
+  // refresh the first image, the second one is evicted instead
+  EXPECT_TRUE(cache.get(1).has_value());
+  cache.put(3, make_entry(/*n_tokens=*/1, 3.0f));
+  EXPECT_TRUE(cache.get(1).has_value());
+  EXPECT_FALSE(cache.get(2).has_value());
+  EXPECT_TRUE(cache.get(3).has_value());
+  EXPECT_EQ(cache.num_bytes(), 3 * 16);
+
+  // too large to cache, and the cached images are kept
+  cache.put(4, make_entry(/*n_tokens=*/5, 4.0f));
+  EXPECT_FALSE(cache.get(4).has_value());
+  EXPECT_EQ(cache.size(), 2);
+
+  // nothing is cached without budget
+  EncoderCache empty_cache(/*max_bytes=*/0);
+  empty_cache.put(1, make_entry(/*n_tokens=*/1, 1.0f));
+  EXPECT_EQ(empty_cache.size(), 0);
+}
+
+}  // namespace llm
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <folly/futures/Future.h>
+
 #include "batch.h"
 #include "memory/block_manager.h"
 #include "models/model_args.h"
@@ -14,6 +16,65 @@ class Engine {
   // execute the model with the given batch, results are stored in the batch
   virtual ModelOutput execute_model(Batch& batch) = 0;
 
+  // execute the model with the given batch without waiting for the result.
+  // the caller can do host side work while the model is running, and has to
+  // wait for the future before touching the batch again. the batch is updated
+  // on the waiting thread.
+  virtual folly::SemiFuture<ModelOutput> execute_model_async(Batch& batch) {
+    return folly::makeSemiFuture(execute_model(batch));
+  }
+
+  // move the model weights to host memory to free device memory for other
+  // models, the kv cache is kept. returns false if not supported.
+  // should only be called when no batch is running.
+  virtual bool offload_weights() { return false; }
+
+  // move the offloaded weights back to the devices.
+  virtual bool reload_weights() { return false; }
+
+  // copy kv cache blocks of another engine serving the same model into the
+  // blocks of this engine, e.g. the prompts computed by a prefill engine.
+  // src_to_dst: flattened [src_block_id, dst_block_id] pairs. blocking call,
+  // should only be called when no batch is running on this engine.
+  // returns false if not supported.
+  virtual bool pull_kv_cache_blocks(
+      Engine* /*src*/,
+      const std::vector<int32_t>& /*src_to_dst*/) {
+    return false;
+  }
+
+  // copy the kv cache of the blocks into host tensors, e.g. to resume a
+  // session on another replica. the kv cache is quantized to int8 with per
+  // token per head scales if quantize is true. should only be called when no
+  // batch is running. returns an empty vector if not supported.
+  virtual std::vector<torch::Tensor> export_kv_cache(
+      const std::vector<int32_t>& /*block_ids*/,
+      bool /*quantize*/) {
+    return {};
+  }
+
+  // write the tensors exported by an engine serving the same model with the
+  // same parallelism into the blocks. should only be called when no batch is
+  // running. returns false if not supported or the layout doesn't match.
+  virtual bool import_kv_cache(const std::vector<int32_t>& /*block_ids*/,
+                               const std::vector<torch::Tensor>& /*tensors*/) {
+    return false;
+  }
+
+  // map or unmap the kv cache of the blocks at the end of the kv cache to
+  // hold n_blocks blocks, up to the size reserved at startup. the blocks
+  // removed should not be in use. should only be called when no batch is
+  // running. returns false if not supported or out of device memory.
+  virtual bool resize_kv_cache(int64_t /*n_blocks*/) { return false; }
+
+  // return the id of the lora adapter with the given name, -1 if not found.
+  virtual int32_t lora_adapter_id(const std::string& /*name*/) const {
+    return -1;
+  }
+
+  // return the number of lora adapters that can be used by a batch.
+  virtual size_t num_lora_slots() const { return 0; }
+
   // return a clone of the tokenizer
   virtual const Tokenizer* tokenizer() const = 0;
 
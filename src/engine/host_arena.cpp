@@ -0,0 +1,51 @@
+#include "host_arena.h"
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <cstdint>
+
+namespace llm {
+namespace {
+// align the tensors for vectorized copies
+constexpr int64_t kAlignment = 64;
+}  // namespace
+
+HostArena::HostArena(PinnedAllocator* allocator, int64_t initial_bytes)
+    : allocator_(allocator), capacity_(initial_bytes) {
+  CHECK_GT(initial_bytes, 0);
+}
+
+void HostArena::reset() {
+  // pinned chunks may still be read by copies in flight, leave them to the
+  // pinned allocator. pageable chunks are reused once all the tensors
+  // created from them are released.
+  if (allocator_ != nullptr || !chunk_.defined() ||
+      chunk_.storage().use_count() > 1) {
+    chunk_ = torch::Tensor();
+  }
+  offset_ = 0;
+}
+
+torch::Tensor HostArena::empty(int64_t numel, torch::ScalarType dtype) {
+  CHECK_GE(numel, 0);
+  const int64_t n_bytes = numel * c10::elementSize(dtype);
+  const int64_t aligned = (n_bytes + kAlignment - 1) / kAlignment * kAlignment;
+  if (!chunk_.defined() || offset_ + aligned > chunk_.numel()) {
+    // the tensors created from the full chunk keep it alive
+    if (chunk_.defined()) {
+      capacity_ *= 2;
+    }
+    capacity_ = std::max(capacity_, aligned);
+    chunk_ = allocator_ != nullptr
+                 ? allocator_->empty(capacity_)
+                 : torch::empty({capacity_}, torch::dtype(torch::kUInt8));
+    offset_ = 0;
+  }
+  auto tensor = chunk_.narrow(/*dim=*/0, offset_, n_bytes).view(dtype);
+  offset_ += aligned;
+  return tensor;
+}
+
+}  // namespace llm
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "common/pinned_allocator.h"
+
+namespace llm {
+
+// Per-step bump allocator for the host tensors of the model inputs. The
+// tensors are views of one chunk, so that building them takes a single copy
+// from the host vectors and, with pinned memory, the copies to device are
+// truly asynchronous without staging. The chunk is released by reset() and
+// recycled by the pinned allocator once its copies are done. The chunk grows
+// to the high-water mark so that steady state steps allocate once.
+class HostArena final {
+ public:
+  // allocator: the pinned allocator of the cuda device to allocate the chunks
+  // from, nullptr for pageable memory
+  // initial_bytes: size of the first chunk
+  explicit HostArena(PinnedAllocator* allocator,
+                     int64_t initial_bytes = 1 << 20);
+
+  // start a new step. tensors created before stay valid.
+  void reset();
+
+  // allocate an uninitialized 1-D tensor from the arena
+  torch::Tensor empty(int64_t numel, torch::ScalarType dtype);
+
+  // copy the data into a 1-D tensor from the arena
+  template <typename T>
+  torch::Tensor tensor(const std::vector<T>& data, torch::ScalarType dtype) {
+    CHECK_EQ(sizeof(T), c10::elementSize(dtype)) << "dtype mismatch";
+    auto t = empty(static_cast<int64_t>(data.size()), dtype);
+    if (!data.empty()) {
+      std::memcpy(t.data_ptr(), data.data(), data.size() * sizeof(T));
+    }
+    return t;
+  }
+
+  // the bytes of the current chunk holding the tensors created since the
+  // last reset, e.g. to copy them to device at once. the tensors created
+  // before the chunk grew are not in it.
+  torch::Tensor used() const {
+    return chunk_.defined() ? chunk_.narrow(/*dim=*/0, 0, offset_)
+                            : torch::Tensor();
+  }
+
+  // size of the next chunk
+  int64_t capacity() const { return capacity_; }
+
+ private:
+  PinnedAllocator* allocator_ = nullptr;
+
+  // bytes of the next chunk, grows to fit all tensors of one step
+  int64_t capacity_ = 0;
+
+  // the current chunk and the offset of its free space
+  torch::Tensor chunk_;
+  int64_t offset_ = 0;
+};
+
+}  // namespace llm
@@ -0,0 +1,84 @@
+#include "host_arena.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "common/tensor_helper.h"
+
+namespace llm {
+
+TEST(HostArenaTest, Tensor) {
+  HostArena arena(/*allocator=*/nullptr, /*initial_bytes=*/256);
+  const std::vector<int32_t> ids = {1, 2, 3};
+  const std::vector<int64_t> idxes = {4, 5};
+  auto ids_tensor = arena.tensor(ids, torch::kInt);
+  auto idxes_tensor = arena.tensor(idxes, torch::kLong);
+  EXPECT_TRUE(torch::equal(ids_tensor, torch::tensor(ids, torch::kInt)));
+  EXPECT_TRUE(torch::equal(idxes_tensor, torch::tensor(idxes, torch::kLong)));
+  EXPECT_TRUE(ids_tensor.is_contiguous());
+  // tensors are views of the same chunk
+  EXPECT_TRUE(ids_tensor.storage().is_alias_of(idxes_tensor.storage()));
+
+  auto empty = arena.tensor(std::vector<int32_t>{}, torch::kInt);
+  EXPECT_EQ(empty.numel(), 0);
+  auto pairs = arena.tensor(std::vector<int32_t>{1, 2, 3, 4}, torch::kInt);
+  EXPECT_EQ(pairs.view({-1, 2}).size(0), 2);
+}
+
+TEST(HostArenaTest, Grow) {
+  HostArena arena(/*allocator=*/nullptr, /*initial_bytes=*/256);
+  auto t1 = arena.empty(/*numel=*/32, torch::kInt);
+  // the full chunk is kept alive by the tensors created from it
+  auto t2 = arena.empty(/*numel=*/64, torch::kInt);
+  EXPECT_EQ(arena.capacity(), 512);
+  EXPECT_FALSE(t1.storage().is_alias_of(t2.storage()));
+  t1.fill_(1);
+  t2.fill_(2);
+  EXPECT_EQ(t1.sum().item<int64_t>(), 32);
+
+  // the chunk is not reused while its tensors are alive
+  arena.reset();
+  auto t3 = arena.empty(/*numel=*/64, torch::kInt);
+  EXPECT_FALSE(t3.storage().is_alias_of(t2.storage()));
+  t3.fill_(3);
+  EXPECT_EQ(t2.sum().item<int64_t>(), 128);
+
+  // but reused once they are released
+  const void* data = t3.data_ptr();
+  t3 = torch::Tensor();
+  arena.reset();
+  auto t4 = arena.empty(/*numel=*/64, torch::kInt);
+  EXPECT_EQ(t4.data_ptr(), data);
+}
+
+TEST(HostArenaTest, DeviceBuffer) {
+  HostArena arena(/*allocator=*/nullptr, /*initial_bytes=*/256);
+  auto ids = arena.tensor(std::vector<int32_t>{1, 2, 3, 4}, torch::kInt);
+  auto idxes = arena.tensor(std::vector<int64_t>{5, 6}, torch::kLong);
+  const auto outside = torch::tensor({7}, torch::kInt);
+  // a host copy stands in for the copy of the buffer on device
+  const auto buffer = arena.used();
+  const auto device_buffer = buffer.clone();
+  const torch::Device device(torch::kCPU);
+
+  {
+    DeviceBufferGuard guard(buffer, device_buffer);
+    // the tensors within the buffer are views of the device buffer
+    const auto mapped_ids = safe_to_async(ids.view({2, 2}), device);
+    EXPECT_TRUE(mapped_ids.storage().is_alias_of(device_buffer.storage()));
+    EXPECT_TRUE(mapped_ids.equal(ids.view({2, 2})));
+    const auto mapped_idxes = safe_to_async(idxes, device);
+    EXPECT_TRUE(mapped_idxes.storage().is_alias_of(device_buffer.storage()));
+    EXPECT_TRUE(mapped_idxes.equal(idxes));
+    // the others are copied
+    const auto copied = safe_to_async(outside, device);
+    EXPECT_FALSE(copied.storage().is_alias_of(device_buffer.storage()));
+  }
+  const auto copied_ids = safe_to_async(ids, device);
+  EXPECT_FALSE(copied_ids.storage().is_alias_of(device_buffer.storage()));
+}
+
+}  // namespace llm
@@ -1,22 +1,88 @@
 #include "llm_engine.h"
 
 #include <ATen/cuda/CUDAContext.h>
+#include <absl/strings/match.h>
+#include <absl/strings/strip.h>
 #include <glog/logging.h>
 #include <sys/sysinfo.h>
 
 #include <algorithm>
 #include <boost/algorithm/string.hpp>
+#include <cmath>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <memory>
+#include <nlohmann/json.hpp>
+#include <sstream>
+#include <vector>
 
 #include "common/metrics.h"
+#include "common/pinned_allocator.h"
 #include "common/pretty_print.h"
+#include "common/threadpool.h"
+#include "common/timer.h"
+#include "kernels/attention/attn_api.h"
+#include "layers/layer_streamer.h"
+#include "layers/lora_linear.h"
+#include "memory/kv_cache.h"
+#include "memory/shared_block_pool.h"
 #include "model_loader/model_loader.h"
 #include "model_parallel/parallel_args.h"
 #include "models/model_args.h"
+#include "utils.h"
 #include "worker.h"
 
 DEFINE_COUNTER(prepare_input_latency_seconds,
                "Latency of preparing input in seconds");
+DEFINE_COUNTER(lora_load_latency_seconds,
+               "Latency of loading lora adapters to devices in seconds");
+
+DEFINE_bool(broadcast_model_input,
+            false,
+            "upload the inputs of each step to the device of the driver "
+            "once and broadcast them to the other tensor parallel workers "
+            "over nccl, instead of each worker copying them from the host.");
+
+DEFINE_bool(persistent_worker_loop,
+            false,
+            "run the steps on persistent loops of the local workers, which "
+            "spin on a step counter instead of being handed a task and a "
+            "future each step. not used with remote workers or pipeline "
+            "parallelism.");
+DEFINE_int32(worker_loop_idle_us,
+             1000,
+             "microseconds a persistent worker loop spins without steps "
+             "before returning its thread to other tasks.");
+
+DEFINE_bool(concurrent_prefill_decode,
+            false,
+            "run the decoding sequences of mixed batches on the compute "
+            "stream and their prefill sequences on a stream of their own "
+            "concurrently, so that the decode steps are not held up by the "
+            "long prefill kernels. only used with a single local cuda worker "
+            "and a decode step at a time.");
+
+DEFINE_bool(data_parallel_attention,
+            false,
+            "split the tensor parallel devices into groups as many as the "
+            "kv heads divide them into, each of which runs the attention of "
+            "its own sequences with the heads split among its devices, "
+            "instead of replicating the kv heads on every device. only used "
+            "for llama models with fewer kv heads than devices, a single "
+            "pipeline stage and no remote workers, lora adapters, cuda "
+            "graphs, prefix cache, host or resizable kv cache, kv cache "
+            "eviction or multi-step decoding.");
+
+DEFINE_HISTOGRAM(cuda_graph_padding_sequences,
+                 "Histogram of padding sequences added per step to replay "
+                 "captured cuda graphs",
+                 std::vector<double>{0, 1, 2, 4, 8, 16, 32, 64});
+DEFINE_HISTOGRAM(cuda_graph_padding_tokens,
+                 "Histogram of padding tokens added per step to replay "
+                 "captured cuda graphs",
+                 std::vector<double>{0, 1, 4, 16, 64, 256, 1024, 4096});
 
 namespace llm {
 namespace {
@@ -48,6 +114,90 @@ torch::ScalarType parse_dtype(const std::string& dtype_str,
   }
   CHECK(false) << "Unsupported dtype: " << dtype_str << " on device " << device;
 }
+
+torch::ScalarType parse_kv_cache_dtype(const std::string& dtype_str,
+                                       torch::ScalarType dtype) {
+  if (dtype_str.empty() || boost::iequals(dtype_str, "auto")) {
+    return dtype;
+  }
+  if (boost::iequals(dtype_str, "int8")) {
+    return torch::kInt8;
+  }
+  if (boost::iequals(dtype_str, "fp8") ||
+      boost::iequals(dtype_str, "fp8_e4m3")) {
+    return torch::kFloat8_e4m3fn;
+  }
+  CHECK(false) << "Unsupported kv cache dtype: " << dtype_str;
+}
+
+// the profile cache is a json object mapping keys to kv cache sizes in bytes
+std::string profile_cache_path(const std::string& dir) {
+  return (std::filesystem::path(dir) / "kv_cache_profiles.json").string();
+}
+
+nlohmann::json read_profile_cache(const std::string& dir) {
+  std::ifstream ifs(profile_cache_path(dir));
+  if (!ifs.is_open()) {
+    return nlohmann::json::object();
+  }
+  auto cache = nlohmann::json::parse(
+      ifs, /*cb=*/nullptr, /*allow_exceptions=*/false);
+  if (cache.is_discarded() || !cache.is_object()) {
+    LOG(WARNING) << "Ignoring corrupted profile cache "
+                 << profile_cache_path(dir);
+    return nlohmann::json::object();
+  }
+  return cache;
+}
+
+// returns 0 if not cached
+int64_t load_profile_cache(const std::string& dir, const std::string& key) {
+  if (dir.empty()) {
+    return 0;
+  }
+  const auto cache = read_profile_cache(dir);
+  const auto it = cache.find(key);
+  if (it == cache.end() || !it->is_number_integer()) {
+    return 0;
+  }
+  return it->get<int64_t>();
+}
+
+void save_profile_cache(const std::string& dir,
+                        const std::string& key,
+                        int64_t cache_size_in_bytes) {
+  if (dir.empty() || cache_size_in_bytes <= 0) {
+    return;
+  }
+  std::error_code ec;
+  std::filesystem::create_directories(dir, ec);
+  auto cache = read_profile_cache(dir);
+  cache[key] = cache_size_in_bytes;
+  // write to a temporary file and rename to make it atomic
+  const auto path = profile_cache_path(dir);
+  const auto tmp_path = path + ".tmp";
+  {
+    std::ofstream ofs(tmp_path);
+    ofs << cache.dump(/*indent=*/2);
+    if (!ofs.good()) {
+      LOG(WARNING) << "Failed to write profile cache " << tmp_path;
+      return;
+    }
+  }
+  std::filesystem::rename(tmp_path, path, ec);
+}
+
+// the attention window of every layer of the model, -1 if any layer attends
+// to all tokens. gemma2 alternates local and global layers, and mistral runs
+// with full attention.
+int32_t uniform_sliding_window(const ModelArgs& args) {
+  // qwen2 applies the window to the layers from max_window_layers on
+  if (args.model_type() == "qwen2" && args.use_sliding_window() &&
+      args.max_window_layers() <= 0) {
+    return args.sliding_window();
+  }
+  return -1;
+}
 }  // namespace
 
 LLMEngine::LLMEngine(const Options& options) : options_(options) {
@@ -69,17 +219,115 @@ LLMEngine::LLMEngine(const Options& options) : options_(options) {
     }
   }
 
-  // initialize process groups if there are multiple devices
-  if (devices.size() > 1) {
-    // create a process group for each device if there are multiple gpus
-    process_groups_ = ProcessGroup::create_process_groups(devices);
+  const int32_t pp_size = options_.pp_size();
+  CHECK_GT(pp_size, 0);
+  CHECK_EQ(devices.size() % pp_size, 0)
+      << "number of devices " << devices.size()
+      << " is not divisible by pipeline stages " << pp_size;
+  const auto& remote_workers = options_.remote_workers();
+  if (!remote_workers.empty()) {
+    CHECK(device_type == torch::kCUDA)
+        << "Remote workers are only supported with cuda devices";
+    CHECK_EQ(pp_size, 1)
+        << "Pipeline parallelism is not supported with remote workers";
+  }
+  // the remote workers join the tensor parallel group of the local devices
+  tp_size_ = static_cast<int32_t>(devices.size()) / pp_size +
+             static_cast<int32_t>(remote_workers.size());
+  if (pp_size > 1) {
+    // the micro-batches are not fixed in shape and the stages block on each
+    // other in the middle of the forward pass
+    if (options_.enable_cuda_graph() ||
+        options_.enable_persistent_block_tables() ||
+        options_.num_decode_steps() > 1) {
+      LOG(WARNING) << "CUDA graphs, persistent block tables and multi-step "
+                      "decoding are disabled with pipeline parallelism";
+    }
+    options_.enable_cuda_graph(false)
+        .enable_persistent_block_tables(false)
+        .num_decode_steps(1);
+  }
+  if (FLAGS_offload_layers > 0) {
+    CHECK_LE(FLAGS_max_loras, 0)
+        << "Lora adapters are not supported with offloaded layers";
+    // the offloaded weights are copied on a side stream between the layers
+    if (options_.enable_cuda_graph()) {
+      LOG(WARNING) << "CUDA graphs are disabled with offloaded layers";
+    }
+    options_.enable_cuda_graph(false);
+  }
+  if (FLAGS_data_parallel_attention) {
+    // the inputs of the attention groups are split from the packed inputs of
+    // each step, whose sequences own the blocks of a single group
+    LOG(WARNING) << "CUDA graphs, persistent block tables, multi-step "
+                    "decoding, cascade attention, prefix cache, host and "
+                    "resizable kv cache and kv cache eviction are disabled "
+                    "with data parallel attention";
+    options_.enable_cuda_graph(false)
+        .enable_persistent_block_tables(false)
+        .num_decode_steps(1)
+        .cascade_min_prefix_len(0)
+        .enable_prefix_cache(false)
+        .host_cache_size(0)
+        .resizable_cache_size(0)
+        .kv_budget(0);
+  }
+  if (FLAGS_batch_invariant) {
+    // the shared prefix of the batch peers is attended in a separate pass
+    if (options_.cascade_min_prefix_len() > 0) {
+      LOG(WARNING) << "Cascade attention is disabled in batch invariant mode";
+    }
+    options_.cascade_min_prefix_len(0);
+    if (tp_size_ > 1) {
+      LOG(WARNING) << "The all-reduce of tensor parallel is not batch "
+                      "invariant, the logits may vary with the batch";
+    }
+  }
+
+  // initialize process groups if there are multiple devices, the process
+  // group is created by each worker with remote workers.
+  if (tp_size_ > 1 && remote_workers.empty()) {
+    // create a process group for the devices of each pipeline stage
+    process_groups_.reserve(devices.size());
+    for (int32_t stage = 0; stage < pp_size; ++stage) {
+      const auto begin = devices.begin() + stage * tp_size_;
+      auto process_groups = ProcessGroup::create_process_groups(
+          std::vector<torch::Device>(begin, begin + tp_size_));
+      for (auto& process_group : process_groups) {
+        process_groups_.push_back(std::move(process_group));
+      }
+    }
+  }
+  if (pp_size > 1) {
+    // create a process group for the same tp rank across pipeline stages
+    pp_process_groups_.resize(devices.size());
+    for (int32_t rank = 0; rank < tp_size_; ++rank) {
+      std::vector<torch::Device> stage_devices;
+      stage_devices.reserve(pp_size);
+      for (int32_t stage = 0; stage < pp_size; ++stage) {
+        stage_devices.push_back(devices[stage * tp_size_ + rank]);
+      }
+      auto process_groups =
+          ProcessGroup::create_process_groups(stage_devices);
+      for (int32_t stage = 0; stage < pp_size; ++stage) {
+        pp_process_groups_[stage * tp_size_ + rank] =
+            std::move(process_groups[stage]);
+      }
+    }
   }
 
   // sort cuda graph batch sizes
+  std::vector<uint32_t> piecewise_num_tokens;
   if (options_.enable_cuda_graph()) {
     batch_sizes_ = options_.cuda_graph_batch_sizes().value_or(
         kDefaultBatchSizesForCudaGraph);
     std::sort(batch_sizes_.begin(), batch_sizes_.end());
+    num_tokens_ = options_.cuda_graph_num_tokens().value_or(
+        std::vector<uint32_t>{});
+    std::sort(num_tokens_.begin(), num_tokens_.end());
+    piecewise_num_tokens =
+        options_.piecewise_cuda_graph_num_tokens().value_or(
+            std::vector<uint32_t>{});
   }
 
   // create a worker for each device
@@ -87,24 +335,60 @@ LLMEngine::LLMEngine(const Options& options) : options_(options) {
   runner_options.block_size(options_.block_size())
       .num_decoding_tokens(options_.num_decoding_tokens())
       .cuda_graph_max_seq_len(options_.cuda_graph_max_seq_len())
-      .cuda_graph_batch_sizes(batch_sizes_);
+      .cuda_graph_batch_sizes(batch_sizes_)
+      .cuda_graph_num_tokens(num_tokens_)
+      .piecewise_cuda_graph_num_tokens(piecewise_num_tokens)
+      .enable_fused_sampling(options_.enable_fused_sampling())
+      .enable_pivot_sampling(options_.enable_pivot_sampling())
+      .enable_vocab_parallel_sampling(
+          options_.enable_vocab_parallel_sampling())
+      .return_hidden_states(options_.return_hidden_states())
+      .lazy_cuda_graph_capture(options_.lazy_cuda_graph_capture())
+      .numa_affinity(options_.numa_affinity())
+      .activation_pool_num_tokens(options_.activation_pool_num_tokens())
+      .share_device_resources(options_.share_device_resources());
 
-  const int32_t world_size = static_cast<int32_t>(devices.size());
   for (size_t i = 0; i < devices.size(); ++i) {
-    const int32_t rank = static_cast<int32_t>(i);
-    ProcessGroup* pg = world_size > 1 ? process_groups_[i].get() : nullptr;
-    ParallelArgs parallel_args(rank, world_size, pg);
+    const int32_t rank = static_cast<int32_t>(i) % tp_size_;
+    ProcessGroup* pg =
+        process_groups_.empty() ? nullptr : process_groups_[i].get();
+    ParallelArgs parallel_args(rank, tp_size_, pg);
+    parallel_args.pp_rank(static_cast<int32_t>(i) / tp_size_)
+        .pp_world_size(pp_size)
+        .pp_process_group(pp_size > 1 ? pp_process_groups_[i].get() : nullptr);
     workers_.emplace_back(
         std::make_unique<Worker>(parallel_args, devices[i], runner_options));
   }
 
-  if (workers_.size() > 1) {
+  if (!remote_workers.empty()) {
+    // all ranks join the nccl communicator at the same time
+    const std::string unique_id = ProcessGroup::create_unique_id();
+    std::vector<folly::SemiFuture<folly::Unit>> futures;
+    futures.reserve(tp_size_);
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      futures.emplace_back(workers_[i]->init_process_group_async(
+          static_cast<int32_t>(i), tp_size_, unique_id));
+    }
+    for (size_t i = 0; i < remote_workers.size(); ++i) {
+      const auto rank = static_cast<int32_t>(workers_.size() + i);
+      auto& remote_worker = remote_workers_.emplace_back(
+          std::make_unique<RemoteWorker>(remote_workers[i]));
+      futures.emplace_back(remote_worker->create_worker_async(
+          rank, tp_size_, unique_id, runner_options));
+    }
+    folly::collectAll(futures).get();
+  }
+
+  if (workers_.size() + remote_workers_.size() > 1) {
     // test process group
     std::vector<folly::SemiFuture<folly::Unit>> futures;
-    futures.reserve(workers_.size());
+    futures.reserve(workers_.size() + remote_workers_.size());
     for (auto& worker : workers_) {
       futures.emplace_back(worker->process_group_test_async());
     }
+    for (auto& worker : remote_workers_) {
+      futures.emplace_back(worker->process_group_test_async());
+    }
     // wait up to 4 seconds for all futures to complete
     folly::collectAll(futures).within(std::chrono::seconds(4)).get();
   }
@@ -115,14 +399,50 @@ bool LLMEngine::init(const std::string& model_weights_path) {
     LOG(ERROR) << "Failed to initialize model from: " << model_weights_path;
     return false;
   }
+  if (!load_lora_adapters()) {
+    LOG(ERROR) << "Failed to load lora adapters";
+    return false;
+  }
 
-  // initialize kv cache
-  const int64_t cache_size_in_bytes = profile_memory_for_kv_cache();
+  // the kv cache pool shared with other processes holds prefixes cached on
+  // cuda devices
+  if (!FLAGS_shared_kv_pool.empty() && options_.devices()[0].is_cuda()) {
+    CHECK(options_.enable_prefix_cache())
+        << "The shared kv pool needs the prefix cache enabled";
+    shared_pool_layout_key_ = shared_pool_layout_key(model_weights_path);
+  }
+
+  // initialize kv cache, reusing the profiling result of previous starts
+  const auto& profile_cache_dir = options_.profile_cache_dir();
+  const auto profile_key = profile_cache_key(model_weights_path);
+  int64_t cache_size_in_bytes =
+      load_profile_cache(profile_cache_dir, profile_key);
+  if (cache_size_in_bytes > 0) {
+    LOG(INFO) << "Using the cached memory profiling result from "
+              << profile_cache_dir;
+  } else {
+    cache_size_in_bytes = profile_memory_for_kv_cache();
+    save_profile_cache(profile_cache_dir, profile_key, cache_size_in_bytes);
+  }
   CHECK_GT(cache_size_in_bytes, 0);
   LOG(INFO) << "Initializing kv cache with size: "
             << readable_size(cache_size_in_bytes);
   const int64_t n_blocks = calculate_kv_cache_blocks(cache_size_in_bytes);
-  if (!init_kv_cache(n_blocks)) {
+
+  // swapping is only supported for cuda devices
+  int64_t n_host_blocks = 0;
+  if (options_.host_cache_size() > 0 && options_.devices()[0].is_cuda()) {
+    n_host_blocks = calculate_kv_cache_blocks(options_.host_cache_size());
+    LOG(INFO) << "Initializing host kv cache with size: "
+              << readable_size(options_.host_cache_size());
+  }
+  // reserve the address range to grow the kv cache into at runtime
+  int64_t max_blocks = 0;
+  if (options_.resizable_cache_size() > 0 && options_.devices()[0].is_cuda()) {
+    max_blocks = std::max(
+        n_blocks, calculate_kv_cache_blocks(options_.resizable_cache_size()));
+  }
+  if (!init_kv_cache(n_blocks, n_host_blocks, max_blocks)) {
     LOG(ERROR) << "Failed to initialize kv cache";
     return false;
   }
@@ -130,9 +450,37 @@ bool LLMEngine::init(const std::string& model_weights_path) {
     LOG(ERROR) << "Failed to warmup model.";
     return false;
   }
+  if (options_.devices()[0].is_cuda()) {
+    const auto breakdowns = memory_breakdown();
+    for (size_t i = 0; i < breakdowns.size(); ++i) {
+      const auto& breakdown = breakdowns[i];
+      LOG(INFO) << workers_[i]->device() << " memory: weights: "
+                << readable_size(breakdown.weights_bytes) << ", kv cache: "
+                << readable_size(breakdown.kv_cache_bytes)
+                << ", cuda graphs: "
+                << readable_size(breakdown.cuda_graph_pool_bytes)
+                << ", activations: "
+                << readable_size(breakdown.activation_pool_bytes)
+                << ", allocated: "
+                << readable_size(breakdown.allocator.allocated_bytes)
+                << ", reserved: "
+                << readable_size(breakdown.allocator.reserved_bytes)
+                << ", available: "
+                << readable_size(breakdown.available_memory);
+    }
+  }
   return true;
 }
 
+std::vector<MemoryBreakdown> LLMEngine::memory_breakdown() {
+  std::vector<folly::SemiFuture<MemoryBreakdown>> futures;
+  futures.reserve(workers_.size());
+  for (auto& worker : workers_) {
+    futures.push_back(worker->memory_breakdown_async());
+  }
+  return folly::collect(futures).get();
+}
+
 bool LLMEngine::init_model(const std::string& model_weights_path) {
   auto model_loader = ModelLoader::create(model_weights_path);
   LOG(INFO) << "Initializing model from: " << model_weights_path;
@@ -142,21 +490,38 @@ bool LLMEngine::init_model(const std::string& model_weights_path) {
 
   args_ = model_loader->model_args();
   quant_args_ = model_loader->quant_args();
+  if (!options_.quant_method().empty() && quant_args_.quant_method().empty()) {
+    if (options_.quant_method() != "fp8") {
+      LOG(ERROR) << "Unsupported quant method to quantize the weights at "
+                    "load: "
+                 << options_.quant_method();
+      return false;
+    }
+    // the dense weights are quantized by the fp8 linear layers at load
+    quant_args_.quant_method() = options_.quant_method();
+    quant_args_.weight_only() = true;
+  }
   tokenizer_args_ = model_loader->tokenizer_args();
 
   // compute the number of local kv heads and head dim
-  const int world_size = static_cast<int>(workers_.size());
   const int64_t n_heads = args_.n_heads();
   const int64_t n_kv_heads = args_.n_kv_heads().value_or(n_heads);
-  n_local_kv_heads_ = std::max<int64_t>(1, n_kv_heads / world_size);
+  n_local_kv_heads_ = std::max<int64_t>(1, n_kv_heads / tp_size_);
   head_dim_ = args_.head_dim();
+  dp_attention_size_ = data_parallel_attention_size();
+  if (dp_attention_size_ > 1) {
+    LOG(INFO) << "Running the attention in " << dp_attention_size_
+              << " data parallel groups of " << tp_size_ / dp_attention_size_
+              << " devices";
+  }
   dtype_ = parse_dtype(args_.dtype(), options_.devices()[0]);
+  kv_cache_dtype_ = parse_kv_cache_dtype(options_.kv_cache_dtype(), dtype_);
 
   // key + value for all layers
   LOG(INFO) << "Block info, block_size: " << options_.block_size()
             << ", n_local_kv_heads: " << n_local_kv_heads_
             << ", head_dim: " << head_dim_ << ", n_layers: " << args_.n_layers()
-            << ", dtype: " << dtype_;
+            << ", dtype: " << dtype_ << ", kv_cache_dtype: " << kv_cache_dtype_;
 
   if (tokenizer_->vocab_size() != args_.vocab_size()) {
     // use tokenizer vocab size if model vocab size is not set
@@ -172,6 +537,28 @@ bool LLMEngine::init_model(const std::string& model_weights_path) {
     }
   }
 
+  const int64_t max_seq_len = args_.max_position_embeddings();
+  if (options_.enable_persistent_block_tables() && max_seq_len > 0) {
+    // round up and add one additional block for speculative tokens
+    const int64_t block_size = options_.block_size();
+    const int64_t max_tokens = max_seq_len + options_.num_decoding_tokens();
+    block_tables_ = std::make_unique<BlockTables>(
+        (max_tokens + block_size - 1) / block_size + 1);
+  }
+
+  if (options_.enable_persistent_token_counts()) {
+    token_counts_ = std::make_unique<TokenCounts>();
+  }
+  const auto& device = options_.devices()[0];
+  host_arena_ = std::make_unique<HostArena>(
+      device.is_cuda() ? &PinnedAllocator::get(device) : nullptr);
+
+  if (FLAGS_offload_layers > 0 && !quant_args_.quant_method().empty()) {
+    // the quantized weights are repacked on the device after loading
+    LOG(ERROR) << "Offloading layers is not supported for quantized models";
+    return false;
+  }
+
   LOG(INFO) << "Initializing model with " << args_;
   LOG(INFO) << "Initializing model with quant args: " << quant_args_;
   LOG(INFO) << "Initializing model with tokenizer args: " << tokenizer_args_;
@@ -181,7 +568,8 @@ bool LLMEngine::init_model(const std::string& model_weights_path) {
   std::vector<folly::SemiFuture<bool>> futures;
   futures.reserve(workers_.size());
   for (auto& worker : workers_) {
-    futures.push_back(worker->init_model_async(dtype_, args_, quant_args_));
+    futures.push_back(worker->init_model_async(
+        dtype_, args_, quant_args_, dp_attention_size_));
   }
   // wait for all futures to complete
   auto results = folly::collectAll(futures).get();
@@ -191,26 +579,432 @@ bool LLMEngine::init_model(const std::string& model_weights_path) {
     }
   }
 
-  // load the weights from the checkpoint in parallel
-  for (const auto& state_dict : *model_loader) {
+  // remote workers load the weights on their hosts at the same time
+  std::vector<folly::SemiFuture<bool>> remote_futures;
+  remote_futures.reserve(remote_workers_.size());
+  for (auto& worker : remote_workers_) {
+    remote_futures.push_back(worker->init_model_async(
+        model_weights_path, dtype_, args_.vocab_size()));
+  }
+
+  // the attention weights of the ranks are sharded differently with data
+  // parallel attention, not recorded in the snapshots
+  const std::string snapshot_dir =
+      dp_attention_size_ == 1 ? options_.weights_snapshot_dir() : "";
+  const bool has_snapshot =
+      !snapshot_dir.empty() &&
+      std::all_of(workers_.begin(), workers_.end(), [&](const auto& worker) {
+        return worker->has_weights_snapshot(snapshot_dir);
+      });
+  if (has_snapshot) {
+    // the snapshot is sharded and transformed already, each worker maps its
+    // own file
+    LOG(INFO) << "Loading model weights from snapshot: " << snapshot_dir;
     std::vector<folly::SemiFuture<folly::Unit>> futures;
     futures.reserve(workers_.size());
     for (auto& worker : workers_) {
-      futures.push_back(worker->load_state_dict_async(state_dict));
+      futures.push_back(worker->load_weights_snapshot_async(snapshot_dir));
     }
-    // wait for all futures to complete
     auto results = folly::collectAll(futures).get();
     for (const auto& result : results) {
       if (result.hasException()) {
         return false;
       }
     }
+  } else {
+    if (!snapshot_dir.empty()) {
+      // record the weights of each rank for the next start
+      std::vector<folly::SemiFuture<folly::Unit>> futures;
+      futures.reserve(workers_.size());
+      for (auto& worker : workers_) {
+        futures.push_back(worker->start_weights_snapshot_async(snapshot_dir));
+      }
+      folly::collectAll(futures).get();
+    }
+    if (!load_weights(*model_loader)) {
+      return false;
+    }
   }
 
   // verify the weights are loaded correctly
   for (const auto& worker : workers_) {
     worker->verify_loaded_weights();
   }
+
+  if (!snapshot_dir.empty() && !has_snapshot) {
+    // only save the snapshot after the weights are verified
+    std::vector<folly::SemiFuture<folly::Unit>> futures;
+    futures.reserve(workers_.size());
+    for (auto& worker : workers_) {
+      futures.push_back(worker->finish_weights_snapshot_async());
+    }
+    folly::collectAll(futures).get();
+  }
+
+  auto remote_results = folly::collectAll(remote_futures).get();
+  for (size_t i = 0; i < remote_results.size(); ++i) {
+    if (!remote_results[i].hasValue() || !remote_results[i].value()) {
+      LOG(ERROR) << "Failed to initialize model on remote worker: "
+                 << remote_workers_[i]->address();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool LLMEngine::load_weights(const ModelLoader& model_loader) {
+  // load the weights from the checkpoint in parallel. the next files are
+  // opened on the loading threads while the workers copy the current ones,
+  // and each worker moves on to the next file at its own pace.
+  const size_t n_files = model_loader.weights_files_count();
+  const size_t max_inflight_files =
+      std::max<int32_t>(options_.max_inflight_weights_files(), 1);
+  ThreadPool loading_threadpool(max_inflight_files);
+  auto load_state_dict_async = [&](size_t index) {
+    folly::Promise<std::unique_ptr<StateDict>> promise;
+    auto future = promise.getSemiFuture();
+    loading_threadpool.schedule(
+        [&model_loader, index, promise = std::move(promise)]() mutable {
+          promise.setValue(model_loader.load_state_dict(index));
+        });
+    return future;
+  };
+
+  struct InflightFile {
+    std::unique_ptr<StateDict> state_dict;
+    std::vector<folly::SemiFuture<folly::Unit>> futures;
+  };
+  std::deque<folly::SemiFuture<std::unique_ptr<StateDict>>> pending_files;
+  std::deque<InflightFile> inflight_files;
+  bool loaded = true;
+  // the state dict must outlive the loading of all workers
+  auto wait_for_front_file = [&]() {
+    auto results = folly::collectAll(inflight_files.front().futures).get();
+    for (const auto& result : results) {
+      if (result.hasException()) {
+        loaded = false;
+      }
+    }
+    inflight_files.pop_front();
+  };
+
+  for (size_t i = 0; i < std::min(n_files, max_inflight_files); ++i) {
+    pending_files.push_back(load_state_dict_async(i));
+  }
+  for (size_t i = 0; i < n_files; ++i) {
+    InflightFile file;
+    file.state_dict = std::move(pending_files.front()).get();
+    pending_files.pop_front();
+    file.futures.reserve(workers_.size());
+    for (auto& worker : workers_) {
+      file.futures.push_back(worker->load_state_dict_async(*file.state_dict));
+    }
+    inflight_files.push_back(std::move(file));
+
+    if (inflight_files.size() >= max_inflight_files) {
+      wait_for_front_file();
+    }
+    if (i + max_inflight_files < n_files) {
+      pending_files.push_back(load_state_dict_async(i + max_inflight_files));
+    }
+  }
+  while (!inflight_files.empty()) {
+    wait_for_front_file();
+  }
+  return loaded;
+
+}
+
+bool LLMEngine::offload_weights() {
+  if (!remote_workers_.empty()) {
+    LOG(WARNING) << "Offloading weights is not supported with remote workers";
+    return false;
+  }
+  if (FLAGS_offload_layers > 0) {
+    // the offloaded layers are bound to the weight slots on the device
+    LOG(WARNING) << "Offloading weights is not supported with offloaded "
+                    "layers";
+    return false;
+  }
+  std::vector<folly::SemiFuture<folly::Unit>> futures;
+  futures.reserve(workers_.size());
+  for (auto& worker : workers_) {
+    futures.emplace_back(worker->offload_weights_async());
+  }
+  folly::collectAll(futures).get();
+  return true;
+}
+
+bool LLMEngine::pull_kv_cache_blocks(Engine* src,
+                                     const std::vector<int32_t>& src_to_dst) {
+  auto* src_engine = dynamic_cast<LLMEngine*>(src);
+  if (src_engine == nullptr || !remote_workers_.empty() ||
+      !src_engine->remote_workers_.empty() || dp_attention_size_ > 1 ||
+      src_engine->dp_attention_size_ > 1) {
+    LOG(WARNING) << "Pulling kv cache blocks is only supported between local "
+                    "llm engines without data parallel attention";
+    return false;
+  }
+  CHECK_EQ(src_engine->workers_.size(), workers_.size())
+      << "parallelism mismatch";
+  CHECK(src_engine->n_local_kv_heads_ == n_local_kv_heads_ &&
+        src_engine->head_dim_ == head_dim_ &&
+        src_engine->kv_cache_dtype_ == kv_cache_dtype_)
+      << "kv cache layout mismatch";
+  CHECK_EQ(src_to_dst.size() % 2, 0);
+  if (src_to_dst.empty()) {
+    return true;
+  }
+
+  const auto pairs = torch::tensor(src_to_dst, torch::kInt).view({-1, 2});
+  std::vector<folly::SemiFuture<folly::Unit>> futures;
+  futures.reserve(workers_.size());
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    futures.emplace_back(workers_[i]->pull_kv_cache_blocks_async(
+        *src_engine->workers_[i], pairs));
+  }
+  folly::collectAll(futures).get();
+  return true;
+}
+
+std::vector<torch::Tensor> LLMEngine::export_kv_cache(
+    const std::vector<int32_t>& block_ids,
+    bool quantize) {
+  if (!remote_workers_.empty() || dp_attention_size_ > 1) {
+    LOG(WARNING) << "Exporting kv cache is not supported with remote workers "
+                    "or data parallel attention";
+    return {};
+  }
+  const auto ids = torch::tensor(block_ids, torch::kInt);
+  std::vector<folly::SemiFuture<std::vector<KVCache::Blocks>>> futures;
+  futures.reserve(workers_.size());
+  for (auto& worker : workers_) {
+    futures.emplace_back(worker->export_kv_cache_async(ids, quantize));
+  }
+  auto results = folly::collectAll(futures).get();
+
+  std::vector<torch::Tensor> tensors;
+  for (auto& result : results) {
+    for (auto& blocks : result.value()) {
+      const bool quantized = blocks.key_scales.defined();
+      tensors.push_back(std::move(blocks.keys));
+      tensors.push_back(std::move(blocks.values));
+      tensors.push_back(quantized ? std::move(blocks.key_scales)
+                                  : torch::empty({0}));
+      tensors.push_back(quantized ? std::move(blocks.value_scales)
+                                  : torch::empty({0}));
+    }
+  }
+  return tensors;
+}
+
+bool LLMEngine::import_kv_cache(const std::vector<int32_t>& block_ids,
+                                const std::vector<torch::Tensor>& tensors) {
+  if (!remote_workers_.empty() || dp_attention_size_ > 1) {
+    LOG(WARNING) << "Importing kv cache is not supported with remote workers "
+                    "or data parallel attention";
+    return false;
+  }
+  size_t n_tensors = 0;
+  for (const auto& worker : workers_) {
+    n_tensors += worker->num_kv_caches() * 4;
+  }
+  if (tensors.size() != n_tensors) {
+    LOG(ERROR) << "Failed to import kv cache: expected " << n_tensors
+               << " tensors, got " << tensors.size();
+    return false;
+  }
+  const int64_t n_slots =
+      static_cast<int64_t>(block_ids.size()) * options_.block_size();
+  for (size_t i = 0; i < tensors.size(); i += 4) {
+    const auto& keys = tensors[i];
+    if (keys.dim() != 3 || keys.size(0) != n_slots ||
+        keys.size(1) != n_local_kv_heads_ || keys.size(2) != head_dim_ ||
+        !keys.sizes().equals(tensors[i + 1].sizes())) {
+      LOG(ERROR) << "Failed to import kv cache: layout mismatch";
+      return false;
+    }
+  }
+
+  const auto ids = torch::tensor(block_ids, torch::kInt);
+  std::vector<folly::SemiFuture<folly::Unit>> futures;
+  futures.reserve(workers_.size());
+  size_t next = 0;
+  for (auto& worker : workers_) {
+    std::vector<KVCache::Blocks> layers(worker->num_kv_caches());
+    for (auto& blocks : layers) {
+      blocks.keys = tensors[next++];
+      blocks.values = tensors[next++];
+      const auto& key_scales = tensors[next++];
+      const auto& value_scales = tensors[next++];
+      if (key_scales.numel() > 0) {
+        blocks.key_scales = key_scales;
+        blocks.value_scales = value_scales;
+      }
+    }
+    futures.emplace_back(worker->import_kv_cache_async(ids, std::move(layers)));
+  }
+  folly::collectAll(futures).get();
+  return true;
+}
+
+bool LLMEngine::resize_kv_cache(int64_t n_blocks) {
+  if (max_kv_cache_blocks_ == 0 || n_blocks <= 0 ||
+      n_blocks > max_kv_cache_blocks_) {
+    return false;
+  }
+  if (n_blocks == num_kv_cache_blocks_) {
+    return true;
+  }
+  auto resize_all = [this](int64_t n_blocks) {
+    std::vector<folly::SemiFuture<bool>> futures;
+    futures.reserve(workers_.size() + remote_workers_.size());
+    for (auto& worker : workers_) {
+      futures.push_back(worker->resize_kv_cache_async(n_blocks));
+    }
+    for (auto& worker : remote_workers_) {
+      futures.push_back(worker->resize_kv_cache_async(n_blocks));
+    }
+    bool success = true;
+    for (const auto& result : folly::collectAll(futures).get()) {
+      success = success && result.hasValue() && result.value();
+    }
+    return success;
+  };
+  if (!resize_all(n_blocks)) {
+    // shrinking only unmaps memory, restore the workers that grew
+    LOG(WARNING) << "Failed to resize kv cache to " << n_blocks << " blocks";
+    CHECK(resize_all(num_kv_cache_blocks_))
+        << "Failed to restore kv cache of " << num_kv_cache_blocks_
+        << " blocks";
+    return false;
+  }
+  LOG(INFO) << "Resized kv cache from " << num_kv_cache_blocks_ << " to "
+            << n_blocks << " blocks";
+  num_kv_cache_blocks_ = n_blocks;
+  return true;
+}
+
+bool LLMEngine::reload_weights() {
+  if (!remote_workers_.empty()) {
+    return false;
+  }
+  std::vector<folly::SemiFuture<folly::Unit>> futures;
+  futures.reserve(workers_.size());
+  for (auto& worker : workers_) {
+    futures.emplace_back(worker->reload_weights_async());
+  }
+  folly::collectAll(futures).get();
+  // the graphs were dropped with the offloaded weights
+  return capture_cuda_graphs();
+}
+
+bool LLMEngine::load_lora_adapters() {
+  const auto& adapters = options_.lora_adapters();
+  if (adapters.empty()) {
+    return true;
+  }
+  if (FLAGS_max_loras <= 0) {
+    LOG(ERROR) << "Lora adapters are given without --max_loras";
+    return false;
+  }
+  if (!remote_workers_.empty()) {
+    LOG(ERROR) << "Lora adapters are not supported with remote workers";
+    return false;
+  }
+
+  const bool pin_memory = options_.devices()[0].is_cuda();
+  for (const auto& adapter : adapters) {
+    const auto pos = adapter.find('=');
+    if (pos == std::string::npos) {
+      LOG(ERROR) << "Invalid lora adapter, expected name=path: " << adapter;
+      return false;
+    }
+    const std::string name = adapter.substr(0, pos);
+    const std::filesystem::path dir = adapter.substr(pos + 1);
+    if (lora_ids_.contains(name)) {
+      LOG(ERROR) << "Duplicated lora adapter: " << name;
+      return false;
+    }
+
+    // scaling of the adapter from the peft config
+    std::ifstream config_file(dir / "adapter_config.json");
+    if (!config_file.is_open()) {
+      LOG(ERROR) << "Failed to open adapter config in " << dir;
+      return false;
+    }
+    const auto config = nlohmann::json::parse(config_file, nullptr, false);
+    if (config.is_discarded() || !config.contains("r")) {
+      LOG(ERROR) << "Invalid adapter config in " << dir;
+      return false;
+    }
+    const double rank = config["r"].get<double>();
+    const double alpha = config.value("lora_alpha", rank);
+    const bool use_rslora = config.value("use_rslora", false);
+    const double scaling = use_rslora ? alpha / std::sqrt(rank) : alpha / rank;
+
+    const auto weights = StateDict::load_safetensors(
+        (dir / "adapter_model.safetensors").string());
+    std::unordered_map<std::string, torch::Tensor> dict;
+    for (const auto& [key, tensor] : *weights) {
+      // peft keys are prefixed with "base_model.model."
+      std::string_view tensor_name = key;
+      absl::ConsumePrefix(&tensor_name, "base_model.model.");
+      auto weight = tensor.to(dtype_);
+      if (absl::EndsWith(tensor_name, "lora_B.weight")) {
+        // fold the scaling into lora_B
+        weight = weight * scaling;
+      }
+      dict[std::string(tensor_name)] =
+          pin_memory ? weight.pin_memory() : weight.contiguous();
+    }
+
+    const auto lora_id = static_cast<int32_t>(lora_adapters_.size());
+    LOG(INFO) << "Loaded lora adapter " << name << " from " << dir
+              << " with rank " << rank << " and scaling " << scaling;
+    lora_adapters_.push_back(std::make_unique<StateDict>(std::move(dict)));
+    lora_ids_[name] = lora_id;
+  }
+  lora_slots_ =
+      std::make_unique<LoRASlots>(FLAGS_max_loras, lora_adapters_.size());
+  return true;
+}
+
+int32_t LLMEngine::lora_adapter_id(const std::string& name) const {
+  const auto it = lora_ids_.find(name);
+  return it != lora_ids_.end() ? it->second : -1;
+}
+
+bool LLMEngine::assign_lora_slots(Batch& batch) {
+  // distinct adapters used by the batch
+  std::vector<int32_t> lora_ids;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    const int32_t lora_id = batch[i]->lora_id();
+    if (lora_id >= 0 && std::find(lora_ids.begin(), lora_ids.end(),
+                                  lora_id) == lora_ids.end()) {
+      lora_ids.push_back(lora_id);
+    }
+  }
+  if (lora_ids.empty()) {
+    return false;
+  }
+
+  const auto to_load = lora_slots_->assign(lora_ids);
+  if (!to_load.empty()) {
+    Timer timer;
+    // run before the batch on the working threads of the workers
+    std::vector<folly::SemiFuture<folly::Unit>> futures;
+    futures.reserve(to_load.size() * workers_.size());
+    for (const auto& [lora_id, slot] : to_load) {
+      for (auto& worker : workers_) {
+        futures.push_back(
+            worker->load_lora_async(slot, *lora_adapters_[lora_id]));
+      }
+    }
+    folly::collectAll(futures).get();
+    COUNTER_ADD(lora_load_latency_seconds, timer.elapsed_seconds());
+  }
+  batch.set_lora_slots(lora_slots_->slots());
   return true;
 }
 
@@ -218,6 +1012,10 @@ bool LLMEngine::capture_cuda_graphs() {
   if (!options_.enable_cuda_graph()) {
     return true;
   }
+  if (options_.lazy_cuda_graph_capture()) {
+    LOG(INFO) << "CUDA graphs are captured at their first use";
+    return true;
+  }
 
   LOG(INFO) << "Capturing CUDA graphs: num_decoding_tokens: "
             << options_.num_decoding_tokens()
@@ -225,16 +1023,84 @@ bool LLMEngine::capture_cuda_graphs() {
 
   for (const auto batch_size : batch_sizes_) {
     std::vector<folly::SemiFuture<folly::Unit>> futures;
-    futures.reserve(workers_.size());
+    futures.reserve(workers_.size() + remote_workers_.size());
     for (auto& worker : workers_) {
       futures.emplace_back(worker->capture_cuda_graph_async(batch_size));
     }
+    for (auto& worker : remote_workers_) {
+      futures.emplace_back(worker->capture_cuda_graph_async(batch_size));
+    }
     // wait up to 4 seconds for all futures to complete
     folly::collectAll(futures).within(std::chrono::seconds(4)).get();
   }
+
+  if (!num_tokens_.empty()) {
+    LOG(INFO) << "Capturing CUDA graphs for mixed batches: num_tokens: "
+              << num_tokens_;
+  }
+  for (const auto num_tokens : num_tokens_) {
+    for (const auto batch_size : batch_sizes_) {
+      if (batch_size > num_tokens) {
+        break;
+      }
+      std::vector<folly::SemiFuture<folly::Unit>> futures;
+      futures.reserve(workers_.size() + remote_workers_.size());
+      for (auto& worker : workers_) {
+        futures.emplace_back(
+            worker->capture_cuda_graph_async(batch_size, num_tokens));
+      }
+      for (auto& worker : remote_workers_) {
+        futures.emplace_back(
+            worker->capture_cuda_graph_async(batch_size, num_tokens));
+      }
+      // wait up to 4 seconds for all futures to complete
+      folly::collectAll(futures).within(std::chrono::seconds(4)).get();
+    }
+  }
   return true;
 }
 
+std::string LLMEngine::profile_cache_key(
+    const std::string& model_weights_path) const {
+  std::stringstream ss;
+  std::error_code ec;
+  ss << std::filesystem::weakly_canonical(model_weights_path, ec).string();
+  for (const auto& worker : workers_) {
+    const auto& device = worker->device();
+    ss << ";" << device;
+    if (device.is_cuda()) {
+      const auto* props = at::cuda::getDeviceProperties(device.index());
+      ss << ":" << props->name << ":" << props->totalGlobalMem;
+    }
+  }
+  for (const auto& worker : remote_workers_) {
+    ss << ";" << worker->address();
+  }
+  ss << ";tp=" << tp_size_ << ";pp=" << options_.pp_size()
+     << ";dtype=" << dtype_ << ";kv_cache_dtype=" << kv_cache_dtype_
+     << ";block_size=" << options_.block_size()
+     << ";max_cache_size=" << options_.max_cache_size()
+     << ";max_memory_utilization=" << options_.max_memory_utilization()
+     << ";num_decoding_tokens=" << options_.num_decoding_tokens()
+     << ";quant_method=" << quant_args_.quant_method()
+     << ";offload_layers=" << FLAGS_offload_layers;
+  return ss.str();
+}
+
+uint64_t LLMEngine::shared_pool_layout_key(
+    const std::string& model_weights_path) const {
+  std::stringstream ss;
+  std::error_code ec;
+  ss << std::filesystem::weakly_canonical(model_weights_path, ec).string();
+  ss << ";tp=" << tp_size_ << ";pp=" << options_.pp_size()
+     << ";kv_cache_dtype=" << kv_cache_dtype_
+     << ";kv_cache_layout=" << FLAGS_kv_cache_layout
+     << ";block_size=" << options_.block_size()
+     << ";quant_method=" << quant_args_.quant_method();
+  // 0 is reserved for the processes that don't check the key
+  return std::max<uint64_t>(std::hash<std::string>{}(ss.str()), 1);
+}
+
 int64_t LLMEngine::profile_memory_for_kv_cache() {
   const int64_t max_cache_size = options_.max_cache_size();
   const double max_memory_utilization = options_.max_memory_utilization();
@@ -272,17 +1138,22 @@ int64_t LLMEngine::profile_memory_for_kv_cache() {
 
   // call worker to profile memory usage
   std::vector<folly::SemiFuture<std::tuple<int64_t, int64_t>>> futures;
-  futures.reserve(workers_.size());
+  futures.reserve(workers_.size() + remote_workers_.size());
   for (auto& worker : workers_) {
     futures.push_back(worker->profile_device_memory_async());
   }
+  for (auto& worker : remote_workers_) {
+    futures.push_back(worker->profile_device_memory_async());
+  }
 
   // pick smallest available memory from all devices
   int64_t smallest_available_memory = std::numeric_limits<int64_t>::max();
   // wait for all futures to complete
   auto results = folly::collectAll(futures).get();
   for (size_t i = 0; i < results.size(); ++i) {
-    const auto device = workers_[i]->device();
+    const auto device = i < workers_.size()
+                            ? workers_[i]->device().str()
+                            : remote_workers_[i - workers_.size()]->address();
     if (!results[i].hasValue()) {
       LOG(ERROR) << "Failed to profile memory usage for device: " << device;
       continue;
@@ -309,28 +1180,86 @@ int64_t LLMEngine::profile_memory_for_kv_cache() {
   return std::max(smallest_available_memory, int64_t(0));
 }
 
-bool LLMEngine::init_kv_cache(int64_t n_blocks) {
+bool LLMEngine::init_kv_cache(int64_t n_blocks,
+                              int64_t n_host_blocks,
+                              int64_t max_blocks) {
   CHECK_GT(n_blocks, 0) << "no memory for kv cache";
+  CHECK_GE(n_host_blocks, 0);
   const int32_t block_size = options_.block_size();
 
-  // init kv cache for each worker
-  LOG(INFO) << "Initializing kv cache with shape: [" << n_blocks << ", "
-            << block_size << ", " << n_local_kv_heads_ << ", " << head_dim_
-            << "]";
-
-  // initialize block manager
+  // initialize block manager, with the blocks of the kv caches of all data
+  // parallel attention groups
   BlockManager::Options options;
-  options.num_blocks(n_blocks)
+  options.num_blocks(n_blocks * dp_attention_size_)
+      .num_block_groups(dp_attention_size_)
+      .max_num_blocks(max_blocks)
       .block_size(block_size)
-      .enable_prefix_cache(options_.enable_prefix_cache());
+      .large_block_size(options_.large_block_size())
+      .enable_prefix_cache(options_.enable_prefix_cache())
+      .num_host_blocks(n_host_blocks)
+      .sliding_window(uniform_sliding_window(args_))
+      .kv_budget(options_.kv_budget())
+      .kv_observation_window(options_.kv_observation_window())
+      .hybrid_attention_device_blocks(options_.hybrid_attention_device_blocks())
+      .block_size_in_bytes(block_size * kv_cache_slot_size_in_bytes());
+  if (shared_pool_layout_key_ != 0) {
+    options.shared_pool_name(FLAGS_shared_kv_pool)
+        .num_shared_blocks(FLAGS_shared_kv_pool_blocks)
+        .shared_pool_layout_key(shared_pool_layout_key_);
+  }
+  if (options.sliding_window() >= 0) {
+    LOG(INFO) << "Releasing kv cache blocks out of the sliding window: "
+              << options.sliding_window();
+  }
+  if (options.kv_budget() > 0) {
+    LOG(INFO) << "Evicting kv cache blocks of prompts longer than "
+              << options.kv_budget() << " tokens";
+  }
+  if (options.hybrid_attention_device_blocks() > 0 && n_host_blocks > 0) {
+    LOG(INFO) << "Offloading kv cache blocks to host beyond the most recent "
+              << options.hybrid_attention_device_blocks() << " blocks";
+  }
   block_manager_ = std::make_unique<BlockManager>(options);
+  return init_worker_kv_caches(n_blocks, n_host_blocks, max_blocks);
+}
+
+bool LLMEngine::init_worker_kv_caches(int64_t n_blocks,
+                                      int64_t n_host_blocks,
+                                      int64_t max_blocks) {
+  CHECK_GT(n_blocks, 0) << "no memory for kv cache";
+  CHECK(max_blocks == 0 || max_blocks >= n_blocks);
+  const int32_t block_size = options_.block_size();
+  LOG(INFO) << "Initializing kv cache with shape: [" << n_blocks << ", "
+            << block_size << ", " << n_local_kv_heads_ << ", " << head_dim_
+            << "]";
+  if (max_blocks > 0) {
+    LOG(INFO) << "Reserving kv cache address range for " << max_blocks
+              << " blocks";
+  }
+  num_kv_cache_blocks_ = n_blocks;
+  max_kv_cache_blocks_ = max_blocks;
 
   // init kv cache for each worker in parallel
   std::vector<folly::SemiFuture<bool>> futures;
-  futures.reserve(workers_.size());
+  futures.reserve(workers_.size() + remote_workers_.size());
   for (auto& worker : workers_) {
     futures.push_back(worker->init_kv_cache_async(
-        n_blocks, block_size, n_local_kv_heads_, head_dim_));
+        n_blocks,
+        n_host_blocks,
+        block_size,
+        n_local_kv_heads_,
+        head_dim_,
+        kv_cache_dtype_,
+        max_kv_cache_blocks_));
+  }
+  for (auto& worker : remote_workers_) {
+    futures.push_back(worker->init_kv_cache_async(n_blocks,
+                                                  n_host_blocks,
+                                                  block_size,
+                                                  n_local_kv_heads_,
+                                                  head_dim_,
+                                                  kv_cache_dtype_,
+                                                  max_kv_cache_blocks_));
   }
   // wait for all futures to complete
   auto results = folly::collectAll(futures).get();
@@ -343,9 +1272,80 @@ bool LLMEngine::init_kv_cache(int64_t n_blocks) {
 }
 
 ModelOutput LLMEngine::execute_model(Batch& batch) {
+  return execute_model_async(batch).get();
+}
+
+folly::SemiFuture<ModelOutput> LLMEngine::execute_model_async(Batch& batch) {
+  return execute_steps_async(batch, options_.num_decode_steps());
+}
+
+ModelOutput LLMEngine::execute_decode_steps(Batch& batch, uint32_t max_steps) {
+  return execute_steps_async(batch, max_steps).get();
+}
+
+int32_t LLMEngine::data_parallel_attention_size() const {
+  if (!FLAGS_data_parallel_attention) {
+    return 1;
+  }
+  const int64_t n_heads = args_.n_heads();
+  const int64_t n_kv_heads = args_.n_kv_heads().value_or(n_heads);
+  if (n_kv_heads >= tp_size_ || tp_size_ % n_kv_heads != 0) {
+    LOG(WARNING) << "Data parallel attention is disabled, the " << n_kv_heads
+                 << " kv heads should be fewer than and divide the "
+                 << tp_size_ << " devices";
+    return 1;
+  }
+  const auto& model_type = args_.model_type();
+  if (model_type != "llama" && model_type != "llama3" && model_type != "Yi") {
+    LOG(WARNING) << "Data parallel attention is not supported for "
+                 << model_type;
+    return 1;
+  }
+  if (options_.pp_size() > 1 || !remote_workers_.empty() ||
+      !options_.lora_adapters().empty() || !FLAGS_shared_kv_pool.empty() ||
+      uniform_sliding_window(args_) >= 0) {
+    LOG(WARNING) << "Data parallel attention is not supported with pipeline "
+                    "parallelism, remote workers, lora adapters, the shared "
+                    "kv pool or sliding windows";
+    return 1;
+  }
+  return static_cast<int32_t>(tp_size_ / n_kv_heads);
+}
+
+folly::SemiFuture<ModelOutput> LLMEngine::execute_steps_async(
+    Batch& batch,
+    uint32_t num_decode_steps) {
+  // the adapters are applied in eager mode
+  const bool has_lora = lora_slots_ != nullptr && assign_lora_slots(batch);
+
+  if (options_.pp_size() > 1) {
+    return execute_micro_batches_async(batch);
+  }
+
+  // collectives issued from two threads could be ordered differently across
+  // the ranks, so the prefill runs concurrently on a single device only
+  if (FLAGS_concurrent_prefill_decode && num_decode_steps <= 1 &&
+      workers_.size() == 1 && remote_workers_.empty() &&
+      options_.devices()[0].is_cuda()) {
+    auto batches = std::make_shared<std::vector<Batch>>(2);
+    if (batch.split_decode_prefill(&(*batches)[0], &(*batches)[1])) {
+      return execute_prefill_decode_async(std::move(batches), has_lora);
+    }
+  }
+
+  // the sequences of each data parallel attention group are consecutive
+  const bool dp_attention = dp_attention_size_ > 1;
+  if (dp_attention) {
+    CHECK_LE(num_decode_steps, 1)
+        << "Multi-step decoding is not supported with data parallel attention";
+    batch.stable_sort([this](const Sequence& sequence) {
+      return block_manager_->block_group_of(sequence);
+    });
+  }
+
   // prepare inputs for workers
   uint32_t adjusted_batch_size = 0;
-  if (options_.enable_cuda_graph()) {
+  if (options_.enable_cuda_graph() && !has_lora) {
     // find the closest batch size in the captured graph
     const auto it = std::lower_bound(
         batch_sizes_.begin(), batch_sizes_.end(), batch.size());
@@ -355,34 +1355,297 @@ ModelOutput LLMEngine::execute_model(Batch& batch) {
   }
 
   Timer timer;
-  auto model_inputs = batch.prepare_model_input(options_.num_decoding_tokens(),
-                                                adjusted_batch_size);
+  host_arena_->reset();
+  auto model_inputs =
+      batch.prepare_model_input(options_.num_decoding_tokens(),
+                                adjusted_batch_size,
+                                block_tables_.get(),
+                                num_decode_steps,
+                                options_.cascade_min_prefix_len(),
+                                token_counts_.get(),
+                                host_arena_.get());
+  if (model_inputs.token_ids.defined() && !num_tokens_.empty() &&
+      !has_lora) {
+    pad_for_cuda_graph(&model_inputs);
+  }
   COUNTER_ADD(prepare_input_latency_seconds, timer.elapsed_seconds());
+  if (model_inputs.token_ids.defined() && options_.enable_cuda_graph()) {
+    observe_cuda_graph_padding(batch, model_inputs);
+  }
 
   if (!model_inputs.token_ids.defined()) {
     // empty input, just return
-    return {};
+    return folly::makeSemiFuture(ModelOutput{});
+  }
+  if (dp_attention) {
+    split_model_input_for_attention_groups(
+        dp_attention_size_,
+        static_cast<int32_t>(block_manager_->num_blocks_per_group()),
+        options_.block_size(),
+        &model_inputs);
+  }
+  // the inputs of the attention groups are not in the arena
+  if (FLAGS_broadcast_model_input && workers_.size() > 1 && !dp_attention &&
+      remote_workers_.empty() && options_.devices()[0].is_cuda()) {
+    // the tensors created from the arena since the reset
+    model_inputs.input_buffer = host_arena_->used();
+  }
+
+  if (FLAGS_persistent_worker_loop && remote_workers_.empty()) {
+    return execute_on_step_loops_async(batch, std::move(model_inputs));
   }
 
   std::vector<folly::SemiFuture<std::optional<ModelOutput>>> futures;
-  futures.reserve(workers_.size());
+  futures.reserve(workers_.size() + remote_workers_.size());
   for (auto& worker : workers_) {
     futures.emplace_back(worker->execute_model_async(model_inputs));
   }
-  // wait for the all future to complete
-  auto results = folly::collectAll(futures).get();
-  // return the result from the driver
-  auto model_output = results.front().value();
-  DCHECK(model_output.has_value()) << "Failed to execute model";
-  batch.process_sample_output(model_output.value().sample_output);
-  return model_output.value();
+  for (auto& worker : remote_workers_) {
+    futures.emplace_back(worker->execute_model_async(model_inputs));
+  }
+  // process the output on the waiting thread once all workers are done
+  return folly::collectAll(futures).deferValue(
+      [&batch](auto&& results) {
+        // return the result from the driver
+        auto model_output = results.front().value();
+        DCHECK(model_output.has_value()) << "Failed to execute model";
+        batch.process_sample_output(model_output.value().sample_output);
+        return model_output.value();
+      });
+}
+
+folly::SemiFuture<ModelOutput> LLMEngine::execute_on_step_loops_async(
+    Batch& batch,
+    ModelInput model_inputs) {
+  if (step_channel_ == nullptr) {
+    step_channel_ = std::make_unique<StepChannel>(workers_.size());
+  }
+  // kept alive until the step is done, the previous one is done already
+  step_inputs_ = std::move(model_inputs);
+  step_channel_->post(&step_inputs_);
+  const auto idle_timeout = absl::Microseconds(FLAGS_worker_loop_idle_us);
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    workers_[i]->start_step_loop(step_channel_.get(), i, idle_timeout);
+  }
+  // wait for the workers on the waiting thread
+  return folly::makeSemiFuture().deferValue([this, &batch](folly::Unit) {
+    auto model_output = step_channel_->wait();
+    DCHECK(model_output.has_value()) << "Failed to execute model";
+    batch.process_sample_output(model_output.value().sample_output);
+    return model_output.value();
+  });
+}
+
+folly::SemiFuture<ModelOutput> LLMEngine::execute_prefill_decode_async(
+    std::shared_ptr<std::vector<Batch>> batches,
+    bool has_lora) {
+  Batch& decode_batch = (*batches)[0];
+  Batch& prefill_batch = (*batches)[1];
+  uint32_t adjusted_batch_size = 0;
+  if (options_.enable_cuda_graph() && !has_lora) {
+    const auto it = std::lower_bound(
+        batch_sizes_.begin(), batch_sizes_.end(), decode_batch.size());
+    if (it != batch_sizes_.end()) {
+      adjusted_batch_size = *it;
+    }
+  }
+
+  Timer timer;
+  host_arena_->reset();
+  auto decode_inputs =
+      decode_batch.prepare_model_input(options_.num_decoding_tokens(),
+                                       adjusted_batch_size,
+                                       block_tables_.get(),
+                                       /*num_decode_steps=*/1,
+                                       options_.cascade_min_prefix_len(),
+                                       token_counts_.get(),
+                                       host_arena_.get());
+  // the prefill keeps no persistent state on device, the rows of its
+  // sequences are released and uploaded again by the next steps.
+  auto prefill_inputs =
+      prefill_batch.prepare_model_input(options_.num_decoding_tokens(),
+                                        /*min_decoding_bach_size=*/0,
+                                        /*block_tables=*/nullptr,
+                                        /*num_decode_steps=*/1,
+                                        options_.cascade_min_prefix_len(),
+                                        /*token_counts=*/nullptr,
+                                        host_arena_.get());
+  COUNTER_ADD(prepare_input_latency_seconds, timer.elapsed_seconds());
+  if (decode_inputs.token_ids.defined() && options_.enable_cuda_graph()) {
+    observe_cuda_graph_padding(decode_batch, decode_inputs);
+  }
+
+  // the decode is queued first to get ahead of the prefill on the device
+  std::vector<size_t> batch_idxes;
+  std::vector<folly::SemiFuture<std::optional<ModelOutput>>> futures;
+  if (decode_inputs.token_ids.defined()) {
+    batch_idxes.push_back(0);
+    futures.emplace_back(workers_[0]->execute_model_async(decode_inputs));
+  }
+  if (prefill_inputs.token_ids.defined()) {
+    batch_idxes.push_back(1);
+    futures.emplace_back(workers_[0]->execute_prefill_async(prefill_inputs));
+  }
+  if (futures.empty()) {
+    return folly::makeSemiFuture(ModelOutput{});
+  }
+
+  return folly::collectAll(futures).deferValue(
+      [batches, batch_idxes = std::move(batch_idxes)](auto&& results) {
+        // only the sampled tokens are merged across the two batches
+        ModelOutput model_output;
+        std::vector<torch::Tensor> next_tokens;
+        for (size_t i = 0; i < batch_idxes.size(); ++i) {
+          auto& output = results[i].value();
+          DCHECK(output.has_value()) << "Failed to execute model";
+          (*batches)[batch_idxes[i]].process_sample_output(
+              output->sample_output);
+          if (output->sample_output.next_tokens.defined()) {
+            next_tokens.push_back(output->sample_output.next_tokens);
+          }
+        }
+        if (!next_tokens.empty()) {
+          model_output.sample_output.next_tokens = torch::cat(next_tokens);
+        }
+        return model_output;
+      });
+}
+
+folly::SemiFuture<ModelOutput> LLMEngine::execute_micro_batches_async(
+    Batch& batch) {
+  const size_t n_micro_batches = options_.num_micro_batches() > 0
+                                     ? options_.num_micro_batches()
+                                     : options_.pp_size();
+  auto micro_batches =
+      std::make_shared<std::vector<Batch>>(batch.split(n_micro_batches));
+
+  // each worker runs the micro-batches in order, the first stage moves on to
+  // the next micro-batch once it sends the activations of the current one.
+  // the inputs of a micro-batch are prepared while the previous ones run.
+  std::vector<size_t> batch_idxes;
+  std::vector<folly::SemiFuture<std::optional<ModelOutput>>> futures;
+  futures.reserve(micro_batches->size() * workers_.size());
+  host_arena_->reset();
+  for (size_t i = 0; i < micro_batches->size(); ++i) {
+    Timer timer;
+    auto model_inputs = (*micro_batches)[i].prepare_model_input(
+        options_.num_decoding_tokens(),
+        /*min_decoding_bach_size=*/0,
+        /*block_tables=*/nullptr,
+        /*num_decode_steps=*/1,
+        options_.cascade_min_prefix_len(),
+        /*token_counts=*/nullptr,
+        host_arena_.get());
+    COUNTER_ADD(prepare_input_latency_seconds, timer.elapsed_seconds());
+    if (!model_inputs.token_ids.defined()) {
+      continue;
+    }
+    batch_idxes.push_back(i);
+    for (auto& worker : workers_) {
+      futures.emplace_back(worker->execute_model_async(model_inputs));
+    }
+  }
+  if (futures.empty()) {
+    return folly::makeSemiFuture(ModelOutput{});
+  }
+
+  const size_t n_workers = workers_.size();
+  return folly::collectAll(futures).deferValue(
+      [micro_batches, batch_idxes = std::move(batch_idxes), n_workers](
+          auto&& results) {
+        // only the sampled tokens are merged across the micro-batches
+        ModelOutput model_output;
+        std::vector<torch::Tensor> next_tokens;
+        for (size_t i = 0; i < batch_idxes.size(); ++i) {
+          // the driver is on the last stage
+          std::optional<ModelOutput> output;
+          for (size_t j = 0; j < n_workers; ++j) {
+            auto& result = results[i * n_workers + j].value();
+            if (result.has_value()) {
+              output = std::move(result);
+              break;
+            }
+          }
+          DCHECK(output.has_value()) << "Failed to execute model";
+          auto& micro_batch = (*micro_batches)[batch_idxes[i]];
+          micro_batch.process_sample_output(output->sample_output);
+          if (output->sample_output.next_tokens.defined()) {
+            next_tokens.push_back(output->sample_output.next_tokens);
+          }
+        }
+        if (!next_tokens.empty()) {
+          model_output.sample_output.next_tokens = torch::cat(next_tokens);
+        }
+        return model_output;
+      });
+}
+
+void LLMEngine::observe_cuda_graph_padding(
+    const Batch& batch,
+    const ModelInput& model_inputs) const {
+  // padding sequences are appended after the sequences of the batch
+  const auto& q_cu_seq_lens = model_inputs.input_params.q_cu_seq_lens;
+  const int64_t n_seqs = q_cu_seq_lens.size(/*dim=*/0) - 1;
+  const int64_t n_padding_seqs = n_seqs - static_cast<int64_t>(batch.size());
+  int64_t n_padding_tokens = 0;
+  if (n_padding_seqs > 0) {
+    const int64_t n_tokens = model_inputs.token_ids.size(/*dim=*/0);
+    n_padding_tokens = n_tokens - q_cu_seq_lens[batch.size()].item<int64_t>();
+  }
+  HISTOGRAM_OBSERVE(cuda_graph_padding_sequences,
+                    std::max<int64_t>(n_padding_seqs, 0));
+  HISTOGRAM_OBSERVE(cuda_graph_padding_tokens, n_padding_tokens);
+}
+
+void LLMEngine::pad_for_cuda_graph(ModelInput* model_inputs) const {
+  const auto& params = model_inputs->input_params;
+  if (params.num_prefix_groups > 0) {
+    // cascade attention runs in eager mode
+    return;
+  }
+  const uint32_t n_tokens = model_inputs->token_ids.size(/*dim=*/0);
+  const uint32_t n_seqs = params.q_cu_seq_lens.size(/*dim=*/0) - 1;
+  const uint32_t num_decoding_tokens = options_.num_decoding_tokens();
+  if (params.q_max_seq_len == num_decoding_tokens &&
+      n_tokens == n_seqs * num_decoding_tokens) {
+    // decode batches are handled by the decode graphs
+    return;
+  }
+  if (params.kv_max_seq_len > options_.cuda_graph_max_seq_len()) {
+    return;
+  }
+
+  // find the smallest captured shape that the batch can be padded to
+  for (const auto num_tokens : num_tokens_) {
+    if (num_tokens < n_tokens) {
+      continue;
+    }
+    for (const auto batch_size : batch_sizes_) {
+      if (batch_size > num_tokens) {
+        break;
+      }
+      if (can_pad_model_input(n_tokens, n_seqs, num_tokens, batch_size)) {
+        pad_model_input(
+            num_tokens, batch_size, options_.block_size(), model_inputs);
+        return;
+      }
+    }
+  }
 }
 
 int64_t LLMEngine::kv_cache_slot_size_in_bytes() const {
-  const auto dtype_size = torch::scalarTypeToTypeMeta(dtype_).itemsize();
-  // key + value for all layers
+  const auto dtype_size =
+      torch::scalarTypeToTypeMeta(kv_cache_dtype_).itemsize();
+  int64_t head_size_in_bytes = head_dim_ * dtype_size;
+  if (KVCache::is_quantized_dtype(kv_cache_dtype_)) {
+    // one float scale per head
+    head_size_in_bytes += sizeof(float);
+  }
+  // key + value for all layers of the largest pipeline stage
+  const int64_t pp_size = options_.pp_size();
+  const int64_t n_stage_layers = (args_.n_layers() + pp_size - 1) / pp_size;
   const int64_t slot_size_in_bytes =
-      2 * n_local_kv_heads_ * head_dim_ * args_.n_layers() * dtype_size;
+      2 * n_local_kv_heads_ * head_size_in_bytes * n_stage_layers;
   return slot_size_in_bytes;
 }
 
@@ -1,12 +1,23 @@
 #pragma once
 
+#include <absl/container/flat_hash_map.h>
+
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "batch.h"
+#include "block_tables.h"
 #include "common/macros.h"
 #include "engine.h"
+#include "host_arena.h"
+#include "lora_slots.h"
 #include "memory/block_manager.h"
+#include "model_loader/model_loader.h"
 #include "quantization/quant_args.h"
+#include "remote_worker.h"
+#include "step_channel.h"
+#include "token_counts.h"
 #include "tokenizer/tokenizer.h"
 #include "tokenizer/tokenizer_args.h"
 #include "worker.h"
@@ -35,19 +46,66 @@ class LLMEngine : public Engine {
     // the number of slots per block, default 8, value must be a power of 2
     DEFINE_ARG(int32_t, block_size) = 8;
 
+    // the number of slots per large block of consecutive blocks allocated to
+    // long prompts, a power of 2 multiple of block_size. 0 means disabled.
+    DEFINE_ARG(int32_t, large_block_size) = 0;
+
+    // max number of kv cache tokens kept for each sequence with a longer
+    // prompt, the blocks with the least attention are evicted. 0 to disable.
+    DEFINE_ARG(int32_t, kv_budget) = 0;
+
+    // number of last prompt tokens whose attention ranks the blocks to evict
+    DEFINE_ARG(int32_t, kv_observation_window) = 32;
+
+    // number of most recent blocks of a sequence kept on device when out of
+    // device blocks, the leading ones are offloaded to the host cache and
+    // attended on host. 0 to disable.
+    DEFINE_ARG(int32_t, hybrid_attention_device_blocks) = 0;
+
     // 0 means that cache size is caculated by available memory
     DEFINE_ARG(int64_t, max_cache_size) = 0;
 
+    // host memory size in bytes used to swap out kv cache blocks of preempted
+    // sequences, 0 means swapping is disabled
+    DEFINE_ARG(int64_t, host_cache_size) = 0;
+
+    // max size in bytes to grow the kv cache to at runtime on each device,
+    // whose address range is reserved at startup. 0 means the kv cache has a
+    // fixed size. only supported on cuda devices.
+    DEFINE_ARG(int64_t, resizable_cache_size) = 0;
+
     // maximum memory utilization allowed, default 0.9
     DEFINE_ARG(double, max_memory_utilization) = 0.9;
 
     // enable prefix cache
     DEFINE_ARG(bool, enable_prefix_cache) = true;
 
+    // data type of kv cache, e.g. auto, int8, fp8
+    // auto means the same data type as the model
+    DEFINE_ARG(std::string, kv_cache_dtype) = "auto";
+
     // number of decoding tokens per sequence
     // in speculative decoding, it is the number of speculative tokens + 1
     DEFINE_ARG(int64_t, num_decoding_tokens) = 1;
 
+    // max number of decode steps to run on device per step for decode
+    // batches, the scheduler should reserve kv cache slots for these steps.
+    DEFINE_ARG(int64_t, num_decode_steps) = 1;
+
+    // sample with a single fused kernel when logprobs are not requested
+    DEFINE_ARG(bool, enable_fused_sampling) = false;
+
+    // apply top_k and top_p with pivot search instead of sorting the vocab
+    DEFINE_ARG(bool, enable_pivot_sampling) = false;
+
+    // sample from the vocab shards of the logits with tensor parallelism,
+    // gathering only the top candidates of each shard
+    DEFINE_ARG(bool, enable_vocab_parallel_sampling) = false;
+
+    // return the hidden states of the selected tokens in the model output,
+    // e.g. for speculative heads on top of the model.
+    DEFINE_ARG(bool, return_hidden_states) = false;
+
     // enable cuda graph
     DEFINE_ARG(bool, enable_cuda_graph) = true;
 
@@ -56,6 +114,84 @@ class LLMEngine : public Engine {
 
     // batch sizes to capture cuda graphs
     DEFINE_ARG(std::optional<std::vector<uint32_t>>, cuda_graph_batch_sizes);
+
+    // numbers of tokens to capture cuda graphs for batches with prefill
+    // sequences, captured for each batch size no larger than the number of
+    // tokens. batches with prefill run eagerly if not set.
+    DEFINE_ARG(std::optional<std::vector<uint32_t>>, cuda_graph_num_tokens);
+
+    // token-count buckets of the piecewise cuda graphs for the batches
+    // without a captured cuda graph, captured at their first use. see
+    // ModelRunner::Options.
+    DEFINE_ARG(std::optional<std::vector<uint32_t>>,
+               piecewise_cuda_graph_num_tokens);
+
+    // capture each cuda graph at its first use instead of at startup
+    DEFINE_ARG(bool, lazy_cuda_graph_capture) = false;
+
+    // pin the threads of each worker to the cpus of the numa node of its
+    // device
+    DEFINE_ARG(bool, numa_affinity) = false;
+
+    // number of tokens to size the private memory pool of the eager
+    // activations with at startup, 0 to disable. see ModelRunner::Options.
+    DEFINE_ARG(int64_t, activation_pool_num_tokens) = 0;
+
+    // directory to cache the kv cache size found by memory profiling, keyed
+    // by the model, devices and options. warm restarts skip the profiling.
+    // empty to disable.
+    DEFINE_ARG(std::string, profile_cache_dir);
+
+    // keep block tables on device across steps and only send the blocks
+    // appended since the last step
+    DEFINE_ARG(bool, enable_persistent_block_tables) = true;
+
+    // keep the token counts for the penalties on device across steps, updated
+    // with the sampled tokens instead of being rebuilt on host every step
+    DEFINE_ARG(bool, enable_persistent_token_counts) = true;
+
+    // min number of kv tokens shared by consecutive sequences to use cascade
+    // attention, which reads the shared prefix once for them. 0 to disable.
+    DEFINE_ARG(int64_t, cascade_min_prefix_len) = 0;
+    // number of pipeline stages, the devices are split into pp_size groups of
+    // consecutive devices, each runs a slice of the layers with tensor
+    // parallelism over the devices of the group.
+    DEFINE_ARG(int32_t, pp_size) = 1;
+
+    // number of micro-batches to split a batch into with pipeline
+    // parallelism, 0 means the number of pipeline stages.
+    DEFINE_ARG(int32_t, num_micro_batches) = 0;
+
+    // addresses (host:port) of worker services in other processes or hosts,
+    // each serving one device. they join the tensor parallel group after the
+    // local devices, and load the model weights from the same path on their
+    // hosts.
+    DEFINE_ARG(std::vector<std::string>, remote_workers);
+
+    // max number of weights files being read and copied to the devices at
+    // the same time when loading the model.
+    DEFINE_ARG(int32_t, max_inflight_weights_files) = 2;
+
+    // directory of the weights snapshot of the model: the weights of each
+    // rank after sharding and transformation. loaded instead of the
+    // checkpoint if it matches the parallelism, otherwise saved while
+    // loading the checkpoint. empty to disable.
+    DEFINE_ARG(std::string, weights_snapshot_dir);
+
+    // lora adapters to serve on top of the model as "name=path" pairs, where
+    // path is a peft adapter directory. the adapters are kept in host memory
+    // and paged into the max_loras slots on devices by lru.
+    DEFINE_ARG(std::vector<std::string>, lora_adapters);
+
+    // quantize the weights of a dense checkpoint at load, e.g. a draft model
+    // served next to a bigger target. only "fp8" is supported, with 16-bit
+    // activations. ignored if the checkpoint is already quantized.
+    DEFINE_ARG(std::string, quant_method);
+
+    // share the cuda graph memory pool and the attention workspace with the
+    // other engines on the same devices, whose forward passes never overlap,
+    // e.g. the target and draft engines of speculative decoding.
+    DEFINE_ARG(bool, share_device_resources) = false;
   };
 
   // create an engine with the given devices
@@ -66,6 +202,46 @@ class LLMEngine : public Engine {
   // step the engine forward by one step with the batch
   ModelOutput execute_model(Batch& batch) override;
 
+  // step the engine forward by one step with the batch asynchronously
+  folly::SemiFuture<ModelOutput> execute_model_async(Batch& batch) override;
+
+  // run up to max_steps decode steps on devices with the batch, feeding the
+  // sampled tokens back without returning to the host, e.g. for the draft
+  // tokens. fewer steps are run if some sequences are not ready to decode one
+  // token per step, see Batch::prepare_model_input(), or with pipeline
+  // parallelism.
+  ModelOutput execute_decode_steps(Batch& batch, uint32_t max_steps);
+
+  // offload/reload the weights of the local workers, not supported with
+  // remote workers.
+  bool offload_weights() override;
+  bool reload_weights() override;
+
+  // copy kv cache blocks from an engine with the same parallelism and kv
+  // cache layout, rank by rank. not supported with remote workers.
+  bool pull_kv_cache_blocks(Engine* src,
+                            const std::vector<int32_t>& src_to_dst) override;
+
+  // export/import the kv cache of the blocks of all layers, rank by rank.
+  // each layer of each rank takes 4 tensors: keys, values, key scales and
+  // value scales, the scales are empty if not quantized. not supported with
+  // remote workers.
+  std::vector<torch::Tensor> export_kv_cache(
+      const std::vector<int32_t>& block_ids,
+      bool quantize) override;
+  bool import_kv_cache(const std::vector<int32_t>& block_ids,
+                       const std::vector<torch::Tensor>& tensors) override;
+
+  // resize the kv cache of all workers, all or nothing. only supported with
+  // a resizable_cache_size.
+  bool resize_kv_cache(int64_t n_blocks) override;
+
+  int32_t lora_adapter_id(const std::string& name) const override;
+
+  size_t num_lora_slots() const override {
+    return lora_slots_ != nullptr ? lora_slots_->num_slots() : 0;
+  }
+
   const Tokenizer* tokenizer() const override { return tokenizer_.get(); }
 
   BlockManager* block_manager() const override { return block_manager_.get(); }
@@ -80,18 +256,50 @@ class LLMEngine : public Engine {
 
   const Options& options() const { return options_; }
 
+  torch::ScalarType dtype() const { return dtype_; }
+
   // initialize the engine with the given model weights
   bool init(const std::string& model_weights_path);
 
   bool init_model(const std::string& model_weights_path);
 
-  bool init_kv_cache(int64_t n_blocks);
+  // initialize the block manager and the kv caches of the workers
+  // max_blocks: max number of blocks to resize the kv cache to, 0 for a
+  // fixed size kv cache
+  bool init_kv_cache(int64_t n_blocks,
+                     int64_t n_host_blocks = 0,
+                     int64_t max_blocks = 0);
+
+  // initialize the kv caches of the workers only, for an engine whose blocks
+  // are allocated by the block manager of another engine, e.g. a draft
+  // engine sharing the blocks of the target engine. block_manager() returns
+  // null then.
+  bool init_worker_kv_caches(int64_t n_blocks,
+                             int64_t n_host_blocks = 0,
+                             int64_t max_blocks = 0);
+
+  // the number of kv cache blocks on each device
+  int64_t num_kv_cache_blocks() const { return num_kv_cache_blocks_; }
 
   bool capture_cuda_graphs();
 
+  // load the lora adapters into host memory
+  bool load_lora_adapters();
+
   // returns the memory size for the kv cache
   int64_t profile_memory_for_kv_cache();
 
+  // breakdown of the device memory of the local workers, in the order of
+  // their devices. the remote workers are not included.
+  std::vector<MemoryBreakdown> memory_breakdown();
+
+  // key of the memory profiling result in the profile cache
+  std::string profile_cache_key(const std::string& model_weights_path) const;
+
+  // key of the model and the kv cache layout held by the shared kv pool,
+  // which should match across the processes sharing the pool
+  uint64_t shared_pool_layout_key(const std::string& model_weights_path) const;
+
   // returns the memory size in bytes for each kv cache slot
   int64_t kv_cache_slot_size_in_bytes() const;
 
@@ -99,12 +307,62 @@ class LLMEngine : public Engine {
   int64_t calculate_kv_cache_blocks(int64_t cache_size_in_bytes) const;
 
  private:
+  // load the weights from the checkpoint into the local workers
+  bool load_weights(const ModelLoader& model_loader);
+
+  // assign device slots to the lora adapters of the batch, loading the
+  // adapters not on devices. returns false if no adapter is used.
+  bool assign_lora_slots(Batch& batch);
+
+  // pad batches with prefill sequences to the closest captured cuda graph
+  void pad_for_cuda_graph(ModelInput* model_inputs) const;
+
+  // record the padding added to the batch for the captured cuda graphs
+  void observe_cuda_graph_padding(const Batch& batch,
+                                  const ModelInput& model_inputs) const;
+
+  // split the batch into micro-batches and run them through the pipeline
+  // stages back to back, so that the stages work on different micro-batches
+  // at the same time.
+  folly::SemiFuture<ModelOutput> execute_micro_batches_async(Batch& batch);
+
+  // run the decoding sequences and the prefill sequences of a mixed batch,
+  // split into batches[0] and batches[1], concurrently on the local worker
+  folly::SemiFuture<ModelOutput> execute_prefill_decode_async(
+      std::shared_ptr<std::vector<Batch>> batches,
+      bool has_lora);
+
+  // run the step on the persistent loops of the local workers
+  folly::SemiFuture<ModelOutput> execute_on_step_loops_async(
+      Batch& batch,
+      ModelInput model_inputs);
+
+  // returns the number of data parallel attention groups, 1 if data
+  // parallel attention is disabled or not supported, see
+  // --data_parallel_attention.
+  int32_t data_parallel_attention_size() const;
+
+  // execute the batch with up to num_decode_steps decode steps on devices
+  folly::SemiFuture<ModelOutput> execute_steps_async(Batch& batch,
+                                                     uint32_t num_decode_steps);
+
   // options
   Options options_;
 
   // dtype
   torch::ScalarType dtype_;
 
+  // dtype of kv cache
+  torch::ScalarType kv_cache_dtype_;
+
+  // the number of kv cache blocks on each device, and the max number of
+  // blocks to resize to, 0 if the kv cache is not resizable.
+  int64_t num_kv_cache_blocks_ = 0;
+  int64_t max_kv_cache_blocks_ = 0;
+
+  // see shared_pool_layout_key(), 0 if the shared kv pool is disabled
+  uint64_t shared_pool_layout_key_ = 0;
+
   // model args
   ModelArgs args_;
 
@@ -120,15 +378,56 @@ class LLMEngine : public Engine {
   // a list of process groups, with each process group handling a single device
   std::vector<std::unique_ptr<ProcessGroup>> process_groups_;
 
+  // process groups across pipeline stages, one for each device, empty if
+  // there is only one stage
+  std::vector<std::unique_ptr<ProcessGroup>> pp_process_groups_;
+
+  // number of devices per pipeline stage
+  int32_t tp_size_ = 1;
+
+  // number of data parallel attention groups of the devices, each group
+  // attends to its own sequences with a kv cache of its own
+  int32_t dp_attention_size_ = 1;
+
   // batch sizes to capture cuda graphs
   std::vector<uint32_t> batch_sizes_;
 
+  // numbers of tokens to capture cuda graphs for mixed batches
+  std::vector<uint32_t> num_tokens_;
+
   // tokenizer
   std::unique_ptr<Tokenizer> tokenizer_;
 
+  // the channel to the step loops of the workers and the inputs of the step
+  // in flight, null if disabled. declared before the workers to outlive
+  // their loops.
+  std::unique_ptr<StepChannel> step_channel_;
+  ModelInput step_inputs_;
+
   // a list of workers, with each worker handling a partial of model
   std::vector<std::unique_ptr<Worker>> workers_;
 
+  // workers in other processes, with ranks after the local workers
+  std::vector<std::unique_ptr<RemoteWorker>> remote_workers_;
+
+  // persistent block tables, null if disabled
+  std::unique_ptr<BlockTables> block_tables_;
+
+  // persistent token counts for the penalties, null if disabled
+  std::unique_ptr<TokenCounts> token_counts_;
+
+  // per-step arena for the host tensors of the model inputs
+  std::unique_ptr<HostArena> host_arena_;
+
+  // lora adapters in pinned host memory with lora_B scaled, indexed by id
+  std::vector<std::unique_ptr<StateDict>> lora_adapters_;
+
+  // map from the name of lora adapter to its id
+  absl::flat_hash_map<std::string, int32_t> lora_ids_;
+
+  // slots of the lora adapters on devices, null if lora is disabled
+  std::unique_ptr<LoRASlots> lora_slots_;
+
   // config for kv cache
   int64_t n_local_kv_heads_ = 0;
   int64_t head_dim_ = 0;
@@ -0,0 +1,59 @@
+#include "lora_slots.h"
+
+#include <glog/logging.h>
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace llm {
+
+LoRASlots::LoRASlots(size_t n_slots, size_t n_loras)
+    : slots_(n_loras, -1), loras_(n_slots, -1), last_used_(n_slots, 0) {}
+
+std::vector<std::pair<int32_t, int32_t>> LoRASlots::assign(
+    const std::vector<int32_t>& lora_ids) {
+  CHECK_LE(lora_ids.size(), loras_.size())
+      << "too many lora adapters in the batch";
+  ++clock_;
+  // pin the resident adapters first so that they are not evicted
+  for (const int32_t lora_id : lora_ids) {
+    CHECK(lora_id >= 0 && static_cast<size_t>(lora_id) < slots_.size())
+        << "invalid lora id " << lora_id;
+    if (const int32_t slot = slots_[lora_id]; slot >= 0) {
+      last_used_[slot] = clock_;
+    }
+  }
+
+  std::vector<std::pair<int32_t, int32_t>> to_load;
+  for (const int32_t lora_id : lora_ids) {
+    if (slots_[lora_id] >= 0) {
+      continue;
+    }
+    // pick a free slot, otherwise the least recently used one
+    int32_t victim = -1;
+    for (size_t slot = 0; slot < loras_.size(); ++slot) {
+      if (last_used_[slot] == clock_) {
+        continue;
+      }
+      if (loras_[slot] < 0) {
+        victim = static_cast<int32_t>(slot);
+        break;
+      }
+      if (victim < 0 || last_used_[slot] < last_used_[victim]) {
+        victim = static_cast<int32_t>(slot);
+      }
+    }
+    CHECK_GE(victim, 0) << "duplicated lora adapters in the batch";
+    if (const int32_t evicted = loras_[victim]; evicted >= 0) {
+      slots_[evicted] = -1;
+    }
+    loras_[victim] = lora_id;
+    slots_[lora_id] = victim;
+    last_used_[victim] = clock_;
+    to_load.emplace_back(lora_id, victim);
+  }
+  return to_load;
+}
+
+}  // namespace llm
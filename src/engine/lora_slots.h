@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace llm {
+
+// Host side bookkeeping for the slots of the lora adapter pool on devices.
+// The adapters used by a batch get a slot each, and the least recently used
+// adapters not in the batch are evicted to make room. Evicted adapters stay
+// in host memory and are loaded into a slot again when used.
+class LoRASlots final {
+ public:
+  // n_slots: number of adapter slots on devices
+  // n_loras: number of adapters, identified by [0, n_loras)
+  LoRASlots(size_t n_slots, size_t n_loras);
+
+  // assign slots to the distinct adapters used by a batch, at most n_slots.
+  // returns the (lora_id, slot) pairs of the adapters to load into their
+  // slots before running the batch.
+  std::vector<std::pair<int32_t, int32_t>> assign(
+      const std::vector<int32_t>& lora_ids);
+
+  // the slot of each adapter indexed by lora id, -1 if not on devices
+  const std::vector<int32_t>& slots() const { return slots_; }
+
+  size_t num_slots() const { return loras_.size(); }
+
+ private:
+  // slot of each adapter, -1 if not on devices
+  std::vector<int32_t> slots_;
+
+  // adapter in each slot, -1 if the slot is free
+  std::vector<int32_t> loras_;
+
+  // the last batch using each slot
+  std::vector<uint64_t> last_used_;
+
+  // number of batches assigned so far
+  uint64_t clock_ = 0;
+};
+
+}  // namespace llm
@@ -0,0 +1,35 @@
+#include "lora_slots.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace llm {
+
+using LoadList = std::vector<std::pair<int32_t, int32_t>>;
+
+TEST(LoRASlotsTest, EvictLeastRecentlyUsed) {
+  LoRASlots lora_slots(/*n_slots=*/2, /*n_loras=*/4);
+
+  // load into free slots
+  EXPECT_EQ(lora_slots.assign({0, 1}), LoadList({{0, 0}, {1, 1}}));
+  EXPECT_EQ(lora_slots.slots(), std::vector<int32_t>({0, 1, -1, -1}));
+
+  // resident adapters are not loaded again
+  EXPECT_TRUE(lora_slots.assign({1}).empty());
+
+  // adapter 0 is the least recently used
+  EXPECT_EQ(lora_slots.assign({2}), LoadList({{2, 0}}));
+  EXPECT_EQ(lora_slots.slots(), std::vector<int32_t>({-1, 1, 0, -1}));
+
+  // adapters in the batch are not evicted
+  EXPECT_EQ(lora_slots.assign({2, 3}), LoadList({{3, 1}}));
+  EXPECT_EQ(lora_slots.slots(), std::vector<int32_t>({-1, -1, 0, 1}));
+
+  // no adapter
+  EXPECT_TRUE(lora_slots.assign({}).empty());
+}
+
+}  // namespace llm
@@ -0,0 +1,130 @@
+#include "model_input_serializer.h"
+
+#include <ATen/core/Dict.h>
+#include <glog/logging.h>
+#include <torch/serialize.h>
+#include <torch/torch.h>
+
+#include <string>
+#include <vector>
+
+namespace llm {
+namespace {
+
+// tensor fields of ModelInput
+// NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
+#define MODEL_INPUT_TENSORS(X)                  \
+  X(token_ids)                                  \
+  X(positions)                                  \
+  X(input_params.q_cu_seq_lens)                 \
+  X(input_params.kv_cu_seq_lens)                \
+  X(input_params.new_cache_slots)               \
+  X(input_params.block_tables)                  \
+  X(input_params.cu_block_lens)                 \
+  X(input_params.tree_mask)                     \
+  X(input_params.prefix_q_cu_seq_lens)          \
+  X(input_params.prefix_kv_cu_seq_lens)         \
+  X(input_params.prefix_cu_block_lens)          \
+  X(input_params.suffix_kv_cu_seq_lens)         \
+  X(input_params.suffix_cu_block_lens)          \
+  X(input_params.offload_q_idxes)               \
+  X(input_params.offload_device_blocks)         \
+  X(input_params.offload_host_blocks)           \
+  X(input_params.offload_kv_lens)               \
+  X(sampling_params.selected_token_idxes)       \
+  X(sampling_params.frequency_penalties)        \
+  X(sampling_params.presence_penalties)         \
+  X(sampling_params.repetition_penalties)       \
+  X(sampling_params.temperatures)               \
+  X(sampling_params.top_p)                      \
+  X(sampling_params.top_k)                      \
+  X(sampling_params.unique_token_ids)           \
+  X(sampling_params.unique_token_counts)        \
+  X(sampling_params.unique_token_ids_lens)      \
+  X(sampling_params.sample_idxes)               \
+  X(sampling_params.do_sample)                  \
+  X(sampling_params.rng_seeds)                  \
+  X(sampling_params.rng_offsets)                \
+  X(sampling_params.logprobs_idxes)             \
+  X(sampling_params.scored_token_idxes)         \
+  X(sampling_params.scored_token_ids)           \
+  X(swap_out_blocks)                            \
+  X(swap_in_blocks)                             \
+  X(copy_blocks)                                \
+  X(shared_out_blocks)                          \
+  X(shared_in_blocks)                           \
+  X(block_table_updates)                        \
+  X(token_count_rows)                           \
+  X(token_count_resets)                         \
+  X(token_count_updates)                        \
+  X(stop_token_ids)                             \
+  X(num_remaining_tokens)
+
+// scalar fields of ModelInput, stored as int64 tensors
+// NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
+#define MODEL_INPUT_SCALARS(X)              \
+  X(input_params.num_sequences)             \
+  X(input_params.kv_max_seq_len)            \
+  X(input_params.q_max_seq_len)             \
+  X(input_params.block_table_width)         \
+  X(input_params.num_prefix_groups)         \
+  X(input_params.prefix_q_max_seq_len)      \
+  X(input_params.prefix_kv_max_seq_len)     \
+  X(input_params.suffix_kv_max_seq_len)     \
+  X(sampling_params.logprobs)               \
+  X(sampling_params.max_top_logprobs)       \
+  X(sampling_params.max_top_k)              \
+  X(block_table_rows)                       \
+  X(block_table_width)                      \
+  X(token_count_num_rows)                   \
+  X(token_count_width)                      \
+  X(num_decode_steps)
+
+}  // namespace
+
+std::string serialize_model_input(const ModelInput& input) {
+  c10::Dict<std::string, torch::Tensor> dict;
+  // NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
+#define WRITE_TENSOR(field)                \
+  if (input.field.defined()) {             \
+    CHECK(input.field.is_cpu()) << #field; \
+    dict.insert(#field, input.field);      \
+  }
+  MODEL_INPUT_TENSORS(WRITE_TENSOR)
+#undef WRITE_TENSOR
+
+  // NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
+#define WRITE_SCALAR(field) \
+  dict.insert(#field, torch::tensor(static_cast<int64_t>(input.field)));
+  MODEL_INPUT_SCALARS(WRITE_SCALAR)
+#undef WRITE_SCALAR
+
+  const std::vector<char> bytes = torch::pickle_save(dict);
+  return {bytes.begin(), bytes.end()};
+}
+
+ModelInput deserialize_model_input(const std::string& bytes) {
+  const auto value =
+      torch::pickle_load(std::vector<char>(bytes.begin(), bytes.end()));
+  const auto dict = c10::impl::toTypedDict<std::string, torch::Tensor>(
+      value.toGenericDict());
+
+  ModelInput input;
+  // NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
+#define READ_TENSOR(field)                             \
+  if (auto it = dict.find(#field); it != dict.end()) { \
+    input.field = it->value();                         \
+  }
+  MODEL_INPUT_TENSORS(READ_TENSOR)
+#undef READ_TENSOR
+
+  // NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
+#define READ_SCALAR(field)                                               \
+  input.field =                                                          \
+      static_cast<decltype(input.field)>(dict.at(#field).item<int64_t>());
+  MODEL_INPUT_SCALARS(READ_SCALAR)
+#undef READ_SCALAR
+  return input;
+}
+
+}  // namespace llm
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+
+#include "parameters.h"
+
+namespace llm {
+
+// serialize the model input on host into bytes, e.g. to send it to workers
+// in other processes. undefined tensors are skipped.
+std::string serialize_model_input(const ModelInput& input);
+
+// deserialize the model input from the bytes of serialize_model_input, the
+// tensors are on host.
+ModelInput deserialize_model_input(const std::string& bytes);
+
+}  // namespace llm
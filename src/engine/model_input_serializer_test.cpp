@@ -0,0 +1,47 @@
+#include "model_input_serializer.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+namespace llm {
+
+TEST(ModelInputSerializerTest, RoundTrip) {
+  ModelInput input;
+  input.token_ids = torch::tensor({1, 3, 5, 7}, torch::kInt);
+  input.positions = torch::arange(4, torch::kInt);
+  input.input_params.num_sequences = 2;
+  input.input_params.q_max_seq_len = 3;
+  input.input_params.kv_max_seq_len = 9;
+  input.input_params.q_cu_seq_lens = torch::tensor({0, 3, 4}, torch::kInt);
+  input.input_params.kv_cu_seq_lens = torch::tensor({0, 3, 9}, torch::kInt);
+  input.sampling_params.temperatures = torch::tensor({0.5f, 1.0f});
+  input.sampling_params.logprobs = true;
+  input.sampling_params.max_top_logprobs = 5;
+  input.copy_blocks = torch::tensor({{1, 2}}, torch::kInt);
+  input.num_decode_steps = 4;
+
+  const ModelInput output =
+      deserialize_model_input(serialize_model_input(input));
+  EXPECT_TRUE(torch::equal(output.token_ids, input.token_ids));
+  EXPECT_TRUE(torch::equal(output.positions, input.positions));
+  EXPECT_EQ(output.input_params.num_sequences, 2);
+  EXPECT_EQ(output.input_params.q_max_seq_len, 3);
+  EXPECT_EQ(output.input_params.kv_max_seq_len, 9);
+  EXPECT_TRUE(torch::equal(output.input_params.q_cu_seq_lens,
+                           input.input_params.q_cu_seq_lens));
+  EXPECT_TRUE(torch::equal(output.input_params.kv_cu_seq_lens,
+                           input.input_params.kv_cu_seq_lens));
+  EXPECT_TRUE(torch::equal(output.sampling_params.temperatures,
+                           input.sampling_params.temperatures));
+  EXPECT_TRUE(output.sampling_params.logprobs);
+  EXPECT_EQ(output.sampling_params.max_top_logprobs, 5);
+  EXPECT_TRUE(torch::equal(output.copy_blocks, input.copy_blocks));
+  EXPECT_EQ(output.num_decode_steps, 4);
+
+  // undefined tensors stay undefined
+  EXPECT_FALSE(output.input_params.block_tables.defined());
+  EXPECT_FALSE(output.sampling_params.top_k.defined());
+  EXPECT_FALSE(output.swap_in_blocks.defined());
+}
+
+}  // namespace llm
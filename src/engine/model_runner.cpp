@@ -1,13 +1,23 @@
 #include "model_runner.h"
 
 #include <c10/core/TensorOptions.h>
+#include <c10/cuda/CUDACachingAllocator.h>
 #include <c10/cuda/CUDAGraphsC10Utils.h>
 #include <c10/cuda/CUDAGuard.h>
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include <algorithm>
+#include <map>
+#include <mutex>
+
 #include "common/metrics.h"
+#include "common/pretty_print.h"
+#include "common/scope_guard.h"
+#include "layers/embedding.h"
+#include "layers/lora_linear.h"
 #include "memory/kv_cache.h"
+#include "memory/memory.h"
 #include "models/causal_lm.h"
 #include "models/parameters.h"
 
@@ -16,16 +26,61 @@ DEFINE_COUNTER_FAMILY(num_model_execution_total,
 DEFINE_COUNTER_INSTANCE(num_cuda_graph_replayed_total,
                         num_model_execution_total,
                         {{"mode", "cuda_graph"}});
+DEFINE_COUNTER_INSTANCE(num_piecewise_cuda_graph_replayed_total,
+                        num_model_execution_total,
+                        {{"mode", "piecewise_cuda_graph"}});
 DEFINE_COUNTER_INSTANCE(num_eager_execution_total,
                         num_model_execution_total,
                         {{"mode", "eager"}});
 
 namespace llm {
+namespace {
+// the graph memory pool of the runners on a device sharing their resources.
+// the pool is never released, as the graphs are kept until exit.
+at::cuda::MempoolId_t shared_graph_pool(const torch::Device& device) {
+  static std::mutex mutex;
+  static std::map<int64_t, at::cuda::MempoolId_t> pools;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = pools.find(device.index());
+  if (it == pools.end()) {
+    it = pools.emplace(device.index(), at::cuda::graph_pool_handle()).first;
+  }
+  return it->second;
+}
+
+// the flashinfer plan of the runners on a device sharing their resources,
+// alive as long as one of them is.
+std::shared_ptr<FlashInferPlan> shared_flash_infer_plan(
+    const torch::Device& device) {
+  static std::mutex mutex;
+  static std::map<int64_t, std::weak_ptr<FlashInferPlan>> plans;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto& weak_plan = plans[device.index()];
+  auto plan = weak_plan.lock();
+  if (plan == nullptr) {
+    plan = std::make_shared<FlashInferPlan>(device);
+    weak_plan = plan;
+  }
+  return plan;
+}
+}  // namespace
 
 ModelRunner::ModelRunner(CausalLM* model,
                          const torch::Device& device,
                          const Options& options)
-    : model_(model), device_(device), options_(options) {
+    : model_(model),
+      device_(device),
+      options_(options),
+      layer_profiler_(options.model_type()) {
+  if (device_.is_cuda() && options_.n_local_heads() > 0 &&
+      FlashInferPlan::enabled()) {
+    torch::DeviceGuard device_guard(device_);
+    // the workspaces are planned on host before each forward pass, which
+    // never overlaps between the runners sharing them.
+    flash_infer_plan_ = options_.share_device_resources()
+                            ? shared_flash_infer_plan(device_)
+                            : std::make_shared<FlashInferPlan>(device_);
+  }
   if (device_.is_cuda() && !options_.cuda_graph_batch_sizes().empty()) {
     // find the biggest batch size
     max_batch_size_ =
@@ -36,17 +91,24 @@ ModelRunner::ModelRunner(CausalLM* model,
     torch::DeviceGuard device_guard(device_);
     // allocate tensors for sharing among graphs
     auto tensor_options = torch::dtype(torch::kInt32).device(device_);
-    const int64_t max_num_tokens = num_decoding_tokens * max_batch_size_;
+    const int64_t max_decoding_tokens = num_decoding_tokens * max_batch_size_;
+    int64_t max_num_tokens = max_decoding_tokens;
+    if (!options_.cuda_graph_num_tokens().empty()) {
+      max_num_tokens = std::max<int64_t>(
+          max_num_tokens,
+          *std::max_element(options_.cuda_graph_num_tokens().begin(),
+                            options_.cuda_graph_num_tokens().end()));
+    }
     token_ids_ = torch::zeros({max_num_tokens}, tensor_options);
     positions_ = torch::zeros({max_num_tokens}, tensor_options);
     q_cu_seq_lens_ = torch::range(
         /*start=*/0,
-        /*end=*/max_num_tokens + 1,
+        /*end=*/max_decoding_tokens + 1,
         /*step=*/num_decoding_tokens,
         tensor_options);
     kv_cu_seq_lens_ = torch::range(
         /*start=*/0,
-        /*end=*/max_num_tokens + 1,
+        /*end=*/max_decoding_tokens + 1,
         /*step=*/num_decoding_tokens,
         tensor_options);
     new_cache_slots_ = torch::zeros({max_num_tokens}, tensor_options);
@@ -54,19 +116,35 @@ ModelRunner::ModelRunner(CausalLM* model,
     const auto max_seq_len = options_.cuda_graph_max_seq_len();
     const auto block_size = options_.block_size();
     // round up and add one additional block for speculative decoding
-    const int64_t max_block_table_len =
-        (max_seq_len + block_size - 1) / block_size + 1;
+    max_block_table_len_ = (max_seq_len + block_size - 1) / block_size + 1;
     block_tables_ =
-        torch::zeros({max_batch_size_ * max_block_table_len}, tensor_options);
+        torch::zeros({max_batch_size_ * max_block_table_len_}, tensor_options);
     cu_block_lens_ = torch::zeros({max_batch_size_ + 1}, tensor_options);
+  }
+  if (device_.is_cuda() &&
+      (!options_.cuda_graph_batch_sizes().empty() ||
+       !options_.piecewise_cuda_graph_num_tokens().empty())) {
+    // all the captured graphs share one memory pool, also with the graphs of
+    // the other runners on the device if share_device_resources. the graphs
+    // are replayed one at a time, so their activations can alias.
+    mem_pool_ = options_.share_device_resources()
+                    ? shared_graph_pool(device_)
+                    : at::cuda::graph_pool_handle();
+  }
+}
 
-    mem_pool_ = at::cuda::graph_pool_handle();
+ModelRunner::~ModelRunner() {
+  if (activation_pool_.has_value()) {
+    // the blocks of the pool are freed once all its tensors are released
+    c10::cuda::CUDACachingAllocator::releasePool(device_.index(),
+                                                 activation_pool_.value());
   }
 }
 
 // capture graph with batch size list
 void ModelRunner::capture_cuda_graphs(uint32_t batch_size,
-                                      std::vector<KVCache>& kv_cache) {
+                                      std::vector<KVCache>& kv_cache,
+                                      uint32_t num_tokens) {
   if (!device_.is_cuda() || options_.cuda_graph_batch_sizes().empty()) {
     // no batch sizes to capture CUDA graphs
     return;
@@ -75,7 +153,11 @@ void ModelRunner::capture_cuda_graphs(uint32_t batch_size,
 
   const int64_t num_decoding_tokens = options_.num_decoding_tokens();
   const auto max_seq_len = options_.cuda_graph_max_seq_len();
-  const int64_t n_tokens = num_decoding_tokens * batch_size;
+  const bool is_mixed = num_tokens > 0;
+  const int64_t n_tokens =
+      is_mixed ? num_tokens : num_decoding_tokens * batch_size;
+  CHECK_LE(n_tokens, token_ids_.size(/*dim=*/0)) << "num tokens too big";
+  CHECK_GE(n_tokens, batch_size) << "at least one token per sequence";
 
   // prepare input tensors for current batch size
   auto flatten_tokens =
@@ -87,6 +169,20 @@ void ModelRunner::capture_cuda_graphs(uint32_t batch_size,
   params.num_sequences = static_cast<int32_t>(batch_size);
   params.q_max_seq_len = static_cast<int32_t>(num_decoding_tokens);
   params.kv_max_seq_len = static_cast<int32_t>(max_seq_len);
+  // the shared buffers may hold values of previous captures
+  auto cu_seq_lens = torch::arange(batch_size + 1, q_cu_seq_lens_.options());
+  if (is_mixed) {
+    // one token for each sequence except the last one, which takes the rest.
+    // the kernels are launched for the longest possible query.
+    params.q_max_seq_len = static_cast<int32_t>(n_tokens - batch_size + 1);
+    cu_seq_lens[batch_size] = n_tokens;
+  } else {
+    cu_seq_lens *= num_decoding_tokens;
+  }
+  q_cu_seq_lens_.slice(/*dim=*/0, /*start=*/0, /*end=*/batch_size + 1)
+      .copy_(cu_seq_lens);
+  kv_cu_seq_lens_.slice(/*dim=*/0, /*start=*/0, /*end=*/batch_size + 1)
+      .copy_(cu_seq_lens);
   params.q_cu_seq_lens = q_cu_seq_lens_.slice(
       /*dim=*/0, /*start=*/0, /*end=*/batch_size + 1);
   params.kv_cu_seq_lens = kv_cu_seq_lens_.slice(
@@ -103,7 +199,17 @@ void ModelRunner::capture_cuda_graphs(uint32_t batch_size,
       mem_pool_, model_, flatten_tokens, flatten_positions, params, kv_cache);
 
   // save the graph
-  graphs_[batch_size] = std::move(graph);
+  if (is_mixed) {
+    mixed_graphs_[{num_tokens, batch_size}] = std::move(graph);
+  } else {
+    graphs_[batch_size] = std::move(graph);
+  }
+}
+
+void ModelRunner::reset_cuda_graphs() {
+  graphs_.clear();
+  mixed_graphs_.clear();
+  piecewise_graphs_.clear();
 }
 
 // tokens: [num_tokens]
@@ -114,30 +220,321 @@ torch::Tensor ModelRunner::forward(const torch::Tensor& tokens,
                                    std::vector<KVCache>& kv_caches,
                                    const InputParameters& params) {
   const uint32_t batch_size = params.num_sequences;
+  const uint32_t n_tokens = tokens.size(/*dim=*/0);
+  // max seq len is supported by captured graph
+  const bool seq_len_supported =
+      params.kv_max_seq_len <= options_.cuda_graph_max_seq_len();
+  // each sequence has the same number of decoding tokens
+  const bool same_num_decoding_tokens =
+      params.q_max_seq_len == options_.num_decoding_tokens() &&
+      n_tokens == batch_size * options_.num_decoding_tokens();
+
+  if (device_.is_cuda() && layer_profiler_.should_profile()) {
+    // run in eager mode to time the kernels of each layer. all the ranks
+    // profile the same forward passes since they run the same batches.
+    layer_profiler_.begin_step();
+    auto hidden_states = forward_eager(tokens, positions, kv_caches, params);
+    layer_profiler_.end_step(same_num_decoding_tokens ? "decode" : "prefill",
+                             n_tokens);
+    return hidden_states;
+  }
+
   // check if captured graph exists
-  auto it = graphs_.find(batch_size);
-  if (it != graphs_.end()) {
-    // max seq len is supported by captured graph
-    const bool seq_len_supported =
-        params.kv_max_seq_len <= options_.cuda_graph_max_seq_len();
-    // each sequence has the same number of decoding tokens
-    const uint32_t n_tokens = tokens.size(/*dim=*/0);
-    const bool same_num_decoding_tokens =
-        params.q_max_seq_len == options_.num_decoding_tokens() &&
-        n_tokens == batch_size * options_.num_decoding_tokens();
-
-    // replay the graph if all conditions are met
-    if (seq_len_supported && same_num_decoding_tokens) {
+  CudaGraph* graph = nullptr;
+  if (same_num_decoding_tokens) {
+    auto it = graphs_.find(batch_size);
+    if (it != graphs_.end()) {
+      graph = it->second.get();
+    }
+  } else {
+    // batches with prefill sequences are padded to the captured shape
+    auto it = mixed_graphs_.find({n_tokens, batch_size});
+    if (it != mixed_graphs_.end()) {
+      graph = it->second.get();
+    }
+  }
+
+  // the image embeddings are merged into the token embeddings eagerly
+  const bool has_images = ImageEmbeddings::current().defined();
+  // replay the graph if all conditions are met, tree masks, cascade
+  // attention, kv scores, offloaded kv cache, lora adapters and images are
+  // not captured
+  const bool can_replay = seq_len_supported && !params.tree_mask.defined() &&
+                          params.num_prefix_groups == 0 &&
+                          !params.kv_scores.defined() &&
+                          !params.offload_q_idxes.defined() &&
+                          !LoRALinearImpl::slots().defined() && !has_images;
+  if (graph == nullptr && can_replay && options_.lazy_cuda_graph_capture()) {
+    graph = capture_lazily(
+        batch_size, same_num_decoding_tokens ? 0 : n_tokens, kv_caches);
+  }
+  if (graph != nullptr && can_replay) {
+    const InputParameters packed_params = params.block_table_width > 0
+                                              ? pack_block_tables(params)
+                                              : params;
+    if (graph->fits(packed_params)) {
       COUNTER_INC(num_cuda_graph_replayed_total);
-      return it->second->replay(tokens, positions, params);
+      return graph->replay(tokens, positions, packed_params);
+    }
+  }
+
+  // plan the flashinfer kernels of the batch once before the decoder layers,
+  // the attention of all layers runs with the plan in the piecewise graphs
+  // and in eager mode.
+  FlashInferPlan* plan = nullptr;
+  const auto dtype = c10::typeMetaToScalarType(model_->options().dtype());
+  if (flash_infer_plan_ != nullptr && !kv_caches.empty() &&
+      FlashInferPlan::should_use(
+          params, options_.n_local_heads(), kv_caches[0], dtype)) {
+    flash_infer_plan_->plan(
+        params, options_.n_local_heads(), kv_caches[0], dtype);
+    plan = flash_infer_plan_.get();
+  }
+  FlashInferPlan::set_current(plan);
+  SCOPE_GUARD([] { FlashInferPlan::set_current(nullptr); });
+
+  // replay the segments between the attention calls for the other batches,
+  // the attention runs eagerly with the parameters of the batch. lora
+  // adapters and images are not captured.
+  if (!LoRALinearImpl::slots().defined() && !has_images) {
+    PiecewiseCudaGraph* piecewise = find_piecewise_graph(n_tokens, kv_caches);
+    if (piecewise != nullptr) {
+      COUNTER_INC(num_piecewise_cuda_graph_replayed_total);
+      // the padding tokens keep the values of previous batches
+      piecewise->flatten_tokens.slice(/*dim=*/0, /*start=*/0, /*end=*/n_tokens)
+          .copy_(tokens, /*non_blocking=*/true);
+      piecewise->flatten_positions
+          .slice(/*dim=*/0, /*start=*/0, /*end=*/n_tokens)
+          .copy_(positions, /*non_blocking=*/true);
+      return piecewise->graph.replay(n_tokens, params)
+          .slice(/*dim=*/0, /*start=*/0, /*end=*/n_tokens);
     }
   }
 
   // run model directly in eager mode
+  return forward_eager(tokens, positions, kv_caches, params);
+}
+
+torch::Tensor ModelRunner::forward_prefill(const torch::Tensor& tokens,
+                                           const torch::Tensor& positions,
+                                           std::vector<KVCache>& kv_caches,
+                                           const InputParameters& params) {
   COUNTER_INC(num_eager_execution_total);
+  FlashInferPlan* plan = nullptr;
+  const auto dtype = c10::typeMetaToScalarType(model_->options().dtype());
+  if (flash_infer_plan_ != nullptr && !kv_caches.empty() &&
+      FlashInferPlan::should_use(
+          params, options_.n_local_heads(), kv_caches[0], dtype)) {
+    if (prefill_flash_infer_plan_ == nullptr) {
+      torch::DeviceGuard device_guard(device_);
+      prefill_flash_infer_plan_ = std::make_unique<FlashInferPlan>(device_);
+    }
+    prefill_flash_infer_plan_->plan(
+        params, options_.n_local_heads(), kv_caches[0], dtype);
+    plan = prefill_flash_infer_plan_.get();
+  }
+  FlashInferPlan::set_current(plan);
+  SCOPE_GUARD([] { FlashInferPlan::set_current(nullptr); });
   return model_->forward(tokens, positions, kv_caches, params);
 }
 
+torch::Tensor ModelRunner::forward_eager(const torch::Tensor& tokens,
+                                         const torch::Tensor& positions,
+                                         std::vector<KVCache>& kv_caches,
+                                         const InputParameters& params) {
+  COUNTER_INC(num_eager_execution_total);
+  if (!device_.is_cuda()) {
+    return model_->forward(tokens, positions, kv_caches, params);
+  }
+  // the allocator keeps the stats on the host, no need to synchronize
+  memory::reset_peak_memory_stats(device_);
+  const int64_t allocated = memory::allocator_stats(device_).allocated_bytes;
+  if (activation_pool_.has_value()) {
+    // only the allocations on the compute stream go to the pool, e.g. not
+    // the weights prefetched by the layer streamer
+    c10::cuda::CUDACachingAllocator::beginAllocateToPool(
+        device_.index(),
+        activation_pool_.value(),
+        [stream = c10::cuda::getCurrentCUDAStream().stream()](
+            cudaStream_t s) { return s == stream; });
+  }
+  auto hidden_states = model_->forward(tokens, positions, kv_caches, params);
+  if (activation_pool_.has_value()) {
+    c10::cuda::CUDACachingAllocator::endAllocateToPool(
+        device_.index(), activation_pool_.value());
+  }
+  const int64_t peak =
+      memory::allocator_stats(device_).peak_allocated_bytes - allocated;
+
+  int64_t num_tokens = 1;
+  while (num_tokens < tokens.size(/*dim=*/0)) {
+    num_tokens *= 2;
+  }
+  auto& max_peak = peak_activation_bytes_[num_tokens];
+  max_peak = std::max(max_peak, peak);
+  return hidden_states;
+}
+
+int64_t ModelRunner::cuda_graph_pool_bytes() const {
+  if (!device_.is_cuda() ||
+      (options_.cuda_graph_batch_sizes().empty() &&
+       options_.piecewise_cuda_graph_num_tokens().empty())) {
+    // no memory pool for cuda graphs
+    return 0;
+  }
+  // N.B. a shared pool is reported by each of the runners sharing it
+  return memory::memory_pool_size(device_, mem_pool_);
+}
+
+void ModelRunner::reserve_activation_pool(std::vector<KVCache>& kv_caches) {
+  const int64_t n_tokens = options_.activation_pool_num_tokens();
+  if (!device_.is_cuda() || n_tokens <= 0 || activation_pool_.has_value()) {
+    return;
+  }
+  torch::DeviceGuard device_guard(device_);
+  activation_pool_ = at::cuda::graph_pool_handle();
+
+  const auto tensor_options = torch::dtype(torch::kInt32).device(device_);
+  const auto tokens = torch::zeros({n_tokens}, tensor_options);
+  const auto positions = torch::arange(n_tokens, tensor_options);
+
+  // the dummy prefill writes the kv of every token into slot 0 of block 0 of
+  // the kv caches. the slot's contents don't matter: block 0 is the padding
+  // block, and no request is served before the pool is reserved at startup.
+  // all the ranks run the dummy forward at the same time for the collectives
+  forward_eager(tokens, positions, kv_caches, dummy_prefill_params(n_tokens));
+  torch::cuda::synchronize();
+  LOG(INFO) << "Reserved " << readable_size(activation_pool_bytes())
+            << " for the activations of " << n_tokens << " tokens on "
+            << device_;
+}
+
+int64_t ModelRunner::activation_pool_bytes() const {
+  if (!activation_pool_.has_value()) {
+    return 0;
+  }
+  return memory::memory_pool_size(device_, activation_pool_.value());
+}
+
+ModelRunner::CudaGraph* ModelRunner::capture_lazily(
+    uint32_t batch_size,
+    uint32_t num_tokens,
+    std::vector<KVCache>& kv_caches) {
+  if (!device_.is_cuda()) {
+    return nullptr;
+  }
+  const auto& batch_sizes = options_.cuda_graph_batch_sizes();
+  if (std::find(batch_sizes.begin(), batch_sizes.end(), batch_size) ==
+      batch_sizes.end()) {
+    return nullptr;
+  }
+  const auto& all_num_tokens = options_.cuda_graph_num_tokens();
+  if (num_tokens > 0 &&
+      std::find(all_num_tokens.begin(), all_num_tokens.end(), num_tokens) ==
+          all_num_tokens.end()) {
+    return nullptr;
+  }
+  // the dummy inputs of the capture only write into the padding block 0, so
+  // it is safe to capture while serving. all the ranks run the same batch,
+  // so they capture the graphs with collectives at the same time.
+  LOG(INFO) << "Capturing CUDA graph at first use, batch_size: " << batch_size
+            << ", num_tokens: " << num_tokens;
+  capture_cuda_graphs(batch_size, kv_caches, num_tokens);
+  if (num_tokens > 0) {
+    return mixed_graphs_[{num_tokens, batch_size}].get();
+  }
+  return graphs_[batch_size].get();
+}
+
+InputParameters ModelRunner::dummy_prefill_params(int64_t n_tokens) const {
+  const auto tensor_options = torch::dtype(torch::kInt32).device(device_);
+  const int64_t block_size = options_.block_size();
+  const int64_t n_blocks = (n_tokens + block_size - 1) / block_size;
+  InputParameters params;
+  params.num_sequences = 1;
+  params.q_max_seq_len = static_cast<int32_t>(n_tokens);
+  params.kv_max_seq_len = static_cast<int32_t>(n_tokens);
+  params.q_cu_seq_lens = torch::tensor({0, static_cast<int32_t>(n_tokens)},
+                                       tensor_options);
+  params.kv_cu_seq_lens = params.q_cu_seq_lens;
+  // every token is written into slot 0 and read from block 0
+  params.new_cache_slots = torch::zeros({n_tokens}, tensor_options);
+  params.block_tables = torch::zeros({n_blocks}, tensor_options);
+  params.cu_block_lens = torch::tensor({0, static_cast<int32_t>(n_blocks)},
+                                       tensor_options);
+  return params;
+}
+
+ModelRunner::PiecewiseCudaGraph* ModelRunner::find_piecewise_graph(
+    uint32_t n_tokens,
+    std::vector<KVCache>& kv_caches) {
+  if (!device_.is_cuda()) {
+    return nullptr;
+  }
+  // the smallest bucket that fits
+  uint32_t num_tokens = 0;
+  for (const auto bucket : options_.piecewise_cuda_graph_num_tokens()) {
+    if (bucket >= n_tokens && (num_tokens == 0 || bucket < num_tokens)) {
+      num_tokens = bucket;
+    }
+  }
+  if (num_tokens == 0) {
+    return nullptr;
+  }
+  auto& graph = piecewise_graphs_[num_tokens];
+  if (graph != nullptr) {
+    return graph.get();
+  }
+
+  // all the ranks run the same batch, so they capture the graphs with
+  // collectives at the same time.
+  LOG(INFO) << "Capturing piecewise CUDA graph at first use, num_tokens: "
+            << num_tokens;
+  graph = std::make_unique<PiecewiseCudaGraph>();
+  const auto tensor_options = torch::dtype(torch::kInt32).device(device_);
+  graph->flatten_tokens = torch::zeros({num_tokens}, tensor_options);
+  graph->flatten_positions = torch::arange(num_tokens, tensor_options);
+  const auto params = dummy_prefill_params(num_tokens);
+
+  // warm up model before capturing the graph
+  torch::cuda::synchronize();
+  model_->forward(
+      graph->flatten_tokens, graph->flatten_positions, kv_caches, params);
+  torch::cuda::synchronize();
+  graph->graph.capture(mem_pool_, [&] {
+    return model_->forward(
+        graph->flatten_tokens, graph->flatten_positions, kv_caches, params);
+  });
+  torch::cuda::synchronize();
+  LOG(INFO) << "Captured " << graph->graph.num_splits() + 1
+            << " segments for " << num_tokens << " tokens";
+  return graph.get();
+}
+
+InputParameters ModelRunner::pack_block_tables(
+    const InputParameters& params) const {
+  const int64_t batch_size = params.num_sequences;
+  const int64_t width = params.block_table_width;
+  // every sequence fits in max_block_table_len_ blocks for captured graphs
+  const int64_t packed_width = std::min(width, max_block_table_len_);
+
+  // row of each sequence: cu_block_lens[i] / width
+  const auto rows =
+      params.cu_block_lens.slice(/*dim=*/0, /*start=*/0, /*end=*/batch_size)
+          .div(width, /*rounding_mode=*/"floor")
+          .to(torch::kLong);
+  InputParameters packed = params;
+  packed.block_tables = params.block_tables.view({-1, width})
+                            .index_select(/*dim=*/0, rows)
+                            .slice(/*dim=*/1, /*start=*/0, packed_width)
+                            .reshape({-1});
+  packed.cu_block_lens =
+      torch::arange(batch_size + 1, params.cu_block_lens.options()) *
+      packed_width;
+  packed.block_table_width = 0;
+  return packed;
+}
+
 void ModelRunner::CudaGraph::capture(at::cuda::MempoolId_t mem_pool,
                                      CausalLM* model,
                                      torch::Tensor flatten_tokens,
@@ -177,6 +574,10 @@ void ModelRunner::CudaGraph::capture(at::cuda::MempoolId_t mem_pool,
   torch::cuda::synchronize();
 }
 
+bool ModelRunner::CudaGraph::fits(const InputParameters& params) const {
+  return params.block_tables.size(/*dim=*/0) <= block_tables_.size(/*dim=*/0);
+}
+
 torch::Tensor ModelRunner::CudaGraph::replay(torch::Tensor flatten_tokens,
                                              torch::Tensor flatten_positions,
                                              const InputParameters& params) {
@@ -6,9 +6,15 @@
 #include <torch/torch.h>
 
 #include <cstdint>
+#include <map>
 #include <memory>
+#include <optional>
+#include <utility>
 
 #include "common/macros.h"
+#include "layers/attention/flash_infer_handler.h"
+#include "layers/attention/piecewise_graph.h"
+#include "layers/layer_profiler.h"
 #include "memory/kv_cache.h"
 #include "models/causal_lm.h"
 #include "models/parameters.h"
@@ -30,14 +36,74 @@ class ModelRunner final {
 
     // batch sizes to capture cuda graphs
     DEFINE_ARG(std::vector<uint32_t>, cuda_graph_batch_sizes);
+
+    // numbers of tokens to capture cuda graphs for batches with prefill
+    // sequences, e.g. chunked prefill mixed with decodes.
+    DEFINE_ARG(std::vector<uint32_t>, cuda_graph_num_tokens);
+
+    // token-count buckets to capture piecewise cuda graphs for the batches
+    // without a captured cuda graph, e.g. prefill batches of any shape. the
+    // segments between the attention calls are captured for each bucket at
+    // its first use and the attention runs eagerly. batches are padded to the
+    // smallest bucket that fits.
+    DEFINE_ARG(std::vector<uint32_t>, piecewise_cuda_graph_num_tokens);
+
+    // sample with a single fused kernel when logprobs are not requested
+    DEFINE_ARG(bool, enable_fused_sampling) = false;
+
+    // apply top_k and top_p with pivot search instead of sorting the vocab
+    DEFINE_ARG(bool, enable_pivot_sampling) = false;
+
+    // sample from the vocab shards of the logits with tensor parallelism,
+    // gathering only the top candidates of each shard
+    DEFINE_ARG(bool, enable_vocab_parallel_sampling) = false;
+
+    // return the hidden states of the selected tokens in the model output
+    DEFINE_ARG(bool, return_hidden_states) = false;
+
+    // capture the cuda graph of a shape at its first use instead of at
+    // startup, running the batches of uncaptured shapes in eager mode.
+    DEFINE_ARG(bool, lazy_cuda_graph_capture) = false;
+
+    // pin the threads of the worker to the cpus of the numa node of its cuda
+    // device, so that its pinned host buffers are allocated on that node.
+    DEFINE_ARG(bool, numa_affinity) = false;
+
+    // number of tokens of the forward pass run at startup to size a private
+    // memory pool for the activations of the eager forward passes, e.g.
+    // max_tokens_per_batch. 0 to allocate them from the shared caching
+    // allocator.
+    DEFINE_ARG(int64_t, activation_pool_num_tokens) = 0;
+
+    // model type to label the latencies of the profiled layers
+    DEFINE_ARG(std::string, model_type);
+
+    // number of attention heads on the device, to plan the flashinfer
+    // kernels of each batch. 0 to disable flashinfer.
+    DEFINE_ARG(int64_t, n_local_heads) = 0;
+
+    // share the graph memory pool and the flashinfer workspace with the
+    // other runners on the device that set it, e.g. the target and draft
+    // models of speculative decoding, which run one after the other.
+    DEFINE_ARG(bool, share_device_resources) = false;
   };
 
   ModelRunner(CausalLM* model,
               const torch::Device& device,
               const Options& options);
 
+  ~ModelRunner();
+
   // capture graph for given batch size
-  void capture_cuda_graphs(uint32_t batch_size, std::vector<KVCache>& kv_cache);
+  // num_tokens: 0 for decode batches, otherwise the number of tokens of the
+  // mixed prefill/decode batches to capture the graph for.
+  void capture_cuda_graphs(uint32_t batch_size,
+                           std::vector<KVCache>& kv_cache,
+                           uint32_t num_tokens = 0);
+
+  // drop the captured graphs, which read the weights at the addresses of
+  // the capture time, e.g. after the weights are moved.
+  void reset_cuda_graphs();
 
   // tokens: [num_tokens]
   // positions: [num_tokens] token pos in the sequence
@@ -47,7 +113,74 @@ class ModelRunner final {
                         std::vector<KVCache>& kv_caches,
                         const InputParameters& params);
 
+  // run the prefill sequences of a batch eagerly on the current stream of the
+  // calling thread, concurrently with forward() on another thread. it uses a
+  // flashinfer plan of its own and neither the captured graphs nor the
+  // activation pool, whose memory may be in use by the other forward pass.
+  torch::Tensor forward_prefill(const torch::Tensor& tokens,
+                                const torch::Tensor& positions,
+                                std::vector<KVCache>& kv_caches,
+                                const InputParameters& params);
+
+  // bytes reserved by the memory pool of the captured cuda graphs
+  int64_t cuda_graph_pool_bytes() const;
+
+  // run a prefill of activation_pool_num_tokens tokens to reserve the memory
+  // pool of the eager activations, so that the eager forward passes reuse
+  // its blocks instead of competing with other allocations, and their peak
+  // memory is reserved at startup. the dummy tokens only write into the
+  // padding block 0 of the kv caches.
+  void reserve_activation_pool(std::vector<KVCache>& kv_caches);
+
+  // bytes reserved by the memory pool of the eager activations
+  int64_t activation_pool_bytes() const;
+
+  // peak bytes allocated by the eager forward passes on top of the memory
+  // allocated before them, keyed by the number of tokens rounded up to a
+  // power of 2.
+  const std::map<int64_t, int64_t>& peak_activation_bytes() const {
+    return peak_activation_bytes_;
+  }
+
+  // times the decoder layers in the forward passes sampled by
+  // FLAGS_layer_profile_interval
+  const LayerProfiler& layer_profiler() const { return layer_profiler_; }
+
  private:
+  class CudaGraph;
+
+  // a piecewise graph with its static inputs
+  struct PiecewiseCudaGraph {
+    PiecewiseGraph graph;
+    torch::Tensor flatten_tokens;
+    torch::Tensor flatten_positions;
+  };
+
+  // dummy parameters of a single prefill sequence of n_tokens tokens, which
+  // only write into the padding block 0 of the kv caches.
+  InputParameters dummy_prefill_params(int64_t n_tokens) const;
+
+  // the piecewise graph of the smallest bucket with at least n_tokens tokens,
+  // captured at its first use. returns nullptr if no bucket fits.
+  PiecewiseCudaGraph* find_piecewise_graph(uint32_t n_tokens,
+                                           std::vector<KVCache>& kv_caches);
+
+  // run the model in eager mode, tracking the peak memory of the activations
+  torch::Tensor forward_eager(const torch::Tensor& tokens,
+                              const torch::Tensor& positions,
+                              std::vector<KVCache>& kv_caches,
+                              const InputParameters& params);
+
+  // capture the graph for the shape at its first use if it is one of the
+  // shapes to capture, returns nullptr otherwise.
+  CudaGraph* capture_lazily(uint32_t batch_size,
+                            uint32_t num_tokens,
+                            std::vector<KVCache>& kv_caches);
+
+  // gather the rows of persistent block tables used by the batch into packed
+  // block tables, the layout used to capture cuda graphs.
+  InputParameters pack_block_tables(const InputParameters& params) const;
+
   // model, do not own
   CausalLM* model_;
 
@@ -57,8 +190,23 @@ class ModelRunner final {
   // options
   Options options_;
 
+  // times the decoder layers in sampled forward passes
+  LayerProfiler layer_profiler_;
+
+  // the flashinfer plan shared by the layers of a forward pass, nullptr if
+  // flashinfer is not enabled. shared with the other runners on the device
+  // if share_device_resources.
+  std::shared_ptr<FlashInferPlan> flash_infer_plan_;
+
+  // the flashinfer plan of forward_prefill(), created on first use
+  std::unique_ptr<FlashInferPlan> prefill_flash_infer_plan_;
+
+  // see peak_activation_bytes()
+  std::map<int64_t, int64_t> peak_activation_bytes_;
+
   // shared inputs and outputs for the model
   uint32_t max_batch_size_ = 0;
+  int64_t max_block_table_len_ = 0;
   torch::Tensor token_ids_;
   torch::Tensor positions_;
   torch::Tensor q_cu_seq_lens_;
@@ -70,10 +218,22 @@ class ModelRunner final {
   // graph pool handler
   at::cuda::MempoolId_t mem_pool_;
 
-  class CudaGraph;
+  // memory pool of the eager activations, see reserve_activation_pool()
+  std::optional<at::cuda::MempoolId_t> activation_pool_;
+
   // captured cuda graphs, mapping from batch size to graph
   absl::flat_hash_map<uint32_t, std::unique_ptr<CudaGraph>> graphs_;
 
+  // captured cuda graphs for mixed batches, mapping from (num_tokens,
+  // batch_size) to graph
+  absl::flat_hash_map<std::pair<uint32_t, uint32_t>, std::unique_ptr<CudaGraph>>
+      mixed_graphs_;
+
+  // captured piecewise cuda graphs, mapping from the number of tokens of the
+  // bucket to graph
+  absl::flat_hash_map<uint32_t, std::unique_ptr<PiecewiseCudaGraph>>
+      piecewise_graphs_;
+
   class CudaGraph final {
    public:
     void capture(at::cuda::MempoolId_t mem_pool,
@@ -83,6 +243,9 @@ class ModelRunner final {
                  const InputParameters& params,
                  std::vector<KVCache>& kv_cache);
 
+    // check if the block tables fit in the captured buffer
+    bool fits(const InputParameters& params) const;
+
     torch::Tensor replay(torch::Tensor flatten_tokens,
                          torch::Tensor flatten_positions,
                          const InputParameters& params);
@@ -2,6 +2,12 @@
 
 #include <torch/torch.h>
 
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "memory/memory.h"
 #include "models/parameters.h"
 #include "sampling/parameters.h"
 
@@ -18,6 +24,88 @@ struct ModelInput {
   InputParameters input_params;
   // sampling parameters, mainly for sampling
   SamplingParameters sampling_params;
+
+  // kv cache blocks to copy between device and host before running the model
+  // swap out blocks are copied before swap in blocks.
+  // [n_blocks, 2] IntTensor: (device_block_id, host_block_id)
+  torch::Tensor swap_out_blocks;
+  // [n_blocks, 2] IntTensor: (host_block_id, device_block_id)
+  torch::Tensor swap_in_blocks;
+  // device kv cache blocks to copy for forked sequences, after swapping.
+  // [n_blocks, 2] IntTensor: (src_block_id, dst_block_id)
+  torch::Tensor copy_blocks;
+
+  // kv cache blocks to copy to the pool shared with other processes before
+  // swapping, and from the pool after swapping.
+  // [n_blocks, 2] IntTensor: (device_block_id, slot)
+  torch::Tensor shared_out_blocks;
+  // [n_blocks, 2] IntTensor: (slot, device_block_id)
+  torch::Tensor shared_in_blocks;
+
+  // incremental updates for the persistent block tables on device, only set
+  // when persistent block tables are used. in that case input_params has
+  // cu_block_lens pointing to the row of each sequence and no block_tables.
+  // [n_updates, 3] IntTensor: (row, col, block_slot_id)
+  torch::Tensor block_table_updates;
+  // the number of rows and the width of the block tables
+  int64_t block_table_rows = 0;
+  int64_t block_table_width = 0;
+
+  // rows of the unique token ids and counts kept on device for the penalties,
+  // only set when the persistent token counts are used. in that case
+  // sampling_params has no unique token ids and counts, and the rows are
+  // updated on device with the sampled tokens.
+  // [n_selected_tokens] IntTensor
+  torch::Tensor token_count_rows;
+  // rows to clear before the updates
+  // [n_resets, 2] IntTensor: (row, n_unique_tokens)
+  torch::Tensor token_count_resets;
+  // [n_updates, 4] IntTensor: (row, col, token_id, count)
+  torch::Tensor token_count_updates;
+  // the number of rows and the width of the token count tables
+  int64_t token_count_num_rows = 0;
+  int64_t token_count_width = 0;
+
+  // number of decode steps to run on device, feeding the sampled tokens back
+  // as the input of the next step. only set for decode batches.
+  int64_t num_decode_steps = 1;
+  // stop token ids for each sequence, padded with -1, used to stop early
+  // once all sequences are finished.
+  // [n_seqs, max_n_stop_tokens] IntTensor
+  torch::Tensor stop_token_ids;
+  // max number of tokens each sequence can still generate
+  // [n_seqs] IntTensor
+  torch::Tensor num_remaining_tokens;
+  // keep the probs of all steps on device for the draft tokens of speculative
+  // decoding, only used by the driver.
+  bool return_probs = false;
+
+  // the lora adapter slot of each token, -1 for tokens without adapter.
+  // undefined if no sequence in the batch has an adapter.
+  // [n_tokens] IntTensor
+  torch::Tensor lora_slots;
+
+  // the images of the batch not in the kv cache yet, unique by hash, and
+  // their preprocessed pixels on host, see ImageInput.
+  std::vector<uint64_t> image_hashes;
+  std::vector<torch::Tensor> image_pixel_values;
+  // the rows of the image embeddings taken by the image tokens of the batch.
+  // the images without rows are encoded ahead of the steps that use them.
+  // [n_image_tokens, 3] IntTensor: (token_idx, image_idx, row)
+  torch::Tensor image_token_rows;
+
+  // data parallel attention: the input params and the device kv cache block
+  // copies of each attention group, with the block ids of the kv cache of
+  // its ranks. empty if not used, see ParallelArgs::dp_attention_size.
+  std::vector<InputParameters> dp_input_params;
+  std::vector<torch::Tensor> dp_copy_blocks;
+
+  // the pinned host buffer holding the host tensors above, uploaded once by
+  // the driver and broadcast to the other tensor parallel workers instead of
+  // copied by each of them, see DeviceBufferGuard. undefined to copy the
+  // tensors one by one on each worker.
+  // [n_bytes] ByteTensor
+  torch::Tensor input_buffer;
 };
 
 // output for the model that encapsulates all the necessary
@@ -26,6 +114,12 @@ struct ModelOutput {
   // sample parameters carried over from input, used for speculative decoding
   torch::Tensor do_sample;
 
+  // the seed and the position of the random numbers of each sequence, see
+  // SamplingParameters::rng_seeds. undefined if no sequence is seeded.
+  // [num_seqs] LongTensor
+  torch::Tensor rng_seeds;
+  torch::Tensor rng_offsets;
+
   // whether to return logprobs
   bool logprobs = false;
 
@@ -37,6 +131,40 @@ struct ModelOutput {
 
   // logits for selected indices
   torch::Tensor logits;
+
+  // hidden states for selected indices, only set if requested
+  // [n_selected_tokens, hidden_size]
+  torch::Tensor hidden_states;
+};
+
+// breakdown of the device memory used by a worker, in bytes
+struct MemoryBreakdown {
+  // weights on the device, and the weights of each module with the layer
+  // indices replaced by '*', e.g. "model.layers.*.mlp"
+  int64_t weights_bytes = 0;
+  std::map<std::string, int64_t> module_weights_bytes;
+
+  // kv cache blocks on the device and in pinned host memory
+  int64_t kv_cache_bytes = 0;
+  int64_t host_kv_cache_bytes = 0;
+
+  // private memory pool of the captured cuda graphs
+  int64_t cuda_graph_pool_bytes = 0;
+
+  // private memory pool of the eager activations
+  int64_t activation_pool_bytes = 0;
+
+  // peak memory allocated by the eager forward passes on top of the memory
+  // allocated before them, keyed by the number of tokens of the batches
+  // rounded up to a power of 2.
+  std::map<int64_t, int64_t> peak_activation_bytes;
+
+  // current stats of the caching allocator, see memory::AllocatorStats
+  memory::AllocatorStats allocator;
+
+  // memory of the device, including the memory used by other processes
+  int64_t available_memory = 0;
+  int64_t total_memory = 0;
 };
 
-}  // namespace llm
\ No newline at end of file
+}  // namespace llm
@@ -0,0 +1,244 @@
+#include "remote_worker.h"
+
+#include <folly/Unit.h>
+#include <folly/futures/Future.h>
+#include <glog/logging.h>
+#include <grpcpp/grpcpp.h>
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <tuple>
+
+#include "model_input_serializer.h"
+#include "worker.grpc.pb.h"
+#include "worker.pb.h"
+
+namespace llm {
+
+RemoteWorker::RemoteWorker(const std::string& address) : address_(address) {
+  grpc::ChannelArguments args;
+  // model inputs of large batches can exceed the default 4MB limit
+  args.SetMaxSendMessageSize(-1);
+  args.SetMaxReceiveMessageSize(-1);
+  auto channel = grpc::CreateCustomChannel(
+      address, grpc::InsecureChannelCredentials(), args);
+  stub_ = proto::Worker::NewStub(channel);
+  LOG(INFO) << "Created remote worker client for " << address;
+}
+
+void RemoteWorker::check_status(const grpc::Status& status,
+                                const proto::WorkerStatus& response,
+                                const char* method) const {
+  CHECK(status.ok()) << method << " failed on remote worker " << address_
+                     << ": " << status.error_message();
+  CHECK(response.ok()) << method << " failed on remote worker " << address_;
+}
+
+folly::SemiFuture<folly::Unit> RemoteWorker::create_worker_async(
+    int32_t rank,
+    int32_t world_size,
+    std::string unique_id,
+    const ModelRunner::Options& runner_options) {
+  proto::CreateWorkerRequest request;
+  request.set_rank(rank);
+  request.set_world_size(world_size);
+  request.set_nccl_unique_id(std::move(unique_id));
+  auto* options = request.mutable_runner_options();
+  options->set_num_decoding_tokens(runner_options.num_decoding_tokens());
+  options->set_block_size(runner_options.block_size());
+  options->set_cuda_graph_max_seq_len(runner_options.cuda_graph_max_seq_len());
+  for (const auto batch_size : runner_options.cuda_graph_batch_sizes()) {
+    options->add_cuda_graph_batch_sizes(batch_size);
+  }
+  for (const auto num_tokens : runner_options.cuda_graph_num_tokens()) {
+    options->add_cuda_graph_num_tokens(num_tokens);
+  }
+  options->set_enable_fused_sampling(runner_options.enable_fused_sampling());
+  options->set_enable_pivot_sampling(runner_options.enable_pivot_sampling());
+  options->set_enable_vocab_parallel_sampling(
+      runner_options.enable_vocab_parallel_sampling());
+  options->set_return_hidden_states(runner_options.return_hidden_states());
+  options->set_lazy_cuda_graph_capture(
+      runner_options.lazy_cuda_graph_capture());
+  options->set_activation_pool_num_tokens(
+      runner_options.activation_pool_num_tokens());
+  for (const auto num_tokens :
+       runner_options.piecewise_cuda_graph_num_tokens()) {
+    options->add_piecewise_cuda_graph_num_tokens(num_tokens);
+  }
+
+  folly::Promise<folly::Unit> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this,
+                        request = std::move(request),
+                        promise = std::move(promise)]() mutable {
+    proto::WorkerStatus response;
+    grpc::ClientContext context;
+    const auto status = stub_->CreateWorker(&context, request, &response);
+    check_status(status, response, "CreateWorker");
+    promise.setValue();
+  });
+  return future;
+}
+
+folly::SemiFuture<bool> RemoteWorker::init_model_async(
+    std::string model_weights_path,
+    torch::ScalarType dtype,
+    int64_t vocab_size) {
+  folly::Promise<bool> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this,
+                        model_weights_path = std::move(model_weights_path),
+                        dtype,
+                        vocab_size,
+                        promise = std::move(promise)]() mutable {
+    proto::InitModelRequest request;
+    request.set_model_weights_path(model_weights_path);
+    request.set_dtype(static_cast<int32_t>(dtype));
+    request.set_vocab_size(vocab_size);
+    proto::WorkerStatus response;
+    grpc::ClientContext context;
+    const auto status = stub_->InitModel(&context, request, &response);
+    if (!status.ok()) {
+      LOG(ERROR) << "InitModel failed on remote worker " << address_ << ": "
+                 << status.error_message();
+    }
+    promise.setValue(status.ok() && response.ok());
+  });
+  return future;
+}
+
+folly::SemiFuture<std::tuple<int64_t, int64_t>>
+RemoteWorker::profile_device_memory_async() {
+  folly::Promise<std::tuple<int64_t, int64_t>> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this, promise = std::move(promise)]() mutable {
+    proto::ProfileDeviceMemoryRequest request;
+    proto::ProfileDeviceMemoryResponse response;
+    grpc::ClientContext context;
+    const auto status =
+        stub_->ProfileDeviceMemory(&context, request, &response);
+    CHECK(status.ok()) << "ProfileDeviceMemory failed on remote worker "
+                       << address_ << ": " << status.error_message();
+    promise.setValue(
+        std::make_tuple(response.available_memory(), response.total_memory()));
+  });
+  return future;
+}
+
+folly::SemiFuture<bool> RemoteWorker::init_kv_cache_async(
+    int64_t n_blocks,
+    int64_t n_host_blocks,
+    int64_t block_size,
+    int64_t n_kv_heads,
+    int64_t head_dim,
+    torch::ScalarType cache_dtype,
+    int64_t max_blocks) {
+  folly::Promise<bool> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this,
+                        n_blocks,
+                        n_host_blocks,
+                        block_size,
+                        n_kv_heads,
+                        head_dim,
+                        cache_dtype,
+                        max_blocks,
+                        promise = std::move(promise)]() mutable {
+    proto::InitKVCacheRequest request;
+    request.set_n_blocks(n_blocks);
+    request.set_n_host_blocks(n_host_blocks);
+    request.set_block_size(block_size);
+    request.set_n_kv_heads(n_kv_heads);
+    request.set_head_dim(head_dim);
+    request.set_cache_dtype(static_cast<int32_t>(cache_dtype));
+    request.set_max_blocks(max_blocks);
+    proto::WorkerStatus response;
+    grpc::ClientContext context;
+    const auto status = stub_->InitKVCache(&context, request, &response);
+    if (!status.ok()) {
+      LOG(ERROR) << "InitKVCache failed on remote worker " << address_ << ": "
+                 << status.error_message();
+    }
+    promise.setValue(status.ok() && response.ok());
+  });
+  return future;
+}
+
+folly::SemiFuture<bool> RemoteWorker::resize_kv_cache_async(
+    int64_t n_blocks) {
+  folly::Promise<bool> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule(
+      [this, n_blocks, promise = std::move(promise)]() mutable {
+        proto::ResizeKVCacheRequest request;
+        request.set_n_blocks(n_blocks);
+        proto::WorkerStatus response;
+        grpc::ClientContext context;
+        const auto status = stub_->ResizeKVCache(&context, request, &response);
+        if (!status.ok()) {
+          LOG(ERROR) << "ResizeKVCache failed on remote worker " << address_
+                     << ": " << status.error_message();
+        }
+        promise.setValue(status.ok() && response.ok());
+      });
+  return future;
+}
+
+folly::SemiFuture<std::optional<ModelOutput>> RemoteWorker::execute_model_async(
+    const ModelInput& inputs) {
+  // serialize on the calling thread, the inputs may be reused after return
+  proto::ExecuteModelRequest request;
+  request.set_model_input(serialize_model_input(inputs));
+
+  folly::Promise<std::optional<ModelOutput>> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this,
+                        request = std::move(request),
+                        promise = std::move(promise)]() mutable {
+    proto::WorkerStatus response;
+    grpc::ClientContext context;
+    const auto status = stub_->ExecuteModel(&context, request, &response);
+    check_status(status, response, "ExecuteModel");
+    promise.setValue(std::nullopt);
+  });
+  return future;
+}
+
+folly::SemiFuture<folly::Unit> RemoteWorker::process_group_test_async() {
+  folly::Promise<folly::Unit> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this, promise = std::move(promise)]() mutable {
+    proto::ProcessGroupTestRequest request;
+    proto::WorkerStatus response;
+    grpc::ClientContext context;
+    const auto status = stub_->ProcessGroupTest(&context, request, &response);
+    check_status(status, response, "ProcessGroupTest");
+    promise.setValue();
+  });
+  return future;
+}
+
+folly::SemiFuture<folly::Unit> RemoteWorker::capture_cuda_graph_async(
+    uint32_t batch_size,
+    uint32_t num_tokens) {
+  folly::Promise<folly::Unit> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this,
+                        batch_size,
+                        num_tokens,
+                        promise = std::move(promise)]() mutable {
+    proto::CaptureCudaGraphRequest request;
+    request.set_batch_size(batch_size);
+    request.set_num_tokens(num_tokens);
+    proto::WorkerStatus response;
+    grpc::ClientContext context;
+    const auto status = stub_->CaptureCudaGraph(&context, request, &response);
+    check_status(status, response, "CaptureCudaGraph");
+    promise.setValue();
+  });
+  return future;
+}
+
+}  // namespace llm
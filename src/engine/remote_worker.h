@@ -0,0 +1,83 @@
+#pragma once
+
+#include <folly/futures/Future.h>
+#include <grpcpp/grpcpp.h>
+#include <torch/torch.h>
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <tuple>
+
+#include "common/threadpool.h"
+#include "model_runner.h"
+#include "parameters.h"
+#include "worker.grpc.pb.h"
+
+namespace llm {
+
+// A client of a worker running in another process or host, serving one
+// device with the worker service. it mirrors the async api of Worker, and
+// the calls are sent one by one in the order they are made, so that the
+// collectives of the remote worker line up with the other workers.
+class RemoteWorker final {
+ public:
+  // address: host:port of the worker service
+  explicit RemoteWorker(const std::string& address);
+
+  ~RemoteWorker() = default;
+
+  // create the worker on the remote device and join the process group of
+  // the tensor parallel ranks. async call
+  folly::SemiFuture<folly::Unit> create_worker_async(
+      int32_t rank,
+      int32_t world_size,
+      std::string unique_id,
+      const ModelRunner::Options& runner_options);
+
+  // create the model and load the weights from the checkpoint on the worker
+  // host. async call
+  folly::SemiFuture<bool> init_model_async(std::string model_weights_path,
+                                           torch::ScalarType dtype,
+                                           int64_t vocab_size);
+
+  folly::SemiFuture<std::tuple<int64_t, int64_t>> profile_device_memory_async();
+
+  folly::SemiFuture<bool> init_kv_cache_async(int64_t n_blocks,
+                                              int64_t n_host_blocks,
+                                              int64_t block_size,
+                                              int64_t n_kv_heads,
+                                              int64_t head_dim,
+                                              torch::ScalarType cache_dtype,
+                                              int64_t max_blocks = 0);
+
+  folly::SemiFuture<bool> resize_kv_cache_async(int64_t n_blocks);
+
+  // run the model on the given input, remote workers never return output
+  folly::SemiFuture<std::optional<ModelOutput>> execute_model_async(
+      const ModelInput& inputs);
+
+  folly::SemiFuture<folly::Unit> process_group_test_async();
+
+  folly::SemiFuture<folly::Unit> capture_cuda_graph_async(
+      uint32_t batch_size,
+      uint32_t num_tokens = 0);
+
+  const std::string& address() const { return address_; }
+
+ private:
+  // check the status of the call, the engine can't make progress without
+  // the worker since the collectives would hang.
+  void check_status(const grpc::Status& status,
+                    const proto::WorkerStatus& response,
+                    const char* method) const;
+
+  std::string address_;
+
+  std::unique_ptr<proto::Worker::Stub> stub_;
+
+  // a single thread to keep the calls in order
+  ThreadPool threadpool_;
+};
+
+}  // namespace llm
@@ -0,0 +1,84 @@
+#include "step_channel.h"
+
+#include <absl/time/clock.h>
+#include <glog/logging.h>
+
+#include <thread>
+#include <utility>
+
+namespace llm {
+namespace {
+// number of times to check for the end of a step before parking
+constexpr int kSpinIters = 1024;
+}  // namespace
+
+StepChannel::StepChannel(size_t n_workers) : outputs_(n_workers) {
+  CHECK_GT(n_workers, 0);
+}
+
+void StepChannel::post(const ModelInput* inputs) {
+  CHECK_EQ(n_running_.load(std::memory_order_acquire), 0)
+      << "the previous step is not done";
+  inputs_ = inputs;
+  for (auto& output : outputs_) {
+    output.reset();
+  }
+  n_running_.store(outputs_.size(), std::memory_order_relaxed);
+  // publishes the inputs to the workers
+  seq_.fetch_add(1, std::memory_order_release);
+}
+
+std::optional<ModelOutput> StepChannel::wait() {
+  for (int i = 0; i < kSpinIters; ++i) {
+    if (n_running_.load(std::memory_order_acquire) == 0) {
+      return std::move(outputs_.front());
+    }
+  }
+  // pairs with the fence in finish(): either the last worker sees the flag,
+  // or it is seen done here.
+  waiting_.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  {
+    absl::MutexLock lock(&mutex_);
+    while (n_running_.load(std::memory_order_acquire) != 0) {
+      cv_.Wait(&mutex_);
+    }
+  }
+  waiting_.store(false, std::memory_order_relaxed);
+  return std::move(outputs_.front());
+}
+
+const ModelInput* StepChannel::wait_for_step(
+    uint64_t* seq,
+    absl::Duration idle_timeout,
+    const std::function<bool()>& should_stop) {
+  const absl::Time deadline = absl::Now() + idle_timeout;
+  for (uint64_t i = 0;; ++i) {
+    const uint64_t current = seq_.load(std::memory_order_acquire);
+    if (current > *seq) {
+      *seq = current;
+      return inputs_;
+    }
+    // check the clock and the other work once in a while
+    if (i % 64 == 63 && (absl::Now() >= deadline || should_stop())) {
+      return nullptr;
+    }
+    std::this_thread::yield();
+  }
+}
+
+void StepChannel::finish(size_t index, std::optional<ModelOutput> output) {
+  CHECK_LT(index, outputs_.size());
+  outputs_[index] = std::move(output);
+  if (n_running_.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+  // the last worker wakes up the engine if parking
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (waiting_.load(std::memory_order_relaxed)) {
+    absl::MutexLock lock(&mutex_);
+    cv_.SignalAll();
+  }
+}
+
+}  // namespace llm
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <absl/synchronization/mutex.h>
+#include <absl/time/time.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <vector>
+
+#include "parameters.h"
+
+namespace llm {
+
+// Hands the steps of the engine over to the persistent loops of its workers
+// without futures or queues: the engine publishes the inputs of a step by
+// bumping a sequence number the workers spin on, and each worker signals
+// completion by decrementing an atomic count. one step is in flight at a
+// time.
+class StepChannel final {
+ public:
+  explicit StepChannel(size_t n_workers);
+
+  // publish the inputs of the next step to the workers, after the previous
+  // step is done. the inputs should be alive until wait() returns.
+  void post(const ModelInput* inputs);
+
+  // wait for all workers to finish the step, spinning for a while before
+  // parking. returns the output of the first worker.
+  std::optional<ModelOutput> wait();
+
+  // the worker side: wait for a step after *seq, spinning with yields until
+  // the idle timeout or should_stop() returns true. returns the inputs and
+  // updates *seq, or nullptr if none.
+  const ModelInput* wait_for_step(uint64_t* seq,
+                                  absl::Duration idle_timeout,
+                                  const std::function<bool()>& should_stop);
+
+  // whether a step after seq is posted
+  bool has_step(uint64_t seq) const {
+    return seq_.load(std::memory_order_acquire) > seq;
+  }
+
+  // the worker side: finish the step with the output of the worker
+  void finish(size_t index, std::optional<ModelOutput> output);
+
+ private:
+  // sequence number of the last posted step
+  std::atomic<uint64_t> seq_{0};
+
+  // the inputs of the last posted step
+  const ModelInput* inputs_ = nullptr;
+
+  // the output of each worker in the last step
+  std::vector<std::optional<ModelOutput>> outputs_;
+
+  // number of workers running the last step
+  std::atomic<size_t> n_running_{0};
+
+  // whether the engine is parking or about to park in wait()
+  std::atomic<bool> waiting_{false};
+
+  absl::Mutex mutex_;
+  absl::CondVar cv_;
+};
+
+}  // namespace llm
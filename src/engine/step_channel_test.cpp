@@ -0,0 +1,67 @@
+#include "step_channel.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace llm {
+
+TEST(StepChannelTest, Steps) {
+  const size_t n_workers = 4;
+  const int n_steps = 100;
+  StepChannel channel(n_workers);
+  std::atomic<int> n_idle{0};
+
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < n_workers; ++i) {
+    workers.emplace_back([&channel, &n_idle, i]() {
+      uint64_t seq = 0;
+      for (int step = 0; step < n_steps;) {
+        const ModelInput* inputs = channel.wait_for_step(
+            &seq, absl::Milliseconds(1), []() { return false; });
+        if (inputs == nullptr) {
+          n_idle.fetch_add(1);
+          continue;
+        }
+        ModelOutput output;
+        // the driver returns the step number as the output
+        output.sample_output.next_tokens =
+            inputs->token_ids.clone().fill_(step);
+        channel.finish(i, output);
+        ++step;
+      }
+    });
+  }
+
+  ModelInput inputs;
+  for (int step = 0; step < n_steps; ++step) {
+    inputs.token_ids = torch::zeros({1}, torch::kLong);
+    EXPECT_FALSE(channel.has_step(step + 1));
+    channel.post(&inputs);
+    EXPECT_TRUE(channel.has_step(step));
+    if (step % 10 == 0) {
+      // let the workers go idle and park the engine
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    auto output = channel.wait();
+    ASSERT_TRUE(output.has_value());
+    EXPECT_EQ(output->sample_output.next_tokens.item<int64_t>(), step);
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  EXPECT_GT(n_idle.load(), 0);
+}
+
+TEST(StepChannelTest, Stop) {
+  StepChannel channel(1);
+  uint64_t seq = 0;
+  // returns without a step when asked to stop
+  EXPECT_EQ(channel.wait_for_step(&seq, absl::Hours(1), []() { return true; }),
+            nullptr);
+  EXPECT_EQ(seq, 0);
+}
+
+}  // namespace llm
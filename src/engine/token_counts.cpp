@@ -0,0 +1,122 @@
+#include "token_counts.h"
+
+#include <absl/container/flat_hash_map.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "request/sequence.h"
+
+namespace llm {
+namespace {
+// grow the width in steps to avoid reallocating the tables every few steps
+constexpr int64_t kWidthAlignment = 64;
+
+bool has_penalties(const Sequence& sequence) {
+  const auto* param = sequence.sampling_param();
+  return param != nullptr && param->has_penalties();
+}
+}  // namespace
+
+TokenCounts::TokenCounts() {
+  // reserve row 0 for the sequences without penalties
+  rows_.emplace_back();
+}
+
+void TokenCounts::update(const std::vector<const Sequence*>& sequences,
+                         uint32_t num_decode_steps,
+                         std::vector<int32_t>* rows,
+                         std::vector<int32_t>* updates,
+                         std::vector<int32_t>* resets) {
+  CHECK(rows != nullptr && updates != nullptr && resets != nullptr);
+  rows->clear();
+  rows->reserve(sequences.size());
+
+  // release rows of sequences that are not in the batch
+  absl::flat_hash_map<int64_t, int32_t> sequence_to_row;
+  sequence_to_row.reserve(sequences.size());
+  for (const Sequence* sequence : sequences) {
+    const auto it = sequence_to_row_.find(sequence->id());
+    if (it != sequence_to_row_.end()) {
+      sequence_to_row.emplace(it->first, it->second);
+      sequence_to_row_.erase(it);
+    }
+  }
+  for (const auto& [sequence_id, row_id] : sequence_to_row_) {
+    rows_[row_id] = Row{};
+    free_rows_.push_back(row_id);
+  }
+  // prefer lower rows to keep the tables compact
+  std::sort(free_rows_.begin(), free_rows_.end(), std::greater<>());
+  sequence_to_row_ = std::move(sequence_to_row);
+
+  for (const Sequence* sequence : sequences) {
+    if (!has_penalties(*sequence)) {
+      rows->push_back(0);
+      continue;
+    }
+    const auto& token_counts = sequence->token_to_count_map();
+    // at most one new unique token per decode step
+    const int64_t max_unique_tokens =
+        static_cast<int64_t>(token_counts.size()) + num_decode_steps;
+    if (max_unique_tokens > width_) {
+      width_ = (max_unique_tokens + kWidthAlignment - 1) / kWidthAlignment *
+               kWidthAlignment;
+    }
+
+    int32_t row_id = 0;
+    bool is_new_row = false;
+    const auto it = sequence_to_row_.find(sequence->id());
+    if (it != sequence_to_row_.end()) {
+      row_id = it->second;
+    } else {
+      // assign a new row for the sequence
+      if (free_rows_.empty()) {
+        row_id = static_cast<int32_t>(rows_.size());
+        rows_.emplace_back();
+      } else {
+        row_id = free_rows_.back();
+        free_rows_.pop_back();
+      }
+      sequence_to_row_[sequence->id()] = row_id;
+      rows_[row_id].sequence_id = sequence->id();
+      is_new_row = true;
+    }
+    rows->push_back(row_id);
+
+    Row& row = rows_[row_id];
+    const size_t n_tokens = sequence->num_tokens();
+    // the row counts all tokens as long as the tokens sampled on device were
+    // appended to the sequence, re-upload the whole row otherwise.
+    const bool up_to_date = !is_new_row &&
+                            row.version == sequence->token_ids_version() &&
+                            n_tokens > row.num_tokens &&
+                            n_tokens <= row.max_num_tokens;
+    if (!up_to_date) {
+      int32_t col = 0;
+      for (const auto& [token_id, count] : token_counts) {
+        if (count <= 0) {
+          continue;
+        }
+        updates->insert(updates->end(), {row_id, col, token_id, count});
+        ++col;
+      }
+      resets->push_back(row_id);
+      resets->push_back(col);
+      row.version = sequence->token_ids_version();
+    }
+    row.num_tokens = n_tokens;
+    row.max_num_tokens = n_tokens + num_decode_steps;
+  }
+}
+
+void TokenCounts::clear() {
+  sequence_to_row_.clear();
+  free_rows_.clear();
+  rows_.resize(1);
+}
+
+}  // namespace llm
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "request/sequence.h"
+
+namespace llm {
+
+// Host side bookkeeping for the unique token ids and counts used by the
+// frequency, presence and repetition penalties, which persist on device across
+// steps. Each sequence with penalties is assigned a row of [n_rows, width]
+// tables. The rows are updated on device with the sampled tokens, so only the
+// rows of new sequences, or of sequences whose tokens have been rewritten, are
+// sent. Row 0 is shared by the sequences without penalties and is kept empty.
+class TokenCounts final {
+ public:
+  TokenCounts();
+
+  // assign rows to the sequences and collect the rows to upload. the next
+  // token of each sequence is sampled after its last token. rows of sequences
+  // that are not in the batch are released.
+  // num_decode_steps: max number of tokens appended to each row on device
+  // rows: [n_seqs] row id for each sequence
+  // updates: flattened [row, col, token_id, count] to write into the tables
+  // resets: flattened [row, n_unique_tokens] of the rows to clear first
+  void update(const std::vector<const Sequence*>& sequences,
+              uint32_t num_decode_steps,
+              std::vector<int32_t>* rows,
+              std::vector<int32_t>* updates,
+              std::vector<int32_t>* resets);
+
+  // release all rows, e.g. after a step that did not update them on device
+  void clear();
+
+  // the number of rows needed on device, including the empty row
+  int64_t num_rows() const { return static_cast<int64_t>(rows_.size()); }
+
+  // max number of unique tokens per row, only grows
+  int64_t width() const { return width_; }
+
+ private:
+  struct Row {
+    // id of the sequence owning the row, -1 if the row is free
+    int64_t sequence_id = -1;
+
+    // token_ids_version of the sequence when the row was uploaded
+    uint32_t version = 0;
+
+    // number of tokens counted when the row was last used, and the max number
+    // of tokens counted on device after that step
+    size_t num_tokens = 0;
+    size_t max_num_tokens = 0;
+  };
+
+  int64_t width_ = 0;
+
+  // map from sequence id to row id
+  absl::flat_hash_map<int64_t, int32_t> sequence_to_row_;
+
+  // all rows, including the empty row
+  std::vector<Row> rows_;
+
+  // free row ids
+  std::vector<int32_t> free_rows_;
+};
+
+}  // namespace llm
@@ -0,0 +1,117 @@
+#include "token_counts.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace llm {
+namespace {
+// collect the uploaded counts of the row: token_id -> count
+std::map<int32_t, int32_t> uploaded_counts(const std::vector<int32_t>& updates,
+                                           int32_t row) {
+  std::map<int32_t, int32_t> counts;
+  for (size_t i = 0; i < updates.size(); i += 4) {
+    if (updates[i] == row) {
+      counts[updates[i + 2]] = updates[i + 3];
+    }
+  }
+  return counts;
+}
+
+// cache the prompt of the sequence so that tokens can be appended
+void commit_prompt(Sequence* sequence) {
+  sequence->append_block({/*id=*/0, /*size=*/16});
+  sequence->commit_kv_cache(sequence->num_tokens());
+}
+}  // namespace
+
+TEST(TokenCountsTest, IncrementalUpdate) {
+  Sequence::Options options;
+  options.sampling_param.frequency_penalty = 0.5;
+  Sequence seq1(/*token_ids=*/{1, 2, 2, 3}, /*capacity=*/100, options);
+  // sequences without penalties share the empty row 0
+  Sequence seq2(/*token_ids=*/{4, 5}, /*capacity=*/100, Sequence::Options());
+
+  TokenCounts token_counts;
+  std::vector<int32_t> rows;
+  std::vector<int32_t> updates;
+  std::vector<int32_t> resets;
+  token_counts.update({&seq1, &seq2}, 1, &rows, &updates, &resets);
+  EXPECT_EQ(rows, std::vector<int32_t>({1, 0}));
+  EXPECT_EQ(token_counts.num_rows(), 2);
+  EXPECT_EQ(token_counts.width(), 64);
+  EXPECT_EQ(resets, std::vector<int32_t>({1, 3}));
+  EXPECT_EQ(uploaded_counts(updates, 1),
+            (std::map<int32_t, int32_t>{{1, 1}, {2, 2}, {3, 1}}));
+
+  // the sampled token is counted on device, no updates
+  commit_prompt(&seq1);
+  seq1.append_token(7);
+  updates.clear();
+  resets.clear();
+  token_counts.update({&seq1, &seq2}, 1, &rows, &updates, &resets);
+  EXPECT_EQ(rows, std::vector<int32_t>({1, 0}));
+  EXPECT_TRUE(updates.empty());
+  EXPECT_TRUE(resets.empty());
+
+  // the whole row is uploaded again once the token is replaced
+  seq1.replace_last_token(/*token_id=*/2, /*logprob=*/0.0);
+  token_counts.update({&seq1, &seq2}, 1, &rows, &updates, &resets);
+  EXPECT_EQ(resets, std::vector<int32_t>({1, 3}));
+  EXPECT_EQ(uploaded_counts(updates, 1),
+            (std::map<int32_t, int32_t>{{1, 1}, {2, 3}, {3, 1}}));
+
+  // or if the sampled token is not appended to the sequence
+  updates.clear();
+  resets.clear();
+  token_counts.update({&seq1}, 1, &rows, &updates, &resets);
+  EXPECT_EQ(resets, std::vector<int32_t>({1, 3}));
+
+  // seq1 leaves the batch, its row is reused by seq3
+  Sequence seq3(/*token_ids=*/{6}, /*capacity=*/100, options);
+  updates.clear();
+  resets.clear();
+  token_counts.update({&seq2, &seq3}, 1, &rows, &updates, &resets);
+  EXPECT_EQ(rows, std::vector<int32_t>({0, 1}));
+  EXPECT_EQ(resets, std::vector<int32_t>({1, 1}));
+  EXPECT_EQ(updates, std::vector<int32_t>({1, 0, 6, 1}));
+
+  // all rows are uploaded again after clear
+  token_counts.clear();
+  EXPECT_EQ(token_counts.num_rows(), 1);
+  commit_prompt(&seq3);
+  seq3.append_token(6);
+  updates.clear();
+  resets.clear();
+  token_counts.update({&seq3}, 1, &rows, &updates, &resets);
+  EXPECT_EQ(rows, std::vector<int32_t>({1}));
+  EXPECT_EQ(updates, std::vector<int32_t>({1, 0, 6, 2}));
+}
+
+TEST(TokenCountsTest, MultiStepDecoding) {
+  Sequence::Options options;
+  options.sampling_param.repetition_penalty = 1.2;
+  Sequence seq(/*token_ids=*/{1, 2}, /*capacity=*/100, options);
+
+  TokenCounts token_counts;
+  std::vector<int32_t> rows;
+  std::vector<int32_t> updates;
+  std::vector<int32_t> resets;
+  token_counts.update({&seq}, /*num_decode_steps=*/4, &rows, &updates, &resets);
+  EXPECT_EQ(resets, std::vector<int32_t>({1, 2}));
+
+  // up to 4 tokens are appended on device
+  commit_prompt(&seq);
+  for (int32_t token_id : {3, 4, 5}) {
+    seq.append_token(token_id);
+  }
+  updates.clear();
+  resets.clear();
+  token_counts.update({&seq}, /*num_decode_steps=*/1, &rows, &updates, &resets);
+  EXPECT_TRUE(updates.empty());
+  EXPECT_TRUE(resets.empty());
+}
+
+}  // namespace llm
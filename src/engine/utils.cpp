@@ -6,6 +6,7 @@
 #include <torch/torch.h>
 #include <torch/types.h>
 
+#include <algorithm>
 #include <vector>
 
 namespace llm {
@@ -40,4 +41,178 @@ std::vector<torch::Device> parse_devices(const std::string& device_str) {
   return devices;
 }
 
+bool can_pad_model_input(uint32_t n_tokens,
+                         uint32_t n_seqs,
+                         uint32_t num_tokens,
+                         uint32_t num_seqs) {
+  if (n_tokens > num_tokens || n_seqs > num_seqs) {
+    return false;
+  }
+  const uint32_t pad_tokens = num_tokens - n_tokens;
+  const uint32_t pad_seqs = num_seqs - n_seqs;
+  if (pad_seqs == 0) {
+    // no sequence to take the padding tokens
+    return pad_tokens == 0;
+  }
+  return pad_tokens >= pad_seqs;
+}
+
+void pad_model_input(uint32_t num_tokens,
+                     uint32_t num_seqs,
+                     int32_t block_size,
+                     ModelInput* input) {
+  auto& params = input->input_params;
+  const uint32_t n_tokens = input->token_ids.size(/*dim=*/0);
+  const uint32_t n_seqs = params.q_cu_seq_lens.size(/*dim=*/0) - 1;
+  CHECK(can_pad_model_input(n_tokens, n_seqs, num_tokens, num_seqs))
+      << "can't pad " << n_tokens << " tokens and " << n_seqs
+      << " sequences to " << num_tokens << " tokens and " << num_seqs
+      << " sequences";
+  const int64_t pad_tokens = num_tokens - n_tokens;
+  const int64_t pad_seqs = num_seqs - n_seqs;
+  if (pad_seqs == 0) {
+    return;
+  }
+
+  // padding tokens write into slot 0 of the padding block 0
+  const auto options = input->token_ids.options();
+  input->token_ids =
+      torch::cat({input->token_ids, torch::zeros({pad_tokens}, options)});
+  input->positions =
+      torch::cat({input->positions, torch::zeros({pad_tokens}, options)});
+  params.new_cache_slots =
+      torch::cat({params.new_cache_slots, torch::zeros({pad_tokens}, options)});
+
+  // one token for each padding sequence except the last one, which takes the
+  // rest. the padding sequences only attend to themselves.
+  std::vector<int32_t> pad_lens(pad_seqs, 1);
+  pad_lens.back() = static_cast<int32_t>(pad_tokens - pad_seqs + 1);
+  std::vector<int32_t> q_cu_lens;
+  std::vector<int32_t> kv_cu_lens;
+  int32_t q_len = params.q_cu_seq_lens[n_seqs].item<int32_t>();
+  int32_t kv_len = params.kv_cu_seq_lens[n_seqs].item<int32_t>();
+  for (const int32_t len : pad_lens) {
+    q_len += len;
+    kv_len += len;
+    q_cu_lens.push_back(q_len);
+    kv_cu_lens.push_back(kv_len);
+  }
+  params.q_cu_seq_lens = torch::cat(
+      {params.q_cu_seq_lens, torch::tensor(q_cu_lens, torch::kInt)});
+  params.kv_cu_seq_lens = torch::cat(
+      {params.kv_cu_seq_lens, torch::tensor(kv_cu_lens, torch::kInt)});
+
+  // padding sequences only use the padding block 0
+  if (params.block_table_width > 0) {
+    // point to the reserved empty row 0 of persistent block tables, keeping
+    // the last entry for the total size
+    auto cu_block_lens = params.cu_block_lens;
+    params.cu_block_lens = torch::cat(
+        {cu_block_lens.slice(/*dim=*/0, /*start=*/0, /*end=*/n_seqs),
+         torch::zeros({pad_seqs}, cu_block_lens.options()),
+         cu_block_lens.slice(/*dim=*/0, /*start=*/n_seqs)});
+  } else {
+    std::vector<int32_t> cu_block_lens;
+    int32_t n_blocks = params.cu_block_lens[n_seqs].item<int32_t>();
+    for (const int32_t len : pad_lens) {
+      n_blocks += (len + block_size - 1) / block_size;
+      cu_block_lens.push_back(n_blocks);
+    }
+    const int64_t n_pad_blocks =
+        n_blocks - params.block_tables.size(/*dim=*/0);
+    params.block_tables = torch::cat(
+        {params.block_tables,
+         torch::zeros({n_pad_blocks}, params.block_tables.options())});
+    params.cu_block_lens = torch::cat(
+        {params.cu_block_lens, torch::tensor(cu_block_lens, torch::kInt)});
+  }
+
+  params.num_sequences = static_cast<int32_t>(num_seqs);
+  params.q_max_seq_len = std::max(params.q_max_seq_len, pad_lens.back());
+  params.kv_max_seq_len = std::max(params.kv_max_seq_len, pad_lens.back());
+}
+
+void split_model_input_for_attention_groups(int32_t n_groups,
+                                            int32_t n_blocks_per_group,
+                                            int32_t block_size,
+                                            ModelInput* input) {
+  const auto& params = input->input_params;
+  CHECK(params.block_table_width == 0 && params.num_prefix_groups == 0 &&
+        !params.tree_mask.defined() && !params.kv_score_slots.defined() &&
+        !params.offload_q_idxes.defined())
+      << "Unsupported attention inputs for data parallel attention";
+  const auto q_cu_lens = params.q_cu_seq_lens.contiguous();
+  const auto kv_cu_lens = params.kv_cu_seq_lens.contiguous();
+  const auto cu_block_lens = params.cu_block_lens.contiguous();
+  const auto block_tables = params.block_tables.contiguous();
+  const int32_t* q_cu = q_cu_lens.data_ptr<int32_t>();
+  const int32_t* kv_cu = kv_cu_lens.data_ptr<int32_t>();
+  const int32_t* cu_blocks = cu_block_lens.data_ptr<int32_t>();
+  const int32_t* block_ids = block_tables.data_ptr<int32_t>();
+  const int32_t n_seqs = static_cast<int32_t>(q_cu_lens.size(/*dim=*/0)) - 1;
+
+  // the group of each sequence is the group of its blocks
+  std::vector<int32_t> group_starts(n_groups + 1, n_seqs);
+  int32_t seq = 0;
+  for (int32_t g = 0; g < n_groups; ++g) {
+    group_starts[g] = seq;
+    while (seq < n_seqs && cu_blocks[seq] < cu_blocks[seq + 1] &&
+           block_ids[cu_blocks[seq]] / n_blocks_per_group == g) {
+      ++seq;
+    }
+  }
+  CHECK_EQ(seq, n_seqs) << "Sequences are not ordered by attention group";
+
+  // the max length of the sequences [start, end) from cumulative lengths
+  auto max_len = [](const int32_t* cu_lens, int32_t start, int32_t end) {
+    int32_t max = 0;
+    for (int32_t i = start; i < end; ++i) {
+      max = std::max(max, cu_lens[i + 1] - cu_lens[i]);
+    }
+    return max;
+  };
+
+  input->dp_input_params.clear();
+  input->dp_input_params.reserve(n_groups);
+  for (int32_t g = 0; g < n_groups; ++g) {
+    const int32_t start = group_starts[g];
+    const int32_t end = group_starts[g + 1];
+    const int32_t first_block = g * n_blocks_per_group;
+    auto& group_params = input->dp_input_params.emplace_back();
+    group_params.num_sequences = end - start;
+    group_params.q_cu_seq_lens =
+        q_cu_lens.slice(/*dim=*/0, start, end + 1) - q_cu[start];
+    group_params.kv_cu_seq_lens =
+        kv_cu_lens.slice(/*dim=*/0, start, end + 1) - kv_cu[start];
+    group_params.q_max_seq_len = max_len(q_cu, start, end);
+    group_params.kv_max_seq_len = max_len(kv_cu, start, end);
+    group_params.cu_block_lens =
+        cu_block_lens.slice(/*dim=*/0, start, end + 1) - cu_blocks[start];
+    group_params.block_tables =
+        block_tables.slice(/*dim=*/0, cu_blocks[start], cu_blocks[end]) -
+        first_block;
+    group_params.new_cache_slots =
+        params.new_cache_slots.slice(/*dim=*/0, q_cu[start], q_cu[end]) -
+        first_block * block_size;
+    group_params.dp_token_offset = q_cu[start];
+    group_params.dp_num_tokens = q_cu[end] - q_cu[start];
+  }
+
+  // the copies stay within the blocks of a group
+  input->dp_copy_blocks.assign(n_groups, torch::Tensor());
+  if (input->copy_blocks.defined()) {
+    // [n_blocks, 2] (src_block_id, dst_block_id)
+    const auto src = input->copy_blocks.select(/*dim=*/1, /*index=*/0);
+    for (int32_t g = 0; g < n_groups; ++g) {
+      const int32_t first_block = g * n_blocks_per_group;
+      const auto in_group =
+          (src >= first_block) & (src < first_block + n_blocks_per_group);
+      auto copy_blocks = input->copy_blocks.index({in_group}) - first_block;
+      if (copy_blocks.size(/*dim=*/0) > 0) {
+        input->dp_copy_blocks[g] = copy_blocks;
+      }
+    }
+  }
+}
+
 }  // namespace llm
@@ -5,11 +5,40 @@
 #include <vector>
 
 #include "models/parameters.h"
+#include "parameters.h"
 
 namespace llm {
 
 std::vector<torch::Device> parse_devices(const std::string& device_str);
 
+// check if the model input with n_tokens tokens and n_seqs sequences can be
+// padded to num_tokens tokens and num_seqs sequences, each padding sequence
+// needs at least one token.
+bool can_pad_model_input(uint32_t n_tokens,
+                         uint32_t n_seqs,
+                         uint32_t num_tokens,
+                         uint32_t num_seqs);
+
+// pad the model input to num_tokens tokens and num_seqs sequences for cuda
+// graph replay. padding tokens are written into the padding block 0.
+void pad_model_input(uint32_t num_tokens,
+                     uint32_t num_seqs,
+                     int32_t block_size,
+                     ModelInput* input);
+
+// split the attention inputs of the model input among n_groups data parallel
+// attention groups into dp_input_params and dp_copy_blocks, see
+// ParallelArgs::dp_attention_size. group g owns the blocks
+// [g * n_blocks_per_group, (g + 1) * n_blocks_per_group), the sequences of
+// each group should be consecutive and in the order of the groups. the
+// block ids are translated into the ids of the kv cache of the group.
+// not supported with persistent block tables, cascade attention, token trees
+// or kv cache eviction.
+void split_model_input_for_attention_groups(int32_t n_groups,
+                                            int32_t n_blocks_per_group,
+                                            int32_t block_size,
+                                            ModelInput* input);
+
 template <typename T>
 std::string to_string(const std::vector<T>& items) {
   std::stringstream ss;
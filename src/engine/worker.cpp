@@ -1,27 +1,51 @@
 #include "worker.h"
 
+#include <ATen/cuda/CUDAEvent.h>
 #include <ATen/cuda/CUDAGraph.h>
+#include <absl/strings/str_join.h>
+#include <absl/strings/str_split.h>
 #include <c10/core/Device.h>
+#include <c10/cuda/CUDAException.h>
 #include <c10/cuda/CUDAGuard.h>
+#include <cuda_runtime.h>
 #include <folly/Unit.h>
 #include <folly/futures/Future.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <memory>
 #include <optional>
+#include <string>
+#include <tuple>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
+#include "common/cpu_affinity.h"
 #include "common/metrics.h"
+#include "common/pinned_allocator.h"
+#include "common/scope_guard.h"
+#include "common/tensor_helper.h"
 #include "common/threadpool.h"
 #include "common/timer.h"
+#include "common/trace.h"
 #include "memory/kv_cache.h"
 #include "memory/memory.h"
+#include "memory/shared_block_pool.h"
 #include "model_loader/state_dict.h"
+#include "model_loader/weights_broadcaster.h"
 #include "model_parallel/model_parallel.h"
+#include "layers/linear_impl.h"
+#include "layers/lora_linear.h"
 #include "models/parameters.h"
+#include "sampling/fused_sampler.h"
 #include "sampling/logits_processor.h"
 #include "sampling/sampler.h"
+#include "sampling/vocab_parallel_sampler.h"
 
 // latency metrics
 DEFINE_COUNTER_FAMILY(execution_latency_seconds,
@@ -36,7 +60,175 @@ DEFINE_COUNTER_INSTANCE(sampling_latency_seconds,
                         execution_latency_seconds,
                         {{"stage", "sampling"}});
 
+DEFINE_COUNTER(num_decode_steps_total,
+               "Total number of decode steps run on device in multi-step mode");
+
+DEFINE_GAUGE_FAMILY(device_memory_bytes,
+                    "Device memory used by the workers by component in bytes");
+
+DEFINE_int32(memory_metrics_interval_s,
+             30,
+             "Interval in seconds to update the device memory metrics of "
+             "the workers, 0 to disable.");
+
+DEFINE_bool(broadcast_weights,
+            false,
+            "read the weights files on the first rank of each tensor "
+            "parallel group only and broadcast or scatter the tensors to the "
+            "other ranks over nccl. set on all the workers, including the "
+            "remote ones.");
+
+DEFINE_int32(encoder_cache_mb,
+             1024,
+             "Max device memory in MB to cache the vision encoder outputs of "
+             "the recent images with, 0 to encode the images of each step "
+             "anew.");
+
 namespace llm {
+namespace {
+
+// max number of prompt tokens to compute the logits for at once when scoring
+// prompts, which bounds the memory of the [n_tokens, vocab_size] logits.
+constexpr int64_t kScoredTokensChunkSize = 256;
+
+// the module of a weight up to the depth of the blocks of a decoder layer,
+// with the layer indices replaced by '*', e.g. "model.layers.*.mlp" for
+// "model.layers.0.mlp.down_proj.weight"
+std::string weight_module(const std::string& name) {
+  constexpr size_t kMaxDepth = 4;
+  std::vector<std::string> parts = absl::StrSplit(name, '.');
+  // drop the name of the weight
+  parts.resize(std::clamp<size_t>(parts.size() - 1, 1, kMaxDepth));
+  for (auto& part : parts) {
+    const bool is_index =
+        !part.empty() && std::all_of(part.begin(), part.end(), [](char c) {
+          return std::isdigit(static_cast<unsigned char>(c));
+        });
+    if (is_index) {
+      part = "*";
+    }
+  }
+  return absl::StrJoin(parts, ".");
+}
+
+int64_t kv_cache_bytes(const std::vector<KVCache>& kv_caches) {
+  int64_t bytes = 0;
+  for (const auto& kv_cache : kv_caches) {
+    const auto [key_cache, value_cache] = kv_cache.get_kv_cache();
+    const auto [key_scales, value_scales] = kv_cache.get_kv_cache_scales();
+    for (const auto& tensor :
+         {key_cache, value_cache, key_scales, value_scales}) {
+      if (tensor.defined()) {
+        bytes += static_cast<int64_t>(tensor.nbytes());
+      }
+    }
+  }
+  return bytes;
+}
+
+// count the sampled tokens into the unique tokens of each sequence for the
+// frequency, presence and repetition penalties. new tokens are put into the
+// first unused column.
+void update_unique_tokens(const torch::Tensor& next_tokens,
+                          SamplingParameters* params) {
+  auto& ids = params->unique_token_ids;
+  if (!ids.defined()) {
+    return;
+  }
+  auto& counts = params->unique_token_counts;
+  auto& lens = params->unique_token_ids_lens;
+
+  // [n_seqs, 1]
+  const auto tokens = next_tokens.to(ids.scalar_type()).unsqueeze(/*dim=*/1);
+  const auto cols = torch::arange(ids.size(/*dim=*/1), lens.options());
+  const auto valid = cols.unsqueeze(/*dim=*/0) < lens.unsqueeze(/*dim=*/1);
+  const auto matched = (ids == tokens) & valid;
+  // [n_seqs, 1]
+  const auto found = matched.any(/*dim=*/1, /*keepdim=*/true);
+  counts.add_(matched.to(counts.scalar_type()));
+
+  // append the token if not seen before
+  const auto new_col = lens.to(torch::kLong)
+                           .clamp_max(ids.size(/*dim=*/1) - 1)
+                           .unsqueeze(/*dim=*/1);
+  ids = torch::where(found, ids, ids.scatter(/*dim=*/1, new_col, tokens));
+  const auto ones = torch::ones_like(new_col, counts.options());
+  counts = torch::where(
+      found, counts, counts.scatter(/*dim=*/1, new_col, ones));
+  lens.add_(found.logical_not().squeeze(/*dim=*/1).to(lens.scalar_type()));
+}
+
+// create the logits processor and sampler, top_k and top_p are applied by the
+// sampler with pivot search if enabled.
+std::tuple<std::unique_ptr<LogitsProcessor>, std::unique_ptr<Sampler>>
+create_logits_processor_and_sampler(const SamplingParameters& params,
+                                    bool enable_pivot_sampling) {
+  // logprobs are computed from the filtered logits
+  const bool pivot_sampling = enable_pivot_sampling && !params.logprobs;
+  auto logits_processor = LogitsProcessor::create(
+      params, /*filter_top_k_top_p=*/!pivot_sampling);
+  const auto select = [&params](const torch::Tensor& t) {
+    return t.defined() ? t.index_select(/*dim=*/0, params.sample_idxes) : t;
+  };
+  if (!pivot_sampling) {
+    auto sampler = std::make_unique<Sampler>(params.do_sample,
+                                             params.logprobs,
+                                             params.max_top_logprobs,
+                                             /*top_k=*/torch::Tensor(),
+                                             /*top_p=*/torch::Tensor(),
+                                             select(params.rng_seeds),
+                                             select(params.rng_offsets),
+                                             params.logprobs_idxes);
+    return {std::move(logits_processor), std::move(sampler)};
+  }
+  auto sampler = std::make_unique<Sampler>(params.do_sample,
+                                           params.logprobs,
+                                           params.max_top_logprobs,
+                                           select(params.top_k),
+                                           select(params.top_p),
+                                           select(params.rng_seeds),
+                                           select(params.rng_offsets));
+  return {std::move(logits_processor), std::move(sampler)};
+}
+
+// set the lora slots of the tokens for the linear layers during a forward
+class LoRASlotsGuard {
+ public:
+  explicit LoRASlotsGuard(torch::Tensor slots) {
+    LoRALinearImpl::set_slots(std::move(slots));
+  }
+
+  ~LoRASlotsGuard() { LoRALinearImpl::set_slots(torch::Tensor()); }
+};
+
+// set the image embeddings of the tokens for the embedding layers during a
+// forward
+class ImageEmbeddingsGuard {
+ public:
+  explicit ImageEmbeddingsGuard(ImageEmbeddings image_embeddings) {
+    ImageEmbeddings::set_current(std::move(image_embeddings));
+  }
+
+  ~ImageEmbeddingsGuard() { ImageEmbeddings::set_current({}); }
+};
+
+// keep the logits of the lm head sharded along the vocab
+class SkipGatherOutputGuard {
+ public:
+  SkipGatherOutputGuard() {
+    ColumnParallelLinearImpl::set_skip_gather_output(true);
+  }
+
+  ~SkipGatherOutputGuard() {
+    ColumnParallelLinearImpl::set_skip_gather_output(false);
+  }
+};
+
+// whether execute_model() runs the prefill sequences of a batch concurrently
+// with the decode sequences on the working thread
+thread_local bool concurrent_prefill = false;
+
+}  // namespace
 
 Worker::Worker(const ParallelArgs& parallel_args,
                const torch::Device& device,
@@ -44,14 +236,45 @@ Worker::Worker(const ParallelArgs& parallel_args,
     : parallel_args_(parallel_args),
       device_(device),
       runner_options_(runner_options) {
-  // first worker is the driver
-  driver_ = parallel_args.rank() == 0;
+  // first worker of the last pipeline stage is the driver
+  driver_ = parallel_args.rank() == 0 && parallel_args.is_last_stage();
+
+  if (runner_options.numa_affinity() && device.is_cuda()) {
+    // the host memory touched first by the worker threads is placed on the
+    // numa node of the device as well
+    const int32_t node = device_numa_node(device);
+    const auto cpus = numa_node_cpus(node);
+    if (!cpus.empty() && threadpool_.set_affinity(cpus)) {
+      LOG(INFO) << "Pinned the worker of " << device << " to numa node "
+                << node;
+    } else {
+      LOG(WARNING) << "Unknown numa node of " << device
+                   << ", the worker threads are not pinned";
+    }
+  }
+}
+
+void Worker::init_process_group(int32_t rank,
+                                int32_t world_size,
+                                const std::string& unique_id) {
+  CHECK(model_ == nullptr) << "Model is already initialized.";
+  process_group_ = ProcessGroup::create_process_group(
+      rank, world_size, device_, unique_id);
+  parallel_args_.rank(rank).world_size(world_size).process_group(
+      process_group_.get());
 }
 
 bool Worker::init_model(torch::ScalarType dtype,
                         const ModelArgs& args,
-                        const QuantArgs& quant_args) {
+                        const QuantArgs& quant_args,
+                        int32_t dp_attention_size) {
   CHECK(model_ == nullptr) << "Model is already initialized.";
+  CHECK(dp_attention_size > 0 &&
+        parallel_args_.world_size() % dp_attention_size == 0)
+      << "World size " << parallel_args_.world_size()
+      << " is not divisible by the data parallel attention size "
+      << dp_attention_size;
+  parallel_args_.dp_attention_size(dp_attention_size);
 
   // initialize model
   args_ = args;
@@ -59,43 +282,414 @@ bool Worker::init_model(torch::ScalarType dtype,
   const auto options = torch::dtype(dtype_).device(device_);
   model_ = CausalLM::create(args, quant_args, parallel_args_, options);
   CHECK(model_ != nullptr) << "Failed to create model.";
+  // the heads are split among the ranks of the attention group
+  runner_options_.model_type(args.model_type())
+      .n_local_heads(args.n_heads() / parallel_args_.attention_world_size());
   model_runner_ =
       std::make_unique<ModelRunner>(model_.get(), device_, runner_options_);
+
+  // the images are embedded with the tokens on the first pipeline stage
+  if (parallel_args_.is_first_stage()) {
+    vision_encoder_ = VisionEncoder::create(args, options);
+  }
+  if (vision_encoder_ != nullptr) {
+    if (device_.is_cuda()) {
+      encoder_stream_ = c10::cuda::getStreamFromPool(
+          /*isHighPriority=*/false, device_.index());
+    }
+    encoder_cache_ = std::make_unique<EncoderCache>(
+        static_cast<int64_t>(FLAGS_encoder_cache_mb) * 1024 * 1024);
+  }
   return true;
 }
 
 bool Worker::init_kv_cache(int64_t n_blocks,
+                           int64_t n_host_blocks,
                            int64_t block_size,
                            int64_t n_kv_heads,
-                           int64_t head_dim) {
+                           int64_t head_dim,
+                           torch::ScalarType cache_dtype,
+                           int64_t max_blocks) {
   CHECK(model_ != nullptr) << "Model is not initialized.";
   CHECK(kv_caches_.empty()) << "KV caches are already initialized.";
 
-  const auto options = torch::dtype(dtype_).device(device_);
-  // create a KVCache for each layer
-  const int64_t num_layers = args_.n_layers();
+  const auto options = torch::dtype(cache_dtype).device(device_);
+  const auto layout = parse_kv_cache_layout(FLAGS_kv_cache_layout);
+  // create a KVCache for each layer of the pipeline stage
+  const auto [start_layer, end_layer] =
+      pipeline_stage_layers(args_.n_layers(), parallel_args_);
+  const int64_t num_layers = end_layer - start_layer;
   kv_caches_.reserve(num_layers);
   for (int64_t i = 0; i < num_layers; ++i) {
-    kv_caches_.emplace_back(
-        n_blocks, block_size, n_kv_heads, head_dim, options);
+    kv_caches_.emplace_back(n_blocks,
+                            block_size,
+                            n_kv_heads,
+                            head_dim,
+                            options,
+                            layout,
+                            max_blocks);
   }
+
+  // create host kv caches in pinned memory on the numa node of the device
+  // for swapping
+  if (n_host_blocks > 0 && device_.is_cuda()) {
+    auto& allocator = PinnedAllocator::get(device_);
+    const int64_t n_host_slots = n_host_blocks * block_size;
+    const std::vector<int64_t> shape =
+        layout == KVCacheLayout::kHND
+            ? std::vector<int64_t>{n_host_blocks, n_kv_heads, block_size,
+                                   head_dim}
+            : std::vector<int64_t>{n_host_slots, n_kv_heads, head_dim};
+    const bool quantized = KVCache::is_quantized_dtype(cache_dtype);
+    host_kv_caches_.reserve(num_layers);
+    for (int64_t i = 0; i < num_layers; ++i) {
+      torch::Tensor key_scale;
+      torch::Tensor value_scale;
+      if (quantized) {
+        key_scale = allocator.empty({n_host_slots, n_kv_heads}, torch::kFloat)
+                        .fill_(1.0f);
+        value_scale =
+            allocator.empty({n_host_slots, n_kv_heads}, torch::kFloat)
+                .fill_(1.0f);
+      }
+      host_kv_caches_.emplace_back(allocator.empty(shape, cache_dtype),
+                                   allocator.empty(shape, cache_dtype),
+                                   std::move(key_scale),
+                                   std::move(value_scale),
+                                   block_size,
+                                   layout);
+      // attended on host for the sequences with offloaded blocks
+      kv_caches_[i].set_host_tier(&host_kv_caches_[i]);
+    }
+    swap_stream_ = c10::cuda::getStreamFromPool(/*isHighPriority=*/false,
+                                               device_.index());
+  }
+
+  // map the kv cache pool shared with other processes
+  if (!FLAGS_shared_kv_pool.empty() && device_.is_cuda()) {
+    init_shared_kv_cache(block_size, n_kv_heads, head_dim, options, layout);
+  }
+  // the activations are reserved with the kv caches, so that running out of
+  // memory for them shows up at startup
+  model_runner_->reserve_activation_pool(kv_caches_);
   return true;
 }
 
-void Worker::capture_cuda_graph(uint32_t batch_size) {
+bool Worker::resize_kv_cache(int64_t n_blocks) {
+  CHECK(!kv_caches_.empty()) << "KV caches are not initialized.";
+  // the blocks to unmap may still be accessed by the pending kernels
+  c10::cuda::getCurrentCUDAStream().synchronize();
+  if (swap_stream_.has_value()) {
+    swap_stream_->synchronize();
+  }
+  const int64_t old_blocks = kv_caches_.front().num_blocks();
+  for (size_t i = 0; i < kv_caches_.size(); ++i) {
+    if (!kv_caches_[i].resize(n_blocks)) {
+      // restore the layers resized
+      for (size_t j = 0; j < i; ++j) {
+        kv_caches_[j].resize(old_blocks);
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+void Worker::swap_kv_cache_blocks(const ModelInput& inputs) {
+  if (!inputs.swap_out_blocks.defined() && !inputs.swap_in_blocks.defined()) {
+    return;
+  }
+  CHECK(swap_stream_.has_value()) << "swapping is not enabled";
+  CHECK_EQ(host_kv_caches_.size(), kv_caches_.size());
+
+  auto compute_stream = c10::cuda::getCurrentCUDAStream();
+  // wait for previous writes into the kv cache
+  at::cuda::CUDAEvent ready;
+  ready.record(compute_stream);
+  ready.block(swap_stream_.value());
+  {
+    c10::cuda::CUDAStreamGuard stream_guard(swap_stream_.value());
+    // swap out first since the device blocks may be reused by swap in
+    if (inputs.swap_out_blocks.defined()) {
+      for (size_t i = 0; i < kv_caches_.size(); ++i) {
+        host_kv_caches_[i].copy_blocks_from(kv_caches_[i],
+                                            inputs.swap_out_blocks);
+      }
+    }
+    if (inputs.swap_in_blocks.defined()) {
+      for (size_t i = 0; i < kv_caches_.size(); ++i) {
+        kv_caches_[i].copy_blocks_from(host_kv_caches_[i],
+                                       inputs.swap_in_blocks);
+      }
+    }
+  }
+  // the model should wait for the copies to finish
+  at::cuda::CUDAEvent done;
+  done.record(swap_stream_.value());
+  done.block(compute_stream);
+}
+
+void Worker::copy_kv_cache_blocks(const ModelInput& inputs) {
+  if (!inputs.copy_blocks.defined()) {
+    return;
+  }
+  // each data parallel attention group copies the blocks of its own kv cache
+  const auto& copy_blocks =
+      inputs.dp_copy_blocks.empty()
+          ? inputs.copy_blocks
+          : inputs.dp_copy_blocks[parallel_args_.attention_group()];
+  if (!copy_blocks.defined()) {
+    return;
+  }
+  // issued on the compute stream, ordered before the model writes
+  for (auto& kv_cache : kv_caches_) {
+    kv_cache.copy_blocks_from(kv_cache, copy_blocks);
+  }
+}
+
+void Worker::init_shared_kv_cache(int64_t block_size,
+                                  int64_t n_kv_heads,
+                                  int64_t head_dim,
+                                  const torch::TensorOptions& options,
+                                  KVCacheLayout layout) {
+  // the layout of the slots is checked by the block manager of the engine
+  shared_pool_ = std::make_unique<SharedBlockPool>(FLAGS_shared_kv_pool,
+                                                   FLAGS_shared_kv_pool_blocks,
+                                                   block_size,
+                                                   /*layout_key=*/0);
+  const int64_t n_blocks = shared_pool_->num_blocks();
+  const int64_t n_slots = n_blocks * block_size;
+  const bool quantized =
+      KVCache::is_quantized_dtype(options.dtype().toScalarType());
+  const int64_t cache_bytes = n_slots * n_kv_heads * head_dim *
+                              static_cast<int64_t>(options.itemsize());
+  const int64_t scale_bytes =
+      quantized ? n_slots * n_kv_heads * static_cast<int64_t>(sizeof(float))
+                : 0;
+  const int64_t layer_bytes = 2 * (cache_bytes + scale_bytes);
+  const int64_t n_layers = static_cast<int64_t>(kv_caches_.size());
+
+  // the first process allocates the memory on the device of the rank, the
+  // others open it with the cuda ipc handle
+  c10::cuda::CUDAGuard device_guard(device_);
+  void* base = nullptr;
+  bool created = false;
+  const std::string handle = shared_pool_->device_memory(
+      snapshot_rank(),
+      layer_bytes * n_layers,
+      [&]() {
+        C10_CUDA_CHECK(cudaMalloc(&base, layer_bytes * n_layers));
+        cudaIpcMemHandle_t ipc_handle;
+        C10_CUDA_CHECK(cudaIpcGetMemHandle(&ipc_handle, base));
+        return std::string(reinterpret_cast<const char*>(&ipc_handle),
+                           sizeof(ipc_handle));
+      },
+      &created);
+  if (!created) {
+    cudaIpcMemHandle_t ipc_handle;
+    CHECK_EQ(handle.size(), sizeof(ipc_handle));
+    std::memcpy(&ipc_handle, handle.data(), sizeof(ipc_handle));
+    C10_CUDA_CHECK(cudaIpcOpenMemHandle(
+        &base, ipc_handle, cudaIpcMemLazyEnablePeerAccess));
+  }
+  // released with the last tensor viewing the memory
+  auto memory = std::shared_ptr<void>(base, [created](void* ptr) {
+    if (created) {
+      cudaFree(ptr);
+    } else {
+      cudaIpcCloseMemHandle(ptr);
+    }
+  });
+
+  int64_t offset = 0;
+  auto view = [&](at::IntArrayRef sizes,
+                  const torch::TensorOptions& view_options,
+                  int64_t n_bytes) {
+    auto tensor = torch::from_blob(
+        static_cast<char*>(base) + offset,
+        sizes,
+        [memory](void* /*ptr*/) {},
+        view_options);
+    offset += n_bytes;
+    return tensor;
+  };
+  const auto scale_options = options.dtype(torch::kFloat32);
+  shared_kv_caches_.reserve(n_layers);
+  for (int64_t i = 0; i < n_layers; ++i) {
+    const std::vector<int64_t> sizes =
+        layout == KVCacheLayout::kHND
+            ? std::vector<int64_t>{n_blocks, n_kv_heads, block_size, head_dim}
+            : std::vector<int64_t>{n_slots, n_kv_heads, head_dim};
+    auto key_cache = view(sizes, options, cache_bytes);
+    auto value_cache = view(sizes, options, cache_bytes);
+    torch::Tensor key_scale;
+    torch::Tensor value_scale;
+    if (quantized) {
+      key_scale = view({n_slots, n_kv_heads}, scale_options, scale_bytes);
+      value_scale = view({n_slots, n_kv_heads}, scale_options, scale_bytes);
+    }
+    shared_kv_caches_.emplace_back(std::move(key_cache),
+                                   std::move(value_cache),
+                                   std::move(key_scale),
+                                   std::move(value_scale),
+                                   block_size,
+                                   layout);
+  }
+  LOG(INFO) << (created ? "Allocated " : "Mapped ") << n_blocks
+            << " blocks of the shared kv pool " << FLAGS_shared_kv_pool
+            << " on " << device_;
+}
+
+void Worker::copy_shared_kv_cache_blocks(const torch::Tensor& src_to_dst,
+                                         bool to_pool) {
+  if (!src_to_dst.defined()) {
+    return;
+  }
+  CHECK_EQ(shared_kv_caches_.size(), kv_caches_.size())
+      << "shared kv pool is not enabled";
+  // issued on the compute stream, ordered with the swaps and the model. the
+  // other processes access the slots after the step is done.
+  for (size_t i = 0; i < kv_caches_.size(); ++i) {
+    if (to_pool) {
+      shared_kv_caches_[i].copy_blocks_from(kv_caches_[i], src_to_dst);
+    } else {
+      kv_caches_[i].copy_blocks_from(shared_kv_caches_[i], src_to_dst);
+    }
+  }
+}
+
+void Worker::capture_cuda_graph(uint32_t batch_size, uint32_t num_tokens) {
   CHECK(model_ != nullptr) << "Model is not initialized.";
   CHECK(!kv_caches_.empty()) << "KV caches are not initialized.";
-  return model_runner_->capture_cuda_graphs(batch_size, kv_caches_);
+  return model_runner_->capture_cuda_graphs(batch_size, kv_caches_, num_tokens);
+}
+
+void Worker::pull_kv_cache_blocks(const Worker& src,
+                                  const torch::Tensor& src_to_dst) {
+  CHECK_EQ(src.kv_caches_.size(), kv_caches_.size())
+      << "kv cache layout mismatch";
+  torch::DeviceGuard device_guard(device_);
+  // issued on the compute stream, torch orders the copies across devices
+  for (size_t i = 0; i < kv_caches_.size(); ++i) {
+    kv_caches_[i].copy_blocks_from(src.kv_caches_[i], src_to_dst);
+  }
+  // the src blocks are released once the copies are done
+  c10::cuda::getCurrentCUDAStream().synchronize();
+}
+
+std::vector<KVCache::Blocks> Worker::export_kv_cache(
+    const torch::Tensor& block_ids,
+    bool quantize) {
+  torch::DeviceGuard device_guard(device_);
+  std::vector<KVCache::Blocks> blocks;
+  blocks.reserve(kv_caches_.size());
+  for (const auto& kv_cache : kv_caches_) {
+    blocks.push_back(kv_cache.export_blocks(block_ids, quantize));
+  }
+  return blocks;
+}
+
+void Worker::import_kv_cache(const torch::Tensor& block_ids,
+                             const std::vector<KVCache::Blocks>& blocks) {
+  CHECK_EQ(blocks.size(), kv_caches_.size()) << "kv cache layout mismatch";
+  torch::DeviceGuard device_guard(device_);
+  for (size_t i = 0; i < kv_caches_.size(); ++i) {
+    kv_caches_[i].import_blocks(block_ids, blocks[i]);
+  }
+  // the host tensors are freed once the copies are done
+  if (device_.is_cuda()) {
+    c10::cuda::getCurrentCUDAStream().synchronize();
+  }
+}
+
+void Worker::offload_weights() {
+  CHECK(model_ != nullptr) << "Model is not initialized.";
+  // the graphs would read the freed weights
+  model_runner_->reset_cuda_graphs();
+  model_->move_weights(torch::kCPU);
+  if (device_.is_cuda()) {
+    // wait for the copies before the host copies are read
+    torch::cuda::synchronize(device_.index());
+  }
+}
+
+void Worker::reload_weights() {
+  CHECK(model_ != nullptr) << "Model is not initialized.";
+  model_->move_weights(device_);
+  if (device_.is_cuda()) {
+    // the host copies are freed once the copies are done
+    torch::cuda::synchronize(device_.index());
+  }
+}
+
+void Worker::load_lora(int32_t slot, const StateDict& state_dict) {
+  CHECK(model_ != nullptr) << "Model is not initialized.";
+  // the linear layers load the adapter weights into the slot instead of the
+  // base weights
+  LoRALinearImpl::set_loading_slot(slot);
+  model_->load_state_dict(state_dict);
+  LoRALinearImpl::set_loading_slot(-1);
+  if (device_.is_cuda()) {
+    torch::cuda::synchronize(device_.index());
+  }
 }
 
 void Worker::load_state_dict(const StateDict& state_dict) {
   CHECK(model_ != nullptr) << "Model is not initialized.";
+  std::unique_ptr<WeightsBroadcaster> broadcaster;
+  if (FLAGS_broadcast_weights && device_.is_cuda() &&
+      parallel_args_.world_size() > 1 &&
+      parallel_args_.process_group() != nullptr) {
+    // the ranks of the group load the same tensors in the same order
+    broadcaster =
+        std::make_unique<WeightsBroadcaster>(parallel_args_.process_group());
+    WeightsBroadcaster::set_current(broadcaster.get());
+  }
+  SCOPE_GUARD([&] {
+    if (broadcaster != nullptr) {
+      WeightsBroadcaster::set_current(nullptr);
+    }
+  });
   model_->load_state_dict(state_dict);
+  if (vision_encoder_ != nullptr) {
+    vision_encoder_->load_state_dict(state_dict);
+    // the cached embeddings are stale with the new weights
+    encoder_cache_ = std::make_unique<EncoderCache>(
+        static_cast<int64_t>(FLAGS_encoder_cache_mb) * 1024 * 1024);
+  }
+  if (device_.is_cuda()) {
+    // the state dict may be freed once loaded, wait for the async copies
+    // out of its pinned memory.
+    torch::cuda::synchronize(device_.index());
+  }
 }
 
 void Worker::verify_loaded_weights() const {
   CHECK(model_ != nullptr) << "Model is not initialized.";
   model_->verify_loaded_weights();
+  if (vision_encoder_ != nullptr) {
+    vision_encoder_->verify_loaded_weights();
+  }
+}
+
+int32_t Worker::snapshot_rank() const {
+  return parallel_args_.pp_rank() * parallel_args_.world_size() +
+         parallel_args_.rank();
+}
+
+int32_t Worker::snapshot_world_size() const {
+  return parallel_args_.pp_world_size() * parallel_args_.world_size();
+}
+
+bool Worker::has_weights_snapshot(const std::string& dir) const {
+  return llm::has_weights_snapshot(
+      dir, snapshot_rank(), snapshot_world_size());
+}
+
+void Worker::load_weights_snapshot(const std::string& dir) {
+  const auto state_dict =
+      llm::load_weights_snapshot(dir, snapshot_rank(), snapshot_world_size());
+  load_state_dict(*state_dict);
 }
 
 std::tuple<int64_t, int64_t> Worker::profile_device_memory() {
@@ -108,6 +702,57 @@ std::tuple<int64_t, int64_t> Worker::profile_device_memory() {
   return {available_memory, total_memory};
 }
 
+MemoryBreakdown Worker::memory_breakdown() {
+  CHECK(model_ != nullptr) << "Model is not initialized.";
+  CHECK(device_.is_cuda()) << "Memory breakdown is only supported on GPU.";
+
+  MemoryBreakdown breakdown;
+  // count the tensors shared by modules once, e.g. tied embeddings
+  std::unordered_set<const void*> counted;
+  for (const auto& [name, weight] : model_->named_weights()) {
+    if (!weight.defined() || weight.device() != device_ ||
+        !counted.insert(weight.storage().data()).second) {
+      continue;
+    }
+    const auto bytes = static_cast<int64_t>(weight.nbytes());
+    breakdown.weights_bytes += bytes;
+    breakdown.module_weights_bytes[weight_module(name)] += bytes;
+  }
+  breakdown.kv_cache_bytes = kv_cache_bytes(kv_caches_);
+  breakdown.host_kv_cache_bytes = kv_cache_bytes(host_kv_caches_);
+  breakdown.cuda_graph_pool_bytes = model_runner_->cuda_graph_pool_bytes();
+  breakdown.activation_pool_bytes = model_runner_->activation_pool_bytes();
+  breakdown.peak_activation_bytes = model_runner_->peak_activation_bytes();
+  breakdown.allocator = memory::allocator_stats(device_);
+  breakdown.available_memory = memory::available_memory(device_);
+  breakdown.total_memory = memory::total_memory(device_);
+  return breakdown;
+}
+
+void Worker::update_memory_metrics() {
+  const auto breakdown = memory_breakdown();
+  const std::string device = device_.str();
+  auto set_gauge = [&](const std::string& component, int64_t bytes) {
+    device_memory_bytes_family
+        .Add({{"device", device}, {"component", component}})
+        .Set(static_cast<double>(bytes));
+  };
+  set_gauge("weights", breakdown.weights_bytes);
+  for (const auto& [module, bytes] : breakdown.module_weights_bytes) {
+    set_gauge("weights:" + module, bytes);
+  }
+  set_gauge("kv_cache", breakdown.kv_cache_bytes);
+  set_gauge("cuda_graph_pool", breakdown.cuda_graph_pool_bytes);
+  set_gauge("activation_pool", breakdown.activation_pool_bytes);
+  for (const auto& [num_tokens, bytes] : breakdown.peak_activation_bytes) {
+    set_gauge("peak_activation:" + std::to_string(num_tokens), bytes);
+  }
+  set_gauge("allocated", breakdown.allocator.allocated_bytes);
+  set_gauge("reserved", breakdown.allocator.reserved_bytes);
+  set_gauge("inactive_split", breakdown.allocator.inactive_split_bytes);
+  set_gauge("available", breakdown.available_memory);
+}
+
 void Worker::process_group_test() {
   torch::DeviceGuard device_guard(device_);
   torch::cuda::synchronize();
@@ -122,30 +767,271 @@ void Worker::process_group_test() {
   torch::cuda::synchronize();
 }
 
+torch::Tensor Worker::update_block_tables(const ModelInput& inputs) {
+  const int64_t n_rows = inputs.block_table_rows;
+  const int64_t width = inputs.block_table_width;
+  if (!block_tables_.defined() || block_tables_.size(/*dim=*/0) < n_rows) {
+    // grow the block tables, keeping the rows already uploaded
+    auto block_tables = torch::zeros(
+        {n_rows, width}, torch::dtype(torch::kInt).device(device_));
+    if (block_tables_.defined()) {
+      CHECK_EQ(block_tables_.size(/*dim=*/1), width);
+      block_tables.slice(/*dim=*/0, /*start=*/0, block_tables_.size(0))
+          .copy_(block_tables_);
+    }
+    block_tables_ = block_tables;
+  }
+
+  if (inputs.block_table_updates.defined()) {
+    // [n_updates, 3] (row, col, block_slot_id)
+    const auto updates = safe_to_async(inputs.block_table_updates, device_);
+    const auto rows = updates.select(/*dim=*/1, /*index=*/0).to(torch::kLong);
+    const auto cols = updates.select(/*dim=*/1, /*index=*/1).to(torch::kLong);
+    block_tables_.index_put_({rows, cols},
+                             updates.select(/*dim=*/1, /*index=*/2));
+  }
+  // cu_block_lens points to the start of each row
+  return block_tables_.view({-1});
+}
+
+void Worker::update_token_counts(const ModelInput& inputs,
+                                 const torch::Tensor& rows,
+                                 SamplingParameters* params) {
+  const int64_t n_rows = inputs.token_count_num_rows;
+  const int64_t width = inputs.token_count_width;
+  if (!unique_token_ids_.defined() || unique_token_ids_.size(0) < n_rows ||
+      unique_token_ids_.size(1) < width) {
+    // grow the tables, keeping the rows already uploaded
+    const int64_t old_rows =
+        unique_token_ids_.defined() ? unique_token_ids_.size(0) : 0;
+    const int64_t old_width =
+        unique_token_ids_.defined() ? unique_token_ids_.size(1) : 0;
+    const auto options = torch::dtype(torch::kInt).device(device_);
+    auto ids = torch::zeros({std::max(n_rows, old_rows),
+                             std::max(width, old_width)},
+                            options.dtype(torch::kLong));
+    auto counts = torch::zeros_like(ids, options);
+    auto lens = torch::zeros({ids.size(0)}, options);
+    if (old_rows > 0) {
+      ids.slice(/*dim=*/0, 0, old_rows)
+          .slice(/*dim=*/1, 0, old_width)
+          .copy_(unique_token_ids_);
+      counts.slice(/*dim=*/0, 0, old_rows)
+          .slice(/*dim=*/1, 0, old_width)
+          .copy_(unique_token_counts_);
+      lens.slice(/*dim=*/0, 0, old_rows).copy_(unique_token_lens_);
+    }
+    unique_token_ids_ = ids;
+    unique_token_counts_ = counts;
+    unique_token_lens_ = lens;
+  }
+
+  if (inputs.token_count_resets.defined()) {
+    // [n_resets, 2] (row, n_unique_tokens)
+    const auto resets = safe_to_async(inputs.token_count_resets, device_);
+    const auto reset_rows =
+        resets.select(/*dim=*/1, /*index=*/0).to(torch::kLong);
+    unique_token_ids_.index_fill_(/*dim=*/0, reset_rows, 0);
+    unique_token_counts_.index_fill_(/*dim=*/0, reset_rows, 0);
+    unique_token_lens_.index_put_({reset_rows},
+                                  resets.select(/*dim=*/1, /*index=*/1));
+  }
+  if (inputs.token_count_updates.defined()) {
+    // [n_updates, 4] (row, col, token_id, count)
+    const auto updates = safe_to_async(inputs.token_count_updates, device_);
+    const auto update_rows =
+        updates.select(/*dim=*/1, /*index=*/0).to(torch::kLong);
+    const auto cols = updates.select(/*dim=*/1, /*index=*/1).to(torch::kLong);
+    unique_token_ids_.index_put_(
+        {update_rows, cols},
+        updates.select(/*dim=*/1, /*index=*/2).to(torch::kLong));
+    unique_token_counts_.index_put_({update_rows, cols},
+                                    updates.select(/*dim=*/1, /*index=*/3));
+  }
+
+  params->unique_token_ids = unique_token_ids_.index_select(/*dim=*/0, rows);
+  params->unique_token_counts =
+      unique_token_counts_.index_select(/*dim=*/0, rows);
+  params->unique_token_ids_lens =
+      unique_token_lens_.index_select(/*dim=*/0, rows);
+}
+
+void Worker::append_token_counts(const torch::Tensor& rows,
+                                 const torch::Tensor& next_tokens,
+                                 SamplingParameters* params) {
+  CHECK_EQ(rows.size(/*dim=*/0), next_tokens.size(/*dim=*/0))
+      << "one sampled token per row is expected";
+  update_unique_tokens(next_tokens, params);
+  const auto idx = rows.to(torch::kLong);
+  const int64_t width = unique_token_ids_.size(/*dim=*/1);
+  unique_token_ids_.index_copy_(
+      /*dim=*/0, idx, params->unique_token_ids.narrow(/*dim=*/1, 0, width));
+  unique_token_counts_.index_copy_(
+      /*dim=*/0, idx, params->unique_token_counts.narrow(/*dim=*/1, 0, width));
+  unique_token_lens_.index_copy_(
+      /*dim=*/0, idx, params->unique_token_ids_lens);
+  // row 0 is shared by the sequences without penalties, keep it empty
+  unique_token_ids_[0].zero_();
+  unique_token_counts_[0].zero_();
+  unique_token_lens_[0].zero_();
+}
+
 std::optional<ModelOutput> Worker::execute_model(const ModelInput& inputs) {
   torch::DeviceGuard device_guard(device_);
-  at::cuda::getCurrentCUDAStream().synchronize();
+  c10::cuda::getCurrentCUDAStream().synchronize();
+
+  if (device_.is_cuda() && !concurrent_prefill &&
+      FLAGS_memory_metrics_interval_s > 0 &&
+      memory_metrics_timer_.elapsed_seconds() >=
+          FLAGS_memory_metrics_interval_s) {
+    memory_metrics_timer_.reset();
+    update_memory_metrics();
+  }
 
   Timer timer;
 
-  // all tensors should be on the same device as model
-  auto flatten_tokens = inputs.token_ids.to(device_);
-  auto flatten_positions = inputs.positions.to(device_);
-  auto params = inputs.input_params.to(device_);
-  auto sampling_params = inputs.sampling_params.to(device_, dtype_);
+  // the driver copies the host buffer of the inputs to its device at once
+  // and broadcasts it over nvlink, the tensors within it are then views of
+  // the device buffer on all ranks instead of copied from the host.
+  torch::Tensor device_buffer;
+  ProcessGroup* process_group = parallel_args_.process_group();
+  if (inputs.input_buffer.defined() && process_group != nullptr) {
+    device_buffer =
+        torch::empty(inputs.input_buffer.sizes(),
+                     torch::dtype(torch::kUInt8).device(device_));
+    if (process_group->rank() == 0) {
+      device_buffer.copy_(inputs.input_buffer, /*non_blocking=*/true);
+      PinnedAllocator::record_stream(
+          inputs.input_buffer,
+          c10::cuda::getCurrentCUDAStream(device_.index()));
+    }
+    if (device_buffer.numel() > 0) {
+      process_group->broadcast(device_buffer, /*src=*/0);
+    }
+  }
+  DeviceBufferGuard device_buffer_guard(inputs.input_buffer, device_buffer);
+
+  // all tensors should be on the same device as model. the inputs are staged
+  // through pinned memory so that the host can keep launching kernels.
+  auto flatten_tokens = safe_to_async(inputs.token_ids, device_);
+  auto flatten_positions = safe_to_async(inputs.positions, device_);
+  // each data parallel attention group attends to its own sequences
+  const auto& input_params =
+      inputs.dp_input_params.empty()
+          ? inputs.input_params
+          : inputs.dp_input_params[parallel_args_.attention_group()];
+  auto params = input_params.to(device_, /*non_blocking=*/true);
+  if (inputs.block_table_rows > 0) {
+    params.block_tables = update_block_tables(inputs);
+  }
+  // the attention layers sum the scores of the observed kv cache
+  if (params.kv_score_slots.defined()) {
+    params.kv_scores =
+        torch::zeros(params.kv_score_slots.sizes(),
+                     torch::dtype(torch::kFloat32).device(device_));
+  }
+  auto sampling_params =
+      inputs.sampling_params.to(device_, dtype_, /*non_blocking=*/true);
+  // the persistent token counts are only kept by the driver which samples
+  torch::Tensor token_count_rows;
+  if (driver_ && inputs.token_count_rows.defined()) {
+    token_count_rows = safe_to_async(inputs.token_count_rows, device_);
+    update_token_counts(inputs, token_count_rows, &sampling_params);
+  }
+
+  // the embedding layers take the embeddings of the image tokens
+  ImageEmbeddingsGuard image_embeddings_guard(
+      prepare_image_embeddings(inputs));
+
+  // the linear layers apply the lora adapters of the tokens
+  LoRASlotsGuard lora_slots_guard(safe_to_async(inputs.lora_slots, device_));
+
+  // swap kv cache blocks before running the model. the blocks published to
+  // the shared pool are copied out first, since they may be evicted and
+  // overwritten by the copies into new blocks in the same step.
+  copy_shared_kv_cache_blocks(inputs.shared_out_blocks, /*to_pool=*/true);
+  swap_kv_cache_blocks(inputs);
+  copy_shared_kv_cache_blocks(inputs.shared_in_blocks, /*to_pool=*/false);
+  copy_kv_cache_blocks(inputs);
+
+  if (inputs.num_decode_steps > 1) {
+    return execute_decode_steps(inputs,
+                                flatten_tokens,
+                                flatten_positions,
+                                std::move(params),
+                                std::move(sampling_params),
+                                token_count_rows);
+  }
 
   // call model runner forward to get hidden states
-  auto hidden_states = model_runner_->forward(
-      flatten_tokens, flatten_positions, kv_caches_, params);
+  TraceScope forward_scope("model_forward");
+  auto hidden_states =
+      concurrent_prefill
+          ? model_runner_->forward_prefill(
+                flatten_tokens, flatten_positions, kv_caches_, params)
+          : model_runner_->forward(
+                flatten_tokens, flatten_positions, kv_caches_, params);
 
+  // sample from the vocab shards on all ranks, only the top candidates of
+  // each shard are gathered instead of the full logits.
+  const bool vocab_parallel_sampling =
+      runner_options_.enable_vocab_parallel_sampling() &&
+      parallel_args_.world_size() > 1 &&
+      VocabParallelSampler::is_supported(sampling_params);
+
+  // only the last pipeline stage has the final hidden states
   torch::Tensor logits;
-  if (sampling_params.selected_token_idxes.defined()) {
-    logits =
-        model_->logits(hidden_states, sampling_params.selected_token_idxes);
+  SampleOutput vocab_parallel_output;
+  if (sampling_params.selected_token_idxes.defined() &&
+      parallel_args_.is_last_stage()) {
+    if (vocab_parallel_sampling) {
+      SkipGatherOutputGuard skip_gather_output_guard;
+      const auto local_logits =
+          model_->logits(hidden_states, sampling_params.selected_token_idxes);
+      VocabParallelSampler sampler(sampling_params, parallel_args_);
+      vocab_parallel_output = sampler.forward(local_logits);
+    } else {
+      logits =
+          model_->logits(hidden_states, sampling_params.selected_token_idxes);
+    }
   }
 
-  at::cuda::getCurrentCUDAStream().synchronize();
-  COUNTER_ADD(model_execution_latency_seconds, timer.elapsed_seconds());
+  // score the prompt tokens on the last stage, copied to host with the sync
+  // below since only the driver returns them.
+  torch::Tensor scored_logprobs;
+  if (sampling_params.scored_token_idxes.defined() &&
+      parallel_args_.is_last_stage()) {
+    TRACE_SCOPE("score_prompt_tokens");
+    scored_logprobs = score_prompt_tokens(hidden_states, sampling_params);
+    if (driver_) {
+      scored_logprobs = safe_to_async(scored_logprobs, torch::kCPU);
+    }
+  }
+
+  // pool the hidden states of the embeddings on the driver, the hidden states
+  // are replicated across the ranks.
+  torch::Tensor pooled_hidden_states;
+  if (driver_ && sampling_params.pooled_token_idxes.defined() &&
+      parallel_args_.is_last_stage()) {
+    TRACE_SCOPE("pool_hidden_states");
+    pooled_hidden_states = safe_to_async(
+        pool_hidden_states(hidden_states, sampling_params), torch::kCPU);
+  }
+
+  // the driver queues the sampling kernels right behind the forward instead
+  // of waiting for it, so that the device doesn't idle while the host
+  // launches them. the forward is waited for once they are queued.
+  const bool forward_pending = driver_ && device_.is_cuda() &&
+                               sampling_params.selected_token_idxes.defined();
+  const Timer forward_timer = timer;
+  at::cuda::CUDAEvent forward_done;
+  if (forward_pending) {
+    forward_done.record(c10::cuda::getCurrentCUDAStream());
+  } else {
+    c10::cuda::getCurrentCUDAStream().synchronize();
+    COUNTER_ADD(model_execution_latency_seconds, timer.elapsed_seconds());
+  }
+  forward_scope.end();
 
   if (!driver_) {
     return std::nullopt;
@@ -154,27 +1040,68 @@ std::optional<ModelOutput> Worker::execute_model(const ModelInput& inputs) {
   // driver prepare model output
   ModelOutput output;
   if (sampling_params.selected_token_idxes.defined()) {
-    // create and call logits processors
-    timer.reset();
-    auto logits_processor = LogitsProcessor::create(sampling_params);
-    // apply logits processors to logits (in place)
-    logits = logits_processor->forward(logits,
-                                       sampling_params.unique_token_ids,
-                                       sampling_params.unique_token_counts,
-                                       sampling_params.unique_token_ids_lens);
-    COUNTER_ADD(logits_processing_latency_seconds, timer.elapsed_seconds());
-
-    // set logits to output
-    output.logits = logits;
-
-    timer.reset();
-    auto sampler = std::make_unique<Sampler>(sampling_params.do_sample,
-                                             sampling_params.logprobs,
-                                             sampling_params.max_top_logprobs);
-    // select sample logits
-    auto sample_logits =
-        logits.index_select(/*dim=*/0, sampling_params.sample_idxes);
-    auto sample_output = sampler->forward(sample_logits);
+    TRACE_SCOPE("sampling");
+    SampleOutput sample_output;
+    if (vocab_parallel_sampling) {
+      // sampled with the model on all ranks
+      timer.reset();
+      sample_output = std::move(vocab_parallel_output);
+    } else if (runner_options_.enable_fused_sampling() &&
+               FusedSampler::is_supported(sampling_params)) {
+      // penalties, filtering and sampling in one kernel
+      timer.reset();
+      FusedSampler sampler(sampling_params);
+      sample_output = sampler.forward(logits,
+                                      sampling_params.unique_token_ids,
+                                      sampling_params.unique_token_counts,
+                                      sampling_params.unique_token_ids_lens);
+    } else {
+      // create and call logits processors
+      timer.reset();
+      auto [logits_processor, sampler] = create_logits_processor_and_sampler(
+          sampling_params, runner_options_.enable_pivot_sampling());
+      // apply logits processors to logits (in place)
+      logits = logits_processor->forward(logits,
+                                         sampling_params.unique_token_ids,
+                                         sampling_params.unique_token_counts,
+                                         sampling_params.unique_token_ids_lens);
+      COUNTER_ADD(logits_processing_latency_seconds, timer.elapsed_seconds());
+
+      // set logits to output
+      output.logits = logits;
+
+      timer.reset();
+      // select sample logits
+      auto sample_logits =
+          logits.index_select(/*dim=*/0, sampling_params.sample_idxes);
+      sample_output = sampler->forward(sample_logits);
+    }
+    if (token_count_rows.defined()) {
+      // count the sampled tokens on device for the next step
+      append_token_counts(
+          token_count_rows, sample_output.next_tokens, &sampling_params);
+    }
+
+    // copy the sample output back to host with a single synchronization
+    // instead of one blocking copy per tensor, the sampled ids first. the
+    // logprobs are only sampled when requested. probs stay on device for
+    // speculative decoding.
+    const auto host = torch::kCPU;
+    sample_output.next_tokens = safe_to_async(sample_output.next_tokens, host);
+    sample_output.logprobs = safe_to_async(sample_output.logprobs, host);
+    sample_output.top_logprobs =
+        safe_to_async(sample_output.top_logprobs, host);
+    sample_output.top_tokens = safe_to_async(sample_output.top_tokens, host);
+    if (forward_pending) {
+      // everything is queued, split the wait between forward and sampling
+      forward_done.synchronize();
+      COUNTER_ADD(model_execution_latency_seconds,
+                  forward_timer.elapsed_seconds());
+      timer.reset();
+    }
+    if (device_.is_cuda()) {
+      c10::cuda::getCurrentCUDAStream().synchronize();
+    }
     COUNTER_ADD(sampling_latency_seconds, timer.elapsed_seconds());
 
     // set sample output to output
@@ -182,9 +1109,346 @@ std::optional<ModelOutput> Worker::execute_model(const ModelInput& inputs) {
 
     // carry over the sampling params
     output.do_sample = sampling_params.do_sample;
+    if (sampling_params.rng_offsets.defined()) {
+      const auto& idxes = sampling_params.sample_idxes;
+      output.rng_seeds = sampling_params.rng_seeds.index_select(0, idxes);
+      output.rng_offsets = sampling_params.rng_offsets.index_select(0, idxes);
+    }
+    output.logprobs = sampling_params.logprobs;
+    output.max_top_logprobs = sampling_params.max_top_logprobs;
+
+    if (runner_options_.return_hidden_states()) {
+      output.hidden_states = hidden_states.index_select(
+          /*dim=*/0, sampling_params.selected_token_idxes);
+    }
+  }
+  // the prompts are also scored by the chunks without a token to sample
+  output.sample_output.scored_logprobs = std::move(scored_logprobs);
+  output.sample_output.pooled_hidden_states = std::move(pooled_hidden_states);
+  if (driver_ && params.kv_scores.defined()) {
+    output.sample_output.kv_scores = safe_to(params.kv_scores, torch::kCPU);
+  }
+  return output;
+}
+
+torch::Tensor Worker::pool_hidden_states(const torch::Tensor& hidden_states,
+                                         const SamplingParameters& params) {
+  // [n_pooled_tokens, hidden_size]
+  const auto pooled_tokens =
+      hidden_states.index_select(/*dim=*/0, params.pooled_token_idxes)
+          .to(torch::kFloat32);
+  // sum the tokens of each embedding with one scatter-add
+  auto sums = torch::zeros({params.num_embeddings, pooled_tokens.size(1)},
+                           pooled_tokens.options());
+  sums.index_add_(/*dim=*/0, params.pooled_embedding_idxes, pooled_tokens);
+  return sums;
+}
+
+torch::Tensor Worker::score_prompt_tokens(const torch::Tensor& hidden_states,
+                                          const SamplingParameters& params) {
+  // the logits of a chunk are reduced to the logprobs of the target tokens
+  // right away: log_softmax(x)[t] = x[t] - logsumexp(x), so neither the full
+  // logits nor the full log_softmax of the prompt are materialized.
+  const int64_t n_tokens = params.scored_token_idxes.size(/*dim=*/0);
+  std::vector<torch::Tensor> logprobs;
+  logprobs.reserve((n_tokens + kScoredTokensChunkSize - 1) /
+                   kScoredTokensChunkSize);
+  for (int64_t start = 0; start < n_tokens; start += kScoredTokensChunkSize) {
+    const int64_t end = std::min(start + kScoredTokensChunkSize, n_tokens);
+    const auto idxes = params.scored_token_idxes.slice(/*dim=*/0, start, end);
+    // [n, 1]
+    const auto target_ids =
+        params.scored_token_ids.slice(/*dim=*/0, start, end).unsqueeze(1);
+    // [n, vocab_size] gathered across the vocab shards on all ranks
+    const auto logits =
+        model_->logits(hidden_states, idxes).to(torch::kFloat32);
+    const auto target_logits = logits.gather(/*dim=*/1, target_ids).squeeze(1);
+    logprobs.push_back(target_logits - torch::logsumexp(logits, /*dim=*/1));
+  }
+  return torch::cat(logprobs);
+}
+
+ImageEmbeddings Worker::prepare_image_embeddings(const ModelInput& inputs) {
+  // the image tokens keep the embeddings of the placeholder without encoder,
+  // e.g. on the draft model
+  const size_t n_images = inputs.image_hashes.size();
+  if (vision_encoder_ == nullptr || n_images == 0) {
+    return {};
+  }
+  TRACE_SCOPE("encode_images");
+  CHECK_EQ(inputs.image_pixel_values.size(), n_images);
+
+  std::vector<EncoderCache::Entry> entries(n_images);
+  std::vector<size_t> missing;
+  for (size_t i = 0; i < n_images; ++i) {
+    if (auto entry = encoder_cache_->get(inputs.image_hashes[i])) {
+      entries[i] = std::move(*entry);
+    } else {
+      missing.push_back(i);
+    }
+  }
+
+  // encode the missing images in one batch, including the ones of the later
+  // prefill chunks, so that they are ready by the time they are used.
+  if (!missing.empty()) {
+    std::optional<c10::cuda::CUDAStreamGuard> stream_guard;
+    if (encoder_stream_.has_value()) {
+      stream_guard.emplace(encoder_stream_.value());
+    }
+    std::vector<torch::Tensor> pixel_values;
+    pixel_values.reserve(missing.size());
+    for (const size_t i : missing) {
+      pixel_values.push_back(inputs.image_pixel_values[i]);
+    }
+    const auto embeddings = vision_encoder_->forward(safe_to_async(
+        torch::stack(pixel_values), vision_encoder_->options()));
+    // recorded once the embeddings are copied out below
+    std::shared_ptr<at::cuda::CUDAEvent> ready;
+    if (encoder_stream_.has_value()) {
+      ready = std::make_shared<at::cuda::CUDAEvent>();
+    }
+    for (size_t k = 0; k < missing.size(); ++k) {
+      // copied out of the batch to bound the cache by the cached images
+      entries[missing[k]] = {embeddings[static_cast<int64_t>(k)].clone(),
+                             ready};
+      encoder_cache_->put(inputs.image_hashes[missing[k]],
+                          entries[missing[k]]);
+    }
+    if (ready != nullptr) {
+      ready->record(encoder_stream_.value());
+    }
+  }
+
+  const auto& rows = inputs.image_token_rows;
+  if (!rows.defined() || rows.size(/*dim=*/0) == 0) {
+    return {};
+  }
+
+  // wait only for the images used by the tokens of the step, the rows are
+  // gathered from their embeddings concatenated in the order first used.
+  const auto rows_accessor = rows.accessor<int32_t, 2>();
+  std::vector<int64_t> image_offsets(n_images, -1);
+  std::vector<torch::Tensor> used_embeddings;
+  int64_t n_used_rows = 0;
+  std::vector<int64_t> token_idxes;
+  std::vector<int64_t> embedding_rows;
+  token_idxes.reserve(rows.size(/*dim=*/0));
+  embedding_rows.reserve(rows.size(/*dim=*/0));
+  for (int64_t r = 0; r < rows.size(/*dim=*/0); ++r) {
+    const int32_t image_idx = rows_accessor[r][1];
+    CHECK(image_idx >= 0 && static_cast<size_t>(image_idx) < n_images)
+        << "Invalid image index " << image_idx;
+    int64_t& offset = image_offsets[image_idx];
+    if (offset < 0) {
+      const auto& entry = entries[image_idx];
+      if (entry.ready != nullptr) {
+        const auto stream = c10::cuda::getCurrentCUDAStream(device_.index());
+        entry.ready->block(stream);
+        entry.embeddings.record_stream(stream);
+      }
+      offset = n_used_rows;
+      n_used_rows += entry.embeddings.size(/*dim=*/0);
+      used_embeddings.push_back(entry.embeddings);
+    }
+    token_idxes.push_back(rows_accessor[r][0]);
+    embedding_rows.push_back(offset + rows_accessor[r][2]);
+  }
+
+  const auto embedding_idxes =
+      safe_to_async(torch::tensor(embedding_rows), device_);
+  ImageEmbeddings image_embeddings;
+  image_embeddings.token_idxes =
+      safe_to_async(torch::tensor(token_idxes), device_);
+  image_embeddings.embeddings =
+      torch::cat(used_embeddings).index_select(/*dim=*/0, embedding_idxes);
+  return image_embeddings;
+}
+
+std::optional<ModelOutput> Worker::execute_decode_steps(
+    const ModelInput& inputs,
+    torch::Tensor flatten_tokens,
+    torch::Tensor flatten_positions,
+    InputParameters params,
+    SamplingParameters sampling_params,
+    const torch::Tensor& token_count_rows) {
+  TRACE_SCOPE("execute_decode_steps");
+  Timer timer;
+  const int64_t num_steps = inputs.num_decode_steps;
+  const int64_t block_size = runner_options_.block_size();
+  // the number of sequences to sample, excluding padding sequences
+  const int64_t n_seqs = sampling_params.sample_idxes.size(/*dim=*/0);
+  CHECK_EQ(sampling_params.selected_token_idxes.size(/*dim=*/0), n_seqs)
+      << "multi-step decoding only supports one token per sequence";
+
+  // the inputs are updated in place for each step, make private copies
+  flatten_tokens = flatten_tokens.clone();
+  flatten_positions = flatten_positions.clone();
+  params.kv_cu_seq_lens = params.kv_cu_seq_lens.clone();
+  params.new_cache_slots = params.new_cache_slots.clone();
+  auto tokens = flatten_tokens.slice(/*dim=*/0, /*start=*/0, n_seqs);
+  auto positions = flatten_positions.slice(/*dim=*/0, /*start=*/0, n_seqs);
+  auto new_cache_slots =
+      params.new_cache_slots.slice(/*dim=*/0, /*start=*/0, n_seqs);
+  // only real sequences grow by one token each step
+  const auto kv_cu_seq_lens_incr =
+      torch::arange(params.kv_cu_seq_lens.size(/*dim=*/0),
+                    params.kv_cu_seq_lens.options())
+          .clamp_max(n_seqs);
+  const auto seq_block_starts =
+      params.cu_block_lens.slice(/*dim=*/0, /*start=*/0, n_seqs);
+
+  // make room for one new unique token per step
+  if (sampling_params.unique_token_ids.defined()) {
+    auto& ids = sampling_params.unique_token_ids;
+    auto& counts = sampling_params.unique_token_counts;
+    ids = torch::cat(
+        {ids, torch::zeros({ids.size(0), num_steps}, ids.options())},
+        /*dim=*/1);
+    counts = torch::cat(
+        {counts, torch::zeros({counts.size(0), num_steps}, counts.options())},
+        /*dim=*/1);
+    sampling_params.unique_token_ids_lens =
+        sampling_params.unique_token_ids_lens.clone();
+  }
+
+  const auto stop_token_ids = safe_to_async(inputs.stop_token_ids, device_);
+  const auto num_remaining_tokens =
+      safe_to_async(inputs.num_remaining_tokens, device_);
+  auto finished =
+      torch::zeros({n_seqs}, torch::dtype(torch::kBool).device(device_));
+
+  std::unique_ptr<LogitsProcessor> logits_processor;
+  std::unique_ptr<Sampler> sampler;
+  std::unique_ptr<FusedSampler> fused_sampler;
+  if (driver_ && runner_options_.enable_fused_sampling() &&
+      FusedSampler::is_supported(sampling_params)) {
+    fused_sampler = std::make_unique<FusedSampler>(sampling_params);
+  } else if (driver_) {
+    std::tie(logits_processor, sampler) = create_logits_processor_and_sampler(
+        sampling_params, runner_options_.enable_pivot_sampling());
+  }
+
+  std::vector<torch::Tensor> step_next_tokens;
+  std::vector<torch::Tensor> step_logprobs;
+  std::vector<torch::Tensor> step_top_tokens;
+  std::vector<torch::Tensor> step_top_logprobs;
+  std::vector<torch::Tensor> step_probs;
+  for (int64_t step = 0; step < num_steps; ++step) {
+    auto hidden_states = model_runner_->forward(
+        flatten_tokens, flatten_positions, kv_caches_, params);
+    auto logits =
+        model_->logits(hidden_states, sampling_params.selected_token_idxes);
+
+    torch::Tensor next_tokens;
+    if (fused_sampler != nullptr) {
+      auto sample_output =
+          fused_sampler->forward(logits,
+                                 sampling_params.unique_token_ids,
+                                 sampling_params.unique_token_counts,
+                                 sampling_params.unique_token_ids_lens);
+      next_tokens = sample_output.next_tokens;
+      step_logprobs.emplace_back();
+      step_top_tokens.emplace_back();
+      step_top_logprobs.emplace_back();
+    } else if (driver_) {
+      logits = logits_processor->forward(logits,
+                                         sampling_params.unique_token_ids,
+                                         sampling_params.unique_token_counts,
+                                         sampling_params.unique_token_ids_lens);
+      auto sample_logits =
+          logits.index_select(/*dim=*/0, sampling_params.sample_idxes);
+      auto sample_output = sampler->forward(sample_logits);
+      next_tokens = sample_output.next_tokens;
+      step_logprobs.push_back(sample_output.logprobs);
+      step_top_tokens.push_back(sample_output.top_tokens);
+      step_top_logprobs.push_back(sample_output.top_logprobs);
+      if (inputs.return_probs) {
+        step_probs.push_back(sample_output.probs);
+      }
+    } else {
+      next_tokens =
+          torch::zeros({n_seqs}, torch::dtype(torch::kLong).device(device_));
+    }
+    if (parallel_args_.world_size() > 1) {
+      // share the sampled tokens from the driver with all workers
+      parallel_args_.process_group()->allreduce(next_tokens);
+    }
+    step_next_tokens.push_back(next_tokens);
+
+    if (step + 1 == num_steps) {
+      break;
+    }
+    // stop once all sequences are finished, at the cost of one sync per step.
+    // the draft tokens run all steps without any sync.
+    if (stop_token_ids.defined() || num_remaining_tokens.defined()) {
+      if (stop_token_ids.defined()) {
+        finished.logical_or_((stop_token_ids == next_tokens.unsqueeze(1))
+                                 .any(/*dim=*/1));
+      }
+      if (num_remaining_tokens.defined()) {
+        finished.logical_or_(num_remaining_tokens <= step + 1);
+      }
+      if (finished.all().item<bool>()) {
+        break;
+      }
+    }
+
+    // feed the sampled tokens back as the input of the next step
+    tokens.copy_(next_tokens);
+    positions.add_(1);
+    params.kv_cu_seq_lens.add_(kv_cu_seq_lens_incr);
+    params.kv_max_seq_len += 1;
+    // the slots are reserved by the scheduler, look them up in block tables
+    const auto block_idxes =
+        seq_block_starts + torch::div(positions, block_size, "floor");
+    new_cache_slots.copy_(
+        params.block_tables.index_select(/*dim=*/0, block_idxes) +
+        torch::remainder(positions, block_size));
+    update_unique_tokens(next_tokens, &sampling_params);
+    // the seeded sequences draw from the next position
+    if (fused_sampler != nullptr) {
+      fused_sampler->advance_rng_offsets();
+    } else if (sampler != nullptr) {
+      sampler->advance_rng_offsets();
+    }
+  }
+  COUNTER_ADD(num_decode_steps_total, step_next_tokens.size());
+  if (token_count_rows.defined()) {
+    // the tokens of the last step are not counted yet
+    append_token_counts(
+        token_count_rows, step_next_tokens.back(), &sampling_params);
+  }
+
+  const auto host = torch::kCPU;
+  const auto stack = [&host](const std::vector<torch::Tensor>& tensors) {
+    if (tensors.empty() || !tensors.front().defined()) {
+      return torch::Tensor();
+    }
+    return safe_to_async(torch::stack(tensors, /*dim=*/1), host);
+  };
+  ModelOutput output;
+  if (driver_) {
+    // [n_seqs, n_steps] and [n_seqs, n_steps, topk]
+    output.sample_output.next_tokens = stack(step_next_tokens);
+    output.sample_output.logprobs = stack(step_logprobs);
+    output.sample_output.top_tokens = stack(step_top_tokens);
+    output.sample_output.top_logprobs = stack(step_top_logprobs);
+    if (!step_probs.empty()) {
+      // [n_seqs, n_steps, vocab_size] stays on device
+      output.sample_output.probs = torch::stack(step_probs, /*dim=*/1);
+    }
+    output.do_sample = sampling_params.do_sample;
     output.logprobs = sampling_params.logprobs;
     output.max_top_logprobs = sampling_params.max_top_logprobs;
   }
+  if (device_.is_cuda()) {
+    c10::cuda::getCurrentCUDAStream().synchronize();
+  }
+  COUNTER_ADD(model_execution_latency_seconds, timer.elapsed_seconds());
+
+  if (!driver_) {
+    return std::nullopt;
+  }
   return output;
 }
 
@@ -199,6 +1463,15 @@ Worker::profile_device_memory_async() {
   return future;
 }
 
+folly::SemiFuture<MemoryBreakdown> Worker::memory_breakdown_async() {
+  folly::Promise<MemoryBreakdown> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this, promise = std::move(promise)]() mutable {
+    promise.setValue(this->memory_breakdown());
+  });
+  return future;
+}
+
 folly::SemiFuture<std::optional<ModelOutput>> Worker::execute_model_async(
     const ModelInput& inputs) {
   folly::Promise<std::optional<ModelOutput>> promise;
@@ -212,6 +1485,76 @@ folly::SemiFuture<std::optional<ModelOutput>> Worker::execute_model_async(
   return future;
 }
 
+folly::SemiFuture<std::optional<ModelOutput>> Worker::execute_prefill_async(
+    const ModelInput& inputs) {
+  CHECK(inputs.block_table_rows == 0 && !inputs.token_count_rows.defined())
+      << "prefill inputs with persistent state";
+  if (prefill_threadpool_ == nullptr) {
+    prefill_threadpool_ = std::make_unique<ThreadPool>();
+    if (device_.is_cuda()) {
+      // the decode sequences on the compute stream are scheduled first
+      prefill_stream_ = c10::cuda::getStreamFromPool(
+          /*isHighPriority=*/false, device_.index());
+    }
+  }
+  folly::Promise<std::optional<ModelOutput>> promise;
+  auto future = promise.getSemiFuture();
+  prefill_threadpool_->schedule(
+      [this, inputs = inputs, promise = std::move(promise)]() mutable {
+        std::optional<c10::cuda::CUDAStreamGuard> stream_guard;
+        if (prefill_stream_.has_value()) {
+          stream_guard.emplace(prefill_stream_.value());
+        }
+        concurrent_prefill = true;
+        SCOPE_GUARD([] { concurrent_prefill = false; });
+        const auto output = this->execute_model(inputs);
+        promise.setValue(output);
+      });
+  return future;
+}
+
+void Worker::start_step_loop(StepChannel* channel,
+                             size_t index,
+                             absl::Duration idle_timeout) {
+  if (step_loop_running_.exchange(true, std::memory_order_acq_rel)) {
+    return;
+  }
+  threadpool_.schedule([this, channel, index, idle_timeout]() {
+    run_step_loop(channel, index, idle_timeout);
+  });
+}
+
+void Worker::run_step_loop(StepChannel* channel,
+                           size_t index,
+                           absl::Duration idle_timeout) {
+  uint64_t seq = step_seq_;
+  const auto should_stop = [this]() { return threadpool_.has_pending(); };
+  while (true) {
+    const ModelInput* inputs =
+        channel->wait_for_step(&seq, idle_timeout, should_stop);
+    if (inputs != nullptr) {
+      channel->finish(index, execute_model(*inputs));
+      continue;
+    }
+    // idle or other tasks are waiting: leave the thread to them. a step
+    // posted before the flag is cleared would not restart the loop, so
+    // check again and take the loop back if nobody else has.
+    step_seq_ = seq;
+    step_loop_running_.store(false, std::memory_order_seq_cst);
+    if (!channel->has_step(seq) ||
+        step_loop_running_.exchange(true, std::memory_order_acq_rel)) {
+      return;
+    }
+    if (threadpool_.has_pending()) {
+      // run the others first, the loop continues after them
+      threadpool_.schedule([this, channel, index, idle_timeout]() {
+        run_step_loop(channel, index, idle_timeout);
+      });
+      return;
+    }
+  }
+}
+
 folly::SemiFuture<folly::Unit> Worker::process_group_test_async() {
   folly::Promise<folly::Unit> promise;
   auto future = promise.getSemiFuture();
@@ -222,54 +1565,220 @@ folly::SemiFuture<folly::Unit> Worker::process_group_test_async() {
   return future;
 }
 
+folly::SemiFuture<folly::Unit> Worker::init_process_group_async(
+    int32_t rank,
+    int32_t world_size,
+    std::string unique_id) {
+  folly::Promise<folly::Unit> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this,
+                        rank,
+                        world_size,
+                        unique_id = std::move(unique_id),
+                        promise = std::move(promise)]() mutable {
+    this->init_process_group(rank, world_size, unique_id);
+    promise.setValue();
+  });
+  return future;
+}
+
 // initialize model, cache manager. async call
 folly::SemiFuture<bool> Worker::init_model_async(torch::ScalarType dtype,
                                                  const ModelArgs& args,
-                                                 const QuantArgs& quant_args) {
+                                                 const QuantArgs& quant_args,
+                                                 int32_t dp_attention_size) {
   folly::Promise<bool> promise;
   auto future = promise.getSemiFuture();
   threadpool_.schedule([this,
                         dtype,
                         &args,
                         &quant_args,
+                        dp_attention_size,
                         promise = std::move(promise)]() mutable {
-    const bool success = this->init_model(dtype, args, quant_args);
+    const bool success =
+        this->init_model(dtype, args, quant_args, dp_attention_size);
     promise.setValue(success);
   });
   return future;
 }
 
-folly::SemiFuture<bool> Worker::init_kv_cache_async(int64_t n_blocks,
-                                                    int64_t block_size,
-                                                    int64_t n_kv_heads,
-                                                    int64_t head_dim) {
+folly::SemiFuture<bool> Worker::init_kv_cache_async(
+    int64_t n_blocks,
+    int64_t n_host_blocks,
+    int64_t block_size,
+    int64_t n_kv_heads,
+    int64_t head_dim,
+    torch::ScalarType cache_dtype,
+    int64_t max_blocks) {
   folly::Promise<bool> promise;
   auto future = promise.getSemiFuture();
   threadpool_.schedule([this,
                         n_blocks,
+                        n_host_blocks,
                         block_size,
                         n_kv_heads,
                         head_dim,
+                        cache_dtype,
+                        max_blocks,
                         promise = std::move(promise)]() mutable {
-    const bool success =
-        this->init_kv_cache(n_blocks, block_size, n_kv_heads, head_dim);
+    const bool success = this->init_kv_cache(n_blocks,
+                                             n_host_blocks,
+                                             block_size,
+                                             n_kv_heads,
+                                             head_dim,
+                                             cache_dtype,
+                                             max_blocks);
     promise.setValue(success);
   });
   return future;
 }
 
+folly::SemiFuture<bool> Worker::resize_kv_cache_async(int64_t n_blocks) {
+  folly::Promise<bool> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule(
+      [this, n_blocks, promise = std::move(promise)]() mutable {
+        const bool success = this->resize_kv_cache(n_blocks);
+        promise.setValue(success);
+      });
+  return future;
+}
+
 folly::SemiFuture<folly::Unit> Worker::capture_cuda_graph_async(
-    uint32_t batch_size) {
+    uint32_t batch_size,
+    uint32_t num_tokens) {
+  folly::Promise<folly::Unit> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this,
+                        batch_size = batch_size,
+                        num_tokens = num_tokens,
+                        promise = std::move(promise)]() mutable {
+    this->capture_cuda_graph(batch_size, num_tokens);
+    promise.setValue();
+  });
+  return future;
+}
+
+folly::SemiFuture<folly::Unit> Worker::offload_weights_async() {
+  folly::Promise<folly::Unit> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this, promise = std::move(promise)]() mutable {
+    this->offload_weights();
+    promise.setValue();
+  });
+  return future;
+}
+
+folly::SemiFuture<folly::Unit> Worker::reload_weights_async() {
+  folly::Promise<folly::Unit> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this, promise = std::move(promise)]() mutable {
+    this->reload_weights();
+    promise.setValue();
+  });
+  return future;
+}
+
+folly::SemiFuture<folly::Unit> Worker::pull_kv_cache_blocks_async(
+    const Worker& src,
+    torch::Tensor src_to_dst) {
+  folly::Promise<folly::Unit> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this,
+                        &src,
+                        src_to_dst = std::move(src_to_dst),
+                        promise = std::move(promise)]() mutable {
+    this->pull_kv_cache_blocks(src, src_to_dst);
+    promise.setValue();
+  });
+  return future;
+}
+
+folly::SemiFuture<std::vector<KVCache::Blocks>> Worker::export_kv_cache_async(
+    torch::Tensor block_ids,
+    bool quantize) {
+  folly::Promise<std::vector<KVCache::Blocks>> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this,
+                        block_ids = std::move(block_ids),
+                        quantize,
+                        promise = std::move(promise)]() mutable {
+    promise.setValue(this->export_kv_cache(block_ids, quantize));
+  });
+  return future;
+}
+
+folly::SemiFuture<folly::Unit> Worker::import_kv_cache_async(
+    torch::Tensor block_ids,
+    std::vector<KVCache::Blocks> blocks) {
+  folly::Promise<folly::Unit> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this,
+                        block_ids = std::move(block_ids),
+                        blocks = std::move(blocks),
+                        promise = std::move(promise)]() mutable {
+    this->import_kv_cache(block_ids, blocks);
+    promise.setValue();
+  });
+  return future;
+}
+
+folly::SemiFuture<folly::Unit> Worker::load_lora_async(
+    int32_t slot,
+    const StateDict& state_dict) {
   folly::Promise<folly::Unit> promise;
   auto future = promise.getSemiFuture();
   threadpool_.schedule(
-      [this, batch_size = batch_size, promise = std::move(promise)]() mutable {
-        this->capture_cuda_graph(batch_size);
+      [this, slot, &state_dict, promise = std::move(promise)]() mutable {
+        this->load_lora(slot, state_dict);
         promise.setValue();
       });
   return future;
 }
 
+folly::SemiFuture<folly::Unit> Worker::load_weights_snapshot_async(
+    std::string dir) {
+  folly::Promise<folly::Unit> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this,
+                        dir = std::move(dir),
+                        promise = std::move(promise)]() mutable {
+    this->load_weights_snapshot(dir);
+    promise.setValue();
+  });
+  return future;
+}
+
+folly::SemiFuture<folly::Unit> Worker::start_weights_snapshot_async(
+    std::string dir) {
+  folly::Promise<folly::Unit> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this,
+                        dir = std::move(dir),
+                        promise = std::move(promise)]() mutable {
+    // state dicts record the tensors into the writer of the working thread
+    snapshot_writer_ = std::make_unique<WeightsSnapshotWriter>(
+        dir, snapshot_rank(), snapshot_world_size());
+    WeightsSnapshotWriter::set_current(snapshot_writer_.get());
+    promise.setValue();
+  });
+  return future;
+}
+
+folly::SemiFuture<folly::Unit> Worker::finish_weights_snapshot_async() {
+  folly::Promise<folly::Unit> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule([this, promise = std::move(promise)]() mutable {
+    WeightsSnapshotWriter::set_current(nullptr);
+    if (snapshot_writer_ != nullptr) {
+      snapshot_writer_->finish();
+      snapshot_writer_.reset();
+    }
+    promise.setValue();
+  });
+  return future;
+}
+
 folly::SemiFuture<folly::Unit> Worker::load_state_dict_async(
     const StateDict& state_dict) {
   folly::Promise<folly::Unit> promise;
@@ -1,17 +1,31 @@
 #pragma once
 
+#include <c10/cuda/CUDAStream.h>
 #include <folly/futures/Future.h>
 #include <torch/torch.h>
 
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <string>
+
 #include "common/threadpool.h"
+#include "common/timer.h"
+#include "encoder_cache.h"
+#include "layers/embedding.h"
+#include "memory/kv_cache.h"
+#include "memory/shared_block_pool.h"
 #include "model_loader/state_dict.h"
+#include "model_loader/weights_snapshot.h"
 #include "model_parallel/parallel_args.h"
 #include "model_runner.h"
 #include "models/causal_lm.h"
 #include "models/model_args.h"
 #include "models/parameters.h"
+#include "models/vision_encoder.h"
 #include "parameters.h"
 #include "quantization/quant_args.h"
+#include "step_channel.h"
 
 namespace llm {
 
@@ -23,10 +37,20 @@ class Worker final {
 
   ~Worker() = default;
 
+  // join the process group of ranks in different processes with the unique
+  // id from ProcessGroup::create_unique_id. blocking call until all ranks
+  // join, should be called before init_model.
+  void init_process_group(int32_t rank,
+                          int32_t world_size,
+                          const std::string& unique_id);
+
   // initialize model, cache manager. blocking call
+  // dp_attention_size: number of data parallel attention groups, see
+  // ParallelArgs::dp_attention_size.
   bool init_model(torch::ScalarType dtype,
                   const ModelArgs& args,
-                  const QuantArgs& quant_args);
+                  const QuantArgs& quant_args,
+                  int32_t dp_attention_size = 1);
 
   // Load the model weights from state_dict. blocking call
   // can be called multiple times to reload the model with different parameters
@@ -35,60 +59,259 @@ class Worker final {
   // verify if the model is loaded correctly
   void verify_loaded_weights() const;
 
+  // whether dir has a complete weights snapshot of this rank
+  bool has_weights_snapshot(const std::string& dir) const;
+
+  // Load the model weights from the weights snapshot of this rank in dir,
+  // which is already sharded and transformed. blocking call
+  void load_weights_snapshot(const std::string& dir);
+
+  // move the model weights to pinned host memory to free device memory, the
+  // kv caches are kept. the captured cuda graphs are dropped. blocking call
+  void offload_weights();
+
+  // move the offloaded weights back to the device. blocking call
+  void reload_weights();
+
+  // copy kv cache blocks from the worker of the same rank in another engine,
+  // e.g. on another device over nvlink. src_to_dst: [n_blocks, 2] IntTensor
+  // on cpu. the writes of the src blocks should have finished. blocking call
+  void pull_kv_cache_blocks(const Worker& src, const torch::Tensor& src_to_dst);
+
+  // copy the kv cache of the blocks of all layers into host memory, see
+  // KVCache::export_blocks. block_ids: [n_blocks] IntTensor on cpu. blocking
+  // call
+  std::vector<KVCache::Blocks> export_kv_cache(const torch::Tensor& block_ids,
+                                               bool quantize);
+
+  // write the exported kv cache of all layers into the blocks. blocking call
+  void import_kv_cache(const torch::Tensor& block_ids,
+                       const std::vector<KVCache::Blocks>& blocks);
+
+  // number of layers with kv cache on this worker, the layers of its
+  // pipeline stage.
+  size_t num_kv_caches() const { return kv_caches_.size(); }
+
+  // load the weights of a lora adapter into the slot of the adapter pool on
+  // the device, replacing the adapter in it. blocking call
+  void load_lora(int32_t slot, const StateDict& state_dict);
+
   // returns available memory and total memory
   std::tuple<int64_t, int64_t> profile_device_memory();
 
+  // breakdown of the device memory used by the weights, kv caches, cuda
+  // graphs and activations. blocking call
+  MemoryBreakdown memory_breakdown();
+
   // initialize kv cache. blocking call
+  // n_host_blocks: number of blocks in pinned host memory for swapping
+  // cache_dtype: data type of kv cache, int8 or fp8 for quantized kv cache
+  // max_blocks: max number of blocks to resize the kv cache to, 0 for a
+  // fixed size kv cache
   bool init_kv_cache(int64_t n_blocks,
+                     int64_t n_host_blocks,
                      int64_t block_size,
                      int64_t n_kv_heads,
-                     int64_t head_dim);
+                     int64_t head_dim,
+                     torch::ScalarType cache_dtype,
+                     int64_t max_blocks = 0);
+
+  // resize the kv caches of all layers to n_blocks blocks, all or nothing.
+  // waits for the pending kernels first since the blocks removed may be in
+  // use. returns false if the device is out of memory. blocking call
+  bool resize_kv_cache(int64_t n_blocks);
 
   // Run the model on the given input. blocking call
   std::optional<ModelOutput> execute_model(const ModelInput& inputs);
 
   // capture cuda graph for the model. blocking call
-  void capture_cuda_graph(uint32_t batch_size);
+  // num_tokens: 0 for decode batches, otherwise the number of tokens of the
+  // mixed prefill/decode batches.
+  void capture_cuda_graph(uint32_t batch_size, uint32_t num_tokens = 0);
+
+  folly::SemiFuture<folly::Unit> init_process_group_async(
+      int32_t rank,
+      int32_t world_size,
+      std::string unique_id);
 
   // initialize model, cache manager. async call
   folly::SemiFuture<bool> init_model_async(torch::ScalarType dtype,
                                            const ModelArgs& args,
-                                           const QuantArgs& quant_args);
+                                           const QuantArgs& quant_args,
+                                           int32_t dp_attention_size = 1);
 
   // Load the model weights from state_dict. async call
   // the future returns a successfull status with no meaningful value
   folly::SemiFuture<folly::Unit> load_state_dict_async(
       const StateDict& state_dict);
 
+  // load the model weights from the weights snapshot. async call
+  folly::SemiFuture<folly::Unit> load_weights_snapshot_async(std::string dir);
+
+  // record the weights loaded by load_state_dict_async from now on into a
+  // weights snapshot of this rank in dir, until finish_weights_snapshot_async
+  // writes its manifest. async call
+  folly::SemiFuture<folly::Unit> start_weights_snapshot_async(std::string dir);
+  folly::SemiFuture<folly::Unit> finish_weights_snapshot_async();
+
+  // offload/reload the model weights. async call
+  folly::SemiFuture<folly::Unit> offload_weights_async();
+  folly::SemiFuture<folly::Unit> reload_weights_async();
+
+  // copy kv cache blocks from the worker of another engine. async call
+  folly::SemiFuture<folly::Unit> pull_kv_cache_blocks_async(
+      const Worker& src,
+      torch::Tensor src_to_dst);
+
+  // export/import the kv cache of the blocks. async call
+  folly::SemiFuture<std::vector<KVCache::Blocks>> export_kv_cache_async(
+      torch::Tensor block_ids,
+      bool quantize);
+  folly::SemiFuture<folly::Unit> import_kv_cache_async(
+      torch::Tensor block_ids,
+      std::vector<KVCache::Blocks> blocks);
+
+  // load the weights of a lora adapter into the slot. async call
+  folly::SemiFuture<folly::Unit> load_lora_async(int32_t slot,
+                                                 const StateDict& state_dict);
+
   folly::SemiFuture<std::tuple<int64_t, int64_t>> profile_device_memory_async();
 
+  folly::SemiFuture<MemoryBreakdown> memory_breakdown_async();
+
   // initialize kv cache. async call
   folly::SemiFuture<bool> init_kv_cache_async(int64_t n_blocks,
+                                              int64_t n_host_blocks,
                                               int64_t block_size,
                                               int64_t n_kv_heads,
-                                              int64_t head_dim);
+                                              int64_t head_dim,
+                                              torch::ScalarType cache_dtype,
+                                              int64_t max_blocks = 0);
+
+  // resize the kv caches. async call
+  folly::SemiFuture<bool> resize_kv_cache_async(int64_t n_blocks);
 
   // Run the model on the given input. async call
   // the future returns a successfull status with no meaningful value
   folly::SemiFuture<std::optional<ModelOutput>> execute_model_async(
       const ModelInput& inputs);
 
+  // run the prefill sequences of a mixed batch on a thread and a stream of
+  // their own, concurrently with the decode sequences of the batch run by
+  // execute_model_async(). the inputs use no persistent block tables nor
+  // token counts. async call
+  folly::SemiFuture<std::optional<ModelOutput>> execute_prefill_async(
+      const ModelInput& inputs);
+
+  // run the steps posted to the channel on a persistent loop of the working
+  // thread, which returns the thread to the other tasks when idle for
+  // idle_timeout. starts the loop if not running. index: the index of the
+  // worker in the channel.
+  void start_step_loop(StepChannel* channel,
+                       size_t index,
+                       absl::Duration idle_timeout);
+
   folly::SemiFuture<folly::Unit> process_group_test_async();
 
   // capture cuda graph for the model. async call
-  folly::SemiFuture<folly::Unit> capture_cuda_graph_async(uint32_t batch_size);
+  folly::SemiFuture<folly::Unit> capture_cuda_graph_async(
+      uint32_t batch_size,
+      uint32_t num_tokens = 0);
 
   const torch::Device& device() const { return device_; }
 
  private:
   void process_group_test();
 
+  void run_step_loop(StepChannel* channel,
+                     size_t index,
+                     absl::Duration idle_timeout);
+
+  // copy kv cache blocks between device and host on the swap stream
+  void swap_kv_cache_blocks(const ModelInput& inputs);
+
+  // copy kv cache blocks on device for forked sequences
+  void copy_kv_cache_blocks(const ModelInput& inputs);
+
+  // allocate or map the device memory of the kv cache pool shared with other
+  // processes, see FLAGS_shared_kv_pool
+  void init_shared_kv_cache(int64_t block_size,
+                            int64_t n_kv_heads,
+                            int64_t head_dim,
+                            const torch::TensorOptions& options,
+                            KVCacheLayout layout);
+
+  // copy kv cache blocks to or from the shared pool on the compute stream
+  // src_to_dst: [n_blocks, 2] IntTensor, undefined for no copies
+  void copy_shared_kv_cache_blocks(const torch::Tensor& src_to_dst,
+                                   bool to_pool);
+
+  // apply incremental updates to the persistent block tables, returns the
+  // flattened block tables on device
+  torch::Tensor update_block_tables(const ModelInput& inputs);
+
+  // apply the uploaded rows to the persistent token counts, and gather the
+  // rows of the selected tokens into the sampling params
+  void update_token_counts(const ModelInput& inputs,
+                           const torch::Tensor& rows,
+                           SamplingParameters* params);
+
+  // count the sampled tokens into the rows of the persistent token counts
+  void append_token_counts(const torch::Tensor& rows,
+                           const torch::Tensor& next_tokens,
+                           SamplingParameters* params);
+
+  // export the memory breakdown as metrics
+  void update_memory_metrics();
+
+  // compute the log probabilities of the scored prompt tokens, returns a
+  // [num_scored_tokens] FloatTensor. called on all ranks of the last stage.
+  torch::Tensor score_prompt_tokens(const torch::Tensor& hidden_states,
+                                    const SamplingParameters& params);
+
+  // sum the hidden states of the pooled tokens of each embedding, returns a
+  // [num_embeddings, hidden_size] FloatTensor.
+  torch::Tensor pool_hidden_states(const torch::Tensor& hidden_states,
+                                   const SamplingParameters& params);
+
+  // encode the images of the inputs missing in the encoder cache on the
+  // encoder stream, and gather the embeddings of the image tokens of the
+  // step once the compute stream waits for their images only. undefined if
+  // the step has no image tokens.
+  ImageEmbeddings prepare_image_embeddings(const ModelInput& inputs);
+
+  // run inputs.num_decode_steps decode steps on device, the sampled tokens
+  // are fed back as the input of the next step without returning to host.
+  std::optional<ModelOutput> execute_decode_steps(
+      const ModelInput& inputs,
+      torch::Tensor flatten_tokens,
+      torch::Tensor flatten_positions,
+      InputParameters params,
+      SamplingParameters sampling_params,
+      const torch::Tensor& token_count_rows);
+
+  // rank and world size of the weights snapshot, over all the tensor and
+  // pipeline parallel ranks
+  int32_t snapshot_rank() const;
+  int32_t snapshot_world_size() const;
+
   // whether the worker is a driver, who takes care of the sampling
   bool driver_ = false;
 
   // working thread
   ThreadPool threadpool_;
 
+  // the thread and the stream of execute_prefill_async(), created on first
+  // use
+  std::unique_ptr<ThreadPool> prefill_threadpool_;
+  std::optional<c10::cuda::CUDAStream> prefill_stream_;
+
+  // whether the step loop is running on the working thread
+  std::atomic<bool> step_loop_running_{false};
+
+  // sequence number of the last step run by the step loop
+  uint64_t step_seq_ = 0;
+
   // dtype of the model
   torch::ScalarType dtype_;
 
@@ -98,12 +321,37 @@ class Worker final {
   // parallel args
   ParallelArgs parallel_args_;
 
+  // process group owned by the worker, only set by init_process_group
+  std::unique_ptr<ProcessGroup> process_group_;
+
   // model args
   ModelArgs args_;
 
   // kv caches
   std::vector<llm::KVCache> kv_caches_;
 
+  // host kv caches in pinned memory, used to swap out preempted sequences
+  std::vector<llm::KVCache> host_kv_caches_;
+
+  // dedicated stream to copy kv cache blocks between device and host
+  std::optional<c10::cuda::CUDAStream> swap_stream_;
+
+  // the kv cache pool shared with other processes, null if disabled
+  std::unique_ptr<SharedBlockPool> shared_pool_;
+
+  // kv caches of the slots of the shared pool in the device memory shared
+  // with other processes, one for each layer
+  std::vector<llm::KVCache> shared_kv_caches_;
+
+  // persistent block tables on device: [n_rows, width] IntTensor
+  torch::Tensor block_tables_;
+
+  // persistent unique token ids and counts for the penalties, only kept by the
+  // driver which samples: [n_rows, width] Long/IntTensor and [n_rows] lengths
+  torch::Tensor unique_token_ids_;
+  torch::Tensor unique_token_counts_;
+  torch::Tensor unique_token_lens_;
+
   // causal LM model
   std::unique_ptr<CausalLM> model_;
 
@@ -112,6 +360,23 @@ class Worker final {
 
   // model runner that runs the model, with cuda graph if enabled
   std::unique_ptr<ModelRunner> model_runner_;
+
+  // vision encoder of the vision-language models on the first pipeline
+  // stage, null for the other models
+  std::unique_ptr<VisionEncoder> vision_encoder_;
+
+  // dedicated stream to encode the images, so that the images of later
+  // prefill chunks are encoded while the model runs
+  std::optional<c10::cuda::CUDAStream> encoder_stream_;
+
+  // the embeddings of the recently encoded images
+  std::unique_ptr<EncoderCache> encoder_cache_;
+
+  // writer of the weights snapshot being recorded on the working thread
+  std::unique_ptr<WeightsSnapshotWriter> snapshot_writer_;
+
+  // time since the memory metrics were updated
+  Timer memory_metrics_timer_;
 };
 
 }  // namespace llm
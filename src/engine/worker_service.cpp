@@ -0,0 +1,178 @@
+#include "worker_service.h"
+
+#include <glog/logging.h>
+#include <grpcpp/grpcpp.h>
+#include <torch/torch.h>
+
+#include <memory>
+#include <vector>
+
+#include "model_input_serializer.h"
+#include "model_loader/model_loader.h"
+#include "model_parallel/parallel_args.h"
+#include "worker.grpc.pb.h"
+#include "worker.pb.h"
+
+namespace llm {
+namespace {
+
+grpc::Status no_worker_status() {
+  return {grpc::StatusCode::FAILED_PRECONDITION, "worker is not created"};
+}
+
+}  // namespace
+
+grpc::Status WorkerService::CreateWorker(
+    grpc::ServerContext* /*context*/,
+    const proto::CreateWorkerRequest* request,
+    proto::WorkerStatus* response) {
+  if (worker_ != nullptr) {
+    return {grpc::StatusCode::ALREADY_EXISTS, "worker is already created"};
+  }
+  const auto& options = request->runner_options();
+  ModelRunner::Options runner_options;
+  runner_options.num_decoding_tokens(options.num_decoding_tokens())
+      .block_size(options.block_size())
+      .cuda_graph_max_seq_len(options.cuda_graph_max_seq_len())
+      .cuda_graph_batch_sizes({options.cuda_graph_batch_sizes().begin(),
+                               options.cuda_graph_batch_sizes().end()})
+      .cuda_graph_num_tokens({options.cuda_graph_num_tokens().begin(),
+                              options.cuda_graph_num_tokens().end()})
+      .enable_fused_sampling(options.enable_fused_sampling())
+      .enable_pivot_sampling(options.enable_pivot_sampling())
+      .enable_vocab_parallel_sampling(options.enable_vocab_parallel_sampling())
+      .return_hidden_states(options.return_hidden_states())
+      .lazy_cuda_graph_capture(options.lazy_cuda_graph_capture())
+      .activation_pool_num_tokens(options.activation_pool_num_tokens())
+      .piecewise_cuda_graph_num_tokens(
+          {options.piecewise_cuda_graph_num_tokens().begin(),
+           options.piecewise_cuda_graph_num_tokens().end()});
+
+  LOG(INFO) << "Creating worker of rank " << request->rank() << "/"
+            << request->world_size() << " on " << device_;
+  // the process group is set up by init_process_group below
+  ParallelArgs parallel_args(
+      request->rank(), request->world_size(), /*process_group=*/nullptr);
+  worker_ = std::make_unique<Worker>(parallel_args, device_, runner_options);
+  worker_
+      ->init_process_group_async(
+          request->rank(), request->world_size(), request->nccl_unique_id())
+      .get();
+  response->set_ok(true);
+  return grpc::Status::OK;
+}
+
+grpc::Status WorkerService::InitModel(grpc::ServerContext* /*context*/,
+                                      const proto::InitModelRequest* request,
+                                      proto::WorkerStatus* response) {
+  if (worker_ == nullptr) {
+    return no_worker_status();
+  }
+  auto model_loader = ModelLoader::create(request->model_weights_path());
+  LOG(INFO) << "Initializing model from: " << request->model_weights_path();
+  auto args = model_loader->model_args();
+  // use the same vocab size as the engine
+  args.vocab_size(request->vocab_size());
+  const auto& quant_args = model_loader->quant_args();
+  const auto dtype = static_cast<torch::ScalarType>(request->dtype());
+  if (!worker_->init_model_async(dtype, args, quant_args).get()) {
+    response->set_ok(false);
+    return grpc::Status::OK;
+  }
+
+  for (const auto& state_dict : *model_loader) {
+    worker_->load_state_dict_async(state_dict).get();
+  }
+  worker_->verify_loaded_weights();
+  response->set_ok(true);
+  return grpc::Status::OK;
+}
+
+grpc::Status WorkerService::ProfileDeviceMemory(
+    grpc::ServerContext* /*context*/,
+    const proto::ProfileDeviceMemoryRequest* /*request*/,
+    proto::ProfileDeviceMemoryResponse* response) {
+  if (worker_ == nullptr) {
+    return no_worker_status();
+  }
+  const auto [available_memory, total_memory] =
+      worker_->profile_device_memory_async().get();
+  response->set_available_memory(available_memory);
+  response->set_total_memory(total_memory);
+  return grpc::Status::OK;
+}
+
+grpc::Status WorkerService::InitKVCache(
+    grpc::ServerContext* /*context*/,
+    const proto::InitKVCacheRequest* request,
+    proto::WorkerStatus* response) {
+  if (worker_ == nullptr) {
+    return no_worker_status();
+  }
+  const auto cache_dtype =
+      static_cast<torch::ScalarType>(request->cache_dtype());
+  const bool ok = worker_
+                      ->init_kv_cache_async(request->n_blocks(),
+                                            request->n_host_blocks(),
+                                            request->block_size(),
+                                            request->n_kv_heads(),
+                                            request->head_dim(),
+                                            cache_dtype,
+                                            request->max_blocks())
+                      .get();
+  response->set_ok(ok);
+  return grpc::Status::OK;
+}
+
+grpc::Status WorkerService::ResizeKVCache(
+    grpc::ServerContext* /*context*/,
+    const proto::ResizeKVCacheRequest* request,
+    proto::WorkerStatus* response) {
+  if (worker_ == nullptr) {
+    return no_worker_status();
+  }
+  const bool ok = worker_->resize_kv_cache_async(request->n_blocks()).get();
+  response->set_ok(ok);
+  return grpc::Status::OK;
+}
+
+grpc::Status WorkerService::CaptureCudaGraph(
+    grpc::ServerContext* /*context*/,
+    const proto::CaptureCudaGraphRequest* request,
+    proto::WorkerStatus* response) {
+  if (worker_ == nullptr) {
+    return no_worker_status();
+  }
+  worker_
+      ->capture_cuda_graph_async(request->batch_size(), request->num_tokens())
+      .get();
+  response->set_ok(true);
+  return grpc::Status::OK;
+}
+
+grpc::Status WorkerService::ProcessGroupTest(
+    grpc::ServerContext* /*context*/,
+    const proto::ProcessGroupTestRequest* /*request*/,
+    proto::WorkerStatus* response) {
+  if (worker_ == nullptr) {
+    return no_worker_status();
+  }
+  worker_->process_group_test_async().get();
+  response->set_ok(true);
+  return grpc::Status::OK;
+}
+
+grpc::Status WorkerService::ExecuteModel(
+    grpc::ServerContext* /*context*/,
+    const proto::ExecuteModelRequest* request,
+    proto::WorkerStatus* response) {
+  if (worker_ == nullptr) {
+    return no_worker_status();
+  }
+  const auto inputs = deserialize_model_input(request->model_input());
+  worker_->execute_model_async(inputs).get();
+  response->set_ok(true);
+  return grpc::Status::OK;
+}
+
+}  // namespace llm
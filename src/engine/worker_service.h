@@ -0,0 +1,60 @@
+#pragma once
+
+#include <grpcpp/grpcpp.h>
+#include <torch/torch.h>
+
+#include <memory>
+
+#include "worker.grpc.pb.h"
+#include "worker.h"
+
+namespace llm {
+
+// Serves a worker on one device of this process for the engine in another
+// process, see RemoteWorker for the client side.
+class WorkerService final : public proto::Worker::Service {
+ public:
+  explicit WorkerService(const torch::Device& device) : device_(device) {}
+
+  grpc::Status CreateWorker(grpc::ServerContext* context,
+                            const proto::CreateWorkerRequest* request,
+                            proto::WorkerStatus* response) override;
+
+  grpc::Status InitModel(grpc::ServerContext* context,
+                         const proto::InitModelRequest* request,
+                         proto::WorkerStatus* response) override;
+
+  grpc::Status ProfileDeviceMemory(
+      grpc::ServerContext* context,
+      const proto::ProfileDeviceMemoryRequest* request,
+      proto::ProfileDeviceMemoryResponse* response) override;
+
+  grpc::Status InitKVCache(grpc::ServerContext* context,
+                           const proto::InitKVCacheRequest* request,
+                           proto::WorkerStatus* response) override;
+
+  grpc::Status ResizeKVCache(grpc::ServerContext* context,
+                             const proto::ResizeKVCacheRequest* request,
+                             proto::WorkerStatus* response) override;
+
+  grpc::Status CaptureCudaGraph(grpc::ServerContext* context,
+                                const proto::CaptureCudaGraphRequest* request,
+                                proto::WorkerStatus* response) override;
+
+  grpc::Status ProcessGroupTest(grpc::ServerContext* context,
+                                const proto::ProcessGroupTestRequest* request,
+                                proto::WorkerStatus* response) override;
+
+  grpc::Status ExecuteModel(grpc::ServerContext* context,
+                            const proto::ExecuteModelRequest* request,
+                            proto::WorkerStatus* response) override;
+
+ private:
+  // device to run the worker on
+  torch::Device device_;
+
+  // created by CreateWorker, the calls run on the thread of the worker
+  std::unique_ptr<Worker> worker_;
+};
+
+}  // namespace llm
@@ -0,0 +1,76 @@
+#include "grammar_cache.h"
+
+#include <glog/logging.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "common/metrics.h"
+#include "common/timer.h"
+
+DEFINE_COUNTER(grammar_compilation_latency_seconds,
+               "Latency of compiling grammars in seconds");
+DEFINE_COUNTER_FAMILY(grammar_cache_requests_total,
+                      "Total number of requests to the grammar cache");
+DEFINE_COUNTER_INSTANCE(grammar_cache_hits_total,
+                        grammar_cache_requests_total,
+                        {{"result", "hit"}});
+DEFINE_COUNTER_INSTANCE(grammar_cache_misses_total,
+                        grammar_cache_requests_total,
+                        {{"result", "miss"}});
+
+namespace llm {
+
+GrammarCache::GrammarCache(std::shared_ptr<const TokenVocab> vocab,
+                           size_t max_grammars)
+    : vocab_(std::move(vocab)), max_grammars_(max_grammars) {
+  CHECK(vocab_ != nullptr);
+  CHECK_GT(max_grammars_, 0) << "max grammars should be greater than 0";
+}
+
+std::shared_ptr<const TokenGrammar> GrammarCache::get(const std::string& regex,
+                                                      std::string* error) {
+  {
+    absl::MutexLock lock(&mu_);
+    auto it = entries_.find(regex);
+    if (it != entries_.end()) {
+      COUNTER_INC(grammar_cache_hits_total);
+      // move the entry to the back of the lru list
+      lru_.splice(lru_.end(), lru_, it->second.lru_it);
+      return it->second.grammar;
+    }
+  }
+  COUNTER_INC(grammar_cache_misses_total);
+
+  // compile without holding the lock, concurrent misses of the same regex
+  // compile it more than once.
+  Timer timer;
+  auto dfa = RegexDFA::compile(regex, error);
+  if (dfa == nullptr) {
+    return nullptr;
+  }
+  auto grammar = std::make_shared<const TokenGrammar>(std::move(dfa), vocab_);
+  COUNTER_ADD(grammar_compilation_latency_seconds, timer.elapsed_seconds());
+
+  absl::MutexLock lock(&mu_);
+  auto [it, inserted] = entries_.try_emplace(regex);
+  if (!inserted) {
+    lru_.splice(lru_.end(), lru_, it->second.lru_it);
+    return it->second.grammar;
+  }
+  it->second.grammar = grammar;
+  it->second.lru_it = lru_.insert(lru_.end(), regex);
+  while (entries_.size() > max_grammars_) {
+    entries_.erase(lru_.front());
+    lru_.pop_front();
+  }
+  return grammar;
+}
+
+size_t GrammarCache::size() const {
+  absl::MutexLock lock(&mu_);
+  return entries_.size();
+}
+
+}  // namespace llm
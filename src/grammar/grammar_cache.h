@@ -0,0 +1,59 @@
+#pragma once
+
+#include <absl/synchronization/mutex.h>
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "token_grammar.h"
+
+namespace llm {
+
+// A cache of the grammars compiled for a vocabulary, keyed by the regular
+// expression, since compiling the automaton and precomputing the token
+// bitmasks of a schema takes much longer than a step. Requests with the same
+// schema, e.g. the function calls of a tool, share the grammar. Thread safe.
+class GrammarCache final {
+ public:
+  // max_grammars: max number of grammars to keep, least recently used ones
+  // are evicted.
+  GrammarCache(std::shared_ptr<const TokenVocab> vocab, size_t max_grammars);
+
+  // disable copy, move and assign
+  GrammarCache(const GrammarCache&) = delete;
+  GrammarCache(GrammarCache&&) = delete;
+  GrammarCache& operator=(const GrammarCache&) = delete;
+  GrammarCache& operator=(GrammarCache&&) = delete;
+
+  // get or compile the grammar of the regular expression.
+  // returns nullptr and sets error if the pattern can't be compiled.
+  std::shared_ptr<const TokenGrammar> get(const std::string& regex,
+                                          std::string* error);
+
+  // get the number of cached grammars
+  size_t size() const;
+
+ private:
+  struct Entry {
+    std::shared_ptr<const TokenGrammar> grammar;
+    // position in the lru list
+    std::list<std::string>::iterator lru_it;
+  };
+
+  std::shared_ptr<const TokenVocab> vocab_;
+
+  size_t max_grammars_ = 0;
+
+  mutable absl::Mutex mu_;
+
+  // regex -> entry
+  std::unordered_map<std::string, Entry> entries_ ABSL_GUARDED_BY(mu_);
+
+  // regexes sorted by the last access time, front is least recently used
+  std::list<std::string> lru_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace llm
@@ -0,0 +1,488 @@
+#include "json_schema.h"
+
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_join.h>
+
+#include <algorithm>
+#include <exception>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace llm {
+namespace {
+using Json = nlohmann::ordered_json;
+
+// optional whitespace between the tokens of json texts, the generated json is
+// kept compact to avoid wasting tokens on whitespace.
+constexpr char kWhitespace[] = "[ ]?";
+
+// a character of a json string, either unescaped or an escape sequence
+constexpr char kStringChar[] =
+    R"((?:[^"\\\x00-\x1F\x7F]|\\(?:["\\/bfnrt]|u[0-9a-fA-F]{4})))";
+
+constexpr char kInteger[] = R"((?:-?(?:0|[1-9][0-9]*)))";
+
+constexpr char kNonNegativeInteger[] = R"((?:0|[1-9][0-9]*))";
+
+constexpr char kNumber[] =
+    R"((?:-?(?:0|[1-9][0-9]*)(?:\.[0-9]+)?(?:[eE][+-]?[0-9]+)?))";
+
+constexpr char kBoolean[] = "(?:true|false)";
+
+constexpr char kNull[] = "null";
+
+// formats of strings, without the quotes
+constexpr char kDate[] =
+    R"([0-9]{4}-(?:0[1-9]|1[0-2])-(?:0[1-9]|[12][0-9]|3[01]))";
+
+constexpr char kTime[] =
+    R"((?:[01][0-9]|2[0-3]):[0-5][0-9]:[0-5][0-9](?:\.[0-9]+)?)"
+    R"((?:Z|[+-](?:[01][0-9]|2[0-3]):[0-5][0-9])?)";
+
+constexpr char kUuid[] =
+    R"([0-9a-fA-F]{8}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-)"
+    R"([0-9a-fA-F]{12})";
+
+// max depth of resolving $ref, deeper references are considered recursive
+constexpr int kMaxRefDepth = 16;
+
+std::string json_string_regex() {
+  return absl::StrCat("\"", kStringChar, "*\"");
+}
+
+// the count of repetitions, e.g. {0,} or {2,5}
+std::string repeat_count(int64_t min, std::optional<int64_t> max) {
+  if (max.has_value()) {
+    if (*max == min) {
+      return absl::StrCat("{", min, "}");
+    }
+    return absl::StrCat("{", min, ",", *max, "}");
+  }
+  return absl::StrCat("{", min, ",}");
+}
+
+// a list of items separated by commas within the brackets, e.g. [1, 2]
+std::string list_regex(const std::string& open,
+                       const std::string& close,
+                       const std::string& item,
+                       int64_t min_items,
+                       std::optional<int64_t> max_items) {
+  const std::string more =
+      absl::StrCat("(?:", kWhitespace, ",", kWhitespace, item, ")");
+  if (max_items.has_value() && *max_items == 0) {
+    return absl::StrCat(open, kWhitespace, close);
+  }
+  const int64_t min_more = min_items > 0 ? min_items - 1 : 0;
+  std::optional<int64_t> max_more;
+  if (max_items.has_value()) {
+    max_more = *max_items - 1;
+  }
+  std::string items =
+      absl::StrCat(item, more, repeat_count(min_more, max_more));
+  if (min_items == 0) {
+    items = absl::StrCat("(?:", items, ")?");
+  }
+  return absl::StrCat(open, kWhitespace, items, kWhitespace, close);
+}
+
+std::string free_value_regex(int depth);
+
+std::string free_object_regex(int depth) {
+  const std::string member = absl::StrCat(json_string_regex(),
+                                          kWhitespace,
+                                          ":",
+                                          kWhitespace,
+                                          free_value_regex(depth));
+  return list_regex(R"(\{)", R"(\})", member, 0, std::nullopt);
+}
+
+// any json value nested up to depth levels
+std::string free_value_regex(int depth) {
+  std::vector<std::string> alternatives = {json_string_regex(),
+                                           std::string(kNumber),
+                                           std::string(kBoolean),
+                                           std::string(kNull)};
+  if (depth > 0) {
+    alternatives.push_back(free_object_regex(depth - 1));
+    alternatives.push_back(list_regex(
+        R"(\[)", R"(\])", free_value_regex(depth - 1), 0, std::nullopt));
+  }
+  return absl::StrCat("(?:", absl::StrJoin(alternatives, "|"), ")");
+}
+
+class SchemaConverter {
+ public:
+  explicit SchemaConverter(const Json& root) : root_(root) {}
+
+  std::optional<std::string> convert(const Json& schema) {
+    if (schema.is_boolean()) {
+      if (!schema.get<bool>()) {
+        return fail("schema false matches nothing");
+      }
+      return free_value_regex(kMaxFreeJsonDepth);
+    }
+    if (!schema.is_object()) {
+      return fail("schema should be an object");
+    }
+
+    if (schema.contains("$ref")) {
+      return convert_ref(schema["$ref"]);
+    }
+    if (schema.contains("const")) {
+      return literal(schema["const"]);
+    }
+    if (schema.contains("enum")) {
+      const auto& values = schema["enum"];
+      if (!values.is_array() || values.empty()) {
+        return fail("enum should be a non-empty array");
+      }
+      std::vector<std::string> alternatives;
+      for (const auto& value : values) {
+        alternatives.push_back(literal(value));
+      }
+      return absl::StrCat("(?:", absl::StrJoin(alternatives, "|"), ")");
+    }
+    for (const char* key : {"anyOf", "oneOf"}) {
+      if (schema.contains(key)) {
+        return convert_alternatives(schema[key]);
+      }
+    }
+    if (schema.contains("allOf")) {
+      const auto& schemas = schema["allOf"];
+      if (!schemas.is_array() || schemas.size() != 1) {
+        return fail("allOf is only supported with a single schema");
+      }
+      return convert(schemas[0]);
+    }
+
+    if (!schema.contains("type")) {
+      if (schema.contains("properties")) {
+        return convert_object(schema);
+      }
+      if (schema.contains("items")) {
+        return convert_array(schema);
+      }
+      // any json value
+      return free_value_regex(kMaxFreeJsonDepth);
+    }
+    const auto& type = schema["type"];
+    if (type.is_array()) {
+      std::vector<std::string> alternatives;
+      for (const auto& t : type) {
+        auto regex = convert_type(schema, t);
+        if (!regex.has_value()) {
+          return std::nullopt;
+        }
+        alternatives.push_back(std::move(*regex));
+      }
+      if (alternatives.empty()) {
+        return fail("type should not be empty");
+      }
+      return absl::StrCat("(?:", absl::StrJoin(alternatives, "|"), ")");
+    }
+    return convert_type(schema, type);
+  }
+
+  const std::string& error() const { return error_; }
+
+ private:
+  std::nullopt_t fail(const std::string& message) {
+    if (error_.empty()) {
+      error_ = message;
+    }
+    return std::nullopt;
+  }
+
+  // the json text of the value as a literal
+  static std::string literal(const Json& value) {
+    return absl::StrCat("(?:", regex_escape(value.dump()), ")");
+  }
+
+  std::optional<std::string> convert_ref(const Json& ref) {
+    if (!ref.is_string()) {
+      return fail("$ref should be a string");
+    }
+    const auto path = ref.get<std::string>();
+    if (path.empty() || path[0] != '#') {
+      return fail("only local $ref is supported: " + path);
+    }
+    if (ref_depth_ >= kMaxRefDepth) {
+      return fail("recursive schemas are not supported");
+    }
+    const Json* target = nullptr;
+    try {
+      target = &root_.at(Json::json_pointer(path.substr(1)));
+    } catch (const std::exception& e) {
+      return fail("failed to resolve $ref " + path + ": " + e.what());
+    }
+    ++ref_depth_;
+    auto regex = convert(*target);
+    --ref_depth_;
+    return regex;
+  }
+
+  std::optional<std::string> convert_alternatives(const Json& schemas) {
+    if (!schemas.is_array() || schemas.empty()) {
+      return fail("anyOf and oneOf should be non-empty arrays");
+    }
+    std::vector<std::string> alternatives;
+    for (const auto& schema : schemas) {
+      auto regex = convert(schema);
+      if (!regex.has_value()) {
+        return std::nullopt;
+      }
+      alternatives.push_back(std::move(*regex));
+    }
+    return absl::StrCat("(?:", absl::StrJoin(alternatives, "|"), ")");
+  }
+
+  std::optional<std::string> convert_type(const Json& schema,
+                                          const Json& type) {
+    if (!type.is_string()) {
+      return fail("type should be a string");
+    }
+    const auto name = type.get<std::string>();
+    if (name == "object") {
+      return convert_object(schema);
+    }
+    if (name == "array") {
+      return convert_array(schema);
+    }
+    if (name == "string") {
+      return convert_string(schema);
+    }
+    if (name == "integer") {
+      const auto minimum = schema.find("minimum");
+      if (minimum != schema.end() && minimum->is_number() &&
+          minimum->get<double>() >= 0) {
+        return std::string(kNonNegativeInteger);
+      }
+      return std::string(kInteger);
+    }
+    if (name == "number") {
+      return std::string(kNumber);
+    }
+    if (name == "boolean") {
+      return std::string(kBoolean);
+    }
+    if (name == "null") {
+      return std::string(kNull);
+    }
+    return fail("unsupported type: " + name);
+  }
+
+  std::optional<std::string> convert_string(const Json& schema) {
+    if (schema.contains("pattern")) {
+      const auto& pattern = schema["pattern"];
+      if (!pattern.is_string()) {
+        return fail("pattern should be a string");
+      }
+      return absl::StrCat("\"(?:", pattern.get<std::string>(), ")\"");
+    }
+    if (schema.contains("format")) {
+      const auto format = schema["format"].get<std::string>();
+      if (format == "date-time") {
+        return absl::StrCat("\"", kDate, "T", kTime, "\"");
+      }
+      if (format == "date") {
+        return absl::StrCat("\"", kDate, "\"");
+      }
+      if (format == "time") {
+        return absl::StrCat("\"", kTime, "\"");
+      }
+      if (format == "uuid") {
+        return absl::StrCat("\"", kUuid, "\"");
+      }
+      // other formats are generated as plain strings
+    }
+    const int64_t min_length = schema.value("minLength", int64_t(0));
+    std::optional<int64_t> max_length;
+    if (schema.contains("maxLength")) {
+      max_length = schema["maxLength"].get<int64_t>();
+    }
+    if (min_length < 0 ||
+        (max_length.has_value() && *max_length < min_length)) {
+      return fail("invalid string length");
+    }
+    if (min_length == 0 && !max_length.has_value()) {
+      return json_string_regex();
+    }
+    return absl::StrCat(
+        "\"", kStringChar, repeat_count(min_length, max_length), "\"");
+  }
+
+  std::optional<std::string> convert_array(const Json& schema) {
+    std::string item;
+    if (schema.contains("items")) {
+      auto regex = convert(schema["items"]);
+      if (!regex.has_value()) {
+        return std::nullopt;
+      }
+      item = std::move(*regex);
+    } else {
+      item = free_value_regex(kMaxFreeJsonDepth - 1);
+    }
+    const int64_t min_items = schema.value("minItems", int64_t(0));
+    std::optional<int64_t> max_items;
+    if (schema.contains("maxItems")) {
+      max_items = schema["maxItems"].get<int64_t>();
+    }
+    if (min_items < 0 || (max_items.has_value() && *max_items < min_items)) {
+      return fail("invalid array length");
+    }
+    return list_regex(R"(\[)", R"(\])", item, min_items, max_items);
+  }
+
+  std::optional<std::string> convert_object(const Json& schema) {
+    const auto properties = schema.find("properties");
+    if (properties == schema.end() || properties->empty()) {
+      // objects with any keys
+      std::string value;
+      const auto additional = schema.find("additionalProperties");
+      if (additional != schema.end() && additional->is_object()) {
+        auto regex = convert(*additional);
+        if (!regex.has_value()) {
+          return std::nullopt;
+        }
+        value = std::move(*regex);
+      } else if (additional != schema.end() && additional->is_boolean() &&
+                 !additional->get<bool>()) {
+        return absl::StrCat(R"(\{)", kWhitespace, R"(\})");
+      } else {
+        value = free_value_regex(kMaxFreeJsonDepth - 1);
+      }
+      const std::string member = absl::StrCat(
+          json_string_regex(), kWhitespace, ":", kWhitespace, value);
+      return list_regex(R"(\{)", R"(\})", member, 0, std::nullopt);
+    }
+    if (!properties->is_object()) {
+      return fail("properties should be an object");
+    }
+
+    std::vector<std::string> required_names;
+    if (schema.contains("required")) {
+      for (const auto& name : schema["required"]) {
+        required_names.push_back(name.get<std::string>());
+      }
+    }
+    std::vector<std::string> members;
+    std::vector<bool> required;
+    for (const auto& [name, property] : properties->items()) {
+      auto value = convert(property);
+      if (!value.has_value()) {
+        return std::nullopt;
+      }
+      members.push_back(absl::StrCat(regex_escape(Json(name).dump()),
+                                     kWhitespace,
+                                     ":",
+                                     kWhitespace,
+                                     *value));
+      required.push_back(std::find(required_names.begin(),
+                                   required_names.end(),
+                                   name) != required_names.end());
+    }
+
+    // the first member has no leading comma, so enumerate which member comes
+    // first. members after the first required one can't come first.
+    const std::string comma = absl::StrCat(kWhitespace, ",", kWhitespace);
+    std::vector<std::string> alternatives;
+    bool has_required = false;
+    for (size_t first = 0; first < members.size(); ++first) {
+      std::string alternative = members[first];
+      for (size_t i = first + 1; i < members.size(); ++i) {
+        if (required[i]) {
+          absl::StrAppend(&alternative, comma, members[i]);
+        } else {
+          absl::StrAppend(&alternative, "(?:", comma, members[i], ")?");
+        }
+      }
+      alternatives.push_back(std::move(alternative));
+      if (required[first]) {
+        has_required = true;
+        break;
+      }
+    }
+    std::string body =
+        absl::StrCat("(?:", absl::StrJoin(alternatives, "|"), ")");
+    if (!has_required) {
+      // all members are optional
+      body = absl::StrCat(body, "?");
+    }
+    return absl::StrCat(R"(\{)", kWhitespace, body, kWhitespace, R"(\})");
+  }
+
+  const Json& root_;
+
+  // depth of the $ref being resolved
+  int ref_depth_ = 0;
+
+  std::string error_;
+};
+
+}  // namespace
+
+std::optional<std::string> json_schema_to_regex(std::string_view schema,
+                                                std::string* error) {
+  Json root;
+  try {
+    root = Json::parse(schema);
+  } catch (const std::exception& e) {
+    if (error != nullptr) {
+      *error = absl::StrCat("invalid json schema: ", e.what());
+    }
+    return std::nullopt;
+  }
+
+  SchemaConverter converter(root);
+  std::optional<std::string> regex;
+  try {
+    regex = converter.convert(root);
+  } catch (const std::exception& e) {
+    if (error != nullptr) {
+      *error = absl::StrCat("invalid json schema: ", e.what());
+    }
+    return std::nullopt;
+  }
+  if (!regex.has_value() && error != nullptr) {
+    *error = converter.error();
+  }
+  return regex;
+}
+
+std::string json_object_regex(int max_depth) {
+  return free_object_regex(max_depth - 1);
+}
+
+std::string regex_escape(std::string_view text) {
+  std::string escaped;
+  escaped.reserve(text.size());
+  for (const char c : text) {
+    switch (c) {
+      case '\\':
+      case '.':
+      case '^':
+      case '$':
+      case '|':
+      case '?':
+      case '*':
+      case '+':
+      case '(':
+      case ')':
+      case '[':
+      case ']':
+      case '{':
+      case '}':
+        escaped.push_back('\\');
+        break;
+      default:
+        break;
+    }
+    escaped.push_back(c);
+  }
+  return escaped;
+}
+
+}  // namespace llm
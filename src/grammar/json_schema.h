@@ -0,0 +1,38 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace llm {
+
+// max nesting depth of the json values without a schema, e.g. the values of
+// objects without properties or the output of the json mode. json values of
+// unbounded depth can't be matched by a regular expression.
+inline constexpr int kMaxFreeJsonDepth = 3;
+
+// convert a json schema to a regular expression matching the compact json
+// texts that follow the schema, to be compiled with RegexDFA.
+//
+// Supported keywords: type (object, array, string, integer, number, boolean
+// and null, or a list of them), properties with required, items with
+// minItems and maxItems, additionalProperties, enum, const, anyOf, oneOf,
+// allOf with a single schema, string minLength, maxLength, pattern and the
+// date-time, date, time and uuid formats, and local $ref to $defs or
+// definitions. The properties of an object are generated in the order of the
+// schema, properties not listed in required are optional.
+// Recursive schemas are not supported.
+//
+// returns std::nullopt and sets error if the schema is invalid or not
+// supported.
+std::optional<std::string> json_schema_to_regex(std::string_view schema,
+                                                std::string* error);
+
+// regular expression matching any json object nested up to max_depth levels,
+// used for the json mode without a schema.
+std::string json_object_regex(int max_depth = kMaxFreeJsonDepth);
+
+// escape the special characters of a regular expression in the text
+std::string regex_escape(std::string_view text);
+
+}  // namespace llm
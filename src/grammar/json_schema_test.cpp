@@ -0,0 +1,137 @@
+#include "json_schema.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "regex_dfa.h"
+
+namespace llm {
+
+namespace {
+std::unique_ptr<RegexDFA> compile_schema(const std::string& schema) {
+  std::string error;
+  const auto regex = json_schema_to_regex(schema, &error);
+  EXPECT_TRUE(regex.has_value()) << schema << ": " << error;
+  if (!regex.has_value()) {
+    return nullptr;
+  }
+  auto dfa = RegexDFA::compile(*regex, &error);
+  EXPECT_NE(dfa, nullptr) << *regex << ": " << error;
+  return dfa;
+}
+}  // namespace
+
+TEST(JsonSchemaTest, Object) {
+  auto dfa = compile_schema(R"({
+    "type": "object",
+    "properties": {
+      "name": {"type": "string"},
+      "age": {"type": "integer"},
+      "score": {"type": "number"},
+      "active": {"type": "boolean"},
+      "tag": {"type": ["string", "null"]}
+    },
+    "required": ["name", "age"]
+  })");
+  ASSERT_NE(dfa, nullptr);
+  EXPECT_TRUE(dfa->matches(R"({"name": "bob", "age": 30})"));
+  EXPECT_TRUE(dfa->matches(R"({"name":"b\"ob","age":-1,"score":1.5e3})"));
+  EXPECT_TRUE(dfa->matches(
+      R"({"name": "", "age": 0, "active": true, "tag": null})"));
+  // missing required property
+  EXPECT_FALSE(dfa->matches(R"({"name": "bob"})"));
+  // out of order
+  EXPECT_FALSE(dfa->matches(R"({"age": 30, "name": "bob"})"));
+  // wrong types
+  EXPECT_FALSE(dfa->matches(R"({"name": 1, "age": 30})"));
+  EXPECT_FALSE(dfa->matches(R"({"name": "bob", "age": 3.5})"));
+  EXPECT_FALSE(dfa->matches(R"({"name": "bob", "age": 01})"));
+}
+
+TEST(JsonSchemaTest, OptionalProperties) {
+  auto dfa = compile_schema(R"({
+    "properties": {"a": {"type": "null"}, "b": {"type": "null"}}
+  })");
+  ASSERT_NE(dfa, nullptr);
+  EXPECT_TRUE(dfa->matches("{}"));
+  EXPECT_TRUE(dfa->matches(R"({"a": null})"));
+  EXPECT_TRUE(dfa->matches(R"({"b": null})"));
+  EXPECT_TRUE(dfa->matches(R"({"a": null, "b": null})"));
+  EXPECT_FALSE(dfa->matches(R"({, "b": null})"));
+  EXPECT_FALSE(dfa->matches(R"({"a": null,})"));
+}
+
+TEST(JsonSchemaTest, Array) {
+  auto dfa = compile_schema(R"({
+    "type": "array",
+    "items": {"enum": ["x", 1, null]},
+    "minItems": 1,
+    "maxItems": 3
+  })");
+  ASSERT_NE(dfa, nullptr);
+  EXPECT_TRUE(dfa->matches(R"(["x"])"));
+  EXPECT_TRUE(dfa->matches(R"([1, null, "x"])"));
+  EXPECT_FALSE(dfa->matches("[]"));
+  EXPECT_FALSE(dfa->matches(R"([1, 1, 1, 1])"));
+  EXPECT_FALSE(dfa->matches(R"(["y"])"));
+}
+
+TEST(JsonSchemaTest, String) {
+  auto dfa = compile_schema(R"({"type": "string", "maxLength": 3})");
+  ASSERT_NE(dfa, nullptr);
+  EXPECT_TRUE(dfa->matches(R"("")"));
+  EXPECT_TRUE(dfa->matches(R"("a\nb")"));
+  EXPECT_FALSE(dfa->matches(R"("abcd")"));
+
+  dfa = compile_schema(R"({"type": "string", "pattern": "^[0-9]{3}-[a-z]+$"})");
+  ASSERT_NE(dfa, nullptr);
+  EXPECT_TRUE(dfa->matches(R"("123-abc")"));
+  EXPECT_FALSE(dfa->matches(R"("12-abc")"));
+
+  dfa = compile_schema(R"({"type": "string", "format": "date-time"})");
+  ASSERT_NE(dfa, nullptr);
+  EXPECT_TRUE(dfa->matches(R"("2024-02-29T13:45:00Z")"));
+  EXPECT_FALSE(dfa->matches(R"("2024-13-01T00:00:00Z")"));
+}
+
+TEST(JsonSchemaTest, RefsAndAlternatives) {
+  auto dfa = compile_schema(R"({
+    "$defs": {
+      "point": {
+        "type": "object",
+        "properties": {"x": {"type": "number"}, "y": {"type": "number"}},
+        "required": ["x", "y"]
+      }
+    },
+    "anyOf": [{"$ref": "#/$defs/point"}, {"const": "origin"}]
+  })");
+  ASSERT_NE(dfa, nullptr);
+  EXPECT_TRUE(dfa->matches(R"({"x": 1, "y": -2.5})"));
+  EXPECT_TRUE(dfa->matches(R"("origin")"));
+  EXPECT_FALSE(dfa->matches(R"({"x": 1})"));
+}
+
+TEST(JsonSchemaTest, FreeJson) {
+  auto dfa = RegexDFA::compile(json_object_regex(), nullptr);
+  ASSERT_NE(dfa, nullptr);
+  EXPECT_TRUE(dfa->matches(R"({})"));
+  EXPECT_TRUE(dfa->matches(R"({"a": [1, {"b": "c"}], "d": {"e": null}})"));
+  EXPECT_FALSE(dfa->matches(R"([1])"));
+  EXPECT_FALSE(dfa->matches(R"({"a": 1,})"));
+  // nested too deep
+  EXPECT_FALSE(dfa->matches(R"({"a": [[[1]]]})"));
+}
+
+TEST(JsonSchemaTest, Errors) {
+  for (const std::string schema :
+       {"{", R"({"type": "tuple"})", R"({"$ref": "#/$defs/missing"})",
+        R"({"$defs": {"a": {"type": "array", "items": {"$ref": "#/$defs/a"}}},
+            "$ref": "#/$defs/a"})"}) {
+    std::string error;
+    EXPECT_FALSE(json_schema_to_regex(schema, &error).has_value()) << schema;
+    EXPECT_FALSE(error.empty()) << schema;
+  }
+}
+
+}  // namespace llm
@@ -0,0 +1,924 @@
+#include "regex_dfa.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace llm {
+namespace {
+
+// max number of states of the nondeterministic automaton
+constexpr size_t kMaxNfaStates = size_t(1) << 18;
+
+// max number of states before pruning the dead states
+constexpr size_t kMaxUnprunedStates = RegexDFA::kMaxStates * 4;
+
+// max count of a bounded repetition
+constexpr int kMaxRepeat = 1000;
+
+struct ByteRange {
+  uint8_t lo = 0;
+  uint8_t hi = 0;
+};
+
+// syntax tree of the pattern
+struct Node {
+  enum class Kind { kEmpty, kBytes, kConcat, kAlt, kRepeat };
+  Kind kind = Kind::kEmpty;
+  // kBytes: matches one byte in the ranges
+  std::vector<ByteRange> ranges;
+  // kConcat, kAlt: the sub expressions, kRepeat: the repeated one
+  std::vector<std::unique_ptr<Node>> children;
+  // kRepeat: the count of repetitions, max < 0 for unbounded
+  int min = 0;
+  int max = 0;
+};
+using NodePtr = std::unique_ptr<Node>;
+
+NodePtr make_node(Node::Kind kind) {
+  auto node = std::make_unique<Node>();
+  node->kind = kind;
+  return node;
+}
+
+NodePtr make_bytes(std::vector<ByteRange> ranges) {
+  auto node = make_node(Node::Kind::kBytes);
+  node->ranges = std::move(ranges);
+  return node;
+}
+
+NodePtr make_literal(std::string_view bytes) {
+  auto node = make_node(Node::Kind::kConcat);
+  for (const char c : bytes) {
+    const auto b = static_cast<uint8_t>(c);
+    node->children.push_back(make_bytes({{b, b}}));
+  }
+  return node;
+}
+
+NodePtr make_repeat(NodePtr child, int min, int max) {
+  auto node = make_node(Node::Kind::kRepeat);
+  node->children.push_back(std::move(child));
+  node->min = min;
+  node->max = max;
+  return node;
+}
+
+// any utf-8 encoded character of 2 to 4 bytes
+NodePtr make_multibyte_char() {
+  const ByteRange cont{0x80, 0xBF};
+  auto node = make_node(Node::Kind::kAlt);
+  auto two = make_node(Node::Kind::kConcat);
+  two->children.push_back(make_bytes({{0xC2, 0xDF}}));
+  two->children.push_back(make_bytes({cont}));
+  node->children.push_back(std::move(two));
+  auto three = make_node(Node::Kind::kConcat);
+  three->children.push_back(make_bytes({{0xE0, 0xEF}}));
+  three->children.push_back(make_repeat(make_bytes({cont}), 2, 2));
+  node->children.push_back(std::move(three));
+  auto four = make_node(Node::Kind::kConcat);
+  four->children.push_back(make_bytes({{0xF0, 0xF4}}));
+  four->children.push_back(make_repeat(make_bytes({cont}), 3, 3));
+  node->children.push_back(std::move(four));
+  return node;
+}
+
+// number of bytes of the utf-8 character starting with the byte
+size_t utf8_char_len(uint8_t lead) {
+  if (lead < 0x80) {
+    return 1;
+  }
+  if ((lead & 0xE0) == 0xC0) {
+    return 2;
+  }
+  if ((lead & 0xF0) == 0xE0) {
+    return 3;
+  }
+  if ((lead & 0xF8) == 0xF0) {
+    return 4;
+  }
+  return 0;
+}
+
+std::string utf8_encode(uint32_t code_point) {
+  std::string out;
+  if (code_point < 0x80) {
+    out.push_back(static_cast<char>(code_point));
+  } else if (code_point < 0x800) {
+    out.push_back(static_cast<char>(0xC0 | (code_point >> 6)));
+    out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+  } else {
+    out.push_back(static_cast<char>(0xE0 | (code_point >> 12)));
+    out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+  }
+  return out;
+}
+
+// a set of characters: ascii characters and utf-8 encoded non-ascii ones
+struct CharSet {
+  std::vector<bool> ascii = std::vector<bool>(128, false);
+  std::vector<std::string> non_ascii;
+  // matches any non-ascii character
+  bool any_non_ascii = false;
+
+  void add_range(uint8_t lo, uint8_t hi) {
+    for (int c = lo; c <= hi; ++c) {
+      ascii[c] = true;
+    }
+  }
+
+  // add the ascii characters not in other and all non-ascii characters
+  void add_complement(const CharSet& other) {
+    for (size_t c = 0; c < 128; ++c) {
+      ascii[c] = ascii[c] || !other.ascii[c];
+    }
+    any_non_ascii = true;
+  }
+
+  NodePtr to_node() const {
+    auto node = make_node(Node::Kind::kAlt);
+    std::vector<ByteRange> ranges;
+    for (int c = 0; c < 128; ++c) {
+      if (!ascii[c]) {
+        continue;
+      }
+      if (!ranges.empty() && ranges.back().hi + 1 == c) {
+        ranges.back().hi = static_cast<uint8_t>(c);
+      } else {
+        ranges.push_back({static_cast<uint8_t>(c), static_cast<uint8_t>(c)});
+      }
+    }
+    if (!ranges.empty()) {
+      node->children.push_back(make_bytes(std::move(ranges)));
+    }
+    if (any_non_ascii) {
+      node->children.push_back(make_multibyte_char());
+    } else {
+      for (const auto& c : non_ascii) {
+        node->children.push_back(make_literal(c));
+      }
+    }
+    return node;
+  }
+};
+
+CharSet class_escape_set(char c) {
+  CharSet set;
+  switch (c) {
+    case 'd':
+      set.add_range('0', '9');
+      break;
+    case 'w':
+      set.add_range('a', 'z');
+      set.add_range('A', 'Z');
+      set.add_range('0', '9');
+      set.add_range('_', '_');
+      break;
+    case 's':
+      for (const char s : {' ', '\t', '\n', '\r', '\f', '\v'}) {
+        set.add_range(s, s);
+      }
+      break;
+    default: {
+      CharSet complement;
+      complement.add_complement(class_escape_set(c - 'A' + 'a'));
+      return complement;
+    }
+  }
+  return set;
+}
+
+// recursive descent parser of the pattern
+class Parser {
+ public:
+  explicit Parser(std::string_view pattern) : pattern_(pattern) {}
+
+  NodePtr parse(std::string* error) {
+    auto node = parse_alt();
+    if (node != nullptr && pos_ < pattern_.size()) {
+      fail("unmatched ')'");
+      node = nullptr;
+    }
+    if (node == nullptr && error != nullptr) {
+      *error = error_;
+    }
+    return node;
+  }
+
+ private:
+  // record the first error, always returns false
+  bool fail(const std::string& message) {
+    if (error_.empty()) {
+      error_ = message + " at position " + std::to_string(pos_);
+    }
+    return false;
+  }
+
+  bool at_end() const { return pos_ >= pattern_.size(); }
+
+  char peek() const { return pattern_[pos_]; }
+
+  // alt := concat ('|' concat)*
+  NodePtr parse_alt() {
+    auto node = make_node(Node::Kind::kAlt);
+    while (true) {
+      auto child = parse_concat();
+      if (child == nullptr) {
+        return nullptr;
+      }
+      node->children.push_back(std::move(child));
+      if (at_end() || peek() != '|') {
+        break;
+      }
+      ++pos_;
+    }
+    if (node->children.size() == 1) {
+      return std::move(node->children.front());
+    }
+    return node;
+  }
+
+  // concat := repeat*
+  NodePtr parse_concat() {
+    auto node = make_node(Node::Kind::kConcat);
+    while (!at_end() && peek() != '|' && peek() != ')') {
+      auto child = parse_repeat();
+      if (child == nullptr) {
+        return nullptr;
+      }
+      node->children.push_back(std::move(child));
+    }
+    return node;
+  }
+
+  // repeat := atom quantifier*
+  NodePtr parse_repeat() {
+    auto node = parse_atom();
+    while (node != nullptr && !at_end()) {
+      int min = 0;
+      int max = -1;
+      const char c = peek();
+      if (c == '*') {
+        ++pos_;
+      } else if (c == '+') {
+        min = 1;
+        ++pos_;
+      } else if (c == '?') {
+        max = 1;
+        ++pos_;
+      } else if (c == '{') {
+        if (!parse_count(&min, &max)) {
+          return nullptr;
+        }
+      } else {
+        break;
+      }
+      // lazy quantifiers match the same texts
+      if (!at_end() && peek() == '?') {
+        ++pos_;
+      }
+      node = make_repeat(std::move(node), min, max);
+    }
+    return node;
+  }
+
+  bool parse_number(int* value) {
+    const size_t start = pos_;
+    int64_t n = 0;
+    while (!at_end() && peek() >= '0' && peek() <= '9') {
+      n = std::min<int64_t>(n * 10 + (peek() - '0'), kMaxRepeat + 1);
+      ++pos_;
+    }
+    *value = static_cast<int>(n);
+    return pos_ > start;
+  }
+
+  // count := '{' n '}' | '{' n ',' '}' | '{' n ',' m '}'
+  bool parse_count(int* min, int* max) {
+    ++pos_;
+    if (!parse_number(min)) {
+      return fail("invalid repetition count");
+    }
+    *max = *min;
+    if (!at_end() && peek() == ',') {
+      ++pos_;
+      if (!parse_number(max)) {
+        *max = -1;
+      }
+    }
+    if (at_end() || peek() != '}') {
+      return fail("invalid repetition count");
+    }
+    ++pos_;
+    if (*min > kMaxRepeat || *max > kMaxRepeat) {
+      return fail("repetition count is too large");
+    }
+    if (*max >= 0 && *max < *min) {
+      return fail("invalid repetition range");
+    }
+    return true;
+  }
+
+  NodePtr parse_atom() {
+    const char c = peek();
+    switch (c) {
+      case '(':
+        return parse_group();
+      case '[':
+        return parse_class();
+      case '.': {
+        ++pos_;
+        CharSet set;
+        set.add_range(0, '\n' - 1);
+        set.add_range('\n' + 1, 127);
+        set.any_non_ascii = true;
+        return set.to_node();
+      }
+      case '^':
+      case '$':
+        // the whole text is matched
+        ++pos_;
+        return make_node(Node::Kind::kEmpty);
+      case '*':
+      case '+':
+      case '?':
+      case '{':
+        fail("nothing to repeat");
+        return nullptr;
+      case '\\': {
+        CharSet set;
+        if (!parse_escape(&set)) {
+          return nullptr;
+        }
+        return set.to_node();
+      }
+      default:
+        return parse_literal_char();
+    }
+  }
+
+  // a literal character, non-ascii characters are matched as a whole
+  NodePtr parse_literal_char() {
+    const size_t len = utf8_char_len(static_cast<uint8_t>(peek()));
+    if (len == 0 || pos_ + len > pattern_.size()) {
+      fail("invalid utf-8 character");
+      return nullptr;
+    }
+    auto node = make_literal(pattern_.substr(pos_, len));
+    pos_ += len;
+    return node;
+  }
+
+  NodePtr parse_group() {
+    ++pos_;
+    if (!at_end() && peek() == '?') {
+      if (pattern_.substr(pos_, 2) != "?:") {
+        fail("unsupported group");
+        return nullptr;
+      }
+      pos_ += 2;
+    }
+    auto node = parse_alt();
+    if (node == nullptr) {
+      return nullptr;
+    }
+    if (at_end() || peek() != ')') {
+      fail("missing ')'");
+      return nullptr;
+    }
+    ++pos_;
+    return node;
+  }
+
+  // class := '[' '^'? (char | char '-' char | escape)+ ']'
+  NodePtr parse_class() {
+    ++pos_;
+    bool negated = false;
+    if (!at_end() && peek() == '^') {
+      negated = true;
+      ++pos_;
+    }
+    CharSet set;
+    bool first = true;
+    while (true) {
+      if (at_end()) {
+        fail("missing ']'");
+        return nullptr;
+      }
+      if (peek() == ']' && !first) {
+        ++pos_;
+        break;
+      }
+      first = false;
+      std::string lo;
+      if (!parse_class_char(&set, &lo)) {
+        return nullptr;
+      }
+      if (lo.empty()) {
+        // a class escape, e.g. \d
+        continue;
+      }
+      if (pos_ + 1 < pattern_.size() && peek() == '-' &&
+          pattern_[pos_ + 1] != ']') {
+        ++pos_;
+        std::string hi;
+        if (!parse_class_char(&set, &hi)) {
+          return nullptr;
+        }
+        if (hi.size() != 1 || lo.size() != 1) {
+          fail("unsupported non-ascii range");
+          return nullptr;
+        }
+        if (hi[0] < lo[0]) {
+          fail("invalid class range");
+          return nullptr;
+        }
+        set.add_range(lo[0], hi[0]);
+      } else if (lo.size() == 1) {
+        set.add_range(lo[0], lo[0]);
+      } else {
+        set.non_ascii.push_back(lo);
+      }
+    }
+    if (negated) {
+      if (!set.non_ascii.empty()) {
+        fail("unsupported non-ascii character in negated class");
+        return nullptr;
+      }
+      CharSet complement;
+      complement.add_complement(set);
+      complement.any_non_ascii = !set.any_non_ascii;
+      return complement.to_node();
+    }
+    return set.to_node();
+  }
+
+  // parse a character of a class into c, or add the characters of a class
+  // escape to the set and leave c empty.
+  bool parse_class_char(CharSet* set, std::string* c) {
+    if (peek() == '\\') {
+      CharSet escaped;
+      if (!parse_escape(&escaped)) {
+        return false;
+      }
+      const auto n_ascii =
+          std::count(escaped.ascii.begin(), escaped.ascii.end(), true);
+      if (n_ascii == 1 && escaped.non_ascii.empty() &&
+          !escaped.any_non_ascii) {
+        const auto it =
+            std::find(escaped.ascii.begin(), escaped.ascii.end(), true);
+        c->push_back(static_cast<char>(it - escaped.ascii.begin()));
+      } else if (n_ascii == 0 && escaped.non_ascii.size() == 1) {
+        *c = escaped.non_ascii.front();
+      } else {
+        for (size_t i = 0; i < 128; ++i) {
+          set->ascii[i] = set->ascii[i] || escaped.ascii[i];
+        }
+        set->any_non_ascii = set->any_non_ascii || escaped.any_non_ascii;
+      }
+      return true;
+    }
+    const size_t len = utf8_char_len(static_cast<uint8_t>(peek()));
+    if (len == 0 || pos_ + len > pattern_.size()) {
+      return fail("invalid utf-8 character");
+    }
+    *c = std::string(pattern_.substr(pos_, len));
+    pos_ += len;
+    return true;
+  }
+
+  bool parse_hex(size_t n_digits, uint32_t* value) {
+    if (pos_ + n_digits > pattern_.size()) {
+      return fail("invalid hex escape");
+    }
+    *value = 0;
+    for (size_t i = 0; i < n_digits; ++i) {
+      const char h = pattern_[pos_++];
+      uint32_t digit = 0;
+      if (h >= '0' && h <= '9') {
+        digit = h - '0';
+      } else if (h >= 'a' && h <= 'f') {
+        digit = h - 'a' + 10;
+      } else if (h >= 'A' && h <= 'F') {
+        digit = h - 'A' + 10;
+      } else {
+        return fail("invalid hex escape");
+      }
+      *value = *value * 16 + digit;
+    }
+    return true;
+  }
+
+  // parse an escape into the set of characters it matches
+  bool parse_escape(CharSet* set) {
+    ++pos_;
+    if (at_end()) {
+      return fail("trailing backslash");
+    }
+    const char c = pattern_[pos_++];
+    switch (c) {
+      case 'd':
+      case 'w':
+      case 's':
+      case 'D':
+      case 'W':
+      case 'S':
+        *set = class_escape_set(c);
+        return true;
+      case 'n':
+        set->add_range('\n', '\n');
+        return true;
+      case 't':
+        set->add_range('\t', '\t');
+        return true;
+      case 'r':
+        set->add_range('\r', '\r');
+        return true;
+      case 'f':
+        set->add_range('\f', '\f');
+        return true;
+      case 'v':
+        set->add_range('\v', '\v');
+        return true;
+      case 'x':
+      case 'u': {
+        uint32_t code_point = 0;
+        if (!parse_hex(c == 'x' ? 2 : 4, &code_point)) {
+          return false;
+        }
+        if (code_point >= 0xD800 && code_point <= 0xDFFF) {
+          return fail("unsupported surrogate escape");
+        }
+        if (code_point < 0x80) {
+          set->add_range(code_point, code_point);
+        } else {
+          set->non_ascii.push_back(utf8_encode(code_point));
+        }
+        return true;
+      }
+      default:
+        break;
+    }
+    // escaped punctuations match themselves
+    const auto b = static_cast<uint8_t>(c);
+    if (b >= 0x80 || std::isalnum(b)) {
+      --pos_;
+      return fail("unsupported escape");
+    }
+    set->add_range(b, b);
+    return true;
+  }
+
+  std::string_view pattern_;
+  size_t pos_ = 0;
+  std::string error_;
+};
+
+// Thompson construction of the nondeterministic automaton
+class NfaBuilder {
+ public:
+  struct State {
+    std::vector<std::pair<ByteRange, int32_t>> edges;
+    std::vector<int32_t> epsilons;
+  };
+
+  // a sub automaton from start to end
+  struct Fragment {
+    int32_t start = 0;
+    int32_t end = 0;
+  };
+
+  // returns false if the automaton is too large
+  bool build(const Node& node, Fragment* fragment) {
+    if (states_.size() > kMaxNfaStates) {
+      return false;
+    }
+    switch (node.kind) {
+      case Node::Kind::kEmpty:
+        fragment->start = fragment->end = new_state();
+        return true;
+      case Node::Kind::kBytes:
+        fragment->start = new_state();
+        fragment->end = new_state();
+        for (const auto& range : node.ranges) {
+          states_[fragment->start].edges.emplace_back(range, fragment->end);
+        }
+        return true;
+      case Node::Kind::kConcat: {
+        const int32_t start = new_state();
+        int32_t cur = start;
+        for (const auto& child : node.children) {
+          Fragment sub;
+          if (!build(*child, &sub)) {
+            return false;
+          }
+          states_[cur].epsilons.push_back(sub.start);
+          cur = sub.end;
+        }
+        fragment->start = start;
+        fragment->end = cur;
+        return true;
+      }
+      case Node::Kind::kAlt: {
+        fragment->start = new_state();
+        fragment->end = new_state();
+        for (const auto& child : node.children) {
+          Fragment sub;
+          if (!build(*child, &sub)) {
+            return false;
+          }
+          states_[fragment->start].epsilons.push_back(sub.start);
+          states_[sub.end].epsilons.push_back(fragment->end);
+        }
+        return true;
+      }
+      case Node::Kind::kRepeat: {
+        const Node& child = *node.children.front();
+        const int32_t start = new_state();
+        const int32_t end = new_state();
+        int32_t cur = start;
+        for (int i = 0; i < node.min; ++i) {
+          Fragment sub;
+          if (!build(child, &sub)) {
+            return false;
+          }
+          states_[cur].epsilons.push_back(sub.start);
+          cur = sub.end;
+        }
+        if (node.max < 0) {
+          Fragment sub;
+          if (!build(child, &sub)) {
+            return false;
+          }
+          states_[cur].epsilons.push_back(sub.start);
+          states_[sub.end].epsilons.push_back(sub.start);
+          states_[sub.end].epsilons.push_back(end);
+        } else {
+          for (int i = node.min; i < node.max; ++i) {
+            Fragment sub;
+            if (!build(child, &sub)) {
+              return false;
+            }
+            states_[cur].epsilons.push_back(sub.start);
+            states_[cur].epsilons.push_back(end);
+            cur = sub.end;
+          }
+        }
+        states_[cur].epsilons.push_back(end);
+        fragment->start = start;
+        fragment->end = end;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  const std::vector<State>& states() const { return states_; }
+
+ private:
+  int32_t new_state() {
+    states_.emplace_back();
+    return static_cast<int32_t>(states_.size() - 1);
+  }
+
+  std::vector<State> states_;
+};
+
+// expand the set with the states reachable by epsilon edges, sorted
+void epsilon_closure(const std::vector<NfaBuilder::State>& states,
+                     std::vector<int32_t>* set,
+                     std::vector<uint32_t>* marks,
+                     uint32_t mark) {
+  std::vector<int32_t> stack = *set;
+  set->clear();
+  while (!stack.empty()) {
+    const int32_t s = stack.back();
+    stack.pop_back();
+    if ((*marks)[s] == mark) {
+      continue;
+    }
+    (*marks)[s] = mark;
+    set->push_back(s);
+    for (const int32_t t : states[s].epsilons) {
+      if ((*marks)[t] != mark) {
+        stack.push_back(t);
+      }
+    }
+  }
+  std::sort(set->begin(), set->end());
+}
+
+}  // namespace
+
+std::unique_ptr<RegexDFA> RegexDFA::compile(std::string_view pattern,
+                                            std::string* error) {
+  Parser parser(pattern);
+  const auto root = parser.parse(error);
+  if (root == nullptr) {
+    return nullptr;
+  }
+
+  NfaBuilder builder;
+  NfaBuilder::Fragment nfa;
+  if (!builder.build(*root, &nfa)) {
+    if (error != nullptr) {
+      *error = "pattern is too complex";
+    }
+    return nullptr;
+  }
+  const auto& nfa_states = builder.states();
+
+  // subset construction, unpruned states may lead to no accepting state
+  std::vector<uint32_t> marks(nfa_states.size(), 0);
+  uint32_t mark = 0;
+  std::map<std::vector<int32_t>, int32_t> set_to_state;
+  std::vector<std::vector<int32_t>> state_sets;
+  std::vector<int32_t> transitions;
+  std::vector<bool> accepting;
+
+  std::vector<int32_t> start_set = {nfa.start};
+  epsilon_closure(nfa_states, &start_set, &marks, ++mark);
+  set_to_state.emplace(start_set, 0);
+  state_sets.push_back(std::move(start_set));
+  for (size_t d = 0; d < state_sets.size(); ++d) {
+    if (state_sets.size() > kMaxUnprunedStates) {
+      if (error != nullptr) {
+        *error = "pattern is too complex";
+      }
+      return nullptr;
+    }
+    const auto set = state_sets[d];
+    accepting.push_back(std::binary_search(set.begin(), set.end(), nfa.end));
+
+    // split the bytes into intervals with the same targets
+    std::vector<int> bounds = {0, 256};
+    for (const int32_t s : set) {
+      for (const auto& [range, target] : nfa_states[s].edges) {
+        bounds.push_back(range.lo);
+        bounds.push_back(range.hi + 1);
+      }
+    }
+    std::sort(bounds.begin(), bounds.end());
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+    transitions.resize((d + 1) * 256, kDeadState);
+    for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+      const int lo = bounds[i];
+      std::vector<int32_t> targets;
+      for (const int32_t s : set) {
+        for (const auto& [range, target] : nfa_states[s].edges) {
+          if (range.lo <= lo && lo <= range.hi) {
+            targets.push_back(target);
+          }
+        }
+      }
+      if (targets.empty()) {
+        continue;
+      }
+      epsilon_closure(nfa_states, &targets, &marks, ++mark);
+      auto [it, inserted] = set_to_state.emplace(
+          targets, static_cast<int32_t>(state_sets.size()));
+      if (inserted) {
+        state_sets.push_back(std::move(targets));
+      }
+      for (int b = lo; b < bounds[i + 1]; ++b) {
+        transitions[d * 256 + b] = it->second;
+      }
+    }
+  }
+
+  // find the states that can reach an accepting state
+  const size_t n_states = state_sets.size();
+  std::vector<std::vector<int32_t>> sources(n_states);
+  for (int32_t s = 0; s < static_cast<int32_t>(n_states); ++s) {
+    for (size_t b = 0; b < 256; ++b) {
+      const int32_t t = transitions[s * 256 + b];
+      if (t != kDeadState && (sources[t].empty() || sources[t].back() != s)) {
+        sources[t].push_back(s);
+      }
+    }
+  }
+  std::vector<bool> live(n_states, false);
+  std::vector<int32_t> stack;
+  for (size_t s = 0; s < n_states; ++s) {
+    if (accepting[s]) {
+      live[s] = true;
+      stack.push_back(static_cast<int32_t>(s));
+    }
+  }
+  while (!stack.empty()) {
+    const int32_t t = stack.back();
+    stack.pop_back();
+    for (const int32_t s : sources[t]) {
+      if (!live[s]) {
+        live[s] = true;
+        stack.push_back(s);
+      }
+    }
+  }
+  if (!live[0]) {
+    if (error != nullptr) {
+      *error = "pattern matches no text";
+    }
+    return nullptr;
+  }
+
+  // merge the equivalent states by partition refinement, the blocks are split
+  // until all states of a block go to the same blocks on every byte.
+  std::vector<int32_t> blocks(n_states, kDeadState);
+  for (size_t s = 0; s < n_states; ++s) {
+    if (live[s]) {
+      blocks[s] = accepting[s] ? 1 : 0;
+    }
+  }
+  size_t n_blocks = 0;
+  std::vector<int32_t> signature(257);
+  while (true) {
+    std::map<std::vector<int32_t>, int32_t> signatures;
+    std::vector<int32_t> new_blocks(n_states, kDeadState);
+    for (size_t s = 0; s < n_states; ++s) {
+      if (!live[s]) {
+        continue;
+      }
+      signature[0] = blocks[s];
+      for (size_t b = 0; b < 256; ++b) {
+        const int32_t t = transitions[s * 256 + b];
+        signature[b + 1] = t != kDeadState ? blocks[t] : kDeadState;
+      }
+      const auto it =
+          signatures
+              .emplace(signature, static_cast<int32_t>(signatures.size()))
+              .first;
+      new_blocks[s] = it->second;
+    }
+    blocks.swap(new_blocks);
+    if (signatures.size() == n_blocks) {
+      break;
+    }
+    n_blocks = signatures.size();
+  }
+  if (n_blocks > kMaxStates) {
+    if (error != nullptr) {
+      *error = "pattern is too complex";
+    }
+    return nullptr;
+  }
+
+  // renumber the blocks in the order reached from the start state, with a
+  // state of each block as the representative
+  std::vector<int32_t> new_ids(n_blocks, kDeadState);
+  std::vector<int32_t> order = {0};
+  new_ids[blocks[0]] = 0;
+  for (size_t i = 0; i < order.size(); ++i) {
+    const int32_t s = order[i];
+    for (size_t b = 0; b < 256; ++b) {
+      const int32_t t = transitions[s * 256 + b];
+      if (t != kDeadState && blocks[t] != kDeadState &&
+          new_ids[blocks[t]] == kDeadState) {
+        new_ids[blocks[t]] = static_cast<int32_t>(order.size());
+        order.push_back(t);
+      }
+    }
+  }
+
+  std::unique_ptr<RegexDFA> dfa(new RegexDFA());
+  dfa->transitions_.resize(order.size() * 256, kDeadState);
+  dfa->accepting_.resize(order.size(), false);
+  for (size_t i = 0; i < order.size(); ++i) {
+    const int32_t s = order[i];
+    dfa->accepting_[i] = accepting[s];
+    for (size_t b = 0; b < 256; ++b) {
+      const int32_t t = transitions[s * 256 + b];
+      if (t != kDeadState && blocks[t] != kDeadState) {
+        dfa->transitions_[i * 256 + b] = new_ids[blocks[t]];
+      }
+    }
+  }
+  return dfa;
+}
+
+int32_t RegexDFA::next(int32_t state, std::string_view bytes) const {
+  for (const char c : bytes) {
+    if (state == kDeadState) {
+      break;
+    }
+    state = next(state, static_cast<uint8_t>(c));
+  }
+  return state;
+}
+
+bool RegexDFA::matches(std::string_view text) const {
+  const int32_t state = next(start_state(), text);
+  return state != kDeadState && is_accepting(state);
+}
+
+}  // namespace llm
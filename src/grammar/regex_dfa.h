@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace llm {
+
+// A deterministic finite automaton over the bytes of utf-8 text compiled from
+// a regular expression, used to constrain the generated text to the pattern.
+// The whole text has to match the pattern, as if it was anchored with ^ and $.
+//
+// Supported syntax: literals, escapes, character classes with ranges and
+// negation, '.', \d \w \s and their negations, groups (capturing or not),
+// alternation, and the quantifiers * + ? {n} {n,} {n,m}. Lazy quantifiers
+// match the same texts as greedy ones. '.' and negated classes match any
+// utf-8 character except the excluded ascii ones. Backreferences and
+// lookarounds are not supported.
+//
+// States that can't reach an accepting state are pruned, so next() returns
+// kDeadState as soon as the text can't be completed to a match, and the
+// equivalent states are merged to keep the automaton minimal.
+class RegexDFA final {
+ public:
+  static constexpr int32_t kDeadState = -1;
+
+  // max number of states of the compiled automaton
+  static constexpr size_t kMaxStates = 4096;
+
+  // compile the pattern, returns nullptr and sets error if the pattern is
+  // invalid, not supported or too complex.
+  static std::unique_ptr<RegexDFA> compile(std::string_view pattern,
+                                           std::string* error);
+
+  int32_t start_state() const { return 0; }
+
+  size_t num_states() const { return accepting_.size(); }
+
+  int32_t next(int32_t state, uint8_t byte) const {
+    return transitions_[static_cast<size_t>(state) * 256 + byte];
+  }
+
+  // returns kDeadState if the bytes can't be completed to a match
+  int32_t next(int32_t state, std::string_view bytes) const;
+
+  bool is_accepting(int32_t state) const { return accepting_[state]; }
+
+  // whether the whole text matches the pattern
+  bool matches(std::string_view text) const;
+
+ private:
+  RegexDFA() = default;
+
+  // [num_states, 256] next state of each state and byte
+  std::vector<int32_t> transitions_;
+
+  // whether each state accepts the text read so far
+  std::vector<bool> accepting_;
+};
+
+}  // namespace llm
@@ -0,0 +1,128 @@
+#include "regex_dfa.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace llm {
+
+namespace {
+std::unique_ptr<RegexDFA> compile(const std::string& pattern) {
+  std::string error;
+  auto dfa = RegexDFA::compile(pattern, &error);
+  EXPECT_NE(dfa, nullptr) << pattern << ": " << error;
+  return dfa;
+}
+}  // namespace
+
+TEST(RegexDFATest, Literals) {
+  auto dfa = compile("abc");
+  EXPECT_TRUE(dfa->matches("abc"));
+  EXPECT_FALSE(dfa->matches("ab"));
+  EXPECT_FALSE(dfa->matches("abcd"));
+  EXPECT_FALSE(dfa->matches(""));
+
+  // escaped special characters
+  dfa = compile(R"(\{\"a\.b\"\})");
+  EXPECT_TRUE(dfa->matches(R"({"a.b"})"));
+  EXPECT_FALSE(dfa->matches(R"({"axb"})"));
+
+  // non-ascii literals
+  dfa = compile("café|日本");
+  EXPECT_TRUE(dfa->matches("café"));
+  EXPECT_TRUE(dfa->matches("日本"));
+  EXPECT_FALSE(dfa->matches("cafe"));
+}
+
+TEST(RegexDFATest, Quantifiers) {
+  auto dfa = compile("ab*c+d?");
+  EXPECT_TRUE(dfa->matches("ac"));
+  EXPECT_TRUE(dfa->matches("abbbccd"));
+  EXPECT_FALSE(dfa->matches("abd"));
+  EXPECT_FALSE(dfa->matches("acdd"));
+
+  dfa = compile("(ab){2,3}x{2}y{1,}");
+  EXPECT_TRUE(dfa->matches("ababxxy"));
+  EXPECT_TRUE(dfa->matches("abababxxyyy"));
+  EXPECT_FALSE(dfa->matches("abxxy"));
+  EXPECT_FALSE(dfa->matches("abababababxxy"));
+  EXPECT_FALSE(dfa->matches("ababxy"));
+
+  // lazy quantifiers match the same texts
+  dfa = compile("a+?b*?");
+  EXPECT_TRUE(dfa->matches("aab"));
+  EXPECT_FALSE(dfa->matches("b"));
+}
+
+TEST(RegexDFATest, Classes) {
+  auto dfa = compile(R"([a-c_\d]+)");
+  EXPECT_TRUE(dfa->matches("ab_09c"));
+  EXPECT_FALSE(dfa->matches("abd"));
+
+  dfa = compile(R"(\w+\s\W)");
+  EXPECT_TRUE(dfa->matches("a_1 !"));
+  EXPECT_TRUE(dfa->matches("x\té"));
+  EXPECT_FALSE(dfa->matches("x y"));
+
+  // negated classes match any utf-8 character except the listed ones
+  dfa = compile(R"("[^"\\\x00-\x1F]*")");
+  EXPECT_TRUE(dfa->matches(R"("hello wörld 日本")"));
+  EXPECT_FALSE(dfa->matches(R"("a"b")"));
+  EXPECT_FALSE(dfa->matches("\"a\nb\""));
+  // invalid utf-8
+  EXPECT_FALSE(dfa->matches("\"\xff\""));
+
+  dfa = compile("[]a-]");
+  EXPECT_TRUE(dfa->matches("]"));
+  EXPECT_TRUE(dfa->matches("-"));
+  EXPECT_FALSE(dfa->matches("b"));
+
+  dfa = compile("a.c");
+  EXPECT_TRUE(dfa->matches("abc"));
+  EXPECT_TRUE(dfa->matches("a€c"));
+  EXPECT_FALSE(dfa->matches("a\nc"));
+}
+
+TEST(RegexDFATest, Alternation) {
+  auto dfa = compile("^(?:true|false|null)$");
+  EXPECT_TRUE(dfa->matches("true"));
+  EXPECT_TRUE(dfa->matches("null"));
+  EXPECT_FALSE(dfa->matches("nul"));
+  EXPECT_FALSE(dfa->matches("truefalse"));
+
+  dfa = compile("a(|b)c");
+  EXPECT_TRUE(dfa->matches("ac"));
+  EXPECT_TRUE(dfa->matches("abc"));
+}
+
+TEST(RegexDFATest, DeadStates) {
+  auto dfa = compile("ab|ac");
+  int32_t state = dfa->next(dfa->start_state(), "a");
+  ASSERT_NE(state, RegexDFA::kDeadState);
+  EXPECT_FALSE(dfa->is_accepting(state));
+  // no text after "b" can be completed to a match
+  EXPECT_EQ(dfa->next(state, "d"), RegexDFA::kDeadState);
+  EXPECT_EQ(dfa->next(state, "bc"), RegexDFA::kDeadState);
+  state = dfa->next(state, "b");
+  ASSERT_NE(state, RegexDFA::kDeadState);
+  EXPECT_TRUE(dfa->is_accepting(state));
+  for (int b = 0; b < 256; ++b) {
+    EXPECT_EQ(dfa->next(state, static_cast<uint8_t>(b)),
+              RegexDFA::kDeadState);
+  }
+}
+
+TEST(RegexDFATest, Errors) {
+  for (const std::string pattern :
+       {"(ab", "ab)", "[ab", "*a", "a{2,1}", "a{1001}", R"(\1)", "(?=a)"}) {
+    std::string error;
+    EXPECT_EQ(RegexDFA::compile(pattern, &error), nullptr) << pattern;
+    EXPECT_FALSE(error.empty()) << pattern;
+  }
+  // too many states
+  std::string error;
+  EXPECT_EQ(RegexDFA::compile("[ab]*a[ab]{20}", &error), nullptr);
+  EXPECT_EQ(error, "pattern is too complex");
+}
+
+}  // namespace llm
@@ -0,0 +1,143 @@
+#include "token_grammar.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llm {
+
+TokenVocab::TokenVocab(std::vector<std::string> token_bytes, size_t vocab_size)
+    : token_bytes_(std::move(token_bytes)), vocab_size_(vocab_size) {
+  CHECK_GE(vocab_size_, token_bytes_.size())
+      << "vocab size should cover all tokens";
+
+  // sort the tokens by bytes to build the trie in preorder
+  std::vector<int32_t> order;
+  for (size_t i = 0; i < token_bytes_.size(); ++i) {
+    if (!token_bytes_[i].empty()) {
+      order.push_back(static_cast<int32_t>(i));
+    }
+  }
+  std::sort(order.begin(), order.end(), [this](int32_t a, int32_t b) {
+    return token_bytes_[a] < token_bytes_[b];
+  });
+
+  // the nodes of the prefixes of the previous token
+  std::vector<int32_t> path;
+  const std::string* prev = nullptr;
+  node_tokens_.reserve(order.size());
+  for (const int32_t token_id : order) {
+    const std::string& bytes = token_bytes_[token_id];
+    size_t common = 0;
+    if (prev != nullptr) {
+      const size_t n = std::min(prev->size(), bytes.size());
+      while (common < n && (*prev)[common] == bytes[common]) {
+        ++common;
+      }
+    }
+    // close the subtrees of the prefixes not shared with the token
+    while (path.size() > common) {
+      nodes_[path.back()].end = static_cast<int32_t>(nodes_.size());
+      path.pop_back();
+    }
+    for (size_t i = common; i < bytes.size(); ++i) {
+      TrieNode node;
+      node.byte = static_cast<uint8_t>(bytes[i]);
+      node.depth = static_cast<uint32_t>(i + 1);
+      node.tokens_begin = node.tokens_end =
+          static_cast<int32_t>(node_tokens_.size());
+      path.push_back(static_cast<int32_t>(nodes_.size()));
+      nodes_.push_back(node);
+    }
+    // tokens are sorted, so the tokens of a node are consecutive
+    auto& node = nodes_[path.back()];
+    node_tokens_.push_back(token_id);
+    node.tokens_end = static_cast<int32_t>(node_tokens_.size());
+    max_depth_ = std::max(max_depth_, node.depth);
+    prev = &bytes;
+  }
+  while (!path.empty()) {
+    nodes_[path.back()].end = static_cast<int32_t>(nodes_.size());
+    path.pop_back();
+  }
+}
+
+std::shared_ptr<const TokenVocab> TokenVocab::create(
+    const Tokenizer& tokenizer,
+    size_t vocab_size) {
+  const size_t n_tokens = std::min(tokenizer.vocab_size(), vocab_size);
+  std::vector<std::string> token_bytes(n_tokens);
+  for (size_t i = 0; i < n_tokens; ++i) {
+    // tokens are decoded in the middle of the generated text
+    TokenStreamState state;
+    state.at_text_start = false;
+    if (!tokenizer.decode_token(static_cast<int32_t>(i),
+                                /*skip_special_tokens=*/true,
+                                &state,
+                                &token_bytes[i])) {
+      return nullptr;
+    }
+  }
+  return std::make_shared<const TokenVocab>(std::move(token_bytes),
+                                            vocab_size);
+}
+
+const std::string& TokenVocab::token_bytes(int32_t token_id) const {
+  static const std::string kEmpty;
+  if (token_id < 0 || static_cast<size_t>(token_id) >= token_bytes_.size()) {
+    return kEmpty;
+  }
+  return token_bytes_[token_id];
+}
+
+TokenGrammar::TokenGrammar(std::unique_ptr<RegexDFA> dfa,
+                           std::shared_ptr<const TokenVocab> vocab)
+    : dfa_(std::move(dfa)),
+      vocab_(std::move(vocab)),
+      num_words_(vocab_->num_words()) {
+  CHECK(dfa_ != nullptr);
+  const size_t n_states = dfa_->num_states();
+  bitmasks_.resize(n_states * num_words_, 0);
+
+  // walk the trie from each state, skipping the subtrees of dead prefixes
+  const auto& nodes = vocab_->nodes_;
+  const auto& node_tokens = vocab_->node_tokens_;
+  std::vector<int32_t> states(vocab_->max_depth_ + 1);
+  for (size_t s = 0; s < n_states; ++s) {
+    auto* mask =
+        reinterpret_cast<uint32_t*>(bitmasks_.data() + s * num_words_);
+    states[0] = static_cast<int32_t>(s);
+    for (size_t i = 0; i < nodes.size();) {
+      const auto& node = nodes[i];
+      const int32_t next = dfa_->next(states[node.depth - 1], node.byte);
+      if (next == kDeadState) {
+        i = node.end;
+        continue;
+      }
+      states[node.depth] = next;
+      for (int32_t k = node.tokens_begin; k < node.tokens_end; ++k) {
+        const int32_t token_id = node_tokens[k];
+        mask[token_id / 32] |= uint32_t(1) << (token_id % 32);
+      }
+      ++i;
+    }
+  }
+}
+
+int32_t TokenGrammar::next_state(int32_t state, int32_t token_id) const {
+  if (state == kDeadState) {
+    return kDeadState;
+  }
+  const std::string& bytes = vocab_->token_bytes(token_id);
+  if (bytes.empty()) {
+    return kDeadState;
+  }
+  return dfa_->next(state, bytes);
+}
+
+}  // namespace llm
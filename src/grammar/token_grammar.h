@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "regex_dfa.h"
+#include "tokenizer/tokenizer.h"
+
+namespace llm {
+
+// The bytes each token of a vocabulary appends to the generated text, kept
+// in a trie to find the tokens allowed in the states of a RegexDFA. Shared by
+// the grammars compiled for a tokenizer.
+class TokenVocab final {
+ public:
+  // token_bytes: the bytes of each token, empty for the tokens never allowed
+  // by a grammar, e.g. special tokens.
+  // vocab_size: the number of logits of the model, tokens beyond token_bytes
+  // are never allowed.
+  TokenVocab(std::vector<std::string> token_bytes, size_t vocab_size);
+
+  // returns nullptr if the tokenizer can't decode tokens one at a time
+  static std::shared_ptr<const TokenVocab> create(const Tokenizer& tokenizer,
+                                                  size_t vocab_size);
+
+  size_t vocab_size() const { return vocab_size_; }
+
+  // the number of 32-bit words of the token bitmasks
+  size_t num_words() const { return (vocab_size_ + 31) / 32; }
+
+  // empty if the token is never allowed
+  const std::string& token_bytes(int32_t token_id) const;
+
+ private:
+  friend class TokenGrammar;
+
+  struct TrieNode {
+    // the last byte of the prefix of the node
+    uint8_t byte = 0;
+    // the length of the prefix, 1 for the children of the root
+    uint32_t depth = 0;
+    // the index after the last node of the subtree in preorder
+    int32_t end = 0;
+    // the tokens with the prefix as bytes: [tokens_begin, tokens_end) of
+    // node_tokens_
+    int32_t tokens_begin = 0;
+    int32_t tokens_end = 0;
+  };
+
+  std::vector<std::string> token_bytes_;
+
+  size_t vocab_size_ = 0;
+
+  // the nodes of the trie in preorder, without the root
+  std::vector<TrieNode> nodes_;
+
+  // the token ids of the nodes
+  std::vector<int32_t> node_tokens_;
+
+  // the max depth of the nodes
+  uint32_t max_depth_ = 0;
+};
+
+// A grammar over the tokens of a vocabulary, compiled from a RegexDFA. The
+// bitmask of the tokens allowed in each state is precomputed, so the masks of
+// a batch are gathered with a copy per sequence at each step. A token is
+// allowed if its bytes lead to a state that can still reach a match. The end
+// of the text, e.g. the eos token, is only allowed in the accepting states,
+// and is not part of the bitmasks.
+class TokenGrammar final {
+ public:
+  static constexpr int32_t kDeadState = RegexDFA::kDeadState;
+
+  TokenGrammar(std::unique_ptr<RegexDFA> dfa,
+               std::shared_ptr<const TokenVocab> vocab);
+
+  int32_t start_state() const { return dfa_->start_state(); }
+
+  // returns kDeadState if the token is not allowed in the state
+  int32_t next_state(int32_t state, int32_t token_id) const;
+
+  bool is_accepting(int32_t state) const { return dfa_->is_accepting(state); }
+
+  size_t num_states() const { return dfa_->num_states(); }
+
+  size_t num_words() const { return num_words_; }
+
+  // [num_words] bit j of word i is set if token i * 32 + j is allowed
+  const int32_t* bitmask(int32_t state) const {
+    return bitmasks_.data() + static_cast<size_t>(state) * num_words_;
+  }
+
+ private:
+  std::unique_ptr<RegexDFA> dfa_;
+
+  std::shared_ptr<const TokenVocab> vocab_;
+
+  size_t num_words_ = 0;
+
+  // [num_states, num_words] the allowed tokens of each state
+  std::vector<int32_t> bitmasks_;
+};
+
+}  // namespace llm
@@ -0,0 +1,89 @@
+#include "token_grammar.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include "grammar_cache.h"
+
+namespace llm {
+
+namespace {
+bool is_allowed(const TokenGrammar& grammar, int32_t state, int32_t token_id) {
+  const auto* mask = reinterpret_cast<const uint32_t*>(grammar.bitmask(state));
+  return (mask[token_id / 32] >> (token_id % 32)) & 1;
+}
+
+// the allowed tokens in the state
+std::vector<int32_t> allowed_tokens(const TokenGrammar& grammar,
+                                    int32_t state,
+                                    size_t vocab_size) {
+  std::vector<int32_t> tokens;
+  for (size_t i = 0; i < vocab_size; ++i) {
+    if (is_allowed(grammar, state, static_cast<int32_t>(i))) {
+      tokens.push_back(static_cast<int32_t>(i));
+    }
+  }
+  return tokens;
+}
+}  // namespace
+
+TEST(TokenGrammarTest, Bitmask) {
+  // the special token 1 has no bytes, tokens 8..39 are padding of the logits
+  std::vector<std::string> token_bytes = {
+      "a", "", "b", "ab", "abc", "c", "ba", "a"};
+  auto vocab =
+      std::make_shared<const TokenVocab>(token_bytes, /*vocab_size=*/40);
+  EXPECT_EQ(vocab->num_words(), 2);
+
+  std::string error;
+  auto dfa = RegexDFA::compile("ab*c", &error);
+  ASSERT_NE(dfa, nullptr) << error;
+  TokenGrammar grammar(std::move(dfa), vocab);
+  EXPECT_EQ(grammar.num_words(), 2);
+
+  int32_t state = grammar.start_state();
+  EXPECT_EQ(allowed_tokens(grammar, state, 40),
+            (std::vector<int32_t>{0, 3, 4, 7}));
+  EXPECT_FALSE(grammar.is_accepting(state));
+  EXPECT_EQ(grammar.next_state(state, 1), TokenGrammar::kDeadState);
+  EXPECT_EQ(grammar.next_state(state, 2), TokenGrammar::kDeadState);
+
+  state = grammar.next_state(state, 3);
+  ASSERT_NE(state, TokenGrammar::kDeadState);
+  EXPECT_EQ(allowed_tokens(grammar, state, 40),
+            (std::vector<int32_t>{2, 5}));
+
+  state = grammar.next_state(state, 5);
+  ASSERT_NE(state, TokenGrammar::kDeadState);
+  EXPECT_TRUE(grammar.is_accepting(state));
+  // only the end of the text is allowed
+  EXPECT_TRUE(allowed_tokens(grammar, state, 40).empty());
+}
+
+TEST(TokenGrammarTest, Cache) {
+  std::vector<std::string> token_bytes = {"0", "1", "2", "x"};
+  auto vocab = std::make_shared<const TokenVocab>(token_bytes, 4);
+  GrammarCache cache(vocab, /*max_grammars=*/2);
+
+  std::string error;
+  auto digits = cache.get("[0-9]+", &error);
+  ASSERT_NE(digits, nullptr);
+  EXPECT_EQ(cache.get("[0-9]+", &error), digits);
+  auto x = cache.get("x", &error);
+  ASSERT_NE(x, nullptr);
+  EXPECT_EQ(cache.size(), 2);
+
+  // evicts the least recently used grammar
+  EXPECT_EQ(cache.get("[0-9]+", &error), digits);
+  ASSERT_NE(cache.get("0|1", &error), nullptr);
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_EQ(cache.get("[0-9]+", &error), digits);
+  EXPECT_NE(cache.get("x", &error), x);
+
+  EXPECT_EQ(cache.get("(x", &error), nullptr);
+  EXPECT_FALSE(error.empty());
+}
+
+}  // namespace llm
@@ -5,7 +5,11 @@
 #include <grpcpp/grpcpp.h>
 
 #include <atomic>
+#include <cstddef>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 
@@ -21,29 +25,79 @@ class CallData {
   virtual bool proceed(bool rpc_ok) = 0;
 };
 
-// Class encompasing the state and logic needed to serve a server streaming
-// request.
+// Interface for replying to a server streaming request, implemented for each
+// transport: grpc and http.
 template <typename Request, typename Response>
-class StreamCallData : public CallData {
+class StreamWriter {
  public:
-  enum class Status { CREATE, WRITE, PENDING, FINISH };
+  virtual ~StreamWriter() = default;
 
-  // pack the response with state
-  struct ResponseWithState {
-    ResponseWithState(Response _response) : response(std::move(_response)) {}
+  virtual const Request& request() const = 0;
 
-    ResponseWithState(grpc::Status _grpc_status)
-        : grpc_status(std::move(_grpc_status)) {}
+  // call following methods to reply to client
+  // returns true if the response has been accepted and will be delivered
+  // asynchronously.
+  // returns false if the channel has been closed/cancelled.
+  virtual bool write(Response response) = 0;
 
-    ResponseWithState(Response _response, grpc::Status _grpc_status)
-        : response(std::move(_response)),
-          grpc_status(std::move(_grpc_status)) {}
+  virtual bool write_and_finish(
+      Response response,
+      grpc::Status grpc_status = grpc::Status::OK) = 0;
 
-    // response to be sent to client
-    std::optional<Response> response;
-    // grpc status to be sent to client
-    std::optional<grpc::Status> grpc_status;
-  };
+  // returns false if the channel has been closed/cancelled.
+  virtual bool finish(grpc::Status grpc_status = grpc::Status::OK) = 0;
+
+  // returns true if the client is not draining the responses, the request
+  // should be paused until the responses are drained.
+  virtual bool is_backlogged() const { return false; }
+
+  // returns true if the client has gone away, e.g. disconnected or timed out,
+  // the request should be dropped. it is polled by the scheduler thread and
+  // must not block.
+  virtual bool is_cancelled() const { return false; }
+
+  // returns false if the channel has been closed/cancelled.
+  bool finish_with_error(const grpc::StatusCode& code,
+                         const std::string& error_message) {
+    return finish(grpc::Status(code, error_message));
+  }
+};
+
+// Options for the flow control of grpc streaming responses.
+struct StreamOptions {
+  // max number of pending responses merged into one message, 1 to write each
+  // response as is.
+  size_t max_write_batch_size = 8;
+
+  // the call is backlogged once as many messages are pending to be written.
+  size_t max_pending_responses = 64;
+};
+
+// Merges a streamed response into the previous one pending to be written, so
+// that they are sent to the client in one message. Specialized for the
+// responses that can be merged.
+template <typename Response>
+struct ResponseMerger {
+  // returns false if the responses can't be merged
+  static bool merge(Response* /*dst*/, const Response& /*src*/) {
+    return false;
+  }
+};
+
+// Class encompasing the state and logic needed to serve a server streaming
+// request. Responses are queued without blocking the caller and written by the
+// grpc handler thread one at a time, as grpc allows only one outstanding write.
+// Responses that pile up while a write is in flight are merged into bounded
+// batches, and the call reports backlogged once too many are pending.
+// grpc notifies the call data once the call is done, which flags the call as
+// cancelled if the client has gone away, so that the request is dropped
+// without waiting for a write to fail. The call data is released after both
+// the call is finished and the done notification is delivered.
+template <typename Request, typename Response>
+class StreamCallData : public CallData,
+                       public StreamWriter<Request, Response> {
+ public:
+  enum class Status { CREATE, WRITE, FINISH };
 
   // callback for registering itself to the service
   using OnRegister =
@@ -57,70 +111,95 @@ class StreamCallData : public CallData {
   using OnRequest = std::function<void(StreamCallData<Request, Response>*)>;
 
   StreamCallData(grpc::ServerCompletionQueue* cq,
+                 const StreamOptions& options,
                  OnRegister on_register,
                  OnRequest on_request)
       : cq_(cq),
+        options_(options),
         responder_(&ctx_),
         on_register_(on_register),
-        on_new_request_(on_request) {
+        on_new_request_(on_request),
+        done_tag_(this) {
+    // get notified once the call is done, e.g. cancelled by the client
+    ctx_.AsyncNotifyWhenDone(&done_tag_);
     // register itself to the service for handling request
     on_register_(&ctx_, &request_, &responder_, cq_, cq_, this);
   }
 
-  const Request& request() const { return request_; }
+  const Request& request() const override { return request_; }
 
   // returns true if the rpc is ok
   bool is_rpc_ok() const { return rpc_ok_.load(std::memory_order_relaxed); }
 
-  // call following methods to reply to client
-  // returns true if the response has been accepted and will be delivered
-  // asynchronously.
-  // returns false if the rpc channel has been closed/cancelled.
-  bool write(Response response) {
-    // pack the response with state
-    auto new_response =
-        std::make_shared<ResponseWithState>(std::move(response));
-    return send_response(new_response);
+  bool write(Response response) override {
+    return send_response(std::move(response), std::nullopt);
   }
 
   bool write_and_finish(Response response,
-                        grpc::Status grpc_status = grpc::Status::OK) {
-    // pack the response with state
-    auto new_response = std::make_shared<ResponseWithState>(
-        std::move(response), std::move(grpc_status));
-    return send_response(new_response);
+                        grpc::Status grpc_status = grpc::Status::OK) override {
+    return send_response(std::move(response), std::move(grpc_status));
   }
 
-  // returns false if the rpc channel has been closed/cancelled.
-  bool finish_with_error(const grpc::StatusCode& code,
-                         const std::string& error_message) {
-    return finish(grpc::Status(code, error_message));
+  bool finish(grpc::Status grpc_status = grpc::Status::OK) override {
+    return send_response(std::nullopt, std::move(grpc_status));
   }
 
-  // returns false if the rpc channel has been closed/cancelled.
-  bool finish(grpc::Status grpc_status = grpc::Status::OK) {
-    // pack status with grpc status
-    auto new_response =
-        std::make_shared<ResponseWithState>(std::move(grpc_status));
-    return send_response(new_response);
+  bool is_backlogged() const override {
+    return num_pending_.load(std::memory_order_relaxed) >=
+           options_.max_pending_responses;
   }
 
-  bool send_response(std::shared_ptr<ResponseWithState> response) {
-    // wait previous response to be processed
-    std::shared_ptr<ResponseWithState> expected = nullptr;
-    while (
-        !std::atomic_compare_exchange_weak(&response_, &expected, response)) {
-      expected = nullptr;
-    }
-
-    // notify the grpc handler thread
-    notify_alarm_.Set(
-        cq_, gpr_time_0(gpr_clock_type::GPR_CLOCK_MONOTONIC), this);
-    return rpc_ok_.load(std::memory_order_relaxed);
+  bool is_cancelled() const override {
+    return cancelled_.load(std::memory_order_relaxed);
   }
 
   // proceed to the next state.
+  // returns false once the call data can be deleted.
   bool proceed(bool rpc_ok) override {
+    if (step(rpc_ok)) {
+      return true;
+    }
+    // the done notification is not delivered for calls that never started
+    if (status_ == Status::CREATE) {
+      return false;
+    }
+    // release the call data if the done notification has been delivered
+    return num_refs_.fetch_sub(1, std::memory_order_acq_rel) > 1;
+  }
+
+ private:
+  // Tag of the done notification of the call.
+  class DoneTag final : public CallData {
+   public:
+    explicit DoneTag(StreamCallData* call_data) : call_data_(call_data) {}
+
+    // always returns true as the tag is owned by the call data
+    bool proceed(bool /*rpc_ok*/) override {
+      StreamCallData* call_data = call_data_;
+      call_data->on_done();
+      if (call_data->num_refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        // the call has been finished
+        // NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
+        delete call_data;
+      }
+      return true;
+    }
+
+   private:
+    StreamCallData* call_data_;
+  };
+
+  // the call is done, flag it as cancelled if the client has gone away,
+  // following responses are dropped.
+  void on_done() {
+    if (ctx_.IsCancelled()) {
+      cancelled_.store(true, std::memory_order_relaxed);
+      rpc_ok_.store(false, std::memory_order_relaxed);
+    }
+  }
+
+  // proceed to the next state, returns false once the call is finished.
+  bool step(bool rpc_ok) {
     // record the rpc status
     if (!rpc_ok) {
       rpc_ok_.store(false, std::memory_order_relaxed);
@@ -131,7 +210,7 @@ class StreamCallData : public CallData {
     // it is notification from cq for new request
     if (status_ == Status::CREATE) {
       // Spawn a new CallData instance to serve new clients
-      new StreamCallData(cq_, on_register_, on_new_request_);
+      new StreamCallData(cq_, options_, on_register_, on_new_request_);
 
       // rpc error before acctually processing the request, release the calldata
       if (!rpc_ok) {
@@ -143,44 +222,44 @@ class StreamCallData : public CallData {
       // The actual processing.
       on_new_request_(this);
     } else if (status_ == Status::WRITE) {
-      if (auto rs = std::atomic_load(&response_)) {
-        // send the response to client
-        // WriteAndFinish
-        if (rs->response.has_value() && rs->grpc_status.has_value()) {
-          if (rpc_ok) {
-            // change the status to pending to wait for write op to finish
-            status_ = Status::FINISH;
-            responder_.WriteAndFinish(
-                rs->response.value(), {}, rs->grpc_status.value(), this);
-          } else {
-            // the request has been finished, release the calldata
-            return false;
-          }
-        } else if (rs->response.has_value()) {
-          // if rpc is ok, send the response to client, otherwise, wait for
-          // finish alarm
-          if (rpc_ok) {
-            // change the status to pending to wait for write op to finish
-            status_ = Status::PENDING;
-            responder_.Write(rs->response.value(), this);
-          } else {
-            std::atomic_store(&response_, {});
-          }
-        } else {
-          if (rpc_ok) {
-            // the rpc is ok, send the finish status to client
-            status_ = Status::FINISH;
-            responder_.Finish(rs->grpc_status.value(), this);
-          } else {
-            // the request has been finished, release the calldata
-            return false;
-          }
+      // notified by the alarm, or the previous write op has been finished
+      std::optional<Response> response;
+      std::optional<grpc::Status> grpc_status;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!rpc_ok) {
+          // drop the responses that can't be delivered
+          pending_.clear();
+        }
+        if (!pending_.empty()) {
+          response = std::move(pending_.front().response);
+          pending_.pop_front();
+        }
+        if (pending_.empty()) {
+          grpc_status = finish_status_;
+        }
+        num_pending_.store(pending_.size(), std::memory_order_relaxed);
+        if (!response.has_value() && !grpc_status.has_value()) {
+          // wait for the next response
+          idle_ = true;
+          return true;
         }
       }
-    } else if (status_ == Status::PENDING) {
-      // the write op has been finished, proceed to the next write op
-      status_ = Status::WRITE;
-      std::atomic_store(&response_, {});
+
+      if (!rpc_ok) {
+        // the request has been finished, release the calldata
+        return false;
+      }
+      if (response.has_value() && grpc_status.has_value()) {
+        status_ = Status::FINISH;
+        responder_.WriteAndFinish(
+            response.value(), {}, grpc_status.value(), this);
+      } else if (response.has_value()) {
+        responder_.Write(response.value(), this);
+      } else {
+        status_ = Status::FINISH;
+        responder_.Finish(grpc_status.value(), this);
+      }
     } else if (status_ == Status::FINISH) {
       // Once in the FINISH state, deallocate CallData.
       return false;
@@ -188,13 +267,52 @@ class StreamCallData : public CallData {
     return true;
   }
 
- private:
+  // queue the response and the finish status, and notify the grpc handler
+  // thread if it is idle.
+  bool send_response(std::optional<Response> response,
+                     std::optional<grpc::Status> grpc_status) {
+    const bool rpc_ok = rpc_ok_.load(std::memory_order_relaxed);
+    bool notify = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (finish_status_.has_value()) {
+        // the call has been finished
+        return false;
+      }
+      if (response.has_value() && rpc_ok) {
+        // merge into the last pending response if the batch is not full
+        if (pending_.empty() ||
+            pending_.back().num_merged >= options_.max_write_batch_size ||
+            !ResponseMerger<Response>::merge(&pending_.back().response,
+                                             response.value())) {
+          pending_.push_back({std::move(response.value()), 0});
+        }
+        ++pending_.back().num_merged;
+        num_pending_.store(pending_.size(), std::memory_order_relaxed);
+      }
+      if (grpc_status.has_value()) {
+        finish_status_ = std::move(grpc_status);
+      }
+      notify = idle_;
+      idle_ = false;
+    }
+
+    if (notify) {
+      // notify the grpc handler thread
+      notify_alarm_.Set(
+          cq_, gpr_time_0(gpr_clock_type::GPR_CLOCK_MONOTONIC), this);
+    }
+    return rpc_ok;
+  }
+
   Status status_ = Status::CREATE;
 
   // completion queue: the producer-consumer queue where for asynchronous server
   // notifications.
   grpc::ServerCompletionQueue* cq_;
 
+  StreamOptions options_;
+
   // context for the request.
   grpc::ServerContext ctx_;
 
@@ -216,8 +334,36 @@ class StreamCallData : public CallData {
   // callback for new request
   OnRequest on_new_request_;
 
-  // next response to be sent to client
-  std::shared_ptr<ResponseWithState> response_;
+  struct PendingResponse {
+    Response response;
+    // number of responses merged into the response
+    size_t num_merged = 0;
+  };
+
+  std::mutex mutex_;
+
+  // responses to be sent to client
+  std::deque<PendingResponse> pending_;
+
+  // status to be sent to client after the pending responses
+  std::optional<grpc::Status> finish_status_;
+
+  // whether the grpc handler thread is waiting for responses, i.e. neither
+  // the alarm nor a write op is outstanding
+  bool idle_ = true;
+
+  // number of pending responses, read without the lock
+  std::atomic<size_t> num_pending_{0};
+
+  // whether the client has gone away, read without the lock
+  std::atomic<bool> cancelled_{false};
+
+  // tag of the done notification
+  DoneTag done_tag_;
+
+  // the call data is deleted once both the call is finished and the done
+  // notification is delivered
+  std::atomic<int> num_refs_{2};
 };
 
 }  // namespace llm
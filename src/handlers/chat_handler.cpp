@@ -9,6 +9,7 @@
 
 #include <boost/algorithm/string.hpp>
 #include <cstdint>
+#include <map>
 #include <string>
 #include <unordered_set>
 
@@ -55,6 +56,7 @@ bool send_delta_to_client(ChatCallData* call_data,
                           const std::string& request_id,
                           int64_t created_time,
                           const std::string& model,
+                          const std::string& session_id,
                           const RequestOutput& output) {
   // send delta to client
   for (const auto& seq_output : output.outputs) {
@@ -72,6 +74,9 @@ bool send_delta_to_client(ChatCallData* call_data,
       auto* message = choice->mutable_delta();
       message->set_role("assistant");
       message->set_content("");
+      if (!session_id.empty()) {
+        response.set_session_id(session_id);
+      }
       // update first_message_sent
       first_message_sent->insert(index);
       if (!call_data->write(std::move(response))) {
@@ -143,12 +148,16 @@ bool send_result_to_client(ChatCallData* call_data,
                            const std::string& request_id,
                            int64_t created_time,
                            const std::string& model,
+                           const std::string& session_id,
                            const RequestOutput& req_output) {
   proto::ChatResponse response;
   response.set_object("chat.completion");
   response.set_id(request_id);
   response.set_created(created_time);
   response.set_model(model);
+  if (!session_id.empty()) {
+    response.set_session_id(session_id);
+  }
 
   for (const auto& output : req_output.outputs) {
     // add choices into response
@@ -186,6 +195,9 @@ SamplingParams grpc_request_to_sampling_params(
   if (request.has_n()) {
     sampling_params.n = request.n();
   }
+  if (request.has_beam_width()) {
+    sampling_params.beam_width = request.beam_width();
+  }
   if (request.has_frequency_penalty()) {
     sampling_params.frequency_penalty = request.frequency_penalty();
   }
@@ -224,23 +236,100 @@ SamplingParams grpc_request_to_sampling_params(
     sampling_params.stop_token_ids = std::vector<int32_t>(
         request.stop_token_ids().begin(), request.stop_token_ids().end());
   }
+  if (request.logit_bias_size() > 0) {
+    sampling_params.logit_bias = std::map<int32_t, float>(
+        request.logit_bias().begin(), request.logit_bias().end());
+  }
+  if (request.allowed_token_ids_size() > 0) {
+    sampling_params.allowed_token_ids = std::vector<int32_t>(
+        request.allowed_token_ids().begin(), request.allowed_token_ids().end());
+  }
+  if (request.has_seed()) {
+    sampling_params.seed = request.seed();
+  }
+  if (request.has_lora_adapter()) {
+    sampling_params.lora_adapter = request.lora_adapter();
+  }
+  if (request.has_truncate_prompt_keep_first()) {
+    sampling_params.truncate_prompt_keep_first =
+        request.truncate_prompt_keep_first();
+  }
+  sampling_params.tenant = request.user();
+  if (request.has_response_format()) {
+    const auto& format = request.response_format();
+    if (format.type() == "json_schema" && format.has_json_schema()) {
+      sampling_params.json_schema = format.json_schema();
+    } else if (format.type() == "json_object" ||
+               format.type() == "json_schema") {
+      sampling_params.json_object = true;
+    }
+  }
+  if (request.has_regex()) {
+    sampling_params.regex = request.regex();
+  }
   return sampling_params;
 }
 
+proto::ChatChoice* find_choice(proto::ChatResponse* response, uint32_t index) {
+  for (auto& choice : *response->mutable_choices()) {
+    if (choice.index() == index) {
+      return &choice;
+    }
+  }
+  return nullptr;
+}
+
 }  // namespace
 
-ChatHandler::ChatHandler(LLMHandler* llm_handler,
-                         const std::vector<std::string>& models)
-    : llm_handler_(llm_handler), models_(models.begin(), models.end()) {
-  CHECK(llm_handler != nullptr);
-  CHECK(!models_.empty());
+bool ResponseMerger<proto::ChatResponse>::merge(
+    proto::ChatResponse* dst,
+    const proto::ChatResponse& src) {
+  // usage statistics are sent in a separate chunk without choices
+  if (dst->has_usage() || src.has_usage() || dst->id() != src.id()) {
+    return false;
+  }
+  // no more deltas are expected for finished choices
+  for (const auto& choice : src.choices()) {
+    const auto* target = find_choice(dst, choice.index());
+    if (target != nullptr && target->has_finish_reason()) {
+      return false;
+    }
+  }
+
+  for (const auto& choice : src.choices()) {
+    auto* target = find_choice(dst, choice.index());
+    if (target == nullptr) {
+      *dst->add_choices() = choice;
+      continue;
+    }
+    if (choice.has_delta()) {
+      const auto& delta = choice.delta();
+      auto* target_delta = target->mutable_delta();
+      if (delta.has_role() && !target_delta->has_role()) {
+        target_delta->set_role(delta.role());
+      }
+      target_delta->mutable_content()->append(delta.content());
+    }
+    if (choice.has_logprobs()) {
+      // append the logprobs of the tokens
+      target->mutable_logprobs()->MergeFrom(choice.logprobs());
+    }
+    if (choice.has_finish_reason()) {
+      target->set_finish_reason(choice.finish_reason());
+    }
+  }
+  return true;
+}
+
+ChatHandler::ChatHandler(ModelPool* model_pool) : model_pool_(model_pool) {
+  CHECK(model_pool_ != nullptr);
 }
 
 void ChatHandler::chat_async(ChatCallData* call_data) {
   const auto& grpc_request = call_data->request();
   // check if model is supported
   const auto& model = grpc_request.model();
-  if (!models_.contains(model)) {
+  if (!model_pool_->contains(model)) {
     call_data->finish_with_error(grpc::StatusCode::NOT_FOUND,
                                  "Model not supported");
     return;
@@ -248,53 +337,111 @@ void ChatHandler::chat_async(ChatCallData* call_data) {
 
   auto sp = grpc_request_to_sampling_params(grpc_request);
   auto priority = to_priority(grpc_request.priority());
-  auto stream = grpc_request.stream();
+  // results cannot be streamed with beam search
+  auto stream = grpc_request.stream() && sp.beam_width == 0;
 
   std::vector<Message> messages;
   messages.reserve(grpc_request.messages_size());
   for (const auto& message : grpc_request.messages()) {
-    messages.emplace_back(message.role(), message.content());
+    auto& msg = messages.emplace_back(message.role(), message.content());
+    msg.images.reserve(message.images_size());
+    for (const auto& image : message.images()) {
+      msg.images.push_back({image.data(),
+                            static_cast<int32_t>(image.width()),
+                            static_cast<int32_t>(image.height())});
+    }
   }
   bool include_usage = false;
   if (grpc_request.has_stream_options()) {
     include_usage = grpc_request.stream_options().include_usage();
   }
 
-  // schedule the request
-  llm_handler_->schedule_chat_async(
-      std::move(messages),
-      std::move(sp),
-      priority,
-      stream,
-      [call_data,
-       model,
-       stream = stream,
-       include_usage = include_usage,
-       first_message_sent = std::unordered_set<size_t>(),
-       request_id = generate_request_id(),
-       created_time = absl::ToUnixSeconds(absl::Now())](
-          const RequestOutput& req_output) mutable -> bool {
-        if (req_output.status.has_value()) {
-          const auto& status = req_output.status.value();
-          if (!status.ok()) {
-            return call_data->finish_with_error(
-                to_grpc_status_code(status.code()), status.message());
-          }
-        }
-
-        if (stream) {
-          // send delta to client
-          return send_delta_to_client(call_data,
-                                      include_usage,
-                                      &first_message_sent,
-                                      request_id,
-                                      created_time,
-                                      model,
-                                      req_output);
-        }
-        return send_result_to_client(
-            call_data, request_id, created_time, model, req_output);
-      });
+  // the turn of a multi-turn session only holds the new messages
+  const bool in_session = grpc_request.has_session_id();
+  std::string session_id = grpc_request.session_id();
+  const bool close_session = in_session && grpc_request.close_session();
+
+  // schedule the request after the weights of the model are resident
+  auto schedule = [&](LLMHandler* llm_handler) {
+    if (in_session && session_id.empty()) {
+      if (llm_handler->options().max_sessions() == 0) {
+        call_data->finish_with_error(grpc::StatusCode::UNIMPLEMENTED,
+                                     "Sessions are not enabled");
+        return;
+      }
+      session_id = llm_handler->open_session();
+      if (session_id.empty()) {
+        call_data->finish_with_error(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                                     "Too many open sessions");
+        return;
+      }
+    }
+
+    OutputCallback callback =
+        [call_data,
+         model,
+         llm_handler,
+         session_id = session_id,
+         close_session = close_session,
+         stream = stream,
+         include_usage = include_usage,
+         first_message_sent = std::unordered_set<size_t>(),
+         request_id = generate_request_id(),
+         created_time = absl::ToUnixSeconds(absl::Now())](
+            const RequestOutput& req_output) mutable -> bool {
+      const bool failed =
+          req_output.status.has_value() && !req_output.status->ok();
+      if (close_session && (failed || req_output.finished)) {
+        llm_handler->close_session(session_id);
+      }
+      if (failed) {
+        const auto& status = req_output.status.value();
+        return call_data->finish_with_error(
+            to_grpc_status_code(status.code()), status.message());
+      }
+
+      if (stream) {
+        // send delta to client
+        return send_delta_to_client(call_data,
+                                    include_usage,
+                                    &first_message_sent,
+                                    request_id,
+                                    created_time,
+                                    model,
+                                    session_id,
+                                    req_output);
+      }
+      return send_result_to_client(
+          call_data, request_id, created_time, model, session_id, req_output);
+    };
+    // pause the request while the client is not draining the responses
+    auto is_backlogged = [call_data]() { return call_data->is_backlogged(); };
+    // drop the request once the client has gone away
+    auto is_cancelled = [call_data]() { return call_data->is_cancelled(); };
+
+    if (in_session) {
+      llm_handler->schedule_session_async(std::move(session_id),
+                                          std::move(messages),
+                                          std::move(sp),
+                                          priority,
+                                          stream,
+                                          std::move(callback),
+                                          std::move(is_backlogged),
+                                          std::move(is_cancelled));
+      return;
+    }
+    llm_handler->schedule_chat_async(std::move(messages),
+                                     std::move(sp),
+                                     priority,
+                                     stream,
+                                     std::move(callback),
+                                     std::move(is_backlogged),
+                                     std::move(is_cancelled));
+  };
+  if (!model_pool_->schedule(model, schedule)) {
+    call_data->finish_with_error(grpc::StatusCode::UNAVAILABLE,
+                                 "No resources to load the model");
+  }
 }
 
 }  // namespace llm
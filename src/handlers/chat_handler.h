@@ -1,26 +1,29 @@
 #pragma once
-#include <absl/container/flat_hash_set.h>
-
 #include "call_data.h"
 #include "chat.grpc.pb.h"  // IWYU pragma: keep
-#include "llm_handler.h"
+#include "model_pool.h"
 
 namespace llm {
-using ChatCallData = StreamCallData<proto::ChatRequest, proto::ChatResponse>;
+using ChatCallData = StreamWriter<proto::ChatRequest, proto::ChatResponse>;
+
+// merges the delta messages and logprobs of streamed chunks for the same
+// choices
+template <>
+struct ResponseMerger<proto::ChatResponse> {
+  static bool merge(proto::ChatResponse* dst, const proto::ChatResponse& src);
+};
 
 // a class to handle completion requests
 class ChatHandler final {
  public:
-  ChatHandler(LLMHandler* llm_handler, const std::vector<std::string>& models);
+  ChatHandler(ModelPool* model_pool);
 
   // caller needs to guarantee the lifetime of call_data.
   void chat_async(ChatCallData* call_data);
 
  private:
-  // request scheduler
-  LLMHandler* llm_handler_;
-
-  absl::flat_hash_set<std::string> models_;
+  // models to serve the requests
+  ModelPool* model_pool_;
 };
 
 }  // namespace llm
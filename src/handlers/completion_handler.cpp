@@ -7,6 +7,7 @@
 #include <torch/torch.h>
 
 #include <cstdint>
+#include <map>
 #include <string>
 
 #include "completion.pb.h"
@@ -146,6 +147,9 @@ SamplingParams grpc_request_to_sampling_params(
   if (request.has_n()) {
     sampling_params.n = request.n();
   }
+  if (request.has_beam_width()) {
+    sampling_params.beam_width = request.beam_width();
+  }
   if (request.has_best_of()) {
     sampling_params.best_of = request.best_of();
   }
@@ -188,23 +192,95 @@ SamplingParams grpc_request_to_sampling_params(
     sampling_params.stop_token_ids = std::vector<int32_t>(
         request.stop_token_ids().begin(), request.stop_token_ids().end());
   }
+  if (request.logit_bias_size() > 0) {
+    sampling_params.logit_bias = std::map<int32_t, float>(
+        request.logit_bias().begin(), request.logit_bias().end());
+  }
+  if (request.allowed_token_ids_size() > 0) {
+    sampling_params.allowed_token_ids = std::vector<int32_t>(
+        request.allowed_token_ids().begin(), request.allowed_token_ids().end());
+  }
+  if (request.has_seed()) {
+    sampling_params.seed = request.seed();
+  }
+  if (request.has_lora_adapter()) {
+    sampling_params.lora_adapter = request.lora_adapter();
+  }
+  if (request.has_truncate_prompt_keep_first()) {
+    sampling_params.truncate_prompt_keep_first =
+        request.truncate_prompt_keep_first();
+  }
+  sampling_params.tenant = request.user();
+  if (request.has_response_format()) {
+    const auto& format = request.response_format();
+    if (format.type() == "json_schema" && format.has_json_schema()) {
+      sampling_params.json_schema = format.json_schema();
+    } else if (format.type() == "json_object" ||
+               format.type() == "json_schema") {
+      sampling_params.json_object = true;
+    }
+  }
+  if (request.has_regex()) {
+    sampling_params.regex = request.regex();
+  }
   return sampling_params;
 }
 
+proto::Choice* find_choice(proto::CompletionResponse* response,
+                           uint32_t index) {
+  for (auto& choice : *response->mutable_choices()) {
+    if (choice.index() == index) {
+      return &choice;
+    }
+  }
+  return nullptr;
+}
+
 }  // namespace
 
-CompletionHandler::CompletionHandler(LLMHandler* llm_handler,
-                                     const std::vector<std::string>& models)
-    : llm_handler_(llm_handler), models_(models.begin(), models.end()) {
-  CHECK(llm_handler_ != nullptr);
-  CHECK(!models_.empty());
+bool ResponseMerger<proto::CompletionResponse>::merge(
+    proto::CompletionResponse* dst,
+    const proto::CompletionResponse& src) {
+  // usage statistics are sent in a separate chunk without choices
+  if (dst->has_usage() || src.has_usage() || dst->id() != src.id()) {
+    return false;
+  }
+  // no more deltas are expected for finished choices
+  for (const auto& choice : src.choices()) {
+    const auto* target = find_choice(dst, choice.index());
+    if (target != nullptr && target->has_finish_reason()) {
+      return false;
+    }
+  }
+
+  for (const auto& choice : src.choices()) {
+    auto* target = find_choice(dst, choice.index());
+    if (target == nullptr) {
+      *dst->add_choices() = choice;
+      continue;
+    }
+    target->mutable_text()->append(choice.text());
+    if (choice.has_logprobs()) {
+      // append the logprobs of the tokens
+      target->mutable_logprobs()->MergeFrom(choice.logprobs());
+    }
+    if (choice.has_finish_reason()) {
+      target->set_finish_reason(choice.finish_reason());
+    }
+  }
+  return true;
+}
+
+CompletionHandler::CompletionHandler(ModelPool* model_pool)
+    : model_pool_(model_pool) {
+  CHECK(model_pool_ != nullptr);
 }
 
 void CompletionHandler::complete_async(CompletionCallData* call_data) {
   const auto& grpc_request = call_data->request();
   // check if model is supported
   const auto& model = grpc_request.model();
-  if (!models_.contains(model)) {
+  if (!model_pool_->contains(model)) {
     call_data->finish_with_error(grpc::StatusCode::NOT_FOUND,
                                  "Model not supported");
     return;
@@ -213,46 +289,57 @@ void CompletionHandler::complete_async(CompletionCallData* call_data) {
   auto sp = grpc_request_to_sampling_params(grpc_request);
   auto priority = to_priority(grpc_request.priority());
   const size_t best_of = sp.best_of.value_or(sp.n);
-  // results cannot be streamed when best_of != n
-  auto stream = grpc_request.stream() && best_of == sp.n;
+  // results cannot be streamed when best_of != n or with beam search
+  auto stream =
+      grpc_request.stream() && best_of == sp.n && sp.beam_width == 0;
   bool include_usage = false;
   if (grpc_request.has_stream_options()) {
     include_usage = grpc_request.stream_options().include_usage();
   }
 
-  // schedule the request
-  llm_handler_->schedule_async(
-      grpc_request.prompt(),
-      sp = std::move(sp),
-      priority,
-      stream,
-      [call_data,
-       model,
-       stream = stream,
-       include_usage = include_usage,
-       request_id = generate_request_id(),
-       created_time = absl::ToUnixSeconds(absl::Now())](
-          const RequestOutput& req_output) -> bool {
-        if (req_output.status.has_value()) {
-          const auto& status = req_output.status.value();
-          if (!status.ok()) {
-            return call_data->finish_with_error(
-                to_grpc_status_code(status.code()), status.message());
+  // schedule the request after the weights of the model are resident
+  auto schedule = [&](LLMHandler* llm_handler) {
+    llm_handler->schedule_async(
+        grpc_request.prompt(),
+        std::move(sp),
+        priority,
+        stream,
+        [call_data,
+         model,
+         stream = stream,
+         include_usage = include_usage,
+         request_id = generate_request_id(),
+         created_time = absl::ToUnixSeconds(absl::Now())](
+            const RequestOutput& req_output) -> bool {
+          if (req_output.status.has_value()) {
+            const auto& status = req_output.status.value();
+            if (!status.ok()) {
+              return call_data->finish_with_error(
+                  to_grpc_status_code(status.code()), status.message());
+            }
           }
-        }
 
-        if (stream) {
-          // send delta to client
-          return send_delta_to_client(call_data,
-                                      include_usage,
-                                      request_id,
-                                      created_time,
-                                      model,
-                                      req_output);
-        }
-        return send_result_to_client(
-            call_data, request_id, created_time, model, req_output);
-      });
+          if (stream) {
+            // send delta to client
+            return send_delta_to_client(call_data,
+                                        include_usage,
+                                        request_id,
+                                        created_time,
+                                        model,
+                                        req_output);
+          }
+          return send_result_to_client(
+              call_data, request_id, created_time, model, req_output);
+        },
+        // pause the request while the client is not draining the responses
+        [call_data]() { return call_data->is_backlogged(); },
+        // drop the request once the client has gone away
+        [call_data]() { return call_data->is_cancelled(); });
+  };
+  if (!model_pool_->schedule(model, schedule)) {
+    call_data->finish_with_error(grpc::StatusCode::UNAVAILABLE,
+                                 "No resources to load the model");
+  }
 }
 
 }  // namespace llm
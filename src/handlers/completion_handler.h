@@ -1,30 +1,32 @@
 #pragma once
 
-#include <absl/container/flat_hash_set.h>
-
 #include "call_data.h"
 #include "completion.grpc.pb.h"  // IWYU pragma: keep
-#include "handlers/llm_handler.h"
+#include "handlers/model_pool.h"
 
 namespace llm {
 
 using CompletionCallData =
-    StreamCallData<proto::CompletionRequest, proto::CompletionResponse>;
+    StreamWriter<proto::CompletionRequest, proto::CompletionResponse>;
+
+// merges the text and logprobs of streamed chunks for the same choices
+template <>
+struct ResponseMerger<proto::CompletionResponse> {
+  static bool merge(proto::CompletionResponse* dst,
+                    const proto::CompletionResponse& src);
+};
 
 // a class to handle completion requests
 class CompletionHandler final {
  public:
-  CompletionHandler(LLMHandler* llm_handler,
-                    const std::vector<std::string>& models);
+  CompletionHandler(ModelPool* model_pool);
 
   // caller needs to guarantee the lifetime of call_data.
   void complete_async(CompletionCallData* call_data);
 
  private:
-  // llm handler
-  LLMHandler* llm_handler_;
-
-  absl::flat_hash_set<std::string> models_;
+  // models to serve the requests
+  ModelPool* model_pool_;
 };
 
 }  // namespace llm
@@ -0,0 +1,116 @@
+#include "embedding_handler.h"
+
+#include <glog/logging.h>
+#include <grpcpp/grpcpp.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "embedding.pb.h"
+#include "request/output.h"
+#include "utils.h"
+
+namespace llm {
+
+namespace {
+
+// the embeddings of the inputs collected from their requests, the response
+// is sent once all of them are done.
+struct EmbeddingState {
+  std::mutex mutex;
+  proto::EmbeddingResponse response;
+  int64_t num_prompt_tokens = 0;
+  size_t num_pending = 0;
+  bool failed = false;
+};
+
+}  // namespace
+
+EmbeddingHandler::EmbeddingHandler(ModelPool* model_pool)
+    : model_pool_(model_pool) {
+  CHECK(model_pool_ != nullptr);
+}
+
+void EmbeddingHandler::embed_async(EmbeddingCallData* call_data) {
+  const auto& grpc_request = call_data->request();
+  // check if model is supported
+  const auto& model = grpc_request.model();
+  if (!model_pool_->contains(model)) {
+    call_data->finish_with_error(grpc::StatusCode::NOT_FOUND,
+                                 "Model not supported");
+    return;
+  }
+  const size_t num_inputs = grpc_request.input_size();
+  if (num_inputs == 0) {
+    call_data->finish_with_error(grpc::StatusCode::INVALID_ARGUMENT,
+                                 "No input to embed");
+    return;
+  }
+
+  SamplingParams sp;
+  sp.pooling = grpc_request.has_pooling() ? grpc_request.pooling() : "last";
+  const auto priority = to_priority(grpc_request.priority());
+
+  auto state = std::make_shared<EmbeddingState>();
+  state->response.set_object("list");
+  state->response.set_model(model);
+  state->num_pending = num_inputs;
+  for (size_t i = 0; i < num_inputs; ++i) {
+    auto* data = state->response.add_data();
+    data->set_index(static_cast<uint32_t>(i));
+    data->set_object("embedding");
+  }
+
+  // schedule the inputs after the weights of the model are resident
+  auto schedule = [&](LLMHandler* llm_handler) {
+    std::vector<std::string> inputs(grpc_request.input().begin(),
+                                    grpc_request.input().end());
+    llm_handler->schedule_batch_async(
+        std::move(inputs),
+        {sp},
+        priority,
+        /*stream=*/false,
+        [call_data, state](size_t index, const RequestOutput& output) -> bool {
+          std::lock_guard<std::mutex> lock(state->mutex);
+          if (state->failed) {
+            return false;
+          }
+          if (output.status.has_value() && !output.status.value().ok()) {
+            // the first error fails the whole request
+            state->failed = true;
+            const auto& status = output.status.value();
+            return call_data->finish_with_error(
+                to_grpc_status_code(status.code()), status.message());
+          }
+          if (!output.outputs.empty()) {
+            const auto& embedding = output.outputs.front().embedding;
+            state->response.mutable_data(static_cast<int>(index))
+                ->mutable_embedding()
+                ->Add(embedding.begin(), embedding.end());
+          }
+          if (output.usage.has_value()) {
+            state->num_prompt_tokens += static_cast<int64_t>(
+                output.usage.value().num_prompt_tokens);
+          }
+          if (!output.finished || --state->num_pending > 0) {
+            return true;
+          }
+
+          auto* usage = state->response.mutable_usage();
+          usage->set_prompt_tokens(
+              static_cast<int32_t>(state->num_prompt_tokens));
+          usage->set_total_tokens(
+              static_cast<int32_t>(state->num_prompt_tokens));
+          return call_data->write_and_finish(std::move(state->response));
+        });
+  };
+  if (!model_pool_->schedule(model, schedule)) {
+    call_data->finish_with_error(grpc::StatusCode::UNAVAILABLE,
+                                 "No resources to load the model");
+  }
+}
+
+}  // namespace llm
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "call_data.h"
+#include "embedding.grpc.pb.h"  // IWYU pragma: keep
+#include "handlers/model_pool.h"
+
+namespace llm {
+
+using EmbeddingCallData =
+    StreamWriter<proto::EmbeddingRequest, proto::EmbeddingResponse>;
+
+// a class to handle embedding requests, the inputs are scheduled as prefill
+// only requests with the generation requests of the model.
+class EmbeddingHandler final {
+ public:
+  EmbeddingHandler(ModelPool* model_pool);
+
+  // caller needs to guarantee the lifetime of call_data.
+  void embed_async(EmbeddingCallData* call_data);
+
+ private:
+  // models to serve the requests
+  ModelPool* model_pool_;
+};
+
+}  // namespace llm
@@ -0,0 +1,156 @@
+#include "image_processor.h"
+
+#include <absl/hash/hash.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace llm {
+namespace {
+// the mean and std of the pixels in [0, 1] of the clip encoders
+constexpr float kClipMean[] = {0.48145466f, 0.4578275f, 0.40821073f};
+constexpr float kClipStd[] = {0.26862954f, 0.26130258f, 0.27577711f};
+
+// number of non-overlapping occurrences of the placeholder in the text
+size_t count_placeholders(std::string_view text) {
+  size_t count = 0;
+  for (size_t pos = text.find(ImageProcessor::kPlaceholder);
+       pos != std::string_view::npos;
+       pos = text.find(ImageProcessor::kPlaceholder,
+                       pos + ImageProcessor::kPlaceholder.size())) {
+    ++count;
+  }
+  return count;
+}
+}  // namespace
+
+ImageProcessor::ImageProcessor(int64_t image_size,
+                               int32_t image_token_id,
+                               size_t num_image_tokens)
+    : image_size_(image_size),
+      image_token_id_(image_token_id),
+      num_image_tokens_(num_image_tokens) {
+  CHECK_GT(image_size, 0) << "Image size should be greater than 0";
+  CHECK_GE(image_token_id, 0) << "No image token id";
+  CHECK_GT(num_image_tokens, 0);
+  mean_ = torch::tensor(std::vector<float>(std::begin(kClipMean),
+                                           std::end(kClipMean)))
+              .view({3, 1, 1});
+  std_ = torch::tensor(std::vector<float>(std::begin(kClipStd),
+                                          std::end(kClipStd)))
+             .view({3, 1, 1});
+}
+
+bool ImageProcessor::add_placeholders(std::vector<Message>* messages) {
+  for (auto& message : *messages) {
+    if (message.images.empty()) {
+      continue;
+    }
+    const size_t n_placeholders = count_placeholders(message.content);
+    if (n_placeholders == 0) {
+      std::string content;
+      content.reserve((kPlaceholder.size() + 1) * message.images.size() +
+                      message.content.size());
+      for (size_t i = 0; i < message.images.size(); ++i) {
+        content.append(kPlaceholder);
+        content.push_back('\n');
+      }
+      content.append(message.content);
+      message.content = std::move(content);
+    } else if (n_placeholders != message.images.size()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+torch::Tensor ImageProcessor::preprocess(const Image& image) const {
+  namespace F = torch::nn::functional;
+  const int64_t height = image.height;
+  const int64_t width = image.width;
+  if (height <= 0 || width <= 0 ||
+      image.data.size() != static_cast<size_t>(height * width * 3)) {
+    return {};
+  }
+  // [1, 3, height, width] in [0, 255]
+  auto pixels =
+      torch::from_blob(const_cast<char*>(image.data.data()),
+                       {height, width, 3},
+                       torch::kUInt8)
+          .permute({2, 0, 1})
+          .to(torch::kFloat)
+          .unsqueeze(0);
+
+  // resize the shortest edge to image_size
+  const double scale =
+      static_cast<double>(image_size_) / std::min(height, width);
+  const int64_t resized_height = std::max<int64_t>(
+      image_size_, static_cast<int64_t>(std::round(height * scale)));
+  const int64_t resized_width = std::max<int64_t>(
+      image_size_, static_cast<int64_t>(std::round(width * scale)));
+  if (resized_height != height || resized_width != width) {
+    pixels = F::interpolate(
+                 pixels,
+                 F::InterpolateFuncOptions()
+                     .size(std::vector<int64_t>{resized_height, resized_width})
+                     .mode(torch::kBicubic)
+                     .align_corners(false))
+                 .clamp(0, 255);
+  }
+
+  // crop the center
+  const int64_t top = (resized_height - image_size_) / 2;
+  const int64_t left = (resized_width - image_size_) / 2;
+  pixels = pixels.squeeze(0)
+               .narrow(/*dim=*/1, top, image_size_)
+               .narrow(/*dim=*/2, left, image_size_);
+  return ((pixels / 255.0f - mean_) / std_).contiguous();
+}
+
+bool ImageProcessor::process(const std::vector<const Image*>& images,
+                             std::vector<int32_t>* token_ids,
+                             std::vector<ImageInput>* inputs) const {
+  const size_t n_placeholders =
+      std::count(token_ids->begin(), token_ids->end(), image_token_id_);
+  if (n_placeholders != images.size()) {
+    return false;
+  }
+
+  inputs->clear();
+  inputs->reserve(images.size());
+  std::vector<int32_t> expanded;
+  expanded.reserve(token_ids->size() +
+                   images.size() * (num_image_tokens_ - 1));
+  for (const int32_t token_id : *token_ids) {
+    if (token_id != image_token_id_) {
+      expanded.push_back(token_id);
+      continue;
+    }
+    const Image& image = *images[inputs->size()];
+    auto pixel_values = preprocess(image);
+    if (!pixel_values.defined()) {
+      return false;
+    }
+    auto& input = inputs->emplace_back();
+    input.pixel_values = std::move(pixel_values);
+    input.hash = hash(image);
+    input.token_offset = expanded.size();
+    input.num_tokens = num_image_tokens_;
+    expanded.insert(expanded.end(), num_image_tokens_, image_token_id_);
+  }
+  *token_ids = std::move(expanded);
+  return true;
+}
+
+uint64_t ImageProcessor::hash(const Image& image) {
+  return absl::HashOf(
+      image.width, image.height, std::string_view(image.data));
+}
+
+}  // namespace llm
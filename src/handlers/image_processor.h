@@ -0,0 +1,67 @@
+#pragma once
+
+#include <torch/torch.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "chat_template/chat_template.h"
+#include "request/image_input.h"
+
+namespace llm {
+
+// Preprocesses the images of the chat messages for the vision encoder of the
+// model, see VisionEncoder. Each image is marked by a placeholder in the text
+// of its message, whose token is expanded into the tokens of the image
+// embeddings in the prompt.
+class ImageProcessor final {
+ public:
+  // the placeholder of an image in the text of the messages
+  static constexpr std::string_view kPlaceholder = "<image>";
+
+  // image_size: the size of the square images of the encoder
+  // image_token_id: the token id of the placeholder
+  // num_image_tokens: the number of embeddings each image is encoded into
+  ImageProcessor(int64_t image_size,
+                 int32_t image_token_id,
+                 size_t num_image_tokens);
+
+  // add the placeholders of the images to the front of the messages without
+  // them. returns false if a message has placeholders but not one for each
+  // of its images.
+  static bool add_placeholders(std::vector<Message>* messages);
+
+  // resize the shortest edge of the image to image_size with bicubic
+  // interpolation, crop the center and normalize the pixels with the mean
+  // and std of clip. returns a [3, image_size, image_size] FloatTensor, or an
+  // undefined tensor if the image is invalid.
+  torch::Tensor preprocess(const Image& image) const;
+
+  // expand the placeholder token of each image in the prompt tokens into
+  // num_image_tokens ones, and preprocess the images into inputs. returns
+  // false if the number of placeholders doesn't match the images or an image
+  // is invalid.
+  bool process(const std::vector<const Image*>& images,
+               std::vector<int32_t>* token_ids,
+               std::vector<ImageInput>* inputs) const;
+
+  // hash of the size and the pixels of the image
+  static uint64_t hash(const Image& image);
+
+  size_t num_image_tokens() const { return num_image_tokens_; }
+
+ private:
+  int64_t image_size_ = 0;
+
+  int32_t image_token_id_ = -1;
+
+  size_t num_image_tokens_ = 0;
+
+  // [3, 1, 1] mean and std of the pixels
+  torch::Tensor mean_;
+  torch::Tensor std_;
+};
+
+}  // namespace llm
@@ -0,0 +1,75 @@
+#include "image_processor.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include <string>
+#include <vector>
+
+namespace llm {
+namespace {
+Image make_image(int32_t width, int32_t height, char value) {
+  Image image;
+  image.width = width;
+  image.height = height;
+  image.data.assign(static_cast<size_t>(width) * height * 3, value);
+  return image;
+}
+}  // namespace
+
+TEST(ImageProcessorTest, AddPlaceholders) {
+  std::vector<Message> messages = {{"user", "describe"}, {"user", "<image>"}};
+  messages[0].images.push_back(make_image(2, 2, 0));
+  messages[0].images.push_back(make_image(2, 2, 1));
+  messages[1].images.push_back(make_image(2, 2, 2));
+  EXPECT_TRUE(ImageProcessor::add_placeholders(&messages));
+  EXPECT_EQ(messages[0].content, "<image>\n<image>\ndescribe");
+  // the placeholders in the content are kept
+  EXPECT_EQ(messages[1].content, "<image>");
+
+  // one placeholder for two images
+  messages[1].images.push_back(make_image(2, 2, 3));
+  EXPECT_FALSE(ImageProcessor::add_placeholders(&messages));
+}
+
+TEST(ImageProcessorTest, Preprocess) {
+  ImageProcessor processor(/*image_size=*/4,
+                           /*image_token_id=*/9,
+                           /*num_image_tokens=*/3);
+  // the shortest edge is resized to 4 and the center is cropped
+  const auto pixels = processor.preprocess(make_image(16, 8, 0));
+  ASSERT_TRUE(pixels.defined());
+  EXPECT_EQ(pixels.sizes(), torch::IntArrayRef({3, 4, 4}));
+  // black pixels are normalized to -mean / std
+  EXPECT_NEAR(pixels[0][0][0].item<float>(), -0.48145466f / 0.26862954f, 1e-4);
+
+  // the size doesn't match the data
+  Image invalid = make_image(4, 4, 0);
+  invalid.height = 5;
+  EXPECT_FALSE(processor.preprocess(invalid).defined());
+}
+
+TEST(ImageProcessorTest, Process) {
+  ImageProcessor processor(/*image_size=*/4,
+                           /*image_token_id=*/9,
+                           /*num_image_tokens=*/3);
+  const Image image1 = make_image(4, 4, 1);
+  const Image image2 = make_image(4, 4, 2);
+  std::vector<int32_t> token_ids = {1, 9, 2, 9, 3};
+  std::vector<ImageInput> inputs;
+  ASSERT_TRUE(processor.process({&image1, &image2}, &token_ids, &inputs));
+  EXPECT_EQ(token_ids,
+            std::vector<int32_t>({1, 9, 9, 9, 2, 9, 9, 9, 3}));
+  ASSERT_EQ(inputs.size(), 2);
+  EXPECT_EQ(inputs[0].token_offset, 1);
+  EXPECT_EQ(inputs[1].token_offset, 5);
+  EXPECT_EQ(inputs[1].num_tokens, 3);
+  EXPECT_NE(inputs[0].hash, inputs[1].hash);
+  EXPECT_EQ(inputs[0].hash, ImageProcessor::hash(make_image(4, 4, 1)));
+
+  // one placeholder for two images
+  token_ids = {1, 9, 2};
+  EXPECT_FALSE(processor.process({&image1, &image2}, &token_ids, &inputs));
+}
+
+}  // namespace llm
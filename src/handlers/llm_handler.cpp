@@ -1,20 +1,34 @@
 #include "llm_handler.h"
 
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/synchronization/blocking_counter.h>
+#include <absl/time/clock.h>
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <atomic>
 #include <future>
+#include <map>
 #include <memory>
+#include <numeric>
+#include <optional>
+#include <string>
+#include <string_view>
 #include <thread>
 #include <utility>
 #include <vector>
 
+#include "chat_template/common_chat_template.h"
+#include "common/cpu_affinity.h"
 #include "common/metrics.h"
 #include "common/scope_guard.h"
 #include "common/timer.h"
 #include "engine/utils.h"
+#include "grammar/json_schema.h"
 #include "models/model_args.h"
 #include "models/model_registry.h"
+#include "models/vision_encoder.h"
 #include "request/output.h"
 #include "request/request.h"
 #include "speculative/speculative_engine.h"
@@ -57,8 +71,24 @@ DEFINE_COUNTER_INSTANCE(completion_handling_latency_seconds,
 
 DEFINE_COUNTER(tokenization_latency_seconds,
                "Prompt tokenization latency in seconds");
+DEFINE_COUNTER(prompt_cache_matched_tokens_total,
+               "Total number of prompt tokens matched in the prompt cache");
 DEFINE_COUNTER(chat_template_latency_seconds,
                "Chat template latency in seconds");
+DEFINE_COUNTER(prompt_dropped_tokens_total,
+               "Total number of prompt tokens dropped between the sink tokens "
+               "and the recent tokens");
+DEFINE_COUNTER(response_cache_hits_total,
+               "Total number of requests served from the response cache");
+DEFINE_COUNTER(response_cache_coalesced_total,
+               "Total number of requests sharing the output of an identical "
+               "request in flight");
+DEFINE_COUNTER(shed_requests_total,
+               "Total number of requests refused for the estimated time to "
+               "first token");
+DEFINE_COUNTER(clamped_requests_total,
+               "Total number of requests with max tokens clamped to the kv "
+               "cache headroom");
 
 namespace llm {
 namespace {
@@ -134,12 +164,14 @@ bool verify_params(const SamplingParams& sp, OutputCallback callback) {
     return false;
   }
 
+  if (sp.truncate_prompt_keep_first >= 0 && sp.echo) {
+    CALLBACK_WITH_ERROR(
+        StatusCode::INVALID_ARGUMENT,
+        "truncate_prompt_keep_first is not supported with echo");
+    return false;
+  }
+
   if (sp.logprobs) {
-    if (sp.echo) {
-      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
-                          "logprobs is not supported with echo");
-      return false;
-    }
     if (sp.top_logprobs < 0 || sp.top_logprobs > 20) {
       CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
                           "logprobs must be between 0 and 20");
@@ -160,19 +192,276 @@ bool verify_params(const SamplingParams& sp, OutputCallback callback) {
                         "frequency_penalty must be between 0.0 and 2.0");
     return false;
   }
+
+  // up to 1024 biased tokens and 4096 allowed tokens
+  if (sp.logit_bias.has_value()) {
+    if (sp.logit_bias->size() > 1024) {
+      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                          "logit_bias size is too large");
+      return false;
+    }
+    for (const auto& [token_id, bias] : sp.logit_bias.value()) {
+      if (bias < -100.0 || bias > 100.0) {
+        CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                            "logit_bias must be between -100 and 100");
+        return false;
+      }
+    }
+  }
+  if (sp.allowed_token_ids.has_value()) {
+    if (sp.allowed_token_ids->empty()) {
+      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                          "allowed_token_ids should not be empty");
+      return false;
+    }
+    if (sp.allowed_token_ids->size() > 4096) {
+      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                          "allowed_token_ids size is too large");
+      return false;
+    }
+  }
+
+  // at most one grammar to constrain the output
+  const int n_grammars = static_cast<int>(sp.json_schema.has_value()) +
+                         static_cast<int>(sp.json_object) +
+                         static_cast<int>(sp.regex.has_value());
+  if (n_grammars > 1) {
+    CALLBACK_WITH_ERROR(
+        StatusCode::INVALID_ARGUMENT,
+        "only one of json_schema, json_object and regex can be set");
+    return false;
+  }
+  if (n_grammars > 0 && sp.ignore_eos) {
+    CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                        "ignore_eos is not supported with constrained output");
+    return false;
+  }
+
+  if (sp.beam_width > 0) {
+    if (sp.beam_width > 10) {
+      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                          "beam_width must be between 0 and 10");
+      return false;
+    }
+    if (sp.n > sp.beam_width) {
+      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                          "n should be less than or equal to beam_width");
+      return false;
+    }
+    if (sp.best_of.has_value()) {
+      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                          "best_of is not supported with beam search");
+      return false;
+    }
+    if (n_grammars > 0) {
+      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                          "constrained output is not supported with beam "
+                          "search");
+      return false;
+    }
+  }
+
+  if (!sp.pooling.empty()) {
+    if (sp.pooling != "mean" && sp.pooling != "last") {
+      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                          "pooling must be one of mean and last");
+      return false;
+    }
+    // nothing is generated for embeddings
+    if (sp.n != 1 || sp.best_of.has_value() || sp.beam_width > 0 ||
+        sp.echo || sp.logprobs || n_grammars > 0) {
+      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                          "only one embedding is returned for each input");
+      return false;
+    }
+  }
   return true;
 }
 
+// merge the logit bias and the allowed tokens into the sparse logit bias of
+// the sampling parameter, returns false if a token id is out of the vocab.
+bool set_logit_bias(const SamplingParams& sp,
+                    int64_t vocab_size,
+                    SamplingParameter* sampling_param) {
+  const auto is_valid = [vocab_size](int32_t token_id) {
+    return token_id >= 0 && (vocab_size <= 0 || token_id < vocab_size);
+  };
+  std::map<int32_t, float> logit_bias;
+  if (sp.logit_bias.has_value()) {
+    logit_bias = sp.logit_bias.value();
+  }
+  if (sp.allowed_token_ids.has_value()) {
+    // only the allowed tokens keep their bias
+    std::map<int32_t, float> allowed_bias;
+    for (const int32_t token_id : sp.allowed_token_ids.value()) {
+      auto it = logit_bias.find(token_id);
+      allowed_bias[token_id] = it != logit_bias.end() ? it->second : 0.0f;
+    }
+    logit_bias = std::move(allowed_bias);
+    sampling_param->logit_bias_exclusive = true;
+  }
+  for (const auto& [token_id, bias] : logit_bias) {
+    if (!is_valid(token_id)) {
+      return false;
+    }
+    // skip the zero bias of non exclusive tokens
+    if (bias != 0.0f || sampling_param->logit_bias_exclusive) {
+      sampling_param->logit_bias.emplace_back(token_id, bias);
+    }
+  }
+  return true;
+}
+
+// keep the first n_first tokens and the most recent tokens, n_keep in total
+void drop_middle_tokens(size_t n_first,
+                        size_t n_keep,
+                        std::vector<int32_t>* tokens) {
+  DCHECK_LT(n_first, n_keep);
+  DCHECK_GT(tokens->size(), n_keep);
+  const size_t n_dropped = tokens->size() - n_keep;
+  tokens->erase(tokens->begin() + n_first,
+                tokens->begin() + n_first + n_dropped);
+  COUNTER_ADD(prompt_dropped_tokens_total, n_dropped);
+}
+
+// whether any of the messages holds images
+bool has_images(const std::vector<Message>& messages) {
+  return std::any_of(
+      messages.begin(), messages.end(), [](const Message& message) {
+        return !message.images.empty();
+      });
+}
+
+// the key of the output of a request in the response cache, which is the
+// serialized prompt token ids and parameters changing the output. empty if
+// the output is not deterministic, e.g. sampled or streamed. greedy
+// sampling, beam search and embeddings are deterministic.
+std::string response_cache_key(const Request& request,
+                               const SamplingParams& sp) {
+  const bool deterministic = request.sampling_param.temperature == 0 ||
+                             request.beam_width > 0 ||
+                             request.pooling != PoolingType::NONE;
+  if (request.stream || !deterministic) {
+    return "";
+  }
+
+  std::string key;
+  const auto append = [&key](const void* data, size_t size) {
+    key.append(static_cast<const char*>(data), size);
+  };
+  const auto append_value = [&append](auto value) {
+    append(&value, sizeof(value));
+  };
+  const auto append_string = [&](const std::string& str) {
+    append_value(str.size());
+    append(str.data(), str.size());
+  };
+  const auto append_ids = [&](const std::vector<int32_t>& ids) {
+    append_value(ids.size());
+    append(ids.data(), ids.size() * sizeof(int32_t));
+  };
+
+  append_ids(request.prompt_tokens);
+  // the prompt text is echoed back
+  append_string(request.echo ? request.prompt : "");
+  append_value(request.stopping_criteria.max_tokens);
+  append_value(request.n);
+  append_value(request.best_of);
+  append_value(request.beam_width);
+  append_value(request.prompt_logprobs);
+  append_value(request.detokenize);
+  append_value(request.lora_id);
+  append_value(static_cast<int32_t>(request.pooling));
+  // the placeholders of the images share one token id
+  if (request.images != nullptr) {
+    for (const auto& image : *request.images) {
+      append_value(image.hash);
+      append_value(image.token_offset);
+    }
+  }
+
+  const auto& sampling_param = request.sampling_param;
+  append_value(sampling_param.frequency_penalty);
+  append_value(sampling_param.presence_penalty);
+  append_value(sampling_param.repetition_penalty);
+  append_value(sampling_param.logprobs);
+  append_value(sampling_param.top_logprobs);
+  append_value(sampling_param.logit_bias_exclusive);
+  append_value(sampling_param.logit_bias.size());
+  for (const auto& [token_id, bias] : sampling_param.logit_bias) {
+    append_value(token_id);
+    append_value(bias);
+  }
+
+  append_value(sp.skip_special_tokens);
+  append_value(sp.ignore_eos);
+  append_value(sp.stop_token_ids.has_value());
+  append_ids(sp.stop_token_ids.value_or(std::vector<int32_t>{}));
+  const auto stop = sp.stop.value_or(std::vector<std::string>{});
+  append_value(stop.size());
+  for (const auto& s : stop) {
+    append_string(s);
+  }
+  append_string(sp.json_schema.value_or(""));
+  append_value(sp.json_object);
+  append_string(sp.regex.value_or(""));
+  return key;
+}
+
+// the content of the placeholder turn rendered ahead of the new messages of a
+// session turn, to cut off the rendering of the messages before them.
+constexpr std::string_view kSessionTurnMarker = "<<session-turn>>";
+
+// the max number of tokens ending the history of a session that are repeated
+// at the start of the next turn, e.g. the end of turn token generated by the
+// model and rendered again by the chat template.
+constexpr size_t kMaxSessionTurnOverlap = 4;
+
+// the max number of prefix blocks remembered to route the requests across
+// the data parallel replicas
+constexpr size_t kMaxRoutedPrefixes = 1 << 16;
+
+// the number of tokens at the start of the turn that end the history
+size_t session_turn_overlap(const std::vector<int32_t>& history,
+                            const std::vector<int32_t>& turn) {
+  const size_t max_overlap =
+      std::min({kMaxSessionTurnOverlap, history.size(), turn.size()});
+  for (size_t n = max_overlap; n > 0; --n) {
+    if (std::equal(turn.begin(), turn.begin() + n, history.end() - n)) {
+      return n;
+    }
+  }
+  return 0;
+}
+
 }  // namespace
 
 LLMHandler::LLMHandler(const Options& options) : options_(options) {
+  // keep the handler threads off the scheduler cpus
+  scheduler_cpus_ = parse_cpu_list(options.scheduler_cpus());
+  std::vector<int32_t> handler_cpus = parse_cpu_list(options.handler_cpus());
+  if (handler_cpus.empty() && !scheduler_cpus_.empty()) {
+    handler_cpus = exclude_cpus(online_cpus(), scheduler_cpus_);
+  }
+
   // construct engine
   const auto devices = parse_devices(options.devices().value_or("auto"));
   LOG(INFO) << "Creating engine with devices: " << to_string(devices);
 
-  // create a speculative engine if draft model path is provided
+  // create a speculative engine if draft model (or medusa heads) path is
+  // provided or the draft tokens come from the n-gram prompt lookup or the
+  // lookahead decoding of the target model
   const auto draft_model_path = options.draft_model_path().value_or("");
-  if (!draft_model_path.empty()) {
+  const bool use_ngram = (options.speculative_proposer() == "ngram" ||
+                          options.speculative_proposer() == "lookahead") &&
+                         options.num_speculative_tokens() > 0;
+  const int32_t dp_size = options.data_parallel_size();
+  CHECK_GT(dp_size, 0) << "Data parallel size should be greater than 0";
+  if (!draft_model_path.empty() || use_ngram) {
+    CHECK_EQ(options.pp_size(), 1)
+        << "Pipeline parallelism is not supported with speculative decoding";
+    CHECK_EQ(dp_size, 1)
+        << "Data parallelism is not supported with speculative decoding";
     const auto draft_devices =
         parse_devices(options.draft_devices().value_or("auto"));
     LOG(INFO) << "Using draft devices: " << to_string(draft_devices);
@@ -181,31 +470,114 @@ LLMHandler::LLMHandler(const Options& options) : options_(options) {
         .draft_devices(draft_devices)
         .block_size(options.block_size())
         .max_cache_size(options.max_cache_size())
+        .resizable_cache_size(options.resizable_cache_size())
         .max_memory_utilization(options.max_memory_utilization())
         .enable_prefix_cache(options.enable_prefix_cache())
+        .kv_cache_dtype(options.kv_cache_dtype())
         .num_speculative_tokens(options.num_speculative_tokens())
+        .speculative_tree_width(options.speculative_tree_width())
+        .speculative_proposer(options.speculative_proposer())
+        .ngram_max_size(options.ngram_max_size())
+        .enable_adaptive_speculation(options.enable_adaptive_speculation())
+        .speculative_min_acceptance(options.speculative_min_acceptance())
+        .speculative_max_batch_size(options.speculative_max_batch_size())
         .enable_cuda_graph(options.enable_cuda_graph())
         .cuda_graph_max_seq_len(options.cuda_graph_max_seq_len())
         .cuda_graph_batch_sizes(options.cuda_graph_batch_sizes())
-        .draft_cuda_graph_batch_sizes(options.draft_cuda_graph_batch_sizes());
+        .draft_cuda_graph_batch_sizes(options.draft_cuda_graph_batch_sizes())
+        .draft_quant_method(options.draft_quant_method());
 
     auto spec_engine = std::make_unique<SpeculativeEngine>(spec_options);
     CHECK(spec_engine->init(options.model_path(), draft_model_path));
     engine_ = std::move(spec_engine);
   } else {
+    // each data parallel replica takes an even share of the devices
+    CHECK_EQ(devices.size() % dp_size, 0)
+        << "The devices should be split evenly across the data parallel "
+           "replicas";
+    const size_t n_replica_devices = devices.size() / dp_size;
+    auto replica_devices = [&](size_t replica) {
+      const auto begin = devices.begin() + replica * n_replica_devices;
+      return std::vector<torch::Device>(begin, begin + n_replica_devices);
+    };
+
     LLMEngine::Options eng_options;
-    eng_options.devices(devices)
+    eng_options.devices(replica_devices(0))
         .block_size(options.block_size())
+        .large_block_size(options.large_block_size())
+        .kv_budget(options.kv_budget())
+        .kv_observation_window(options.kv_observation_window())
+        .hybrid_attention_device_blocks(
+            options.hybrid_attention_device_blocks())
         .max_cache_size(options.max_cache_size())
+        .host_cache_size(options.host_cache_size())
+        .resizable_cache_size(options.resizable_cache_size())
         .max_memory_utilization(options.max_memory_utilization())
         .enable_prefix_cache(options.enable_prefix_cache())
+        .kv_cache_dtype(options.kv_cache_dtype())
         .enable_cuda_graph(options.enable_cuda_graph())
         .cuda_graph_max_seq_len(options.cuda_graph_max_seq_len())
-        .cuda_graph_batch_sizes(options.cuda_graph_batch_sizes());
+        .cuda_graph_batch_sizes(options.cuda_graph_batch_sizes())
+        .cuda_graph_num_tokens(options.cuda_graph_num_tokens())
+        .piecewise_cuda_graph_num_tokens(
+            options.piecewise_cuda_graph_num_tokens())
+        .lazy_cuda_graph_capture(options.lazy_cuda_graph_capture())
+        .profile_cache_dir(options.profile_cache_dir())
+        .num_decode_steps(options.num_decode_steps())
+        .enable_fused_sampling(options.enable_fused_sampling())
+        .enable_pivot_sampling(options.enable_pivot_sampling())
+        .enable_vocab_parallel_sampling(
+            options.enable_vocab_parallel_sampling())
+        .cascade_min_prefix_len(options.cascade_min_prefix_len())
+        .pp_size(options.pp_size())
+        .num_micro_batches(options.num_micro_batches())
+        .weights_snapshot_dir(options.weights_snapshot_dir())
+        .numa_affinity(options.numa_affinity())
+        .activation_pool_num_tokens(options.enable_activation_pool()
+                                        ? options.max_tokens_per_batch()
+                                        : 0);
+    if (!options.remote_workers().empty()) {
+      const std::vector<std::string> remote_workers =
+          absl::StrSplit(options.remote_workers(), ',', absl::SkipEmpty());
+      eng_options.remote_workers(remote_workers);
+    }
+    if (!options.lora_adapters().empty()) {
+      const std::vector<std::string> lora_adapters =
+          absl::StrSplit(options.lora_adapters(), ',', absl::SkipEmpty());
+      eng_options.lora_adapters(lora_adapters);
+    }
 
     auto engine = std::make_unique<LLMEngine>(eng_options);
     CHECK(engine->init(options.model_path()));
     engine_ = std::move(engine);
+
+    if (dp_size > 1) {
+      CHECK(options.remote_workers().empty())
+          << "Remote workers are not supported with data parallelism";
+      CHECK(!options.decode_devices().has_value())
+          << "Decode devices are not supported with data parallelism";
+    }
+    for (int32_t i = 1; i < dp_size; ++i) {
+      const auto devices_i = replica_devices(i);
+      LOG(INFO) << "Creating data parallel replica " << i
+                << " with devices: " << to_string(devices_i);
+      eng_options.devices(devices_i);
+      auto replica_engine = std::make_unique<LLMEngine>(eng_options);
+      CHECK(replica_engine->init(options.model_path()));
+      replica_engines_.push_back(std::move(replica_engine));
+    }
+
+    if (options.decode_devices().has_value()) {
+      CHECK(options.remote_workers().empty())
+          << "Remote workers are not supported with decode devices";
+      const auto decode_devices =
+          parse_devices(options.decode_devices().value());
+      LOG(INFO) << "Using decode devices: " << to_string(decode_devices);
+      eng_options.devices(decode_devices);
+      auto decode_engine = std::make_unique<LLMEngine>(eng_options);
+      CHECK(decode_engine->init(options.model_path()));
+      decode_engine_ = std::move(decode_engine);
+    }
   }
 
   model_args_ = engine_->model_args();
@@ -213,9 +585,52 @@ LLMHandler::LLMHandler(const Options& options) : options_(options) {
   ContinuousScheduler::Options scheduler_options;
   scheduler_options.max_tokens_per_batch(options.max_tokens_per_batch())
       .max_seqs_per_batch(options.max_seqs_per_batch())
-      .num_speculative_tokens(options.num_speculative_tokens());
-  scheduler_ =
+      .target_step_time_ms(options.target_step_time_ms())
+      .min_tokens_per_batch(options.min_tokens_per_batch())
+      .num_speculative_tokens(options.num_speculative_tokens())
+      .speculative_tree_width(options.speculative_tree_width())
+      .num_decode_steps(options.num_decode_steps())
+      .scheduling_policy(options.scheduling_policy())
+      .sjf_aging_tokens_per_second(options.sjf_aging_tokens_per_second())
+      .tenant_weights(options.tenant_weights())
+      .max_tenant_kv_cache_share(options.max_tenant_kv_cache_share())
+      .swap_bandwidth_gbps(options.swap_bandwidth_gbps())
+      .max_compaction_blocks_per_step(
+          options.max_compaction_blocks_per_step())
+      .ttft_slo_ms(options.ttft_slo_ms())
+      .itl_slo_ms(options.itl_slo_ms())
+      .prefix_admission_window(options.prefix_admission_window())
+      .max_admission_skips(options.max_admission_skips())
+      .wait_for_inflight_prefix(options.wait_for_inflight_prefix())
+      .high_priority_reserved_tokens(options.high_priority_reserved_tokens())
+      .high_priority_reserved_seqs(options.high_priority_reserved_seqs())
+      .session_ttl_seconds(options.session_ttl_seconds())
+      .max_session_kv_cache_share(options.max_session_kv_cache_share())
+      .best_of_prune_margin(options.best_of_prune_margin())
+      .best_of_prune_interval(options.best_of_prune_interval())
+      .num_response_threads(options.num_response_threads())
+      .response_cpus(handler_cpus);
+  auto scheduler =
       std::make_unique<ContinuousScheduler>(engine_.get(), scheduler_options);
+  if (decode_engine_ != nullptr) {
+    decode_scheduler_ = std::make_unique<ContinuousScheduler>(
+        decode_engine_.get(), scheduler_options);
+    scheduler->set_decode_scheduler(decode_scheduler_.get());
+  }
+  scheduler_ = std::move(scheduler);
+  // the replicas send their outputs through the response threads of the
+  // first one
+  for (auto& replica_engine : replica_engines_) {
+    auto replica_scheduler = std::make_unique<ContinuousScheduler>(
+        replica_engine.get(), scheduler_options);
+    replica_scheduler->share_response_handler(*scheduler_);
+    replica_schedulers_.push_back(std::move(replica_scheduler));
+  }
+  if (!replica_schedulers_.empty()) {
+    router_ = std::make_unique<ReplicaRouter>(replica_schedulers_.size() + 1,
+                                              options.block_size(),
+                                              kMaxRoutedPrefixes);
+  }
 
   // construct chat template
   auto factory = ModelRegistry::get_default_chat_template_factory(
@@ -225,19 +640,71 @@ LLMHandler::LLMHandler(const Options& options) : options_(options) {
               << model_args_.model_type();
     chat_template_ = factory();
   } else {
+    // render the chat template from the tokenizer config with the coded
+    // template of the same family, if any.
     const auto& tokenizer_args = engine_->tokenizer_args();
     if (!tokenizer_args.chat_template().empty()) {
-      LOG(WARNING) << "No default chat template found for model type: "
-                   << model_args_.model_type();
+      chat_template_ =
+          create_coded_chat_template(tokenizer_args.chat_template());
+      if (chat_template_ != nullptr) {
+        LOG(INFO) << "Using coded chat template matching the tokenizer config";
+      } else {
+        LOG(WARNING) << "No default chat template found for model type: "
+                     << model_args_.model_type();
+      }
     }
   }
 
+  // the images of the messages are encoded by the vision encoder
+  if (const size_t n_image_tokens =
+          VisionEncoder::num_image_tokens(model_args_);
+      n_image_tokens > 0 && ModelRegistry::get_vision_encoder_factory(
+                                model_args_.model_type()) != nullptr) {
+    image_processor_ = std::make_unique<ImageProcessor>(
+        model_args_.image_size(), model_args_.image_token_id(), n_image_tokens);
+  }
+
   // construct tokenizers and handling threads
   const auto* tokenizer = engine_->tokenizer();
   for (size_t i = 0; i < options.num_handling_threads(); ++i) {
     // create a tokenizer for each thread for now
     tokenizers_.emplace_back(tokenizer->clone());
-    handling_threads_.emplace_back([this, i] { handling_loop(i); });
+  }
+  handling_threadpool_ =
+      std::make_unique<ThreadPool>(options.num_handling_threads());
+  handling_threadpool_->set_affinity(handler_cpus);
+  if (options.num_encode_threads() > 0) {
+    encoder_ = std::make_unique<BatchEncoder>(*tokenizer,
+                                              options.num_encode_threads());
+    encoder_->set_affinity(handler_cpus);
+  }
+  if (options.prompt_cache_tokens() > 0) {
+    prompt_cache_ =
+        std::make_unique<PromptCache>(options.prompt_cache_tokens());
+  }
+  if (options.response_cache_size() > 0) {
+    response_cache_ = std::make_unique<ResponseCache>(
+        options.response_cache_size(),
+        absl::Seconds(options.response_cache_ttl_seconds()));
+  }
+  if (options.max_sessions() > 0) {
+    session_store_ = std::make_unique<SessionStore>(
+        options.max_sessions(), absl::Seconds(options.session_ttl_seconds()));
+  }
+  // constrained decoding is not supported with speculative decoding
+  if (options.max_cached_grammars() > 0 &&
+      options.num_speculative_tokens() == 0 && model_args_.vocab_size() > 0) {
+    auto vocab = TokenVocab::create(*tokenizer, model_args_.vocab_size());
+    if (vocab != nullptr) {
+      grammar_cache_ = std::make_unique<GrammarCache>(
+          std::move(vocab), options.max_cached_grammars());
+    } else {
+      LOG(WARNING) << "Constrained decoding is not supported by the tokenizer";
+    }
+  }
+
+  if (options.enable_warmup()) {
+    warmup();
   }
 }
 
@@ -247,11 +714,14 @@ std::future<bool> LLMHandler::schedule_async(std::string prompt,
                                              SamplingParams sp,
                                              Priority priority,
                                              bool stream,
-                                             OutputCallback callback) {
+                                             OutputCallback callback,
+                                             BacklogCallback is_backlogged,
+                                             CancelCallback is_cancelled) {
   // add one pending request
   scheduler_->inc_pending_requests(1);
   return schedule(
       std::move(prompt),
+      /*prompt_tokens=*/{},
       std::move(sp),
       priority,
       stream,
@@ -260,14 +730,19 @@ std::future<bool> LLMHandler::schedule_async(std::string prompt,
           log_request_status(output.status.value().code());
         }
         return callback(output);
-      });
+      },
+      std::move(is_backlogged),
+      std::move(is_cancelled));
 }
 
-std::future<bool> LLMHandler::schedule_chat_async(std::vector<Message> messages,
-                                                  SamplingParams sp,
-                                                  Priority priority,
-                                                  bool stream,
-                                                  OutputCallback callback) {
+std::future<bool> LLMHandler::schedule_chat_async(
+    std::vector<Message> messages,
+    SamplingParams sp,
+    Priority priority,
+    bool stream,
+    OutputCallback callback,
+    BacklogCallback is_backlogged,
+    CancelCallback is_cancelled) {
   // add one pending request
   scheduler_->inc_pending_requests(1);
   return schedule(
@@ -280,7 +755,183 @@ std::future<bool> LLMHandler::schedule_chat_async(std::vector<Message> messages,
           log_request_status(output.status.value().code());
         }
         return callback(output);
-      });
+      },
+      std::move(is_backlogged),
+      std::move(is_cancelled));
+}
+
+std::string LLMHandler::open_session() {
+  if (session_store_ == nullptr) {
+    return "";
+  }
+  return session_store_->open();
+}
+
+bool LLMHandler::close_session(const std::string& session_id) {
+  if (session_store_ == nullptr || !session_store_->close(session_id)) {
+    return false;
+  }
+  // the turns may have been routed to any replica
+  for (auto* scheduler : schedulers()) {
+    scheduler->unpin_session(session_id);
+  }
+  return true;
+}
+
+std::future<bool> LLMHandler::schedule_session_async(
+    std::string session_id,
+    std::vector<Message> messages,
+    SamplingParams sp,
+    Priority priority,
+    bool stream,
+    OutputCallback callback,
+    BacklogCallback is_backlogged,
+    CancelCallback is_cancelled) {
+  // add one pending request
+  scheduler_->inc_pending_requests(1);
+  std::promise<bool> promise;
+  auto future = promise.get_future();
+  handling_threadpool_->schedule([this,
+                                  promise = std::move(promise),
+                                  session_id = std::move(session_id),
+                                  messages = std::move(messages),
+                                  sp = std::move(sp),
+                                  priority,
+                                  stream,
+                                  user_callback = std::move(callback),
+                                  is_backlogged = std::move(is_backlogged),
+                                  is_cancelled =
+                                      std::move(is_cancelled)]() mutable {
+    const size_t tid = ThreadPool::current_thread_index();
+    AUTO_COUNTER(chat_handling_latency_seconds);
+    // remove the pending request after scheduling
+    SCOPE_GUARD([this] { scheduler_->dec_pending_requests(); });
+
+    OutputCallback callback = [&user_callback](const RequestOutput& output) {
+      if (output.status.has_value()) {
+        log_request_status(output.status.value().code());
+      }
+      return user_callback(output);
+    };
+    if (draining_.load(std::memory_order_relaxed)) {
+      CALLBACK_WITH_ERROR(StatusCode::UNAVAILABLE, "Server is draining");
+      promise.set_value(false);
+      return;
+    }
+    if (is_cancelled != nullptr && is_cancelled()) {
+      CALLBACK_WITH_ERROR(StatusCode::CANCELLED, "Request cancelled");
+      promise.set_value(false);
+      return;
+    }
+    if (session_store_ == nullptr) {
+      CALLBACK_WITH_ERROR(StatusCode::UNIMPLEMENTED,
+                          "Sessions are not enabled");
+      promise.set_value(false);
+      return;
+    }
+    if (!verify_params(sp, callback)) {
+      promise.set_value(false);
+      return;
+    }
+    // the history is extended with the output of a single sequence, and the
+    // kv cache of lora adapters is not in the prefix cache
+    if (sp.n != 1 || sp.best_of.value_or(1) != 1 || sp.beam_width > 0 ||
+        sp.echo || !sp.pooling.empty() || sp.lora_adapter.has_value() ||
+        has_images(messages)) {
+      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                          "Sessions only support a single sampled completion "
+                          "with the base model and no images");
+      promise.set_value(false);
+      return;
+    }
+
+    std::vector<int32_t> token_ids;
+    if (!session_store_->begin_turn(session_id, &token_ids)) {
+      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                          "Session is not open, expired or running a turn");
+      promise.set_value(false);
+      return;
+    }
+    std::string prompt;
+    if (!encode_session_turn(tid, messages, &token_ids, &prompt)) {
+      session_store_->end_turn(session_id, /*succeeded=*/false, {});
+      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                          "Failed to construct prompt from messages");
+      promise.set_value(false);
+      return;
+    }
+
+    // the turn ends before the final output is sent, so that the client can
+    // send the next turn right away. the history is kept if the turn fails.
+    struct TurnState {
+      std::vector<int32_t> token_ids;
+      bool ended = false;
+    };
+    auto state = std::make_shared<TurnState>();
+    OutputCallback turn_callback = [store = session_store_.get(),
+                                    session_id,
+                                    state,
+                                    user_callback](RequestOutput output) {
+      if (output.status.has_value()) {
+        log_request_status(output.status.value().code());
+      }
+      if (state->ended) {
+        return user_callback(std::move(output));
+      }
+      for (const auto& seq_output : output.outputs) {
+        state->token_ids.insert(state->token_ids.end(),
+                                seq_output.token_ids.begin(),
+                                seq_output.token_ids.end());
+      }
+      const bool failed = output.status.has_value() && !output.status->ok();
+      bool keep = true;
+      if (!output.finished && !failed) {
+        keep = user_callback(output);
+        if (keep) {
+          return true;
+        }
+      }
+      state->ended = true;
+      store->end_turn(session_id,
+                      output.finished && !failed,
+                      std::move(state->token_ids));
+      return keep && user_callback(std::move(output));
+    };
+
+    auto request = create_request(tid,
+                                  std::move(prompt),
+                                  std::move(token_ids),
+                                  sp,
+                                  priority,
+                                  stream,
+                                  turn_callback);
+    if (!request) {
+      promise.set_value(false);
+      return;
+    }
+    // the prompt may be shortened to the sink and recent tokens
+    state->token_ids = request->prompt_tokens;
+    // the kv cache of the handed over requests is in the decode engine
+    if (decode_scheduler_ == nullptr) {
+      request->session_id = session_id;
+    }
+    request->is_output_backlogged = std::move(is_backlogged);
+    request->is_client_cancelled = std::move(is_cancelled);
+
+    auto* scheduler = route(request.get());
+    if (!admit(*scheduler, request.get(), priority, turn_callback)) {
+      promise.set_value(false);
+      return;
+    }
+    if (!scheduler->schedule(request)) {
+      turn_callback(Status{StatusCode::RESOURCE_EXHAUSTED,
+                           "No available resources to schedule request"});
+      promise.set_value(false);
+      return;
+    }
+    promise.set_value(true);
+  });
+  return future;
 }
 
 BatchFuture LLMHandler::schedule_batch_async(std::vector<std::string> prompts,
@@ -293,10 +944,27 @@ BatchFuture LLMHandler::schedule_batch_async(std::vector<std::string> prompts,
 
   const size_t num_requests = prompts.size();
   scheduler_->inc_pending_requests(num_requests);
+
+  // encode all prompts in parallel before handling the requests, the prompts
+  // are encoded one by one by the handling threads if failed.
+  std::vector<std::vector<int32_t>> prompt_tokens;
+  if (encoder_ != nullptr) {
+    Timer timer;
+    const std::vector<std::string_view> texts(prompts.begin(), prompts.end());
+    if (encoder_->batch_encode(texts, &prompt_tokens)) {
+      COUNTER_ADD(tokenization_latency_seconds, timer.elapsed_seconds());
+    } else {
+      prompt_tokens.clear();
+    }
+  }
+
   auto futures = std::make_unique<std::vector<std::future<bool>>>();
   futures->reserve(num_requests);
   for (size_t i = 0; i < num_requests; ++i) {
     auto future = schedule(std::move(prompts[i]),
+                           prompt_tokens.empty()
+                               ? std::vector<int32_t>{}
+                               : std::move(prompt_tokens[i]),
                            // the sampling parameter may be shared
                            sps.size() == 1 ? sps[0] : std::move(sps[i]),
                            priority,
@@ -342,41 +1010,197 @@ BatchFuture LLMHandler::schedule_chat_batch_async(
   return {std::move(futures)};
 }
 
+BatchOutput LLMHandler::generate_batch(std::vector<std::string> prompts,
+                                       std::vector<SamplingParams> sps) {
+  CHECK(prompts.size() == sps.size() || sps.size() == 1)
+      << "Number of prompts and sampling parameters should be the same";
+  CHECK(!running_.load(std::memory_order_relaxed))
+      << "Handler is already running";
+
+  const size_t num_requests = prompts.size();
+  scheduler_->inc_pending_requests(num_requests);
+
+  // encode all prompts in parallel up front, the prompts are encoded one by
+  // one by the feeding threads if failed.
+  std::vector<std::vector<int32_t>> prompt_tokens;
+  if (encoder_ != nullptr) {
+    Timer timer;
+    const std::vector<std::string_view> texts(prompts.begin(), prompts.end());
+    if (encoder_->batch_encode(texts, &prompt_tokens)) {
+      COUNTER_ADD(tokenization_latency_seconds, timer.elapsed_seconds());
+    } else {
+      prompt_tokens.clear();
+    }
+  }
+
+  // feed the longest requests first, so that the tail of the run is packed
+  // with short requests instead of a few long ones leaving the kv cache idle.
+  auto sp_of = [&](size_t i) -> const SamplingParams& {
+    return sps.size() == 1 ? sps[0] : sps[i];
+  };
+  std::vector<size_t> lengths(num_requests);
+  for (size_t i = 0; i < num_requests; ++i) {
+    // the number of chars is a good enough proxy for unencoded prompts
+    const size_t prompt_len =
+        prompt_tokens.empty() ? prompts[i].size() : prompt_tokens[i].size();
+    lengths[i] = prompt_len + sp_of(i).max_tokens;
+  }
+  std::vector<size_t> order(num_requests);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+    return lengths[lhs] > lengths[rhs];
+  });
+
+  // outputs are written by the response threads, one slot per request
+  std::vector<std::optional<RequestOutput>> outputs(num_requests);
+
+  // each handling thread feeds a strided slice of the sorted requests,
+  // waiting for the scheduling loop to drain the request queue when full.
+  const size_t num_feeders =
+      std::min(handling_threadpool_->size(), std::max<size_t>(num_requests, 1));
+  absl::BlockingCounter feeders(static_cast<int>(num_feeders));
+  for (size_t f = 0; f < num_feeders; ++f) {
+    handling_threadpool_->schedule([&, f] {
+      const size_t tid = ThreadPool::current_thread_index();
+      for (size_t k = f; k < num_requests; k += num_feeders) {
+        const size_t i = order[k];
+        // remove the pending request after scheduling
+        SCOPE_GUARD([this] { scheduler_->dec_pending_requests(); });
+
+        OutputCallback callback = [&outputs, i](RequestOutput output) {
+          if (output.status.has_value()) {
+            log_request_status(output.status.value().code());
+          }
+          outputs[i] = std::move(output);
+          return true;
+        };
+        if (!verify_params(sp_of(i), callback)) {
+          continue;
+        }
+        auto request = create_request(tid,
+                                      std::move(prompts[i]),
+                                      prompt_tokens.empty()
+                                          ? std::vector<int32_t>{}
+                                          : std::move(prompt_tokens[i]),
+                                      sp_of(i),
+                                      Priority::NORMAL,
+                                      /*stream=*/false,
+                                      callback);
+        if (!request) {
+          continue;
+        }
+        auto* scheduler = route(request.get());
+        while (!scheduler->schedule(request)) {
+          absl::SleepFor(absl::Milliseconds(1));
+        }
+      }
+      feeders.DecrementCount();
+    });
+  }
+
+  run_until_complete();
+  feeders.Wait();
+
+  // convert the outputs into columns
+  BatchOutput batch;
+  batch.offsets.reserve(num_requests + 1);
+  batch.statuses.reserve(num_requests);
+  batch.num_prompt_tokens.reserve(num_requests);
+  batch.num_generated_tokens.reserve(num_requests);
+  batch.offsets.push_back(0);
+  for (auto& output : outputs) {
+    if (!output.has_value()) {
+      output.emplace(Status{StatusCode::UNKNOWN, "No output received"});
+    }
+    for (auto& seq_output : output->outputs) {
+      batch.texts.push_back(std::move(seq_output.text));
+      batch.token_ids.push_back(std::move(seq_output.token_ids));
+      batch.token_logprobs.push_back(std::move(seq_output.token_logprobs));
+      batch.finish_reasons.push_back(std::move(seq_output.finish_reason));
+    }
+    batch.offsets.push_back(batch.texts.size());
+    batch.statuses.push_back(output->status.value_or(Status()));
+    const Usage usage = output->usage.value_or(Usage());
+    batch.num_prompt_tokens.push_back(usage.num_prompt_tokens);
+    batch.num_generated_tokens.push_back(usage.num_generated_tokens);
+  }
+  return batch;
+}
+
 std::future<bool> LLMHandler::schedule(std::string prompt,
+                                       std::vector<int32_t> prompt_tokens,
                                        SamplingParams sp,
                                        Priority priority,
                                        bool stream,
-                                       OutputCallback callback) {
+                                       OutputCallback callback,
+                                       BacklogCallback is_backlogged,
+                                       CancelCallback is_cancelled) {
   std::promise<bool> promise;
   auto future = promise.get_future();
   // add into the queue
-  queue_.push([this,
-               promise = std::move(promise),
-               prompt = std::move(prompt),
-               sp = std::move(sp),
-               priority,
-               stream,
-               callback = std::move(callback)](size_t tid) mutable {
+  handling_threadpool_->schedule([this,
+                                  promise = std::move(promise),
+                                  prompt = std::move(prompt),
+                                  prompt_tokens = std::move(prompt_tokens),
+                                  sp = std::move(sp),
+                                  priority,
+                                  stream,
+                                  callback = std::move(callback),
+                                  is_backlogged = std::move(is_backlogged),
+                                  is_cancelled =
+                                      std::move(is_cancelled)]() mutable {
+    const size_t tid = ThreadPool::current_thread_index();
     AUTO_COUNTER(completion_handling_latency_seconds);
 
     // remove the pending request after scheduling
     SCOPE_GUARD([this] { scheduler_->dec_pending_requests(); });
 
+    if (draining_.load(std::memory_order_relaxed)) {
+      CALLBACK_WITH_ERROR(StatusCode::UNAVAILABLE, "Server is draining");
+      promise.set_value(false);
+      return;
+    }
+
     Timer timer;
+    // drop the request before tokenizing it if the client has gone away
+    if (is_cancelled != nullptr && is_cancelled()) {
+      CALLBACK_WITH_ERROR(StatusCode::CANCELLED, "Request cancelled");
+      promise.set_value(false);
+      return;
+    }
+
     // verify the prompt
     if (!verify_params(sp, callback)) {
       promise.set_value(false);
       return;
     }
 
-    auto request =
-        create_request(tid, std::move(prompt), sp, priority, stream, callback);
+    auto request = create_request(tid,
+                                  std::move(prompt),
+                                  std::move(prompt_tokens),
+                                  sp,
+                                  priority,
+                                  stream,
+                                  callback);
     if (!request) {
       promise.set_value(false);
       return;
     }
+    request->is_output_backlogged = std::move(is_backlogged);
+    request->is_client_cancelled = std::move(is_cancelled);
 
-    if (!scheduler_->schedule(request)) {
+    if (serve_from_response_cache(sp, request.get(), &callback)) {
+      promise.set_value(true);
+      return;
+    }
+
+    auto* scheduler = route(request.get());
+    if (!admit(*scheduler, request.get(), priority, callback)) {
+      promise.set_value(false);
+      return;
+    }
+
+    if (!scheduler->schedule(request)) {
       CALLBACK_WITH_ERROR(StatusCode::RESOURCE_EXHAUSTED,
                           "No available resources to schedule request");
       promise.set_value(false);
@@ -391,21 +1215,41 @@ std::future<bool> LLMHandler::schedule(std::vector<Message> messages,
                                        SamplingParams sp,
                                        Priority priority,
                                        bool stream,
-                                       OutputCallback callback) {
+                                       OutputCallback callback,
+                                       BacklogCallback is_backlogged,
+                                       CancelCallback is_cancelled) {
   std::promise<bool> promise;
   auto future = promise.get_future();
   // add into the queue
-  queue_.push([this,
-               promise = std::move(promise),
-               messages = std::move(messages),
-               sp = std::move(sp),
-               priority,
-               stream,
-               callback = std::move(callback)](size_t tid) mutable {
+  handling_threadpool_->schedule([this,
+                                  promise = std::move(promise),
+                                  messages = std::move(messages),
+                                  sp = std::move(sp),
+                                  priority,
+                                  stream,
+                                  callback = std::move(callback),
+                                  is_backlogged = std::move(is_backlogged),
+                                  is_cancelled =
+                                      std::move(is_cancelled)]() mutable {
+    const size_t tid = ThreadPool::current_thread_index();
     AUTO_COUNTER(chat_handling_latency_seconds);
     // remove the pending request after scheduling
     SCOPE_GUARD([this] { scheduler_->dec_pending_requests(); });
 
+    if (draining_.load(std::memory_order_relaxed)) {
+      CALLBACK_WITH_ERROR(StatusCode::UNAVAILABLE, "Server is draining");
+      promise.set_value(false);
+      return;
+    }
+
+    // drop the request before applying the chat template if the client has
+    // gone away
+    if (is_cancelled != nullptr && is_cancelled()) {
+      CALLBACK_WITH_ERROR(StatusCode::CANCELLED, "Request cancelled");
+      promise.set_value(false);
+      return;
+    }
+
     // verify the prompt
     if (!verify_params(sp, callback)) {
       promise.set_value(false);
@@ -418,8 +1262,21 @@ std::future<bool> LLMHandler::schedule(std::vector<Message> messages,
       promise.set_value(false);
       return;
     }
+    request->is_output_backlogged = std::move(is_backlogged);
+    request->is_client_cancelled = std::move(is_cancelled);
 
-    if (!scheduler_->schedule(request)) {
+    if (serve_from_response_cache(sp, request.get(), &callback)) {
+      promise.set_value(true);
+      return;
+    }
+
+    auto* scheduler = route(request.get());
+    if (!admit(*scheduler, request.get(), priority, callback)) {
+      promise.set_value(false);
+      return;
+    }
+
+    if (!scheduler->schedule(request)) {
       CALLBACK_WITH_ERROR(StatusCode::RESOURCE_EXHAUSTED,
                           "No available resources to schedule request");
       promise.set_value(false);
@@ -430,23 +1287,13 @@ std::future<bool> LLMHandler::schedule(std::vector<Message> messages,
   return future;
 }
 
-void LLMHandler::handling_loop(size_t tid) {
-  while (true) {
-    Task task = queue_.pop();
-    if (task == nullptr) {
-      // nullptr is a signal to exit
-      break;
-    }
-    task(tid);
-  }
-}
-
 void LLMHandler::start() {
   loop_thread_ = std::thread([this]() {
     const bool running = running_.load(std::memory_order_relaxed);
     CHECK(!running) << "Handler is already running";
 
     running_.store(true, std::memory_order_relaxed);
+    set_current_thread_affinity(scheduler_cpus_);
     const auto timeout = absl::Milliseconds(500);
     while (!stoped_.load(std::memory_order_relaxed)) {
       // move scheduler forward
@@ -454,6 +1301,26 @@ void LLMHandler::start() {
     }
     running_.store(false, std::memory_order_relaxed);
   });
+
+  if (decode_scheduler_ != nullptr) {
+    decode_loop_thread_ = std::thread([this]() {
+      set_current_thread_affinity(scheduler_cpus_);
+      const auto timeout = absl::Milliseconds(500);
+      while (!stoped_.load(std::memory_order_relaxed)) {
+        decode_scheduler_->step(timeout);
+      }
+    });
+  }
+
+  for (auto& replica_scheduler : replica_schedulers_) {
+    replica_loop_threads_.emplace_back([this, s = replica_scheduler.get()]() {
+      set_current_thread_affinity(scheduler_cpus_);
+      const auto timeout = absl::Milliseconds(500);
+      while (!stoped_.load(std::memory_order_relaxed)) {
+        s->step(timeout);
+      }
+    });
+  }
 }
 
 // stop the engine
@@ -464,6 +1331,13 @@ void LLMHandler::stop() {
   if (loop_thread_.joinable()) {
     loop_thread_.join();
   }
+  if (decode_loop_thread_.joinable()) {
+    decode_loop_thread_.join();
+  }
+  for (auto& thread : replica_loop_threads_) {
+    thread.join();
+  }
+  replica_loop_threads_.clear();
 }
 
 void LLMHandler::run_until_complete() {
@@ -471,45 +1345,553 @@ void LLMHandler::run_until_complete() {
   CHECK(!running) << "Handler is already running";
 
   running_.store(true, std::memory_order_relaxed);
-  scheduler_->run_until_complete();
+  if (!replica_schedulers_.empty()) {
+    // the pending requests are counted by scheduler_, which completes once
+    // they are all routed. the replicas are stepped alongside until then.
+    std::atomic_bool routing_done{false};
+    std::vector<std::thread> replica_threads;
+    for (auto& replica_scheduler : replica_schedulers_) {
+      replica_threads.emplace_back(
+          [&routing_done, s = replica_scheduler.get()]() {
+            const auto timeout = absl::Milliseconds(10);
+            while (!routing_done.load(std::memory_order_relaxed)) {
+              s->step(timeout);
+            }
+            s->run_until_complete();
+          });
+    }
+    scheduler_->run_until_complete();
+    routing_done.store(true, std::memory_order_relaxed);
+    for (auto& thread : replica_threads) {
+      thread.join();
+    }
+  } else if (decode_scheduler_ == nullptr) {
+    scheduler_->run_until_complete();
+  } else {
+    // step the decode scheduler alongside, the prefill scheduler completes
+    // once all handed over requests are ingested by the decode scheduler.
+    std::atomic_bool prefill_done{false};
+    std::thread decode_thread([this, &prefill_done]() {
+      const auto timeout = absl::Milliseconds(10);
+      while (!prefill_done.load(std::memory_order_relaxed)) {
+        decode_scheduler_->step(timeout);
+      }
+    });
+    scheduler_->run_until_complete();
+    prefill_done.store(true, std::memory_order_relaxed);
+    decode_thread.join();
+    decode_scheduler_->run_until_complete();
+  }
   running_.store(false, std::memory_order_relaxed);
 }
 
-std::unique_ptr<Request> LLMHandler::create_request(size_t tid,
-                                                    std::string prompt,
-                                                    const SamplingParams& sp,
-                                                    Priority priority,
-                                                    bool stream,
-                                                    OutputCallback callback) {
-  if (prompt.empty()) {
-    CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT, "Prompt is empty");
+void LLMHandler::warmup() {
+  CHECK(!running_.load(std::memory_order_relaxed))
+      << "Handler is already running";
+  Timer timer;
+
+  // cycle through greedy, top-k/top-p, penalties and logprobs
+  std::vector<SamplingParams> sps(4);
+  sps[0].temperature = 0;
+  sps[1].temperature = 0.7;
+  sps[1].top_p = 0.9;
+  sps[1].top_k = 50;
+  sps[2].frequency_penalty = 0.5;
+  sps[2].presence_penalty = 0.5;
+  sps[2].repetition_penalty = 1.1;
+  sps[3].temperature = 0;
+  sps[3].logprobs = true;
+  sps[3].top_logprobs = 5;
+  for (auto& sp : sps) {
+    sp.ignore_eos = true;
+  }
+
+  // each round is run to completion on its own to hit its shapes
+  struct Round {
+    size_t n_requests = 0;
+    size_t prompt_len = 0;
+    uint32_t max_tokens = 0;
+  };
+  std::vector<Round> rounds;
+  const size_t max_context_len = model_args_.max_position_embeddings();
+  const size_t max_tokens_per_batch = options_.max_tokens_per_batch();
+  // prefill lengths by powers of two, up to a prompt of two chunks
+  for (size_t len = 32;
+       len <= 2 * max_tokens_per_batch && len + 1 < max_context_len;
+       len *= 2) {
+    rounds.push_back({/*n_requests=*/1, len, /*max_tokens=*/1});
+  }
+  // decode batch sizes of the cuda graphs, or by powers of two
+  const size_t max_seqs = options_.max_seqs_per_batch();
+  std::vector<uint32_t> batch_sizes =
+      options_.cuda_graph_batch_sizes().value_or(std::vector<uint32_t>{});
+  if (batch_sizes.empty()) {
+    for (uint32_t n = 1; n <= max_seqs; n *= 2) {
+      batch_sizes.push_back(n);
+    }
+  }
+  for (const uint32_t n : batch_sizes) {
+    rounds.push_back({std::min<size_t>(n, max_seqs),
+                      /*prompt_len=*/16,
+                      /*max_tokens=*/8});
+  }
+
+  const size_t vocab_size = engine_->tokenizer()->vocab_size();
+  size_t n_requests = 0;
+  for (const auto& round : rounds) {
+    if (round.prompt_len + round.max_tokens >= max_context_len) {
+      continue;
+    }
+    for (size_t i = 0; i < round.n_requests; ++i, ++n_requests) {
+      SamplingParams sp = sps[n_requests % sps.size()];
+      sp.max_tokens = round.max_tokens;
+      // distinct prompts to miss the prefix cache
+      std::vector<int32_t> prompt_tokens(round.prompt_len);
+      for (size_t j = 0; j < prompt_tokens.size(); ++j) {
+        prompt_tokens[j] =
+            static_cast<int32_t>((n_requests * 7919 + j) % vocab_size);
+      }
+      // every replica runs the round
+      for (auto* scheduler : schedulers()) {
+        auto request = create_request(
+            /*tid=*/0,
+            "warmup",
+            prompt_tokens,
+            sp,
+            Priority::NORMAL,
+            /*stream=*/false,
+            [](const RequestOutput& /*output*/) { return true; });
+        if (request == nullptr || !scheduler->schedule(request)) {
+          LOG(WARNING) << "Failed to schedule the warmup request";
+        }
+      }
+    }
+    run_until_complete();
+  }
+  LOG(INFO) << "Warmed up with " << n_requests << " requests in "
+            << timer.elapsed_seconds() << "s";
+}
+
+LoadReport LLMHandler::load_report() const {
+  LoadReport report = scheduler_->load_report();
+  if (decode_scheduler_ != nullptr) {
+    // new requests wait for the prefill scheduler only
+    const LoadReport decode_report = decode_scheduler_->load_report();
+    report.num_running_requests += decode_report.num_running_requests;
+    report.num_running_sequences += decode_report.num_running_sequences;
+    report.num_running_tokens += decode_report.num_running_tokens;
+  }
+  if (!replica_schedulers_.empty()) {
+    // the replicas add up to a larger engine, whose throughput is the sum
+    // of theirs
+    double tokens_per_second =
+        report.latency_per_token > 0 ? 1.0 / report.latency_per_token : 0;
+    for (const auto& replica_scheduler : replica_schedulers_) {
+      const LoadReport replica = replica_scheduler->load_report();
+      report.num_waiting_requests += replica.num_waiting_requests;
+      report.num_waiting_tokens += replica.num_waiting_tokens;
+      report.num_waiting_blocks += replica.num_waiting_blocks;
+      report.num_running_requests += replica.num_running_requests;
+      report.num_running_sequences += replica.num_running_sequences;
+      report.num_running_tokens += replica.num_running_tokens;
+      report.num_free_blocks += replica.num_free_blocks;
+      report.num_total_blocks += replica.num_total_blocks;
+      report.block_release_rate += replica.block_release_rate;
+      report.max_tokens_per_batch += replica.max_tokens_per_batch;
+      report.num_decode_tokens += replica.num_decode_tokens;
+      if (replica.latency_per_token > 0) {
+        tokens_per_second += 1.0 / replica.latency_per_token;
+      }
+    }
+    report.latency_per_token =
+        tokens_per_second > 0 ? 1.0 / tokens_per_second : 0;
+  }
+  return report;
+}
+
+bool LLMHandler::is_idle() const {
+  for (const auto* scheduler : schedulers()) {
+    if (!scheduler->is_idle()) {
+      return false;
+    }
+  }
+  return decode_scheduler_ == nullptr || decode_scheduler_->is_idle();
+}
+
+bool LLMHandler::offload_weights() {
+  bool ok = engine_->offload_weights();
+  for (auto& replica_engine : replica_engines_) {
+    ok = replica_engine->offload_weights() && ok;
+  }
+  return ok;
+}
+
+bool LLMHandler::reload_weights() {
+  bool ok = engine_->reload_weights();
+  for (auto& replica_engine : replica_engines_) {
+    ok = replica_engine->reload_weights() && ok;
+  }
+  return ok;
+}
+
+ContinuousScheduler* LLMHandler::route(Request* request) {
+  if (router_ == nullptr) {
+    return scheduler_.get();
+  }
+  const size_t num_tokens = request->prompt_tokens.size();
+  const size_t replica = router_->route(request->prompt_tokens, num_tokens);
+  // the callback is destroyed with the request
+  std::shared_ptr<void> release(
+      nullptr, [router = router_.get(), replica, num_tokens](void*) {
+        router->release(replica, num_tokens);
+      });
+  request->on_output = [release = std::move(release),
+                        on_output = std::move(request->on_output)](
+                           const RequestOutput& output) {
+    return on_output(output);
+  };
+  return replica == 0 ? scheduler_.get()
+                      : replica_schedulers_[replica - 1].get();
+}
+
+std::vector<ContinuousScheduler*> LLMHandler::schedulers() const {
+  std::vector<ContinuousScheduler*> schedulers = {scheduler_.get()};
+  for (const auto& replica_scheduler : replica_schedulers_) {
+    schedulers.push_back(replica_scheduler.get());
+  }
+  return schedulers;
+}
+
+void LLMHandler::start_draining() {
+  draining_.store(true, std::memory_order_relaxed);
+}
+
+bool LLMHandler::drain(absl::Duration timeout) {
+  start_draining();
+  const absl::Time deadline = absl::Now() + timeout;
+  while (!is_idle()) {
+    if (absl::Now() >= deadline) {
+      return false;
+    }
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  return true;
+}
+
+std::string LLMHandler::export_kv_cache(const std::vector<int32_t>& token_ids,
+                                        bool quantize) {
+  // the prefix may be cached by any replica, the longest one is exported
+  std::vector<folly::SemiFuture<std::string>> futures;
+  for (auto* scheduler : schedulers()) {
+    futures.push_back(scheduler->export_prefix_cache(token_ids, quantize));
+  }
+  if (!loop_thread_.joinable()) {
+    // the task runs in the scheduling loop
+    run_until_complete();
+  }
+  std::string buffer;
+  for (auto& future : futures) {
+    std::string replica_buffer = std::move(future).get();
+    if (replica_buffer.size() > buffer.size()) {
+      buffer = std::move(replica_buffer);
+    }
+  }
+  return buffer;
+}
+
+size_t LLMHandler::import_kv_cache(const std::string& buffer) {
+  // imported into every replica, so that the requests sharing the prefix
+  // skip its prefill wherever they are routed
+  std::vector<folly::SemiFuture<size_t>> futures;
+  for (auto* scheduler : schedulers()) {
+    futures.push_back(scheduler->import_prefix_cache(buffer));
+  }
+  if (!loop_thread_.joinable()) {
+    // the task runs in the scheduling loop
+    run_until_complete();
+  }
+  size_t n_tokens = 0;
+  for (auto& future : futures) {
+    n_tokens = std::max(n_tokens, std::move(future).get());
+  }
+  return n_tokens;
+}
+
+bool LLMHandler::resize_kv_cache(int64_t n_blocks) {
+  std::vector<folly::SemiFuture<bool>> futures;
+  for (auto* scheduler : schedulers()) {
+    futures.push_back(scheduler->resize_kv_cache(n_blocks));
+  }
+  if (!loop_thread_.joinable()) {
+    // the task runs in the scheduling loop
+    run_until_complete();
+  }
+  bool ok = true;
+  for (auto& future : futures) {
+    ok = std::move(future).get() && ok;
+  }
+  return ok;
+}
+
+bool LLMHandler::encode_prompt(size_t tid,
+                               const std::string& prompt,
+                               std::vector<int32_t>* prompt_tokens) {
+  const auto& tokenizer = tokenizers_[tid];
+  if (prompt_cache_ == nullptr) {
+    // split long prompts into pieces to encode in parallel
+    return encoder_ != nullptr && prompt.size() > encoder_->piece_size()
+               ? encoder_->encode(prompt, prompt_tokens)
+               : tokenizer->encode(prompt, prompt_tokens);
+  }
+
+  // reuse the ids of the cached leading pieces, and only encode the rest
+  const auto pieces =
+      tokenizer->split_pieces(prompt, prompt_cache_->piece_size());
+  const size_t n_matched = prompt_cache_->match(pieces, prompt_tokens);
+  COUNTER_ADD(prompt_cache_matched_tokens_total, prompt_tokens->size());
+
+  const std::vector<std::string_view> rest(pieces.begin() + n_matched,
+                                           pieces.end());
+  const size_t rest_size =
+      rest.empty() ? 0 : prompt.data() + prompt.size() - rest.front().data();
+  const bool first_piece = n_matched == 0;
+  std::vector<std::vector<int32_t>> rest_ids;
+  if (encoder_ != nullptr && rest_size > encoder_->piece_size()) {
+    if (!encoder_->encode_pieces(rest, first_piece, &rest_ids)) {
+      return false;
+    }
+  } else {
+    rest_ids.resize(rest.size());
+    for (size_t i = 0; i < rest.size(); ++i) {
+      if (!tokenizer->encode_piece(
+              rest[i], first_piece && i == 0, &rest_ids[i])) {
+        return false;
+      }
+    }
+  }
+  for (const auto& ids : rest_ids) {
+    prompt_tokens->insert(prompt_tokens->end(), ids.begin(), ids.end());
+  }
+
+  // skip the last piece, which runs to the end of the prompt and is split
+  // differently in longer prompts.
+  if (!rest_ids.empty()) {
+    rest_ids.pop_back();
+    prompt_cache_->insert(pieces, n_matched, rest_ids);
+  }
+  return true;
+}
+
+bool LLMHandler::serve_from_response_cache(const SamplingParams& sp,
+                                           Request* request,
+                                           OutputCallback* callback) {
+  if (response_cache_ == nullptr) {
+    return false;
+  }
+  const std::string key = response_cache_key(*request, sp);
+  if (key.empty()) {
+    return false;
+  }
+
+  RequestOutput output;
+  if (response_cache_->lookup(key, &output)) {
+    COUNTER_INC(response_cache_hits_total);
+    (*callback)(std::move(output));
+    return true;
+  }
+  // wait for the output of the identical request in flight
+  if (response_cache_->join(key, *callback)) {
+    COUNTER_INC(response_cache_coalesced_total);
+    return true;
+  }
+
+  // run the request, and pass its final output to the cache and the waiting
+  // requests. non-streaming requests only output once at the end or on
+  // errors, including the errors of admitting or scheduling the request.
+  auto* cache = response_cache_.get();
+  *callback = [cache, key, on_output = std::move(*callback)](
+                  RequestOutput output) {
+    cache->complete(key, output);
+    return on_output(std::move(output));
+  };
+  request->on_output = *callback;
+  // the request is shared, only cancel it if no one else waits for it
+  if (request->is_client_cancelled != nullptr) {
+    request->is_client_cancelled =
+        [cache, key, is_cancelled = std::move(request->is_client_cancelled)]() {
+          return is_cancelled() && !cache->has_waiters(key);
+        };
+  }
+  return false;
+}
+
+bool LLMHandler::admit(const ContinuousScheduler& scheduler,
+                       Request* request,
+                       Priority priority,
+                       const OutputCallback& callback) {
+  if (options_.max_estimated_ttft_ms() <= 0 &&
+      !options_.clamp_max_tokens_to_kv_cache()) {
+    return true;
+  }
+  const LoadReport load = scheduler.load_report();
+  const size_t prompt_len = request->prompt_tokens.size();
+  if (options_.max_estimated_ttft_ms() > 0 && priority != Priority::HIGH) {
+    const double ttft_ms = load.estimated_ttft_seconds(prompt_len) * 1000;
+    if (ttft_ms > options_.max_estimated_ttft_ms()) {
+      COUNTER_INC(shed_requests_total);
+      CALLBACK_WITH_ERROR(
+          StatusCode::UNAVAILABLE,
+          absl::StrCat("Server is overloaded, estimated time to first token ",
+                       static_cast<int64_t>(ttft_ms),
+                       "ms"));
+      return false;
+    }
+  }
+
+  if (options_.clamp_max_tokens_to_kv_cache() && load.block_size > 0) {
+    // the sequences share the blocks of the prompt
+    const size_t num_seqs = std::max(request->n, request->best_of);
+    const size_t headroom = load.num_headroom_blocks() * load.block_size;
+    auto& max_tokens = request->stopping_criteria.max_tokens;
+    if (headroom > prompt_len) {
+      const size_t max_fit_tokens = (headroom - prompt_len) / num_seqs;
+      if (max_fit_tokens > 0 && max_fit_tokens < max_tokens) {
+        COUNTER_INC(clamped_requests_total);
+        max_tokens = max_fit_tokens;
+      }
+    }
+  }
+  return true;
+}
+
+std::shared_ptr<const TokenGrammar> LLMHandler::create_grammar(
+    const SamplingParams& sp,
+    OutputCallback callback) {
+  if (grammar_cache_ == nullptr) {
+    CALLBACK_WITH_ERROR(StatusCode::UNIMPLEMENTED,
+                        "Constrained output is not supported");
     return nullptr;
   }
 
-  // encode the prompt
-  Timer timer;
-  std::vector<int> prompt_tokens;
-  if (!tokenizers_[tid]->encode(prompt, &prompt_tokens)) {
-    LOG(ERROR) << "Failed to encode prompt: " << prompt;
+  std::string error;
+  std::string regex;
+  if (sp.json_schema.has_value()) {
+    auto schema_regex = json_schema_to_regex(sp.json_schema.value(), &error);
+    if (!schema_regex.has_value()) {
+      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                          "Invalid json schema: " + error);
+      return nullptr;
+    }
+    regex = std::move(schema_regex.value());
+  } else if (sp.json_object) {
+    regex = json_object_regex();
+  } else {
+    regex = sp.regex.value();
+  }
+
+  auto grammar = grammar_cache_->get(regex, &error);
+  if (grammar == nullptr) {
     CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
-                        "Failed to encode prompt");
+                        "Invalid regex: " + error);
     return nullptr;
   }
-  COUNTER_ADD(tokenization_latency_seconds, timer.elapsed_seconds());
+  return grammar;
+}
 
-  const int64_t max_context_len = model_args_.max_position_embeddings();
-  if (prompt_tokens.size() >= max_context_len) {
-    LOG(ERROR) << "Prompt is too long: " << prompt_tokens.size();
-    CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT, "Prompt is too long");
+std::unique_ptr<Request> LLMHandler::create_request(
+    size_t tid,
+    std::string prompt,
+    std::vector<int32_t> prompt_tokens,
+    const SamplingParams& sp,
+    Priority priority,
+    bool stream,
+    OutputCallback callback,
+    std::shared_ptr<const std::vector<ImageInput>> images) {
+  if (prompt.empty()) {
+    CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT, "Prompt is empty");
     return nullptr;
   }
 
+  // encode the prompt if not encoded yet
+  if (prompt_tokens.empty()) {
+    Timer timer;
+    if (!encode_prompt(tid, prompt, &prompt_tokens)) {
+      LOG(ERROR) << "Failed to encode prompt: " << prompt;
+      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                          "Failed to encode prompt");
+      return nullptr;
+    }
+    COUNTER_ADD(tokenization_latency_seconds, timer.elapsed_seconds());
+  }
+
   uint32_t max_tokens = sp.max_tokens;
   if (max_tokens == 0) {
     const uint32_t kDefaultMaxTokens = 16;
     max_tokens = kDefaultMaxTokens;
   }
 
+  const int64_t max_context_len = model_args_.max_position_embeddings();
+  if (sp.truncate_prompt_keep_first >= 0) {
+    // leave room for the max tokens and the speculative tokens
+    const int64_t max_prompt_len = max_context_len - max_tokens -
+                                   options_.num_speculative_tokens() - 1;
+    if (sp.truncate_prompt_keep_first >= max_prompt_len) {
+      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                          "No room for recent tokens after the first tokens");
+      return nullptr;
+    }
+    if (prompt_tokens.size() > max_prompt_len) {
+      drop_middle_tokens(
+          sp.truncate_prompt_keep_first, max_prompt_len, &prompt_tokens);
+    }
+  }
+  if (prompt_tokens.size() >= max_context_len) {
+    LOG(ERROR) << "Prompt is too long: " << prompt_tokens.size();
+    CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT, "Prompt is too long");
+    return nullptr;
+  }
+
+  int32_t lora_id = -1;
+  if (sp.lora_adapter.has_value()) {
+    lora_id = engine_->lora_adapter_id(sp.lora_adapter.value());
+    if (lora_id < 0) {
+      CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                          "Unknown lora adapter: " + sp.lora_adapter.value());
+      return nullptr;
+    }
+  }
+
+  if (sp.beam_width > 0 && options_.num_speculative_tokens() > 0) {
+    CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                        "beam search is not supported with speculative "
+                        "decoding");
+    return nullptr;
+  }
+
+  if (!sp.pooling.empty() && options_.num_speculative_tokens() > 0) {
+    CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                        "embeddings are not supported with speculative "
+                        "decoding");
+    return nullptr;
+  }
+
+  // the prompt echoed back is scored with the logits of the prefill
+  const bool prompt_logprobs = sp.echo && sp.logprobs;
+  if (prompt_logprobs && options_.num_speculative_tokens() > 0) {
+    CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                        "logprobs with echo is not supported with speculative "
+                        "decoding");
+    return nullptr;
+  }
+
+  std::shared_ptr<const TokenGrammar> grammar;
+  if (sp.json_schema.has_value() || sp.json_object || sp.regex.has_value()) {
+    grammar = create_grammar(sp, callback);
+    if (grammar == nullptr) {
+      return nullptr;
+    }
+  }
+
   // allocate enough capacity for prompt tokens, max tokens, and speculative
   // tokens
   const size_t capacity = prompt_tokens.size() + max_tokens +
@@ -536,8 +1918,22 @@ std::unique_ptr<Request> LLMHandler::create_request(size_t tid,
     // enable logprobs for best_of to generate sequence logprob
     sampling_param.logprobs = true;
   }
-  // sampling_param.do_sample = sp.do_sample;
-  // sampling_param.seed = sp.seed;
+  if (sp.beam_width > 0) {
+    // the beams are continued with the top tokens of each step, two per beam
+    // to keep beam_width beams besides the ones ending the text.
+    sampling_param.temperature = 0;
+    sampling_param.top_p = 1.0;
+    sampling_param.top_k = -1;
+    sampling_param.logprobs = true;
+    sampling_param.top_logprobs =
+        std::max<int64_t>(sp.top_logprobs, 2 * sp.beam_width);
+  }
+  if (!set_logit_bias(sp, model_args_.vocab_size(), &sampling_param)) {
+    CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                        "Token id out of the vocabulary");
+    return nullptr;
+  }
+  sampling_param.seed = sp.seed;
 
   // stopping criteria
   auto& stopping_criteria = request->stopping_criteria;
@@ -567,24 +1963,105 @@ std::unique_ptr<Request> LLMHandler::create_request(size_t tid,
       }
       stopping_criteria.stop_sequences.push_back(std::move(stop_tokens));
     }
+    stopping_criteria.build_stop_sequence_matcher();
   }
 
-  // results cannot be streamed when best_of != n
-  if (best_of != sp.n) {
+  // results cannot be streamed when best_of != n, with beam search or for
+  // embeddings
+  if (best_of != sp.n || sp.beam_width > 0 || !sp.pooling.empty()) {
     stream = false;
   }
   request->stream = stream;
   request->priority = priority;
   request->echo = sp.echo;
+  request->prompt_logprobs = prompt_logprobs;
+  request->detokenize = sp.detokenize;
+  request->lora_id = lora_id;
+  request->tenant = sp.tenant;
+  request->grammar = std::move(grammar);
+  request->beam_width = sp.beam_width;
+  if (sp.pooling == "mean") {
+    request->pooling = PoolingType::MEAN;
+  } else if (sp.pooling == "last") {
+    request->pooling = PoolingType::LAST;
+  }
 
   // set callback for outputs
   request->on_output = callback;
+  request->images = std::move(images);
 
   // add one sequence, rest will be added by scheduler
   request->add_sequence();
   return request;
 }
 
+bool LLMHandler::encode_session_turn(size_t tid,
+                                     const std::vector<Message>& messages,
+                                     std::vector<int32_t>* token_ids,
+                                     std::string* prompt) {
+  if (chat_template_ == nullptr) {
+    LOG(ERROR) << "Chat template has not configured for model type: "
+               << model_args_.model_type();
+    return false;
+  }
+  Timer timer;
+  if (token_ids->empty()) {
+    // the first turn is rendered as a whole conversation
+    auto text = chat_template_->apply(messages);
+    if (!text.has_value()) {
+      return false;
+    }
+    COUNTER_ADD(chat_template_latency_seconds, timer.elapsed_seconds());
+    *prompt = std::move(text.value());
+    timer.reset();
+    if (!encode_prompt(tid, *prompt, token_ids)) {
+      return false;
+    }
+    COUNTER_ADD(tokenization_latency_seconds, timer.elapsed_seconds());
+    return true;
+  }
+
+  // render the messages after a placeholder turn, and cut off the rendering
+  // up to the end of the placeholder reply, so that the messages are rendered
+  // the same as after the history.
+  const std::string marker(kSessionTurnMarker);
+  std::vector<Message> turn = {{"user", marker}, {"assistant", marker}};
+  turn.insert(turn.end(), messages.begin(), messages.end());
+  const auto text = chat_template_->apply(turn);
+  if (!text.has_value()) {
+    return false;
+  }
+  const size_t first = text->find(marker);
+  const size_t second = first == std::string::npos
+                            ? std::string::npos
+                            : text->find(marker, first + marker.size());
+  if (second == std::string::npos) {
+    LOG(ERROR) << "Chat template can't render the turns of a session";
+    return false;
+  }
+  *prompt = text->substr(second + marker.size());
+  COUNTER_ADD(chat_template_latency_seconds, timer.elapsed_seconds());
+
+  timer.reset();
+  const auto& tokenizer = tokenizers_[tid];
+  std::vector<int32_t> ids;
+  if (!tokenizer->encode_piece(*prompt, /*first_piece=*/false, &ids)) {
+    return false;
+  }
+  // drop the prefix tokens added to any text by some tokenizers
+  std::vector<int32_t> prefix_ids;
+  if (tokenizer->encode_piece("", /*first_piece=*/false, &prefix_ids) &&
+      !prefix_ids.empty() && prefix_ids.size() <= ids.size() &&
+      std::equal(prefix_ids.begin(), prefix_ids.end(), ids.begin())) {
+    ids.erase(ids.begin(), ids.begin() + prefix_ids.size());
+  }
+  // the end of the reply is rendered again if generated by the model
+  const size_t n_overlap = session_turn_overlap(*token_ids, ids);
+  token_ids->insert(token_ids->end(), ids.begin() + n_overlap, ids.end());
+  COUNTER_ADD(tokenization_latency_seconds, timer.elapsed_seconds());
+  return !prompt->empty();
+}
+
 std::unique_ptr<Request> LLMHandler::create_chat_request(
     size_t tid,
     const std::vector<Message>& messages,
@@ -602,6 +2079,11 @@ std::unique_ptr<Request> LLMHandler::create_chat_request(
     return nullptr;
   }
 
+  if (has_images(messages)) {
+    return create_multimodal_chat_request(
+        tid, messages, sp, priority, stream, callback);
+  }
+
   Timer timer;
   auto prompt = chat_template_->apply(messages);
   if (!prompt.has_value()) {
@@ -612,8 +2094,74 @@ std::unique_ptr<Request> LLMHandler::create_chat_request(
   }
   COUNTER_ADD(chat_template_latency_seconds, timer.elapsed_seconds());
 
-  return create_request(
-      tid, std::move(prompt.value()), sp, priority, stream, callback);
+  return create_request(tid,
+                        std::move(prompt.value()),
+                        /*prompt_tokens=*/{},
+                        sp,
+                        priority,
+                        stream,
+                        callback);
+}
+
+std::unique_ptr<Request> LLMHandler::create_multimodal_chat_request(
+    size_t tid,
+    std::vector<Message> messages,
+    const SamplingParams& sp,
+    Priority priority,
+    bool stream,
+    OutputCallback callback) {
+  if (image_processor_ == nullptr) {
+    CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                        "Images are not supported by the model");
+    return nullptr;
+  }
+  if (!ImageProcessor::add_placeholders(&messages)) {
+    CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                        "Messages should have one <image> for each image");
+    return nullptr;
+  }
+
+  Timer timer;
+  auto prompt = chat_template_->apply(messages);
+  if (!prompt.has_value()) {
+    CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                        "Failed to construct prompt from messages");
+    LOG(ERROR) << "Failed to construct prompt from messages";
+    return nullptr;
+  }
+  COUNTER_ADD(chat_template_latency_seconds, timer.elapsed_seconds());
+
+  timer.reset();
+  std::vector<int32_t> prompt_tokens;
+  if (!encode_prompt(tid, prompt.value(), &prompt_tokens)) {
+    CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                        "Failed to encode prompt");
+    return nullptr;
+  }
+  COUNTER_ADD(tokenization_latency_seconds, timer.elapsed_seconds());
+
+  // the images in the order of their placeholders
+  std::vector<const Image*> images;
+  for (const auto& message : messages) {
+    for (const auto& image : message.images) {
+      images.push_back(&image);
+    }
+  }
+  auto image_inputs = std::make_shared<std::vector<ImageInput>>();
+  if (!image_processor_->process(images, &prompt_tokens, image_inputs.get())) {
+    CALLBACK_WITH_ERROR(StatusCode::INVALID_ARGUMENT,
+                        "Invalid images or placeholders in the messages");
+    return nullptr;
+  }
+
+  return create_request(tid,
+                        std::move(prompt.value()),
+                        std::move(prompt_tokens),
+                        sp,
+                        priority,
+                        stream,
+                        callback,
+                        std::move(image_inputs));
 }
 
 std::optional<std::string> LLMHandler::apply_chat_template(
@@ -639,21 +2187,23 @@ std::string LLMHandler::decode(const std::vector<int32_t>& tokens,
 void LLMHandler::reset() {
   stop();
 
-  // stop all handling threads
-  // push nullptr to the queue to signal threads to exit
-  for (size_t i = 0; i < handling_threads_.size(); ++i) {
-    queue_.push(nullptr);
-  }
-  // wait for all threads to finish
-  for (auto& thread : handling_threads_) {
-    thread.join();
-  }
-  handling_threads_.clear();
+  // stop all handling threads after handling the pending tasks
+  handling_threadpool_.reset();
 
   // release all underlying resources
+  // the pending hand overs of scheduler_ still reach the decode scheduler
+  replica_schedulers_.clear();
   scheduler_.reset();
+  decode_scheduler_.reset();
+  router_.reset();
+  replica_engines_.clear();
   engine_.reset();
+  decode_engine_.reset();
   tokenizers_.clear();
+  encoder_.reset();
+  prompt_cache_.reset();
+  response_cache_.reset();
+  session_store_.reset();
   chat_template_.reset();
 
   // torch::cuda::empty_cache();
@@ -1,20 +1,30 @@
 #pragma once
 
+#include <absl/time/time.h>
 #include <folly/Function.h>
 
 #include <functional>
 #include <future>
 #include <memory>
+#include <optional>
 #include <string>
 #include <thread>
 #include <vector>
 
 #include "chat_template/chat_template.h"
-#include "common/concurrent_queue.h"
+#include "common/threadpool.h"
 #include "engine/engine.h"
+#include "grammar/grammar_cache.h"
+#include "image_processor.h"
 #include "request/output.h"
 #include "sampling_params.h"
 #include "scheduler/continuous_scheduler.h"
+#include "scheduler/load_report.h"
+#include "tokenizer/batch_encoder.h"
+#include "replica_router.h"
+#include "response_cache.h"
+#include "session_store.h"
+#include "tokenizer/prompt_cache.h"
 
 namespace llm {
 
@@ -24,6 +34,14 @@ using OutputCallback = std::function<bool(RequestOutput output)>;
 using BatchOutputCallback =
     std::function<bool(size_t index, RequestOutput output)>;
 
+// callback to check whether the client is not draining the streamed outputs,
+// the request is paused while it returns true
+using BacklogCallback = std::function<bool()>;
+
+// callback to check whether the client has gone away, the request is dropped
+// once it returns true. it must not block.
+using CancelCallback = std::function<bool()>;
+
 class BatchFuture {
  public:
   BatchFuture(std::unique_ptr<std::vector<std::future<bool>>> futures)
@@ -50,6 +68,24 @@ class BatchFuture {
   std::unique_ptr<std::vector<std::future<bool>>> futures_;
 };
 
+// outputs of a batch of prompts in columns, see LLMHandler::generate_batch.
+struct BatchOutput {
+  // the sequences of prompt i are in [offsets[i], offsets[i + 1])
+  std::vector<size_t> offsets;
+
+  // per sequence
+  std::vector<std::string> texts;
+  std::vector<std::vector<int32_t>> token_ids;
+  // empty unless the output is not detokenized, see SequenceOutput
+  std::vector<std::vector<float>> token_logprobs;
+  std::vector<std::optional<std::string>> finish_reasons;
+
+  // per prompt
+  std::vector<Status> statuses;
+  std::vector<size_t> num_prompt_tokens;
+  std::vector<size_t> num_generated_tokens;
+};
+
 // NOLINTNEXTLINE
 class LLMHandler {
  public:
@@ -62,19 +98,53 @@ class LLMHandler {
 
     DEFINE_ARG(std::optional<std::string>, draft_devices);
 
+    // devices of a second engine that runs the decodes of the requests
+    // prefilled by the engine on the devices above, with the kv cache pulled
+    // between the engines. disabled if not set.
+    DEFINE_ARG(std::optional<std::string>, decode_devices);
+
     // the number of slots per block, default 16, value must be power of 2
     DEFINE_ARG(int32_t, block_size) = 16;
 
+    // the number of slots per large block of consecutive blocks allocated to
+    // long prompts, a power of 2 multiple of block_size. 0 means disabled.
+    DEFINE_ARG(int32_t, large_block_size) = 0;
+
+    // max number of kv cache tokens kept for each sequence with a longer
+    // prompt, the blocks with the least attention are evicted. 0 to disable.
+    DEFINE_ARG(int32_t, kv_budget) = 0;
+
+    // number of last prompt tokens whose attention ranks the blocks to evict
+    DEFINE_ARG(int32_t, kv_observation_window) = 32;
+
+    // number of most recent blocks of a sequence kept on device when out of
+    // device blocks, the leading ones are offloaded to the host cache and
+    // attended on host. 0 to disable.
+    DEFINE_ARG(int32_t, hybrid_attention_device_blocks) = 0;
+
     // the maximum cache size in bytes, default is 0 which means cache size is
     // caculated by available memory * max_memory_utilization
     DEFINE_ARG(int64_t, max_cache_size) = 0;
 
+    // the host memory size in bytes used to swap out kv cache of preempted
+    // requests, default is 0 which means swapping is disabled
+    DEFINE_ARG(int64_t, host_cache_size) = 0;
+
+    // the max device memory size in bytes to grow the kv cache to at runtime
+    // with resize_kv_cache, default is 0 which means the kv cache has a
+    // fixed size
+    DEFINE_ARG(int64_t, resizable_cache_size) = 0;
+
     // maximum memory utilization allowed, default 0.9
     DEFINE_ARG(double, max_memory_utilization) = 0.9;
 
     // enable prefix cache
     DEFINE_ARG(bool, enable_prefix_cache) = true;
 
+    // data type of kv cache, e.g. auto, int8, fp8
+    // auto means the same data type as the model
+    DEFINE_ARG(std::string, kv_cache_dtype) = "auto";
+
     // enable cuda graph
     DEFINE_ARG(bool, enable_cuda_graph) = true;
 
@@ -88,17 +158,227 @@ class LLMHandler {
     DEFINE_ARG(std::optional<std::vector<uint32_t>>,
                draft_cuda_graph_batch_sizes);
 
+    // quantize the weights of a dense draft checkpoint at load, e.g. "fp8"
+    DEFINE_ARG(std::string, draft_quant_method);
+
+    // numbers of tokens to capture cuda graphs for batches with prefill
+    DEFINE_ARG(std::optional<std::vector<uint32_t>>, cuda_graph_num_tokens);
+
+    // token-count buckets of the piecewise cuda graphs for the batches
+    // without a captured cuda graph, captured at their first use
+    DEFINE_ARG(std::optional<std::vector<uint32_t>>,
+               piecewise_cuda_graph_num_tokens);
+
+    // capture each cuda graph at its first use instead of at startup
+    DEFINE_ARG(bool, lazy_cuda_graph_capture) = false;
+
+    // reserve a private memory pool for the activations of the eager forward
+    // passes at startup, sized by a forward pass of max_tokens_per_batch
+    // tokens.
+    DEFINE_ARG(bool, enable_activation_pool) = false;
+
+    // directory to cache the memory profiling result, empty to disable
+    DEFINE_ARG(std::string, profile_cache_dir);
+
     // the maximum number of tokens per batch
     DEFINE_ARG(int32_t, max_tokens_per_batch) = 256;
 
     // the maximum number of sequences per batch
     DEFINE_ARG(int32_t, max_seqs_per_batch) = 64;
 
+    // the target step time in milliseconds to tune the tokens per batch for
+    // within [min_tokens_per_batch, max_tokens_per_batch], 0 to keep
+    // max_tokens_per_batch fixed.
+    DEFINE_ARG(int64_t, target_step_time_ms) = 0;
+
+    // the lower bound of the tuned tokens per batch
+    DEFINE_ARG(int32_t, min_tokens_per_batch) = 64;
+
     // the number of speculative tokens per step
     DEFINE_ARG(int32_t, num_speculative_tokens) = 0;
 
+    // the number of candidates per speculative position, 1 means a single chain
+    DEFINE_ARG(int32_t, speculative_tree_width) = 1;
+
+    // the source of speculative tokens, e.g. draft, ngram, medusa, lookahead
+    DEFINE_ARG(std::string, speculative_proposer) = "draft";
+
+    // the max n-gram size matched by the ngram proposer, or collected by the
+    // lookahead proposer
+    DEFINE_ARG(int32_t, ngram_max_size) = 3;
+
+    // adapt the number of speculative tokens to the acceptance rate
+    DEFINE_ARG(bool, enable_adaptive_speculation) = false;
+
+    // min acceptance probability of the last speculative token
+    DEFINE_ARG(double, speculative_min_acceptance) = 0.3;
+
+    // turn off speculation at this many decoding sequences, 0 means never
+    DEFINE_ARG(int32_t, speculative_max_batch_size) = 0;
+
+    // the number of decode steps to run on device per scheduler step
+    DEFINE_ARG(int32_t, num_decode_steps) = 1;
+
+    // sample with a single fused kernel when logprobs are not requested
+    DEFINE_ARG(bool, enable_fused_sampling) = false;
+
+    // apply top_k and top_p with pivot search instead of sorting the vocab
+    DEFINE_ARG(bool, enable_pivot_sampling) = false;
+
+    // sample from the vocab shards of the logits with tensor parallelism,
+    // gathering only the top candidates of each shard
+    DEFINE_ARG(bool, enable_vocab_parallel_sampling) = false;
+
+    // min number of kv tokens shared by consecutive sequences to use cascade
+    // attention, which reads the shared prefix once for them. 0 to disable.
+    DEFINE_ARG(int32_t, cascade_min_prefix_len) = 0;
+
+    // number of pipeline stages, the devices are split evenly across them
+    DEFINE_ARG(int32_t, pp_size) = 1;
+
+    // number of micro-batches per step with pipeline parallelism, 0 means
+    // the number of pipeline stages
+    DEFINE_ARG(int32_t, num_micro_batches) = 0;
+
+    // number of data parallel replicas of the model, the devices are split
+    // evenly across them. each replica has its own engine, kv cache and
+    // scheduler, while the tokenizers and the response threads are shared.
+    // the requests are routed by load and prefix cache affinity, see
+    // ReplicaRouter. not supported with speculative decoding, decode devices
+    // or remote workers.
+    DEFINE_ARG(int32_t, data_parallel_size) = 1;
+
+    // comma separated addresses (host:port) of worker services in other
+    // processes, which join the tensor parallel group of the local devices
+    DEFINE_ARG(std::string, remote_workers);
+
+    // directory of the per-rank weights snapshot of the model, loaded instead
+    // of the checkpoint if present, otherwise saved while loading
+    DEFINE_ARG(std::string, weights_snapshot_dir);
+
+    // comma separated name=path pairs of the lora adapters to serve, not
+    // supported with speculative decoding
+    DEFINE_ARG(std::string, lora_adapters);
+
+    // the scheduling policy, e.g. fcfs, slo, wfq, sjf
+    DEFINE_ARG(std::string, scheduling_policy) = "fcfs";
+
+    // the predicted output tokens a waiting request is credited per second
+    // under the sjf policy
+    DEFINE_ARG(double, sjf_aging_tokens_per_second) = 50.0;
+
+    // comma separated tenant=weight pairs for the wfq policy, 1 by default
+    DEFINE_ARG(std::string, tenant_weights);
+
+    // the max fraction of the kv cache a tenant can hold under the wfq policy
+    DEFINE_ARG(double, max_tenant_kv_cache_share) = 1.0;
+
+    // the host to device bandwidth in GB/s to weigh swapping preempted
+    // requests against recomputing them, 0 to always swap if possible
+    DEFINE_ARG(double, swap_bandwidth_gbps) = 16.0;
+
+    // the max number of kv cache blocks copied per decode step to compact the
+    // blocks of running sequences, 0 to disable
+    DEFINE_ARG(int32_t, max_compaction_blocks_per_step) = 0;
+
+    // default time to first token target in milliseconds, 0 means no target
+    DEFINE_ARG(int64_t, ttft_slo_ms) = 0;
+
+    // default inter token latency target in milliseconds, 0 means no target
+    DEFINE_ARG(int64_t, itl_slo_ms) = 0;
+
+    // the number of waiting requests to pick from by their cached prefix
+    // length, 0 or 1 to admit requests in the queue order
+    DEFINE_ARG(int32_t, prefix_admission_window) = 0;
+
+    // the maximum number of times a waiting request can be passed over by the
+    // prefix aware admission
+    DEFINE_ARG(int32_t, max_admission_skips) = 8;
+
+    // hold new requests sharing a prompt prefix with a running prefill until
+    // the prefix is cached instead of computing it again
+    DEFINE_ARG(bool, wait_for_inflight_prefix) = true;
+
+    // the tokens and the sequences per step kept for high priority requests,
+    // the others share the rest. 0 to share the whole budgets.
+    DEFINE_ARG(int32_t, high_priority_reserved_tokens) = 0;
+    DEFINE_ARG(int32_t, high_priority_reserved_seqs) = 0;
+
     // the number of threads to use for handling requests
     DEFINE_ARG(size_t, num_handling_threads) = 4;
+
+    // the number of threads to detokenize and send responses
+    DEFINE_ARG(int32_t, num_response_threads) = 4;
+
+    // the number of threads to encode long prompts in pieces and batches of
+    // prompts in parallel, 0 to encode on the handling threads only.
+    DEFINE_ARG(size_t, num_encode_threads) = 8;
+
+    // max number of token ids of prompt pieces to cache, so that prompts
+    // sharing a long prefix only encode the rest, 0 to disable.
+    DEFINE_ARG(size_t, prompt_cache_tokens) = 1024 * 1024;
+
+    // max number of outputs of deterministic requests to cache, which are
+    // the non-streaming requests with greedy sampling, beam search or
+    // embeddings. repeated requests are served from the cache without
+    // running them, and identical requests in flight share one run. 0 to
+    // disable.
+    DEFINE_ARG(size_t, response_cache_size) = 0;
+
+    // seconds a cached output is served for
+    DEFINE_ARG(int64_t, response_cache_ttl_seconds) = 60;
+
+    // max number of multi-turn chat sessions, whose history is kept as token
+    // ids with the kv cache pinned in the prefix cache between the turns, so
+    // that each turn only sends, renders and encodes its new messages. 0 to
+    // disable sessions.
+    DEFINE_ARG(size_t, max_sessions) = 0;
+
+    // seconds an idle session is kept after its last turn
+    DEFINE_ARG(int64_t, session_ttl_seconds) = 300;
+
+    // the max fraction of the kv cache blocks pinned by the sessions
+    DEFINE_ARG(double, max_session_kv_cache_share) = 0.5;
+
+    // prune the best_of candidates falling behind the n-th best one by this
+    // margin of cumulative logprob, 0 to keep all candidates.
+    DEFINE_ARG(double, best_of_prune_margin) = 0;
+
+    // the number of generated tokens between the prunings of the candidates
+    DEFINE_ARG(int32_t, best_of_prune_interval) = 16;
+
+    // max number of compiled grammars of json schemas and regular expressions
+    // to cache for constrained decoding, 0 to disable constrained decoding.
+    DEFINE_ARG(size_t, max_cached_grammars) = 64;
+
+    // cpus to pin the scheduler threads to as a cpu list, e.g. "0-1", empty
+    // to float freely.
+    DEFINE_ARG(std::string, scheduler_cpus);
+
+    // cpus to pin the handling, encoding and response threads to as a cpu
+    // list. defaults to all cpus but the scheduler cpus if those are set.
+    DEFINE_ARG(std::string, handler_cpus);
+
+    // pin the threads of each worker to the cpus of the numa node of its
+    // device.
+    DEFINE_ARG(bool, numa_affinity) = false;
+
+    // run synthetic requests through the scheduler at startup to pay the lazy
+    // costs of the first requests up front, see warmup().
+    DEFINE_ARG(bool, enable_warmup) = false;
+
+    // refuse the requests whose estimated time to first token is over it in
+    // milliseconds as unavailable, instead of queueing them, so that they
+    // can be retried on another replica. the estimate is from the waiting
+    // work, the kv cache headroom and the current throughput, see
+    // LoadReport::estimated_ttft_seconds. high priority requests are always
+    // admitted as they skip the queue. 0 to disable.
+    DEFINE_ARG(int64_t, max_estimated_ttft_ms) = 0;
+
+    // clamp the max tokens of the requests to the kv cache headroom left
+    // after the waiting requests, so that the admitted requests run to the
+    // end without waiting for blocks or being preempted.
+    DEFINE_ARG(bool, clamp_max_tokens_to_kv_cache) = false;
   };
 
   LLMHandler(const Options& options);
@@ -113,13 +393,40 @@ class LLMHandler {
                                    SamplingParams sp,
                                    Priority priority,
                                    bool stream,
-                                   OutputCallback callback);
+                                   OutputCallback callback,
+                                   BacklogCallback is_backlogged = nullptr,
+                                   CancelCallback is_cancelled = nullptr);
 
-  std::future<bool> schedule_chat_async(std::vector<Message> messages,
-                                        SamplingParams sp,
-                                        Priority priority,
-                                        bool stream,
-                                        OutputCallback callback);
+  std::future<bool> schedule_chat_async(
+      std::vector<Message> messages,
+      SamplingParams sp,
+      Priority priority,
+      bool stream,
+      OutputCallback callback,
+      BacklogCallback is_backlogged = nullptr,
+      CancelCallback is_cancelled = nullptr);
+
+  // open a multi-turn chat session, see Options::max_sessions. returns the
+  // session id, empty if sessions are disabled or too many are open.
+  std::string open_session();
+
+  // close the session and unpin its kv cache, returns false if not open
+  bool close_session(const std::string& session_id);
+
+  // schedule the next turn of the session, the messages are the new ones
+  // since the last turn, e.g. the next user message. only they are rendered
+  // with the chat template and encoded, then appended to the history of the
+  // session, which is extended with the output once the turn finishes. the
+  // session runs one turn at a time with a single sampled sequence.
+  std::future<bool> schedule_session_async(
+      std::string session_id,
+      std::vector<Message> messages,
+      SamplingParams sp,
+      Priority priority,
+      bool stream,
+      OutputCallback callback,
+      BacklogCallback is_backlogged = nullptr,
+      CancelCallback is_cancelled = nullptr);
 
   // batch version
   BatchFuture schedule_batch_async(std::vector<std::string> prompts,
@@ -135,6 +442,14 @@ class LLMHandler {
       bool stream,
       BatchOutputCallback callback);
 
+  // offline version of schedule_batch_async + run_until_complete for
+  // throughput, blocking call. the prompts are encoded in parallel and fed to
+  // the scheduler from the longest to the shortest without streaming, and
+  // the outputs are returned in the order of the prompts.
+  // should not be called while the handling loop is running.
+  BatchOutput generate_batch(std::vector<std::string> prompts,
+                             std::vector<SamplingParams> sps);
+
   // start the handling loop
   void start();
 
@@ -144,6 +459,51 @@ class LLMHandler {
   // run until complete, blocking call
   void run_until_complete();
 
+  // run synthetic requests covering the prefill lengths, the decode batch
+  // sizes and the sampling configs, so that the allocator growth, the library
+  // handles and the workspaces are set up before the first real requests.
+  // called at construction with enable_warmup. blocking call, should not be
+  // called while the handling loop is running.
+  void warmup();
+
+  // stop admitting requests, which fail as unavailable from now on. the
+  // requests in flight keep running.
+  void start_draining();
+
+  // stop admitting requests and wait for the requests in flight to finish,
+  // returns false on timeout. the handling loop should be running.
+  bool drain(absl::Duration timeout);
+
+  // whether requests are refused
+  bool is_draining() const {
+    return draining_.load(std::memory_order_relaxed);
+  }
+
+  // the latest load of the scheduler, e.g. for load aware routing. the
+  // running requests of the decode scheduler are counted if any. thread safe.
+  LoadReport load_report() const;
+
+  // export the kv cache of the longest cached prefix of the token ids, e.g.
+  // the history of a multi-turn session, into a buffer that another replica
+  // of the same model can import. the kv cache is quantized to int8 if
+  // quantize is true. empty if nothing is cached. blocking call, runs the
+  // scheduler until complete if the handling loop is not started.
+  std::string export_kv_cache(const std::vector<int32_t>& token_ids,
+                              bool quantize);
+
+  // import a buffer from export_kv_cache into the prefix cache, so that
+  // requests sharing the prefix skip its prefill. returns the number of newly
+  // cached tokens. blocking call like export_kv_cache.
+  size_t import_kv_cache(const std::string& buffer);
+
+  // grow or shrink the kv cache pool of the engine to n_blocks blocks per
+  // device, up to resizable_cache_size, e.g. to lend device memory to a
+  // colocated model. a shrink waits for the sequences holding the blocks at
+  // the end to finish. the kv cache of the decode engine is not resized.
+  // returns false if not resizable or out of device memory. blocking call
+  // like export_kv_cache.
+  bool resize_kv_cache(int64_t n_blocks);
+
   // helper functions exposed for in python
   // apply the chat template to the conversation and return the result
   std::optional<std::string> apply_chat_template(
@@ -157,16 +517,73 @@ class LLMHandler {
   // release underlying resources
   void reset();
 
+  // whether no request is pending or running, thread safe
+  bool is_idle() const;
+
+  // move the model weights to host memory and back, the kv cache is kept.
+  // should only be called when the handler is idle. returns false if not
+  // supported by the engine.
+  bool offload_weights();
+  bool reload_weights();
+
   const Options& options() const { return options_; }
 
  private:
-  using Task = folly::Function<void(size_t tid)>;
-  std::unique_ptr<Request> create_request(size_t tid,
-                                          std::string prompt,
-                                          const SamplingParams& sp,
-                                          Priority priority,
-                                          bool stream,
-                                          OutputCallback callback);
+  // encode the prompt with the tokenizer of the thread, reusing the ids of
+  // cached pieces and encoding long prompts in parallel if possible.
+  bool encode_prompt(size_t tid,
+                     const std::string& prompt,
+                     std::vector<int32_t>* prompt_tokens);
+
+  // prompt_tokens: the encoded prompt, the prompt is encoded if empty
+  // images: the images of the prompt with the placeholders expanded, nullptr
+  // for none
+  std::unique_ptr<Request> create_request(
+      size_t tid,
+      std::string prompt,
+      std::vector<int32_t> prompt_tokens,
+      const SamplingParams& sp,
+      Priority priority,
+      bool stream,
+      OutputCallback callback,
+      std::shared_ptr<const std::vector<ImageInput>> images = nullptr);
+
+  // pick the scheduler of the data parallel replica to run the request, see
+  // ReplicaRouter. the load routed to the replica is released once the
+  // request is destroyed. scheduler_ without data parallelism.
+  ContinuousScheduler* route(Request* request);
+
+  // the schedulers of all data parallel replicas, scheduler_ first
+  std::vector<ContinuousScheduler*> schedulers() const;
+
+  // check the request against the load of the scheduler, see
+  // Options::max_estimated_ttft_ms and Options::clamp_max_tokens_to_kv_cache.
+  // returns false and calls back with the error if it is refused.
+  bool admit(const ContinuousScheduler& scheduler,
+             Request* request,
+             Priority priority,
+             const OutputCallback& callback);
+
+  // serve the deterministic request from the response cache, or attach it to
+  // the identical request in flight. returns true if served or attached.
+  // otherwise the request is to run, and its output is passed to the cache
+  // by the callback, which is updated. see Options::response_cache_size.
+  bool serve_from_response_cache(const SamplingParams& sp,
+                                 Request* request,
+                                 OutputCallback* callback);
+
+  // compile the grammar constraining the output, or get it from the cache.
+  // returns nullptr and calls back with the error on failure.
+  std::shared_ptr<const TokenGrammar> create_grammar(const SamplingParams& sp,
+                                                     OutputCallback callback);
+
+  // render the new messages of a session turn with the chat template and
+  // append their token ids to the history of the session in token_ids. the
+  // rendered text is returned in prompt. returns false on failure.
+  bool encode_session_turn(size_t tid,
+                           const std::vector<Message>& messages,
+                           std::vector<int32_t>* token_ids,
+                           std::string* prompt);
 
   std::unique_ptr<Request> create_chat_request(
       size_t tid,
@@ -176,50 +593,106 @@ class LLMHandler {
       bool stream,
       OutputCallback callback);
 
+  // the placeholder token of each image in the prompt is expanded into the
+  // tokens of its embeddings, see ImageProcessor. the kv cache of the request
+  // is not shared through the prefix cache.
+  std::unique_ptr<Request> create_multimodal_chat_request(
+      size_t tid,
+      std::vector<Message> messages,
+      const SamplingParams& sp,
+      Priority priority,
+      bool stream,
+      OutputCallback callback);
+
   std::future<bool> schedule(std::string prompt,
+                             std::vector<int32_t> prompt_tokens,
                              SamplingParams sp,
                              Priority priority,
                              bool stream,
-                             OutputCallback callback);
+                             OutputCallback callback,
+                             BacklogCallback is_backlogged = nullptr,
+                             CancelCallback is_cancelled = nullptr);
 
   std::future<bool> schedule(std::vector<Message> messages,
                              SamplingParams sp,
                              Priority priority,
                              bool stream,
-                             OutputCallback callback);
-
-  void handling_loop(size_t tid);
+                             OutputCallback callback,
+                             BacklogCallback is_backlogged = nullptr,
+                             CancelCallback is_cancelled = nullptr);
 
   const Options options_;
 
   std::unique_ptr<Engine> engine_;
 
-  std::unique_ptr<Scheduler> scheduler_;
+  // the pending requests of the handler are counted by it, whichever
+  // replica they are routed to
+  std::unique_ptr<ContinuousScheduler> scheduler_;
+
+  // engines and schedulers of the other data parallel replicas, engine_ and
+  // scheduler_ are the first one
+  std::vector<std::unique_ptr<Engine>> replica_engines_;
+  std::vector<std::unique_ptr<ContinuousScheduler>> replica_schedulers_;
+
+  // router of the requests across the replicas (optional)
+  std::unique_ptr<ReplicaRouter> router_;
+
+  // engine and scheduler of the decodes handed over by scheduler_ (optional)
+  std::unique_ptr<Engine> decode_engine_;
+  std::unique_ptr<ContinuousScheduler> decode_scheduler_;
 
   // model args
   ModelArgs model_args_;
 
   // thread pool for handling requests
-  std::vector<std::thread> handling_threads_;
-
-  // queue for tasks
-  ConcurrentQueue<Task> queue_;
+  std::unique_ptr<ThreadPool> handling_threadpool_;
 
   // we don't know if tokenizer is thread safe, so we create one for each thread
   // for now
   std::vector<std::unique_ptr<Tokenizer>> tokenizers_;
 
+  // encoder for long prompts and batches of prompts (optional)
+  std::unique_ptr<BatchEncoder> encoder_;
+
+  // cache of the token ids of prompt pieces (optional)
+  std::unique_ptr<PromptCache> prompt_cache_;
+
+  // cache of the outputs of deterministic requests (optional)
+  std::unique_ptr<ResponseCache> response_cache_;
+
+  // history of the multi-turn sessions (optional)
+  std::unique_ptr<SessionStore> session_store_;
+
   // chat template instance
   std::unique_ptr<ChatTemplate> chat_template_;
 
+  // preprocessor of the images of the chat messages, only for the
+  // vision-language models
+  std::unique_ptr<ImageProcessor> image_processor_;
+
+  // cache of the grammars for constrained decoding (optional)
+  std::unique_ptr<GrammarCache> grammar_cache_;
+
+  // cpus to pin the scheduler threads to, empty to float freely
+  std::vector<int32_t> scheduler_cpus_;
+
   // thread for moving forward the scheduler
   std::thread loop_thread_;
 
+  // thread for moving forward the decode scheduler
+  std::thread decode_loop_thread_;
+
+  // threads for moving forward the schedulers of the other replicas
+  std::vector<std::thread> replica_loop_threads_;
+
   // flag to stop the loop
   std::atomic_bool stoped_{false};
 
   // flag to indicate if the handler is running
   std::atomic_bool running_{false};
+
+  // flag to refuse new requests
+  std::atomic_bool draining_{false};
 };
 
 }  // namespace llm
@@ -0,0 +1,72 @@
+#include "load_handler.h"
+
+#include <absl/time/time.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdint>
+
+#include "load.pb.h"
+#include "scheduler/load_report.h"
+
+namespace llm {
+namespace {
+constexpr uint32_t kDefaultIntervalMs = 100;
+constexpr uint32_t kMinIntervalMs = 10;
+constexpr uint32_t kMaxIntervalMs = 60000;
+}  // namespace
+
+LoadHandler::LoadHandler(ModelPool* model_pool) : model_pool_(model_pool) {
+  CHECK(model_pool_ != nullptr);
+}
+
+grpc::Status LoadHandler::Watch(grpc::ServerContext* context,
+                                const proto::LoadReportRequest* request,
+                                grpc::ServerWriter<proto::LoadReport>* writer) {
+  const uint32_t interval_ms =
+      request->interval_ms() == 0
+          ? kDefaultIntervalMs
+          : std::clamp(request->interval_ms(), kMinIntervalMs, kMaxIntervalMs);
+  const absl::Duration interval = absl::Milliseconds(interval_ms);
+  while (!context->IsCancelled()) {
+    proto::LoadReport report;
+    build_report(request->prompt_len(), &report);
+    if (!writer->Write(report)) {
+      // the client has gone away
+      break;
+    }
+    absl::MutexLock lock(&mutex_);
+    if (mutex_.AwaitWithTimeout(absl::Condition(&stopped_), interval)) {
+      break;
+    }
+  }
+  return grpc::Status::OK;
+}
+
+void LoadHandler::stop() {
+  absl::MutexLock lock(&mutex_);
+  stopped_ = true;
+}
+
+void LoadHandler::build_report(uint32_t prompt_len,
+                               proto::LoadReport* report) const {
+  const bool draining = model_pool_->is_draining();
+  for (const auto& model_id : model_pool_->models()) {
+    LoadReport load;
+    if (!model_pool_->load_report(model_id, &load)) {
+      continue;
+    }
+    auto* model_load = report->add_models();
+    model_load->set_model(model_id);
+    model_load->set_num_waiting_requests(load.num_waiting_requests);
+    model_load->set_num_running_requests(load.num_running_requests);
+    model_load->set_num_running_tokens(load.num_running_tokens);
+    model_load->set_num_waiting_tokens(load.num_waiting_tokens);
+    model_load->set_kv_cache_free_ratio(load.kv_cache_free_ratio());
+    model_load->set_estimated_ttft_ms(
+        load.estimated_ttft_seconds(prompt_len) * 1000);
+    model_load->set_draining(draining);
+  }
+}
+
+}  // namespace llm
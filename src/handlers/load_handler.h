@@ -0,0 +1,34 @@
+#pragma once
+
+#include <absl/synchronization/mutex.h>
+
+#include "load.grpc.pb.h"
+#include "model_pool.h"
+
+namespace llm {
+
+// Streams the load of the models in the pool, e.g. to a gateway routing
+// requests to the least loaded replica. Each stream holds a thread of the
+// grpc server until the client cancels or the handler is stopped.
+class LoadHandler : public proto::Load::Service {
+ public:
+  explicit LoadHandler(ModelPool* model_pool);
+
+  grpc::Status Watch(grpc::ServerContext* context,
+                     const proto::LoadReportRequest* request,
+                     grpc::ServerWriter<proto::LoadReport>* writer) override;
+
+  // end the streams, e.g. before shutting down the server, thread safe
+  void stop();
+
+ private:
+  // fill the report with the latest load of the models
+  void build_report(uint32_t prompt_len, proto::LoadReport* report) const;
+
+  ModelPool* model_pool_;
+
+  absl::Mutex mutex_;
+  bool stopped_ ABSL_GUARDED_BY(mutex_) = false;
+};
+
+}  // namespace llm
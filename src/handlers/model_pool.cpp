@@ -0,0 +1,160 @@
+#include "model_pool.h"
+
+#include <absl/time/clock.h>
+#include <c10/cuda/CUDACachingAllocator.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "common/metrics.h"
+#include "common/timer.h"
+
+DEFINE_COUNTER(model_swap_latency_seconds,
+               "Latency of paging model weights back to the devices");
+DEFINE_GAUGE(num_resident_models, "Number of models with weights on devices");
+
+namespace llm {
+
+ModelPool::ModelPool(const Options& options) : options_(options) {}
+
+ModelPool::~ModelPool() { stop(); }
+
+void ModelPool::add(const std::string& model_id,
+                    const LLMHandler::Options& options) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  CHECK(!entries_.contains(model_id)) << "Duplicated model " << model_id;
+
+  const size_t max_resident = options_.max_resident_models();
+  if (max_resident > 0 && num_resident_ >= max_resident) {
+    CHECK(evict_lru(/*excluded=*/nullptr))
+        << "Failed to offload a model to load " << model_id;
+    // return the offloaded weights to the device for the memory profiling of
+    // the new model
+    c10::cuda::CUDACachingAllocator::emptyCache();
+  }
+
+  LOG(INFO) << "Loading model " << model_id << " from "
+            << options.model_path();
+  auto& entry = entries_[model_id];
+  entry.handler = std::make_unique<LLMHandler>(options);
+  entry.resident = true;
+  entry.last_used = ++clock_;
+  ++num_resident_;
+  model_ids_.push_back(model_id);
+  GAUGE_SET(num_resident_models, num_resident_);
+}
+
+bool ModelPool::contains(const std::string& model_id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.contains(model_id);
+}
+
+bool ModelPool::load_report(const std::string& model_id,
+                            LoadReport* report) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(model_id);
+  if (it == entries_.end()) {
+    return false;
+  }
+  *report = it->second.handler->load_report();
+  return true;
+}
+
+bool ModelPool::schedule(const std::string& model_id,
+                         const std::function<void(LLMHandler*)>& func) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(model_id);
+  if (it == entries_.end()) {
+    return false;
+  }
+  auto& entry = it->second;
+  if (!entry.resident) {
+    const size_t max_resident = options_.max_resident_models();
+    if (max_resident > 0 && num_resident_ >= max_resident &&
+        !evict_lru(/*excluded=*/&entry)) {
+      LOG(WARNING) << "No idle model to offload for " << model_id;
+      return false;
+    }
+    Timer timer;
+    CHECK(entry.handler->reload_weights())
+        << "Failed to reload weights of " << model_id;
+    entry.resident = true;
+    ++num_resident_;
+    GAUGE_SET(num_resident_models, num_resident_);
+    COUNTER_ADD(model_swap_latency_seconds, timer.elapsed_seconds());
+    LOG(INFO) << "Reloaded weights of " << model_id << " in "
+              << timer.elapsed_seconds() << "s";
+  }
+  entry.last_used = ++clock_;
+  func(entry.handler.get());
+  return true;
+}
+
+bool ModelPool::evict_lru(const Entry* excluded) {
+  Entry* victim = nullptr;
+  const std::string* victim_id = nullptr;
+  for (auto& [model_id, entry] : entries_) {
+    if (&entry == excluded || !entry.resident || !entry.handler->is_idle()) {
+      continue;
+    }
+    if (victim == nullptr || entry.last_used < victim->last_used) {
+      victim = &entry;
+      victim_id = &model_id;
+    }
+  }
+  if (victim == nullptr) {
+    return false;
+  }
+  // no request can be routed to the victim while the lock is held
+  if (!victim->handler->offload_weights()) {
+    LOG(WARNING) << "Offloading weights is not supported by " << *victim_id;
+    return false;
+  }
+  LOG(INFO) << "Offloaded weights of " << *victim_id << " to host memory";
+  victim->resident = false;
+  --num_resident_;
+  GAUGE_SET(num_resident_models, num_resident_);
+  return true;
+}
+
+void ModelPool::start() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& [model_id, entry] : entries_) {
+    entry.handler->start();
+  }
+}
+
+void ModelPool::stop() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& [model_id, entry] : entries_) {
+    entry.handler->stop();
+  }
+}
+
+bool ModelPool::drain(absl::Duration timeout) {
+  const absl::Time deadline = absl::Now() + timeout;
+  draining_.store(true, std::memory_order_relaxed);
+  // stop the admission of all models first, then wait without the lock
+  std::vector<LLMHandler*> handlers;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& [model_id, entry] : entries_) {
+      entry.handler->start_draining();
+      handlers.push_back(entry.handler.get());
+    }
+  }
+  bool drained = true;
+  for (auto* handler : handlers) {
+    const absl::Duration remaining =
+        std::max(deadline - absl::Now(), absl::ZeroDuration());
+    drained = handler->drain(remaining) && drained;
+  }
+  return drained;
+}
+
+}  // namespace llm
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/time/time.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "common/macros.h"
+#include "llm_handler.h"
+
+namespace llm {
+
+// A pool of models served by the same process on the same devices.
+// Only a limited number of models keep their weights on the devices, the
+// weights of the others are offloaded to pinned host memory and paged back on
+// demand, evicting the least recently used idle model. The kv cache of each
+// model stays allocated, so the models keep their cache budgets and prefix
+// caches across the swaps.
+class ModelPool final {
+ public:
+  struct Options {
+    // max number of models with weights on the devices, 0 means no limit
+    DEFINE_ARG(size_t, max_resident_models) = 0;
+  };
+
+  explicit ModelPool(const Options& options);
+
+  ~ModelPool();
+
+  // create a handler for the model, evicting the least recently used model
+  // first if the resident limit is reached. not thread safe.
+  void add(const std::string& model_id, const LLMHandler::Options& options);
+
+  // whether the model is served by the pool, thread safe
+  bool contains(const std::string& model_id) const;
+
+  // ids of the models in the order they were added
+  const std::vector<std::string>& models() const { return model_ids_; }
+
+  // make the weights of the model resident, then call func with its handler
+  // to schedule requests. func is called under the lock of the pool so that
+  // the model can't be evicted before its requests are counted, it should not
+  // block. returns false if the model is unknown, or no idle model can be
+  // evicted to make room for it.
+  bool schedule(const std::string& model_id,
+                const std::function<void(LLMHandler*)>& func);
+
+  // start/stop the handling loops of all models
+  void start();
+  void stop();
+
+  // stop admitting requests to all models and wait for the requests in
+  // flight to finish, e.g. before shutting down. returns false on timeout.
+  bool drain(absl::Duration timeout);
+
+  // get the latest load of the model, returns false if the model is unknown.
+  // thread safe.
+  bool load_report(const std::string& model_id, LoadReport* report) const;
+
+  // whether the pool is draining, thread safe
+  bool is_draining() const {
+    return draining_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Entry {
+    std::unique_ptr<LLMHandler> handler;
+
+    // whether the weights are on the devices
+    bool resident = true;
+
+    // logical time of the last use, for lru eviction
+    uint64_t last_used = 0;
+  };
+
+  // offload the least recently used idle model other than the excluded one,
+  // returns false if there is none. lock held.
+  bool evict_lru(const Entry* excluded);
+
+  const Options options_;
+
+  // protects the residency of the entries
+  mutable std::mutex mutex_;
+
+  absl::flat_hash_map<std::string, Entry> entries_;
+
+  std::vector<std::string> model_ids_;
+
+  size_t num_resident_ = 0;
+
+  // logical clock for lru
+  uint64_t clock_ = 0;
+
+  std::atomic_bool draining_{false};
+};
+
+}  // namespace llm
@@ -0,0 +1,105 @@
+#include "replica_router.h"
+
+#include <absl/hash/hash.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace llm {
+namespace {
+// the prefixes are only remembered up to the blocks, the leading blocks are
+// enough to tell apart the system prompts and the chat histories
+constexpr size_t kMaxPrefixBlocks = 64;
+}  // namespace
+
+ReplicaRouter::ReplicaRouter(size_t num_replicas,
+                             size_t block_size,
+                             size_t max_prefixes)
+    : block_size_(block_size),
+      max_prefixes_(max_prefixes),
+      loads_(num_replicas, 0) {
+  CHECK_GT(num_replicas, 0) << "Number of replicas should be greater than 0";
+  CHECK_GT(block_size, 0) << "Block size should be greater than 0";
+}
+
+std::vector<uint64_t> ReplicaRouter::prefix_hashes(
+    const std::vector<int32_t>& token_ids) const {
+  const size_t n_blocks =
+      std::min(token_ids.size() / block_size_, kMaxPrefixBlocks);
+  std::vector<uint64_t> hashes;
+  hashes.reserve(n_blocks);
+  uint64_t hash = 0;
+  for (size_t i = 0; i < n_blocks; ++i) {
+    // chain the hash of each block with the ones before it
+    for (size_t j = i * block_size_; j < (i + 1) * block_size_; ++j) {
+      hash = absl::HashOf(hash, token_ids[j]);
+    }
+    hashes.push_back(hash);
+  }
+  return hashes;
+}
+
+size_t ReplicaRouter::route(const std::vector<int32_t>& token_ids,
+                            size_t num_tokens) {
+  const std::vector<uint64_t> hashes = prefix_hashes(token_ids);
+  absl::MutexLock lock(&mu_);
+  // the replica holding the longest prefix
+  size_t cached_replica = 0;
+  size_t n_cached_tokens = 0;
+  for (size_t i = hashes.size(); i > 0; --i) {
+    auto it = prefixes_.find(hashes[i - 1]);
+    if (it != prefixes_.end()) {
+      cached_replica = it->second.replica;
+      n_cached_tokens = i * block_size_;
+      break;
+    }
+  }
+
+  size_t replica = 0;
+  size_t min_work = std::numeric_limits<size_t>::max();
+  for (size_t i = 0; i < loads_.size(); ++i) {
+    size_t work = loads_[i] + token_ids.size();
+    if (i == cached_replica) {
+      work -= n_cached_tokens;
+    }
+    if (work < min_work) {
+      min_work = work;
+      replica = i;
+    }
+  }
+  loads_[replica] += num_tokens;
+
+  // remember the prefixes of the prompt on the replica
+  for (const uint64_t hash : hashes) {
+    auto it = prefixes_.find(hash);
+    if (it != prefixes_.end()) {
+      it->second.replica = replica;
+      lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+      continue;
+    }
+    lru_.push_front(hash);
+    prefixes_[hash] = {replica, lru_.begin()};
+  }
+  while (prefixes_.size() > max_prefixes_) {
+    prefixes_.erase(lru_.back());
+    lru_.pop_back();
+  }
+  return replica;
+}
+
+void ReplicaRouter::release(size_t replica, size_t num_tokens) {
+  absl::MutexLock lock(&mu_);
+  CHECK_LT(replica, loads_.size());
+  loads_[replica] -= std::min(loads_[replica], num_tokens);
+}
+
+size_t ReplicaRouter::load(size_t replica) const {
+  absl::MutexLock lock(&mu_);
+  CHECK_LT(replica, loads_.size());
+  return loads_[replica];
+}
+
+}  // namespace llm
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <absl/synchronization/mutex.h>
+
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+namespace llm {
+
+// Router of the requests across the data parallel replicas of a model, each
+// with its own kv cache. A request goes to the replica with the least work
+// after taking it: the tokens of the requests routed to the replica and not
+// released yet, plus the tokens of the prompt it has to prefill. The prompt
+// prefixes of the routed requests are remembered by blocks, so that the
+// requests sharing a prefix, e.g. a system prompt or the history of a chat,
+// land on the replica holding its kv cache unless the replica is overloaded
+// by more than the prefix saves. Thread safe.
+class ReplicaRouter final {
+ public:
+  // num_replicas: number of the replicas
+  // block_size: number of tokens per block of the prefixes to remember
+  // max_prefixes: max number of the prefix blocks to remember, the least
+  // recently routed ones are forgotten
+  ReplicaRouter(size_t num_replicas, size_t block_size, size_t max_prefixes);
+
+  // disable copy, move and assign
+  ReplicaRouter(const ReplicaRouter&) = delete;
+  ReplicaRouter(ReplicaRouter&&) = delete;
+  ReplicaRouter& operator=(const ReplicaRouter&) = delete;
+  ReplicaRouter& operator=(ReplicaRouter&&) = delete;
+
+  // pick the replica of the prompt and add num_tokens to its load, which
+  // should be released once the request is done.
+  size_t route(const std::vector<int32_t>& token_ids, size_t num_tokens);
+
+  // remove the tokens of a done request from the load of the replica
+  void release(size_t replica, size_t num_tokens);
+
+  // get the tokens routed to the replica and not released yet
+  size_t load(size_t replica) const;
+
+  size_t num_replicas() const { return loads_.size(); }
+
+ private:
+  struct Prefix {
+    size_t replica = 0;
+    // position in lru_
+    std::list<uint64_t>::iterator lru_it;
+  };
+
+  // the hashes of the block aligned prefixes of the prompt, from the shortest
+  std::vector<uint64_t> prefix_hashes(
+      const std::vector<int32_t>& token_ids) const;
+
+  size_t block_size_ = 0;
+
+  size_t max_prefixes_ = 0;
+
+  mutable absl::Mutex mu_;
+
+  // replica -> tokens routed and not released
+  std::vector<size_t> loads_ ABSL_GUARDED_BY(mu_);
+
+  // prefix hash -> the replica it was last routed to
+  std::unordered_map<uint64_t, Prefix> prefixes_ ABSL_GUARDED_BY(mu_);
+
+  // prefix hashes from the most to the least recently routed
+  std::list<uint64_t> lru_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace llm
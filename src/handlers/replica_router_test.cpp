@@ -0,0 +1,70 @@
+#include "replica_router.h"
+
+#include <gtest/gtest.h>
+
+#include <numeric>
+#include <vector>
+
+namespace llm {
+namespace {
+std::vector<int32_t> tokens(int32_t start, size_t n) {
+  std::vector<int32_t> token_ids(n);
+  std::iota(token_ids.begin(), token_ids.end(), start);
+  return token_ids;
+}
+}  // namespace
+
+TEST(ReplicaRouterTest, Load) {
+  ReplicaRouter router(/*num_replicas=*/2,
+                       /*block_size=*/4,
+                       /*max_prefixes=*/16);
+  EXPECT_EQ(router.route(tokens(0, 8), 8), 0);
+  // the distinct prompt goes to the idle replica
+  EXPECT_EQ(router.route(tokens(100, 8), 8), 1);
+  EXPECT_EQ(router.load(0), 8);
+  EXPECT_EQ(router.load(1), 8);
+
+  router.release(0, 8);
+  EXPECT_EQ(router.load(0), 0);
+  EXPECT_EQ(router.route(tokens(200, 8), 8), 0);
+  // released more than routed
+  router.release(1, 100);
+  EXPECT_EQ(router.load(1), 0);
+}
+
+TEST(ReplicaRouterTest, PrefixAffinity) {
+  ReplicaRouter router(/*num_replicas=*/2,
+                       /*block_size=*/4,
+                       /*max_prefixes=*/16);
+  EXPECT_EQ(router.route(tokens(0, 8), 8), 0);
+  EXPECT_EQ(router.route(tokens(100, 8), 8), 1);
+
+  // the prompt sharing the prefix stays on its replica, the work left is
+  // 8 + 12 - 8 = 12 tokens against 8 + 12 = 20 tokens
+  EXPECT_EQ(router.route(tokens(0, 12), 12), 0);
+  // a partial block is not a shared prefix
+  EXPECT_EQ(router.route(tokens(100, 3), 3), 1);
+
+  // unless the replica is overloaded by more than the prefix saves
+  EXPECT_EQ(router.load(0), 20);
+  EXPECT_EQ(router.load(1), 11);
+  EXPECT_EQ(router.route(tokens(0, 8), 8), 1);
+  // and the prefix moves to the new replica
+  router.release(0, 20);
+  router.release(1, 19);
+  EXPECT_EQ(router.route(tokens(0, 4), 4), 1);
+}
+
+TEST(ReplicaRouterTest, MaxPrefixes) {
+  ReplicaRouter router(/*num_replicas=*/2,
+                       /*block_size=*/4,
+                       /*max_prefixes=*/2);
+  EXPECT_EQ(router.route(tokens(200, 3), 4), 0);
+  EXPECT_EQ(router.route(tokens(0, 4), 4), 1);
+  // the two blocks of the prompt evict the least recently routed prefix
+  EXPECT_EQ(router.route(tokens(100, 8), 0), 0);
+  // so the prompt is routed by load only, ties go to the first replica
+  EXPECT_EQ(router.route(tokens(0, 4), 4), 0);
+}
+
+}  // namespace llm
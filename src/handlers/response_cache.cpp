@@ -0,0 +1,98 @@
+#include "response_cache.h"
+
+#include <absl/time/clock.h>
+#include <glog/logging.h>
+
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llm {
+
+ResponseCache::ResponseCache(size_t max_entries, absl::Duration ttl)
+    : max_entries_(max_entries), ttl_(ttl) {
+  CHECK_GT(max_entries, 0) << "Max entries should be greater than 0";
+}
+
+bool ResponseCache::lookup(const std::string& key, RequestOutput* output) {
+  absl::MutexLock lock(&mu_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    return false;
+  }
+  if (absl::Now() >= it->second.expire_time) {
+    lru_.erase(it->second.lru_it);
+    entries_.erase(it);
+    return false;
+  }
+  // move the entry to the back of the lru list
+  lru_.splice(lru_.end(), lru_, it->second.lru_it);
+  *output = it->second.output;
+  return true;
+}
+
+bool ResponseCache::join(const std::string& key, Callback callback) {
+  absl::MutexLock lock(&mu_);
+  auto it = inflight_.find(key);
+  if (it == inflight_.end()) {
+    inflight_.emplace(key, std::vector<Callback>{});
+    return false;
+  }
+  it->second.push_back(std::move(callback));
+  return true;
+}
+
+bool ResponseCache::has_waiters(const std::string& key) const {
+  absl::MutexLock lock(&mu_);
+  auto it = inflight_.find(key);
+  return it != inflight_.end() && !it->second.empty();
+}
+
+void ResponseCache::complete(const std::string& key,
+                             const RequestOutput& output) {
+  std::vector<Callback> waiters;
+  {
+    absl::MutexLock lock(&mu_);
+    auto it = inflight_.find(key);
+    if (it != inflight_.end()) {
+      waiters = std::move(it->second);
+      inflight_.erase(it);
+    }
+
+    const bool ok = !output.status.has_value() || output.status->ok();
+    if (ok && output.finished) {
+      auto entry_it = entries_.find(key);
+      if (entry_it == entries_.end()) {
+        lru_.push_back(key);
+        entry_it = entries_.emplace(key, Entry{}).first;
+        entry_it->second.lru_it = std::prev(lru_.end());
+      } else {
+        lru_.splice(lru_.end(), lru_, entry_it->second.lru_it);
+      }
+      entry_it->second.output = output;
+      entry_it->second.expire_time = absl::Now() + ttl_;
+      evict();
+    }
+  }
+
+  // call back out of the lock, the waiters have gone away if they return
+  // false, which is ignored since the request has finished.
+  for (auto& waiter : waiters) {
+    waiter(output);
+  }
+}
+
+size_t ResponseCache::size() const {
+  absl::MutexLock lock(&mu_);
+  return entries_.size();
+}
+
+void ResponseCache::evict() {
+  while (entries_.size() > max_entries_ && !lru_.empty()) {
+    entries_.erase(lru_.front());
+    lru_.pop_front();
+  }
+}
+
+}  // namespace llm
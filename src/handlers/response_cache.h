@@ -0,0 +1,82 @@
+#pragma once
+
+#include <absl/synchronization/mutex.h>
+#include <absl/time/time.h>
+
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "request/output.h"
+
+namespace llm {
+
+// A cache of the outputs of deterministic requests, e.g. greedy requests
+// without streaming, keyed by the prompt token ids and the sampling
+// parameters, so that repeated requests are served without running them
+// again. Identical requests in flight are coalesced: the first one runs and
+// the others wait for its output. Thread safe.
+class ResponseCache final {
+ public:
+  using Callback = std::function<bool(RequestOutput output)>;
+
+  // max_entries: max number of outputs to cache
+  // ttl: how long an output is served after it is cached
+  ResponseCache(size_t max_entries, absl::Duration ttl);
+
+  // disable copy, move and assign
+  ResponseCache(const ResponseCache&) = delete;
+  ResponseCache(ResponseCache&&) = delete;
+  ResponseCache& operator=(const ResponseCache&) = delete;
+  ResponseCache& operator=(ResponseCache&&) = delete;
+
+  // copy the cached output of the key into output, returns false if not
+  // cached or expired.
+  bool lookup(const std::string& key, RequestOutput* output);
+
+  // wait for the output of the identical request in flight, the callback is
+  // called with it once by complete(). returns false if none is in flight,
+  // then the caller runs the request and must call complete() for the key.
+  bool join(const std::string& key, Callback callback);
+
+  // whether any request waits for the output of the key
+  bool has_waiters(const std::string& key) const;
+
+  // the final output of the request in flight for the key, which is cached
+  // if successful and passed to the waiting requests.
+  void complete(const std::string& key, const RequestOutput& output);
+
+  // get the number of cached outputs
+  size_t size() const;
+
+ private:
+  struct Entry {
+    RequestOutput output;
+    absl::Time expire_time;
+    // position in the lru list
+    std::list<std::string>::iterator lru_it;
+  };
+
+  // evict least recently used outputs until within max_entries_
+  void evict() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  mutable absl::Mutex mu_;
+
+  // key -> cached output
+  std::unordered_map<std::string, Entry> entries_ ABSL_GUARDED_BY(mu_);
+
+  // keys sorted by the last access time, front is least recently used
+  std::list<std::string> lru_ ABSL_GUARDED_BY(mu_);
+
+  // key of the requests in flight -> callbacks of the waiting requests
+  std::unordered_map<std::string, std::vector<Callback>> inflight_
+      ABSL_GUARDED_BY(mu_);
+
+  size_t max_entries_ = 0;
+
+  absl::Duration ttl_;
+};
+
+}  // namespace llm
@@ -0,0 +1,84 @@
+#include "response_cache.h"
+
+#include <absl/time/clock.h>
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+namespace llm {
+
+namespace {
+RequestOutput make_output(const std::string& text) {
+  RequestOutput output;
+  output.status = Status(StatusCode::OK);
+  output.finished = true;
+  auto& seq_output = output.outputs.emplace_back();
+  seq_output.index = 0;
+  seq_output.text = text;
+  return output;
+}
+}  // namespace
+
+TEST(ResponseCacheTest, Basic) {
+  ResponseCache cache(/*max_entries=*/2, absl::Hours(1));
+  RequestOutput output;
+  EXPECT_FALSE(cache.lookup("a", &output));
+
+  // the first request runs, the output is cached when it completes
+  EXPECT_FALSE(cache.join("a", nullptr));
+  cache.complete("a", make_output("hello"));
+  ASSERT_TRUE(cache.lookup("a", &output));
+  EXPECT_EQ(output.outputs[0].text, "hello");
+  EXPECT_EQ(cache.size(), 1);
+
+  // failed requests are not cached
+  EXPECT_FALSE(cache.join("b", nullptr));
+  cache.complete("b", RequestOutput(Status(StatusCode::CANCELLED)));
+  EXPECT_FALSE(cache.lookup("b", &output));
+
+  // the least recently used output is evicted
+  cache.complete("b", make_output("b"));
+  EXPECT_TRUE(cache.lookup("a", &output));
+  cache.complete("c", make_output("c"));
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_TRUE(cache.lookup("a", &output));
+  EXPECT_FALSE(cache.lookup("b", &output));
+  EXPECT_TRUE(cache.lookup("c", &output));
+}
+
+TEST(ResponseCacheTest, Expire) {
+  ResponseCache cache(/*max_entries=*/2, absl::Milliseconds(50));
+  cache.complete("a", make_output("hello"));
+  RequestOutput output;
+  EXPECT_TRUE(cache.lookup("a", &output));
+  absl::SleepFor(absl::Milliseconds(100));
+  EXPECT_FALSE(cache.lookup("a", &output));
+  EXPECT_EQ(cache.size(), 0);
+}
+
+TEST(ResponseCacheTest, Coalesce) {
+  ResponseCache cache(/*max_entries=*/2, absl::Hours(1));
+  std::vector<std::string> texts;
+  auto callback = [&texts](RequestOutput output) {
+    texts.push_back(output.outputs[0].text);
+    return true;
+  };
+
+  // the identical requests wait for the first one
+  EXPECT_FALSE(cache.join("a", callback));
+  EXPECT_FALSE(cache.has_waiters("a"));
+  EXPECT_TRUE(cache.join("a", callback));
+  EXPECT_TRUE(cache.join("a", callback));
+  EXPECT_TRUE(cache.has_waiters("a"));
+  EXPECT_TRUE(texts.empty());
+
+  cache.complete("a", make_output("hello"));
+  EXPECT_EQ(texts, std::vector<std::string>({"hello", "hello"}));
+  EXPECT_FALSE(cache.has_waiters("a"));
+
+  // the next identical request runs again
+  EXPECT_FALSE(cache.join("a", callback));
+}
+
+}  // namespace llm
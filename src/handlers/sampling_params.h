@@ -1,5 +1,6 @@
 #pragma once
 #include <cstdint>
+#include <map>
 #include <optional>
 #include <string>
 #include <vector>
@@ -26,7 +27,8 @@ struct SamplingParams {
                  bool skip_special_tokens,
                  bool ignore_eos,
                  std::optional<std::vector<std::string>> stop,
-                 std::optional<std::vector<int32_t>> stop_token_ids)
+                 std::optional<std::vector<int32_t>> stop_token_ids,
+                 bool detokenize)
       : max_tokens(max_tokens),
         n(n),
         best_of(best_of),
@@ -42,7 +44,8 @@ struct SamplingParams {
         skip_special_tokens(skip_special_tokens),
         ignore_eos(ignore_eos),
         stop(stop),
-        stop_token_ids(stop_token_ids) {}
+        stop_token_ids(stop_token_ids),
+        detokenize(detokenize) {}
 
   // number of tokens to generate. truncted to model's max context length.
   uint32_t max_tokens = 16;
@@ -53,6 +56,11 @@ struct SamplingParams {
   // number of sequences to generate for each prompt and select n best among.
   std::optional<uint32_t> best_of;
 
+  // number of beams to search the n best sequences with, between [0, 10].
+  // the sampling parameters are ignored with beam search. default = 0 to
+  // sample the sequences.
+  uint32_t beam_width = 0;
+
   // whether to include the original prompt in the completion response.
   bool echo = false;
 
@@ -100,6 +108,54 @@ struct SamplingParams {
 
   // the list of token ids to stop generating further tokens.
   std::optional<std::vector<int32_t>> stop_token_ids;
+
+  // the bias added to the logits of the token ids, between [-100, 100].
+  // -100 effectively bans the token.
+  std::optional<std::map<int32_t, float>> logit_bias;
+
+  // the only token ids that can be generated, e.g. the answers of a
+  // classification prompt. default = all tokens.
+  std::optional<std::vector<int32_t>> allowed_token_ids;
+
+  // the seed of the random numbers to sample with, which makes the outputs
+  // reproducible for the same prompt and parameters. default = unseeded.
+  std::optional<uint64_t> seed;
+
+  // whether to decode the output tokens into text. default = true.
+  // when false, only the token ids and the log probabilities of the output
+  // tokens are returned, without the text and the top log probabilities.
+  bool detokenize = true;
+
+  // truncate a prompt that leaves no room for max_tokens in the context
+  // instead of rejecting it: the middle tokens are dropped, keeping the first
+  // n tokens and the most recent ones. it is a one-time cut of the prompt,
+  // nothing is evicted from the kv cache during generation.
+  // default = -1 to disable.
+  int32_t truncate_prompt_keep_first = -1;
+
+  // the name of the lora adapter to generate with. default = base model.
+  std::optional<std::string> lora_adapter;
+
+  // the tenant to account the request to under the wfq scheduling policy.
+  // default = "" for the default tenant.
+  std::string tenant;
+
+  // constrain the output to the json following the json schema. default =
+  // unconstrained.
+  std::optional<std::string> json_schema;
+
+  // constrain the output to a json object, the json mode. default = false.
+  bool json_object = false;
+
+  // constrain the output to the text matching the regular expression.
+  // default = unconstrained.
+  std::optional<std::string> regex;
+
+  // return the normalized embedding of the prompt pooled from the last
+  // hidden states instead of generating tokens: "mean" for the mean of the
+  // prompt tokens or "last" for the last prompt token. default = "" to
+  // generate tokens.
+  std::string pooling;
 };
 
 }  // namespace llm
\ No newline at end of file
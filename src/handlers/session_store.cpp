@@ -0,0 +1,86 @@
+#include "session_store.h"
+
+#include <absl/random/distributions.h>
+#include <absl/strings/str_cat.h>
+#include <absl/time/clock.h>
+#include <glog/logging.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llm {
+
+SessionStore::SessionStore(size_t max_sessions, absl::Duration ttl)
+    : max_sessions_(max_sessions), ttl_(ttl) {
+  CHECK_GT(max_sessions, 0) << "Max sessions should be greater than 0";
+}
+
+std::string SessionStore::open() {
+  absl::MutexLock lock(&mu_);
+  const absl::Time now = absl::Now();
+  expire(now);
+  if (sessions_.size() >= max_sessions_) {
+    return "";
+  }
+  std::string id;
+  do {
+    id = absl::StrCat(
+        "sess-",
+        absl::Hex(absl::Uniform<uint64_t>(gen_), absl::kZeroPad16),
+        absl::Hex(absl::Uniform<uint64_t>(gen_), absl::kZeroPad16));
+  } while (sessions_.count(id) > 0);
+  sessions_[id].expire_time = now + ttl_;
+  return id;
+}
+
+bool SessionStore::begin_turn(const std::string& id,
+                              std::vector<int32_t>* token_ids) {
+  absl::MutexLock lock(&mu_);
+  expire(absl::Now());
+  auto it = sessions_.find(id);
+  if (it == sessions_.end() || it->second.busy) {
+    return false;
+  }
+  it->second.busy = true;
+  *token_ids = it->second.token_ids;
+  return true;
+}
+
+void SessionStore::end_turn(const std::string& id,
+                            bool succeeded,
+                            std::vector<int32_t> token_ids) {
+  absl::MutexLock lock(&mu_);
+  auto it = sessions_.find(id);
+  if (it == sessions_.end()) {
+    // closed while the turn was running
+    return;
+  }
+  if (succeeded) {
+    it->second.token_ids = std::move(token_ids);
+  }
+  it->second.busy = false;
+  it->second.expire_time = absl::Now() + ttl_;
+}
+
+bool SessionStore::close(const std::string& id) {
+  absl::MutexLock lock(&mu_);
+  return sessions_.erase(id) > 0;
+}
+
+size_t SessionStore::size() const {
+  absl::MutexLock lock(&mu_);
+  return sessions_.size();
+}
+
+void SessionStore::expire(absl::Time now) {
+  for (auto it = sessions_.begin(); it != sessions_.end();) {
+    if (!it->second.busy && now >= it->second.expire_time) {
+      it = sessions_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+}  // namespace llm
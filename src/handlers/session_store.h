@@ -0,0 +1,74 @@
+#pragma once
+
+#include <absl/random/random.h>
+#include <absl/synchronization/mutex.h>
+#include <absl/time/time.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace llm {
+
+// The token ids of the multi-turn sessions opened by the clients, so that
+// each turn only sends and encodes its new messages, which are appended to
+// the history of the session. A session expires once idle for the ttl, and
+// runs one turn at a time. Thread safe.
+class SessionStore final {
+ public:
+  // max_sessions: max number of open sessions
+  // ttl: how long an idle session is kept after its last turn
+  SessionStore(size_t max_sessions, absl::Duration ttl);
+
+  // disable copy, move and assign
+  SessionStore(const SessionStore&) = delete;
+  SessionStore(SessionStore&&) = delete;
+  SessionStore& operator=(const SessionStore&) = delete;
+  SessionStore& operator=(SessionStore&&) = delete;
+
+  // open a new session without history, returns its id. empty if there are
+  // max_sessions open sessions.
+  std::string open();
+
+  // start a turn of the session, copying its history into token_ids. returns
+  // false if the session is not open or expired, or a turn is running.
+  bool begin_turn(const std::string& id, std::vector<int32_t>* token_ids);
+
+  // finish the running turn of the session. the history is replaced by
+  // token_ids if the turn succeeded, otherwise kept for a retry.
+  void end_turn(const std::string& id,
+                bool succeeded,
+                std::vector<int32_t> token_ids);
+
+  // close the session, returns false if not open
+  bool close(const std::string& id);
+
+  // get the number of open sessions
+  size_t size() const;
+
+ private:
+  struct Session {
+    std::vector<int32_t> token_ids;
+    absl::Time expire_time;
+    // whether a turn is running, the session doesn't expire meanwhile
+    bool busy = false;
+  };
+
+  // remove the idle sessions past their expire time
+  void expire(absl::Time now) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  mutable absl::Mutex mu_;
+
+  // session id -> session
+  std::unordered_map<std::string, Session> sessions_ ABSL_GUARDED_BY(mu_);
+
+  // generator of the session ids
+  absl::BitGen gen_ ABSL_GUARDED_BY(mu_);
+
+  size_t max_sessions_ = 0;
+
+  absl::Duration ttl_;
+};
+
+}  // namespace llm
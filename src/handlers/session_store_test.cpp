@@ -0,0 +1,67 @@
+#include "session_store.h"
+
+#include <absl/time/clock.h>
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+namespace llm {
+
+TEST(SessionStoreTest, Turns) {
+  SessionStore store(/*max_sessions=*/2, absl::Hours(1));
+  const std::string id = store.open();
+  ASSERT_FALSE(id.empty());
+  EXPECT_EQ(store.size(), 1);
+
+  // a new session has no history
+  std::vector<int32_t> token_ids = {1};
+  ASSERT_TRUE(store.begin_turn(id, &token_ids));
+  EXPECT_TRUE(token_ids.empty());
+  // one turn at a time
+  EXPECT_FALSE(store.begin_turn(id, &token_ids));
+  store.end_turn(id, /*succeeded=*/true, {1, 2, 3});
+
+  // the history is kept across the turns, unless a turn fails
+  ASSERT_TRUE(store.begin_turn(id, &token_ids));
+  EXPECT_EQ(token_ids, std::vector<int32_t>({1, 2, 3}));
+  store.end_turn(id, /*succeeded=*/false, {4});
+  ASSERT_TRUE(store.begin_turn(id, &token_ids));
+  EXPECT_EQ(token_ids, std::vector<int32_t>({1, 2, 3}));
+  store.end_turn(id, /*succeeded=*/true, {1, 2, 3, 4});
+
+  EXPECT_FALSE(store.begin_turn("unknown", &token_ids));
+  EXPECT_TRUE(store.close(id));
+  EXPECT_FALSE(store.close(id));
+  EXPECT_FALSE(store.begin_turn(id, &token_ids));
+}
+
+TEST(SessionStoreTest, MaxSessions) {
+  SessionStore store(/*max_sessions=*/2, absl::Hours(1));
+  const std::string first = store.open();
+  const std::string second = store.open();
+  EXPECT_FALSE(first.empty());
+  EXPECT_FALSE(second.empty());
+  EXPECT_NE(first, second);
+  EXPECT_TRUE(store.open().empty());
+  EXPECT_TRUE(store.close(first));
+  EXPECT_FALSE(store.open().empty());
+}
+
+TEST(SessionStoreTest, Expire) {
+  SessionStore store(/*max_sessions=*/2, absl::Milliseconds(50));
+  const std::string idle = store.open();
+  const std::string busy = store.open();
+  std::vector<int32_t> token_ids;
+  ASSERT_TRUE(store.begin_turn(busy, &token_ids));
+  absl::SleepFor(absl::Milliseconds(100));
+
+  // the session running a turn is kept
+  EXPECT_FALSE(store.begin_turn(idle, &token_ids));
+  EXPECT_EQ(store.size(), 1);
+  store.end_turn(busy, /*succeeded=*/true, {1});
+  ASSERT_TRUE(store.begin_turn(busy, &token_ids));
+  EXPECT_EQ(token_ids, std::vector<int32_t>({1}));
+}
+
+}  // namespace llm
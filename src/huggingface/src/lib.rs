@@ -426,6 +426,10 @@ pub struct TokenizerWrapper {
     encode_ids: Vec<u32>,
     // Holds the decoded string to avoid dropping it
     decode_str: String,
+    // Holds the decoded strings of a batch back to back
+    decode_batch_str: String,
+    // Holds the end offset of each decoded string in decode_batch_str
+    decode_batch_offsets: Vec<usize>,
     // Holds the result of the token_to_id function
     id_to_token_result: String,
 }
@@ -446,6 +450,20 @@ impl TokenizerWrapper {
         self.decode_str = self.tokenizer.decode(&ids, skip_special_tokens).unwrap();
     }
 
+    pub fn decode_batch(&mut self, sentences: &[&[u32]], skip_special_tokens: bool) {
+        // Decode all sequences in one call and store the strings back to back
+        let texts = self
+            .tokenizer
+            .decode_batch(sentences, skip_special_tokens)
+            .unwrap();
+        self.decode_batch_str.clear();
+        self.decode_batch_offsets.clear();
+        for text in texts {
+            self.decode_batch_str.push_str(&text);
+            self.decode_batch_offsets.push(self.decode_batch_str.len());
+        }
+    }
+
     pub fn get_vocab_size(&self, with_added_tokens: bool) -> usize {
         self.tokenizer.get_vocab_size(with_added_tokens)
     }
@@ -463,6 +481,8 @@ extern "C" fn tokenizer_from_file(path: *const c_char) -> *mut TokenizerWrapper
         tokenizer: Tokenizer::from_file(path_str).unwrap().into(),
         encode_ids: Vec::new(),
         decode_str: String::new(),
+        decode_batch_str: String::new(),
+        decode_batch_offsets: Vec::new(),
         id_to_token_result: String::new(),
     });
 
@@ -519,6 +539,42 @@ extern "C" fn tokenizer_get_decode_str(
     }
 }
 
+// Decode n sequences in one call, the ids of sequence i are
+// input_ids[offsets[i]..offsets[i + 1]].
+#[no_mangle]
+extern "C" fn tokenizer_decode_batch(
+    handle: *mut TokenizerWrapper,
+    input_ids: *const u32,
+    offsets: *const usize,
+    n: usize,
+    skip_special_tokens: bool,
+) {
+    unsafe {
+        let offsets = std::slice::from_raw_parts(offsets, n + 1);
+        let ids = std::slice::from_raw_parts(input_ids, offsets[n]);
+        let sentences: Vec<&[u32]> = (0..n)
+            .map(|i| &ids[offsets[i]..offsets[i + 1]])
+            .collect();
+        (*handle).decode_batch(&sentences, skip_special_tokens);
+    }
+}
+
+// Get the decoded strings of the last batch, the string i is
+// out_cstr[out_offsets[i - 1]..out_offsets[i]] with out_offsets[-1] = 0.
+#[no_mangle]
+extern "C" fn tokenizer_get_decode_batch_str(
+    handle: *mut TokenizerWrapper,
+    out_cstr: *mut *mut u8,
+    out_len: *mut usize,
+    out_offsets: *mut *const usize,
+) {
+    unsafe {
+        *out_cstr = (*handle).decode_batch_str.as_mut_ptr();
+        *out_len = (*handle).decode_batch_str.len();
+        *out_offsets = (*handle).decode_batch_offsets.as_ptr();
+    }
+}
+
 #[no_mangle]
 extern "C" fn tokenizer_free(wrapper: *mut TokenizerWrapper) {
     unsafe {
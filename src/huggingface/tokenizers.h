@@ -29,6 +29,20 @@ void tokenizer_get_decode_str(TokenizerHandle handle,
                               const char** data,
                               size_t* len);
 
+// decode n sequences in one call, the ids of sequence i are
+// data[offsets[i], offsets[i + 1]).
+void tokenizer_decode_batch(TokenizerHandle handle,
+                            const uint32_t* data,
+                            const size_t* offsets,
+                            size_t n,
+                            bool skip_special_tokens);
+
+// the texts of the last batch back to back, text i ends at offsets[i].
+void tokenizer_get_decode_batch_str(TokenizerHandle handle,
+                                    const char** data,
+                                    size_t* len,
+                                    const size_t** offsets);
+
 void tokenizer_get_encode_ids(TokenizerHandle handle,
                               const uint32_t** id_data,
                               size_t* len);
@@ -0,0 +1,326 @@
+#include <ATen/cuda/CUDAContext.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+
+#include "all_reduce_kernels.h"
+#include "dispatch.h"
+#include "reduce_kernel_utils.cuh"
+
+namespace llm::kernel {
+
+namespace {
+// 16 bytes of elements, loaded and stored with one vector instruction
+template <typename T>
+struct alignas(16) Pack {
+  static constexpr int kSize = 16 / sizeof(T);
+  T data[kSize];
+};
+
+// sync the thread block with the same thread block of all peers. all writes
+// of the block before the barrier are visible to the peers after it. value
+// increases with each barrier, so a peer can't be mistaken as arrived.
+__device__ __forceinline__ void block_barrier(const AllReduceBuffers& p,
+                                              uint32_t value) {
+  __syncthreads();
+  const int peer = threadIdx.x;
+  if (peer < p.world_size) {
+    __threadfence_system();
+    // tell the peer that this block of this rank has arrived
+    volatile uint32_t* flag = &p.signals[peer]->flags[blockIdx.x][p.rank];
+    *flag = value;
+    // wait for the same block of the peer
+    volatile uint32_t* peer_flag =
+        &p.signals[p.rank]->flags[blockIdx.x][peer];
+    while (*peer_flag < value) {
+    }
+    __threadfence_system();
+  }
+  __syncthreads();
+}
+
+// sum the packs at idx of the buffers of all ranks, in the same order on all
+// ranks so that every rank gets bitwise identical results
+template <typename T>
+__device__ __forceinline__ void sum_packs(
+    float (&acc)[Pack<T>::kSize],
+    const AllReduceBuffers& p,
+    int64_t idx) {
+  using P = Pack<T>;
+#pragma unroll
+  for (int j = 0; j < P::kSize; ++j) {
+    acc[j] = 0.0f;
+  }
+  for (int r = 0; r < p.world_size; ++r) {
+    const P v = reinterpret_cast<const P*>(p.buffers[r])[idx];
+#pragma unroll
+    for (int j = 0; j < P::kSize; ++j) {
+      acc[j] += (float)v.data[j];
+    }
+  }
+}
+}  // namespace
+
+template <typename T>
+__global__ void one_shot_all_reduce_kernel(T* __restrict__ data,
+                                           const AllReduceBuffers p,
+                                           int64_t n_packs) {
+  using P = Pack<T>;
+  AllReduceSignal* self = p.signals[p.rank];
+  const uint32_t base = self->counters[blockIdx.x];
+  const int64_t start = int64_t(blockIdx.x) * blockDim.x + threadIdx.x;
+  const int64_t stride = int64_t(gridDim.x) * blockDim.x;
+
+  // stage the input, each block reads back from the peers exactly the packs
+  // it wrote, so syncing the same block across ranks is enough
+  P* staging = reinterpret_cast<P*>(p.buffers[p.rank]);
+  P* packs = reinterpret_cast<P*>(data);
+  for (int64_t i = start; i < n_packs; i += stride) {
+    staging[i] = packs[i];
+  }
+  block_barrier(p, base + 1);
+
+  for (int64_t i = start; i < n_packs; i += stride) {
+    float acc[P::kSize];
+    sum_packs<T>(acc, p, i);
+    P out;
+#pragma unroll
+    for (int j = 0; j < P::kSize; ++j) {
+      out.data[j] = static_cast<T>(acc[j]);
+    }
+    packs[i] = out;
+  }
+  // the peers are done reading the staging buffer before it is reused
+  block_barrier(p, base + 2);
+  if (threadIdx.x == 0) {
+    self->counters[blockIdx.x] = base + 2;
+  }
+}
+
+template <typename T>
+__global__ void two_shot_all_reduce_kernel(T* __restrict__ data,
+                                           const AllReduceBuffers p,
+                                           int64_t n_packs) {
+  using P = Pack<T>;
+  AllReduceSignal* self = p.signals[p.rank];
+  const uint32_t base = self->counters[blockIdx.x];
+  const int64_t start = int64_t(blockIdx.x) * blockDim.x + threadIdx.x;
+  const int64_t stride = int64_t(gridDim.x) * blockDim.x;
+  // packs of each slice, rank r reduces [r * part, (r + 1) * part)
+  const int64_t part = (n_packs + p.world_size - 1) / p.world_size;
+  // reduced slices follow the staged inputs in the buffers
+  const int64_t result_offset = p.max_bytes / sizeof(P);
+
+  // stage the input with the same offsets within each slice, so the packs
+  // of a slice are reduced by the block that staged them on every rank
+  P* staging = reinterpret_cast<P*>(p.buffers[p.rank]);
+  P* packs = reinterpret_cast<P*>(data);
+  for (int64_t i = start; i < part; i += stride) {
+    for (int s = 0; s < p.world_size; ++s) {
+      const int64_t idx = s * part + i;
+      if (idx < n_packs) {
+        staging[idx] = packs[idx];
+      }
+    }
+  }
+  block_barrier(p, base + 1);
+
+  // reduce-scatter: reduce the slice of this rank
+  for (int64_t i = start; i < part; i += stride) {
+    const int64_t idx = p.rank * part + i;
+    if (idx < n_packs) {
+      float acc[P::kSize];
+      sum_packs<T>(acc, p, idx);
+      P out;
+#pragma unroll
+      for (int j = 0; j < P::kSize; ++j) {
+        out.data[j] = static_cast<T>(acc[j]);
+      }
+      staging[result_offset + idx] = out;
+    }
+  }
+  block_barrier(p, base + 2);
+
+  // all-gather: read the reduced slice of each peer
+  for (int64_t i = start; i < part; i += stride) {
+    for (int s = 0; s < p.world_size; ++s) {
+      const int64_t idx = s * part + i;
+      if (idx < n_packs) {
+        packs[idx] =
+            reinterpret_cast<const P*>(p.buffers[s])[result_offset + idx];
+      }
+    }
+  }
+  block_barrier(p, base + 3);
+  if (threadIdx.x == 0) {
+    self->counters[blockIdx.x] = base + 3;
+  }
+}
+
+// one-shot all-reduce with one row per block at a time, the reduced row is
+// added into the residual and normalized like rms_norm_residual_kernel.
+template <typename T>
+__global__ void all_reduce_rms_norm_residual_kernel(
+    T* __restrict__ out,
+    T* __restrict__ residual,
+    const T* __restrict__ input,
+    const T* __restrict__ weight,
+    const float epsilon,
+    const AllReduceBuffers p,
+    int64_t n_rows,
+    int64_t n) {
+  using P = Pack<T>;
+  AllReduceSignal* self = p.signals[p.rank];
+  const uint32_t base = self->counters[blockIdx.x];
+  const int tidx = threadIdx.x;
+  const int64_t row_packs = n / P::kSize;
+
+  P* staging = reinterpret_cast<P*>(p.buffers[p.rank]);
+  const P* in_packs = reinterpret_cast<const P*>(input);
+  for (int64_t row = blockIdx.x; row < n_rows; row += gridDim.x) {
+    for (int64_t i = tidx; i < row_packs; i += blockDim.x) {
+      const int64_t idx = row * row_packs + i;
+      staging[idx] = in_packs[idx];
+    }
+  }
+  block_barrier(p, base + 1);
+
+  __shared__ float s_variance;
+  P* res_packs = reinterpret_cast<P*>(residual);
+  P* out_packs = reinterpret_cast<P*>(out);
+  const P* w_packs = reinterpret_cast<const P*>(weight);
+  for (int64_t row = blockIdx.x; row < n_rows; row += gridDim.x) {
+    float variance = 0.0f;
+    for (int64_t i = tidx; i < row_packs; i += blockDim.x) {
+      const int64_t idx = row * row_packs + i;
+      float acc[P::kSize];
+      sum_packs<T>(acc, p, idx);
+      P r = res_packs[idx];
+#pragma unroll
+      for (int j = 0; j < P::kSize; ++j) {
+        const float x = (float)r.data[j] + acc[j];
+        r.data[j] = static_cast<T>(x);
+        variance += x * x;
+      }
+      res_packs[idx] = r;
+    }
+    variance = block_reduce_sum<float>(variance);
+    if (tidx == 0) {
+      s_variance = rsqrtf(variance / n + epsilon);
+    }
+    __syncthreads();
+
+    for (int64_t i = tidx; i < row_packs; i += blockDim.x) {
+      const int64_t idx = row * row_packs + i;
+      const P r = res_packs[idx];
+      const P w = w_packs[i];
+      P o;
+#pragma unroll
+      for (int j = 0; j < P::kSize; ++j) {
+        const float x = r.data[j];
+        o.data[j] = (T)(x * s_variance) * w.data[j];
+      }
+      out_packs[idx] = o;
+    }
+    // s_variance and the shared memory of the reduction are reused
+    __syncthreads();
+  }
+  block_barrier(p, base + 2);
+  if (tidx == 0) {
+    self->counters[blockIdx.x] = base + 2;
+  }
+}
+
+namespace {
+constexpr int kAllReduceThreads = 512;
+
+void check_all_reduce_input(const torch::Tensor& input,
+                            const AllReduceBuffers& bufs) {
+  CHECK(input.is_cuda() && input.is_contiguous())
+      << "input must be contiguous on device";
+  CHECK(bufs.world_size > 1 && bufs.world_size <= kMaxAllReduceRanks)
+      << "unsupported world size " << bufs.world_size;
+  CHECK(input.nbytes() <= bufs.max_bytes && input.nbytes() % 16 == 0)
+      << "unsupported all-reduce size " << input.nbytes();
+}
+
+int all_reduce_blocks(int64_t n) {
+  const int64_t blocks = (n + kAllReduceThreads - 1) / kAllReduceThreads;
+  return static_cast<int>(
+      std::clamp<int64_t>(blocks, 1, kMaxAllReduceBlocks));
+}
+}  // namespace
+
+void one_shot_all_reduce(torch::Tensor& input, const AllReduceBuffers& bufs) {
+  check_all_reduce_input(input, bufs);
+  const int64_t n_packs = input.nbytes() / 16;
+  if (n_packs == 0) {
+    return;
+  }
+
+  dim3 grid(all_reduce_blocks(n_packs));
+  dim3 block(kAllReduceThreads);
+  auto stream = at::cuda::getCurrentCUDAStream();
+  DISPATCH_FLOATING_TYPES(
+      input.scalar_type(), "one_shot_all_reduce_kernel", [&] {
+        one_shot_all_reduce_kernel<scalar_t><<<grid, block, 0, stream>>>(
+            input.data_ptr<scalar_t>(), bufs, n_packs);
+      });
+}
+
+void two_shot_all_reduce(torch::Tensor& input, const AllReduceBuffers& bufs) {
+  check_all_reduce_input(input, bufs);
+  const int64_t n_packs = input.nbytes() / 16;
+  if (n_packs == 0) {
+    return;
+  }
+
+  const int64_t part = (n_packs + bufs.world_size - 1) / bufs.world_size;
+  dim3 grid(all_reduce_blocks(part));
+  dim3 block(kAllReduceThreads);
+  auto stream = at::cuda::getCurrentCUDAStream();
+  DISPATCH_FLOATING_TYPES(
+      input.scalar_type(), "two_shot_all_reduce_kernel", [&] {
+        two_shot_all_reduce_kernel<scalar_t><<<grid, block, 0, stream>>>(
+            input.data_ptr<scalar_t>(), bufs, n_packs);
+      });
+}
+
+void all_reduce_rms_norm_residual(torch::Tensor& out,
+                                  torch::Tensor& residual,
+                                  torch::Tensor input,
+                                  torch::Tensor weight,
+                                  float epsilon,
+                                  const AllReduceBuffers& bufs) {
+  check_all_reduce_input(input, bufs);
+  DCHECK(out.is_contiguous()) << "output tensor must be contiguous";
+  DCHECK(residual.is_contiguous()) << "residual tensor must be contiguous";
+  const int64_t n_rows = input.size(0);
+  const int64_t n = input.size(1);
+  CHECK((n * input.element_size()) % 16 == 0)
+      << "unsupported hidden size " << n;
+  if (n_rows == 0) {
+    return;
+  }
+
+  const int64_t row_packs = n * input.element_size() / 16;
+  dim3 grid(std::min<int64_t>(n_rows, kMaxAllReduceBlocks));
+  // whole warps for the block reduction
+  dim3 block(std::min<int64_t>((row_packs + 31) / 32 * 32, 1024));
+  auto stream = at::cuda::getCurrentCUDAStream();
+  DISPATCH_FLOATING_TYPES(
+      input.scalar_type(), "all_reduce_rms_norm_residual_kernel", [&] {
+        all_reduce_rms_norm_residual_kernel<scalar_t>
+            <<<grid, block, 0, stream>>>(out.data_ptr<scalar_t>(),
+                                         residual.data_ptr<scalar_t>(),
+                                         input.data_ptr<scalar_t>(),
+                                         weight.data_ptr<scalar_t>(),
+                                         epsilon,
+                                         bufs,
+                                         n_rows,
+                                         n);
+      });
+}
+
+}  // namespace llm::kernel
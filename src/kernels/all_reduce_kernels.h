@@ -0,0 +1,55 @@
+#pragma once
+#include <torch/torch.h>
+
+#include <cstdint>
+
+namespace llm::kernel {
+
+// max number of ranks and thread blocks of the custom all-reduce kernels. the
+// thread blocks of all ranks must be resident at the same time since they
+// spin on each other, so the grid is kept small.
+inline constexpr int kMaxAllReduceRanks = 8;
+inline constexpr int kMaxAllReduceBlocks = 36;
+
+// flags to synchronize the same thread block across ranks, one per rank in
+// device memory and zero initialized.
+struct AllReduceSignal {
+  // flags[block][rank]: number of barriers passed by the block of the rank
+  uint32_t flags[kMaxAllReduceBlocks][kMaxAllReduceRanks];
+  // number of barriers passed by each block of this rank
+  uint32_t counters[kMaxAllReduceBlocks];
+};
+
+// staging buffers and signals of all ranks, the pointers of the peers are
+// accessed directly with peer access enabled.
+struct AllReduceBuffers {
+  // each buffer holds max_bytes for the input followed by max_bytes for the
+  // reduced slice of the two-shot algorithm
+  void* buffers[kMaxAllReduceRanks] = {nullptr};
+  AllReduceSignal* signals[kMaxAllReduceRanks] = {nullptr};
+  int64_t max_bytes = 0;
+  int rank = 0;
+  int world_size = 0;
+};
+
+// one-shot all-reduce: each rank reads the inputs of all peers and reduces
+// the whole tensor. one round of peer reads, best for small messages.
+// input is reduced in place, input.nbytes() <= max_bytes.
+void one_shot_all_reduce(torch::Tensor& input, const AllReduceBuffers& bufs);
+
+// two-shot all-reduce: reduce-scatter followed by all-gather, each rank
+// reduces 1/world_size of the tensor. moves less data over the links for
+// larger messages. input is reduced in place, input.nbytes() <= max_bytes.
+void two_shot_all_reduce(torch::Tensor& input, const AllReduceBuffers& bufs);
+
+// one-shot all-reduce of the input fused with the residual add and rms norm:
+// residual += all_reduce(input), out = rms_norm(residual) * weight
+// input/residual/out: [n_tokens, dim], weight: [dim]
+void all_reduce_rms_norm_residual(torch::Tensor& out,
+                                  torch::Tensor& residual,
+                                  torch::Tensor input,
+                                  torch::Tensor weight,
+                                  float epsilon,
+                                  const AllReduceBuffers& bufs);
+
+}  // namespace llm::kernel
@@ -1,11 +1,38 @@
 #include "attn_api.h"
 
 #include <ATen/cuda/CUDAContext.h>
+#include <ATen/cuda/CUDAEvent.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <limits>
+#include <mutex>
+#include <string>
 
 #include "cute/layout.hpp"
 #include "mha_params.h"
+#include "mha_tile_table.h"
 #include "static_dispatch.h"
 
+DEFINE_bool(mha_autotune,
+            false,
+            "time the tile configs of the attention kernel at the first use "
+            "of each problem shape and use the fastest one");
+
+DEFINE_string(mha_tune_cache,
+              "",
+              "file to load the tuned attention tile configs from and to save "
+              "them to");
+
+DEFINE_bool(batch_invariant,
+            false,
+            "make the outputs of each sequence independent of the other "
+            "sequences in the batch, for reproducible logits, with fixed "
+            "tiles and reduction orders in attention and dense linear layers "
+            "at the cost of some throughput. tensor parallel all-reduce is "
+            "not covered.");
+
 namespace llm {
 using namespace cute;
 
@@ -13,51 +40,133 @@ using namespace cute;
 template <typename Dtype, int HEAD_DIM, typename Params>
 void run_mha_kernel_sm80(Params& params, cudaStream_t stream);
 
-void paged_kv_varlen_mha(
-    torch::Tensor& out,                // [n_tokens, n_heads, head_dim]
-    const torch::Tensor& query,        // [n_tokens, n_heads, head_dim]
-    const torch::Tensor& key_cache,    // [n_slots, n_kv_heads, head_dim]
-    const torch::Tensor& value_cache,  // [n_slots, n_kv_heads, head_dim]
-    const torch::Tensor& q_cu_lens,    // [batch + 1]
-    const torch::Tensor& kv_cu_lens,   // [batch + 1]
+template <typename Dtype, int HEAD_DIM, typename Params>
+void run_mha_kernel_sm90(Params& params, cudaStream_t stream);
+
+namespace {
+// number of query rows per thread block of the persistent kernel
+constexpr int kBlockM = kMHABlockM;
+// min number of kv tokens per split to amortize the merge
+constexpr int kMinKVPerSplit = 512;
+// number of untimed and timed runs of each candidate tile config
+constexpr int kWarmupIters = 2;
+constexpr int kTuneIters = 10;
+
+// the smallest query tile that holds the packed query rows of a sequence and
+// kv head, for batches with few query tokens per sequence, e.g. speculative
+// verification. decode and prefill batches use the 64-row tile.
+int choose_block_m(const MHAPagedKVParams& params) {
+  if (FLAGS_batch_invariant || params.max_q_len <= 1 ||
+      params.kv_type != MHAKVType::kSame) {
+    // in batch invariant mode, the tile of a sequence would depend on the
+    // longest one in the batch. the quantized kv cache only comes with the
+    // default tiles.
+    return kMHABlockM;
+  }
+  const int group_size = params.n_heads / params.n_kv_heads;
+  const int q_packed_len = params.max_q_len * group_size;
+  for (const int block_m : kMHASmallBlockMCandidates) {
+    if (q_packed_len <= block_m) {
+      return block_m;
+    }
+  }
+  return kMHABlockM;
+}
+
+// split kv across thread blocks when (batch, kv_heads, q_blocks) can't fill
+// the gpu, e.g. decoding few sequences with long context.
+int num_kv_splits(const MHAPagedKVParams& params, int max_kv_len) {
+  if (FLAGS_batch_invariant) {
+    // the merge order of the splits depends on the batch
+    return 1;
+  }
+  const int group_size = params.n_heads / params.n_kv_heads;
+  const int n_blocks =
+      params.batch_size * params.n_kv_heads *
+      cute::ceil_div(params.max_q_len * group_size, params.block_m);
+  const int n_sms = at::cuda::getCurrentDeviceProperties()->multiProcessorCount;
+  if (n_blocks * 5 >= n_sms * 4) {
+    // already 80% of the sms are busy
+    return 1;
+  }
+  const int max_splits = std::min(kMaxKVSplits, max_kv_len / kMinKVPerSplit);
+  if (max_splits <= 1) {
+    return 1;
+  }
+  return std::min(max_splits, cute::ceil_div(n_sms, n_blocks));
+}
+
+// use the persistent kernel when most of the launched thread blocks would
+// exit early, e.g. prefilling a batch of sequences with varied lengths.
+bool use_persistent_kernel(const MHAPagedKVParams& params, int n_tokens) {
+  if (FLAGS_batch_invariant || params.block_m != kBlockM) {
+    // the partial tiles of a sequence are merged based on the batch, and
+    // the work items are planned with 64-row tiles
+    return false;
+  }
+  const int group_size = params.n_heads / params.n_kv_heads;
+  const int64_t n_launched = int64_t(params.batch_size) *
+                             cute::ceil_div(params.max_q_len * group_size,
+                                            kBlockM);
+  const int64_t n_useful = std::max<int64_t>(
+      params.batch_size, cute::ceil_div(n_tokens * group_size, kBlockM));
+  return n_launched > 2 * n_useful;
+}
+
+MHAPagedKVParams make_paged_kv_params(
+    torch::Tensor& out,
+    const torch::Tensor& query,
+    const torch::Tensor& key_cache,
+    const torch::Tensor& value_cache,
+    const torch::Tensor& q_cu_lens,
+    const torch::Tensor& kv_cu_lens,
     const torch::Tensor& block_table,
-    const torch::Tensor& block_cu_lens,                // [batch + 1]
-    const std::optional<torch::Tensor>& alibi_slopes,  // [n_heads]
+    const torch::Tensor& block_cu_lens,
+    const std::optional<torch::Tensor>& alibi_slopes,
     int block_size,
     int max_q_len,
-    int max_kv_len,
     float sm_scale,
     float logits_soft_cap,
-    int sliding_window) {
-  const int batch_size = q_cu_lens.size(0) - 1;
-  const int n_heads = query.size(-2);
-  const int n_kv_heads = key_cache.size(-2);
-  const int head_dim = query.size(-1);
-
+    int sliding_window,
+    const std::optional<torch::Tensor>& tree_mask,
+    const std::optional<torch::Tensor>& key_scale,
+    const std::optional<torch::Tensor>& value_scale) {
   // construct attention params
   MHAPagedKVParams params;
   params.q_ptr = query.const_data_ptr();
   params.q_stride = make_stride(query.stride(0), query.stride(1));
   params.k_ptr = key_cache.const_data_ptr();
-  params.k_stride = make_stride(key_cache.stride(0), key_cache.stride(1));
   params.v_ptr = value_cache.const_data_ptr();
-  params.v_stride = make_stride(value_cache.stride(0), value_cache.stride(1));
+  if (key_cache.dim() == 4) {
+    // [n_blocks, block_size, n_kv_heads, head_dim] view of any layout
+    CHECK_EQ(key_cache.size(1), block_size) << "block_size mismatch";
+    params.k_stride = make_stride(key_cache.stride(1), key_cache.stride(2));
+    params.v_stride = make_stride(value_cache.stride(1), value_cache.stride(2));
+    params.k_block_stride = key_cache.stride(0);
+    params.v_block_stride = value_cache.stride(0);
+  } else {
+    // [n_slots, n_kv_heads, head_dim]
+    params.k_stride = make_stride(key_cache.stride(0), key_cache.stride(1));
+    params.v_stride = make_stride(value_cache.stride(0), value_cache.stride(1));
+  }
   params.o_ptr = out.mutable_data_ptr();
   params.o_stride = make_stride(out.stride(0), out.stride(1));
   params.alibi_slopes_ptr = alibi_slopes.has_value()
                                 ? alibi_slopes.value().const_data_ptr<float>()
                                 : nullptr;
-  params.batch_size = batch_size;
+  params.batch_size = q_cu_lens.size(0) - 1;
   params.block_size = block_size;
   params.max_q_len = max_q_len;
-  (void)max_kv_len;  // unused
-  params.n_heads = n_heads;
-  params.n_kv_heads = n_kv_heads;
-  params.head_dim = head_dim;
+  params.n_heads = query.size(-2);
+  params.n_kv_heads = key_cache.size(-2);
+  params.head_dim = query.size(-1);
 
   params.sm_scale = sm_scale;
   params.logits_soft_cap = logits_soft_cap;
   params.sliding_window = sliding_window;
+  params.tree_mask_ptr = tree_mask.has_value()
+                             ? tree_mask.value().const_data_ptr<int64_t>()
+                             : nullptr;
 
   params.q_cu_lens = q_cu_lens.const_data_ptr<int32_t>();
   params.kv_cu_lens = kv_cu_lens.const_data_ptr<int32_t>();
@@ -65,12 +174,343 @@ void paged_kv_varlen_mha(
   params.block_table = block_table.const_data_ptr<int32_t>();
   params.block_cu_lens = block_cu_lens.const_data_ptr<int32_t>();
 
-  cudaStream_t stream = at::cuda::getCurrentCUDAStream().stream();
-  DISPATCH_HEAD_DIM(head_dim, HEAD_DIM, [&] {
-    DISPATCH_TORCH_DTYPE(query.scalar_type(), DTYPE, [&] {
+  const auto kv_dtype = key_cache.scalar_type();
+  if (kv_dtype != query.scalar_type()) {
+    CHECK(kv_dtype == torch::kInt8 || kv_dtype == torch::kFloat8_e4m3fn)
+        << "unsupported kv cache dtype " << kv_dtype;
+    CHECK(key_scale.has_value() && value_scale.has_value())
+        << "scales are required for the quantized kv cache";
+    // the scales are looked up by the slot ids of the block table
+    CHECK_EQ(key_cache.dim(), 3)
+        << "quantized kv cache only supports the slot major layout";
+    CHECK(key_scale->is_contiguous() && value_scale->is_contiguous());
+    CHECK_EQ(key_scale->scalar_type(), torch::kFloat32);
+    params.kv_type = kv_dtype == torch::kInt8 ? MHAKVType::kInt8
+                                              : MHAKVType::kFp8E4M3;
+    params.k_scale_ptr = key_scale->const_data_ptr<float>();
+    params.v_scale_ptr = value_scale->const_data_ptr<float>();
+  }
+  return params;
+}
+
+void dispatch_mha_kernel_sm80(MHAPagedKVParams& params,
+                              torch::ScalarType dtype,
+                              cudaStream_t stream) {
+  DISPATCH_HEAD_DIM_SM80(params.head_dim, HEAD_DIM, [&] {
+    DISPATCH_TORCH_DTYPE(dtype, DTYPE, [&] {
       run_mha_kernel_sm80<DTYPE, HEAD_DIM>(params, stream);
     });
   });
 }
 
+void maybe_load_tune_cache() {
+  static std::once_flag flag;
+  std::call_once(flag, [] {
+    if (FLAGS_mha_tune_cache.empty()) {
+      return;
+    }
+    auto& table = MHATileTable::get_instance();
+    if (table.load(FLAGS_mha_tune_cache)) {
+      LOG(INFO) << "Loaded " << table.size() << " attention tile entries from "
+                << FLAGS_mha_tune_cache;
+    }
+  });
+}
+
+bool is_capturing_graph(cudaStream_t stream) {
+  cudaStreamCaptureStatus status = cudaStreamCaptureStatusNone;
+  cudaStreamIsCapturing(stream, &status);
+  return status != cudaStreamCaptureStatusNone;
+}
+
+// time the supported tile configs on the inputs and return the fastest one
+int tune_tile_config(const MHAPagedKVParams& params,
+                     torch::ScalarType dtype,
+                     cudaStream_t stream) {
+  int best_config = 0;
+  float best_ms = std::numeric_limits<float>::max();
+  for (int config = 0; config < kNumMHATileConfigs; ++config) {
+    if (!mha_tile_config_supported(config, params.head_dim)) {
+      continue;
+    }
+    auto candidate = params;
+    candidate.tile_config = config;
+    for (int i = 0; i < kWarmupIters; ++i) {
+      dispatch_mha_kernel_sm80(candidate, dtype, stream);
+    }
+    at::cuda::CUDAEvent start(cudaEventDefault);
+    at::cuda::CUDAEvent stop(cudaEventDefault);
+    start.record();
+    for (int i = 0; i < kTuneIters; ++i) {
+      dispatch_mha_kernel_sm80(candidate, dtype, stream);
+    }
+    stop.record();
+    stop.synchronize();
+    const float ms = start.elapsed_time(stop);
+    if (ms < best_ms) {
+      best_ms = ms;
+      best_config = config;
+    }
+  }
+  return best_config;
+}
+
+// the tile config of the problem shape, tuned at its first use if enabled.
+// the kernels are not timed while capturing cuda graphs.
+int choose_tile_config(const MHAPagedKVParams& params,
+                       torch::ScalarType dtype,
+                       cudaStream_t stream,
+                       bool allow_tuning) {
+  if (FLAGS_batch_invariant || params.block_m != kMHABlockM ||
+      params.kv_type != MHAKVType::kSame) {
+    // the same tiles for decode and prefill, regardless of the tuning, and
+    // the small query tiles and the quantized kv cache only come with the
+    // default kv tile
+    return 0;
+  }
+  maybe_load_tune_cache();
+  auto& table = MHATileTable::get_instance();
+  const auto key = MHATileTable::make_key(
+      dtype == torch::kHalf ? "fp16" : "bf16",
+      params.head_dim,
+      params.n_heads / params.n_kv_heads,
+      params.block_size,
+      /*decode=*/params.max_q_len == 1);
+  if (const int config = table.lookup(key); config >= 0) {
+    return config;
+  }
+  if (!FLAGS_mha_autotune || !allow_tuning || is_capturing_graph(stream)) {
+    return 0;
+  }
+
+  const int config = tune_tile_config(params, dtype, stream);
+  table.insert(key, config);
+  LOG(INFO) << "Tuned attention tile config for " << key << ": block_n="
+            << kMHABlockNCandidates[config];
+  if (!FLAGS_mha_tune_cache.empty() && !table.save(FLAGS_mha_tune_cache)) {
+    LOG(WARNING) << "Failed to save attention tile configs to "
+                 << FLAGS_mha_tune_cache;
+  }
+  return config;
+}
+}  // namespace
+
+void paged_kv_varlen_mha(
+    torch::Tensor& out,                // [n_tokens, n_heads, head_dim]
+    const torch::Tensor& query,        // [n_tokens, n_heads, head_dim]
+    const torch::Tensor& key_cache,    // [n_slots, n_kv_heads, head_dim]
+    const torch::Tensor& value_cache,  // [n_slots, n_kv_heads, head_dim]
+    const torch::Tensor& q_cu_lens,    // [batch + 1]
+    const torch::Tensor& kv_cu_lens,   // [batch + 1]
+    const torch::Tensor& block_table,
+    const torch::Tensor& block_cu_lens,                // [batch + 1]
+    const std::optional<torch::Tensor>& alibi_slopes,  // [n_heads]
+    int block_size,
+    int max_q_len,
+    int max_kv_len,
+    float sm_scale,
+    float logits_soft_cap,
+    int sliding_window,
+    const std::optional<torch::Tensor>& tree_mask,     // [n_tokens]
+    const std::optional<torch::Tensor>& key_scale,     // [n_slots, n_kv_heads]
+    const std::optional<torch::Tensor>& value_scale) {  // [n_slots, n_kv_heads]
+  auto params = make_paged_kv_params(out,
+                                     query,
+                                     key_cache,
+                                     value_cache,
+                                     q_cu_lens,
+                                     kv_cu_lens,
+                                     block_table,
+                                     block_cu_lens,
+                                     alibi_slopes,
+                                     block_size,
+                                     max_q_len,
+                                     sm_scale,
+                                     logits_soft_cap,
+                                     sliding_window,
+                                     tree_mask,
+                                     key_scale,
+                                     value_scale);
+  params.block_m = choose_block_m(params);
+
+  // split kv for long context decoding
+  const int n_splits = num_kv_splits(params, max_kv_len);
+  torch::Tensor o_split;
+  torch::Tensor lse_split;
+  if (n_splits > 1) {
+    const int n_tokens = query.size(0);
+    const auto options = query.options().dtype(torch::kFloat32);
+    o_split = torch::empty(
+        {n_tokens, n_splits, params.n_heads, params.head_dim}, options);
+    lse_split = torch::empty({n_tokens, n_splits, params.n_heads}, options);
+    params.n_kv_splits = n_splits;
+    params.n_split_slots = n_splits;
+    params.n_tokens = n_tokens;
+    params.o_split_ptr = o_split.mutable_data_ptr<float>();
+    params.lse_split_ptr = lse_split.mutable_data_ptr<float>();
+  }
+
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream().stream();
+#ifdef USE_MHA_SM90
+  // split kv and the quantized kv cache are only supported by the sm80 kernel
+  const auto* dprops = at::cuda::getCurrentDeviceProperties();
+  if (dprops->major == 9 && n_splits == 1 &&
+      params.kv_type == MHAKVType::kSame) {
+    DISPATCH_HEAD_DIM(params.head_dim, HEAD_DIM, [&] {
+      DISPATCH_TORCH_DTYPE(query.scalar_type(), DTYPE, [&] {
+        run_mha_kernel_sm90<DTYPE, HEAD_DIM>(params, stream);
+      });
+    });
+    return;
+  }
+#endif
+
+  // balance the tiles of varied length sequences across persistent blocks
+  torch::Tensor workspace;
+  torch::Tensor o_partial;
+  torch::Tensor lse_partial;
+  const int n_tokens = query.size(0);
+  if (n_splits == 1 && use_persistent_kernel(params, n_tokens)) {
+    const int n_sms =
+        at::cuda::getCurrentDeviceProperties()->multiProcessorCount;
+    // the launcher caps it by the occupancy of the kernel
+    const int n_ctas = n_sms * 2;
+    const int max_items = mha_max_work_items(n_tokens,
+                                             params.batch_size,
+                                             params.n_heads / params.n_kv_heads,
+                                             params.n_kv_heads,
+                                             n_ctas,
+                                             kBlockM);
+    constexpr int kItemInts = sizeof(MHAWorkItem) / sizeof(int);
+    static_assert(sizeof(MHAWorkItem) == kItemInts * sizeof(int));
+    // work items, merge tiles, cta offsets and the count of merge tiles
+    workspace = torch::empty({(max_items + n_ctas) * kItemInts + n_ctas + 2},
+                             query.options().dtype(torch::kInt32));
+    int* ptr = workspace.mutable_data_ptr<int>();
+    params.n_ctas = n_ctas;
+    params.max_work_items = max_items;
+    params.work_items = reinterpret_cast<MHAWorkItem*>(ptr);
+    ptr += max_items * kItemInts;
+    params.merge_tiles = reinterpret_cast<MHAWorkItem*>(ptr);
+    ptr += n_ctas * kItemInts;
+    params.cta_cu_items = ptr;
+    params.n_merge_tiles = ptr + n_ctas + 1;
+
+    const int n_slots = 2 * n_ctas;
+    const auto options = query.options().dtype(torch::kFloat32);
+    o_partial = torch::empty({n_slots, kBlockM, params.head_dim}, options);
+    lse_partial = torch::empty({n_slots, kBlockM}, options);
+    params.o_partial_ptr = o_partial.mutable_data_ptr<float>();
+    params.lse_partial_ptr = lse_partial.mutable_data_ptr<float>();
+  }
+  params.tile_config = choose_tile_config(
+      params, query.scalar_type(), stream, /*allow_tuning=*/true);
+  dispatch_mha_kernel_sm80(params, query.scalar_type(), stream);
+}
+
+void paged_kv_cascade_mha(
+    torch::Tensor& out,                // [n_tokens, n_heads, head_dim]
+    const torch::Tensor& query,        // [n_tokens, n_heads, head_dim]
+    const torch::Tensor& key_cache,    // [n_slots, n_kv_heads, head_dim]
+    const torch::Tensor& value_cache,  // [n_slots, n_kv_heads, head_dim]
+    const torch::Tensor& block_table,
+    const torch::Tensor& prefix_q_cu_lens,      // [n_groups + 1]
+    const torch::Tensor& prefix_kv_cu_lens,     // [n_groups + 1]
+    const torch::Tensor& prefix_block_cu_lens,  // [n_groups + 1]
+    const torch::Tensor& q_cu_lens,             // [batch + 1]
+    const torch::Tensor& kv_cu_lens,            // [batch + 1]
+    const torch::Tensor& block_cu_lens,         // [batch + 1]
+    const std::optional<torch::Tensor>& alibi_slopes,      // [n_heads]
+    const std::optional<torch::Tensor>& alibi_kv_offsets,  // [batch]
+    int block_size,
+    int max_prefix_q_len,
+    int max_prefix_kv_len,
+    int max_q_len,
+    int max_kv_len,
+    float sm_scale,
+    float logits_soft_cap,
+    const std::optional<torch::Tensor>& tree_mask,     // [n_tokens]
+    const std::optional<torch::Tensor>& key_scale,     // [n_slots, n_kv_heads]
+    const std::optional<torch::Tensor>& value_scale) {  // [n_slots, n_kv_heads]
+  // 1> all query tokens of a group attend to the shared prefix
+  auto prefix_params = make_paged_kv_params(out,
+                                            query,
+                                            key_cache,
+                                            value_cache,
+                                            prefix_q_cu_lens,
+                                            prefix_kv_cu_lens,
+                                            block_table,
+                                            prefix_block_cu_lens,
+                                            alibi_slopes,
+                                            block_size,
+                                            max_prefix_q_len,
+                                            sm_scale,
+                                            logits_soft_cap,
+                                            /*sliding_window=*/-1,
+                                            /*tree_mask=*/std::nullopt,
+                                            key_scale,
+                                            value_scale);
+  prefix_params.causal = false;
+  // 2> each sequence attends to its own suffix with causal mask
+  auto params = make_paged_kv_params(out,
+                                     query,
+                                     key_cache,
+                                     value_cache,
+                                     q_cu_lens,
+                                     kv_cu_lens,
+                                     block_table,
+                                     block_cu_lens,
+                                     alibi_slopes,
+                                     block_size,
+                                     max_q_len,
+                                     sm_scale,
+                                     logits_soft_cap,
+                                     /*sliding_window=*/-1,
+                                     tree_mask,
+                                     key_scale,
+                                     value_scale);
+  if (alibi_slopes.has_value()) {
+    // the suffix starts after the shared prefix in the alibi bias, which
+    // keeps the scores of both passes consistent for the merge
+    CHECK(alibi_kv_offsets.has_value())
+        << "alibi_kv_offsets is required for cascade attention with alibi";
+    params.alibi_kv_offsets =
+        alibi_kv_offsets.value().const_data_ptr<int32_t>();
+  }
+
+  // both passes write into the slots of the same split buffers, which are
+  // merged by the last launch.
+  const int n_prefix_splits =
+      std::min(num_kv_splits(prefix_params, max_prefix_kv_len),
+               kMaxKVSplits / 2);
+  const int n_splits =
+      std::min(num_kv_splits(params, max_kv_len), kMaxKVSplits / 2);
+  const int n_slots = n_prefix_splits + n_splits;
+  const int n_tokens = query.size(0);
+  const auto options = query.options().dtype(torch::kFloat32);
+  auto o_split = torch::empty(
+      {n_tokens, n_slots, params.n_heads, params.head_dim}, options);
+  auto lse_split = torch::empty({n_tokens, n_slots, params.n_heads}, options);
+  for (auto* p : {&prefix_params, &params}) {
+    p->n_split_slots = n_slots;
+    p->n_tokens = n_tokens;
+    p->o_split_ptr = o_split.mutable_data_ptr<float>();
+    p->lse_split_ptr = lse_split.mutable_data_ptr<float>();
+  }
+  prefix_params.n_kv_splits = n_prefix_splits;
+  params.n_kv_splits = n_splits;
+  params.split_offset = n_prefix_splits;
+
+  // split slots are only supported by the sm80 kernel
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream().stream();
+  // the passes merge into the same buffers, use the configs tuned without
+  // cascade instead of timing them.
+  const int config = choose_tile_config(
+      params, query.scalar_type(), stream, /*allow_tuning=*/false);
+  prefix_params.tile_config = config;
+  params.tile_config = config;
+  dispatch_mha_kernel_sm80(prefix_params, query.scalar_type(), stream);
+  dispatch_mha_kernel_sm80(params, query.scalar_type(), stream);
+}
+
 }  // namespace llm
@@ -1,6 +1,9 @@
+#include <gflags/gflags.h>
 #include <torch/torch.h>
 #include <torch/types.h>
 
+DECLARE_bool(batch_invariant);
+
 namespace llm {
 // the input tensors are packed into one-dimensional tensors, and the sequence
 // lengths are stored in q_cu_lens and k_cu_lens.
@@ -9,6 +12,10 @@ namespace llm {
 // the length: q/kv_cu_lens[i+1] - q/kv_cu_lens[i].
 // the maximum sequence length is max_q_len and max_kv_len, which are used
 // to decide the kernel dispatch.
+// tree_mask holds one bitmask per query token for tree speculative decoding,
+// bit j is set if the token attends to the j-th new token of its sequence.
+// an int8 or fp8 (e4m3) kv cache is dequantized inside the kernel with
+// key_scale/value_scale, one float scale per slot and kv head.
 void paged_kv_varlen_mha(
     torch::Tensor& out,                // [n_tokens, n_heads, head_dim]
     const torch::Tensor& query,        // [n_tokens, n_heads, head_dim]
@@ -24,6 +31,50 @@ void paged_kv_varlen_mha(
     int max_kv_len,
     float sm_scale,
     float logits_soft_cap,
-    int sliding_window);
+    int sliding_window,
+    const std::optional<torch::Tensor>& tree_mask =
+        std::nullopt,  // [n_tokens]
+    const std::optional<torch::Tensor>& key_scale =
+        std::nullopt,  // [n_slots, n_kv_heads]
+    const std::optional<torch::Tensor>& value_scale =
+        std::nullopt);  // [n_slots, n_kv_heads]
+
+// cascade attention for groups of consecutive sequences sharing kv prefixes:
+// 1> all query tokens of a group attend to the shared prefix without causal
+//    mask, reading the shared blocks once for the group.
+// 2> each sequence attends to its own suffix with causal mask.
+// the partial outputs of both passes are merged by their log-sum-exp. the
+// prefix_* tensors describe the groups in the same way as the sequences, the
+// block_cu_lens hold the offset of the first block in block_table. with alibi,
+// alibi_kv_offsets hold the shared prefix length of each sequence, which is
+// the position of its first suffix kv token. sliding window is not supported.
+// the quantized kv cache is handled as in paged_kv_varlen_mha.
+void paged_kv_cascade_mha(
+    torch::Tensor& out,                // [n_tokens, n_heads, head_dim]
+    const torch::Tensor& query,        // [n_tokens, n_heads, head_dim]
+    const torch::Tensor& key_cache,    // [n_slots, n_kv_heads, head_dim]
+    const torch::Tensor& value_cache,  // [n_slots, n_kv_heads, head_dim]
+    const torch::Tensor& block_table,
+    const torch::Tensor& prefix_q_cu_lens,      // [n_groups + 1]
+    const torch::Tensor& prefix_kv_cu_lens,     // [n_groups + 1]
+    const torch::Tensor& prefix_block_cu_lens,  // [n_groups + 1]
+    const torch::Tensor& q_cu_lens,             // [batch + 1]
+    const torch::Tensor& kv_cu_lens,            // [batch + 1], suffix only
+    const torch::Tensor& block_cu_lens,         // [batch + 1], suffix only
+    const std::optional<torch::Tensor>& alibi_slopes,      // [n_heads]
+    const std::optional<torch::Tensor>& alibi_kv_offsets,  // [batch]
+    int block_size,
+    int max_prefix_q_len,
+    int max_prefix_kv_len,
+    int max_q_len,
+    int max_kv_len,
+    float sm_scale,
+    float logits_soft_cap,
+    const std::optional<torch::Tensor>& tree_mask =
+        std::nullopt,  // [n_tokens]
+    const std::optional<torch::Tensor>& key_scale =
+        std::nullopt,  // [n_slots, n_kv_heads]
+    const std::optional<torch::Tensor>& value_scale =
+        std::nullopt);  // [n_slots, n_kv_heads]
 
 }  // namespace llm
\ No newline at end of file
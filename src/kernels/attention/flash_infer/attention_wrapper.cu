@@ -8,6 +8,7 @@
 #include <flashinfer/attention/warp_layout.cuh>
 
 #include "attention_wrapper.h"
+#include "handler.h"
 #include "kv_cache.h"
 #include "static_switch.h"
 
@@ -127,6 +128,15 @@ cudaError_t mha_varlen_wrapper_dispatch(BatchPrefillHandler* handler,
   return cudaSuccess;
 }
 
+BatchPrefillWrapper::BatchPrefillWrapper(bool enable_cuda_graph)
+    : handler_(std::make_unique<BatchPrefillHandler>(enable_cuda_graph)) {}
+
+BatchPrefillWrapper::~BatchPrefillWrapper() = default;
+
+bool BatchPrefillWrapper::IsCUDAGraphEnabled() const {
+  return handler_->IsCUDAGraphEnabled();
+}
+
 void BatchPrefillWrapper::Plan(torch::Tensor float_workspace_buffer,
                                torch::Tensor int_workspace_buffer,
                                torch::Tensor qo_indptr,
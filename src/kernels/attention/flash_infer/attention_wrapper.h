@@ -3,15 +3,19 @@
 
 #include <torch/torch.h>
 
-#include "handler.h"
+#include <memory>
+#include <optional>
 
 namespace flashinfer {
 
+// defined in handler.h, which is only included by the cuda sources
+class BatchPrefillHandler;
+
 class BatchPrefillWrapper {
  public:
-  BatchPrefillWrapper(bool enable_cuda_graph)
-      : handler_(std::make_unique<flashinfer::BatchPrefillHandler>(
-            enable_cuda_graph)) {}
+  BatchPrefillWrapper(bool enable_cuda_graph);
+
+  ~BatchPrefillWrapper();
 
   void Plan(torch::Tensor float_workspace_buffer,
             torch::Tensor int_workspace_buffer,
@@ -25,7 +29,7 @@ class BatchPrefillWrapper {
             torch::Tensor empty_q_data,
             int32_t num_sm);
 
-  bool IsCUDAGraphEnabled() const { return handler_->IsCUDAGraphEnabled(); }
+  bool IsCUDAGraphEnabled() const;
 
   void UpdatePageLockedBufferSize(uint32_t int_workspace_size_in_bytes);
 
@@ -12,7 +12,11 @@ DTYPE_MAP = {
     "bf16": "cute::bfloat16_t",
 }
 
-HEAD_DIMENSIONS = [64, 96, 128, 256]
+# exact head dims of the sm80 kernels, see DISPATCH_HEAD_DIM_SM80
+HEAD_DIMENSIONS = {
+    "sm80": [64, 80, 96, 112, 128, 160, 192, 256],
+    "sm90": [64, 96, 128, 256],
+}
 
 PAGEDKV_KERNEL_IMPL_TEMPLATE = """
 #include "mha_launch_sm80.cuh" // IWYU pragma: keep
@@ -26,25 +30,46 @@ template void run_mha_kernel_sm80<{DTYPE}, {HEAD_DIM}, Params>(
 }}  // namespace llm
 """
 
+PAGEDKV_KERNEL_SM90_IMPL_TEMPLATE = """
+#include "mha_launch_sm90.cuh" // IWYU pragma: keep
+
+namespace llm {{
+
+using Params = MHAPagedKVParams;
+template void run_mha_kernel_sm90<{DTYPE}, {HEAD_DIM}, Params>(
+    Params& params, cudaStream_t stream);
+
+}}  // namespace llm
+"""
+
+TEMPLATE_MAP = {
+    "sm80": PAGEDKV_KERNEL_IMPL_TEMPLATE,
+    "sm90": PAGEDKV_KERNEL_SM90_IMPL_TEMPLATE,
+}
+
 @dataclass
 class Kernel:
     dtype: str
     head_dim: int
+    arch: str
 
     @property
     def template(self) -> str:
-        return PAGEDKV_KERNEL_IMPL_TEMPLATE.format(
+        return TEMPLATE_MAP[self.arch].format(
             DTYPE=DTYPE_MAP[self.dtype], HEAD_DIM=self.head_dim
         )
 
     @property
     def filename(self) -> str:
-        return f"mha_{self.dtype}_hd{self.head_dim}_sm80.cu"
+        return f"mha_{self.dtype}_hd{self.head_dim}_{self.arch}.cu"
 
 
 def get_all_kernels() -> Iterator[Kernel]:
-    for dtype, head_dim in itertools.product(DTYPE_MAP.keys(), HEAD_DIMENSIONS):
-        yield Kernel(dtype=dtype, head_dim=head_dim)
+    for arch in TEMPLATE_MAP.keys():
+        for dtype, head_dim in itertools.product(
+            DTYPE_MAP.keys(), HEAD_DIMENSIONS[arch]
+        ):
+            yield Kernel(dtype=dtype, head_dim=head_dim, arch=arch)
 
 
 if __name__ == "__main__":
@@ -27,6 +27,12 @@ struct Mask {
 
   FragmentT alibi_slopes_;
 
+  // tree mask of the query tokens, nullptr for causal mask
+  const int64_t* tree_mask_;
+
+  // position of the first kv token in the alibi bias
+  int alibi_kv_offset_;
+
   CUTE_HOST_DEVICE Mask(int tidx,
                         int m_block,
                         int q_len,
@@ -35,11 +41,15 @@ struct Mask {
                         int group_size,
                         int sliding_window,
                         float sm_scale,
-                        const float* alibi_slops_ptr)
+                        const float* alibi_slops_ptr,
+                        const int64_t* tree_mask = nullptr,
+                        int alibi_kv_offset = 0)
       : q_len_(q_len),
         kv_len_(kv_len),
         group_size_(group_size),
-        sliding_window_(sliding_window) {
+        sliding_window_(sliding_window),
+        tree_mask_(tree_mask),
+        alibi_kv_offset_(alibi_kv_offset) {
     lane_idx_ = tidx % 32;
     // Warp layout 4x1, each warp processes 16 rows (4 threads per row)
     m_base_idx_ = m_block * BLK_M + tidx / 32 * 16 + lane_idx_ / 4;
@@ -75,6 +85,10 @@ struct Mask {
       for (int i = 0; i < size<0, 0>(rAccS); ++i) {          // 2
         const int q_packed_idx = q_packed_idx_base + i * 8;  // m stride = 8
         const int q_idx = q_packed_idx / group_size_ + diagonal_offset_;
+        // visible new tokens, all bits set for causal mask
+        const uint64_t tree_bits = tree_mask_ != nullptr && q_idx < kv_len_
+                                       ? tree_mask_[q_idx - diagonal_offset_]
+                                       : ~uint64_t(0);
 
         const auto m_coord = make_coord(i, mi);
         const auto alibi_slope = ALIBI ? alibi_slopes_(i, mi) : 0.0f;
@@ -103,13 +117,18 @@ struct Mask {
                 return false;
               }
             }();
+            // tree mask only applies to the new tokens
+            const int new_idx = kv_idx - diagonal_offset_;
+            const bool tree_masked = new_idx >= 0 && new_idx < 64 &&
+                                     ((tree_bits >> new_idx) & 1) == 0;
 
             const auto n_coord = make_coord(j, nj);
-            if (out_of_boundary) {
+            if (out_of_boundary || tree_masked) {
               rAccS(m_coord, n_coord) = -INFINITY;
             } else if constexpr (ALIBI) {
               // Apply alibi bias to the attention scores
-              rAccS(m_coord, n_coord) += alibi_slope * kv_idx;
+              rAccS(m_coord, n_coord) +=
+                  alibi_slope * (kv_idx + alibi_kv_offset_);
             }
           }
         }
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+#include <cute/config.hpp>
+#include <cute/tensor.hpp>
+
+#include "mha_params.h"
+#include "ptx.cuh"
+
+namespace llm {
+
+// merge the partial outputs in the split slots by their log-sum-exp:
+//   o = sum_i(2^(lse_i - lse_max) * o_i) / sum_i(2^(lse_i - lse_max))
+// each thread block handles one (token, head) pair.
+template <typename DType, typename Params>
+__global__ void mha_combine_kernel(__grid_constant__ const Params params) {
+  // scale of each split
+  __shared__ float s_scales[kMaxKVSplits];
+
+  const int token_idx = blockIdx.x;
+  const int head_idx = blockIdx.y;
+  const int tidx = threadIdx.x;
+  const int n_splits = params.n_split_slots;
+  const int n_heads = params.n_heads;
+  const int head_dim = params.head_dim;
+
+  // lse_split: [n_tokens, n_split_slots, n_heads]
+  const int64_t row = int64_t(token_idx) * n_splits * n_heads + head_idx;
+  if (tidx == 0) {
+    const float* lse = params.lse_split_ptr + row;
+    float lse_max = -INFINITY;
+    for (int i = 0; i < n_splits; ++i) {
+      lse_max = max(lse_max, lse[i * n_heads]);
+    }
+    float sum = 0.0f;
+    for (int i = 0; i < n_splits; ++i) {
+      // splits without visible kv have lse = -inf
+      const float scale = lse_max == -INFINITY
+                              ? 0.0f
+                              : ptx::exp2(lse[i * n_heads] - lse_max);
+      s_scales[i] = scale;
+      sum += scale;
+    }
+    const float inv_sum = sum == 0.0f ? 0.0f : ptx::rcp(sum);
+    for (int i = 0; i < n_splits; ++i) {
+      s_scales[i] *= inv_sum;
+    }
+  }
+  __syncthreads();
+
+  // o_split: [n_tokens, n_split_slots, n_heads, head_dim]
+  const float* o_split = params.o_split_ptr + row * head_dim;
+  DType* o = (DType*)params.o_ptr + token_idx * cute::get<0>(params.o_stride) +
+             head_idx * cute::get<1>(params.o_stride);
+  for (int k = tidx; k < head_dim; k += blockDim.x) {
+    float acc = 0.0f;
+    for (int i = 0; i < n_splits; ++i) {
+      acc += s_scales[i] * o_split[int64_t(i) * n_heads * head_dim + k];
+    }
+    o[k] = static_cast<DType>(acc);
+  }
+}
+
+}  // namespace llm
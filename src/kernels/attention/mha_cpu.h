@@ -1,10 +1,13 @@
 #pragma once
 
+#include <ATen/Parallel.h>
 #include <torch/torch.h>
 
 #include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <cute/tensor.hpp>
+#include <vector>
 
 #include "common/range.h"
 #include "cute/layout.hpp"
@@ -126,4 +129,76 @@ inline void mha(torch::Tensor query,
   }
 }
 
+// attention of the query tokens over all the keys without a mask, e.g. the kv
+// cache blocks of a sequence offloaded to host memory, which precede all its
+// query tokens. the (query token, head) pairs are split among the threads,
+// and the loops over the contiguous head_dim are vectorized by the compiler.
+// query/out: [q_seq_len, n_heads, head_dim] contiguous FloatTensor
+// key/value: [seq_len, n_kv_heads, head_dim] contiguous FloatTensor
+// lse: [q_seq_len, n_heads] FloatTensor, the log-sum-exp of the scores to
+// merge the output with the attention over the other keys, -inf if no key.
+inline void mha_with_lse(const torch::Tensor& query,
+                         const torch::Tensor& key,
+                         const torch::Tensor& value,
+                         float sm_scale,
+                         torch::Tensor& out,
+                         torch::Tensor& lse) {
+  const int64_t q_seq_len = query.size(0);
+  const int64_t n_heads = query.size(1);
+  const int64_t head_dim = query.size(2);
+  const int64_t seq_len = key.size(0);
+  const int64_t n_kv_heads = key.size(1);
+  assert(n_heads % n_kv_heads == 0);
+  const int64_t group_size = n_heads / n_kv_heads;
+
+  const float* q_data = query.const_data_ptr<float>();
+  const float* k_data = key.const_data_ptr<float>();
+  const float* v_data = value.const_data_ptr<float>();
+  float* o_data = out.data_ptr<float>();
+  float* lse_data = lse.data_ptr<float>();
+  const int64_t kv_stride = n_kv_heads * head_dim;
+
+  const auto attend = [&](int64_t begin, int64_t end) {
+    std::vector<float> scores(seq_len);
+    for (int64_t idx = begin; idx < end; ++idx) {
+      const int64_t head_idx = idx % n_heads;
+      const float* q = q_data + idx * head_dim;
+      float* o = o_data + idx * head_dim;
+      const float* k = k_data + (head_idx / group_size) * head_dim;
+      const float* v = v_data + (head_idx / group_size) * head_dim;
+
+      float max = -INFINITY;
+      for (int64_t j = 0; j < seq_len; ++j) {
+        const float* k_j = k + j * kv_stride;
+        float s = 0;
+        for (int64_t d = 0; d < head_dim; ++d) {
+          s += q[d] * k_j[d];
+        }
+        scores[j] = s * sm_scale;
+        max = std::max(max, scores[j]);
+      }
+
+      std::fill(o, o + head_dim, 0.0f);
+      if (seq_len == 0) {
+        lse_data[idx] = -INFINITY;
+        continue;
+      }
+      float sum = 0;
+      for (int64_t j = 0; j < seq_len; ++j) {
+        const float p = std::exp(scores[j] - max);
+        sum += p;
+        const float* v_j = v + j * kv_stride;
+        for (int64_t d = 0; d < head_dim; ++d) {
+          o[d] += p * v_j[d];
+        }
+      }
+      for (int64_t d = 0; d < head_dim; ++d) {
+        o[d] /= sum;
+      }
+      lse_data[idx] = max + std::log(sum);
+    }
+  };
+  at::parallel_for(0, q_seq_len * n_heads, /*grain_size=*/1, attend);
+}
+
 }  // namespace llm
\ No newline at end of file
@@ -85,4 +85,32 @@ INSTANTIATE_TEST_SUITE_P(
                        ::testing::Values(32)        // head_dim
                        ));
 
+TEST(AttentionCPUTest, MHAWithLse) {
+  torch::manual_seed(0);
+  const int64_t q_seq_len = 3;
+  const int64_t seq_len = 40;
+  const int64_t n_heads = 8;
+  const int64_t n_kv_heads = 2;
+  const int64_t head_dim = 64;
+  const auto options = torch::dtype(torch::kFloat).device(torch::kCPU);
+  const auto query = torch::randn({q_seq_len, n_heads, head_dim}, options);
+  const auto key = torch::randn({seq_len, n_kv_heads, head_dim}, options);
+  const auto value = torch::randn({seq_len, n_kv_heads, head_dim}, options);
+  const float sm_scale = 0.125f;
+
+  auto out = torch::empty_like(query);
+  auto lse = torch::empty({q_seq_len, n_heads}, options);
+  mha_with_lse(query, key, value, sm_scale, out, lse);
+
+  // all keys are attended without a mask
+  const auto k = key.repeat_interleave(n_heads / n_kv_heads, /*dim=*/1);
+  const auto v = value.repeat_interleave(n_heads / n_kv_heads, /*dim=*/1);
+  const auto scores = torch::einsum("qhd,khd->qhk", {query, k}) * sm_scale;
+  const auto ref_out =
+      torch::einsum("qhk,khd->qhd", {torch::softmax(scores, /*dim=*/-1), v});
+  const auto ref_lse = torch::logsumexp(scores, /*dim=*/-1);
+  EXPECT_TRUE(torch::allclose(out, ref_out, /*rtol=*/1e-4, /*atol=*/1e-4));
+  EXPECT_TRUE(torch::allclose(lse, ref_lse, /*rtol=*/1e-4, /*atol=*/1e-4));
+}
+
 }  // namespace llm
\ No newline at end of file
@@ -5,6 +5,7 @@
 
 #include <cute/layout.hpp>
 #include <cute/tensor.hpp>
+#include <type_traits>
 
 #include "cute/config.hpp"
 #include "cute_extensions.cuh"
@@ -16,13 +17,83 @@
 
 namespace llm {
 
+namespace detail {
+// load a tile of the 8-bit kv cache into smem, dequantized with the scale of
+// each kv token. the same oob handling as safe_copy, except that the oob
+// rows and columns are always filled with zeros.
+template <bool EVEN_MN,
+          bool EVEN_K,
+          class TensorS,
+          class TensorScale,
+          class TensorD,
+          class TensorC,
+          class Coord>
+CUTE_DEVICE void dequant_copy(
+    const TensorS& src,        // (CPY, CPY_N, CPY_K)
+    const TensorScale& scale,  // (kv_len)
+    int n_offset,              // kv index of the first row of the tile
+    TensorD& dst,              // (CPY, CPY_N, CPY_K)
+    const TensorC& identity,   // (CPY, CPY_N, CPY_K) -> (blk_n, head_dim)
+    const Coord& max_coord     // max_coord(blk_n, head_dim)
+) {
+  using namespace cute;
+  using SrcType = typename TensorS::value_type;
+  using DstType = typename TensorD::value_type;
+  // the vals of one copy are contiguous along head_dim
+  constexpr int kVals = decltype(size<0>(dst))::value;
+  using VecType = uint_bit_t<kVals * sizeof_bits_v<SrcType>>;
+
+  CUTE_UNROLL
+  for (int ni = 0; ni < size<1>(dst); ++ni) {
+    const bool n_in_bound =
+        EVEN_MN || elem_less<0>(identity(_0{}, ni, _0{}), max_coord);
+    const float s =
+        n_in_bound ? scale(n_offset + get<0>(identity(_0{}, ni, _0{})))
+                   : 0.0f;
+    CUTE_UNROLL
+    for (int ki = 0; ki < size<2>(dst); ++ki) {
+      auto rQ = make_tensor<SrcType>(Int<kVals>{});
+      if (n_in_bound &&
+          (EVEN_K || elem_less<1>(identity(_0{}, _0{}, ki), max_coord))) {
+        // load the 8-bit vals at once
+        *reinterpret_cast<VecType*>(rQ.data()) =
+            *reinterpret_cast<const VecType*>(&src(_0{}, ni, ki));
+      } else {
+        clear(rQ);
+      }
+      auto rF = make_tensor<float>(Int<kVals>{});
+      CUTE_UNROLL
+      for (int i = 0; i < kVals; ++i) {
+        rF(i) = static_cast<float>(rQ(i)) * s;
+      }
+      auto rD = make_tensor_like<DstType>(rF);
+      fast_cast(rF, rD);
+      cute::copy(rD, dst(_, ni, ki));
+    }
+  }
+}
+
+// process one tile of the attention: rows [m_block * BLK_M, (m_block + 1) *
+// BLK_M) of the packed queries of (batch_idx, kv_head_idx) against the kv
+// blocks of split split_idx out of n_splits.
+// with SPLIT_KV, the normalized partial output and its lse are written to
+// (o_partial, lse_partial): [BLK_M, head_dim] and [BLK_M] if not nullptr,
+// otherwise to the split slots of the query tokens.
 template <typename Traits,
           typename Params,
           bool EVEN_K,
           bool ALIBI,
           bool SOFT_CAP,
-          bool LOCAL>
-__global__ void mha_kernel_sm80(__grid_constant__ const Params params) {
+          bool LOCAL,
+          bool SPLIT_KV>
+CUTE_DEVICE void mha_tile_sm80(const Params& params,
+                               int m_block,
+                               int batch_idx,
+                               int kv_head_idx,
+                               int split_idx,
+                               int n_splits,
+                               float* o_partial = nullptr,
+                               float* lse_partial = nullptr) {
   using namespace cute;
 
   constexpr int kBlockM = Traits::kBlockM;
@@ -36,6 +107,9 @@ __global__ void mha_kernel_sm80(__grid_constant__ const Params params) {
 
   // type alias
   using DType = typename Traits::DType;
+  // element type of the kv cache, an 8-bit cache is dequantized to DType
+  using KVType = typename Traits::KVType;
+  constexpr bool kQuantKV = !std::is_same_v<KVType, DType>;
 
   using TiledMma = typename Traits::TiledMma;
   using Layout = typename Traits::LayoutConvertor;
@@ -54,9 +128,6 @@ __global__ void mha_kernel_sm80(__grid_constant__ const Params params) {
   using SmemTiledCopyVt = typename Traits::SmemTiledCopyVt;
   using SmemTiledCopyO = typename Traits::SmemTiledCopyO;
 
-  const int m_block = blockIdx.x;
-  const int batch_idx = blockIdx.y;
-  const int kv_head_idx = blockIdx.z;
   const int tidx = threadIdx.x;
 
   MHATile<Params> tile(params);
@@ -72,10 +143,19 @@ __global__ void mha_kernel_sm80(__grid_constant__ const Params params) {
   // (q_packed_len, HEAD_DIM)
   auto [Q, O] = tile.template get_qo_tile<DType>(batch_idx, kv_head_idx);
   // (kv_len, HEAD_DIM)
-  auto [K, V] = tile.template get_kv_tile<DType>(batch_idx, kv_head_idx);
+  auto [K, V] = tile.template get_kv_tile<KVType>(batch_idx, kv_head_idx);
+  // ((kv_len), (kv_len)), the scales of the quantized kv cache
+  const auto KV_scale = [&] {
+    if constexpr (kQuantKV) {
+      return tile.get_kv_scale_tile(batch_idx, kv_head_idx);
+    } else {
+      return make_tuple(_0{}, _0{});
+    }
+  }();
 
   const int q_packed_len = size<0>(Q);
-  const int q_len = q_packed_len / group_size;
+  // all kv are visible to all query tokens without causal mask
+  const int q_len = params.causal ? q_packed_len / group_size : 0;
   const int kv_len = size<0>(K);
 
   if (m_block * kBlockM >= q_packed_len) {
@@ -135,38 +215,72 @@ __global__ void mha_kernel_sm80(__grid_constant__ const Params params) {
   Tensor cKV = make_identity_tensor(Shape<_BLK_N, _HEAD_DIM>{});
   Tensor tKVcKV = gmem_thr_copy_KV.partition_S(cKV);
 
+  // the quantized kv cache is loaded into registers and dequantized before
+  // being stored into smem, instead of the cp.async copies
   Tensor tKsK = gmem_thr_copy_KV.partition_D(sK);
   auto produce_key = [&](int ni) {
     auto tKgK = gmem_thr_copy_KV.partition_S(gK(_, _, ni));
     auto max_coord = make_coord(kv_len - ni * kBlockN, head_dim);
-    // skip ZFILL_MN for key since Mask will mask out oob with -inf
-    safe_copy</*EVEN_MN=*/false, EVEN_K, /*ZFILL_MN=*/false, /*ZFILL_K=*/true>(
-        gmem_tiled_copy_KV, tKgK, tKsK, tKVcKV, max_coord);
+    if constexpr (kQuantKV) {
+      dequant_copy</*EVEN_MN=*/false, EVEN_K>(
+          tKgK, get<0>(KV_scale), ni * kBlockN, tKsK, tKVcKV, max_coord);
+    } else {
+      // skip ZFILL_MN for key since Mask will mask out oob with -inf
+      safe_copy</*EVEN_MN=*/false,
+                EVEN_K,
+                /*ZFILL_MN=*/false,
+                /*ZFILL_K=*/true>(
+          gmem_tiled_copy_KV, tKgK, tKsK, tKVcKV, max_coord);
+    }
   };
 
   // produce key without oob handling
   auto produce_key_no_oob = [&](int ni) {
     auto tKgK = gmem_thr_copy_KV.partition_S(gK(_, _, ni));
     auto max_coord = make_coord(kv_len - ni * kBlockN, head_dim);
-    safe_copy</*EVEN_MN=*/true, EVEN_K, /*ZFILL_MN=*/false, /*ZFILL_K=*/false>(
-        gmem_tiled_copy_KV, tKgK, tKsK, tKVcKV, max_coord);
+    if constexpr (kQuantKV) {
+      dequant_copy</*EVEN_MN=*/true, EVEN_K>(
+          tKgK, get<0>(KV_scale), ni * kBlockN, tKsK, tKVcKV, max_coord);
+    } else {
+      safe_copy</*EVEN_MN=*/true,
+                EVEN_K,
+                /*ZFILL_MN=*/false,
+                /*ZFILL_K=*/false>(
+          gmem_tiled_copy_KV, tKgK, tKsK, tKVcKV, max_coord);
+    }
   };
 
   Tensor tVsV = gmem_thr_copy_KV.partition_D(sV);
   auto produce_value = [&](int ni) {
     auto tVgV = gmem_thr_copy_KV.partition_S(gV(_, _, ni));
     auto max_coord = make_coord(kv_len - ni * kBlockN, head_dim);
-    // skipping ZFILL_MN for v may cause nan issue
-    safe_copy</*EVEN_MN=*/false, EVEN_K, /*ZFILL_MN=*/true, /*ZFILL_K=*/true>(
-        gmem_tiled_copy_KV, tVgV, tVsV, tKVcKV, max_coord);
+    if constexpr (kQuantKV) {
+      dequant_copy</*EVEN_MN=*/false, EVEN_K>(
+          tVgV, get<1>(KV_scale), ni * kBlockN, tVsV, tKVcKV, max_coord);
+    } else {
+      // skipping ZFILL_MN for v may cause nan issue
+      safe_copy</*EVEN_MN=*/false,
+                EVEN_K,
+                /*ZFILL_MN=*/true,
+                /*ZFILL_K=*/true>(
+          gmem_tiled_copy_KV, tVgV, tVsV, tKVcKV, max_coord);
+    }
   };
 
   // produce value without oob handling
   auto produce_value_no_oob = [&](int ni) {
     auto tVgV = gmem_thr_copy_KV.partition_S(gV(_, _, ni));
     auto max_coord = make_coord(kv_len - ni * kBlockN, head_dim);
-    safe_copy</*EVEN_MN=*/true, EVEN_K, /*ZFILL_MN=*/false, /*ZFILL_K=*/false>(
-        gmem_tiled_copy_KV, tVgV, tVsV, tKVcKV, max_coord);
+    if constexpr (kQuantKV) {
+      dequant_copy</*EVEN_MN=*/true, EVEN_K>(
+          tVgV, get<1>(KV_scale), ni * kBlockN, tVsV, tKVcKV, max_coord);
+    } else {
+      safe_copy</*EVEN_MN=*/true,
+                EVEN_K,
+                /*ZFILL_MN=*/false,
+                /*ZFILL_K=*/false>(
+          gmem_tiled_copy_KV, tVgV, tVsV, tKVcKV, max_coord);
+    }
   };
 
   TiledMma tiled_mma;
@@ -280,22 +394,92 @@ __global__ void mha_kernel_sm80(__grid_constant__ const Params params) {
         gmem_tiled_copy_O, tOsO, tOgO, tOcO, max_coord);
   };
 
+  // write the normalized partial output and its lse
+  // gO_split: (BLK_M, HEAD_DIM), gLSE_split: (BLK_M)
+  // tOrAccO: (MMA,MMA_M,MMA_K), rLse: (ROWS)
+  auto write_split = [&](auto& gO_split,
+                         auto& gLSE_split,
+                         const auto& tOrAccO,
+                         const auto& rLse) {
+    // (BLK_M, HEAD_DIM) -> (blk_m, head_dim)
+    auto cO = make_identity_tensor(Shape<_BLK_M, _HEAD_DIM>{});
+    auto tOcO = thr_mma.partition_C(cO);
+    auto tOcO_rc = make_tensor(tOcO.data(), Layout::to_rowcol(tOcO.layout()));
+    auto tOrAccO_rc =
+        make_tensor(tOrAccO.data(), Layout::to_rowcol(tOrAccO.layout()));
+
+    const int max_m = q_packed_len - m_block * kBlockM;
+    CUTE_UNROLL
+    for (int i = 0; i < size<0>(tOrAccO_rc); ++i) {
+      const int m = get<0>(tOcO_rc(i, 0));
+      if (m >= max_m) {
+        continue;
+      }
+      CUTE_UNROLL
+      for (int j = 0; j < size<1>(tOrAccO_rc); ++j) {
+        const int k = get<1>(tOcO_rc(i, j));
+        if (EVEN_K || k < head_dim) {
+          gO_split(m, k) = tOrAccO_rc(i, j);
+        }
+      }
+      // 4 threads share a row, the one holding column 0 writes the lse
+      if (get<1>(tOcO_rc(i, 0)) == 0) {
+        gLSE_split(m) = rLse(i);
+      }
+    }
+  };
+
+  auto epilogue_split = [&](const auto& tOrAccO, const auto& rLse) {
+    if (o_partial != nullptr) {
+      Tensor gO_split = make_tensor(make_gmem_ptr(o_partial),
+                                    Shape<_BLK_M, _HEAD_DIM>{},
+                                    make_stride(head_dim, _1{}));
+      Tensor gLSE_split =
+          make_tensor(make_gmem_ptr(lse_partial), Shape<_BLK_M>{});
+      write_split(gO_split, gLSE_split, tOrAccO, rLse);
+      return;
+    }
+    // (BLK_M, HEAD_DIM), (BLK_M)
+    auto [O_split, LSE_split] = tile.template get_split_tile<float>(
+        batch_idx, kv_head_idx, split_idx);
+    Tensor gO_split = local_tile(
+        O_split, Shape<_BLK_M, _HEAD_DIM>{}, make_coord(m_block, _0{}));
+    Tensor gLSE_split =
+        local_tile(LSE_split, Shape<_BLK_M>{}, make_coord(m_block));
+    write_split(gO_split, gLSE_split, tOrAccO, rLse);
+  };
+
   // output accumulator, (MMA,MMA_M,MMA_K)
   auto tOrAccO = partition_fragment_C(tiled_mma, Shape<_BLK_M, _HEAD_DIM>{});
   auto tOrAccO_rc_view =
       make_tensor(tOrAccO.data(), Layout::to_rowcol(tOrAccO.layout()));
   clear(tOrAccO);
+  // log2 of the sum of exp scores for each row, only used for split kv
+  auto rLse = make_tensor<float>(size<0>(tOrAccO_rc_view));
 
   const int diagonal = (m_block * kBlockM) / group_size + kv_len - q_len;
   // process kv in range: [kv_idx_min, kv_idx_max)
   const int kv_idx_min = std::max(0, diagonal - sliding_window);
   const int kv_idx_max = std::min(kv_len, diagonal + kBlockM);
-  const int n_block_min = LOCAL ? kv_idx_min / kBlockN : 0;
-  const int n_block_max = cute::ceil_div(kv_idx_max, kBlockN);
+  int n_block_min = LOCAL ? kv_idx_min / kBlockN : 0;
+  int n_block_max = cute::ceil_div(kv_idx_max, kBlockN);
+  if constexpr (SPLIT_KV) {
+    // each split processes a contiguous range of kv blocks, the top blocks
+    // of each range are processed with oob mask as usual.
+    const int n_blocks_per_split =
+        cute::ceil_div(n_block_max - n_block_min, n_splits);
+    n_block_min += split_idx * n_blocks_per_split;
+    n_block_max = std::min(n_block_max, n_block_min + n_blocks_per_split);
+  }
 
   if (n_block_min >= n_block_max) {
     // write output to gmem
-    epilogue(tOrAccO);
+    if constexpr (SPLIT_KV) {
+      fill(rLse, -INFINITY);
+      epilogue_split(tOrAccO, rLse);
+    } else {
+      epilogue(tOrAccO);
+    }
     return;
   }
 
@@ -336,7 +520,11 @@ __global__ void mha_kernel_sm80(__grid_constant__ const Params params) {
             group_size,
             sliding_window,
             sm_scale,
-            params.alibi_slopes_ptr);
+            params.alibi_slopes_ptr,
+            tile.get_tree_mask(batch_idx),
+            ALIBI && params.alibi_kv_offsets != nullptr
+                ? params.alibi_kv_offsets[batch_idx]
+                : 0);
 
   // seperate oob mask iterations for better performance
   constexpr int n_oob_mask = cute::ceil_div(kBlockM, kBlockN) + 1;
@@ -425,11 +613,98 @@ __global__ void mha_kernel_sm80(__grid_constant__ const Params params) {
 
   // ###############  Epilogue  ###############
 
+  if constexpr (SPLIT_KV) {
+    // normalize output and keep the lse to merge the splits
+    softmax.finalize(tOrAccO_rc_view, rLse);
+    epilogue_split(tOrAccO, rLse);
+    return;
+  }
+
   // normalize output: o /= rowsum
   softmax.finalize(tOrAccO_rc_view);
 
   // write output to gmem
   epilogue(tOrAccO);
 }
+}  // namespace detail
+
+template <typename Traits,
+          typename Params,
+          bool EVEN_K,
+          bool ALIBI,
+          bool SOFT_CAP,
+          bool LOCAL,
+          bool SPLIT_KV = false>
+__global__ void mha_kernel_sm80(__grid_constant__ const Params params) {
+  int m_block = blockIdx.x;
+  int split_idx = 0;
+  int n_splits = 1;
+  if constexpr (SPLIT_KV) {
+    // splits of the same m_block are adjacent: (n_splits, m_blocks)
+    n_splits = params.n_kv_splits;
+    split_idx = m_block % n_splits;
+    m_block /= n_splits;
+  }
+  const int batch_idx = blockIdx.y;
+  const int kv_head_idx = blockIdx.z;
+
+  detail::
+      mha_tile_sm80<Traits, Params, EVEN_K, ALIBI, SOFT_CAP, LOCAL, SPLIT_KV>(
+          params, m_block, batch_idx, kv_head_idx, split_idx, n_splits);
+}
+
+// each thread block processes the work items assigned by the scheduler one
+// by one, see mha_scheduler.cuh. the chunks of long tiles are written to
+// partial slots and merged by mha_merge_tiles_kernel.
+template <typename Traits,
+          typename Params,
+          bool EVEN_K,
+          bool ALIBI,
+          bool SOFT_CAP,
+          bool LOCAL>
+__global__ void mha_persistent_kernel_sm80(
+    __grid_constant__ const Params params) {
+  constexpr int kBlockM = Traits::kBlockM;
+  const int begin = params.cta_cu_items[blockIdx.x];
+  const int end = params.cta_cu_items[blockIdx.x + 1];
+  for (int i = begin; i < end; ++i) {
+    // wait for the smem of the previous item to be consumed
+    cp_async_wait<0>();
+    __syncthreads();
+
+    const MHAWorkItem item = params.work_items[i];
+    if (item.n_splits == 1) {
+      detail::mha_tile_sm80<Traits,
+                            Params,
+                            EVEN_K,
+                            ALIBI,
+                            SOFT_CAP,
+                            LOCAL,
+                            /*SPLIT_KV=*/false>(params,
+                                                item.m_block,
+                                                item.batch_idx,
+                                                item.kv_head_idx,
+                                                /*split_idx=*/0,
+                                                /*n_splits=*/1);
+    } else {
+      const int64_t slot = item.slot_idx;
+      detail::mha_tile_sm80<Traits,
+                            Params,
+                            EVEN_K,
+                            ALIBI,
+                            SOFT_CAP,
+                            LOCAL,
+                            /*SPLIT_KV=*/true>(
+          params,
+          item.m_block,
+          item.batch_idx,
+          item.kv_head_idx,
+          item.split_idx,
+          item.n_splits,
+          params.o_partial_ptr + slot * kBlockM * params.head_dim,
+          params.lse_partial_ptr + slot * kBlockM);
+    }
+  }
+}
 
 }  // namespace llm
\ No newline at end of file
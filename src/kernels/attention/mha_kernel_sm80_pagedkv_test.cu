@@ -13,6 +13,9 @@ namespace llm {
     if (HEAD_DIM_V <= 64) {                                \
       constexpr static int HEAD_DIM_NAME = 64;             \
       return __VA_ARGS__();                                \
+    } else if (HEAD_DIM_V <= 80) {                         \
+      constexpr static int HEAD_DIM_NAME = 80;             \
+      return __VA_ARGS__();                                \
     } else if (HEAD_DIM_V <= 256) {                        \
       constexpr static int HEAD_DIM_NAME = 256;            \
       return __VA_ARGS__();                                \
@@ -34,7 +37,14 @@ torch::Tensor mha_pagedkv_sm80(
     torch::optional<torch::Tensor> alibi_slopes,  //[n_heads]
     float logits_soft_cap,
     int32_t sliding_window,
-    int32_t max_q_len) {
+    int32_t max_q_len,
+    int32_t n_kv_splits = 1,
+    int32_t n_ctas = 0,
+    int32_t tile_config = 0,
+    int32_t block_m = kMHABlockM,
+    // [n_slots, n_kv_heads] scales of the quantized kv cache
+    torch::optional<torch::Tensor> key_scale = torch::nullopt,
+    torch::optional<torch::Tensor> value_scale = torch::nullopt) {
   const auto batch_size = q_cu_lens.size(0) - 1;
   const auto n_heads = query.size(-2);
   const auto n_kv_heads = key_cache.size(-2);
@@ -72,6 +82,64 @@ torch::Tensor mha_pagedkv_sm80(
   params.block_table = block_table.const_data_ptr<int32_t>();
   params.block_cu_lens = block_cu_lens.const_data_ptr<int32_t>();
   params.block_size = block_size;
+  if (key_scale.has_value()) {
+    params.kv_type = key_cache.scalar_type() == torch::kInt8
+                         ? MHAKVType::kInt8
+                         : MHAKVType::kFp8E4M3;
+    params.k_scale_ptr = key_scale.value().const_data_ptr<float>();
+    params.v_scale_ptr = value_scale.value().const_data_ptr<float>();
+  }
+
+  torch::Tensor o_split;
+  torch::Tensor lse_split;
+  if (n_kv_splits > 1) {
+    const auto n_tokens = query.size(0);
+    const auto options = query.options().dtype(torch::kFloat32);
+    o_split = torch::empty({n_tokens, n_kv_splits, n_heads, head_dim}, options);
+    lse_split = torch::empty({n_tokens, n_kv_splits, n_heads}, options);
+    params.n_kv_splits = n_kv_splits;
+    params.n_split_slots = n_kv_splits;
+    params.n_tokens = n_tokens;
+    params.o_split_ptr = o_split.mutable_data_ptr<float>();
+    params.lse_split_ptr = lse_split.mutable_data_ptr<float>();
+  }
+
+  // persistent kernel with BLK_M = 64
+  torch::Tensor work_items;
+  torch::Tensor merge_tiles;
+  torch::Tensor cta_cu_items;
+  torch::Tensor o_partial;
+  torch::Tensor lse_partial;
+  if (n_ctas > 0) {
+    const auto n_tokens = query.size(0);
+    const int max_items = mha_max_work_items(n_tokens,
+                                             batch_size,
+                                             n_heads / n_kv_heads,
+                                             n_kv_heads,
+                                             n_ctas,
+                                             /*block_m=*/64);
+    constexpr int kItemInts = sizeof(MHAWorkItem) / sizeof(int);
+    const auto int_options = query.options().dtype(torch::kInt32);
+    work_items = torch::empty({max_items, kItemInts}, int_options);
+    merge_tiles = torch::empty({n_ctas, kItemInts}, int_options);
+    // the last one is the count of merge tiles
+    cta_cu_items = torch::empty({n_ctas + 2}, int_options);
+    const auto options = query.options().dtype(torch::kFloat32);
+    o_partial = torch::empty({2 * n_ctas, 64, head_dim}, options);
+    lse_partial = torch::empty({2 * n_ctas, 64}, options);
+    params.n_ctas = n_ctas;
+    params.max_work_items = max_items;
+    params.work_items =
+        reinterpret_cast<MHAWorkItem*>(work_items.mutable_data_ptr<int>());
+    params.merge_tiles =
+        reinterpret_cast<MHAWorkItem*>(merge_tiles.mutable_data_ptr<int>());
+    params.cta_cu_items = cta_cu_items.mutable_data_ptr<int>();
+    params.n_merge_tiles = params.cta_cu_items + n_ctas + 1;
+    params.o_partial_ptr = o_partial.mutable_data_ptr<float>();
+    params.lse_partial_ptr = lse_partial.mutable_data_ptr<float>();
+  }
+  params.tile_config = tile_config;
+  params.block_m = block_m;
 
   DISPATCH_HEAD_DIM_(head_dim, HEAD_DIM, [&] {
     run_mha_kernel_sm80<cute::half_t, HEAD_DIM>(params);
@@ -79,6 +147,87 @@ torch::Tensor mha_pagedkv_sm80(
   return out;
 }
 
+// cascade attention for one group of sequences sharing prefix blocks
+torch::Tensor mha_pagedkv_cascade_sm80(
+    torch::Tensor query,                 // [q_seq_len, n_heads, head_dim]
+    torch::Tensor key_cache,             // [n_slots, n_kv_heads, head_dim]
+    torch::Tensor value_cache,           // [n_slots, n_kv_heads, head_dim]
+    torch::Tensor block_table,           // [n_blocks]
+    torch::Tensor prefix_q_cu_lens,      // [2]
+    torch::Tensor prefix_kv_cu_lens,     // [2]
+    torch::Tensor prefix_block_cu_lens,  // [2]
+    torch::Tensor q_cu_lens,             // [batch_size+1]
+    torch::Tensor kv_cu_lens,            // [batch_size+1]
+    torch::Tensor block_cu_lens,         // [batch_size+1]
+    torch::optional<torch::Tensor> alibi_slopes,  // [n_heads]
+    torch::Tensor alibi_kv_offsets,               // [batch_size]
+    int block_size,
+    int32_t max_q_len,
+    int32_t n_prefix_splits,
+    int32_t n_suffix_splits) {
+  const auto n_tokens = query.size(0);
+  const auto n_heads = query.size(-2);
+  const auto head_dim = query.size(-1);
+
+  auto out = torch::empty_like(query);
+  const auto options = query.options().dtype(torch::kFloat32);
+  const int n_slots = n_prefix_splits + n_suffix_splits;
+  auto o_split = torch::empty({n_tokens, n_slots, n_heads, head_dim}, options);
+  auto lse_split = torch::empty({n_tokens, n_slots, n_heads}, options);
+
+  auto make_params = [&](const torch::Tensor& q_cu,
+                         const torch::Tensor& kv_cu,
+                         const torch::Tensor& block_cu,
+                         int q_len) {
+    MHAPagedKVParams params;
+    params.q_ptr = query.const_data_ptr();
+    params.q_stride = make_stride(query.stride(0), query.stride(1));
+    params.k_ptr = key_cache.const_data_ptr();
+    params.k_stride = make_stride(key_cache.stride(0), key_cache.stride(1));
+    params.v_ptr = value_cache.const_data_ptr();
+    params.v_stride =
+        make_stride(value_cache.stride(0), value_cache.stride(1));
+    params.o_ptr = out.mutable_data_ptr();
+    params.o_stride = make_stride(out.stride(0), out.stride(1));
+    params.batch_size = q_cu.size(0) - 1;
+    params.max_q_len = q_len;
+    params.n_heads = n_heads;
+    params.n_kv_heads = key_cache.size(-2);
+    params.head_dim = head_dim;
+    params.sm_scale = 1.0 / sqrt(head_dim);
+    params.alibi_slopes_ptr =
+        alibi_slopes.has_value() ? alibi_slopes.value().const_data_ptr<float>()
+                                 : nullptr;
+    params.q_cu_lens = q_cu.const_data_ptr<int32_t>();
+    params.kv_cu_lens = kv_cu.const_data_ptr<int32_t>();
+    params.block_table = block_table.const_data_ptr<int32_t>();
+    params.block_cu_lens = block_cu.const_data_ptr<int32_t>();
+    params.block_size = block_size;
+    params.n_split_slots = n_slots;
+    params.n_tokens = n_tokens;
+    params.o_split_ptr = o_split.mutable_data_ptr<float>();
+    params.lse_split_ptr = lse_split.mutable_data_ptr<float>();
+    return params;
+  };
+
+  auto prefix_params = make_params(
+      prefix_q_cu_lens, prefix_kv_cu_lens, prefix_block_cu_lens, n_tokens);
+  prefix_params.causal = false;
+  prefix_params.n_kv_splits = n_prefix_splits;
+  auto params = make_params(q_cu_lens, kv_cu_lens, block_cu_lens, max_q_len);
+  params.n_kv_splits = n_suffix_splits;
+  params.split_offset = n_prefix_splits;
+  if (alibi_slopes.has_value()) {
+    params.alibi_kv_offsets = alibi_kv_offsets.const_data_ptr<int32_t>();
+  }
+
+  DISPATCH_HEAD_DIM_(head_dim, HEAD_DIM, [&] {
+    run_mha_kernel_sm80<cute::half_t, HEAD_DIM>(prefix_params);
+    run_mha_kernel_sm80<cute::half_t, HEAD_DIM>(params);
+  });
+  return out;
+}
+
 }  // namespace
 
 class MHAKernelPagedKVTest
@@ -224,6 +373,91 @@ TEST_P(MHAKernelPagedKVTest, PageKV) {
                               max_q_len);
 
   EXPECT_TRUE(torch::allclose(out, ref_out, /*rtol=*/1e-3, /*atol=*/1e-3));
+
+  // split kv, some splits may have no kv blocks to process
+  auto split_out = mha_pagedkv_sm80(query,
+                                    key_cache,
+                                    value_cache,
+                                    q_cu_lens,
+                                    kv_cu_lens,
+                                    block_table,
+                                    block_cu_lens,
+                                    block_size,
+                                    alibi_slopes,
+                                    logits_soft_cap,
+                                    sliding_window,
+                                    max_q_len,
+                                    /*n_kv_splits=*/3);
+  EXPECT_TRUE(
+      torch::allclose(split_out, ref_out, /*rtol=*/1e-3, /*atol=*/1e-3));
+
+  // persistent kernel, few thread blocks to chunk the long tiles
+  auto persistent_out = mha_pagedkv_sm80(query,
+                                         key_cache,
+                                         value_cache,
+                                         q_cu_lens,
+                                         kv_cu_lens,
+                                         block_table,
+                                         block_cu_lens,
+                                         block_size,
+                                         alibi_slopes,
+                                         logits_soft_cap,
+                                         sliding_window,
+                                         max_q_len,
+                                         /*n_kv_splits=*/1,
+                                         /*n_ctas=*/5);
+  EXPECT_TRUE(
+      torch::allclose(persistent_out, ref_out, /*rtol=*/1e-3, /*atol=*/1e-3));
+
+  // all tile configs picked by the tuner
+  for (int config = 1; config < kNumMHATileConfigs; ++config) {
+    if (!mha_tile_config_supported(config, head_dim)) {
+      continue;
+    }
+    auto tile_out = mha_pagedkv_sm80(query,
+                                     key_cache,
+                                     value_cache,
+                                     q_cu_lens,
+                                     kv_cu_lens,
+                                     block_table,
+                                     block_cu_lens,
+                                     block_size,
+                                     alibi_slopes,
+                                     logits_soft_cap,
+                                     sliding_window,
+                                     max_q_len,
+                                     /*n_kv_splits=*/1,
+                                     /*n_ctas=*/0,
+                                     /*tile_config=*/config);
+    EXPECT_TRUE(
+        torch::allclose(tile_out, ref_out, /*rtol=*/1e-3, /*atol=*/1e-3))
+        << "block_n=" << kMHABlockNCandidates[config];
+  }
+
+  // small query tiles, with and without split kv
+  for (const int block_m : kMHASmallBlockMCandidates) {
+    for (const int n_kv_splits : {1, 3}) {
+      auto small_tile_out = mha_pagedkv_sm80(query,
+                                             key_cache,
+                                             value_cache,
+                                             q_cu_lens,
+                                             kv_cu_lens,
+                                             block_table,
+                                             block_cu_lens,
+                                             block_size,
+                                             alibi_slopes,
+                                             logits_soft_cap,
+                                             sliding_window,
+                                             max_q_len,
+                                             n_kv_splits,
+                                             /*n_ctas=*/0,
+                                             /*tile_config=*/0,
+                                             block_m);
+      EXPECT_TRUE(torch::allclose(
+          small_tile_out, ref_out, /*rtol=*/1e-3, /*atol=*/1e-3))
+          << "block_m=" << block_m << ", n_kv_splits=" << n_kv_splits;
+    }
+  }
 }
 
 INSTANTIATE_TEST_SUITE_P(
@@ -232,14 +466,303 @@ INSTANTIATE_TEST_SUITE_P(
     ::testing::Combine(
         ::testing::Values(1, 2, 4),                          // batch_size
         ::testing::Values(1, 8),                             // block_size
-        ::testing::Values(1, 125),                           // max_q_len
+        ::testing::Values(1, 5, 125),                        // max_q_len
         ::testing::Values(127, 1000),                        // max_kv_len
         ::testing::Values(6),                                // n_heads
         ::testing::Values(6 /*mha*/, 3 /*gqa*/, 1 /*mqa*/),  // n_kv_heads
-        ::testing::Values(32, 64, 96, 128, 256),             // head_dim
+        ::testing::Values(32, 64, 80, 96, 128, 256),         // head_dim
         ::testing::Values(0.0, 50.0),                        // logits_soft_cap
         ::testing::Values(false, true),                      // alibi slope
         ::testing::Values(-1, 0, 10)                         // sliding window
         ));
 
+class MHAKernelPagedKVQuantTest
+    : public ::testing::TestWithParam<std::tuple<torch::ScalarType /*dtype*/,
+                                                 int64_t /*block_size*/,
+                                                 int64_t /*q_len*/,
+                                                 int64_t /*n_kv_heads*/,
+                                                 int64_t /*head_dim*/,
+                                                 int32_t /*sliding_window*/>> {
+ public:
+  void SetUp() override {
+    // Set random seed for test stability
+    torch::manual_seed(0);
+  }
+};
+
+TEST_P(MHAKernelPagedKVQuantTest, QuantizedKV) {
+  const auto [cache_dtype,
+              block_size,
+              max_q_len,
+              n_kv_heads,
+              head_dim,
+              sliding_window] = GetParam();
+  const int64_t batch_size = 3;
+  const int64_t max_kv_len = 300;
+  const int64_t n_heads = 6;
+
+  const auto options = torch::dtype(torch::kHalf).device(torch::kCUDA);
+  const auto int_options = torch::dtype(torch::kInt32).device(torch::kCUDA);
+
+  // scatter the blocks of each sequence in reverse order
+  const int32_t n_seq_blocks = (max_kv_len + block_size - 1) / block_size;
+  const int32_t total_blocks = n_seq_blocks * batch_size + 1;
+  std::vector<int32_t> block_table_vec;
+  std::vector<int32_t> block_cu_lens_vec = {0};
+  std::vector<int32_t> q_cu_lens_vec = {0};
+  std::vector<int32_t> kv_cu_lens_vec = {0};
+  std::vector<int> slot_ids;
+  absl::BitGen gen;
+  for (int i = 0; i < batch_size; ++i) {
+    const int32_t q_len =
+        absl::Uniform<int>(absl::IntervalClosedClosed, gen, 1, max_q_len);
+    const int32_t kv_len = absl::Uniform<int>(
+        absl::IntervalClosedClosed, gen, q_len, max_kv_len);
+    q_cu_lens_vec.push_back(q_cu_lens_vec.back() + q_len);
+    kv_cu_lens_vec.push_back(kv_cu_lens_vec.back() + kv_len);
+
+    const int32_t n_blocks = (kv_len + block_size - 1) / block_size;
+    for (int j = 0; j < n_blocks; ++j) {
+      const int32_t id = total_blocks - 1 - (i * n_seq_blocks + j);
+      block_table_vec.push_back(id * block_size);
+    }
+    block_cu_lens_vec.push_back(block_table_vec.size());
+    for (int j = 0; j < kv_len; ++j) {
+      const int32_t idx = block_cu_lens_vec[i] + j / block_size;
+      slot_ids.push_back(block_table_vec[idx] + j % block_size);
+    }
+  }
+  const int32_t n_q_tokens = q_cu_lens_vec.back();
+
+  // quantize the kv cache with one scale per slot and kv head
+  const int64_t n_slots = total_blocks * block_size;
+  const float max_value = cache_dtype == torch::kInt8 ? 127.0f : 448.0f;
+  auto quantize = [&](const torch::Tensor& x) {
+    auto scale = (x.abs().amax(/*dim=*/-1) / max_value).clamp_min(1e-8);
+    auto q = x / scale.unsqueeze(-1);
+    if (cache_dtype == torch::kInt8) {
+      q = q.round().clamp(-max_value, max_value);
+    }
+    return std::make_tuple(q.to(cache_dtype), scale);
+  };
+  auto dequantize = [&](const torch::Tensor& q, const torch::Tensor& scale) {
+    return (q.to(torch::kFloat32) * scale.unsqueeze(-1)).to(torch::kHalf);
+  };
+  const auto float_options = options.dtype(torch::kFloat32);
+  auto [key_cache, key_scale] =
+      quantize(torch::rand({n_slots, n_kv_heads, head_dim}, float_options));
+  auto [value_cache, value_scale] =
+      quantize(torch::rand({n_slots, n_kv_heads, head_dim}, float_options));
+
+  torch::Tensor query = torch::rand({n_q_tokens, n_heads, head_dim}, options);
+  torch::Tensor q_cu_lens = torch::tensor(q_cu_lens_vec, int_options);
+  torch::Tensor kv_cu_lens = torch::tensor(kv_cu_lens_vec, int_options);
+  torch::Tensor block_table = torch::tensor(block_table_vec, int_options);
+  torch::Tensor block_cu_lens = torch::tensor(block_cu_lens_vec, int_options);
+
+  // the reference attends to the dequantized kv
+  const auto slots = torch::tensor(slot_ids, int_options).to(torch::kLong);
+  const auto key = dequantize(key_cache, key_scale).index_select(0, slots);
+  const auto value =
+      dequantize(value_cache, value_scale).index_select(0, slots);
+  auto ref_out = mha_varlen_ref(query,
+                                key,
+                                value,
+                                q_cu_lens,
+                                kv_cu_lens,
+                                /*alibi_slopes=*/torch::nullopt,
+                                /*logits_soft_cap=*/0.0,
+                                sliding_window);
+
+  // the default kernel, split kv and the persistent kernel
+  for (const auto [n_kv_splits, n_ctas] :
+       {std::pair{1, 0}, std::pair{3, 0}, std::pair{1, 5}}) {
+    auto out = mha_pagedkv_sm80(query,
+                                key_cache,
+                                value_cache,
+                                q_cu_lens,
+                                kv_cu_lens,
+                                block_table,
+                                block_cu_lens,
+                                block_size,
+                                /*alibi_slopes=*/torch::nullopt,
+                                /*logits_soft_cap=*/0.0,
+                                sliding_window,
+                                max_q_len,
+                                n_kv_splits,
+                                n_ctas,
+                                /*tile_config=*/0,
+                                /*block_m=*/kMHABlockM,
+                                key_scale,
+                                value_scale);
+    EXPECT_TRUE(torch::allclose(out, ref_out, /*rtol=*/1e-3, /*atol=*/1e-3))
+        << "n_kv_splits=" << n_kv_splits << ", n_ctas=" << n_ctas;
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    MHA,
+    MHAKernelPagedKVQuantTest,
+    ::testing::Combine(
+        ::testing::Values(torch::kInt8, torch::kFloat8_e4m3fn),  // dtype
+        ::testing::Values(1, 8),                                 // block_size
+        ::testing::Values(1, 65),                                // max_q_len
+        ::testing::Values(6, 2),                                 // n_kv_heads
+        ::testing::Values(64, 80, 128),                          // head_dim
+        ::testing::Values(-1, 10)  // sliding window
+        ));
+
+class MHAKernelPagedKVCascadeTest
+    : public ::testing::TestWithParam<std::tuple<int64_t /*batch_size*/,
+                                                 int64_t /*block_size*/,
+                                                 int64_t /*q_len*/,
+                                                 int64_t /*prefix_len*/,
+                                                 int64_t /*n_kv_heads*/,
+                                                 int64_t /*head_dim*/,
+                                                 int32_t /*n_prefix_splits*/,
+                                                 bool /*alibi*/>> {
+ public:
+  void SetUp() override {
+    // Set random seed for test stability
+    torch::manual_seed(0);
+  }
+};
+
+TEST_P(MHAKernelPagedKVCascadeTest, SharedPrefix) {
+  const auto [batch_size,
+              block_size,
+              max_q_len,
+              prefix_len,
+              n_kv_heads,
+              head_dim,
+              n_prefix_splits,
+              alibi] = GetParam();
+  const int64_t n_heads = 6;
+  const int64_t max_suffix_len = 100;
+
+  const auto options = torch::dtype(torch::kHalf).device(torch::kCUDA);
+  const auto int_options = torch::dtype(torch::kInt32).device(torch::kCUDA);
+
+  // the shared prefix takes blocks [1, n_prefix_blocks]
+  const int32_t n_prefix_blocks = prefix_len / block_size;
+  const int32_t total_blocks =
+      n_prefix_blocks + (max_suffix_len + max_q_len) * batch_size / block_size +
+      batch_size + 2;
+  std::vector<int32_t> block_table_vec;
+  std::vector<int32_t> block_cu_lens_vec = {0};
+  std::vector<int32_t> suffix_block_cu_lens_vec;
+  std::vector<int32_t> q_cu_lens_vec = {0};
+  std::vector<int32_t> kv_cu_lens_vec = {0};
+  std::vector<int32_t> suffix_kv_cu_lens_vec = {0};
+  std::vector<int> slot_ids;
+  int32_t next_block = n_prefix_blocks + 1;
+  absl::BitGen gen;
+  for (int i = 0; i < batch_size; ++i) {
+    const int32_t q_len =
+        absl::Uniform<int>(absl::IntervalClosedClosed, gen, 1, max_q_len);
+    // the suffix holds the new tokens
+    const int32_t suffix_len = absl::Uniform<int>(
+        absl::IntervalClosedClosed, gen, q_len, max_suffix_len);
+    const int32_t kv_len = prefix_len + suffix_len;
+    q_cu_lens_vec.push_back(q_cu_lens_vec.back() + q_len);
+    kv_cu_lens_vec.push_back(kv_cu_lens_vec.back() + kv_len);
+    suffix_kv_cu_lens_vec.push_back(suffix_kv_cu_lens_vec.back() + suffix_len);
+
+    std::vector<int32_t> block_ids;
+    for (int j = 0; j < n_prefix_blocks; ++j) {
+      block_ids.push_back((j + 1) * block_size);
+    }
+    const int32_t n_blocks = (kv_len + block_size - 1) / block_size;
+    for (int j = n_prefix_blocks; j < n_blocks; ++j) {
+      block_ids.push_back(next_block++ * block_size);
+    }
+    suffix_block_cu_lens_vec.push_back(block_table_vec.size() +
+                                       n_prefix_blocks);
+    block_table_vec.insert(
+        block_table_vec.end(), block_ids.begin(), block_ids.end());
+    block_cu_lens_vec.push_back(block_table_vec.size());
+    for (int j = 0; j < kv_len; ++j) {
+      slot_ids.push_back(block_ids[j / block_size] + j % block_size);
+    }
+  }
+  suffix_block_cu_lens_vec.push_back(block_table_vec.size());
+  ASSERT_LE(next_block, total_blocks);
+  const int32_t n_q_tokens = q_cu_lens_vec.back();
+
+  torch::Tensor query = torch::rand({n_q_tokens, n_heads, head_dim}, options);
+  const auto n_slots = total_blocks * block_size;
+  torch::Tensor key_cache =
+      torch::rand({n_slots, n_kv_heads, head_dim}, options);
+  torch::Tensor value_cache =
+      torch::rand({n_slots, n_kv_heads, head_dim}, options);
+
+  torch::Tensor q_cu_lens = torch::tensor(q_cu_lens_vec, int_options);
+  torch::Tensor kv_cu_lens = torch::tensor(kv_cu_lens_vec, int_options);
+  torch::Tensor block_table = torch::tensor(block_table_vec, int_options);
+  torch::Tensor suffix_kv_cu_lens =
+      torch::tensor(suffix_kv_cu_lens_vec, int_options);
+  torch::Tensor suffix_block_cu_lens =
+      torch::tensor(suffix_block_cu_lens_vec, int_options);
+  // one group with all the query tokens
+  torch::Tensor prefix_q_cu_lens =
+      torch::tensor(std::vector<int32_t>{0, n_q_tokens}, int_options);
+  torch::Tensor prefix_kv_cu_lens = torch::tensor(
+      std::vector<int32_t>{0, static_cast<int32_t>(prefix_len)}, int_options);
+  torch::Tensor prefix_block_cu_lens = torch::tensor(
+      std::vector<int32_t>{0, static_cast<int32_t>(block_table_vec.size())},
+      int_options);
+
+  torch::optional<torch::Tensor> alibi_slopes;
+  if (alibi) {
+    alibi_slopes = torch::rand(
+        {n_heads}, torch::dtype(torch::kFloat32).device(torch::kCUDA));
+  }
+  // the suffix of each sequence starts after the shared prefix
+  torch::Tensor alibi_kv_offsets =
+      torch::full({batch_size}, static_cast<int32_t>(prefix_len), int_options);
+
+  const auto slots = torch::tensor(slot_ids, int_options).to(torch::kLong);
+  const auto key = key_cache.index_select(/*dim=*/0, slots);
+  const auto value = value_cache.index_select(/*dim=*/0, slots);
+  auto ref_out = mha_varlen_ref(query,
+                                key,
+                                value,
+                                q_cu_lens,
+                                kv_cu_lens,
+                                alibi_slopes,
+                                /*logits_soft_cap=*/0.0,
+                                /*sliding_window=*/-1);
+
+  auto out = mha_pagedkv_cascade_sm80(query,
+                                      key_cache,
+                                      value_cache,
+                                      block_table,
+                                      prefix_q_cu_lens,
+                                      prefix_kv_cu_lens,
+                                      prefix_block_cu_lens,
+                                      q_cu_lens,
+                                      suffix_kv_cu_lens,
+                                      suffix_block_cu_lens,
+                                      alibi_slopes,
+                                      alibi_kv_offsets,
+                                      block_size,
+                                      max_q_len,
+                                      n_prefix_splits,
+                                      /*n_suffix_splits=*/1);
+  EXPECT_TRUE(torch::allclose(out, ref_out, /*rtol=*/1e-3, /*atol=*/1e-3));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    MHA,
+    MHAKernelPagedKVCascadeTest,
+    ::testing::Combine(::testing::Values(1, 4),              // batch_size
+                       ::testing::Values(1, 8),              // block_size
+                       ::testing::Values(1, 17),             // max_q_len
+                       ::testing::Values(0, 64, 520),        // prefix_len
+                       ::testing::Values(6, 1),              // n_kv_heads
+                       ::testing::Values(64, 128),           // head_dim
+                       ::testing::Values(1, 3),              // n_prefix_splits
+                       ::testing::Values(false, true)        // alibi
+                       ));
+
 }  // namespace llm
\ No newline at end of file
@@ -0,0 +1,410 @@
+#pragma once
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+#include <cute/arch/copy_sm90_desc.hpp>
+#include <cute/layout.hpp>
+#include <cute/tensor.hpp>
+#include <cutlass/arch/barrier.h>
+#include <cutlass/arch/reg_reconfig.h>
+
+#include "cute/config.hpp"
+#include "cute_extensions.cuh"
+#include "fast_cast.cuh"
+#include "mask.h"
+#include "mha_tile.h"
+#include "online_softmax.cuh"
+#include "ptx.cuh"
+
+namespace llm {
+
+namespace detail {
+// C = A@B (+ C) with warpgroup MMA, waits for the result before returning.
+// A is either in registers or in smem, B is in smem.
+template <bool ZERO_INIT,
+          typename TiledMma,
+          typename TensorA,
+          typename TensorB,
+          typename TensorC>
+CUTE_DEVICE void wgmma_gemm(TiledMma& tiled_mma,
+                            const TensorA& tCrA,
+                            const TensorB& tCrB,
+                            TensorC& tCrC) {
+  constexpr bool kRegA =
+      !cute::is_base_of<GMMA::DescriptorIterator,
+                        typename TiledMma::FrgTypeA>::value;
+  if constexpr (kRegA) {
+    warpgroup_fence_operand(const_cast<TensorA&>(tCrA));
+  }
+  warpgroup_fence_operand(tCrC);
+  warpgroup_arrive();
+  if constexpr (ZERO_INIT) {
+    tiled_mma.accumulate_ = GMMA::ScaleOut::Zero;
+  }
+  CUTE_UNROLL
+  for (int ki = 0; ki < size<2>(tCrA); ++ki) {
+    cute::gemm(tiled_mma, tCrA(_, _, ki), tCrB(_, _, ki), tCrC);
+    tiled_mma.accumulate_ = GMMA::ScaleOut::One;
+  }
+  warpgroup_commit_batch();
+  warpgroup_wait<0>();
+  warpgroup_fence_operand(tCrC);
+  if constexpr (kRegA) {
+    warpgroup_fence_operand(const_cast<TensorA&>(tCrA));
+  }
+}
+}  // namespace detail
+
+// the producer warpgroup loads q once and then k/v blocks from the last one
+// into a STAGES deep smem ring, the consumer warpgroups wait for each stage,
+// compute S = Q@K.T and O += softmax(S)@V, then release the stage.
+template <typename Traits,
+          typename Params,
+          bool EVEN_K,
+          bool ALIBI,
+          bool SOFT_CAP,
+          bool LOCAL>
+__global__ void __launch_bounds__(Traits::kThreadNum, 1)
+    mha_kernel_sm90(__grid_constant__ const Params params) {
+#if defined(CUTE_ARCH_MMA_SM90A_ENABLED)
+  using namespace cute;
+
+  constexpr int kBlockM = Traits::kBlockM;
+  constexpr int kBlockN = Traits::kBlockN;
+  constexpr int kHeadDim = Traits::kHeadDim;
+  constexpr int kStages = Traits::kStages;
+  constexpr int kRowsPerMMA = Traits::kRowsPerMMA;
+  constexpr int kProducerThreads = Traits::kProducerThreads;
+  constexpr int kConsumerThreads = Traits::kConsumerThreads;
+
+  using _BLK_M = Int<kBlockM>;
+  using _BLK_N = Int<kBlockN>;
+  using _HEAD_DIM = Int<kHeadDim>;
+
+  // type alias
+  using DType = typename Traits::DType;
+
+  using TiledMmaQK = typename Traits::TiledMmaQK;
+  using TiledMmaPV = typename Traits::TiledMmaPV;
+  using Layout = typename Traits::LayoutConvertor;
+
+  using SmemLayoutQ = typename Traits::SmemLayoutQ;
+  using SmemLayoutK = typename Traits::SmemLayoutK;
+  using SmemLayoutV = typename Traits::SmemLayoutV;
+  using SmemLayoutVt = typename Traits::SmemLayoutVt;
+  using SmemLayoutO = typename Traits::SmemLayoutO;
+  using GmemTiledCopyQKV = typename Traits::GmemTiledCopyQKV;
+  using GmemTiledCopyO = typename Traits::GmemTiledCopyO;
+  using SmemTiledCopyO = typename Traits::SmemTiledCopyO;
+  using SharedStorage = typename Traits::SharedStorage;
+
+  const int m_block = blockIdx.x;
+  const int batch_idx = blockIdx.y;
+  const int kv_head_idx = blockIdx.z;
+  const int tidx = threadIdx.x;
+
+  MHATile<Params> tile(params);
+
+  // preprocess input parameters
+  const int head_dim = params.head_dim;
+  const int group_size = params.group_size;
+  const float logits_soft_cap = params.logits_soft_cap;
+  const float sm_scale = params.sm_scale;
+  const float sm_scale_log2 = params.sm_scale_log2;
+
+  // ProblemShape
+  // (q_packed_len, HEAD_DIM)
+  auto [Q, O] = tile.template get_qo_tile<DType>(batch_idx, kv_head_idx);
+  // (kv_len, HEAD_DIM)
+  auto [K, V] = tile.template get_kv_tile<DType>(batch_idx, kv_head_idx);
+
+  const int q_packed_len = size<0>(Q);
+  // all kv are visible to all query tokens without causal mask
+  const int q_len = params.causal ? q_packed_len / group_size : 0;
+  const int kv_len = size<0>(K);
+
+  if (m_block * kBlockM >= q_packed_len) {
+    // m out of bound, return
+    return;
+  }
+
+  const int sliding_window = LOCAL ? params.sliding_window : kv_len;
+
+  const int diagonal = (m_block * kBlockM) / group_size + kv_len - q_len;
+  // process kv in range: [kv_idx_min, kv_idx_max)
+  const int kv_idx_min = std::max(0, diagonal - sliding_window);
+  const int kv_idx_max = std::min(kv_len, diagonal + kBlockM);
+  const int n_block_min = LOCAL ? kv_idx_min / kBlockN : 0;
+  const int n_block_max = cute::ceil_div(kv_idx_max, kBlockN);
+  const int n_blocks = n_block_max - n_block_min;
+
+  // Gmem
+  // (BLK_M, HEAD_DIM)
+  Tensor gQ =
+      local_tile(Q, Shape<_BLK_M, _HEAD_DIM>{}, make_coord(m_block, _0{}));
+  Tensor gO =
+      local_tile(O, Shape<_BLK_M, _HEAD_DIM>{}, make_coord(m_block, _0{}));
+  // (BLK_N, HEAD_DIM, n)
+  Tensor gK = local_tile(K, Shape<_BLK_N, _HEAD_DIM>{}, make_coord(_, _0{}));
+  Tensor gV = local_tile(V, Shape<_BLK_N, _HEAD_DIM>{}, make_coord(_, _0{}));
+
+  // Smem
+  extern __shared__ __align__(128) char smem[];
+  auto& ss = *reinterpret_cast<SharedStorage*>(smem);
+
+  // (BLK_M, HEAD_DIM), k-major
+  Tensor sQ = make_tensor(make_smem_ptr(ss.smem_q.data()), SmemLayoutQ{});
+  // (BLK_N, HEAD_DIM, STAGES), k-major
+  Tensor sK = make_tensor(make_smem_ptr(ss.smem_k.data()), SmemLayoutK{});
+  Tensor sV = make_tensor(make_smem_ptr(ss.smem_v.data()), SmemLayoutV{});
+  // Tensor for V^t; used in GEMM-II.
+  // (HEAD_DIM, BLK_N, STAGES), m-major
+  Tensor sVt = make_tensor(make_smem_ptr(ss.smem_v.data()), SmemLayoutVt{});
+
+  // init pipeline barriers
+  if (tidx == 0) {
+    initialize_barrier(ss.q_full, kProducerThreads);
+    CUTE_UNROLL
+    for (int i = 0; i < kStages; ++i) {
+      initialize_barrier(ss.k_full[i], kProducerThreads);
+      initialize_barrier(ss.k_empty[i], kConsumerThreads);
+      initialize_barrier(ss.v_full[i], kProducerThreads);
+      initialize_barrier(ss.v_empty[i], kConsumerThreads);
+    }
+  }
+  __syncthreads();
+
+  // ###############  Producer  ###############
+  if (tidx < kProducerThreads) {
+    cutlass::arch::warpgroup_reg_dealloc<24>();
+    if (n_blocks <= 0) {
+      // no kv to load, consumers write zeros directly
+      return;
+    }
+
+    GmemTiledCopyQKV gmem_tiled_copy;
+    auto gmem_thr_copy = gmem_tiled_copy.get_thread_slice(tidx);
+
+    // (BLK_M, HEAD_DIM) -> (blk_m, head_dim)
+    Tensor cQ = make_identity_tensor(Shape<_BLK_M, _HEAD_DIM>{});
+    Tensor tQcQ = gmem_thr_copy.partition_S(cQ);
+    // (BLK_N, HEAD_DIM) -> (blk_n, head_dim)
+    Tensor cKV = make_identity_tensor(Shape<_BLK_N, _HEAD_DIM>{});
+    Tensor tKVcKV = gmem_thr_copy.partition_S(cKV);
+
+    // make the smem writes visible to warpgroup MMA and signal the stage
+    auto commit = [&](uint64_t& full_barrier) {
+      cp_async_fence();
+      cp_async_wait<0>();
+      cutlass::arch::fence_view_async_shared();
+      arrive_barrier(full_barrier);
+    };
+
+    // produce query
+    auto tQgQ = gmem_thr_copy.partition_S(gQ);
+    auto tQsQ = gmem_thr_copy.partition_D(sQ);
+    auto max_coord_q = make_coord(q_packed_len - m_block * kBlockM, head_dim);
+    safe_copy</*EVEN_MN=*/false, EVEN_K, /*ZFILL_MN=*/true, /*ZFILL_K=*/true>(
+        gmem_tiled_copy, tQgQ, tQsQ, tQcQ, max_coord_q);
+    commit(ss.q_full);
+
+    // produce key and value from the last block, only the first one may
+    // be out of bound.
+    for (int i = 0; i < n_blocks; ++i) {
+      const int ni = n_block_max - 1 - i;
+      const int stage = i % kStages;
+      const int phase = (i / kStages) & 1;
+      auto max_coord = make_coord(kv_len - ni * kBlockN, head_dim);
+
+      // wait for the consumers to release the stage
+      wait_barrier(ss.k_empty[stage], phase ^ 1);
+      auto tKgK = gmem_thr_copy.partition_S(gK(_, _, ni));
+      auto tKsK = gmem_thr_copy.partition_D(sK(_, _, stage));
+      if (i == 0) {
+        // skip ZFILL_MN for key since Mask will mask out oob with -inf
+        safe_copy</*EVEN_MN=*/false,
+                  EVEN_K,
+                  /*ZFILL_MN=*/false,
+                  /*ZFILL_K=*/true>(
+            gmem_tiled_copy, tKgK, tKsK, tKVcKV, max_coord);
+      } else {
+        safe_copy</*EVEN_MN=*/true,
+                  EVEN_K,
+                  /*ZFILL_MN=*/false,
+                  /*ZFILL_K=*/false>(
+            gmem_tiled_copy, tKgK, tKsK, tKVcKV, max_coord);
+      }
+      commit(ss.k_full[stage]);
+
+      wait_barrier(ss.v_empty[stage], phase ^ 1);
+      auto tVgV = gmem_thr_copy.partition_S(gV(_, _, ni));
+      auto tVsV = gmem_thr_copy.partition_D(sV(_, _, stage));
+      if (i == 0) {
+        // skipping ZFILL_MN for v may cause nan issue
+        safe_copy</*EVEN_MN=*/false,
+                  EVEN_K,
+                  /*ZFILL_MN=*/true,
+                  /*ZFILL_K=*/true>(
+            gmem_tiled_copy, tVgV, tVsV, tKVcKV, max_coord);
+      } else {
+        safe_copy</*EVEN_MN=*/true,
+                  EVEN_K,
+                  /*ZFILL_MN=*/false,
+                  /*ZFILL_K=*/false>(
+            gmem_tiled_copy, tVgV, tVsV, tKVcKV, max_coord);
+      }
+      commit(ss.v_full[stage]);
+    }
+    return;
+  }
+
+  // ###############  Consumer  ###############
+  cutlass::arch::warpgroup_reg_alloc<240>();
+  const int ctidx = tidx - kProducerThreads;
+
+  TiledMmaQK tiled_mma_qk;
+  auto thr_mma_qk = tiled_mma_qk.get_thread_slice(ctidx);
+  // GEMM-I: S = Q@K.T
+  auto tSrQ = thr_mma_qk.partition_fragment_A(sQ);  // (MMA,MMA_M,MMA_K)
+  auto tSrK = thr_mma_qk.partition_fragment_B(sK);  // (MMA,MMA_N,MMA_K,STAGES)
+
+  TiledMmaPV tiled_mma_pv;
+  auto thr_mma_pv = tiled_mma_pv.get_thread_slice(ctidx);
+  // GEMM-II: O = softmax(S)@V
+  // (MMA,MMA_N,MMA_K,STAGES)
+  auto tOrVt = thr_mma_pv.partition_fragment_B(sVt);
+
+  // tOrAccO: (MMA,MMA_M,MMA_K)
+  auto epilogue = [&](const auto& tOrAccO) {
+    // write output to gmem
+    // 1> cast output from ElementAccumulator to Element
+    auto tOrO = make_tensor_like<DType>(tOrAccO);
+    fast_cast(tOrAccO, tOrO);
+
+    // wait for all consumers to finish reading sQ
+    cutlass::arch::NamedBarrier::sync(kConsumerThreads, /*id=*/1);
+
+    // 2. copy output from reg to smem (reuse sQ)
+    auto sO = make_tensor(sQ.data(), SmemLayoutO{});
+
+    SmemTiledCopyO smem_tiled_copy_O;
+    auto smem_thr_copy_O = smem_tiled_copy_O.get_thread_slice(ctidx);
+    auto taccOrO = smem_thr_copy_O.retile_S(tOrO);
+    auto taccOsO = smem_thr_copy_O.partition_D(sO);
+    cute::copy(smem_tiled_copy_O, taccOrO, taccOsO);
+
+    // 3. copy output from smem to gmem
+    GmemTiledCopyO gmem_tiled_copy_O;
+    auto gmem_thr_copy_O = gmem_tiled_copy_O.get_thread_slice(ctidx);
+
+    // (BLK_M, HEAD_DIM) -> (blk_m, head_dim)
+    auto cO = make_identity_tensor(Shape<_BLK_M, _HEAD_DIM>{});
+
+    auto tOsO = gmem_thr_copy_O.partition_S(sO);  // (CPY,CPY_M,CPY_K)
+    auto tOgO = gmem_thr_copy_O.partition_D(gO);  // (CPY,CPY_M,CPY_K)
+    // (CPY,CPY_M,CPY_K) -> (blk_m, head_dim)
+    auto tOcO = gmem_thr_copy_O.partition_D(cO);
+
+    // wait for smem copy done before gmem copy
+    cutlass::arch::NamedBarrier::sync(kConsumerThreads, /*id=*/1);
+
+    auto max_coord = make_coord(q_packed_len - m_block * kBlockM, head_dim);
+    safe_copy</*EVEN_MN=*/false, EVEN_K, /*ZFILL_MN=*/false, /*ZFILL_K=*/false>(
+        gmem_tiled_copy_O, tOsO, tOgO, tOcO, max_coord);
+  };
+
+  // output accumulator, (MMA,MMA_M,MMA_K)
+  auto tOrAccO = partition_fragment_C(tiled_mma_pv, Shape<_BLK_M, _HEAD_DIM>{});
+  auto tOrAccO_rc_view =
+      make_tensor(tOrAccO.data(), Layout::to_rowcol(tOrAccO.layout()));
+  clear(tOrAccO);
+
+  if (n_blocks <= 0) {
+    // write output to gmem
+    epilogue(tOrAccO);
+    return;
+  }
+
+  // attention score accumulator, (MMA,MMA_M,MMA_N)
+  auto tSrAccS = partition_fragment_C(tiled_mma_qk, Shape<_BLK_M, _BLK_N>{});
+  auto tSrAccS_rc_view =
+      make_tensor(tSrAccS.data(), Layout::to_rowcol(tSrAccS.layout()));
+
+  auto apply_logits_soft_cap = [&](auto& tSrAccS) {
+    if constexpr (SOFT_CAP) {
+      CUTE_UNROLL
+      for (int i = 0; i < size(tSrAccS); ++i) {
+        tSrAccS(i) = ptx::tanh(tSrAccS(i) * logits_soft_cap);
+      }
+    }
+  };
+
+  constexpr int kMMA_M = size<1>(tSrAccS);
+  using Softmax = OnlineSoftmax<kRowsPerMMA * kMMA_M>;
+  using Mask = Mask<kBlockM, kBlockN, kRowsPerMMA, kMMA_M, ALIBI, LOCAL>;
+
+  Softmax softmax(sm_scale_log2);
+  Mask mask(ctidx,
+            m_block,
+            q_len,
+            kv_len,
+            kv_head_idx,
+            group_size,
+            sliding_window,
+            sm_scale,
+            params.alibi_slopes_ptr,
+            tile.get_tree_mask(batch_idx));
+
+  // the first blocks may cross the diagonal or the end of kv
+  constexpr int n_oob_mask = cute::ceil_div(kBlockM, kBlockN) + 1;
+
+  // wait query
+  wait_barrier(ss.q_full, 0);
+
+  CUTE_NO_UNROLL
+  for (int i = 0; i < n_blocks; ++i) {
+    const int ni = n_block_max - 1 - i;
+    const int stage = i % kStages;
+    const int phase = (i / kStages) & 1;
+
+    // 1> S = Q@K.T
+    wait_barrier(ss.k_full[stage], phase);
+    detail::wgmma_gemm</*ZERO_INIT=*/true>(
+        tiled_mma_qk, tSrQ, tSrK(_, _, _, stage), tSrAccS);
+    arrive_barrier(ss.k_empty[stage]);
+
+    if constexpr (SOFT_CAP) {
+      apply_logits_soft_cap(tSrAccS);
+    }
+    if (i < n_oob_mask) {
+      mask.apply(tSrAccS_rc_view, ni);
+    } else {
+      mask.apply</*OOB_MASK=*/false>(tSrAccS_rc_view, ni);
+    }
+    softmax.rescale(tSrAccS_rc_view, tOrAccO_rc_view);
+
+    // cast scores from Accumulator to Element
+    auto tSrS = make_tensor_like<DType>(tSrAccS);
+    fast_cast(tSrAccS, tSrS);
+    // convert layout from gemm-I C to gemm-II A
+    auto tOrS = make_tensor(tSrS.data(), Layout::to_mma_a(tSrS.layout()));
+
+    // 2> O = softmax(S)*V
+    wait_barrier(ss.v_full[stage], phase);
+    detail::wgmma_gemm</*ZERO_INIT=*/false>(
+        tiled_mma_pv, tOrS, tOrVt(_, _, _, stage), tOrAccO);
+    arrive_barrier(ss.v_empty[stage]);
+  }
+
+  // ###############  Epilogue  ###############
+
+  // normalize output: o /= rowsum
+  softmax.finalize(tOrAccO_rc_view);
+
+  // write output to gmem
+  epilogue(tOrAccO);
+#endif  // CUTE_ARCH_MMA_SM90A_ENABLED
+}
+
+}  // namespace llm
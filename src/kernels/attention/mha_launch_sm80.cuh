@@ -2,8 +2,12 @@
 
 #include <cute/int_tuple.hpp>
 #include <cute/layout.hpp>
+#include <type_traits>
 
+#include "mha_combine_kernel.cuh"
 #include "mha_kernel_sm80.cuh"
+#include "mha_params.h"
+#include "mha_scheduler.cuh"
 #include "mha_traits_sm80.h"
 #include "static_dispatch.h"
 
@@ -14,25 +18,96 @@ template <typename Traits,
           bool EVEN_K,
           bool ALIBI,
           bool SOFT_CAP,
-          bool LOCAL>
+          bool LOCAL,
+          bool SPLIT_KV>
 void launch_mha_kernel(const Params& params, cudaStream_t stream) {
   const auto batch_size = params.batch_size;
   const auto n_kv_heads = params.n_kv_heads;
   const auto max_q_packed_len = params.max_q_len * params.group_size;
+  int n_splits = 1;
+  if constexpr (SPLIT_KV) {
+    n_splits = params.n_kv_splits;
+  }
 
   const auto smem_size = Traits::kSmemSize;
-  auto mha_kernel =
-      mha_kernel_sm80<Traits, Params, EVEN_K, ALIBI, SOFT_CAP, LOCAL>;
+  auto mha_kernel = mha_kernel_sm80<Traits,
+                                    Params,
+                                    EVEN_K,
+                                    ALIBI,
+                                    SOFT_CAP,
+                                    LOCAL,
+                                    SPLIT_KV>;
   cudaFuncSetAttribute(
       mha_kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size);
-  // TODO: support persistent kernels
-  dim3 grid(cute::ceil_div(max_q_packed_len, Traits::kBlockM),
+  dim3 grid(cute::ceil_div(max_q_packed_len, Traits::kBlockM) * n_splits,
             batch_size,
             n_kv_heads);
   dim3 block = Traits::kThreadNum;
   mha_kernel<<<grid, block, smem_size, stream>>>(params);
+
+  if constexpr (SPLIT_KV) {
+    if (params.split_offset + n_splits < params.n_split_slots) {
+      // the remaining slots are written by following launches
+      return;
+    }
+    // merge the partial outputs of the splits
+    using DType = typename Traits::DType;
+    dim3 combine_grid(params.n_tokens, params.n_heads);
+    dim3 combine_block(std::min(params.head_dim, 128));
+    mha_combine_kernel<DType, Params>
+        <<<combine_grid, combine_block, 0, stream>>>(params);
+  }
 }
 
+// plan the work items on device, run one wave of persistent thread blocks,
+// then merge the partial outputs of the chunked tiles.
+template <typename Traits,
+          typename Params,
+          bool EVEN_K,
+          bool ALIBI,
+          bool SOFT_CAP,
+          bool LOCAL>
+void launch_mha_persistent_kernel(const Params& params, cudaStream_t stream) {
+  const auto smem_size = Traits::kSmemSize;
+  auto mha_kernel = mha_persistent_kernel_sm80<Traits,
+                                               Params,
+                                               EVEN_K,
+                                               ALIBI,
+                                               SOFT_CAP,
+                                               LOCAL>;
+  cudaFuncSetAttribute(
+      mha_kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size);
+
+  // no more thread blocks than can be resident at the same time
+  int device = 0;
+  cudaGetDevice(&device);
+  int n_sms = 0;
+  cudaDeviceGetAttribute(&n_sms, cudaDevAttrMultiProcessorCount, device);
+  int n_blocks_per_sm = 0;
+  cudaOccupancyMaxActiveBlocksPerMultiprocessor(
+      &n_blocks_per_sm, mha_kernel, Traits::kThreadNum, smem_size);
+  Params persistent_params = params;
+  persistent_params.n_ctas =
+      std::min(params.n_ctas, std::max(1, n_sms * n_blocks_per_sm));
+  const int n_ctas = persistent_params.n_ctas;
+
+  constexpr int kPlanThreads = 256;
+  mha_plan_kernel<Traits::kBlockM, Traits::kBlockN, kPlanThreads, Params>
+      <<<1, kPlanThreads, 0, stream>>>(persistent_params);
+
+  dim3 block = Traits::kThreadNum;
+  mha_kernel<<<n_ctas, block, smem_size, stream>>>(persistent_params);
+
+  // less than n_ctas tiles are chunked
+  using DType = typename Traits::DType;
+  mha_merge_tiles_kernel<DType, Traits::kBlockM, Params>
+      <<<n_ctas, 128, 0, stream>>>(persistent_params);
+}
+
+// split kv is only supported for variable length sequences
+template <typename Params>
+constexpr bool kSupportSplitKV = std::is_base_of_v<MHAVarLenParams, Params>;
+
 template <typename Traits, typename Params>
 void run_mha_kernel(const Params& params, cudaStream_t stream) {
   // dispatch to proper kernel instantiation based on params
@@ -40,8 +115,38 @@ void run_mha_kernel(const Params& params, cudaStream_t stream) {
     DISPATCH_BOOL(params.alibi_slopes_ptr != nullptr, ALIBI, [&] {
       DISPATCH_BOOL(params.logits_soft_cap > 0, SOFT_CAP, [&] {
         DISPATCH_BOOL(params.sliding_window >= 0, LOCAL, [&] {
-          launch_mha_kernel<Traits, Params, EVEN_K, ALIBI, SOFT_CAP, LOCAL>(
-              params, stream);
+          if constexpr (kSupportSplitKV<Params> &&
+                        Traits::kBlockM == kMHABlockM) {
+            // the persistent kernel is planned with 64-row tiles
+            if (params.n_ctas > 0) {
+              launch_mha_persistent_kernel<Traits,
+                                           Params,
+                                           EVEN_K,
+                                           ALIBI,
+                                           SOFT_CAP,
+                                           LOCAL>(params, stream);
+              return;
+            }
+          }
+          if constexpr (kSupportSplitKV<Params>) {
+            if (params.n_split_slots > 1) {
+              launch_mha_kernel<Traits,
+                                Params,
+                                EVEN_K,
+                                ALIBI,
+                                SOFT_CAP,
+                                LOCAL,
+                                /*SPLIT_KV=*/true>(params, stream);
+              return;
+            }
+          }
+          launch_mha_kernel<Traits,
+                            Params,
+                            EVEN_K,
+                            ALIBI,
+                            SOFT_CAP,
+                            LOCAL,
+                            /*SPLIT_KV=*/false>(params, stream);
         });
       });
     });
@@ -56,44 +161,75 @@ void run_mha_kernel_sm80(Params& params, cudaStream_t stream = nullptr) {
   // normalize params that for performance optimization
   params.normalize();
 
-  // TODO: tune block shape MNK based on the head dim and smem size
-  if constexpr (HEAD_DIM == 64) {
-    using Traits = MHATraitsSM80<Dtype,
-                                 HEAD_DIM,
-                                 /*BLK_M=*/64,
-                                 /*BLK_N=*/64,
-                                 /*BLK_K=*/64>;
-    detail::run_mha_kernel<Traits>(params, stream);
-  } else if constexpr (HEAD_DIM == 96) {
-    using Traits = MHATraitsSM80<Dtype,
-                                 HEAD_DIM,
-                                 /*BLK_M=*/64,
-                                 /*BLK_N=*/64,
-                                 /*BLK_K=*/32>;
-    detail::run_mha_kernel<Traits>(params, stream);
-  } else if constexpr (HEAD_DIM == 128) {
-    using Traits = MHATraitsSM80<Dtype,
-                                 HEAD_DIM,
-                                 /*BLK_M=*/64,
-                                 /*BLK_N=*/64,
-                                 /*BLK_K=*/64>;
-    detail::run_mha_kernel<Traits>(params, stream);
-  } else if constexpr (HEAD_DIM == 256) {
-    using Traits = MHATraitsSM80<Dtype,
-                                 HEAD_DIM,
-                                 /*BLK_M=*/64,
-                                 /*BLK_N=*/64,
-                                 /*BLK_K=*/64>;
-    detail::run_mha_kernel<Traits>(params, stream);
-  } else {
-    // use the default block size
+  // BLK_K has to divide the head dim
+  constexpr int BLK_K =
+      HEAD_DIM % 64 == 0 ? 64 : (HEAD_DIM % 32 == 0 ? 32 : 16);
+  // BLK_N is picked by the tuner from kMHABlockNCandidates
+  auto run = [&](auto blk_m, auto blk_n) {
     using Traits = MHATraitsSM80<Dtype,
                                  HEAD_DIM,
-                                 /*BLK_M=*/64,
-                                 /*BLK_N=*/64,
-                                 /*BLK_K=*/64>;
+                                 /*BLK_M=*/decltype(blk_m)::value,
+                                 /*BLK_N=*/decltype(blk_n)::value,
+                                 BLK_K>;
     detail::run_mha_kernel<Traits>(params, stream);
+  };
+  if constexpr (std::is_same_v<Params, MHAPagedKVParams>) {
+    // the 8-bit kv cache is only instantiated with the default tiles
+    auto run_quant = [&](auto kv_dtype) {
+      using Traits = MHATraitsSM80<Dtype,
+                                   HEAD_DIM,
+                                   /*BLK_M=*/kMHABlockM,
+                                   /*BLK_N=*/kMHABlockNCandidates[0],
+                                   BLK_K,
+                                   /*KV_DTYPE=*/decltype(kv_dtype)>;
+      detail::run_mha_kernel<Traits>(params, stream);
+    };
+    switch (params.kv_type) {
+      case MHAKVType::kInt8:
+        run_quant(int8_t{});
+        return;
+      case MHAKVType::kFp8E4M3:
+        run_quant(cute::float_e4m3_t{});
+        return;
+      default:
+        break;
+    }
+  }
+
+  static_assert(kMHABlockM == 64 && kMHASmallBlockMCandidates[0] == 16 &&
+                kMHASmallBlockMCandidates[1] == 32);
+  // few packed query rows, e.g. speculative verification
+  switch (params.block_m) {
+    case 16:
+      run(cute::Int<16>{}, cute::Int<64>{});
+      return;
+    case 32:
+      run(cute::Int<32>{}, cute::Int<64>{});
+      return;
+    default:
+      break;
+  }
+
+  static_assert(kMHABlockNCandidates[0] == 64 &&
+                kMHABlockNCandidates[1] == 32 &&
+                kMHABlockNCandidates[2] == 128);
+  switch (params.tile_config) {
+    case 1:
+      if constexpr (mha_tile_config_supported(/*tile_config=*/1, HEAD_DIM)) {
+        run(cute::Int<64>{}, cute::Int<32>{});
+        return;
+      }
+      break;
+    case 2:
+      if constexpr (mha_tile_config_supported(/*tile_config=*/2, HEAD_DIM)) {
+        run(cute::Int<64>{}, cute::Int<128>{});
+        return;
+      }
+      break;
+    default:
+      break;
   }
+  run(cute::Int<64>{}, cute::Int<64>{});
 }
 
 }  // namespace llm
\ No newline at end of file
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cute/int_tuple.hpp>
+#include <cute/layout.hpp>
+
+#include "mha_kernel_sm90.cuh"
+#include "mha_traits_sm90.h"
+#include "static_dispatch.h"
+
+namespace llm {
+namespace detail {
+template <typename Traits,
+          typename Params,
+          bool EVEN_K,
+          bool ALIBI,
+          bool SOFT_CAP,
+          bool LOCAL>
+void launch_mha_kernel_sm90(const Params& params, cudaStream_t stream) {
+  const auto batch_size = params.batch_size;
+  const auto n_kv_heads = params.n_kv_heads;
+  const auto max_q_packed_len = params.max_q_len * params.group_size;
+
+  const auto smem_size = Traits::kSmemSize;
+  auto mha_kernel =
+      mha_kernel_sm90<Traits, Params, EVEN_K, ALIBI, SOFT_CAP, LOCAL>;
+  cudaFuncSetAttribute(
+      mha_kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size);
+  dim3 grid(cute::ceil_div(max_q_packed_len, Traits::kBlockM),
+            batch_size,
+            n_kv_heads);
+  dim3 block = Traits::kThreadNum;
+  mha_kernel<<<grid, block, smem_size, stream>>>(params);
+}
+
+template <typename Traits, typename Params>
+void run_mha_kernel_sm90(const Params& params, cudaStream_t stream) {
+  // dispatch to proper kernel instantiation based on params
+  DISPATCH_BOOL(params.head_dim == Traits::kHeadDim, EVEN_K, [&] {
+    DISPATCH_BOOL(params.alibi_slopes_ptr != nullptr, ALIBI, [&] {
+      DISPATCH_BOOL(params.logits_soft_cap > 0, SOFT_CAP, [&] {
+        DISPATCH_BOOL(params.sliding_window >= 0, LOCAL, [&] {
+          launch_mha_kernel_sm90<Traits,
+                                 Params,
+                                 EVEN_K,
+                                 ALIBI,
+                                 SOFT_CAP,
+                                 LOCAL>(params, stream);
+        });
+      });
+    });
+  });
+}
+
+}  // namespace detail
+
+// user-facing function to run the attention kernel on hopper
+template <typename Dtype, int HEAD_DIM, typename Params>
+void run_mha_kernel_sm90(Params& params, cudaStream_t stream = nullptr) {
+  // normalize params that for performance optimization
+  params.normalize();
+
+  // two consumer warpgroups for 128 rows, 2 stages of k/v in smem
+  if constexpr (HEAD_DIM == 256) {
+    // smaller kv block to fit in smem
+    using Traits = MHATraitsSM90<Dtype,
+                                 HEAD_DIM,
+                                 /*BLK_M=*/128,
+                                 /*BLK_N=*/64,
+                                 /*STAGES=*/2>;
+    detail::run_mha_kernel_sm90<Traits>(params, stream);
+  } else {
+    using Traits = MHATraitsSM90<Dtype,
+                                 HEAD_DIM,
+                                 /*BLK_M=*/128,
+                                 /*BLK_N=*/128,
+                                 /*STAGES=*/2>;
+    detail::run_mha_kernel_sm90<Traits>(params, stream);
+  }
+}
+
+}  // namespace llm
@@ -6,6 +6,68 @@
 #include "cute/layout.hpp"
 namespace llm {
 
+// max number of kv splits supported by the combine kernel
+constexpr int kMaxKVSplits = 64;
+
+// query tile size (BLK_M) of the sm80 kernel, one warp per 16 rows.
+constexpr int kMHABlockM = 64;
+// smaller query tiles for batches with few packed query rows per sequence
+// and kv head (q_len x group_size), e.g. speculative verification, which
+// would mostly be padding in a 64-row tile. the causal mask is applied
+// inside the tile as usual. they are only instantiated with BLK_N = 64.
+constexpr int kMHASmallBlockMCandidates[] = {16, 32};
+
+// candidate kv tile sizes (BLK_N) of the sm80 kernel indexed by tile_config,
+// the first one is the default. BLK_M = 64 uses all candidates, and
+// BLK_N = 128 is only instantiated for head_dim <= 128 to fit in smem, and
+// BLK_N = 32 for head_dim multiple of 32, since the gmem copy of head dims
+// like 80 covers 64 rows at a time.
+constexpr int kMHABlockNCandidates[] = {64, 32, 128};
+constexpr int kNumMHATileConfigs = 3;
+
+// whether the tile config is instantiated for the head dim
+CUTE_HOST_DEVICE constexpr bool mha_tile_config_supported(int tile_config,
+                                                          int head_dim) {
+  const int block_n = kMHABlockNCandidates[tile_config];
+  return (block_n != 128 || head_dim <= 128) &&
+         (block_n != 32 || head_dim % 32 == 0);
+}
+
+// element type of the paged kv cache
+enum class MHAKVType : int8_t {
+  // the same type as the query
+  kSame = 0,
+  // 8-bit cache with one float scale per (slot, kv_head)
+  kInt8 = 1,
+  kFp8E4M3 = 2,
+};
+
+// a tile of the attention processed by the persistent kernel: the packed
+// queries of (batch_idx, kv_head_idx) in m_block against the kv blocks of
+// split split_idx out of n_splits. the chunks of a tile with n_splits > 1
+// are written to partial slots [slot_idx, slot_idx + n_splits).
+struct MHAWorkItem {
+  int batch_idx = 0;
+  int m_block = 0;
+  int kv_head_idx = 0;
+  int split_idx = 0;
+  int n_splits = 1;
+  int slot_idx = 0;
+};
+
+// upper bound of the work items planned for n_ctas thread blocks: each
+// (tile, kv_head) is one item, plus at most 2 * n_ctas extra chunks.
+CUTE_HOST_DEVICE int mha_max_work_items(int n_tokens,
+                                        int batch_size,
+                                        int group_size,
+                                        int n_kv_heads,
+                                        int n_ctas,
+                                        int block_m) {
+  const int n_tiles =
+      cute::ceil_div(n_tokens * group_size, block_m) + batch_size;
+  return n_tiles * n_kv_heads + 2 * n_ctas;
+}
+
 // common params for attention kernels
 struct MHAParamsCommon {
   const void* __restrict__ q_ptr = nullptr;
@@ -26,6 +88,15 @@ struct MHAParamsCommon {
   // mask
   int sliding_window = -1;
 
+  // causal mask between the query tokens and kv, all kv are visible to all
+  // query tokens if false. used by the shared prefix pass of cascade attention.
+  bool causal = true;
+
+  // tree mask for speculative decoding, one bitmask per query token.
+  // bit j is set if the token attends to the j-th new token of its sequence,
+  // tokens in kv cache are always visible. nullptr means causal mask.
+  const int64_t* __restrict__ tree_mask_ptr = nullptr;  // [n_tokens]
+
   // softcap
   float logits_soft_cap = 0.0;
 
@@ -34,10 +105,21 @@ struct MHAParamsCommon {
 
   // alibi
   const float* __restrict__ alibi_slopes_ptr = nullptr;  // [n_heads]
+  // position of the first kv token of each sequence in the alibi bias,
+  // nullptr means 0. used by the suffix pass of cascade attention, whose kv
+  // starts after the shared prefix.
+  const int* __restrict__ alibi_kv_offsets = nullptr;  // [batch]
 
   // block size, only used for paged KV cache
   int block_size = 0;
 
+  // index of the tile shape in kMHABlockNCandidates, picked by the tuner
+  int tile_config = 0;
+
+  // rows of the query tile, kMHABlockM or one of kMHASmallBlockMCandidates.
+  // tile_config is ignored for the small tiles.
+  int block_m = kMHABlockM;
+
   // private:
   // used for performance optimization, don't change it
   bool normalized = false;
@@ -114,6 +196,38 @@ struct MHAVarLenParams : public MHAParamsCommon {
   // array of length batch_size + 1 holding starting offset of each sequence.
   const int* __restrict__ q_cu_lens = nullptr;
   const int* __restrict__ kv_cu_lens = nullptr;
+
+  // split kv: each split attends to a range of kv blocks, the partial outputs
+  // are merged by their log-sum-exp. 1 means no split.
+  int n_kv_splits = 1;
+  // the splits are written to slots [split_offset, split_offset + n_kv_splits)
+  // of the split buffers, and all slots are merged once the last one is
+  // written. cascade attention writes the prefix and suffix passes into
+  // different slots of the same buffers.
+  int split_offset = 0;
+  int n_split_slots = 1;
+  // total number of query tokens, used to merge the partial outputs
+  int n_tokens = 0;
+  // partial outputs: [n_tokens, n_split_slots, n_heads, head_dim]
+  float* __restrict__ o_split_ptr = nullptr;
+  // log2 of the sum of exp scores: [n_tokens, n_split_slots, n_heads]
+  float* __restrict__ lse_split_ptr = nullptr;
+
+  // persistent kernel: at most n_ctas thread blocks process the work items
+  // planned on device by mha_plan_kernel. 0 means one thread block per tile.
+  int n_ctas = 0;
+  // capacity of work_items, see mha_max_work_items()
+  int max_work_items = 0;
+  MHAWorkItem* __restrict__ work_items = nullptr;
+  // [n_ctas + 1] offsets of the work items of each thread block
+  int* __restrict__ cta_cu_items = nullptr;
+  // the first chunk of the tiles to merge: [n_ctas], and their count: [1]
+  MHAWorkItem* __restrict__ merge_tiles = nullptr;
+  int* __restrict__ n_merge_tiles = nullptr;
+  // partial outputs of the chunks: [2 * n_ctas, BLK_M, head_dim]
+  float* __restrict__ o_partial_ptr = nullptr;
+  // log2 of the sum of exp scores: [2 * n_ctas, BLK_M]
+  float* __restrict__ lse_partial_ptr = nullptr;
 };
 
 // paged KV cache
@@ -123,6 +237,29 @@ struct MHAPagedKVParams : public MHAVarLenParams {
   const int* __restrict__ block_table = nullptr;
   // array of length batch_size + 1 holding starting offset of each sequence.
   const int* __restrict__ block_cu_lens = nullptr;
+
+  // k_stride/v_stride are the strides of (slot in block, head), and these are
+  // the strides between blocks. 0 means the slot major layout:
+  // [n_slots, n_kv_heads, head_dim], other layouts, e.g. head major:
+  // [n_blocks, n_kv_heads, block_size, head_dim], need to set them.
+  int64_t k_block_stride = 0;
+  int64_t v_block_stride = 0;
+
+  // 8-bit kv cache in the slot major layout, dequantized by the scales when
+  // the kv tiles are loaded into smem. the scales are nullptr for kSame.
+  MHAKVType kv_type = MHAKVType::kSame;
+  const float* __restrict__ k_scale_ptr = nullptr;  // [n_slots, n_kv_heads]
+  const float* __restrict__ v_scale_ptr = nullptr;  // [n_slots, n_kv_heads]
+
+  void normalize() {
+    if (k_block_stride == 0) {
+      k_block_stride = block_size * cute::get<0>(k_stride);
+    }
+    if (v_block_stride == 0) {
+      v_block_stride = block_size * cute::get<0>(v_stride);
+    }
+    MHAVarLenParams::normalize();
+  }
 };
 
 }  // namespace llm
\ No newline at end of file
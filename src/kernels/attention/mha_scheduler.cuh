@@ -0,0 +1,271 @@
+#pragma once
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+#include <climits>
+#include <cub/cub.cuh>
+#include <cute/config.hpp>
+#include <cute/tensor.hpp>
+
+#include "mha_params.h"
+#include "ptx.cuh"
+
+namespace llm {
+
+namespace detail {
+// number of items, merged tiles, partial slots and cost of a range of tiles
+struct MHAPlanCounts {
+  int items = 0;
+  int merges = 0;
+  int slots = 0;
+  int64_t cost = 0;
+
+  CUTE_DEVICE MHAPlanCounts operator+(const MHAPlanCounts& other) const {
+    return {items + other.items,
+            merges + other.merges,
+            slots + other.slots,
+            cost + other.cost};
+  }
+};
+
+struct MHAPlanSumOp {
+  CUTE_DEVICE MHAPlanCounts operator()(const MHAPlanCounts& a,
+                                       const MHAPlanCounts& b) const {
+    return a + b;
+  }
+};
+
+struct MHAPlanPrefixOp {
+  MHAPlanCounts running_total;
+
+  CUTE_DEVICE MHAPlanCounts operator()(const MHAPlanCounts& block_aggregate) {
+    const MHAPlanCounts old_prefix = running_total;
+    running_total = running_total + block_aggregate;
+    return old_prefix;
+  }
+};
+
+// kv blocks visited by the tile m_block, same as the range in the kernel
+template <int BLK_M, int BLK_N, typename Params>
+CUTE_DEVICE int mha_tile_kv_blocks(const Params& params,
+                                   int m_block,
+                                   int q_len,
+                                   int kv_len) {
+  const int group_size = params.group_size;
+  // all kv are visible to all query tokens without causal mask
+  const int diagonal =
+      (m_block * BLK_M) / group_size + kv_len - (params.causal ? q_len : 0);
+  const int kv_idx_max = std::min(kv_len, diagonal + BLK_M);
+  int n_block_min = 0;
+  if (params.sliding_window >= 0) {
+    n_block_min = std::max(0, diagonal - params.sliding_window) / BLK_N;
+  }
+  const int n_block_max = cute::ceil_div(kv_idx_max, BLK_N);
+  return std::max(0, n_block_max - n_block_min);
+}
+}  // namespace detail
+
+// plan the work of the persistent kernel with a single thread block.
+// the tiles are flattened in (batch, m_block, kv_head) order, each costs its
+// kv blocks plus one for the prologue and epilogue. tiles costing more than
+// the average cost per thread block are chunked along kv, and each item is
+// assigned to the thread block at the start of its cost range, so that all
+// thread blocks get a contiguous range of items with similar total cost.
+// each thread handles all tiles of one sequence at a time.
+template <int BLK_M, int BLK_N, int BLOCK_SIZE, typename Params>
+__global__ void mha_plan_kernel(__grid_constant__ const Params params) {
+  using BlockReduce = cub::BlockReduce<int64_t, BLOCK_SIZE>;
+  using BlockScan = cub::BlockScan<detail::MHAPlanCounts, BLOCK_SIZE>;
+  __shared__ union {
+    typename BlockReduce::TempStorage reduce;
+    typename BlockScan::TempStorage scan;
+  } temp_storage;
+  __shared__ int64_t s_avg_cost;
+
+  const int tidx = threadIdx.x;
+  const int batch_size = params.batch_size;
+  const int group_size = params.group_size;
+  const int n_kv_heads = params.n_kv_heads;
+  const int n_ctas = params.n_ctas;
+
+  auto q_len_of = [&](int batch_idx) {
+    return params.q_cu_lens[batch_idx + 1] - params.q_cu_lens[batch_idx];
+  };
+  auto kv_len_of = [&](int batch_idx) {
+    return params.kv_cu_lens[batch_idx + 1] - params.kv_cu_lens[batch_idx];
+  };
+
+  // 1> total cost of all tiles
+  int64_t thread_cost = 0;
+  for (int b = tidx; b < batch_size; b += BLOCK_SIZE) {
+    const int q_len = q_len_of(b);
+    const int kv_len = kv_len_of(b);
+    const int n_m_blocks = cute::ceil_div(q_len * group_size, BLK_M);
+    for (int m_block = 0; m_block < n_m_blocks; ++m_block) {
+      thread_cost += 1 + detail::mha_tile_kv_blocks<BLK_M, BLK_N>(
+                             params, m_block, q_len, kv_len);
+    }
+  }
+  const int64_t total_cost =
+      BlockReduce(temp_storage.reduce).Sum(thread_cost) * n_kv_heads;
+  if (tidx == 0) {
+    s_avg_cost = std::max<int64_t>(1, cute::ceil_div(total_cost, n_ctas));
+  }
+  for (int i = tidx; i < n_ctas; i += BLOCK_SIZE) {
+    params.cta_cu_items[i] = INT_MAX;
+  }
+  __syncthreads();
+  const int64_t avg_cost = s_avg_cost;
+
+  // chunk a tile costing more than the average
+  auto n_chunks = [&](int n_blocks) {
+    const int64_t n = cute::ceil_div(int64_t(n_blocks) + 1, avg_cost);
+    const int max_chunks = std::min(n_blocks, kMaxKVSplits);
+    return std::max(1, (int)std::min<int64_t>(n, max_chunks));
+  };
+
+  // 2> emit the work items in order
+  detail::MHAPlanPrefixOp prefix_op{};
+  for (int start = 0; start < batch_size; start += BLOCK_SIZE) {
+    const int b = start + tidx;
+    const int q_len = b < batch_size ? q_len_of(b) : 0;
+    const int kv_len = b < batch_size ? kv_len_of(b) : 0;
+    const int n_m_blocks = cute::ceil_div(q_len * group_size, BLK_M);
+
+    detail::MHAPlanCounts counts;
+    for (int m_block = 0; m_block < n_m_blocks; ++m_block) {
+      const int n_blocks = detail::mha_tile_kv_blocks<BLK_M, BLK_N>(
+          params, m_block, q_len, kv_len);
+      const int chunks = n_chunks(n_blocks);
+      counts.items += chunks * n_kv_heads;
+      counts.cost += int64_t(n_blocks + 1) * n_kv_heads;
+      if (chunks > 1) {
+        counts.merges += n_kv_heads;
+        counts.slots += chunks * n_kv_heads;
+      }
+    }
+    detail::MHAPlanCounts offsets;
+    BlockScan(temp_storage.scan)
+        .ExclusiveScan(counts, offsets, detail::MHAPlanSumOp{}, prefix_op);
+
+    for (int m_block = 0; m_block < n_m_blocks; ++m_block) {
+      const int n_blocks = detail::mha_tile_kv_blocks<BLK_M, BLK_N>(
+          params, m_block, q_len, kv_len);
+      const int chunks = n_chunks(n_blocks);
+      const int64_t cost = n_blocks + 1;
+      for (int kv_head_idx = 0; kv_head_idx < n_kv_heads; ++kv_head_idx) {
+        MHAWorkItem item;
+        item.batch_idx = b;
+        item.m_block = m_block;
+        item.kv_head_idx = kv_head_idx;
+        item.n_splits = chunks;
+        item.slot_idx = offsets.slots;
+        if (chunks > 1) {
+          item.split_idx = 0;
+          params.merge_tiles[offsets.merges] = item;
+          ++offsets.merges;
+          offsets.slots += chunks;
+        }
+        for (int i = 0; i < chunks; ++i) {
+          const int idx = offsets.items + i;
+          if (idx >= params.max_work_items) {
+            break;
+          }
+          // the thread block at the start of the cost range of the chunk
+          const int64_t chunk_start = offsets.cost + cost * i / chunks;
+          const int cta = (int)std::min<int64_t>(n_ctas - 1,
+                                                 chunk_start / avg_cost);
+          item.split_idx = i;
+          params.work_items[idx] = item;
+          atomicMin(&params.cta_cu_items[cta], idx);
+        }
+        offsets.items += chunks;
+        offsets.cost += cost;
+      }
+    }
+    __syncthreads();
+  }
+
+  // 3> the items of each thread block: [cta_cu_items[i], cta_cu_items[i+1])
+  if (tidx == 0) {
+    const int n_items =
+        std::min(prefix_op.running_total.items, params.max_work_items);
+    params.cta_cu_items[n_ctas] = n_items;
+    for (int i = n_ctas - 1; i >= 0; --i) {
+      params.cta_cu_items[i] =
+          std::min(params.cta_cu_items[i], params.cta_cu_items[i + 1]);
+    }
+    *params.n_merge_tiles = prefix_op.running_total.merges;
+  }
+}
+
+// merge the partial outputs of the chunked tiles by their log-sum-exp, see
+// mha_combine_kernel. each thread block handles one tile, one row per warp.
+template <typename DType, int BLK_M, typename Params>
+__global__ void mha_merge_tiles_kernel(__grid_constant__ const Params params) {
+  constexpr int kWarpSize = 32;
+  // scale of each chunk for each row of the warps
+  __shared__ float s_scales[BLK_M][kMaxKVSplits];
+
+  if (blockIdx.x >= *params.n_merge_tiles) {
+    return;
+  }
+  const MHAWorkItem tile = params.merge_tiles[blockIdx.x];
+  const int warp_idx = threadIdx.x / kWarpSize;
+  const int lane_idx = threadIdx.x % kWarpSize;
+  const int n_warps = blockDim.x / kWarpSize;
+  const int n_splits = tile.n_splits;
+  const int head_dim = params.head_dim;
+  const int group_size = params.group_size;
+
+  const int q_begin = params.q_cu_lens[tile.batch_idx];
+  const int q_len = params.q_cu_lens[tile.batch_idx + 1] - q_begin;
+  const int max_m = q_len * group_size - tile.m_block * BLK_M;
+
+  // lse_partial: [n_slots, BLK_M], o_partial: [n_slots, BLK_M, head_dim]
+  const float* lse = params.lse_partial_ptr + int64_t(tile.slot_idx) * BLK_M;
+  const float* o_partial =
+      params.o_partial_ptr + int64_t(tile.slot_idx) * BLK_M * head_dim;
+  for (int m = warp_idx; m < BLK_M && m < max_m; m += n_warps) {
+    if (lane_idx == 0) {
+      float lse_max = -INFINITY;
+      for (int i = 0; i < n_splits; ++i) {
+        lse_max = max(lse_max, lse[i * BLK_M + m]);
+      }
+      float sum = 0.0f;
+      for (int i = 0; i < n_splits; ++i) {
+        // chunks without visible kv have lse = -inf
+        const float scale = lse_max == -INFINITY
+                                ? 0.0f
+                                : ptx::exp2(lse[i * BLK_M + m] - lse_max);
+        s_scales[m][i] = scale;
+        sum += scale;
+      }
+      const float inv_sum = sum == 0.0f ? 0.0f : ptx::rcp(sum);
+      for (int i = 0; i < n_splits; ++i) {
+        s_scales[m][i] *= inv_sum;
+      }
+    }
+    __syncwarp();
+
+    // packed row => (token, head)
+    const int packed_idx = tile.m_block * BLK_M + m;
+    const int token_idx = q_begin + packed_idx / group_size;
+    const int head_idx =
+        tile.kv_head_idx * group_size + packed_idx % group_size;
+    DType* o = (DType*)params.o_ptr +
+               int64_t(token_idx) * cute::get<0>(params.o_stride) +
+               head_idx * cute::get<1>(params.o_stride);
+    for (int k = lane_idx; k < head_dim; k += kWarpSize) {
+      float acc = 0.0f;
+      for (int i = 0; i < n_splits; ++i) {
+        acc += s_scales[m][i] *
+               o_partial[(int64_t(i) * BLK_M + m) * head_dim + k];
+      }
+      o[k] = static_cast<DType>(acc);
+    }
+  }
+}
+
+}  // namespace llm
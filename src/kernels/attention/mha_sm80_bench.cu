@@ -6,22 +6,10 @@
 
 #include "mha_launch_sm80.cuh"
 #include "mha_params.h"
+#include "static_dispatch.h"
 
 using namespace llm;
 
-#define DISPATCH_HEAD_DIM_(HEAD_DIM_V, HEAD_DIM_NAME, ...) \
-  [&] {                                                    \
-    if (HEAD_DIM_V <= 64) {                                \
-      constexpr static int HEAD_DIM_NAME = 64;             \
-      return __VA_ARGS__();                                \
-    } else if (HEAD_DIM_V <= 128) {                        \
-      constexpr static int HEAD_DIM_NAME = 128;            \
-      return __VA_ARGS__();                                \
-    } else {                                               \
-      assert(false);                                       \
-    }                                                      \
-  }()
-
 void mha_bench_sm80(nvbench::state& state) {
   // Collect CUPTI metrics
   state.collect_cupti_metrics();
@@ -81,7 +69,7 @@ void mha_bench_sm80(nvbench::state& state) {
   params.sliding_window = sliding_window;
 
   state.exec([&](nvbench::launch& launch) {
-    DISPATCH_HEAD_DIM_(head_dim, HEAD_DIM, [&] {
+    DISPATCH_HEAD_DIM_SM80(head_dim, HEAD_DIM, [&] {
       run_mha_kernel_sm80<cute::half_t, HEAD_DIM>(params, launch.get_stream());
     });
   });
@@ -93,7 +81,7 @@ NVBENCH_BENCH(mha_bench_sm80)
     .add_int64_axis("kv_len", {1024})
     .add_int64_axis("n_heads", {8})
     .add_int64_axis("n_kv_heads", {8})
-    .add_int64_axis("head_dim", {64})
+    .add_int64_axis("head_dim", {64, 80, 96, 112, 128})
     .add_float64_axis("logits_soft_cap", {0.0})
     .add_int64_axis("alibi", {0})
     .add_int64_axis("sliding_window", {-1});
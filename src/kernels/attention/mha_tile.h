@@ -8,6 +8,47 @@
 namespace llm {
 using namespace cute;
 
+namespace detail {
+// return the partial output/lse tiles of the kv split for the query tokens
+// [begin, begin + qo_len): (packed_len, head_dim) and (packed_len)
+template <typename Element, typename Params>
+CUTE_HOST_DEVICE auto make_split_tile(const Params& params,
+                                      int begin,
+                                      int qo_len,
+                                      int kv_head_idx,
+                                      int split_idx) {
+  const auto group_size = params.group_size;
+  const auto head_base = kv_head_idx * group_size;
+  auto packed_idx_to_coord = [group_size, head_base](int packed_idx) {
+    const int idx = packed_idx / group_size;
+    const int offset = packed_idx % group_size;
+    // (group_size, n_tokens)
+    return make_coord(head_base + offset, idx);
+  };
+
+  // o_split: [n_tokens, n_split_slots, n_heads, head_dim]
+  // lse_split: [n_tokens, n_split_slots, n_heads]
+  const auto packed_len = qo_len * group_size;
+  const int64_t row = int64_t(begin) * params.n_split_slots +
+                      params.split_offset + split_idx;
+  const int64_t token_stride = int64_t(params.n_split_slots) * params.n_heads;
+  auto o = make_gather_tensor(
+      make_gmem_ptr((Element*)params.o_split_ptr +
+                    row * params.n_heads * params.head_dim),
+      make_shape(packed_len, params.head_dim),
+      make_stride(make_stride(int64_t(params.head_dim),
+                              token_stride * params.head_dim),
+                  _1{}),
+      packed_idx_to_coord);
+  auto lse = make_gather_tensor(
+      make_gmem_ptr((Element*)params.lse_split_ptr + row * params.n_heads),
+      make_shape(packed_len),
+      make_stride(make_stride(_1{}, token_stride)),
+      packed_idx_to_coord);
+  return make_tuple(o, lse);
+}
+}  // namespace detail
+
 template <typename Params>
 struct MHATile {
   static_assert(cute::dependent_false<Params>, "not implemented");
@@ -21,6 +62,14 @@ struct MHATile<MHAParams> {
 
   CUTE_HOST_DEVICE MHATile(const MHAParams& params) : params_(params) {}
 
+  // return the tree mask for the query tokens: (q_len)
+  CUTE_HOST_DEVICE const int64_t* get_tree_mask(int batch_idx) const {
+    if (params_.tree_mask_ptr == nullptr) {
+      return nullptr;
+    }
+    return params_.tree_mask_ptr + batch_idx * params_.q_len;
+  }
+
   // return the query/output tile: (q_len, head_dim)
   template <typename Element>
   CUTE_HOST_DEVICE auto get_qo_tile(int batch_idx, int kv_head_idx) const {
@@ -93,6 +142,14 @@ struct MHATile<MHAVarLenParams> {
 
   CUTE_HOST_DEVICE MHATile(const MHAVarLenParams& params) : params_(params) {}
 
+  // return the tree mask for the query tokens: (q_len)
+  CUTE_HOST_DEVICE const int64_t* get_tree_mask(int batch_idx) const {
+    if (params_.tree_mask_ptr == nullptr) {
+      return nullptr;
+    }
+    return params_.tree_mask_ptr + params_.q_cu_lens[batch_idx];
+  }
+
   // return the query tile: (q_len, head_dim)
   template <typename Element>
   CUTE_HOST_DEVICE auto get_qo_tile(int batch_idx, int kv_head_idx) const {
@@ -129,6 +186,18 @@ struct MHATile<MHAVarLenParams> {
     return make_tuple(q, o);
   }
 
+  // return the partial output/lse tiles of the kv split:
+  // (q_packed_len, head_dim) and (q_packed_len)
+  template <typename Element>
+  CUTE_HOST_DEVICE auto get_split_tile(int batch_idx,
+                                       int kv_head_idx,
+                                       int split_idx) const {
+    const auto begin = params_.q_cu_lens[batch_idx];
+    const auto qo_len = params_.q_cu_lens[batch_idx + 1] - begin;
+    return detail::make_split_tile<Element>(
+        params_, begin, qo_len, kv_head_idx, split_idx);
+  }
+
   // return the key/value tile: (kv_len, head_dim)
   template <typename Element>
   CUTE_HOST_DEVICE auto get_kv_tile(int batch_idx, int kv_head_idx) const {
@@ -162,6 +231,14 @@ struct MHATile<MHAPagedKVParams> {
 
   CUTE_HOST_DEVICE MHATile(const MHAPagedKVParams& params) : params_(params) {}
 
+  // return the tree mask for the query tokens: (q_len)
+  CUTE_HOST_DEVICE const int64_t* get_tree_mask(int batch_idx) const {
+    if (params_.tree_mask_ptr == nullptr) {
+      return nullptr;
+    }
+    return params_.tree_mask_ptr + params_.q_cu_lens[batch_idx];
+  }
+
   // return the query/output tile: (q_len, head_dim)
   template <typename Element>
   CUTE_HOST_DEVICE auto get_qo_tile(int batch_idx, int kv_head_idx) const {
@@ -197,42 +274,89 @@ struct MHATile<MHAPagedKVParams> {
     return make_tuple(q, o);
   }
 
+  // return the partial output/lse tiles of the kv split:
+  // (q_packed_len, head_dim) and (q_packed_len)
+  template <typename Element>
+  CUTE_HOST_DEVICE auto get_split_tile(int batch_idx,
+                                       int kv_head_idx,
+                                       int split_idx) const {
+    const auto begin = params_.q_cu_lens[batch_idx];
+    const auto qo_len = params_.q_cu_lens[batch_idx + 1] - begin;
+    return detail::make_split_tile<Element>(
+        params_, begin, qo_len, kv_head_idx, split_idx);
+  }
+
   // return the key/value tile: (kv_len, head_dim)
   template <typename Element>
   CUTE_HOST_DEVICE auto get_kv_tile(int batch_idx, int kv_head_idx) const {
     const auto kv_len =
         params_.kv_cu_lens[batch_idx + 1] - params_.kv_cu_lens[batch_idx];
 
-    // map seq_idx to slot_idx
-    const int* block_table =
-        params_.block_table + params_.block_cu_lens[batch_idx];
-    auto idx_to_slot = [block_table,
-                        right_shift = params_.block_shift_right,
-                        mask = params_.block_mask](int idx) {
-      // idx / block_size;
-      const int block_idx = idx >> right_shift;
-      // idx % block_size;
-      const int block_offset = idx & mask;
-      return block_table[block_idx] + block_offset;
-    };
-
-    // v[:, kv_head_idx, :]
+    // k[:, kv_head_idx, :]
     const auto k_offset = kv_head_idx * get<1>(params_.k_stride);
     auto k = make_gather_tensor(
         make_gmem_ptr((const Element*)params_.k_ptr + k_offset),
         make_shape(kv_len, params_.head_dim),
-        make_stride(get<0>(params_.k_stride), _1{}),
-        idx_to_slot);
+        make_stride(int64_t(1), _1{}),
+        make_idx_to_offset(
+            batch_idx, params_.k_block_stride, get<0>(params_.k_stride)));
 
     // v[:, kv_head_idx, :]
     const auto v_offset = kv_head_idx * get<1>(params_.v_stride);
     auto v = make_gather_tensor(
         make_gmem_ptr((const Element*)params_.v_ptr + v_offset),
         make_shape(kv_len, params_.head_dim),
-        make_stride(get<0>(params_.v_stride), _1{}),
-        idx_to_slot);
+        make_stride(int64_t(1), _1{}),
+        make_idx_to_offset(
+            batch_idx, params_.v_block_stride, get<0>(params_.v_stride)));
     return make_tuple(k, v);
   }
+
+  // return the scales of the quantized key/value tile: (kv_len)
+  CUTE_HOST_DEVICE auto get_kv_scale_tile(int batch_idx,
+                                          int kv_head_idx) const {
+    const auto kv_len =
+        params_.kv_cu_lens[batch_idx + 1] - params_.kv_cu_lens[batch_idx];
+
+    // scales: [n_slots, n_kv_heads]
+    const int64_t slot_stride = params_.n_kv_heads;
+    const int64_t block_stride = params_.block_size * slot_stride;
+    // k_scale[:, kv_head_idx]
+    auto k_scale = make_gather_tensor(
+        make_gmem_ptr(params_.k_scale_ptr + kv_head_idx),
+        make_shape(kv_len),
+        make_stride(int64_t(1)),
+        make_idx_to_offset(batch_idx, block_stride, slot_stride));
+    // v_scale[:, kv_head_idx]
+    auto v_scale = make_gather_tensor(
+        make_gmem_ptr(params_.v_scale_ptr + kv_head_idx),
+        make_shape(kv_len),
+        make_stride(int64_t(1)),
+        make_idx_to_offset(batch_idx, block_stride, slot_stride));
+    return make_tuple(k_scale, v_scale);
+  }
+
+ private:
+  // map seq_idx to the offset of the slot in the cache
+  CUTE_HOST_DEVICE auto make_idx_to_offset(int batch_idx,
+                                           int64_t block_stride,
+                                           int64_t slot_stride) const {
+    const int* block_table =
+        params_.block_table + params_.block_cu_lens[batch_idx];
+    return [block_table,
+            block_stride,
+            slot_stride,
+            right_shift = params_.block_shift_right,
+            mask = params_.block_mask](int idx) {
+      // idx / block_size;
+      const int block_idx = idx >> right_shift;
+      // idx % block_size;
+      const int block_offset = idx & mask;
+      // block_table holds the first slot id of each block
+      const int64_t block_id = block_table[block_idx] >> right_shift;
+      return block_id * block_stride + block_offset * slot_stride;
+    };
+  }
 };
 
 }  // namespace llm
\ No newline at end of file
@@ -0,0 +1,82 @@
+#include "mha_tile_table.h"
+
+#include <glog/logging.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "mha_params.h"
+
+namespace llm {
+
+std::string MHATileTable::make_key(const std::string& dtype,
+                                   int64_t head_dim,
+                                   int64_t group_size,
+                                   int64_t block_size,
+                                   bool decode) {
+  std::stringstream ss;
+  ss << dtype << "_hd" << head_dim << "_g" << group_size << "_bs"
+     << block_size << (decode ? "_decode" : "_prefill");
+  return ss.str();
+}
+
+MHATileTable& MHATileTable::get_instance() {
+  static MHATileTable table;
+  return table;
+}
+
+int MHATileTable::lookup(const std::string& key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = table_.find(key);
+  if (it == table_.end()) {
+    return -1;
+  }
+  return it->second;
+}
+
+void MHATileTable::insert(const std::string& key, int tile_config) {
+  CHECK(tile_config >= 0 && tile_config < kNumMHATileConfigs)
+      << "invalid tile config " << tile_config;
+  std::lock_guard<std::mutex> lock(mutex_);
+  table_[key] = tile_config;
+}
+
+bool MHATileTable::load(const std::string& path) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string line;
+  while (std::getline(file, line)) {
+    std::stringstream ss(line);
+    std::string key;
+    int tile_config = -1;
+    if (!(ss >> key >> tile_config) || tile_config < 0 ||
+        tile_config >= kNumMHATileConfigs) {
+      LOG(WARNING) << "Skipping invalid attention tile entry: " << line;
+      continue;
+    }
+    table_[key] = tile_config;
+  }
+  return true;
+}
+
+bool MHATileTable::save(const std::string& path) const {
+  std::ofstream file(path);
+  if (!file.is_open()) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& [key, tile_config] : table_) {
+    file << key << " " << tile_config << "\n";
+  }
+  return file.good();
+}
+
+size_t MHATileTable::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return table_.size();
+}
+
+}  // namespace llm
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace llm {
+
+// the tile config (index into kMHABlockNCandidates) of the attention kernel
+// for each problem shape, either tuned on the device or loaded from a cache
+// file. decode and prefill batches of the same shape are tuned separately.
+class MHATileTable {
+ public:
+  // key of an attention problem shape
+  static std::string make_key(const std::string& dtype,
+                              int64_t head_dim,
+                              int64_t group_size,
+                              int64_t block_size,
+                              bool decode);
+
+  // the process wide table shared by all attention layers
+  static MHATileTable& get_instance();
+
+  // returns the tile config of the shape, -1 if the shape is not found
+  int lookup(const std::string& key) const;
+
+  void insert(const std::string& key, int tile_config);
+
+  // load and save the table as text, one shape per line:
+  // "<key> <tile config>"
+  // lines without a valid tile config are skipped.
+  bool load(const std::string& path);
+  bool save(const std::string& path) const;
+
+  size_t size() const;
+
+ private:
+  mutable std::mutex mutex_;
+
+  std::unordered_map<std::string, int> table_;
+};
+
+}  // namespace llm
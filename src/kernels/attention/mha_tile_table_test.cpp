@@ -0,0 +1,43 @@
+#include "mha_tile_table.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+
+namespace llm {
+
+TEST(MHATileTableTest, SaveAndLoad) {
+  const auto path =
+      std::filesystem::temp_directory_path() / "mha_tile_table_test.txt";
+  const auto decode_key = MHATileTable::make_key(
+      "fp16", /*head_dim=*/128, /*group_size=*/4, /*block_size=*/16, true);
+  const auto prefill_key = MHATileTable::make_key(
+      "fp16", /*head_dim=*/128, /*group_size=*/4, /*block_size=*/16, false);
+  EXPECT_NE(decode_key, prefill_key);
+
+  MHATileTable table;
+  EXPECT_EQ(table.lookup(decode_key), -1);
+  table.insert(decode_key, 1);
+  table.insert(prefill_key, 2);
+  EXPECT_EQ(table.lookup(decode_key), 1);
+  ASSERT_TRUE(table.save(path.string()));
+
+  {
+    // append invalid entries
+    std::ofstream file(path, std::ios::app);
+    file << "bf16_hd64_g1_bs16_decode\n";
+    file << "bf16_hd64_g1_bs16_prefill 100\n";
+  }
+
+  MHATileTable loaded;
+  ASSERT_TRUE(loaded.load(path.string()));
+  EXPECT_EQ(loaded.size(), 2);
+  EXPECT_EQ(loaded.lookup(decode_key), 1);
+  EXPECT_EQ(loaded.lookup(prefill_key), 2);
+
+  std::filesystem::remove(path);
+  EXPECT_FALSE(loaded.load(path.string()));
+}
+
+}  // namespace llm
@@ -8,7 +8,7 @@ using namespace cute;
 namespace detail {
 
 // Convert fragment layout for different purposes
-// Only works for TiledMMA (64x16x16) with SM80_16x8x16_F32F16F16F32_TN
+// Only works for TiledMMA (BLK_Mx16x16) with SM80_16x8x16_F32F16F16F32_TN
 struct LayoutConvertor {
   // Convert fragment layout to rowcol layout for iterating
   // (MMA=4, MMA_M, MMA_N) => ((2, MMA_M), (2, MMA_N))
@@ -31,7 +31,14 @@ struct LayoutConvertor {
 
 }  // namespace detail
 
-template <typename DTYPE, int HEAD_DIM, int BLK_M, int BLK_N, int BLK_K>
+// KV_DTYPE is the element type of the kv cache, an 8-bit KV_DTYPE is
+// dequantized to DTYPE when the kv tiles are loaded into smem.
+template <typename DTYPE,
+          int HEAD_DIM,
+          int BLK_M,
+          int BLK_N,
+          int BLK_K,
+          typename KV_DTYPE = DTYPE>
 struct MHATraitsSM80 {
   // helpful aliases
   static constexpr int kHeadDim = HEAD_DIM;
@@ -41,23 +48,28 @@ struct MHATraitsSM80 {
   static constexpr int kRowsPerMMA = 2;
 
   using DType = DTYPE;
+  using KVType = KV_DTYPE;
   using _BLK_M = Int<kBlockM>;
   using _BLK_N = Int<kBlockN>;
   using _BLK_K = Int<kBlockK>;
   using _HEAD_DIM = Int<kHeadDim>;
 
   // ******* Mainloop *******
-  // TiledMMA (64x16x16) for gemm-I and gemm-II
+  // TiledMMA (BLK_Mx16x16) for gemm-I and gemm-II, one warp per 16 rows
+  static_assert(BLK_M == 16 || BLK_M == 32 || BLK_M == 64,
+                "BLK_M must be 16, 32 or 64");
+  static constexpr int kWarpsM = BLK_M / 16;
   // choose MMA_Atom based on Element type
   using MMA_Atom_ =
       std::conditional_t<std::is_same_v<DType, cute::half_t>,
                          MMA_Atom<SM80_16x8x16_F32F16F16F32_TN>,
                          MMA_Atom<SM80_16x8x16_F32BF16BF16F32_TN>>;
-  using TiledMma = TiledMMA<MMA_Atom_,
-                            Layout<Shape<_4, _1, _1>>,  // warp layout 4x1x1
-                            Tile<_64, _16, _16>>;       // Prom Shape 64x16x16
+  using TiledMma =
+      TiledMMA<MMA_Atom_,
+               Layout<Shape<Int<kWarpsM>, _1, _1>>,  // warp layout Mx1x1
+               Tile<_BLK_M, _16, _16>>;              // Prom Shape BLK_Mx16x16
 
-  // Layout convertor for TiledMMA (64x16x16)
+  // Layout convertor for TiledMMA (BLK_Mx16x16)
   using LayoutConvertor = detail::LayoutConvertor;
 
   // SMEM layout for QKV
@@ -82,17 +94,22 @@ struct MHATraitsSM80 {
       SmemLayoutV{},
       make_layout(Shape<_HEAD_DIM, _BLK_N>{}, GenRowMajor{})));
 
-  // Thr layout for gmem copy
+  // Thr layout for gmem copy: all threads of the block, i.e. 32 per 16 rows
+  // of BLK_M, each reads 8 vals along BLK_K
+  static_assert(BLK_K == 16 || BLK_K == 32 || BLK_K == 64,
+                "BLK_K must be 16, 32 or 64");
+  static_assert(HEAD_DIM % BLK_K == 0, "BLK_K must divide HEAD_DIM");
+  static constexpr int kThrsPerRow = BLK_K / 8;
+  static constexpr int kCopyThrs = kWarpsM * 32;
   using GmemCopyThrLayout =
-      std::conditional_t<BLK_K == 32,
-                         Layout<Shape<_32, _4>, Stride<_4, _1>>,
-                         Layout<Shape<_16, _8>, Stride<_8, _1>>>;
+      Layout<Shape<Int<kCopyThrs / kThrsPerRow>, Int<kThrsPerRow>>,
+             Stride<Int<kThrsPerRow>, _1>>;
 
   // Tiled copy for QKV
   // g2s tiled copy for q
   using GmemTiledCopyQ = decltype(make_tiled_copy(
       Copy_Atom<SM80_CP_ASYNC_CACHEGLOBAL_ZFILL<cute::uint128_t>, DType>{},
-      GmemCopyThrLayout{},     // Thr layout: (_16,_8)/(_32, _4)
+      GmemCopyThrLayout{},     // Thr layout: (_16,_8)/(_32,_4)/(_64,_2) @ 128
       Layout<Shape<_1, _8>>{}  // Val layout: 8 vals per read
       ));
 
@@ -123,7 +140,7 @@ struct MHATraitsSM80 {
   // s2g tiled copy for O
   using GmemTiledCopyO = decltype(make_tiled_copy(
       Copy_Atom<VectorizingCopy, DType>{},
-      GmemCopyThrLayout{},     // Thr layout: (_16,_8)/(_32, _4)
+      GmemCopyThrLayout{},     // Thr layout: (_16,_8)/(_32,_4)/(_64,_2)
       Layout<Shape<_1, _8>>{}  // Val layout: 8 vals per read
       ));
 
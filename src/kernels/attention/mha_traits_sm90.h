@@ -0,0 +1,170 @@
+#pragma once
+#include <cute/atom/mma_atom.hpp>
+#include <cute/config.hpp>
+#include <cute/tensor.hpp>
+
+namespace llm {
+using namespace cute;
+
+namespace detail {
+
+// Convert fragment layout for different purposes
+// Only works for warpgroup MMA (64xNx16) with 16-bit inputs
+struct LayoutConvertorSM90 {
+  // Convert fragment layout to rowcol layout for iterating
+  // (MMA=(2, 2, N/8), MMA_M, MMA_N) => ((2, MMA_M), (2, (N/8, MMA_N)))
+  template <typename LayoutC>
+  CUTE_HOST_DEVICE static constexpr auto to_rowcol(const LayoutC& layout) {
+    return make_layout(
+        make_layout(get<0, 1>(layout), get<1>(layout)),
+        make_layout(get<0, 0>(layout),
+                    make_layout(get<0, 2>(layout), get<2>(layout))));
+  }
+
+  // Convert fragment layout from gemm-I C to gemm-II A in registers
+  // (MMA_C=(2, 2, N/8), MMA_M, MMA_N) => (MMA_A=(2, 2, 2), MMA_M, N/16*MMA_N)
+  template <typename LayoutC>
+  CUTE_HOST_DEVICE static constexpr auto to_mma_a(const LayoutC& layout) {
+    auto l = logical_divide(get<0, 2>(layout), Tile<_2>{});
+    return make_layout(
+        make_layout(get<0, 0>(layout), get<0, 1>(layout), get<0, 0>(l)),
+        get<1>(layout),
+        coalesce(make_layout(get<0, 1>(l), get<2>(layout))));
+  }
+};
+
+}  // namespace detail
+
+// warp specialized attention for hopper: one producer warpgroup gathers
+// q/k/v into a multi-stage smem pipeline, and BLK_M / 64 consumer warpgroups
+// compute with warpgroup MMA.
+template <typename DTYPE, int HEAD_DIM, int BLK_M, int BLK_N, int STAGES>
+struct MHATraitsSM90 {
+  // helpful aliases
+  static constexpr int kHeadDim = HEAD_DIM;
+  static constexpr int kBlockM = BLK_M;
+  static constexpr int kBlockN = BLK_N;
+  static constexpr int kStages = STAGES;
+  static constexpr int kRowsPerMMA = 2;
+
+  static constexpr int kProducerThreads = 128;
+  static constexpr int kConsumerWarpGroups = BLK_M / 64;
+  static constexpr int kConsumerThreads = kConsumerWarpGroups * 128;
+  static_assert(BLK_M % 64 == 0, "BLK_M must be multiple of 64");
+
+  using DType = DTYPE;
+  using _BLK_M = Int<kBlockM>;
+  using _BLK_N = Int<kBlockN>;
+  using _HEAD_DIM = Int<kHeadDim>;
+  using _STAGES = Int<kStages>;
+
+  // ******* Mainloop *******
+  // consumer warpgroups are stacked along M
+  using AtomLayoutMNK = Layout<Shape<Int<kConsumerWarpGroups>, _1, _1>>;
+
+  // gemm-I: S = Q@K.T, Q and K are k-major in smem
+  using TiledMmaQK = decltype(make_tiled_mma(
+      GMMA::ss_op_selector<DType,
+                           DType,
+                           float,
+                           Shape<_64, _BLK_N, _HEAD_DIM>>(),
+      AtomLayoutMNK{}));
+
+  // gemm-II: O = P@V, P in registers and V is mn-major in smem
+  using TiledMmaPV = decltype(make_tiled_mma(
+      GMMA::rs_op_selector<DType,
+                           DType,
+                           float,
+                           Shape<_64, _HEAD_DIM, _BLK_N>,
+                           GMMA::Major::K,
+                           GMMA::Major::MN>(),
+      AtomLayoutMNK{}));
+
+  // Layout convertor for warpgroup MMA
+  using LayoutConvertor = detail::LayoutConvertorSM90;
+
+  // SMEM layout for QKV
+  // Q smem: (BLK_M, HEAD_DIM)
+  using SmemLayoutAtomQ = decltype(GMMA::ss_smem_selector<GMMA::Major::K,
+                                                          DType,
+                                                          _BLK_M,
+                                                          _HEAD_DIM>());
+  using SmemLayoutQ =
+      decltype(tile_to_shape(SmemLayoutAtomQ{}, Shape<_BLK_M, _HEAD_DIM>{}));
+
+  // KV smem: (BLK_N, HEAD_DIM, STAGES)
+  using SmemLayoutAtomKV = decltype(GMMA::ss_smem_selector<GMMA::Major::K,
+                                                           DType,
+                                                           _BLK_N,
+                                                           _HEAD_DIM>());
+  using SmemLayoutK = decltype(tile_to_shape(
+      SmemLayoutAtomKV{}, Shape<_BLK_N, _HEAD_DIM, _STAGES>{}));
+  using SmemLayoutV = SmemLayoutK;
+
+  // V^T smem: (HEAD_DIM, BLK_N, STAGES), mn-major view of V
+  using SmemLayoutVt = decltype(composition(
+      SmemLayoutV{},
+      make_ordered_layout(Shape<_HEAD_DIM, _BLK_N, _STAGES>{},
+                          Step<_2, _1, _3>{})));
+
+  // Thr layout for gmem copy
+  using GmemCopyThrLayout =
+      std::conditional_t<HEAD_DIM % 64 == 0,
+                         Layout<Shape<_16, _8>, Stride<_8, _1>>,
+                         Layout<Shape<_32, _4>, Stride<_4, _1>>>;
+
+  // g2s tiled copy for qkv, done by the producer warpgroup. paged kv and
+  // packed queries are gathered by rows, so cp.async is used instead of tma.
+  using GmemTiledCopyQKV = decltype(make_tiled_copy(
+      Copy_Atom<SM80_CP_ASYNC_CACHEGLOBAL_ZFILL<cute::uint128_t>, DType>{},
+      GmemCopyThrLayout{},     // Thr layout: (_16,_8)/(_32, _4)
+      Layout<Shape<_1, _8>>{}  // Val layout: 8 vals per read
+      ));
+
+  // ******* Epilogue *******
+
+  // O smem: (BLK_M, HEAD_DIM), same as Q
+  using SmemLayoutO = SmemLayoutQ;
+
+  // use 128-bit vectorizing copy
+  using VectorizingCopy = AutoVectorizingCopyWithAssumedAlignment<128>;
+
+  // s2g tiled copy for O, done by the consumer warpgroups
+  using GmemCopyThrLayoutO =
+      std::conditional_t<HEAD_DIM % 64 == 0,
+                         Layout<Shape<Int<kConsumerThreads / 8>, _8>,
+                                Stride<_8, _1>>,
+                         Layout<Shape<Int<kConsumerThreads / 4>, _4>,
+                                Stride<_4, _1>>>;
+  using GmemTiledCopyO = decltype(make_tiled_copy(
+      Copy_Atom<VectorizingCopy, DType>{},
+      GmemCopyThrLayoutO{},
+      Layout<Shape<_1, _8>>{}  // Val layout: 8 vals per write
+      ));
+
+  // r2s tiled copy for O
+  using SmemTiledCopyO =
+      decltype(make_tiled_copy_C(Copy_Atom<DefaultCopy, DType>{},
+                                 TiledMmaPV{}));
+
+  struct SharedStorage {
+    cute::array_aligned<DType, cosize_v<SmemLayoutQ>, 128> smem_q;
+    cute::array_aligned<DType, cosize_v<SmemLayoutK>, 128> smem_k;
+    cute::array_aligned<DType, cosize_v<SmemLayoutV>, 128> smem_v;
+
+    // pipeline barriers, full: loaded by producer, empty: released by
+    // consumers
+    uint64_t q_full;
+    uint64_t k_full[kStages];
+    uint64_t k_empty[kStages];
+    uint64_t v_full[kStages];
+    uint64_t v_empty[kStages];
+  };
+
+  // constexpr values for kernel launch
+  static constexpr size_t kSmemSize = sizeof(SharedStorage);
+
+  static constexpr size_t kThreadNum = kProducerThreads + kConsumerThreads;
+};
+
+}  // namespace llm
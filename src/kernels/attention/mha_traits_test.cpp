@@ -53,6 +53,22 @@ TEST(MHATraitsTest, TraitsSM80) {
                                 /*BLK_M=*/64,
                                 /*BLK_N=*/64,
                                 /*BLK_K=*/64>>();
+  test_mha_traits<MHATraitsSM80<cute::half_t,
+                                /*HEAD_DIM=*/80,
+                                /*BLK_M=*/64,
+                                /*BLK_N=*/64,
+                                /*BLK_K=*/16>>();
+  // small query tiles for speculative verification
+  test_mha_traits<MHATraitsSM80<cute::half_t,
+                                /*HEAD_DIM=*/128,
+                                /*BLK_M=*/16,
+                                /*BLK_N=*/64,
+                                /*BLK_K=*/64>>();
+  test_mha_traits<MHATraitsSM80<cute::half_t,
+                                /*HEAD_DIM=*/80,
+                                /*BLK_M=*/32,
+                                /*BLK_N=*/64,
+                                /*BLK_K=*/16>>();
 }
 
 }  // namespace llm
\ No newline at end of file
@@ -105,6 +105,27 @@ struct OnlineSoftmax {
       }
     }
   }
+
+  // finalizes the softmax computation with O = O / row_sum and returns the
+  // log2 of the sum of exp scores for each row, used to merge partial outputs
+  // across kv splits. rows without visible kv get O = 0 and lse = -inf.
+  template <typename FragmentO, typename FragmentLSE>
+  CUTE_DEVICE void finalize(FragmentO& rAccO, FragmentLSE& rLse) {
+    CUTE_UNROLL
+    for (int oi = 0; oi < size<0>(rAccO); ++oi) {
+      // rowsum across 4 threads
+      row_sum_(oi) = detail::group_reduce_sum<4>(row_sum_(oi));
+
+      const bool empty = row_sum_(oi) == 0.0f;
+      const float scale = empty ? 0.0f : ptx::rcp(row_sum_(oi));
+      CUTE_UNROLL
+      for (int oj = 0; oj < size<1>(rAccO); ++oj) {
+        rAccO(oi, oj) *= scale;
+      }
+      rLse(oi) = empty ? -INFINITY
+                       : row_max_(oi) * sm_scale_ + ptx::log2(row_sum_(oi));
+    }
+  }
 };
 
 }  // namespace llm
\ No newline at end of file
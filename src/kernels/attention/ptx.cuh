@@ -12,6 +12,13 @@ CUTE_DEVICE float exp2(float x) {
   return y;
 }
 
+// wrapper of PTX lg2.approx instruction, which computes log2(x)
+CUTE_DEVICE float log2(float x) {
+  float y;
+  asm volatile("lg2.approx.ftz.f32 %0, %1;" : "=f"(y) : "f"(x));
+  return y;
+}
+
 // wrapper of PTX rcp.approx instruction, which computes 1/x
 CUTE_DEVICE float rcp(float x) {
   float y;
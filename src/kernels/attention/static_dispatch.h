@@ -45,4 +45,38 @@ namespace llm {
     }                                                     \
   }()
 
+// exact head dims for the sm80 kernels, others are padded to the next one.
+// non power of two head dims, e.g. 80 for phi-2, would waste smem, registers
+// and mma work on the padding otherwise.
+#define DISPATCH_HEAD_DIM_SM80(HEAD_DIM_V, HEAD_DIM_NAME, ...) \
+  [&] {                                                        \
+    if (HEAD_DIM_V <= 64) {                                    \
+      constexpr static int HEAD_DIM_NAME = 64;                 \
+      return __VA_ARGS__();                                    \
+    } else if (HEAD_DIM_V <= 80) {                             \
+      constexpr static int HEAD_DIM_NAME = 80;                 \
+      return __VA_ARGS__();                                    \
+    } else if (HEAD_DIM_V <= 96) {                             \
+      constexpr static int HEAD_DIM_NAME = 96;                 \
+      return __VA_ARGS__();                                    \
+    } else if (HEAD_DIM_V <= 112) {                            \
+      constexpr static int HEAD_DIM_NAME = 112;                \
+      return __VA_ARGS__();                                    \
+    } else if (HEAD_DIM_V <= 128) {                            \
+      constexpr static int HEAD_DIM_NAME = 128;                \
+      return __VA_ARGS__();                                    \
+    } else if (HEAD_DIM_V <= 160) {                            \
+      constexpr static int HEAD_DIM_NAME = 160;                \
+      return __VA_ARGS__();                                    \
+    } else if (HEAD_DIM_V <= 192) {                            \
+      constexpr static int HEAD_DIM_NAME = 192;                \
+      return __VA_ARGS__();                                    \
+    } else if (HEAD_DIM_V <= 256) {                            \
+      constexpr static int HEAD_DIM_NAME = 256;                \
+      return __VA_ARGS__();                                    \
+    } else {                                                   \
+      assert(false);                                           \
+    }                                                          \
+  }()
+
 }  // namespace llm
\ No newline at end of file
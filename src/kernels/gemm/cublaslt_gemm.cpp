@@ -0,0 +1,452 @@
+#include <ATen/cuda/CUDAContext.h>
+#include <ATen/cuda/CUDAEvent.h>
+#include <c10/cuda/CUDAGraphsC10Utils.h>
+#include <cublasLt.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "gemm_api.h"
+
+namespace llm {
+namespace {
+// size of the persistent workspace of each stream
+constexpr size_t kWorkspaceBytes = 32 * 1024 * 1024;
+// number of the candidate algorithms asked from the heuristic
+constexpr int kMaxAlgos = 8;
+// the candidates of gemms with up to this many rows are timed, the heuristic
+// is poor at the small m of decode, where split-k choices pay off.
+constexpr int64_t kMaxTunedM = 32;
+constexpr int kTuneIters = 5;
+// the split-k variants of the heuristic algorithms are tried for gemms with
+// up to this many rows. a few rows of a narrow (tensor parallel) n only fill
+// a handful of ctas, splitting k spreads the work over more of the sms.
+constexpr int64_t kMaxSplitKM = 16;
+// number of the heuristic algorithms to derive the split-k variants from
+constexpr int kMaxSplitKAlgos = 2;
+// the split-k factors to try, each split covering at least kMinSplitKSize
+constexpr int32_t kSplitKFactors[] = {2, 4, 8, 16};
+constexpr int64_t kMinSplitKSize = 256;
+static_assert(kMaxSplitKM <= kMaxTunedM, "split-k variants must be timed");
+// the alignment of the operands, in bytes
+constexpr int64_t kAlignBytes = 16;
+
+#define CHECK_CUBLASLT(expr)                                          \
+  do {                                                                \
+    const cublasStatus_t status = (expr);                             \
+    CHECK_EQ(status, CUBLAS_STATUS_SUCCESS)                           \
+        << #expr << " failed: " << cublasGetStatusString(status);     \
+  } while (0)
+
+// the gemm shape and the epilogue an algorithm is chosen for
+struct GemmKey {
+  int device = 0;
+  int64_t m = 0;
+  int64_t n = 0;
+  int64_t k = 0;
+  int64_t a_stride = 0;
+  torch::ScalarType dtype = torch::kHalf;
+  EpilogueAct act = EpilogueAct::kNone;
+  bool bias = false;
+
+  bool operator==(const GemmKey& other) const {
+    return device == other.device && m == other.m && n == other.n &&
+           k == other.k && a_stride == other.a_stride &&
+           dtype == other.dtype && act == other.act && bias == other.bias;
+  }
+};
+
+struct GemmKeyHash {
+  size_t operator()(const GemmKey& key) const {
+    size_t seed = 0;
+    auto combine = [&seed](size_t value) {
+      seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    };
+    combine(std::hash<int>()(key.device));
+    combine(std::hash<int64_t>()(key.m));
+    combine(std::hash<int64_t>()(key.n));
+    combine(std::hash<int64_t>()(key.k));
+    combine(std::hash<int64_t>()(key.a_stride));
+    combine(std::hash<int>()(static_cast<int>(key.dtype)));
+    combine(std::hash<int>()(static_cast<int>(key.act)));
+    combine(std::hash<bool>()(key.bias));
+    return seed;
+  }
+};
+
+// the chosen algorithms and the workspaces, shared by all gemms
+class CublasLtState {
+ public:
+  static CublasLtState& get() {
+    static CublasLtState state;
+    return state;
+  }
+
+  std::optional<cublasLtMatmulAlgo_t> find_algo(const GemmKey& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = algos_.find(key);
+    if (it == algos_.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  void set_algo(const GemmKey& key, const cublasLtMatmulAlgo_t& algo) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    algos_[key] = algo;
+  }
+
+  // the persistent workspace of the stream
+  void* workspace(const c10::cuda::CUDAStream& stream) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& workspace = workspaces_[stream.id()];
+    if (!workspace.defined()) {
+      const auto options = torch::dtype(torch::kUInt8)
+                               .device(torch::kCUDA, stream.device_index());
+      workspace =
+          torch::empty({static_cast<int64_t>(kWorkspaceBytes)}, options);
+    }
+    return workspace.data_ptr();
+  }
+
+ private:
+  std::mutex mutex_;
+
+  std::unordered_map<GemmKey, cublasLtMatmulAlgo_t, GemmKeyHash> algos_;
+
+  std::unordered_map<c10::StreamId, torch::Tensor> workspaces_;
+};
+
+// owners of the cublaslt descriptors
+struct MatmulDescDeleter {
+  void operator()(cublasLtMatmulDescOpaque_t* desc) const {
+    cublasLtMatmulDescDestroy(desc);
+  }
+};
+struct LayoutDeleter {
+  void operator()(cublasLtMatrixLayoutOpaque_t* layout) const {
+    cublasLtMatrixLayoutDestroy(layout);
+  }
+};
+struct PreferenceDeleter {
+  void operator()(cublasLtMatmulPreferenceOpaque_t* pref) const {
+    cublasLtMatmulPreferenceDestroy(pref);
+  }
+};
+using MatmulDesc =
+    std::unique_ptr<cublasLtMatmulDescOpaque_t, MatmulDescDeleter>;
+using Layout = std::unique_ptr<cublasLtMatrixLayoutOpaque_t, LayoutDeleter>;
+using Preference =
+    std::unique_ptr<cublasLtMatmulPreferenceOpaque_t, PreferenceDeleter>;
+
+Layout create_layout(cudaDataType_t type,
+                     uint64_t rows,
+                     uint64_t cols,
+                     int64_t ld) {
+  cublasLtMatrixLayout_t layout = nullptr;
+  CHECK_CUBLASLT(cublasLtMatrixLayoutCreate(&layout, type, rows, cols, ld));
+  return Layout(layout);
+}
+
+cublasLtEpilogue_t to_epilogue(EpilogueAct act, bool bias) {
+  switch (act) {
+    case EpilogueAct::kNone:
+      return bias ? CUBLASLT_EPILOGUE_BIAS : CUBLASLT_EPILOGUE_DEFAULT;
+    case EpilogueAct::kGeluTanh:
+      return bias ? CUBLASLT_EPILOGUE_GELU_BIAS : CUBLASLT_EPILOGUE_GELU;
+    case EpilogueAct::kRelu:
+      return bias ? CUBLASLT_EPILOGUE_RELU_BIAS : CUBLASLT_EPILOGUE_RELU;
+  }
+  return CUBLASLT_EPILOGUE_DEFAULT;
+}
+
+// the variants of algo splitting k into partial sums reduced in fp32 within
+// the workspace, only the ones valid for the gemm.
+std::vector<cublasLtMatmulAlgo_t> split_k_variants(
+    cublasLtHandle_t handle,
+    cublasLtMatmulDesc_t op_desc,
+    cublasLtMatrixLayout_t w_layout,
+    cublasLtMatrixLayout_t a_layout,
+    cublasLtMatrixLayout_t out_layout,
+    const cublasLtMatmulAlgo_t& algo,
+    int64_t k) {
+  std::vector<cublasLtMatmulAlgo_t> variants;
+  int32_t split_k_support = 0;
+  size_t size = 0;
+  if (cublasLtMatmulAlgoCapGetAttribute(&algo,
+                                        CUBLASLT_ALGO_CAP_SPLITK_SUPPORT,
+                                        &split_k_support,
+                                        sizeof(split_k_support),
+                                        &size) != CUBLAS_STATUS_SUCCESS ||
+      split_k_support == 0) {
+    return variants;
+  }
+  int32_t split_k = 1;
+  cublasLtMatmulAlgoConfigGetAttribute(&algo,
+                                       CUBLASLT_ALGO_CONFIG_SPLITK_NUM,
+                                       &split_k,
+                                       sizeof(split_k),
+                                       &size);
+  // already split by the heuristic
+  if (split_k > 1) {
+    return variants;
+  }
+
+  const uint32_t reduction = CUBLASLT_REDUCTION_SCHEME_COMPUTE_TYPE;
+  for (const int32_t factor : kSplitKFactors) {
+    if (k / factor < kMinSplitKSize) {
+      break;
+    }
+    cublasLtMatmulAlgo_t variant = algo;
+    if (cublasLtMatmulAlgoConfigSetAttribute(&variant,
+                                             CUBLASLT_ALGO_CONFIG_SPLITK_NUM,
+                                             &factor,
+                                             sizeof(factor)) !=
+            CUBLAS_STATUS_SUCCESS ||
+        cublasLtMatmulAlgoConfigSetAttribute(
+            &variant,
+            CUBLASLT_ALGO_CONFIG_REDUCTION_SCHEME,
+            &reduction,
+            sizeof(reduction)) != CUBLAS_STATUS_SUCCESS) {
+      continue;
+    }
+    cublasLtMatmulHeuristicResult_t check;
+    if (cublasLtMatmulAlgoCheck(handle,
+                                op_desc,
+                                w_layout,
+                                a_layout,
+                                out_layout,
+                                out_layout,
+                                &variant,
+                                &check) == CUBLAS_STATUS_SUCCESS &&
+        check.workspaceSize <= kWorkspaceBytes) {
+      variants.push_back(variant);
+    }
+  }
+  return variants;
+}
+
+bool is_aligned(const torch::Tensor& t) {
+  return reinterpret_cast<uintptr_t>(t.data_ptr()) % kAlignBytes == 0;
+}
+}  // namespace
+
+bool can_use_cublaslt_gemm(const torch::Tensor& input,
+                           const torch::Tensor& weight) {
+  if (!input.is_cuda() || weight.dim() != 2 ||
+      input.scalar_type() != weight.scalar_type()) {
+    return false;
+  }
+  const auto dtype = input.scalar_type();
+  if (dtype != torch::kHalf && dtype != torch::kBFloat16) {
+    return false;
+  }
+  // 16 bytes aligned rows for the vectorized kernels
+  const int64_t align = kAlignBytes / input.element_size();
+  const auto k = weight.size(1);
+  const auto n = weight.size(0);
+  return input.size(-1) == k && k % align == 0 && n % align == 0 &&
+         weight.is_contiguous() && is_aligned(weight);
+}
+
+torch::Tensor cublaslt_gemm(const torch::Tensor& input,
+                            const torch::Tensor& weight,
+                            const std::optional<torch::Tensor>& bias,
+                            EpilogueAct act) {
+  CHECK(can_use_cublaslt_gemm(input, weight))
+      << "cublaslt gemm not supported for input " << input.sizes()
+      << " and weight " << weight.sizes();
+  const auto k = weight.size(1);
+  const auto n = weight.size(0);
+  const int64_t align = kAlignBytes / input.element_size();
+
+  // [m, k] with contiguous and aligned k
+  auto a = input.reshape({-1, k});
+  if (a.stride(-1) != 1 || a.stride(0) % align != 0 || !is_aligned(a)) {
+    a = a.contiguous();
+  }
+  const bool has_bias = bias.has_value() && bias->defined();
+  if (has_bias) {
+    CHECK(bias->is_contiguous() && bias->numel() == n &&
+          bias->scalar_type() == input.scalar_type())
+        << "bias should be contiguous [out_features] of the input dtype";
+  }
+  auto out_sizes = input.sizes().vec();
+  out_sizes.back() = n;
+  auto out = torch::empty(out_sizes, input.options());
+  const int64_t m = a.size(0);
+  if (m == 0) {
+    return out;
+  }
+
+  // row major out[m, n] = a[m, k] @ weight[n, k].T is the column major
+  // out.T[n, m] = weight.T.T[n, k] @ a.T[k, m]
+  const cudaDataType_t type =
+      input.scalar_type() == torch::kHalf ? CUDA_R_16F : CUDA_R_16BF;
+  cublasLtMatmulDesc_t op_desc_ptr = nullptr;
+  CHECK_CUBLASLT(
+      cublasLtMatmulDescCreate(&op_desc_ptr, CUBLAS_COMPUTE_32F, CUDA_R_32F));
+  MatmulDesc op_desc(op_desc_ptr);
+  const cublasOperation_t trans_a = CUBLAS_OP_T;
+  const cublasOperation_t trans_b = CUBLAS_OP_N;
+  CHECK_CUBLASLT(cublasLtMatmulDescSetAttribute(op_desc.get(),
+                                                CUBLASLT_MATMUL_DESC_TRANSA,
+                                                &trans_a,
+                                                sizeof(trans_a)));
+  CHECK_CUBLASLT(cublasLtMatmulDescSetAttribute(op_desc.get(),
+                                                CUBLASLT_MATMUL_DESC_TRANSB,
+                                                &trans_b,
+                                                sizeof(trans_b)));
+  const cublasLtEpilogue_t epilogue = to_epilogue(act, has_bias);
+  CHECK_CUBLASLT(cublasLtMatmulDescSetAttribute(op_desc.get(),
+                                                CUBLASLT_MATMUL_DESC_EPILOGUE,
+                                                &epilogue,
+                                                sizeof(epilogue)));
+  if (has_bias) {
+    const void* bias_ptr = bias->const_data_ptr();
+    CHECK_CUBLASLT(
+        cublasLtMatmulDescSetAttribute(op_desc.get(),
+                                       CUBLASLT_MATMUL_DESC_BIAS_POINTER,
+                                       &bias_ptr,
+                                       sizeof(bias_ptr)));
+  }
+  const Layout w_layout = create_layout(type, k, n, k);
+  const Layout a_layout = create_layout(type, k, m, a.stride(0));
+  const Layout out_layout = create_layout(type, n, m, n);
+
+  auto stream = at::cuda::getCurrentCUDAStream();
+  cublasLtHandle_t handle = at::cuda::getCurrentCUDABlasLtHandle();
+  auto& state = CublasLtState::get();
+  void* workspace = state.workspace(stream);
+  const float alpha = 1.0f;
+  const float beta = 0.0f;
+  auto run = [&](const cublasLtMatmulAlgo_t& algo) {
+    return cublasLtMatmul(handle,
+                          op_desc.get(),
+                          &alpha,
+                          weight.const_data_ptr(),
+                          w_layout.get(),
+                          a.const_data_ptr(),
+                          a_layout.get(),
+                          &beta,
+                          out.mutable_data_ptr(),
+                          out_layout.get(),
+                          out.mutable_data_ptr(),
+                          out_layout.get(),
+                          &algo,
+                          workspace,
+                          kWorkspaceBytes,
+                          stream);
+  };
+
+  const GemmKey key{input.get_device(),
+                    m,
+                    n,
+                    k,
+                    a.stride(0),
+                    input.scalar_type(),
+                    act,
+                    has_bias};
+  if (auto algo = state.find_algo(key)) {
+    CHECK_CUBLASLT(run(algo.value()));
+    return out;
+  }
+
+  // ask the heuristic for the candidates
+  cublasLtMatmulPreference_t pref_ptr = nullptr;
+  CHECK_CUBLASLT(cublasLtMatmulPreferenceCreate(&pref_ptr));
+  Preference pref(pref_ptr);
+  const uint64_t workspace_bytes = kWorkspaceBytes;
+  CHECK_CUBLASLT(cublasLtMatmulPreferenceSetAttribute(
+      pref.get(),
+      CUBLASLT_MATMUL_PREF_MAX_WORKSPACE_BYTES,
+      &workspace_bytes,
+      sizeof(workspace_bytes)));
+  // only the algorithms working with the alignment of the operands
+  const uint32_t align_bytes = kAlignBytes;
+  for (const auto attr : {CUBLASLT_MATMUL_PREF_MIN_ALIGNMENT_A_BYTES,
+                          CUBLASLT_MATMUL_PREF_MIN_ALIGNMENT_B_BYTES,
+                          CUBLASLT_MATMUL_PREF_MIN_ALIGNMENT_C_BYTES,
+                          CUBLASLT_MATMUL_PREF_MIN_ALIGNMENT_D_BYTES}) {
+    CHECK_CUBLASLT(cublasLtMatmulPreferenceSetAttribute(
+        pref.get(), attr, &align_bytes, sizeof(align_bytes)));
+  }
+  std::vector<cublasLtMatmulHeuristicResult_t> results(kMaxAlgos);
+  int n_results = 0;
+  CHECK_CUBLASLT(cublasLtMatmulAlgoGetHeuristic(handle,
+                                                op_desc.get(),
+                                                w_layout.get(),
+                                                a_layout.get(),
+                                                out_layout.get(),
+                                                out_layout.get(),
+                                                pref.get(),
+                                                kMaxAlgos,
+                                                results.data(),
+                                                &n_results));
+  CHECK_GT(n_results, 0) << "no cublaslt algorithm for m=" << m
+                         << ", n=" << n << ", k=" << k;
+
+  // the candidates can't be timed while a cuda graph is captured, use the
+  // first one of the heuristic without caching it.
+  if (c10::cuda::currentStreamCaptureStatusMayInitCtx() !=
+      c10::cuda::CaptureStatus::None) {
+    CHECK_CUBLASLT(run(results[0].algo));
+    return out;
+  }
+
+  std::vector<cublasLtMatmulAlgo_t> algos;
+  algos.reserve(n_results);
+  for (int i = 0; i < n_results; ++i) {
+    algos.push_back(results[i].algo);
+  }
+  if (m <= kMaxSplitKM) {
+    for (int i = 0; i < std::min(n_results, kMaxSplitKAlgos); ++i) {
+      const auto variants = split_k_variants(handle,
+                                             op_desc.get(),
+                                             w_layout.get(),
+                                             a_layout.get(),
+                                             out_layout.get(),
+                                             results[i].algo,
+                                             k);
+      algos.insert(algos.end(), variants.begin(), variants.end());
+    }
+  }
+
+  size_t best = 0;
+  if (m <= kMaxTunedM && algos.size() > 1) {
+    float best_ms = std::numeric_limits<float>::max();
+    for (size_t i = 0; i < algos.size(); ++i) {
+      // warm up, and skip the algorithms that fail to run
+      if (run(algos[i]) != CUBLAS_STATUS_SUCCESS) {
+        continue;
+      }
+      at::cuda::CUDAEvent start(cudaEventDefault);
+      at::cuda::CUDAEvent end(cudaEventDefault);
+      start.record(stream);
+      for (int iter = 0; iter < kTuneIters; ++iter) {
+        run(algos[i]);
+      }
+      end.record(stream);
+      end.synchronize();
+      const float ms = start.elapsed_time(end);
+      if (ms < best_ms) {
+        best_ms = ms;
+        best = i;
+      }
+    }
+  }
+  state.set_algo(key, algos[best]);
+  CHECK_CUBLASLT(run(algos[best]));
+  return out;
+}
+
+}  // namespace llm
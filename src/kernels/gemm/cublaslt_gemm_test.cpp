@@ -0,0 +1,100 @@
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <optional>
+
+#include "gemm_api.h"
+
+namespace llm {
+namespace {
+// act(input @ weight.T + bias) in float
+torch::Tensor cublaslt_gemm_ref(const torch::Tensor& input,
+                                const torch::Tensor& weight,
+                                const std::optional<torch::Tensor>& bias,
+                                EpilogueAct act) {
+  auto out =
+      torch::matmul(input.to(torch::kFloat), weight.to(torch::kFloat).t());
+  if (bias.has_value()) {
+    out = out + bias->to(torch::kFloat);
+  }
+  switch (act) {
+    case EpilogueAct::kNone:
+      return out;
+    case EpilogueAct::kGeluTanh:
+      return torch::gelu(out, /*approximate=*/"tanh");
+    case EpilogueAct::kRelu:
+      return torch::relu(out);
+  }
+  return out;
+}
+}  // namespace
+
+class CublasLtGemmTest
+    : public ::testing::TestWithParam<std::tuple<torch::ScalarType /*dtype*/,
+                                                 int64_t /*n_tokens*/,
+                                                 int64_t /*in_features*/,
+                                                 int64_t /*out_features*/,
+                                                 bool /*bias*/,
+                                                 EpilogueAct /*act*/>> {
+ public:
+  void SetUp() override {
+    // skip test if cuda is not available
+    if (!torch::cuda::is_available()) {
+      GTEST_SKIP() << "CUDA is not available";
+    }
+  }
+};
+
+TEST_P(CublasLtGemmTest, Result) {
+  const auto [dtype, n_tokens, in_features, out_features, has_bias, act] =
+      GetParam();
+  const auto options = torch::dtype(dtype).device(torch::kCUDA);
+
+  const auto input = torch::randn({n_tokens, in_features}, options);
+  const auto weight = torch::randn({out_features, in_features}, options);
+  std::optional<torch::Tensor> bias;
+  if (has_bias) {
+    bias = torch::randn({out_features}, options);
+  }
+  ASSERT_TRUE(can_use_cublaslt_gemm(input, weight));
+
+  const auto ref_out = cublaslt_gemm_ref(input, weight, bias, act);
+  // the second call runs the cached algorithm
+  for (int i = 0; i < 2; ++i) {
+    const auto out = cublaslt_gemm(input, weight, bias, act);
+    ASSERT_EQ(out.sizes(), torch::IntArrayRef({n_tokens, out_features}));
+    ASSERT_EQ(out.scalar_type(), dtype);
+    EXPECT_TRUE(torch::allclose(
+        out.to(torch::kFloat), ref_out, /*rtol=*/1e-2, /*atol=*/1e-1));
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    CublasLtGemm,
+    CublasLtGemmTest,
+    ::testing::Combine(::testing::Values(torch::kHalf, torch::kBFloat16),
+                       ::testing::Values(1, 7, 32, 300),  // n_tokens
+                       ::testing::Values(64, 2304),       // in_features
+                       ::testing::Values(64, 1000),       // out_features
+                       ::testing::Values(false, true),    // bias
+                       ::testing::Values(EpilogueAct::kNone,
+                                         EpilogueAct::kGeluTanh,
+                                         EpilogueAct::kRelu)));
+
+TEST(CublasLtGemmTest, Unsupported) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA is not available";
+  }
+  const auto options = torch::dtype(torch::kHalf).device(torch::kCUDA);
+  // in_features not aligned to 8
+  const auto input = torch::randn({4, 100}, options);
+  EXPECT_FALSE(can_use_cublaslt_gemm(input, torch::randn({128, 100}, options)));
+  // float32 is not supported
+  const auto aligned = torch::randn({4, 64}, options);
+  const auto weight = torch::randn({128, 64}, options);
+  EXPECT_FALSE(can_use_cublaslt_gemm(aligned.to(torch::kFloat),
+                                     weight.to(torch::kFloat)));
+}
+
+}  // namespace llm
@@ -0,0 +1,339 @@
+#pragma once
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+#include <cute/layout.hpp>
+#include <cute/tensor.hpp>
+
+#include "../attention/cute_extensions.cuh"
+#include "../attention/fast_cast.cuh"
+#include "cute/config.hpp"
+#include "gemm_params.h"
+
+namespace llm {
+using namespace cute;
+
+template <GatedAct ACT>
+CUTE_DEVICE float gated_act(float x) {
+  if constexpr (ACT == GatedAct::kSilu) {
+    return x / (1.0f + __expf(-x));
+  } else if constexpr (ACT == GatedAct::kGelu) {
+    return 0.5f * x * (1.0f + erff(x * 0.7071067811865475f));
+  } else if constexpr (ACT == GatedAct::kGeluTanh) {
+    const float inner = 0.7978845608028654f * (x + 0.044715f * x * x * x);
+    return 0.5f * x * (1.0f + tanhf(inner));
+  } else {
+    return x > 0.0f ? x : 0.0f;
+  }
+}
+
+template <typename DTYPE, int BLK_M, int BLK_N, int BLK_K, int STAGES>
+struct GatedGemmTraitsSM80 {
+  // helpful aliases
+  static constexpr int kBlockM = BLK_M;
+  static constexpr int kBlockN = BLK_N;
+  static constexpr int kBlockK = BLK_K;
+  static constexpr int kStages = STAGES;
+  // each tile of BLK_N columns has BLK_N / 2 gate and up columns
+  static constexpr int kBlockI = BLK_N / 2;
+
+  using DType = DTYPE;
+  using _BLK_M = Int<kBlockM>;
+  using _BLK_N = Int<kBlockN>;
+  using _BLK_K = Int<kBlockK>;
+  using _BLK_I = Int<kBlockI>;
+  using _STAGES = Int<kStages>;
+
+  // ******* Mainloop *******
+  // TiledMMA (32x32x16) with 2x2 warps
+  using MMA_Atom_ =
+      std::conditional_t<std::is_same_v<DType, cute::half_t>,
+                         MMA_Atom<SM80_16x8x16_F32F16F16F32_TN>,
+                         MMA_Atom<SM80_16x8x16_F32BF16BF16F32_TN>>;
+  using TiledMma = TiledMMA<MMA_Atom_,
+                            Layout<Shape<_2, _2, _1>>,  // warp layout 2x2x1
+                            Tile<_32, _32, _16>>;       // Prom Shape 32x32x16
+
+  // Atom layout: (8, BLK_K):(BLK_K, 1) k-major
+  using SmemLayoutAtom =
+      decltype(composition(Swizzle<3, 3, 3>{},
+                           Layout<Shape<_8, _BLK_K>, Stride<_BLK_K, _1>>{}));
+
+  // A smem: (BLK_M, BLK_K, STAGES)
+  using SmemLayoutA = decltype(tile_to_shape(SmemLayoutAtom{},
+                                             Shape<_BLK_M, _BLK_K, _STAGES>{}));
+
+  // B smem: (BLK_N, BLK_K, STAGES), gate rows followed by up rows
+  using SmemLayoutB = decltype(tile_to_shape(SmemLayoutAtom{},
+                                             Shape<_BLK_N, _BLK_K, _STAGES>{}));
+
+  // g2s tiled copy for A and B
+  using GmemTiledCopy = decltype(make_tiled_copy(
+      Copy_Atom<SM80_CP_ASYNC_CACHEGLOBAL_ZFILL<cute::uint128_t>, DType>{},
+      Layout<Shape<_16, _8>, Stride<_8, _1>>{},  // Thr layout: (_16,_8)
+      Layout<Shape<_1, _8>>{}                    // Val layout: 8 vals per read
+      ));
+
+  // s2r tiled copy for A and B
+  using SmemTiledCopyA =
+      decltype(make_tiled_copy_A(Copy_Atom<SM75_U32x4_LDSM_N, DType>{},
+                                 TiledMma{}));
+  using SmemTiledCopyB =
+      decltype(make_tiled_copy_B(Copy_Atom<SM75_U32x4_LDSM_N, DType>{},
+                                 TiledMma{}));
+
+  // ******* Epilogue *******
+  // C smem: (BLK_M, BLK_N), k-major, reuses the smem of A
+  using SmemLayoutC =
+      decltype(tile_to_shape(SmemLayoutAtom{}, Shape<_BLK_M, _BLK_N>{}));
+
+  // r2s tiled copy for C
+  using SmemTiledCopyC = decltype(make_tiled_copy_C(
+      Copy_Atom<AutoVectorizingCopyWithAssumedAlignment<128>, DType>{},
+      TiledMma{}));
+
+  // constexpr values for kernel launch
+  static constexpr size_t kSmemSizeAB =
+      (cosize(SmemLayoutA{}) + cosize(SmemLayoutB{})) * sizeof(DType);
+  static constexpr size_t kSmemSizeC = cosize(SmemLayoutC{}) * sizeof(DType);
+  static constexpr size_t kSmemSize =
+      kSmemSizeAB > kSmemSizeC ? kSmemSizeAB : kSmemSizeC;
+
+  static constexpr size_t kThreadNum = size(TiledMma{});
+};
+
+// c = act(a @ gate.T) * (a @ up.T), where gate = b[:n] and up = b[n:].
+// each thread block computes the gate and up columns of a (BLK_M, BLK_N / 2)
+// output tile with a multi-stage cp.async pipeline, then rounds both to DType
+// like a separate gemm would, and applies the gated activation in float.
+// requires n % (BLK_N / 2) == 0 and k % BLK_K == 0.
+template <typename Traits, GatedAct ACT>
+__global__ __launch_bounds__(Traits::kThreadNum) void gated_gemm_kernel_sm80(
+    __grid_constant__ const GatedGemmParams params) {
+  using DType = typename Traits::DType;
+  using _BLK_M = typename Traits::_BLK_M;
+  using _BLK_N = typename Traits::_BLK_N;
+  using _BLK_K = typename Traits::_BLK_K;
+  using _BLK_I = typename Traits::_BLK_I;
+
+  using TiledMma = typename Traits::TiledMma;
+  using SmemLayoutA = typename Traits::SmemLayoutA;
+  using SmemLayoutB = typename Traits::SmemLayoutB;
+  using SmemLayoutC = typename Traits::SmemLayoutC;
+  using GmemTiledCopy = typename Traits::GmemTiledCopy;
+  using SmemTiledCopyA = typename Traits::SmemTiledCopyA;
+  using SmemTiledCopyB = typename Traits::SmemTiledCopyB;
+  using SmemTiledCopyC = typename Traits::SmemTiledCopyC;
+
+  constexpr int kBlockM = Traits::kBlockM;
+  constexpr int kBlockI = Traits::kBlockI;
+  constexpr int kStages = Traits::kStages;
+  constexpr int kThreadNum = Traits::kThreadNum;
+
+  const int tidx = threadIdx.x;
+  const int m_block = blockIdx.x;
+  const int n_block = blockIdx.y;
+  const int m = params.m;
+  const int n = params.n;
+  const int k = params.k;
+
+  // Gmem
+  // (m, k), (2 * n, k) and (m, n)
+  Tensor A = make_tensor(make_gmem_ptr((const DType*)params.a_ptr),
+                         make_shape(m, k),
+                         make_stride(params.a_stride, _1{}));
+  Tensor B = make_tensor(make_gmem_ptr((const DType*)params.b_ptr),
+                         make_shape(2 * n, k),
+                         make_stride(int64_t(k), _1{}));
+  Tensor C = make_tensor(make_gmem_ptr((DType*)params.c_ptr),
+                         make_shape(m, n),
+                         make_stride(params.c_stride, _1{}));
+
+  // (BLK_M, BLK_K, k_blocks)
+  Tensor gA = local_tile(A, Shape<_BLK_M, _BLK_K>{}, make_coord(m_block, _));
+  // (BLK_I, BLK_K, k_blocks) for gate and up
+  Tensor gGate = local_tile(B, Shape<_BLK_I, _BLK_K>{}, make_coord(n_block, _));
+  Tensor gUp = local_tile(
+      B, Shape<_BLK_I, _BLK_K>{}, make_coord(n / kBlockI + n_block, _));
+  // (BLK_M, BLK_I)
+  Tensor gC =
+      local_tile(C, Shape<_BLK_M, _BLK_I>{}, make_coord(m_block, n_block));
+
+  // Smem
+  extern __shared__ char smem[];
+  DType* a_smem = (DType*)smem;
+  DType* b_smem = a_smem + cosize(SmemLayoutA{});
+
+  // (BLK_M, BLK_K, STAGES), k-major
+  Tensor sA = make_tensor(make_smem_ptr(a_smem), SmemLayoutA{});
+  // (BLK_N, BLK_K, STAGES), k-major
+  Tensor sB = make_tensor(make_smem_ptr(b_smem), SmemLayoutB{});
+
+  // Tiled Copy
+  GmemTiledCopy gmem_tiled_copy;
+  auto gmem_thr_copy = gmem_tiled_copy.get_thread_slice(tidx);
+
+  // coordinate tensor for oob handling
+  // (BLK_M, BLK_K) -> (blk_m, blk_k)
+  Tensor cA = make_identity_tensor(Shape<_BLK_M, _BLK_K>{});
+  Tensor tAcA = gmem_thr_copy.partition_S(cA);
+  // (BLK_I, BLK_K) -> (blk_i, blk_k)
+  Tensor cB = make_identity_tensor(Shape<_BLK_I, _BLK_K>{});
+  Tensor tBcB = gmem_thr_copy.partition_S(cB);
+
+  Tensor tAsA = gmem_thr_copy.partition_D(sA);  // (CPY,CPY_M,CPY_K,STAGES)
+
+  const auto max_coord_a = make_coord(m - m_block * kBlockM, k);
+  const auto max_coord_b = make_coord(kBlockI, k);
+  auto produce_ab = [&](int ki, int stage) {
+    auto tAgA = gmem_thr_copy.partition_S(gA(_, _, ki));
+    auto tAsA_s = tAsA(_, _, _, stage);
+    safe_copy</*EVEN_MN=*/false,
+              /*EVEN_K=*/true,
+              /*ZFILL_MN=*/true,
+              /*ZFILL_K=*/false>(
+        gmem_tiled_copy, tAgA, tAsA_s, tAcA, max_coord_a);
+
+    // (BLK_I, BLK_K) for gate and up
+    auto sB_s = sB(_, _, stage);
+    auto sGate = local_tile(sB_s, Shape<_BLK_I, _BLK_K>{}, make_coord(0, 0));
+    auto sUp = local_tile(sB_s, Shape<_BLK_I, _BLK_K>{}, make_coord(1, 0));
+
+    auto tBgGate = gmem_thr_copy.partition_S(gGate(_, _, ki));
+    auto tBsGate_s = gmem_thr_copy.partition_D(sGate);
+    safe_copy</*EVEN_MN=*/true,
+              /*EVEN_K=*/true,
+              /*ZFILL_MN=*/false,
+              /*ZFILL_K=*/false>(
+        gmem_tiled_copy, tBgGate, tBsGate_s, tBcB, max_coord_b);
+
+    auto tBgUp = gmem_thr_copy.partition_S(gUp(_, _, ki));
+    auto tBsUp_s = gmem_thr_copy.partition_D(sUp);
+    safe_copy</*EVEN_MN=*/true,
+              /*EVEN_K=*/true,
+              /*ZFILL_MN=*/false,
+              /*ZFILL_K=*/false>(
+        gmem_tiled_copy, tBgUp, tBsUp_s, tBcB, max_coord_b);
+  };
+
+  TiledMma tiled_mma;
+  auto thr_mma = tiled_mma.get_slice(tidx);
+  // (MMA,MMA_M,MMA_K) and (MMA,MMA_N,MMA_K)
+  auto tCrA = thr_mma.partition_fragment_A(sA(_, _, _0{}));
+  auto tCrB = thr_mma.partition_fragment_B(sB(_, _, _0{}));
+
+  // s2r tiled copy for A and B
+  SmemTiledCopyA smem_tiled_copy_A;
+  auto smem_thr_copy_A = smem_tiled_copy_A.get_thread_slice(tidx);
+  auto tCsA = smem_thr_copy_A.partition_S(sA);  // (CPY,CPY_M,CPY_K,STAGES)
+  auto tCrA_copy_view = smem_thr_copy_A.retile_D(tCrA);
+
+  SmemTiledCopyB smem_tiled_copy_B;
+  auto smem_thr_copy_B = smem_tiled_copy_B.get_thread_slice(tidx);
+  auto tCsB = smem_thr_copy_B.partition_S(sB);  // (CPY,CPY_N,CPY_K,STAGES)
+  auto tCrB_copy_view = smem_thr_copy_B.retile_D(tCrB);
+
+  // tCrAccC: (MMA,MMA_M,MMA_N)
+  auto compute_ab = [&](int stage, auto& tCrAccC) {
+    auto tCsA_s = tCsA(_, _, _, stage);
+    auto tCsB_s = tCsB(_, _, _, stage);
+    // prefetch the first k slice
+    cute::copy(
+        smem_tiled_copy_A, tCsA_s(_, _, _0{}), tCrA_copy_view(_, _, _0{}));
+    cute::copy(
+        smem_tiled_copy_B, tCsB_s(_, _, _0{}), tCrB_copy_view(_, _, _0{}));
+
+    CUTE_UNROLL
+    for (int ki = 0; ki < size<2>(tCrA); ++ki) {
+      // prefetch next k slice
+      if (ki != size<2>(tCrA) - 1) {
+        const auto next_ki = ki + 1;
+        cute::copy(smem_tiled_copy_A,
+                   tCsA_s(_, _, next_ki),
+                   tCrA_copy_view(_, _, next_ki));
+        cute::copy(smem_tiled_copy_B,
+                   tCsB_s(_, _, next_ki),
+                   tCrB_copy_view(_, _, next_ki));
+      }
+      cute::gemm(tiled_mma, tCrA(_, _, ki), tCrB(_, _, ki), tCrAccC);
+    }
+  };
+
+  // ############### Prologue ###############
+  // (MMA,MMA_M,MMA_N)
+  auto tCrAccC = partition_fragment_C(tiled_mma, Shape<_BLK_M, _BLK_N>{});
+  clear(tCrAccC);
+
+  const int n_k_blocks = k / Traits::kBlockK;
+  // fill the first STAGES - 1 stages
+  CUTE_UNROLL
+  for (int stage = 0; stage < kStages - 1; ++stage) {
+    if (stage < n_k_blocks) {
+      produce_ab(stage, stage);
+    }
+    cp_async_fence();
+  }
+
+  // ############### Mainloop ###############
+  for (int ki = 0; ki < n_k_blocks; ++ki) {
+    // wait for the k block ki, and for the stage of ki - 1 to be consumed
+    cp_async_wait<kStages - 2>();
+    __syncthreads();
+
+    // prefetch into the stage consumed in the previous iteration
+    const int next_ki = ki + kStages - 1;
+    if (next_ki < n_k_blocks) {
+      produce_ab(next_ki, next_ki % kStages);
+    }
+    cp_async_fence();
+
+    compute_ab(ki % kStages, tCrAccC);
+  }
+
+  // ############### Epilogue ###############
+  // wait for all stages to be consumed before reusing the smem
+  cp_async_wait<0>();
+  __syncthreads();
+
+  // 1> cast gate and up from ElementAccumulator to Element
+  auto tCrC = make_tensor_like<DType>(tCrAccC);
+  fast_cast(tCrAccC, tCrC);
+
+  // 2> copy gate and up from reg to smem
+  Tensor sC = make_tensor(make_smem_ptr(a_smem), SmemLayoutC{});
+  SmemTiledCopyC smem_tiled_copy_C;
+  auto smem_thr_copy_C = smem_tiled_copy_C.get_thread_slice(tidx);
+  auto tCrC_copy_view = smem_thr_copy_C.retile_S(tCrC);
+  auto tCsC = smem_thr_copy_C.partition_D(sC);
+  cute::copy(smem_tiled_copy_C, tCrC_copy_view, tCsC);
+  __syncthreads();
+
+  // 3> write act(gate) * up to gmem
+  const int max_m = m - m_block * kBlockM;
+  for (int i = tidx; i < kBlockM * kBlockI; i += kThreadNum) {
+    const int mi = i / kBlockI;
+    const int ni = i % kBlockI;
+    if (mi < max_m) {
+      const float gate = static_cast<float>(sC(mi, ni));
+      const float up = static_cast<float>(sC(mi, ni + kBlockI));
+      gC(mi, ni) = static_cast<DType>(gated_act<ACT>(gate) * up);
+    }
+  }
+}
+
+template <typename Traits, GatedAct ACT>
+void launch_gated_gemm_kernel_sm80(const GatedGemmParams& params,
+                                   cudaStream_t stream) {
+  const auto smem_size = Traits::kSmemSize;
+  auto gemm_kernel = gated_gemm_kernel_sm80<Traits, ACT>;
+  cudaFuncSetAttribute(
+      gemm_kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size);
+  // thread blocks sharing the same weight tile are scheduled together
+  dim3 grid(cute::ceil_div(params.m, Traits::kBlockM),
+            params.n / Traits::kBlockI);
+  dim3 block = Traits::kThreadNum;
+  gemm_kernel<<<grid, block, smem_size, stream>>>(params);
+}
+
+}  // namespace llm
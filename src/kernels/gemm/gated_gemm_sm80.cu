@@ -0,0 +1,31 @@
+#include "cute/numeric/numeric_types.hpp"
+#include "gated_gemm_kernel_sm80.cuh"
+#include "gemm_params.h"
+
+namespace llm {
+
+template <typename Dtype, GatedAct ACT>
+void run_gated_gemm_sm80(GatedGemmParams& params, cudaStream_t stream) {
+  // 128x128 tiles of 64 gate and 64 up columns, 3 stages of 64 k
+  using Traits = GatedGemmTraitsSM80<Dtype,
+                                     /*BLK_M=*/128,
+                                     /*BLK_N=*/128,
+                                     /*BLK_K=*/64,
+                                     /*STAGES=*/3>;
+  launch_gated_gemm_kernel_sm80<Traits, ACT>(params, stream);
+}
+
+#define INSTANTIATE_GATED_GEMM_SM80(DTYPE)                                   \
+  template void run_gated_gemm_sm80<DTYPE, GatedAct::kSilu>(                 \
+      GatedGemmParams & params, cudaStream_t stream);                        \
+  template void run_gated_gemm_sm80<DTYPE, GatedAct::kGelu>(                 \
+      GatedGemmParams & params, cudaStream_t stream);                        \
+  template void run_gated_gemm_sm80<DTYPE, GatedAct::kGeluTanh>(             \
+      GatedGemmParams & params, cudaStream_t stream);                        \
+  template void run_gated_gemm_sm80<DTYPE, GatedAct::kRelu>(                 \
+      GatedGemmParams & params, cudaStream_t stream);
+
+INSTANTIATE_GATED_GEMM_SM80(cute::half_t);
+INSTANTIATE_GATED_GEMM_SM80(cute::bfloat16_t);
+
+}  // namespace llm
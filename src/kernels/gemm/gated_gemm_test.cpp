@@ -0,0 +1,95 @@
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+
+#include "gemm_api.h"
+
+namespace llm {
+namespace {
+torch::Tensor gated_act_ref(const torch::Tensor& x, GatedAct act) {
+  namespace F = torch::nn::functional;
+  switch (act) {
+    case GatedAct::kSilu:
+      return F::silu(x);
+    case GatedAct::kGelu:
+      return F::gelu(x);
+    case GatedAct::kGeluTanh:
+      return F::gelu(x, F::GELUFuncOptions().approximate("tanh"));
+    case GatedAct::kRelu:
+      return F::relu(x);
+  }
+  return x;
+}
+
+// act(input @ gate.T) * (input @ up.T) with separate gemm and activation
+torch::Tensor gated_gemm_ref(const torch::Tensor& input,
+                             const torch::Tensor& weight,
+                             GatedAct act) {
+  const auto gate_up = torch::matmul(input, weight.t()).chunk(2, /*dim=*/-1);
+  const auto gate = gate_up[0].to(torch::kFloat);
+  const auto up = gate_up[1].to(torch::kFloat);
+  return (gated_act_ref(gate, act) * up).to(input.scalar_type());
+}
+}  // namespace
+
+class GatedGemmTest
+    : public ::testing::TestWithParam<std::tuple<torch::ScalarType /*dtype*/,
+                                                 int64_t /*n_tokens*/,
+                                                 int64_t /*in_features*/,
+                                                 int64_t /*out_features*/,
+                                                 GatedAct /*act*/>> {
+ public:
+  void SetUp() override {
+    // skip test if cuda is not available
+    if (!torch::cuda::is_available()) {
+      GTEST_SKIP() << "CUDA is not available";
+    }
+  }
+};
+
+TEST_P(GatedGemmTest, Result) {
+  const auto [dtype, n_tokens, in_features, out_features, act] = GetParam();
+  const auto options = torch::dtype(dtype).device(torch::kCUDA);
+
+  const auto input = torch::randn({n_tokens, in_features}, options);
+  const auto weight =
+      torch::randn({2 * out_features, in_features}, options) * 0.05;
+  ASSERT_TRUE(can_use_gated_gemm(input, weight));
+
+  const auto out = gated_gemm(input, weight, act);
+  const auto ref_out = gated_gemm_ref(input, weight, act);
+  ASSERT_EQ(out.sizes(), torch::IntArrayRef({n_tokens, out_features}));
+  EXPECT_TRUE(torch::allclose(out, ref_out, /*rtol=*/1e-2, /*atol=*/1e-2));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    GatedGemm,
+    GatedGemmTest,
+    ::testing::Combine(::testing::Values(torch::kHalf, torch::kBFloat16),
+                       ::testing::Values(1, 17, 128, 300),  // n_tokens
+                       ::testing::Values(64, 512, 4096),    // in_features
+                       ::testing::Values(64, 320, 1024),    // out_features
+                       ::testing::Values(GatedAct::kSilu,
+                                         GatedAct::kGelu,
+                                         GatedAct::kGeluTanh,
+                                         GatedAct::kRelu)));
+
+TEST(GatedGemmTest, Unsupported) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA is not available";
+  }
+  const auto options = torch::dtype(torch::kHalf).device(torch::kCUDA);
+  const auto input = torch::randn({4, 96}, options);
+  // in_features not aligned to 64
+  EXPECT_FALSE(can_use_gated_gemm(input, torch::randn({128, 96}, options)));
+  // out_features / 2 not aligned to 64
+  const auto aligned = torch::randn({4, 64}, options);
+  EXPECT_FALSE(can_use_gated_gemm(aligned, torch::randn({96, 64}, options)));
+  // float32 is not supported
+  const auto weight = torch::randn({128, 64}, options);
+  EXPECT_FALSE(can_use_gated_gemm(aligned.to(torch::kFloat),
+                                  weight.to(torch::kFloat)));
+}
+
+}  // namespace llm
@@ -0,0 +1,380 @@
+#include "gemm_api.h"
+
+#include <ATen/cuda/CUDAContext.h>
+#include <glog/logging.h>
+
+#include "cute/numeric/numeric_types.hpp"
+#include "../attention/static_dispatch.h"
+
+namespace llm {
+
+// forward declaration
+template <typename Dtype, GatedAct ACT>
+void run_gated_gemm_sm80(GatedGemmParams& params, cudaStream_t stream);
+
+template <typename Dtype, typename OutType>
+void run_softcap_gemm_sm80(SoftcapGemmParams& params, cudaStream_t stream);
+
+template <typename QType, typename Dtype>
+void run_scaled_gemm_sm80(ScaledGemmParams& params, cudaStream_t stream);
+
+template <typename Dtype>
+void run_grouped_gemm_sm80(GroupedGemmParams& params, cudaStream_t stream);
+
+namespace {
+// alignment of k and n required by the tiles of the kernel
+constexpr int kAlignK = 64;
+constexpr int kAlignN = 64;
+
+template <typename Dtype>
+void dispatch_gated_act(GatedAct act,
+                        GatedGemmParams& params,
+                        cudaStream_t stream) {
+  switch (act) {
+    case GatedAct::kSilu:
+      return run_gated_gemm_sm80<Dtype, GatedAct::kSilu>(params, stream);
+    case GatedAct::kGelu:
+      return run_gated_gemm_sm80<Dtype, GatedAct::kGelu>(params, stream);
+    case GatedAct::kGeluTanh:
+      return run_gated_gemm_sm80<Dtype, GatedAct::kGeluTanh>(params, stream);
+    case GatedAct::kRelu:
+      return run_gated_gemm_sm80<Dtype, GatedAct::kRelu>(params, stream);
+  }
+}
+
+template <typename Dtype>
+void dispatch_scaled_gemm_qtype(torch::ScalarType qtype,
+                                ScaledGemmParams& params,
+                                cudaStream_t stream) {
+  if (qtype == torch::kInt8) {
+    return run_scaled_gemm_sm80<int8_t, Dtype>(params, stream);
+  }
+  CHECK(qtype == torch::kFloat8_e4m3fn) << "unsupported quant type " << qtype;
+  return run_scaled_gemm_sm80<cute::float_e4m3_t, Dtype>(params, stream);
+}
+
+void check_group_offsets(const torch::Tensor& group_offsets,
+                         const torch::Tensor& weight) {
+  CHECK(group_offsets.is_cuda() &&
+        group_offsets.scalar_type() == torch::kInt &&
+        group_offsets.is_contiguous())
+      << "group offsets must be contiguous int32 on device";
+  CHECK_EQ(group_offsets.numel(), weight.size(0) + 1)
+      << "group offsets size mismatch";
+}
+}  // namespace
+
+bool can_use_gated_gemm(const torch::Tensor& input,
+                        const torch::Tensor& weight) {
+  if (!input.is_cuda() || weight.dim() != 2 ||
+      input.scalar_type() != weight.scalar_type()) {
+    return false;
+  }
+  const auto dtype = input.scalar_type();
+  if (dtype != torch::kHalf && dtype != torch::kBFloat16) {
+    return false;
+  }
+  if (at::cuda::getDeviceProperties(input.get_device())->major < 8) {
+    return false;
+  }
+  const auto k = weight.size(1);
+  const auto n = weight.size(0) / 2;
+  return input.size(-1) == k && k % kAlignK == 0 &&
+         weight.size(0) % 2 == 0 && n % kAlignN == 0 &&
+         weight.is_contiguous();
+}
+
+torch::Tensor gated_gemm(const torch::Tensor& input,
+                         const torch::Tensor& weight,
+                         GatedAct act) {
+  CHECK(can_use_gated_gemm(input, weight))
+      << "gated gemm not supported for input " << input.sizes()
+      << " and weight " << weight.sizes();
+  const auto k = weight.size(1);
+  const auto n = weight.size(0) / 2;
+
+  // [m, k] with contiguous k
+  auto a = input.reshape({-1, k});
+  if (a.stride(-1) != 1) {
+    a = a.contiguous();
+  }
+  auto out_sizes = input.sizes().vec();
+  out_sizes.back() = n;
+  auto out = torch::empty(out_sizes, input.options());
+
+  GatedGemmParams params;
+  params.a_ptr = a.const_data_ptr();
+  params.a_stride = a.stride(0);
+  params.b_ptr = weight.const_data_ptr();
+  params.c_ptr = out.mutable_data_ptr();
+  params.c_stride = n;
+  params.m = static_cast<int>(a.size(0));
+  params.n = static_cast<int>(n);
+  params.k = static_cast<int>(k);
+  if (params.m == 0) {
+    return out;
+  }
+
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  DISPATCH_TORCH_DTYPE(input.scalar_type(), DTYPE, [&] {
+    dispatch_gated_act<DTYPE>(act, params, stream);
+  });
+  return out;
+}
+
+bool can_use_softcap_gemm(const torch::Tensor& input,
+                          const torch::Tensor& weight) {
+  if (!input.is_cuda() || weight.dim() != 2 ||
+      input.scalar_type() != weight.scalar_type()) {
+    return false;
+  }
+  const auto dtype = input.scalar_type();
+  if (dtype != torch::kHalf && dtype != torch::kBFloat16) {
+    return false;
+  }
+  if (at::cuda::getDeviceProperties(input.get_device())->major < 8) {
+    return false;
+  }
+  const auto k = weight.size(1);
+  return input.size(-1) == k && k % kAlignK == 0 && weight.stride(1) == 1 &&
+         weight.stride(0) % 8 == 0;
+}
+
+torch::Tensor softcap_gemm(const torch::Tensor& input,
+                           const torch::Tensor& weight,
+                           float soft_cap,
+                           torch::ScalarType out_dtype) {
+  CHECK(can_use_softcap_gemm(input, weight))
+      << "softcap gemm not supported for input " << input.sizes()
+      << " and weight " << weight.sizes();
+  CHECK(out_dtype == torch::kFloat || out_dtype == input.scalar_type())
+      << "unsupported output dtype " << out_dtype;
+  const auto k = weight.size(1);
+  const auto n = weight.size(0);
+
+  // [m, k] with contiguous k
+  auto a = input.reshape({-1, k});
+  if (a.stride(-1) != 1 || a.stride(0) % 8 != 0) {
+    a = a.contiguous();
+  }
+  auto out_sizes = input.sizes().vec();
+  out_sizes.back() = n;
+  auto out = torch::empty(out_sizes, input.options().dtype(out_dtype));
+
+  SoftcapGemmParams params;
+  params.a_ptr = a.const_data_ptr();
+  params.a_stride = a.stride(0);
+  params.b_ptr = weight.const_data_ptr();
+  params.b_stride = weight.stride(0);
+  params.c_ptr = out.mutable_data_ptr();
+  params.c_stride = n;
+  params.soft_cap = soft_cap;
+  params.m = static_cast<int>(a.size(0));
+  params.n = static_cast<int>(n);
+  params.k = static_cast<int>(k);
+  if (params.m == 0) {
+    return out;
+  }
+
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  DISPATCH_TORCH_DTYPE(input.scalar_type(), DTYPE, [&] {
+    if (out_dtype == torch::kFloat) {
+      run_softcap_gemm_sm80<DTYPE, float>(params, stream);
+    } else {
+      run_softcap_gemm_sm80<DTYPE, DTYPE>(params, stream);
+    }
+  });
+  return out;
+}
+
+bool can_use_scaled_gemm(const torch::Tensor& input,
+                         const torch::Tensor& weight) {
+  if (!input.is_cuda() || weight.dim() != 2 ||
+      input.scalar_type() != weight.scalar_type()) {
+    return false;
+  }
+  const auto* props = at::cuda::getDeviceProperties(input.get_device());
+  const int arch = props->major * 10 + props->minor;
+  const auto qtype = input.scalar_type();
+  if (qtype == torch::kInt8) {
+    if (arch < 80) {
+      return false;
+    }
+  } else if (qtype == torch::kFloat8_e4m3fn) {
+    if (arch < 89) {
+      return false;
+    }
+  } else {
+    return false;
+  }
+  const auto k = weight.size(1);
+  return input.size(-1) == k && k % kAlignK == 0 && weight.is_contiguous();
+}
+
+torch::Tensor scaled_gemm(const torch::Tensor& input,
+                          const torch::Tensor& input_scale,
+                          const torch::Tensor& weight,
+                          const torch::Tensor& weight_scale,
+                          const std::optional<torch::Tensor>& bias,
+                          torch::ScalarType out_dtype) {
+  CHECK(can_use_scaled_gemm(input, weight))
+      << "scaled gemm not supported for input " << input.sizes()
+      << " and weight " << weight.sizes();
+  CHECK(out_dtype == torch::kHalf || out_dtype == torch::kBFloat16)
+      << "unsupported output dtype " << out_dtype;
+  const auto k = weight.size(1);
+  const auto n = weight.size(0);
+
+  // [m, k] with contiguous k
+  auto a = input.reshape({-1, k});
+  if (a.stride(-1) != 1) {
+    a = a.contiguous();
+  }
+  const auto a_scale = input_scale.reshape({-1}).to(torch::kFloat);
+  const auto b_scale = weight_scale.reshape({-1}).to(torch::kFloat);
+  CHECK_EQ(a_scale.numel(), a.size(0)) << "input scale size mismatch";
+  CHECK_EQ(b_scale.numel(), n) << "weight scale size mismatch";
+
+  auto out_sizes = input.sizes().vec();
+  out_sizes.back() = n;
+  auto out = torch::empty(out_sizes, input.options().dtype(out_dtype));
+
+  torch::Tensor bias_c;
+  if (bias.has_value() && bias->defined()) {
+    bias_c = bias->to(out_dtype).contiguous();
+    CHECK_EQ(bias_c.numel(), n) << "bias size mismatch";
+  }
+
+  ScaledGemmParams params;
+  params.a_ptr = a.const_data_ptr();
+  params.a_stride = a.stride(0);
+  params.b_ptr = weight.const_data_ptr();
+  params.b_stride = weight.stride(0);
+  params.a_scale_ptr = a_scale.const_data_ptr<float>();
+  params.b_scale_ptr = b_scale.const_data_ptr<float>();
+  params.bias_ptr = bias_c.defined() ? bias_c.const_data_ptr() : nullptr;
+  params.c_ptr = out.mutable_data_ptr();
+  params.c_stride = n;
+  params.m = static_cast<int>(a.size(0));
+  params.n = static_cast<int>(n);
+  params.k = static_cast<int>(k);
+  if (params.m == 0) {
+    return out;
+  }
+
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  DISPATCH_TORCH_DTYPE(out_dtype, DTYPE, [&] {
+    dispatch_scaled_gemm_qtype<DTYPE>(input.scalar_type(), params, stream);
+  });
+  return out;
+}
+
+bool can_use_grouped_gemm(const torch::Tensor& input,
+                          const torch::Tensor& weight) {
+  if (!input.is_cuda() || input.dim() != 2 || weight.dim() != 3 ||
+      input.scalar_type() != weight.scalar_type()) {
+    return false;
+  }
+  const auto dtype = input.scalar_type();
+  if (dtype != torch::kHalf && dtype != torch::kBFloat16) {
+    return false;
+  }
+  if (at::cuda::getDeviceProperties(input.get_device())->major < 8) {
+    return false;
+  }
+  const auto k = weight.size(2);
+  return input.size(1) == k && k % kAlignK == 0 && weight.is_contiguous();
+}
+
+torch::Tensor grouped_gemm(const torch::Tensor& input,
+                           const torch::Tensor& weight,
+                           const torch::Tensor& group_offsets) {
+  CHECK(can_use_grouped_gemm(input, weight))
+      << "grouped gemm not supported for input " << input.sizes()
+      << " and weight " << weight.sizes();
+  check_group_offsets(group_offsets, weight);
+  const auto n = weight.size(1);
+  const auto k = weight.size(2);
+
+  // [m, k] with contiguous k
+  auto a = input.stride(-1) == 1 ? input : input.contiguous();
+  auto out = torch::empty({a.size(0), n}, input.options());
+
+  GroupedGemmParams params;
+  params.a_ptr = a.const_data_ptr();
+  params.a_stride = a.stride(0);
+  params.b_ptr = weight.const_data_ptr();
+  params.b_stride = weight.stride(1);
+  params.b_group_stride = weight.stride(0);
+  params.c_ptr = out.mutable_data_ptr();
+  params.c_stride = n;
+  params.group_offsets = group_offsets.const_data_ptr<int>();
+  params.n_groups = static_cast<int>(weight.size(0));
+  params.m = static_cast<int>(a.size(0));
+  params.n = static_cast<int>(n);
+  params.k = static_cast<int>(k);
+  if (params.m == 0 || params.n_groups == 0) {
+    return out;
+  }
+
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  DISPATCH_TORCH_DTYPE(input.scalar_type(), DTYPE, [&] {
+    run_grouped_gemm_sm80<DTYPE>(params, stream);
+  });
+  return out;
+}
+
+torch::Tensor grouped_scaled_gemm(const torch::Tensor& input,
+                                  const torch::Tensor& input_scale,
+                                  const torch::Tensor& weight,
+                                  const torch::Tensor& weight_scale,
+                                  const torch::Tensor& group_offsets,
+                                  torch::ScalarType out_dtype) {
+  CHECK(input.dim() == 2 && weight.dim() == 3)
+      << "grouped scaled gemm expects 2d input and 3d weight";
+  CHECK(can_use_scaled_gemm(input, weight[0]))
+      << "grouped scaled gemm not supported for input " << input.sizes()
+      << " and weight " << weight.sizes();
+  CHECK(out_dtype == torch::kHalf || out_dtype == torch::kBFloat16)
+      << "unsupported output dtype " << out_dtype;
+  check_group_offsets(group_offsets, weight);
+  const auto n = weight.size(1);
+  const auto k = weight.size(2);
+
+  // [m, k] with contiguous k
+  auto a = input.stride(-1) == 1 ? input : input.contiguous();
+  const auto a_scale = input_scale.reshape({-1}).to(torch::kFloat);
+  const auto b_scale =
+      weight_scale.to(torch::kFloat).contiguous().reshape({-1});
+  CHECK_EQ(a_scale.numel(), a.size(0)) << "input scale size mismatch";
+  CHECK_EQ(b_scale.numel(), weight.size(0) * n)
+      << "weight scale size mismatch";
+  auto out = torch::empty({a.size(0), n}, input.options().dtype(out_dtype));
+
+  ScaledGemmParams params;
+  params.a_ptr = a.const_data_ptr();
+  params.a_stride = a.stride(0);
+  params.b_ptr = weight.const_data_ptr();
+  params.b_stride = weight.stride(1);
+  params.a_scale_ptr = a_scale.const_data_ptr<float>();
+  params.b_scale_ptr = b_scale.const_data_ptr<float>();
+  params.c_ptr = out.mutable_data_ptr();
+  params.c_stride = n;
+  params.group_offsets = group_offsets.const_data_ptr<int>();
+  params.n_groups = static_cast<int>(weight.size(0));
+  params.b_group_stride = weight.stride(0);
+  params.m = static_cast<int>(a.size(0));
+  params.n = static_cast<int>(n);
+  params.k = static_cast<int>(k);
+  if (params.m == 0 || params.n_groups == 0) {
+    return out;
+  }
+
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  DISPATCH_TORCH_DTYPE(out_dtype, DTYPE, [&] {
+    dispatch_scaled_gemm_qtype<DTYPE>(input.scalar_type(), params, stream);
+  });
+  return out;
+}
+
+}  // namespace llm
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <torch/torch.h>
+#include <torch/types.h>
+
+#include <optional>
+
+#include "gemm_params.h"
+
+namespace llm {
+// whether the gated gemm supports the input and weight:
+// fp16/bf16 on sm80+, k % 64 == 0 and out_features % 128 == 0.
+bool can_use_gated_gemm(const torch::Tensor& input,
+                        const torch::Tensor& weight);
+
+// act(input @ gate.T) * (input @ up.T) with the gated activation applied in
+// the gemm epilogue, where gate and up are the first and second halves of the
+// weight rows. only the [..., out_features / 2] result is written.
+torch::Tensor gated_gemm(
+    const torch::Tensor& input,   // [..., in_features]
+    const torch::Tensor& weight,  // [out_features, in_features]
+    GatedAct act);
+
+// whether the soft-capped gemm supports the input and weight:
+// fp16/bf16 on sm80+ with k % 64 == 0, any out_features.
+bool can_use_softcap_gemm(const torch::Tensor& input,
+                          const torch::Tensor& weight);
+
+// soft_cap * tanh((input @ weight.T) / soft_cap), with the soft cap applied on
+// the float accumulators in the gemm epilogue. the output is float or the
+// dtype of the input. a soft_cap <= 0 disables the cap.
+torch::Tensor softcap_gemm(
+    const torch::Tensor& input,   // [..., in_features]
+    const torch::Tensor& weight,  // [out_features, in_features]
+    float soft_cap,
+    torch::ScalarType out_dtype);
+
+// whether the cublaslt gemm supports the input and weight:
+// fp16/bf16 with k and out_features multiples of 8.
+bool can_use_cublaslt_gemm(const torch::Tensor& input,
+                           const torch::Tensor& weight);
+
+// act(input @ weight.T + bias) with cublaslt, the bias and the activation
+// applied in the gemm epilogue. the algorithm of each shape is chosen once,
+// by timing the candidates of the heuristic for small m, and cached.
+torch::Tensor cublaslt_gemm(
+    const torch::Tensor& input,                // [..., in_features]
+    const torch::Tensor& weight,               // [out_features, in_features]
+    const std::optional<torch::Tensor>& bias,  // [out_features]
+    EpilogueAct act);
+
+// whether the scaled gemm supports the quantized input and weight:
+// int8 on sm80+ or fp8 (e4m3) on sm89+, with k % 64 == 0.
+bool can_use_scaled_gemm(const torch::Tensor& input,
+                         const torch::Tensor& weight);
+
+// (input @ weight.T) * input_scale[:, None] * weight_scale[None, :] + bias
+// with int8 or fp8 inputs, accumulated in int32 or fp32 and dequantized to
+// out_dtype (fp16/bf16) in the gemm epilogue.
+torch::Tensor scaled_gemm(
+    const torch::Tensor& input,         // [..., in_features]
+    const torch::Tensor& input_scale,   // [...] per token, float
+    const torch::Tensor& weight,        // [out_features, in_features]
+    const torch::Tensor& weight_scale,  // [out_features] per channel, float
+    const std::optional<torch::Tensor>& bias,  // [out_features]
+    torch::ScalarType out_dtype);
+
+// whether the grouped gemm supports the input and the stacked weights:
+// fp16/bf16 on sm80+ with k % 64 == 0.
+bool can_use_grouped_gemm(const torch::Tensor& input,
+                          const torch::Tensor& weight);
+
+// out[rows of g] = input[rows of g] @ weight[g].T for each group g, where the
+// rows of group g are [group_offsets[g], group_offsets[g + 1]). rows after
+// the last group are left uninitialized.
+torch::Tensor grouped_gemm(
+    const torch::Tensor& input,          // [m, in_features]
+    const torch::Tensor& weight,  // [n_groups, out_features, in_features]
+    const torch::Tensor& group_offsets);  // [n_groups + 1] int32 on device
+
+// grouped version of scaled_gemm with the per channel weight scales of
+// each group, see grouped_gemm and scaled_gemm.
+torch::Tensor grouped_scaled_gemm(
+    const torch::Tensor& input,          // [m, in_features]
+    const torch::Tensor& input_scale,    // [m] per token, float
+    const torch::Tensor& weight,  // [n_groups, out_features, in_features]
+    const torch::Tensor& weight_scale,   // [n_groups, out_features], float
+    const torch::Tensor& group_offsets,  // [n_groups + 1] int32 on device
+    torch::ScalarType out_dtype);
+
+}  // namespace llm
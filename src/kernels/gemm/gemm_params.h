@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+
+namespace llm {
+
+// gated activations applied in the epilogue of the gated gemm
+enum class GatedAct : int8_t {
+  kSilu = 0,
+  kGelu,
+  kGeluTanh,
+  kRelu,
+};
+
+// activations applied in the epilogue of the cublaslt gemm
+enum class EpilogueAct : int8_t {
+  kNone = 0,
+  kGeluTanh,
+  kRelu,
+};
+
+struct GatedGemmParams {
+  // input: [m, k]
+  const void* __restrict__ a_ptr = nullptr;
+  int64_t a_stride = 0;
+  // weight: [2 * n, k], the gate rows followed by the up rows
+  const void* __restrict__ b_ptr = nullptr;
+  // output: [m, n]
+  void* __restrict__ c_ptr = nullptr;
+  int64_t c_stride = 0;
+
+  int m = 0;
+  int n = 0;
+  int k = 0;
+};
+
+struct SoftcapGemmParams {
+  // input: [m, k]
+  const void* __restrict__ a_ptr = nullptr;
+  int64_t a_stride = 0;
+  // weight: [n, k]
+  const void* __restrict__ b_ptr = nullptr;
+  int64_t b_stride = 0;
+  // output: [m, n], float or the type of the input
+  void* __restrict__ c_ptr = nullptr;
+  int64_t c_stride = 0;
+
+  // c = soft_cap * tanh(c / soft_cap), disabled if <= 0
+  float soft_cap = 0.0f;
+
+  int m = 0;
+  int n = 0;
+  int k = 0;
+};
+
+struct ScaledGemmParams {
+  // quantized input: [m, k], int8 or fp8
+  const void* __restrict__ a_ptr = nullptr;
+  int64_t a_stride = 0;
+  // quantized weight: [n, k], same type as input
+  const void* __restrict__ b_ptr = nullptr;
+  int64_t b_stride = 0;
+  // per token scales of the input: [m]
+  const float* __restrict__ a_scale_ptr = nullptr;
+  // per channel scales of the weight: [n]
+  const float* __restrict__ b_scale_ptr = nullptr;
+  // optional bias: [n], same type as output
+  const void* __restrict__ bias_ptr = nullptr;
+  // output: [m, n]
+  void* __restrict__ c_ptr = nullptr;
+  int64_t c_stride = 0;
+
+  // optional groups of rows, each multiplied with its own weight:
+  // rows of group g are [group_offsets[g], group_offsets[g + 1]), its weight
+  // and scales start at g * b_group_stride and g * n.
+  const int* __restrict__ group_offsets = nullptr;
+  int n_groups = 0;
+  int64_t b_group_stride = 0;
+
+  int m = 0;
+  int n = 0;
+  int k = 0;
+};
+
+struct GroupedGemmParams {
+  // input: [m, k], rows sorted by group
+  const void* __restrict__ a_ptr = nullptr;
+  int64_t a_stride = 0;
+  // weight: [n_groups, n, k]
+  const void* __restrict__ b_ptr = nullptr;
+  int64_t b_stride = 0;
+  int64_t b_group_stride = 0;
+  // output: [m, n]
+  void* __restrict__ c_ptr = nullptr;
+  int64_t c_stride = 0;
+
+  // rows of group g are [group_offsets[g], group_offsets[g + 1])
+  const int* __restrict__ group_offsets = nullptr;
+  int n_groups = 0;
+
+  // m is the number of rows of the input, rows after the last group are
+  // not touched
+  int m = 0;
+  int n = 0;
+  int k = 0;
+};
+
+}  // namespace llm
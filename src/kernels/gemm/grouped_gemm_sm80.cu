@@ -0,0 +1,24 @@
+#include "cute/numeric/numeric_types.hpp"
+#include "gemm_params.h"
+#include "grouped_gemm_kernel_sm80.cuh"
+
+namespace llm {
+
+template <typename Dtype>
+void run_grouped_gemm_sm80(GroupedGemmParams& params, cudaStream_t stream) {
+  // 128x128 tiles, 3 stages of 64 k
+  using Traits = GroupedGemmTraitsSM80<Dtype,
+                                       /*BLK_M=*/128,
+                                       /*BLK_N=*/128,
+                                       /*BLK_K=*/64,
+                                       /*STAGES=*/3>;
+  launch_grouped_gemm_kernel_sm80<Traits>(params, stream);
+}
+
+template void run_grouped_gemm_sm80<cute::half_t>(GroupedGemmParams& params,
+                                                  cudaStream_t stream);
+template void run_grouped_gemm_sm80<cute::bfloat16_t>(
+    GroupedGemmParams& params,
+    cudaStream_t stream);
+
+}  // namespace llm
@@ -0,0 +1,126 @@
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "gemm_api.h"
+
+namespace llm {
+namespace {
+// random group sizes summing up to n_tokens, including empty groups
+torch::Tensor make_group_offsets(int64_t n_tokens, int64_t n_groups) {
+  auto weights = torch::rand({n_groups}) + 0.1;
+  if (n_groups > 2) {
+    // leave the second group empty
+    weights[1] = 0;
+  }
+  auto counts = (weights / weights.sum() * n_tokens).to(torch::kInt);
+  // put the leftover rows into the last group
+  counts[-1] += n_tokens - counts.sum().item<int>();
+  auto offsets = torch::zeros({n_groups + 1}, torch::kInt);
+  offsets.slice(/*dim=*/0, /*start=*/1) = counts.cumsum(/*dim=*/0);
+  return offsets;
+}
+
+// multiply the rows of each group with its own weight in float
+torch::Tensor grouped_gemm_ref(const torch::Tensor& input,
+                               const torch::Tensor& weight,
+                               const torch::Tensor& group_offsets) {
+  auto out = torch::zeros({input.size(0), weight.size(1)},
+                          input.options().dtype(torch::kFloat));
+  const auto offsets = group_offsets.cpu();
+  const auto* offsets_ptr = offsets.const_data_ptr<int>();
+  for (int64_t g = 0; g < weight.size(0); ++g) {
+    const auto start = offsets_ptr[g];
+    const auto end = offsets_ptr[g + 1];
+    const auto a = input.slice(/*dim=*/0, start, end).to(torch::kFloat);
+    out.slice(/*dim=*/0, start, end) =
+        torch::matmul(a, weight[g].to(torch::kFloat).t());
+  }
+  return out;
+}
+}  // namespace
+
+class GroupedGemmTest
+    : public ::testing::TestWithParam<std::tuple<torch::ScalarType /*dtype*/,
+                                                 int64_t /*n_tokens*/,
+                                                 int64_t /*n_groups*/,
+                                                 int64_t /*in_features*/,
+                                                 int64_t /*out_features*/>> {
+ public:
+  void SetUp() override {
+    // skip test if cuda is not available
+    if (!torch::cuda::is_available()) {
+      GTEST_SKIP() << "CUDA is not available";
+    }
+  }
+};
+
+TEST_P(GroupedGemmTest, Result) {
+  const auto [dtype, n_tokens, n_groups, in_features, out_features] =
+      GetParam();
+  const auto options = torch::dtype(dtype).device(torch::kCUDA);
+
+  const auto input = torch::randn({n_tokens, in_features}, options);
+  const auto weight =
+      torch::randn({n_groups, out_features, in_features}, options) / 16;
+  const auto group_offsets =
+      make_group_offsets(n_tokens, n_groups).to(torch::kCUDA);
+  if (!can_use_grouped_gemm(input, weight)) {
+    GTEST_SKIP() << "grouped gemm not supported on this device";
+  }
+
+  const auto out = grouped_gemm(input, weight, group_offsets);
+  const auto ref_out = grouped_gemm_ref(input, weight, group_offsets);
+  ASSERT_EQ(out.sizes(), torch::IntArrayRef({n_tokens, out_features}));
+  EXPECT_TRUE(torch::allclose(
+      out.to(torch::kFloat), ref_out, /*rtol=*/1e-2, /*atol=*/1e-2));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    GroupedGemm,
+    GroupedGemmTest,
+    ::testing::Combine(::testing::Values(torch::kHalf, torch::kBFloat16),
+                       ::testing::Values(1, 17, 300),      // n_tokens
+                       ::testing::Values(1, 3, 8),         // n_groups
+                       ::testing::Values(64, 512, 2048),   // in_features
+                       ::testing::Values(8, 320, 1024)));  // out_features
+
+TEST(GroupedGemmTest, Scaled) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA is not available";
+  }
+  const int64_t n_tokens = 100;
+  const int64_t n_groups = 4;
+  const int64_t k = 256;
+  const int64_t n = 192;
+  const auto options = torch::dtype(torch::kFloat).device(torch::kCUDA);
+
+  const auto input =
+      torch::randint(-127, 128, {n_tokens, k}, options).to(torch::kInt8);
+  const auto input_scale = torch::rand({n_tokens}, options) / 100;
+  const auto weight =
+      torch::randint(-127, 128, {n_groups, n, k}, options).to(torch::kInt8);
+  const auto weight_scale = torch::rand({n_groups, n}, options) / 100;
+  const auto group_offsets =
+      make_group_offsets(n_tokens, n_groups).to(torch::kCUDA);
+  if (!can_use_scaled_gemm(input, weight[0])) {
+    GTEST_SKIP() << "scaled gemm not supported on this device";
+  }
+
+  const auto out = grouped_scaled_gemm(input,
+                                       input_scale,
+                                       weight,
+                                       weight_scale,
+                                       group_offsets,
+                                       torch::kHalf);
+  // the scales of each group folded into its weight
+  const auto a = input.to(torch::kFloat) * input_scale.unsqueeze(-1);
+  const auto b = weight.to(torch::kFloat) * weight_scale.unsqueeze(-1);
+  const auto ref_out = grouped_gemm_ref(a, b, group_offsets);
+  EXPECT_TRUE(torch::allclose(
+      out.to(torch::kFloat), ref_out, /*rtol=*/1e-2, /*atol=*/1e-2));
+}
+
+}  // namespace llm
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cute/config.hpp>
+
+namespace llm {
+
+// map the linear tile index to the group and m block of the tile, where the
+// rows of group g are [offsets[g], offsets[g + 1]) and each group has
+// ceil(rows / BLK_M) tiles. returns false for the tiles after the last group.
+template <int BLK_M>
+CUTE_DEVICE bool get_group_m_block(const int* offsets,
+                                   int n_groups,
+                                   int tile_idx,
+                                   int& group,
+                                   int& m_block) {
+  int n_tiles = 0;
+  for (int g = 0; g < n_groups; ++g) {
+    const int rows = offsets[g + 1] - offsets[g];
+    const int tiles = (rows + BLK_M - 1) / BLK_M;
+    if (tile_idx < n_tiles + tiles) {
+      group = g;
+      m_block = tile_idx - n_tiles;
+      return true;
+    }
+    n_tiles += tiles;
+  }
+  return false;
+}
+
+// upper bound of the number of tiles for m rows in n_groups groups
+inline int max_group_tiles(int m, int n_groups, int blk_m) {
+  return (m + blk_m - 1) / blk_m + n_groups;
+}
+
+}  // namespace llm
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cute/arch/mma.hpp>
+#include <cute/atom/mma_traits.hpp>
+#include <cute/atom/mma_traits_sm80.hpp>
+#include <cute/config.hpp>
+#include <cute/numeric/numeric_types.hpp>
+
+namespace llm {
+
+// MMA 16x8x32 TN with fp8 (e4m3) inputs and fp32 accumulators, sm89+
+struct SM89_16x8x32_F32E4M3E4M3F32_TN {
+  using DRegisters = float[4];
+  using ARegisters = uint32_t[4];
+  using BRegisters = uint32_t[2];
+  using CRegisters = float[4];
+
+  CUTE_HOST_DEVICE static void fma(float& d0,
+                                   float& d1,
+                                   float& d2,
+                                   float& d3,
+                                   const uint32_t& a0,
+                                   const uint32_t& a1,
+                                   const uint32_t& a2,
+                                   const uint32_t& a3,
+                                   const uint32_t& b0,
+                                   const uint32_t& b1,
+                                   const float& c0,
+                                   const float& c1,
+                                   const float& c2,
+                                   const float& c3) {
+#if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 890
+    asm volatile(
+        "mma.sync.aligned.m16n8k32.row.col.f32.e4m3.e4m3.f32 "
+        "{%0, %1, %2, %3},"
+        "{%4, %5, %6, %7},"
+        "{%8, %9},"
+        "{%10, %11, %12, %13};\n"
+        : "=f"(d0), "=f"(d1), "=f"(d2), "=f"(d3)
+        : "r"(a0),
+          "r"(a1),
+          "r"(a2),
+          "r"(a3),
+          "r"(b0),
+          "r"(b1),
+          "f"(c0),
+          "f"(c1),
+          "f"(c2),
+          "f"(c3));
+#else
+    CUTE_INVALID_CONTROL_PATH(
+        "SM89_16x8x32_F32E4M3E4M3F32_TN requires sm89 or newer");
+#endif
+  }
+};
+
+}  // namespace llm
+
+namespace cute {
+
+// same thread layouts as the int8 mma of the same shape
+template <>
+struct MMA_Traits<llm::SM89_16x8x32_F32E4M3E4M3F32_TN>
+    : MMA_Traits<SM80_16x8x32_S32S8S8S32_TN> {
+  using ValTypeD = float;
+  using ValTypeA = float_e4m3_t;
+  using ValTypeB = float_e4m3_t;
+  using ValTypeC = float;
+};
+
+}  // namespace cute
@@ -0,0 +1,28 @@
+#include "cute/numeric/numeric_types.hpp"
+#include "gemm_params.h"
+#include "scaled_gemm_kernel_sm80.cuh"
+
+namespace llm {
+
+template <typename QType, typename Dtype>
+void run_scaled_gemm_sm80(ScaledGemmParams& params, cudaStream_t stream) {
+  // 128x128 tiles, 4 stages of 64 k
+  using Traits = ScaledGemmTraitsSM80<QType,
+                                      Dtype,
+                                      /*BLK_M=*/128,
+                                      /*BLK_N=*/128,
+                                      /*BLK_K=*/64,
+                                      /*STAGES=*/4>;
+  launch_scaled_gemm_kernel_sm80<Traits>(params, stream);
+}
+
+#define INSTANTIATE_SCALED_GEMM_SM80(QTYPE, DTYPE)        \
+  template void run_scaled_gemm_sm80<QTYPE, DTYPE>(       \
+      ScaledGemmParams & params, cudaStream_t stream);
+
+INSTANTIATE_SCALED_GEMM_SM80(int8_t, cute::half_t);
+INSTANTIATE_SCALED_GEMM_SM80(int8_t, cute::bfloat16_t);
+INSTANTIATE_SCALED_GEMM_SM80(cute::float_e4m3_t, cute::half_t);
+INSTANTIATE_SCALED_GEMM_SM80(cute::float_e4m3_t, cute::bfloat16_t);
+
+}  // namespace llm
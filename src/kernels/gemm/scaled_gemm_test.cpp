@@ -0,0 +1,98 @@
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+
+#include "gemm_api.h"
+
+namespace llm {
+namespace {
+// dequantize and multiply in float
+torch::Tensor scaled_gemm_ref(const torch::Tensor& input,
+                              const torch::Tensor& input_scale,
+                              const torch::Tensor& weight,
+                              const torch::Tensor& weight_scale,
+                              const torch::Tensor& bias,
+                              torch::ScalarType out_dtype) {
+  const auto a = input.to(torch::kFloat) * input_scale.unsqueeze(-1);
+  const auto b = weight.to(torch::kFloat) * weight_scale.unsqueeze(-1);
+  return (torch::matmul(a, b.t()) + bias.to(torch::kFloat)).to(out_dtype);
+}
+
+// symmetric quantization along the last dim
+std::tuple<torch::Tensor, torch::Tensor> quant_ref(const torch::Tensor& x,
+                                                   torch::ScalarType qtype) {
+  const float max_value = qtype == torch::kInt8 ? 127.0f : 448.0f;
+  const auto scale = x.abs().amax(/*dim=*/-1).clamp_min(1e-6) / max_value;
+  auto q = x / scale.unsqueeze(-1);
+  if (qtype == torch::kInt8) {
+    q = q.round().clamp(-max_value, max_value);
+  }
+  return {q.to(qtype), scale};
+}
+}  // namespace
+
+class ScaledGemmTest
+    : public ::testing::TestWithParam<std::tuple<torch::ScalarType /*qtype*/,
+                                                 torch::ScalarType /*dtype*/,
+                                                 int64_t /*n_tokens*/,
+                                                 int64_t /*in_features*/,
+                                                 int64_t /*out_features*/>> {
+ public:
+  void SetUp() override {
+    // skip test if cuda is not available
+    if (!torch::cuda::is_available()) {
+      GTEST_SKIP() << "CUDA is not available";
+    }
+  }
+};
+
+TEST_P(ScaledGemmTest, Result) {
+  const auto [qtype, dtype, n_tokens, in_features, out_features] = GetParam();
+  const auto options = torch::dtype(torch::kFloat).device(torch::kCUDA);
+
+  const auto [input, input_scale] =
+      quant_ref(torch::randn({n_tokens, in_features}, options), qtype);
+  const auto [weight, weight_scale] =
+      quant_ref(torch::randn({out_features, in_features}, options), qtype);
+  const auto bias = torch::randn({out_features}, options).to(dtype);
+  if (!can_use_scaled_gemm(input, weight)) {
+    GTEST_SKIP() << "scaled gemm not supported on this device";
+  }
+
+  const auto out = scaled_gemm(
+      input, input_scale, weight, weight_scale, bias, dtype);
+  const auto ref_out = scaled_gemm_ref(
+      input, input_scale, weight, weight_scale, bias, dtype);
+  ASSERT_EQ(out.sizes(), torch::IntArrayRef({n_tokens, out_features}));
+  EXPECT_TRUE(torch::allclose(out, ref_out, /*rtol=*/1e-2, /*atol=*/1e-2));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    ScaledGemm,
+    ScaledGemmTest,
+    ::testing::Combine(::testing::Values(torch::kInt8, torch::kFloat8_e4m3fn),
+                       ::testing::Values(torch::kHalf, torch::kBFloat16),
+                       ::testing::Values(1, 17, 128, 300),  // n_tokens
+                       ::testing::Values(64, 512, 4096),    // in_features
+                       ::testing::Values(8, 320, 1024)));   // out_features
+
+TEST(ScaledGemmTest, Unsupported) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA is not available";
+  }
+  const auto options = torch::dtype(torch::kInt8).device(torch::kCUDA);
+  // k is not a multiple of 64
+  EXPECT_FALSE(can_use_scaled_gemm(torch::ones({4, 100}, options),
+                                   torch::ones({64, 100}, options)));
+  // mismatched quant types
+  EXPECT_FALSE(can_use_scaled_gemm(
+      torch::ones({4, 64}, options),
+      torch::ones({64, 64}, options.dtype(torch::kFloat8_e4m3fn))));
+  // not quantized
+  EXPECT_FALSE(can_use_scaled_gemm(
+      torch::ones({4, 64}, options.dtype(torch::kHalf)),
+      torch::ones({64, 64}, options.dtype(torch::kHalf))));
+}
+
+}  // namespace llm
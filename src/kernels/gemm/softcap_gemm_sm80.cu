@@ -0,0 +1,27 @@
+#include "cute/numeric/numeric_types.hpp"
+#include "gemm_params.h"
+#include "softcap_gemm_kernel_sm80.cuh"
+
+namespace llm {
+
+template <typename Dtype, typename OutType>
+void run_softcap_gemm_sm80(SoftcapGemmParams& params, cudaStream_t stream) {
+  // 128x128 tiles, 3 stages of 64 k
+  using Traits = SoftcapGemmTraitsSM80<Dtype,
+                                       /*BLK_M=*/128,
+                                       /*BLK_N=*/128,
+                                       /*BLK_K=*/64,
+                                       /*STAGES=*/3>;
+  launch_softcap_gemm_kernel_sm80<Traits, OutType>(params, stream);
+}
+
+#define INSTANTIATE_SOFTCAP_GEMM_SM80(DTYPE)                         \
+  template void run_softcap_gemm_sm80<DTYPE, DTYPE>(                 \
+      SoftcapGemmParams & params, cudaStream_t stream);              \
+  template void run_softcap_gemm_sm80<DTYPE, float>(                 \
+      SoftcapGemmParams & params, cudaStream_t stream);
+
+INSTANTIATE_SOFTCAP_GEMM_SM80(cute::half_t);
+INSTANTIATE_SOFTCAP_GEMM_SM80(cute::bfloat16_t);
+
+}  // namespace llm
@@ -0,0 +1,81 @@
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+
+#include "gemm_api.h"
+
+namespace llm {
+namespace {
+// soft_cap * tanh((input @ weight.T) / soft_cap) in float
+torch::Tensor softcap_gemm_ref(const torch::Tensor& input,
+                               const torch::Tensor& weight,
+                               float soft_cap) {
+  auto out =
+      torch::matmul(input.to(torch::kFloat), weight.to(torch::kFloat).t());
+  if (soft_cap > 0.0f) {
+    out = torch::tanh(out / soft_cap) * soft_cap;
+  }
+  return out;
+}
+}  // namespace
+
+class SoftcapGemmTest
+    : public ::testing::TestWithParam<std::tuple<torch::ScalarType /*dtype*/,
+                                                 int64_t /*n_tokens*/,
+                                                 int64_t /*in_features*/,
+                                                 int64_t /*out_features*/,
+                                                 float /*soft_cap*/>> {
+ public:
+  void SetUp() override {
+    // skip test if cuda is not available
+    if (!torch::cuda::is_available()) {
+      GTEST_SKIP() << "CUDA is not available";
+    }
+  }
+};
+
+TEST_P(SoftcapGemmTest, Result) {
+  const auto [dtype, n_tokens, in_features, out_features, soft_cap] =
+      GetParam();
+  const auto options = torch::dtype(dtype).device(torch::kCUDA);
+
+  const auto input = torch::randn({n_tokens, in_features}, options);
+  const auto weight = torch::randn({out_features, in_features}, options);
+  ASSERT_TRUE(can_use_softcap_gemm(input, weight));
+
+  const auto ref_out = softcap_gemm_ref(input, weight, soft_cap);
+  for (const auto out_dtype : {torch::kFloat, dtype}) {
+    const auto out = softcap_gemm(input, weight, soft_cap, out_dtype);
+    ASSERT_EQ(out.sizes(), torch::IntArrayRef({n_tokens, out_features}));
+    ASSERT_EQ(out.scalar_type(), out_dtype);
+    EXPECT_TRUE(torch::allclose(
+        out.to(torch::kFloat), ref_out, /*rtol=*/1e-2, /*atol=*/1e-1));
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    SoftcapGemm,
+    SoftcapGemmTest,
+    ::testing::Combine(::testing::Values(torch::kHalf, torch::kBFloat16),
+                       ::testing::Values(1, 17, 128, 300),  // n_tokens
+                       ::testing::Values(64, 512, 2304),    // in_features
+                       ::testing::Values(64, 320, 1000),    // out_features
+                       ::testing::Values(0.0f, 30.0f)));    // soft_cap
+
+TEST(SoftcapGemmTest, Unsupported) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA is not available";
+  }
+  const auto options = torch::dtype(torch::kHalf).device(torch::kCUDA);
+  // in_features not aligned to 64
+  const auto input = torch::randn({4, 96}, options);
+  EXPECT_FALSE(can_use_softcap_gemm(input, torch::randn({128, 96}, options)));
+  // float32 is not supported
+  const auto aligned = torch::randn({4, 64}, options);
+  const auto weight = torch::randn({128, 64}, options);
+  EXPECT_FALSE(can_use_softcap_gemm(aligned.to(torch::kFloat),
+                                    weight.to(torch::kFloat)));
+}
+
+}  // namespace llm
@@ -1,8 +1,11 @@
 #include <ATen/cuda/CUDAContext.h>
+#include <glog/logging.h>
 #include <torch/torch.h>
 
 #include "dispatch.h"
 #include "kv_cache_kernels.h"
+#include "quant_utils.cuh"
+#include "reduce_kernel_utils.cuh"
 namespace llm::kernel {
 
 template <typename T>
@@ -10,8 +13,9 @@ __global__ void set_kv_cache_kernel(
     const int* __restrict__ slot_ids,  // [n_tokens]
     const T* __restrict__ keys,        // [n_tokens, n_heads, head_dim]
     const T* __restrict__ values,      // [n_tokens, n_heads, head_dim]
-    T* __restrict__ key_cache,         // [n_slots, n_heads, head_dim]
-    T* __restrict__ value_cache,       // [n_slots, n_heads, head_dim]
+    T* __restrict__ key_cache,         // see KVCacheStrides
+    T* __restrict__ value_cache,       // see KVCacheStrides
+    KVCacheStrides cache_strides,
     int64_t k_stride,
     int64_t v_stride,
     int64_t n_kv_heads,
@@ -21,8 +25,9 @@ __global__ void set_kv_cache_kernel(
   // which slot to write to
   const int64_t slot_id = slot_ids[bid];
 
-  // cache: [n_slots, n_heads, head_dim]
-  const int64_t head_base_idx = slot_id * n_kv_heads * head_dim;
+  const int64_t slot_base_idx =
+      (slot_id / cache_strides.block_size) * cache_strides.block_stride +
+      (slot_id % cache_strides.block_size) * cache_strides.slot_stride;
 
   // copy value one by one for the token
   for (int64_t i = threadIdx.x; i < n_kv_heads * head_dim; i += blockDim.x) {
@@ -33,22 +38,84 @@ __global__ void set_kv_cache_kernel(
     const int64_t head_idx = i / head_dim;
     // which dim within head to write to
     const int64_t head_offset = i % head_dim;
-    const int64_t dst_idx = head_base_idx + head_idx * head_dim + head_offset;
+    const int64_t dst_idx =
+        slot_base_idx + head_idx * cache_strides.head_stride + head_offset;
 
     key_cache[dst_idx] = keys[k_src_idx];
     value_cache[dst_idx] = values[v_src_idx];
   }
 }
 
+// copy 16 bytes at a time for the whole batch, keys and values in one
+// launch. consecutive threads write consecutive 16 bytes of a head, and of
+// consecutive tokens when their slots are a contiguous run in a block, e.g.
+// a prefill chunk in the slot major layout, so the runs are written with
+// fully coalesced stores without being detected explicitly.
+// all strides are in units of 16 bytes.
+__global__ void set_kv_cache_vec_kernel(
+    const int* __restrict__ slot_ids,  // [n_tokens]
+    const uint4* __restrict__ keys,    // [n_tokens, n_heads, head_dim]
+    const uint4* __restrict__ values,  // [n_tokens, n_heads, head_dim]
+    uint4* __restrict__ key_cache,     // see KVCacheStrides
+    uint4* __restrict__ value_cache,   // see KVCacheStrides
+    KVCacheStrides cache_strides,
+    int64_t k_stride,
+    int64_t v_stride,
+    int64_t n_tokens,
+    int64_t n_kv_heads,
+    int64_t head_vecs) {
+  const int64_t n = n_kv_heads * head_vecs;
+  const int64_t total = n_tokens * n;
+  for (int64_t idx = int64_t(blockIdx.x) * blockDim.x + threadIdx.x;
+       idx < total;
+       idx += int64_t(gridDim.x) * blockDim.x) {
+    const int64_t token_idx = idx / n;
+    const int64_t i = idx % n;
+    const int64_t slot_id = slot_ids[token_idx];
+    const int64_t head_idx = i / head_vecs;
+    const int64_t head_offset = i % head_vecs;
+    const int64_t dst_idx =
+        (slot_id / cache_strides.block_size) * cache_strides.block_stride +
+        (slot_id % cache_strides.block_size) * cache_strides.slot_stride +
+        head_idx * cache_strides.head_stride + head_offset;
+    key_cache[dst_idx] = keys[token_idx * k_stride + i];
+    value_cache[dst_idx] = values[token_idx * v_stride + i];
+  }
+}
+
+namespace {
+// whether the kv can be copied 16 bytes at a time
+bool can_vectorize(const torch::Tensor& keys,
+                   const torch::Tensor& values,
+                   const torch::Tensor& key_cache,
+                   const torch::Tensor& value_cache,
+                   const KVCacheStrides& cache_strides) {
+  const int64_t vec = sizeof(uint4) / keys.element_size();
+  auto aligned = [](const void* ptr) {
+    return reinterpret_cast<uintptr_t>(ptr) % sizeof(uint4) == 0;
+  };
+  return keys.size(-1) % vec == 0 && keys.stride(-3) % vec == 0 &&
+         values.stride(-3) % vec == 0 &&
+         cache_strides.block_stride % vec == 0 &&
+         cache_strides.slot_stride % vec == 0 &&
+         cache_strides.head_stride % vec == 0 && aligned(keys.data_ptr()) &&
+         aligned(values.data_ptr()) && aligned(key_cache.data_ptr()) &&
+         aligned(value_cache.data_ptr());
+}
+}  // namespace
+
 void set_kv_cache(
     const torch::Tensor& slot_ids,  // [n_tokens]
     const torch::Tensor& keys,      // [n_tokens, n_kv_heads, head_dim]
     const torch::Tensor& values,    // [n_tokens, n_kv_heads, head_dim]
-    torch::Tensor& key_cache,       // [n_slots, n_kv_heads, head_dim]
+    torch::Tensor& key_cache,       // see KVCacheStrides
     torch::Tensor& value_cache) {
   // keys and values should be continuous at n_kv_heads and head_dim dims
   CHECK(keys.stride(-1) == 1 && keys.stride(-2) == keys.size(-1));
   CHECK(values.stride(-1) == 1 && values.stride(-2) == values.size(-1));
+  CHECK(key_cache.strides() == value_cache.strides())
+      << "key and value caches should have the same layout";
+  const auto cache_strides = kv_cache_strides(key_cache);
 
   const int64_t n_tokens = keys.size(-3);
   const int64_t n_kv_heads = keys.size(-2);
@@ -57,6 +124,40 @@ void set_kv_cache(
   const int64_t k_stride = keys.stride(-3);
   const int64_t v_stride = values.stride(-3);
   const int64_t n = n_kv_heads * head_dim;
+  if (n_tokens == 0) {
+    return;
+  }
+
+  if (can_vectorize(keys, values, key_cache, value_cache, cache_strides)) {
+    const int64_t vec = sizeof(uint4) / keys.element_size();
+    KVCacheStrides vec_strides = cache_strides;
+    vec_strides.block_stride /= vec;
+    vec_strides.slot_stride /= vec;
+    vec_strides.head_stride /= vec;
+    const int64_t total = n_tokens * n / vec;
+    constexpr int kThreads = 256;
+    // at most a few waves, the threads loop over the rest
+    const int n_sms =
+        at::cuda::getCurrentDeviceProperties()->multiProcessorCount;
+    const int64_t n_blocks = std::min<int64_t>(
+        (total + kThreads - 1) / kThreads, int64_t(n_sms) * 16);
+    set_kv_cache_vec_kernel<<<n_blocks,
+                              kThreads,
+                              0,
+                              at::cuda::getCurrentCUDAStream()>>>(
+        slot_ids.data_ptr<int>(),
+        reinterpret_cast<const uint4*>(keys.const_data_ptr()),
+        reinterpret_cast<const uint4*>(values.const_data_ptr()),
+        reinterpret_cast<uint4*>(key_cache.data_ptr()),
+        reinterpret_cast<uint4*>(value_cache.data_ptr()),
+        vec_strides,
+        k_stride / vec,
+        v_stride / vec,
+        n_tokens,
+        n_kv_heads,
+        head_dim / vec);
+    return;
+  }
 
   dim3 grid(n_tokens);
   dim3 block(std::min<int>(n, 1024));
@@ -68,6 +169,7 @@ void set_kv_cache(
             values.const_data_ptr<scalar_t>(),
             key_cache.data_ptr<scalar_t>(),
             value_cache.data_ptr<scalar_t>(),
+            cache_strides,
             k_stride,
             v_stride,
             n_kv_heads,
@@ -75,4 +177,106 @@ void set_kv_cache(
   });
 }
 
+// grid: (n_tokens, n_kv_heads), each block quantizes one head of one token
+template <typename T, typename Q>
+__global__ void set_kv_cache_quant_kernel(
+    const int* __restrict__ slot_ids,  // [n_tokens]
+    const T* __restrict__ keys,        // [n_tokens, n_heads, head_dim]
+    const T* __restrict__ values,      // [n_tokens, n_heads, head_dim]
+    Q* __restrict__ key_cache,         // [n_slots, n_heads, head_dim]
+    Q* __restrict__ value_cache,       // [n_slots, n_heads, head_dim]
+    float* __restrict__ key_scale,     // [n_slots, n_heads]
+    float* __restrict__ value_scale,   // [n_slots, n_heads]
+    int64_t k_stride,
+    int64_t v_stride,
+    int64_t n_kv_heads,
+    int64_t head_dim) {
+  using Traits = QuantTraits<Q>;
+  __shared__ float s_k_scale;
+  __shared__ float s_v_scale;
+
+  const int64_t bid = blockIdx.x;
+  const int64_t head_idx = blockIdx.y;
+  const int64_t slot_id = slot_ids[bid];
+
+  const T* k_src = keys + bid * k_stride + head_idx * head_dim;
+  const T* v_src = values + bid * v_stride + head_idx * head_dim;
+
+  // find the absmax of the head
+  float k_max = 0.0f;
+  float v_max = 0.0f;
+  for (int64_t i = threadIdx.x; i < head_dim; i += blockDim.x) {
+    k_max = fmaxf(k_max, fabsf(static_cast<float>(k_src[i])));
+    v_max = fmaxf(v_max, fabsf(static_cast<float>(v_src[i])));
+  }
+  k_max = block_reduce_max<float>(k_max);
+  // the shared memory in block_reduce_max is reused
+  __syncthreads();
+  v_max = block_reduce_max<float>(v_max);
+  if (threadIdx.x == 0) {
+    s_k_scale = fmaxf(k_max / Traits::kMaxValue, kMinScale);
+    s_v_scale = fmaxf(v_max / Traits::kMaxValue, kMinScale);
+    key_scale[slot_id * n_kv_heads + head_idx] = s_k_scale;
+    value_scale[slot_id * n_kv_heads + head_idx] = s_v_scale;
+  }
+  __syncthreads();
+
+  const float k_inv_scale = 1.0f / s_k_scale;
+  const float v_inv_scale = 1.0f / s_v_scale;
+  const int64_t dst_base = (slot_id * n_kv_heads + head_idx) * head_dim;
+  for (int64_t i = threadIdx.x; i < head_dim; i += blockDim.x) {
+    key_cache[dst_base + i] =
+        Traits::quant(static_cast<float>(k_src[i]) * k_inv_scale);
+    value_cache[dst_base + i] =
+        Traits::quant(static_cast<float>(v_src[i]) * v_inv_scale);
+  }
+}
+
+void set_kv_cache_quant(
+    const torch::Tensor& slot_ids,  // [n_tokens]
+    const torch::Tensor& keys,      // [n_tokens, n_kv_heads, head_dim]
+    const torch::Tensor& values,    // [n_tokens, n_kv_heads, head_dim]
+    torch::Tensor& key_cache,       // [n_slots, n_kv_heads, head_dim]
+    torch::Tensor& value_cache,     // [n_slots, n_kv_heads, head_dim]
+    torch::Tensor& key_scale,       // [n_slots, n_kv_heads]
+    torch::Tensor& value_scale) {
+  // keys and values should be continuous at n_kv_heads and head_dim dims
+  CHECK(keys.stride(-1) == 1 && keys.stride(-2) == keys.size(-1));
+  CHECK(values.stride(-1) == 1 && values.stride(-2) == values.size(-1));
+  CHECK(key_scale.scalar_type() == torch::kFloat32);
+  // only the slot major layout is supported for quantized kv cache
+  CHECK(key_cache.dim() == 3 && key_cache.is_contiguous());
+
+  const int64_t n_tokens = keys.size(-3);
+  const int64_t n_kv_heads = keys.size(-2);
+  const int64_t head_dim = keys.size(-1);
+  const int64_t k_stride = keys.stride(-3);
+  const int64_t v_stride = values.stride(-3);
+  if (n_tokens == 0) {
+    return;
+  }
+
+  dim3 grid(n_tokens, n_kv_heads);
+  // block_reduce_max requires a multiple of warp size
+  dim3 block(std::min<int64_t>(128, (head_dim + 31) / 32 * 32));
+  auto stream = at::cuda::getCurrentCUDAStream();
+  DISPATCH_FLOATING_TYPES(keys.scalar_type(), "set_kv_cache_quant_kernel", [&] {
+    dispatch_quant_type(key_cache.scalar_type(), [&](auto q) {
+      using Q = decltype(q);
+      set_kv_cache_quant_kernel<scalar_t, Q><<<grid, block, 0, stream>>>(
+          slot_ids.data_ptr<int>(),
+          keys.const_data_ptr<scalar_t>(),
+          values.const_data_ptr<scalar_t>(),
+          reinterpret_cast<Q*>(key_cache.data_ptr()),
+          reinterpret_cast<Q*>(value_cache.data_ptr()),
+          key_scale.data_ptr<float>(),
+          value_scale.data_ptr<float>(),
+          k_stride,
+          v_stride,
+          n_kv_heads,
+          head_dim);
+    });
+  });
+}
+
 }  // namespace llm::kernel
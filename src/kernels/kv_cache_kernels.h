@@ -1,13 +1,59 @@
 #pragma once
+#include <glog/logging.h>
 #include <torch/torch.h>
 
+#include <cstdint>
+
 namespace llm::kernel {
 
+// strides of a kv cache in elements. the cache is either contiguous slots:
+// [n_slots, n_kv_heads, head_dim], or a view of the blocks with any strides:
+// [n_blocks, block_size, n_kv_heads, head_dim], e.g. of a head major cache.
+// head h of slot s starts at:
+//   (s / block_size) * block_stride + (s % block_size) * slot_stride +
+//   h * head_stride
+struct KVCacheStrides {
+  int64_t block_size = 1;
+  int64_t block_stride = 0;
+  int64_t slot_stride = 0;
+  int64_t head_stride = 0;
+};
+
+inline KVCacheStrides kv_cache_strides(const torch::Tensor& cache) {
+  CHECK(cache.dim() == 3 || cache.dim() == 4)
+      << "unexpected kv cache shape " << cache.sizes();
+  CHECK_EQ(cache.stride(-1), 1) << "head_dim of kv cache is not contiguous";
+  KVCacheStrides strides;
+  if (cache.dim() == 3) {
+    // one slot per block
+    strides.block_stride = cache.stride(0);
+    strides.head_stride = cache.stride(1);
+  } else {
+    strides.block_size = cache.size(1);
+    strides.block_stride = cache.stride(0);
+    strides.slot_stride = cache.stride(1);
+    strides.head_stride = cache.stride(2);
+  }
+  return strides;
+}
+
 void set_kv_cache(
     const torch::Tensor& slot_ids,  // [n_tokens]
     const torch::Tensor& keys,      // [n_tokens, n_kv_heads, head_dim]
     const torch::Tensor& values,    // [n_tokens, n_kv_heads, head_dim]
-    torch::Tensor& key_cache,       // [n_blocks, block_size, n_heads, head_dim]
+    torch::Tensor& key_cache,       // [n_slots, n_kv_heads, head_dim] or
+                                    // [n_blocks, block_size, n_heads, head_dim]
     torch::Tensor& value_cache);
 
+// quantize keys and values into int8/fp8 kv cache with per token per head
+// scales: scale = absmax / max_quant_value
+void set_kv_cache_quant(
+    const torch::Tensor& slot_ids,  // [n_tokens]
+    const torch::Tensor& keys,      // [n_tokens, n_kv_heads, head_dim]
+    const torch::Tensor& values,    // [n_tokens, n_kv_heads, head_dim]
+    torch::Tensor& key_cache,       // [n_slots, n_kv_heads, head_dim]
+    torch::Tensor& value_cache,     // [n_slots, n_kv_heads, head_dim]
+    torch::Tensor& key_scale,       // [n_slots, n_kv_heads]
+    torch::Tensor& value_scale);    // [n_slots, n_kv_heads]
+
 }  // namespace llm::kernel
@@ -1,11 +1,273 @@
 #include <ATen/cuda/CUDAContext.h>
 #include <torch/torch.h>
 
+#include <cstdint>
+#include <type_traits>
+
 #include "dispatch.h"
+#include "layernorm_kernels.h"
+#include "quant_utils.cuh"
 #include "reduce_kernel_utils.cuh"
 
 namespace llm::kernel {
 
+namespace {
+// 16 bytes of elements, loaded and stored with one vector instruction
+template <typename T>
+struct alignas(16) Pack {
+  static constexpr int kSize = 16 / sizeof(T);
+  T data[kSize];
+};
+
+enum class NormType : int8_t { kRMSNorm, kGemmaRMSNorm, kLayerNorm };
+
+// rows handled by one block of 32 x kWarpRowsPerBlock threads in warp mode
+constexpr int kWarpRowsPerBlock = 4;
+// max packs kept in registers by one thread
+constexpr int kMaxWarpPacks = 16;
+constexpr int kMaxBlockPacks = 8;
+// preferred number of threads per row in block mode
+constexpr int kBlockThreads = 256;
+
+// sum of val over the threads of a row: a warp or the whole block
+template <bool kWarpPerRow>
+__device__ __forceinline__ float row_reduce_sum(float val) {
+  if constexpr (kWarpPerRow) {
+    return warp_reduce_sum<float>(val);
+  } else {
+    __shared__ float s_sum;
+    val = block_reduce_sum<float>(val);
+    if (threadIdx.x == 0) {
+      s_sum = val;
+    }
+    __syncthreads();
+    return s_sum;
+  }
+}
+
+// vectorized normalization kernels, a row is handled by a warp when
+// kWarpPerRow, otherwise by a block. each thread keeps up to kPacks packs of
+// the row in registers, so that the input is only read once from global
+// memory. n must be divisible by Pack<T>::kSize and all pointers must be 16
+// bytes aligned. same rounding as the scalar kernels.
+template <typename T,
+          NormType kNorm,
+          bool kResidual,
+          bool kWarpPerRow,
+          int kPacks>
+__global__ void norm_vec_kernel(T* __restrict__ out,
+                                T* __restrict__ residual,
+                                const T* __restrict__ input,
+                                const T* __restrict__ weight,
+                                const T* __restrict__ bias,
+                                const float epsilon,
+                                int64_t n_rows,
+                                int64_t n) {
+  using P = Pack<T>;
+  const int tidx = threadIdx.x;
+  const int n_threads = blockDim.x;
+  const int64_t row =
+      kWarpPerRow ? int64_t(blockIdx.x) * blockDim.y + threadIdx.y
+                  : int64_t(blockIdx.x);
+  if (kWarpPerRow && row >= n_rows) {
+    // the whole warp exits, no block level sync in warp mode
+    return;
+  }
+
+  const int64_t n_packs = n / P::kSize;
+  const P* in_packs = reinterpret_cast<const P*>(input) + row * n_packs;
+  P* out_packs = reinterpret_cast<P*>(out) + row * n_packs;
+
+  P x[kPacks];
+  float sum = 0.0f;
+#pragma unroll
+  for (int j = 0; j < kPacks; ++j) {
+    const int64_t i = tidx + int64_t(j) * n_threads;
+    if (i < n_packs) {
+      x[j] = in_packs[i];
+      if constexpr (kResidual) {
+        P* res_packs = reinterpret_cast<P*>(residual) + row * n_packs;
+        P r = res_packs[i];
+#pragma unroll
+        for (int k = 0; k < P::kSize; ++k) {
+          r.data[k] = (T)((float)r.data[k] + (float)x[j].data[k]);
+        }
+        res_packs[i] = r;
+        x[j] = r;
+      }
+#pragma unroll
+      for (int k = 0; k < P::kSize; ++k) {
+        const float v = x[j].data[k];
+        sum += kNorm == NormType::kLayerNorm ? v : v * v;
+      }
+    }
+  }
+
+  float mean = 0.0f;
+  if constexpr (kNorm == NormType::kLayerNorm) {
+    // calculate the variance from the registers after the mean
+    mean = row_reduce_sum<kWarpPerRow>(sum) / n;
+    sum = 0.0f;
+#pragma unroll
+    for (int j = 0; j < kPacks; ++j) {
+      const int64_t i = tidx + int64_t(j) * n_threads;
+      if (i < n_packs) {
+#pragma unroll
+        for (int k = 0; k < P::kSize; ++k) {
+          const float v = (float)x[j].data[k] - mean;
+          sum += v * v;
+        }
+      }
+    }
+  }
+  const float s_variance =
+      rsqrtf(row_reduce_sum<kWarpPerRow>(sum) / n + epsilon);
+
+  const P* w_packs = reinterpret_cast<const P*>(weight);
+  const P* b_packs = reinterpret_cast<const P*>(bias);
+#pragma unroll
+  for (int j = 0; j < kPacks; ++j) {
+    const int64_t i = tidx + int64_t(j) * n_threads;
+    if (i < n_packs) {
+      const P w = w_packs[i];
+      P o;
+      if constexpr (kNorm == NormType::kRMSNorm) {
+#pragma unroll
+        for (int k = 0; k < P::kSize; ++k) {
+          const float v = x[j].data[k];
+          o.data[k] = (T)(v * s_variance) * w.data[k];
+        }
+      } else if constexpr (kNorm == NormType::kGemmaRMSNorm) {
+#pragma unroll
+        for (int k = 0; k < P::kSize; ++k) {
+          const float v = x[j].data[k];
+          o.data[k] = (T)(v * s_variance * (1.0f + (float)w.data[k]));
+        }
+      } else {
+        P b;
+        if (bias != nullptr) {
+          b = b_packs[i];
+        }
+#pragma unroll
+        for (int k = 0; k < P::kSize; ++k) {
+          float v = ((float)x[j].data[k] - mean) * s_variance *
+                    (float)w.data[k];
+          if (bias != nullptr) {
+            v += (float)b.data[k];
+          }
+          o.data[k] = (T)v;
+        }
+      }
+      out_packs[i] = o;
+    }
+  }
+}
+
+bool is_pack_aligned(const torch::Tensor& t) {
+  return !t.defined() || reinterpret_cast<uintptr_t>(t.data_ptr()) % 16 == 0;
+}
+
+// calls fn with the smallest packs per thread bucket holding n_packs
+template <typename Fn>
+void dispatch_packs(int64_t n_packs, Fn&& fn) {
+  if (n_packs <= 1) {
+    fn(std::integral_constant<int, 1>{});
+  } else if (n_packs <= 2) {
+    fn(std::integral_constant<int, 2>{});
+  } else if (n_packs <= 4) {
+    fn(std::integral_constant<int, 4>{});
+  } else if (n_packs <= 8) {
+    fn(std::integral_constant<int, 8>{});
+  } else {
+    CHECK_LE(n_packs, kMaxWarpPacks);
+    fn(std::integral_constant<int, 16>{});
+  }
+}
+
+// launches the vectorized kernel for the normalization, returns false if the
+// shape or the alignment of the tensors doesn't allow it.
+template <NormType kNorm, bool kResidual>
+bool launch_norm_vec(torch::Tensor& out,
+                     torch::Tensor residual,
+                     const torch::Tensor& input,
+                     const torch::Tensor& weight,
+                     const torch::Tensor& bias,
+                     float epsilon,
+                     NormImpl impl) {
+  if (impl == NormImpl::kScalar) {
+    return false;
+  }
+  const int64_t n_rows = input.size(0);
+  const int64_t n = input.size(1);
+  const int64_t pack_size = 16 / input.element_size();
+  if (n_rows == 0 || n % pack_size != 0 || !is_pack_aligned(out) ||
+      !is_pack_aligned(residual) || !is_pack_aligned(input) ||
+      !is_pack_aligned(weight) || !is_pack_aligned(bias)) {
+    return false;
+  }
+  const int64_t n_packs = n / pack_size;
+  const int64_t warp_packs = (n_packs + 31) / 32;
+
+  bool warp_per_row = impl == NormImpl::kWarpPerRow;
+  if (impl == NormImpl::kAuto) {
+    // one warp per row avoids the block level syncs, but only pays off when
+    // there are enough rows to occupy all SMs, otherwise spreading a row over
+    // a block gives more loads in flight.
+    const int64_t n_sms =
+        at::cuda::getCurrentDeviceProperties()->multiProcessorCount;
+    warp_per_row = n_rows >= 2 * n_sms * kWarpRowsPerBlock;
+  }
+  // the row doesn't fit into the registers of a warp
+  warp_per_row = warp_per_row && warp_packs <= kMaxWarpPacks;
+
+  dim3 grid;
+  dim3 block;
+  int64_t packs_per_thread = 0;
+  if (warp_per_row) {
+    grid = dim3((n_rows + kWarpRowsPerBlock - 1) / kWarpRowsPerBlock);
+    block = dim3(32, kWarpRowsPerBlock);
+    packs_per_thread = warp_packs;
+  } else {
+    // use more packs per thread for wider rows to keep the block small
+    packs_per_thread = 1;
+    while (packs_per_thread < kMaxBlockPacks &&
+           n_packs > packs_per_thread * kBlockThreads) {
+      packs_per_thread *= 2;
+    }
+    const int64_t n_threads =
+        (n_packs + packs_per_thread - 1) / packs_per_thread;
+    // round up to a multiple of warps for the block reduction
+    const int64_t block_size = (n_threads + 31) / 32 * 32;
+    if (block_size > 1024) {
+      return false;
+    }
+    grid = dim3(n_rows);
+    block = dim3(block_size);
+  }
+
+  auto stream = at::cuda::getCurrentCUDAStream();
+  DISPATCH_FLOATING_TYPES(input.scalar_type(), "norm_vec_kernel", [&] {
+    dispatch_packs(packs_per_thread, [&](auto packs) {
+      constexpr int kPacks = decltype(packs)::value;
+      auto kernel =
+          warp_per_row
+              ? norm_vec_kernel<scalar_t, kNorm, kResidual, true, kPacks>
+              : norm_vec_kernel<scalar_t, kNorm, kResidual, false, kPacks>;
+      kernel<<<grid, block, 0, stream>>>(
+          out.data_ptr<scalar_t>(),
+          kResidual ? residual.data_ptr<scalar_t>() : nullptr,
+          input.data_ptr<scalar_t>(),
+          weight.data_ptr<scalar_t>(),
+          bias.defined() ? bias.data_ptr<scalar_t>() : nullptr,
+          epsilon,
+          n_rows,
+          n);
+    });
+  });
+  return true;
+}
+}  // namespace
+
 // calculate the root mean square norm.
 // equation: x -> w * x / sqrt(E[x^2] + eps)
 // The mean is calculated over the last dimension
@@ -43,10 +305,22 @@ __global__ void rms_norm_kernel(T* __restrict__ out,
 void rms_norm(torch::Tensor& out,
               torch::Tensor input,
               torch::Tensor weight,
-              float epsilon) {
+              float epsilon,
+              NormImpl impl) {
   DCHECK(input.is_contiguous()) << "input tensor must be contiguous";
   DCHECK(out.is_contiguous()) << "output tensor must be contiguous";
 
+  if (launch_norm_vec<NormType::kRMSNorm, /*kResidual=*/false>(
+          out,
+          /*residual=*/torch::Tensor(),
+          input,
+          weight,
+          /*bias=*/torch::Tensor(),
+          epsilon,
+          impl)) {
+    return;
+  }
+
   const int64_t n = input.size(1);
 
   dim3 grid(input.size(0));
@@ -97,10 +371,22 @@ __global__ void gemma_rms_norm_kernel(T* __restrict__ out,
 void gemma_rms_norm(torch::Tensor& out,
                     torch::Tensor input,
                     torch::Tensor weight,
-                    float epsilon) {
+                    float epsilon,
+                    NormImpl impl) {
   DCHECK(input.is_contiguous()) << "input tensor must be contiguous";
   DCHECK(out.is_contiguous()) << "output tensor must be contiguous";
 
+  if (launch_norm_vec<NormType::kGemmaRMSNorm, /*kResidual=*/false>(
+          out,
+          /*residual=*/torch::Tensor(),
+          input,
+          weight,
+          /*bias=*/torch::Tensor(),
+          epsilon,
+          impl)) {
+    return;
+  }
+
   const int64_t n = input.size(1);
 
   dim3 grid(input.size(0));
@@ -158,11 +444,17 @@ void rms_norm_residual(torch::Tensor& out,
                        torch::Tensor& residual,
                        torch::Tensor input,
                        torch::Tensor weight,
-                       float epsilon) {
+                       float epsilon,
+                       NormImpl impl) {
   DCHECK(input.is_contiguous()) << "input tensor must be contiguous";
   DCHECK(out.is_contiguous()) << "output tensor must be contiguous";
   DCHECK(residual.is_contiguous()) << "residual tensor must be contiguous";
 
+  if (launch_norm_vec<NormType::kRMSNorm, /*kResidual=*/true>(
+          out, residual, input, weight, torch::Tensor(), epsilon, impl)) {
+    return;
+  }
+
   const int64_t n = input.size(1);
 
   dim3 grid(input.size(0));
@@ -179,6 +471,102 @@ void rms_norm_residual(torch::Tensor& out,
   });
 }
 
+// add the residual in place, then normalize and quantize the output with
+// per token scales in one pass: scale = absmax(out) / max_quant_value.
+// the first layer has no residual, the input is copied into it instead.
+template <typename T, typename Q>
+__global__ void rms_norm_residual_quant_kernel(Q* __restrict__ out,
+                                               float* __restrict__ scale,
+                                               T* __restrict__ residual,
+                                               const T* __restrict__ input,
+                                               const T* __restrict__ weight,
+                                               bool add_residual,
+                                               const float epsilon,
+                                               int64_t n) {
+  using Traits = QuantTraits<Q>;
+  const auto tidx = threadIdx.x;
+  const auto bidx = blockIdx.x;
+
+  __shared__ float s_variance;
+  __shared__ float s_inv_scale;
+  float variance = 0.0f;
+
+  for (int64_t i = tidx; i < n; i += blockDim.x) {
+    const int64_t idx = bidx * n + i;
+    float x = input[idx];
+    if (add_residual) {
+      x += (float)residual[idx];
+    }
+    residual[idx] = x;
+    variance += x * x;
+  }
+  variance = block_reduce_sum<float>(variance);
+  if (tidx == 0) {
+    s_variance = rsqrtf(variance / n + epsilon);
+  }
+  __syncthreads();
+
+  // output before quantization, same rounding as rms_norm_residual
+  auto norm = [&](int64_t i) {
+    const float x = residual[bidx * n + i];
+    return (float)((T)(x * s_variance) * weight[i]);
+  };
+
+  float absmax = 0.0f;
+  for (int64_t i = tidx; i < n; i += blockDim.x) {
+    absmax = fmaxf(absmax, fabsf(norm(i)));
+  }
+  absmax = block_reduce_max<float>(absmax);
+  if (tidx == 0) {
+    const float s = fmaxf(absmax / Traits::kMaxValue, kMinScale);
+    scale[bidx] = s;
+    s_inv_scale = 1.0f / s;
+  }
+  __syncthreads();
+
+  for (int64_t i = tidx; i < n; i += blockDim.x) {
+    out[bidx * n + i] = Traits::quant(norm(i) * s_inv_scale);
+  }
+}
+
+void rms_norm_residual_quant(torch::Tensor& out,
+                             torch::Tensor& scale,
+                             torch::Tensor& residual,
+                             torch::Tensor input,
+                             torch::Tensor weight,
+                             float epsilon) {
+  DCHECK(input.is_contiguous()) << "input tensor must be contiguous";
+  DCHECK(out.is_contiguous()) << "output tensor must be contiguous";
+
+  const bool add_residual = residual.defined();
+  if (!add_residual) {
+    residual = torch::empty_like(input);
+  }
+  DCHECK(residual.is_contiguous()) << "residual tensor must be contiguous";
+
+  const int64_t n = input.size(1);
+
+  dim3 grid(input.size(0));
+  dim3 block(std::min<int>(n, 1024));
+  auto stream = at::cuda::getCurrentCUDAStream();
+  DISPATCH_FLOATING_TYPES(
+      input.scalar_type(), "rms_norm_residual_quant_kernel", [&] {
+        dispatch_quant_type(out.scalar_type(), [&](auto q) {
+          using Q = decltype(q);
+          rms_norm_residual_quant_kernel<scalar_t, Q>
+              <<<grid, block, 0, stream>>>(
+                  reinterpret_cast<Q*>(out.data_ptr()),
+                  scale.data_ptr<float>(),
+                  residual.data_ptr<scalar_t>(),
+                  input.data_ptr<scalar_t>(),
+                  weight.data_ptr<scalar_t>(),
+                  add_residual,
+                  epsilon,
+                  n);
+        });
+      });
+}
+
 // equation: x -> (x - E[x]) / sqrt(Var[x] + eps) * w + b
 // The mean and standard-deviation are calculated over the last dimension
 template <typename T>
@@ -231,10 +619,16 @@ void layer_norm(torch::Tensor& out,
                 torch::Tensor input,
                 torch::Tensor weight,
                 torch::Tensor bias,
-                float epsilon) {
+                float epsilon,
+                NormImpl impl) {
   DCHECK(input.is_contiguous()) << "input tensor must be contiguous";
   DCHECK(out.is_contiguous()) << "output tensor must be contiguous";
 
+  if (launch_norm_vec<NormType::kLayerNorm, /*kResidual=*/false>(
+          out, torch::Tensor(), input, weight, bias, epsilon, impl)) {
+    return;
+  }
+
   const int64_t n = input.size(1);
 
   dim3 grid(input.size(0));
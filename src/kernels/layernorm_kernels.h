@@ -3,26 +3,47 @@
 
 namespace llm::kernel {
 
+// kernels of the normalizations below, kAuto picks one for the shape.
+// kWarpPerRow and kBlockPerRow are vectorized with 16 bytes accesses and keep
+// the row in registers, they fall back to kScalar when the hidden size or the
+// tensors are not 16 bytes aligned.
+enum class NormImpl : int8_t { kAuto, kScalar, kWarpPerRow, kBlockPerRow };
+
 void rms_norm(torch::Tensor& out,
               torch::Tensor input,
               torch::Tensor weight,
-              float epsilon);
+              float epsilon,
+              NormImpl impl = NormImpl::kAuto);
 
 void gemma_rms_norm(torch::Tensor& out,
                     torch::Tensor input,
                     torch::Tensor weight,
-                    float epsilon);
+                    float epsilon,
+                    NormImpl impl = NormImpl::kAuto);
 
 void rms_norm_residual(torch::Tensor& out,
                        torch::Tensor& residual,
                        torch::Tensor input,
                        torch::Tensor weight,
-                       float epsilon);
+                       float epsilon,
+                       NormImpl impl = NormImpl::kAuto);
+
+// fused residual add, rms norm and per token int8/fp8 quantization
+// out: [n_tokens, dim] int8 or fp8, scale: [n_tokens] float
+// residual is updated in place to residual + input, an undefined residual is
+// allocated and set to input.
+void rms_norm_residual_quant(torch::Tensor& out,
+                             torch::Tensor& scale,
+                             torch::Tensor& residual,
+                             torch::Tensor input,
+                             torch::Tensor weight,
+                             float epsilon);
 
 void layer_norm(torch::Tensor& out,
                 torch::Tensor input,
                 torch::Tensor weight,
                 torch::Tensor bias,
-                float epsilon);
+                float epsilon,
+                NormImpl impl = NormImpl::kAuto);
 
 }  // namespace llm::kernel
@@ -0,0 +1,143 @@
+#include <ATen/cuda/CUDAContext.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include "dispatch.h"
+#include "lora_kernels.h"
+#include "reduce_kernel_utils.cuh"
+
+namespace llm::kernel {
+
+namespace {
+// number of ranks computed by each thread block of lora_shrink
+constexpr int kShrinkWarps = 4;
+// number of output features computed by each thread block of lora_expand
+constexpr int kExpandThreads = 256;
+}  // namespace
+
+// one warp per (token, rank), the dot product is accumulated in float
+template <typename T>
+__global__ void lora_shrink_kernel(T* __restrict__ out,
+                                   const T* __restrict__ input,
+                                   const T* __restrict__ lora_a,
+                                   const int* __restrict__ slots,
+                                   int rank,
+                                   int64_t in_features) {
+  const int64_t token = blockIdx.x;
+  const int warp = threadIdx.x / 32;
+  const int lane = threadIdx.x % 32;
+  const int r = blockIdx.y * kShrinkWarps + warp;
+  if (r >= rank) {
+    return;
+  }
+  const int slot = slots[token];
+  float acc = 0.0f;
+  if (slot >= 0) {
+    const T* x = input + token * in_features;
+    const T* a = lora_a + (int64_t(slot) * rank + r) * in_features;
+    for (int64_t i = lane; i < in_features; i += 32) {
+      acc += (float)x[i] * (float)a[i];
+    }
+    acc = warp_reduce_sum(acc);
+  }
+  if (lane == 0) {
+    out[token * rank + r] = static_cast<T>(acc);
+  }
+}
+
+// one thread per (token, output feature), the token's input is staged in
+// shared memory and the rows of lora_b are read coalesced
+template <typename T>
+__global__ void lora_expand_kernel(T* __restrict__ out,
+                                   const T* __restrict__ input,
+                                   const T* __restrict__ lora_b,
+                                   const int* __restrict__ slots,
+                                   int rank,
+                                   int64_t out_features) {
+  extern __shared__ float s_input[];
+  const int64_t token = blockIdx.x;
+  const int slot = slots[token];
+  if (slot < 0) {
+    // same for the whole block
+    return;
+  }
+  for (int r = threadIdx.x; r < rank; r += blockDim.x) {
+    s_input[r] = (float)input[token * rank + r];
+  }
+  __syncthreads();
+
+  const int64_t o = int64_t(blockIdx.y) * blockDim.x + threadIdx.x;
+  if (o >= out_features) {
+    return;
+  }
+  const T* b = lora_b + int64_t(slot) * rank * out_features + o;
+  float acc = 0.0f;
+  for (int r = 0; r < rank; ++r) {
+    acc += s_input[r] * (float)b[r * out_features];
+  }
+  T* dst = out + token * out_features + o;
+  *dst = static_cast<T>((float)*dst + acc);
+}
+
+void lora_shrink(torch::Tensor& out,
+                 torch::Tensor input,
+                 torch::Tensor lora_a,
+                 torch::Tensor slots) {
+  DCHECK(out.is_contiguous()) << "output tensor must be contiguous";
+  DCHECK(input.is_contiguous()) << "input tensor must be contiguous";
+  DCHECK(lora_a.is_contiguous()) << "lora_a must be contiguous";
+  const int64_t n_tokens = input.size(0);
+  const int64_t in_features = input.size(1);
+  const int rank = static_cast<int>(lora_a.size(1));
+  CHECK_EQ(lora_a.size(2), in_features);
+  CHECK_EQ(out.size(1), rank);
+  if (n_tokens == 0 || rank == 0) {
+    return;
+  }
+
+  dim3 grid(n_tokens, (rank + kShrinkWarps - 1) / kShrinkWarps);
+  dim3 block(kShrinkWarps * 32);
+  auto stream = at::cuda::getCurrentCUDAStream();
+  DISPATCH_FLOATING_TYPES(input.scalar_type(), "lora_shrink_kernel", [&] {
+    lora_shrink_kernel<scalar_t><<<grid, block, 0, stream>>>(
+        out.data_ptr<scalar_t>(),
+        input.data_ptr<scalar_t>(),
+        lora_a.data_ptr<scalar_t>(),
+        slots.data_ptr<int>(),
+        rank,
+        in_features);
+  });
+}
+
+void lora_expand(torch::Tensor& out,
+                 torch::Tensor input,
+                 torch::Tensor lora_b,
+                 torch::Tensor slots) {
+  DCHECK(out.is_contiguous()) << "output tensor must be contiguous";
+  DCHECK(input.is_contiguous()) << "input tensor must be contiguous";
+  DCHECK(lora_b.is_contiguous()) << "lora_b must be contiguous";
+  const int64_t n_tokens = out.size(0);
+  const int64_t out_features = out.size(1);
+  const int rank = static_cast<int>(lora_b.size(1));
+  CHECK_EQ(lora_b.size(2), out_features);
+  CHECK_EQ(input.size(1), rank);
+  if (n_tokens == 0 || rank == 0) {
+    return;
+  }
+
+  dim3 grid(n_tokens, (out_features + kExpandThreads - 1) / kExpandThreads);
+  dim3 block(kExpandThreads);
+  const size_t smem_size = rank * sizeof(float);
+  auto stream = at::cuda::getCurrentCUDAStream();
+  DISPATCH_FLOATING_TYPES(out.scalar_type(), "lora_expand_kernel", [&] {
+    lora_expand_kernel<scalar_t><<<grid, block, smem_size, stream>>>(
+        out.data_ptr<scalar_t>(),
+        input.data_ptr<scalar_t>(),
+        lora_b.data_ptr<scalar_t>(),
+        slots.data_ptr<int>(),
+        rank,
+        out_features);
+  });
+}
+
+}  // namespace llm::kernel
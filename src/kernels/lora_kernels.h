@@ -0,0 +1,31 @@
+#pragma once
+#include <torch/torch.h>
+
+namespace llm::kernel {
+
+// Batched gather matmuls for the lora adapters of a mixed batch, each token
+// reads the adapter weights of its own slot, so tokens of different adapters
+// run in a single pass. tokens of a sequence read the same slot one after
+// another, which keeps its weights in cache for prefill segments.
+// slots: [n_tokens] int32, the slot of the adapter of each token, tokens
+//   with a negative slot are skipped.
+
+// shrink the input to the lora rank:
+// out[t] = lora_a[slots[t]] @ input[t], zeros for skipped tokens
+// out: [n_tokens, rank], input: [n_tokens, in_features]
+// lora_a: [n_slots, rank, in_features]
+void lora_shrink(torch::Tensor& out,
+                 torch::Tensor input,
+                 torch::Tensor lora_a,
+                 torch::Tensor slots);
+
+// expand from the lora rank and accumulate into the output in place:
+// out[t] += input[t] @ lora_b[slots[t]]
+// out: [n_tokens, out_features], input: [n_tokens, rank]
+// lora_b: [n_slots, rank, out_features]
+void lora_expand(torch::Tensor& out,
+                 torch::Tensor input,
+                 torch::Tensor lora_b,
+                 torch::Tensor slots);
+
+}  // namespace llm::kernel
@@ -0,0 +1,260 @@
+#include <ATen/cuda/CUDAContext.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <cfloat>
+
+#include "dispatch.h"
+#include "moe_kernels.h"
+
+namespace llm::kernel {
+
+// one thread per token, the experts are kept sorted by weight in registers
+template <typename T>
+__global__ void topk_softmax_kernel(float* __restrict__ topk_weights,
+                                    int* __restrict__ topk_ids,
+                                    const T* __restrict__ gating_logits,
+                                    int n_tokens,
+                                    int n_experts,
+                                    int topk,
+                                    bool renormalize) {
+  const int token = blockIdx.x * blockDim.x + threadIdx.x;
+  if (token >= n_tokens) {
+    return;
+  }
+  const T* logits = gating_logits + int64_t(token) * n_experts;
+
+  float max_logit = -FLT_MAX;
+  for (int e = 0; e < n_experts; ++e) {
+    max_logit = fmaxf(max_logit, (float)logits[e]);
+  }
+  float sum = 0.0f;
+  for (int e = 0; e < n_experts; ++e) {
+    sum += __expf((float)logits[e] - max_logit);
+  }
+
+  float weights[kMaxMoETopK];
+  int ids[kMaxMoETopK];
+  for (int i = 0; i < topk; ++i) {
+    weights[i] = -1.0f;
+    ids[i] = -1;
+  }
+  for (int e = 0; e < n_experts; ++e) {
+    const float w = __expf((float)logits[e] - max_logit);
+    if (w <= weights[topk - 1]) {
+      continue;
+    }
+    // insert into the sorted list, ties keep the lower expert id first
+    int i = topk - 1;
+    for (; i > 0 && weights[i - 1] < w; --i) {
+      weights[i] = weights[i - 1];
+      ids[i] = ids[i - 1];
+    }
+    weights[i] = w;
+    ids[i] = e;
+  }
+
+  float topk_sum = 0.0f;
+  for (int i = 0; i < topk; ++i) {
+    topk_sum += weights[i];
+  }
+  const float scale = 1.0f / (renormalize ? topk_sum : sum);
+  for (int i = 0; i < topk; ++i) {
+    topk_weights[int64_t(token) * topk + i] = weights[i] * scale;
+    topk_ids[int64_t(token) * topk + i] = ids[i];
+  }
+}
+
+// number of rows of each expert
+__global__ void moe_count_kernel(int* __restrict__ counts,
+                                 const int* __restrict__ topk_ids,
+                                 int64_t n_ids,
+                                 int n_experts) {
+  const int64_t idx = int64_t(blockIdx.x) * blockDim.x + threadIdx.x;
+  if (idx < n_ids) {
+    const int e = topk_ids[idx];
+    if (e >= 0 && e < n_experts) {
+      atomicAdd(&counts[e], 1);
+    }
+  }
+}
+
+// exclusive scan of the counts with a single thread, the counts become the
+// next free row of each expert
+__global__ void moe_offsets_kernel(int* __restrict__ offsets,
+                                   int* __restrict__ counts,
+                                   int n_experts) {
+  int offset = 0;
+  for (int e = 0; e < n_experts; ++e) {
+    offsets[e] = offset;
+    offset += counts[e];
+    counts[e] = offsets[e];
+  }
+  offsets[n_experts] = offset;
+}
+
+// one thread block per token, claim a row for each selected expert and copy
+// the token into the rows
+template <typename T>
+__global__ void moe_scatter_kernel(T* __restrict__ permuted,
+                                   int* __restrict__ inv_perm,
+                                   int* __restrict__ next_rows,
+                                   const T* __restrict__ input,
+                                   const int* __restrict__ topk_ids,
+                                   int topk,
+                                   int n_experts,
+                                   int64_t dim) {
+  __shared__ int s_rows[kMaxMoETopK];
+  const int64_t token = blockIdx.x;
+  const int tidx = threadIdx.x;
+  if (tidx < topk) {
+    const int64_t idx = token * topk + tidx;
+    const int e = topk_ids[idx];
+    const int row =
+        (e >= 0 && e < n_experts) ? atomicAdd(&next_rows[e], 1) : -1;
+    s_rows[tidx] = row;
+    inv_perm[idx] = row;
+  }
+  __syncthreads();
+
+  const T* src = input + token * dim;
+  for (int k = 0; k < topk; ++k) {
+    const int row = s_rows[k];
+    if (row < 0) {
+      continue;
+    }
+    T* dst = permuted + int64_t(row) * dim;
+    for (int64_t i = tidx; i < dim; i += blockDim.x) {
+      dst[i] = src[i];
+    }
+  }
+}
+
+// one thread block per token
+template <typename T>
+__global__ void moe_combine_kernel(T* __restrict__ out,
+                                   const T* __restrict__ expert_out,
+                                   const float* __restrict__ topk_weights,
+                                   const int* __restrict__ inv_perm,
+                                   int topk,
+                                   int64_t dim) {
+  const int64_t token = blockIdx.x;
+  const float* weights = topk_weights + token * topk;
+  const int* rows = inv_perm + token * topk;
+  for (int64_t i = threadIdx.x; i < dim; i += blockDim.x) {
+    float acc = 0.0f;
+    for (int k = 0; k < topk; ++k) {
+      const int row = rows[k];
+      if (row >= 0) {
+        acc += weights[k] * (float)expert_out[int64_t(row) * dim + i];
+      }
+    }
+    out[token * dim + i] = static_cast<T>(acc);
+  }
+}
+
+void topk_softmax(torch::Tensor& topk_weights,
+                  torch::Tensor& topk_ids,
+                  torch::Tensor gating_logits,
+                  bool renormalize) {
+  DCHECK(gating_logits.is_contiguous()) << "logits must be contiguous";
+  const int n_tokens = static_cast<int>(gating_logits.size(0));
+  const int n_experts = static_cast<int>(gating_logits.size(1));
+  const int topk = static_cast<int>(topk_ids.size(1));
+  CHECK(topk > 0 && topk <= kMaxMoETopK && topk <= n_experts)
+      << "unsupported topk " << topk;
+  if (n_tokens == 0) {
+    return;
+  }
+
+  const int threads = 128;
+  dim3 grid((n_tokens + threads - 1) / threads);
+  dim3 block(threads);
+  auto stream = at::cuda::getCurrentCUDAStream();
+  DISPATCH_FLOATING_TYPES(
+      gating_logits.scalar_type(), "topk_softmax_kernel", [&] {
+        topk_softmax_kernel<scalar_t><<<grid, block, 0, stream>>>(
+            topk_weights.data_ptr<float>(),
+            topk_ids.data_ptr<int>(),
+            gating_logits.data_ptr<scalar_t>(),
+            n_tokens,
+            n_experts,
+            topk,
+            renormalize);
+      });
+}
+
+void moe_permute(torch::Tensor& permuted,
+                 torch::Tensor& expert_offsets,
+                 torch::Tensor& inv_perm,
+                 torch::Tensor input,
+                 torch::Tensor topk_ids,
+                 int64_t n_experts) {
+  DCHECK(input.is_contiguous()) << "input tensor must be contiguous";
+  DCHECK(topk_ids.is_contiguous()) << "topk ids must be contiguous";
+  const int64_t n_tokens = input.size(0);
+  const int64_t dim = input.size(1);
+  const int topk = static_cast<int>(topk_ids.size(1));
+  CHECK(topk > 0 && topk <= kMaxMoETopK) << "unsupported topk " << topk;
+
+  auto stream = at::cuda::getCurrentCUDAStream();
+  auto next_rows = torch::zeros({n_experts}, topk_ids.options());
+  const int64_t n_ids = n_tokens * topk;
+  if (n_ids > 0) {
+    const int threads = 256;
+    moe_count_kernel<<<(n_ids + threads - 1) / threads, threads, 0, stream>>>(
+        next_rows.data_ptr<int>(),
+        topk_ids.data_ptr<int>(),
+        n_ids,
+        static_cast<int>(n_experts));
+  }
+  moe_offsets_kernel<<<1, 1, 0, stream>>>(expert_offsets.data_ptr<int>(),
+                                          next_rows.data_ptr<int>(),
+                                          static_cast<int>(n_experts));
+  if (n_tokens == 0) {
+    return;
+  }
+
+  dim3 grid(n_tokens);
+  dim3 block(std::max<int>(topk, std::min<int64_t>(dim, 256)));
+  DISPATCH_FLOATING_TYPES(input.scalar_type(), "moe_scatter_kernel", [&] {
+    moe_scatter_kernel<scalar_t><<<grid, block, 0, stream>>>(
+        permuted.data_ptr<scalar_t>(),
+        inv_perm.data_ptr<int>(),
+        next_rows.data_ptr<int>(),
+        input.data_ptr<scalar_t>(),
+        topk_ids.data_ptr<int>(),
+        topk,
+        static_cast<int>(n_experts),
+        dim);
+  });
+}
+
+void moe_combine(torch::Tensor& out,
+                 torch::Tensor expert_out,
+                 torch::Tensor topk_weights,
+                 torch::Tensor inv_perm) {
+  DCHECK(out.is_contiguous()) << "output tensor must be contiguous";
+  DCHECK(expert_out.is_contiguous()) << "expert output must be contiguous";
+  const int64_t n_tokens = out.size(0);
+  const int64_t dim = out.size(1);
+  const int topk = static_cast<int>(topk_weights.size(1));
+  if (n_tokens == 0) {
+    return;
+  }
+
+  dim3 grid(n_tokens);
+  dim3 block(std::min<int64_t>(dim, 1024));
+  auto stream = at::cuda::getCurrentCUDAStream();
+  DISPATCH_FLOATING_TYPES(out.scalar_type(), "moe_combine_kernel", [&] {
+    moe_combine_kernel<scalar_t><<<grid, block, 0, stream>>>(
+        out.data_ptr<scalar_t>(),
+        expert_out.data_ptr<scalar_t>(),
+        topk_weights.data_ptr<float>(),
+        inv_perm.data_ptr<int>(),
+        topk,
+        dim);
+  });
+}
+
+}  // namespace llm::kernel
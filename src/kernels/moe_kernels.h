@@ -0,0 +1,40 @@
+#pragma once
+#include <torch/torch.h>
+
+namespace llm::kernel {
+
+// max number of experts selected per token
+inline constexpr int kMaxMoETopK = 16;
+
+// softmax over the gating logits followed by the top k experts per token,
+// the weights are renormalized to sum up to 1 if renormalize is set.
+// gating_logits: [n_tokens, n_experts]
+// topk_weights: [n_tokens, topk] float, topk_ids: [n_tokens, topk] int32
+void topk_softmax(torch::Tensor& topk_weights,
+                  torch::Tensor& topk_ids,
+                  torch::Tensor gating_logits,
+                  bool renormalize);
+
+// gather the tokens into rows sorted by expert, one row per selected expert.
+// ids outside of [0, n_experts) are skipped, e.g. experts on other ranks.
+// topk_ids: [n_tokens, topk] int32, input: [n_tokens, dim]
+// permuted: [n_tokens * topk, dim], rows after the last expert are unused
+// expert_offsets: [n_experts + 1] int32, rows of expert e in permuted are
+//   [expert_offsets[e], expert_offsets[e + 1])
+// inv_perm: [n_tokens * topk] int32, row of (token, k) in permuted or -1
+void moe_permute(torch::Tensor& permuted,
+                 torch::Tensor& expert_offsets,
+                 torch::Tensor& inv_perm,
+                 torch::Tensor input,
+                 torch::Tensor topk_ids,
+                 int64_t n_experts);
+
+// weighted sum of the expert outputs of each token, accumulated in float:
+// out[t] = sum_k topk_weights[t, k] * expert_out[inv_perm[t * topk + k]]
+// out: [n_tokens, dim], expert_out: [n_tokens * topk, dim]
+void moe_combine(torch::Tensor& out,
+                 torch::Tensor expert_out,
+                 torch::Tensor topk_weights,
+                 torch::Tensor inv_perm);
+
+}  // namespace llm::kernel
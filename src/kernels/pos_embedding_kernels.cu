@@ -2,18 +2,68 @@
 #include <torch/torch.h>
 
 #include "dispatch.h"
+#include "kv_cache_kernels.h"
 #include "pos_embedding_kernels.h"
 
 namespace llm::kernel {
 
+// data[idx] plus bias[idx] if the bias is given
+template <typename T>
+__device__ __forceinline__ T add_bias(const T* __restrict__ data,
+                                      const T* __restrict__ bias,
+                                      int64_t idx) {
+  return bias == nullptr ? data[idx] : (T)(data[idx] + bias[idx]);
+}
+
+// cos and sin of the rotary pair idx on the position. the cached positions
+// are read from the cos/sin cache, the ones beyond are computed from the
+// inverse frequency.
+template <typename T>
+struct RotaryCosSin {
+  const T* __restrict__ cos_sin;       // [n_cached, 2, n]
+  const float* __restrict__ inv_freq;  // [n]
+  int64_t n_cached;
+  float attention_factor;
+
+  __device__ __forceinline__ void get(int pos,
+                                      int64_t idx,
+                                      int64_t n,
+                                      T* c,
+                                      T* s) const {
+    if (pos < n_cached) {
+      const T* cos = cos_sin + pos * 2 * n;
+      *c = cos[idx];
+      *s = cos[n + idx];
+    } else {
+      float cos_v = 0;
+      float sin_v = 0;
+      sincosf(static_cast<float>(pos) * inv_freq[idx], &sin_v, &cos_v);
+      *c = (T)(cos_v * attention_factor);
+      *s = (T)(sin_v * attention_factor);
+    }
+  }
+};
+
+template <typename T>
+RotaryCosSin<T> rotary_cos_sin(const torch::Tensor& cos_sin,
+                               const torch::Tensor& inv_freq,
+                               float attention_factor) {
+  return {cos_sin.const_data_ptr<T>(),
+          inv_freq.const_data_ptr<float>(),
+          cos_sin.size(0),
+          attention_factor};
+}
+
 template <typename T>
 struct RotaryEmbedding {
   // apply rotary embedding to data on position idx
   // x -> x * cos - y * sin
   // y -> x * sin + y * cos
+  // the bias, if not null, is added to data before the rotation
   static __device__ __forceinline__ void apply(T* __restrict__ data,
-                                               const T* __restrict__ cos,
-                                               const T* __restrict__ sin,
+                                               const T* __restrict__ bias,
+                                               T c,
+                                               T s,
                                                int idx,
                                                int n,
                                                bool interleaved) {
@@ -21,24 +71,26 @@ struct RotaryEmbedding {
     // rotated: x = data[idx], y = data[idx + rotary_dim / 2]
     const int x_idx = interleaved ? 2 * idx : idx;
     const int y_idx = interleaved ? 2 * idx + 1 : idx + n;
-    const T x = data[x_idx];
-    const T y = data[y_idx];
-    const T c = cos[idx];
-    const T s = sin[idx];
+    const T x = add_bias(data, bias, x_idx);
+    const T y = add_bias(data, bias, y_idx);
     data[x_idx] = x * c - y * s;
     data[y_idx] = x * s + y * c;
   }
 };
 
 // inplace update query and key
+// each head has n_sections sections of rotary_dim dims, section s is rotated
+// with positions[token, s], e.g. the 2D rotary of chatglm-6b. the dims after
+// the sections are not rotated.
 template <typename T>
 __global__ void rotary_embedding_kernel(
     T* __restrict__ querys,             // [n_tokens, n_heads, head_dim]
     T* __restrict__ keys,               // [n_tokens, n_kv_heads, head_dim]
-    const int* __restrict__ positions,  // [n_tokens]
-    const T* __restrict__ cos_sin,      // [max_positions, 2, rotary_dim/2]
+    const int* __restrict__ positions,  // [n_tokens, n_sections]
+    RotaryCosSin<T> cos_sin,
     int64_t head_dim,
     int64_t rotary_dim,
+    int64_t n_sections,
     int64_t n_heads,
     int64_t n_kv_heads,
     int64_t q_stride,
@@ -47,36 +99,40 @@ __global__ void rotary_embedding_kernel(
   const int tidx = threadIdx.x;
   const int bidx = blockIdx.x;
 
-  // figure out cos sin base ptr for the token
+  // number of rotary pairs per section
   const int64_t n = rotary_dim / 2;
-  const T* cos_sin_base = cos_sin + positions[bidx] * rotary_dim;
-  const T* cos = cos_sin_base;
-  const T* sin = cos_sin_base + n;
+  const int* token_positions = positions + bidx * n_sections;
 
   // apply rotary embedding to query head by head
   // q base ptr for the token
   T* q_base = querys + bidx * q_stride;
-  for (int64_t i = tidx; i < n_heads * n; i += blockDim.x) {
+  for (int64_t i = tidx; i < n_heads * n_sections * n; i += blockDim.x) {
     // head idx
-    const int64_t h_idx = i / n;
-    // rotary idx within head
+    const int64_t h_idx = i / (n_sections * n);
+    // section idx within head
+    const int64_t s_idx = (i / n) % n_sections;
+    // rotary idx within section
     const int64_t r_idx = i % n;
-    // q ptr for the head
-    T* q = q_base + h_idx * head_dim;
-    RotaryEmbedding<T>::apply(q, cos, sin, r_idx, n, interleaved);
+    // cos sin for the position of the section
+    T c, s;
+    cos_sin.get(token_positions[s_idx], r_idx, n, &c, &s);
+    // q ptr for the section
+    T* q = q_base + h_idx * head_dim + s_idx * rotary_dim;
+    RotaryEmbedding<T>::apply(q, nullptr, c, s, r_idx, n, interleaved);
   }
 
   // apply rotary embedding to key head by head
   // k base ptr for the token
   T* k_base = keys + bidx * k_stride;
-  for (int64_t i = tidx; i < n_kv_heads * n; i += blockDim.x) {
-    // head idx
-    const int64_t h_idx = i / n;
-    // rotary idx within head
+  for (int64_t i = tidx; i < n_kv_heads * n_sections * n; i += blockDim.x) {
+    const int64_t h_idx = i / (n_sections * n);
+    const int64_t s_idx = (i / n) % n_sections;
     const int64_t r_idx = i % n;
-    // k ptr for the head
-    T* k = k_base + h_idx * head_dim;
-    RotaryEmbedding<T>::apply(k, cos, sin, r_idx, n, interleaved);
+    T c, s;
+    cos_sin.get(token_positions[s_idx], r_idx, n, &c, &s);
+    // k ptr for the section
+    T* k = k_base + h_idx * head_dim + s_idx * rotary_dim;
+    RotaryEmbedding<T>::apply(k, nullptr, c, s, r_idx, n, interleaved);
   }
 }
 
@@ -84,13 +140,18 @@ __global__ void rotary_embedding_kernel(
 void apply_rotary_pos_emb(
     torch::Tensor& querys,           // [n_tokens, n_heads, head_dim]
     torch::Tensor& keys,             // [n_tokens, n_kv_heads, head_dim]
-    const torch::Tensor& positions,  // [n_tokens]
-    const torch::Tensor& cos_sin,    // [max_positions, 2, rotary_dim/2]
+    const torch::Tensor& positions,  // [n_tokens] or [n_tokens, n_sections]
+    const torch::Tensor& cos_sin,    // [n_cached, 2, rotary_dim/2]
+    const torch::Tensor& inv_freq,   // [rotary_dim/2]
+    float attention_factor,
     int rotary_dim,
     bool interleaved) {
   // keys and values should be continuous at n_kv_heads and head_dim dims
   CHECK(querys.stride(-1) == 1 && querys.stride(-2) == querys.size(-1));
   CHECK(keys.stride(-1) == 1 && keys.stride(-2) == keys.size(-1));
+  CHECK(positions.is_contiguous());
+  CHECK(cos_sin.is_contiguous() && inv_freq.is_contiguous());
+  CHECK(inv_freq.scalar_type() == torch::kFloat32);
 
   const int64_t n_tokens = querys.size(-3);
   const int64_t n_heads = querys.size(-2);
@@ -98,18 +159,21 @@ void apply_rotary_pos_emb(
   const int64_t head_dim = querys.size(-1);
   const int64_t q_stride = querys.stride(-3);
   const int64_t k_stride = keys.stride(-3);
+  const int64_t n_sections = positions.dim() == 2 ? positions.size(1) : 1;
+  CHECK_LE(n_sections * rotary_dim, head_dim);
 
   const dim3 grid(n_tokens);
-  const dim3 block(std::min<int>(1024, n_heads * rotary_dim) / 2);
+  const dim3 block(std::min<int>(1024, n_heads * n_sections * rotary_dim) / 2);
   DISPATCH_FLOATING_TYPES(querys.scalar_type(), "rotary_embedding_kernel", [&] {
     rotary_embedding_kernel<scalar_t>
         <<<grid, block, 0, at::cuda::getCurrentCUDAStream()>>>(
             querys.data_ptr<scalar_t>(),
             keys.data_ptr<scalar_t>(),
             positions.data_ptr<int>(),
-            cos_sin.data_ptr<scalar_t>(),
+            rotary_cos_sin<scalar_t>(cos_sin, inv_freq, attention_factor),
             head_dim,
             rotary_dim,
+            n_sections,
             n_heads,
             n_kv_heads,
             q_stride,
@@ -118,4 +182,170 @@ void apply_rotary_pos_emb(
   });
 }
 
+// rotate query inplace, and write rotated key and value into the kv cache.
+// the bias of the qkv projection, if given, is added to all of them first.
+// see rotary_embedding_kernel for the sections.
+template <typename T>
+__global__ void rotary_embedding_set_kv_cache_kernel(
+    T* __restrict__ querys,              // [n_tokens, n_heads, head_dim]
+    const T* __restrict__ keys,          // [n_tokens, n_kv_heads, head_dim]
+    const T* __restrict__ values,        // [n_tokens, n_kv_heads, head_dim]
+    const int* __restrict__ positions,   // [n_tokens, n_sections]
+    RotaryCosSin<T> cos_sin,
+    const int* __restrict__ slot_ids,    // [n_tokens]
+    T* __restrict__ key_cache,           // see KVCacheStrides
+    T* __restrict__ value_cache,         // see KVCacheStrides
+    const T* __restrict__ qkv_bias,      // [(n_heads + 2*n_kv_heads)*head_dim]
+    KVCacheStrides cache_strides,
+    int64_t head_dim,
+    int64_t rotary_dim,
+    int64_t n_sections,
+    int64_t n_heads,
+    int64_t n_kv_heads,
+    int64_t q_stride,
+    int64_t k_stride,
+    int64_t v_stride,
+    bool interleaved) {
+  const int tidx = threadIdx.x;
+  const int bidx = blockIdx.x;
+
+  // number of rotary pairs per section
+  const int64_t n = rotary_dim / 2;
+  const int* token_positions = positions + bidx * n_sections;
+
+  const T* q_bias = qkv_bias;
+  const T* k_bias = qkv_bias == nullptr ? nullptr : q_bias + n_heads * head_dim;
+  const T* v_bias =
+      qkv_bias == nullptr ? nullptr : k_bias + n_kv_heads * head_dim;
+
+  // apply rotary embedding to query head by head
+  T* q_base = querys + bidx * q_stride;
+  for (int64_t i = tidx; i < n_heads * n_sections * n; i += blockDim.x) {
+    const int64_t h_idx = i / (n_sections * n);
+    const int64_t s_idx = (i / n) % n_sections;
+    const int64_t r_idx = i % n;
+    T c, s;
+    cos_sin.get(token_positions[s_idx], r_idx, n, &c, &s);
+    const int64_t offset = h_idx * head_dim + s_idx * rotary_dim;
+    T* q = q_base + offset;
+    const T* b = q_bias == nullptr ? nullptr : q_bias + offset;
+    RotaryEmbedding<T>::apply(q, b, c, s, r_idx, n, interleaved);
+  }
+  // add the bias to the query dims without rotation
+  const int64_t rotated_dim = n_sections * rotary_dim;
+  const int64_t pass_dim = head_dim - rotated_dim;
+  if (q_bias != nullptr && pass_dim > 0) {
+    for (int64_t i = tidx; i < n_heads * pass_dim; i += blockDim.x) {
+      const int64_t idx =
+          (i / pass_dim) * head_dim + rotated_dim + i % pass_dim;
+      q_base[idx] = add_bias(q_base, q_bias, idx);
+    }
+  }
+
+  // each thread writes one rotated element of key and the value
+  const T* k_base = keys + bidx * k_stride;
+  const T* v_base = values + bidx * v_stride;
+  const int64_t slot_id = slot_ids[bidx];
+  const int64_t dst_base =
+      (slot_id / cache_strides.block_size) * cache_strides.block_stride +
+      (slot_id % cache_strides.block_size) * cache_strides.slot_stride;
+  for (int64_t i = tidx; i < n_kv_heads * head_dim; i += blockDim.x) {
+    const int64_t d = i % head_dim;
+    const int64_t dst_idx =
+        dst_base + (i / head_dim) * cache_strides.head_stride + d;
+    T key = add_bias(k_base, k_bias, i);
+    if (d < rotated_dim) {
+      // x -> x * cos - y * sin
+      // y -> x * sin + y * cos
+      const int64_t s_idx = d / rotary_dim;
+      const int64_t sd = d % rotary_dim;
+      // k ptr for the section
+      const T* k = k_base + (i - sd);
+      const T* b = k_bias == nullptr ? nullptr : k_bias + (i - sd);
+      const bool is_x = interleaved ? sd % 2 == 0 : sd < n;
+      const int64_t r_idx = interleaved ? sd / 2 : sd % n;
+      const int64_t x_idx = interleaved ? 2 * r_idx : r_idx;
+      const int64_t y_idx = interleaved ? 2 * r_idx + 1 : r_idx + n;
+      const T x = add_bias(k, b, x_idx);
+      const T y = add_bias(k, b, y_idx);
+      T c, s;
+      cos_sin.get(token_positions[s_idx], r_idx, n, &c, &s);
+      key = is_x ? x * c - y * s : x * s + y * c;
+    }
+    key_cache[dst_idx] = key;
+    value_cache[dst_idx] = add_bias(v_base, v_bias, i);
+  }
+}
+
+// apply rotary embedding to query inplace, and write the rotated key and
+// value into kv cache in one pass. key is not modified.
+// the qkv bias is optional, it is added to query, key and value first.
+void apply_rotary_pos_emb_set_kv_cache(
+    torch::Tensor& querys,           // [n_tokens, n_heads, head_dim]
+    const torch::Tensor& keys,       // [n_tokens, n_kv_heads, head_dim]
+    const torch::Tensor& values,     // [n_tokens, n_kv_heads, head_dim]
+    const torch::Tensor& positions,  // [n_tokens] or [n_tokens, n_sections]
+    const torch::Tensor& cos_sin,    // [n_cached, 2, rotary_dim/2]
+    const torch::Tensor& inv_freq,   // [rotary_dim/2]
+    float attention_factor,
+    int rotary_dim,
+    bool interleaved,
+    const torch::Tensor& slot_ids,  // [n_tokens]
+    torch::Tensor& key_cache,       // see KVCacheStrides
+    torch::Tensor& value_cache,     // see KVCacheStrides
+    const torch::Tensor& qkv_bias) {
+  // query, key and value should be continuous at n_heads and head_dim dims
+  CHECK(querys.stride(-1) == 1 && querys.stride(-2) == querys.size(-1));
+  CHECK(keys.stride(-1) == 1 && keys.stride(-2) == keys.size(-1));
+  CHECK(values.stride(-1) == 1 && values.stride(-2) == values.size(-1));
+  CHECK(!qkv_bias.defined() || qkv_bias.is_contiguous());
+  CHECK(positions.is_contiguous());
+  CHECK(cos_sin.is_contiguous() && inv_freq.is_contiguous());
+  CHECK(inv_freq.scalar_type() == torch::kFloat32);
+  CHECK(key_cache.strides() == value_cache.strides())
+      << "key and value caches should have the same layout";
+  const auto cache_strides = kv_cache_strides(key_cache);
+
+  const int64_t n_tokens = querys.size(-3);
+  const int64_t n_heads = querys.size(-2);
+  const int64_t n_kv_heads = keys.size(-2);
+  const int64_t head_dim = querys.size(-1);
+  const int64_t q_stride = querys.stride(-3);
+  const int64_t k_stride = keys.stride(-3);
+  const int64_t v_stride = values.stride(-3);
+  const int64_t n_sections = positions.dim() == 2 ? positions.size(1) : 1;
+  CHECK_LE(n_sections * rotary_dim, head_dim);
+  if (qkv_bias.defined()) {
+    CHECK_EQ(qkv_bias.numel(), (n_heads + 2 * n_kv_heads) * head_dim);
+  }
+
+  const dim3 grid(n_tokens);
+  const dim3 block(std::min<int>(1024, n_kv_heads * head_dim));
+  DISPATCH_FLOATING_TYPES(
+      querys.scalar_type(), "rotary_embedding_set_kv_cache_kernel", [&] {
+        rotary_embedding_set_kv_cache_kernel<scalar_t>
+            <<<grid, block, 0, at::cuda::getCurrentCUDAStream()>>>(
+                querys.data_ptr<scalar_t>(),
+                keys.const_data_ptr<scalar_t>(),
+                values.const_data_ptr<scalar_t>(),
+                positions.data_ptr<int>(),
+                rotary_cos_sin<scalar_t>(cos_sin, inv_freq, attention_factor),
+                slot_ids.data_ptr<int>(),
+                key_cache.data_ptr<scalar_t>(),
+                value_cache.data_ptr<scalar_t>(),
+                qkv_bias.defined() ? qkv_bias.const_data_ptr<scalar_t>()
+                                   : nullptr,
+                cache_strides,
+                head_dim,
+                rotary_dim,
+                n_sections,
+                n_heads,
+                n_kv_heads,
+                q_stride,
+                k_stride,
+                v_stride,
+                interleaved);
+      });
+}
+
 }  // namespace llm::kernel
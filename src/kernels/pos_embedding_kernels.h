@@ -3,13 +3,40 @@
 
 namespace llm::kernel {
 
-// apply rotary embedding to query and key inplace
+// apply rotary embedding to query and key inplace. with 2D positions, each
+// head has n_sections sections of rotary_dim dims, and section s is rotated
+// with positions[:, s], e.g. the 2D rotary of chatglm-6b. the dims after the
+// rotary dims are not rotated.
+// cos and sin of the positions in [0, cos_sin.size(0)) are read from the
+// cos/sin cache, the ones of the positions beyond are computed from inv_freq
+// and scaled by attention_factor, the same scale as the cached ones.
 void apply_rotary_pos_emb(
     torch::Tensor& query,            // [n_tokens, n_heads, head_dim]
     torch::Tensor& key,              // [n_tokens, n_kv_heads, head_dim]
-    const torch::Tensor& positions,  // [n_tokens]
-    const torch::Tensor& cos_sin,    // [max_positions, 2, rotary_dim/2]
+    const torch::Tensor& positions,  // [n_tokens] or [n_tokens, n_sections]
+    const torch::Tensor& cos_sin,    // [n_cached, 2, rotary_dim/2]
+    const torch::Tensor& inv_freq,   // [rotary_dim/2] float32
+    float attention_factor,
     int rotary_dim,
     bool interleaved);
 
+// apply rotary embedding to query inplace, and write the rotated key and
+// value into kv cache slots in one pass. key is not modified.
+// qkv_bias is the optional bias of the qkv projection, which is added to
+// query, key and value before the rotation, undefined if no bias.
+void apply_rotary_pos_emb_set_kv_cache(
+    torch::Tensor& query,            // [n_tokens, n_heads, head_dim]
+    const torch::Tensor& key,        // [n_tokens, n_kv_heads, head_dim]
+    const torch::Tensor& value,      // [n_tokens, n_kv_heads, head_dim]
+    const torch::Tensor& positions,  // [n_tokens] or [n_tokens, n_sections]
+    const torch::Tensor& cos_sin,    // [n_cached, 2, rotary_dim/2]
+    const torch::Tensor& inv_freq,   // [rotary_dim/2] float32
+    float attention_factor,
+    int rotary_dim,
+    bool interleaved,
+    const torch::Tensor& slot_ids,  // [n_tokens]
+    torch::Tensor& key_cache,       // [n_slots, n_kv_heads, head_dim]
+    torch::Tensor& value_cache,     // [n_slots, n_kv_heads, head_dim]
+    const torch::Tensor& qkv_bias);  // [(n_heads + 2*n_kv_heads)*head_dim]
+
 }  // namespace llm::kernel
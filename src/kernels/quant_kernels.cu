@@ -0,0 +1,63 @@
+#include <ATen/cuda/CUDAContext.h>
+#include <torch/torch.h>
+
+#include "dispatch.h"
+#include "quant_utils.cuh"
+#include "reduce_kernel_utils.cuh"
+
+namespace llm::kernel {
+
+// one thread block per token
+template <typename T, typename Q>
+__global__ void per_token_quant_kernel(Q* __restrict__ out,
+                                       float* __restrict__ scale,
+                                       const T* __restrict__ input,
+                                       int64_t n) {
+  using Traits = QuantTraits<Q>;
+  const auto tidx = threadIdx.x;
+  const auto bidx = blockIdx.x;
+
+  __shared__ float s_inv_scale;
+
+  float absmax = 0.0f;
+  for (int64_t i = tidx; i < n; i += blockDim.x) {
+    absmax = fmaxf(absmax, fabsf((float)input[bidx * n + i]));
+  }
+  absmax = block_reduce_max<float>(absmax);
+  if (tidx == 0) {
+    const float s = fmaxf(absmax / Traits::kMaxValue, kMinScale);
+    scale[bidx] = s;
+    s_inv_scale = 1.0f / s;
+  }
+  __syncthreads();
+
+  for (int64_t i = tidx; i < n; i += blockDim.x) {
+    const int64_t idx = bidx * n + i;
+    out[idx] = Traits::quant((float)input[idx] * s_inv_scale);
+  }
+}
+
+void per_token_quant(torch::Tensor& out,
+                     torch::Tensor& scale,
+                     torch::Tensor input) {
+  DCHECK(input.is_contiguous()) << "input tensor must be contiguous";
+  DCHECK(out.is_contiguous()) << "output tensor must be contiguous";
+
+  const int64_t n = input.size(1);
+
+  dim3 grid(input.size(0));
+  dim3 block(std::min<int>(n, 1024));
+  auto stream = at::cuda::getCurrentCUDAStream();
+  DISPATCH_FLOATING_TYPES(input.scalar_type(), "per_token_quant_kernel", [&] {
+    dispatch_quant_type(out.scalar_type(), [&](auto q) {
+      using Q = decltype(q);
+      per_token_quant_kernel<scalar_t, Q><<<grid, block, 0, stream>>>(
+          reinterpret_cast<Q*>(out.data_ptr()),
+          scale.data_ptr<float>(),
+          input.data_ptr<scalar_t>(),
+          n);
+    });
+  });
+}
+
+}  // namespace llm::kernel
@@ -0,0 +1,12 @@
+#pragma once
+#include <torch/torch.h>
+
+namespace llm::kernel {
+
+// dynamic per token int8/fp8 quantization: scale = absmax / max_quant_value
+// out: [n_tokens, dim] int8 or fp8, scale: [n_tokens] float
+void per_token_quant(torch::Tensor& out,
+                     torch::Tensor& scale,
+                     torch::Tensor input);
+
+}  // namespace llm::kernel
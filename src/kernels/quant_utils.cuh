@@ -0,0 +1,54 @@
+#pragma once
+#include <cuda_fp8.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+namespace llm::kernel {
+
+// the minimal scale to avoid division by zero
+constexpr float kMinScale = 1e-8f;
+
+template <typename Q>
+struct QuantTraits;
+
+template <>
+struct QuantTraits<int8_t> {
+  static constexpr float kMaxValue = 127.0f;
+
+  static __device__ __forceinline__ int8_t quant(float x) {
+    const int v = __float2int_rn(x);
+    return static_cast<int8_t>(max(-127, min(127, v)));
+  }
+
+  static __device__ __forceinline__ float dequant(int8_t x) {
+    return static_cast<float>(x);
+  }
+};
+
+template <>
+struct QuantTraits<__nv_fp8_e4m3> {
+  static constexpr float kMaxValue = 448.0f;
+
+  static __device__ __forceinline__ __nv_fp8_e4m3 quant(float x) {
+    // saturate to finite values
+    return __nv_fp8_e4m3(fminf(fmaxf(x, -kMaxValue), kMaxValue));
+  }
+
+  static __device__ __forceinline__ float dequant(__nv_fp8_e4m3 x) {
+    return static_cast<float>(x);
+  }
+};
+
+// dispatch the quantized type: int8 or fp8 (e4m3)
+template <typename Func>
+void dispatch_quant_type(torch::ScalarType type, Func&& func) {
+  if (type == torch::kInt8) {
+    func(int8_t{});
+  } else if (type == torch::kFloat8_e4m3fn) {
+    func(__nv_fp8_e4m3{});
+  } else {
+    LOG(FATAL) << "Unsupported quantized type: " << type;
+  }
+}
+
+}  // namespace llm::kernel
@@ -14,6 +14,19 @@ void fp16_int4_gemm(const torch::Tensor& A,  // (m, k)
                     int sms = -1,
                     int max_par = 8);
 
+// 2:4 sparse weights, only the 2 kept weights of every 4 are stored with
+// the 2-bit metadata of their positions.
+void fp16_int4_sparse_gemm(const torch::Tensor& A,     // (m, k)
+                           const torch::Tensor& B,     // (k/32, n*16/8)
+                           const torch::Tensor& meta,  // (k/32, n*2)
+                           torch::Tensor& C,           // (m, n)
+                           const torch::Tensor& s,     // (n_groups, n)
+                           torch::Tensor& workspace,
+                           int thread_k = -1,
+                           int thread_m = -1,
+                           int sms = -1,
+                           int max_par = 16);
+
 void gptq_gemm(const torch::Tensor& A,  // (m, k)
                const torch::Tensor& B,  // (k, n) => (k/16, n*16/8)
                torch::Tensor& C,        // (m, n)
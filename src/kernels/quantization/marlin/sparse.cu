@@ -17,9 +17,12 @@
 
 // Adapted from https://github.com/IST-DASLab/Sparse-Marlin
 
+#include <ATen/cuda/CUDAContext.h>
 #include <cuda.h>
 #include <cuda_fp16.h>
 #include <cuda_runtime.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
 
 namespace marlin {
 
@@ -1180,4 +1183,53 @@ int marlin_sparse(const void* A,
   return ret;
 }
 
-}  // namespace marlin
\ No newline at end of file
+void fp16_int4_sparse_gemm(const torch::Tensor& A,     // (m, k)
+                           const torch::Tensor& B,     // (k/32, n*16/8)
+                           const torch::Tensor& meta,  // (k/32, n*2)
+                           torch::Tensor& C,           // (m, n)
+                           const torch::Tensor& s,     // (n_groups, n)
+                           torch::Tensor& workspace,
+                           int thread_k,
+                           int thread_m,
+                           int sms,
+                           int max_par) {
+  // (m, k) x (k, n) = (m, n), the kernel calls the batch n and the output m
+  int prob_n = A.size(0);
+  int prob_m = C.size(1);
+  int prob_k = A.size(1);
+  // half of the weights are pruned, the groups are counted on the kept ones
+  // s: (k/2/groupsize, n) => groupsize = k / 2 / s.size(0)
+  int groupsize = (s.size(0) == 1) ? -1 : prob_k / 2 / s.size(0);
+  CHECK(groupsize == -1 || groupsize * s.size(0) == prob_k / 2)
+      << "k=" << prob_k << " not compatible with " << s.size(0) << " groups.";
+  CHECK_GE(workspace.numel(), prob_m / 128 * max_par)
+      << "workspace must be of size at least " << prob_m / 128 * max_par
+      << ".";
+
+  int dev = A.get_device();
+  const int err = marlin_sparse(A.data_ptr(),
+                                B.data_ptr(),
+                                meta.data_ptr(),
+                                C.data_ptr(),
+                                s.data_ptr(),
+                                prob_m,
+                                prob_n,
+                                prob_k,
+                                workspace.data_ptr(),
+                                groupsize,
+                                dev,
+                                at::cuda::getCurrentCUDAStream(dev),
+                                thread_k,
+                                thread_m,
+                                sms,
+                                max_par);
+  CHECK(err != ERR_PROB_SHAPE)
+      << "Problem (m=" << prob_n << ", n=" << prob_m << ", k=" << prob_k
+      << ") not compatible with thread_k=" << thread_k
+      << ", thread_m=" << thread_m << ".";
+  CHECK(err != ERR_KERN_SHAPE)
+      << "No kernel implementation for thread_k=" << thread_k
+      << ", thread_m=" << thread_m << ", groupsize=" << groupsize << ".";
+}
+
+}  // namespace marlin
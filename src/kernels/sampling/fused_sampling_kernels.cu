@@ -0,0 +1,226 @@
+#include <ATen/cuda/CUDAContext.h>
+#include <ATen/cuda/CUDAGraphsUtils.cuh>
+#include <curand_kernel.h>
+#include <torch/torch.h>
+
+#include <cub/cub.cuh>
+
+#include "../dispatch.h"
+#include "pivot_sampling.cuh"
+#include "sampling_kernels.h"
+
+namespace llm::kernel {
+
+namespace {
+template <typename T>
+const T* data_ptr_or_null(const torch::Tensor& t) {
+  return t.defined() ? t.data_ptr<T>() : nullptr;
+}
+
+torch::Tensor to_float(const torch::Tensor& t) {
+  return t.defined() ? t.to(torch::kFloat32).contiguous() : t;
+}
+
+}  // namespace
+
+// each thread block handles one sequence with following steps:
+// 1> apply penalties to the unique tokens in place
+// 2> find the max logit, which is also the greedy sample
+// 3> draw from softmax(logits / temperature) filtered by top_k and top_p
+//    with pivot search, see pivot_sample for details.
+template <typename T, int BLOCK_SIZE>
+__global__ void fused_sampling_kernel(
+    long* __restrict__ output_ids,
+    T* __restrict__ logits,
+    const int* __restrict__ sample_idxes,
+    const long* __restrict__ token_ids,
+    const int* __restrict__ token_counts,
+    const int* __restrict__ token_ids_lens,
+    const float* __restrict__ frequency_penalties,
+    const float* __restrict__ presence_penalties,
+    const float* __restrict__ repetition_penalties,
+    const float* __restrict__ temperatures,
+    const long* __restrict__ top_ks,
+    const float* __restrict__ top_ps,
+    const bool* __restrict__ do_sample,
+    const long* __restrict__ rng_seeds,
+    const long* __restrict__ rng_offsets,
+    int max_unique_tokens,
+    int vocab_size,
+    at::PhiloxCudaState philox_args) {
+  using ArgMaxPair = cub::KeyValuePair<int, float>;
+  using BlockReduceArgMax = cub::BlockReduce<ArgMaxPair, BLOCK_SIZE>;
+  using BlockReduceFloat = cub::BlockReduce<float, BLOCK_SIZE>;
+  __shared__ union {
+    typename BlockReduceArgMax::TempStorage argmax;
+    typename BlockReduceFloat::TempStorage reduce_float;
+  } temp_storage;
+  // shared variables used to broadcast results from thread 0
+  __shared__ float s_value;
+  __shared__ int s_token;
+
+  const int tid = threadIdx.x;
+  const int seq_idx = blockIdx.x;
+  const int row = sample_idxes[seq_idx];
+  // move the pointer to the start of the row
+  logits += static_cast<int64_t>(row) * vocab_size;
+
+  // 1> apply frequency, presence then repetition penalties
+  if (token_ids != nullptr) {
+    const int len = token_ids_lens[row];
+    for (int i = tid; i < len; i += BLOCK_SIZE) {
+      const int idx = row * max_unique_tokens + i;
+      const long token_id = token_ids[idx];
+      const int token_count = token_counts[idx];
+      float logit = logits[token_id];
+      if (frequency_penalties != nullptr && token_count > 0) {
+        logit -= token_count * frequency_penalties[row];
+      }
+      if (presence_penalties != nullptr && token_count > 0) {
+        logit -= presence_penalties[row];
+      }
+      if (repetition_penalties != nullptr) {
+        const float penalty = repetition_penalties[row];
+        logit = logit < 0.0f ? logit * penalty : logit / penalty;
+      }
+      logits[token_id] = logit;
+    }
+    __syncthreads();
+  }
+
+  // 2> find the max logit
+  ArgMaxPair thread_max(0, -INFINITY);
+  for (int i = tid; i < vocab_size; i += BLOCK_SIZE) {
+    const float logit = logits[i];
+    if (logit > thread_max.value) {
+      thread_max = ArgMaxPair(i, logit);
+    }
+  }
+  const ArgMaxPair block_max =
+      BlockReduceArgMax(temp_storage.argmax).Reduce(thread_max, cub::ArgMax());
+  if (tid == 0) {
+    s_token = block_max.key;
+    s_value = block_max.value;
+  }
+  __syncthreads();
+  const int greedy_token = s_token;
+  const float max_logit = s_value;
+
+  const bool sample = do_sample != nullptr && do_sample[seq_idx];
+  if (!sample) {
+    if (tid == 0) {
+      output_ids[seq_idx] = greedy_token;
+    }
+    return;
+  }
+
+  // replace 0 with 1 to avoid division by 0
+  const float temperature = temperatures != nullptr ? temperatures[row] : 1.0f;
+  const float inv_temperature = temperature == 0.0f ? 1.0f : 1.0f / temperature;
+  // unnormalized probability of each token
+  auto prob_of = [&](int i) {
+    return __expf((static_cast<float>(logits[i]) - max_logit) *
+                  inv_temperature);
+  };
+
+  float thread_sum = 0.0f;
+  for (int i = tid; i < vocab_size; i += BLOCK_SIZE) {
+    thread_sum += prob_of(i);
+  }
+  __syncthreads();
+  const float block_sum =
+      BlockReduceFloat(temp_storage.reduce_float).Sum(thread_sum);
+  if (tid == 0) {
+    s_value = block_sum;
+  }
+  __syncthreads();
+  const float prob_sum = s_value;
+
+  curandStatePhilox4_32_10_t state;
+  if (tid == 0) {
+    init_philox_state(philox_args,
+                      rng_seeds,
+                      rng_offsets,
+                      row,
+                      /*subsequence=*/seq_idx,
+                      &state);
+  }
+
+  // 3> draw from probs filtered by top_k and top_p
+  const long top_k = top_ks != nullptr ? top_ks[row] : 0;
+  const float top_p = top_ps != nullptr ? top_ps[row] : 1.0f;
+  const int token = pivot_sample<BLOCK_SIZE>(
+      prob_of, vocab_size, prob_sum, top_k, top_p, greedy_token, &state);
+  if (tid == 0) {
+    output_ids[seq_idx] = token;
+  }
+}
+
+void invoke_fused_sampling(torch::Tensor& output_ids,
+                           torch::Tensor& logits,
+                           const torch::Tensor& sample_idxes,
+                           const torch::Tensor& token_ids,
+                           const torch::Tensor& token_counts,
+                           const torch::Tensor& token_ids_lens,
+                           const torch::Tensor& frequency_penalties,
+                           const torch::Tensor& presence_penalties,
+                           const torch::Tensor& repetition_penalties,
+                           const torch::Tensor& temperatures,
+                           const torch::Tensor& top_ks,
+                           const torch::Tensor& top_ps,
+                           const torch::Tensor& do_sample,
+                           const torch::Tensor& rng_seeds,
+                           const torch::Tensor& rng_offsets) {
+  DCHECK(logits.is_contiguous()) << "logits tensor must be contiguous";
+  DCHECK(!token_ids.defined() || token_ids.is_contiguous())
+      << "token_ids tensor must be contiguous";
+
+  const int num_seqs = sample_idxes.size(0);
+  const int vocab_size = logits.size(1);
+  const int max_unique_tokens = token_ids.defined() ? token_ids.size(1) : 0;
+  DCHECK_EQ(output_ids.size(0), num_seqs);
+
+  // penalties and filters are small, keep them in float32
+  const auto freq = to_float(frequency_penalties);
+  const auto presence = to_float(presence_penalties);
+  const auto repetition = to_float(repetition_penalties);
+  const auto temps = to_float(temperatures);
+  const auto top_p = to_float(top_ps);
+  const auto top_k =
+      top_ks.defined() ? top_ks.to(torch::kLong).contiguous() : top_ks;
+  const auto sample =
+      do_sample.defined() ? do_sample.to(torch::kBool).contiguous() : do_sample;
+  const auto seeds = to_long(rng_seeds);
+  const auto offsets = to_long(rng_offsets);
+
+  const auto philox_args = pivot_sample_philox_state();
+
+  // each thread block handles one sequence
+  constexpr int kBlockSize = 1024;
+  dim3 grid(num_seqs);
+  dim3 block(kBlockSize);
+  DISPATCH_FLOATING_TYPES(logits.scalar_type(), "fused_sampling_kernel", [&] {
+    fused_sampling_kernel<scalar_t, kBlockSize>
+        <<<grid, block, 0, at::cuda::getCurrentCUDAStream()>>>(
+            output_ids.data_ptr<long>(),
+            logits.data_ptr<scalar_t>(),
+            sample_idxes.data_ptr<int>(),
+            data_ptr_or_null<long>(token_ids),
+            data_ptr_or_null<int>(token_counts),
+            data_ptr_or_null<int>(token_ids_lens),
+            data_ptr_or_null<float>(freq),
+            data_ptr_or_null<float>(presence),
+            data_ptr_or_null<float>(repetition),
+            data_ptr_or_null<float>(temps),
+            data_ptr_or_null<long>(top_k),
+            data_ptr_or_null<float>(top_p),
+            data_ptr_or_null<bool>(sample),
+            data_ptr_or_null<long>(seeds),
+            data_ptr_or_null<long>(offsets),
+            max_unique_tokens,
+            vocab_size,
+            philox_args);
+  });
+}
+
+}  // namespace llm::kernel
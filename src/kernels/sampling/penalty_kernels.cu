@@ -181,4 +181,80 @@ void apply_frequency_presence_penalty(torch::Tensor& logits,
       });
 }
 
+template <typename T>
+__global__ void apply_logit_bias_kernel(T* __restrict__ logits,
+                                        const long* __restrict__ token_ids,
+                                        const T* __restrict__ biases,
+                                        const int* __restrict__ lens,
+                                        const bool* __restrict__ exclusive,
+                                        int max_len,
+                                        int vocab_size) {
+  // biased logits of the allowed tokens of exclusive rows
+  extern __shared__ float biased_logits[];
+  const int tid = threadIdx.x;
+  // batch idx
+  const int bid = blockIdx.x;
+  const int len = lens[bid];
+  // move the pointers to the start of the batch
+  logits += static_cast<int64_t>(bid) * vocab_size;
+  token_ids += bid * max_len;
+  biases += bid * max_len;
+
+  if (!exclusive[bid]) {
+    for (int i = tid; i < len; i += blockDim.x) {
+      const long token_id = token_ids[i];
+      logits[token_id] = (float)logits[token_id] + (float)biases[i];
+    }
+    return;
+  }
+
+  // only the tokens with a bias are allowed: save their biased logits, mask
+  // out the whole row, then restore them.
+  for (int i = tid; i < len; i += blockDim.x) {
+    biased_logits[i] = (float)logits[token_ids[i]] + (float)biases[i];
+  }
+  __syncthreads();
+  for (int i = tid; i < vocab_size; i += blockDim.x) {
+    logits[i] = -INFINITY;
+  }
+  __syncthreads();
+  for (int i = tid; i < len; i += blockDim.x) {
+    logits[token_ids[i]] = biased_logits[i];
+  }
+}
+
+void apply_logit_bias(torch::Tensor& logits,
+                      const torch::Tensor& token_ids,
+                      const torch::Tensor& biases,
+                      const torch::Tensor& lens,
+                      const torch::Tensor& exclusive) {
+  DCHECK(logits.is_contiguous()) << "logits tensor must be contiguous";
+  DCHECK(token_ids.is_contiguous()) << "token_ids tensor must be contiguous";
+  DCHECK(biases.is_contiguous()) << "biases tensor must be contiguous";
+  DCHECK(logits.size(0) == token_ids.size(0))
+      << "logits and token_ids must have the same batch size";
+
+  const int batch_size = logits.size(0);
+  const int vocab_size = logits.size(1);
+  const int max_len = token_ids.size(1);
+
+  // each thread block handles one batch, exclusive rows touch the full vocab
+  dim3 grid(batch_size);
+  dim3 block(std::min(vocab_size, 1024));
+
+  DISPATCH_FLOATING_TYPES(
+      logits.scalar_type(), "apply_logit_bias_kernel", [&] {
+        size_t smem_size = max_len * sizeof(float);
+        apply_logit_bias_kernel<scalar_t>
+            <<<grid, block, smem_size, at::cuda::getCurrentCUDAStream()>>>(
+                logits.data_ptr<scalar_t>(),
+                token_ids.data_ptr<long>(),
+                biases.data_ptr<scalar_t>(),
+                lens.data_ptr<int>(),
+                exclusive.data_ptr<bool>(),
+                max_len,
+                vocab_size);
+      });
+}
+
 }  // namespace llm::kernel
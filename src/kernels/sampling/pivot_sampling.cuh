@@ -0,0 +1,231 @@
+#pragma once
+
+#include <ATen/cuda/CUDAGeneratorImpl.h>
+#include <curand_kernel.h>
+#include <torch/torch.h>
+
+#include <cub/cub.cuh>
+#include <mutex>
+
+namespace llm::kernel {
+
+// max number of rejected candidates before falling back to greedy sampling
+constexpr int kMaxPivotRounds = 32;
+
+// the seeds and offsets of the rows as contiguous int64, if defined
+inline torch::Tensor to_long(const torch::Tensor& t) {
+  return t.defined() ? t.to(torch::kLong).contiguous() : t;
+}
+
+// reserve philox offsets from the default generator for one pivot_sample call
+// per row, each round draws one random number from thread 0.
+inline at::PhiloxCudaState pivot_sample_philox_state() {
+  auto* gen = at::get_generator_or_default<at::CUDAGeneratorImpl>(
+      c10::nullopt, at::cuda::detail::getDefaultCUDAGenerator());
+  std::lock_guard<std::mutex> lock(gen->mutex_);
+  return gen->philox_cuda_state((kMaxPivotRounds + 3) / 4 * 4);
+}
+
+// init the philox state of a row from the seed of the row, at the
+// subsequence of the position of the sampled token, if the row is seeded,
+// which makes the samples independent of the batch and the default generator.
+// otherwise from the default generator at the given subsequence.
+// rng_seeds, rng_offsets: [n_rows], the offset is -1 for unseeded rows, both
+// null if no row is seeded.
+__device__ inline void init_philox_state(at::PhiloxCudaState philox_args,
+                                         const long* rng_seeds,
+                                         const long* rng_offsets,
+                                         int64_t row,
+                                         uint64_t subsequence,
+                                         curandStatePhilox4_32_10_t* state) {
+  if (rng_offsets != nullptr && rng_offsets[row] >= 0) {
+    curand_init(static_cast<uint64_t>(rng_seeds[row]),
+                /*subsequence=*/rng_offsets[row],
+                /*offset=*/0,
+                state);
+    return;
+  }
+  const auto seeds = at::cuda::philox::unpack(philox_args);
+  curand_init(std::get<0>(seeds),
+              /*subsequence=*/subsequence,
+              /*offset=*/std::get<1>(seeds),
+              state);
+}
+
+struct PivotPrefixSumOp {
+  float running_total;
+
+  __device__ PivotPrefixSumOp(float running_total)
+      : running_total(running_total) {}
+
+  __device__ float operator()(float block_aggregate) {
+    const float old_prefix = running_total;
+    running_total += block_aggregate;
+    return old_prefix;
+  }
+};
+
+// count and sum of probs that are greater than (or equal to) the threshold
+template <int BLOCK_SIZE, bool INCLUSIVE, typename ProbFn>
+__device__ void count_and_sum_above(ProbFn prob_of,
+                                    int vocab_size,
+                                    float threshold,
+                                    int* count,
+                                    float* sum) {
+  using BlockReduceInt = cub::BlockReduce<int, BLOCK_SIZE>;
+  using BlockReduceFloat = cub::BlockReduce<float, BLOCK_SIZE>;
+  __shared__ union {
+    typename BlockReduceInt::TempStorage reduce_int;
+    typename BlockReduceFloat::TempStorage reduce_float;
+  } temp_storage;
+  __shared__ int s_count;
+  __shared__ float s_sum;
+
+  int thread_count = 0;
+  float thread_sum = 0.0f;
+  for (int i = threadIdx.x; i < vocab_size; i += BLOCK_SIZE) {
+    const float prob = prob_of(i);
+    if (INCLUSIVE ? prob >= threshold : prob > threshold) {
+      ++thread_count;
+      thread_sum += prob;
+    }
+  }
+  const int block_count =
+      BlockReduceInt(temp_storage.reduce_int).Sum(thread_count);
+  __syncthreads();
+  const float block_sum =
+      BlockReduceFloat(temp_storage.reduce_float).Sum(thread_sum);
+  if (threadIdx.x == 0) {
+    s_count = block_count;
+    s_sum = block_sum;
+  }
+  __syncthreads();
+  *count = s_count;
+  *sum = s_sum;
+  __syncthreads();
+}
+
+// mass of the top_k most likely tokens, found by bisecting the bits of the
+// k-th largest prob instead of sorting. non-negative floats keep their order
+// when compared as unsigned integers.
+template <int BLOCK_SIZE, typename ProbFn>
+__device__ float top_k_mass(ProbFn prob_of,
+                            int vocab_size,
+                            float max_prob,
+                            int top_k) {
+  // invariant: count(p >= lo) > top_k and count(p >= hi) < top_k
+  uint32_t lo = 0;
+  uint32_t hi = __float_as_uint(max_prob) + 1;
+  int hi_count = 0;
+  float hi_sum = 0.0f;
+  while (hi - lo > 1) {
+    const uint32_t mid = lo + (hi - lo) / 2;
+    int count = 0;
+    float sum = 0.0f;
+    count_and_sum_above<BLOCK_SIZE, /*INCLUSIVE=*/true>(
+        prob_of, vocab_size, __uint_as_float(mid), &count, &sum);
+    if (count == top_k) {
+      return sum;
+    }
+    if (count > top_k) {
+      lo = mid;
+    } else {
+      hi = mid;
+      hi_count = count;
+      hi_sum = sum;
+    }
+  }
+  // the remaining tokens in the top_k all have the prob of lo
+  return hi_sum + (top_k - hi_count) * __uint_as_float(lo);
+}
+
+// sample a token for the row handled by the thread block, restricted to the
+// top_k tokens and then to the top_p of the renormalized top_k mass, without
+// sorting. the returned token is only valid in thread 0.
+// 1> draw a candidate via inverse cdf over the tokens above the pivot
+// 2> accept it if the count and mass of more likely tokens are within top_k
+//    and top_p, otherwise raise the pivot to the candidate and draw again.
+// accepted candidates follow the filtered and renormalized distribution, and
+// each rejection at least removes the candidate from the next draw.
+// prob_of: returns the unnormalized prob of token i
+// prob_sum: sum of all probs
+// greedy_token: the most likely token, used as fallback
+template <int BLOCK_SIZE, typename ProbFn>
+__device__ int pivot_sample(ProbFn prob_of,
+                            int vocab_size,
+                            float prob_sum,
+                            long top_k,
+                            float top_p,
+                            int greedy_token,
+                            curandStatePhilox4_32_10_t* state) {
+  using BlockScan = cub::BlockScan<float, BLOCK_SIZE>;
+  __shared__ typename BlockScan::TempStorage temp_storage;
+  __shared__ float s_threshold;
+  __shared__ int s_token;
+
+  // replace 0 with vocab_size to disable top_k
+  if (top_k <= 0 || top_k > vocab_size) {
+    top_k = vocab_size;
+  }
+  const bool filter_top_k = top_k < vocab_size;
+  const bool filter_top_p = top_p < 1.0f;
+  // top_p is applied on the renormalized top_k tokens
+  float top_p_mass = prob_sum;
+  if (filter_top_k && filter_top_p) {
+    top_p_mass = top_k_mass<BLOCK_SIZE>(
+        prob_of, vocab_size, prob_of(greedy_token), static_cast<int>(top_k));
+  }
+  top_p_mass *= top_p;
+
+  // only tokens with probs above the pivot are candidates
+  float pivot = -1.0f;
+  float candidates_sum = prob_sum;
+  for (int round = 0; round < kMaxPivotRounds; ++round) {
+    if (threadIdx.x == 0) {
+      s_threshold = curand_uniform(state) * candidates_sum;
+      s_token = vocab_size;
+    }
+    __syncthreads();
+    const float threshold = s_threshold;
+
+    // inverse cdf sampling over the candidates in vocab order
+    PivotPrefixSumOp prefix_op(0.0f);
+    for (int start = 0; start < vocab_size; start += BLOCK_SIZE) {
+      const int i = start + threadIdx.x;
+      const float prob = i < vocab_size ? prob_of(i) : 0.0f;
+      const float candidate_prob = prob > pivot ? prob : 0.0f;
+      float prefix_sum = 0.0f;
+      BlockScan(temp_storage)
+          .InclusiveSum(candidate_prob, prefix_sum, prefix_op);
+      if (candidate_prob > 0.0f && prefix_sum >= threshold) {
+        atomicMin(&s_token, i);
+      }
+      __syncthreads();
+      if (s_token < vocab_size) {
+        break;
+      }
+    }
+    // fall back to the most likely token if rounding errors skip the end
+    const int token = s_token < vocab_size ? s_token : greedy_token;
+    __syncthreads();
+    if (!filter_top_k && !filter_top_p) {
+      return token;
+    }
+
+    // count the tokens that are more likely than the candidate
+    const float token_prob = prob_of(token);
+    int count = 0;
+    float mass = 0.0f;
+    count_and_sum_above<BLOCK_SIZE, /*INCLUSIVE=*/false>(
+        prob_of, vocab_size, token_prob, &count, &mass);
+    if (count < top_k && (!filter_top_p || mass <= top_p_mass)) {
+      return token;
+    }
+    // draw again from the tokens that are more likely than the candidate
+    pivot = token_prob;
+    candidates_sum = mass;
+  }
+  return greedy_token;
+}
+
+}  // namespace llm::kernel
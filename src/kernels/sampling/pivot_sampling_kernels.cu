@@ -0,0 +1,112 @@
+#include <ATen/cuda/CUDAContext.h>
+#include <ATen/cuda/CUDAGraphsUtils.cuh>
+#include <curand_kernel.h>
+#include <torch/torch.h>
+
+#include <cub/cub.cuh>
+
+#include "pivot_sampling.cuh"
+#include "sampling_kernels.h"
+
+namespace llm::kernel {
+
+// each thread block samples one row of probs filtered by top_k and top_p
+template <int BLOCK_SIZE>
+__global__ void pivot_sampling_kernel(long* __restrict__ output_ids,
+                                      const float* __restrict__ probs,
+                                      const long* __restrict__ top_ks,
+                                      const float* __restrict__ top_ps,
+                                      const long* __restrict__ rng_seeds,
+                                      const long* __restrict__ rng_offsets,
+                                      int vocab_size,
+                                      at::PhiloxCudaState philox_args) {
+  using ArgMaxPair = cub::KeyValuePair<int, float>;
+  using BlockReduceArgMax = cub::BlockReduce<ArgMaxPair, BLOCK_SIZE>;
+  using BlockReduceFloat = cub::BlockReduce<float, BLOCK_SIZE>;
+  __shared__ union {
+    typename BlockReduceArgMax::TempStorage argmax;
+    typename BlockReduceFloat::TempStorage reduce_float;
+  } temp_storage;
+  __shared__ float s_sum;
+  __shared__ int s_token;
+
+  const int tid = threadIdx.x;
+  const int row = blockIdx.x;
+  // move the pointer to the start of the row
+  probs += static_cast<int64_t>(row) * vocab_size;
+  auto prob_of = [&](int i) { return probs[i]; };
+
+  // sum of probs may drift from 1, and the max is used as fallback
+  ArgMaxPair thread_max(0, -1.0f);
+  float thread_sum = 0.0f;
+  for (int i = tid; i < vocab_size; i += BLOCK_SIZE) {
+    const float prob = probs[i];
+    thread_sum += prob;
+    if (prob > thread_max.value) {
+      thread_max = ArgMaxPair(i, prob);
+    }
+  }
+  const ArgMaxPair block_max =
+      BlockReduceArgMax(temp_storage.argmax).Reduce(thread_max, cub::ArgMax());
+  __syncthreads();
+  const float block_sum =
+      BlockReduceFloat(temp_storage.reduce_float).Sum(thread_sum);
+  if (tid == 0) {
+    s_token = block_max.key;
+    s_sum = block_sum;
+  }
+  __syncthreads();
+
+  curandStatePhilox4_32_10_t state;
+  if (tid == 0) {
+    init_philox_state(
+        philox_args, rng_seeds, rng_offsets, row, /*subsequence=*/row, &state);
+  }
+
+  const long top_k = top_ks != nullptr ? top_ks[row] : 0;
+  const float top_p = top_ps != nullptr ? top_ps[row] : 1.0f;
+  const int token = pivot_sample<BLOCK_SIZE>(
+      prob_of, vocab_size, s_sum, top_k, top_p, s_token, &state);
+  if (tid == 0) {
+    output_ids[row] = token;
+  }
+}
+
+void invoke_pivot_sampling(torch::Tensor& output_ids,
+                           const torch::Tensor& probs,
+                           const torch::Tensor& top_ks,
+                           const torch::Tensor& top_ps,
+                           const torch::Tensor& rng_seeds,
+                           const torch::Tensor& rng_offsets) {
+  DCHECK(probs.is_contiguous()) << "probs tensor must be contiguous";
+  DCHECK(probs.scalar_type() == torch::kFloat32) << "probs must be float32";
+
+  const int batch_size = probs.size(0);
+  const int vocab_size = probs.size(1);
+  DCHECK_EQ(output_ids.size(0), batch_size);
+
+  const auto top_k =
+      top_ks.defined() ? top_ks.to(torch::kLong).contiguous() : top_ks;
+  const auto top_p =
+      top_ps.defined() ? top_ps.to(torch::kFloat32).contiguous() : top_ps;
+  const auto seeds = to_long(rng_seeds);
+  const auto offsets = to_long(rng_offsets);
+  const auto philox_args = pivot_sample_philox_state();
+
+  // each thread block handles one row
+  constexpr int kBlockSize = 1024;
+  dim3 grid(batch_size);
+  dim3 block(kBlockSize);
+  pivot_sampling_kernel<kBlockSize>
+      <<<grid, block, 0, at::cuda::getCurrentCUDAStream()>>>(
+          output_ids.data_ptr<long>(),
+          probs.data_ptr<float>(),
+          top_k.defined() ? top_k.data_ptr<long>() : nullptr,
+          top_p.defined() ? top_p.data_ptr<float>() : nullptr,
+          seeds.defined() ? seeds.data_ptr<long>() : nullptr,
+          offsets.defined() ? offsets.data_ptr<long>() : nullptr,
+          vocab_size,
+          philox_args);
+}
+
+}  // namespace llm::kernel
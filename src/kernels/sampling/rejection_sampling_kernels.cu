@@ -0,0 +1,256 @@
+#include <ATen/cuda/CUDAContext.h>
+#include <ATen/cuda/CUDAGeneratorImpl.h>
+#include <ATen/cuda/CUDAGraphsUtils.cuh>
+#include <curand_kernel.h>
+#include <torch/torch.h>
+
+#include <cub/cub.cuh>
+#include <mutex>
+
+#include "../dispatch.h"
+#include "pivot_sampling.cuh"
+#include "sampling_kernels.h"
+
+namespace llm::kernel {
+
+// each thread block verifies the draft tokens of one sequence in order, and
+// stops at the first rejected token. for each verified position:
+// 1> find the max logit of the target, which is also the greedy sample
+// 2> greedy: accept the draft token if it is the greedy sample
+//    random: sum the target probs once, then accept the draft token x with
+//    probability min(1, p(x) / q(x)), where p(x) is only computed at x.
+// 3> on rejection, resample from the residual max(p - q, 0) via inverse cdf,
+//    q is one-hot on the draft token for deterministic proposals.
+// the positions after the rejected one are not verified at all.
+template <typename T, int BLOCK_SIZE>
+__global__ void rejection_sampling_kernel(
+    long* __restrict__ output_ids,
+    long* __restrict__ masked_output_ids,
+    const long* __restrict__ draft_token_ids,
+    const float* __restrict__ draft_probs,
+    const T* __restrict__ target_logits,
+    const long* __restrict__ bonus_token_ids,
+    const bool* __restrict__ do_sample,
+    const long* __restrict__ rng_seeds,
+    const long* __restrict__ rng_offsets,
+    int n_speculative_tokens,
+    int vocab_size,
+    at::PhiloxCudaState philox_args) {
+  using ArgMaxPair = cub::KeyValuePair<int, float>;
+  using BlockReduceArgMax = cub::BlockReduce<ArgMaxPair, BLOCK_SIZE>;
+  using BlockReduceFloat = cub::BlockReduce<float, BLOCK_SIZE>;
+  using BlockScan = cub::BlockScan<float, BLOCK_SIZE>;
+  __shared__ union {
+    typename BlockReduceArgMax::TempStorage argmax;
+    typename BlockReduceFloat::TempStorage reduce_float;
+    typename BlockScan::TempStorage scan;
+  } temp_storage;
+  // shared variables used to broadcast results from thread 0
+  __shared__ float s_value;
+  __shared__ int s_token;
+  __shared__ bool s_accepted;
+
+  const int tid = threadIdx.x;
+  const int seq_idx = blockIdx.x;
+  const int n_tokens = n_speculative_tokens;
+  draft_token_ids += static_cast<int64_t>(seq_idx) * n_tokens;
+
+  const bool sample = do_sample != nullptr && do_sample[seq_idx];
+  curandStatePhilox4_32_10_t state;
+  if (sample && tid == 0) {
+    init_philox_state(philox_args,
+                      rng_seeds,
+                      rng_offsets,
+                      seq_idx,
+                      /*subsequence=*/seq_idx,
+                      &state);
+  }
+
+  // all tokens are accepted if no rejection is found
+  int first_rejected = n_tokens;
+  int resampled_token = -1;
+  for (int pos = 0; pos < n_tokens; ++pos) {
+    const int64_t row = static_cast<int64_t>(seq_idx) * (n_tokens + 1) + pos;
+    const T* logits = target_logits + row * vocab_size;
+    const int draft_token = static_cast<int>(draft_token_ids[pos]);
+
+    // 1> find the max logit
+    ArgMaxPair thread_max(0, -INFINITY);
+    for (int i = tid; i < vocab_size; i += BLOCK_SIZE) {
+      const float logit = logits[i];
+      if (logit > thread_max.value) {
+        thread_max = ArgMaxPair(i, logit);
+      }
+    }
+    __syncthreads();
+    const ArgMaxPair block_max = BlockReduceArgMax(temp_storage.argmax)
+                                     .Reduce(thread_max, cub::ArgMax());
+    if (tid == 0) {
+      s_token = block_max.key;
+      s_value = block_max.value;
+    }
+    __syncthreads();
+    const int greedy_token = s_token;
+    const float max_logit = s_value;
+
+    // 2> verify the draft token
+    if (!sample) {
+      if (greedy_token != draft_token) {
+        first_rejected = pos;
+        resampled_token = greedy_token;
+        break;
+      }
+      continue;
+    }
+
+    float thread_sum = 0.0f;
+    for (int i = tid; i < vocab_size; i += BLOCK_SIZE) {
+      thread_sum += __expf(static_cast<float>(logits[i]) - max_logit);
+    }
+    __syncthreads();
+    const float block_sum =
+        BlockReduceFloat(temp_storage.reduce_float).Sum(thread_sum);
+    if (tid == 0) {
+      s_value = block_sum;
+    }
+    __syncthreads();
+    const float prob_sum = s_value;
+
+    const float* q = draft_probs != nullptr ? draft_probs + row * vocab_size
+                                            : nullptr;
+    if (tid == 0) {
+      const float target_prob =
+          __expf(static_cast<float>(logits[draft_token]) - max_logit) /
+          prob_sum;
+      const float draft_prob = q != nullptr ? q[draft_token] : 1.0f;
+      // curand_uniform returns (0, 1], flip it to [0, 1)
+      const float u = 1.0f - curand_uniform(&state);
+      s_accepted = u * draft_prob < target_prob;
+    }
+    __syncthreads();
+    if (s_accepted) {
+      continue;
+    }
+
+    // 3> resample from the residual distribution
+    auto residual_of = [&](int i) {
+      const float p =
+          __expf(static_cast<float>(logits[i]) - max_logit) / prob_sum;
+      const float d = q != nullptr ? q[i] : (i == draft_token ? 1.0f : 0.0f);
+      return fmaxf(p - d, 0.0f);
+    };
+    float thread_residual = 0.0f;
+    for (int i = tid; i < vocab_size; i += BLOCK_SIZE) {
+      thread_residual += residual_of(i);
+    }
+    const float residual_sum =
+        BlockReduceFloat(temp_storage.reduce_float).Sum(thread_residual);
+    if (tid == 0) {
+      s_value = (1.0f - curand_uniform(&state)) * residual_sum;
+      s_token = vocab_size;
+    }
+    __syncthreads();
+    const float threshold = s_value;
+
+    // inverse cdf sampling over the residual in vocab order
+    PivotPrefixSumOp prefix_op(0.0f);
+    for (int start = 0; start < vocab_size; start += BLOCK_SIZE) {
+      const int i = start + tid;
+      const float prob = i < vocab_size ? residual_of(i) : 0.0f;
+      float prefix_sum = 0.0f;
+      BlockScan(temp_storage.scan).InclusiveSum(prob, prefix_sum, prefix_op);
+      if (prob > 0.0f && prefix_sum > threshold) {
+        atomicMin(&s_token, i);
+      }
+      __syncthreads();
+      if (s_token < vocab_size) {
+        break;
+      }
+    }
+    first_rejected = pos;
+    // fall back to the most likely token if the residual is empty or
+    // rounding errors skip the end
+    resampled_token = s_token < vocab_size ? s_token : greedy_token;
+    break;
+  }
+
+  if (tid == 0) {
+    const int64_t offset = static_cast<int64_t>(seq_idx) * (n_tokens + 1);
+    for (int i = 0; i < n_tokens; ++i) {
+      output_ids[offset + i] =
+          i == first_rejected ? resampled_token : draft_token_ids[i];
+    }
+    output_ids[offset + n_tokens] = bonus_token_ids[seq_idx];
+    if (masked_output_ids != nullptr) {
+      for (int i = 0; i <= n_tokens; ++i) {
+        masked_output_ids[offset + i] =
+            i <= first_rejected ? output_ids[offset + i] : -1;
+      }
+    }
+  }
+}
+
+void invoke_rejection_sampling(torch::Tensor& output_ids,
+                               torch::Tensor& masked_output_ids,
+                               const torch::Tensor& draft_token_ids,
+                               const torch::Tensor& draft_probs,
+                               const torch::Tensor& target_logits,
+                               const torch::Tensor& bonus_token_ids,
+                               const torch::Tensor& do_sample,
+                               const torch::Tensor& rng_seeds,
+                               const torch::Tensor& rng_offsets) {
+  DCHECK(target_logits.is_contiguous())
+      << "target_logits tensor must be contiguous";
+
+  const int num_seqs = draft_token_ids.size(0);
+  const int n_speculative_tokens = draft_token_ids.size(1);
+  const int vocab_size = target_logits.size(-1);
+  DCHECK_EQ(target_logits.size(1), n_speculative_tokens + 1);
+
+  const auto draft_ids = draft_token_ids.to(torch::kLong).contiguous();
+  const auto bonus_ids = bonus_token_ids.to(torch::kLong).contiguous();
+  const auto q = draft_probs.defined()
+                     ? draft_probs.to(torch::kFloat32).contiguous()
+                     : draft_probs;
+  const auto sample =
+      do_sample.defined() ? do_sample.to(torch::kBool).contiguous() : do_sample;
+  const auto seeds = to_long(rng_seeds);
+  const auto offsets = to_long(rng_offsets);
+
+  // each row draws one random number per verified token and one for the
+  // resampled token from thread 0.
+  at::PhiloxCudaState philox_args;
+  {
+    auto* gen = at::get_generator_or_default<at::CUDAGeneratorImpl>(
+        c10::nullopt, at::cuda::detail::getDefaultCUDAGenerator());
+    std::lock_guard<std::mutex> lock(gen->mutex_);
+    philox_args =
+        gen->philox_cuda_state((n_speculative_tokens + 1 + 3) / 4 * 4);
+  }
+
+  // each thread block handles one sequence
+  constexpr int kBlockSize = 1024;
+  dim3 grid(num_seqs);
+  dim3 block(kBlockSize);
+  DISPATCH_FLOATING_TYPES(
+      target_logits.scalar_type(), "rejection_sampling_kernel", [&] {
+        rejection_sampling_kernel<scalar_t, kBlockSize>
+            <<<grid, block, 0, at::cuda::getCurrentCUDAStream()>>>(
+                output_ids.data_ptr<long>(),
+                masked_output_ids.defined()
+                    ? masked_output_ids.data_ptr<long>()
+                    : nullptr,
+                draft_ids.data_ptr<long>(),
+                q.defined() ? q.data_ptr<float>() : nullptr,
+                target_logits.data_ptr<scalar_t>(),
+                bonus_ids.data_ptr<long>(),
+                sample.defined() ? sample.data_ptr<bool>() : nullptr,
+                seeds.defined() ? seeds.data_ptr<long>() : nullptr,
+                offsets.defined() ? offsets.data_ptr<long>() : nullptr,
+                n_speculative_tokens,
+                vocab_size,
+                philox_args);
+      });
+}
+
+}  // namespace llm::kernel
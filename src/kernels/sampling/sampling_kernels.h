@@ -24,6 +24,23 @@ void apply_frequency_presence_penalty(torch::Tensor& logits,
                                       const torch::Tensor& frequency_penalties,
                                       const torch::Tensor& presence_penalties);
 
+// add the sparse bias to the logits of the tokens in place. for the exclusive
+// sequences, the logits of the tokens without a bias are set to -inf.
+// token_ids: [num_seqs, max_len] the first lens[i] entries of row i are valid
+// biases: [num_seqs, max_len] the bias of each token
+// exclusive: [num_seqs] bool
+void apply_logit_bias(torch::Tensor& logits,
+                      const torch::Tensor& token_ids,
+                      const torch::Tensor& biases,
+                      const torch::Tensor& lens,
+                      const torch::Tensor& exclusive);
+
+// set the logits of the tokens disallowed by the bitmask to -inf in place.
+// logits: [num_seqs, vocab_size]
+// bitmask: [num_seqs, n_words] int32, bit j of word i is set if token
+// i * 32 + j is allowed. tokens beyond n_words * 32 are disallowed.
+void apply_token_bitmask(torch::Tensor& logits, const torch::Tensor& bitmask);
+
 // calculate softmax in place
 void invoke_softmax(torch::Tensor& logits);
 
@@ -36,4 +53,65 @@ void invoke_topk_sampling(torch::Tensor& output_ids,
                           torch::Tensor top_ks,
                           torch::Tensor top_ps);
 
+// sample from probs filtered by top_k and then top_p without sorting.
+// probs: [batch_size, vocab_size] float32
+// top_ks, top_ps: [batch_size], optional and skipped when undefined.
+// rng_seeds, rng_offsets: [batch_size] int64, the philox seed and subsequence
+// of each row, rows with a negative offset and all rows when undefined draw
+// from the default cuda generator.
+void invoke_pivot_sampling(torch::Tensor& output_ids,
+                           const torch::Tensor& probs,
+                           const torch::Tensor& top_ks,
+                           const torch::Tensor& top_ps,
+                           const torch::Tensor& rng_seeds = {},
+                           const torch::Tensor& rng_offsets = {});
+
+// fused penalties, temperature, top_k and top_p filtering and sampling in one
+// kernel without sorting. sequence i is sampled from logits[sample_idxes[i]],
+// and penalties are applied to the logits in place. all parameters except
+// logits and sample_idxes are optional and skipped when undefined.
+// rng_seeds, rng_offsets: [num_tokens] indexed like the logits, see
+// invoke_pivot_sampling.
+void invoke_fused_sampling(torch::Tensor& output_ids,
+                           torch::Tensor& logits,
+                           const torch::Tensor& sample_idxes,
+                           const torch::Tensor& token_ids,
+                           const torch::Tensor& token_counts,
+                           const torch::Tensor& token_ids_lens,
+                           const torch::Tensor& frequency_penalties,
+                           const torch::Tensor& presence_penalties,
+                           const torch::Tensor& repetition_penalties,
+                           const torch::Tensor& temperatures,
+                           const torch::Tensor& top_ks,
+                           const torch::Tensor& top_ps,
+                           const torch::Tensor& do_sample,
+                           const torch::Tensor& rng_seeds = {},
+                           const torch::Tensor& rng_offsets = {});
+
+// verify the draft tokens of speculative decoding with rejection sampling in
+// one kernel, stopping at the first rejected token of each sequence. the
+// target probs are only computed at the draft tokens, and the residual
+// distribution only at the rejected position.
+// output_ids: [num_seqs, n_speculative_tokens + 1] int64, the draft tokens
+// with the first rejected one replaced by the resampled token, followed by
+// the bonus token.
+// masked_output_ids: same as output_ids with the tokens after the first
+// rejected one set to -1, optional and skipped when undefined.
+// draft_token_ids: [num_seqs, n_speculative_tokens]
+// draft_probs: [num_seqs, n_speculative_tokens, vocab_size], undefined for
+// deterministic proposals.
+// target_logits: [num_seqs, n_speculative_tokens + 1, vocab_size]
+// bonus_token_ids: [num_seqs, 1]
+// do_sample: [num_seqs] bool, greedy for all sequences when undefined.
+// rng_seeds, rng_offsets: [num_seqs], see invoke_pivot_sampling.
+void invoke_rejection_sampling(torch::Tensor& output_ids,
+                               torch::Tensor& masked_output_ids,
+                               const torch::Tensor& draft_token_ids,
+                               const torch::Tensor& draft_probs,
+                               const torch::Tensor& target_logits,
+                               const torch::Tensor& bonus_token_ids,
+                               const torch::Tensor& do_sample,
+                               const torch::Tensor& rng_seeds = {},
+                               const torch::Tensor& rng_offsets = {});
+
 }  // namespace llm::kernel
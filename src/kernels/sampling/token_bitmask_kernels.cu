@@ -0,0 +1,70 @@
+#include <ATen/cuda/CUDAContext.h>
+#include <torch/torch.h>
+
+#include <limits>
+
+#include "../dispatch.h"
+
+namespace llm::kernel {
+
+// each thread handles 32 consecutive tokens of a row, which are covered by one
+// word of the bitmask, so the bitmask is read once and the logits are written
+// only for the disallowed tokens.
+template <typename T>
+__global__ void apply_token_bitmask_kernel(T* __restrict__ logits,
+                                           const int* __restrict__ bitmask,
+                                           int vocab_size,
+                                           int n_words) {
+  const int row = blockIdx.y;
+  const int word_idx = blockIdx.x * blockDim.x + threadIdx.x;
+  const int base = word_idx * 32;
+  if (base >= vocab_size) {
+    return;
+  }
+  // tokens beyond the bitmask are disallowed
+  const uint32_t word =
+      word_idx < n_words
+          ? static_cast<uint32_t>(bitmask[int64_t(row) * n_words + word_idx])
+          : 0u;
+  if (word == 0xffffffffu) {
+    return;
+  }
+  T* row_logits = logits + int64_t(row) * vocab_size;
+  const T neg_inf = T(-std::numeric_limits<float>::infinity());
+  const int n = min(32, vocab_size - base);
+  for (int i = 0; i < n; ++i) {
+    if (((word >> i) & 1u) == 0) {
+      row_logits[base + i] = neg_inf;
+    }
+  }
+}
+
+void apply_token_bitmask(torch::Tensor& logits, const torch::Tensor& bitmask) {
+  DCHECK(logits.is_contiguous()) << "logits tensor must be contiguous";
+  DCHECK(bitmask.is_contiguous()) << "bitmask tensor must be contiguous";
+  DCHECK(bitmask.scalar_type() == torch::kInt) << "bitmask must be int32";
+  CHECK_EQ(logits.size(0), bitmask.size(0));
+
+  const int batch_size = logits.size(0);
+  const int vocab_size = logits.size(1);
+  const int n_words = bitmask.size(1);
+  if (batch_size == 0) {
+    return;
+  }
+
+  const int total_words = (vocab_size + 31) / 32;
+  dim3 block(std::min(total_words, 256));
+  dim3 grid((total_words + block.x - 1) / block.x, batch_size);
+
+  DISPATCH_FLOATING_TYPES(
+      logits.scalar_type(), "apply_token_bitmask_kernel", [&] {
+        apply_token_bitmask_kernel<scalar_t>
+            <<<grid, block, 0, at::cuda::getCurrentCUDAStream()>>>(
+                logits.data_ptr<scalar_t>(),
+                bitmask.data_ptr<int>(),
+                vocab_size,
+                n_words);
+      });
+}
+
+}  // namespace llm::kernel
@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+
+# This file is run at configure time to AOT compile a triton kernel for each
+# dtype, see "cmake/triton_aot_library.cmake". For each dtype, all signatures
+# are compiled into aot/<dtype>/ and linked into one dispatcher:
+# aot/<kernel_name>_<dtype>.{h,c}
+import argparse
+import shutil
+import subprocess
+import sys
+from pathlib import Path
+
+
+def run(args, cwd):
+    print(" ".join(args), flush=True)
+    subprocess.run(args, cwd=cwd, check=True)
+
+
+def compile_dtype(args, dtype: str, out_dir: Path):
+    out_name = f"{args.kernel_name}_{dtype}"
+    dtype_dir = out_dir / dtype
+    dtype_dir.mkdir(parents=True, exist_ok=True)
+    kernel = Path(args.kernel).resolve()
+    for signature in args.signature:
+        run(
+            [
+                sys.executable,
+                "-m",
+                "triton.tools.compile",
+                str(kernel),
+                "--kernel-name",
+                args.kernel_name,
+                "--out-path",
+                str(dtype_dir / out_name),
+                "--out-name",
+                out_name,
+                "--signature",
+                signature.replace("{dtype}", dtype),
+                "--grid",
+                args.grid,
+                "--num-warps",
+                str(args.num_warps),
+                "--num-stages",
+                str(args.num_stages),
+            ],
+            cwd=kernel.parent,
+        )
+    # link generated headers and create the dispatcher
+    headers = sorted(str(h) for h in dtype_dir.glob("*.h"))
+    run(
+        [
+            sys.executable,
+            "-m",
+            "triton.tools.link",
+            *headers,
+            "--out",
+            str(out_dir / out_name),
+        ],
+        cwd=out_dir,
+    )
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="AOT compile triton kernels")
+    parser.add_argument("--kernel", required=True)
+    parser.add_argument("--kernel-name", required=True)
+    parser.add_argument("--dtypes", nargs="+", required=True)
+    parser.add_argument("--signature", action="append", required=True)
+    parser.add_argument("--grid", required=True)
+    parser.add_argument("--num-warps", type=int, default=4)
+    parser.add_argument("--num-stages", type=int, default=3)
+    parser.add_argument("--out-dir", required=True)
+    args = parser.parse_args()
+
+    # remove previous generated files
+    out_dir = Path(args.out_dir)
+    shutil.rmtree(out_dir, ignore_errors=True)
+    out_dir.mkdir(parents=True)
+    for dtype in args.dtypes:
+        compile_dtype(args, dtype, out_dir)
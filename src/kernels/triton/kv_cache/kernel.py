@@ -0,0 +1,32 @@
+import triton
+import triton.language as tl
+
+
+@triton.jit
+def set_kv_cache_kernel(
+    slot_ids_ptr,  # [n_tokens]
+    keys_ptr,  # [n_tokens, n_kv_heads, head_dim]
+    values_ptr,  # [n_tokens, n_kv_heads, head_dim]
+    key_cache_ptr,  # [n_slots, n_kv_heads, head_dim]
+    value_cache_ptr,  # [n_slots, n_kv_heads, head_dim]
+    n_tokens,  # only used by the launch grid
+    k_stride,  # stride of keys between tokens
+    v_stride,  # stride of values between tokens
+    n,  # n_kv_heads * head_dim
+    BLOCK_SIZE: tl.constexpr,
+):
+    # one program per token
+    token_idx = tl.program_id(axis=0).to(tl.int64)
+    slot_id = tl.load(slot_ids_ptr + token_idx).to(tl.int64)
+
+    k_src = keys_ptr + token_idx * k_stride
+    v_src = values_ptr + token_idx * v_stride
+    k_dst = key_cache_ptr + slot_id * n
+    v_dst = value_cache_ptr + slot_id * n
+    for start in range(0, n, BLOCK_SIZE):
+        offsets = start + tl.arange(0, BLOCK_SIZE)
+        mask = offsets < n
+        k = tl.load(k_src + offsets, mask=mask)
+        v = tl.load(v_src + offsets, mask=mask)
+        tl.store(k_dst + offsets, k, mask=mask)
+        tl.store(v_dst + offsets, v, mask=mask)
@@ -0,0 +1,142 @@
+#include "triton_kernels.h"
+
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDAGuard.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <mutex>
+
+#ifdef LLM_HAS_TRITON_KERNELS
+extern "C" {
+#include "set_kv_cache_kernel_bf16.h"
+#include "set_kv_cache_kernel_fp16.h"
+#include "set_kv_cache_kernel_fp32.h"
+}
+#endif
+
+DEFINE_bool(use_triton_kernels,
+            false,
+            "Use the AOT compiled triton kernels for the ops that have one, "
+            "requires building with -DBUILD_TRITON_KERNELS=ON.");
+
+namespace llm::kernel::triton {
+namespace {
+#ifdef LLM_HAS_TRITON_KERNELS
+// the generated loaders keep the modules in globals, loaded into the cuda
+// context of the first device. returns false for other devices.
+bool load_kernels(int device) {
+  static std::once_flag flag;
+  static int loaded_device = -1;
+  std::call_once(flag, [device]() {
+    const c10::cuda::CUDAGuard device_guard(device);
+    load_set_kv_cache_kernel_fp16();
+    load_set_kv_cache_kernel_bf16();
+    load_set_kv_cache_kernel_fp32();
+    loaded_device = device;
+  });
+  return loaded_device == device;
+}
+
+CUdeviceptr ptr(const torch::Tensor& t) {
+  return reinterpret_cast<CUdeviceptr>(t.data_ptr());
+}
+#endif
+}  // namespace
+
+bool is_available() {
+#ifdef LLM_HAS_TRITON_KERNELS
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool set_kv_cache(const torch::Tensor& slot_ids,
+                  const torch::Tensor& keys,
+                  const torch::Tensor& values,
+                  torch::Tensor& key_cache,
+                  torch::Tensor& value_cache) {
+#ifdef LLM_HAS_TRITON_KERNELS
+  const auto dtype = keys.scalar_type();
+  if (!keys.is_cuda() || values.scalar_type() != dtype ||
+      key_cache.scalar_type() != dtype || value_cache.scalar_type() != dtype ||
+      slot_ids.scalar_type() != torch::kInt || !slot_ids.is_contiguous()) {
+    return false;
+  }
+  // keys and values should be continuous at n_kv_heads and head_dim dims
+  if (keys.stride(-1) != 1 || keys.stride(-2) != keys.size(-1) ||
+      values.stride(-1) != 1 || values.stride(-2) != values.size(-1)) {
+    return false;
+  }
+  // the kernel only writes the slot major layout: [n_slots, n_kv_heads, dim]
+  if (key_cache.dim() != 3 || !key_cache.is_contiguous() ||
+      !value_cache.is_contiguous()) {
+    return false;
+  }
+  if (!load_kernels(keys.get_device())) {
+    return false;
+  }
+
+  const int32_t n_tokens = static_cast<int32_t>(keys.size(-3));
+  if (n_tokens == 0) {
+    return true;
+  }
+  const int32_t n = static_cast<int32_t>(keys.size(-2) * keys.size(-1));
+  // it is possible that keys and values have different strides
+  const int64_t k_stride = keys.stride(-3);
+  const int64_t v_stride = values.stride(-3);
+  const CUstream stream = at::cuda::getCurrentCUDAStream();
+
+  CUresult result = CUDA_SUCCESS;
+  switch (dtype) {
+    case torch::kHalf:
+      result = set_kv_cache_kernel_fp16_default(stream,
+                                                ptr(slot_ids),
+                                                ptr(keys),
+                                                ptr(values),
+                                                ptr(key_cache),
+                                                ptr(value_cache),
+                                                n_tokens,
+                                                k_stride,
+                                                v_stride,
+                                                n);
+      break;
+    case torch::kBFloat16:
+      result = set_kv_cache_kernel_bf16_default(stream,
+                                                ptr(slot_ids),
+                                                ptr(keys),
+                                                ptr(values),
+                                                ptr(key_cache),
+                                                ptr(value_cache),
+                                                n_tokens,
+                                                k_stride,
+                                                v_stride,
+                                                n);
+      break;
+    case torch::kFloat:
+      result = set_kv_cache_kernel_fp32_default(stream,
+                                                ptr(slot_ids),
+                                                ptr(keys),
+                                                ptr(values),
+                                                ptr(key_cache),
+                                                ptr(value_cache),
+                                                n_tokens,
+                                                k_stride,
+                                                v_stride,
+                                                n);
+      break;
+    default:
+      return false;
+  }
+  CHECK_EQ(result, CUDA_SUCCESS) << "failed to launch triton set_kv_cache";
+  return true;
+#else
+  LOG_FIRST_N(WARNING, 1)
+      << "triton kernels are not built, rebuild with "
+         "-DBUILD_TRITON_KERNELS=ON to use them";
+  return false;
+#endif
+}
+
+}  // namespace llm::kernel::triton
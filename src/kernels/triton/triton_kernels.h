@@ -0,0 +1,25 @@
+#pragma once
+
+#include <gflags/gflags.h>
+#include <torch/torch.h>
+
+DECLARE_bool(use_triton_kernels);
+
+// AOT compiled triton alternatives of the cuda kernels, see
+// "cmake/triton_aot_library.cmake". They return false if they can't be used
+// for the inputs, or if the build doesn't have them, to fall back to the cuda
+// kernels.
+namespace llm::kernel::triton {
+
+// whether the triton kernels are built, with -DBUILD_TRITON_KERNELS=ON
+bool is_available();
+
+// same as kernel::set_kv_cache
+bool set_kv_cache(
+    const torch::Tensor& slot_ids,  // [n_tokens]
+    const torch::Tensor& keys,      // [n_tokens, n_kv_heads, head_dim]
+    const torch::Tensor& values,    // [n_tokens, n_kv_heads, head_dim]
+    torch::Tensor& key_cache,       // [n_slots, n_kv_heads, head_dim]
+    torch::Tensor& value_cache);    // [n_slots, n_kv_heads, head_dim]
+
+}  // namespace llm::kernel::triton
@@ -0,0 +1,42 @@
+#include "triton_kernels.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include "kernels/kv_cache_kernels.h"
+
+namespace llm::kernel {
+
+TEST(TritonKernelsTest, SetKVCache) {
+  if (!torch::cuda::is_available() || !triton::is_available()) {
+    GTEST_SKIP() << "CUDA or triton kernels not available, skipping test";
+  }
+  const int64_t n_slots = 256;
+  const int64_t n_tokens = 37;
+  const int64_t n_kv_heads = 4;
+  const int64_t head_dim = 64;
+
+  for (const auto dtype : {torch::kHalf, torch::kBFloat16, torch::kFloat}) {
+    const auto options = torch::dtype(dtype).device(torch::kCUDA);
+    // keys and values are slices of a fused kv tensor
+    const auto kv = torch::randn({n_tokens, 2, n_kv_heads, head_dim}, options);
+    const auto keys = kv.select(/*dim=*/1, /*index=*/0);
+    const auto values = kv.select(/*dim=*/1, /*index=*/1);
+    const auto slot_ids =
+        torch::randperm(n_slots, torch::dtype(torch::kInt).device(torch::kCUDA))
+            .slice(/*dim=*/0, /*start=*/0, /*end=*/n_tokens);
+
+    auto key_cache = torch::zeros({n_slots, n_kv_heads, head_dim}, options);
+    auto value_cache = torch::zeros_like(key_cache);
+    ASSERT_TRUE(
+        triton::set_kv_cache(slot_ids, keys, values, key_cache, value_cache));
+
+    auto key_cache_ref = torch::zeros_like(key_cache);
+    auto value_cache_ref = torch::zeros_like(key_cache);
+    set_kv_cache(slot_ids, keys, values, key_cache_ref, value_cache_ref);
+    EXPECT_TRUE(torch::equal(key_cache, key_cache_ref));
+    EXPECT_TRUE(torch::equal(value_cache, value_cache_ref));
+  }
+}
+
+}  // namespace llm::kernel
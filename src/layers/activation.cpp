@@ -33,6 +33,10 @@ torch::Tensor gelu_new(torch::Tensor x) {
                             (x + 0.044715f * torch::pow(x, 3.0))));
 }
 
+torch::Tensor quick_gelu(torch::Tensor x) {
+  return x * torch::sigmoid(1.702f * x);
+}
+
 torch::Tensor relu(torch::Tensor x) {
   namespace F = torch::nn::functional;
   return F::relu(x);
@@ -95,6 +99,9 @@ ActFunc Activation::get_act_func(const std::string& name,
   if (boost::iequals(name, "gelu_pytorch_tanh")) {
     return gelu_pytorch_tanh;
   }
+  if (boost::iequals(name, "quick_gelu")) {
+    return quick_gelu;
+  }
   if (boost::iequals(name, "relu")) {
     return relu;
   }
@@ -107,6 +114,19 @@ ActFunc Activation::get_act_func(const std::string& name,
   return nullptr;
 }
 
+std::optional<EpilogueAct> Activation::get_epilogue_act(
+    const std::string& name) {
+  // all tanh approximations of gelu, the epilogue has no erf gelu
+  if (boost::iequals(name, "gelu_pytorch_tanh") ||
+      boost::iequals(name, "gelu_new") || boost::iequals(name, "gelu_fast")) {
+    return EpilogueAct::kGeluTanh;
+  }
+  if (boost::iequals(name, "relu")) {
+    return EpilogueAct::kRelu;
+  }
+  return std::nullopt;
+}
+
 ActFunc Activation::get_act_with_mul_func(const std::string& name,
                                           const torch::Device& device) {
   CHECK(!name.empty()) << "Activation function name cannot be empty";
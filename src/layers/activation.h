@@ -2,6 +2,11 @@
 
 #include <torch/torch.h>
 
+#include <optional>
+#include <string>
+
+#include "kernels/gemm/gemm_params.h"
+
 namespace llm {
   
 namespace detail {
@@ -13,6 +18,9 @@ torch::Tensor gelu_fast(torch::Tensor x);
 
 torch::Tensor gelu_new(torch::Tensor x);
 
+// x * sigmoid(1.702 * x), used by the clip vision encoders
+torch::Tensor quick_gelu(torch::Tensor x);
+
 torch::Tensor relu(torch::Tensor x);
 
 torch::Tensor silu(torch::Tensor x);
@@ -42,6 +50,9 @@ class Activation {
   // calculate act(x) * y where x = input[0] and y = input[1]
   static ActFunc get_act_with_mul_func(const std::string& name,
                                        const torch::Device& device);
+
+  // the activation of the gemm epilogue for the name, if any
+  static std::optional<EpilogueAct> get_epilogue_act(const std::string& name);
 };
 
 }  // namespace llm
@@ -23,6 +23,7 @@ const std::map<std::string, ActFunc> activations = {
     {"gelu_fast", detail::gelu_fast},
     {"gelu_new", detail::gelu_new},
     {"gelu_pytorch_tanh", detail::gelu_pytorch_tanh},
+    {"quick_gelu", detail::quick_gelu},
     {"relu", detail::relu},
     {"silu", detail::silu},
 };
@@ -85,6 +86,7 @@ INSTANTIATE_TEST_SUITE_P(
                                          "gelu_fast",
                                          "gelu_new",
                                          "gelu_pytorch_tanh",
+                                         "quick_gelu",
                                          "relu",
                                          "silu"),
                        ::testing::Values(200),          // in_features
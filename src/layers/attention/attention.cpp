@@ -3,7 +3,73 @@
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include <vector>
+
+#include "kernels/attention/mha_cpu.h"
+#include "layers/attention/attention_states.h"
+#include "layers/attention/piecewise_graph.h"
+#include "layers/layer_profiler.h"
+
 namespace llm {
+namespace {
+// attend the new tokens of the sequences with offloaded kv cache blocks to
+// the offloaded tokens on host, and merge them into the output by their
+// log-sum-exp. the attention over the device blocks is recomputed with its
+// log-sum-exp for these sequences, which the handlers don't return.
+void merge_offloaded_attention(const torch::Tensor& query,
+                               const KVCache& kv_cache,
+                               const InputParameters& params,
+                               float sm_scale,
+                               torch::Tensor& output) {
+  const KVCache* host_cache = kv_cache.host_tier();
+  CHECK(host_cache != nullptr) << "no host tier for the offloaded kv cache";
+  CHECK_GT(sm_scale, 0.0f) << "unsupported attention for offloaded kv cache";
+  const auto& q_idxes = params.offload_q_idxes;
+  const auto& host_blocks = params.offload_host_blocks;
+  const int64_t n_seqs = params.offload_kv_lens.size(0);
+  const int64_t n_heads = query.size(1);
+  const int64_t block_size = kv_cache.block_size();
+  const auto* kv_lens = params.offload_kv_lens.const_data_ptr<int32_t>();
+  for (int64_t i = 0; i < n_seqs; ++i) {
+    const auto q_row = q_idxes[i];
+    const int64_t q_len = (q_row >= 0).sum().item<int64_t>();
+    const auto idxes = q_row.narrow(/*dim=*/0, /*start=*/0, q_len)
+                           .to(query.device(), torch::kLong);
+    // [q_len, n_heads, head_dim]
+    const auto q = query.index_select(/*dim=*/0, idxes);
+
+    // the new tokens are the last ones of the device kv cache
+    const int64_t kv_len = kv_lens[i];
+    const int64_t n_blocks = (kv_len + block_size - 1) / block_size;
+    auto [key, value] = kv_cache.get_blocks(
+        params.offload_device_blocks[i].narrow(/*dim=*/0, 0, n_blocks),
+        torch::kFloat32);
+    auto [out, lse] = attention_with_lse(q,
+                                         key.narrow(/*dim=*/0, 0, kv_len),
+                                         value.narrow(/*dim=*/0, 0, kv_len),
+                                         /*q_start=*/kv_len - q_len,
+                                         /*k_start=*/0,
+                                         /*causal=*/true,
+                                         sm_scale);
+
+    // the offloaded tokens are all before the new tokens. copying the query
+    // to host also waits for the blocks swapped out before the step.
+    const auto host_row = host_blocks[i];
+    const int64_t n_host_blocks = (host_row >= 0).sum().item<int64_t>();
+    auto [host_key, host_value] = host_cache->get_blocks(
+        host_row.narrow(/*dim=*/0, 0, n_host_blocks), torch::kFloat32);
+    const auto host_q = q.to(torch::kCPU, torch::kFloat32).contiguous();
+    auto host_out = torch::empty_like(host_q);
+    auto host_lse = torch::empty({q_len, n_heads}, host_q.options());
+    mha_with_lse(host_q, host_key, host_value, sm_scale, host_out, host_lse);
+
+    merge_attention_states(
+        out, lse, host_out.to(out.device()), host_lse.to(lse.device()));
+    output.index_copy_(/*dim=*/0, idxes, out.to(output.dtype()));
+  }
+}
+}  // namespace
+
 AttentionImpl::AttentionImpl(int64_t n_heads,
                              int64_t n_kv_heads,
                              int64_t head_dim,
@@ -24,25 +90,48 @@ torch::Tensor AttentionImpl::forward(const torch::Tensor& query,
                                      const torch::Tensor& value,
                                      const torch::Tensor& positions,
                                      KVCache& kv_cache,
-                                     const InputParameters& input_params) {
-  const int64_t n_tokens = query.size(0);
-  // [n_tokens, hidden_dim] => [n_tokens, n_heads, head_dim]
-  auto q = query.view({n_tokens, n_heads_, head_dim_});
-  auto k = key.view({n_tokens, n_kv_heads_, head_dim_});
-  auto v = value.view({n_tokens, n_kv_heads_, head_dim_});
+                                     const InputParameters& input_params,
+                                     const torch::Tensor& qkv_bias) {
+  LAYER_PROFILE_SCOPE("attention");
+  // runs eagerly between the segments of piecewise cuda graphs
+  return PiecewiseGraph::split(
+      {query, key, value, positions},
+      input_params,
+      [this, &kv_cache, qkv_bias](const std::vector<torch::Tensor>& inputs,
+                                  const InputParameters& params) {
+        const int64_t n_tokens = inputs[0].size(0);
+        // [n_tokens, hidden_dim] => [n_tokens, n_heads, head_dim]
+        auto q = inputs[0].view({n_tokens, n_heads_, head_dim_});
+        auto k = inputs[1].view({n_tokens, n_kv_heads_, head_dim_});
+        auto v = inputs[2].view({n_tokens, n_kv_heads_, head_dim_});
+
+        // add the qkv bias, apply positional embedding and append key and
+        // value to kv_cache. positional embedding is an non-op if the handler
+        // does not support ROPE
+        q = handler_->apply_pos_emb_and_append_kv_cache(
+            kv_cache, q, k, v, inputs[3], params, qkv_bias);
 
-  // apply positional embedding
-  // it is an non-op if the handler does not support ROPE
-  std::tie(q, k) = handler_->apply_pos_emb(q, k, positions);
+        auto output = torch::empty_like(q);
+        handler_->batch_decode(q, kv_cache, params, sliding_window_, output);
 
-  // append key and value to kv_cache
-  handler_->append_kv_cache(kv_cache, k, v, input_params);
+        // with a sliding window, the offloaded tokens are out of the window
+        // as long as the device blocks cover it.
+        if (params.offload_q_idxes.defined() && sliding_window_ < 0) {
+          merge_offloaded_attention(
+              q, kv_cache, params, handler_->sm_scale(), output);
+        }
 
-  auto output = torch::empty_like(q);
-  handler_->batch_decode(q, kv_cache, input_params, sliding_window_, output);
+        if (params.kv_scores.defined()) {
+          accumulate_kv_scores(q,
+                               kv_cache,
+                               params.kv_score_q_idxes,
+                               params.kv_score_slots,
+                               params.kv_scores);
+        }
 
-  // reshape output to [n_tokens, n_heads * head_dim]
-  return output.view({n_tokens, -1});
+        // reshape output to [n_tokens, n_heads * head_dim]
+        return output.view({n_tokens, -1});
+      });
 }
 
 }  // namespace llm
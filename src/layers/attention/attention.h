@@ -19,13 +19,16 @@ class AttentionImpl : public torch::nn::Module {
   // query: [n_tokens, n_heads, head_dim]
   // key/value: [n_tokens, n_kv_heads, head_dim]
   // positions: [n_tokens]
+  // qkv_bias: [(n_heads + 2 * n_kv_heads) * head_dim], optional bias of the
+  // qkv projection, added together with the positional embedding
   // return: [n_tokens, n_heads, head_dim]
   torch::Tensor forward(const torch::Tensor& query,
                         const torch::Tensor& key,
                         const torch::Tensor& value,
                         const torch::Tensor& positions,
                         KVCache& kv_cache,
-                        const InputParameters& input_params);
+                        const InputParameters& input_params,
+                        const torch::Tensor& qkv_bias = torch::Tensor());
 
  private:
   int64_t n_heads_ = 0;
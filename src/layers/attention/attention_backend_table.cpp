@@ -0,0 +1,162 @@
+#include "attention_backend_table.h"
+
+#include <glog/logging.h>
+
+#include <fstream>
+#include <sstream>
+
+DEFINE_string(attention_backend_table,
+              "",
+              "file of the attention backend of each batch shape bucket, "
+              "written by the attention backend benchmark, used when "
+              "--attention_handler is auto");
+
+DEFINE_int32(flash_infer_min_kv_len,
+             8192,
+             "min kv length of the longest sequence of a decode batch to run "
+             "with flashinfer when --attention_handler is auto and the batch "
+             "is not found in --attention_backend_table");
+
+namespace llm {
+namespace {
+int64_t next_power_of_2(int64_t n) {
+  int64_t power = 1;
+  while (power < n) {
+    power *= 2;
+  }
+  return power;
+}
+}  // namespace
+
+const char* to_string(AttentionBackend backend) {
+  switch (backend) {
+    case AttentionBackend::kScaleAttn:
+      return "scale_attn";
+    case AttentionBackend::kFlashInfer:
+      return "flash_infer";
+  }
+  return "unknown";
+}
+
+std::optional<AttentionBackend> parse_attention_backend(
+    const std::string& name) {
+  if (name == "scale_attn") {
+    return AttentionBackend::kScaleAttn;
+  }
+  if (name == "flash_infer") {
+    return AttentionBackend::kFlashInfer;
+  }
+  return std::nullopt;
+}
+
+std::string AttentionBackendTable::make_key(int64_t head_dim,
+                                            int64_t group_size,
+                                            int64_t q_max_seq_len,
+                                            int64_t batch_size,
+                                            int64_t kv_max_seq_len) {
+  const char* phase = "prefill";
+  if (q_max_seq_len <= 1) {
+    phase = "decode";
+  } else if (q_max_seq_len <= kMaxVerifyQueryLen) {
+    phase = "verify";
+  }
+  std::stringstream ss;
+  ss << "hd" << head_dim << "_g" << group_size << "_" << phase << "_b"
+     << next_power_of_2(batch_size) << "_kv"
+     << next_power_of_2(kv_max_seq_len);
+  return ss.str();
+}
+
+AttentionBackendTable& AttentionBackendTable::get_instance() {
+  static AttentionBackendTable* table = [] {
+    auto* table = new AttentionBackendTable();
+    if (!FLAGS_attention_backend_table.empty()) {
+      if (table->load(FLAGS_attention_backend_table)) {
+        LOG(INFO) << "Loaded " << table->size()
+                  << " attention backend entries from "
+                  << FLAGS_attention_backend_table;
+      } else {
+        LOG(WARNING) << "Failed to load attention backends from "
+                     << FLAGS_attention_backend_table;
+      }
+    }
+    return table;
+  }();
+  return *table;
+}
+
+std::optional<AttentionBackend> AttentionBackendTable::lookup(
+    const std::string& key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = table_.find(key);
+  if (it == table_.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+AttentionBackend AttentionBackendTable::choose(int64_t head_dim,
+                                               int64_t group_size,
+                                               int64_t q_max_seq_len,
+                                               int64_t batch_size,
+                                               int64_t kv_max_seq_len) const {
+  const auto key = make_key(
+      head_dim, group_size, q_max_seq_len, batch_size, kv_max_seq_len);
+  if (const auto backend = lookup(key); backend.has_value()) {
+    return backend.value();
+  }
+  if (q_max_seq_len <= 1 && group_size > 1 &&
+      kv_max_seq_len >= FLAGS_flash_infer_min_kv_len) {
+    return AttentionBackend::kFlashInfer;
+  }
+  return AttentionBackend::kScaleAttn;
+}
+
+void AttentionBackendTable::insert(const std::string& key,
+                                   AttentionBackend backend) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  table_[key] = backend;
+}
+
+bool AttentionBackendTable::load(const std::string& path) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string line;
+  while (std::getline(file, line)) {
+    std::stringstream ss(line);
+    std::string key;
+    std::string name;
+    std::optional<AttentionBackend> backend;
+    if (ss >> key >> name) {
+      backend = parse_attention_backend(name);
+    }
+    if (!backend.has_value()) {
+      LOG(WARNING) << "Skipping invalid attention backend entry: " << line;
+      continue;
+    }
+    table_[key] = backend.value();
+  }
+  return true;
+}
+
+bool AttentionBackendTable::save(const std::string& path) const {
+  std::ofstream file(path);
+  if (!file.is_open()) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& [key, backend] : table_) {
+    file << key << " " << to_string(backend) << "\n";
+  }
+  return file.good();
+}
+
+size_t AttentionBackendTable::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return table_.size();
+}
+
+}  // namespace llm
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <gflags/gflags.h>
+
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+DECLARE_string(attention_backend_table);
+
+namespace llm {
+
+// the attention kernels a batch can run with
+enum class AttentionBackend : int8_t {
+  kScaleAttn = 0,
+  kFlashInfer,
+};
+
+// name of the backend, e.g. "scale_attn"
+const char* to_string(AttentionBackend backend);
+
+// parse the backend from its name, nullopt if unknown
+std::optional<AttentionBackend> parse_attention_backend(
+    const std::string& name);
+
+// The attention backend of each batch shape bucket, learned by timing the
+// backends with the attention backend benchmark, or loaded from the file of
+// --attention_backend_table. The batches are bucketed by the model shape,
+// the phase (decode, speculative verification with few query tokens, or
+// prefill and mixed batches), the number of sequences and the longest kv,
+// both rounded up to powers of 2.
+class AttentionBackendTable {
+ public:
+  // the max number of query tokens per sequence of verification batches
+  static constexpr int64_t kMaxVerifyQueryLen = 16;
+
+  // key of the bucket of a batch
+  static std::string make_key(int64_t head_dim,
+                              int64_t group_size,
+                              int64_t q_max_seq_len,
+                              int64_t batch_size,
+                              int64_t kv_max_seq_len);
+
+  // the process wide table, loaded from --attention_backend_table at the
+  // first use
+  static AttentionBackendTable& get_instance();
+
+  // returns the backend of the bucket, nullopt if the bucket is not found
+  std::optional<AttentionBackend> lookup(const std::string& key) const;
+
+  // the backend of the batch: the one of its bucket if found, or flashinfer
+  // for the decode batches of long contexts with grouped query attention.
+  AttentionBackend choose(int64_t head_dim,
+                          int64_t group_size,
+                          int64_t q_max_seq_len,
+                          int64_t batch_size,
+                          int64_t kv_max_seq_len) const;
+
+  void insert(const std::string& key, AttentionBackend backend);
+
+  // load and save the table as text, one bucket per line:
+  // "<key> <backend name>"
+  // lines without a valid backend are skipped.
+  bool load(const std::string& path);
+  bool save(const std::string& path) const;
+
+  size_t size() const;
+
+ private:
+  mutable std::mutex mutex_;
+
+  std::unordered_map<std::string, AttentionBackend> table_;
+};
+
+}  // namespace llm
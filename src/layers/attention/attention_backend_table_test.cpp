@@ -0,0 +1,68 @@
+#include "attention_backend_table.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+
+namespace llm {
+
+TEST(AttentionBackendTableTest, Key) {
+  // batches in the same bucket share the key
+  EXPECT_EQ(AttentionBackendTable::make_key(128, 4, 1, 5, 3000),
+            AttentionBackendTable::make_key(128, 4, 1, 8, 4096));
+  EXPECT_EQ(AttentionBackendTable::make_key(128, 4, 1, 5, 3000),
+            "hd128_g4_decode_b8_kv4096");
+  EXPECT_EQ(AttentionBackendTable::make_key(128, 4, 5, 8, 4096),
+            "hd128_g4_verify_b8_kv4096");
+  EXPECT_EQ(AttentionBackendTable::make_key(128, 4, 512, 8, 4096),
+            "hd128_g4_prefill_b8_kv4096");
+}
+
+TEST(AttentionBackendTableTest, Choose) {
+  AttentionBackendTable table;
+  // long decode with grouped query attention goes to flashinfer by default
+  EXPECT_EQ(table.choose(128, 4, 1, 8, 32768), AttentionBackend::kFlashInfer);
+  EXPECT_EQ(table.choose(128, 1, 1, 8, 32768), AttentionBackend::kScaleAttn);
+  EXPECT_EQ(table.choose(128, 4, 1, 8, 1024), AttentionBackend::kScaleAttn);
+  EXPECT_EQ(table.choose(128, 4, 512, 8, 32768), AttentionBackend::kScaleAttn);
+
+  // the learned backends override the default
+  table.insert(AttentionBackendTable::make_key(128, 4, 1, 8, 32768),
+               AttentionBackend::kScaleAttn);
+  table.insert(AttentionBackendTable::make_key(128, 4, 4, 8, 1024),
+               AttentionBackend::kFlashInfer);
+  EXPECT_EQ(table.choose(128, 4, 1, 8, 32768), AttentionBackend::kScaleAttn);
+  EXPECT_EQ(table.choose(128, 4, 4, 7, 1000), AttentionBackend::kFlashInfer);
+}
+
+TEST(AttentionBackendTableTest, SaveAndLoad) {
+  const auto path = std::filesystem::temp_directory_path() /
+                    "attention_backend_table_test.txt";
+  const auto decode_key = AttentionBackendTable::make_key(128, 4, 1, 8, 8192);
+  const auto verify_key = AttentionBackendTable::make_key(128, 4, 4, 8, 8192);
+
+  AttentionBackendTable table;
+  EXPECT_FALSE(table.lookup(decode_key).has_value());
+  table.insert(decode_key, AttentionBackend::kFlashInfer);
+  table.insert(verify_key, AttentionBackend::kScaleAttn);
+  ASSERT_TRUE(table.save(path.string()));
+
+  {
+    // append invalid entries
+    std::ofstream file(path, std::ios::app);
+    file << "hd64_g1_decode_b1_kv1024\n";
+    file << "hd64_g1_decode_b2_kv1024 unknown\n";
+  }
+
+  AttentionBackendTable loaded;
+  ASSERT_TRUE(loaded.load(path.string()));
+  EXPECT_EQ(loaded.size(), 2);
+  EXPECT_EQ(loaded.lookup(decode_key), AttentionBackend::kFlashInfer);
+  EXPECT_EQ(loaded.lookup(verify_key), AttentionBackend::kScaleAttn);
+
+  std::filesystem::remove(path);
+  EXPECT_FALSE(loaded.load(path.string()));
+}
+
+}  // namespace llm
@@ -0,0 +1,141 @@
+#include "attention_states.h"
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <utility>
+
+namespace llm {
+
+std::pair<torch::Tensor, torch::Tensor> attention_with_lse(
+    const torch::Tensor& query,  // [q_len, n_heads, head_dim]
+    const torch::Tensor& key,    // [k_len, n_kv_heads, head_dim]
+    const torch::Tensor& value,  // [k_len, n_kv_heads, head_dim]
+    int64_t q_start,
+    int64_t k_start,
+    bool causal,
+    float sm_scale) {
+  const int64_t q_len = query.size(0);
+  const int64_t n_heads = query.size(1);
+  const int64_t head_dim = query.size(2);
+  const int64_t k_len = key.size(0);
+  const int64_t n_kv_heads = key.size(1);
+  CHECK(n_heads % n_kv_heads == 0);
+  const int64_t group_size = n_heads / n_kv_heads;
+
+  // the query heads sharing a kv head are attended with one batched gemm
+  // => [n_kv_heads, group_size * q_len, head_dim]
+  const auto q = query.to(torch::kFloat)
+                     .view({q_len, n_kv_heads, group_size, head_dim})
+                     .permute({1, 2, 0, 3})
+                     .reshape({n_kv_heads, group_size * q_len, head_dim});
+  // => [n_kv_heads, k_len, head_dim]
+  const auto k = key.to(torch::kFloat).transpose(0, 1);
+  const auto v = value.to(torch::kFloat).transpose(0, 1);
+
+  // => [n_heads, q_len, k_len]
+  auto scores = torch::bmm(q, k.transpose(1, 2))
+                    .mul_(sm_scale)
+                    .view({n_heads, q_len, k_len});
+  if (causal) {
+    const auto options = torch::dtype(torch::kLong).device(query.device());
+    const auto q_pos = torch::arange(q_start, q_start + q_len, options);
+    const auto k_pos = torch::arange(k_start, k_start + k_len, options);
+    const auto mask = k_pos.unsqueeze(0) <= q_pos.unsqueeze(1);
+    scores.masked_fill_(mask.logical_not().unsqueeze(0), -INFINITY);
+  }
+
+  // rows without any visible key have lse of -inf and zero output
+  const auto lse = torch::logsumexp(scores, /*dim=*/-1, /*keepdim=*/true);
+  const auto safe_lse =
+      torch::where(torch::isinf(lse), torch::zeros_like(lse), lse);
+  const auto probs = torch::exp(scores - safe_lse);
+  // => [q_len, n_heads, head_dim]
+  auto out = torch::bmm(probs.view({n_kv_heads, group_size * q_len, k_len}), v)
+                 .view({n_kv_heads, group_size, q_len, head_dim})
+                 .permute({2, 0, 1, 3})
+                 .reshape({q_len, n_heads, head_dim});
+  return {out, lse.squeeze(-1).transpose(0, 1)};
+}
+
+void merge_attention_states(torch::Tensor& out,
+                            torch::Tensor& lse,
+                            const torch::Tensor& part_out,
+                            const torch::Tensor& part_lse) {
+  // rescale both sides to the max lse, which is -inf only if neither side
+  // attends any key
+  auto max_lse = torch::maximum(lse, part_lse);
+  max_lse =
+      torch::where(torch::isinf(max_lse), torch::zeros_like(max_lse), max_lse);
+  const auto scale = torch::exp(lse - max_lse);
+  const auto part_scale = torch::exp(part_lse - max_lse);
+  const auto sum = scale + part_scale;
+  const auto safe_sum = torch::where(sum > 0, sum, torch::ones_like(sum));
+  out.copy_((out * scale.unsqueeze(-1) + part_out * part_scale.unsqueeze(-1)) /
+            safe_sum.unsqueeze(-1));
+  lse.copy_(max_lse + torch::log(sum));
+}
+
+void accumulate_kv_scores(const torch::Tensor& query,
+                          const KVCache& kv_cache,
+                          const torch::Tensor& q_idxes,
+                          const torch::Tensor& slots,
+                          const torch::Tensor& scores) {
+  const int64_t n_seqs = q_idxes.size(0);
+  const int64_t window = q_idxes.size(1);
+  const int64_t max_kv_len = slots.size(1);
+  const int64_t n_heads = query.size(1);
+  const int64_t head_dim = query.size(2);
+
+  // [n_seqs * max_kv_len, n_kv_heads, head_dim], dequantized into float32 if
+  // the cache is quantized
+  const auto [key_cache, value_cache] =
+      kv_cache.get_kv_cache(slots.clamp_min(0).flatten());
+  const int64_t n_kv_heads = key_cache.size(1);
+  CHECK(n_heads % n_kv_heads == 0);
+  const int64_t group_size = n_heads / n_kv_heads;
+
+  // [n_seqs, window, n_heads, head_dim]
+  const auto q = query.index_select(/*dim=*/0, q_idxes.clamp_min(0).flatten())
+                     .view({n_seqs, window, n_heads, head_dim})
+                     .to(torch::kFloat32);
+
+  // the observed tokens are the last ones of their sequences, each attends
+  // to the tokens up to itself. [n_seqs, window, max_kv_len]
+  const auto kv_valid = slots >= 0;
+  const auto kv_lens = kv_valid.sum(/*dim=*/1);
+  const auto long_options = kv_lens.options();
+  const auto q_kv_idxes = kv_lens.unsqueeze(1) - window +
+                          torch::arange(window, long_options).unsqueeze(0);
+  const auto mask =
+      (torch::arange(max_kv_len, long_options).view({1, 1, -1}) <=
+       q_kv_idxes.unsqueeze(2)) &
+      kv_valid.unsqueeze(1) & (q_idxes >= 0).unsqueeze(2);
+
+  // one kv head is scored at a time to bound the memory of the logits for
+  // long sequences
+  const float sm_scale = 1.0f / std::sqrt(static_cast<float>(head_dim));
+  auto sums = torch::zeros({n_seqs, max_kv_len}, q.options());
+  for (int64_t h = 0; h < n_kv_heads; ++h) {
+    // [n_seqs, max_kv_len, head_dim]
+    const auto keys = key_cache.select(/*dim=*/1, h)
+                          .view({n_seqs, max_kv_len, head_dim})
+                          .to(torch::kFloat32);
+    // [n_seqs, window, group_size, head_dim]
+    const auto q_h = q.slice(/*dim=*/2, h * group_size, (h + 1) * group_size);
+    // [n_seqs, group_size, window, max_kv_len]
+    auto logits = torch::einsum("bwgd,bkd->bgwk", {q_h, keys}) * sm_scale;
+    logits.masked_fill_(~mask.unsqueeze(1),
+                        -std::numeric_limits<float>::infinity());
+    // the rows of padding tokens are all masked out
+    auto probs = torch::softmax(logits, /*dim=*/-1)
+                     .masked_fill_(~mask.unsqueeze(1), 0.0f);
+    sums.add_(probs.sum({1, 2}));
+  }
+  scores.add_(sums);
+}
+
+}  // namespace llm
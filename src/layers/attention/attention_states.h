@@ -0,0 +1,53 @@
+#pragma once
+
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <utility>
+
+#include "memory/kv_cache.h"
+
+namespace llm {
+
+// Attention over a subset of the keys together with its log-sum-exp, and the
+// merge of such partial outputs, so that the attention over keys held in
+// separate places can be computed piece by piece.
+
+// attention of the query tokens at positions [q_start, q_start + q_len) over
+// the keys at positions [k_start, k_start + k_len), masked causally if needed.
+// query: [q_len, n_heads, head_dim]
+// key/value: [k_len, n_kv_heads, head_dim]
+// returns the output [q_len, n_heads, head_dim] and lse [q_len, n_heads],
+// both FloatTensor.
+std::pair<torch::Tensor, torch::Tensor> attention_with_lse(
+    const torch::Tensor& query,
+    const torch::Tensor& key,
+    const torch::Tensor& value,
+    int64_t q_start,
+    int64_t k_start,
+    bool causal,
+    float sm_scale);
+
+// merge the attention output over another set of keys into the accumulated
+// output in place.
+// out/part_out: [n_tokens, n_heads, head_dim] FloatTensor
+// lse/part_lse: [n_tokens, n_heads] FloatTensor, -inf if no key is attended
+void merge_attention_states(torch::Tensor& out,
+                            torch::Tensor& lse,
+                            const torch::Tensor& part_out,
+                            const torch::Tensor& part_lse);
+
+// sum the attention probabilities of the observed tokens over the kv cache of
+// their sequences into scores, see InputParameters::kv_scores. the keys are
+// dequantized if the cache is quantized.
+// query: [n_tokens, n_heads, head_dim]
+// q_idxes: [n_seqs, window] IntTensor, -1 for padding in front
+// slots: [n_seqs, max_kv_len] IntTensor, -1 for padding
+// scores: [n_seqs, max_kv_len] FloatTensor, accumulated in place
+void accumulate_kv_scores(const torch::Tensor& query,
+                          const KVCache& kv_cache,
+                          const torch::Tensor& q_idxes,
+                          const torch::Tensor& slots,
+                          const torch::Tensor& scores);
+
+}  // namespace llm
@@ -0,0 +1,201 @@
+#include "attention_states.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "memory/kv_cache.h"
+
+namespace llm {
+namespace {
+// causal attention over the whole sequence
+torch::Tensor causal_attention(const torch::Tensor& query,
+                               const torch::Tensor& key,
+                               const torch::Tensor& value,
+                               float sm_scale) {
+  const int64_t seq_len = query.size(0);
+  const int64_t group_size = query.size(1) / key.size(1);
+  const auto k = key.repeat_interleave(group_size, /*dim=*/1);
+  const auto v = value.repeat_interleave(group_size, /*dim=*/1);
+  // => [n_heads, seq_len, seq_len]
+  auto scores = torch::einsum("qhd,khd->hqk", {query, k}) * sm_scale;
+  const auto mask = torch::ones({seq_len, seq_len}, torch::kBool).tril();
+  scores.masked_fill_(mask.logical_not(), -INFINITY);
+  const auto probs = torch::softmax(scores, /*dim=*/-1);
+  return torch::einsum("hqk,khd->qhd", {probs, v});
+}
+
+// the attention of the last query.size(0) tokens of a sequence over its keys,
+// summed over the tokens and heads. => [seq_len]
+torch::Tensor observed_attention(const torch::Tensor& query,
+                                 const torch::Tensor& key) {
+  const int64_t window = query.size(0);
+  const int64_t seq_len = key.size(0);
+  const int64_t group_size = query.size(1) / key.size(1);
+  const float sm_scale = 1.0 / std::sqrt(query.size(2));
+  const auto k = key.repeat_interleave(group_size, /*dim=*/1);
+  // => [n_heads, window, seq_len]
+  auto scores = torch::einsum("qhd,khd->hqk", {query, k}) * sm_scale;
+  const auto mask = torch::ones({window, seq_len}, torch::kBool)
+                        .tril(/*diagonal=*/seq_len - window);
+  scores.masked_fill_(mask.logical_not(), -INFINITY);
+  return torch::softmax(scores, /*dim=*/-1).sum({0, 1});
+}
+}  // namespace
+
+TEST(AttentionStatesTest, AttentionWithLse) {
+  const int64_t seq_len = 48;
+  const int64_t n_heads = 8;
+  const int64_t n_kv_heads = 2;
+  const int64_t head_dim = 32;
+  const float sm_scale = 1.0 / std::sqrt(head_dim);
+  torch::manual_seed(0);
+  const auto query = torch::randn({seq_len, n_heads, head_dim});
+  const auto key = torch::randn({seq_len, n_kv_heads, head_dim});
+  const auto value = torch::randn({seq_len, n_kv_heads, head_dim});
+  const auto ref_out = causal_attention(query, key, value, sm_scale);
+
+  const auto [out, lse] = attention_with_lse(query,
+                                             key,
+                                             value,
+                                             /*q_start=*/0,
+                                             /*k_start=*/0,
+                                             /*causal=*/true,
+                                             sm_scale);
+  EXPECT_TRUE(torch::allclose(out, ref_out, /*rtol=*/1e-4, /*atol=*/1e-4));
+  EXPECT_EQ(lse.sizes(), torch::IntArrayRef({seq_len, n_heads}));
+
+  // attend the second half of the queries to the keys in two pieces
+  const int64_t half = seq_len / 2;
+  const auto q = query.slice(/*dim=*/0, half);
+  auto [merged_out, merged_lse] = attention_with_lse(q,
+                                                     key.slice(0, 0, half),
+                                                     value.slice(0, 0, half),
+                                                     /*q_start=*/half,
+                                                     /*k_start=*/0,
+                                                     /*causal=*/false,
+                                                     sm_scale);
+  const auto [part_out, part_lse] = attention_with_lse(q,
+                                                       key.slice(0, half),
+                                                       value.slice(0, half),
+                                                       /*q_start=*/half,
+                                                       /*k_start=*/half,
+                                                       /*causal=*/true,
+                                                       sm_scale);
+  merge_attention_states(merged_out, merged_lse, part_out, part_lse);
+  EXPECT_TRUE(torch::allclose(merged_out,
+                              ref_out.slice(/*dim=*/0, half),
+                              /*rtol=*/1e-4,
+                              /*atol=*/1e-4));
+}
+
+TEST(AttentionStatesTest, MergeAttentionStates) {
+  const int64_t n_tokens = 8;
+  const int64_t n_heads = 4;
+  const int64_t head_dim = 16;
+  const int64_t n_keys = 32;
+  torch::manual_seed(0);
+  const auto scores = torch::randn({n_tokens, n_heads, n_keys});
+  const auto values = torch::randn({n_keys, head_dim});
+
+  // attention over a range of keys
+  const auto attend = [&](int64_t start, int64_t end) {
+    const auto s = scores.slice(/*dim=*/-1, start, end);
+    const auto lse = torch::logsumexp(s, /*dim=*/-1);
+    const auto out = torch::matmul(torch::softmax(s, /*dim=*/-1),
+                                   values.slice(/*dim=*/0, start, end));
+    return std::make_pair(out, lse);
+  };
+
+  // start from the empty state
+  auto out = torch::zeros({n_tokens, n_heads, head_dim});
+  auto lse = torch::full({n_tokens, n_heads}, -INFINITY);
+  for (const auto& [start, end] : {std::make_pair(0, 10),
+                                   std::make_pair(10, 11),
+                                   std::make_pair(11, 32)}) {
+    const auto [part_out, part_lse] = attend(start, end);
+    merge_attention_states(out, lse, part_out, part_lse);
+  }
+  const auto [ref_out, ref_lse] = attend(0, n_keys);
+  EXPECT_TRUE(torch::allclose(out, ref_out, /*rtol=*/1e-5, /*atol=*/1e-5));
+  EXPECT_TRUE(torch::allclose(lse, ref_lse, /*rtol=*/1e-5, /*atol=*/1e-5));
+
+  // merging an empty state is a no-op
+  const auto empty_out = torch::zeros_like(out);
+  const auto empty_lse = torch::full_like(lse, -INFINITY);
+  merge_attention_states(out, lse, empty_out, empty_lse);
+  EXPECT_TRUE(torch::allclose(out, ref_out, /*rtol=*/1e-5, /*atol=*/1e-5));
+}
+
+class AccumulateKVScoresTest
+    : public ::testing::TestWithParam<torch::ScalarType> {};
+
+TEST_P(AccumulateKVScoresTest, Cpu) {
+  const auto cache_dtype = GetParam();
+  const int64_t n_heads = 4;
+  const int64_t n_kv_heads = 2;
+  const int64_t head_dim = 32;
+  const int64_t block_size = 4;
+  const int64_t n_blocks = 8;
+  const int64_t window = 3;
+  const int64_t n_slots = n_blocks * block_size;
+
+  torch::manual_seed(0);
+  KVCache kv_cache(n_blocks,
+                   block_size,
+                   n_kv_heads,
+                   head_dim,
+                   torch::dtype(cache_dtype).device(torch::kCPU));
+  std::vector<int32_t> all_slots(n_slots);
+  for (int32_t i = 0; i < n_slots; ++i) {
+    all_slots[i] = i;
+  }
+  const auto keys = torch::randn({n_slots, n_kv_heads, head_dim});
+  kv_cache.set_kv_cache(all_slots, keys, torch::randn_like(keys));
+  // the keys as stored, dequantized if the cache is quantized
+  const auto [cached_keys, cached_values] = kv_cache.get_kv_cache(all_slots);
+
+  // two sequences of 10 and 7 tokens in scattered blocks, observed by their
+  // last 3 tokens in the batch
+  const std::vector<std::vector<int32_t>> seq_slots = {
+      {20, 21, 22, 23, 4, 5, 6, 7, 28, 29},
+      {8, 9, 10, 11, 12, 13, 14}};
+  const int64_t max_kv_len = 10;
+  const auto query = torch::randn({2 * window, n_heads, head_dim});
+  const auto q_idxes =
+      torch::arange(2 * window, torch::kInt).view({2, window});
+  auto slots = torch::full({2, max_kv_len}, -1, torch::kInt);
+  for (size_t i = 0; i < seq_slots.size(); ++i) {
+    const auto& s = seq_slots[i];
+    slots[i].slice(/*dim=*/0, 0, s.size()).copy_(torch::tensor(s, torch::kInt));
+  }
+
+  auto scores = torch::zeros({2, max_kv_len});
+  accumulate_kv_scores(query, kv_cache, q_idxes, slots, scores);
+
+  for (size_t i = 0; i < seq_slots.size(); ++i) {
+    const int64_t seq_len = seq_slots[i].size();
+    const auto ids = torch::tensor(seq_slots[i], torch::kLong);
+    const auto ref = observed_attention(
+        query.slice(/*dim=*/0, i * window, (i + 1) * window),
+        cached_keys.index_select(/*dim=*/0, ids).to(torch::kFloat32));
+    EXPECT_TRUE(torch::allclose(scores[i].slice(/*dim=*/0, 0, seq_len),
+                                ref,
+                                /*rtol=*/1e-4,
+                                /*atol=*/1e-4));
+    // the padding slots get no attention
+    EXPECT_TRUE(scores[i].slice(/*dim=*/0, seq_len).eq(0).all().item<bool>());
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(KVCacheDtypes,
+                         AccumulateKVScoresTest,
+                         ::testing::Values(torch::kFloat32,
+                                           torch::kInt8,
+                                           torch::kFloat8_e4m3fn));
+
+}  // namespace llm
@@ -13,6 +13,7 @@
 
 #include "gtest/gtest.h"
 #include "models/parameters.h"
+#include "flash_infer_handler.h"
 #include "ref_handler.h"
 #include "scale_attn_handler.h"
 
@@ -185,6 +186,22 @@ TEST_P(AttentionDecodeTest, KVCache) {
     std::cerr << "max diff: " << (ref_output - output).abs().max() << std::endl;
   }
   EXPECT_TRUE(success);
+
+  // flashinfer handler with the plan shared by the layers
+  if (head_dim == 64 || head_dim == 128) {
+    input_params.num_sequences = batch_size;
+    FlashInferPlan plan(device);
+    plan.plan(input_params, n_heads, kv_cache, dtype);
+    FlashInferPlan::set_current(&plan);
+    FlashInferHandler flash_infer_handler(
+        sm_scale, logits_soft_cap, alibi_slopes);
+    torch::Tensor flash_infer_output = torch::empty_like(query);
+    flash_infer_handler.batch_decode(
+        query, kv_cache, input_params, sliding_window, flash_infer_output);
+    FlashInferPlan::set_current(nullptr);
+    EXPECT_TRUE(torch::allclose(
+        ref_output, flash_infer_output, /*rtol=*/1e-2, /*atol=*/1e-3));
+  }
 }
 
 INSTANTIATE_TEST_SUITE_P(
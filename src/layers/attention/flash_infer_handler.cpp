@@ -0,0 +1,186 @@
+#include "flash_infer_handler.h"
+
+#include <ATen/cuda/CUDAContext.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <boost/algorithm/string.hpp>
+
+#include "attention_backend_table.h"
+#include "kernels/attention/attn_api.h"
+#include "kernels/attention/flash_infer/attention_wrapper.h"
+
+DECLARE_string(attention_handler);
+
+namespace llm {
+namespace {
+// workspace sizes of the flashinfer kernels
+constexpr int64_t kFloatWorkspaceBytes = 128 * 1024 * 1024;
+constexpr int64_t kIntWorkspaceBytes = 8 * 1024 * 1024;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+thread_local FlashInferPlan* current_plan = nullptr;
+
+bool is_supported(const InputParameters& params,
+                  int64_t n_heads,
+                  const KVCache& kv_cache,
+                  torch::ScalarType dtype) {
+  if (kv_cache.empty() || kv_cache.is_quantized() ||
+      kv_cache.layout() != KVCacheLayout::kNHD) {
+    return false;
+  }
+  // the splits of flashinfer depend on the batch
+  if (FLAGS_batch_invariant) {
+    return false;
+  }
+  // tree masks and cascade attention are only supported by scale_attn, and
+  // the rows of persistent block tables are not packed
+  if (params.tree_mask.defined() || params.num_prefix_groups > 0 ||
+      params.block_table_width > 0) {
+    return false;
+  }
+  const auto [key_cache, value_cache] = kv_cache.get_kv_cache();
+  const int64_t n_kv_heads = key_cache.size(-2);
+  const int64_t head_dim = key_cache.size(-1);
+  return (dtype == torch::kHalf || dtype == torch::kBFloat16) &&
+         key_cache.scalar_type() == dtype && n_heads % n_kv_heads == 0 &&
+         (head_dim == 64 || head_dim == 128 || head_dim == 256);
+}
+}  // namespace
+
+FlashInferPlan::FlashInferPlan(const torch::Device& device)
+    : wrapper_(std::make_unique<flashinfer::BatchPrefillWrapper>(
+          /*enable_cuda_graph=*/false)) {
+  CHECK(device.is_cuda()) << "flashinfer only supports cuda devices";
+  const auto options = torch::dtype(torch::kUInt8).device(device);
+  float_workspace_ = torch::empty({kFloatWorkspaceBytes}, options);
+  int_workspace_ = torch::empty({kIntWorkspaceBytes}, options);
+  wrapper_->UpdatePageLockedBufferSize(kIntWorkspaceBytes);
+}
+
+FlashInferPlan::~FlashInferPlan() = default;
+
+bool FlashInferPlan::enabled() {
+  return boost::iequals(FLAGS_attention_handler, "auto") ||
+         boost::iequals(FLAGS_attention_handler, "flash_infer");
+}
+
+bool FlashInferPlan::should_use(const InputParameters& params,
+                                int64_t n_heads,
+                                const KVCache& kv_cache,
+                                torch::ScalarType dtype) {
+  if (boost::iequals(FLAGS_attention_handler, "flash_infer")) {
+    return is_supported(params, n_heads, kv_cache, dtype);
+  }
+  if (!boost::iequals(FLAGS_attention_handler, "auto")) {
+    return false;
+  }
+  if (!is_supported(params, n_heads, kv_cache, dtype)) {
+    return false;
+  }
+  const auto [key_cache, value_cache] = kv_cache.get_kv_cache();
+  const auto backend = AttentionBackendTable::get_instance().choose(
+      /*head_dim=*/key_cache.size(-1),
+      /*group_size=*/n_heads / key_cache.size(-2),
+      params.q_max_seq_len,
+      params.num_sequences,
+      params.kv_max_seq_len);
+  return backend == AttentionBackend::kFlashInfer;
+}
+
+void FlashInferPlan::plan(const InputParameters& params,
+                          int64_t n_heads,
+                          const KVCache& kv_cache,
+                          torch::ScalarType dtype) {
+  CHECK_EQ(params.block_table_width, 0) << "block tables should be packed";
+  const int64_t block_size = kv_cache.block_size();
+  const auto [key_cache, value_cache] = kv_cache.get_kv_cache();
+
+  // the previous plan may still be copied from the page-locked buffer
+  planned_.synchronize();
+
+  q_cu_seq_lens_ = params.q_cu_seq_lens;
+  kv_cu_seq_lens_ = params.kv_cu_seq_lens;
+  // the block tables hold the first slot of each block
+  paged_kv_indices_ = torch::div(params.block_tables, block_size, "floor");
+  paged_kv_indptr_ = params.cu_block_lens;
+
+  // the lengths are copied to the host once for all layers
+  wrapper_->Plan(float_workspace_,
+                 int_workspace_,
+                 q_cu_seq_lens_,
+                 paged_kv_indptr_,
+                 params.num_sequences,
+                 n_heads,
+                 key_cache.size(-2),
+                 key_cache.size(-1),
+                 block_size,
+                 torch::empty({0}, torch::dtype(dtype)),
+                 /*num_sm=*/0);
+  planned_.record(at::cuda::getCurrentCUDAStream());
+}
+
+bool FlashInferPlan::matches(const InputParameters& params) const {
+  return q_cu_seq_lens_.defined() &&
+         params.q_cu_seq_lens.is_same(q_cu_seq_lens_);
+}
+
+void FlashInferPlan::run(const torch::Tensor& query,
+                         const KVCache& kv_cache,
+                         int32_t sliding_window,
+                         float sm_scale,
+                         float logits_soft_cap,
+                         const torch::optional<torch::Tensor>& alibi_slopes,
+                         torch::Tensor& output) {
+  const int64_t block_size = kv_cache.block_size();
+  const auto [key_cache, value_cache] = kv_cache.get_kv_cache();
+  // [n_blocks, block_size, n_kv_heads, head_dim]
+  const auto paged_key_cache = key_cache.view(
+      {-1, block_size, key_cache.size(-2), key_cache.size(-1)});
+  const auto paged_value_cache = value_cache.view(
+      {-1, block_size, value_cache.size(-2), value_cache.size(-1)});
+
+  std::optional<torch::Tensor> slopes;
+  if (alibi_slopes.has_value()) {
+    slopes = alibi_slopes.value().to(torch::kFloat32);
+  }
+  auto out = wrapper_->Run(query,
+                           q_cu_seq_lens_,
+                           kv_cu_seq_lens_,
+                           paged_key_cache,
+                           paged_value_cache,
+                           paged_kv_indptr_,
+                           paged_kv_indices_,
+                           /*window_left=*/sliding_window,
+                           logits_soft_cap,
+                           sm_scale,
+                           slopes);
+  output.copy_(out);
+}
+
+FlashInferPlan* FlashInferPlan::current() { return current_plan; }
+
+void FlashInferPlan::set_current(FlashInferPlan* plan) { current_plan = plan; }
+
+void FlashInferHandler::batch_decode(const torch::Tensor& query,
+                                     const KVCache& kv_cache,
+                                     const InputParameters& input_params,
+                                     int32_t sliding_window,
+                                     torch::Tensor& output) {
+  FlashInferPlan* plan = FlashInferPlan::current();
+  if (plan == nullptr || !plan->matches(input_params)) {
+    ScaleAttnHandler::batch_decode(
+        query, kv_cache, input_params, sliding_window, output);
+    return;
+  }
+  plan->run(query,
+            kv_cache,
+            sliding_window,
+            sm_scale_,
+            logits_soft_cap_,
+            alibi_slopes_,
+            output);
+}
+
+}  // namespace llm
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <ATen/cuda/CUDAEvent.h>
+#include <gflags/gflags.h>
+#include <torch/torch.h>
+
+#include <memory>
+
+#include "memory/kv_cache.h"
+#include "models/parameters.h"
+#include "scale_attn_handler.h"
+
+namespace flashinfer {
+class BatchPrefillWrapper;
+}  // namespace flashinfer
+
+namespace llm {
+
+// The work plan of the flashinfer attention kernels for the batch of a
+// forward pass: how the query and kv of each sequence are split across the
+// thread blocks. It is computed once on the host before the decoder layers
+// and shared by the attention of all layers, instead of planning per layer.
+class FlashInferPlan final {
+ public:
+  explicit FlashInferPlan(const torch::Device& device);
+
+  ~FlashInferPlan();
+
+  // whether --attention_handler may select flashinfer
+  static bool enabled();
+
+  // whether the batch runs with flashinfer, by --attention_handler and, for
+  // "auto", by the backend of the shape of the batch in the
+  // AttentionBackendTable.
+  static bool should_use(const InputParameters& params,
+                         int64_t n_heads,
+                         const KVCache& kv_cache,
+                         torch::ScalarType dtype);
+
+  // plan the batch with packed block tables. the kv cache is one of the
+  // layers, all layers have the same shape.
+  void plan(const InputParameters& params,
+            int64_t n_heads,
+            const KVCache& kv_cache,
+            torch::ScalarType dtype);
+
+  // whether the plan is for the batch of params
+  bool matches(const InputParameters& params) const;
+
+  // run the attention of a layer with the plan
+  void run(const torch::Tensor& query,  // [n_tokens, n_heads, head_dim]
+           const KVCache& kv_cache,
+           int32_t sliding_window,
+           float sm_scale,
+           float logits_soft_cap,
+           const torch::optional<torch::Tensor>& alibi_slopes,
+           torch::Tensor& output);
+
+  // the plan of the forward pass running on this thread, nullptr if none
+  static FlashInferPlan* current();
+  static void set_current(FlashInferPlan* plan);
+
+ private:
+  std::unique_ptr<flashinfer::BatchPrefillWrapper> wrapper_;
+
+  // workspace for the split kv partial outputs and the plan on the device
+  torch::Tensor float_workspace_;
+  torch::Tensor int_workspace_;
+
+  // the sequence lengths of the planned batch, also used to match the
+  // parameters passed to the layers
+  torch::Tensor q_cu_seq_lens_;
+  torch::Tensor kv_cu_seq_lens_;
+
+  // the block ids of the sequences and the offset of each sequence
+  torch::Tensor paged_kv_indices_;
+  torch::Tensor paged_kv_indptr_;
+
+  // recorded after the plan is copied to the device from the page-locked
+  // buffer, which is not overwritten by the next plan before then.
+  at::cuda::CUDAEvent planned_;
+};
+
+// A handler running decode attention with flashinfer for the batches planned
+// by FlashInferPlan, and with scale_attn otherwise.
+class FlashInferHandler : public ScaleAttnHandler {
+ public:
+  using ScaleAttnHandler::ScaleAttnHandler;
+
+  ~FlashInferHandler() override = default;
+
+  void batch_decode(
+      const torch::Tensor& query,  // [n_tokens, n_heads, head_dim]
+      const KVCache& kv_cache,     // where to store and retrieval key and value
+      const InputParameters& input_params,  // input paras used for attention
+      int32_t sliding_window,               // sliding window size
+      torch::Tensor& output) override;
+};
+
+}  // namespace llm
@@ -4,37 +4,96 @@
 #include <gflags/gflags.h>
 #include <torch/torch.h>
 
+#include <algorithm>
 #include <boost/algorithm/string.hpp>
 #include <memory>
+#include <string>
 
-#include "scale_attn_handler.h"
+#include "flash_infer_handler.h"
 #include "layers/pos_embedding.h"
+#include "scale_attn_handler.h"
 #include "ref_handler.h"
 
 // decide which attention implementation to use
 DEFINE_string(attention_handler,
               "auto",
-              "attention handler, e.g. auto, pytorch, scale_attn");
+              "attention handler, e.g. auto, pytorch, scale_attn, "
+              "flash_infer. auto picks the backend of each batch on cuda by "
+              "its shape, see --attention_backend_table.");
 
 namespace llm {
 
 namespace {
-torch::Tensor compute_inv_freq(int64_t rotary_dim, const ModelArgs& args) {
-  auto inv_freq =
-      detail::compute_default_inv_freq(rotary_dim, args.rope_theta());
-  if (boost::iequals(args.rope_scaling_rope_type(), "llama3")) {
+// compute the inverse frequencies of the rope scaling type, and the attention
+// factor that scales cos and sin.
+torch::Tensor compute_inv_freq(int64_t rotary_dim,
+                               const ModelArgs& args,
+                               float* attention_factor) {
+  const std::string& rope_type = args.rope_scaling_rope_type();
+  const float theta = args.rope_theta();
+  const float factor = args.rope_scaling_factor();
+  const int64_t max_position = args.max_position_embeddings();
+  // the context length the model was trained with before the scaling
+  const int64_t old_context_len =
+      args.rope_scaling_original_max_position_embeddings() > 0
+          ? args.rope_scaling_original_max_position_embeddings()
+          : max_position;
+
+  *attention_factor = 1.0f;
+  auto inv_freq = detail::compute_default_inv_freq(rotary_dim, theta);
+  if (rope_type.empty() || boost::iequals(rope_type, "default")) {
+    return inv_freq;
+  }
+  if (boost::iequals(rope_type, "llama3")) {
     return detail::apply_llama3_rope_scaling(
         inv_freq,
-        args.rope_scaling_factor(),
+        factor,
         args.rope_scaling_low_freq_factor(),
         args.rope_scaling_high_freq_factor(),
-        args.rope_scaling_original_max_position_embeddings());
+        old_context_len);
   }
-
-  if (!args.rope_scaling_rope_type().empty()) {
-    LOG(FATAL) << "Unsupported rope scaling type: "
-               << args.rope_scaling_rope_type();
+  if (boost::iequals(rope_type, "linear")) {
+    return inv_freq / factor;
+  }
+  if (boost::iequals(rope_type, "dynamic")) {
+    // ntk-aware scaling of the base for the longest sequence, which the
+    // factor extends the original context to. the base is scaled once
+    // instead of per batch, so the rotated keys in the kv cache stay valid as
+    // sequences grow.
+    const int64_t seq_len = std::max<int64_t>(
+        max_position, static_cast<int64_t>(old_context_len * factor));
+    const float scaled_theta = detail::dynamic_ntk_theta(
+        theta, factor, rotary_dim, seq_len, old_context_len);
+    return detail::compute_default_inv_freq(rotary_dim, scaled_theta);
   }
+  if (boost::iequals(rope_type, "yarn")) {
+    *attention_factor = args.rope_scaling_attention_factor().value_or(
+        detail::yarn_mscale(factor, args.rope_scaling_mscale()) /
+        detail::yarn_mscale(factor, args.rope_scaling_mscale_all_dim()));
+    return detail::apply_yarn_rope_scaling(inv_freq,
+                                           factor,
+                                           args.rope_scaling_beta_fast(),
+                                           args.rope_scaling_beta_slow(),
+                                           rotary_dim,
+                                           theta,
+                                           old_context_len);
+  }
+  if (boost::iequals(rope_type, "longrope") ||
+      boost::iequals(rope_type, "su")) {
+    // the long factors are used if the model serves beyond the original
+    // context, the short ones otherwise. the choice is made once instead of
+    // per batch for the same reason as the dynamic scaling.
+    const float long_factor =
+        static_cast<float>(max_position) / old_context_len;
+    *attention_factor = args.rope_scaling_attention_factor().value_or(
+        detail::longrope_attention_factor(long_factor, old_context_len));
+    return detail::apply_longrope_scaling(
+        inv_freq,
+        max_position > old_context_len ? args.rope_scaling_long_factor()
+                                       : args.rope_scaling_short_factor());
+  }
+
+  LOG(FATAL) << "Unsupported rope scaling type: " << rope_type;
   return inv_freq;
 }
 
@@ -68,11 +127,16 @@ std::unique_ptr<AttentionHandler> AttentionHandler::create_handler_with_alibi(
     return std::make_unique<ScaleAttnHandler>(
         sm_scale, args.attn_logit_soft_cap(), alibi_slopes);
   }
+  if (boost::iequals(FLAGS_attention_handler, "flash_infer")) {
+    CHECK(is_cuda) << "flash_infer only supports cuda device";
+    return std::make_unique<FlashInferHandler>(
+        sm_scale, args.attn_logit_soft_cap(), alibi_slopes);
+  }
 
   // choose the best handler based on device type
   if (is_cuda) {
-    // use scale_attn for cuda device
-    return std::make_unique<ScaleAttnHandler>(
+    // use flashinfer for the batches planned with it, scale_attn otherwise
+    return std::make_unique<FlashInferHandler>(
         sm_scale, args.attn_logit_soft_cap(), alibi_slopes);
   }
 
@@ -96,7 +160,8 @@ std::unique_ptr<AttentionHandler> AttentionHandler::create_handler_with_rope(
       args.attn_scalar().value_or(static_cast<float>(head_dim));
   const float sm_scale = 1.0f / std::sqrt(attn_scale);
 
-  const auto inv_freq = compute_inv_freq(rotary_dim, args);
+  float attention_factor = 1.0f;
+  const auto inv_freq = compute_inv_freq(rotary_dim, args, &attention_factor);
 
   // check if the user specified the attention handler
   if (boost::iequals(FLAGS_attention_handler, "pytorch")) {
@@ -105,6 +170,7 @@ std::unique_ptr<AttentionHandler> AttentionHandler::create_handler_with_rope(
                                         rotary_dim,
                                         args.max_position_embeddings(),
                                         inv_freq,
+                                        attention_factor,
                                         interleaved,
                                         options);
   }
@@ -117,20 +183,33 @@ std::unique_ptr<AttentionHandler> AttentionHandler::create_handler_with_rope(
                                               rotary_dim,
                                               args.max_position_embeddings(),
                                               inv_freq,
+                                              attention_factor,
                                               interleaved,
                                               options);
   }
+  if (boost::iequals(FLAGS_attention_handler, "flash_infer")) {
+    CHECK(is_cuda) << "flash_infer only supports cuda device";
+    return std::make_unique<FlashInferHandler>(sm_scale,
+                                               args.attn_logit_soft_cap(),
+                                               rotary_dim,
+                                               args.max_position_embeddings(),
+                                               inv_freq,
+                                               attention_factor,
+                                               interleaved,
+                                               options);
+  }
 
   // choose the best handler based on device type
   if (is_cuda) {
-    // use scale_attn for cuda device
-    return std::make_unique<ScaleAttnHandler>(sm_scale,
-                                              args.attn_logit_soft_cap(),
-                                              rotary_dim,
-                                              args.max_position_embeddings(),
-                                              inv_freq,
-                                              interleaved,
-                                              options);
+    // use flashinfer for the batches planned with it, scale_attn otherwise
+    return std::make_unique<FlashInferHandler>(sm_scale,
+                                               args.attn_logit_soft_cap(),
+                                               rotary_dim,
+                                               args.max_position_embeddings(),
+                                               inv_freq,
+                                               attention_factor,
+                                               interleaved,
+                                               options);
   }
 
   // use slower ref handler for other devices for now.
@@ -139,6 +218,7 @@ std::unique_ptr<AttentionHandler> AttentionHandler::create_handler_with_rope(
                                       rotary_dim,
                                       args.max_position_embeddings(),
                                       inv_freq,
+                                      attention_factor,
                                       interleaved,
                                       options);
 }
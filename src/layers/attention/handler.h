@@ -22,6 +22,10 @@ class AttentionHandler {
   // set workspace for temporary storage before calling any attention operations
   virtual void set_workspace(const torch::Tensor& workspace) {}
 
+  // the softmax scale of the plain scaled dot product attention, 0 if the
+  // logits are capped or biased, or the handler doesn't tell.
+  virtual float sm_scale() const { return 0.0f; }
+
   // apply positional embedding to query and key if needed
   virtual std::tuple<torch::Tensor, torch::Tensor> apply_pos_emb(
       const torch::Tensor& query,
@@ -44,6 +48,32 @@ class AttentionHandler {
       const torch::Tensor& value,  // [n_tokens, n_kv_heads, head_dim]
       const InputParameters& input_params) = 0;
 
+  // add the optional qkv bias and apply positional embedding to query and
+  // key, then append key and value to kv_cache. handlers may fuse them into
+  // one pass. returns the query.
+  virtual torch::Tensor apply_pos_emb_and_append_kv_cache(
+      KVCache& kv_cache,               // where to store key and value
+      const torch::Tensor& query,      // [n_tokens, n_heads, head_dim]
+      const torch::Tensor& key,        // [n_tokens, n_kv_heads, head_dim]
+      const torch::Tensor& value,      // [n_tokens, n_kv_heads, head_dim]
+      const torch::Tensor& positions,  // [n_tokens]
+      const InputParameters& input_params,
+      const torch::Tensor& qkv_bias) {  // [(n_heads + 2*n_kv_heads)*head_dim]
+    if (qkv_bias.defined()) {
+      // [n_heads + 2 * n_kv_heads, head_dim]
+      const auto bias = qkv_bias.view({-1, query.size(-1)});
+      const auto biases =
+          bias.split({query.size(-2), key.size(-2), value.size(-2)});
+      auto [q, k] =
+          apply_pos_emb(query + biases[0], key + biases[1], positions);
+      append_kv_cache(kv_cache, k, value + biases[2], input_params);
+      return q;
+    }
+    auto [q, k] = apply_pos_emb(query, key, positions);
+    append_kv_cache(kv_cache, k, value, input_params);
+    return q;
+  }
+
   // create an attention handler
   static std::unique_ptr<AttentionHandler> create_handler(
       const ModelArgs& args,
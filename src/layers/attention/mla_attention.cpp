@@ -0,0 +1,229 @@
+#include "mla_attention.h"
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "layers/attention/piecewise_graph.h"
+#include "layers/pos_embedding.h"
+#include "layers/weight_utils.h"
+#include "memory/kv_cache.h"
+#include "models/parameters.h"
+
+namespace llm {
+namespace {
+// max number of query positions attended at once, which bounds the scores to
+// n_seqs * n_heads * kQueryBlockSize * kv_max_seq_len floats
+constexpr int64_t kQueryBlockSize = 256;
+}  // namespace
+
+MLAAttentionImpl::MLAAttentionImpl(int64_t n_local_heads,
+                                   int64_t qk_nope_head_dim,
+                                   int64_t qk_rope_head_dim,
+                                   int64_t v_head_dim,
+                                   int64_t kv_lora_rank,
+                                   float sm_scale,
+                                   float rope_mscale,
+                                   int64_t max_position,
+                                   torch::Tensor inv_freq,
+                                   const ParallelArgs& parallel_args,
+                                   const torch::TensorOptions& options)
+    : n_local_heads_(n_local_heads),
+      qk_nope_head_dim_(qk_nope_head_dim),
+      qk_rope_head_dim_(qk_rope_head_dim),
+      v_head_dim_(v_head_dim),
+      kv_lora_rank_(kv_lora_rank),
+      sm_scale_(sm_scale),
+      parallel_args_(parallel_args) {
+  // the rotary key is shared by all heads, which has one head in the cache
+  rotary_emb_ = RotaryEmbedding(qk_rope_head_dim,
+                                max_position,
+                                inv_freq,
+                                /*interleaved=*/true,
+                                options,
+                                /*attention_factor=*/rope_mscale);
+  weight_ = register_parameter(
+      "weight",
+      torch::empty(
+          {n_local_heads * (qk_nope_head_dim + v_head_dim), kv_lora_rank},
+          options),
+      /*requires_grad=*/false);
+}
+
+torch::Tensor MLAAttentionImpl::forward(const torch::Tensor& query,
+                                        const torch::Tensor& latent,
+                                        const torch::Tensor& k_rope,
+                                        const torch::Tensor& positions,
+                                        KVCache& kv_cache,
+                                        const InputParameters& input_params) {
+  CHECK(!input_params.tree_mask.defined())
+      << "tree mask is not supported by mla";
+  CHECK(!input_params.offload_q_idxes.defined())
+      << "offloaded kv cache is not supported by mla";
+  const int64_t n_tokens = query.size(0);
+
+  // apply rotary embeddings to the rope parts of the query and key
+  // => [n_tokens, n_heads, qk_rope_head_dim], [n_tokens, 1, qk_rope_head_dim]
+  const auto [q_rope, k_rot] =
+      rotary_emb_(query.slice(/*dim=*/-1, qk_nope_head_dim_).contiguous(),
+                  k_rope.unsqueeze(/*dim=*/1).contiguous(),
+                  positions);
+
+  // [n_heads, qk_nope_head_dim + v_head_dim, kv_lora_rank]
+  const auto w = weight_.view({n_local_heads_, -1, kv_lora_rank_});
+  // absorb the key up projection into the query
+  // => [n_tokens, n_heads, kv_lora_rank]
+  const auto w_kc = w.slice(/*dim=*/1, 0, qk_nope_head_dim_);
+  const auto q_nope = query.slice(/*dim=*/-1, 0, qk_nope_head_dim_);
+  const auto q_latent =
+      torch::bmm(q_nope.transpose(0, 1), w_kc).transpose(0, 1);
+
+  // => [n_tokens, n_heads, kv_lora_rank + qk_rope_head_dim]
+  const auto q = torch::cat({q_latent, q_rope}, /*dim=*/-1);
+  // => [n_tokens, kv_lora_rank + qk_rope_head_dim]
+  const auto entries = torch::cat({latent, k_rot.squeeze(/*dim=*/1)}, -1);
+
+  // runs eagerly between the segments of piecewise cuda graphs
+  // => [n_tokens, n_heads, kv_lora_rank]
+  const auto out_latent = PiecewiseGraph::split(
+      {q, entries},
+      input_params,
+      [this, &kv_cache](const std::vector<torch::Tensor>& inputs,
+                        const InputParameters& params) {
+        const auto& new_q = inputs[0];
+        const auto& new_entries = inputs[1];
+        const int64_t num_tokens = new_q.size(0);
+        if (!kv_cache.empty()) {
+          // split the entries across the key and value cache
+          const int64_t half = new_entries.size(-1) / 2;
+          kv_cache.set_kv_cache(
+              params.new_cache_slots,
+              new_entries.slice(/*dim=*/-1, 0, half)
+                  .reshape({num_tokens, 1, half}),
+              new_entries.slice(/*dim=*/-1, half)
+                  .reshape({num_tokens, 1, half}));
+        }
+        return latent_attention(new_q, new_entries, kv_cache, params)
+            .to(new_q.dtype());
+      });
+
+  // absorb the value up projection into the output
+  // => [n_tokens, n_heads, v_head_dim]
+  const auto w_vc = w.slice(/*dim=*/1, qk_nope_head_dim_);
+  const auto out =
+      torch::bmm(out_latent.transpose(0, 1), w_vc.transpose(1, 2))
+          .transpose(0, 1);
+  return out.reshape({n_tokens, n_local_heads_ * v_head_dim_});
+}
+
+// the sequences are padded to q_max_seq_len queries and kv_max_seq_len keys,
+// and attended with batched gemms without host synchronization.
+torch::Tensor MLAAttentionImpl::latent_attention(
+    const torch::Tensor& query,
+    const torch::Tensor& entries,
+    const KVCache& kv_cache,
+    const InputParameters& input_params) const {
+  const int64_t n_tokens = query.size(0);
+  const int64_t n_seqs = input_params.num_sequences;
+  const int64_t q_max = input_params.q_max_seq_len;
+  const int64_t kv_max = input_params.kv_max_seq_len;
+  const auto device = query.device();
+  const auto long_options = torch::dtype(torch::kLong).device(device);
+
+  const auto q_cu = input_params.q_cu_seq_lens.to(torch::kLong);
+  const auto kv_cu = input_params.kv_cu_seq_lens.to(torch::kLong);
+  // [n_seqs, 1]
+  const auto q_lens =
+      (q_cu.slice(0, 1) - q_cu.slice(0, 0, n_seqs)).unsqueeze(1);
+  const auto kv_lens =
+      (kv_cu.slice(0, 1) - kv_cu.slice(0, 0, n_seqs)).unsqueeze(1);
+
+  // gather the kv entries of each sequence
+  // => [n_seqs, kv_max, kv_lora_rank + qk_rope_head_dim]
+  const auto kv_pos = torch::arange(kv_max, long_options).unsqueeze(0);
+  const auto kv_valid = kv_pos < kv_lens;
+  torch::Tensor kv;
+  if (kv_cache.empty()) {
+    // no cached tokens, attend the new tokens directly
+    const auto idx = (q_cu.slice(0, 0, n_seqs).unsqueeze(1) + kv_pos)
+                         .clamp(0, std::max<int64_t>(n_tokens - 1, 0));
+    kv = entries.index_select(/*dim=*/0, idx.flatten())
+             .view({n_seqs, kv_max, -1});
+  } else {
+    const int64_t block_size = kv_cache.block_size();
+    const auto block_tables = input_params.block_tables.to(torch::kLong);
+    const auto block_idx =
+        (input_params.cu_block_lens.slice(0, 0, n_seqs)
+             .to(torch::kLong)
+             .unsqueeze(1) +
+         kv_pos.div(block_size, /*rounding_mode=*/"floor"))
+            .clamp(0, std::max<int64_t>(block_tables.numel() - 1, 0));
+    auto slots = block_tables.index_select(0, block_idx.flatten())
+                     .view({n_seqs, kv_max}) *
+                     block_size +
+                 kv_pos.remainder(block_size);
+    // read slot 0 for the padding positions, which are masked out
+    slots = slots.masked_fill(kv_valid.logical_not(), 0).to(torch::kInt);
+    const auto [keys, values] = kv_cache.get_kv_cache(slots.flatten());
+    kv = torch::cat({keys, values}, /*dim=*/-1).view({n_seqs, kv_max, -1});
+  }
+  kv = kv.to(torch::kFloat);
+  const auto kv_latent = kv.slice(/*dim=*/-1, 0, kv_lora_rank_);
+
+  // pad the queries of each sequence
+  // => [n_seqs, q_max, n_heads, kv_lora_rank + qk_rope_head_dim]
+  const auto q_pos = torch::arange(q_max, long_options).unsqueeze(0);
+  const auto q_idx = (q_cu.slice(0, 0, n_seqs).unsqueeze(1) + q_pos)
+                         .clamp(0, std::max<int64_t>(n_tokens - 1, 0));
+  const auto q = query.to(torch::kFloat)
+                     .index_select(/*dim=*/0, q_idx.flatten())
+                     .view({n_seqs, q_max, n_local_heads_, -1});
+
+  std::vector<torch::Tensor> outputs;
+  for (int64_t start = 0; start < q_max; start += kQueryBlockSize) {
+    const int64_t end = std::min(start + kQueryBlockSize, q_max);
+    // => [n_seqs, n_heads, q_block, kv_max]
+    auto scores = torch::einsum("sqhd,skd->shqk", {q.slice(1, start, end), kv})
+                      .mul_(sm_scale_);
+    // query p of a sequence is at position kv_len - q_len + p. key 0 is kept
+    // for the padding queries to avoid rows without any key.
+    // => [n_seqs, q_block, kv_max]
+    const auto p = q_pos.slice(/*dim=*/1, start, end).unsqueeze(-1);
+    const auto k = kv_pos.unsqueeze(1);
+    const auto mask = ((k <= (kv_lens - q_lens).unsqueeze(-1) + p) &
+                       kv_valid.unsqueeze(1)) |
+                      (k == 0);
+    scores.masked_fill_(mask.logical_not().unsqueeze(1), -INFINITY);
+    const auto probs = torch::softmax(scores, /*dim=*/-1);
+    // => [n_seqs, q_block, n_heads, kv_lora_rank]
+    outputs.push_back(torch::einsum("shqk,skr->sqhr", {probs, kv_latent}));
+  }
+  // => [n_seqs * q_max, n_heads, kv_lora_rank]
+  const auto out = torch::cat(outputs, /*dim=*/1)
+                       .view({n_seqs * q_max, n_local_heads_, kv_lora_rank_});
+
+  // gather the outputs back to the tokens, padding tokens after the last
+  // sequence read the last position.
+  const auto tokens = torch::arange(n_tokens, long_options);
+  const auto seq_ids =
+      (torch::searchsorted(q_cu, tokens, /*out_int32=*/false, /*right=*/true) -
+       1)
+          .clamp(0, n_seqs - 1);
+  const auto offsets =
+      (tokens - q_cu.index_select(/*dim=*/0, seq_ids)).clamp(0, q_max - 1);
+  return out.index_select(/*dim=*/0, seq_ids * q_max + offsets);
+}
+
+void MLAAttentionImpl::load_state_dict(const StateDict& state_dict) {
+  const auto rank = parallel_args_.rank();
+  const auto world_size = parallel_args_.world_size();
+
+  // load sharded weights on dim 0, by heads
+  LOAD_SHARDED_WEIGHT(weight, 0);
+}
+
+}  // namespace llm
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <string>
+
+#include "layers/pos_embedding.h"
+#include "layers/weight_utils.h"
+#include "memory/kv_cache.h"
+#include "model_parallel/parallel_args.h"
+#include "models/parameters.h"
+
+namespace llm {
+
+// Multi-head latent attention (MLA) as in DeepSeek-V2. Keys and values of all
+// heads are projected up from one low-rank latent of kv_lora_rank, and each
+// query/key head has an extra qk_rope_head_dim part with rotary embeddings
+// shared by all key heads. Only the latent and the rotary key of each token
+// are cached, as a single kv head: the first half of [latent, k_rope] goes to
+// the key cache and the second half to the value cache, see mla_cache_dim().
+//
+// The up projections are absorbed into the query and the output: the query is
+// projected into the latent space and attends the cached latents directly, and
+// the attention output in the latent space is projected up to the values.
+class MLAAttentionImpl : public torch::nn::Module {
+ public:
+  // n_local_heads: number of query heads of the rank
+  // sm_scale: softmax scale of the attention scores
+  // rope_mscale: scale of the query and key after rotary embeddings, applied
+  // by the rotary embeddings to cos and sin
+  // inv_freq: inverse frequencies of the rotary embeddings
+  MLAAttentionImpl(int64_t n_local_heads,
+                   int64_t qk_nope_head_dim,
+                   int64_t qk_rope_head_dim,
+                   int64_t v_head_dim,
+                   int64_t kv_lora_rank,
+                   float sm_scale,
+                   float rope_mscale,
+                   int64_t max_position,
+                   torch::Tensor inv_freq,
+                   const ParallelArgs& parallel_args,
+                   const torch::TensorOptions& options);
+
+  // head_dim of the kv cache for the latent and the rotary key of a token
+  static int64_t mla_cache_dim(int64_t kv_lora_rank, int64_t qk_rope_head_dim) {
+    CHECK((kv_lora_rank + qk_rope_head_dim) % 2 == 0)
+        << "kv_lora_rank + qk_rope_head_dim should be even";
+    return (kv_lora_rank + qk_rope_head_dim) / 2;
+  }
+
+  // query: [n_tokens, n_local_heads, qk_nope_head_dim + qk_rope_head_dim]
+  // latent: [n_tokens, kv_lora_rank], normalized
+  // k_rope: [n_tokens, qk_rope_head_dim], before rotary embeddings
+  // positions: [n_tokens]
+  // return: [n_tokens, n_local_heads * v_head_dim]
+  torch::Tensor forward(const torch::Tensor& query,
+                        const torch::Tensor& latent,
+                        const torch::Tensor& k_rope,
+                        const torch::Tensor& positions,
+                        KVCache& kv_cache,
+                        const InputParameters& input_params);
+
+  // load kv_b_proj.weight: [n_heads * (qk_nope_head_dim + v_head_dim),
+  // kv_lora_rank], sharded by heads
+  void load_state_dict(const StateDict& state_dict);
+
+  void verify_loaded_weights(const std::string& prefix) const {
+    CHECK(weight_is_loaded_)
+        << "weight is not loaded for " << prefix + "weight";
+  }
+
+ private:
+  // attention of the query over the cached latents of each sequence.
+  // query: [n_tokens, n_local_heads, kv_lora_rank + qk_rope_head_dim]
+  // entries: [n_tokens, kv_lora_rank + qk_rope_head_dim] of the new tokens
+  // return: [n_tokens, n_local_heads, kv_lora_rank]
+  torch::Tensor latent_attention(const torch::Tensor& query,
+                                 const torch::Tensor& entries,
+                                 const KVCache& kv_cache,
+                                 const InputParameters& input_params) const;
+
+  int64_t n_local_heads_ = 0;
+  int64_t qk_nope_head_dim_ = 0;
+  int64_t qk_rope_head_dim_ = 0;
+  int64_t v_head_dim_ = 0;
+  int64_t kv_lora_rank_ = 0;
+
+  float sm_scale_ = 1.0f;
+
+  RotaryEmbedding rotary_emb_{nullptr};
+
+  // the up projection of keys and values:
+  // [n_local_heads * (qk_nope_head_dim + v_head_dim), kv_lora_rank]
+  DEFINE_WEIGHT(weight);
+
+  ParallelArgs parallel_args_;
+};
+TORCH_MODULE(MLAAttention);
+
+}  // namespace llm
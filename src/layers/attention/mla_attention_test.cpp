@@ -0,0 +1,191 @@
+#include "mla_attention.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "layers/pos_embedding.h"
+#include "memory/kv_cache.h"
+#include "model_loader/state_dict.h"
+#include "models/parameters.h"
+
+namespace llm {
+namespace {
+constexpr int64_t kHeads = 2;
+constexpr int64_t kNopeDim = 8;
+constexpr int64_t kRopeDim = 4;
+constexpr int64_t kVDim = 6;
+constexpr int64_t kLoraRank = 12;
+constexpr int64_t kBlockSize = 4;
+constexpr int64_t kMaxPosition = 64;
+
+// causal attention of one sequence with keys and values projected up from
+// the latents.
+// query: [n_tokens, n_heads, nope + rope]
+// latent: [n_tokens, kv_lora_rank], k_rope: [n_tokens, rope] rotated
+// return: [n_tokens, n_heads * v_head_dim]
+torch::Tensor mha_attention(const torch::Tensor& query,
+                            const torch::Tensor& latent,
+                            const torch::Tensor& k_rope,
+                            const torch::Tensor& weight,
+                            float sm_scale) {
+  const int64_t n_tokens = query.size(0);
+  // => [n_tokens, n_heads, nope + v]
+  const auto kv =
+      torch::matmul(latent, weight.t()).view({n_tokens, kHeads, -1});
+  const auto key = torch::cat(
+      {kv.slice(-1, 0, kNopeDim),
+       k_rope.unsqueeze(1).expand({n_tokens, kHeads, kRopeDim})},
+      /*dim=*/-1);
+  const auto value = kv.slice(-1, kNopeDim);
+  // => [n_heads, n_tokens, n_tokens]
+  auto scores = torch::einsum("qhd,khd->hqk", {query, key}).mul_(sm_scale);
+  const auto mask = torch::ones({n_tokens, n_tokens}, torch::kBool).tril();
+  scores.masked_fill_(mask.logical_not(), -INFINITY);
+  const auto probs = torch::softmax(scores, /*dim=*/-1);
+  return torch::einsum("hqk,khd->qhd", {probs, value})
+      .reshape({n_tokens, kHeads * kVDim});
+}
+
+// slot ids of the tokens [start, end) of the sequence with the blocks
+torch::Tensor slot_ids(const std::vector<int32_t>& blocks,
+                       int32_t start,
+                       int32_t end) {
+  std::vector<int32_t> slots;
+  for (int32_t i = start; i < end; ++i) {
+    slots.push_back(blocks[i / kBlockSize] * kBlockSize + i % kBlockSize);
+  }
+  return torch::tensor(slots, torch::kInt);
+}
+}  // namespace
+
+TEST(MLAAttentionTest, SameAsMHA) {
+  torch::manual_seed(0);
+  const auto options = torch::dtype(torch::kFloat);
+  const float sm_scale = 1.0f / std::sqrt(kNopeDim + kRopeDim);
+  const auto inv_freq = detail::compute_default_inv_freq(kRopeDim, 10000.0f);
+
+  MLAAttention attention(kHeads,
+                         kNopeDim,
+                         kRopeDim,
+                         kVDim,
+                         kLoraRank,
+                         sm_scale,
+                         /*rope_mscale=*/1.0f,
+                         kMaxPosition,
+                         inv_freq,
+                         ParallelArgs(0, 1, nullptr),
+                         options);
+  const auto weight =
+      torch::randn({kHeads * (kNopeDim + kVDim), kLoraRank}, options);
+  attention->load_state_dict(StateDict({{"weight", weight}}));
+  attention->verify_loaded_weights("");
+
+  const int64_t cache_dim =
+      MLAAttentionImpl::mla_cache_dim(kLoraRank, kRopeDim);
+  KVCache kv_cache(
+      /*n_blocks=*/8, kBlockSize, /*n_kv_heads=*/1, cache_dim, options);
+
+  // two sequences of 5 and 6 tokens, prefilled with 3 and 5 tokens
+  const std::vector<int32_t> seq_lens = {5, 6};
+  const std::vector<int32_t> prefill_lens = {3, 5};
+  const std::vector<std::vector<int32_t>> blocks = {{1, 2}, {3, 4}};
+  std::vector<torch::Tensor> queries;
+  std::vector<torch::Tensor> latents;
+  std::vector<torch::Tensor> k_ropes;
+  for (int32_t len : seq_lens) {
+    queries.push_back(
+        torch::randn({len, kHeads, kNopeDim + kRopeDim}, options));
+    latents.push_back(torch::randn({len, kLoraRank}, options));
+    k_ropes.push_back(torch::randn({len, kRopeDim}, options));
+  }
+
+  // run the tokens [starts[i], ends[i]) of each sequence
+  auto run = [&](const std::vector<int32_t>& starts,
+                 const std::vector<int32_t>& ends) {
+    InputParameters params;
+    params.num_sequences = 2;
+    std::vector<int32_t> q_cu = {0};
+    std::vector<int32_t> kv_cu = {0};
+    std::vector<torch::Tensor> q, latent, k_rope, positions, slots;
+    for (size_t i = 0; i < 2; ++i) {
+      q_cu.push_back(q_cu.back() + ends[i] - starts[i]);
+      kv_cu.push_back(kv_cu.back() + ends[i]);
+      params.q_max_seq_len =
+          std::max<int32_t>(params.q_max_seq_len, ends[i] - starts[i]);
+      params.kv_max_seq_len =
+          std::max<int32_t>(params.kv_max_seq_len, ends[i]);
+      q.push_back(queries[i].slice(0, starts[i], ends[i]));
+      latent.push_back(latents[i].slice(0, starts[i], ends[i]));
+      k_rope.push_back(k_ropes[i].slice(0, starts[i], ends[i]));
+      positions.push_back(torch::arange(starts[i], ends[i], torch::kInt));
+      slots.push_back(slot_ids(blocks[i], starts[i], ends[i]));
+    }
+    params.q_cu_seq_lens = torch::tensor(q_cu, torch::kInt);
+    params.kv_cu_seq_lens = torch::tensor(kv_cu, torch::kInt);
+    params.new_cache_slots = torch::cat(slots);
+    params.block_tables = torch::tensor({1, 2, 3, 4}, torch::kInt);
+    params.cu_block_lens = torch::tensor({0, 2, 4}, torch::kInt);
+    return attention(torch::cat(q),
+                     torch::cat(latent),
+                     torch::cat(k_rope),
+                     torch::cat(positions),
+                     kv_cache,
+                     params);
+  };
+
+  const auto prefill_out = run({0, 0}, prefill_lens);
+  const auto out = run(prefill_lens, seq_lens);
+
+  // rotate the full sequences for the reference
+  RotaryEmbedding rotary_emb(
+      kRopeDim, kMaxPosition, inv_freq, /*interleaved=*/true, options);
+  std::vector<torch::Tensor> prefill_expected;
+  std::vector<torch::Tensor> expected;
+  for (size_t i = 0; i < 2; ++i) {
+    const int32_t len = seq_lens[i];
+    auto query = queries[i].clone();
+    const auto [q_rope, k_rope] =
+        rotary_emb(query.slice(-1, kNopeDim).contiguous(),
+                   k_ropes[i].unsqueeze(1).contiguous(),
+                   torch::arange(len, torch::kInt));
+    query.slice(-1, kNopeDim).copy_(q_rope);
+    const auto ref = mha_attention(
+        query, latents[i], k_rope.squeeze(1), weight, sm_scale);
+    prefill_expected.push_back(ref.slice(0, 0, prefill_lens[i]));
+    expected.push_back(ref.slice(0, prefill_lens[i]));
+  }
+  EXPECT_TRUE(torch::allclose(prefill_out,
+                              torch::cat(prefill_expected),
+                              /*rtol=*/1e-4,
+                              /*atol=*/1e-4));
+  EXPECT_TRUE(torch::allclose(out,
+                              torch::cat(expected),
+                              /*rtol=*/1e-4,
+                              /*atol=*/1e-4));
+
+  // same results without kv cache
+  KVCache empty_cache;
+  InputParameters params;
+  params.num_sequences = 1;
+  params.q_cu_seq_lens = torch::tensor({0, seq_lens[1]}, torch::kInt);
+  params.kv_cu_seq_lens = params.q_cu_seq_lens;
+  params.q_max_seq_len = seq_lens[1];
+  params.kv_max_seq_len = seq_lens[1];
+  const auto no_cache_out = attention(queries[1],
+                                      latents[1],
+                                      k_ropes[1],
+                                      torch::arange(seq_lens[1], torch::kInt),
+                                      empty_cache,
+                                      params);
+  EXPECT_TRUE(torch::allclose(no_cache_out.slice(0, prefill_lens[1]),
+                              expected[1],
+                              /*rtol=*/1e-4,
+                              /*atol=*/1e-4));
+}
+
+}  // namespace llm
@@ -0,0 +1,116 @@
+#include "piecewise_graph.h"
+
+#include <ATen/cuda/CUDAGraph.h>
+#include <c10/cuda/CUDAGuard.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace llm {
+namespace {
+// the piecewise graph being captured on this thread
+thread_local PiecewiseGraph* capturing_graph = nullptr;
+}  // namespace
+
+torch::Tensor PiecewiseGraph::split(const std::vector<torch::Tensor>& inputs,
+                                    const InputParameters& params,
+                                    EagerFn fn) {
+  if (capturing_graph == nullptr) {
+    return fn(inputs, params);
+  }
+  return capturing_graph->split_segment(inputs, params, std::move(fn));
+}
+
+torch::Tensor PiecewiseGraph::capture(
+    at::cuda::MempoolId_t mem_pool,
+    const std::function<torch::Tensor()>& forward) {
+  CHECK(segments_.empty()) << "graph already captured";
+  CHECK(capturing_graph == nullptr) << "nested piecewise graph capture";
+  mem_pool_ = mem_pool;
+
+  at::cuda::CUDAStream capture_stream = at::cuda::getStreamFromPool();
+  at::cuda::CUDAStreamGuard stream_guard(capture_stream);
+  capturing_graph = this;
+  begin_segment();
+  output_ = forward();
+  end_segment();
+  capturing_graph = nullptr;
+  CHECK(!splits_.empty()) << "no calls are split from the graph";
+  return output_;
+}
+
+torch::Tensor PiecewiseGraph::replay(int64_t n_tokens,
+                                     const InputParameters& params) {
+  CHECK(!segments_.empty()) << "graph not captured";
+  CHECK_LE(n_tokens, output_.size(/*dim=*/0)) << "too many tokens";
+
+  std::vector<torch::Tensor> inputs;
+  for (size_t i = 0; i < splits_.size(); ++i) {
+    segments_[i]->replay();
+
+    const auto& split = splits_[i];
+    inputs.clear();
+    for (const auto& input : split.inputs) {
+      inputs.push_back(input.slice(/*dim=*/0, /*start=*/0, /*end=*/n_tokens));
+    }
+    const auto output = split.fn(inputs, params);
+    split.output.slice(/*dim=*/0, /*start=*/0, /*end=*/n_tokens)
+        .copy_(output);
+  }
+  segments_.back()->replay();
+  return output_;
+}
+
+torch::Tensor PiecewiseGraph::split_segment(
+    const std::vector<torch::Tensor>& inputs,
+    const InputParameters& params,
+    EagerFn fn) {
+  Split split;
+  // copy the inputs into the static buffers at the end of the segment
+  for (const auto& input : inputs) {
+    auto buffer = static_buffer(input, split.inputs, &input_buffers_);
+    buffer.copy_(input);
+    split.inputs.push_back(buffer);
+  }
+  end_segment();
+
+  // run the call once for the shape of its output. the buffers hold no values
+  // yet, the parameters of the capture only write into the padding slots.
+  const auto output = fn(split.inputs, params);
+  split.output = static_buffer(output, /*used=*/{}, &output_buffers_);
+  split.fn = std::move(fn);
+  splits_.push_back(std::move(split));
+
+  begin_segment();
+  return splits_.back().output;
+}
+
+void PiecewiseGraph::begin_segment() {
+  auto& segment =
+      segments_.emplace_back(std::make_unique<at::cuda::CUDAGraph>());
+  segment->capture_begin(mem_pool_, cudaStreamCaptureModeThreadLocal);
+}
+
+void PiecewiseGraph::end_segment() { segments_.back()->capture_end(); }
+
+torch::Tensor PiecewiseGraph::static_buffer(
+    const torch::Tensor& tensor,
+    const std::vector<torch::Tensor>& used,
+    std::vector<torch::Tensor>* buffers) {
+  for (const auto& buffer : *buffers) {
+    const bool in_use =
+        std::any_of(used.begin(), used.end(), [&](const torch::Tensor& t) {
+          return t.is_same(buffer);
+        });
+    if (!in_use && buffer.sizes() == tensor.sizes() &&
+        buffer.dtype() == tensor.dtype()) {
+      return buffer;
+    }
+  }
+  return buffers->emplace_back(torch::empty(tensor.sizes(), tensor.options()));
+}
+
+}  // namespace llm
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <ATen/cuda/CUDAGraph.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "models/parameters.h"
+
+namespace llm {
+
+// A cuda graph of a forward pass captured in segments around the calls that
+// can't be captured, i.e. the attention, whose kernels and workspaces depend
+// on the varlen metadata of the batch. The segments in between, e.g. norms,
+// qkv and output projections and mlps, are replayed from graphs while the
+// attention runs eagerly with the parameters of the batch.
+//
+// The inputs and outputs of the eager calls go through static buffers of the
+// graph, so the graph only depends on the number of tokens: batches with
+// fewer tokens are padded, and the eager calls only see the tokens of the
+// batch. The padding tokens compute garbage which is never read.
+class PiecewiseGraph final {
+ public:
+  // inputs: [n_tokens, ...] each, contiguous
+  // returns: [n_tokens, ...]
+  using EagerFn =
+      std::function<torch::Tensor(const std::vector<torch::Tensor>& inputs,
+                                  const InputParameters& params)>;
+
+  // run fn on the inputs. while a piecewise graph is captured on this thread,
+  // the current segment ends after the inputs are copied into the static
+  // buffers, fn is recorded to run at replay and the next segment begins.
+  static torch::Tensor split(const std::vector<torch::Tensor>& inputs,
+                             const InputParameters& params,
+                             EagerFn fn);
+
+  // capture the segments of the forward pass with the calls split by split().
+  // forward runs the model with the static inputs of the graph.
+  // returns the static output of the forward pass.
+  torch::Tensor capture(at::cuda::MempoolId_t mem_pool,
+                        const std::function<torch::Tensor()>& forward);
+
+  // replay the segments with the eager calls in between on the first
+  // n_tokens tokens of the static buffers.
+  // returns the static output of the forward pass, padded to the captured
+  // number of tokens.
+  torch::Tensor replay(int64_t n_tokens, const InputParameters& params);
+
+  // number of the eager calls between the segments
+  size_t num_splits() const { return splits_.size(); }
+
+ private:
+  struct Split {
+    EagerFn fn;
+    // static buffers of the inputs and the output of fn
+    std::vector<torch::Tensor> inputs;
+    torch::Tensor output;
+  };
+
+  // end the current segment at the eager call and begin the next one
+  torch::Tensor split_segment(const std::vector<torch::Tensor>& inputs,
+                              const InputParameters& params,
+                              EagerFn fn);
+
+  void begin_segment();
+
+  void end_segment();
+
+  // a static buffer from buffers with the shape and dtype of tensor that is
+  // not in use, or a new one appended to buffers.
+  static torch::Tensor static_buffer(const torch::Tensor& tensor,
+                                     const std::vector<torch::Tensor>& used,
+                                     std::vector<torch::Tensor>* buffers);
+
+  at::cuda::MempoolId_t mem_pool_;
+
+  // the captured segments, one more than the splits
+  std::vector<std::unique_ptr<at::cuda::CUDAGraph>> segments_;
+
+  // the eager calls between the segments
+  std::vector<Split> splits_;
+
+  // static buffers shared by the splits. the inputs of a split are only
+  // read by its eager call, and its output only by the next segment, so the
+  // splits reuse the buffers of the same shape.
+  std::vector<torch::Tensor> input_buffers_;
+  std::vector<torch::Tensor> output_buffers_;
+
+  // static output of the forward pass
+  torch::Tensor output_;
+};
+
+}  // namespace llm
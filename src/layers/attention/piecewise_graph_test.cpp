@@ -0,0 +1,95 @@
+#include "piecewise_graph.h"
+
+#include <ATen/cuda/CUDAGraph.h>
+#include <gtest/gtest.h>
+#include <torch/cuda.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "models/parameters.h"
+
+namespace llm {
+namespace {
+// a toy forward pass with an eager call that depends on the parameters: the
+// cumulative sum of each sequence.
+torch::Tensor forward(const torch::Tensor& input,
+                      const torch::Tensor& weight,
+                      const InputParameters& params) {
+  auto h = torch::matmul(input, weight).relu();
+  h = PiecewiseGraph::split(
+      {h},
+      params,
+      [](const std::vector<torch::Tensor>& inputs,
+         const InputParameters& params) {
+        const auto cu_seq_lens = params.q_cu_seq_lens.cpu();
+        std::vector<torch::Tensor> outputs;
+        for (int32_t i = 0; i < params.num_sequences; ++i) {
+          const int64_t start = cu_seq_lens[i].item<int64_t>();
+          const int64_t end = cu_seq_lens[i + 1].item<int64_t>();
+          outputs.push_back(inputs[0].slice(0, start, end).cumsum(0));
+        }
+        return torch::cat(outputs);
+      });
+  return torch::matmul(h, weight.t()) + 1;
+}
+
+InputParameters make_params(const std::vector<int32_t>& cu_seq_lens,
+                            const torch::Device& device) {
+  InputParameters params;
+  params.num_sequences = static_cast<int32_t>(cu_seq_lens.size()) - 1;
+  params.q_cu_seq_lens =
+      torch::tensor(cu_seq_lens, torch::dtype(torch::kInt).device(device));
+  return params;
+}
+}  // namespace
+
+TEST(PiecewiseGraphTest, EagerWithoutCapture) {
+  const auto params = make_params({0, 2, 5}, torch::kCPU);
+  const auto input = torch::randn({5, 4});
+  const auto output = PiecewiseGraph::split(
+      {input},
+      params,
+      [](const std::vector<torch::Tensor>& inputs,
+         const InputParameters& /*params*/) { return inputs[0] * 2; });
+  EXPECT_TRUE(torch::equal(output, input * 2));
+}
+
+TEST(PiecewiseGraphTest, ReplayPaddedBatches) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  torch::manual_seed(0);
+  const torch::Device device(torch::kCUDA);
+  const auto options = torch::dtype(torch::kFloat).device(device);
+  const int32_t num_tokens = 16;
+  const auto weight = torch::randn({8, 32}, options);
+
+  auto static_input = torch::zeros({num_tokens, 8}, options);
+  PiecewiseGraph graph;
+  const auto capture_params = make_params({0, num_tokens}, device);
+  // warm up
+  forward(static_input, weight, capture_params);
+  torch::cuda::synchronize();
+  graph.capture(at::cuda::graph_pool_handle(),
+                [&] { return forward(static_input, weight, capture_params); });
+  torch::cuda::synchronize();
+  EXPECT_EQ(graph.num_splits(), size_t{1});
+
+  for (const auto& cu_seq_lens : std::vector<std::vector<int32_t>>{
+           {0, 16}, {0, 3, 10}, {0, 1, 2, 3}}) {
+    const int64_t n_tokens = cu_seq_lens.back();
+    const auto params = make_params(cu_seq_lens, device);
+    const auto input = torch::randn({n_tokens, 8}, options);
+    static_input.slice(0, 0, n_tokens).copy_(input);
+    const auto output = graph.replay(n_tokens, params).slice(0, 0, n_tokens);
+    const auto expected = forward(input, weight, params);
+    EXPECT_TRUE(torch::allclose(output,
+                                expected,
+                                /*rtol=*/1e-4,
+                                /*atol=*/1e-4));
+  }
+}
+
+}  // namespace llm
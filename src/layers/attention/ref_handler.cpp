@@ -1,27 +1,45 @@
 #include "ref_handler.h"
 
+#include <ATen/Parallel.h>
 #include <torch/torch.h>
 
 #include "memory/kv_cache.h"
 #include "models/parameters.h"
 
 namespace llm {
-using ISlice = torch::indexing::Slice;
 
 namespace {
+// the query heads sharing a kv head are attended with one batched gemm per kv
+// head, without repeating the key and value for grouped-query attention.
 torch::Tensor masked_self_attention(
     const torch::Tensor& query,         // [q_seq_len, n_heads, head_dim]
-    const torch::Tensor& key,           // [k_seq_len, n_heads, head_dim]
-    const torch::Tensor& value,         // [k_seq_len, n_heads, head_dim]
-    const torch::Tensor& alibi_biases,  // [n_heads, q_seq_len, k_seq_len]
-    const torch::Tensor& mask,          // [n_heads, q_seq_len, k_seq_len]
+    const torch::Tensor& key,           // [k_seq_len, n_kv_heads, head_dim]
+    const torch::Tensor& value,         // [k_seq_len, n_kv_heads, head_dim]
+    const torch::Tensor& alibi_biases,  // [n_heads, 1, k_seq_len]
+    const torch::Tensor& mask,          // [1, q_seq_len, k_seq_len]
     float sm_scale,
     float logits_soft_cap) {
+  const int64_t q_len = query.size(0);
+  const int64_t n_heads = query.size(1);
+  const int64_t head_dim = query.size(2);
+  const int64_t kv_len = key.size(0);
+  const int64_t n_kv_heads = key.size(1);
+  CHECK(n_heads % n_kv_heads == 0);
+  const int64_t group_size = n_heads / n_kv_heads;
+
+  // => [n_kv_heads, group_size * q_seq_len, head_dim]
+  const auto q = query.to(torch::kFloat)
+                     .view({q_len, n_kv_heads, group_size, head_dim})
+                     .permute({1, 2, 0, 3})
+                     .reshape({n_kv_heads, group_size * q_len, head_dim});
+  // => [n_kv_heads, k_seq_len, head_dim]
+  const auto k = key.to(torch::kFloat).transpose(0, 1);
+  const auto v = value.to(torch::kFloat).transpose(0, 1);
+
   // => [n_heads, q_seq_len, k_seq_len]
-  auto scores = torch::einsum("qhd,khd->hqk",
-                              {query.to(torch::kFloat), key.to(torch::kFloat)});
-  // apply scale
-  scores *= sm_scale;
+  auto scores = torch::bmm(q, k.transpose(1, 2))
+                    .mul_(sm_scale)
+                    .view({n_heads, q_len, kv_len});
 
   // apply softcap if needed
   if (logits_soft_cap > 0.0) {
@@ -34,22 +52,26 @@ torch::Tensor masked_self_attention(
   }
   // apply causal mask
   if (mask.defined()) {
-    scores = scores.masked_fill(mask == 0, -INFINITY);
+    scores.masked_fill_(mask.logical_not(), -INFINITY);
   }
 
   scores = torch::softmax(scores, /*dim=*/-1);
   // => [q_seq_len, n_heads, head_dim]
-  return torch::einsum("hqk,khd->qhd", {scores, value.to(torch::kFloat)})
-      .type_as(query);
+  return torch::bmm(scores.view({n_kv_heads, group_size * q_len, kv_len}), v)
+      .view({n_kv_heads, group_size, q_len, head_dim})
+      .permute({2, 0, 1, 3})
+      .reshape({q_len, n_heads, head_dim})
+      .to(query.dtype());
 }
 
-// slow reference implementation for varlen_masked_self_attention
+// pytorch implementation of varlen_masked_self_attention, the fallback on cpu
 void varlen_masked_self_attention(
     const torch::Tensor& query,           // [n_tokens, n_heads, head_dim]
     const torch::Tensor& key,             // [n_tokens, n_kv_heads, head_dim]
     const torch::Tensor& value,           // [n_tokens, n_kv_heads, head_dim]
     const torch::Tensor& q_cu_seq_lens,   // [n_seqs + 1]
     const torch::Tensor& kv_cu_seq_lens,  // [n_seqs + 1]
+    const torch::Tensor& tree_mask,       // [n_tokens]
     const torch::optional<torch::Tensor> alibi_slopes,  // [n_heads]
     float sm_scale,
     float logits_soft_cap,
@@ -58,71 +80,87 @@ void varlen_masked_self_attention(
   // same length for key and value
   DCHECK(key.size(0) == value.size(0));
 
-  const auto head_dim = query.size(-1);
   const auto n_heads = query.size(-2);
-  const auto n_kv_heads = key.size(-2);
 
   torch::Tensor q_cu_seq_lens_cpu = q_cu_seq_lens.cpu();
   torch::Tensor kv_cu_seq_lens_cpu = kv_cu_seq_lens.cpu();
-  const size_t n_seqs = q_cu_seq_lens_cpu.numel() - 1;
+  const int64_t n_seqs = q_cu_seq_lens_cpu.numel() - 1;
   const int32_t* q_cu_lens = q_cu_seq_lens_cpu.data_ptr<int32_t>();
   const int32_t* kv_cu_lens = kv_cu_seq_lens_cpu.data_ptr<int32_t>();
-
-  // process sequence one by one
-  for (int64_t i = 0; i < n_seqs; ++i) {
-    // calaculate attention for each sequence
-    const int32_t q_start = q_cu_lens[i];
-    const int32_t q_end = q_cu_lens[i + 1];
-    const int32_t q_len = q_end - q_start;
-    const int32_t kv_start = kv_cu_lens[i];
-    const int32_t kv_end = kv_cu_lens[i + 1];
-    const int32_t kv_len = kv_end - kv_start;
-
-    torch::Tensor _query =
-        query.slice(/*dim=*/0, /*start=*/q_start, /*end=*/q_end);
-    torch::Tensor _key =
-        key.slice(/*dim=*/0, /*start=*/kv_start, /*end=*/kv_end);
-    torch::Tensor _value =
-        value.slice(/*dim=*/0, /*start=*/kv_start, /*end=*/kv_end);
-
-    CHECK(kv_len >= q_len);
-
-    // repeat key and value if n_heads > n_kv_heads
-    if (n_heads != n_kv_heads) {
-      CHECK(n_heads % n_kv_heads == 0);
-      const auto num_goups = n_heads / n_kv_heads;
-      _key = _key.repeat_interleave(/*repeats=*/num_goups, /*dim=*/-2);
-      _value = _value.repeat_interleave(/*repeats=*/num_goups, /*dim=*/-2);
+  const torch::Tensor tree_mask_cpu =
+      tree_mask.defined() ? tree_mask.cpu() : tree_mask;
+
+  // calaculate attention for sequences in [begin, end)
+  auto attend = [&](int64_t begin, int64_t end) {
+    for (int64_t i = begin; i < end; ++i) {
+      const int32_t q_start = q_cu_lens[i];
+      const int32_t q_end = q_cu_lens[i + 1];
+      const int32_t q_len = q_end - q_start;
+      const int32_t kv_start = kv_cu_lens[i];
+      const int32_t kv_end = kv_cu_lens[i + 1];
+      const int32_t kv_len = kv_end - kv_start;
+      CHECK(kv_len >= q_len);
+
+      torch::Tensor _query =
+          query.slice(/*dim=*/0, /*start=*/q_start, /*end=*/q_end);
+      torch::Tensor _key =
+          key.slice(/*dim=*/0, /*start=*/kv_start, /*end=*/kv_end);
+      torch::Tensor _value =
+          value.slice(/*dim=*/0, /*start=*/kv_start, /*end=*/kv_end);
+
+      // a single query sees all keys without sliding window, e.g. decode
+      torch::Tensor mask;
+      if (q_len > 1 || sliding_window >= 0 || tree_mask_cpu.defined()) {
+        // [1, q_len, kv_len]
+        mask = torch::ones({1, q_len, kv_len}, torch::kBool);
+        if (sliding_window >= 0) {
+          // sliding window mask
+          // returns the upper triangular part of a matrix
+          mask =
+              torch::triu(mask, /*diagonal=*/kv_len - q_len - sliding_window);
+        }
+
+        // causal mask
+        // returns the lower triangular part of a matrix
+        mask = torch::tril(mask, /*diagonal=*/kv_len - q_len);
+        if (tree_mask_cpu.defined()) {
+          // tree mask among the new tokens: bit j of token i
+          const auto bits = tree_mask_cpu.slice(/*dim=*/0, q_start, q_end);
+          const auto shifts = torch::arange(q_len, torch::kLong);
+          const auto visible =
+              torch::bitwise_right_shift(bits.view({q_len, 1}), shifts)
+                  .bitwise_and(1)
+                  .to(torch::kBool);
+          mask.slice(/*dim=*/2, kv_len - q_len, kv_len).logical_and_(visible);
+        }
+        mask = mask.to(query.device());
+      }
+
+      torch::Tensor bias;
+      if (alibi_slopes) {
+        const torch::Tensor& slopes = alibi_slopes.value();
+        CHECK(slopes.size(0) == n_heads);
+
+        // calculate alibi attention bias
+        // since it's causal mask, we can just use [0, 1, ...,, kv_len)
+        auto distance = torch::arange(
+            0, kv_len, query.options().dtype(torch::kFloat));
+        // [n_heads, 1, kv_len]
+        bias = distance.view({1, 1, kv_len}) *
+               slopes.to(torch::kFloat).view({n_heads, 1, 1});
+      }
+
+      const auto attn = masked_self_attention(
+          _query, _key, _value, bias, mask, sm_scale, logits_soft_cap);
+      output.slice(/*dim=*/0, q_start, q_end).copy_(attn);
     }
+  };
 
-    // create mask
-    // [1, q_len, kv_len]
-    torch::Tensor mask = torch::ones({1, q_len, kv_len}, torch::kBool);
-    if (sliding_window >= 0) {
-      // sliding window mask
-      // returns the upper triangular part of a matrix
-      mask = torch::triu(mask, /*diagonal=*/kv_len - q_len - sliding_window);
-    }
-
-    // causal mask
-    // returns the lower triangular part of a matrix
-    mask = torch::tril(mask, /*diagonal=*/kv_len - q_len).to(query);
-
-    torch::Tensor bias;
-    if (alibi_slopes) {
-      const torch::Tensor& slopes = alibi_slopes.value();
-      CHECK(slopes.size(0) == n_heads);
-
-      // calculate alibi attention bias
-      // since it's causal mask, we can just use [0, 1, ...,, kv_len)
-      auto distance = torch::arange(0, kv_len, query.options());
-      // [n_heads, 1, kv_len]
-      bias = distance.view({1, 1, kv_len}) * slopes.view({n_heads, 1, 1});
-    }
-
-    const auto attn = masked_self_attention(
-        _query, _key, _value, bias, mask, sm_scale, logits_soft_cap);
-    output.index_put_({ISlice(q_start, q_end), ISlice(), ISlice()}, attn);
+  // sequences are attended in parallel on cpu, each writing its own rows
+  if (query.is_cpu()) {
+    at::parallel_for(/*begin=*/0, n_seqs, /*grain_size=*/1, attend);
+  } else {
+    attend(0, n_seqs);
   }
 }
 
@@ -133,12 +171,17 @@ RefHandler::RefHandler(float sm_scale,
                        int64_t rotary_dim,
                        int64_t max_position,
                        torch::Tensor inv_freq,
+                       float attention_factor,
                        bool interleaved,
                        const torch::TensorOptions& options)
     : sm_scale_(sm_scale), logits_soft_cap_(logits_soft_cap) {
   // register rotary positional embedding
-  pos_emb_ =
-      RotaryEmbedding(rotary_dim, max_position, inv_freq, interleaved, options);
+  pos_emb_ = RotaryEmbedding(rotary_dim,
+                             max_position,
+                             inv_freq,
+                             interleaved,
+                             options,
+                             attention_factor);
 }
 
 RefHandler::RefHandler(float sm_scale,
@@ -169,12 +212,17 @@ void RefHandler::batch_decode(
     torch::Tensor& output) {
   // retrieval key and value from kv_cache
   auto [key, value] = kv_cache.get_kv_cache(input_params.new_cache_slots);
+  if (kv_cache.is_quantized()) {
+    key = key.to(query.dtype());
+    value = value.to(query.dtype());
+  }
 
   varlen_masked_self_attention(query,
                                key,
                                value,
                                input_params.q_cu_seq_lens,
                                input_params.kv_cu_seq_lens,
+                               input_params.tree_mask,
                                alibi_slopes_,
                                sm_scale_,
                                logits_soft_cap_,
@@ -10,6 +10,7 @@
 namespace llm {
 
 // an pytorch implementation handler for attention operations, used for testing
+// and as the attention of the cpu device.
 class RefHandler : public AttentionHandler {
  public:
   // create a flash attn handler with rope positional embedding
@@ -18,6 +19,7 @@ class RefHandler : public AttentionHandler {
              int64_t rotary_dim,
              int64_t max_position,
              torch::Tensor inv_freq,
+             float attention_factor,
              bool interleaved,
              const torch::TensorOptions& options);
 
@@ -37,6 +39,11 @@ class RefHandler : public AttentionHandler {
       const torch::Tensor& key,
       const torch::Tensor& positions) override;
 
+  float sm_scale() const override {
+    return logits_soft_cap_ == 0.0f && !alibi_slopes_.has_value() ? sm_scale_
+                                                                  : 0.0f;
+  }
+
   // batch decode for attention, optimized for decode stage
   // support multiple queries: one sequence with multiple query tokens
   void batch_decode(
@@ -2,6 +2,9 @@
 
 #include <torch/torch.h>
 
+#include <optional>
+#include <tuple>
+
 #include "kernels/attention/attn_api.h"
 #include "memory/kv_cache.h"
 #include "models/parameters.h"
@@ -13,12 +16,17 @@ ScaleAttnHandler::ScaleAttnHandler(float sm_scale,
                                    int64_t rotary_dim,
                                    int64_t max_position,
                                    torch::Tensor inv_freq,
+                                   float attention_factor,
                                    bool interleaved,
                                    const torch::TensorOptions& options)
     : sm_scale_(sm_scale), logits_soft_cap_(logits_soft_cap) {
   // register rotary positional embedding
-  pos_emb_ =
-      RotaryEmbedding(rotary_dim, max_position, inv_freq, interleaved, options);
+  pos_emb_ = RotaryEmbedding(rotary_dim,
+                             max_position,
+                             inv_freq,
+                             interleaved,
+                             options,
+                             attention_factor);
 }
 
 ScaleAttnHandler::ScaleAttnHandler(float sm_scale,
@@ -50,6 +58,53 @@ void ScaleAttnHandler::batch_decode(
   auto [key_cache, value_cache] = kv_cache.get_kv_cache();
   const auto block_size = kv_cache.block_size();
 
+  // the quantized kv cache is dequantized by the kernel with the scales
+  std::optional<torch::Tensor> key_scale;
+  std::optional<torch::Tensor> value_scale;
+  if (kv_cache.is_quantized()) {
+    std::tie(key_scale, value_scale) = kv_cache.get_kv_cache_scales();
+  }
+
+  const auto tree_mask =
+      input_params.tree_mask.defined()
+          ? std::optional<torch::Tensor>(input_params.tree_mask)
+          : std::nullopt;
+  if (input_params.num_prefix_groups > 0 && sliding_window < 0) {
+    // the suffix of each sequence starts after its shared prefix in the alibi
+    // bias: kv_len - suffix_kv_len
+    std::optional<torch::Tensor> alibi_kv_offsets;
+    if (alibi_slopes_.has_value()) {
+      alibi_kv_offsets = (input_params.kv_cu_seq_lens.diff() -
+                          input_params.suffix_kv_cu_seq_lens.diff())
+                             .to(torch::kInt32);
+    }
+    // read the shared prefix blocks once for each group of sequences
+    paged_kv_cascade_mha(output,
+                         query,
+                         key_cache,
+                         value_cache,
+                         input_params.block_tables,
+                         input_params.prefix_q_cu_seq_lens,
+                         input_params.prefix_kv_cu_seq_lens,
+                         input_params.prefix_cu_block_lens,
+                         input_params.q_cu_seq_lens,
+                         input_params.suffix_kv_cu_seq_lens,
+                         input_params.suffix_cu_block_lens,
+                         alibi_slopes_,
+                         alibi_kv_offsets,
+                         block_size,
+                         input_params.prefix_q_max_seq_len,
+                         input_params.prefix_kv_max_seq_len,
+                         input_params.q_max_seq_len,
+                         input_params.suffix_kv_max_seq_len,
+                         sm_scale_,
+                         logits_soft_cap_,
+                         tree_mask,
+                         key_scale,
+                         value_scale);
+    return;
+  }
+
   paged_kv_varlen_mha(output,
                       query,
                       key_cache,
@@ -64,7 +119,10 @@ void ScaleAttnHandler::batch_decode(
                       input_params.kv_max_seq_len,
                       sm_scale_,
                       logits_soft_cap_,
-                      sliding_window);
+                      sliding_window,
+                      tree_mask,
+                      key_scale,
+                      value_scale);
 }
 
 // append key and value to kv_cache
@@ -79,4 +137,34 @@ void ScaleAttnHandler::append_kv_cache(
   }
 }
 
+torch::Tensor ScaleAttnHandler::apply_pos_emb_and_append_kv_cache(
+    KVCache& kv_cache,
+    const torch::Tensor& query,
+    const torch::Tensor& key,
+    const torch::Tensor& value,
+    const torch::Tensor& positions,
+    const InputParameters& input_params,
+    const torch::Tensor& qkv_bias) {
+  if (positions.defined() && pos_emb_) {
+    // grow the cos/sin cache to the longest sequence of the batch
+    pos_emb_->reserve(input_params.kv_max_seq_len);
+  }
+  if (positions.defined() && pos_emb_ && !kv_cache.empty()) {
+    auto [key_cache, value_cache] = kv_cache.get_kv_cache();
+    torch::Tensor q = query;
+    if (pos_emb_->forward_set_kv_cache(q,
+                                       key,
+                                       value,
+                                       positions,
+                                       input_params.new_cache_slots,
+                                       key_cache,
+                                       value_cache,
+                                       qkv_bias)) {
+      return q;
+    }
+  }
+  return AttentionHandler::apply_pos_emb_and_append_kv_cache(
+      kv_cache, query, key, value, positions, input_params, qkv_bias);
+}
+
 }  // namespace llm
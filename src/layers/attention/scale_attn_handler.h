@@ -19,6 +19,7 @@ class ScaleAttnHandler : public AttentionHandler {
                    int64_t rotary_dim,
                    int64_t max_position,
                    torch::Tensor inv_freq,
+                   float attention_factor,
                    bool interleaved,
                    const torch::TensorOptions& options);
 
@@ -37,6 +38,11 @@ class ScaleAttnHandler : public AttentionHandler {
       const torch::Tensor& key,
       const torch::Tensor& positions) override;
 
+  float sm_scale() const override {
+    return logits_soft_cap_ == 0.0f && !alibi_slopes_.has_value() ? sm_scale_
+                                                                  : 0.0f;
+  }
+
   // batch decode for attention, optimized for decode stage
   // support multiple queries: one sequence with multiple query tokens
   void batch_decode(
@@ -53,7 +59,18 @@ class ScaleAttnHandler : public AttentionHandler {
       const torch::Tensor& value,  // [n_tokens, n_kv_heads, head_dim]
       const InputParameters& input_params) override;
 
- private:
+  // add the qkv bias, rotate query and write the rotated key and value into
+  // kv_cache with one kernel if possible
+  torch::Tensor apply_pos_emb_and_append_kv_cache(
+      KVCache& kv_cache,
+      const torch::Tensor& query,
+      const torch::Tensor& key,
+      const torch::Tensor& value,
+      const torch::Tensor& positions,
+      const InputParameters& input_params,
+      const torch::Tensor& qkv_bias) override;
+
+ protected:
   // softmax scale factor
   float sm_scale_ = 0.0;
 
@@ -0,0 +1,14 @@
+#include "chunked_forward.h"
+
+#include <gflags/gflags.h>
+
+DEFINE_int32(mlp_chunk_tokens,
+             0,
+             "max number of tokens to run the mlp of the decoder layers for "
+             "at once, large batches are split into chunks to bound the "
+             "memory of the intermediate activations. 0 to disable");
+
+DEFINE_int32(lm_head_chunk_tokens,
+             0,
+             "max number of tokens to compute the logits for at once, to "
+             "bound the memory of the intermediate logits. 0 to disable");
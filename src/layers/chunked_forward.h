@@ -0,0 +1,48 @@
+#pragma once
+
+#include <gflags/gflags.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+DECLARE_int32(mlp_chunk_tokens);
+
+DECLARE_int32(lm_head_chunk_tokens);
+
+namespace llm {
+
+// Run a token-wise function over chunks of at most chunk_size tokens of the
+// input and write the outputs into one output tensor, so that the
+// intermediate tensors of the function, e.g. the [n_tokens,
+// intermediate_size] activations of the mlp, only take the memory of one
+// chunk for large prefill batches. The chunks run one by one and reuse the
+// blocks freed by the previous chunk.
+// input: [n_tokens, ...]
+// chunk_size: max number of tokens per chunk, <= 0 to run in one go
+// returns: [n_tokens, ...]
+template <typename Fn>
+torch::Tensor chunked_forward(const torch::Tensor& input,
+                              int64_t chunk_size,
+                              Fn&& fn) {
+  const int64_t n_tokens = input.size(/*dim=*/0);
+  if (chunk_size <= 0 || n_tokens <= chunk_size) {
+    return fn(input);
+  }
+
+  torch::Tensor output;
+  for (int64_t start = 0; start < n_tokens; start += chunk_size) {
+    const int64_t len = std::min(chunk_size, n_tokens - start);
+    const auto chunk_output = fn(input.narrow(/*dim=*/0, start, len));
+    if (!output.defined()) {
+      std::vector<int64_t> sizes = chunk_output.sizes().vec();
+      sizes[0] = n_tokens;
+      output = torch::empty(sizes, chunk_output.options());
+    }
+    output.narrow(/*dim=*/0, start, len).copy_(chunk_output);
+  }
+  return output;
+}
+
+}  // namespace llm
@@ -0,0 +1,44 @@
+#include "chunked_forward.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include <utility>
+#include <vector>
+
+namespace llm {
+
+TEST(ChunkedForwardTest, SameAsOneGo) {
+  const int64_t n_tokens = 10;
+  const int64_t hidden_size = 8;
+  const int64_t intermediate_size = 32;
+  torch::manual_seed(0);
+  const auto input = torch::randn({n_tokens, hidden_size});
+  const auto up = torch::randn({hidden_size, intermediate_size});
+  const auto down = torch::randn({intermediate_size, hidden_size});
+
+  std::vector<int64_t> chunk_lens;
+  const auto mlp = [&](const torch::Tensor& x) {
+    chunk_lens.push_back(x.size(0));
+    return torch::matmul(torch::relu(torch::matmul(x, up)), down);
+  };
+
+  const auto expected = mlp(input);
+  const std::vector<std::pair<int64_t, std::vector<int64_t>>> cases = {
+      {0, {10}},
+      {3, {3, 3, 3, 1}},
+      {5, {5, 5}},
+      {10, {10}},
+      {16, {10}},
+  };
+  for (const auto& [chunk_size, expected_chunk_lens] : cases) {
+    chunk_lens.clear();
+    const auto output = chunked_forward(input, chunk_size, mlp);
+    EXPECT_TRUE(torch::allclose(output, expected, /*rtol=*/1e-5,
+                                /*atol=*/1e-5))
+        << "chunk_size: " << chunk_size;
+    EXPECT_EQ(chunk_lens, expected_chunk_lens);
+  }
+}
+
+}  // namespace llm
@@ -0,0 +1,114 @@
+#include "embedding.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <tuple>
+#include <utility>
+
+#include "model_parallel/parallel_args.h"
+
+DEFINE_int64(max_replicated_embedding_mb,
+             512,
+             "keep the whole embedding table on every rank if its size in MB "
+             "is not larger than this, which saves the collective of the "
+             "sharded lookup for each step. 0 to always shard the table.");
+
+DEFINE_bool(int8_embedding,
+            false,
+            "keep the token embedding tables in int8 with a scale per row, "
+            "e.g. for the large vocabs. dense tables are quantized while "
+            "loading.");
+
+namespace llm {
+namespace {
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+thread_local ImageEmbeddings current_image_embeddings;
+}  // namespace
+
+bool use_replicated_embedding(int64_t num_embeddings,
+                              int64_t embedding_dim,
+                              const ParallelArgs& parallel_args,
+                              const torch::TensorOptions& options) {
+  if (parallel_args.world_size() <= 1) {
+    return false;
+  }
+  const int64_t table_bytes = num_embeddings * embedding_dim *
+                              static_cast<int64_t>(options.dtype().itemsize());
+  return table_bytes <= FLAGS_max_replicated_embedding_mb * 1024 * 1024;
+}
+
+const ImageEmbeddings& ImageEmbeddings::current() {
+  return current_image_embeddings;
+}
+
+void ImageEmbeddings::set_current(ImageEmbeddings image_embeddings) {
+  current_image_embeddings = std::move(image_embeddings);
+}
+
+namespace detail {
+torch::Tensor merge_image_embeddings(torch::Tensor output) {
+  const auto& image_embeddings = ImageEmbeddings::current();
+  if (!image_embeddings.defined()) {
+    return output;
+  }
+  CHECK_EQ(image_embeddings.embeddings.size(-1), output.size(-1))
+      << "image embeddings size mismatch";
+  return output.index_copy_(
+      /*dim=*/0,
+      image_embeddings.token_idxes,
+      image_embeddings.embeddings.to(output.dtype()));
+}
+
+std::tuple<torch::Tensor, torch::Tensor> quant_embedding_rows(
+    const torch::Tensor& table,
+    const torch::Device& device) {
+  CHECK_EQ(table.dim(), 2) << "embedding table must be 2-D";
+  const auto x = table.to(device, torch::kFloat);
+  const auto scale =
+      (x.abs().amax(/*dim=*/-1) / 127.0f).clamp_min(/*min=*/1e-8);
+  const auto qtable = (x / scale.unsqueeze(/*dim=*/-1))
+                          .round()
+                          .clamp(-127, 127)
+                          .to(torch::kInt8);
+  return {qtable, scale};
+}
+
+bool load_int8_embedding(const torch::Tensor& table,
+                         const torch::Tensor& scale,
+                         torch::Tensor& weight,
+                         torch::Tensor& weight_scale) {
+  if (!table.defined()) {
+    return false;
+  }
+  CHECK_EQ(weight.sizes(), table.sizes()) << "weight size mismatch";
+  if (table.scalar_type() == torch::kInt8) {
+    CHECK(scale.defined()) << "weight_scale is missing for the int8 table";
+    weight.copy_(table);
+    weight_scale.copy_(scale.reshape({-1}));
+    return true;
+  }
+  const auto [qtable, qscale] = quant_embedding_rows(table, weight.device());
+  weight.copy_(qtable);
+  weight_scale.copy_(qscale);
+  return true;
+}
+
+torch::Tensor int8_embedding(const torch::Tensor& input,
+                             const torch::Tensor& weight,
+                             const torch::Tensor& weight_scale,
+                             torch::ScalarType dtype) {
+  const auto indices = input.reshape({-1});
+  const auto rows = weight.index_select(/*dim=*/0, indices);
+  const auto scales = weight_scale.index_select(/*dim=*/0, indices);
+  auto output = (rows.to(torch::kFloat) * scales.unsqueeze(/*dim=*/-1))
+                    .to(dtype);
+  auto out_sizes = input.sizes().vec();
+  out_sizes.push_back(weight.size(1));
+  return output.reshape(out_sizes);
+}
+}  // namespace detail
+
+}  // namespace llm
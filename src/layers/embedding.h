@@ -1,15 +1,70 @@
 #pragma once
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <torch/torch.h>
 
 #include <cstdint>
+#include <tuple>
 
 #include "model_loader/state_dict.h"
 #include "model_parallel/model_parallel.h"
 
+DECLARE_int64(max_replicated_embedding_mb);
+
+DECLARE_bool(int8_embedding);
+
 namespace llm {
 
+// whether to keep the whole embedding table on every rank instead of sharding
+// it, which turns the lookup into a local one without any collective. Only
+// used for small tables, see --max_replicated_embedding_mb.
+bool use_replicated_embedding(int64_t num_embeddings,
+                              int64_t embedding_dim,
+                              const ParallelArgs& parallel_args,
+                              const torch::TensorOptions& options);
+
+// The embeddings of the image placeholder tokens of the batch running on this
+// thread, which replace the rows of the token embeddings. set by the worker
+// for the prompts with images, see Sequence::images().
+struct ImageEmbeddings {
+  // [n_image_tokens] LongTensor: the index of each placeholder in the batch
+  torch::Tensor token_idxes;
+  // [n_image_tokens, embedding_dim]
+  torch::Tensor embeddings;
+
+  bool defined() const { return token_idxes.defined(); }
+
+  static const ImageEmbeddings& current();
+  static void set_current(ImageEmbeddings image_embeddings);
+};
+
+namespace detail {
+// replace the rows of the image placeholder tokens of the whole embeddings
+// with the current image embeddings, if any.
+torch::Tensor merge_image_embeddings(torch::Tensor output);
+
+// quantize the rows of the dense embedding table to int8 on the device of the
+// weight, returns the table and its per row scales
+std::tuple<torch::Tensor, torch::Tensor> quant_embedding_rows(
+    const torch::Tensor& table,
+    const torch::Device& device);
+
+// load the table into the int8 weight and its [rows] scales. a dense table is
+// quantized per row, an int8 one is loaded with the scale. returns false if
+// the table is not in the checkpoint.
+bool load_int8_embedding(const torch::Tensor& table,
+                         const torch::Tensor& scale,
+                         torch::Tensor& weight,
+                         torch::Tensor& weight_scale);
+
+// look up the int8 rows of the indices and dequantize them into dtype
+torch::Tensor int8_embedding(const torch::Tensor& input,
+                             const torch::Tensor& weight,
+                             const torch::Tensor& weight_scale,
+                             torch::ScalarType dtype);
+}  // namespace detail
+
 // A simple lookup table that stores embeddings of a fixed dictionary and size.
 // This module is often used to store word embeddings and retrieve them using
 // indices.
@@ -30,7 +85,7 @@ class EmbeddingImpl : public torch::nn::Module {
   // corresponding word embeddings.
   torch::Tensor forward(torch::Tensor input) {
     namespace F = torch::nn::functional;
-    return F::embedding(input, weight_);
+    return detail::merge_image_embeddings(F::embedding(input, weight_));
   }
 
   // load the weight from the checkpoint
@@ -72,8 +127,15 @@ class ParallelEmbeddingImpl : public torch::nn::Module {
                         int64_t embedding_dim,
                         const ParallelArgs& parallel_args,
                         const torch::TensorOptions& options)
-      : parallel_args_(parallel_args) {
-    const auto world_size = parallel_args_.world_size();
+      : parallel_args_(parallel_args),
+        dtype_(options.dtype().toScalarType()),
+        quantized_(FLAGS_int8_embedding) {
+    // the table is kept in int8 with a scale per row if quantized
+    const auto weight_options =
+        quantized_ ? options.dtype(torch::kInt8) : options;
+    replicated_ = use_replicated_embedding(
+        num_embeddings, embedding_dim, parallel_args, weight_options);
+    const auto world_size = replicated_ ? 1 : parallel_args_.world_size();
     CHECK(embedding_dim % world_size == 0)
         << "out_features " << embedding_dim << " not divisible by world_size "
         << world_size;
@@ -82,28 +144,49 @@ class ParallelEmbeddingImpl : public torch::nn::Module {
     // register the weight parameter
     weight_ = register_parameter(
         "weight",
-        torch::empty({num_embeddings, embedding_dim_per_partition}, options),
+        torch::empty({num_embeddings, embedding_dim_per_partition},
+                     weight_options),
         /*requires_grad=*/false);
+    if (quantized_) {
+      // the scales of the rows of the shard, or of the whole rows if loaded
+      // from an int8 checkpoint
+      weight_scale_ = register_parameter(
+          "weight_scale",
+          torch::empty({num_embeddings}, options.dtype(torch::kFloat)),
+          /*requires_grad=*/false);
+    }
   }
 
   // The input to the module is a list of indices, and the output is the
   // corresponding word embeddings.
   torch::Tensor forward(torch::Tensor input) {
     namespace F = torch::nn::functional;
-    auto output = F::embedding(input, weight_);
-    if (parallel_args_.world_size() > 1) {
+    auto output =
+        quantized_
+            ? detail::int8_embedding(input, weight_, weight_scale_, dtype_)
+            : F::embedding(input, weight_);
+    if (!replicated_ && parallel_args_.world_size() > 1) {
       output = gather_from_model_parallel_region(output, parallel_args_);
     }
-    return output;
+    return detail::merge_image_embeddings(output);
   }
 
   // load the weight from the checkpoint
   void load_state_dict(const StateDict& state_dict) {
-    const auto weight = state_dict.get_sharded_tensor(
-        "weight",
-        /*dim=*/1,
-        /*rank=*/parallel_args_.rank(),
-        /*world_size=*/parallel_args_.world_size());
+    const auto weight =
+        replicated_ ? state_dict.get_tensor("weight")
+                    : state_dict.get_sharded_tensor(
+                          "weight",
+                          /*dim=*/1,
+                          /*rank=*/parallel_args_.rank(),
+                          /*world_size=*/parallel_args_.world_size());
+    if (quantized_) {
+      // the scales of the whole rows for a sharded int8 table
+      const auto scale = state_dict.get_tensor("weight_scale");
+      is_loaded_ |=
+          detail::load_int8_embedding(weight, scale, weight_, weight_scale_);
+      return;
+    }
     if (weight.defined()) {
       CHECK_EQ(weight_.sizes(), weight.sizes())
           << "weight size mismatch for " << name();
@@ -127,12 +210,23 @@ class ParallelEmbeddingImpl : public torch::nn::Module {
  private:
   // parameter members, must be registered
   torch::Tensor weight_{nullptr};
+  // [num_embeddings] per row scales of the int8 table
+  torch::Tensor weight_scale_{nullptr};
 
   // whether the weight is loaded
   bool is_loaded_ = false;
 
+  // whether the whole table is kept on every rank
+  bool replicated_ = false;
+
   // parallel args
   ParallelArgs parallel_args_;
+
+  // dtype of the embeddings
+  torch::ScalarType dtype_;
+
+  // whether the table is quantized to int8, see --int8_embedding
+  bool quantized_ = false;
 };
 TORCH_MODULE(ParallelEmbedding);
 
@@ -143,26 +237,47 @@ class VocabParallelEmbeddingImpl : public torch::nn::Module {
                              int64_t embedding_dim,
                              const ParallelArgs& parallel_args,
                              const torch::TensorOptions& options)
-      : parallel_args_(parallel_args) {
+      : parallel_args_(parallel_args),
+        dtype_(options.dtype().toScalarType()),
+        quantized_(FLAGS_int8_embedding) {
+    // the table is kept in int8 with a scale per row if quantized
+    const auto weight_options =
+        quantized_ ? options.dtype(torch::kInt8) : options;
+    replicated_ = use_replicated_embedding(
+        num_embeddings, embedding_dim, parallel_args, weight_options);
     const int64_t num_embeddings_per_partition =
-        num_embeddings / parallel_args_.world_size();
-    start_index_ = num_embeddings_per_partition * parallel_args_.rank();
+        replicated_ ? num_embeddings
+                    : num_embeddings / parallel_args_.world_size();
+    start_index_ =
+        replicated_ ? 0 : num_embeddings_per_partition * parallel_args_.rank();
     end_index_ = start_index_ + num_embeddings_per_partition;
 
     // register the weight parameter
     weight_ = register_parameter(
         "weight",
         torch::empty({num_embeddings_per_partition, embedding_dim},
-                     options),
+                     weight_options),
         /*requires_grad=*/false);
+    if (quantized_) {
+      weight_scale_ = register_parameter(
+          "weight_scale",
+          torch::empty({num_embeddings_per_partition},
+                       options.dtype(torch::kFloat)),
+          /*requires_grad=*/false);
+    }
   }
 
   // The input to the module is a list of indices, and the output is the
   // corresponding word embeddings.
   torch::Tensor forward(torch::Tensor input) {
     namespace F = torch::nn::functional;
-    if (parallel_args_.world_size() == 1) {
-      return F::embedding(input, weight_);
+    auto lookup = [this](const torch::Tensor& indices) {
+      return quantized_ ? detail::int8_embedding(
+                              indices, weight_, weight_scale_, dtype_)
+                        : F::embedding(indices, weight_);
+    };
+    if (replicated_ || parallel_args_.world_size() == 1) {
+      return detail::merge_image_embeddings(lookup(input));
     }
 
     // build mask to filter out tokens that are not in the local vocab
@@ -170,20 +285,35 @@ class VocabParallelEmbeddingImpl : public torch::nn::Module {
     const auto input_mask = (input < start_index_) | (input >= end_index_);
     masked_input.masked_fill_(input_mask, 0);
 
-    auto output = F::embedding(masked_input, weight_);
+    auto output = lookup(masked_input);
     // mask out tokens not in the local vocab before reduce
     output.masked_fill_(input_mask.unsqueeze(-1), 0);
     // reduce across all gpus
-    return reduce_from_model_parallel_region(output, parallel_args_);
+    return detail::merge_image_embeddings(
+        reduce_from_model_parallel_region(output, parallel_args_));
   }
 
   // load the weight from the checkpoint
   void load_state_dict(const StateDict& state_dict) {
-    const auto weight = state_dict.get_sharded_tensor(
-        "weight",
-        /*dim=*/0,
-        /*rank=*/parallel_args_.rank(),
-        /*world_size=*/parallel_args_.world_size());
+    const auto weight =
+        replicated_ ? state_dict.get_tensor("weight")
+                    : state_dict.get_sharded_tensor(
+                          "weight",
+                          /*dim=*/0,
+                          /*rank=*/parallel_args_.rank(),
+                          /*world_size=*/parallel_args_.world_size());
+    if (quantized_) {
+      const auto scale =
+          replicated_ ? state_dict.get_tensor("weight_scale")
+                      : state_dict.get_sharded_tensor(
+                            "weight_scale",
+                            /*dim=*/0,
+                            /*rank=*/parallel_args_.rank(),
+                            /*world_size=*/parallel_args_.world_size());
+      is_loaded_ |=
+          detail::load_int8_embedding(weight, scale, weight_, weight_scale_);
+      return;
+    }
     if (weight.defined()) {
       CHECK_EQ(weight_.sizes(), weight.sizes())
           << "weight size mismatch for " << name();
@@ -207,13 +337,24 @@ class VocabParallelEmbeddingImpl : public torch::nn::Module {
  private:
   // parameter members, must be registered
   torch::Tensor weight_{nullptr};
+  // [num_embeddings_per_partition] per row scales of the int8 table
+  torch::Tensor weight_scale_{nullptr};
 
   // whether the weight is loaded
   bool is_loaded_ = false;
 
+  // whether the whole table is kept on every rank
+  bool replicated_ = false;
+
   // parallel args
   ParallelArgs parallel_args_;
 
+  // dtype of the embeddings
+  torch::ScalarType dtype_;
+
+  // whether the table is quantized to int8, see --int8_embedding
+  bool quantized_ = false;
+
   // index used to mask out tokens that are not in the local vocab
   int64_t start_index_ = 0;
   int64_t end_index_ = 0;
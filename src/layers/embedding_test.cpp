@@ -0,0 +1,149 @@
+#include "embedding.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include "model_loader/state_dict.h"
+
+namespace llm {
+
+TEST(EmbeddingTest, ReplicatedSmallTable) {
+  const int64_t num_embeddings = 32;
+  const int64_t embedding_dim = 16;
+  const auto options = torch::dtype(torch::kFloat).device(torch::kCPU);
+
+  std::unordered_map<std::string, torch::Tensor> state_dict_data;
+  state_dict_data["weight"] = torch::randn({num_embeddings, embedding_dim});
+  StateDict state_dict(state_dict_data);
+
+  const auto input = torch::randint(num_embeddings, {8}, torch::kInt);
+  const auto expected = state_dict_data["weight"].index_select(0, input);
+
+  // small tables are replicated on every rank: the lookup is local, so no
+  // process group is needed even with 2 ranks
+  const int32_t num_shards = 2;
+  for (int32_t shard_id = 0; shard_id < num_shards; ++shard_id) {
+    ParallelArgs parallel_args(shard_id, num_shards, nullptr);
+    ParallelEmbeddingImpl embedding(
+        num_embeddings, embedding_dim, parallel_args, options);
+    embedding.load_state_dict(state_dict);
+    embedding.verify_loaded_weights("");
+    EXPECT_TRUE(torch::equal(embedding.weight(), state_dict_data["weight"]));
+    EXPECT_TRUE(torch::equal(embedding.forward(input), expected));
+
+    VocabParallelEmbeddingImpl vocab_embedding(
+        num_embeddings, embedding_dim, parallel_args, options);
+    vocab_embedding.load_state_dict(state_dict);
+    vocab_embedding.verify_loaded_weights();
+    EXPECT_TRUE(torch::equal(vocab_embedding.forward(input), expected));
+  }
+}
+
+TEST(EmbeddingTest, ShardedLargeTable) {
+  const int64_t num_embeddings = 32;
+  const int64_t embedding_dim = 16;
+  const auto options = torch::dtype(torch::kFloat).device(torch::kCPU);
+
+  std::unordered_map<std::string, torch::Tensor> state_dict_data;
+  state_dict_data["weight"] = torch::randn({num_embeddings, embedding_dim});
+  StateDict state_dict(state_dict_data);
+
+  // always shard the table
+  const auto saved_limit = FLAGS_max_replicated_embedding_mb;
+  FLAGS_max_replicated_embedding_mb = 0;
+  const int32_t num_shards = 2;
+  for (int32_t shard_id = 0; shard_id < num_shards; ++shard_id) {
+    ParallelArgs parallel_args(shard_id, num_shards, nullptr);
+    ParallelEmbeddingImpl embedding(
+        num_embeddings, embedding_dim, parallel_args, options);
+    embedding.load_state_dict(state_dict);
+    EXPECT_TRUE(torch::equal(
+        embedding.weight(),
+        state_dict_data["weight"].chunk(num_shards, /*dim=*/1)[shard_id]));
+
+    VocabParallelEmbeddingImpl vocab_embedding(
+        num_embeddings, embedding_dim, parallel_args, options);
+    vocab_embedding.load_state_dict(state_dict);
+    EXPECT_TRUE(torch::equal(
+        vocab_embedding.weight(),
+        state_dict_data["weight"].chunk(num_shards, /*dim=*/0)[shard_id]));
+  }
+  FLAGS_max_replicated_embedding_mb = saved_limit;
+}
+
+TEST(EmbeddingTest, Int8Table) {
+  const int64_t num_embeddings = 32;
+  const int64_t embedding_dim = 16;
+  const auto options = torch::dtype(torch::kFloat).device(torch::kCPU);
+
+  std::unordered_map<std::string, torch::Tensor> state_dict_data;
+  state_dict_data["weight"] = torch::randn({num_embeddings, embedding_dim});
+  StateDict state_dict(state_dict_data);
+
+  const auto input = torch::randint(num_embeddings, {2, 4}, torch::kLong);
+  const auto expected = torch::embedding(state_dict_data["weight"], input);
+
+  FLAGS_int8_embedding = true;
+  ParallelArgs parallel_args(/*rank=*/0, /*world_size=*/1, nullptr);
+  ParallelEmbeddingImpl embedding(
+      num_embeddings, embedding_dim, parallel_args, options);
+  // the dense table is quantized per row while loading
+  embedding.load_state_dict(state_dict);
+  embedding.verify_loaded_weights("");
+  EXPECT_EQ(embedding.weight().scalar_type(), torch::kInt8);
+  auto output = embedding.forward(input);
+  EXPECT_EQ(output.sizes(), expected.sizes());
+  EXPECT_EQ(output.scalar_type(), torch::kFloat);
+  // the error is at most half a step of the row
+  const auto max_abs = state_dict_data["weight"].abs().amax();
+  EXPECT_TRUE(torch::allclose(output,
+                              expected,
+                              /*rtol=*/0,
+                              /*atol=*/max_abs.item<float>() / 254 + 1e-6));
+
+  // the int8 table is loaded as is with its scales
+  const auto [qtable, scale] = detail::quant_embedding_rows(
+      state_dict_data["weight"], torch::kCPU);
+  std::unordered_map<std::string, torch::Tensor> qstate_dict_data;
+  qstate_dict_data["weight"] = qtable;
+  qstate_dict_data["weight_scale"] = scale;
+  StateDict qstate_dict(qstate_dict_data);
+  VocabParallelEmbeddingImpl vocab_embedding(
+      num_embeddings, embedding_dim, parallel_args, options);
+  vocab_embedding.load_state_dict(qstate_dict);
+  vocab_embedding.verify_loaded_weights();
+  EXPECT_TRUE(torch::equal(vocab_embedding.weight(), qtable));
+  EXPECT_TRUE(torch::equal(vocab_embedding.forward(input), output));
+  FLAGS_int8_embedding = false;
+}
+
+TEST(EmbeddingTest, ImageEmbeddings) {
+  const int64_t num_embeddings = 32;
+  const int64_t embedding_dim = 16;
+  const auto options = torch::dtype(torch::kFloat).device(torch::kCPU);
+
+  std::unordered_map<std::string, torch::Tensor> state_dict_data;
+  state_dict_data["weight"] = torch::randn({num_embeddings, embedding_dim});
+  StateDict state_dict(state_dict_data);
+
+  ParallelArgs parallel_args(/*rank=*/0, /*world_size=*/1, nullptr);
+  ParallelEmbeddingImpl embedding(
+      num_embeddings, embedding_dim, parallel_args, options);
+  embedding.load_state_dict(state_dict);
+
+  const auto input = torch::randint(num_embeddings, {8}, torch::kInt);
+  auto expected = state_dict_data["weight"].index_select(0, input);
+  // the rows of the placeholders are replaced by the image embeddings
+  const auto token_idxes = torch::tensor({2, 3, 6}, torch::kLong);
+  const auto image_embeddings = torch::randn({3, embedding_dim});
+  expected.index_copy_(/*dim=*/0, token_idxes, image_embeddings);
+
+  ImageEmbeddings::set_current({token_idxes, image_embeddings});
+  EXPECT_TRUE(torch::equal(embedding.forward(input), expected));
+  ImageEmbeddings::set_current({});
+  EXPECT_TRUE(torch::equal(embedding.forward(input),
+                           state_dict_data["weight"].index_select(0, input)));
+}
+
+}  // namespace llm
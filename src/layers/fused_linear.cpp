@@ -30,7 +30,8 @@ FusedColumnParallelLinearImpl::FusedColumnParallelLinearImpl(
                                          gather_output,
                                          quant_args,
                                          parallel_args,
-                                         options);
+                                         options,
+                                         out_features_vec);
     // calculate split sizes
     split_sizes_.reserve(out_features_vec.size());
     const auto world_size = parallel_args.world_size();
@@ -0,0 +1,319 @@
+#include "fused_moe.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <optional>
+#include <string>
+
+#include "activation.h"
+#include "kernels/gemm/gemm_api.h"
+#include "kernels/moe_kernels.h"
+#include "kernels/quant_kernels.h"
+#include "model_loader/state_dict.h"
+#include "model_parallel/model_parallel.h"
+#include "quantization/qlinear_w8a8_impl.h"
+
+DEFINE_bool(moe_expert_parallel,
+            false,
+            "shard the experts of moe layers across ranks instead of "
+            "sharding the intermediate dim of every expert.");
+
+DECLARE_bool(disable_custom_kernels);
+
+namespace llm {
+namespace {
+// input @ weight.T for each group of rows, quantizing the input per token
+// for quantized weights
+torch::Tensor grouped_linear(const torch::Tensor& input,
+                             const torch::Tensor& weight,
+                             const torch::Tensor& weight_scale,
+                             const torch::Tensor& group_offsets) {
+  if (!weight_scale.defined()) {
+    return grouped_gemm(input, weight, group_offsets);
+  }
+  auto input_q = torch::empty_like(input, weight.scalar_type());
+  auto input_scale =
+      torch::empty({input.size(0)}, input.options().dtype(torch::kFloat));
+  kernel::per_token_quant(input_q, input_scale, input);
+  return grouped_scaled_gemm(input_q,
+                             input_scale,
+                             weight,
+                             weight_scale,
+                             group_offsets,
+                             input.scalar_type());
+}
+
+// input @ weight.T of one expert
+torch::Tensor expert_linear(const torch::Tensor& input,
+                            const torch::Tensor& weight,
+                            const torch::Tensor& weight_scale) {
+  if (!weight_scale.defined()) {
+    return torch::matmul(input, weight.t());
+  }
+  return detail::w8a8_linear(input, weight, weight_scale, std::nullopt);
+}
+}  // namespace
+
+FusedMoEImpl::FusedMoEImpl(int64_t n_experts,
+                           int64_t topk,
+                           int64_t hidden_size,
+                           int64_t intermediate_size,
+                           bool renormalize,
+                           bool expert_parallel,
+                           const std::string& act,
+                           const QuantArgs& quant_args,
+                           const ParallelArgs& parallel_args,
+                           const torch::TensorOptions& options)
+    : n_experts_(n_experts),
+      topk_(topk),
+      renormalize_(renormalize),
+      expert_parallel_(expert_parallel),
+      parallel_args_(parallel_args) {
+  CHECK(topk > 0 && topk <= n_experts && topk <= kernel::kMaxMoETopK)
+      << "unsupported topk " << topk << " for " << n_experts << " experts";
+  act_with_mul_func_ = Activation::get_act_with_mul_func(act, options.device());
+  CHECK(act_with_mul_func_ != nullptr);
+
+  const int64_t world_size = parallel_args.world_size();
+  if (expert_parallel_) {
+    CHECK(n_experts % world_size == 0)
+        << "n_experts " << n_experts << " not divisible by world_size "
+        << world_size;
+    n_local_experts_ = n_experts / world_size;
+    expert_start_ = parallel_args.rank() * n_local_experts_;
+    intermediate_size_per_partition_ = intermediate_size;
+  } else {
+    CHECK(intermediate_size % world_size == 0)
+        << "intermediate_size " << intermediate_size
+        << " not divisible by world_size " << world_size;
+    n_local_experts_ = n_experts;
+    intermediate_size_per_partition_ = intermediate_size / world_size;
+  }
+  const int64_t n_local = n_local_experts_;
+  const int64_t inter = intermediate_size_per_partition_;
+
+  auto weight_options = options;
+  quantized_ = !quant_args.quant_method().empty();
+  if (quantized_) {
+    // only w8a8 quantization is supported for experts
+    weight_options = options.dtype(detail::w8a8_quant_type(quant_args));
+  }
+  w13_ = register_parameter(
+      "w13",
+      torch::empty({n_local, 2 * inter, hidden_size}, weight_options),
+      /*requires_grad=*/false);
+  w2_ = register_parameter(
+      "w2",
+      torch::empty({n_local, hidden_size, inter}, weight_options),
+      /*requires_grad=*/false);
+  if (quantized_) {
+    const auto scale_options = options.dtype(torch::kFloat);
+    w13_scale_ = register_parameter(
+        "w13_scale",
+        torch::empty({n_local, 2 * inter}, scale_options),
+        /*requires_grad=*/false);
+    w2_scale_ = register_parameter(
+        "w2_scale",
+        torch::empty({n_local, hidden_size}, scale_options),
+        /*requires_grad=*/false);
+  }
+  weight_is_loaded_.resize(n_local * kNumParts, false);
+  scale_is_loaded_.resize(n_local * kNumParts, !quantized_);
+
+  // grouped gemms on cuda for the shapes supported by the kernels
+  const auto dtype = options.dtype().toScalarType();
+  if (options.device().is_cuda() && !FLAGS_disable_custom_kernels &&
+      (dtype == torch::kHalf || dtype == torch::kBFloat16)) {
+    // empty inputs of the gate/up and down gemms for the shape checks
+    const auto x = torch::empty({0, hidden_size}, weight_options);
+    const auto h = torch::empty({0, inter}, weight_options);
+    grouped_ = quantized_ ? can_use_scaled_gemm(x, w13_[0]) &&
+                                can_use_scaled_gemm(h, w2_[0])
+                          : can_use_grouped_gemm(x, w13_) &&
+                                can_use_grouped_gemm(h, w2_);
+  }
+}
+
+torch::Tensor FusedMoEImpl::forward(torch::Tensor hidden_states,
+                                    torch::Tensor router_logits) {
+  const auto [topk_weights, topk_ids] = route(router_logits);
+  auto output = grouped_
+                    ? forward_grouped(hidden_states, topk_weights, topk_ids)
+                    : forward_experts(hidden_states, topk_weights, topk_ids);
+  // partial sums over the sharded intermediate dim or the local experts
+  if (parallel_args_.world_size() > 1) {
+    output = reduce_from_model_parallel_region(output, parallel_args_);
+  }
+  return output;
+}
+
+std::tuple<torch::Tensor, torch::Tensor> FusedMoEImpl::route(
+    const torch::Tensor& router_logits) const {
+  const int64_t n_tokens = router_logits.size(0);
+  torch::Tensor topk_weights;
+  torch::Tensor topk_ids;
+  if (grouped_) {
+    const auto options = router_logits.options();
+    topk_weights =
+        torch::empty({n_tokens, topk_}, options.dtype(torch::kFloat));
+    topk_ids = torch::empty({n_tokens, topk_}, options.dtype(torch::kInt));
+    kernel::topk_softmax(
+        topk_weights, topk_ids, router_logits.contiguous(), renormalize_);
+  } else {
+    const auto probs =
+        torch::softmax(router_logits.to(torch::kFloat), /*dim=*/-1);
+    std::tie(topk_weights, topk_ids) = probs.topk(topk_, /*dim=*/-1);
+    if (renormalize_) {
+      topk_weights = topk_weights / topk_weights.sum(/*dim=*/-1, true);
+    }
+    topk_ids = topk_ids.to(torch::kInt);
+  }
+
+  // map to the local experts, -1 for the experts of other ranks
+  if (expert_parallel_ && n_local_experts_ != n_experts_) {
+    topk_ids = topk_ids - expert_start_;
+    topk_ids.masked_fill_((topk_ids < 0) | (topk_ids >= n_local_experts_), -1);
+  }
+  return {topk_weights, topk_ids};
+}
+
+torch::Tensor FusedMoEImpl::forward_grouped(const torch::Tensor& hidden_states,
+                                            const torch::Tensor& topk_weights,
+                                            const torch::Tensor& topk_ids) {
+  const auto input = hidden_states.contiguous();
+  const int64_t n_rows = input.size(0) * topk_;
+
+  // rows sorted by expert, rows of remote experts are left at the end
+  auto permuted = torch::empty({n_rows, input.size(1)}, input.options());
+  auto expert_offsets =
+      torch::empty({n_local_experts_ + 1}, topk_ids.options());
+  auto inv_perm = torch::empty({n_rows}, topk_ids.options());
+  kernel::moe_permute(
+      permuted, expert_offsets, inv_perm, input, topk_ids, n_local_experts_);
+
+  const auto gate_up =
+      grouped_linear(permuted, w13_, w13_scale_, expert_offsets);
+  const auto hidden = act_with_mul_func_(gate_up);
+  const auto down = grouped_linear(hidden, w2_, w2_scale_, expert_offsets);
+
+  auto output = torch::empty_like(input);
+  kernel::moe_combine(output, down, topk_weights, inv_perm);
+  return output;
+}
+
+torch::Tensor FusedMoEImpl::forward_experts(const torch::Tensor& hidden_states,
+                                            const torch::Tensor& topk_weights,
+                                            const torch::Tensor& topk_ids) {
+  // accumulate in float
+  auto output = torch::zeros_like(hidden_states, torch::kFloat);
+  for (int64_t e = 0; e < n_local_experts_; ++e) {
+    // [n, 2]: (token, k) of the rows routed to the expert
+    const auto indices = (topk_ids == e).nonzero();
+    if (indices.size(0) == 0) {
+      continue;
+    }
+    const auto tokens = indices.select(/*dim=*/1, /*index=*/0);
+    const auto ks = indices.select(/*dim=*/1, /*index=*/1);
+    const auto input = hidden_states.index_select(/*dim=*/0, tokens);
+
+    const auto gate_up = expert_linear(
+        input, w13_[e], quantized_ ? w13_scale_[e] : torch::Tensor());
+    const auto hidden = act_with_mul_func_(gate_up);
+    const auto down = expert_linear(
+        hidden, w2_[e], quantized_ ? w2_scale_[e] : torch::Tensor());
+
+    const auto weights = topk_weights.index({tokens, ks}).unsqueeze(-1);
+    output.index_add_(/*dim=*/0, tokens, down.to(torch::kFloat) * weights);
+  }
+  return output.to(hidden_states.scalar_type());
+}
+
+torch::Tensor FusedMoEImpl::part_weight(int64_t expert, Part part) const {
+  const int64_t inter = intermediate_size_per_partition_;
+  if (part == kDown) {
+    return w2_[expert];
+  }
+  return w13_[expert].slice(/*dim=*/0, part * inter, (part + 1) * inter);
+}
+
+torch::Tensor FusedMoEImpl::part_scale(int64_t expert, Part part) const {
+  const int64_t inter = intermediate_size_per_partition_;
+  if (part == kDown) {
+    return w2_scale_[expert];
+  }
+  return w13_scale_[expert].slice(/*dim=*/0, part * inter, (part + 1) * inter);
+}
+
+void FusedMoEImpl::load_state_dict(const StateDict& state_dict,
+                                   const std::vector<std::string>& prefixes) {
+  CHECK_EQ(prefixes.size(), static_cast<size_t>(kNumParts))
+      << "expect prefixes for gate, up and down";
+  // whole experts are loaded with expert parallelism
+  const int32_t rank = expert_parallel_ ? 0 : parallel_args_.rank();
+  const int32_t world_size = expert_parallel_ ? 1 : parallel_args_.world_size();
+
+  for (int64_t i = 0; i < n_local_experts_; ++i) {
+    const auto expert =
+        state_dict.select(std::to_string(expert_start_ + i) + ".");
+    if (expert.size() == 0) {
+      continue;
+    }
+    for (int p = 0; p < kNumParts; ++p) {
+      const auto part = static_cast<Part>(p);
+      const auto& prefix = prefixes[p];
+      const size_t idx = i * kNumParts + p;
+      // gate and up are sharded on the output dim, down on the input dim
+      const int64_t dim = part == kDown ? 1 : 0;
+      const auto weight =
+          expert.get_sharded_tensor(prefix + "weight", dim, rank, world_size);
+      if (weight.defined()) {
+        auto dst = part_weight(i, part);
+        CHECK_EQ(dst.sizes(), weight.sizes())
+            << "weight size mismatch for " << expert.prefix() << prefix;
+        dst.copy_(weight);
+        weight_is_loaded_[idx] = true;
+      }
+      if (!quantized_) {
+        continue;
+      }
+
+      // per tensor or per channel scale
+      auto scale = expert.get_tensor(prefix + "weight_scale");
+      if (!scale.defined()) {
+        continue;
+      }
+      auto dst = part_scale(i, part);
+      if (scale.numel() == 1) {
+        dst.fill_(scale.item<float>());
+      } else {
+        if (part != kDown) {
+          scale = expert.get_sharded_tensor(
+              prefix + "weight_scale", /*dim=*/0, rank, world_size);
+        }
+        scale = scale.reshape({-1});
+        CHECK_EQ(dst.sizes(), scale.sizes())
+            << "weight_scale size mismatch for " << expert.prefix() << prefix;
+        dst.copy_(scale);
+      }
+      scale_is_loaded_[idx] = true;
+    }
+  }
+}
+
+void FusedMoEImpl::verify_loaded_weights(const std::string& prefix) const {
+  for (int64_t i = 0; i < n_local_experts_; ++i) {
+    for (int p = 0; p < kNumParts; ++p) {
+      const size_t idx = i * kNumParts + p;
+      CHECK(weight_is_loaded_[idx])
+          << "weight is not loaded for " << prefix << expert_start_ + i
+          << " part " << p;
+      CHECK(scale_is_loaded_[idx])
+          << "weight_scale is not loaded for " << prefix << expert_start_ + i
+          << " part " << p;
+    }
+  }
+}
+
+}  // namespace llm
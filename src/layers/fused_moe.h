@@ -0,0 +1,109 @@
+#pragma once
+
+#include <torch/torch.h>
+
+#include <string>
+#include <vector>
+
+#include "activation.h"
+#include "model_loader/state_dict.h"
+#include "model_parallel/parallel_args.h"
+#include "quantization/quant_args.h"
+
+namespace llm {
+
+// mixture of experts mlp with top k routing: each token is sent to the topk
+// experts with the highest router probabilities and the expert outputs are
+// combined with those probabilities. each expert is a gated mlp:
+// down(act(x @ gate.T) * (x @ up.T)).
+// on cuda, tokens are permuted into rows sorted by expert and all experts are
+// computed with one grouped gemm for gate/up and one for down, otherwise the
+// experts are computed one by one.
+// with tensor parallelism the intermediate dim of all experts is sharded, with
+// expert parallelism each rank holds n_experts / world_size whole experts.
+// both produce partial sums of the output that are all-reduced at the end.
+// dense and w8a8 (int8/fp8) quantized experts are supported.
+class FusedMoEImpl : public torch::nn::Module {
+ public:
+  FusedMoEImpl(int64_t n_experts,
+               int64_t topk,
+               int64_t hidden_size,
+               int64_t intermediate_size,
+               bool renormalize,
+               bool expert_parallel,
+               const std::string& act,
+               const QuantArgs& quant_args,
+               const ParallelArgs& parallel_args,
+               const torch::TensorOptions& options);
+
+  // hidden_states: [n_tokens, hidden_size]
+  // router_logits: [n_tokens, n_experts]
+  // returns: [n_tokens, hidden_size]
+  torch::Tensor forward(torch::Tensor hidden_states,
+                        torch::Tensor router_logits);
+
+  // load the weights of the experts, named "{expert}.{prefix}weight" for the
+  // prefixes of gate, up and down, e.g. {"w1.", "w3.", "w2."} for mixtral.
+  void load_state_dict(const StateDict& state_dict,
+                       const std::vector<std::string>& prefixes);
+
+  void verify_loaded_weights(const std::string& prefix = "") const;
+
+  int64_t n_local_experts() const { return n_local_experts_; }
+
+ private:
+  // weights of each expert, in the order of the load prefixes
+  enum Part : int8_t { kGate = 0, kUp, kDown, kNumParts };
+
+  // compute the experts on the rows sorted by expert with grouped gemms
+  torch::Tensor forward_grouped(const torch::Tensor& hidden_states,
+                                const torch::Tensor& topk_weights,
+                                const torch::Tensor& topk_ids);
+
+  // compute the experts one by one
+  torch::Tensor forward_experts(const torch::Tensor& hidden_states,
+                                const torch::Tensor& topk_weights,
+                                const torch::Tensor& topk_ids);
+
+  // [n_tokens, topk] weights and local expert ids, -1 for remote experts
+  std::tuple<torch::Tensor, torch::Tensor> route(
+      const torch::Tensor& router_logits) const;
+
+  // views of the weight and scale of the part of the local expert
+  torch::Tensor part_weight(int64_t expert, Part part) const;
+  torch::Tensor part_scale(int64_t expert, Part part) const;
+
+  // parameter members, must be registered
+  // [n_local_experts, 2 * intermediate_size_per_partition, hidden_size]
+  torch::Tensor w13_;
+  // [n_local_experts, hidden_size, intermediate_size_per_partition]
+  torch::Tensor w2_;
+  // per channel scales of the quantized weights
+  // [n_local_experts, 2 * intermediate_size_per_partition]
+  torch::Tensor w13_scale_;
+  // [n_local_experts, hidden_size]
+  torch::Tensor w2_scale_;
+
+  // whether the weight and scale of each part of each expert is loaded
+  std::vector<bool> weight_is_loaded_;
+  std::vector<bool> scale_is_loaded_;
+
+  ActFunc act_with_mul_func_{nullptr};
+
+  int64_t n_experts_ = 0;
+  int64_t n_local_experts_ = 0;
+  // global id of the first local expert
+  int64_t expert_start_ = 0;
+  int64_t topk_ = 0;
+  int64_t intermediate_size_per_partition_ = 0;
+  bool renormalize_ = false;
+  bool expert_parallel_ = false;
+  bool quantized_ = false;
+  // whether to use the custom kernels and grouped gemms
+  bool grouped_ = false;
+
+  ParallelArgs parallel_args_;
+};
+TORCH_MODULE(FusedMoE);
+
+}  // namespace llm
@@ -0,0 +1,138 @@
+#include "fused_moe.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include <string>
+#include <unordered_map>
+
+#include "model_loader/state_dict.h"
+#include "model_parallel/process_group.h"
+
+namespace llm {
+namespace {
+// keeps the partial sums of each rank, which are summed up by the test
+class NoopProcessGroup : public ProcessGroup {
+ public:
+  NoopProcessGroup(int rank, int world_size)
+      : ProcessGroup(rank, world_size, torch::kCPU) {}
+
+  void allreduce(torch::Tensor& /*input*/) override {}
+
+  void allgather(torch::Tensor /*input*/,
+                 std::vector<torch::Tensor>& /*outputs*/) override {}
+
+  void send(const torch::Tensor& /*input*/, int /*dst*/) override {}
+
+  void recv(torch::Tensor& /*output*/, int /*src*/) override {}
+};
+
+// route each token to its topk experts and sum up the weighted outputs
+torch::Tensor moe_ref(const torch::Tensor& input,
+                      const torch::Tensor& router_logits,
+                      const std::unordered_map<std::string, torch::Tensor>& w,
+                      int64_t n_experts,
+                      int64_t topk) {
+  const auto x = input.to(torch::kFloat);
+  const auto probs = torch::softmax(router_logits.to(torch::kFloat), -1);
+  auto [weights, ids] = probs.topk(topk, /*dim=*/-1);
+  weights = weights / weights.sum(/*dim=*/-1, /*keepdim=*/true);
+
+  auto output = torch::zeros_like(x);
+  for (int64_t e = 0; e < n_experts; ++e) {
+    const auto prefix = std::to_string(e) + ".";
+    const auto gate = x.matmul(w.at(prefix + "w1.weight").to(x).t());
+    const auto up = x.matmul(w.at(prefix + "w3.weight").to(x).t());
+    const auto down =
+        (torch::silu(gate) * up).matmul(w.at(prefix + "w2.weight").to(x).t());
+    // [n_tokens, 1] weight of the expert for each token, 0 if not selected
+    const auto weight = (weights * (ids == e)).sum(/*dim=*/-1, true);
+    output += down * weight;
+  }
+  return output.to(input.scalar_type());
+}
+}  // namespace
+
+class FusedMoETest
+    : public ::testing::TestWithParam<std::tuple<torch::Device,
+                                                 torch::ScalarType,
+                                                 int64_t /*n_shards*/,
+                                                 bool /*expert_parallel*/>> {
+};
+
+TEST_P(FusedMoETest, Result) {
+  const auto& [device, dtype, n_shards, expert_parallel] = GetParam();
+  if (device.is_cuda() && !torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  const int64_t n_tokens = 37;
+  const int64_t n_experts = 8;
+  const int64_t topk = 2;
+  const int64_t hidden_size = 256;
+  const int64_t intermediate_size = 512;
+  const auto options = torch::dtype(dtype).device(device);
+
+  std::unordered_map<std::string, torch::Tensor> weights;
+  for (int64_t e = 0; e < n_experts; ++e) {
+    const auto prefix = std::to_string(e) + ".";
+    weights[prefix + "w1.weight"] =
+        torch::randn({intermediate_size, hidden_size}, options) * 0.05;
+    weights[prefix + "w3.weight"] =
+        torch::randn({intermediate_size, hidden_size}, options) * 0.05;
+    weights[prefix + "w2.weight"] =
+        torch::randn({hidden_size, intermediate_size}, options) * 0.05;
+  }
+  StateDict state_dict(weights);
+
+  const auto input = torch::randn({n_tokens, hidden_size}, options);
+  const auto router_logits = torch::randn({n_tokens, n_experts}, options);
+
+  auto output = torch::zeros({n_tokens, hidden_size}, torch::kFloat);
+  for (int32_t shard_id = 0; shard_id < n_shards; ++shard_id) {
+    NoopProcessGroup process_group(shard_id, n_shards);
+    ParallelArgs parallel_args(shard_id, n_shards, &process_group);
+    FusedMoEImpl moe(n_experts,
+                     topk,
+                     hidden_size,
+                     intermediate_size,
+                     /*renormalize=*/true,
+                     expert_parallel,
+                     "silu",
+                     QuantArgs(),
+                     parallel_args,
+                     options);
+    moe.load_state_dict(state_dict, {"w1.", "w3.", "w2."});
+    moe.verify_loaded_weights();
+    EXPECT_EQ(moe.n_local_experts(),
+              expert_parallel ? n_experts / n_shards : n_experts);
+
+    const auto partial = moe.forward(input, router_logits);
+    ASSERT_EQ(partial.sizes(), input.sizes());
+    output += partial.cpu().to(torch::kFloat);
+  }
+
+  const auto desired_output =
+      moe_ref(input, router_logits, weights, n_experts, topk);
+  EXPECT_TRUE(torch::allclose(output,
+                              desired_output.cpu().to(torch::kFloat),
+                              /*rtol=*/1e-2,
+                              /*atol=*/1e-2));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    FusedMoE,
+    FusedMoETest,
+    ::testing::Combine(::testing::Values(torch::kCPU),
+                       ::testing::Values(torch::kFloat),
+                       ::testing::Values(1, 2, 4),  // n_shards
+                       ::testing::Values(false, true)));
+
+INSTANTIATE_TEST_SUITE_P(
+    FusedMoEKernel,
+    FusedMoETest,
+    ::testing::Combine(::testing::Values(torch::kCUDA),
+                       ::testing::Values(torch::kHalf, torch::kBFloat16),
+                       ::testing::Values(1, 2),  // n_shards
+                       ::testing::Values(false, true)));
+
+}  // namespace llm
@@ -0,0 +1,125 @@
+#include "gated_linear.h"
+
+#include <gflags/gflags_declare.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <boost/algorithm/string.hpp>
+
+#include "activation.h"
+#include "linear.h"
+#include "model_loader/state_dict.h"
+#include "model_parallel/parallel_args.h"
+#include "quantization/quant_args.h"
+
+DECLARE_bool(disable_custom_kernels);
+
+namespace llm {
+namespace {
+// the gated activation of the gemm epilogue for the activation name
+std::optional<GatedAct> to_gated_act(const std::string& name) {
+  if (boost::iequals(name, "silu")) {
+    return GatedAct::kSilu;
+  }
+  if (boost::iequals(name, "gelu")) {
+    return GatedAct::kGelu;
+  }
+  // all tanh approximations of gelu
+  if (boost::iequals(name, "gelu_pytorch_tanh") ||
+      boost::iequals(name, "gelu_new") || boost::iequals(name, "gelu_fast")) {
+    return GatedAct::kGeluTanh;
+  }
+  if (boost::iequals(name, "relu")) {
+    return GatedAct::kRelu;
+  }
+  return std::nullopt;
+}
+}  // namespace
+
+FusedGateUpLinearImpl::FusedGateUpLinearImpl(
+    int64_t in_features,
+    int64_t out_features,
+    bool bias,
+    const std::string& act,
+    const QuantArgs& quant_args,
+    const ParallelArgs& parallel_args,
+    const torch::TensorOptions& options) {
+  act_func_ = Activation::get_act_func(act, options.device());
+  CHECK(act_func_ != nullptr);
+  act_with_mul_func_ = Activation::get_act_with_mul_func(act, options.device());
+  CHECK(act_with_mul_func_ != nullptr);
+
+  // check if the linear layers can be fused
+  fused_ = quant_args.can_be_fused();
+  if (fused_) {
+    gate_up_proj_ =
+        register_module("gate_up_proj",
+                        ColumnParallelLinear(in_features,
+                                             2 * out_features,
+                                             bias,
+                                             /*gather_output=*/false,
+                                             quant_args,
+                                             parallel_args,
+                                             options,
+                                             {out_features, out_features}));
+    if (options.device().is_cuda() && !FLAGS_disable_custom_kernels) {
+      gated_act_ = to_gated_act(act);
+    }
+  } else {
+    gate_proj_ = register_module("gate_proj",
+                                 ColumnParallelLinear(in_features,
+                                                      out_features,
+                                                      bias,
+                                                      /*gather_output=*/false,
+                                                      quant_args,
+                                                      parallel_args,
+                                                      options));
+    up_proj_ = register_module("up_proj",
+                               ColumnParallelLinear(in_features,
+                                                    out_features,
+                                                    bias,
+                                                    /*gather_output=*/false,
+                                                    quant_args,
+                                                    parallel_args,
+                                                    options));
+  }
+}
+
+torch::Tensor FusedGateUpLinearImpl::forward(torch::Tensor input) {
+  if (!fused_) {
+    return act_func_(gate_proj_(input)) * up_proj_(input);
+  }
+  // apply the gated activation in the gemm epilogue if supported
+  if (gated_act_.has_value()) {
+    auto output = gate_up_proj_->forward_gated(input, gated_act_.value());
+    if (output.defined()) {
+      return output;
+    }
+  }
+  // otherwise in one pass over the fused output, e.g. for quantized gemms
+  return act_with_mul_func_(gate_up_proj_(input));
+}
+
+void FusedGateUpLinearImpl::load_state_dict(
+    const StateDict& state_dict,
+    const std::vector<std::string>& prefixes) {
+  CHECK_EQ(prefixes.size(), 2) << "expect prefixes for gate and up";
+  if (fused_) {
+    gate_up_proj_->load_state_dict(state_dict, prefixes);
+  } else {
+    gate_proj_->load_state_dict(state_dict.select(prefixes[0]));
+    up_proj_->load_state_dict(state_dict.select(prefixes[1]));
+  }
+}
+
+void FusedGateUpLinearImpl::verify_loaded_weights(
+    const std::string& prefix) const {
+  if (fused_) {
+    gate_up_proj_->verify_loaded_weights(prefix);
+  } else {
+    gate_proj_->verify_loaded_weights(prefix);
+    up_proj_->verify_loaded_weights(prefix);
+  }
+}
+
+}  // namespace llm
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "activation.h"
+#include "linear.h"
+#include "model_loader/state_dict.h"
+#include "model_parallel/parallel_args.h"
+#include "quantization/quant_args.h"
+
+namespace llm {
+
+// fused gate and up projections of a mlp followed by the gated activation:
+// act(x @ gate.T) * (x @ up.T). for dense weights on cuda, the activation is
+// applied in the gemm epilogue and only the [n_tokens, out_features] result
+// is written, otherwise the activation is applied on the fused gemm output.
+class FusedGateUpLinearImpl : public torch::nn::Module {
+ public:
+  FusedGateUpLinearImpl(int64_t in_features,
+                        int64_t out_features,
+                        bool bias,
+                        const std::string& act,
+                        const QuantArgs& quant_args,
+                        const ParallelArgs& parallel_args,
+                        const torch::TensorOptions& options);
+
+  torch::Tensor forward(torch::Tensor input);
+
+  // load_state_dict for gate and up weights
+  void load_state_dict(const StateDict& state_dict,
+                       const std::vector<std::string>& prefixes);
+
+  void verify_loaded_weights(const std::string& prefix = "") const;
+
+ private:
+  // fused linear layer for gate and up
+  ColumnParallelLinear gate_up_proj_{nullptr};
+
+  // non-fused linear layers
+  ColumnParallelLinear gate_proj_{nullptr};
+  ColumnParallelLinear up_proj_{nullptr};
+
+  // activation functions
+  ActFunc act_func_{nullptr};
+  ActFunc act_with_mul_func_{nullptr};
+
+  // gated activation of the gemm epilogue if supported
+  std::optional<GatedAct> gated_act_;
+
+  // whether the linear layers are fused
+  bool fused_ = false;
+};
+TORCH_MODULE(FusedGateUpLinear);
+
+}  // namespace llm
@@ -0,0 +1,89 @@
+#include "gated_linear.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include "model_loader/state_dict.h"
+
+namespace llm {
+
+class GatedLinearTest
+    : public ::testing::TestWithParam<std::tuple<torch::Device,
+                                                 torch::ScalarType,
+                                                 int64_t /*n_shards*/,
+                                                 std::string /*act*/>> {};
+
+TEST_P(GatedLinearTest, LoadFusedWeight) {
+  const auto& [device, dtype, n_shards, act] = GetParam();
+  if (device.is_cuda() && !torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  const int64_t n_tokens = 20;
+  const int64_t in_features = 256;
+  const int64_t out_features = 512;
+  const auto options = torch::dtype(dtype).device(device);
+
+  std::unordered_map<std::string, torch::Tensor> gate_data;
+  gate_data["gate_proj.weight"] =
+      torch::randn({out_features, in_features}, options) * 0.05;
+  std::unordered_map<std::string, torch::Tensor> up_data;
+  up_data["up_proj.weight"] =
+      torch::randn({out_features, in_features}, options) * 0.05;
+  // gate and up weights come from different files
+  StateDict gate_state_dict(gate_data);
+  StateDict up_state_dict(up_data);
+
+  const auto gate_chunks = gate_data["gate_proj.weight"].chunk(n_shards, 0);
+  const auto up_chunks = up_data["up_proj.weight"].chunk(n_shards, 0);
+  const auto act_func = Activation::get_act_func(act, torch::kCPU);
+  for (int32_t shard_id = 0; shard_id < n_shards; ++shard_id) {
+    QuantArgs quant_args;
+    ParallelArgs parallel_args(shard_id, n_shards, nullptr);
+    FusedGateUpLinearImpl linear(in_features,
+                                 out_features,
+                                 /*bias=*/false,
+                                 act,
+                                 quant_args,
+                                 parallel_args,
+                                 options);
+    linear.load_state_dict(gate_state_dict, {"gate_proj.", "up_proj."});
+    linear.load_state_dict(up_state_dict, {"gate_proj.", "up_proj."});
+    linear.verify_loaded_weights();
+
+    const auto input = torch::randn({n_tokens, in_features}, options);
+    const auto output = linear.forward(input);
+
+    // separate gemms and activation in float
+    const auto gate = input.matmul(gate_chunks[shard_id].t());
+    const auto up = input.matmul(up_chunks[shard_id].t());
+    const auto desired_output =
+        (act_func(gate.cpu().to(torch::kFloat)) * up.cpu().to(torch::kFloat))
+            .to(dtype);
+    ASSERT_EQ(output.sizes(),
+              torch::IntArrayRef({n_tokens, out_features / n_shards}));
+    EXPECT_TRUE(torch::allclose(output.cpu(),
+                                desired_output,
+                                /*rtol=*/1e-2,
+                                /*atol=*/1e-2));
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    GatedLinear,
+    GatedLinearTest,
+    ::testing::Combine(
+        ::testing::Values(torch::kCPU),
+        ::testing::Values(torch::kFloat),
+        ::testing::Values(1, 2),  // n_shards
+        ::testing::Values("silu", "gelu", "gelu_pytorch_tanh")));
+
+INSTANTIATE_TEST_SUITE_P(
+    GatedLinearKernel,
+    GatedLinearTest,
+    ::testing::Combine(
+        ::testing::Values(torch::kCUDA),
+        ::testing::Values(torch::kHalf, torch::kBFloat16),
+        ::testing::Values(1, 2),  // n_shards
+        ::testing::Values("silu", "gelu", "gelu_pytorch_tanh")));
+
+}  // namespace llm
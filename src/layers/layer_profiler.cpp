@@ -0,0 +1,161 @@
+#include "layer_profiler.h"
+
+#include <ATen/cuda/CUDAContext.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common/metrics.h"
+
+DEFINE_int32(layer_profile_interval,
+             0,
+             "Time the attention, norm and communication of each decoder "
+             "layer with cuda events in 1 of every n forward passes, which "
+             "run in eager mode. 0 to disable.");
+
+DEFINE_HISTOGRAM_FAMILY(layer_component_latency_seconds,
+                        "Latency of the components of a decoder layer in "
+                        "profiled forward passes");
+
+namespace llm {
+namespace {
+
+const std::vector<double> kLatencyBuckets = {0.000005,
+                                             0.00001,
+                                             0.00002,
+                                             0.00005,
+                                             0.0001,
+                                             0.0002,
+                                             0.0005,
+                                             0.001,
+                                             0.002,
+                                             0.005,
+                                             0.01,
+                                             0.02,
+                                             0.05};
+
+// round up to a power of 2 to bound the number of label values
+int64_t num_tokens_bucket(int64_t num_tokens) {
+  int64_t bucket = 1;
+  while (bucket < num_tokens) {
+    bucket *= 2;
+  }
+  return bucket;
+}
+
+}  // namespace
+
+thread_local LayerProfiler* LayerProfiler::current_ = nullptr;
+
+LayerProfiler::LayerProfiler(std::string model_type)
+    : model_type_(std::move(model_type)) {}
+
+bool LayerProfiler::should_profile() {
+  if (FLAGS_layer_profile_interval <= 0) {
+    return false;
+  }
+  return ++num_steps_ % FLAGS_layer_profile_interval == 0;
+}
+
+void LayerProfiler::begin_step() {
+  CHECK(current_ == nullptr) << "another forward pass is being profiled";
+  scopes_.clear();
+  open_scopes_.clear();
+  current_layer_ = -1;
+  current_ = this;
+}
+
+size_t LayerProfiler::begin_scope(const char* component) {
+  const size_t index = scopes_.size();
+  Scope scope;
+  scope.component = component;
+  scope.parent = open_scopes_.empty() ? -1 : open_scopes_.back();
+  if (component == kDecoderLayerComponent) {
+    current_layer_ = static_cast<int64_t>(index);
+  }
+  scope.layer = current_layer_;
+  scope.stream = at::cuda::getCurrentCUDAStream().stream();
+  scopes_.push_back(scope);
+  open_scopes_.push_back(static_cast<int64_t>(index));
+
+  event(2 * index).record(at::cuda::getCurrentCUDAStream());
+  return index;
+}
+
+void LayerProfiler::end_scope(size_t index) {
+  CHECK(!open_scopes_.empty() &&
+        open_scopes_.back() == static_cast<int64_t>(index))
+      << "scopes should be ended in the reverse order they started";
+  event(2 * index + 1).record(at::cuda::getCurrentCUDAStream());
+  open_scopes_.pop_back();
+  if (scopes_[index].component == kDecoderLayerComponent) {
+    current_layer_ = -1;
+  }
+}
+
+void LayerProfiler::end_step(const char* phase, int64_t num_tokens) {
+  current_ = nullptr;
+  CHECK(open_scopes_.empty()) << "scopes are not ended";
+
+  const size_t n_scopes = scopes_.size();
+  std::vector<double> inclusive(n_scopes);
+  for (size_t i = 0; i < n_scopes; ++i) {
+    auto& end = event(2 * i + 1);
+    end.synchronize();
+    inclusive[i] = event(2 * i).elapsed_time(end) / 1000.0;
+  }
+  // exclude the nested scopes, except the ones overlapped on other streams
+  std::vector<double> exclusive = inclusive;
+  for (size_t i = 0; i < n_scopes; ++i) {
+    const int64_t parent = scopes_[i].parent;
+    if (parent >= 0 && scopes_[parent].stream == scopes_[i].stream) {
+      exclusive[parent] -= inclusive[i];
+    }
+  }
+
+  // sum up the time of each component per layer
+  std::map<int64_t, std::map<std::string, double>> layers;
+  for (size_t i = 0; i < n_scopes; ++i) {
+    const int64_t layer = scopes_[i].layer;
+    if (layer < 0) {
+      // scopes out of the decoder layers, e.g. the final norm
+      continue;
+    }
+    if (layer == static_cast<int64_t>(i)) {
+      layers[layer]["other"] += exclusive[i];
+      layers[layer]["total"] += inclusive[i];
+    } else {
+      layers[layer][scopes_[i].component] += exclusive[i];
+    }
+  }
+
+  const std::string num_tokens_label =
+      std::to_string(num_tokens_bucket(num_tokens));
+  last_step_seconds_.clear();
+  for (const auto& [layer, components] : layers) {
+    for (const auto& [component, seconds] : components) {
+      last_step_seconds_[component] += std::max(seconds, 0.0);
+      layer_component_latency_seconds_family
+          .Add({{"model", model_type_},
+                {"phase", phase},
+                {"num_tokens", num_tokens_label},
+                {"component", component}},
+               kLatencyBuckets)
+          .Observe(std::max(seconds, 0.0));
+    }
+  }
+}
+
+at::cuda::CUDAEvent& LayerProfiler::event(size_t idx) {
+  while (events_.size() <= idx) {
+    // the default flags enable timing
+    events_.push_back(std::make_unique<at::cuda::CUDAEvent>(cudaEventDefault));
+  }
+  return *events_[idx];
+}
+
+}  // namespace llm
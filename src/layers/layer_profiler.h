@@ -0,0 +1,140 @@
+#pragma once
+
+#include <ATen/cuda/CUDAEvent.h>
+#include <cuda_runtime.h>
+#include <gflags/gflags_declare.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common/macros.h"
+#include "common/trace.h"
+
+// profile the decoder layers in 1 of every n forward passes, 0 to disable.
+DECLARE_int32(layer_profile_interval);
+
+namespace llm {
+
+// component name of the decoder layer scopes
+inline constexpr const char* kDecoderLayerComponent = "decoder_layer";
+
+// Times the components of the decoder layers, e.g. attention, norm and
+// communication, with cuda events in sampled forward passes, and exports the
+// latency of each component per layer as histograms labeled by the model and
+// the batch shape. The time of a scope excludes the time of the scopes nested
+// in it on the same stream, and the rest of a decoder layer is reported as
+// "other". Profiled passes run in eager mode and wait for the device at the
+// end, so only a small fraction of them should be profiled.
+class LayerProfiler final {
+ public:
+  explicit LayerProfiler(std::string model_type);
+
+  // the profiler of the forward pass being profiled on the calling thread,
+  // nullptr if none. the scopes are no-ops without it.
+  static LayerProfiler* current() { return current_; }
+
+  // whether to profile the next forward pass, true for 1 in every
+  // FLAGS_layer_profile_interval calls.
+  bool should_profile();
+
+  // start profiling a forward pass on the calling thread
+  void begin_step();
+
+  // wait for the forward pass to finish on the device and export the
+  // latencies of the components of each layer.
+  // phase: "decode" or "prefill", num_tokens: the number of tokens of the batch
+  void end_step(const char* phase, int64_t num_tokens);
+
+  // record the start of a scope on the current stream, returns its index
+  size_t begin_scope(const char* component);
+
+  // record the end of the scope on the current stream
+  void end_scope(size_t index);
+
+  // seconds of each component of the last profiled forward pass, summed over
+  // the decoder layers, including "other" and "total".
+  const std::map<std::string, double>& last_step_seconds() const {
+    return last_step_seconds_;
+  }
+
+ private:
+  struct Scope {
+    // static name of the component
+    const char* component = nullptr;
+
+    // index of the enclosing scope, -1 for none
+    int64_t parent = -1;
+
+    // index of the enclosing decoder layer scope, -1 for none
+    int64_t layer = -1;
+
+    // stream the events are recorded on
+    cudaStream_t stream = nullptr;
+  };
+
+  // the idx-th event of the step, created on first use and reused
+  at::cuda::CUDAEvent& event(size_t idx);
+
+  static thread_local LayerProfiler* current_;
+
+  std::string model_type_;
+
+  // number of calls to should_profile
+  int64_t num_steps_ = 0;
+
+  // scopes of the step in the order they started
+  std::vector<Scope> scopes_;
+
+  // indices of the scopes not ended yet
+  std::vector<int64_t> open_scopes_;
+
+  // index of the open decoder layer scope, -1 for none
+  int64_t current_layer_ = -1;
+
+  // start and end events of the scopes, two for each
+  std::vector<std::unique_ptr<at::cuda::CUDAEvent>> events_;
+
+  // see last_step_seconds()
+  std::map<std::string, double> last_step_seconds_;
+};
+
+// Times the scope as a component of a decoder layer if the forward pass is
+// being profiled.
+class LayerProfileScope final {
+ public:
+  explicit LayerProfileScope(const char* component)
+      : profiler_(LayerProfiler::current()) {
+    if (profiler_ != nullptr) {
+      index_ = profiler_->begin_scope(component);
+    }
+  }
+
+  ~LayerProfileScope() {
+    if (profiler_ != nullptr) {
+      profiler_->end_scope(index_);
+    }
+  }
+
+  LayerProfileScope(const LayerProfileScope&) = delete;
+  LayerProfileScope& operator=(const LayerProfileScope&) = delete;
+
+ private:
+  LayerProfiler* profiler_ = nullptr;
+
+  size_t index_ = 0;
+};
+
+}  // namespace llm
+
+// example: LAYER_PROFILE_SCOPE("attention");
+#define LAYER_PROFILE_SCOPE(component) \
+  llm::LayerProfileScope LLM_ANON_VAR(layer_profile_scope_)(component);
+
+// marks a decoder layer as a nvtx range and as the layer of the profiled
+// components in it
+#define DECODER_LAYER_SCOPE() \
+  NVTX_SCOPE("decoder_layer") \
+  LAYER_PROFILE_SCOPE(llm::kDecoderLayerComponent)
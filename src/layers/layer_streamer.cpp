@@ -0,0 +1,147 @@
+#include "layer_streamer.h"
+
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDAGuard.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+
+#include "common/pinned_allocator.h"
+
+DEFINE_int32(offload_layers,
+             0,
+             "number of decoder layers whose weights stay in pinned host "
+             "memory and are streamed onto the device for each forward pass, "
+             "to run models larger than the device memory. 0 to disable");
+
+namespace llm {
+
+namespace {
+// the parameters and buffers of the layer, in a stable order
+std::vector<torch::Tensor> layer_weights(const torch::nn::Module& layer) {
+  auto weights = layer.parameters();
+  for (auto& buffer : layer.buffers()) {
+    weights.push_back(buffer);
+  }
+  return weights;
+}
+}  // namespace
+
+LayerStreamer::LayerStreamer(int64_t n_layers, const torch::Device& device)
+    : device_(device), n_layers_(n_layers) {
+  CHECK_GE(FLAGS_offload_layers, 0) << "offload_layers should be >= 0";
+  first_offloaded_ = n_layers_ - std::min<size_t>(FLAGS_offload_layers,
+                                                  n_layers_);
+  layers_.resize(n_layers_ - first_offloaded_);
+  if (enabled() && device_.is_cuda()) {
+    copy_stream_ = c10::cuda::getStreamFromPool(/*isHighPriority=*/false,
+                                                device_.index());
+  }
+}
+
+void LayerStreamer::add_layer(
+    size_t layer_idx,
+    const std::shared_ptr<torch::nn::Module>& layer) {
+  CHECK_LT(layer_idx, n_layers_);
+  if (layer_idx < first_offloaded_) {
+    return;
+  }
+  CHECK(!bound_) << "layers can't be added after the first forward pass";
+  torch::NoGradGuard no_grad;
+  for (auto& weight : layer_weights(*layer)) {
+    // pinned on the numa node of the device
+    auto host = device_.is_cuda()
+                    ? PinnedAllocator::get(device_).empty(weight.sizes(),
+                                                          weight.scalar_type())
+                    : torch::empty_like(weight, weight.options().device(
+                                                    torch::kCPU));
+    host.copy_(weight);
+    // swap the storage in place to keep the references valid, the device
+    // memory is freed.
+    weight.set_data(host);
+  }
+  layers_[layer_idx - first_offloaded_] = layer;
+}
+
+void LayerStreamer::bind_slots() {
+  torch::NoGradGuard no_grad;
+  host_weights_.reserve(layers_.size());
+  for (size_t i = 0; i < layers_.size(); ++i) {
+    CHECK(layers_[i] != nullptr)
+        << "offloaded layer " << first_offloaded_ + i << " is not added";
+    auto weights = layer_weights(*layers_[i]);
+    auto& slot = slots_[i % 2];
+    if (slot.empty()) {
+      slot.reserve(weights.size());
+      for (const auto& weight : weights) {
+        slot.push_back(torch::empty_like(
+            weight, weight.options().device(device_).pinned_memory(false)));
+      }
+    }
+    CHECK_EQ(weights.size(), slot.size())
+        << "offloaded layers should have the same weights";
+
+    auto& host = host_weights_.emplace_back();
+    host.reserve(weights.size());
+    for (size_t j = 0; j < weights.size(); ++j) {
+      CHECK(weights[j].device().is_cpu())
+          << "weights of offloaded layers were moved to "
+          << weights[j].device();
+      CHECK(weights[j].sizes() == slot[j].sizes() &&
+            weights[j].dtype() == slot[j].dtype())
+          << "offloaded layers should have the same weights";
+      // keep the host storage, the layer runs out of the slot from now on
+      host.push_back(weights[j].data());
+      weights[j].set_data(slot[j]);
+    }
+  }
+  bound_ = true;
+}
+
+void LayerStreamer::prefetch(size_t layer_idx) {
+  const auto slot = slot_of(layer_idx);
+  const auto& host = host_weights_[layer_idx - first_offloaded_];
+  if (!copy_stream_.has_value()) {
+    for (size_t j = 0; j < host.size(); ++j) {
+      slots_[slot][j].copy_(host[j]);
+    }
+    return;
+  }
+
+  // the slot is free once the kernels of the previous layer using it are
+  // done, which were all enqueued before this call.
+  free_[slot].record(at::cuda::getCurrentCUDAStream(device_.index()));
+  c10::cuda::CUDAStreamGuard stream_guard(copy_stream_.value());
+  free_[slot].block(copy_stream_.value());
+  for (size_t j = 0; j < host.size(); ++j) {
+    slots_[slot][j].copy_(host[j], /*non_blocking=*/true);
+  }
+  ready_[slot].record(copy_stream_.value());
+}
+
+void LayerStreamer::fetch(size_t layer_idx) {
+  if (!enabled()) {
+    return;
+  }
+  if (!bound_) {
+    bind_slots();
+  }
+  torch::NoGradGuard no_grad;
+  if (layer_idx == 0) {
+    // overlap the first offloaded layer with the resident layers
+    prefetch(first_offloaded_);
+  }
+  if (layer_idx < first_offloaded_) {
+    return;
+  }
+  if (copy_stream_.has_value()) {
+    ready_[slot_of(layer_idx)].block(
+        at::cuda::getCurrentCUDAStream(device_.index()));
+  }
+  if (layer_idx + 1 < n_layers_) {
+    prefetch(layer_idx + 1);
+  }
+}
+
+}  // namespace llm
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <ATen/cuda/CUDAEvent.h>
+#include <c10/cuda/CUDAStream.h>
+#include <gflags/gflags_declare.h>
+#include <torch/torch.h>
+
+#include <memory>
+#include <optional>
+#include <vector>
+
+// number of decoder layers of each model whose weights stay in pinned host
+// memory and are streamed onto the device for each forward pass, counted from
+// the last layer. 0 to keep all layers on the device
+DECLARE_int32(offload_layers);
+
+namespace llm {
+
+// Streams the weights of the offloaded decoder layers from pinned host memory
+// through two weight slots on the device: while layer i runs out of one slot,
+// the weights of layer i + 1 are copied into the other one on a side stream.
+// The weights of each offloaded layer are bound to a fixed slot, so the
+// layers keep running with their own tensors.
+class LayerStreamer final {
+ public:
+  // n_layers: number of decoder layers of the model, offloads the last
+  // FLAGS_offload_layers ones.
+  LayerStreamer(int64_t n_layers, const torch::Device& device);
+
+  // move the weights of the layer to host memory if it is offloaded. called
+  // right after creating the layer to keep at most one offloaded layer on
+  // the device while building the model.
+  void add_layer(size_t layer_idx,
+                 const std::shared_ptr<torch::nn::Module>& layer);
+
+  // called by the decoder loop before running each layer: makes the weights
+  // of the layer ready on the device and starts fetching the next one.
+  void fetch(size_t layer_idx);
+
+  bool enabled() const { return first_offloaded_ < n_layers_; }
+
+ private:
+  // bind the offloaded layers to the slots, the host copies were filled by
+  // load_state_dict.
+  void bind_slots();
+
+  // copy the weights of the layer into its slot
+  void prefetch(size_t layer_idx);
+
+  size_t slot_of(size_t layer_idx) const {
+    return (layer_idx - first_offloaded_) % 2;
+  }
+
+  torch::Device device_;
+
+  size_t n_layers_ = 0;
+
+  // index of the first offloaded layer
+  size_t first_offloaded_ = 0;
+
+  // offloaded layers indexed by layer_idx - first_offloaded_
+  std::vector<std::shared_ptr<torch::nn::Module>> layers_;
+
+  // pinned host copies of the weights of the offloaded layers
+  std::vector<std::vector<torch::Tensor>> host_weights_;
+
+  // two sets of device tensors shared by the offloaded layers
+  std::vector<torch::Tensor> slots_[2];
+
+  bool bound_ = false;
+
+  // side stream for the copies, only for cuda devices
+  std::optional<c10::cuda::CUDAStream> copy_stream_;
+
+  // recorded on the compute stream when the slot can be overwritten
+  at::cuda::CUDAEvent free_[2];
+
+  // recorded on the copy stream when the weights in the slot are ready
+  at::cuda::CUDAEvent ready_[2];
+};
+
+}  // namespace llm
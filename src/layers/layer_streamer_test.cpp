@@ -0,0 +1,72 @@
+#include "layer_streamer.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+namespace llm {
+
+TEST(LayerStreamerTest, StreamOffloadedLayers) {
+  const int64_t n_layers = 4;
+  const int64_t hidden_size = 16;
+
+  gflags::FlagSaver flag_saver;
+  FLAGS_offload_layers = 3;
+
+  const torch::Device device(torch::kCPU);
+  LayerStreamer streamer(n_layers, device);
+  EXPECT_TRUE(streamer.enabled());
+
+  std::vector<torch::nn::Linear> layers;
+  for (int64_t i = 0; i < n_layers; ++i) {
+    auto& layer = layers.emplace_back(hidden_size, hidden_size);
+    streamer.add_layer(i, layer.ptr());
+  }
+
+  // load weights after the layers are offloaded
+  std::vector<torch::Tensor> weights;
+  std::vector<torch::Tensor> biases;
+  {
+    torch::NoGradGuard no_grad;
+    for (auto& layer : layers) {
+      weights.push_back(torch::randn({hidden_size, hidden_size}));
+      biases.push_back(torch::randn({hidden_size}));
+      layer->weight.copy_(weights.back());
+      layer->bias.copy_(biases.back());
+    }
+  }
+
+  auto input = torch::randn({2, hidden_size});
+  // run the decoder loop twice to reuse the slots
+  for (int step = 0; step < 2; ++step) {
+    auto h = input;
+    auto desired = input;
+    for (int64_t i = 0; i < n_layers; ++i) {
+      streamer.fetch(i);
+      h = layers[i]->forward(h);
+      desired = torch::matmul(desired, weights[i].t()) + biases[i];
+    }
+    EXPECT_TRUE(torch::allclose(h, desired, /*rtol=*/1e-4, /*atol=*/1e-4));
+  }
+
+  // the offloaded layers share the two slots
+  EXPECT_EQ(layers[1]->weight.data_ptr(), layers[3]->weight.data_ptr());
+  EXPECT_NE(layers[1]->weight.data_ptr(), layers[2]->weight.data_ptr());
+  EXPECT_NE(layers[0]->weight.data_ptr(), layers[2]->weight.data_ptr());
+}
+
+TEST(LayerStreamerTest, Disabled) {
+  gflags::FlagSaver flag_saver;
+  FLAGS_offload_layers = 0;
+
+  LayerStreamer streamer(/*n_layers=*/2, torch::Device(torch::kCPU));
+  EXPECT_FALSE(streamer.enabled());
+
+  torch::nn::Linear layer(4, 4);
+  const auto* data_ptr = layer->weight.data_ptr();
+  streamer.add_layer(0, layer.ptr());
+  streamer.fetch(0);
+  EXPECT_EQ(layer->weight.data_ptr(), data_ptr);
+}
+
+}  // namespace llm
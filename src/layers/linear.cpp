@@ -7,19 +7,35 @@
 #include <memory>
 
 #include "linear_impl.h"
+#include "lora_linear.h"
 #include "quantization/qlinear_awq_impl.h"
 #include "quantization/qlinear_awq_marlin_impl.h"
 #include "quantization/qlinear_exllamav2_impl.h"
+#include "quantization/qlinear_gptq_auto_impl.h"
 #include "quantization/qlinear_gptq_impl.h"
 #include "quantization/qlinear_gptq_marlin_impl.h"
+#include "quantization/qlinear_sparse_marlin_impl.h"
+#include "quantization/qlinear_w8a8_impl.h"
 
 DEFINE_string(
     qlinear_gptq_impl,
     "auto",
     "type of qlinear gptq impl: slow, cuda, exllamav2, marlin or auto");
 
+DEFINE_string(lm_head_quant_method,
+              "",
+              "quantize the weight of the lm head: int8 for int8 weights and "
+              "activations, fp8 for fp8 weights with 16-bit activations, "
+              "empty to keep it unquantized");
+
 namespace llm {
 namespace {
+// 2:4 sparse weights can only be served by the sparse marlin kernel
+bool is_sparse_marlin(const QuantArgs& quant_args) {
+  return boost::iequals(quant_args.checkpoint_format(), "marlin_24") ||
+         boost::iequals(quant_args.quant_method(), "gptq_marlin_24");
+}
+
 #define MAKE_ROW_PARALLEL_QLINEAR(QLinearlImplClass)         \
   std::make_shared<QLinearlImplClass>(in_features,           \
                                       out_features,          \
@@ -118,6 +134,9 @@ std::shared_ptr<ParallelLinearImpl> create_column_parallel_qlinear(
     const QuantArgs& quant_args,
     const ParallelArgs& parallel_args,
     const torch::TensorOptions& options) {
+  if (is_sparse_marlin(quant_args)) {
+    return MAKE_COLUMN_PARALLEL_QLINEAR(ColumnParallelQLinearSparseMarlinImpl);
+  }
   if (auto qlinear = create_column_parallel_qlinear_by_impl(in_features,
                                                             out_features,
                                                             bias,
@@ -128,6 +147,12 @@ std::shared_ptr<ParallelLinearImpl> create_column_parallel_qlinear(
     return qlinear;
   }
   if (boost::iequals(quant_args.quant_method(), "gptq")) {
+    if (boost::iequals(FLAGS_qlinear_gptq_impl, "auto") &&
+        options.device().is_cuda() && options.dtype() == torch::kHalf &&
+        detail::GPTQAutoMatmul::is_supported(quant_args)) {
+      // pick exllamav2, marlin or dequantization per batch size
+      return MAKE_COLUMN_PARALLEL_QLINEAR(ColumnParallelQLinearGPTQAutoImpl);
+    }
     // default to use marlin implementation for gptq
     return MAKE_COLUMN_PARALLEL_QLINEAR(ColumnParallelQLinearGPTQMarlinImpl);
   }
@@ -137,6 +162,12 @@ std::shared_ptr<ParallelLinearImpl> create_column_parallel_qlinear(
     // return MAKE_COLUMN_PARALLEL_QLINEAR(ColumnParallelQLinearAWQImpl);
     return MAKE_COLUMN_PARALLEL_QLINEAR(ColumnParallelQLinearAWQMarlinImpl);
   }
+  if (boost::iequals(quant_args.quant_method(), "w8a8") ||
+      boost::iequals(quant_args.quant_method(), "smoothquant") ||
+      boost::iequals(quant_args.quant_method(), "fp8")) {
+    // int8 or fp8 weights and activations
+    return MAKE_COLUMN_PARALLEL_QLINEAR(ColumnParallelQLinearW8A8Impl);
+  }
   // not supported quant method
   LOG(FATAL) << "Unsupported quant method: " << quant_args.quant_method();
 }
@@ -149,6 +180,9 @@ std::shared_ptr<ParallelLinearImpl> create_row_parallel_qlinear(
     const QuantArgs& quant_args,
     const ParallelArgs& parallel_args,
     const torch::TensorOptions& options) {
+  if (is_sparse_marlin(quant_args)) {
+    return MAKE_ROW_PARALLEL_QLINEAR(RowParallelQLinearSparseMarlinImpl);
+  }
   if (auto qlinear = create_row_parallel_qlinear_by_impl(in_features,
                                                          out_features,
                                                          bias,
@@ -159,6 +193,14 @@ std::shared_ptr<ParallelLinearImpl> create_row_parallel_qlinear(
     return qlinear;
   }
   if (boost::iequals(quant_args.quant_method(), "gptq")) {
+    if (boost::iequals(FLAGS_qlinear_gptq_impl, "auto") &&
+        options.device().is_cuda() && options.dtype() == torch::kHalf &&
+        detail::GPTQAutoMatmul::is_supported(quant_args) &&
+        (!quant_args.desc_act() || parallel_args.world_size() == 1)) {
+      // pick exllamav2, marlin or dequantization per batch size
+      // N.B. act order with sharded rows needs all the scales, left to marlin
+      return MAKE_ROW_PARALLEL_QLINEAR(RowParallelQLinearGPTQAutoImpl);
+    }
     // default to use marlin implementation for gptq
     return MAKE_ROW_PARALLEL_QLINEAR(RowParallelQLinearGPTQMarlinImpl);
   }
@@ -168,6 +210,12 @@ std::shared_ptr<ParallelLinearImpl> create_row_parallel_qlinear(
     // return MAKE_ROW_PARALLEL_QLINEAR(RowParallelQLinearAWQImpl);
     return MAKE_ROW_PARALLEL_QLINEAR(RowParallelQLinearAWQMarlinImpl);
   }
+  if (boost::iequals(quant_args.quant_method(), "w8a8") ||
+      boost::iequals(quant_args.quant_method(), "smoothquant") ||
+      boost::iequals(quant_args.quant_method(), "fp8")) {
+    // int8 or fp8 weights and activations
+    return MAKE_ROW_PARALLEL_QLINEAR(RowParallelQLinearW8A8Impl);
+  }
   // not supported quant method
   LOG(FATAL) << "Unsupported quant method: " << quant_args.quant_method();
 }
@@ -211,24 +259,62 @@ std::shared_ptr<ParallelLinearImpl> create_row_parallel_linear(
   }
   return MAKE_ROW_PARALLEL_LINEAR(RowParallelLinearImpl);
 }
+
+// wrap the linear with lora adapters if lora is enabled. the layers gathering
+// the output, i.e. lm head, are left as is.
+std::shared_ptr<ParallelLinearImpl> maybe_wrap_with_lora(
+    std::shared_ptr<ParallelLinearImpl> linear,
+    int64_t in_features,
+    const std::vector<int64_t>& part_out_features,
+    bool row_parallel,
+    bool input_is_parallelized,
+    const ParallelArgs& parallel_args,
+    const torch::TensorOptions& options) {
+  if (FLAGS_max_loras <= 0) {
+    return linear;
+  }
+  return std::make_shared<LoRALinearImpl>(std::move(linear),
+                                          in_features,
+                                          part_out_features,
+                                          row_parallel,
+                                          input_is_parallelized,
+                                          parallel_args,
+                                          options);
+}
 }  // namespace
 
 // construct a ColumnParallelLinear.
 // chose right implementation based on the args.
-ColumnParallelLinear::ColumnParallelLinear(int64_t in_features,
-                                           int64_t out_features,
-                                           bool bias,
-                                           bool gather_output,
-                                           const QuantArgs& quant_args,
-                                           const ParallelArgs& parallel_args,
-                                           const torch::TensorOptions& options)
+ColumnParallelLinear::ColumnParallelLinear(
+    int64_t in_features,
+    int64_t out_features,
+    bool bias,
+    bool gather_output,
+    const QuantArgs& quant_args,
+    const ParallelArgs& parallel_args,
+    const torch::TensorOptions& options,
+    const std::vector<int64_t>& fused_out_features)
     : ModuleHolder(create_column_parallel_linear(in_features,
                                                  out_features,
                                                  bias,
                                                  gather_output,
                                                  quant_args,
                                                  parallel_args,
-                                                 options)) {}
+                                                 options)) {
+  if (!gather_output) {
+    auto part_out_features = fused_out_features;
+    if (part_out_features.empty()) {
+      part_out_features.push_back(out_features);
+    }
+    impl_ = maybe_wrap_with_lora(impl_,
+                                 in_features,
+                                 part_out_features,
+                                 /*row_parallel=*/false,
+                                 /*input_is_parallelized=*/false,
+                                 parallel_args,
+                                 options);
+  }
+}
 
 ColumnParallelLinear::ColumnParallelLinear(int64_t in_features,
                                            int64_t out_features,
@@ -259,5 +345,45 @@ RowParallelLinear::RowParallelLinear(int64_t in_features,
                                               input_is_parallelized,
                                               quant_args,
                                               parallel_args,
-                                              options)) {}
+                                              options)) {
+  impl_ = maybe_wrap_with_lora(impl_,
+                               in_features,
+                               {out_features},
+                               /*row_parallel=*/true,
+                               input_is_parallelized,
+                               parallel_args,
+                               options);
+}
+ColumnParallelLinear create_lm_head(int64_t hidden_size,
+                                    int64_t vocab_size,
+                                    const ParallelArgs& parallel_args,
+                                    const torch::TensorOptions& options) {
+  const auto& method = FLAGS_lm_head_quant_method;
+  if (method.empty()) {
+    return ColumnParallelLinear(hidden_size,
+                                vocab_size,
+                                /*bias=*/false,
+                                /*gather_output=*/true,
+                                parallel_args,
+                                options);
+  }
+  QuantArgs quant_args;
+  if (boost::iequals(method, "int8")) {
+    // the activations are quantized per token for the int8 gemm
+    quant_args.quant_method("w8a8");
+  } else if (boost::iequals(method, "fp8")) {
+    // the marlin fp8 gemm dequantizes the weight in its mainloop
+    quant_args.quant_method("fp8").weight_only(true);
+  } else {
+    LOG(FATAL) << "Unsupported lm head quant method: " << method;
+  }
+  return ColumnParallelLinear(hidden_size,
+                              vocab_size,
+                              /*bias=*/false,
+                              /*gather_output=*/true,
+                              quant_args,
+                              parallel_args,
+                              options);
+}
+
 }  // namespace llm
@@ -3,6 +3,7 @@
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include "kernels/gemm/gemm_params.h"
 #include "model_loader/state_dict.h"
 #include "model_parallel/parallel_args.h"
 #include "quantization/quant_args.h"
@@ -24,6 +25,30 @@ class ParallelLinearImpl : public torch::nn::Module {
 
   virtual void verify_loaded_weights(const std::string& prefix = "") const = 0;
 
+  // forward followed by act(gate) * up, where gate and up are the first and
+  // second halves of the output features, with the gated activation applied
+  // in the gemm epilogue. returns an undefined tensor if not supported.
+  virtual torch::Tensor forward_gated(torch::Tensor /*input*/,
+                                      GatedAct /*act*/) {
+    return {};
+  }
+
+  // soft_cap * tanh(forward(input) / soft_cap) with the soft cap applied in
+  // the gemm epilogue, output in out_dtype: float or the dtype of the input.
+  // returns an undefined tensor if not supported.
+  virtual torch::Tensor forward_softcap(torch::Tensor /*input*/,
+                                        float /*soft_cap*/,
+                                        torch::ScalarType /*out_dtype*/) {
+    return {};
+  }
+
+  // act(forward(input)) with the bias and the activation applied in the gemm
+  // epilogue. returns an undefined tensor if not supported.
+  virtual torch::Tensor forward_act(torch::Tensor /*input*/,
+                                    EpilogueAct /*act*/) {
+    return {};
+  }
+
   // load state dict with a transform function
   virtual void load_state_dict(const StateDict& /*state_dict*/,
                                TensorTransform /*transform_func*/) {
@@ -45,13 +70,16 @@ class ColumnParallelLinear
 
   // construct a rotary positional embedding.
   // chose right implementation based on the args.
+  // fused_out_features: out features of the layers fused into this one, e.g.
+  // gate and up, used by the lora adapters of the fused layers.
   ColumnParallelLinear(int64_t in_features,
                        int64_t out_features,
                        bool bias,
                        bool gather_output,
                        const QuantArgs& quant_args,
                        const ParallelArgs& parallel_args,
-                       const torch::TensorOptions& options);
+                       const torch::TensorOptions& options,
+                       const std::vector<int64_t>& fused_out_features = {});
 
   ColumnParallelLinear(int64_t in_features,
                        int64_t out_features,
@@ -76,4 +104,15 @@ class RowParallelLinear : public torch::nn::ModuleHolder<ParallelLinearImpl> {
                     const ParallelArgs& parallel_args,
                     const torch::TensorOptions& options);
 };
+
+// create the lm head projecting the hidden states to the logits of the vocab,
+// with the output gathered. the weight is quantized to int8 or fp8 per
+// --lm_head_quant_method, e.g. for the large vocabs where the head is a large
+// share of the weights and of the decode bandwidth. a dense weight is
+// quantized per channel while loading, a quantized one is loaded with its
+// "weight_scale".
+ColumnParallelLinear create_lm_head(int64_t hidden_size,
+                                    int64_t vocab_size,
+                                    const ParallelArgs& parallel_args,
+                                    const torch::TensorOptions& options);
 }  // namespace llm
@@ -1,13 +1,49 @@
 #include "linear_impl.h"
 
 #include <c10/core/TensorImpl.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include "kernels/gemm/gemm_api.h"
 #include "model_loader/state_dict.h"
 #include "model_parallel/model_parallel.h"
 
+DEFINE_bool(enable_cublaslt_linear,
+            true,
+            "use cublaslt for the dense linear layers on cuda, with cached "
+            "algorithms and the bias in the gemm epilogue");
+
+DECLARE_bool(batch_invariant);
+
 namespace llm {
+namespace {
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+thread_local bool current_skip_gather_output = false;
+
+bool use_cublaslt(const torch::Tensor& input, const torch::Tensor& weight) {
+  return FLAGS_enable_cublaslt_linear && can_use_cublaslt_gemm(input, weight);
+}
+
+// input @ weight.T + bias with cublaslt if supported, or with torch otherwise.
+// in batch invariant mode, the gemm with fixed tiles and without split-k is
+// preferred, since the algorithms picked by cublaslt vary with the rows.
+torch::Tensor linear(const torch::Tensor& input,
+                     const torch::Tensor& weight,
+                     const torch::Tensor& bias) {
+  if (FLAGS_batch_invariant && can_use_softcap_gemm(input, weight)) {
+    auto output = softcap_gemm(
+        input, weight, /*soft_cap=*/0, /*out_dtype=*/input.scalar_type());
+    return bias.defined() ? output.add_(bias) : output;
+  }
+  if (use_cublaslt(input, weight)) {
+    return cublaslt_gemm(input, weight, bias, EpilogueAct::kNone);
+  }
+  return torch::nn::functional::linear(input, weight, bias);
+}
+
+}  // namespace
 
 // Linear layer with column parallelism.
 ColumnParallelLinearImpl::ColumnParallelLinearImpl(
@@ -40,12 +76,75 @@ ColumnParallelLinearImpl::ColumnParallelLinearImpl(
 }
 
 torch::Tensor ColumnParallelLinearImpl::forward(torch::Tensor input) {
-  namespace F = torch::nn::functional;
-  auto output = F::linear(input, weight_, bias_);
-  if (parallel_args_.world_size() > 1 && gather_output_) {
-    output = gather_from_model_parallel_region(output, parallel_args_);
+  if (should_gather_output()) {
+    // overlap the gather of finished chunks with the rest of the gemm
+    return matmul_gather_from_model_parallel_region(
+        input,
+        [this](const torch::Tensor& chunk) {
+          return linear(chunk, weight_, bias_);
+        },
+        parallel_args_);
   }
-  return output;
+  return linear(input, weight_, bias_);
+}
+
+torch::Tensor ColumnParallelLinearImpl::forward_gated(torch::Tensor input,
+                                                      GatedAct act) {
+  // neither the bias nor the gather is fused into the gemm
+  if (should_gather_output() || bias_.defined() ||
+      !can_use_gated_gemm(input, weight_)) {
+    return {};
+  }
+  return gated_gemm(input, weight_, act);
+}
+
+torch::Tensor ColumnParallelLinearImpl::forward_softcap(
+    torch::Tensor input,
+    float soft_cap,
+    torch::ScalarType out_dtype) {
+  // the bias is not fused into the gemm
+  if (bias_.defined() || !can_use_softcap_gemm(input, weight_)) {
+    return {};
+  }
+  auto gemm = [&](const torch::Tensor& chunk) {
+    return softcap_gemm(chunk, weight_, soft_cap, out_dtype);
+  };
+  if (should_gather_output()) {
+    // overlap the gather of finished chunks with the rest of the gemm
+    return matmul_gather_from_model_parallel_region(
+        input, gemm, parallel_args_);
+  }
+  return gemm(input);
+}
+
+torch::Tensor ColumnParallelLinearImpl::forward_act(torch::Tensor input,
+                                                    EpilogueAct act) {
+  if (!use_cublaslt(input, weight_)) {
+    return {};
+  }
+  // the activation is elementwise, so it is applied before the gather
+  auto gemm = [&](const torch::Tensor& chunk) {
+    return cublaslt_gemm(chunk, weight_, bias_, act);
+  };
+  if (should_gather_output()) {
+    // overlap the gather of finished chunks with the rest of the gemm
+    return matmul_gather_from_model_parallel_region(
+        input, gemm, parallel_args_);
+  }
+  return gemm(input);
+}
+
+bool ColumnParallelLinearImpl::should_gather_output() const {
+  return parallel_args_.world_size() > 1 && gather_output_ &&
+         !current_skip_gather_output;
+}
+
+bool ColumnParallelLinearImpl::skip_gather_output() {
+  return current_skip_gather_output;
+}
+
+void ColumnParallelLinearImpl::set_skip_gather_output(bool skip) {
+  current_skip_gather_output = skip;
 }
 
 // load the weight from the checkpoint
@@ -115,14 +214,20 @@ RowParallelLinearImpl::RowParallelLinearImpl(
 }
 
 torch::Tensor RowParallelLinearImpl::forward(torch::Tensor input) {
-  namespace F = torch::nn::functional;
+  if (parallel_args_.world_size() == 1) {
+    // nothing to reduce, the bias is applied in the gemm epilogue
+    return linear(input, weight_, bias_);
+  }
   if (!input_is_parallelized_) {
     input = scatter_to_model_parallel_region(input, parallel_args_);
   }
-  auto output = F::linear(input, weight_);
-  if (parallel_args_.world_size() > 1) {
-    output = reduce_from_model_parallel_region(output, parallel_args_);
-  }
+  // overlap the all-reduce of finished chunks with the rest of the gemm
+  auto output = matmul_reduce_from_model_parallel_region(
+      input,
+      [this](const torch::Tensor& chunk) {
+        return linear(chunk, weight_, /*bias=*/{});
+      },
+      parallel_args_);
   // N.B. need to apply bias after the reduce
   if (bias_.defined()) {
     output.add_(bias_);
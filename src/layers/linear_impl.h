@@ -1,5 +1,6 @@
 #pragma once
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <torch/torch.h>
 
@@ -7,6 +8,8 @@
 #include "model_loader/state_dict.h"
 #include "weight_utils.h"
 
+DECLARE_bool(enable_cublaslt_linear);
+
 namespace llm {
 
 // Linear layer with column parallelism.
@@ -23,6 +26,14 @@ class ColumnParallelLinearImpl : public ParallelLinearImpl {
 
   torch::Tensor forward(torch::Tensor input) override;
 
+  torch::Tensor forward_gated(torch::Tensor input, GatedAct act) override;
+
+  torch::Tensor forward_softcap(torch::Tensor input,
+                                float soft_cap,
+                                torch::ScalarType out_dtype) override;
+
+  torch::Tensor forward_act(torch::Tensor input, EpilogueAct act) override;
+
   // load the weight from the checkpoint
   void load_state_dict(const StateDict& state_dict) override;
 
@@ -49,7 +60,15 @@ class ColumnParallelLinearImpl : public ParallelLinearImpl {
   // return the weight (for testing)
   torch::Tensor weight() const { return weight_; }
 
+  // keep the output sharded on this thread even if gather_output is set,
+  // e.g. to sample from the vocab shards of the lm head logits.
+  static bool skip_gather_output();
+  static void set_skip_gather_output(bool skip);
+
  private:
+  // whether to gather the output on this thread
+  bool should_gather_output() const;
+
   // parameter members, must be registered
   // we allocate the transpose since linear performs XA^T.
   // A^T: [out_features_per_partition, in_features]
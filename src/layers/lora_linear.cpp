@@ -0,0 +1,268 @@
+#include "lora_linear.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <memory>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "kernels/lora_kernels.h"
+#include "model_parallel/model_parallel.h"
+
+DEFINE_int32(max_loras,
+             0,
+             "number of lora adapter slots on each device, the adapters are "
+             "paged in and out of the slots by lru. 0 to disable lora");
+
+DEFINE_int32(max_lora_rank, 16, "max rank of the lora adapters");
+
+namespace llm {
+namespace {
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+thread_local torch::Tensor current_slots;
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+thread_local int32_t current_loading_slot = -1;
+
+// gather the adapter weights of each token with index_select, only used on
+// devices without the gather kernels.
+torch::Tensor lora_shrink_ref(const torch::Tensor& input,
+                              const torch::Tensor& lora_a,
+                              const torch::Tensor& slots) {
+  const auto mask = slots.ge(0).unsqueeze(-1).to(input.dtype());
+  const auto indices = slots.clamp_min(0).to(torch::kLong);
+  // [n_tokens, rank, in_features] @ [n_tokens, in_features, 1]
+  auto out = torch::bmm(lora_a.index_select(/*dim=*/0, indices),
+                        input.unsqueeze(-1));
+  return out.squeeze(-1) * mask;
+}
+
+void lora_expand_ref(torch::Tensor& output,
+                     const torch::Tensor& input,
+                     const torch::Tensor& lora_b,
+                     const torch::Tensor& slots) {
+  const auto indices = slots.clamp_min(0).to(torch::kLong);
+  // [n_tokens, 1, rank] @ [n_tokens, rank, out_features]
+  const auto delta = torch::bmm(input.unsqueeze(1),
+                                lora_b.index_select(/*dim=*/0, indices));
+  // the shrunk input is zero for tokens without adapter
+  output.add_(delta.squeeze(1));
+}
+
+}  // namespace
+
+LoRALinearImpl::LoRALinearImpl(std::shared_ptr<ParallelLinearImpl> base,
+                               int64_t in_features,
+                               const std::vector<int64_t>& part_out_features,
+                               bool row_parallel,
+                               bool input_is_parallelized,
+                               const ParallelArgs& parallel_args,
+                               const torch::TensorOptions& options)
+    : row_parallel_(row_parallel),
+      input_is_parallelized_(input_is_parallelized),
+      parallel_args_(parallel_args) {
+  CHECK_GT(FLAGS_max_loras, 0) << "lora is not enabled";
+  CHECK_GT(FLAGS_max_lora_rank, 0) << "max_lora_rank must be positive";
+  base_ = register_module("base", std::move(base));
+
+  const auto world_size = parallel_args_.world_size();
+  // the shards of the adapter weights on this rank
+  int64_t in_features_per_partition = in_features;
+  part_out_features_ = part_out_features;
+  if (row_parallel_) {
+    CHECK(in_features % world_size == 0)
+        << "in_features " << in_features << " not divisible by world_size "
+        << world_size;
+    in_features_per_partition = in_features / world_size;
+  } else {
+    for (auto& out_features : part_out_features_) {
+      CHECK(out_features % world_size == 0)
+          << "out_features " << out_features << " not divisible by world_size "
+          << world_size;
+      out_features /= world_size;
+    }
+  }
+  const int64_t out_features_per_partition = std::accumulate(
+      part_out_features_.begin(), part_out_features_.end(), int64_t(0));
+
+  const int64_t rank =
+      static_cast<int64_t>(part_out_features_.size()) * FLAGS_max_lora_rank;
+  lora_a_ = register_buffer(
+      "lora_a",
+      torch::zeros({FLAGS_max_loras, rank, in_features_per_partition},
+                   options));
+  lora_b_ = register_buffer(
+      "lora_b",
+      torch::zeros({FLAGS_max_loras, rank, out_features_per_partition},
+                   options));
+}
+
+torch::Tensor LoRALinearImpl::forward(torch::Tensor input) {
+  auto output = base_->forward(input);
+  const auto& token_slots = slots();
+  if (!token_slots.defined()) {
+    return output;
+  }
+
+  auto x = input;
+  if (row_parallel_ && !input_is_parallelized_) {
+    x = scatter_to_model_parallel_region(x, parallel_args_);
+  }
+  x = x.reshape({-1, x.size(-1)}).contiguous();
+  auto output_2d = output.view({-1, output.size(-1)});
+  CHECK_EQ(x.size(0), token_slots.size(0))
+      << "the number of tokens doesn't match the lora slots";
+
+  torch::Tensor shrunk;
+  if (x.is_cuda()) {
+    shrunk = torch::empty({x.size(0), lora_a_.size(1)}, x.options());
+    kernel::lora_shrink(shrunk, x, lora_a_, token_slots);
+  } else {
+    shrunk = lora_shrink_ref(x, lora_a_, token_slots);
+  }
+  if (row_parallel_ && parallel_args_.world_size() > 1) {
+    // sum up the partial products over the shards of the in features
+    shrunk = reduce_from_model_parallel_region(shrunk, parallel_args_);
+  }
+  if (output_2d.is_cuda()) {
+    kernel::lora_expand(output_2d, shrunk, lora_b_, token_slots);
+  } else {
+    lora_expand_ref(output_2d, shrunk, lora_b_, token_slots);
+  }
+  return output;
+}
+
+torch::Tensor LoRALinearImpl::forward_gated(torch::Tensor input,
+                                            GatedAct act) {
+  if (slots().defined()) {
+    // the adapters have to be applied before the activation
+    return {};
+  }
+  return base_->forward_gated(input, act);
+}
+
+torch::Tensor LoRALinearImpl::forward_softcap(torch::Tensor input,
+                                              float soft_cap,
+                                              torch::ScalarType out_dtype) {
+  if (slots().defined()) {
+    // the adapters have to be applied before the soft cap
+    return {};
+  }
+  return base_->forward_softcap(input, soft_cap, out_dtype);
+}
+
+torch::Tensor LoRALinearImpl::forward_act(torch::Tensor input,
+                                          EpilogueAct act) {
+  if (slots().defined()) {
+    // the adapters have to be applied before the activation
+    return {};
+  }
+  return base_->forward_act(input, act);
+}
+
+void LoRALinearImpl::load_state_dict(const StateDict& state_dict) {
+  if (loading_slot() < 0) {
+    base_->load_state_dict(state_dict);
+    return;
+  }
+  load_state_dict(state_dict,
+                  [](const torch::Tensor& tensor) { return tensor; });
+}
+
+void LoRALinearImpl::load_state_dict(const StateDict& state_dict,
+                                     TensorTransform transform_func) {
+  if (loading_slot() < 0) {
+    base_->load_state_dict(state_dict, std::move(transform_func));
+    return;
+  }
+  const auto rank = parallel_args_.rank();
+  const auto world_size = parallel_args_.world_size();
+  torch::Tensor lora_a;
+  torch::Tensor lora_b;
+  if (row_parallel_) {
+    lora_a = state_dict.get_sharded_tensor(
+        "lora_A.weight", /*dim=*/1, rank, world_size);
+    lora_b = state_dict.get_tensor("lora_B.weight");
+  } else {
+    lora_a = state_dict.get_tensor("lora_A.weight");
+    lora_b = state_dict.get_sharded_tensor(
+        "lora_B.weight", /*dim=*/0, rank, world_size);
+  }
+  if (lora_b.defined()) {
+    // the transform works on the rows of the weight, i.e. the out features
+    lora_b = transform_func(lora_b);
+  }
+  load_lora({lora_a}, {lora_b});
+}
+
+void LoRALinearImpl::load_state_dict(const StateDict& state_dict,
+                                     const std::vector<std::string>& prefixes) {
+  if (loading_slot() < 0) {
+    base_->load_state_dict(state_dict, prefixes);
+    return;
+  }
+  CHECK(!row_parallel_) << "fused row parallel linear is not supported";
+  const auto rank = parallel_args_.rank();
+  const auto world_size = parallel_args_.world_size();
+  std::vector<torch::Tensor> lora_as;
+  std::vector<torch::Tensor> lora_bs;
+  for (const auto& prefix : prefixes) {
+    lora_as.push_back(state_dict.get_tensor(prefix + "lora_A.weight"));
+    lora_bs.push_back(state_dict.get_sharded_tensor(
+        prefix + "lora_B.weight", /*dim=*/0, rank, world_size));
+  }
+  load_lora(lora_as, lora_bs);
+}
+
+void LoRALinearImpl::load_lora(const std::vector<torch::Tensor>& lora_as,
+                               const std::vector<torch::Tensor>& lora_bs) {
+  const int32_t slot = loading_slot();
+  CHECK(slot >= 0 && slot < lora_a_.size(0)) << "invalid lora slot " << slot;
+  CHECK_EQ(lora_as.size(), part_out_features_.size());
+  CHECK_EQ(lora_bs.size(), part_out_features_.size());
+
+  // clear the weights of the previous adapter in the slot, the parts not
+  // targeted by the adapter stay zeros.
+  auto slot_a = lora_a_[slot];
+  auto slot_b = lora_b_[slot];
+  slot_a.zero_();
+  slot_b.zero_();
+
+  const int64_t max_rank = FLAGS_max_lora_rank;
+  int64_t out_offset = 0;
+  for (size_t i = 0; i < part_out_features_.size(); ++i) {
+    const int64_t out_features = part_out_features_[i];
+    const auto& lora_a = lora_as[i];
+    const auto& lora_b = lora_bs[i];
+    if (lora_a.defined() && lora_b.defined()) {
+      const int64_t r = lora_a.size(0);
+      CHECK_LE(r, max_rank) << "lora rank " << r << " exceeds max_lora_rank";
+      CHECK_EQ(lora_a.size(1), slot_a.size(1)) << "lora_A size mismatch";
+      CHECK_EQ(lora_b.size(0), out_features) << "lora_B size mismatch";
+      CHECK_EQ(lora_b.size(1), r) << "lora_B size mismatch";
+      const int64_t rank_offset = static_cast<int64_t>(i) * max_rank;
+      slot_a.narrow(/*dim=*/0, rank_offset, r).copy_(lora_a);
+      slot_b.narrow(/*dim=*/0, rank_offset, r)
+          .narrow(/*dim=*/1, out_offset, out_features)
+          .copy_(lora_b.t());
+    }
+    out_offset += out_features;
+  }
+}
+
+const torch::Tensor& LoRALinearImpl::slots() { return current_slots; }
+
+void LoRALinearImpl::set_slots(torch::Tensor slots) {
+  current_slots = std::move(slots);
+}
+
+int32_t LoRALinearImpl::loading_slot() { return current_loading_slot; }
+
+void LoRALinearImpl::set_loading_slot(int32_t slot) {
+  current_loading_slot = slot;
+}
+
+}  // namespace llm
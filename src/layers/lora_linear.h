@@ -0,0 +1,106 @@
+#pragma once
+
+#include <gflags/gflags_declare.h>
+#include <torch/torch.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "linear.h"
+#include "model_loader/state_dict.h"
+#include "model_parallel/parallel_args.h"
+
+// number of lora adapter slots on each device, 0 to disable lora
+DECLARE_int32(max_loras);
+
+// max rank of the lora adapters
+DECLARE_int32(max_lora_rank);
+
+namespace llm {
+
+// A parallel linear layer with lora adapters on top of a base layer.
+// The weights of up to max_loras adapters live in slots of a pool on the
+// device, and each token of the batch is run with the adapter of its own
+// slot: Y = base(X) + (X @ A[slot]^T) @ B[slot]^T, with the scaling of the
+// adapter folded into B.
+// * column parallel: A is replicated and B is sharded along out features.
+// * row parallel: A is sharded along in features, the shrunk input is
+//   all-reduced before the expand with the replicated B.
+// For layers fused from n parts, e.g. qkv, the rank dimension holds the
+// ranks of all parts, and B is block diagonal.
+class LoRALinearImpl : public ParallelLinearImpl {
+ public:
+  LoRALinearImpl(std::shared_ptr<ParallelLinearImpl> base,
+                 int64_t in_features,
+                 const std::vector<int64_t>& part_out_features,
+                 bool row_parallel,
+                 bool input_is_parallelized,
+                 const ParallelArgs& parallel_args,
+                 const torch::TensorOptions& options);
+
+  torch::Tensor forward(torch::Tensor input) override;
+
+  torch::Tensor forward_gated(torch::Tensor input, GatedAct act) override;
+
+  torch::Tensor forward_softcap(torch::Tensor input,
+                                float soft_cap,
+                                torch::ScalarType out_dtype) override;
+
+  torch::Tensor forward_act(torch::Tensor input, EpilogueAct act) override;
+
+  // load the base weights, or the adapter weights into the loading slot.
+  void load_state_dict(const StateDict& state_dict) override;
+
+  void load_state_dict(const StateDict& state_dict,
+                       TensorTransform transform_func) override;
+
+  void load_state_dict(const StateDict& state_dict,
+                       const std::vector<std::string>& prefixes) override;
+
+  void verify_loaded_weights(const std::string& prefix) const override {
+    base_->verify_loaded_weights(prefix);
+  }
+
+  // the adapter slots of the tokens of the batch running on this thread:
+  // [n_tokens] IntTensor on device, -1 for tokens without adapter. undefined
+  // if no token in the batch has an adapter.
+  static const torch::Tensor& slots();
+  static void set_slots(torch::Tensor slots);
+
+  // the slot to load the adapter weights into by load_state_dict on this
+  // thread, -1 to load the base weights.
+  static int32_t loading_slot();
+  static void set_loading_slot(int32_t slot);
+
+  // return the adapter weights (for testing)
+  const torch::Tensor& lora_a() const { return lora_a_; }
+  const torch::Tensor& lora_b() const { return lora_b_; }
+
+ private:
+  // copy the adapter weights of the parts into the loading slot
+  // lora_as: [rank, in_features] for each part
+  // lora_bs: [out_features, rank] for each part
+  void load_lora(const std::vector<torch::Tensor>& lora_as,
+                 const std::vector<torch::Tensor>& lora_bs);
+
+  std::shared_ptr<ParallelLinearImpl> base_;
+
+  // [max_loras, n_parts * max_rank, in_features(_per_partition)]
+  torch::Tensor lora_a_;
+
+  // transposed for coalesced reads in the expand:
+  // [max_loras, n_parts * max_rank, out_features(_per_partition)]
+  torch::Tensor lora_b_;
+
+  bool row_parallel_ = false;
+
+  bool input_is_parallelized_ = false;
+
+  // out features of the fused parts on this rank
+  std::vector<int64_t> part_out_features_;
+
+  ParallelArgs parallel_args_;
+};
+
+}  // namespace llm
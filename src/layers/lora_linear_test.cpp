@@ -0,0 +1,82 @@
+#include "lora_linear.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include "linear_impl.h"
+#include "model_loader/state_dict.h"
+
+namespace llm {
+
+TEST(LoRALinearTest, MixedAdapters) {
+  const int64_t in_features = 32;
+  const int64_t out_features = 48;
+  const int64_t n_tokens = 6;
+  const std::vector<int64_t> ranks = {4, 8};
+
+  gflags::FlagSaver flag_saver;
+  FLAGS_max_loras = 2;
+  FLAGS_max_lora_rank = 8;
+
+  const auto options = torch::dtype(torch::kFloat).device(torch::kCPU);
+  ParallelArgs parallel_args(0, 1, nullptr);
+  auto base =
+      std::make_shared<ColumnParallelLinearImpl>(in_features,
+                                                 out_features,
+                                                 /*bias=*/false,
+                                                 /*gather_output=*/false,
+                                                 parallel_args,
+                                                 options);
+  LoRALinearImpl linear(base,
+                        in_features,
+                        {out_features},
+                        /*row_parallel=*/false,
+                        /*input_is_parallelized=*/false,
+                        parallel_args,
+                        options);
+
+  // load base weights
+  std::unordered_map<std::string, torch::Tensor> base_data;
+  base_data["weight"] = torch::randn({out_features, in_features});
+  linear.load_state_dict(StateDict(base_data));
+  linear.verify_loaded_weights();
+
+  // load an adapter into each slot
+  std::vector<torch::Tensor> lora_as;
+  std::vector<torch::Tensor> lora_bs;
+  for (size_t slot = 0; slot < ranks.size(); ++slot) {
+    std::unordered_map<std::string, torch::Tensor> lora_data;
+    lora_data["lora_A.weight"] = torch::randn({ranks[slot], in_features});
+    lora_data["lora_B.weight"] = torch::randn({out_features, ranks[slot]});
+    lora_as.push_back(lora_data["lora_A.weight"]);
+    lora_bs.push_back(lora_data["lora_B.weight"]);
+    LoRALinearImpl::set_loading_slot(static_cast<int32_t>(slot));
+    linear.load_state_dict(StateDict(lora_data));
+  }
+  LoRALinearImpl::set_loading_slot(-1);
+
+  auto input = torch::randn({n_tokens, in_features});
+  auto slots = torch::tensor({0, 1, -1, 1, 0, -1}, torch::kInt);
+  LoRALinearImpl::set_slots(slots);
+  auto output = linear.forward(input);
+  LoRALinearImpl::set_slots(torch::Tensor());
+
+  auto desired = torch::matmul(input, base_data["weight"].t());
+  for (int64_t i = 0; i < n_tokens; ++i) {
+    const int32_t slot = slots[i].item<int32_t>();
+    if (slot >= 0) {
+      desired[i] += torch::matmul(
+          torch::matmul(input[i], lora_as[slot].t()), lora_bs[slot].t());
+    }
+  }
+  EXPECT_TRUE(torch::allclose(output, desired, /*rtol=*/1e-4, /*atol=*/1e-4));
+
+  // no adapter in the batch
+  EXPECT_TRUE(torch::allclose(linear.forward(input),
+                              torch::matmul(input, base_data["weight"].t()),
+                              /*rtol=*/1e-4,
+                              /*atol=*/1e-4));
+}
+
+}  // namespace llm
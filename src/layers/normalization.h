@@ -6,7 +6,10 @@
 #include <torch/torch.h>
 
 #include "kernels/layernorm_kernels.h"
+#include "layers/layer_profiler.h"
 #include "model_loader/state_dict.h"
+#include "model_parallel/model_parallel.h"
+#include "model_parallel/parallel_args.h"
 
 DECLARE_bool(disable_custom_kernels);
 namespace llm {
@@ -49,6 +52,21 @@ inline torch::Tensor rms_norm_residual(const torch::Tensor& input,
   return output.to(input) * weight;
 }
 
+// quantize the input with per token scales: scale = absmax / max_quant_value
+inline std::tuple<torch::Tensor, torch::Tensor> quant_per_token(
+    const torch::Tensor& input,
+    torch::ScalarType quant_dtype) {
+  const float max_value = quant_dtype == torch::kInt8 ? 127.0f : 448.0f;
+  const auto x = input.to(torch::kFloat);
+  const auto scale =
+      (x.abs().amax(/*dim=*/-1) / max_value).clamp_min(/*min=*/1e-8);
+  auto output = (x / scale.unsqueeze(/*dim=*/-1)).clamp(-max_value, max_value);
+  if (quant_dtype == torch::kInt8) {
+    output = output.round();
+  }
+  return {output.to(quant_dtype), scale};
+}
+
 inline torch::Tensor layer_norm(torch::Tensor input,
                                 const std::vector<int64_t>& normalized_shape,
                                 const torch::Tensor& weight,
@@ -84,6 +102,7 @@ class LayerNormImpl : public torch::nn::Module {
   }
 
   torch::Tensor forward(torch::Tensor input) {
+    LAYER_PROFILE_SCOPE("norm");
     if (input.is_cuda() && !FLAGS_disable_custom_kernels) {
       auto output = torch::empty_like(input);
       kernel::layer_norm(output, input, weight_, bias_, eps_);
@@ -153,6 +172,7 @@ class RMSNormImpl : public torch::nn::Module {
   }
 
   torch::Tensor forward(const torch::Tensor& input) {
+    LAYER_PROFILE_SCOPE("norm");
     if (input.is_cuda() && !FLAGS_disable_custom_kernels) {
       auto output = torch::empty_like(input);
       kernel::rms_norm(output, input, weight_, eps_);
@@ -203,6 +223,7 @@ class GemmaRMSNormImpl : public torch::nn::Module {
   }
 
   torch::Tensor forward(const torch::Tensor& input) {
+    LAYER_PROFILE_SCOPE("norm");
     if (input.is_cuda() && !FLAGS_disable_custom_kernels) {
       auto output = torch::empty_like(input);
       kernel::gemma_rms_norm(output, input, weight_, eps_);
@@ -256,6 +277,7 @@ class RMSNormResidualImpl : public torch::nn::Module {
   }
 
   torch::Tensor forward(const torch::Tensor& input, torch::Tensor& residual) {
+    LAYER_PROFILE_SCOPE("norm");
     if (input.is_cuda() && !FLAGS_disable_custom_kernels) {
       auto output = torch::empty_like(input);
       if (residual.defined()) {
@@ -274,6 +296,46 @@ class RMSNormResidualImpl : public torch::nn::Module {
     return detail::rms_norm(input, weight_, eps_);
   }
 
+  // same as forward, and quantize the output into int8 or fp8 with per token
+  // scales in the same pass for the following linear.
+  // returns the quantized output: [n_tokens, dim] and scales: [n_tokens]
+  std::tuple<torch::Tensor, torch::Tensor> forward_quant(
+      const torch::Tensor& input,
+      torch::Tensor& residual,
+      torch::ScalarType quant_dtype) {
+    if (input.is_cuda() && !FLAGS_disable_custom_kernels) {
+      auto output =
+          torch::empty_like(input, input.options().dtype(quant_dtype));
+      auto scale =
+          torch::empty({input.size(0)}, input.options().dtype(torch::kFloat));
+      kernel::rms_norm_residual_quant(
+          output, scale, residual, input, weight_, eps_);
+      return {output, scale};
+    }
+    return detail::quant_per_token(forward(input, residual), quant_dtype);
+  }
+
+  // same as forward, with the input being the partial sums of all ranks, e.g.
+  // the output of a row parallel linear before its all-reduce. the
+  // all-reduce is fused with the residual add and rms norm when the process
+  // group supports it.
+  torch::Tensor forward_reduce(torch::Tensor input,
+                               torch::Tensor& residual,
+                               const ParallelArgs& parallel_args) {
+    if (parallel_args.world_size() > 1) {
+      if (input.is_cuda() && residual.defined() &&
+          !FLAGS_disable_custom_kernels) {
+        auto output = torch::empty_like(input);
+        if (parallel_args.process_group()->allreduce_rms_norm_residual(
+                output, residual, input, weight_, eps_)) {
+          return output;
+        }
+      }
+      input = reduce_from_model_parallel_region(input, parallel_args);
+    }
+    return forward(input, residual);
+  }
+
   // load the weight from the checkpoint
   void load_state_dict(const StateDict& state_dict) {
     const auto weight = state_dict.get_tensor("weight");
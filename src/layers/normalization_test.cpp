@@ -169,4 +169,112 @@ TEST(NormalizationTest, RMSNormResidualKernel) {
                               /*atol=*/1e-05));
 }
 
+TEST(NormalizationTest, VectorizedNormKernels) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+
+  const float eps = 1e-5;
+  for (const auto dtype : {torch::kHalf, torch::kBFloat16, torch::kFloat}) {
+    const auto options = torch::dtype(dtype).device(torch::kCUDA);
+    // small rows fit into a warp, large rows need more packs per thread
+    for (const int64_t dim : {256, 2048, 5120, 16384}) {
+      const auto weight = torch::rand({dim}, options);
+      const auto bias = torch::rand({dim}, options);
+      const auto input = torch::randn({33, dim}, options);
+      const auto residual = torch::randn({33, dim}, options);
+
+      for (const auto impl : {kernel::NormImpl::kScalar,
+                              kernel::NormImpl::kWarpPerRow,
+                              kernel::NormImpl::kBlockPerRow}) {
+        // the same rounding as the scalar kernels
+        auto output = torch::empty_like(input);
+        kernel::rms_norm(output, input, weight, eps, impl);
+        auto output_ref = torch::empty_like(input);
+        kernel::rms_norm(
+            output_ref, input, weight, eps, kernel::NormImpl::kScalar);
+        EXPECT_TRUE(torch::allclose(output,
+                                    output_ref,
+                                    /*rtol=*/1e-02,
+                                    /*atol=*/1e-03));
+
+        auto res = residual.clone();
+        auto res_ref = residual.clone();
+        kernel::rms_norm_residual(output, res, input, weight, eps, impl);
+        output_ref = detail::rms_norm_residual(input, res_ref, weight, eps);
+        EXPECT_TRUE(torch::allclose(output,
+                                    output_ref,
+                                    /*rtol=*/1e-02,
+                                    /*atol=*/1e-02));
+        EXPECT_TRUE(torch::equal(res, res_ref));
+
+        kernel::layer_norm(output, input, weight, bias, eps, impl);
+        output_ref = detail::layer_norm(input.to(torch::kFloat32),
+                                        {dim},
+                                        weight.to(torch::kFloat32),
+                                        bias.to(torch::kFloat32),
+                                        eps)
+                         .to(dtype);
+        EXPECT_TRUE(torch::allclose(output,
+                                    output_ref,
+                                    /*rtol=*/1e-02,
+                                    /*atol=*/1e-02));
+      }
+    }
+  }
+}
+
+TEST(NormalizationTest, RMSNormResidualQuantKernel) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+
+  const auto dtype = torch::kHalf;
+  const auto device = torch::kCUDA;
+  const auto options = torch::dtype(dtype).device(device);
+
+  const int64_t dim = 1024;
+  const float eps = 1e-5;
+
+  const auto weight = torch::rand({dim}, options);
+  const auto input = torch::randn({100, dim}, options);
+
+  for (const auto quant_dtype : {torch::kInt8, torch::kFloat8_e4m3fn}) {
+    auto residual = torch::randn({100, dim}, options);
+    auto residual_ref = residual.clone();
+
+    auto output = torch::empty({100, dim}, options.dtype(quant_dtype));
+    auto scale = torch::empty({100}, options.dtype(torch::kFloat));
+    kernel::rms_norm_residual_quant(
+        output, scale, residual, input, weight, eps);
+
+    const auto norm_ref =
+        detail::rms_norm_residual(input, residual_ref, weight, eps);
+    const auto [output_ref, scale_ref] =
+        detail::quant_per_token(norm_ref, quant_dtype);
+
+    EXPECT_TRUE(torch::allclose(residual,
+                                residual_ref,
+                                /*rtol=*/1e-03,
+                                /*atol=*/1e-05));
+    EXPECT_TRUE(torch::allclose(scale,
+                                scale_ref,
+                                /*rtol=*/1e-03,
+                                /*atol=*/1e-05));
+    // compare the dequantized outputs, allow one quantization step off
+    const auto dequant = output.to(torch::kFloat) * scale.unsqueeze(-1);
+    EXPECT_TRUE(torch::allclose(dequant,
+                                norm_ref.to(torch::kFloat),
+                                /*rtol=*/6e-02,
+                                /*atol=*/2 * scale.max().item<float>()));
+  }
+
+  // without residual, the residual is set to the input
+  torch::Tensor residual;
+  auto output = torch::empty({100, dim}, options.dtype(torch::kInt8));
+  auto scale = torch::empty({100}, options.dtype(torch::kFloat));
+  kernel::rms_norm_residual_quant(output, scale, residual, input, weight, eps);
+  EXPECT_TRUE(torch::equal(residual, input));
+}
+
 }  // namespace llm
@@ -1,22 +1,34 @@
 #include "pos_embedding.h"
 
 #include <c10/core/ScalarType.h>
+#include <c10/cuda/CUDAGraphsC10Utils.h>
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include <algorithm>
+#include <cmath>
 #include <memory>
+#include <vector>
 
 #include "common/slice.h"
 #include "kernels/pos_embedding_kernels.h"
 
 DEFINE_bool(disable_custom_kernels, false, "disable all custom kernels");
 
+DEFINE_int64(max_rope_cache_positions,
+             131072,
+             "max number of positions in the rotary cos/sin cache, cos and "
+             "sin of the positions beyond are computed in the kernels");
+
 namespace llm {
 
 namespace {
 using torch::indexing::None;
 using ISlice = torch::indexing::Slice;
 
+// number of the positions in the cos/sin cache before it grows
+constexpr int64_t kInitialCachedPositions = 4096;
+
 // [1, 2, 3, 4] => [-2, 1, -4, 3]
 inline torch::Tensor rotate_every_two(const torch::Tensor& x) {
   auto x1 = x.index({ISlice(), ISlice(), ISlice(0, None, 2)});
@@ -58,14 +70,23 @@ std::shared_ptr<RotaryEmbeddingImpl> create(
     int64_t max_position_embeddings,
     torch::Tensor inv_freq,
     bool interleaved,
-    const torch::TensorOptions& options) {
+    const torch::TensorOptions& options,
+    float attention_factor) {
   if (options.device().is_cuda() && !FLAGS_disable_custom_kernels) {
     // use custom kernels
-    return std::make_shared<RotaryEmbeddingKernel>(
-        rotary_dim, max_position_embeddings, inv_freq, interleaved, options);
+    return std::make_shared<RotaryEmbeddingKernel>(rotary_dim,
+                                                   max_position_embeddings,
+                                                   inv_freq,
+                                                   interleaved,
+                                                   options,
+                                                   attention_factor);
   }
-  return std::make_shared<RotaryEmbeddingGeneric>(
-      rotary_dim, max_position_embeddings, inv_freq, interleaved, options);
+  return std::make_shared<RotaryEmbeddingGeneric>(rotary_dim,
+                                                  max_position_embeddings,
+                                                  inv_freq,
+                                                  interleaved,
+                                                  options,
+                                                  attention_factor);
 }
 }  // namespace
 
@@ -108,6 +129,70 @@ torch::Tensor apply_llama3_rope_scaling(torch::Tensor inv_freq,
   return torch::tensor(new_inv_freq, inv_freq.options());
 }
 
+torch::Tensor apply_yarn_rope_scaling(torch::Tensor inv_freq,
+                                      float factor,
+                                      float beta_fast,
+                                      float beta_slow,
+                                      int64_t rotary_dim,
+                                      float theta,
+                                      int64_t old_context_len) {
+  // the dim whose frequency rotates num_rotations times in the context
+  auto correction_dim = [&](float num_rotations) {
+    return rotary_dim *
+           std::log(old_context_len / (num_rotations * 2 * M_PI)) /
+           (2 * std::log(theta));
+  };
+  const int64_t half_dim = rotary_dim / 2;
+  const float low = std::max<float>(std::floor(correction_dim(beta_fast)), 0);
+  float high = std::min<float>(std::ceil(correction_dim(beta_slow)),
+                               static_cast<float>(rotary_dim - 1));
+  if (low == high) {
+    // avoid division by zero
+    high += 0.001f;
+  }
+  // 0 for the dims to keep, 1 for the dims to interpolate
+  const auto ramp =
+      ((torch::arange(half_dim, inv_freq.options()) - low) / (high - low))
+          .clamp(0, 1);
+  return inv_freq / factor * ramp + inv_freq * (1 - ramp);
+}
+
+float yarn_mscale(float factor, float mscale) {
+  if (factor <= 1.0f) {
+    return 1.0f;
+  }
+  return 0.1f * mscale * std::log(factor) + 1.0f;
+}
+
+torch::Tensor apply_longrope_scaling(torch::Tensor inv_freq,
+                                     const std::vector<float>& ext_factors) {
+  CHECK_EQ(static_cast<int64_t>(ext_factors.size()), inv_freq.numel())
+      << "one rescale factor per frequency is expected";
+  return inv_freq / torch::tensor(ext_factors, inv_freq.options());
+}
+
+float longrope_attention_factor(float factor, int64_t old_context_len) {
+  if (factor <= 1.0f) {
+    return 1.0f;
+  }
+  return std::sqrt(1.0f + std::log(factor) / std::log(old_context_len));
+}
+
+float dynamic_ntk_theta(float theta,
+                        float factor,
+                        int64_t rotary_dim,
+                        int64_t seq_len,
+                        int64_t old_context_len) {
+  CHECK_GT(rotary_dim, 2);
+  if (seq_len <= old_context_len) {
+    return theta;
+  }
+  const float scale =
+      factor * static_cast<float>(seq_len) / old_context_len - (factor - 1);
+  return theta * std::pow(scale,
+                          static_cast<float>(rotary_dim) / (rotary_dim - 2));
+}
+
 std::tuple<torch::Tensor, torch::Tensor> apply_rotary_pos_emb(
     const torch::Tensor& q,
     const torch::Tensor& k,
@@ -126,36 +211,48 @@ RotaryEmbedding::RotaryEmbedding(int64_t rotary_dim,
                                  int64_t max_position_embeddings,
                                  torch::Tensor inv_freq,
                                  bool interleaved,
-                                 const torch::TensorOptions& options)
+                                 const torch::TensorOptions& options,
+                                 float attention_factor)
     : ModuleHolder(create(rotary_dim,
                           max_position_embeddings,
                           inv_freq,
                           interleaved,
-                          options)) {}
+                          options,
+                          attention_factor)) {}
 
 RotaryEmbeddingGeneric::RotaryEmbeddingGeneric(
     int64_t rotary_dim,
-    int64_t max_position_embeddings,
+    int64_t /*max_position_embeddings*/,
     torch::Tensor inv_freq,
     bool interleaved,
-    const torch::TensorOptions& options)
-    : rotary_dim_(rotary_dim), interleaved_(interleaved) {
-  // [max_position_embeddings]
-  auto t = torch::arange(0, max_position_embeddings, 1, torch::kFloat32);
-  // [max_position_embeddings, rotary_dim/2]
-  const auto freqs = torch::einsum("i,j->ij", {t, inv_freq});
+    const torch::TensorOptions& options,
+    float attention_factor)
+    : rotary_dim_(rotary_dim),
+      interleaved_(interleaved),
+      attention_factor_(attention_factor) {
+  inv_freq_ = inv_freq.to(options.device(), torch::kFloat32);
+}
+
+torch::Tensor RotaryEmbeddingGeneric::compute_cos_sin(
+    const torch::Tensor& positions,
+    torch::ScalarType dtype) const {
+  // [num_tokens, rotary_dim/2]
+  const auto freqs =
+      positions.to(torch::kFloat32).unsqueeze(/*dim=*/-1) * inv_freq_;
   // Create cos and sin embeddings.
   torch::Tensor emd;
-  if (interleaved) {
+  if (interleaved_) {
     // [a, b, c, d] => [a, a, b, b, c, c, d, d]
     emd = freqs.repeat_interleave(/*repeats=*/2, /*dim=*/-1);
   } else {
     // [a, b, c, d] => [a, b, c, d, a, b, c, d]
     emd = torch::cat({freqs, freqs}, /*dim=*/-1);
   }
-
-  const auto cos_sin = torch::cat({emd.cos(), emd.sin()}, /*dim=*/-1);
-  cos_sin_cache_ = register_buffer("cos_sin_cache", cos_sin.to(options));
+  auto cos_sin = torch::cat({emd.cos(), emd.sin()}, /*dim=*/-1);
+  if (attention_factor_ != 1.0f) {
+    cos_sin.mul_(attention_factor_);
+  }
+  return cos_sin.to(dtype);
 }
 
 // inplace rotary positional embedding
@@ -164,20 +261,31 @@ std::tuple<torch::Tensor, torch::Tensor> RotaryEmbeddingGeneric::forward(
     const torch::Tensor& key,       // [num_tokens, n_kv_heads, head_dim]
     const torch::Tensor& positions  // [num_tokens]
 ) const {
-  DCHECK_GE(query.size(-1), rotary_dim_);
-  auto query_rotary = query.index({"...", ISlice(0, rotary_dim_)});
-  auto query_pass = query.index({"...", ISlice(rotary_dim_, None)});
-  auto key_rotary = key.index({"...", ISlice(0, rotary_dim_)});
-  auto key_pass = key.index({"...", ISlice(rotary_dim_, None)});
-
-  namespace F = torch::nn::functional;
-  auto cos_sin = F::embedding(positions, cos_sin_cache_);
-  // add a new dimension for n_heads
-  cos_sin = cos_sin.unsqueeze(1);
-  std::tie(query_rotary, key_rotary) = detail::apply_rotary_pos_emb(
-      query_rotary, key_rotary, cos_sin, interleaved_);
-  return std::make_tuple(torch::cat({query_rotary, query_pass}, /*dim=*/-1),
-                         torch::cat({key_rotary, key_pass}, /*dim=*/-1));
+  // rotate each section of rotary_dim dims with its own positions
+  const int64_t n_sections = positions.dim() == 2 ? positions.size(1) : 1;
+  const int64_t rotated_dim = n_sections * rotary_dim_;
+  DCHECK_GE(query.size(-1), rotated_dim);
+  std::vector<torch::Tensor> query_parts;
+  std::vector<torch::Tensor> key_parts;
+  for (int64_t s = 0; s < n_sections; ++s) {
+    const auto section = ISlice(s * rotary_dim_, (s + 1) * rotary_dim_);
+    const auto section_positions =
+        positions.dim() == 2 ? positions.select(/*dim=*/1, s) : positions;
+    // add a new dimension for n_heads
+    const auto cos_sin =
+        compute_cos_sin(section_positions, query.scalar_type()).unsqueeze(1);
+    auto [query_rotary, key_rotary] =
+        detail::apply_rotary_pos_emb(query.index({"...", section}),
+                                     key.index({"...", section}),
+                                     cos_sin,
+                                     interleaved_);
+    query_parts.push_back(query_rotary);
+    key_parts.push_back(key_rotary);
+  }
+  query_parts.push_back(query.index({"...", ISlice(rotated_dim, None)}));
+  key_parts.push_back(key.index({"...", ISlice(rotated_dim, None)}));
+  return std::make_tuple(torch::cat(query_parts, /*dim=*/-1),
+                         torch::cat(key_parts, /*dim=*/-1));
 }
 
 RotaryEmbeddingKernel::RotaryEmbeddingKernel(
@@ -185,15 +293,48 @@ RotaryEmbeddingKernel::RotaryEmbeddingKernel(
     int64_t max_position_embeddings,
     torch::Tensor inv_freq,
     bool interleaved,
-    const torch::TensorOptions& options)
-    : rotary_dim_(rotary_dim), interleaved_(interleaved) {
-  // [max_position_embeddings]
-  auto t = torch::arange(0, max_position_embeddings, 1, torch::kFloat32);
-  // [max_position_embeddings, rotary_dim/2]
-  const auto freqs = torch::einsum("i,j->ij", {t, inv_freq});
+    const torch::TensorOptions& options,
+    float attention_factor)
+    : max_cached_positions_(
+          std::min(max_position_embeddings, FLAGS_max_rope_cache_positions)),
+      rotary_dim_(rotary_dim),
+      interleaved_(interleaved),
+      attention_factor_(attention_factor),
+      options_(options) {
+  inv_freq_ = inv_freq.to(options.device(), torch::kFloat32);
+  cos_sin_cache_ = compute_cos_sin(
+      std::min(max_cached_positions_, kInitialCachedPositions));
+}
+
+torch::Tensor RotaryEmbeddingKernel::compute_cos_sin(
+    int64_t n_positions) const {
+  // [n_positions]
+  auto t = torch::arange(0, n_positions, 1, inv_freq_.options());
+  // [n_positions, rotary_dim/2]
+  const auto freqs = torch::einsum("i,j->ij", {t, inv_freq_});
 
-  const auto cos_sin = torch::cat({freqs.cos(), freqs.sin()}, /*dim=*/-1);
-  cos_sin_cache_ = register_buffer("cos_sin_cache", cos_sin.to(options));
+  auto cos_sin = torch::cat({freqs.cos(), freqs.sin()}, /*dim=*/-1);
+  if (attention_factor_ != 1.0f) {
+    cos_sin.mul_(attention_factor_);
+  }
+  return cos_sin.to(options_);
+}
+
+void RotaryEmbeddingKernel::reserve(int64_t n_positions) {
+  const int64_t n_cached = num_cached_positions();
+  if (n_positions <= n_cached || n_cached >= max_cached_positions_) {
+    return;
+  }
+  // can't allocate and fill the cache while capturing
+  if (c10::cuda::currentStreamCaptureStatusMayInitCtx() !=
+      c10::cuda::CaptureStatus::None) {
+    return;
+  }
+  // grow geometrically to amortize the recomputation
+  const int64_t new_size =
+      std::min(std::max(n_positions, 2 * n_cached), max_cached_positions_);
+  retired_caches_.push_back(cos_sin_cache_);
+  cos_sin_cache_ = compute_cos_sin(new_size);
 }
 
 // inplace rotary positional embedding
@@ -202,16 +343,46 @@ std::tuple<torch::Tensor, torch::Tensor> RotaryEmbeddingKernel::forward(
     const torch::Tensor& key,       // [num_tokens, n_kv_heads, head_dim]
     const torch::Tensor& positions  // [num_tokens]
 ) const {
-  DCHECK_GE(query.size(-1), rotary_dim_);
   torch::Tensor _query = query;
   torch::Tensor _key = key;
   kernel::apply_rotary_pos_emb(_query,
                                _key,
                                positions,
                                cos_sin_cache_,
+                               inv_freq_,
+                               attention_factor_,
                                static_cast<int>(rotary_dim_),
                                interleaved_);
   return std::make_tuple(query, key);
 }
 
+bool RotaryEmbeddingKernel::forward_set_kv_cache(
+    torch::Tensor& query,            // [num_tokens, n_heads, head_dim]
+    const torch::Tensor& key,        // [num_tokens, n_kv_heads, head_dim]
+    const torch::Tensor& value,      // [num_tokens, n_kv_heads, head_dim]
+    const torch::Tensor& positions,  // [num_tokens]
+    const torch::Tensor& slot_ids,   // [num_tokens]
+    torch::Tensor& key_cache,        // [n_slots, n_kv_heads, head_dim]
+    torch::Tensor& value_cache,      // [n_slots, n_kv_heads, head_dim]
+    const torch::Tensor& qkv_bias) const {
+  // quantized kv cache is written by its own kernel
+  if (key_cache.scalar_type() != query.scalar_type()) {
+    return false;
+  }
+  kernel::apply_rotary_pos_emb_set_kv_cache(query,
+                                            key,
+                                            value,
+                                            positions,
+                                            cos_sin_cache_,
+                                            inv_freq_,
+                                            attention_factor_,
+                                            static_cast<int>(rotary_dim_),
+                                            interleaved_,
+                                            slot_ids,
+                                            key_cache,
+                                            value_cache,
+                                            qkv_bias);
+  return true;
+}
+
 }  // namespace llm
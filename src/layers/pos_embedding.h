@@ -2,9 +2,13 @@
 
 #include <c10/core/Device.h>
 #include <c10/core/ScalarType.h>
+#include <gflags/gflags.h>
 #include <torch/torch.h>
 
 #include <tuple>
+#include <vector>
+
+DECLARE_int64(max_rope_cache_positions);
 
 namespace llm {
 namespace detail {
@@ -16,6 +20,37 @@ torch::Tensor apply_llama3_rope_scaling(torch::Tensor inv_freq,
                                         float high_freq_factor,
                                         int64_t old_context_len);
 
+// yarn rope scaling: the frequencies with less than beta_fast rotations in the
+// original context are interpolated by the factor, the ones with more than
+// beta_slow rotations are kept, and the ones in between are blended linearly.
+torch::Tensor apply_yarn_rope_scaling(torch::Tensor inv_freq,
+                                      float factor,
+                                      float beta_fast,
+                                      float beta_slow,
+                                      int64_t rotary_dim,
+                                      float theta,
+                                      int64_t old_context_len);
+
+// the attention scale of yarn for the scaling factor
+float yarn_mscale(float factor, float mscale);
+
+// longrope scaling of phi-3: each frequency is divided by its own rescale
+// factor, the short factors within the original context and the long ones
+// beyond it.
+torch::Tensor apply_longrope_scaling(torch::Tensor inv_freq,
+                                     const std::vector<float>& ext_factors);
+
+// the attention scale of longrope for the scaling factor
+float longrope_attention_factor(float factor, int64_t old_context_len);
+
+// the base of the ntk-aware dynamic scaling for sequences of seq_len tokens.
+// returns theta for sequences within the original context.
+float dynamic_ntk_theta(float theta,
+                        float factor,
+                        int64_t rotary_dim,
+                        int64_t seq_len,
+                        int64_t old_context_len);
+
 std::tuple<torch::Tensor, torch::Tensor> apply_rotary_pos_emb(
     const torch::Tensor& q,
     const torch::Tensor& k,
@@ -32,11 +67,34 @@ class RotaryEmbeddingImpl : public torch::nn::Module {
 
   // returns a tuple of query and key embeddings with the same shape as the
   // input query and key.
+  // positions: [num_tokens], or [num_tokens, n_sections] for the 2D rotary of
+  // chatglm-6b, where each head has n_sections sections of rotary_dim dims
+  // and section s is rotated with positions[:, s].
   virtual std::tuple<torch::Tensor, torch::Tensor> forward(
       const torch::Tensor& query,     // [num_tokens, n_heads, head_dim]
       const torch::Tensor& key,       // [num_tokens, n_kv_heads, head_dim]
       const torch::Tensor& positions  // [num_tokens]
   ) const = 0;
+
+  // make the positions [0, n_positions) cheap to look up, e.g. grow the
+  // cos/sin cache. positions beyond are still supported, maybe slower.
+  virtual void reserve(int64_t /*n_positions*/) {}
+
+  // rotate query inplace, and write the rotated key and value into the kv
+  // cache slots in one pass. the qkv bias, if defined, is added to query, key
+  // and value first. returns false if not supported, nothing is changed in
+  // that case.
+  virtual bool forward_set_kv_cache(
+      torch::Tensor& /*query*/,
+      const torch::Tensor& /*key*/,
+      const torch::Tensor& /*value*/,
+      const torch::Tensor& /*positions*/,
+      const torch::Tensor& /*slot_ids*/,
+      torch::Tensor& /*key_cache*/,
+      torch::Tensor& /*value_cache*/,
+      const torch::Tensor& /*qkv_bias*/) const {
+    return false;
+  }
 };
 
 // RotaryEmbedding is a wrapper class that chooses the right rotary positional
@@ -49,11 +107,13 @@ class RotaryEmbedding : public torch::nn::ModuleHolder<RotaryEmbeddingImpl> {
 
   // construct a rotary positional embedding.
   // chose right implementation based on the args.
+  // attention_factor scales cos and sin, e.g. the mscale of yarn.
   RotaryEmbedding(int64_t rotary_dim,
                   int64_t max_position_embeddings,
                   torch::Tensor inv_freq,
                   bool interleaved,
-                  const torch::TensorOptions& options);
+                  const torch::TensorOptions& options,
+                  float attention_factor = 1.0f);
 };
 
 // ============= Rotary positional embedding implementations =============
@@ -62,13 +122,16 @@ class RotaryEmbedding : public torch::nn::ModuleHolder<RotaryEmbeddingImpl> {
 // (used in GPT-J and LLama).
 // 2> Half-half rotation style of rotary positional embedding (as seen in
 // GPT-Neo).
+// cos and sin are computed for the positions of each call, so any position is
+// supported.
 class RotaryEmbeddingGeneric : public RotaryEmbeddingImpl {
  public:
   RotaryEmbeddingGeneric(int64_t rotary_dim,
                          int64_t max_position_embeddings,
                          torch::Tensor inv_freq,
                          bool interleaved,
-                         const torch::TensorOptions& options);
+                         const torch::TensorOptions& options,
+                         float attention_factor = 1.0f);
 
   // inplace rotary positional embedding
   std::tuple<torch::Tensor, torch::Tensor> forward(
@@ -78,20 +141,31 @@ class RotaryEmbeddingGeneric : public RotaryEmbeddingImpl {
   ) const override;
 
  private:
-  torch::Tensor cos_sin_cache_;
+  // [num_tokens, rotary_dim * 2]
+  torch::Tensor compute_cos_sin(const torch::Tensor& positions,
+                                torch::ScalarType dtype) const;
+
+  // [rotary_dim/2] float32
+  torch::Tensor inv_freq_;
 
   int64_t rotary_dim_ = 0;
 
   bool interleaved_ = false;
+
+  float attention_factor_ = 1.0f;
 };
 
+// the cos/sin cache starts small and grows on demand up to
+// min(max_position_embeddings, FLAGS_max_rope_cache_positions) positions, the
+// kernels compute cos and sin of the positions beyond the cache on the fly.
 class RotaryEmbeddingKernel : public RotaryEmbeddingImpl {
  public:
   RotaryEmbeddingKernel(int64_t rotary_dim,
                         int64_t max_position_embeddings,
                         torch::Tensor inv_freq,
                         bool interleaved,
-                        const torch::TensorOptions& options);
+                        const torch::TensorOptions& options,
+                        float attention_factor = 1.0f);
 
   // inplace rotary positional embedding
   std::tuple<torch::Tensor, torch::Tensor> forward(
@@ -100,12 +174,46 @@ class RotaryEmbeddingKernel : public RotaryEmbeddingImpl {
       const torch::Tensor& positions  // [num_tokens]
   ) const override;
 
+  bool forward_set_kv_cache(
+      torch::Tensor& query,            // [num_tokens, n_heads, head_dim]
+      const torch::Tensor& key,        // [num_tokens, n_kv_heads, head_dim]
+      const torch::Tensor& value,      // [num_tokens, n_kv_heads, head_dim]
+      const torch::Tensor& positions,  // [num_tokens]
+      const torch::Tensor& slot_ids,   // [num_tokens]
+      torch::Tensor& key_cache,        // [n_slots, n_kv_heads, head_dim]
+      torch::Tensor& value_cache,      // [n_slots, n_kv_heads, head_dim]
+      const torch::Tensor& qkv_bias) const override;
+
+  // grow the cos/sin cache to cover the positions [0, n_positions), no-op
+  // while a cuda graph is captured.
+  void reserve(int64_t n_positions) override;
+
+  // number of the positions in the cos/sin cache
+  int64_t num_cached_positions() const { return cos_sin_cache_.size(0); }
+
  private:
+  // [n_positions, rotary_dim]: cos and sin scaled by the attention factor
+  torch::Tensor compute_cos_sin(int64_t n_positions) const;
+
+  // [rotary_dim/2] float32
+  torch::Tensor inv_freq_;
+
   torch::Tensor cos_sin_cache_;
 
+  // the caches replaced by larger ones, kept alive for the captured cuda
+  // graphs that still read them.
+  std::vector<torch::Tensor> retired_caches_;
+
+  // upper bound of the cached positions
+  int64_t max_cached_positions_ = 0;
+
   int64_t rotary_dim_ = 0;
 
   bool interleaved_ = false;
+
+  float attention_factor_ = 1.0f;
+
+  torch::TensorOptions options_;
 };
 
 }  // namespace llm
@@ -4,7 +4,10 @@
 #include <gtest/gtest.h>
 #include <torch/torch.h>
 
+#include <algorithm>
+#include <cmath>
 #include <tuple>
+#include <vector>
 
 namespace llm {
 namespace {
@@ -140,6 +143,34 @@ TEST(RopeScalingTest, Llama3) {
                               /*rtol=*/1e-04));
 }
 
+TEST(RopeScalingTest, LongRope) {
+  const int64_t rotary_dim = 8;
+  const auto inv_freq = detail::compute_default_inv_freq(rotary_dim, 10000.0f);
+  const std::vector<float> ext_factors = {1.0f, 2.0f, 4.0f, 8.0f};
+  const auto scaled_inv_freq =
+      detail::apply_longrope_scaling(inv_freq, ext_factors);
+  for (int64_t i = 0; i < rotary_dim / 2; ++i) {
+    EXPECT_FLOAT_EQ(scaled_inv_freq[i].item<float>(),
+                    inv_freq[i].item<float>() / ext_factors[i]);
+  }
+
+  // phi-3 extends 4k to 128k
+  EXPECT_FLOAT_EQ(detail::longrope_attention_factor(32.0f, 4096),
+                  std::sqrt(1.0f + std::log(32.0f) / std::log(4096.0f)));
+  EXPECT_FLOAT_EQ(detail::longrope_attention_factor(1.0f, 4096), 1.0f);
+}
+
+TEST(RopeScalingTest, DynamicNTK) {
+  const float theta = 10000.0f;
+  // no scaling within the original context
+  EXPECT_FLOAT_EQ(detail::dynamic_ntk_theta(theta, 2.0f, 128, 4096, 4096),
+                  theta);
+  // base * ((factor * seq_len / old_context_len) - (factor - 1)) ^
+  //   (dim / (dim - 2))
+  EXPECT_FLOAT_EQ(detail::dynamic_ntk_theta(theta, 2.0f, 128, 8192, 4096),
+                  theta * std::pow(3.0f, 128.0f / 126.0f));
+}
+
 class PosEmbeddingTest : public ::testing::TestWithParam<
                              std::tuple<torch::Device,
                                         torch::ScalarType,
@@ -199,6 +230,60 @@ TEST_P(PosEmbeddingTest, Rotary) {
                               /*atol=*/1e-05));
 }
 
+TEST_P(PosEmbeddingTest, Rotary2D) {
+  const auto [device,
+              dtype,
+              num_tokens,
+              n_heads,
+              n_kv_heads,
+              head_dim,
+              theta,
+              interleaved,
+              max_position_embeddings] = GetParam();
+  if (device.is_cuda() && !torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+
+  const auto options = torch::dtype(dtype).device(device);
+
+  // prepare inputs
+  torch::Tensor query = torch::rand({num_tokens, n_heads, head_dim}, options);
+  torch::Tensor key = torch::rand({num_tokens, n_kv_heads, head_dim}, options);
+  // position and block position of each token
+  const torch::Tensor positions = torch::randint(
+      0, max_position_embeddings, {num_tokens, 2}, options.dtype(torch::kInt));
+
+  // each half of the head is rotated with its own positions
+  const int64_t rotary_dim = head_dim / 2;
+  const auto inv_freq = detail::compute_default_inv_freq(rotary_dim, theta);
+  RotaryEmbeddingGeneric rotary_embedding(
+      rotary_dim, max_position_embeddings, inv_freq, interleaved, options);
+  const auto [query_output, key_output] =
+      rotary_embedding.forward(query, key, positions);
+
+  // compute the desired output half by half
+  const auto query_halves = query.chunk(/*chunks=*/2, /*dim=*/-1);
+  const auto key_halves = key.chunk(/*chunks=*/2, /*dim=*/-1);
+  for (int64_t s = 0; s < 2; ++s) {
+    auto [query_ref, key_ref] =
+        apply_rotary_emb_ref(query_halves[s],
+                             key_halves[s],
+                             positions.select(/*dim=*/1, s),
+                             rotary_dim,
+                             max_position_embeddings,
+                             theta,
+                             interleaved);
+    ASSERT_TRUE(torch::allclose(query_ref,
+                                query_output.chunk(2, /*dim=*/-1)[s],
+                                /*rtol=*/1e-03,
+                                /*atol=*/1e-05));
+    ASSERT_TRUE(torch::allclose(key_ref,
+                                key_output.chunk(2, /*dim=*/-1)[s],
+                                /*rtol=*/1e-03,
+                                /*atol=*/1e-05));
+  }
+}
+
 INSTANTIATE_TEST_SUITE_P(
     RotaryCorrectness,
     PosEmbeddingTest,
@@ -268,6 +353,214 @@ TEST_P(PosEmbeddingKernelTest, Rotary) {
   ASSERT_TRUE(torch::allclose(key_output, key_output_kernel));
 }
 
+TEST_P(PosEmbeddingKernelTest, RotarySetKVCache) {
+  const auto [device,
+              dtype,
+              num_tokens,
+              n_heads,
+              n_kv_heads,
+              head_dim,
+              rotary_dim,
+              theta,
+              interleaved,
+              max_position_embeddings] = GetParam();
+
+  if (device.is_cuda() && !torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+
+  const auto options = torch::dtype(dtype).device(device);
+  // prepare inputs
+  torch::Tensor query = torch::rand({num_tokens, n_heads, head_dim}, options);
+  torch::Tensor key = torch::rand({num_tokens, n_kv_heads, head_dim}, options);
+  torch::Tensor value =
+      torch::rand({num_tokens, n_kv_heads, head_dim}, options);
+  const torch::Tensor positions = torch::randint(
+      0, max_position_embeddings, {num_tokens}, options.dtype(torch::kInt));
+
+  // write into random slots of the kv cache
+  const int64_t n_slots = num_tokens * 4;
+  const torch::Tensor slot_ids =
+      torch::randperm(n_slots, options.dtype(torch::kInt))
+          .slice(/*dim=*/0, /*start=*/0, /*end=*/num_tokens);
+  torch::Tensor key_cache =
+      torch::zeros({n_slots, n_kv_heads, head_dim}, options);
+  torch::Tensor value_cache =
+      torch::zeros({n_slots, n_kv_heads, head_dim}, options);
+
+  const auto inv_freq = detail::compute_default_inv_freq(rotary_dim, theta);
+  RotaryEmbeddingKernel rotary_embedding_kernel(
+      rotary_dim, max_position_embeddings, inv_freq, interleaved, options);
+
+  auto [query_ref, key_ref] =
+      rotary_embedding_kernel.forward(query.clone(), key.clone(), positions);
+
+  torch::Tensor query_output = query.clone();
+  ASSERT_TRUE(rotary_embedding_kernel.forward_set_kv_cache(query_output,
+                                                           key,
+                                                           value,
+                                                           positions,
+                                                           slot_ids,
+                                                           key_cache,
+                                                           value_cache,
+                                                           /*qkv_bias=*/{}));
+
+  ASSERT_TRUE(torch::allclose(query_output, query_ref));
+  const auto slots = slot_ids.to(torch::kLong);
+  ASSERT_TRUE(torch::allclose(key_cache.index_select(0, slots), key_ref));
+  ASSERT_TRUE(torch::equal(value_cache.index_select(0, slots), value));
+
+  // the qkv bias is added before the rotation
+  const auto qkv_bias =
+      torch::rand({(n_heads + 2 * n_kv_heads) * head_dim}, options);
+  const auto biases =
+      qkv_bias.view({-1, head_dim}).split({n_heads, n_kv_heads, n_kv_heads});
+  auto [query_bias_ref, key_bias_ref] = rotary_embedding_kernel.forward(
+      query + biases[0], key + biases[1], positions);
+
+  query_output = query.clone();
+  ASSERT_TRUE(rotary_embedding_kernel.forward_set_kv_cache(query_output,
+                                                           key,
+                                                           value,
+                                                           positions,
+                                                           slot_ids,
+                                                           key_cache,
+                                                           value_cache,
+                                                           qkv_bias));
+
+  ASSERT_TRUE(torch::allclose(query_output, query_bias_ref));
+  ASSERT_TRUE(
+      torch::allclose(key_cache.index_select(0, slots), key_bias_ref));
+  ASSERT_TRUE(
+      torch::equal(value_cache.index_select(0, slots), value + biases[2]));
+}
+
+TEST_P(PosEmbeddingKernelTest, Rotary2D) {
+  const auto [device,
+              dtype,
+              num_tokens,
+              n_heads,
+              n_kv_heads,
+              head_dim,
+              rotary_dim,
+              theta,
+              interleaved,
+              max_position_embeddings] = GetParam();
+
+  if (device.is_cuda() && !torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  if (2 * rotary_dim > head_dim) {
+    GTEST_SKIP() << "two sections of rotary_dim don't fit in head_dim";
+  }
+
+  const auto options = torch::dtype(dtype).device(device);
+  // prepare inputs
+  torch::Tensor query = torch::rand({num_tokens, n_heads, head_dim}, options);
+  torch::Tensor key = torch::rand({num_tokens, n_kv_heads, head_dim}, options);
+  torch::Tensor value =
+      torch::rand({num_tokens, n_kv_heads, head_dim}, options);
+  // position and block position of each token
+  const torch::Tensor positions = torch::randint(
+      0, max_position_embeddings, {num_tokens, 2}, options.dtype(torch::kInt));
+
+  const auto inv_freq = detail::compute_default_inv_freq(rotary_dim, theta);
+  RotaryEmbeddingGeneric rotary_embedding(
+      rotary_dim, max_position_embeddings, inv_freq, interleaved, options);
+  RotaryEmbeddingKernel rotary_embedding_kernel(
+      rotary_dim, max_position_embeddings, inv_freq, interleaved, options);
+
+  auto [query_ref, key_ref] = rotary_embedding.forward(query, key, positions);
+  auto [query_output, key_output] =
+      rotary_embedding_kernel.forward(query.clone(), key.clone(), positions);
+  ASSERT_TRUE(torch::allclose(query_output, query_ref));
+  ASSERT_TRUE(torch::allclose(key_output, key_ref));
+
+  const int64_t n_slots = num_tokens * 4;
+  const torch::Tensor slot_ids =
+      torch::randperm(n_slots, options.dtype(torch::kInt))
+          .slice(/*dim=*/0, /*start=*/0, /*end=*/num_tokens);
+  torch::Tensor key_cache =
+      torch::zeros({n_slots, n_kv_heads, head_dim}, options);
+  torch::Tensor value_cache =
+      torch::zeros({n_slots, n_kv_heads, head_dim}, options);
+  query_output = query.clone();
+  ASSERT_TRUE(rotary_embedding_kernel.forward_set_kv_cache(query_output,
+                                                           key,
+                                                           value,
+                                                           positions,
+                                                           slot_ids,
+                                                           key_cache,
+                                                           value_cache,
+                                                           /*qkv_bias=*/{}));
+  ASSERT_TRUE(torch::allclose(query_output, query_ref));
+  const auto slots = slot_ids.to(torch::kLong);
+  ASSERT_TRUE(torch::allclose(key_cache.index_select(0, slots), key_ref));
+}
+
+TEST_P(PosEmbeddingKernelTest, GrowCache) {
+  const auto [device,
+              dtype,
+              num_tokens,
+              n_heads,
+              n_kv_heads,
+              head_dim,
+              rotary_dim,
+              theta,
+              interleaved,
+              max_position_embeddings] = GetParam();
+
+  if (device.is_cuda() && !torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+
+  const auto options = torch::dtype(dtype).device(device);
+  torch::Tensor query = torch::rand({num_tokens, n_heads, head_dim}, options);
+  torch::Tensor key = torch::rand({num_tokens, n_kv_heads, head_dim}, options);
+  // positions beyond max_position_embeddings are supported too
+  const torch::Tensor positions = torch::randint(0,
+                                                 2 * max_position_embeddings,
+                                                 {num_tokens},
+                                                 options.dtype(torch::kInt));
+
+  // a yarn-like scale of cos and sin
+  const float attention_factor = 1.2f;
+  const auto inv_freq = detail::compute_default_inv_freq(rotary_dim, theta);
+  RotaryEmbeddingGeneric rotary_embedding(rotary_dim,
+                                          max_position_embeddings,
+                                          inv_freq,
+                                          interleaved,
+                                          options,
+                                          attention_factor);
+  RotaryEmbeddingKernel rotary_embedding_kernel(rotary_dim,
+                                                max_position_embeddings,
+                                                inv_freq,
+                                                interleaved,
+                                                options,
+                                                attention_factor);
+  auto [query_ref, key_ref] = rotary_embedding.forward(query, key, positions);
+
+  // the positions beyond the cache are computed in the kernel
+  const int64_t n_cached = rotary_embedding_kernel.num_cached_positions();
+  EXPECT_LE(n_cached, max_position_embeddings);
+  auto [query_output, key_output] =
+      rotary_embedding_kernel.forward(query.clone(), key.clone(), positions);
+  EXPECT_TRUE(torch::allclose(query_output, query_ref, 1e-2, 1e-2));
+  EXPECT_TRUE(torch::allclose(key_output, key_ref, 1e-2, 1e-2));
+
+  // the cache grows up to max_position_embeddings
+  rotary_embedding_kernel.reserve(n_cached + 1);
+  EXPECT_EQ(rotary_embedding_kernel.num_cached_positions(),
+            std::min(2 * n_cached, max_position_embeddings));
+  rotary_embedding_kernel.reserve(2 * max_position_embeddings);
+  EXPECT_EQ(rotary_embedding_kernel.num_cached_positions(),
+            max_position_embeddings);
+  std::tie(query_output, key_output) =
+      rotary_embedding_kernel.forward(query.clone(), key.clone(), positions);
+  EXPECT_TRUE(torch::allclose(query_output, query_ref, 1e-2, 1e-2));
+  EXPECT_TRUE(torch::allclose(key_output, key_ref, 1e-2, 1e-2));
+}
+
 INSTANTIATE_TEST_SUITE_P(
     Rotary,
     PosEmbeddingKernelTest,
@@ -278,7 +571,7 @@ INSTANTIATE_TEST_SUITE_P(
         ::testing::Values(32),                                // n_heads
         ::testing::Values(32 /*mha*/, 8 /*gqa*/, 1 /*mqa*/),  // n_kv_heads
         ::testing::Values(128),                               // head_dim
-        ::testing::Values(128, 64),                           // rotary_dim
+        ::testing::Values(128, 64, 32),                       // rotary_dim
         ::testing::Values(100000.0f, 500000.0f),              // theta
         ::testing::Values(false, true),                       // interleaved
         ::testing::Values(4096, 8192)  // max_position_embeddings
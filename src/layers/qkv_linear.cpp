@@ -4,6 +4,8 @@
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include <numeric>
+
 namespace llm {
 QKVColumnParallelLinearImpl::QKVColumnParallelLinearImpl(
     int64_t hidden_size,
@@ -15,7 +17,9 @@ QKVColumnParallelLinearImpl::QKVColumnParallelLinearImpl(
     const QuantArgs& quant_args,
     const ParallelArgs& parallel_args,
     const torch::TensorOptions& options)
-    : n_kv_heads_(n_kv_heads), head_dim_(head_dim) {
+    : parallel_args_(parallel_args),
+      n_kv_heads_(n_kv_heads),
+      head_dim_(head_dim) {
   // calculate logical kv heads with support of MQA/GQA
   const int32_t world_size = parallel_args.world_size();
   int64_t effective_kv_heads = n_kv_heads;
@@ -36,14 +40,43 @@ QKVColumnParallelLinearImpl::QKVColumnParallelLinearImpl(
                                        effective_kv_heads * head_dim,
                                        effective_kv_heads * head_dim};
 
-  parallel_linear_ = register_module("parallel_linear",
-                                     FusedColumnParallelLinear(hidden_size,
-                                                               out_features,
-                                                               bias,
-                                                               gather_output,
-                                                               quant_args,
-                                                               parallel_args,
-                                                               options));
+  // a gathered output needs the full bias, leave it to the linear
+  const bool own_bias = bias && !gather_output;
+  parallel_linear_ = register_module(
+      "parallel_linear",
+      FusedColumnParallelLinear(hidden_size,
+                                out_features,
+                                /*bias=*/bias && !own_bias,
+                                gather_output,
+                                quant_args,
+                                parallel_args,
+                                options));
+
+  for (const auto features : out_features) {
+    out_features_per_partition_.push_back(features / world_size);
+  }
+  if (own_bias) {
+    const int64_t local_features =
+        std::accumulate(out_features_per_partition_.begin(),
+                        out_features_per_partition_.end(),
+                        int64_t{0});
+    bias_ = register_parameter("bias",
+                               torch::empty({local_features}, options),
+                               /*requires_grad=*/false);
+  }
+}
+
+std::vector<torch::Tensor> QKVColumnParallelLinearImpl::forward(
+    torch::Tensor input,
+    bool add_bias) {
+  auto qkv = parallel_linear_->forward(input);
+  if (add_bias && bias_.defined()) {
+    const auto biases = bias_.split(out_features_per_partition_);
+    for (size_t i = 0; i < qkv.size(); ++i) {
+      qkv[i].add_(biases[i]);
+    }
+  }
+  return qkv;
 }
 
 // special load_state_dict for fused cases
@@ -55,6 +88,10 @@ void QKVColumnParallelLinearImpl::load_state_dict(
     // replicate kv heads
     auto kv_replicated_state_dict = state_dict.select_with_transform(
         "", [&](const std::string& name, const torch::Tensor& tensor) {
+          if (absl::EndsWith(name, "lora_A.weight")) {
+            // the lora down projection is over the input features
+            return tensor;
+          }
           for (const auto& kv_prefix : kv_prefixes) {
             if (absl::StartsWith(name, kv_prefix)) {
               // reshape to [n_kv_heads, head_dim, ...]
@@ -64,16 +101,38 @@ void QKVColumnParallelLinearImpl::load_state_dict(
               reshaped_tensor = reshaped_tensor.repeat_interleave(
                   kv_replication_ratio_, /*dim=*/0);
               // reshape to [n_kv_heads * kv_replication_ratio * head_dim, ...]
-              return reshaped_tensor.reshape(
+              reshaped_tensor = reshaped_tensor.reshape(
                   {n_kv_heads_ * kv_replication_ratio_ * head_dim_, -1});
+              // keep the bias in 1d
+              return tensor.dim() == 1 ? reshaped_tensor.view({-1})
+                                       : reshaped_tensor;
             }
           }
           return tensor;
         });
-    parallel_linear_->load_state_dict(kv_replicated_state_dict, prefixes);
+    load_fused_state_dict(kv_replicated_state_dict, prefixes);
   } else {
-    parallel_linear_->load_state_dict(state_dict, prefixes);
+    load_fused_state_dict(state_dict, prefixes);
   }
 }
 
+void QKVColumnParallelLinearImpl::load_fused_state_dict(
+    const StateDict& state_dict,
+    const std::vector<std::string>& prefixes) {
+  parallel_linear_->load_state_dict(state_dict, prefixes);
+  if (bias_.defined()) {
+    const auto rank = parallel_args_.rank();
+    const auto world_size = parallel_args_.world_size();
+    // load and merge bias on dim 0
+    LOAD_FUSED_WEIGHT(bias, 0);
+  }
+}
+
+void QKVColumnParallelLinearImpl::verify_loaded_weights(
+    const std::string& prefix) const {
+  parallel_linear_->verify_loaded_weights(prefix);
+  CHECK(!bias_.defined() || bias_is_loaded_)
+      << "bias is not loaded for " << prefix + "bias";
+}
+
 }  // namespace llm
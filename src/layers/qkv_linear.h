@@ -4,6 +4,7 @@
 #include <torch/torch.h>
 
 #include "fused_linear.h"
+#include "layers/weight_utils.h"
 #include "model_loader/state_dict.h"
 #include "model_parallel/parallel_args.h"
 #include "quantization/quant_args.h"
@@ -24,22 +25,37 @@ class QKVColumnParallelLinearImpl : public torch::nn::Module {
                               const ParallelArgs& parallel_args,
                               const torch::TensorOptions& options);
 
-  std::vector<torch::Tensor> forward(torch::Tensor input) {
-    return parallel_linear_->forward(input);
-  }
+  // returns query, key and value. with add_bias false, the bias is left to
+  // the caller, e.g. to be added by the rotary kernel of the attention.
+  std::vector<torch::Tensor> forward(torch::Tensor input,
+                                     bool add_bias = true);
+
+  // the bias of the local query, key and value heads, undefined if no bias.
+  // [(n_local_heads + 2 * n_local_kv_heads) * head_dim]
+  const torch::Tensor& bias() const { return bias_; }
 
   // special load_state_dict for fused cases
   void load_state_dict(const StateDict& state_dict,
                        const std::vector<std::string>& prefixes,
                        const std::vector<std::string>& kv_prefixes);
 
-  void verify_loaded_weights(const std::string& prefix = "") const {
-    parallel_linear_->verify_loaded_weights(prefix);
-  }
+  void verify_loaded_weights(const std::string& prefix = "") const;
 
  private:
+  void load_fused_state_dict(const StateDict& state_dict,
+                             const std::vector<std::string>& prefixes);
+
   FusedColumnParallelLinear parallel_linear_{nullptr};
 
+  // the bias is kept out of the linear so that it can be fused with the
+  // rotary embedding, only used when the output is not gathered.
+  DEFINE_FUSED_WEIGHT(bias);
+
+  // local output features for Q, K, V
+  std::vector<int64_t> out_features_per_partition_;
+
+  ParallelArgs parallel_args_;
+
   // replication ratio of kv heads for MQA/GQA cases
   int64_t kv_replication_ratio_ = 0;
 
@@ -82,6 +82,63 @@ TEST_P(QKVLinearTest, LoadFusedWeight) {
   }
 }
 
+TEST_P(QKVLinearTest, LoadFusedBias) {
+  const auto& [n_tokens, n_heads, n_kv_heads, n_shards, head_dim, hidden_size] =
+      GetParam();
+
+  const auto options = torch::dtype(torch::kFloat).device(torch::kCPU);
+  std::unordered_map<std::string, torch::Tensor> state_dict_data;
+  state_dict_data["query.weight"] =
+      torch::randn({n_heads * head_dim, hidden_size}, options);
+  state_dict_data["query.bias"] = torch::randn({n_heads * head_dim}, options);
+  for (const std::string name : {"key", "value"}) {
+    state_dict_data[name + ".weight"] =
+        torch::randn({n_kv_heads * head_dim, hidden_size}, options);
+    state_dict_data[name + ".bias"] =
+        torch::randn({n_kv_heads * head_dim}, options);
+  }
+  StateDict state_dict(state_dict_data);
+
+  const int64_t n_kv_shards = std::min(n_kv_heads, n_shards);
+  auto query_bias_chunks = state_dict_data["query.bias"].chunk(n_shards);
+  auto key_bias_chunks = state_dict_data["key.bias"].chunk(n_kv_shards);
+  auto value_bias_chunks = state_dict_data["value.bias"].chunk(n_kv_shards);
+
+  for (int32_t shard_id = 0; shard_id < n_shards; ++shard_id) {
+    QuantArgs quant_args;
+    ParallelArgs parallel_args(shard_id, n_shards, nullptr);
+    QKVColumnParallelLinearImpl linear(hidden_size,
+                                       n_heads,
+                                       n_kv_heads,
+                                       head_dim,
+                                       /*bias=*/true,
+                                       /*gather_output=*/false,
+                                       quant_args,
+                                       parallel_args,
+                                       options);
+    linear.load_state_dict(state_dict,
+                           /*prefixes=*/{"query.", "key.", "value."},
+                           /*kv_prefixes=*/{"key.", "value."});
+    linear.verify_loaded_weights();
+
+    const int64_t kv_shard_id =
+        n_kv_heads >= n_shards ? shard_id : n_kv_heads * shard_id / n_shards;
+    const auto bias_ref = torch::cat({query_bias_chunks[shard_id],
+                                      key_bias_chunks[kv_shard_id],
+                                      value_bias_chunks[kv_shard_id]});
+    EXPECT_TRUE(torch::equal(linear.bias(), bias_ref));
+
+    // the bias is added unless it is left to the caller
+    auto input = torch::randn({n_tokens, hidden_size}, options);
+    const auto qkv = linear.forward(input);
+    const auto qkv_no_bias = linear.forward(input, /*add_bias=*/false);
+    const auto output = torch::cat(qkv, /*dim=*/1);
+    const auto output_ref = torch::cat(qkv_no_bias, /*dim=*/1) + bias_ref;
+    EXPECT_TRUE(
+        torch::allclose(output, output_ref, /*rtol=*/1e-5, /*atol=*/1e-5));
+  }
+}
+
 INSTANTIATE_TEST_SUITE_P(
     QKVLinearTestSuite,
     QKVLinearTest,
@@ -1,6 +1,115 @@
 #include "weight_utils.h"
 
+#include <ATen/cuda/CUDAEvent.h>
+#include <c10/cuda/CUDAStream.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <array>
+
+#include "common/pinned_allocator.h"
+
+DEFINE_int32(weight_staging_buffer_mb,
+             64,
+             "size of each pinned buffer to stage the weights copied to the "
+             "devices, 0 to copy from the checkpoint directly.");
+
 namespace llm {
+namespace {
+
+// double buffered pinned host memory for the weights copied to the device by
+// the current thread. one buffer is filled from the checkpoint while the other
+// one is being copied to the device.
+class WeightStager final {
+ public:
+  static WeightStager& get() {
+    thread_local WeightStager stager;
+    return stager;
+  }
+
+  void copy(torch::Tensor& dst, const torch::Tensor& src) {
+    const int64_t buffer_bytes =
+        static_cast<int64_t>(FLAGS_weight_staging_buffer_mb) * 1024 * 1024;
+    const int64_t n_rows = src.dim() > 0 ? src.size(0) : 0;
+    if (buffer_bytes <= 0 || !dst.is_cuda() || !src.device().is_cpu() ||
+        n_rows == 0) {
+      dst.copy_(src);
+      return;
+    }
+    if (src.is_pinned() && src.scalar_type() == dst.scalar_type()) {
+      // already in pinned memory (direct io), copy to the device directly.
+      // the owner of the state dict waits for the copies before freeing it.
+      dst.copy_(src, /*non_blocking=*/true);
+      return;
+    }
+    // staged in the dtype of the weight, so the conversion happens on the
+    // host while the previous buffer is copied.
+    const int64_t row_bytes = src.numel() / n_rows * dst.element_size();
+    if (row_bytes == 0 || row_bytes > buffer_bytes) {
+      dst.copy_(src);
+      return;
+    }
+
+    const auto device_index = dst.device().index();
+    if (device_index != device_index_) {
+      // events can't be recorded on another device, and the buffers are
+      // placed on the numa node of the device
+      for (auto& buffer : buffers_) {
+        buffer.event.synchronize();
+        buffer.event = at::cuda::CUDAEvent();
+        buffer.storage = torch::Tensor();
+      }
+      device_index_ = device_index;
+    }
+    auto stream = c10::cuda::getCurrentCUDAStream(device_index);
+
+    const int64_t rows_per_copy = buffer_bytes / row_bytes;
+    for (int64_t start = 0; start < n_rows; start += rows_per_copy) {
+      const int64_t n = std::min(rows_per_copy, n_rows - start);
+      auto& buffer = next_buffer(dst.device(), buffer_bytes);
+      // wait for the previous copy out of this buffer to finish
+      buffer.event.synchronize();
+
+      const auto src_rows = src.narrow(/*dim=*/0, start, n);
+      auto staging = buffer.storage.narrow(/*dim=*/0, 0, n * row_bytes)
+                         .view(dst.scalar_type())
+                         .view(src_rows.sizes());
+      // the pages of the checkpoint are faulted in here
+      staging.copy_(src_rows);
+      dst.narrow(/*dim=*/0, start, n).copy_(staging, /*non_blocking=*/true);
+      buffer.event.record(stream);
+    }
+  }
+
+ private:
+  struct Buffer {
+    torch::Tensor storage;
+    at::cuda::CUDAEvent event;
+  };
+
+  Buffer& next_buffer(const torch::Device& device, int64_t buffer_bytes) {
+    auto& buffer = buffers_[next_];
+    next_ = (next_ + 1) % buffers_.size();
+    if (!buffer.storage.defined() || buffer.storage.numel() != buffer_bytes) {
+      buffer.event.synchronize();
+      buffer.storage = PinnedAllocator::get(device).empty(buffer_bytes);
+    }
+    return buffer;
+  }
+
+  std::array<Buffer, 2> buffers_;
+  size_t next_ = 0;
+  c10::DeviceIndex device_index_ = -1;
+};
+
+}  // namespace
+
+void WeightUtils::copy_weight(torch::Tensor& weight,
+                              const torch::Tensor& tensor) {
+  WeightStager::get().copy(weight, tensor);
+}
 
 void WeightUtils::load_weight(const StateDict& state_dict,
                               const std::string& name,
@@ -12,7 +121,8 @@ void WeightUtils::load_weight(const StateDict& state_dict,
         << "weight already loaded, name: " << state_dict.prefix() << name;
     CHECK_EQ(weight.sizes(), tensor.sizes())
         << "weight size mismatch for " << state_dict.prefix() << name;
-    weight.copy_(tensor);
+    copy_weight(weight, tensor);
+    state_dict.release(tensor);
     weight_is_loaded = true;
   }
 }
@@ -29,7 +139,8 @@ void WeightUtils::load_sharded_weight(const StateDict& state_dict,
   if (tensor.defined()) {
     CHECK_EQ(weight.sizes(), tensor.sizes())
         << "weight size mismatch for " << state_dict.prefix() << name;
-    weight.copy_(tensor);
+    copy_weight(weight, tensor);
+    state_dict.release(tensor);
     weight_is_loaded = true;
   }
 }
@@ -49,7 +160,9 @@ void WeightUtils::load_sharded_weight(const StateDict& state_dict,
         << "weight already loaded, name: " << state_dict.prefix() << name;
     CHECK_EQ(weight.sizes(), tensor.sizes())
         << "weight size mismatch for " << state_dict.prefix() << name;
-    weight.copy_(tensor);
+    copy_weight(weight, tensor);
+    // no-op if transformed into a new tensor
+    state_dict.release(tensor);
     weight_is_loaded = true;
   }
 }
@@ -101,10 +214,24 @@ void WeightUtils::load_fused_weight(
       }
     }
   } else {
-    const auto merged_weight = torch::cat(tensors, /*dim=*/dim);
-    CHECK_EQ(weight.sizes(), merged_weight.sizes())
+    // copy each tensor into its slice of the weight instead of merging them
+    // on the host first
+    int64_t merged_size = 0;
+    for (const auto& tensor : tensors) {
+      merged_size += tensor.size(dim);
+    }
+    CHECK_EQ(weight.size(dim), merged_size)
         << "weight size mismatch for " << state_dict.prefix() << name;
-    weight.copy_(merged_weight);
+    int64_t offset = 0;
+    for (const auto& tensor : tensors) {
+      auto slice = weight.narrow(dim, offset, tensor.size(dim));
+      CHECK_EQ(slice.sizes(), tensor.sizes())
+          << "weight size mismatch for " << state_dict.prefix() << name;
+      copy_weight(slice, tensor);
+      // the accumulated tensors are clones
+      state_dict.release(tensor);
+      offset += tensor.size(dim);
+    }
     // release the memory for weight_list
     accumulated_tensors.clear();
     weight_is_loaded = true;
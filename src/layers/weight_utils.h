@@ -10,6 +10,14 @@ namespace llm {
 
 class WeightUtils {
  public:
+  // copy the host tensor into the device weight through pinned staging
+  // buffers, so that reading the next rows from the checkpoint overlaps with
+  // the async copy of the previous ones. only the bytes of the given tensor
+  // (i.e. the shard of this rank) are read. the copy may still be in flight
+  // on return for tensors in pinned memory, synchronize the stream before
+  // freeing them.
+  static void copy_weight(torch::Tensor& weight, const torch::Tensor& tensor);
+
   static void load_weight(const StateDict& state_dict,
                           const std::string& name,
                           torch::Tensor& weight,
@@ -2,7 +2,9 @@
 
 #include <glog/logging.h>
 
+#include <atomic>
 #include <cstdint>
+#include <vector>
 
 #include "block_allocator.h"
 
@@ -10,12 +12,18 @@ namespace llm {
 Block::Block(int32_t id) : Block(id, uint32_t(0)) {}
 
 Block::Block(int32_t id, uint32_t size)
-    : id_(id), size_(size), ref_count_(new uint32_t(1)) {}
+    : id_(id), size_(size), ref_count_(new std::atomic<uint32_t>(1)) {}
 
 Block::Block(int32_t id, BlockAllocator* allocator)
-    : id_(id), ref_count_(new uint32_t(1)), allocator_(allocator) {
-  // get the block size from the allocator
-  size_ = allocator_ == nullptr ? 0 : allocator_->block_size();
+    : id_(id), allocator_(allocator) {
+  if (allocator_ == nullptr) {
+    ref_count_ = new std::atomic<uint32_t>(1);
+    return;
+  }
+  // get the block size and the reference count from the allocator
+  size_ = allocator_->block_size();
+  ref_count_ = allocator_->ref_count(id_);
+  ref_count_->store(1, std::memory_order_relaxed);
 }
 
 Block::~Block() {
@@ -53,10 +61,7 @@ Block::Block(Block&& other) noexcept
       ref_count_(other.ref_count_),
       allocator_(other.allocator_) {
   // reset other without adjusting the reference count
-  other.id_ = -1;
-  other.size_ = 0;
-  other.ref_count_ = nullptr;
-  other.allocator_ = nullptr;
+  other.reset();
 }
 
 Block& Block::operator=(Block&& other) noexcept {
@@ -68,29 +73,65 @@ Block& Block::operator=(Block&& other) noexcept {
     allocator_ = other.allocator_;
     ref_count_ = other.ref_count_;
 
-    other.id_ = -1;
-    other.size_ = 0;
-    other.ref_count_ = nullptr;
-    other.allocator_ = nullptr;
+    other.reset();
   }
   return *this;
 }
 
+void Block::release(std::vector<Block>* blocks) {
+  CHECK(blocks != nullptr);
+  // collect the freed block ids for each run of blocks from the same allocator
+  std::vector<int32_t> free_block_ids;
+  BlockAllocator* allocator = nullptr;
+  for (auto& block : *blocks) {
+    if (block.allocator_ == nullptr) {
+      // blocks without allocator are released one by one
+      block.dec_ref_count();
+      block.reset();
+      continue;
+    }
+    if (block.allocator_ != allocator) {
+      if (allocator != nullptr) {
+        allocator->free(free_block_ids);
+        free_block_ids.clear();
+      }
+      allocator = block.allocator_;
+    }
+    if (block.ref_count_->fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      free_block_ids.push_back(block.id_);
+    }
+    block.reset();
+  }
+  if (allocator != nullptr) {
+    allocator->free(free_block_ids);
+  }
+  blocks->clear();
+}
+
 void Block::inc_ref_count() {
   if (ref_count_ != nullptr) {
-    ++(*ref_count_);
+    ref_count_->fetch_add(1, std::memory_order_relaxed);
   }
 }
 
 void Block::dec_ref_count() {
-  if (ref_count_ != nullptr && --(*ref_count_) == 0) {
-    // release the reference count memory
-    delete ref_count_;
-    // return the block id to the allocator
+  if (ref_count_ != nullptr &&
+      ref_count_->fetch_sub(1, std::memory_order_acq_rel) == 1) {
     if (allocator_ != nullptr) {
+      // return the block id to the allocator
       allocator_->free(id_);
+    } else {
+      // release the reference count memory
+      delete ref_count_;
     }
   }
 }
 
-}  // namespace llm
\ No newline at end of file
+void Block::reset() {
+  id_ = -1;
+  size_ = 0;
+  ref_count_ = nullptr;
+  allocator_ = nullptr;
+}
+
+}  // namespace llm
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <vector>
 
 namespace llm {
 
@@ -9,7 +11,8 @@ class BlockAllocator;
 
 // Memory block represents a contiguous memory region.
 // It is used to track memory usage. the block will be released when the
-// reference count drops to zero.
+// reference count drops to zero. the reference count is atomic and lives in
+// the allocator, so blocks can be copied and released from any thread.
 class Block final {
  public:
   ~Block();
@@ -38,7 +41,10 @@ class Block final {
   uint32_t size() const { return size_; }
 
   // get the reference count, 0 if the block is invalid after move
-  uint32_t ref_count() const { return ref_count_ == nullptr ? 0 : *ref_count_; }
+  uint32_t ref_count() const {
+    return ref_count_ == nullptr ? 0
+                                 : ref_count_->load(std::memory_order_acquire);
+  }
 
   // check if the block is shared
   bool is_shared() const { return ref_count() > 1; }
@@ -46,6 +52,10 @@ class Block final {
   // check if the block is valid
   bool is_valid() const { return id_ >= 0 && ref_count_ != nullptr; }
 
+  // release a list of blocks and clear the list. blocks whose reference count
+  // drops to zero are returned to their allocator in one batch.
+  static void release(std::vector<Block>* blocks);
+
  private:
   // increase reference count
   void inc_ref_count();
@@ -53,14 +63,17 @@ class Block final {
   // decrease reference count
   void dec_ref_count();
 
+  // reset the block without adjusting the reference count
+  void reset();
+
   // block id
   int32_t id_ = -1;
 
   // block size
   uint32_t size_ = 0;
 
-  // reference count
-  uint32_t* ref_count_ = nullptr;
+  // reference count, owned by the allocator if any
+  std::atomic<uint32_t>* ref_count_ = nullptr;
 
   // allocator that manages this block
   BlockAllocator* allocator_ = nullptr;
@@ -2,55 +2,417 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <numeric>
 #include <vector>
 
 #include "block.h"
 
 namespace llm {
+namespace {
 
-BlockAllocator::BlockAllocator(uint32_t total_blocks, uint32_t block_size)
-    : num_free_blocks_(total_blocks), block_size_(block_size) {
+// marks the end of the free list
+constexpr int32_t kEndOfList = -1;
+
+uint64_t pack(uint32_t tag, int32_t block_id) {
+  return (static_cast<uint64_t>(tag) << 32) | static_cast<uint32_t>(block_id);
+}
+
+uint32_t tag_of(uint64_t head) { return static_cast<uint32_t>(head >> 32); }
+
+int32_t block_id_of(uint64_t head) {
+  return static_cast<int32_t>(static_cast<uint32_t>(head));
+}
+
+}  // namespace
+
+BlockAllocator::BlockAllocator(uint32_t total_blocks,
+                               uint32_t block_size,
+                               uint32_t blocks_per_large_block,
+                               uint32_t max_blocks,
+                               int32_t first_block_id)
+    : num_free_blocks_(total_blocks),
+      num_total_blocks_(total_blocks),
+      max_blocks_(std::max(total_blocks, max_blocks)),
+      block_limit_(total_blocks),
+      block_size_(block_size),
+      first_block_id_(first_block_id),
+      blocks_per_large_block_(blocks_per_large_block) {
   CHECK_GT(total_blocks, 0) << "No blocks to allocate";
+  CHECK_GE(first_block_id, 0) << "Negative first block id";
   auto power_of_2 = [](int32_t x) { return (x > 0) && ((x & (x - 1)) == 0); };
   CHECK(power_of_2(block_size))
       << "Block size must be positive and a power of 2, got " << block_size;
+  CHECK(power_of_2(blocks_per_large_block))
+      << "Blocks per large block must be positive and a power of 2, got "
+      << blocks_per_large_block;
 
-  free_blocks_.reserve(total_blocks);
-  for (int32_t i = 0; i < total_blocks; ++i) {
-    // push smaller block ids to the back of the vector
-    free_blocks_.push_back(total_blocks - i - 1);
+  next_free_blocks_ = std::make_unique<std::atomic<int32_t>[]>(max_blocks_);
+  ref_counts_ = std::make_unique<std::atomic<uint32_t>[]>(max_blocks_);
+  for (size_t i = 0; i < max_blocks_; ++i) {
+    ref_counts_[i].store(0, std::memory_order_relaxed);
+  }
+  if (blocks_per_large_block > 1) {
+    num_large_blocks_ = total_blocks / blocks_per_large_block;
+  }
+  free_list_head_.store(pack(/*tag=*/0, kEndOfList));
+  free_large_list_head_.store(pack(/*tag=*/0, kEndOfList));
+  drained_list_head_.store(pack(/*tag=*/0, kEndOfList));
+
+  // smaller block ids are allocated first. the first large block is split
+  // for the padding block and the blocks out of large blocks are free blocks.
+  std::vector<int32_t> block_ids;
+  std::vector<int32_t> large_block_ids;
+  for (uint32_t i = 0; i < total_blocks; ++i) {
+    const uint32_t large_block = i / blocks_per_large_block;
+    if (large_block == 0 || large_block >= num_large_blocks_) {
+      block_ids.push_back(i);
+    } else if (i % blocks_per_large_block == 0) {
+      large_block_ids.push_back(i);
+    }
+  }
+  push(&free_list_head_, block_ids.data(), block_ids.size());
+  if (!large_block_ids.empty()) {
+    push(&free_large_list_head_,
+         large_block_ids.data(),
+         large_block_ids.size());
+    num_free_large_blocks_.store(large_block_ids.size());
   }
 }
 
 BlockAllocator::~BlockAllocator() {
-  CHECK(num_free_blocks_ == free_blocks_.size())
+  CHECK(num_free_blocks() + num_drained_blocks_.load() == num_total_blocks())
       << "Not all blocks have been freed";
 }
 
 // allocate a list of block ids
 std::vector<Block> BlockAllocator::allocate(uint32_t n_blocks) {
-  CHECK(n_blocks <= num_free_blocks_) << "Not enough blocks available";
+  reserve(n_blocks);
   std::vector<Block> blocks;
   blocks.reserve(n_blocks);
   for (uint32_t i = 0; i < n_blocks; ++i) {
-    const int32_t block_id = free_blocks_[--num_free_blocks_];
-    blocks.emplace_back(block_id, this);
+    blocks.push_back(make_block(pop()));
   }
   return blocks;
 }
 
 // allocate a block id
 Block BlockAllocator::allocate() {
-  CHECK(num_free_blocks_ > 0) << "No more blocks available";
-  const int32_t block_id = free_blocks_[--num_free_blocks_];
-  return {block_id, this};
+  size_t n_free = num_free_blocks_.load(std::memory_order_relaxed);
+  do {
+    CHECK(n_free > 0) << "No more blocks available";
+  } while (!num_free_blocks_.compare_exchange_weak(
+      n_free, n_free - 1, std::memory_order_acquire));
+  return make_block(pop());
+}
+
+std::vector<Block> BlockAllocator::allocate_contiguous(uint32_t n_blocks) {
+  if (n_blocks == 0 || n_blocks > num_free_blocks()) {
+    return {};
+  }
+
+  // take all free blocks and sort them by id
+  std::vector<int32_t> block_ids = take_free_blocks();
+  std::sort(block_ids.begin(), block_ids.end());
+
+  // find the first run of n consecutive block ids
+  size_t run_start = 0;
+  bool found = false;
+  for (size_t i = 1; i <= block_ids.size(); ++i) {
+    if (i - run_start == n_blocks) {
+      found = true;
+      break;
+    }
+    if (i < block_ids.size() && block_ids[i] != block_ids[i - 1] + 1) {
+      run_start = i;
+    }
+  }
+
+  std::vector<Block> blocks;
+  if (found) {
+    num_free_blocks_.fetch_sub(n_blocks, std::memory_order_acquire);
+    const auto first = block_ids.begin() + run_start;
+    blocks.reserve(n_blocks);
+    for (auto it = first; it != first + n_blocks; ++it) {
+      blocks.push_back(make_block(*it));
+    }
+    block_ids.erase(first, first + n_blocks);
+  }
+  // return the rest in order, smaller block ids are allocated first
+  put_free_blocks(block_ids);
+  return blocks;
+}
+
+std::vector<Block> BlockAllocator::allocate_large_block() {
+  if (num_large_blocks_ == 0) {
+    return {};
+  }
+  // reserve the blocks first to keep the free block count exact
+  const uint32_t n_blocks = blocks_per_large_block_;
+  size_t n_free = num_free_blocks_.load(std::memory_order_relaxed);
+  do {
+    if (n_free < n_blocks) {
+      return {};
+    }
+  } while (!num_free_blocks_.compare_exchange_weak(
+      n_free, n_free - n_blocks, std::memory_order_acquire));
+
+  const int32_t first = pop(&free_large_list_head_);
+  if (first == kEndOfList) {
+    num_free_blocks_.fetch_add(n_blocks, std::memory_order_release);
+    return {};
+  }
+  num_free_large_blocks_.fetch_sub(1, std::memory_order_relaxed);
+  std::vector<Block> blocks;
+  blocks.reserve(n_blocks);
+  for (uint32_t i = 0; i < n_blocks; ++i) {
+    blocks.push_back(make_block(first + static_cast<int32_t>(i)));
+  }
+  return blocks;
+}
+
+void BlockAllocator::merge_free_blocks() {
+  if (num_large_blocks_ == 0) {
+    return;
+  }
+  put_free_blocks(take(&free_list_head_));
+}
+
+bool BlockAllocator::grow(uint32_t n_blocks) {
+  const size_t n_total = num_total_blocks();
+  if (is_shrinking() || n_blocks < n_total || n_blocks > max_blocks_) {
+    return false;
+  }
+  if (blocks_per_large_block_ > 1) {
+    num_large_blocks_ = n_blocks / blocks_per_large_block_;
+  }
+  // smaller block ids are allocated first
+  std::vector<int32_t> block_ids = take_free_blocks();
+  for (size_t id = n_total; id < n_blocks; ++id) {
+    block_ids.push_back(static_cast<int32_t>(id));
+  }
+  std::sort(block_ids.begin(), block_ids.end());
+  put_free_blocks(block_ids);
+  num_total_blocks_.store(n_blocks, std::memory_order_relaxed);
+  block_limit_.store(n_blocks);
+  num_free_blocks_.fetch_add(n_blocks - n_total, std::memory_order_release);
+  return true;
+}
+
+void BlockAllocator::begin_shrink(uint32_t n_blocks) {
+  CHECK(n_blocks > 0 && n_blocks <= block_limit_.load())
+      << "can't shrink to " << n_blocks << " blocks";
+  block_limit_.store(n_blocks);
+  if (blocks_per_large_block_ > 1) {
+    num_large_blocks_ = n_blocks / blocks_per_large_block_;
+  }
+  drain_free_blocks();
+}
+
+bool BlockAllocator::finish_shrink() {
+  if (!is_shrinking()) {
+    return true;
+  }
+  // catch the blocks released while the shrink began
+  drain_free_blocks();
+  const uint32_t limit = block_limit_.load();
+  if (num_drained_blocks_.load() + limit < num_total_blocks()) {
+    return false;
+  }
+  take(&drained_list_head_);
+  num_drained_blocks_.store(0);
+  num_total_blocks_.store(limit, std::memory_order_relaxed);
+  return true;
+}
+
+void BlockAllocator::drain_free_blocks() {
+  const int32_t limit = static_cast<int32_t>(block_limit_.load());
+  std::vector<int32_t> block_ids = take_free_blocks();
+  const auto it =
+      std::partition(block_ids.begin(), block_ids.end(), [limit](int32_t id) {
+        return id < limit;
+      });
+  const size_t n_drained = std::distance(it, block_ids.end());
+  if (n_drained > 0) {
+    push(&drained_list_head_, &*it, n_drained);
+    num_free_blocks_.fetch_sub(n_drained, std::memory_order_acquire);
+    num_drained_blocks_.fetch_add(n_drained);
+  }
+  block_ids.erase(it, block_ids.end());
+  // smaller block ids are allocated first
+  std::sort(block_ids.begin(), block_ids.end());
+  put_free_blocks(block_ids);
+}
+
+void BlockAllocator::reserve(uint32_t n_blocks) {
+  size_t n_free = num_free_blocks_.load(std::memory_order_relaxed);
+  do {
+    CHECK(n_blocks <= n_free) << "Not enough blocks available";
+  } while (!num_free_blocks_.compare_exchange_weak(
+      n_free, n_free - n_blocks, std::memory_order_acquire));
+}
+
+int32_t BlockAllocator::pop() {
+  while (true) {
+    const int32_t block_id = pop(&free_list_head_);
+    if (block_id != kEndOfList) {
+      return block_id;
+    }
+    // split a free large block, keeping its first block
+    const int32_t first = pop(&free_large_list_head_);
+    if (first != kEndOfList) {
+      num_free_large_blocks_.fetch_sub(1, std::memory_order_relaxed);
+      std::vector<int32_t> block_ids(blocks_per_large_block_ - 1);
+      std::iota(block_ids.begin(), block_ids.end(), first + 1);
+      push(&free_list_head_, block_ids.data(), block_ids.size());
+      return first;
+    }
+    // blocks are reserved before popping, the lists can only be empty while
+    // another thread is splitting a large block
+    CHECK_GT(num_large_blocks_, 0) << "free block list is corrupted";
+  }
+}
+
+int32_t BlockAllocator::pop(std::atomic<uint64_t>* head) {
+  uint64_t old_head = head->load(std::memory_order_acquire);
+  while (true) {
+    const int32_t block_id = block_id_of(old_head);
+    if (block_id == kEndOfList) {
+      return kEndOfList;
+    }
+    const int32_t next =
+        next_free_blocks_[block_id].load(std::memory_order_relaxed);
+    if (head->compare_exchange_weak(old_head,
+                                    pack(tag_of(old_head) + 1, next),
+                                    std::memory_order_acq_rel,
+                                    std::memory_order_acquire)) {
+      return block_id;
+    }
+  }
+}
+
+void BlockAllocator::push(std::atomic<uint64_t>* head,
+                          const int32_t* block_ids,
+                          size_t n_blocks) {
+  if (n_blocks == 0) {
+    return;
+  }
+  // link the blocks into a chain first, then publish it with a single swap
+  for (size_t i = 0; i + 1 < n_blocks; ++i) {
+    next_free_blocks_[block_ids[i]].store(block_ids[i + 1],
+                                          std::memory_order_relaxed);
+  }
+  const int32_t last = block_ids[n_blocks - 1];
+  uint64_t old_head = head->load(std::memory_order_relaxed);
+  do {
+    next_free_blocks_[last].store(block_id_of(old_head),
+                                  std::memory_order_relaxed);
+  } while (!head->compare_exchange_weak(
+      old_head,
+      pack(tag_of(old_head) + 1, block_ids[0]),
+      std::memory_order_release,
+      std::memory_order_relaxed));
+}
+
+std::vector<int32_t> BlockAllocator::take(std::atomic<uint64_t>* head) {
+  uint64_t old_head = head->load(std::memory_order_relaxed);
+  while (!head->compare_exchange_weak(old_head,
+                                      pack(tag_of(old_head) + 1, kEndOfList),
+                                      std::memory_order_acquire,
+                                      std::memory_order_relaxed)) {
+  }
+  // the taken chain is not reachable by other threads anymore
+  std::vector<int32_t> block_ids;
+  for (int32_t block_id = block_id_of(old_head); block_id != kEndOfList;
+       block_id = next_free_blocks_[block_id].load(std::memory_order_relaxed)) {
+    block_ids.push_back(block_id);
+  }
+  return block_ids;
+}
+
+std::vector<int32_t> BlockAllocator::take_free_blocks() {
+  std::vector<int32_t> block_ids = take(&free_list_head_);
+  const std::vector<int32_t> large_block_ids = take(&free_large_list_head_);
+  num_free_large_blocks_.fetch_sub(large_block_ids.size(),
+                                   std::memory_order_relaxed);
+  for (const int32_t first : large_block_ids) {
+    for (uint32_t i = 0; i < blocks_per_large_block_; ++i) {
+      block_ids.push_back(first + static_cast<int32_t>(i));
+    }
+  }
+  return block_ids;
+}
+
+void BlockAllocator::put_free_blocks(const std::vector<int32_t>& block_ids) {
+  // count the free blocks of each large block
+  std::vector<uint32_t> n_free_blocks(num_large_blocks_, 0);
+  for (const int32_t block_id : block_ids) {
+    const uint32_t large_block = block_id / blocks_per_large_block_;
+    if (large_block < num_large_blocks_) {
+      ++n_free_blocks[large_block];
+    }
+  }
+
+  std::vector<int32_t> free_block_ids;
+  std::vector<int32_t> large_block_ids;
+  for (const int32_t block_id : block_ids) {
+    const uint32_t large_block = block_id / blocks_per_large_block_;
+    if (large_block < num_large_blocks_ &&
+        n_free_blocks[large_block] == blocks_per_large_block_) {
+      if (block_id % blocks_per_large_block_ == 0) {
+        large_block_ids.push_back(block_id);
+      }
+    } else {
+      free_block_ids.push_back(block_id);
+    }
+  }
+  push(&free_large_list_head_, large_block_ids.data(), large_block_ids.size());
+  num_free_large_blocks_.fetch_add(large_block_ids.size(),
+                                   std::memory_order_relaxed);
+  push(&free_list_head_, free_block_ids.data(), free_block_ids.size());
+}
+
+Block BlockAllocator::make_block(int32_t local_id) {
+  return {local_id + first_block_id_, this};
 }
 
 // caller should make sure the block_id is valid
 void BlockAllocator::free(int32_t block_id) {
-  CHECK(num_free_blocks_ < free_blocks_.size());
-  free_blocks_[num_free_blocks_++] = block_id;
+  block_id -= first_block_id_;
+  DCHECK(block_id >= 0 && block_id < static_cast<int32_t>(num_total_blocks()));
+  if (block_id >= static_cast<int32_t>(block_limit_.load())) {
+    // set aside for the shrink in progress
+    push(&drained_list_head_, &block_id, 1);
+    num_drained_blocks_.fetch_add(1);
+    return;
+  }
+  push(&free_list_head_, &block_id, 1);
+  num_free_blocks_.fetch_add(1, std::memory_order_release);
+}
+
+void BlockAllocator::free(const std::vector<int32_t>& block_ids) {
+  if (block_ids.empty()) {
+    return;
+  }
+  if (is_shrinking()) {
+    for (const int32_t block_id : block_ids) {
+      free(block_id);
+    }
+    return;
+  }
+  CHECK(num_free_blocks() + block_ids.size() <= num_total_blocks());
+  if (first_block_id_ != 0) {
+    std::vector<int32_t> local_ids(block_ids);
+    for (auto& block_id : local_ids) {
+      block_id -= first_block_id_;
+    }
+    push(&free_list_head_, local_ids.data(), local_ids.size());
+  } else {
+    push(&free_list_head_, block_ids.data(), block_ids.size());
+  }
+  num_free_blocks_.fetch_add(block_ids.size(), std::memory_order_release);
 }
 
 }  // namespace llm
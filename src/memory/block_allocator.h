@@ -1,20 +1,45 @@
 #pragma once
 #include <glog/logging.h>
 
+#include <atomic>
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 #include "block.h"
 
 namespace llm {
 
-// BlockAllocator is used to track memory blocks. It is not thread safe.
+// BlockAllocator is used to track memory blocks. It is thread safe and lock
+// free, so that blocks can be released from any thread.
 // Please note: The actual memory has been allocated outside of this class.
 // This class only manages the allocation and deallocation of block ids.
+// Free block ids are kept in an intrusive linked list, and the reference
+// counts of all blocks live in one array owned by the allocator.
+// Optionally, the blocks are grouped into aligned large blocks of consecutive
+// block ids, buddy style. Free large blocks are kept in a second list and
+// split into blocks on demand. Released blocks are merged back into large
+// blocks lazily by merge_free_blocks().
+// The number of blocks can change at runtime up to max_blocks: grow() adds
+// the block ids after the current ones, and a shrink drains the block ids
+// at the end, which are not allocated again but set aside as they are
+// released, until all of them are released.
+// The block ids can start from an offset, so that several allocators share
+// one id space, e.g. one for the kv cache of each data parallel attention
+// group. The offset is only seen by the blocks.
 class BlockAllocator final {
  public:
   // block_size: number of slots per block
-  BlockAllocator(uint32_t total_blocks, uint32_t block_size);
+  // blocks_per_large_block: number of blocks per large block, must be a
+  // power of 2. 1 means large blocks are disabled.
+  // max_blocks: the max number of blocks to grow to, 0 to not grow beyond
+  // total_blocks.
+  // first_block_id: the id of the first block
+  BlockAllocator(uint32_t total_blocks,
+                 uint32_t block_size,
+                 uint32_t blocks_per_large_block = 1,
+                 uint32_t max_blocks = 0,
+                 int32_t first_block_id = 0);
 
   ~BlockAllocator();
 
@@ -30,27 +55,176 @@ class BlockAllocator final {
   // allocate a block
   Block allocate();
 
+  // allocate a run of n blocks with consecutive ids, the one with the
+  // smallest ids. returns an empty list if there is no such run. the free
+  // list is sorted by block id along the way, so that following allocations
+  // are more likely to get consecutive ids.
+  // N.B. all free blocks are taken temporarily, it should not be called
+  // concurrently with other allocations.
+  std::vector<Block> allocate_contiguous(uint32_t n_blocks);
+
+  // allocate the blocks of a free large block, which have consecutive ids.
+  // returns an empty list if there is no free large block.
+  std::vector<Block> allocate_large_block();
+
+  // merge the free blocks of fully released large blocks back into large
+  // blocks. N.B. it should not be called concurrently with other allocations.
+  void merge_free_blocks();
+
+  // add free blocks to have n_blocks blocks in total, up to max_blocks.
+  // returns false if n_blocks is out of range or a shrink is in progress.
+  // N.B. it should not be called concurrently with other allocations.
+  bool grow(uint32_t n_blocks);
+
+  // start to shrink to n_blocks blocks in total. the free blocks at the end
+  // are set aside right away, and the ones in use as they are released.
+  // shrinking again to fewer blocks is allowed while in progress.
+  // N.B. it should not be called concurrently with other allocations.
+  void begin_shrink(uint32_t n_blocks);
+
+  // finish the shrink once all blocks at the end are released, returns true
+  // if there is no shrink in progress afterwards.
+  // N.B. it should not be called concurrently with other allocations.
+  bool finish_shrink();
+
+  // check if a shrink is in progress
+  bool is_shrinking() const {
+    return block_limit_.load(std::memory_order_relaxed) < num_total_blocks();
+  }
+
+  // get the number of blocks to allocate from, smaller than the total block
+  // count while a shrink is in progress
+  uint32_t block_limit() const {
+    return block_limit_.load(std::memory_order_relaxed);
+  }
+
+  // get number of blocks at the end still in use by a shrink in progress
+  size_t num_draining_blocks() const {
+    return num_total_blocks() - block_limit_.load(std::memory_order_relaxed) -
+           num_drained_blocks_.load(std::memory_order_relaxed);
+  }
+
   // get number of slots per block
   size_t block_size() const { return block_size_; }
 
+  // get the id of the first block
+  int32_t first_block_id() const { return first_block_id_; }
+
   // get number of free blocks
-  size_t num_free_blocks() const { return num_free_blocks_; }
+  size_t num_free_blocks() const {
+    return num_free_blocks_.load(std::memory_order_relaxed);
+  }
+
+  // get number of total blocks, including the ones being drained by a
+  // shrink in progress
+  size_t num_total_blocks() const {
+    return num_total_blocks_.load(std::memory_order_relaxed);
+  }
+
+  // get the max number of blocks to grow to
+  size_t max_blocks() const { return max_blocks_; }
 
-  // get number of total blocks
-  size_t num_total_blocks() const { return free_blocks_.size(); }
+  // get number of blocks per large block
+  uint32_t blocks_per_large_block() const { return blocks_per_large_block_; }
+
+  // get number of free large blocks, whose blocks are also counted as free
+  // blocks
+  size_t num_free_large_blocks() const {
+    return num_free_large_blocks_.load(std::memory_order_relaxed);
+  }
 
  private:
   friend class Block;
+
+  // return block ids to the free list
   void free(int32_t block_id);
+  void free(const std::vector<int32_t>& block_ids);
+
+  // reference count of the block
+  std::atomic<uint32_t>* ref_count(int32_t block_id) {
+    return &ref_counts_[block_id - first_block_id_];
+  }
+
+  // create a block for the id out of the free lists
+  Block make_block(int32_t local_id);
+
+  // reserve n free blocks, the caller can pop them from the free list
+  void reserve(uint32_t n_blocks);
+
+  // pop a block id from the free list, splitting a free large block if the
+  // list is empty. should be reserved first.
+  int32_t pop();
+
+  // pop an id from the list, returns -1 if the list is empty
+  int32_t pop(std::atomic<uint64_t>* head);
+
+  // push a chain of ids to the list
+  void push(std::atomic<uint64_t>* head,
+            const int32_t* block_ids,
+            size_t n_blocks);
+
+  // take all ids out of the list
+  std::vector<int32_t> take(std::atomic<uint64_t>* head);
+
+  // take all free block ids out of both lists, the large blocks are expanded
+  // into their blocks. the free block count is not changed.
+  std::vector<int32_t> take_free_blocks();
+
+  // put the free block ids back in order, merging the ones covering a whole
+  // large block. the free block count is not changed.
+  void put_free_blocks(const std::vector<int32_t>& block_ids);
+
+  // move the free block ids beyond the block limit to the drained list
+  void drain_free_blocks();
 
   // free block count
-  size_t num_free_blocks_ = 0;
+  std::atomic<size_t> num_free_blocks_{0};
+
+  // total block count
+  std::atomic<size_t> num_total_blocks_{0};
+
+  // the capacity of the per block arrays
+  size_t max_blocks_ = 0;
+
+  // block ids from the limit on are drained instead of freed, equal to the
+  // total block count without a shrink in progress.
+  std::atomic<uint32_t> block_limit_{0};
+
+  // released block ids beyond the block limit, not counted as free blocks
+  std::atomic<size_t> num_drained_blocks_{0};
 
   // number of slots per block
   size_t block_size_ = 0;
 
-  // free block list
-  std::vector<int32_t> free_blocks_;
+  // the id of the first block, the free lists and the per block arrays are
+  // indexed from 0
+  int32_t first_block_id_ = 0;
+
+  // number of blocks per large block
+  uint32_t blocks_per_large_block_ = 1;
+
+  // number of large blocks fitting in the total blocks
+  uint32_t num_large_blocks_ = 0;
+
+  // free large block count
+  std::atomic<size_t> num_free_large_blocks_{0};
+
+  // head of the free list, packed as (tag << 32 | block_id). the tag is bumped
+  // for each update to avoid the ABA problem.
+  std::atomic<uint64_t> free_list_head_{0};
+
+  // head of the free large block list, linked by their first block ids in
+  // the same way.
+  std::atomic<uint64_t> free_large_list_head_{0};
+
+  // head of the list of drained block ids, linked in the same way.
+  std::atomic<uint64_t> drained_list_head_{0};
+
+  // next free block id for each block in the free list
+  std::unique_ptr<std::atomic<int32_t>[]> next_free_blocks_;
+
+  // reference count for each block
+  std::unique_ptr<std::atomic<uint32_t>[]> ref_counts_;
 };
 
 }  // namespace llm
@@ -2,6 +2,9 @@
 
 #include <gtest/gtest.h>
 
+#include <thread>
+#include <vector>
+
 namespace llm {
 
 TEST(BlockAllocatorTest, Basic) {
@@ -101,4 +104,211 @@ TEST(BlockAllocatorTest, Basic) {
   }
 }
 
-}  // namespace llm
\ No newline at end of file
+TEST(BlockAllocatorTest, BatchRelease) {
+  const uint32_t n_blocks = 10;
+  const uint32_t block_size = 2;
+  BlockAllocator allocator(n_blocks, block_size);
+
+  auto blocks = allocator.allocate(4);
+  EXPECT_EQ(allocator.num_free_blocks(), n_blocks - 4);
+  // shared blocks are kept until the last reference is released
+  const Block shared = blocks[1];
+  Block::release(&blocks);
+  EXPECT_TRUE(blocks.empty());
+  EXPECT_EQ(allocator.num_free_blocks(), n_blocks - 1);
+  EXPECT_EQ(shared.ref_count(), 1);
+
+  // released blocks are allocated again in the same order
+  auto new_blocks = allocator.allocate(3);
+  EXPECT_EQ(new_blocks[0].id(), 0);
+  EXPECT_EQ(new_blocks[1].id(), 2);
+  EXPECT_EQ(new_blocks[2].id(), 3);
+}
+
+TEST(BlockAllocatorTest, AllocateContiguous) {
+  const uint32_t n_blocks = 10;
+  const uint32_t block_size = 2;
+  BlockAllocator allocator(n_blocks, block_size);
+
+  // leave free blocks 1, 3, 4, 6, 7, 8 scattered in the free list
+  auto blocks = allocator.allocate(n_blocks);
+  std::vector<Block> held = {blocks[0], blocks[2], blocks[5], blocks[9]};
+  for (int32_t id : {7, 3, 8, 1, 6, 4}) {
+    blocks[id] = Block();
+  }
+  blocks.clear();
+  EXPECT_EQ(allocator.num_free_blocks(), 6);
+
+  EXPECT_TRUE(allocator.allocate_contiguous(4).empty());
+  EXPECT_EQ(allocator.num_free_blocks(), 6);
+
+  auto run = allocator.allocate_contiguous(3);
+  ASSERT_EQ(run.size(), 3);
+  EXPECT_EQ(run[0].id(), 6);
+  EXPECT_EQ(run[1].id(), 7);
+  EXPECT_EQ(run[2].id(), 8);
+  EXPECT_EQ(run[0].ref_count(), 1);
+  EXPECT_EQ(allocator.num_free_blocks(), 3);
+
+  // the rest of the free list is sorted by block id
+  auto rest = allocator.allocate(3);
+  EXPECT_EQ(rest[0].id(), 1);
+  EXPECT_EQ(rest[1].id(), 3);
+  EXPECT_EQ(rest[2].id(), 4);
+}
+
+TEST(BlockAllocatorTest, LargeBlocks) {
+  const uint32_t n_blocks = 18;
+  const uint32_t block_size = 2;
+  // large blocks [4, 8), [8, 12) and [12, 16), the rest are free blocks
+  BlockAllocator allocator(n_blocks, block_size, /*blocks_per_large_block=*/4);
+  EXPECT_EQ(allocator.num_free_blocks(), n_blocks);
+  EXPECT_EQ(allocator.num_free_large_blocks(), 3);
+
+  auto blocks = allocator.allocate(5);
+  EXPECT_EQ(blocks[0].id(), 0);
+  EXPECT_EQ(blocks[3].id(), 3);
+  EXPECT_EQ(blocks[4].id(), 16);
+
+  auto large_block = allocator.allocate_large_block();
+  ASSERT_EQ(large_block.size(), 4);
+  EXPECT_EQ(large_block[0].id(), 4);
+  EXPECT_EQ(large_block[3].id(), 7);
+  EXPECT_EQ(allocator.num_free_large_blocks(), 2);
+  EXPECT_EQ(allocator.num_free_blocks(), n_blocks - 9);
+
+  // a large block is split when the free blocks run out
+  auto more = allocator.allocate(2);
+  EXPECT_EQ(more[0].id(), 17);
+  EXPECT_EQ(more[1].id(), 8);
+  EXPECT_EQ(allocator.num_free_large_blocks(), 1);
+
+  // released blocks are merged back into a large block
+  large_block.clear();
+  EXPECT_EQ(allocator.num_free_large_blocks(), 1);
+  allocator.merge_free_blocks();
+  EXPECT_EQ(allocator.num_free_large_blocks(), 2);
+  EXPECT_EQ(allocator.num_free_blocks(), n_blocks - 7);
+
+  // the split large block is merged once all its blocks are released
+  auto single = allocator.allocate();
+  EXPECT_EQ(single.id(), 9);
+  more.clear();
+  allocator.merge_free_blocks();
+  EXPECT_EQ(allocator.num_free_large_blocks(), 2);
+  single = Block();
+  allocator.merge_free_blocks();
+  EXPECT_EQ(allocator.num_free_large_blocks(), 3);
+  EXPECT_EQ(allocator.num_free_blocks(), n_blocks - 5);
+}
+
+TEST(BlockAllocatorTest, GrowAndShrink) {
+  const uint32_t block_size = 2;
+  BlockAllocator allocator(/*total_blocks=*/4,
+                           block_size,
+                           /*blocks_per_large_block=*/1,
+                           /*max_blocks=*/8);
+  EXPECT_EQ(allocator.max_blocks(), 8);
+  EXPECT_FALSE(allocator.grow(9));
+  EXPECT_TRUE(allocator.grow(8));
+  EXPECT_EQ(allocator.num_total_blocks(), 8);
+  EXPECT_EQ(allocator.num_free_blocks(), 8);
+
+  auto blocks = allocator.allocate(6);
+  EXPECT_EQ(blocks[0].id(), 0);
+  EXPECT_EQ(blocks[5].id(), 5);
+
+  // the free blocks 6 and 7 are drained right away
+  allocator.begin_shrink(3);
+  EXPECT_TRUE(allocator.is_shrinking());
+  EXPECT_EQ(allocator.num_free_blocks(), 0);
+  EXPECT_EQ(allocator.num_draining_blocks(), 3);
+  EXPECT_FALSE(allocator.grow(8));
+  EXPECT_FALSE(allocator.finish_shrink());
+
+  // released blocks beyond the limit are not allocated again
+  blocks[4] = Block();
+  EXPECT_EQ(allocator.num_draining_blocks(), 2);
+  blocks[1] = Block();
+  EXPECT_EQ(allocator.num_free_blocks(), 1);
+  Block single = allocator.allocate();
+  EXPECT_EQ(single.id(), 1);
+
+  blocks.clear();
+  EXPECT_EQ(allocator.num_draining_blocks(), 0);
+  EXPECT_TRUE(allocator.finish_shrink());
+  EXPECT_FALSE(allocator.is_shrinking());
+  EXPECT_EQ(allocator.num_total_blocks(), 3);
+  EXPECT_EQ(allocator.num_free_blocks(), 2);
+
+  // grow back with the smaller block ids first
+  single = Block();
+  EXPECT_TRUE(allocator.grow(8));
+  blocks = allocator.allocate(8);
+  for (int32_t i = 0; i < 8; ++i) {
+    EXPECT_EQ(blocks[i].id(), i);
+  }
+}
+
+TEST(BlockAllocatorTest, FirstBlockId) {
+  const uint32_t n_blocks = 4;
+  BlockAllocator allocator(n_blocks,
+                           /*block_size=*/2,
+                           /*blocks_per_large_block=*/1,
+                           /*max_blocks=*/0,
+                           /*first_block_id=*/8);
+  EXPECT_EQ(allocator.first_block_id(), 8);
+  {
+    auto blocks = allocator.allocate(n_blocks);
+    for (uint32_t i = 0; i < n_blocks; ++i) {
+      EXPECT_EQ(blocks[i].id(), static_cast<int32_t>(8 + i));
+      EXPECT_EQ(blocks[i].ref_count(), 1);
+    }
+    Block shared = blocks[3];
+    EXPECT_EQ(blocks[3].ref_count(), 2);
+    EXPECT_EQ(allocator.num_free_blocks(), 0);
+    // released in a batch back into the free list
+    Block::release(&blocks);
+    EXPECT_EQ(allocator.num_free_blocks(), n_blocks - 1);
+  }
+  EXPECT_EQ(allocator.num_free_blocks(), n_blocks);
+
+  // the runs of consecutive ids are offset as well
+  auto blocks = allocator.allocate_contiguous(3);
+  ASSERT_EQ(blocks.size(), 3);
+  for (size_t i = 1; i < blocks.size(); ++i) {
+    EXPECT_EQ(blocks[i].id(), blocks[i - 1].id() + 1);
+    EXPECT_GE(blocks[i - 1].id(), 8);
+  }
+}
+
+TEST(BlockAllocatorTest, ConcurrentAllocateAndRelease) {
+  const uint32_t n_blocks = 64;
+  const uint32_t block_size = 4;
+  const int n_threads = 8;
+  const int n_iterations = 1000;
+  BlockAllocator allocator(n_blocks, block_size);
+
+  std::vector<std::thread> threads;
+  threads.reserve(n_threads);
+  for (int t = 0; t < n_threads; ++t) {
+    threads.emplace_back([&allocator, t]() {
+      for (int i = 0; i < n_iterations; ++i) {
+        // each thread holds at most 8 blocks at a time
+        auto blocks = allocator.allocate(1 + (t + i) % 7);
+        Block single = allocator.allocate();
+        for (const auto& block : blocks) {
+          EXPECT_EQ(block.ref_count(), 1);
+          EXPECT_NE(block.id(), single.id());
+        }
+        Block::release(&blocks);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(allocator.num_free_blocks(), n_blocks);
+}
+
+}  // namespace llm
@@ -2,8 +2,10 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <memory>
+#include <unordered_map>
 #include <vector>
 
 #include "block_allocator.h"
@@ -27,18 +29,156 @@ DEFINE_COUNTER_INSTANCE(prefix_cache_evict_latency_seconds,
 DEFINE_COUNTER(prefix_cache_match_length_total,
                "Length of matched prefix in tokens");
 
+DEFINE_COUNTER(host_prefix_cache_match_length_total,
+               "Length of matched prefix in host prefix cache in tokens");
+
+DEFINE_HISTOGRAM(prefix_cache_hit_tokens,
+                 "Histogram of prompt tokens served from the prefix caches "
+                 "per sequence",
+                 std::vector<double>{0, 16, 64, 256, 1024, 4096, 16384, 65536});
+DEFINE_COUNTER(shared_pool_match_length_total,
+               "Length of matched prefix in the shared kv pool in tokens");
+DEFINE_COUNTER(num_published_blocks_total,
+               "Total number of blocks published to the shared kv pool");
+
+DEFINE_COUNTER(num_demoted_blocks_total,
+               "Total number of evicted blocks demoted to host prefix cache");
+
+DEFINE_COUNTER(num_forked_blocks_total,
+               "Total number of blocks shared with forked sequences");
+DEFINE_COUNTER(num_copied_blocks_total,
+               "Total number of partially filled blocks copied on fork");
+
+DEFINE_COUNTER(num_compacted_blocks_total,
+               "Total number of blocks moved into consecutive blocks by "
+               "compaction");
+
+DEFINE_COUNTER(num_received_blocks_total,
+               "Total number of blocks received from other engines, e.g. "
+               "prefilled by a prefill engine");
+
+DEFINE_COUNTER(num_imported_blocks_total,
+               "Total number of blocks imported into the prefix cache");
+
+DEFINE_COUNTER(num_large_blocks_allocated_total,
+               "Total number of large blocks of consecutive blocks allocated");
+
 DEFINE_COUNTER(allocate_blocks_latency_seconds,
                "Latency of blocks allocation in seconds");
 
+DEFINE_COUNTER(num_out_of_window_blocks_total,
+               "Total number of blocks released after scrolling out of the "
+               "sliding window");
+
+DEFINE_COUNTER(num_evicted_kv_blocks_total,
+               "Total number of blocks evicted from the kv cache of sequences "
+               "for receiving the least attention");
+
+DEFINE_COUNTER(num_offloaded_blocks_total,
+               "Total number of blocks of running sequences offloaded to host "
+               "memory and attended on host");
+
+DEFINE_COUNTER_FAMILY(num_swapped_blocks_total,
+                      "Total number of blocks swapped between device and host");
+DEFINE_COUNTER_INSTANCE(num_swapped_out_blocks_total,
+                        num_swapped_blocks_total,
+                        {{"direction", "out"}});
+DEFINE_COUNTER_INSTANCE(num_swapped_in_blocks_total,
+                        num_swapped_blocks_total,
+                        {{"direction", "in"}});
+
 namespace llm {
+namespace {
+
+uint32_t blocks_per_large_block(const BlockManager::Options& options) {
+  if (options.large_block_size() <= 0) {
+    return 1;
+  }
+  CHECK(options.large_block_size() % options.block_size() == 0)
+      << "Large block size must be a multiple of block size, got "
+      << options.large_block_size();
+  return options.large_block_size() / options.block_size();
+}
+
+uint32_t blocks_per_group(const BlockManager::Options& options) {
+  const int32_t n_groups = options.num_block_groups();
+  CHECK(n_groups > 0 && options.num_blocks() % n_groups == 0)
+      << "Number of blocks " << options.num_blocks()
+      << " is not divisible by the number of block groups " << n_groups;
+  return options.num_blocks() / n_groups;
+}
+
+}  // namespace
 
 BlockManager::BlockManager(const Options& options)
     : options_(options),
-      block_allocator_(options.num_blocks(), options.block_size()),
+      block_allocator_(blocks_per_group(options),
+                       options.block_size(),
+                       blocks_per_large_block(options),
+                       options.max_num_blocks()),
       prefix_cache_(options.block_size()) {
   // reserve block 0 for padding
   padding_block_ = block_allocator_.allocate();
   CHECK_EQ(padding_block_.id(), 0) << "Padding block id should be 0";
+
+  if (options.num_block_groups() > 1) {
+    CHECK(!options.enable_prefix_cache() &&
+          blocks_per_large_block(options) == 1 &&
+          options.max_num_blocks() == 0 && options.num_host_blocks() == 0 &&
+          options.kv_budget() == 0 && options.sliding_window() < 0)
+        << "Unsupported block manager options for block groups";
+    const uint32_t n_blocks = blocks_per_group(options);
+    for (int32_t g = 1; g < options.num_block_groups(); ++g) {
+      auto& allocator =
+          group_allocators_.emplace_back(std::make_unique<BlockAllocator>(
+              n_blocks,
+              options.block_size(),
+              /*blocks_per_large_block=*/1,
+              /*max_blocks=*/0,
+              /*first_block_id=*/g * n_blocks));
+      // reserve the first block of each group for padding
+      group_padding_blocks_.push_back(allocator->allocate());
+    }
+  }
+
+  if (options.num_host_blocks() > 0) {
+    host_block_allocator_ = std::make_unique<BlockAllocator>(
+        options.num_host_blocks(), options.block_size());
+    if (options.enable_prefix_cache() && options.enable_host_prefix_cache()) {
+      host_prefix_cache_ =
+          std::make_unique<HostPrefixCache>(options.block_size());
+    }
+  }
+
+  if (options.enable_prefix_cache() && !options.shared_pool_name().empty()) {
+    shared_pool_ =
+        std::make_unique<SharedBlockPool>(options.shared_pool_name(),
+                                          options.num_shared_blocks(),
+                                          options.block_size(),
+                                          options.shared_pool_layout_key());
+  }
+
+  if (options_.kv_budget() > 0 && options_.sliding_window() >= 0) {
+    LOG(WARNING) << "kv cache eviction is not supported with sliding window";
+    options_.kv_budget(0);
+  }
+  if (options_.hybrid_attention_device_blocks() > 0 &&
+      (options_.kv_budget() > 0 || options_.sliding_window() >= 0)) {
+    LOG(WARNING) << "hybrid attention is not supported with kv cache "
+                    "eviction or sliding window";
+    options_.hybrid_attention_device_blocks(0);
+  }
+}
+
+BlockManager::~BlockManager() {
+  if (shared_pool_ == nullptr) {
+    return;
+  }
+  // the copies to the pool may not have run, don't publish their slots
+  shared_pool_->cancel(shared_slots_to_commit_);
+  shared_pool_->cancel(shared_slots_written_);
+  shared_pool_->release(shared_slots_to_release_);
+  shared_pool_->release(shared_slots_read_);
 }
 
 bool BlockManager::allocate_blocks_for(Sequence* sequence) {
@@ -50,26 +190,51 @@ bool BlockManager::allocate_blocks_for(Sequence* sequence, size_t num_tokens) {
   AUTO_COUNTER(allocate_blocks_latency_seconds);
 
   DCHECK(sequence != nullptr);
-  // first try to allocate shared blocks
-  if (sequence->num_blocks() == 0) {
+  if (sequence->is_swapped_out()) {
+    // bring the kv cache back before allocating new blocks
+    if (!swap_in_blocks_for(sequence)) {
+      return false;
+    }
+  } else if (sequence->num_blocks() == 0) {
+    // first try to allocate shared blocks
     allocate_shared_blocks_for(sequence);
+  } else {
+    // reuse the blocks scrolled out of the window or evicted first
+    release_out_of_window_blocks_for(sequence);
+    evict_kv_blocks_for(sequence);
+  }
+
+  // observe the attention over the kv cache when the long prompt is processed
+  if (options_.kv_budget() > 0 && sequence->beam_width() == 0 &&
+      sequence->num_prompt_tokens() >
+          static_cast<size_t>(options_.kv_budget())) {
+    sequence->set_kv_observation_window(options_.kv_observation_window());
   }
 
   const size_t num_blocks = sequence->num_blocks();
-  // round up to the nearest block number
+  // round up to the nearest block number, the kv cache of the evicted tokens
+  // takes no blocks
   const size_t block_size = options_.block_size();
-  const size_t num_blocks_needed = (num_tokens + block_size - 1) / block_size;
+  CHECK_GE(num_tokens, sequence->num_evicted_tokens());
+  const size_t num_kv_tokens = num_tokens - sequence->num_evicted_tokens();
+  const size_t num_blocks_needed =
+      (num_kv_tokens + block_size - 1) / block_size;
   if (num_blocks_needed <= num_blocks) {
     return true;
   }
 
   const uint32_t num_additional_blocks = num_blocks_needed - num_blocks;
-  if (!has_enough_blocks(num_additional_blocks)) {
-    // not enough blocks
-    return false;
+  const int32_t group = block_group_of(*sequence);
+  if (!has_enough_blocks(num_additional_blocks, /*demote=*/true, group)) {
+    // free the leading blocks of the sequence by offloading them to host
+    if (!offload_blocks_for(sequence) ||
+        !has_enough_blocks(num_additional_blocks, /*demote=*/true, group)) {
+      // not enough blocks
+      return false;
+    }
   }
 
-  const auto block_ids = block_allocator_.allocate(num_additional_blocks);
+  const auto block_ids = allocate_blocks(num_additional_blocks, group);
   sequence->append_blocks(block_ids);
 
   num_blocks_in_use_ += num_additional_blocks;
@@ -111,9 +276,55 @@ void BlockManager::release_blocks_for(Sequence* sequence) {
   sequence->release_blocks();
 }
 
-bool BlockManager::has_enough_blocks(uint32_t num_blocks) {
+std::vector<Block> BlockManager::allocate_blocks(uint32_t n_blocks,
+                                                 int32_t group) {
+  if (group > 0) {
+    // no large blocks with block groups
+    return allocator_of(group).allocate(n_blocks);
+  }
+  const uint32_t n_large = block_allocator_.blocks_per_large_block();
+  if (n_large == 1 || n_blocks < n_large) {
+    return block_allocator_.allocate(n_blocks);
+  }
+
+  // merge the released blocks into large blocks once a large block worth of
+  // blocks has been released since the last merge
+  auto num_free_small_blocks = [this, n_large]() {
+    return block_allocator_.num_free_blocks() -
+           block_allocator_.num_free_large_blocks() * n_large;
+  };
+  min_free_small_blocks_ =
+      std::min(min_free_small_blocks_, num_free_small_blocks());
+  if (block_allocator_.num_free_large_blocks() < n_blocks / n_large &&
+      num_free_small_blocks() >= min_free_small_blocks_ + n_large) {
+    block_allocator_.merge_free_blocks();
+    min_free_small_blocks_ = num_free_small_blocks();
+  }
+
+  std::vector<Block> blocks;
+  blocks.reserve(n_blocks);
+  while (blocks.size() + n_large <= n_blocks) {
+    auto large_block = block_allocator_.allocate_large_block();
+    if (large_block.empty()) {
+      break;
+    }
+    blocks.insert(blocks.end(),
+                  std::make_move_iterator(large_block.begin()),
+                  std::make_move_iterator(large_block.end()));
+    COUNTER_INC(num_large_blocks_allocated_total);
+  }
+  auto rest = block_allocator_.allocate(n_blocks - blocks.size());
+  blocks.insert(blocks.end(),
+                std::make_move_iterator(rest.begin()),
+                std::make_move_iterator(rest.end()));
+  return blocks;
+}
+
+bool BlockManager::has_enough_blocks(uint32_t num_blocks,
+                                     bool demote,
+                                     int32_t group) {
   // still have enough blocks
-  if (num_blocks <= block_allocator_.num_free_blocks()) {
+  if (num_blocks <= allocator_of(group).num_free_blocks()) {
     return true;
   }
 
@@ -127,7 +338,18 @@ bool BlockManager::has_enough_blocks(uint32_t num_blocks) {
       num_blocks - block_allocator_.num_free_blocks();
 
   AUTO_COUNTER(prefix_cache_evict_latency_seconds);
-  const uint32_t n_blocks_evicted = prefix_cache_.evict(n_blocks_to_evict);
+  uint32_t n_blocks_evicted = 0;
+  if (host_prefix_cache_ != nullptr && demote) {
+    // demote evicted blocks to the host prefix cache
+    n_blocks_evicted = prefix_cache_.evict(
+        n_blocks_to_evict,
+        [this](const std::vector<int32_t>& token_ids,
+               const Slice<Block>& blocks) {
+          demote_blocks(token_ids, blocks);
+        });
+  } else {
+    n_blocks_evicted = prefix_cache_.evict(n_blocks_to_evict);
+  }
   if (n_blocks_evicted < n_blocks_to_evict) {
     return false;
   }
@@ -142,9 +364,429 @@ bool BlockManager::has_enough_blocks(uint32_t num_blocks) {
   return false;
 }
 
+bool BlockManager::has_enough_host_blocks(uint32_t num_blocks) {
+  DCHECK(host_block_allocator_ != nullptr);
+  const size_t n_free_blocks = host_block_allocator_->num_free_blocks();
+  if (num_blocks <= n_free_blocks) {
+    return true;
+  }
+  if (host_prefix_cache_ == nullptr) {
+    return false;
+  }
+  // try to evict some blocks from the host prefix cache
+  host_prefix_cache_->evict(num_blocks - n_free_blocks);
+  return num_blocks <= host_block_allocator_->num_free_blocks();
+}
+
+bool BlockManager::offload_blocks_for(Sequence* sequence) {
+  const int32_t n_device_blocks = options_.hybrid_attention_device_blocks();
+  if (n_device_blocks <= 0 || host_block_allocator_ == nullptr ||
+      sequence->beam_width() > 0 || sequence->num_released_blocks() > 0 ||
+      sequence->is_swapped_out()) {
+    return false;
+  }
+  // only the full blocks written into the kv cache are offloaded
+  const size_t block_size = options_.block_size();
+  const size_t n_kv_tokens =
+      sequence->num_kv_cache_tokens() - sequence->num_evicted_tokens();
+  const size_t num_blocks = sequence->num_blocks();
+  if (num_blocks <= static_cast<size_t>(n_device_blocks)) {
+    return false;
+  }
+  const size_t n_to_offload =
+      std::min(num_blocks - n_device_blocks, n_kv_tokens / block_size);
+  if (n_to_offload == 0 || !has_enough_host_blocks(n_to_offload)) {
+    return false;
+  }
+
+  auto host_blocks = host_block_allocator_->allocate(n_to_offload);
+  const auto blocks = sequence->blocks();
+  for (size_t i = 0; i < n_to_offload; ++i) {
+    swap_out_blocks_.push_back(blocks[i].id());
+    swap_out_blocks_.push_back(host_blocks[i].id());
+  }
+  // the device blocks are still valid until the pending copies are done,
+  // which is guaranteed by executing swap out copies before the model.
+  const auto offloaded = sequence->offload_blocks(std::move(host_blocks));
+  release_blocks_in_use(
+      offloaded,
+      options_.enable_prefix_cache() && sequence->prefix_cacheable());
+  COUNTER_ADD(num_offloaded_blocks_total, n_to_offload);
+  return true;
+}
+
+void BlockManager::demote_blocks(const std::vector<int32_t>& token_ids,
+                                 const Slice<Block>& blocks) {
+  DCHECK(host_prefix_cache_ != nullptr);
+  const size_t n_blocks = token_ids.size() / options_.block_size();
+  CHECK_GE(n_blocks, blocks.size());
+  size_t start_block = n_blocks - blocks.size();
+
+  // skip blocks that are already in the host prefix cache
+  const size_t n_cached =
+      host_prefix_cache_->match(token_ids, start_block).size();
+  start_block += n_cached;
+  const size_t n_to_demote = n_blocks - start_block;
+  if (n_to_demote == 0 || !has_enough_host_blocks(n_to_demote)) {
+    return;
+  }
+
+  auto host_blocks = host_block_allocator_->allocate(n_to_demote);
+  const auto device_blocks = blocks.slice(n_cached);
+  for (size_t i = 0; i < n_to_demote; ++i) {
+    swap_out_blocks_.push_back(device_blocks[i].id());
+    swap_out_blocks_.push_back(host_blocks[i].id());
+  }
+  COUNTER_ADD(num_demoted_blocks_total, n_to_demote);
+
+  // the device blocks are still valid until the pending copies are done,
+  // which is guaranteed by executing swap out copies before the model.
+  host_prefix_cache_->insert(token_ids, host_blocks, start_block);
+}
+
+bool BlockManager::swap_out_blocks_for(Request* request) {
+  DCHECK(request != nullptr);
+  if (host_block_allocator_ == nullptr) {
+    return false;
+  }
+
+  size_t num_blocks_needed = 0;
+  for (const auto& sequence : request->sequences) {
+    if (sequence.num_released_blocks() > 0 ||
+        !sequence.offloaded_blocks().empty()) {
+      // the released blocks can't be swapped back, recompute instead
+      return false;
+    }
+    num_blocks_needed += sequence.num_blocks();
+  }
+  if (num_blocks_needed == 0 || !has_enough_host_blocks(num_blocks_needed)) {
+    return false;
+  }
+
+  for (auto& sequence : request->sequences) {
+    const size_t num_blocks = sequence.num_blocks();
+    if (num_blocks == 0) {
+      continue;
+    }
+    auto host_blocks = host_block_allocator_->allocate(num_blocks);
+    const auto blocks = sequence.blocks();
+    for (size_t i = 0; i < num_blocks; ++i) {
+      swap_out_blocks_.push_back(blocks[i].id());
+      swap_out_blocks_.push_back(host_blocks[i].id());
+    }
+    COUNTER_ADD(num_swapped_out_blocks_total, num_blocks);
+
+    // the device blocks are still valid until the pending copies are done,
+    // which is guaranteed by executing swap out copies before the model.
+    cache_blocks_for(&sequence);
+    sequence.swap_out_blocks(std::move(host_blocks));
+  }
+  return true;
+}
+
+bool BlockManager::swap_in_blocks_for(Sequence* sequence) {
+  DCHECK(sequence != nullptr);
+  DCHECK(sequence->is_swapped_out());
+
+  const size_t num_blocks = sequence->host_blocks().size();
+  if (!has_enough_blocks(num_blocks)) {
+    return false;
+  }
+
+  auto device_blocks = allocate_blocks(num_blocks);
+  const auto host_blocks = sequence->host_blocks();
+  for (size_t i = 0; i < num_blocks; ++i) {
+    swap_in_blocks_.push_back(host_blocks[i].id());
+    swap_in_blocks_.push_back(device_blocks[i].id());
+  }
+  COUNTER_ADD(num_swapped_in_blocks_total, num_blocks);
+
+  auto released = sequence->swap_in_blocks(std::move(device_blocks));
+  host_blocks_to_release_.insert(host_blocks_to_release_.end(),
+                                 std::make_move_iterator(released.begin()),
+                                 std::make_move_iterator(released.end()));
+  num_blocks_in_use_ += num_blocks;
+  return true;
+}
+
+std::vector<int32_t> BlockManager::take_swap_out_blocks() {
+  std::vector<int32_t> blocks;
+  blocks.swap(swap_out_blocks_);
+  return blocks;
+}
+
+std::vector<int32_t> BlockManager::take_copy_blocks() {
+  // the moved out blocks can be reused once the pending copies are issued
+  compacted_blocks_to_release_.clear();
+
+  std::vector<int32_t> blocks;
+  blocks.swap(copy_blocks_);
+  return blocks;
+}
+
+bool BlockManager::fork_blocks_for(const Sequence& src, Sequence* dst) {
+  DCHECK(dst != nullptr);
+  if (dst->num_blocks() > 0 || dst->is_swapped_out() ||
+      src.is_swapped_out() || src.num_released_blocks() > 0 ||
+      src.num_evicted_tokens() > 0 ||
+      dst->num_prompt_tokens() == 0) {
+    return false;
+  }
+
+  // share the kv cache of all prompt tokens but the last one
+  const size_t block_size = options_.block_size();
+  const size_t num_tokens = std::min({src.num_kv_cache_tokens(),
+                                      src.num_blocks() * block_size,
+                                      dst->num_prompt_tokens() - 1});
+  const size_t n_full_blocks = num_tokens / block_size;
+  const auto src_blocks = src.blocks();
+  std::vector<Block> blocks(src_blocks.begin(),
+                            src_blocks.begin() + n_full_blocks);
+  size_t num_forked_tokens = n_full_blocks * block_size;
+  COUNTER_ADD(num_forked_blocks_total, n_full_blocks);
+
+  // copy the partially filled last block since both sequences write into it
+  const int32_t group = block_group_of(src);
+  if (num_tokens > num_forked_tokens &&
+      has_enough_blocks(1, /*demote=*/true, group)) {
+    Block block = allocator_of(group).allocate();
+    copy_blocks_.push_back(src_blocks[n_full_blocks].id());
+    copy_blocks_.push_back(block.id());
+    blocks.push_back(std::move(block));
+    num_forked_tokens = num_tokens;
+    ++num_blocks_in_use_;
+    COUNTER_INC(num_copied_blocks_total);
+  }
+
+  if (blocks.empty()) {
+    return false;
+  }
+  dst->set_forked_blocks(std::move(blocks), num_forked_tokens);
+  return true;
+}
+
+bool BlockManager::fork_beam_blocks_for(const Sequence& beam,
+                                        Sequence* sequence) {
+  DCHECK(sequence != nullptr);
+  CHECK(!beam.is_swapped_out() && beam.num_released_blocks() == 0)
+      << "only beams with all blocks on device can be forked";
+
+  // the blocks holding the kv cache, without the slots reserved after it
+  const size_t block_size = options_.block_size();
+  const size_t num_tokens = beam.num_kv_cache_tokens();
+  const size_t n_blocks =
+      std::min(beam.num_blocks(), (num_tokens + block_size - 1) / block_size);
+  const auto beam_blocks = beam.blocks();
+  std::vector<Block> blocks(beam_blocks.begin(),
+                            beam_blocks.begin() + n_blocks);
+
+  // copy the partially filled last block since both sequences write into it
+  if (num_tokens % block_size != 0) {
+    const int32_t group = block_group_of(beam);
+    if (!has_enough_blocks(1, /*demote=*/true, group)) {
+      return false;
+    }
+    Block block = allocator_of(group).allocate();
+    copy_blocks_.push_back(blocks.back().id());
+    copy_blocks_.push_back(block.id());
+    blocks.back() = std::move(block);
+    ++num_blocks_in_use_;
+    COUNTER_INC(num_copied_blocks_total);
+  }
+  COUNTER_ADD(num_forked_blocks_total, num_tokens / block_size);
+
+  release_blocks_for(sequence);
+  sequence->set_forked_blocks(std::move(blocks), num_tokens);
+  return true;
+}
+
+bool BlockManager::receive_blocks_for(Request* request,
+                                      std::vector<int32_t>* src_to_dst,
+                                      std::vector<Block>* src_blocks) {
+  DCHECK(request != nullptr);
+  // the blocks shared among the sequences are received once
+  std::vector<int32_t> src_ids;
+  std::unordered_map<int32_t, size_t> block_indices;
+  for (const Sequence& sequence : request->sequences) {
+    CHECK(!sequence.is_swapped_out() && sequence.num_released_blocks() == 0)
+        << "only sequences with all blocks on device can be received";
+    for (const Block& block : sequence.blocks()) {
+      if (block_indices.try_emplace(block.id(), src_ids.size()).second) {
+        src_ids.push_back(block.id());
+      }
+    }
+  }
+  const uint32_t n_blocks = src_ids.size();
+  if (!has_enough_blocks(n_blocks)) {
+    return false;
+  }
+  const auto blocks = allocate_blocks(n_blocks);
+  for (Sequence& sequence : request->sequences) {
+    std::vector<Block> new_blocks;
+    new_blocks.reserve(sequence.num_blocks());
+    for (const Block& block : sequence.blocks()) {
+      new_blocks.push_back(blocks[block_indices[block.id()]]);
+    }
+    auto old_blocks = sequence.replace_blocks(std::move(new_blocks));
+    src_blocks->insert(src_blocks->end(),
+                       std::make_move_iterator(old_blocks.begin()),
+                       std::make_move_iterator(old_blocks.end()));
+  }
+  src_to_dst->reserve(src_to_dst->size() + 2 * n_blocks);
+  for (size_t i = 0; i < src_ids.size(); ++i) {
+    src_to_dst->push_back(src_ids[i]);
+    src_to_dst->push_back(blocks[i].id());
+  }
+  num_blocks_in_use_ += n_blocks;
+  COUNTER_ADD(num_received_blocks_total, n_blocks);
+  return true;
+}
+
+void BlockManager::release_transferred_blocks(std::vector<Block>* blocks,
+                                              bool cacheable) {
+  DCHECK(blocks != nullptr);
+  cacheable = cacheable && options_.enable_prefix_cache();
+  // the blocks shared among the sequences are listed more than once
+  std::unordered_map<int32_t, uint32_t> num_listed;
+  for (const Block& block : *blocks) {
+    ++num_listed[block.id()];
+  }
+  for (const Block& block : *blocks) {
+    auto it = num_listed.find(block.id());
+    if (it == num_listed.end()) {
+      continue;
+    }
+    // the block is not held by other sequences, but the prefix cache
+    const uint32_t num_other_refs = block.ref_count() - it->second;
+    if (num_other_refs <= (cacheable ? 1 : 0)) {
+      --num_blocks_in_use_;
+    }
+    num_listed.erase(it);
+  }
+  Block::release(blocks);
+}
+
+size_t BlockManager::import_prefix_blocks(const Slice<int32_t>& token_ids,
+                                          const WriteBlocks& write_blocks) {
+  if (!options_.enable_prefix_cache()) {
+    return 0;
+  }
+  const size_t block_size = options_.block_size();
+  const size_t n_blocks = token_ids.size() / block_size;
+  const auto tokens = token_ids.slice(0, n_blocks * block_size);
+
+  // hold the cached blocks to keep them from being evicted
+  std::vector<Block> blocks = prefix_cache_.match(tokens);
+  const size_t start_block = blocks.size();
+  const size_t n_new_blocks = n_blocks - start_block;
+  // the new blocks are written right away, before the pending copies of
+  // the demoted blocks
+  if (n_new_blocks == 0 ||
+      !has_enough_blocks(n_new_blocks, /*demote=*/false)) {
+    return 0;
+  }
+  auto new_blocks = allocate_blocks(n_new_blocks);
+  if (!write_blocks(start_block, new_blocks)) {
+    return 0;
+  }
+  blocks.insert(blocks.end(),
+                std::make_move_iterator(new_blocks.begin()),
+                std::make_move_iterator(new_blocks.end()));
+  // the blocks are only held by the prefix cache afterwards, not in use
+  prefix_cache_.insert(tokens, Slice<Block>(blocks));
+  COUNTER_ADD(num_imported_blocks_total, n_new_blocks);
+  return n_new_blocks * block_size;
+}
+
+size_t BlockManager::compact_blocks_for(Sequence* sequence) {
+  DCHECK(sequence != nullptr);
+  const auto blocks = sequence->blocks();
+  if (blocks.size() < 2 || sequence->is_swapped_out() ||
+      sequence->num_released_blocks() > 0 ||
+      sequence->num_evicted_tokens() > 0) {
+    return 0;
+  }
+  bool contiguous = true;
+  for (size_t i = 1; i < blocks.size(); ++i) {
+    if (blocks[i].id() != blocks[i - 1].id() + 1) {
+      contiguous = false;
+      break;
+    }
+  }
+  if (contiguous) {
+    return 0;
+  }
+
+  // only move the blocks owned by the sequence alone or with the prefix cache
+  const bool cacheable =
+      options_.enable_prefix_cache() && sequence->prefix_cacheable();
+  const auto token_ids = sequence->token_ids();
+  std::vector<int32_t> cached_block_ids;
+  if (cacheable) {
+    cached_block_ids = prefix_cache_.matched_block_ids(token_ids);
+  }
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    const bool cached =
+        i < cached_block_ids.size() && cached_block_ids[i] == blocks[i].id();
+    if (blocks[i].ref_count() > (cached ? 2 : 1)) {
+      return 0;
+    }
+  }
+  // the destinations of pending copies are written by them
+  for (size_t i = 1; i < copy_blocks_.size(); i += 2) {
+    for (const auto& block : blocks) {
+      if (block.id() == copy_blocks_[i]) {
+        return 0;
+      }
+    }
+  }
+
+  auto new_blocks = allocator_of(block_group_of(*sequence))
+                        .allocate_contiguous(blocks.size());
+  if (new_blocks.empty()) {
+    return 0;
+  }
+  const size_t n_blocks = new_blocks.size();
+  for (size_t i = 0; i < n_blocks; ++i) {
+    copy_blocks_.push_back(blocks[i].id());
+    copy_blocks_.push_back(new_blocks[i].id());
+  }
+  if (!cached_block_ids.empty()) {
+    prefix_cache_.replace_blocks(token_ids, blocks, new_blocks);
+  }
+  auto moved = sequence->replace_blocks(std::move(new_blocks));
+  compacted_blocks_to_release_.insert(
+      compacted_blocks_to_release_.end(),
+      std::make_move_iterator(moved.begin()),
+      std::make_move_iterator(moved.end()));
+  COUNTER_ADD(num_compacted_blocks_total, n_blocks);
+  return n_blocks;
+}
+
+std::vector<int32_t> BlockManager::take_swap_in_blocks() {
+  // the host blocks can be reused once the pending copies are issued
+  host_blocks_to_release_.clear();
+
+  std::vector<int32_t> blocks;
+  blocks.swap(swap_in_blocks_);
+  return blocks;
+}
+
+size_t BlockManager::num_cached_tokens(const Sequence& sequence) const {
+  if (!options_.enable_prefix_cache() || !sequence.prefix_cacheable() ||
+      sequence.needs_full_prefill()) {
+    return 0;
+  }
+  return prefix_cache_.num_matched_tokens(sequence.token_ids());
+}
+
 void BlockManager::allocate_shared_blocks_for(Sequence* sequence) {
-  // only allocate shared blocks for prefill sequences
-  if (options_.enable_prefix_cache()) {
+  // only allocate shared blocks for prefill sequences. the kv cache of the
+  // sequences with lora adapters or images is not shared since it depends on
+  // them, see Sequence::prefix_cacheable().
+  // the prompt to score or mean pool is prefilled in full.
+  if (options_.enable_prefix_cache() && sequence->prefix_cacheable() &&
+      !sequence->needs_full_prefill()) {
     AUTO_COUNTER(prefix_cache_match_latency_seconds);
 
     const auto tokens_ids = sequence->token_ids();
@@ -162,30 +804,304 @@ void BlockManager::allocate_shared_blocks_for(Sequence* sequence) {
         ++num_blocks_in_use_;
       }
     }
+
+    // promote following blocks from the host prefix cache
+    if (host_prefix_cache_ != nullptr) {
+      promote_blocks(tokens_ids, &shared_blocks);
+    }
+    // then copy following blocks from the pool shared with other processes
+    if (shared_pool_ != nullptr) {
+      import_shared_blocks(tokens_ids, &shared_blocks);
+    }
+    HISTOGRAM_OBSERVE(prefix_cache_hit_tokens,
+                      shared_blocks.size() * options_.block_size());
     sequence->set_shared_blocks(std::move(shared_blocks));
   }
 }
 
+void BlockManager::promote_blocks(const Slice<int32_t>& token_ids,
+                                  std::vector<Block>* blocks) {
+  auto host_blocks = host_prefix_cache_->match(token_ids, blocks->size());
+  const size_t n_blocks = host_blocks.size();
+  if (n_blocks == 0 || !has_enough_blocks(n_blocks)) {
+    return;
+  }
+  COUNTER_ADD(host_prefix_cache_match_length_total,
+              n_blocks * options_.block_size());
+
+  auto device_blocks = allocate_blocks(n_blocks);
+  for (size_t i = 0; i < n_blocks; ++i) {
+    swap_in_blocks_.push_back(host_blocks[i].id());
+    swap_in_blocks_.push_back(device_blocks[i].id());
+  }
+  blocks->insert(blocks->end(),
+                 std::make_move_iterator(device_blocks.begin()),
+                 std::make_move_iterator(device_blocks.end()));
+  // hold the host blocks until the pending copies are taken
+  host_blocks_to_release_.insert(host_blocks_to_release_.end(),
+                                 std::make_move_iterator(host_blocks.begin()),
+                                 std::make_move_iterator(host_blocks.end()));
+  num_blocks_in_use_ += n_blocks;
+}
+
+void BlockManager::import_shared_blocks(const Slice<int32_t>& token_ids,
+                                        std::vector<Block>* blocks) {
+  auto slots = shared_pool_->acquire(token_ids, blocks->size());
+  const size_t n_blocks = slots.size();
+  if (n_blocks == 0) {
+    return;
+  }
+  if (!has_enough_blocks(n_blocks)) {
+    shared_pool_->release(slots);
+    return;
+  }
+  COUNTER_ADD(shared_pool_match_length_total,
+              n_blocks * options_.block_size());
+
+  auto device_blocks = allocate_blocks(n_blocks);
+  for (size_t i = 0; i < n_blocks; ++i) {
+    shared_in_blocks_.push_back(slots[i]);
+    shared_in_blocks_.push_back(device_blocks[i].id());
+  }
+  blocks->insert(blocks->end(),
+                 std::make_move_iterator(device_blocks.begin()),
+                 std::make_move_iterator(device_blocks.end()));
+  // hold the slots until the pending copies are done
+  shared_slots_to_release_.insert(
+      shared_slots_to_release_.end(), slots.begin(), slots.end());
+  num_blocks_in_use_ += n_blocks;
+}
+
+void BlockManager::publish_blocks(const Slice<int32_t>& token_ids,
+                                  const Slice<Block>& blocks,
+                                  size_t n_blocks) {
+  const auto slots = shared_pool_->reserve(token_ids, n_blocks);
+  size_t n_published = 0;
+  for (size_t i = 0; i < slots.size(); ++i) {
+    if (slots[i] < 0) {
+      continue;
+    }
+    // the device blocks are still valid until the pending copies are done,
+    // which is guaranteed by executing the copies first before the model.
+    shared_out_blocks_.push_back(blocks[i].id());
+    shared_out_blocks_.push_back(slots[i]);
+    shared_slots_to_commit_.push_back(slots[i]);
+    ++n_published;
+  }
+  COUNTER_ADD(num_published_blocks_total, n_published);
+}
+
+std::vector<int32_t> BlockManager::take_shared_out_blocks() {
+  DCHECK(shared_pool_ != nullptr);
+  // the copies taken last time are done once their batch is executed
+  shared_pool_->commit(shared_slots_written_);
+  shared_slots_written_.swap(shared_slots_to_commit_);
+  shared_slots_to_commit_.clear();
+
+  std::vector<int32_t> blocks;
+  blocks.swap(shared_out_blocks_);
+  return blocks;
+}
+
+std::vector<int32_t> BlockManager::take_shared_in_blocks() {
+  DCHECK(shared_pool_ != nullptr);
+  shared_pool_->release(shared_slots_read_);
+  shared_slots_read_.swap(shared_slots_to_release_);
+  shared_slots_to_release_.clear();
+
+  std::vector<int32_t> blocks;
+  blocks.swap(shared_in_blocks_);
+  return blocks;
+}
+
 void BlockManager::cache_blocks_for(Sequence* sequence) {
-  if (options_.enable_prefix_cache()) {
+  // skip the released blocks, which point to the padding block
+  const auto blocks = sequence->blocks().slice(sequence->num_released_blocks());
+  const bool cacheable =
+      options_.enable_prefix_cache() && sequence->prefix_cacheable();
+  // the prefix cache needs the blocks from the start of the sequence
+  if (cacheable && sequence->num_released_blocks() == 0 &&
+      sequence->num_evicted_tokens() == 0) {
     AUTO_COUNTER(prefix_cache_insert_latency_seconds);
 
     // only insert tokens in kv cache to the prefix cache
     const auto tokens_ids = sequence->tokens_in_kv_cache();
-    const auto blocks = sequence->blocks();
     // Add the kv cache to the prefix cache
     prefix_cache_.insert(tokens_ids, blocks);
 
+    // share the full blocks of the prompt with other processes
+    if (shared_pool_ != nullptr) {
+      const size_t n_tokens =
+          std::min(tokens_ids.size(), sequence->num_prompt_tokens());
+      publish_blocks(tokens_ids,
+                     blocks,
+                     std::min(n_tokens / options_.block_size(), blocks.size()));
+    }
+  }
+  release_blocks_in_use(blocks, cacheable);
+}
+
+void BlockManager::cache_committed_blocks_for(Sequence* sequence) {
+  DCHECK(sequence != nullptr);
+  // the prefix cache needs the blocks from the start of the sequence
+  if (!options_.enable_prefix_cache() || !sequence->prefix_cacheable() ||
+      sequence->num_released_blocks() > 0 ||
+      sequence->num_evicted_tokens() > 0 || sequence->is_swapped_out()) {
+    return;
+  }
+  AUTO_COUNTER(prefix_cache_insert_latency_seconds);
+  prefix_cache_.insert(sequence->tokens_in_kv_cache(), sequence->blocks());
+}
+
+void BlockManager::release_blocks_in_use(const Slice<Block>& blocks,
+                                         bool cacheable) {
+  if (cacheable) {
     // update effective block usage
-    for (const auto& block : sequence->blocks()) {
+    for (const auto& block : blocks) {
       // the block is not shared by other sequence
       if (block.ref_count() <= 2) {
         --num_blocks_in_use_;
       }
     }
   } else {
-    num_blocks_in_use_ -= sequence->num_blocks();
+    // blocks shared with forked sequences are counted once
+    for (const auto& block : blocks) {
+      if (block.ref_count() == 1) {
+        --num_blocks_in_use_;
+      }
+    }
+  }
+}
+
+size_t BlockManager::num_free_blocks() const {
+  size_t n_blocks = block_allocator_.num_free_blocks();
+  for (const auto& allocator : group_allocators_) {
+    n_blocks += allocator->num_free_blocks();
+  }
+  return n_blocks;
+}
+
+size_t BlockManager::num_total_blocks() const {
+  size_t n_blocks = block_allocator_.num_total_blocks();
+  for (const auto& allocator : group_allocators_) {
+    n_blocks += allocator->num_total_blocks();
+  }
+  return n_blocks;
+}
+
+int32_t BlockManager::block_group_of(const Sequence& sequence) const {
+  if (group_allocators_.empty()) {
+    return 0;
   }
+  const auto blocks = sequence.blocks();
+  if (!blocks.empty()) {
+    return blocks[0].id() / static_cast<int32_t>(num_blocks_per_group());
+  }
+  // balance the new sequences across the groups
+  int32_t group = 0;
+  size_t max_free_blocks = block_allocator_.num_free_blocks();
+  for (size_t i = 0; i < group_allocators_.size(); ++i) {
+    const size_t n_free_blocks = group_allocators_[i]->num_free_blocks();
+    if (n_free_blocks > max_free_blocks) {
+      group = static_cast<int32_t>(i) + 1;
+      max_free_blocks = n_free_blocks;
+    }
+  }
+  return group;
+}
+
+void BlockManager::begin_shrink(uint32_t n_blocks) {
+  CHECK_GT(n_blocks, padding_block_.id()) << "can't drain the padding block";
+  CHECK(group_allocators_.empty()) << "can't shrink the block groups";
+  const size_t n_evicted = prefix_cache_.evict_blocks_from(n_blocks);
+  block_allocator_.begin_shrink(n_blocks);
+  LOG(INFO) << "Shrinking kv cache from " << num_total_blocks() << " to "
+            << n_blocks << " blocks, evicted " << n_evicted
+            << " blocks from prefix cache, "
+            << block_allocator_.num_draining_blocks() << " blocks in use";
+}
+
+bool BlockManager::finish_shrink() {
+  if (!block_allocator_.is_shrinking()) {
+    return true;
+  }
+  // the blocks beyond the limit cached by finished sequences since then
+  prefix_cache_.evict_blocks_from(block_allocator_.block_limit());
+  return block_allocator_.finish_shrink();
+}
+
+void BlockManager::release_out_of_window_blocks_for(Sequence* sequence) {
+  const int32_t sliding_window = options_.sliding_window();
+  if (sliding_window < 0) {
+    return;
+  }
+  // the following tokens attend to the tokens from n_kv_tokens - window on
+  const size_t n_kv_tokens = sequence->tokens_in_kv_cache().size();
+  if (n_kv_tokens <= static_cast<size_t>(sliding_window)) {
+    return;
+  }
+  const size_t n_blocks =
+      (n_kv_tokens - sliding_window) / options_.block_size();
+  if (n_blocks <= sequence->num_released_blocks()) {
+    return;
+  }
+
+  const auto released =
+      sequence->release_leading_blocks(n_blocks, padding_block_);
+  release_blocks_in_use(
+      released,
+      options_.enable_prefix_cache() && sequence->prefix_cacheable());
+  COUNTER_ADD(num_out_of_window_blocks_total, released.size());
+}
+
+void BlockManager::evict_kv_blocks_for(Sequence* sequence) {
+  const auto& scores = sequence->kv_block_scores();
+  if (scores.empty() || sequence->is_swapped_out()) {
+    return;
+  }
+  const size_t block_size = options_.block_size();
+  const size_t n_kv_blocks = scores.size();
+  // attention sinks to the first tokens, and the observed tokens and the
+  // following ones are attended to by the next tokens
+  constexpr size_t kNumSinkBlocks = 1;
+  // the observed prompt ends in the last scored block
+  const size_t min_kv_len = (n_kv_blocks - 1) * block_size + 1;
+  const size_t n_observed_tokens =
+      std::min(sequence->kv_observation_window(), min_kv_len);
+  const size_t recent_start =
+      std::min((min_kv_len - n_observed_tokens) / block_size,
+               sequence->num_blocks());
+  const size_t n_budget_blocks = options_.kv_budget() / block_size;
+  const size_t n_kept_blocks =
+      kNumSinkBlocks + sequence->num_blocks() - recent_start;
+
+  // evict the candidates with the least attention over the budget, no
+  // attention is observed by models without the scores, e.g. mla.
+  std::vector<size_t> candidates;
+  for (size_t i = kNumSinkBlocks; i < recent_start; ++i) {
+    candidates.push_back(i);
+  }
+  const bool observed = std::any_of(
+      scores.begin(), scores.end(), [](float score) { return score > 0; });
+  const size_t n_kept_candidates =
+      n_budget_blocks > n_kept_blocks ? n_budget_blocks - n_kept_blocks : 0;
+  if (!observed || candidates.size() <= n_kept_candidates) {
+    sequence->set_kv_block_scores({});
+    return;
+  }
+  std::stable_sort(
+      candidates.begin(), candidates.end(), [&scores](size_t a, size_t b) {
+        return scores[a] > scores[b];
+      });
+  std::vector<size_t> evicted_idxes(candidates.begin() + n_kept_candidates,
+                                    candidates.end());
+  std::sort(evicted_idxes.begin(), evicted_idxes.end());
+
+  const auto evicted = sequence->evict_blocks(evicted_idxes);
+  release_blocks_in_use(
+      evicted,
+      options_.enable_prefix_cache() && sequence->prefix_cacheable());
+  COUNTER_ADD(num_evicted_kv_blocks_total, evicted.size());
 }
 
 }  // namespace llm
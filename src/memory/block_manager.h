@@ -1,14 +1,19 @@
 #pragma once
 
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "block_allocator.h"
+#include "host_prefix_cache.h"
 #include "common/macros.h"
 #include "memory/block.h"
 #include "prefix_cache.h"
 #include "request/request.h"
 #include "request/sequence.h"
+#include "shared_block_pool.h"
 
 namespace llm {
 
@@ -17,13 +22,86 @@ class BlockManager final {
   struct Options {
     DEFINE_ARG(uint32_t, num_blocks) = 0;
 
+    // max number of blocks to grow the kv cache to at runtime, 0 means the
+    // kv cache can't grow beyond num_blocks.
+    DEFINE_ARG(uint32_t, max_num_blocks) = 0;
+
     DEFINE_ARG(int32_t, block_size) = 0;
 
+    // number of slots per large block, a power of 2 multiple of block_size.
+    // sequences allocating a large block worth of blocks at once, e.g. long
+    // prompts, get runs of consecutive blocks. 0 means large blocks are
+    // disabled.
+    DEFINE_ARG(int32_t, large_block_size) = 0;
+
     DEFINE_ARG(bool, enable_prefix_cache) = true;
+
+    // number of blocks in host memory used to swap out preempted sequences,
+    // 0 means swapping is disabled.
+    DEFINE_ARG(uint32_t, num_host_blocks) = 0;
+
+    // demote blocks evicted from the prefix cache to host memory, and promote
+    // them back on match. only used when both prefix cache and host blocks are
+    // enabled.
+    DEFINE_ARG(bool, enable_host_prefix_cache) = true;
+
+    // number of preceding tokens attended by every layer of the model, the
+    // blocks scrolled out of the window are released while the sequences are
+    // running. -1 if any layer attends to all tokens.
+    DEFINE_ARG(int32_t, sliding_window) = -1;
+
+    // max number of kv cache tokens kept for each sequence whose prompt is
+    // longer. once the prompt is processed, the blocks receiving the least
+    // attention from the last prompt tokens are evicted, the first block and
+    // the blocks of the observed tokens are always kept. 0 to disable, not
+    // supported with a sliding window.
+    DEFINE_ARG(int32_t, kv_budget) = 0;
+
+    // number of last prompt tokens whose attention ranks the blocks to evict
+    DEFINE_ARG(int32_t, kv_observation_window) = 32;
+
+    // number of most recent blocks of a sequence kept on device when there
+    // are not enough device blocks for it. the kv cache of its leading blocks
+    // is offloaded to host blocks instead of preempting it, and attended on
+    // host. 0 to disable, only used with host blocks, and not supported with
+    // kv cache eviction or a sliding window.
+    DEFINE_ARG(int32_t, hybrid_attention_device_blocks) = 0;
+
+    // bytes of the kv cache of a block on each device, used to estimate the
+    // cost of swapping. 0 if unknown.
+    DEFINE_ARG(int64_t, block_size_in_bytes) = 0;
+
+    // name of the kv cache pool shared with the engines of other processes,
+    // see SharedBlockPool. the full prompt blocks of finished sequences are
+    // published to the pool, and the blocks missed by the prefix caches are
+    // copied from it. only used when prefix cache is enabled, empty to
+    // disable.
+    DEFINE_ARG(std::string, shared_pool_name);
+
+    // number of blocks of the shared pool if this process creates it
+    DEFINE_ARG(uint32_t, num_shared_blocks) = 0;
+
+    // identifies the model and the kv cache layout of the shared pool
+    DEFINE_ARG(uint64_t, shared_pool_layout_key) = 0;
+
+    // number of groups the blocks are split into evenly, each group of
+    // consecutive block ids is the kv cache of a data parallel attention
+    // group, and all blocks of a sequence are from the same group. the first
+    // block of each group is reserved for padding. more than one group is
+    // not supported with the prefix cache, large blocks, growing the kv
+    // cache, host blocks, kv cache eviction or a sliding window.
+    DEFINE_ARG(int32_t, num_block_groups) = 1;
   };
 
+  // writes the kv cache of the blocks for the tokens starting from the block
+  // index start_block, returns false on failure.
+  using WriteBlocks = std::function<bool(size_t start_block,
+                                         const std::vector<Block>& blocks)>;
+
   BlockManager(const Options& options);
 
+  ~BlockManager();
+
   bool allocate_blocks_for(Sequence* sequence);
 
   bool allocate_blocks_for(std::vector<Sequence*>& sequences);
@@ -40,9 +118,137 @@ class BlockManager final {
   // try to share blocks among sequences with the same prefix
   void allocate_shared_blocks_for(Sequence* sequence);
 
+  // get the number of leading tokens of the sequence that
+  // allocate_shared_blocks_for would share from the prefix cache, without
+  // holding the blocks. only the device prefix cache is looked up.
+  size_t num_cached_tokens(const Sequence& sequence) const;
+
+  // release the blocks of the sequence that are out of the attention window
+  // of all following tokens, no-op without a sliding window.
+  void release_out_of_window_blocks_for(Sequence* sequence);
+
+  // evict the blocks of the sequence receiving the least attention from the
+  // observed prompt tokens, keeping at most kv_budget tokens of the kv cache.
+  // no-op until the prompt is observed, see Options::kv_budget.
+  void evict_kv_blocks_for(Sequence* sequence);
+
   // cache the blocks for the sequence
   void cache_blocks_for(Sequence* sequence);
 
+  // insert the full blocks of the tokens in the kv cache into the prefix
+  // cache while the sequence keeps running, so that other sequences sharing
+  // the prefix can reuse them before the sequence finishes. the blocks stay
+  // in use by the sequence.
+  void cache_committed_blocks_for(Sequence* sequence);
+
+  // fork the kv cache of the prompt from src to dst, which shares the full
+  // blocks with src and gets a copy of the partially filled last block. the
+  // last prompt token is left for dst to sample its own first token.
+  // returns false if nothing is forked.
+  bool fork_blocks_for(const Sequence& src, Sequence* dst);
+
+  // fork the kv cache of the beam into the sequence for beam search, which
+  // releases its own blocks, shares the full blocks of the beam and gets a
+  // copy of the partially filled block that both of them write into next.
+  // returns false without changing the sequence if no block is free.
+  bool fork_beam_blocks_for(const Sequence& beam, Sequence* sequence);
+
+  // move the kv cache of the sequence into blocks with consecutive ids if its
+  // blocks are scattered, updating the blocks shared with the prefix cache
+  // as well. skipped if any block is shared with other sequences or there is
+  // no free run of blocks. the copies are taken by take_copy_blocks().
+  // returns the number of moved blocks.
+  size_t compact_blocks_for(Sequence* sequence);
+
+  // move the kv cache of a request computed by another engine, e.g. a
+  // prefill engine, into new blocks of this block manager. the blocks shared
+  // among its sequences are shared with the new blocks as well. the copies
+  // are appended to src_to_dst as [src_block_id, dst_block_id] pairs, and
+  // the blocks of the other engine are moved into src_blocks, which should be
+  // held until the copies are done. returns false if there are not enough
+  // blocks, the request is not changed then.
+  bool receive_blocks_for(Request* request,
+                          std::vector<int32_t>* src_to_dst,
+                          std::vector<Block>* src_blocks);
+
+  // release the blocks of a request whose kv cache has been copied to
+  // another engine, see receive_blocks_for. the blocks are counted in use
+  // until then. cacheable if the blocks were inserted into the prefix cache.
+  void release_transferred_blocks(std::vector<Block>* blocks, bool cacheable);
+
+  // get the ids of the blocks of the longest block aligned prefix of the
+  // token ids in the prefix cache, e.g. to export their kv cache.
+  std::vector<int32_t> cached_block_ids(const Slice<int32_t>& token_ids) const {
+    return prefix_cache_.matched_block_ids(token_ids);
+  }
+
+  // get the blocks of the longest block aligned prefix of the token ids in
+  // the prefix cache. they are not evicted while held, e.g. to pin the kv
+  // cache of a session between its turns.
+  std::vector<Block> match_cached_blocks(const Slice<int32_t>& token_ids) {
+    return prefix_cache_.match(token_ids);
+  }
+
+  // insert the full blocks of the token ids into the prefix cache, e.g. the
+  // kv cache exported by another engine. new blocks are allocated for the
+  // blocks not cached yet, and their kv cache is written by write_blocks
+  // before the insertion. returns the number of newly cached tokens, 0 if
+  // there are not enough blocks or write_blocks fails.
+  size_t import_prefix_blocks(const Slice<int32_t>& token_ids,
+                              const WriteBlocks& write_blocks);
+
+  // try to swap out the blocks of all sequences in the request to host
+  // memory, all or nothing. returns false if there are not enough host blocks.
+  bool swap_out_blocks_for(Request* request);
+
+  // swap in the kv cache of a swapped out sequence into device blocks.
+  // returns false if there are not enough device blocks.
+  bool swap_in_blocks_for(Sequence* sequence);
+
+  // check if swapping to host memory is enabled
+  bool swap_enabled() const { return host_block_allocator_ != nullptr; }
+
+  // returns pending block copies since last call, flattened as
+  // [src_block_id, dst_block_id] pairs, and clears the pending lists.
+  // N.B. all swap out copies must be finished before swap in copies.
+  std::vector<int32_t> take_swap_out_blocks();
+  std::vector<int32_t> take_swap_in_blocks();
+
+  // returns pending device block copies for forked and compacted sequences
+  // since last call, flattened as [src_block_id, dst_block_id] pairs.
+  std::vector<int32_t> take_copy_blocks();
+
+  // check if the kv cache pool shared with other processes is enabled
+  bool shared_pool_enabled() const { return shared_pool_ != nullptr; }
+
+  // returns pending block copies between the device blocks and the slots of
+  // the shared pool since last call, flattened as [device_block_id, slot] and
+  // [slot, device_block_id] pairs. the copies of the last call should be done
+  // by then, the slots written are published and the slots read are released
+  // to other processes.
+  // N.B. the copies to the pool must be finished before swapping, and the
+  // copies from the pool must follow swapping.
+  std::vector<int32_t> take_shared_out_blocks();
+  std::vector<int32_t> take_shared_in_blocks();
+
+  // grow the kv cache to n_blocks blocks, up to max_num_blocks. the kv
+  // cache of the new blocks should be allocated first. returns false if
+  // n_blocks is out of range or a shrink is in progress.
+  bool grow(uint32_t n_blocks) { return block_allocator_.grow(n_blocks); }
+
+  // start to shrink the kv cache to n_blocks blocks. the blocks from
+  // n_blocks on are evicted from the prefix cache and no longer allocated,
+  // the ones held by sequences are drained as the sequences finish.
+  void begin_shrink(uint32_t n_blocks);
+
+  // finish the shrink once all blocks beyond the limit are released, returns
+  // true if there is no shrink in progress afterwards. the kv cache of the
+  // drained blocks can be released then.
+  bool finish_shrink();
+
+  // check if a shrink is in progress
+  bool is_shrinking() const { return block_allocator_.is_shrinking(); }
+
   // get the options for the block manager
   const Options& options() const { return options_; }
 
@@ -51,37 +257,174 @@ class BlockManager final {
     return prefix_cache_.num_blocks();
   }
 
-  // get the number of free blocks in the block allocator
-  size_t num_free_blocks() const { return block_allocator_.num_free_blocks(); }
+  // get the cumulative statistics of the prefix cache
+  const PrefixCache::Stats& prefix_cache_stats() const {
+    return prefix_cache_.stats();
+  }
+
+  // get the k most hit prefixes in the prefix cache
+  std::vector<PrefixCache::PrefixInfo> hottest_prefixes(
+      size_t k,
+      size_t max_token_ids) const {
+    return prefix_cache_.hottest_prefixes(k, max_token_ids);
+  }
+
+  // get the number of free blocks in the block allocators
+  size_t num_free_blocks() const;
+
+  // get the number of free blocks in the host block allocator
+  size_t num_free_host_blocks() const {
+    return host_block_allocator_ == nullptr
+               ? 0
+               : host_block_allocator_->num_free_blocks();
+  }
+
+  // get the number of blocks in the host prefix cache
+  size_t num_blocks_in_host_prefix_cache() const {
+    return host_prefix_cache_ == nullptr ? 0 : host_prefix_cache_->num_blocks();
+  }
+
+  // get the total number of blocks in the block allocators
+  size_t num_total_blocks() const;
+
+  // get the number of blocks of each block group
+  size_t num_blocks_per_group() const {
+    return block_allocator_.num_total_blocks();
+  }
+
+  // get the block group of the sequence, the group with the most free blocks
+  // for a sequence without blocks
+  int32_t block_group_of(const Sequence& sequence) const;
+
+  // get the number of free large blocks in the block allocator
+  size_t num_free_large_blocks() const {
+    return block_allocator_.num_free_large_blocks();
+  }
 
   // get the effective number of blocks in use
   size_t num_blocks_in_use() const { return num_blocks_in_use_; }
 
   // get the block utilization.
   double kv_cache_utilization() const {
-    return static_cast<double>(num_blocks_in_use_) /
-           block_allocator_.num_total_blocks();
+    return static_cast<double>(num_blocks_in_use_) / num_total_blocks();
   }
 
  private:
   // check if block allocator has enough slots, if not, try to evict some blocks
-  // from the prefix cache
-  bool has_enough_blocks(uint32_t num_blocks);
+  // from the prefix cache. the evicted blocks are demoted to the host prefix
+  // cache if demote is true, which copies them before the next model run.
+  // the blocks are from the block group.
+  bool has_enough_blocks(uint32_t num_blocks,
+                         bool demote = true,
+                         int32_t group = 0);
+
+  // allocate n blocks of the block group, in large blocks of consecutive
+  // blocks as many as possible. the caller should check if there are enough
+  // blocks first.
+  std::vector<Block> allocate_blocks(uint32_t n_blocks, int32_t group = 0);
+
+  // the block allocator of the block group
+  BlockAllocator& allocator_of(int32_t group) {
+    return group == 0 ? block_allocator_ : *group_allocators_[group - 1];
+  }
+
+  // check if there are enough free host blocks, evicting blocks from the host
+  // prefix cache if needed
+  bool has_enough_host_blocks(uint32_t num_blocks);
+
+  // offload the leading blocks of the sequence to host blocks, keeping
+  // hybrid_attention_device_blocks blocks on device. returns false if nothing
+  // is offloaded, see Options::hybrid_attention_device_blocks.
+  bool offload_blocks_for(Sequence* sequence);
+
+  // copy evicted blocks into the host prefix cache
+  void demote_blocks(const std::vector<int32_t>& token_ids,
+                     const Slice<Block>& blocks);
+
+  // append blocks promoted from the host prefix cache that follow the blocks
+  void promote_blocks(const Slice<int32_t>& token_ids,
+                      std::vector<Block>* blocks);
+
+  // append blocks copied from the shared pool that follow the blocks
+  void import_shared_blocks(const Slice<int32_t>& token_ids,
+                            std::vector<Block>* blocks);
+
+  // copy the first n_blocks blocks of the tokens into the shared pool, the
+  // ones already in the pool are skipped.
+  void publish_blocks(const Slice<int32_t>& token_ids,
+                      const Slice<Block>& blocks,
+                      size_t n_blocks);
+
+  // update the number of blocks in use for the blocks dropped by a sequence,
+  // which may be shared with the prefix cache if cacheable.
+  void release_blocks_in_use(const Slice<Block>& blocks, bool cacheable);
 
   // the options for the block manager
   Options options_;
 
-  // the block allocator that manages the memory blocks
+  // the block allocator that manages the memory blocks, of the first block
+  // group if there are more
   BlockAllocator block_allocator_;
 
+  // the block allocators of the other block groups
+  std::vector<std::unique_ptr<BlockAllocator>> group_allocators_;
+
   // prefix cache
   PrefixCache prefix_cache_;
 
+  // the block allocator that manages the host memory blocks for swapping
+  std::unique_ptr<BlockAllocator> host_block_allocator_;
+
+  // the prefix cache for blocks demoted to host memory
+  std::unique_ptr<HostPrefixCache> host_prefix_cache_;
+
+  // pending block copies, flattened as [src_block_id, dst_block_id] pairs
+  std::vector<int32_t> swap_out_blocks_;
+  std::vector<int32_t> swap_in_blocks_;
+
+  // pending device block copies for forked and compacted sequences
+  std::vector<int32_t> copy_blocks_;
+
+  // blocks moved out by compaction, hold them until the pending copies are
+  // taken to avoid reusing them in the same step.
+  std::vector<Block> compacted_blocks_to_release_;
+
+  // host blocks released by swap in, hold them until the pending copies are
+  // taken to avoid reusing them in the same step.
+  std::vector<Block> host_blocks_to_release_;
+
+  // the kv cache pool shared with other processes, null if disabled
+  std::unique_ptr<SharedBlockPool> shared_pool_;
+
+  // pending block copies to and from the shared pool, flattened as
+  // [device_block_id, slot] and [slot, device_block_id] pairs
+  std::vector<int32_t> shared_out_blocks_;
+  std::vector<int32_t> shared_in_blocks_;
+
+  // the slots of the pool written by the pending copies and by the copies
+  // taken last time, the latter are published on the next take.
+  std::vector<int32_t> shared_slots_to_commit_;
+  std::vector<int32_t> shared_slots_written_;
+
+  // the slots of the pool read by the pending copies and by the copies taken
+  // last time, the latter are released on the next take. the slots may be
+  // overwritten by other processes once released, which is not ordered with
+  // the copies of this process.
+  std::vector<int32_t> shared_slots_to_release_;
+  std::vector<int32_t> shared_slots_read_;
+
   // reserved block id for padding
   Block padding_block_;
 
+  // reserved padding blocks of the other block groups
+  std::vector<Block> group_padding_blocks_;
+
   // number of blocks in use
   size_t num_blocks_in_use_ = 0;
+
+  // the least number of free blocks out of large blocks since the last merge
+  // of free blocks into large blocks
+  size_t min_free_small_blocks_ = 0;
 };
 
 }  // namespace llm
@@ -1,6 +1,9 @@
 #include "block_manager.h"
 
 #include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <string>
 
 namespace llm {
 
@@ -12,4 +15,667 @@ TEST(BlockManagerTest, Basic) {
   // TODO: add more tests
 }
 
-}  // namespace llm
\ No newline at end of file
+TEST(BlockManagerTest, SwapDisabled) {
+  BlockManager::Options options;
+  options.num_blocks(10).block_size(2).enable_prefix_cache(false);
+  BlockManager manager(options);
+  EXPECT_FALSE(manager.swap_enabled());
+  EXPECT_EQ(manager.num_free_host_blocks(), 0);
+
+  Request request("", {1, 2, 3, 4, 5}, /*seq_capacity=*/20, 1, 1, false);
+  request.add_sequence();
+  EXPECT_TRUE(manager.allocate_blocks_for(&request.sequences[0]));
+  EXPECT_FALSE(manager.swap_out_blocks_for(&request));
+  EXPECT_FALSE(request.sequences[0].is_swapped_out());
+  EXPECT_EQ(request.sequences[0].num_blocks(), 3);
+}
+
+TEST(BlockManagerTest, SwapOutAndIn) {
+  BlockManager::Options options;
+  options.num_blocks(10).block_size(2).enable_prefix_cache(false);
+  options.num_host_blocks(4);
+  BlockManager manager(options);
+  EXPECT_TRUE(manager.swap_enabled());
+  EXPECT_EQ(manager.num_free_host_blocks(), 4);
+  // block 0 is reserved for padding
+  EXPECT_EQ(manager.num_free_blocks(), 9);
+
+  Request request("", {1, 2, 3, 4, 5}, /*seq_capacity=*/20, 1, 1, false);
+  request.add_sequence();
+  Sequence& sequence = request.sequences[0];
+  EXPECT_TRUE(manager.allocate_blocks_for(&sequence));
+  EXPECT_EQ(sequence.num_blocks(), 3);
+  sequence.commit_kv_cache(/*size=*/5);
+  std::vector<int32_t> device_ids;
+  for (const auto& block : sequence.blocks()) {
+    device_ids.push_back(block.id());
+  }
+
+  // swap out all blocks to host
+  EXPECT_TRUE(manager.swap_out_blocks_for(&request));
+  EXPECT_TRUE(sequence.is_swapped_out());
+  EXPECT_EQ(sequence.num_blocks(), 0);
+  EXPECT_EQ(sequence.host_blocks().size(), 3);
+  // the kv cache position is kept
+  EXPECT_EQ(sequence.num_kv_cache_tokens(), 5);
+  EXPECT_EQ(manager.num_free_blocks(), 9);
+  EXPECT_EQ(manager.num_free_host_blocks(), 1);
+  EXPECT_EQ(manager.num_blocks_in_use(), 0);
+
+  const auto swap_out = manager.take_swap_out_blocks();
+  ASSERT_EQ(swap_out.size(), 6);
+  std::vector<int32_t> host_ids;
+  for (size_t i = 0; i < 3; ++i) {
+    EXPECT_EQ(swap_out[2 * i], device_ids[i]);
+    EXPECT_EQ(swap_out[2 * i + 1], sequence.host_blocks()[i].id());
+    host_ids.push_back(swap_out[2 * i + 1]);
+  }
+  // pending copies are cleared after taking
+  EXPECT_TRUE(manager.take_swap_out_blocks().empty());
+
+  // not enough host blocks for another swap out
+  Request other("", {1, 2, 3, 4}, /*seq_capacity=*/20, 1, 1, false);
+  other.add_sequence();
+  EXPECT_TRUE(manager.allocate_blocks_for(&other.sequences[0]));
+  EXPECT_FALSE(manager.swap_out_blocks_for(&other));
+  EXPECT_EQ(other.sequences[0].num_blocks(), 2);
+  manager.release_blocks_for(&other);
+
+  // swap in blocks when allocating blocks for the sequence
+  sequence.append_token(6);
+  EXPECT_TRUE(manager.allocate_blocks_for(&sequence));
+  EXPECT_FALSE(sequence.is_swapped_out());
+  EXPECT_EQ(sequence.num_blocks(), 3);
+  EXPECT_EQ(sequence.num_kv_cache_tokens(), 5);
+  EXPECT_EQ(manager.num_blocks_in_use(), 3);
+
+  const auto swap_in = manager.take_swap_in_blocks();
+  ASSERT_EQ(swap_in.size(), 6);
+  for (size_t i = 0; i < 3; ++i) {
+    EXPECT_EQ(swap_in[2 * i], host_ids[i]);
+    EXPECT_EQ(swap_in[2 * i + 1], sequence.blocks()[i].id());
+  }
+  // host blocks are freed after the pending copies are taken
+  EXPECT_EQ(manager.num_free_host_blocks(), 4);
+
+  manager.release_blocks_for(&request);
+  EXPECT_EQ(manager.num_blocks_in_use(), 0);
+  EXPECT_EQ(manager.num_free_blocks(), 9);
+}
+
+TEST(BlockManagerTest, HostPrefixCache) {
+  BlockManager::Options options;
+  options.num_blocks(4).block_size(2).enable_prefix_cache(true);
+  options.num_host_blocks(4);
+  BlockManager manager(options);
+  EXPECT_EQ(manager.num_free_blocks(), 3);
+
+  // cache two full blocks in the prefix cache
+  {
+    Request request("", {1, 2, 3, 4, 5}, /*seq_capacity=*/20, 1, 1, false);
+    request.add_sequence();
+    EXPECT_TRUE(manager.allocate_blocks_for(&request.sequences[0]));
+    request.sequences[0].commit_kv_cache(/*size=*/5);
+    manager.release_blocks_for(&request);
+    EXPECT_EQ(manager.num_blocks_in_prefix_cache(), 2);
+    EXPECT_EQ(manager.num_free_blocks(), 1);
+  }
+
+  // evicted blocks are demoted to host memory
+  {
+    Request request("", {9, 9, 9, 9, 9}, /*seq_capacity=*/20, 1, 1, false);
+    request.add_sequence();
+    EXPECT_TRUE(manager.allocate_blocks_for(&request.sequences[0]));
+    EXPECT_EQ(manager.num_blocks_in_prefix_cache(), 0);
+    EXPECT_EQ(manager.num_blocks_in_host_prefix_cache(), 2);
+    EXPECT_EQ(manager.num_free_host_blocks(), 2);
+    EXPECT_EQ(manager.take_swap_out_blocks().size(), 4);
+    manager.release_blocks_for(&request);
+  }
+
+  // matched blocks are promoted back from host memory
+  {
+    Request request("", {1, 2, 3, 4, 5}, /*seq_capacity=*/20, 1, 1, false);
+    request.add_sequence();
+    Sequence& sequence = request.sequences[0];
+    EXPECT_TRUE(manager.allocate_blocks_for(&sequence));
+    EXPECT_EQ(sequence.num_blocks(), 3);
+    EXPECT_EQ(sequence.num_kv_cache_tokens(), 4);
+
+    const auto swap_in = manager.take_swap_in_blocks();
+    ASSERT_EQ(swap_in.size(), 4);
+    EXPECT_EQ(swap_in[1], sequence.blocks()[0].id());
+    EXPECT_EQ(swap_in[3], sequence.blocks()[1].id());
+    // the host copy is kept in the host prefix cache
+    EXPECT_EQ(manager.num_blocks_in_host_prefix_cache(), 2);
+    manager.release_blocks_for(&request);
+  }
+}
+
+TEST(BlockManagerTest, SharedPool) {
+  BlockManager::Options options;
+  options.num_blocks(4).block_size(2).enable_prefix_cache(true);
+  options.shared_pool_name("scalellm_block_manager_test_" +
+                           std::to_string(getpid()))
+      .num_shared_blocks(4)
+      .shared_pool_layout_key(1);
+  // two block managers stand for the engines of two processes
+  BlockManager writer(options);
+  BlockManager reader(options);
+  EXPECT_TRUE(writer.shared_pool_enabled());
+
+  // the full prompt blocks are published once the sequence finishes
+  {
+    Request request("", {1, 2, 3, 4, 5}, /*seq_capacity=*/20, 1, 1, false);
+    request.add_sequence();
+    EXPECT_TRUE(writer.allocate_blocks_for(&request.sequences[0]));
+    request.sequences[0].commit_kv_cache(/*size=*/5);
+    writer.release_blocks_for(&request);
+  }
+  const auto shared_out = writer.take_shared_out_blocks();
+  ASSERT_EQ(shared_out.size(), 4);
+
+  // not matched until the copies are done, i.e. on the next take
+  {
+    Request request("", {1, 2, 3, 4, 5}, /*seq_capacity=*/20, 1, 1, false);
+    request.add_sequence();
+    EXPECT_TRUE(reader.allocate_blocks_for(&request.sequences[0]));
+    EXPECT_EQ(request.sequences[0].num_kv_cache_tokens(), 0);
+    reader.release_blocks_for(&request);
+  }
+  EXPECT_TRUE(writer.take_shared_out_blocks().empty());
+
+  // matched blocks are copied from the pool
+  Request request("", {1, 2, 3, 4, 5}, /*seq_capacity=*/20, 1, 1, false);
+  request.add_sequence();
+  Sequence& sequence = request.sequences[0];
+  EXPECT_TRUE(reader.allocate_blocks_for(&sequence));
+  EXPECT_EQ(sequence.num_kv_cache_tokens(), 4);
+  const auto shared_in = reader.take_shared_in_blocks();
+  ASSERT_EQ(shared_in.size(), 4);
+  EXPECT_EQ(shared_in[0], shared_out[1]);
+  EXPECT_EQ(shared_in[1], sequence.blocks()[0].id());
+  EXPECT_EQ(shared_in[2], shared_out[3]);
+  EXPECT_EQ(shared_in[3], sequence.blocks()[1].id());
+  reader.release_blocks_for(&request);
+}
+
+TEST(BlockManagerTest, ForkBlocks) {
+  BlockManager::Options options;
+  options.num_blocks(10).block_size(2).enable_prefix_cache(false);
+  BlockManager manager(options);
+
+  Request request("", {1, 2, 3, 4, 5, 6}, /*seq_capacity=*/20, 2, 2, false);
+  request.add_sequence();
+  Sequence& src = request.sequences[0];
+  EXPECT_TRUE(manager.allocate_blocks_for(&src));
+  src.commit_kv_cache(/*size=*/6);
+  EXPECT_EQ(manager.num_blocks_in_use(), 3);
+
+  request.add_sequence();
+  Sequence& dst = request.sequences[1];
+  EXPECT_TRUE(manager.fork_blocks_for(src, &dst));
+  // two full blocks are shared, and the partially filled third block for
+  // the first 5 tokens is copied.
+  EXPECT_EQ(dst.num_blocks(), 3);
+  EXPECT_EQ(dst.num_kv_cache_tokens(), 5);
+  EXPECT_EQ(dst.blocks()[0], src.blocks()[0]);
+  EXPECT_EQ(dst.blocks()[1], src.blocks()[1]);
+  EXPECT_FALSE(dst.blocks()[2] == src.blocks()[2]);
+  EXPECT_EQ(src.blocks()[0].ref_count(), 2);
+  EXPECT_EQ(manager.num_blocks_in_use(), 4);
+  EXPECT_EQ(manager.take_copy_blocks(),
+            std::vector<int32_t>({src.blocks()[2].id(), dst.blocks()[2].id()}));
+  EXPECT_TRUE(manager.take_copy_blocks().empty());
+
+  // shared blocks are counted once
+  manager.release_blocks_for(&dst);
+  EXPECT_EQ(manager.num_blocks_in_use(), 3);
+  manager.release_blocks_for(&src);
+  EXPECT_EQ(manager.num_blocks_in_use(), 0);
+  // block 0 is reserved for padding
+  EXPECT_EQ(manager.num_free_blocks(), 9);
+}
+
+TEST(BlockManagerTest, BlockGroups) {
+  BlockManager::Options options;
+  options.num_blocks(10).block_size(2).enable_prefix_cache(false);
+  options.num_block_groups(2);
+  BlockManager manager(options);
+  EXPECT_EQ(manager.num_blocks_per_group(), 5);
+  EXPECT_EQ(manager.num_total_blocks(), 10);
+  // block 0 and 5 are reserved for padding
+  EXPECT_EQ(manager.num_free_blocks(), 8);
+
+  // the new sequences go to the group with the most free blocks
+  Request request("", {1, 2, 3, 4, 5}, /*seq_capacity=*/20, 3, 3, false);
+  std::vector<int32_t> groups;
+  for (size_t i = 0; i < 3; ++i) {
+    request.add_sequence();
+    Sequence& sequence = request.sequences[i];
+    EXPECT_TRUE(manager.allocate_blocks_for(&sequence, /*num_tokens=*/i + 1));
+    const int32_t group = manager.block_group_of(sequence);
+    for (const auto& block : sequence.blocks()) {
+      EXPECT_EQ(block.id() / 5, group);
+      EXPECT_NE(block.id() % 5, 0);
+    }
+    groups.push_back(group);
+  }
+  EXPECT_EQ(groups, std::vector<int32_t>({0, 1, 0}));
+
+  // the sequences keep growing in their groups, with 2 free blocks each
+  Sequence& sequence = request.sequences[1];
+  EXPECT_TRUE(manager.allocate_blocks_for(&sequence, /*num_tokens=*/6));
+  EXPECT_EQ(sequence.num_blocks(), 3);
+  for (const auto& block : sequence.blocks()) {
+    EXPECT_EQ(block.id() / 5, 1);
+  }
+  EXPECT_FALSE(manager.allocate_blocks_for(&sequence, /*num_tokens=*/10));
+  EXPECT_EQ(manager.num_free_blocks(), 2);
+
+  manager.release_blocks_for(&request);
+  EXPECT_EQ(manager.num_free_blocks(), 8);
+}
+
+TEST(BlockManagerTest, ForkBeamBlocks) {
+  BlockManager::Options options;
+  options.num_blocks(10).block_size(2).enable_prefix_cache(false);
+  BlockManager manager(options);
+
+  Request request("", {1, 2, 3, 4, 5}, /*seq_capacity=*/20, 1, 1, false);
+  request.beam_width = 2;
+  request.add_sequence();
+  Sequence& beam = request.sequences[0];
+  EXPECT_TRUE(manager.allocate_blocks_for(&beam));
+  beam.commit_kv_cache(/*size=*/5);
+  beam.append_token(6);
+  EXPECT_EQ(manager.num_blocks_in_use(), 3);
+
+  // a new beam as a copy of the beam, sharing its blocks until forked
+  Sequence& other = request.sequences.emplace_back(beam);
+  other.release_blocks();
+  EXPECT_TRUE(manager.fork_beam_blocks_for(beam, &other));
+  other.assign_beam(beam, /*token_id=*/7, /*logprob=*/-1.0);
+  // two full blocks are shared, and the partially filled third block that
+  // both beams write into next is copied.
+  EXPECT_EQ(other.num_blocks(), 3);
+  EXPECT_EQ(other.num_kv_cache_tokens(), 5);
+  EXPECT_EQ(other.blocks()[0], beam.blocks()[0]);
+  EXPECT_EQ(other.blocks()[1], beam.blocks()[1]);
+  EXPECT_FALSE(other.blocks()[2] == beam.blocks()[2]);
+  EXPECT_EQ(manager.num_blocks_in_use(), 4);
+  EXPECT_EQ(
+      manager.take_copy_blocks(),
+      std::vector<int32_t>({beam.blocks()[2].id(), other.blocks()[2].id()}));
+  EXPECT_EQ(other.token_ids(), std::vector<int32_t>({1, 2, 3, 4, 5, 7}));
+
+  // forking into a beam releases the blocks it doesn't share
+  EXPECT_TRUE(manager.fork_beam_blocks_for(beam, &other));
+  EXPECT_EQ(manager.num_blocks_in_use(), 4);
+  EXPECT_EQ(manager.take_copy_blocks().size(), 2);
+
+  manager.release_blocks_for(&other);
+  EXPECT_EQ(manager.num_blocks_in_use(), 3);
+  manager.release_blocks_for(&beam);
+  EXPECT_EQ(manager.num_blocks_in_use(), 0);
+  // block 0 is reserved for padding
+  EXPECT_EQ(manager.num_free_blocks(), 9);
+}
+
+TEST(BlockManagerTest, CacheCommittedBlocks) {
+  BlockManager::Options options;
+  options.num_blocks(10).block_size(2);
+  BlockManager manager(options);
+
+  Request request("", {1, 2, 3, 4, 5, 6}, /*seq_capacity=*/20, 1, 1, false);
+  request.add_sequence();
+  Sequence& sequence = request.sequences[0];
+  EXPECT_TRUE(manager.allocate_blocks_for(&sequence, /*num_tokens=*/4));
+  EXPECT_EQ(manager.num_blocks_in_use(), 2);
+
+  // the first chunk of the prompt is cached while it is running
+  sequence.commit_kv_cache(/*size=*/3);
+  manager.cache_committed_blocks_for(&sequence);
+  EXPECT_EQ(manager.num_blocks_in_prefix_cache(), 1);
+  EXPECT_EQ(sequence.blocks()[0].ref_count(), 2);
+  EXPECT_EQ(manager.num_blocks_in_use(), 2);
+
+  // another sequence with the same prompt shares the cached block
+  Request other("", {1, 2, 3, 4, 5, 6}, /*seq_capacity=*/20, 1, 1, false);
+  other.add_sequence();
+  EXPECT_EQ(manager.num_cached_tokens(other.sequences[0]), 2);
+  EXPECT_TRUE(manager.allocate_blocks_for(&other.sequences[0]));
+  EXPECT_EQ(other.sequences[0].blocks()[0], sequence.blocks()[0]);
+  EXPECT_EQ(other.sequences[0].num_kv_cache_tokens(), 2);
+
+  manager.release_blocks_for(&other);
+  manager.release_blocks_for(&request);
+  EXPECT_EQ(manager.num_blocks_in_use(), 0);
+}
+
+TEST(BlockManagerTest, CompactBlocks) {
+  BlockManager::Options options;
+  options.num_blocks(10).block_size(2);
+  BlockManager manager(options);
+
+  // interleave the blocks of two sequences
+  Request request("", {1, 2, 3, 4, 5, 6}, /*seq_capacity=*/20, 2, 2, false);
+  request.add_sequence();
+  request.add_sequence();
+  Sequence& seq0 = request.sequences[0];
+  Sequence& seq1 = request.sequences[1];
+  for (size_t num_tokens = 2; num_tokens <= 6; num_tokens += 2) {
+    EXPECT_TRUE(manager.allocate_blocks_for(&seq0, num_tokens));
+    EXPECT_TRUE(manager.allocate_blocks_for(&seq1, num_tokens));
+  }
+  EXPECT_EQ(seq0.blocks()[0].id(), 1);
+  EXPECT_EQ(seq0.blocks()[1].id(), 3);
+  EXPECT_EQ(seq0.blocks()[2].id(), 5);
+  seq0.commit_kv_cache(/*size=*/6);
+  manager.cache_blocks_for(&seq0);
+  EXPECT_EQ(manager.num_blocks_in_prefix_cache(), 3);
+  const size_t num_blocks_in_use = manager.num_blocks_in_use();
+
+  // the blocks of seq0 are moved into 7, 8, 9 with the prefix cache updated
+  EXPECT_EQ(manager.compact_blocks_for(&seq0), 3);
+  EXPECT_EQ(seq0.blocks()[0].id(), 7);
+  EXPECT_EQ(seq0.blocks()[1].id(), 8);
+  EXPECT_EQ(seq0.blocks()[2].id(), 9);
+  EXPECT_EQ(seq0.blocks()[0].ref_count(), 2);
+  EXPECT_EQ(manager.num_blocks_in_use(), num_blocks_in_use);
+  // already contiguous
+  EXPECT_EQ(manager.compact_blocks_for(&seq0), 0);
+  // no free run for seq1, the moved out blocks are held until the copies
+  // are taken
+  EXPECT_EQ(manager.compact_blocks_for(&seq1), 0);
+  EXPECT_EQ(manager.num_free_blocks(), 0);
+  EXPECT_EQ(manager.take_copy_blocks(),
+            std::vector<int32_t>({1, 7, 3, 8, 5, 9}));
+  EXPECT_EQ(manager.num_free_blocks(), 3);
+
+  // a new sequence shares the moved blocks from the prefix cache
+  Request other("", {1, 2, 3, 4, 5, 6, 7}, /*seq_capacity=*/20, 1, 1, false);
+  other.add_sequence();
+  EXPECT_TRUE(manager.allocate_blocks_for(&other.sequences[0]));
+  EXPECT_EQ(other.sequences[0].blocks()[0].id(), 7);
+  // blocks shared with other sequences are not moved
+  EXPECT_EQ(manager.compact_blocks_for(&other.sequences[0]), 0);
+
+  manager.release_blocks_for(&other);
+  manager.release_blocks_for(&request);
+}
+
+TEST(BlockManagerTest, ReceiveBlocks) {
+  BlockManager::Options options;
+  options.num_blocks(10).block_size(2).enable_prefix_cache(false);
+  BlockManager src_manager(options);
+
+  // two sequences sharing the two full blocks of the prompt
+  Request request("", {1, 2, 3, 4, 5, 6}, /*seq_capacity=*/20, 2, 2, false);
+  request.add_sequence();
+  Sequence& seq0 = request.sequences[0];
+  EXPECT_TRUE(src_manager.allocate_blocks_for(&seq0));
+  seq0.commit_kv_cache(/*size=*/6);
+  request.add_sequence();
+  Sequence& seq1 = request.sequences[1];
+  EXPECT_TRUE(src_manager.fork_blocks_for(seq0, &seq1));
+  src_manager.take_copy_blocks();
+
+  // not enough blocks, the request is not changed
+  BlockManager small_manager(BlockManager::Options(options).num_blocks(4));
+  std::vector<int32_t> src_to_dst;
+  std::vector<Block> src_blocks;
+  EXPECT_FALSE(
+      small_manager.receive_blocks_for(&request, &src_to_dst, &src_blocks));
+  EXPECT_TRUE(src_to_dst.empty());
+  EXPECT_TRUE(src_blocks.empty());
+  EXPECT_EQ(seq0.blocks()[0].id(), 1);
+
+  BlockManager manager(options);
+  Request other("", {1, 2, 3, 4, 5}, /*seq_capacity=*/20, 1, 1, false);
+  other.add_sequence();
+  EXPECT_TRUE(manager.allocate_blocks_for(&other.sequences[0]));
+  EXPECT_EQ(manager.num_blocks_in_use(), 3);
+
+  // the shared blocks are received once
+  EXPECT_TRUE(manager.receive_blocks_for(&request, &src_to_dst, &src_blocks));
+  EXPECT_EQ(src_to_dst, std::vector<int32_t>({1, 4, 2, 5, 3, 6, 4, 7}));
+  EXPECT_EQ(src_blocks.size(), 6);
+  EXPECT_EQ(seq0.blocks()[2].id(), 6);
+  EXPECT_EQ(seq1.blocks()[2].id(), 7);
+  EXPECT_EQ(seq1.blocks()[0], seq0.blocks()[0]);
+  EXPECT_EQ(seq0.blocks()[0].ref_count(), 2);
+  EXPECT_EQ(seq0.num_kv_cache_tokens(), 6);
+  EXPECT_EQ(manager.num_blocks_in_use(), 7);
+
+  // the source blocks are freed once released after the copies
+  Block::release(&src_blocks);
+  EXPECT_EQ(src_manager.num_free_blocks(), 9);
+
+  manager.release_blocks_for(&request);
+  manager.release_blocks_for(&other);
+  EXPECT_EQ(manager.num_blocks_in_use(), 0);
+}
+
+TEST(BlockManagerTest, ImportPrefixBlocks) {
+  BlockManager::Options options;
+  options.num_blocks(10).block_size(2);
+  BlockManager manager(options);
+  const std::vector<int32_t> token_ids = {1, 2, 3, 4, 5, 6, 7};
+
+  // nothing is cached if the kv cache fails to be written
+  auto fail = [](size_t, const std::vector<Block>&) { return false; };
+  EXPECT_EQ(manager.import_prefix_blocks(token_ids, fail), 0);
+  EXPECT_EQ(manager.num_blocks_in_prefix_cache(), 0);
+  EXPECT_EQ(manager.num_free_blocks(), 9);
+
+  // the partial block is dropped
+  std::vector<int32_t> written;
+  auto write = [&](size_t start_block, const std::vector<Block>& blocks) {
+    EXPECT_EQ(start_block, written.size());
+    for (const auto& block : blocks) {
+      written.push_back(block.id());
+    }
+    return true;
+  };
+  const std::vector<int32_t> prefix = {1, 2, 3, 4};
+  EXPECT_EQ(manager.import_prefix_blocks(prefix, write), 4);
+  EXPECT_EQ(written.size(), 2);
+  // only the blocks not cached yet are written
+  EXPECT_EQ(manager.import_prefix_blocks(token_ids, write), 2);
+  EXPECT_EQ(written.size(), 3);
+  EXPECT_EQ(manager.import_prefix_blocks(token_ids, write), 0);
+
+  EXPECT_EQ(manager.cached_block_ids(token_ids), written);
+  EXPECT_EQ(manager.num_blocks_in_prefix_cache(), 3);
+  EXPECT_EQ(manager.num_blocks_in_use(), 0);
+  EXPECT_EQ(manager.num_free_blocks(), 6);
+}
+
+TEST(BlockManagerTest, LargeBlocks) {
+  BlockManager::Options options;
+  // large blocks [4, 8), [8, 12) and [12, 16)
+  options.num_blocks(18).block_size(2).large_block_size(8);
+  options.enable_prefix_cache(false);
+  BlockManager manager(options);
+  EXPECT_EQ(manager.num_free_large_blocks(), 3);
+
+  // the prompt gets a large block and a block
+  Request request("", {1, 2, 3, 4, 5, 6, 7, 8, 9}, 20, 1, 1, false);
+  request.add_sequence();
+  Sequence& sequence = request.sequences[0];
+  EXPECT_TRUE(manager.allocate_blocks_for(&sequence));
+  ASSERT_EQ(sequence.num_blocks(), 5);
+  for (size_t i = 0; i < 4; ++i) {
+    EXPECT_EQ(sequence.blocks()[i].id(), 4 + i);
+  }
+  EXPECT_EQ(sequence.blocks()[4].id(), 1);
+  EXPECT_EQ(manager.num_free_large_blocks(), 2);
+  EXPECT_EQ(manager.num_blocks_in_use(), 5);
+
+  // decoding allocates blocks one by one
+  sequence.commit_kv_cache(/*size=*/9);
+  sequence.append_token(10);
+  sequence.append_token(11);
+  EXPECT_TRUE(manager.allocate_blocks_for(&sequence));
+  EXPECT_EQ(sequence.blocks()[5].id(), 2);
+
+  manager.release_blocks_for(&request);
+  EXPECT_EQ(manager.num_blocks_in_use(), 0);
+  EXPECT_EQ(manager.num_free_blocks(), 17);
+}
+
+TEST(BlockManagerTest, SlidingWindow) {
+  BlockManager::Options options;
+  options.num_blocks(10).block_size(2).enable_prefix_cache(false);
+  options.sliding_window(3);
+  BlockManager manager(options);
+
+  Request request("", {1, 2, 3, 4, 5}, /*seq_capacity=*/20, 1, 1, false);
+  request.add_sequence();
+  Sequence& sequence = request.sequences[0];
+  EXPECT_TRUE(manager.allocate_blocks_for(&sequence));
+  EXPECT_EQ(sequence.num_blocks(), 3);
+  EXPECT_EQ(manager.num_blocks_in_use(), 3);
+  EXPECT_EQ(manager.num_free_blocks(), 6);
+
+  // token 5 attends to tokens [2, 5), block 0 is out of the window
+  sequence.commit_kv_cache(/*size=*/5);
+  sequence.append_token(6);
+  EXPECT_TRUE(manager.allocate_blocks_for(&sequence));
+  EXPECT_EQ(sequence.num_released_blocks(), 1);
+  EXPECT_EQ(sequence.num_blocks(), 3);
+  EXPECT_EQ(sequence.blocks()[0].id(), 0);
+  EXPECT_EQ(manager.num_blocks_in_use(), 2);
+  EXPECT_EQ(manager.num_free_blocks(), 7);
+
+  // token 6 attends to tokens [3, 6), block 1 is still in the window
+  sequence.commit_kv_cache(/*size=*/1);
+  sequence.append_token(7);
+  EXPECT_TRUE(manager.allocate_blocks_for(&sequence));
+  EXPECT_EQ(sequence.num_released_blocks(), 1);
+  EXPECT_EQ(sequence.num_blocks(), 4);
+  EXPECT_EQ(manager.num_blocks_in_use(), 3);
+
+  sequence.commit_kv_cache(/*size=*/1);
+  sequence.append_token(8);
+  EXPECT_TRUE(manager.allocate_blocks_for(&sequence));
+  EXPECT_EQ(sequence.num_released_blocks(), 2);
+  EXPECT_EQ(sequence.num_blocks(), 4);
+  EXPECT_EQ(manager.num_blocks_in_use(), 2);
+  EXPECT_EQ(manager.num_free_blocks(), 7);
+
+  // the kv cache slots of the new tokens are in the kept blocks
+  const auto slots = sequence.kv_cache_slots(7, 8);
+  EXPECT_EQ(slots[0] / 2, sequence.blocks()[3].id());
+
+  manager.release_blocks_for(&request);
+  EXPECT_EQ(sequence.num_released_blocks(), 0);
+  EXPECT_EQ(manager.num_blocks_in_use(), 0);
+  EXPECT_EQ(manager.num_free_blocks(), 9);
+}
+
+TEST(BlockManagerTest, EvictKvBlocks) {
+  BlockManager::Options options;
+  options.num_blocks(10).block_size(2).enable_prefix_cache(false);
+  options.kv_budget(8).kv_observation_window(2);
+  BlockManager manager(options);
+
+  Request request("", {1, 2, 3, 4, 5, 6, 7, 8, 9}, /*seq_capacity=*/20, 1, 1,
+                  false);
+  request.add_sequence();
+  Sequence& sequence = request.sequences[0];
+  EXPECT_TRUE(manager.allocate_blocks_for(&sequence));
+  EXPECT_EQ(sequence.kv_observation_window(), 2);
+  EXPECT_EQ(sequence.num_blocks(), 5);
+  EXPECT_EQ(manager.num_blocks_in_use(), 5);
+
+  // tokens 7 and 8 are observed, blocks 3 and 4 are kept with the sink block,
+  // block 2 is kept within the budget and block 1 is evicted
+  sequence.commit_kv_cache(/*size=*/9);
+  std::vector<int32_t> block_ids;
+  for (const auto& block : sequence.blocks()) {
+    block_ids.push_back(block.id());
+  }
+  sequence.set_kv_block_scores({1.0f, 0.1f, 0.5f, 0.2f, 1.0f});
+  sequence.append_token(10);
+  EXPECT_TRUE(manager.allocate_blocks_for(&sequence));
+  EXPECT_TRUE(sequence.kv_block_scores().empty());
+  EXPECT_EQ(sequence.num_evicted_tokens(), 2);
+  EXPECT_EQ(sequence.num_blocks(), 4);
+  EXPECT_EQ(sequence.blocks()[0].id(), block_ids[0]);
+  EXPECT_EQ(sequence.blocks()[1].id(), block_ids[2]);
+  EXPECT_EQ(sequence.blocks()[2].id(), block_ids[3]);
+  EXPECT_EQ(sequence.blocks()[3].id(), block_ids[4]);
+  EXPECT_EQ(sequence.kv_cache_capacity(), 10);
+  EXPECT_EQ(manager.num_blocks_in_use(), 4);
+  EXPECT_EQ(manager.num_free_blocks(), 5);
+
+  // the kv cache of token 9 is in the last block
+  const auto slots = sequence.kv_cache_slots(9, 10);
+  EXPECT_EQ(slots[0], block_ids[4] * 2 + 1);
+
+  // nothing is evicted without new scores
+  sequence.commit_kv_cache(/*size=*/1);
+  sequence.append_token(11);
+  EXPECT_TRUE(manager.allocate_blocks_for(&sequence));
+  EXPECT_EQ(sequence.num_evicted_tokens(), 2);
+  EXPECT_EQ(sequence.num_blocks(), 5);
+
+  manager.release_blocks_for(&request);
+  EXPECT_EQ(sequence.num_evicted_tokens(), 0);
+  EXPECT_EQ(manager.num_blocks_in_use(), 0);
+  EXPECT_EQ(manager.num_free_blocks(), 9);
+}
+
+TEST(BlockManagerTest, HybridAttention) {
+  BlockManager::Options options;
+  options.num_blocks(5).block_size(2).enable_prefix_cache(false);
+  options.num_host_blocks(4).hybrid_attention_device_blocks(2);
+  BlockManager manager(options);
+
+  Request request("", {1, 2, 3, 4, 5, 6, 7, 8}, /*seq_capacity=*/20, 1, 1,
+                  false);
+  request.add_sequence();
+  Sequence& sequence = request.sequences[0];
+  EXPECT_TRUE(manager.allocate_blocks_for(&sequence));
+  EXPECT_EQ(sequence.num_blocks(), 4);
+  EXPECT_EQ(manager.num_free_blocks(), 0);
+  sequence.commit_kv_cache(/*size=*/8);
+  std::vector<int32_t> block_ids;
+  for (const auto& block : sequence.blocks()) {
+    block_ids.push_back(block.id());
+  }
+
+  // out of device blocks, the first two blocks are offloaded to host
+  sequence.append_token(9);
+  EXPECT_TRUE(manager.allocate_blocks_for(&sequence));
+  EXPECT_EQ(sequence.num_blocks(), 3);
+  EXPECT_EQ(sequence.blocks()[0].id(), block_ids[2]);
+  EXPECT_EQ(sequence.blocks()[1].id(), block_ids[3]);
+  ASSERT_EQ(sequence.offloaded_blocks().size(), 2);
+  EXPECT_EQ(sequence.num_evicted_tokens(), 4);
+  EXPECT_EQ(sequence.kv_cache_capacity(), 10);
+  EXPECT_EQ(manager.num_blocks_in_use(), 3);
+  EXPECT_EQ(manager.num_free_blocks(), 1);
+  EXPECT_EQ(manager.num_free_host_blocks(), 2);
+
+  const auto swap_out = manager.take_swap_out_blocks();
+  ASSERT_EQ(swap_out.size(), 4);
+  for (size_t i = 0; i < 2; ++i) {
+    EXPECT_EQ(swap_out[2 * i], block_ids[i]);
+    EXPECT_EQ(swap_out[2 * i + 1], sequence.offloaded_blocks()[i].id());
+  }
+
+  // the offloaded sequence is recomputed instead of swapped out
+  EXPECT_FALSE(manager.swap_out_blocks_for(&request));
+
+  manager.release_blocks_for(&request);
+  EXPECT_TRUE(sequence.offloaded_blocks().empty());
+  EXPECT_EQ(sequence.num_evicted_tokens(), 0);
+  EXPECT_EQ(manager.num_blocks_in_use(), 0);
+  EXPECT_EQ(manager.num_free_blocks(), 4);
+  EXPECT_EQ(manager.num_free_host_blocks(), 4);
+}
+
+}  // namespace llm
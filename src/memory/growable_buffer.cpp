@@ -0,0 +1,111 @@
+#include "growable_buffer.h"
+
+#include <c10/cuda/CUDAGuard.h>
+#include <cuda.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace llm {
+namespace {
+
+#define CHECK_CU(expr)                                                 \
+  do {                                                                 \
+    const CUresult result = (expr);                                    \
+    if (result != CUDA_SUCCESS) {                                      \
+      const char* error = nullptr;                                     \
+      cuGetErrorString(result, &error);                                \
+      LOG(FATAL) << #expr << " failed: " << (error ? error : "unknown"); \
+    }                                                                  \
+  } while (0)
+
+CUmemAllocationProp allocation_prop(int device_index) {
+  CUmemAllocationProp prop = {};
+  prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+  prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+  prop.location.id = device_index;
+  return prop;
+}
+
+size_t round_up(size_t n, size_t multiple) {
+  return (n + multiple - 1) / multiple * multiple;
+}
+
+}  // namespace
+
+GrowableBuffer::GrowableBuffer(const torch::Device& device, int64_t max_bytes)
+    : device_(device) {
+  CHECK(device.is_cuda() && device.has_index())
+      << "growable buffers are only supported on cuda devices, got " << device;
+  CHECK_GT(max_bytes, 0);
+  c10::cuda::CUDAGuard device_guard(device_);
+
+  const CUmemAllocationProp prop = allocation_prop(device_.index());
+  CHECK_CU(cuMemGetAllocationGranularity(
+      &granularity_, &prop, CU_MEM_ALLOC_GRANULARITY_MINIMUM));
+  max_bytes_ = round_up(static_cast<size_t>(max_bytes), granularity_);
+  CHECK_CU(cuMemAddressReserve(&base_,
+                               max_bytes_,
+                               /*alignment=*/granularity_,
+                               /*addr=*/0,
+                               /*flags=*/0));
+}
+
+GrowableBuffer::~GrowableBuffer() {
+  c10::cuda::CUDAGuard device_guard(device_);
+  resize(0);
+  CHECK_CU(cuMemAddressFree(base_, max_bytes_));
+}
+
+bool GrowableBuffer::resize(int64_t n_bytes) {
+  CHECK(n_bytes >= 0 && static_cast<size_t>(n_bytes) <= max_bytes_)
+      << "size " << n_bytes << " out of the capacity " << max_bytes_;
+  c10::cuda::CUDAGuard device_guard(device_);
+  const size_t n_chunks =
+      round_up(static_cast<size_t>(n_bytes), granularity_) / granularity_;
+
+  // unmap and release the chunks at the end
+  while (chunks_.size() > n_chunks) {
+    const CUdeviceptr ptr = base_ + (chunks_.size() - 1) * granularity_;
+    CHECK_CU(cuMemUnmap(ptr, granularity_));
+    CHECK_CU(cuMemRelease(chunks_.back()));
+    chunks_.pop_back();
+  }
+  if (chunks_.size() == n_chunks) {
+    return true;
+  }
+
+  // map new chunks after the mapped ones, all or nothing
+  const CUmemAllocationProp prop = allocation_prop(device_.index());
+  const size_t n_mapped = chunks_.size();
+  const CUdeviceptr start = base_ + n_mapped * granularity_;
+  while (chunks_.size() < n_chunks) {
+    CUmemGenericAllocationHandle handle;
+    const CUresult result =
+        cuMemCreate(&handle, granularity_, &prop, /*flags=*/0);
+    if (result == CUDA_ERROR_OUT_OF_MEMORY) {
+      LOG(WARNING) << "Out of memory to grow the buffer on " << device_
+                   << " to " << n_bytes << " bytes";
+      // roll back to the mapped size
+      resize(static_cast<int64_t>(n_mapped * granularity_));
+      return false;
+    }
+    CHECK_CU(result);
+    const CUdeviceptr ptr = base_ + chunks_.size() * granularity_;
+    CHECK_CU(cuMemMap(ptr, granularity_, /*offset=*/0, handle, /*flags=*/0));
+    chunks_.push_back(handle);
+  }
+
+  // allow the device to access the new chunks
+  CUmemAccessDesc access = {};
+  access.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+  access.location.id = device_.index();
+  access.flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+  CHECK_CU(cuMemSetAccess(
+      start, (n_chunks - n_mapped) * granularity_, &access, /*count=*/1));
+  return true;
+}
+
+}  // namespace llm
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cuda.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace llm {
+
+// A device buffer with a fixed virtual address range of max_bytes, backed by
+// physical memory only for its first size() bytes. Resizing maps or unmaps
+// physical memory at the end of the range in chunks of the allocation
+// granularity, so the address of the buffer stays valid across resizes, e.g.
+// for the tensors captured by cuda graphs. The memory is allocated with the
+// cuda virtual memory management api, outside of the caching allocator of
+// torch. Not thread safe.
+class GrowableBuffer final {
+ public:
+  // reserve the virtual address range of max_bytes on the device without
+  // mapping any memory.
+  GrowableBuffer(const torch::Device& device, int64_t max_bytes);
+
+  ~GrowableBuffer();
+
+  // disable copy, move and assign
+  GrowableBuffer(const GrowableBuffer&) = delete;
+  GrowableBuffer(GrowableBuffer&&) = delete;
+  GrowableBuffer& operator=(const GrowableBuffer&) = delete;
+  GrowableBuffer& operator=(GrowableBuffer&&) = delete;
+
+  // map memory for the first n_bytes of the buffer, rounded up to the
+  // granularity, and unmap the rest. returns false without changing the
+  // buffer if the device is out of memory. the caller should make sure the
+  // unmapped memory is not in use by any pending kernel.
+  bool resize(int64_t n_bytes);
+
+  // the start of the buffer
+  void* data() const { return reinterpret_cast<void*>(base_); }
+
+  // number of mapped bytes
+  int64_t size() const {
+    return static_cast<int64_t>(chunks_.size() * granularity_);
+  }
+
+  // number of bytes of the virtual address range
+  int64_t capacity() const { return static_cast<int64_t>(max_bytes_); }
+
+  const torch::Device& device() const { return device_; }
+
+ private:
+  torch::Device device_;
+
+  // the start of the virtual address range
+  CUdeviceptr base_ = 0;
+
+  // size of the virtual address range, a multiple of the granularity
+  size_t max_bytes_ = 0;
+
+  // the minimal size of a physical allocation
+  size_t granularity_ = 0;
+
+  // the physical allocations mapped at the start of the range in order, each
+  // of the granularity size.
+  std::vector<CUmemGenericAllocationHandle> chunks_;
+};
+
+}  // namespace llm
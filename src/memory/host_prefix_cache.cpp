@@ -0,0 +1,138 @@
+#include "host_prefix_cache.h"
+
+#include <glog/logging.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "common/slice.h"
+
+namespace llm {
+namespace {
+// fnv-1a style hash chained over tokens
+uint64_t hash_tokens(uint64_t seed, const Slice<int32_t>& token_ids) {
+  constexpr uint64_t kPrime = 1099511628211ULL;
+  uint64_t hash = seed;
+  for (const int32_t token_id : token_ids) {
+    hash ^= static_cast<uint32_t>(token_id);
+    hash *= kPrime;
+  }
+  return hash;
+}
+
+constexpr uint64_t kHashSeed = 14695981039346656037ULL;
+}  // namespace
+
+HostPrefixCache::HostPrefixCache(uint32_t block_size)
+    : block_size_(block_size) {
+  CHECK_GT(block_size, 0) << "Block size should be greater than 0";
+}
+
+std::vector<Block> HostPrefixCache::match(const Slice<int32_t>& token_ids,
+                                          size_t start_block) {
+  std::vector<Block> blocks;
+  const size_t n_blocks = token_ids.size() / block_size_;
+  if (entries_.empty() || start_block >= n_blocks) {
+    return blocks;
+  }
+
+  const auto hashes = block_hashes(token_ids, n_blocks);
+  for (size_t i = start_block; i < n_blocks; ++i) {
+    const uint64_t prefix_hash = i == 0 ? kHashSeed : hashes[i - 1];
+    const auto block_tokens =
+        token_ids.slice(i * block_size_, (i + 1) * block_size_);
+    Entry* entry = find(hashes[i], prefix_hash, block_tokens);
+    if (entry == nullptr) {
+      break;
+    }
+    // move the entry to the back of the lru list
+    lru_.splice(lru_.end(), lru_, entry->lru_it);
+    blocks.push_back(entry->block);
+  }
+  return blocks;
+}
+
+size_t HostPrefixCache::insert(const Slice<int32_t>& token_ids,
+                               const Slice<Block>& blocks,
+                               size_t start_block) {
+  const size_t n_blocks = start_block + blocks.size();
+  CHECK_GE(token_ids.size(), n_blocks * block_size_)
+      << "The token ids should cover all blocks";
+
+  const auto hashes = block_hashes(token_ids, n_blocks);
+  size_t n_inserted = 0;
+  for (size_t i = start_block; i < n_blocks; ++i) {
+    const uint64_t prefix_hash = i == 0 ? kHashSeed : hashes[i - 1];
+    const auto block_tokens =
+        token_ids.slice(i * block_size_, (i + 1) * block_size_);
+    Entry* entry = find(hashes[i], prefix_hash, block_tokens);
+    if (entry != nullptr) {
+      // already cached, just refresh the lru position
+      lru_.splice(lru_.end(), lru_, entry->lru_it);
+      continue;
+    }
+    // replace the entry on hash collision
+    auto it = entries_.find(hashes[i]);
+    if (it != entries_.end()) {
+      lru_.erase(it->second.lru_it);
+      entries_.erase(it);
+    }
+
+    Entry& new_entry = entries_[hashes[i]];
+    new_entry.prefix_hash = prefix_hash;
+    new_entry.token_ids = block_tokens;
+    new_entry.block = blocks[i - start_block];
+    new_entry.lru_it = lru_.insert(lru_.end(), hashes[i]);
+    ++n_inserted;
+  }
+  return n_inserted;
+}
+
+size_t HostPrefixCache::evict(size_t n_blocks_to_evict) {
+  size_t total_evicted = 0;
+  for (auto it = lru_.begin();
+       total_evicted < n_blocks_to_evict && it != lru_.end();) {
+    auto entry_it = entries_.find(*it);
+    DCHECK(entry_it != entries_.end());
+    // skip blocks that are still in use
+    if (entry_it->second.block.is_shared()) {
+      ++it;
+      continue;
+    }
+    entries_.erase(entry_it);
+    it = lru_.erase(it);
+    ++total_evicted;
+  }
+  return total_evicted;
+}
+
+std::vector<uint64_t> HostPrefixCache::block_hashes(
+    const Slice<int32_t>& token_ids,
+    size_t n_blocks) const {
+  std::vector<uint64_t> hashes;
+  hashes.reserve(n_blocks);
+  uint64_t hash = kHashSeed;
+  for (size_t i = 0; i < n_blocks; ++i) {
+    hash = hash_tokens(
+        hash, token_ids.slice(i * block_size_, (i + 1) * block_size_));
+    hashes.push_back(hash);
+  }
+  return hashes;
+}
+
+HostPrefixCache::Entry* HostPrefixCache::find(
+    uint64_t hash,
+    uint64_t prefix_hash,
+    const Slice<int32_t>& block_tokens) {
+  auto it = entries_.find(hash);
+  if (it == entries_.end()) {
+    return nullptr;
+  }
+  Entry& entry = it->second;
+  if (entry.prefix_hash != prefix_hash || !(entry.token_ids == block_tokens)) {
+    return nullptr;
+  }
+  return &entry;
+}
+
+}  // namespace llm
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "block.h"
+#include "common/slice.h"
+
+namespace llm {
+
+// A second tier prefix cache for kv cache blocks that were evicted from the
+// device prefix cache and copied into host memory. Each block is keyed by the
+// hash of all tokens up to the end of the block, so that blocks of the same
+// prefix can be demoted independently and matched from any block index.
+class HostPrefixCache final {
+ public:
+  explicit HostPrefixCache(uint32_t block_size);
+
+  // disable copy, move and assign
+  HostPrefixCache(const HostPrefixCache&) = delete;
+  HostPrefixCache(HostPrefixCache&&) = delete;
+  HostPrefixCache& operator=(const HostPrefixCache&) = delete;
+  HostPrefixCache& operator=(HostPrefixCache&&) = delete;
+
+  // match consecutive blocks starting from the block index start_block.
+  // return matched host blocks
+  std::vector<Block> match(const Slice<int32_t>& token_ids, size_t start_block);
+
+  // insert host blocks that hold the kv cache for blocks starting from the
+  // block index start_block. token_ids should cover all inserted blocks.
+  // return the number of new inserted blocks
+  size_t insert(const Slice<int32_t>& token_ids,
+                const Slice<Block>& blocks,
+                size_t start_block);
+
+  // evict least recently used blocks that are not in use
+  // return the actual number of evicted blocks
+  size_t evict(size_t n_blocks);
+
+  // get the number of blocks in the cache
+  size_t num_blocks() const { return entries_.size(); }
+
+ private:
+  struct Entry {
+    // hash of tokens before the block, used to verify the match
+    uint64_t prefix_hash = 0;
+    // the token ids that the block holds
+    std::vector<int32_t> token_ids;
+    // the host block
+    Block block;
+    // position in the lru list
+    std::list<uint64_t>::iterator lru_it;
+  };
+
+  // returns the hash of tokens up to the end of each block
+  std::vector<uint64_t> block_hashes(const Slice<int32_t>& token_ids,
+                                     size_t n_blocks) const;
+
+  // find the entry for the block, nullptr if not found
+  Entry* find(uint64_t hash,
+              uint64_t prefix_hash,
+              const Slice<int32_t>& block_tokens);
+
+  // block hash -> entry
+  std::unordered_map<uint64_t, Entry> entries_;
+
+  // block hashes sorted by the last access time, front is least recently used
+  std::list<uint64_t> lru_;
+
+  // the block size of the memory blocks
+  uint32_t block_size_;
+};
+
+}  // namespace llm
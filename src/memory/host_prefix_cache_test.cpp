@@ -0,0 +1,65 @@
+#include "host_prefix_cache.h"
+
+#include <gtest/gtest.h>
+
+#include "block_allocator.h"
+
+namespace llm {
+
+TEST(HostPrefixCacheTest, Basic) {
+  const uint32_t block_size = 2;
+  BlockAllocator allocator(/*total_blocks=*/10, block_size);
+  HostPrefixCache cache(block_size);
+
+  const std::vector<int32_t> token_ids = {1, 2, 3, 4, 5, 6, 7};
+  // empty cache
+  EXPECT_TRUE(cache.match(token_ids, 0).empty());
+
+  // insert the last two blocks
+  {
+    std::vector<Block> blocks = allocator.allocate(2);
+    EXPECT_EQ(cache.insert(token_ids, blocks, /*start_block=*/1), 2);
+    EXPECT_EQ(cache.num_blocks(), 2);
+    // insert again is a no-op
+    EXPECT_EQ(cache.insert(token_ids, blocks, /*start_block=*/1), 0);
+  }
+
+  // the first block is not cached
+  EXPECT_TRUE(cache.match(token_ids, 0).empty());
+  EXPECT_EQ(cache.match(token_ids, 1).size(), 2);
+  EXPECT_EQ(cache.match(token_ids, 2).size(), 1);
+
+  // match is keyed by the whole prefix
+  const std::vector<int32_t> other = {1, 0, 3, 4, 5, 6};
+  EXPECT_TRUE(cache.match(other, 1).empty());
+
+  // partial block is not matched
+  const std::vector<int32_t> short_ids = {1, 2, 3, 4, 5};
+  EXPECT_EQ(cache.match(short_ids, 1).size(), 1);
+}
+
+TEST(HostPrefixCacheTest, Evict) {
+  const uint32_t block_size = 2;
+  BlockAllocator allocator(/*total_blocks=*/10, block_size);
+  HostPrefixCache cache(block_size);
+
+  const std::vector<int32_t> token_ids = {1, 2, 3, 4, 5, 6};
+  cache.insert(token_ids, allocator.allocate(3), /*start_block=*/0);
+  EXPECT_EQ(allocator.num_free_blocks(), 7);
+
+  // hold the matched blocks to prevent eviction
+  auto blocks = cache.match(Slice<int32_t>(token_ids).slice(0, 2), 0);
+  ASSERT_EQ(blocks.size(), 1);
+
+  EXPECT_EQ(cache.evict(10), 2);
+  EXPECT_EQ(cache.num_blocks(), 1);
+  EXPECT_EQ(allocator.num_free_blocks(), 9);
+
+  // release the held block then evict
+  blocks.clear();
+  EXPECT_EQ(cache.evict(10), 1);
+  EXPECT_EQ(cache.num_blocks(), 0);
+  EXPECT_EQ(allocator.num_free_blocks(), 10);
+}
+
+}  // namespace llm
@@ -6,24 +6,251 @@
 #include <torch/torch.h>
 
 #include <cstdint>
+#include <memory>
+#include <utility>
 #include <vector>
 
 #include "kernels/kv_cache_kernels.h"
+#include "kernels/triton/triton_kernels.h"
+
+DEFINE_string(kv_cache_layout,
+              "nhd",
+              "Memory layout of the kv cache blocks, one of: nhd (slot major) "
+              "and hnd (head major). quantized kv cache only supports nhd.");
 
 namespace llm {
+namespace {
+// the minimal scale to avoid division by zero
+constexpr float kMinScale = 1e-8f;
+
+// quantize x: [n_tokens, n_kv_heads, head_dim] with per token per head scales
+std::tuple<torch::Tensor, torch::Tensor> quantize(const torch::Tensor& x,
+                                                  torch::ScalarType dtype) {
+  const float max_value = dtype == torch::kInt8 ? 127.0f : 448.0f;
+  auto x_fp32 = x.to(torch::kFloat32);
+  // [n_tokens, n_kv_heads]
+  auto scale =
+      x_fp32.abs().amax(/*dim=*/-1).div(max_value).clamp_min(kMinScale);
+  auto q = x_fp32.div(scale.unsqueeze(-1));
+  if (dtype == torch::kInt8) {
+    q = q.round().clamp(-max_value, max_value);
+  } else {
+    q = q.clamp(-max_value, max_value);
+  }
+  return {q.to(dtype), scale};
+}
+
+torch::Tensor dequantize(const torch::Tensor& q, const torch::Tensor& scale) {
+  return q.to(torch::kFloat32) * scale.unsqueeze(-1);
+}
+
+// view the slots of x: [n_slots, ...] as [n_blocks, block_size, ...]
+torch::Tensor blocks_view(const torch::Tensor& x, int64_t block_size) {
+  auto sizes = x.sizes().vec();
+  sizes[0] /= block_size;
+  sizes.insert(sizes.begin() + 1, block_size);
+  return x.view(sizes);
+}
+
+// gather the slots of the blocks: [n_blocks * block_size, ...]
+torch::Tensor gather_blocks(const torch::Tensor& blocks,
+                            const torch::Tensor& ids) {
+  return blocks.index_select(/*dim=*/0, ids).flatten(0, 1);
+}
+
+// write src: [n_blocks * block_size, ...] into the slots of the blocks
+void scatter_blocks(torch::Tensor blocks,
+                    const torch::Tensor& ids,
+                    const torch::Tensor& src) {
+  auto sizes = blocks.sizes().vec();
+  sizes[0] = ids.numel();
+  blocks.index_copy_(/*dim=*/0, ids, src.to(blocks.options()).reshape(sizes));
+}
+
+// view the buffer as a tensor, which keeps the buffer alive
+torch::Tensor view_of(const std::shared_ptr<GrowableBuffer>& buffer,
+                      torch::IntArrayRef sizes,
+                      const torch::TensorOptions& options) {
+  return torch::from_blob(
+      buffer->data(), sizes, [buffer](void* /*data*/) {}, options);
+}
+
+// copy the slot ids into an IntTensor on cpu
+torch::Tensor slot_ids_tensor(const Slice<int32_t>& slot_ids) {
+  return torch::from_blob(const_cast<int32_t*>(slot_ids.data()),
+                          {static_cast<int64_t>(slot_ids.size())},
+                          torch::kInt)
+      .clone();
+}
+}  // namespace
+
+KVCacheLayout parse_kv_cache_layout(const std::string& layout) {
+  if (layout == "nhd") {
+    return KVCacheLayout::kNHD;
+  }
+  if (layout == "hnd") {
+    return KVCacheLayout::kHND;
+  }
+  LOG(FATAL) << "Unsupported kv cache layout: " << layout;
+  return KVCacheLayout::kNHD;
+}
 
 KVCache::KVCache(int64_t n_blocks,
                  int64_t block_size,
                  int64_t n_kv_heads,
                  int64_t head_dim,
-                 const torch::TensorOptions& options)
-    : block_size_(block_size) {
+                 const torch::TensorOptions& options,
+                 KVCacheLayout layout,
+                 int64_t max_blocks)
+    : block_size_(block_size), layout_(layout) {
+  const bool quantized = is_quantized_dtype(options.dtype().toScalarType());
+  if (max_blocks > 0) {
+    CHECK(options.device().is_cuda())
+        << "resizable kv cache is only supported on cuda devices";
+    CHECK_GE(max_blocks, n_blocks);
+    CHECK(layout == KVCacheLayout::kNHD || !quantized)
+        << "quantized kv cache only supports the nhd layout";
+    n_kv_heads_ = n_kv_heads;
+    head_dim_ = head_dim;
+    options_ = options;
+    // reserve the address range of max_blocks for each tensor
+    const int64_t max_slots = max_blocks * block_size;
+    const int64_t cache_bytes = max_slots * n_kv_heads * head_dim *
+                                static_cast<int64_t>(options.itemsize());
+    const auto device = options.device();
+    key_buffer_ = std::make_shared<GrowableBuffer>(device, cache_bytes);
+    value_buffer_ = std::make_shared<GrowableBuffer>(device, cache_bytes);
+    if (quantized) {
+      const int64_t scale_bytes = max_slots * n_kv_heads * sizeof(float);
+      key_scale_buffer_ = std::make_shared<GrowableBuffer>(device, scale_bytes);
+      value_scale_buffer_ =
+          std::make_shared<GrowableBuffer>(device, scale_bytes);
+    }
+    CHECK(resize(n_blocks)) << "Failed to allocate " << n_blocks
+                            << " blocks for the kv cache";
+    return;
+  }
+
   // TODO: allocate cache with shape: [n_slots, num_heads, 2, head_dim]
+  if (layout == KVCacheLayout::kHND) {
+    CHECK(!is_quantized_dtype(options.dtype().toScalarType()))
+        << "quantized kv cache only supports the nhd layout";
+    // [n_blocks, n_kv_heads, block_size, head_dim]
+    key_cache_ =
+        torch::empty({n_blocks, n_kv_heads, block_size, head_dim}, options);
+    value_cache_ =
+        torch::empty({n_blocks, n_kv_heads, block_size, head_dim}, options);
+    return;
+  }
   // [n_slots, n_kv_heads, head_dim]
   key_cache_ =
       torch::empty({n_blocks * block_size, n_kv_heads, head_dim}, options);
   value_cache_ =
       torch::empty({n_blocks * block_size, n_kv_heads, head_dim}, options);
+
+  if (quantized) {
+    // [n_slots, n_kv_heads]
+    const auto scale_options = options.dtype(torch::kFloat32);
+    const int64_t n_slots = n_blocks * block_size;
+    key_scale_ = torch::ones({n_slots, n_kv_heads}, scale_options);
+    value_scale_ = torch::ones({n_slots, n_kv_heads}, scale_options);
+  }
+}
+
+KVCache::KVCache(torch::Tensor key_cache,
+                 torch::Tensor value_cache,
+                 torch::Tensor key_scale,
+                 torch::Tensor value_scale,
+                 int64_t block_size,
+                 KVCacheLayout layout)
+    : block_size_(block_size),
+      layout_(layout),
+      key_cache_(std::move(key_cache)),
+      value_cache_(std::move(value_cache)),
+      key_scale_(std::move(key_scale)),
+      value_scale_(std::move(value_scale)) {
+  CHECK_GT(block_size_, 0);
+  CHECK(layout_ == KVCacheLayout::kNHD || !key_scale_.defined())
+      << "quantized kv cache only supports the nhd layout";
+}
+
+int64_t KVCache::num_blocks() const {
+  if (empty()) {
+    return 0;
+  }
+  if (layout_ == KVCacheLayout::kHND) {
+    return key_cache_.size(0);
+  }
+  return key_cache_.size(0) / block_size_;
+}
+
+bool KVCache::resize(int64_t n_blocks) {
+  CHECK(is_resizable()) << "the kv cache is not resizable";
+  const int64_t old_blocks = key_cache_.defined() ? num_blocks() : 0;
+  if (n_blocks == old_blocks) {
+    return true;
+  }
+  const int64_t n_slots = n_blocks * block_size_;
+  const int64_t cache_bytes = n_slots * n_kv_heads_ * head_dim_ *
+                              static_cast<int64_t>(options_.itemsize());
+  const int64_t scale_bytes = n_slots * n_kv_heads_ * sizeof(float);
+  std::vector<std::pair<GrowableBuffer*, int64_t>> resizes = {
+      {key_buffer_.get(), cache_bytes}, {value_buffer_.get(), cache_bytes}};
+  if (key_scale_buffer_ != nullptr) {
+    resizes.emplace_back(key_scale_buffer_.get(), scale_bytes);
+    resizes.emplace_back(value_scale_buffer_.get(), scale_bytes);
+  }
+  // all or nothing, the buffers resized are restored on failure
+  std::vector<int64_t> old_sizes;
+  for (const auto& [buffer, bytes] : resizes) {
+    old_sizes.push_back(buffer->size());
+    if (!buffer->resize(bytes)) {
+      for (size_t i = 0; i + 1 < old_sizes.size(); ++i) {
+        resizes[i].first->resize(old_sizes[i]);
+      }
+      return false;
+    }
+  }
+  view_buffers(n_blocks);
+
+  // the scales of the new slots start as ones, same as a fixed size cache
+  if (key_scale_.defined() && n_blocks > old_blocks) {
+    const int64_t old_slots = old_blocks * block_size_;
+    key_scale_.slice(/*dim=*/0, old_slots).fill_(1.0f);
+    value_scale_.slice(/*dim=*/0, old_slots).fill_(1.0f);
+  }
+  return true;
+}
+
+void KVCache::view_buffers(int64_t n_blocks) {
+  if (layout_ == KVCacheLayout::kHND) {
+    // [n_blocks, n_kv_heads, block_size, head_dim]
+    const std::vector<int64_t> sizes = {
+        n_blocks, n_kv_heads_, block_size_, head_dim_};
+    key_cache_ = view_of(key_buffer_, sizes, options_);
+    value_cache_ = view_of(value_buffer_, sizes, options_);
+    return;
+  }
+  // [n_slots, n_kv_heads, head_dim]
+  const int64_t n_slots = n_blocks * block_size_;
+  const std::vector<int64_t> sizes = {n_slots, n_kv_heads_, head_dim_};
+  key_cache_ = view_of(key_buffer_, sizes, options_);
+  value_cache_ = view_of(value_buffer_, sizes, options_);
+  if (key_scale_buffer_ != nullptr) {
+    // [n_slots, n_kv_heads]
+    const auto scale_options = options_.dtype(torch::kFloat32);
+    key_scale_ =
+        view_of(key_scale_buffer_, {n_slots, n_kv_heads_}, scale_options);
+    value_scale_ =
+        view_of(value_scale_buffer_, {n_slots, n_kv_heads_}, scale_options);
+  }
+}
+
+torch::Tensor KVCache::blocks_of(const torch::Tensor& cache) const {
+  if (layout_ == KVCacheLayout::kHND) {
+    return cache.permute({0, 2, 1, 3});
+  }
+  return blocks_view(cache, block_size_);
 }
 
 void KVCache::set_kv_cache(const torch::Tensor& slot_ids,
@@ -44,57 +271,240 @@ void KVCache::set_kv_cache(const torch::Tensor& slot_ids,
 void KVCache::set_kv_cache_slow(const torch::Tensor& slot_ids,
                                 const torch::Tensor& keys,
                                 const torch::Tensor& values) {
-  const torch::Tensor slot_ids_cpu = slot_ids.cpu();
-  const int32_t* ids = slot_ids_cpu.data_ptr<int32_t>();
-  const auto n_slots = slot_ids_cpu.numel();
-  set_kv_cache(Slice<int32_t>(ids, n_slots), keys, values);
+  const auto n_tokens = keys.size(0);
+  CHECK(slot_ids.numel() == n_tokens);
+  const auto ids = slot_ids.to(key_cache_.device(), torch::kLong);
+
+  // write all slots with one scatter instead of a copy per slot
+  if (is_quantized()) {
+    const auto dtype = key_cache_.scalar_type();
+    auto [q_keys, k_scales] = quantize(keys, dtype);
+    auto [q_values, v_scales] = quantize(values, dtype);
+    key_cache_.index_copy_(/*dim=*/0, ids, q_keys);
+    value_cache_.index_copy_(/*dim=*/0, ids, q_values);
+    key_scale_.index_copy_(/*dim=*/0, ids, k_scales);
+    value_scale_.index_copy_(/*dim=*/0, ids, v_scales);
+    return;
+  }
+  if (layout_ == KVCacheLayout::kHND) {
+    // scatter into the (block, offset) of the slots
+    const auto block_ids = ids.div(block_size_, /*rounding_mode=*/"floor");
+    const auto offsets = ids.remainder(block_size_);
+    blocks_of(key_cache_)
+        .index_put_({block_ids, offsets}, keys.to(key_cache_.dtype()));
+    blocks_of(value_cache_)
+        .index_put_({block_ids, offsets}, values.to(value_cache_.dtype()));
+    return;
+  }
+  // [n_slots, n_kv_heads, head_dim]
+  key_cache_.index_copy_(/*dim=*/0, ids, keys.to(key_cache_.dtype()));
+  value_cache_.index_copy_(/*dim=*/0, ids, values.to(value_cache_.dtype()));
 }
 
 void KVCache::set_kv_cache_cuda(const torch::Tensor& slot_ids,
                                 const torch::Tensor& keys,
                                 const torch::Tensor& values) {
-  kernel::set_kv_cache(slot_ids, keys, values, key_cache_, value_cache_);
+  if (is_quantized()) {
+    kernel::set_kv_cache_quant(slot_ids,
+                               keys,
+                               values,
+                               key_cache_,
+                               value_cache_,
+                               key_scale_,
+                               value_scale_);
+    return;
+  }
+  auto [key_cache, value_cache] = get_kv_cache();
+  if (FLAGS_use_triton_kernels &&
+      kernel::triton::set_kv_cache(
+          slot_ids, keys, values, key_cache, value_cache)) {
+    return;
+  }
+  kernel::set_kv_cache(slot_ids, keys, values, key_cache, value_cache);
 }
 
 // keys/values: [n_tokens, n_kv_heads, head_dim]
 void KVCache::set_kv_cache(const Slice<int32_t>& slot_ids,
                            const torch::Tensor& keys,
                            const torch::Tensor& values) {
-  const auto n_tokens = keys.size(0);
-  CHECK(slot_ids.size() == n_tokens);
-
-  // set key and value into cache one by one
-  for (int64_t i = 0; i < n_tokens; ++i) {
-    const int32_t slot_id = slot_ids[i];
-    // [n_slots, n_kv_heads, head_dim]
-    key_cache_[slot_id] = keys[i];
-    value_cache_[slot_id] = values[i];
-  }
+  set_kv_cache_slow(slot_ids_tensor(slot_ids), keys, values);
 }
 
 std::tuple<torch::Tensor, torch::Tensor> KVCache::get_kv_cache(
     const torch::Tensor& slot_ids) const {
   DCHECK_EQ(slot_ids.dtype(), torch::kInt);
+  const auto ids = slot_ids.to(key_cache_.device(), torch::kLong);
 
-  const torch::Tensor slot_ids_cpu = slot_ids.cpu();
-  const int32_t* ids = slot_ids_cpu.data_ptr<int32_t>();
-  const auto n_slots = slot_ids_cpu.numel();
-  return get_kv_cache(Slice<int32_t>(ids, n_slots));
+  // gather all slots with one index_select instead of a slice per slot
+  if (is_quantized()) {
+    // dequantize into float32
+    return {dequantize(key_cache_.index_select(/*dim=*/0, ids),
+                       key_scale_.index_select(/*dim=*/0, ids)),
+            dequantize(value_cache_.index_select(/*dim=*/0, ids),
+                       value_scale_.index_select(/*dim=*/0, ids))};
+  }
+  if (layout_ == KVCacheLayout::kHND) {
+    const auto block_ids = ids.div(block_size_, /*rounding_mode=*/"floor");
+    const auto offsets = ids.remainder(block_size_);
+    return {blocks_of(key_cache_).index({block_ids, offsets}),
+            blocks_of(value_cache_).index({block_ids, offsets})};
+  }
+  return {key_cache_.index_select(/*dim=*/0, ids),
+          value_cache_.index_select(/*dim=*/0, ids)};
 }
 
 std::tuple<torch::Tensor, torch::Tensor> KVCache::get_kv_cache(
     const Slice<int32_t>& slot_ids) const {
-  std::vector<torch::Tensor> keys;
-  keys.reserve(slot_ids.size());
-  std::vector<torch::Tensor> values;
-  values.reserve(slot_ids.size());
+  return get_kv_cache(slot_ids_tensor(slot_ids));
+}
+
+std::tuple<torch::Tensor, torch::Tensor> KVCache::get_blocks(
+    const torch::Tensor& block_ids,
+    torch::ScalarType dtype) const {
+  const int64_t n_kv_heads = key_cache_.size(-2);
+  const int64_t head_dim = key_cache_.size(-1);
+  const auto ids = block_ids.to(torch::kLong);
+  if (is_quantized()) {
+    // [n_blocks, block_size, n_kv_heads, head_dim]
+    const int64_t n_blocks = key_cache_.size(0) / block_size_;
+    const int64_t n_slots = block_ids.numel() * block_size_;
+    auto gather = [&](const torch::Tensor& cache, const torch::Tensor& scale) {
+      auto q = cache.view({n_blocks, block_size_, n_kv_heads, head_dim})
+                   .index_select(/*dim=*/0, ids);
+      auto s =
+          scale.view({n_blocks, block_size_, n_kv_heads}).index_select(0, ids);
+      return dequantize(q, s).to(dtype).view({n_slots, n_kv_heads, head_dim});
+    };
+    return {gather(key_cache_, key_scale_),
+            gather(value_cache_, value_scale_)};
+  }
+  auto gather = [&](const torch::Tensor& cache) {
+    return blocks_of(cache)
+        .index_select(/*dim=*/0, ids)
+        .reshape({-1, n_kv_heads, head_dim})
+        .to(dtype)
+        .contiguous();
+  };
+  return {gather(key_cache_), gather(value_cache_)};
+}
+
+void KVCache::copy_blocks_from(const KVCache& src,
+                               const torch::Tensor& src_to_dst) {
+  CHECK_EQ(block_size_, src.block_size_) << "block size mismatch";
+  CHECK(src_to_dst.device().is_cpu()) << "block ids should be on cpu";
+  CHECK_EQ(is_quantized(), src.is_quantized()) << "kv cache type mismatch";
+  CHECK(layout_ == src.layout_) << "kv cache layout mismatch";
+
+  const auto pairs = src_to_dst.to(torch::kInt).contiguous();
+  const int32_t* ids = pairs.const_data_ptr<int32_t>();
+  const int64_t n_blocks = pairs.size(0);
+
+  // coalesce consecutive blocks into a single copy
+  int64_t i = 0;
+  while (i < n_blocks) {
+    const int64_t src_start = ids[2 * i];
+    const int64_t dst_start = ids[2 * i + 1];
+    int64_t len = 1;
+    while (i + len < n_blocks && ids[2 * (i + len)] == src_start + len &&
+           ids[2 * (i + len) + 1] == dst_start + len) {
+      ++len;
+    }
+
+    using ISlice = torch::indexing::Slice;
+    const auto src_slots =
+        ISlice(src_start * block_size_, (src_start + len) * block_size_);
+    const auto dst_slots =
+        ISlice(dst_start * block_size_, (dst_start + len) * block_size_);
+    if (layout_ == KVCacheLayout::kHND) {
+      // blocks are the outermost dim, copy the contiguous range of blocks
+      const auto src_range = ISlice(src_start, src_start + len);
+      const auto dst_range = ISlice(dst_start, dst_start + len);
+      key_cache_.index({dst_range})
+          .copy_(src.key_cache_.index({src_range}), /*non_blocking=*/true);
+      value_cache_.index({dst_range})
+          .copy_(src.value_cache_.index({src_range}), /*non_blocking=*/true);
+    } else {
+      key_cache_.index({dst_slots})
+          .copy_(src.key_cache_.index({src_slots}), /*non_blocking=*/true);
+      value_cache_.index({dst_slots})
+          .copy_(src.value_cache_.index({src_slots}), /*non_blocking=*/true);
+    }
+    if (is_quantized()) {
+      key_scale_.index({dst_slots})
+          .copy_(src.key_scale_.index({src_slots}), /*non_blocking=*/true);
+      value_scale_.index({dst_slots})
+          .copy_(src.value_scale_.index({src_slots}), /*non_blocking=*/true);
+    }
+    i += len;
+  }
+}
+
+KVCache::Blocks KVCache::export_blocks(const torch::Tensor& block_ids,
+                                       bool quantize) const {
+  const auto ids = block_ids.to(key_cache_.device(), torch::kLong);
+  Blocks blocks;
+  // exported blocks are always slot major
+  blocks.keys = gather_blocks(blocks_of(key_cache_), ids);
+  blocks.values = gather_blocks(blocks_of(value_cache_), ids);
+  if (is_quantized()) {
+    blocks.key_scales =
+        gather_blocks(blocks_view(key_scale_, block_size_), ids);
+    blocks.value_scales =
+        gather_blocks(blocks_view(value_scale_, block_size_), ids);
+  } else if (quantize) {
+    // quantize on the device to copy less to the host
+    std::tie(blocks.keys, blocks.key_scales) =
+        quantize(blocks.keys, torch::kInt8);
+    std::tie(blocks.values, blocks.value_scales) =
+        quantize(blocks.values, torch::kInt8);
+  }
+
+  auto to_host = [](torch::Tensor& x) {
+    if (x.defined()) {
+      x = x.to(torch::kCPU);
+    }
+  };
+  to_host(blocks.keys);
+  to_host(blocks.values);
+  to_host(blocks.key_scales);
+  to_host(blocks.value_scales);
+  return blocks;
+}
+
+void KVCache::import_blocks(const torch::Tensor& block_ids,
+                            const Blocks& blocks) {
+  CHECK_EQ(blocks.keys.size(0), block_ids.numel() * block_size_)
+      << "number of slots mismatch";
+  CHECK_EQ(blocks.keys.sizes().slice(1),
+           blocks_of(key_cache_).sizes().slice(2))
+      << "kv cache layout mismatch";
+  const auto device = key_cache_.device();
+  const auto ids = block_ids.to(device, torch::kLong);
+  auto keys = blocks.keys.to(device);
+  auto values = blocks.values.to(device);
+  const bool src_quantized = blocks.key_scales.defined();
+  auto key_scales =
+      src_quantized ? blocks.key_scales.to(device) : torch::Tensor();
+  auto value_scales =
+      src_quantized ? blocks.value_scales.to(device) : torch::Tensor();
+
+  const auto dtype = key_cache_.scalar_type();
+  if (src_quantized && keys.scalar_type() != dtype) {
+    keys = dequantize(keys, key_scales);
+    values = dequantize(values, value_scales);
+    key_scales = value_scales = torch::Tensor();
+  }
+  if (is_quantized() && !key_scales.defined()) {
+    std::tie(keys, key_scales) = quantize(keys, dtype);
+    std::tie(values, value_scales) = quantize(values, dtype);
+  }
 
-  for (int slot_id : slot_ids) {
-    // key/value_cache_[slot_id, :, :]
-    keys.push_back(key_cache_[slot_id]);
-    values.push_back(value_cache_[slot_id]);
+  scatter_blocks(blocks_of(key_cache_), ids, keys);
+  scatter_blocks(blocks_of(value_cache_), ids, values);
+  if (is_quantized()) {
+    scatter_blocks(blocks_view(key_scale_, block_size_), ids, key_scales);
+    scatter_blocks(blocks_view(value_scale_, block_size_), ids, value_scales);
   }
-  return std::make_tuple(torch::stack(keys), torch::stack(values));
 }
 
 }  // namespace llm
@@ -1,33 +1,129 @@
 #pragma once
+#include <gflags/gflags.h>
 #include <torch/torch.h>
 
 #include <cstdint>
+#include <memory>
+#include <string>
 
 #include "common/slice.h"
+#include "growable_buffer.h"
+
+DECLARE_string(kv_cache_layout);
 
 namespace llm {
+
+// memory layout of the kv cache blocks
+enum class KVCacheLayout : int8_t {
+  // slot major: [n_slots, n_kv_heads, head_dim]
+  kNHD = 0,
+  // head major: [n_blocks, n_kv_heads, block_size, head_dim], the tokens of a
+  // head in a block are contiguous.
+  kHND = 1,
+};
+
+// parse the layout from "nhd" or "hnd"
+KVCacheLayout parse_kv_cache_layout(const std::string& layout);
+
 // Physical memory used for key and value cache in attention layers
 // the fixed memory is allocated in the constructor for each attention layer.
 class KVCache final {
  public:
+  // kv cache of blocks copied out of a cache, e.g. to move the kv cache of a
+  // session to another engine.
+  struct Blocks {
+    // [n_blocks * block_size, n_kv_heads, head_dim]
+    torch::Tensor keys;
+    torch::Tensor values;
+    // [n_blocks * block_size, n_kv_heads], undefined if not quantized
+    torch::Tensor key_scales;
+    torch::Tensor value_scales;
+  };
+
   KVCache() = default;
 
+  // the cache is quantized with per token per head scales if the dtype in
+  // options is int8 or fp8 (e4m3). quantized cache only supports kNHD.
+  // max_blocks: the number of blocks the cache can be resized to, whose
+  // address range is reserved up front on a cuda device. 0 for a fixed size
+  // cache.
   KVCache(int64_t n_blocks,
           int64_t block_size,
           int64_t n_kv_heads,
           int64_t head_dim,
-          const torch::TensorOptions& options);
+          const torch::TensorOptions& options,
+          KVCacheLayout layout = KVCacheLayout::kNHD,
+          int64_t max_blocks = 0);
+
+  // view the cache over tensors allocated elsewhere, e.g. device memory
+  // shared with other processes, in the shapes of the tensors of the layout
+  // below. the scales are undefined if not quantized.
+  KVCache(torch::Tensor key_cache,
+          torch::Tensor value_cache,
+          torch::Tensor key_scale,
+          torch::Tensor value_scale,
+          int64_t block_size,
+          KVCacheLayout layout);
+
+  // check if the dtype is supported for quantized kv cache
+  static bool is_quantized_dtype(torch::ScalarType dtype) {
+    return dtype == torch::kInt8 || dtype == torch::kFloat8_e4m3fn;
+  }
+
+  // check if the key and value cache is quantized
+  bool is_quantized() const { return key_scale_.defined(); }
 
   // check if the key and value cache is empty
   bool empty() const { return block_size_ == 0; }
 
   int64_t block_size() const { return block_size_; }
 
+  // get the number of blocks
+  int64_t num_blocks() const;
+
+  // check if the cache can be resized
+  bool is_resizable() const { return key_buffer_ != nullptr; }
+
+  // map or unmap the memory of the blocks at the end of the cache to hold
+  // n_blocks blocks, up to max_blocks. the addresses of the blocks don't
+  // change, and the blocks kept are not touched. the caller should make sure
+  // the blocks removed are not in use. returns false without changing the
+  // cache if the device is out of memory.
+  bool resize(int64_t n_blocks);
+
+  KVCacheLayout layout() const { return layout_; }
+
   // get key and value cache tensors
+  // kNHD: [n_slots, n_kv_heads, head_dim]
+  // kHND: strided view of [n_blocks, block_size, n_kv_heads, head_dim]
   std::tuple<torch::Tensor, torch::Tensor> get_kv_cache() const {
+    if (layout_ == KVCacheLayout::kHND) {
+      return {key_cache_.permute({0, 2, 1, 3}),
+              value_cache_.permute({0, 2, 1, 3})};
+    }
     return {key_cache_, value_cache_};
   }
 
+  // get key and value scales for quantized cache: [n_slots, n_kv_heads]
+  std::tuple<torch::Tensor, torch::Tensor> get_kv_cache_scales() const {
+    return {key_scale_, value_scale_};
+  }
+
+  // gather the blocks, dequantized if the cache is quantized.
+  // block_ids: [n_blocks] IntTensor on the device of the cache
+  // returns keys/values: [n_blocks * block_size, n_kv_heads, head_dim]
+  // contiguous tensors of dtype
+  std::tuple<torch::Tensor, torch::Tensor> get_blocks(
+      const torch::Tensor& block_ids,
+      torch::ScalarType dtype) const;
+
+  // the cache in host memory holding the leading blocks of the sequences
+  // offloaded from this cache, see InputParameters::offload_host_blocks.
+  // null if none.
+  const KVCache* host_tier() const { return host_tier_; }
+
+  void set_host_tier(const KVCache* host_tier) { host_tier_ = host_tier; }
+
   // set key and value cache for the given slot_ids
   // the slot_ids are the indices of the key/value cache, [num_slots] IntTensor
   // keys/values: [num_slots, num_heads, head_dim]
@@ -54,16 +150,60 @@ class KVCache final {
   std::tuple<torch::Tensor, torch::Tensor> get_kv_cache(
       const torch::Tensor& slot_ids) const;
 
+  // copy blocks from another kv cache, e.g. swapping between device and host.
+  // src_to_dst: [n_blocks, 2] IntTensor on cpu: (src_block_id, dst_block_id)
+  // the copies are issued on current stream without synchronization.
+  void copy_blocks_from(const KVCache& src, const torch::Tensor& src_to_dst);
+
+  // copy the blocks into host memory. a cache that is not quantized is
+  // quantized to int8 with per token per head scales if quantize is true.
+  // block_ids: [n_blocks] IntTensor on cpu. blocking call
+  Blocks export_blocks(const torch::Tensor& block_ids, bool quantize) const;
+
+  // write the exported blocks of a cache with the same block size and heads
+  // into the blocks, converted to the dtype of this cache.
+  // block_ids: [n_blocks] IntTensor on cpu
+  void import_blocks(const torch::Tensor& block_ids, const Blocks& blocks);
+
  private:
+  // view the cache as [n_blocks, block_size, n_kv_heads, head_dim]
+  torch::Tensor blocks_of(const torch::Tensor& cache) const;
+
+  // view the cache tensors of n_blocks over the growable buffers
+  void view_buffers(int64_t n_blocks);
+
   int64_t block_size_ = 0;
 
+  KVCacheLayout layout_ = KVCacheLayout::kNHD;
+
   // the contunuous memory region for key and value cache would be splited into
   // fixed size blocks. the blocks allocation would be managed by the
   // blockallocator.
-  // [n_slots, num_heads, head_dim]
+  // kNHD: [n_slots, num_heads, head_dim]
+  // kHND: [n_blocks, num_heads, block_size, head_dim]
   torch::Tensor key_cache_;
-  // [n_slots, num_heads, head_dim]
   torch::Tensor value_cache_;
+
+  // scales for quantized key and value cache, undefined if not quantized
+  // [n_slots, num_heads]
+  torch::Tensor key_scale_;
+  // [n_slots, num_heads]
+  torch::Tensor value_scale_;
+
+  // the buffers the tensors above are viewed over for a resizable cache,
+  // null otherwise. the buffers of the scales are null if not quantized.
+  std::shared_ptr<GrowableBuffer> key_buffer_;
+  std::shared_ptr<GrowableBuffer> value_buffer_;
+  std::shared_ptr<GrowableBuffer> key_scale_buffer_;
+  std::shared_ptr<GrowableBuffer> value_scale_buffer_;
+
+  // the shape and options of the tensors of a resizable cache
+  int64_t n_kv_heads_ = 0;
+  int64_t head_dim_ = 0;
+  torch::TensorOptions options_;
+
+  // not owned, see host_tier()
+  const KVCache* host_tier_ = nullptr;
 };
 
 }  // namespace llm
@@ -97,4 +97,267 @@ TEST(KVCacheTest, Random) {
   }
 }
 
+TEST(KVCacheTest, ContiguousRuns) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+
+  const int64_t num_kv_heads = 4;
+  const int64_t block_size = 16;
+  const int64_t num_blocks = 8;
+  const auto options = torch::dtype(torch::kHalf).device(torch::kCUDA);
+
+  torch::manual_seed(10);
+  // a prefill chunk starting in the middle of a block, in shuffled blocks
+  const auto blocks = torch::randperm(num_blocks, torch::kInt);
+  std::vector<int32_t> slots;
+  for (int64_t i = 5; i < num_blocks * block_size - 3; ++i) {
+    slots.push_back(blocks[i / block_size].item<int32_t>() * block_size +
+                    i % block_size);
+  }
+  const auto slot_ids =
+      torch::tensor(slots, torch::dtype(torch::kInt).device(torch::kCUDA));
+  const int64_t num_tokens = slot_ids.size(0);
+
+  // vectorized copy, and the fallback for head dims of less than 16 bytes
+  for (const int64_t head_dim : {128, 4}) {
+    KVCache kv_cache(num_blocks, block_size, num_kv_heads, head_dim, options);
+    auto keys = torch::randn({num_tokens, num_kv_heads, head_dim}, options);
+    auto values = torch::randn({num_tokens, num_kv_heads, head_dim}, options);
+
+    kv_cache.set_kv_cache_cuda(slot_ids, keys, values);
+
+    auto [keys_out, values_out] = kv_cache.get_kv_cache(slot_ids);
+    EXPECT_TRUE(torch::equal(keys, keys_out)) << "head_dim=" << head_dim;
+    EXPECT_TRUE(torch::equal(values, values_out)) << "head_dim=" << head_dim;
+  }
+}
+
+TEST(KVCacheTest, ExportImportBlocks) {
+  const int64_t num_kv_heads = 2;
+  const int64_t head_dim = 16;
+  const int64_t block_size = 4;
+  const int64_t num_blocks = 4;
+  const int64_t num_slots = num_blocks * block_size;
+
+  torch::manual_seed(10);
+  const auto options = torch::dtype(torch::kFloat32);
+  KVCache src(num_blocks, block_size, num_kv_heads, head_dim, options);
+  std::vector<int32_t> slot_ids(num_slots);
+  for (int32_t i = 0; i < num_slots; ++i) {
+    slot_ids[i] = i;
+  }
+  torch::Tensor keys = torch::randn({num_slots, num_kv_heads, head_dim});
+  torch::Tensor values = torch::randn({num_slots, num_kv_heads, head_dim});
+  src.set_kv_cache(slot_ids, keys, values);
+
+  using ISlice = torch::indexing::Slice;
+  auto slots = [&](int64_t block) {
+    return ISlice(block * block_size, (block + 1) * block_size);
+  };
+  // export blocks 2 and 0 into blocks 1 and 3 of another cache
+  const torch::Tensor src_ids = torch::tensor({2, 0}, torch::kInt);
+  const torch::Tensor dst_ids = torch::tensor({1, 3}, torch::kInt);
+  for (const bool quantize : {false, true}) {
+    const auto blocks = src.export_blocks(src_ids, quantize);
+    EXPECT_EQ(blocks.keys.sizes(),
+              torch::IntArrayRef({2 * block_size, num_kv_heads, head_dim}));
+    EXPECT_EQ(blocks.key_scales.defined(), quantize);
+    if (quantize) {
+      EXPECT_EQ(blocks.keys.scalar_type(), torch::kInt8);
+    }
+
+    KVCache dst(num_blocks, block_size, num_kv_heads, head_dim, options);
+    dst.import_blocks(dst_ids, blocks);
+    auto [keys_out, values_out] = dst.get_kv_cache(slot_ids);
+    const double tol = quantize ? 0.05 : 0;
+    EXPECT_TRUE(torch::allclose(
+        keys_out.index({slots(1)}), keys.index({slots(2)}), tol, tol));
+    EXPECT_TRUE(torch::allclose(
+        values_out.index({slots(3)}), values.index({slots(0)}), tol, tol));
+  }
+
+  // import into a quantized cache
+  KVCache dst(num_blocks,
+              block_size,
+              num_kv_heads,
+              head_dim,
+              torch::dtype(torch::kInt8));
+  dst.import_blocks(dst_ids, src.export_blocks(src_ids, /*quantize=*/false));
+  auto [keys_out, values_out] = dst.get_kv_cache(slot_ids);
+  EXPECT_TRUE(torch::allclose(
+      keys_out.index({slots(3)}), keys.index({slots(0)}), 0.01, 0.02));
+}
+
+TEST(KVCacheTest, HeadMajorLayout) {
+  const int64_t num_kv_heads = 2;
+  const int64_t head_dim = 16;
+  const int64_t block_size = 4;
+  const int64_t num_blocks = 4;
+  const int64_t num_slots = num_blocks * block_size;
+
+  torch::manual_seed(10);
+  std::vector<torch::Device> devices = {torch::kCPU};
+  if (torch::cuda::is_available()) {
+    devices.emplace_back(torch::kCUDA);
+  }
+  for (const auto& device : devices) {
+    const auto options = torch::dtype(torch::kFloat32).device(device);
+    KVCache kv_cache(num_blocks,
+                     block_size,
+                     num_kv_heads,
+                     head_dim,
+                     options,
+                     KVCacheLayout::kHND);
+    EXPECT_EQ(kv_cache.layout(), KVCacheLayout::kHND);
+
+    // write the slots in a random order
+    const auto slot_ids =
+        torch::randperm(num_slots, torch::dtype(torch::kInt).device(device));
+    auto keys = torch::randn({num_slots, num_kv_heads, head_dim}, options);
+    auto values = torch::randn({num_slots, num_kv_heads, head_dim}, options);
+    kv_cache.set_kv_cache(slot_ids, keys, values);
+
+    auto [keys_out, values_out] = kv_cache.get_kv_cache(slot_ids);
+    EXPECT_TRUE(torch::equal(keys_out, keys));
+    EXPECT_TRUE(torch::equal(values_out, values));
+
+    // [n_blocks, block_size, n_kv_heads, head_dim] view of the head major
+    // cache: the tokens of a head in a block are contiguous
+    auto [key_cache, value_cache] = kv_cache.get_kv_cache();
+    EXPECT_EQ(key_cache.sizes(),
+              torch::IntArrayRef(
+                  {num_blocks, block_size, num_kv_heads, head_dim}));
+    EXPECT_EQ(key_cache.stride(1), head_dim);
+    EXPECT_EQ(key_cache.stride(2), block_size * head_dim);
+
+    // the exported blocks are slot major, import into a nhd cache
+    const torch::Tensor block_ids = torch::tensor({2, 0}, torch::kInt);
+    KVCache dst(num_blocks, block_size, num_kv_heads, head_dim, options);
+    dst.import_blocks(block_ids,
+                      kv_cache.export_blocks(block_ids, /*quantize=*/false));
+    const auto all_ids =
+        torch::arange(num_slots, torch::dtype(torch::kInt).device(device));
+    const auto expected = std::get<0>(kv_cache.get_kv_cache(all_ids));
+    const auto nhd_keys = std::get<0>(dst.get_kv_cache(all_ids));
+    using ISlice = torch::indexing::Slice;
+    const auto block2 = ISlice(2 * block_size, 3 * block_size);
+    EXPECT_TRUE(
+        torch::equal(nhd_keys.index({block2}), expected.index({block2})));
+
+    // copy block 2 into block 1
+    kv_cache.copy_blocks_from(kv_cache, torch::tensor({{2, 1}}, torch::kInt));
+    const auto copied = std::get<0>(kv_cache.get_kv_cache(all_ids));
+    const auto block1 = ISlice(block_size, 2 * block_size);
+    EXPECT_TRUE(torch::equal(copied.index({block1}), expected.index({block2})));
+  }
+}
+
+class KVCacheQuantTest : public ::testing::TestWithParam<torch::ScalarType> {};
+
+TEST_P(KVCacheQuantTest, Cpu) {
+  const auto cache_dtype = GetParam();
+  const int64_t num_kv_heads = 4;
+  const int64_t head_dim = 64;
+  const int64_t block_size = 4;
+  const int64_t num_blocks = 3;
+
+  torch::manual_seed(10);
+  KVCache kv_cache(num_blocks,
+                   block_size,
+                   num_kv_heads,
+                   head_dim,
+                   torch::dtype(cache_dtype).device(torch::kCPU));
+  EXPECT_TRUE(kv_cache.is_quantized());
+
+  const int64_t num_slots = num_blocks * block_size;
+  std::vector<int32_t> slot_ids(num_slots);
+  for (int32_t i = 0; i < num_slots; ++i) {
+    slot_ids[i] = i;
+  }
+  torch::Tensor keys = torch::randn({num_slots, num_kv_heads, head_dim});
+  torch::Tensor values = torch::randn({num_slots, num_kv_heads, head_dim});
+  kv_cache.set_kv_cache(slot_ids, keys, values);
+
+  // int8 error is bounded by half of the scale, fp8 has 3 mantissa bits
+  const double rtol = cache_dtype == torch::kInt8 ? 0.01 : 0.07;
+  const double atol = 0.02;
+  auto [keys_out, values_out] = kv_cache.get_kv_cache(slot_ids);
+  EXPECT_TRUE(torch::allclose(keys_out, keys, rtol, atol));
+  EXPECT_TRUE(torch::allclose(values_out, values, rtol, atol));
+
+  // gather blocks in a different order
+  torch::Tensor block_ids = torch::tensor({2, 0}, torch::kInt);
+  auto [k_blocks, v_blocks] =
+      kv_cache.get_blocks(block_ids, torch::kFloat32);
+  EXPECT_EQ(k_blocks.sizes(),
+            torch::IntArrayRef({2 * block_size, num_kv_heads, head_dim}));
+  using ISlice = torch::indexing::Slice;
+  const auto first = ISlice(0, block_size);
+  const auto second = ISlice(block_size, 2 * block_size);
+  const auto third = ISlice(2 * block_size, 3 * block_size);
+  EXPECT_TRUE(torch::allclose(
+      k_blocks.index({first}), keys.index({third}), rtol, atol));
+  EXPECT_TRUE(torch::allclose(
+      v_blocks.index({second}), values.index({first}), rtol, atol));
+}
+
+TEST_P(KVCacheQuantTest, Cuda) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  const auto cache_dtype = GetParam();
+  const int64_t num_kv_heads = 8;
+  const int64_t head_dim = 128;
+  const int64_t block_size = 8;
+  const int64_t num_blocks = 5;
+  const int64_t num_slots = num_blocks * block_size;
+  torch::Device device(torch::kCUDA);
+
+  torch::manual_seed(10);
+  const auto options = torch::dtype(cache_dtype).device(device);
+  KVCache kv_cache(num_blocks, block_size, num_kv_heads, head_dim, options);
+  KVCache ref_cache(num_blocks, block_size, num_kv_heads, head_dim, options);
+
+  torch::Tensor slot_ids =
+      torch::randperm(num_slots, torch::dtype(torch::kInt).device(device));
+  const auto input_options = torch::dtype(torch::kHalf).device(device);
+  torch::Tensor keys =
+      torch::randn({num_slots, num_kv_heads, head_dim}, input_options);
+  torch::Tensor values =
+      torch::randn({num_slots, num_kv_heads, head_dim}, input_options);
+  kv_cache.set_kv_cache_cuda(slot_ids, keys, values);
+  ref_cache.set_kv_cache_slow(slot_ids, keys, values);
+
+  // the scales should match the reference implementation
+  auto [k_scale, v_scale] = kv_cache.get_kv_cache_scales();
+  auto [k_scale_ref, v_scale_ref] = ref_cache.get_kv_cache_scales();
+  EXPECT_TRUE(torch::allclose(k_scale, k_scale_ref));
+  EXPECT_TRUE(torch::allclose(v_scale, v_scale_ref));
+
+  // dequantize all blocks and compare with the original keys and values
+  torch::Tensor block_ids =
+      torch::arange(num_blocks, torch::dtype(torch::kInt).device(device));
+  auto [k_blocks, v_blocks] =
+      kv_cache.get_blocks(block_ids, torch::kHalf);
+  const auto ids = slot_ids.to(torch::kLong);
+  const double rtol = cache_dtype == torch::kInt8 ? 0.01 : 0.07;
+  const double atol = 0.02;
+  EXPECT_TRUE(torch::allclose(
+      k_blocks.index_select(0, ids).to(torch::kFloat32),
+      keys.to(torch::kFloat32),
+      rtol,
+      atol));
+  EXPECT_TRUE(torch::allclose(
+      v_blocks.index_select(0, ids).to(torch::kFloat32),
+      values.to(torch::kFloat32),
+      rtol,
+      atol));
+}
+
+INSTANTIATE_TEST_SUITE_P(KVCache,
+                         KVCacheQuantTest,
+                         ::testing::Values(torch::kInt8,
+                                           torch::kFloat8_e4m3fn));
+
 }  // namespace llm
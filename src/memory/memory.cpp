@@ -47,4 +47,46 @@ int64_t available_memory(const torch::Device& device) {
   return static_cast<int64_t>(free);
 }
 
+AllocatorStats allocator_stats(const torch::Device& device) {
+  CHECK(device.is_cuda()) << "Only support CUDA device for now.";
+  using namespace c10::cuda;
+  const auto device_index =
+      device.has_index() ? device.index() : current_device();
+  const auto stats = CUDACachingAllocator::getDeviceStats(device_index);
+  const auto aggregate =
+      static_cast<size_t>(CUDACachingAllocator::StatType::AGGREGATE);
+  AllocatorStats result;
+  result.allocated_bytes = stats.allocated_bytes[aggregate].current;
+  result.peak_allocated_bytes = stats.allocated_bytes[aggregate].peak;
+  result.reserved_bytes = stats.reserved_bytes[aggregate].current;
+  result.inactive_split_bytes = stats.inactive_split_bytes[aggregate].current;
+  return result;
+}
+
+void reset_peak_memory_stats(const torch::Device& device) {
+  CHECK(device.is_cuda()) << "Only support CUDA device for now.";
+  using namespace c10::cuda;
+  const auto device_index =
+      device.has_index() ? device.index() : current_device();
+  CUDACachingAllocator::resetPeakStats(device_index);
+}
+
+int64_t memory_pool_size(const torch::Device& device,
+                         c10::cuda::MempoolId_t pool_id) {
+  CHECK(device.is_cuda()) << "Only support CUDA device for now.";
+  using namespace c10::cuda;
+  const auto device_index =
+      device.has_index() ? device.index() : current_device();
+  int64_t size = 0;
+  // the snapshot copies the info of all the segments, not for hot paths
+  const auto snapshot = CUDACachingAllocator::snapshot();
+  for (const auto& segment : snapshot.segments) {
+    if (segment.device == device_index &&
+        segment.owner_private_pool_id == pool_id) {
+      size += static_cast<int64_t>(segment.total_size);
+    }
+  }
+  return size;
+}
+
 }  // namespace llm::memory
@@ -1,4 +1,5 @@
 #pragma once
+#include <c10/cuda/CUDAGraphsC10Utils.h>
 #include <torch/torch.h>
 
 namespace llm::memory {
@@ -16,4 +17,33 @@ int64_t total_memory(const torch::Device& device);
 // returns the available memory in bytes of the device.
 int64_t available_memory(const torch::Device& device);
 
+// stats of the caching allocator of the device, in bytes
+struct AllocatorStats {
+  // memory held by tensors
+  int64_t allocated_bytes = 0;
+
+  // peak of allocated_bytes since the last reset_peak_memory_stats
+  int64_t peak_allocated_bytes = 0;
+
+  // memory reserved from the device by the allocator
+  int64_t reserved_bytes = 0;
+
+  // free memory in partially used blocks of the allocator, which can only be
+  // reused by allocations that fit, a measure of fragmentation.
+  int64_t inactive_split_bytes = 0;
+};
+
+// Only support CUDA device for now.
+AllocatorStats allocator_stats(const torch::Device& device);
+
+// reset the peak stats of the allocator of the device.
+// Only support CUDA device for now.
+void reset_peak_memory_stats(const torch::Device& device);
+
+// returns the memory in bytes reserved by the segments of the private memory
+// pool of the device, e.g. the pool of captured cuda graphs.
+// Only support CUDA device for now.
+int64_t memory_pool_size(const torch::Device& device,
+                         c10::cuda::MempoolId_t pool_id);
+
 } // namespace llm::memory
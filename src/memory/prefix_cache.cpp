@@ -4,11 +4,36 @@
 #include <absl/time/time.h>
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <vector>
 
+#include "common/metrics.h"
 #include "common/slice.h"
 
+DEFINE_COUNTER_FAMILY(prefix_cache_lookup_tokens_total,
+                      "Block aligned prompt tokens looked up in the prefix "
+                      "cache");
+DEFINE_COUNTER_INSTANCE(prefix_cache_matched_tokens_total,
+                        prefix_cache_lookup_tokens_total,
+                        {{"result", "hit"}});
+DEFINE_COUNTER_INSTANCE(prefix_cache_missed_tokens_total,
+                        prefix_cache_lookup_tokens_total,
+                        {{"result", "miss"}});
+
+DEFINE_COUNTER(prefix_cache_evicted_blocks_total,
+               "Total number of blocks evicted from the prefix cache");
+
+DEFINE_HISTOGRAM(
+    prefix_cache_eviction_age_seconds,
+    "Histogram of time since the last access of evicted prefix cache nodes",
+    std::vector<double>{0.1, 1, 5, 10, 30, 60, 300, 600, 1800, 3600});
+
+DEFINE_HISTOGRAM(
+    prefix_cache_reuse_distance_seconds,
+    "Histogram of time between two matches of the same prefix cache node",
+    std::vector<double>{0.01, 0.1, 1, 5, 10, 30, 60, 300, 600, 1800, 3600});
+
 namespace llm {
 namespace {
 // get the lenght of common prefix of two token ids
@@ -77,6 +102,8 @@ std::vector<Block> PrefixCache::match(const Slice<int32_t>& token_ids) {
 
       // find a match
       if (prefix_length > 0) {
+        HISTOGRAM_OBSERVE(prefix_cache_reuse_distance_seconds,
+                          (now - child->last_access_time) / 1e6);
         // update the last access time and move the node to the back of the LRU
         child->last_access_time = now;
         move_node_to_lru_back(child);
@@ -97,14 +124,111 @@ std::vector<Block> PrefixCache::match(const Slice<int32_t>& token_ids) {
           // partial match, split the child node on the common prefix
           split_node(child, prefix_length);
         }
+        // count the hit after splitting, only the matched part is hit
+        ++child->num_hits;
         break;
       }
     }
   }
 
+  stats_.matched_tokens += matched_tokens;
+  stats_.missed_tokens += n_tokens - matched_tokens;
+  COUNTER_ADD(prefix_cache_matched_tokens_total, matched_tokens);
+  COUNTER_ADD(prefix_cache_missed_tokens_total, n_tokens - matched_tokens);
   return blocks;
 }
 
+size_t PrefixCache::num_matched_tokens(const Slice<int32_t>& token_ids) const {
+  const size_t n_tokens = round_down(token_ids.size(), block_size_);
+  auto tokens_slice = token_ids.slice(0, n_tokens);
+
+  size_t matched_tokens = 0;
+  const Node* next_node = &root_;
+  while (next_node != nullptr && !tokens_slice.empty()) {
+    const Node* curr = next_node;
+    next_node = nullptr;
+    for (const Node* child : curr->children) {
+      const size_t prefix_length = round_down(
+          common_prefix_length(tokens_slice, child->token_ids), block_size_);
+      if (prefix_length > 0) {
+        matched_tokens += prefix_length;
+        tokens_slice = tokens_slice.slice(prefix_length);
+        if (prefix_length == child->token_ids.size()) {
+          next_node = child;
+        }
+        break;
+      }
+    }
+  }
+  return matched_tokens;
+}
+
+std::vector<int32_t> PrefixCache::matched_block_ids(
+    const Slice<int32_t>& token_ids) const {
+  const size_t n_tokens = round_down(token_ids.size(), block_size_);
+  auto tokens_slice = token_ids.slice(0, n_tokens);
+
+  std::vector<int32_t> block_ids;
+  const Node* next_node = &root_;
+  while (next_node != nullptr && !tokens_slice.empty()) {
+    const Node* curr = next_node;
+    next_node = nullptr;
+    for (const Node* child : curr->children) {
+      const size_t prefix_length = round_down(
+          common_prefix_length(tokens_slice, child->token_ids), block_size_);
+      if (prefix_length > 0) {
+        const size_t n_blocks = prefix_length / block_size_;
+        for (size_t i = 0; i < n_blocks; ++i) {
+          block_ids.push_back(child->blocks[i].id());
+        }
+        tokens_slice = tokens_slice.slice(prefix_length);
+        if (prefix_length == child->token_ids.size()) {
+          next_node = child;
+        }
+        break;
+      }
+    }
+  }
+  return block_ids;
+}
+
+size_t PrefixCache::replace_blocks(const Slice<int32_t>& token_ids,
+                                   const Slice<Block>& blocks,
+                                   const Slice<Block>& new_blocks) {
+  CHECK_EQ(blocks.size(), new_blocks.size());
+  const size_t n_tokens =
+      round_down(std::min(token_ids.size(), blocks.size() * block_size_),
+                 block_size_);
+  auto tokens_slice = token_ids.slice(0, n_tokens);
+
+  size_t n_replaced = 0;
+  size_t block_idx = 0;
+  Node* next_node = &root_;
+  while (next_node != nullptr && !tokens_slice.empty()) {
+    Node* curr = next_node;
+    next_node = nullptr;
+    for (Node* child : curr->children) {
+      const size_t prefix_length = round_down(
+          common_prefix_length(tokens_slice, child->token_ids), block_size_);
+      if (prefix_length > 0) {
+        const size_t n_blocks = prefix_length / block_size_;
+        for (size_t i = 0; i < n_blocks; ++i, ++block_idx) {
+          if (child->blocks[i].id() == blocks[block_idx].id()) {
+            child->blocks[i] = new_blocks[block_idx];
+            ++n_replaced;
+          }
+        }
+        tokens_slice = tokens_slice.slice(prefix_length);
+        if (prefix_length == child->token_ids.size()) {
+          next_node = child;
+        }
+        break;
+      }
+    }
+  }
+  return n_replaced;
+}
+
 // insert the token ids and blocks into the prefix tree
 // return the length of new inserted tokens
 size_t PrefixCache::insert(const Slice<int32_t>& token_ids,
@@ -166,12 +290,14 @@ size_t PrefixCache::insert(const Slice<int32_t>& token_ids,
 }
 
 // release the blocks hold by the prefix cache
-size_t PrefixCache::evict(size_t n_blocks_to_evict) {
+size_t PrefixCache::evict(size_t n_blocks_to_evict,
+                          const EvictCallback& on_evict) {
   size_t total_evicted = 0;
   // loop until no blocks to evict
   while (total_evicted < n_blocks_to_evict) {
     // conduct multiple round scaning to avoid invalidating leaf_nodes_ iterator
-    const size_t evicted = evict_helper(n_blocks_to_evict - total_evicted);
+    const size_t evicted =
+        evict_helper(n_blocks_to_evict - total_evicted, on_evict);
     if (evicted == 0) {
       // no more cache to evict, just return
       break;
@@ -181,7 +307,9 @@ size_t PrefixCache::evict(size_t n_blocks_to_evict) {
   return total_evicted;
 }
 
-size_t PrefixCache::evict_helper(size_t n_blocks_to_evict) {
+size_t PrefixCache::evict_helper(size_t n_blocks_to_evict,
+                                 const EvictCallback& on_evict) {
+  const int64_t now = absl::ToUnixMicros(absl::Now());
   size_t total_evicted = 0;
   // evict nodes at the end to avoid invaliding iterator
   std::vector<Node*> nodes_to_evict;
@@ -212,6 +340,14 @@ size_t PrefixCache::evict_helper(size_t n_blocks_to_evict) {
     const size_t n_to_evict = std::min(n_blocks_to_evict - total_evicted,
                                        n_blocks - non_shared_start);
     total_evicted += n_to_evict;
+    if (n_to_evict > 0) {
+      HISTOGRAM_OBSERVE(prefix_cache_eviction_age_seconds,
+                        (now - node->last_access_time) / 1e6);
+    }
+    if (n_to_evict > 0 && on_evict) {
+      on_evict(prefix_token_ids(node),
+               Slice<Block>(blocks).slice(n_blocks - n_to_evict));
+    }
     if (n_to_evict == n_blocks) {
       // mark the node as to be evicted
       nodes_to_evict.push_back(node);
@@ -231,9 +367,111 @@ size_t PrefixCache::evict_helper(size_t n_blocks_to_evict) {
 
   // update the number of blocks
   num_blocks_ -= total_evicted;
+  stats_.evicted_blocks += total_evicted;
+  COUNTER_ADD(prefix_cache_evicted_blocks_total, total_evicted);
   return total_evicted;
 }
 
+size_t PrefixCache::evict_blocks_from(int32_t block_id) {
+  size_t total_evicted = 0;
+  std::vector<Node*> nodes = {&root_};
+  while (!nodes.empty()) {
+    Node* node = nodes.back();
+    nodes.pop_back();
+    const auto it = std::find_if(
+        node->blocks.begin(), node->blocks.end(), [block_id](const Block& b) {
+          return b.id() >= block_id;
+        });
+    if (it == node->blocks.end()) {
+      nodes.insert(nodes.end(), node->children.begin(), node->children.end());
+      continue;
+    }
+
+    // the descendants can't be matched without the evicted blocks
+    while (!node->children.empty()) {
+      total_evicted += release_subtree(*node->children.begin());
+    }
+    const size_t n_blocks_left = std::distance(node->blocks.begin(), it);
+    total_evicted += node->blocks.size() - n_blocks_left;
+    if (n_blocks_left == 0) {
+      release_node(node);
+    } else {
+      node->token_ids.resize(n_blocks_left * block_size_);
+      node->blocks.resize(n_blocks_left);
+    }
+  }
+
+  num_blocks_ -= total_evicted;
+  stats_.evicted_blocks += total_evicted;
+  COUNTER_ADD(prefix_cache_evicted_blocks_total, total_evicted);
+  return total_evicted;
+}
+
+std::vector<PrefixCache::PrefixInfo> PrefixCache::hottest_prefixes(
+    size_t k,
+    size_t max_token_ids) const {
+  struct Candidate {
+    const Node* node;
+    size_t num_tokens;
+  };
+  std::vector<Candidate> candidates;
+  candidates.reserve(num_nodes_);
+  for (const Node* node = lru_front_.next; node != &lru_back_;
+       node = node->next) {
+    size_t num_tokens = 0;
+    for (const Node* n = node; n != &root_; n = n->parent) {
+      num_tokens += n->token_ids.size();
+    }
+    candidates.push_back({node, num_tokens});
+  }
+
+  k = std::min(k, candidates.size());
+  std::partial_sort(candidates.begin(),
+                    candidates.begin() + k,
+                    candidates.end(),
+                    [](const Candidate& a, const Candidate& b) {
+                      if (a.node->num_hits != b.node->num_hits) {
+                        return a.node->num_hits > b.node->num_hits;
+                      }
+                      return a.num_tokens > b.num_tokens;
+                    });
+
+  const int64_t now = absl::ToUnixMicros(absl::Now());
+  std::vector<PrefixInfo> prefixes;
+  prefixes.reserve(k);
+  for (size_t i = 0; i < k; ++i) {
+    const Node* node = candidates[i].node;
+    PrefixInfo info;
+    info.num_tokens = candidates[i].num_tokens;
+    info.num_hits = node->num_hits;
+    info.idle_seconds = (now - node->last_access_time) / 1e6;
+    // only collect the leading token ids from the root
+    std::vector<int32_t> token_ids = prefix_token_ids(node);
+    token_ids.resize(std::min(token_ids.size(), max_token_ids));
+    info.token_ids = std::move(token_ids);
+    prefixes.push_back(std::move(info));
+  }
+  return prefixes;
+}
+
+std::vector<int32_t> PrefixCache::prefix_token_ids(const Node* node) {
+  // collect nodes from the node up to the root
+  std::vector<const Node*> path;
+  size_t n_tokens = 0;
+  for (; node != nullptr && node->parent != nullptr; node = node->parent) {
+    path.push_back(node);
+    n_tokens += node->token_ids.size();
+  }
+
+  std::vector<int32_t> token_ids;
+  token_ids.reserve(n_tokens);
+  for (auto it = path.rbegin(); it != path.rend(); ++it) {
+    const auto& ids = (*it)->token_ids;
+    token_ids.insert(token_ids.end(), ids.begin(), ids.end());
+  }
+  return token_ids;
+}
+
 void PrefixCache::release_node(Node* node) {
   DCHECK(node != &root_);
   DCHECK(node->children.empty()) << "should only release leaf node";
@@ -248,6 +486,15 @@ void PrefixCache::release_node(Node* node) {
   --num_nodes_;
 }
 
+size_t PrefixCache::release_subtree(Node* node) {
+  size_t n_blocks = node->blocks.size();
+  while (!node->children.empty()) {
+    n_blocks += release_subtree(*node->children.begin());
+  }
+  release_node(node);
+  return n_blocks;
+}
+
 void PrefixCache::split_node(Node* node, size_t common_prefix_length) {
   CHECK(common_prefix_length > 0 && common_prefix_length % block_size_ == 0)
       << "The common prefix length should be greater than 0";
@@ -267,6 +514,7 @@ void PrefixCache::split_node(Node* node, size_t common_prefix_length) {
   child->token_ids = token_ids.slice(common_prefix_length);
   child->blocks = blocks.slice(n_blocks);
   child->last_access_time = node->last_access_time;
+  child->num_hits = node->num_hits;
   // point to parent
   child->parent = node;
   // take over children
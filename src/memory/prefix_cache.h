@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <functional>
 #include <unordered_set>
 #include <vector>
 
@@ -11,6 +12,34 @@ namespace llm {
 
 class PrefixCache final {
  public:
+  // called before evicting blocks with the token ids from the root to the end
+  // of the evicted blocks, the evicted blocks are at the tail of token ids.
+  using EvictCallback =
+      std::function<void(const std::vector<int32_t>& token_ids,
+                         const Slice<Block>& blocks)>;
+
+  // cumulative statistics since the creation of the cache
+  struct Stats {
+    // block aligned tokens found in the cache by match
+    size_t matched_tokens = 0;
+    // block aligned tokens not found in the cache by match
+    size_t missed_tokens = 0;
+    // number of evicted blocks
+    size_t evicted_blocks = 0;
+  };
+
+  // a cached prefix ending at a node of the prefix tree
+  struct PrefixInfo {
+    // number of tokens from the root to the end of the prefix
+    size_t num_tokens = 0;
+    // number of matches passing through the end of the prefix
+    uint64_t num_hits = 0;
+    // time since the last access in seconds
+    double idle_seconds = 0;
+    // the leading token ids of the prefix
+    std::vector<int32_t> token_ids;
+  };
+
   explicit PrefixCache(uint32_t block_size);
 
   ~PrefixCache();
@@ -28,6 +57,23 @@ class PrefixCache final {
   }
   std::vector<Block> match(const Slice<int32_t>& token_ids);
 
+  // get the number of block aligned tokens that match would return, without
+  // touching the blocks, the lru order or the statistics.
+  size_t num_matched_tokens(const Slice<int32_t>& token_ids) const;
+
+  // get the ids of the cached blocks that match would return, without
+  // touching the blocks, the lru order or the statistics.
+  std::vector<int32_t> matched_block_ids(
+      const Slice<int32_t>& token_ids) const;
+
+  // replace the matched blocks of the token ids with new blocks holding a
+  // copy of their kv cache. the i-th matched block is replaced by
+  // new_blocks[i] only if it is blocks[i]. returns the number of replaced
+  // blocks.
+  size_t replace_blocks(const Slice<int32_t>& token_ids,
+                        const Slice<Block>& blocks,
+                        const Slice<Block>& new_blocks);
+
   // insert the token ids and blocks into the prefix tree
   // return the length of new inserted tokens
   size_t insert(const std::vector<int32_t>& token_ids,
@@ -38,7 +84,13 @@ class PrefixCache final {
 
   // evict blocks hold by the prefix cache
   // return the actual number of evicted blocks
-  size_t evict(size_t n_blocks);
+  size_t evict(size_t n_blocks, const EvictCallback& on_evict = nullptr);
+
+  // evict the blocks with ids >= block_id regardless of the lru order, with
+  // the blocks after them in the prefix tree. used to drain the blocks at
+  // the end of the kv cache before shrinking it.
+  // return the actual number of evicted blocks
+  size_t evict_blocks_from(int32_t block_id);
 
   // get the number of blocks in the prefix cache
   size_t num_blocks() const { return num_blocks_; }
@@ -46,6 +98,13 @@ class PrefixCache final {
   // get the total number of nodes in the prefix tree
   size_t num_nodes() const { return num_nodes_; }
 
+  const Stats& stats() const { return stats_; }
+
+  // the k most hit prefixes, ties broken by longer prefixes first. each
+  // prefix keeps at most max_token_ids leading token ids.
+  std::vector<PrefixInfo> hottest_prefixes(size_t k,
+                                           size_t max_token_ids) const;
+
  private:
   struct Node {
     // the token ids that the node represents
@@ -62,6 +121,9 @@ class PrefixCache final {
     // the last access time of the node, used to evict blocks
     int64_t last_access_time = 0;
 
+    // number of matches passing through the node
+    uint64_t num_hits = 0;
+
     // the previous and next nodes, used to maintain the LRU list
     Node* prev = nullptr;
     Node* next = nullptr;
@@ -70,6 +132,10 @@ class PrefixCache final {
   // release the node and update leaf_nodes_
   void release_node(Node* node);
 
+  // release the node with all its descendants, return the number of blocks
+  // they held
+  size_t release_subtree(Node* node);
+
   // split the node on the common prefix
   void split_node(Node* node, size_t common_prefix_length);
 
@@ -79,7 +145,10 @@ class PrefixCache final {
                     const Slice<Block>& blocks,
                     int64_t now);
 
-  size_t evict_helper(size_t n_blocks);
+  size_t evict_helper(size_t n_blocks, const EvictCallback& on_evict);
+
+  // get all token ids from the root to the end of the node
+  static std::vector<int32_t> prefix_token_ids(const Node* node);
 
   // remove the node from the LRU list
   static void remove_node_from_lru(Node* node);
@@ -107,6 +176,8 @@ class PrefixCache final {
 
   // the total number of nodes in the prefix tree
   size_t num_nodes_ = 0;
+
+  Stats stats_;
 };
 
 }  // namespace llm
\ No newline at end of file
@@ -133,6 +133,191 @@ TEST(PrefixCacheTest, Basic) {
   }
 }
 
+TEST(PrefixCacheTest, EvictCallback) {
+  const uint32_t block_size = 2;
+  BlockAllocator allocator(/*total_blocks=*/10, block_size);
+  PrefixCache cache(block_size);
+
+  //   tokens: [1, 2] -> [3, 4, 5, 6]
+  //                  -> [7, 8]
+  std::vector<int32_t> token_ids = {1, 2, 3, 4, 5, 6};
+  std::vector<Block> blocks = allocator.allocate(3);
+  cache.insert(token_ids, blocks);
+  std::vector<int32_t> token_ids2 = {1, 2, 7, 8};
+  std::vector<Block> blocks2 = {blocks[0], allocator.allocate()};
+  cache.insert(token_ids2, blocks2);
+  const int32_t last_block_id = blocks[2].id();
+  blocks.clear();
+  blocks2.clear();
+
+  std::vector<std::vector<int32_t>> evicted_tokens;
+  std::vector<std::vector<int32_t>> evicted_block_ids;
+  auto on_evict = [&](const std::vector<int32_t>& token_ids,
+                      const Slice<Block>& blocks) {
+    evicted_tokens.push_back(token_ids);
+    std::vector<int32_t> ids;
+    for (const auto& block : blocks) {
+      ids.push_back(block.id());
+    }
+    evicted_block_ids.push_back(ids);
+  };
+
+  // evict one block from the lru leaf node
+  EXPECT_EQ(cache.evict(1, on_evict), 1);
+  ASSERT_EQ(evicted_tokens.size(), 1);
+  EXPECT_EQ(evicted_tokens[0], std::vector<int32_t>({1, 2, 3, 4, 5, 6}));
+  EXPECT_EQ(evicted_block_ids[0], std::vector<int32_t>({last_block_id}));
+
+  // evict all, full token ids from the root are passed for each node
+  EXPECT_EQ(cache.evict(3, on_evict), 3);
+  EXPECT_EQ(cache.num_blocks(), 0);
+  ASSERT_EQ(evicted_tokens.size(), 4);
+  for (size_t i = 0; i < evicted_tokens.size(); ++i) {
+    EXPECT_EQ(evicted_tokens[i].size() % block_size, 0);
+    EXPECT_GE(evicted_tokens[i].size(),
+              evicted_block_ids[i].size() * block_size);
+  }
+  EXPECT_EQ(allocator.num_free_blocks(), 10);
+}
+
+TEST(PrefixCacheTest, EvictBlocksFrom) {
+  const uint32_t block_size = 2;
+  PrefixCache cache(block_size);
+
+  //   tokens: [1, 2, 3, 4] -> [5, 6, 7, 8]
+  //                        -> [9, 10]
+  //           [11, 12, 13, 14]
+  //   blocks: [0, 6] -> [2, 3]
+  //                  -> [4]
+  //           [1, 8]
+  std::vector<int32_t> token_ids = {1, 2, 3, 4, 5, 6, 7, 8};
+  std::vector<int32_t> token_ids2 = {1, 2, 3, 4, 9, 10};
+  std::vector<int32_t> token_ids3 = {11, 12, 13, 14};
+  cache.insert(token_ids, std::vector<Block>{0, 6, 2, 3});
+  cache.insert(token_ids2, std::vector<Block>{0, 6, 4});
+  cache.insert(token_ids3, std::vector<Block>{1, 8});
+  EXPECT_EQ(cache.num_blocks(), 7);
+  EXPECT_EQ(cache.num_nodes(), 4);
+
+  // nothing to evict
+  EXPECT_EQ(cache.evict_blocks_from(9), 0);
+  EXPECT_EQ(cache.num_blocks(), 7);
+
+  // block 6 is evicted with the blocks after it, block 8 is truncated
+  EXPECT_EQ(cache.evict_blocks_from(5), 5);
+  EXPECT_EQ(cache.num_blocks(), 2);
+  EXPECT_EQ(cache.num_nodes(), 2);
+  EXPECT_EQ(cache.num_matched_tokens(token_ids), 2);
+  EXPECT_EQ(cache.num_matched_tokens(token_ids3), 2);
+  EXPECT_EQ(cache.stats().evicted_blocks, 5);
+}
+
+TEST(PrefixCacheTest, StatsAndHottestPrefixes) {
+  const uint32_t block_size = 2;
+  BlockAllocator allocator(/*total_blocks=*/10, block_size);
+  PrefixCache cache(block_size);
+
+  //   tokens: [1, 2] -> [3, 4, 5, 6]
+  //                  -> [7, 8]
+  std::vector<int32_t> token_ids = {1, 2, 3, 4, 5, 6};
+  std::vector<Block> blocks = allocator.allocate(3);
+  cache.insert(token_ids, blocks);
+  std::vector<int32_t> token_ids2 = {1, 2, 7, 8};
+  std::vector<Block> blocks2 = {blocks[0], allocator.allocate()};
+  cache.insert(token_ids2, blocks2);
+  blocks.clear();
+  blocks2.clear();
+
+  // match [1, 2, 3, 4] and miss [9, 10], the last token is not aligned
+  EXPECT_EQ(cache.match({1, 2, 3, 4, 9, 10, 11}).size(), 2);
+  // match [1, 2] twice more
+  EXPECT_EQ(cache.match({1, 2, 7, 8}).size(), 2);
+  EXPECT_EQ(cache.match({1, 2, 9, 10}).size(), 1);
+  EXPECT_EQ(cache.stats().matched_tokens, 10);
+  EXPECT_EQ(cache.stats().missed_tokens, 4);
+
+  // [1, 2] is hit by all matches, [1, 2, 3, 4] and [1, 2, 7, 8] once, and
+  // [1, 2, 3, 4, 5, 6] split from [1, 2, 3, 4] is never hit
+  auto prefixes = cache.hottest_prefixes(/*k=*/4, /*max_token_ids=*/3);
+  ASSERT_EQ(prefixes.size(), 4);
+  EXPECT_EQ(prefixes[0].num_tokens, 2);
+  EXPECT_EQ(prefixes[0].num_hits, 3);
+  EXPECT_EQ(prefixes[0].token_ids, std::vector<int32_t>({1, 2}));
+  for (size_t i = 1; i < 3; ++i) {
+    EXPECT_EQ(prefixes[i].num_hits, 1);
+    EXPECT_EQ(prefixes[i].num_tokens, 4);
+    EXPECT_EQ(prefixes[i].token_ids.size(), 3);
+    EXPECT_GE(prefixes[i].idle_seconds, 0);
+  }
+  EXPECT_EQ(prefixes[3].num_hits, 0);
+  EXPECT_EQ(prefixes[3].num_tokens, 6);
+
+  // matching the whole sequence hits every node on the path
+  cache.match({1, 2, 3, 4, 5, 6});
+  prefixes = cache.hottest_prefixes(/*k=*/2, /*max_token_ids=*/8);
+  ASSERT_EQ(prefixes.size(), 2);
+  EXPECT_EQ(prefixes[1].num_hits, 2);
+  EXPECT_EQ(prefixes[1].token_ids, std::vector<int32_t>({1, 2, 3, 4}));
+
+  EXPECT_EQ(cache.evict(4), 4);
+  EXPECT_EQ(cache.stats().evicted_blocks, 4);
+  EXPECT_TRUE(cache.hottest_prefixes(/*k=*/2, /*max_token_ids=*/3).empty());
+}
+
+TEST(PrefixCacheTest, NumMatchedTokens) {
+  const uint32_t block_size = 2;
+  BlockAllocator allocator(/*total_blocks=*/10, block_size);
+  PrefixCache cache(block_size);
+
+  std::vector<int32_t> token_ids = {1, 2, 3, 4, 5, 6};
+  std::vector<Block> blocks = allocator.allocate(3);
+  cache.insert(token_ids, blocks);
+
+  std::vector<int32_t> partial = {1, 2, 3, 9, 5, 6, 7};
+  std::vector<int32_t> full = {1, 2, 3, 4, 5, 6, 7};
+  std::vector<int32_t> miss = {9, 2, 3, 4};
+  EXPECT_EQ(cache.num_matched_tokens(partial), 2);
+  EXPECT_EQ(cache.num_matched_tokens(full), 6);
+  EXPECT_EQ(cache.num_matched_tokens(miss), 0);
+
+  // the lookup neither splits nodes, holds blocks nor counts as a match
+  EXPECT_EQ(cache.num_nodes(), 1);
+  EXPECT_EQ(blocks[0].ref_count(), 2);
+  EXPECT_EQ(cache.stats().matched_tokens, 0);
+  EXPECT_EQ(cache.stats().missed_tokens, 0);
+  EXPECT_EQ(cache.match(full).size(), 3);
+}
+
+TEST(PrefixCacheTest, ReplaceBlocks) {
+  const uint32_t block_size = 2;
+  BlockAllocator allocator(/*total_blocks=*/10, block_size);
+  PrefixCache cache(block_size);
+
+  std::vector<int32_t> token_ids = {1, 2, 3, 4, 5, 6};
+  std::vector<Block> blocks = allocator.allocate(3);
+  cache.insert(token_ids, blocks);
+
+  std::vector<int32_t> full = {1, 2, 3, 4, 5, 6, 7};
+  EXPECT_EQ(cache.matched_block_ids(full),
+            std::vector<int32_t>({blocks[0].id(),
+                                  blocks[1].id(),
+                                  blocks[2].id()}));
+
+  // the second block is not the cached one, so it is kept
+  std::vector<Block> old_blocks = {blocks[0], allocator.allocate(), blocks[2]};
+  std::vector<Block> new_blocks = allocator.allocate(3);
+  EXPECT_EQ(cache.replace_blocks(full, old_blocks, new_blocks), 2);
+  EXPECT_EQ(cache.matched_block_ids(full),
+            std::vector<int32_t>({new_blocks[0].id(),
+                                  blocks[1].id(),
+                                  new_blocks[2].id()}));
+  EXPECT_EQ(new_blocks[0].ref_count(), 2);
+  EXPECT_EQ(new_blocks[1].ref_count(), 1);
+  EXPECT_EQ(blocks[0].ref_count(), 2);
+  EXPECT_EQ(blocks[1].ref_count(), 2);
+  EXPECT_EQ(cache.num_blocks(), 3);
+}
+
 struct SequenceData {
   std::vector<int32_t> token_ids;
   std::vector<Block> blocks;
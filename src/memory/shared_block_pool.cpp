@@ -0,0 +1,475 @@
+#include "shared_block_pool.h"
+
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/slice.h"
+
+// NOLINTNEXTLINE
+DEFINE_string(shared_kv_pool,
+              "",
+              "Name of the kv cache pool shared with the engines of other "
+              "processes on the same devices, empty to disable. The device "
+              "memory of the pool is allocated on top of the kv cache by the "
+              "first process, leave room for it with --max_cache_size.");
+
+// NOLINTNEXTLINE
+DEFINE_int32(shared_kv_pool_blocks,
+             0,
+             "Number of blocks of the shared kv cache pool, used by the "
+             "process creating the pool.");
+
+namespace llm {
+namespace {
+// fnv-1a style hash chained over tokens, stable across processes
+uint64_t hash_tokens(uint64_t seed, const Slice<int32_t>& token_ids) {
+  constexpr uint64_t kPrime = 1099511628211ULL;
+  uint64_t hash = seed;
+  for (const int32_t token_id : token_ids) {
+    hash ^= static_cast<uint32_t>(token_id);
+    hash *= kPrime;
+  }
+  return hash;
+}
+
+constexpr uint64_t kHashSeed = 14695981039346656037ULL;
+
+// written last by the creator once the segment is initialized
+constexpr uint64_t kMagic = 0x6c6c6d2d6b762d31ULL;
+
+// max time to wait for the creator to initialize the segment
+constexpr auto kAttachTimeout = std::chrono::seconds(30);
+
+enum SlotState : uint8_t {
+  kFree = 0,
+  // reserved by a process writing its kv cache
+  kWriting = 1,
+  kPublished = 2,
+};
+
+}  // namespace
+
+struct SharedBlockPool::Header {
+  std::atomic<uint64_t> magic;
+  uint64_t layout_key;
+  uint32_t n_blocks;
+  uint32_t block_size;
+  uint32_t n_buckets;
+  uint32_t n_attached;
+  // the position of the clock hand for eviction
+  uint32_t clock_hand;
+  // head of the list of free slots linked by Slot::next
+  int32_t free_head;
+  uint32_t n_published;
+  pthread_mutex_t mutex;
+  // the device memory of the slots for each rank
+  int64_t device_bytes[kMaxDevices];
+  uint32_t handle_bytes[kMaxDevices];
+  char handles[kMaxDevices][kMaxHandleBytes];
+};
+
+struct SharedBlockPool::Slot {
+  // hash of tokens up to the end of the block
+  uint64_t hash;
+  // hash of tokens before the block, used to verify the match
+  uint64_t prefix_hash;
+  // next slot in the hash bucket or the free list, -1 for none
+  int32_t next;
+  // number of processes reading the slot
+  int32_t ref_count;
+  uint8_t state;
+  // set on access, cleared by the clock hand
+  uint8_t referenced;
+};
+
+namespace {
+// lock the process shared mutex, recovering it from a dead owner
+class SegmentLock final {
+ public:
+  explicit SegmentLock(pthread_mutex_t* mutex) : mutex_(mutex) {
+    const int ret = pthread_mutex_lock(mutex_);
+    if (ret == EOWNERDEAD) {
+      LOG(WARNING) << "Recovering the shared kv pool from a dead process";
+      pthread_mutex_consistent(mutex_);
+    } else {
+      CHECK_EQ(ret, 0) << "Failed to lock the shared kv pool";
+    }
+  }
+
+  ~SegmentLock() { pthread_mutex_unlock(mutex_); }
+
+  SegmentLock(const SegmentLock&) = delete;
+  SegmentLock& operator=(const SegmentLock&) = delete;
+
+ private:
+  pthread_mutex_t* mutex_;
+};
+
+size_t align_up(size_t n, size_t alignment) {
+  return (n + alignment - 1) / alignment * alignment;
+}
+}  // namespace
+
+SharedBlockPool::SharedBlockPool(const std::string& name,
+                                 uint32_t n_blocks,
+                                 uint32_t block_size,
+                                 uint64_t layout_key)
+    : name_(name.empty() || name.front() == '/' ? name : "/" + name),
+      block_size_(block_size) {
+  CHECK(!name.empty()) << "The shared kv pool needs a name";
+  CHECK_GT(block_size, 0) << "Block size should be greater than 0";
+
+  int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  const bool creator = fd >= 0;
+  if (creator) {
+    CHECK_GT(n_blocks, 0) << "Number of blocks of the pool " << name_
+                          << " should be greater than 0";
+    const uint32_t n_buckets = n_blocks * 2;
+    segment_bytes_ = align_up(sizeof(Header), alignof(Slot)) +
+                     align_up(n_buckets * sizeof(int32_t), alignof(Slot)) +
+                     n_blocks * sizeof(Slot) +
+                     sizeof(int32_t) * n_blocks * block_size;
+    CHECK_EQ(ftruncate(fd, static_cast<off_t>(segment_bytes_)), 0)
+        << "Failed to size the shared kv pool " << name_ << ": "
+        << std::strerror(errno);
+  } else {
+    CHECK_EQ(errno, EEXIST) << "Failed to create the shared kv pool " << name_
+                            << ": " << std::strerror(errno);
+    fd = shm_open(name_.c_str(), O_RDWR, 0600);
+    CHECK_GE(fd, 0) << "Failed to open the shared kv pool " << name_ << ": "
+                    << std::strerror(errno);
+    // wait for the creator to size the segment
+    const auto deadline = std::chrono::steady_clock::now() + kAttachTimeout;
+    struct stat st = {};
+    while (fstat(fd, &st) == 0 && st.st_size == 0) {
+      CHECK(std::chrono::steady_clock::now() < deadline)
+          << "Timed out waiting for the shared kv pool " << name_;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    segment_bytes_ = static_cast<size_t>(st.st_size);
+  }
+
+  void* addr = mmap(nullptr,
+                    segment_bytes_,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED,
+                    fd,
+                    /*offset=*/0);
+  close(fd);
+  CHECK(addr != MAP_FAILED) << "Failed to map the shared kv pool " << name_
+                            << ": " << std::strerror(errno);
+  header_ = static_cast<Header*>(addr);
+
+  if (creator) {
+    // the segment is zero filled
+    header_->layout_key = layout_key;
+    header_->n_blocks = n_blocks;
+    header_->block_size = block_size;
+    header_->n_buckets = n_blocks * 2;
+    header_->free_head = 0;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header_->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    int32_t* heads = buckets();
+    for (uint32_t i = 0; i < header_->n_buckets; ++i) {
+      heads[i] = -1;
+    }
+    Slot* all_slots = slots();
+    for (uint32_t i = 0; i < n_blocks; ++i) {
+      all_slots[i].next = i + 1 < n_blocks ? static_cast<int32_t>(i + 1) : -1;
+    }
+    header_->magic.store(kMagic, std::memory_order_release);
+  } else {
+    const auto deadline = std::chrono::steady_clock::now() + kAttachTimeout;
+    while (header_->magic.load(std::memory_order_acquire) != kMagic) {
+      CHECK(std::chrono::steady_clock::now() < deadline)
+          << "Timed out waiting for the shared kv pool " << name_;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    CHECK_EQ(header_->block_size, block_size)
+        << "Block size mismatch with the shared kv pool " << name_;
+    CHECK(layout_key == 0 || header_->layout_key == 0 ||
+          header_->layout_key == layout_key)
+        << "The shared kv pool " << name_ << " holds the kv cache of another "
+        << "model or layout";
+    if (n_blocks > 0 && n_blocks != header_->n_blocks) {
+      LOG(WARNING) << "Using " << header_->n_blocks << " blocks of the shared "
+                   << "kv pool " << name_ << " instead of " << n_blocks;
+    }
+  }
+
+  SegmentLock lock(&header_->mutex);
+  if (header_->layout_key == 0) {
+    header_->layout_key = layout_key;
+  }
+  ++header_->n_attached;
+  LOG(INFO) << "Attached to the shared kv pool " << name_ << " with "
+            << header_->n_blocks << " blocks, " << header_->n_attached
+            << " processes attached";
+}
+
+SharedBlockPool::~SharedBlockPool() {
+  bool last = false;
+  {
+    SegmentLock lock(&header_->mutex);
+    last = --header_->n_attached == 0;
+    if (last) {
+      shm_unlink(name_.c_str());
+    }
+  }
+  munmap(header_, segment_bytes_);
+}
+
+int32_t* SharedBlockPool::buckets() const {
+  auto* base = reinterpret_cast<char*>(header_);
+  return reinterpret_cast<int32_t*>(base +
+                                    align_up(sizeof(Header), alignof(Slot)));
+}
+
+SharedBlockPool::Slot* SharedBlockPool::slots() const {
+  auto* base = reinterpret_cast<char*>(buckets());
+  return reinterpret_cast<Slot*>(
+      base + align_up(header_->n_buckets * sizeof(int32_t), alignof(Slot)));
+}
+
+int32_t* SharedBlockPool::slot_tokens(int32_t slot) const {
+  auto* base = reinterpret_cast<int32_t*>(slots() + header_->n_blocks);
+  return base + static_cast<size_t>(slot) * block_size_;
+}
+
+uint32_t SharedBlockPool::num_blocks() const { return header_->n_blocks; }
+
+size_t SharedBlockPool::num_published_blocks() const {
+  SegmentLock lock(&header_->mutex);
+  return header_->n_published;
+}
+
+std::vector<int32_t> SharedBlockPool::acquire(const Slice<int32_t>& token_ids,
+                                              size_t start_block) {
+  std::vector<int32_t> matched;
+  const size_t n_blocks = token_ids.size() / block_size_;
+  if (start_block >= n_blocks) {
+    return matched;
+  }
+  // hash outside of the lock
+  const auto hashes = block_hashes(token_ids, n_blocks);
+
+  SegmentLock lock(&header_->mutex);
+  Slot* all_slots = slots();
+  for (size_t i = start_block; i < n_blocks; ++i) {
+    const uint64_t prefix_hash = i == 0 ? kHashSeed : hashes[i - 1];
+    const auto block_tokens =
+        token_ids.slice(i * block_size_, (i + 1) * block_size_);
+    const int32_t slot = find(hashes[i], prefix_hash, block_tokens);
+    if (slot < 0 || all_slots[slot].state != kPublished) {
+      break;
+    }
+    ++all_slots[slot].ref_count;
+    all_slots[slot].referenced = 1;
+    matched.push_back(slot);
+  }
+  return matched;
+}
+
+void SharedBlockPool::release(const std::vector<int32_t>& slots_to_release) {
+  if (slots_to_release.empty()) {
+    return;
+  }
+  SegmentLock lock(&header_->mutex);
+  Slot* all_slots = slots();
+  for (const int32_t slot : slots_to_release) {
+    DCHECK_GT(all_slots[slot].ref_count, 0);
+    --all_slots[slot].ref_count;
+  }
+}
+
+std::vector<int32_t> SharedBlockPool::reserve(const Slice<int32_t>& token_ids,
+                                              size_t n_blocks) {
+  CHECK_GE(token_ids.size(), n_blocks * block_size_)
+      << "The token ids should cover all blocks";
+  std::vector<int32_t> reserved(n_blocks, -1);
+  if (n_blocks == 0) {
+    return reserved;
+  }
+  const auto hashes = block_hashes(token_ids, n_blocks);
+
+  SegmentLock lock(&header_->mutex);
+  Slot* all_slots = slots();
+  int32_t* heads = buckets();
+  for (size_t i = 0; i < n_blocks; ++i) {
+    const uint64_t prefix_hash = i == 0 ? kHashSeed : hashes[i - 1];
+    const auto block_tokens =
+        token_ids.slice(i * block_size_, (i + 1) * block_size_);
+    const int32_t found = find(hashes[i], prefix_hash, block_tokens);
+    if (found >= 0) {
+      // published or being written by another process
+      all_slots[found].referenced = 1;
+      continue;
+    }
+    const int32_t slot = take_free_slot();
+    if (slot < 0) {
+      break;
+    }
+    Slot& entry = all_slots[slot];
+    entry.hash = hashes[i];
+    entry.prefix_hash = prefix_hash;
+    std::memcpy(slot_tokens(slot),
+                block_tokens.data(),
+                block_size_ * sizeof(int32_t));
+    entry.ref_count = 0;
+    entry.state = kWriting;
+    entry.referenced = 1;
+    // link into the hash table so that other writers skip the block
+    const uint32_t bucket = hashes[i] % header_->n_buckets;
+    entry.next = heads[bucket];
+    heads[bucket] = slot;
+    reserved[i] = slot;
+  }
+  return reserved;
+}
+
+void SharedBlockPool::commit(const std::vector<int32_t>& slots_to_commit) {
+  SegmentLock lock(&header_->mutex);
+  Slot* all_slots = slots();
+  for (const int32_t slot : slots_to_commit) {
+    if (slot < 0) {
+      continue;
+    }
+    DCHECK_EQ(all_slots[slot].state, kWriting);
+    all_slots[slot].state = kPublished;
+    ++header_->n_published;
+  }
+}
+
+void SharedBlockPool::cancel(const std::vector<int32_t>& slots_to_cancel) {
+  SegmentLock lock(&header_->mutex);
+  for (const int32_t slot : slots_to_cancel) {
+    if (slot >= 0) {
+      remove(slot);
+    }
+  }
+}
+
+std::string SharedBlockPool::device_memory(
+    int32_t rank,
+    int64_t n_bytes,
+    const std::function<std::string()>& alloc,
+    bool* created) {
+  CHECK(rank >= 0 && rank < kMaxDevices)
+      << "Too many devices for the shared kv pool: " << rank;
+  CHECK_GT(n_bytes, 0);
+  SegmentLock lock(&header_->mutex);
+  *created = false;
+  if (header_->device_bytes[rank] == 0) {
+    const std::string handle = alloc();
+    CHECK_LE(handle.size(), kMaxHandleBytes);
+    std::memcpy(header_->handles[rank], handle.data(), handle.size());
+    header_->handle_bytes[rank] = handle.size();
+    header_->device_bytes[rank] = n_bytes;
+    *created = true;
+    return handle;
+  }
+  CHECK_EQ(header_->device_bytes[rank], n_bytes)
+      << "Device memory size mismatch with the shared kv pool " << name_;
+  return {header_->handles[rank], header_->handle_bytes[rank]};
+}
+
+int32_t SharedBlockPool::find(uint64_t hash,
+                              uint64_t prefix_hash,
+                              const Slice<int32_t>& block_tokens) const {
+  DCHECK_EQ(block_tokens.size(), block_size_);
+  const Slot* all_slots = slots();
+  int32_t slot = buckets()[hash % header_->n_buckets];
+  while (slot >= 0) {
+    const Slot& entry = all_slots[slot];
+    // compare the tokens too in case of a hash collision
+    if (entry.hash == hash && entry.prefix_hash == prefix_hash &&
+        std::memcmp(slot_tokens(slot),
+                    block_tokens.data(),
+                    block_size_ * sizeof(int32_t)) == 0) {
+      return slot;
+    }
+    slot = entry.next;
+  }
+  return -1;
+}
+
+void SharedBlockPool::remove(int32_t slot) {
+  Slot* all_slots = slots();
+  Slot& entry = all_slots[slot];
+  int32_t* link = &buckets()[entry.hash % header_->n_buckets];
+  while (*link != slot) {
+    CHECK_GE(*link, 0) << "Slot " << slot << " is not in the hash table";
+    link = &all_slots[*link].next;
+  }
+  *link = entry.next;
+
+  if (entry.state == kPublished) {
+    --header_->n_published;
+  }
+  entry.state = kFree;
+  entry.ref_count = 0;
+  entry.next = header_->free_head;
+  header_->free_head = slot;
+}
+
+int32_t SharedBlockPool::take_free_slot() {
+  Slot* all_slots = slots();
+  if (header_->free_head < 0) {
+    // give the recently used slots a second chance, two rounds at most
+    const uint32_t n_blocks = header_->n_blocks;
+    for (uint32_t i = 0; i < 2 * n_blocks; ++i) {
+      const uint32_t slot = header_->clock_hand;
+      header_->clock_hand = (slot + 1) % n_blocks;
+      Slot& entry = all_slots[slot];
+      if (entry.state != kPublished || entry.ref_count > 0) {
+        continue;
+      }
+      if (entry.referenced) {
+        entry.referenced = 0;
+        continue;
+      }
+      remove(static_cast<int32_t>(slot));
+      break;
+    }
+    if (header_->free_head < 0) {
+      return -1;
+    }
+  }
+  const int32_t slot = header_->free_head;
+  header_->free_head = all_slots[slot].next;
+  return slot;
+}
+
+std::vector<uint64_t> SharedBlockPool::block_hashes(
+    const Slice<int32_t>& token_ids,
+    size_t n_blocks) const {
+  std::vector<uint64_t> hashes;
+  hashes.reserve(n_blocks);
+  uint64_t hash = kHashSeed;
+  for (size_t i = 0; i < n_blocks; ++i) {
+    hash = hash_tokens(
+        hash, token_ids.slice(i * block_size_, (i + 1) * block_size_));
+    hashes.push_back(hash);
+  }
+  return hashes;
+}
+
+}  // namespace llm
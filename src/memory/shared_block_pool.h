@@ -0,0 +1,136 @@
+#pragma once
+
+#include <gflags/gflags.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "common/slice.h"
+
+DECLARE_string(shared_kv_pool);
+DECLARE_int32(shared_kv_pool_blocks);
+
+namespace llm {
+
+// A pool of kv cache blocks shared by the engines of different processes on
+// the same devices, e.g. replicas of a model serving prompts with the same
+// system prompt, so that a common prefix is prefilled and held in the pool
+// once. The pool is indexed by a control segment in POSIX shared memory,
+// which holds the state, the reference count, the token ids and the hash of
+// the tokens up to the end of the block for each slot of the pool, as well as
+// the cuda ipc handles of the device memory of the slots on each device. Slots
+// are looked up by the hashes and verified against the token ids of the
+// block, so a collision of the block hashes doesn't return the kv cache of
+// other tokens, while the tokens before the block are identified by their
+// hash. All methods are thread and process safe.
+//
+// The reference counts of a process that dies without detaching are leaked
+// until all processes detach, which removes the segment. The segment left by
+// crashed processes should be removed from /dev/shm before restarting them.
+class SharedBlockPool final {
+ public:
+  // the max number of devices of an engine, across pipeline stages
+  static constexpr int32_t kMaxDevices = 16;
+
+  // the max number of bytes of a device memory handle
+  static constexpr size_t kMaxHandleBytes = 64;
+
+  // attach to the pool of the name, creating it with n_blocks slots of
+  // block_size tokens if it doesn't exist. layout_key identifies the kv cache
+  // held by the slots, e.g. the model, the dtype and the layout, processes
+  // with different keys can't share a pool. 0 to skip the check for the
+  // processes that only map the device memory.
+  SharedBlockPool(const std::string& name,
+                  uint32_t n_blocks,
+                  uint32_t block_size,
+                  uint64_t layout_key);
+
+  // detach from the pool, the last process removes it
+  ~SharedBlockPool();
+
+  // disable copy, move and assign
+  SharedBlockPool(const SharedBlockPool&) = delete;
+  SharedBlockPool(SharedBlockPool&&) = delete;
+  SharedBlockPool& operator=(const SharedBlockPool&) = delete;
+  SharedBlockPool& operator=(SharedBlockPool&&) = delete;
+
+  // match consecutive published blocks starting from the block index
+  // start_block. returns the slots of the matched blocks, which are held from
+  // being evicted until release().
+  std::vector<int32_t> acquire(const Slice<int32_t>& token_ids,
+                               size_t start_block);
+
+  // drop the references taken by acquire()
+  void release(const std::vector<int32_t>& slots);
+
+  // reserve slots to publish the first n_blocks blocks of the tokens,
+  // evicting the least recently used slots not in use if needed. returns a
+  // slot for each block, -1 for the blocks already in the pool or without a
+  // free slot. the reserved slots are matched once commit() is called after
+  // their kv cache is written.
+  std::vector<int32_t> reserve(const Slice<int32_t>& token_ids,
+                               size_t n_blocks);
+
+  // publish the reserved slots whose kv cache has been written, -1 skipped
+  void commit(const std::vector<int32_t>& slots);
+
+  // give up the reserved slots without publishing them, -1 skipped
+  void cancel(const std::vector<int32_t>& slots);
+
+  // get the handle of the device memory of the slots on the device of the
+  // rank. the first process asking for it allocates the memory of n_bytes
+  // with alloc, which returns the handle to open it in other processes, and
+  // keeps the memory until it exits. created is set to whether alloc was
+  // called.
+  std::string device_memory(int32_t rank,
+                            int64_t n_bytes,
+                            const std::function<std::string()>& alloc,
+                            bool* created);
+
+  // get the number of slots
+  uint32_t num_blocks() const;
+
+  // get the number of published slots
+  size_t num_published_blocks() const;
+
+ private:
+  struct Header;
+  struct Slot;
+
+  // the hash table heads, the slots and the token ids of the slots in the
+  // segment
+  int32_t* buckets() const;
+  Slot* slots() const;
+  int32_t* slot_tokens(int32_t slot) const;
+
+  // find the slot of the block with the token ids in the hash table, -1 if
+  // not found
+  int32_t find(uint64_t hash,
+               uint64_t prefix_hash,
+               const Slice<int32_t>& block_tokens) const;
+
+  // unlink the slot from the hash table and mark it free
+  void remove(int32_t slot);
+
+  // get a free slot, evicting a published one not in use with the clock
+  // algorithm if needed. returns -1 if all slots are in use.
+  int32_t take_free_slot();
+
+  // returns the hash of tokens up to the end of each block
+  std::vector<uint64_t> block_hashes(const Slice<int32_t>& token_ids,
+                                     size_t n_blocks) const;
+
+  // the name of the shared memory object
+  std::string name_;
+
+  // the mapped segment
+  Header* header_ = nullptr;
+  size_t segment_bytes_ = 0;
+
+  uint32_t block_size_ = 0;
+};
+
+}  // namespace llm
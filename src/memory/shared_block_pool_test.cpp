@@ -0,0 +1,109 @@
+#include "shared_block_pool.h"
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+namespace llm {
+namespace {
+// a pool name unique to the test process
+std::string pool_name(const std::string& test) {
+  return "scalellm_test_" + test + "_" + std::to_string(getpid());
+}
+}  // namespace
+
+TEST(SharedBlockPoolTest, PublishAndAcquire) {
+  const uint32_t block_size = 2;
+  const std::string name = pool_name("publish");
+  // two instances of the same pool stand for two processes
+  SharedBlockPool writer(name, /*n_blocks=*/4, block_size, /*layout_key=*/1);
+  SharedBlockPool reader(name, /*n_blocks=*/4, block_size, /*layout_key=*/1);
+  EXPECT_EQ(reader.num_blocks(), 4);
+
+  const std::vector<int32_t> token_ids = {1, 2, 3, 4, 5, 6, 7};
+  EXPECT_TRUE(reader.acquire(token_ids, 0).empty());
+
+  const auto slots = writer.reserve(token_ids, /*n_blocks=*/3);
+  ASSERT_EQ(slots.size(), 3);
+  for (const int32_t slot : slots) {
+    EXPECT_GE(slot, 0);
+  }
+  // the blocks being written are neither matched nor reserved again
+  EXPECT_TRUE(reader.acquire(token_ids, 0).empty());
+  EXPECT_EQ(reader.reserve(token_ids, 3), std::vector<int32_t>(3, -1));
+
+  writer.commit(slots);
+  EXPECT_EQ(reader.num_published_blocks(), 3);
+  EXPECT_EQ(reader.acquire(token_ids, 0), slots);
+  EXPECT_EQ(reader.acquire(token_ids, 2),
+            std::vector<int32_t>(slots.begin() + 2, slots.end()));
+  reader.release(slots);
+  reader.release({slots[2]});
+
+  // a different prefix doesn't match the following blocks
+  const std::vector<int32_t> other_ids = {9, 9, 3, 4, 5, 6};
+  EXPECT_TRUE(reader.acquire(other_ids, 0).empty());
+  EXPECT_TRUE(reader.acquire(other_ids, 1).empty());
+}
+
+TEST(SharedBlockPoolTest, Evict) {
+  const uint32_t block_size = 1;
+  const std::string name = pool_name("evict");
+  SharedBlockPool pool(name, /*n_blocks=*/2, block_size, /*layout_key=*/1);
+
+  const std::vector<int32_t> first = {1, 2};
+  auto slots = pool.reserve(first, 2);
+  pool.commit(slots);
+  EXPECT_EQ(pool.num_published_blocks(), 2);
+
+  // the blocks in use are not evicted
+  const auto held = pool.acquire(first, 0);
+  EXPECT_EQ(held.size(), 2);
+  const std::vector<int32_t> second = {3, 4};
+  EXPECT_EQ(pool.reserve(second, 2), std::vector<int32_t>(2, -1));
+
+  // evicted once released
+  pool.release(held);
+  slots = pool.reserve(second, 2);
+  EXPECT_GE(slots[0], 0);
+  EXPECT_GE(slots[1], 0);
+  pool.commit(slots);
+  EXPECT_TRUE(pool.acquire(first, 0).empty());
+  EXPECT_EQ(pool.num_published_blocks(), 2);
+
+  // canceled slots are free again
+  pool.release(pool.acquire(second, 0));
+  const std::vector<int32_t> third = {5};
+  slots = pool.reserve(third, 1);
+  EXPECT_GE(slots[0], 0);
+  pool.cancel(slots);
+  EXPECT_TRUE(pool.acquire(third, 0).empty());
+  EXPECT_EQ(pool.num_published_blocks(), 1);
+}
+
+TEST(SharedBlockPoolTest, DeviceMemory) {
+  const std::string name = pool_name("device");
+  SharedBlockPool first(name, /*n_blocks=*/2, /*block_size=*/1, 1);
+  SharedBlockPool second(name, /*n_blocks=*/2, /*block_size=*/1, 0);
+
+  int n_allocs = 0;
+  auto alloc = [&n_allocs]() {
+    ++n_allocs;
+    return std::string("handle");
+  };
+  bool created = false;
+  EXPECT_EQ(first.device_memory(/*rank=*/0, 1024, alloc, &created), "handle");
+  EXPECT_TRUE(created);
+  EXPECT_EQ(second.device_memory(/*rank=*/0, 1024, alloc, &created), "handle");
+  EXPECT_FALSE(created);
+  EXPECT_EQ(n_allocs, 1);
+
+  // each rank has its own memory
+  second.device_memory(/*rank=*/1, 1024, alloc, &created);
+  EXPECT_TRUE(created);
+  EXPECT_EQ(n_allocs, 2);
+}
+
+}  // namespace llm
@@ -58,6 +58,12 @@ DEFINE_string(group_size, "", "group size for quantization");
 DEFINE_string(desc_act, "", "desc_act for quantization");
 DEFINE_string(is_sym, "", "is_sym for quantization");
 DEFINE_string(zero_point, "", "zero_point for quantization");
+DEFINE_string(checkpoint_format,
+              "",
+              "format of the quantized weights, e.g. marlin_24");
+DEFINE_string(weight_only,
+              "",
+              "only quantize the weights for w8a8 methods, e.g. fp8");
 
 // define gflags for all tokenizer args defined in
 DEFINE_string(tokenizer_type,
@@ -191,6 +197,8 @@ void override_args_from_gflag(ModelArgs& args,
   OVERRIDE_ARG_FROM_GFLAG(quant_args, desc_act);
   OVERRIDE_ARG_FROM_GFLAG(quant_args, is_sym);
   OVERRIDE_ARG_FROM_GFLAG(quant_args, zero_point);
+  OVERRIDE_ARG_FROM_GFLAG(quant_args, checkpoint_format);
+  OVERRIDE_ARG_FROM_GFLAG(quant_args, weight_only);
 
   // override tokenizer args from gflag
   OVERRIDE_ARG_FROM_GFLAG(tokenizer_args, tokenizer_type);
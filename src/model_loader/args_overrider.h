@@ -40,6 +40,8 @@ DECLARE_string(group_size);
 DECLARE_string(desc_act);
 DECLARE_string(is_sym);
 DECLARE_string(zero_point);
+DECLARE_string(checkpoint_format);
+DECLARE_string(weight_only);
 
 // tokenizer flags
 DECLARE_string(tokenizer_type);
@@ -1,12 +1,18 @@
 #include "model_loader.h"
 
 #include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
 #include <absl/strings/str_replace.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include <algorithm>
+#include <atomic>
 #include <boost/algorithm/string.hpp>
 #include <filesystem>
+#include <functional>
+#include <thread>
 #include <vector>
 
 #include "args_overrider.h"
@@ -18,7 +24,38 @@
 #include "tokenizer/sentencepiece_tokenizer.h"
 #include "tokenizer/tiktoken_tokenizer.h"
 
+DEFINE_string(safetensors_cache_dir,
+              "",
+              "directory to cache the pickle (.bin) weights files of models "
+              "converted to safetensors, which are memory mapped instead of "
+              "unpickled. converted once at the first load. empty to "
+              "disable.");
+
+DEFINE_int32(safetensors_conversion_threads,
+             4,
+             "number of pickle files converted to safetensors at the same "
+             "time, each one is held in host memory while converted.");
+
 namespace llm {
+namespace {
+namespace fs = std::filesystem;
+
+// the directory of the converted files of a model in the cache, keyed by the
+// path, size and modification time of the pickle files.
+std::string safetensors_cache_path(const std::string& model_weights_path,
+                                   const std::vector<std::string>& files) {
+  std::string key = fs::absolute(model_weights_path).string();
+  for (const auto& file : files) {
+    const auto mtime = fs::last_write_time(file).time_since_epoch().count();
+    absl::StrAppend(&key, ";", file, ":", fs::file_size(file), ":", mtime);
+  }
+  const auto name = fs::absolute(model_weights_path).filename().string();
+  return (fs::path(FLAGS_safetensors_cache_dir) /
+          absl::StrCat(name, "-", absl::Hex(std::hash<std::string>{}(key))))
+      .string();
+}
+}  // namespace
+
 StateDictIterator::StateDictIterator(
     const std::vector<std::string>& model_weights_files,
     size_t index,
@@ -83,6 +120,73 @@ HFModelLoader::HFModelLoader(const std::string& model_weights_path)
       << "Failed to find model weights files in " << model_weights_path;
   // sort the model weights files by name
   std::sort(model_weights_files_.begin(), model_weights_files_.end());
+  if (is_pickle_ && !FLAGS_safetensors_cache_dir.empty()) {
+    convert_pickle_files();
+  }
+}
+
+void HFModelLoader::convert_pickle_files() {
+  const std::string cache_path =
+      safetensors_cache_path(model_weights_path_, model_weights_files_);
+  std::error_code ec;
+  fs::create_directories(cache_path, ec);
+  if (ec) {
+    LOG(WARNING) << "Failed to create safetensors cache " << cache_path
+                 << ": " << ec.message();
+    return;
+  }
+
+  std::vector<std::string> converted_files;
+  std::vector<size_t> missing;
+  for (size_t i = 0; i < model_weights_files_.size(); ++i) {
+    const auto stem = fs::path(model_weights_files_[i]).stem().string();
+    converted_files.push_back(
+        (fs::path(cache_path) / (stem + ".safetensors")).string());
+    if (!fs::exists(converted_files.back())) {
+      missing.push_back(i);
+    }
+  }
+
+  if (!missing.empty()) {
+    LOG(INFO) << "Converting " << missing.size()
+              << " pickle weights files to safetensors in " << cache_path;
+    // one file per thread, the files are unpickled in parallel
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    auto convert = [&]() {
+      for (size_t i = next++; i < missing.size() && !failed; i = next++) {
+        const size_t index = missing[i];
+        const auto state_dict =
+            StateDict::load_pickle_file(model_weights_files_[index]);
+        if (!state_dict->save_safetensors(converted_files[index])) {
+          failed = true;
+        }
+      }
+    };
+    const size_t n_threads = std::min<size_t>(
+        std::max(FLAGS_safetensors_conversion_threads, 1), missing.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < n_threads; ++i) {
+      threads.emplace_back(convert);
+    }
+    convert();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    if (failed) {
+      LOG(WARNING) << "Failed to convert the pickle weights files, loading "
+                      "them as is";
+      return;
+    }
+  }
+  model_weights_files_ = std::move(converted_files);
+  is_pickle_ = false;
+}
+
+std::unique_ptr<StateDict> HFModelLoader::load_state_dict(size_t index) const {
+  CHECK(index < model_weights_files_.size());
+  LOG(INFO) << "Loading model weights from " << model_weights_files_[index];
+  return StateDict::load(model_weights_files_[index], is_pickle_);
 }
 
 std::unique_ptr<Tokenizer> HFModelLoader::tokenizer() const {
@@ -151,6 +255,10 @@ bool HFModelLoader::load_model_args(const std::string& model_weights_path) {
     if (auto v = reader.value<bool>("quantization_config.zero_point")) {
       quant_args_.zero_point() = v.value();
     }
+    if (auto v = reader.value<std::string>(
+            "quantization_config.checkpoint_format")) {
+      quant_args_.checkpoint_format() = v.value();
+    }
   }
 
   // load quantization args for awq if exists
@@ -194,6 +302,9 @@ bool HFModelLoader::load_model_args(const std::string& model_weights_path) {
     if (auto v = gptq_reader.value<bool>("zero_point")) {
       quant_args_.zero_point() = v.value();
     }
+    if (auto v = gptq_reader.value<std::string>("checkpoint_format")) {
+      quant_args_.checkpoint_format() = v.value();
+    }
   }
 
   // load tokenizer args from tokenizer_config.json if exists
@@ -2,6 +2,7 @@
 
 #include <torch/torch.h>
 
+#include <memory>
 #include <vector>
 
 #include "model_loader/state_dict.h"
@@ -71,6 +72,10 @@ class ModelLoader {
   virtual std::unique_ptr<Tokenizer> tokenizer() const = 0;
 
   virtual size_t weights_files_count() const = 0;
+
+  // load the state dict of the index-th model weights file, thread safe.
+  virtual std::unique_ptr<StateDict> load_state_dict(size_t index) const = 0;
+
   virtual StateDictIterator begin() const = 0;
   virtual StateDictIterator end() const = 0;
 
@@ -98,6 +103,8 @@ class HFModelLoader : public ModelLoader {
     return model_weights_files_.size();
   }
 
+  std::unique_ptr<StateDict> load_state_dict(size_t index) const override;
+
   // support range-based for loop
   StateDictIterator begin() const override {
     return {model_weights_files_, 0, is_pickle_, false};
@@ -109,6 +116,10 @@ class HFModelLoader : public ModelLoader {
  private:
   bool load_model_args(const std::string& args_file_path);
 
+  // convert the pickle files into safetensors files in the cache directory
+  // if not yet, and load the converted files instead.
+  void convert_pickle_files();
+
   std::string model_weights_path_;
 
   // loaded model args
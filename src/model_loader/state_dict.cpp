@@ -3,18 +3,54 @@
 #include <ATen/core/TensorBody.h>
 #include <absl/strings/match.h>
 #include <caffe2/serialize/inline_container.h>
+#include <cuda_runtime.h>
+#include <fcntl.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <torch/csrc/jit/serialization/import_read.h>
 #include <torch/csrc/jit/serialization/storage_context.h>
 #include <torch/torch.h>
+#include <unistd.h>
 
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
 #include <memory>
+#include <nlohmann/json.hpp>
+#include <thread>
+#include <vector>
 
 #include "huggingface/safetensors.h"
+#include "weights_broadcaster.h"
+#include "weights_snapshot.h"
+
+DEFINE_bool(direct_io_weights,
+            false,
+            "read the safetensors weights files with O_DIRECT into pinned "
+            "host memory, bypassing the page cache. falls back to mmap if "
+            "not supported by the file system.");
+
+DEFINE_int32(direct_io_threads,
+             8,
+             "number of threads to read a weights file with O_DIRECT.");
+
+DEFINE_bool(release_weights_pages,
+            true,
+            "drop the pages of the memory mapped weights files once the "
+            "tensors are copied to the devices, to bound the host memory "
+            "used while loading the model.");
 
 namespace llm {
 
 namespace {
+// O_DIRECT requires the file offset, length and buffer to be aligned
+constexpr size_t kDirectIOAlignment = 4096;
+constexpr size_t kDirectIOChunkSize = 16 * 1024 * 1024;
 // adapt from
 // https://github.com/pytorch/pytorch/blob/main/torch/csrc/jit/serialization/pickle.cpp#L98
 // but with different parameters for efficiency
@@ -67,6 +103,35 @@ torch::ScalarType get_dtype(const Dtype& dtype) {
   __builtin_unreachable();
 }
 
+// the dtype name in the header of safetensors files
+const char* safetensors_dtype(torch::ScalarType dtype) {
+  switch (dtype) {
+    case torch::kBool:
+      return "BOOL";
+    case torch::kUInt8:
+      return "U8";
+    case torch::kInt8:
+      return "I8";
+    case torch::kInt16:
+      return "I16";
+    case torch::kFloat16:
+      return "F16";
+    case torch::kBFloat16:
+      return "BF16";
+    case torch::kInt32:
+      return "I32";
+    case torch::kFloat32:
+      return "F32";
+    case torch::kFloat64:
+      return "F64";
+    case torch::kInt64:
+      return "I64";
+    default:
+      LOG(FATAL) << "Unsupported dtype " << dtype;
+  }
+  __builtin_unreachable();
+}
+
 std::vector<int64_t> get_sizes(const View* view) {
   std::vector<int64_t> sizes;
   sizes.reserve(view->rank);
@@ -76,47 +141,112 @@ std::vector<int64_t> get_sizes(const View* view) {
   return sizes;
 }
 
-}  // namespace
-
-std::unique_ptr<StateDict> StateDict::load(const std::string& weights_file,
-                                           bool is_pickle) {
-  if (is_pickle) {
-    return load_pickle_file(weights_file);
+// the bytes spanned by the tensor, which may be a strided view, e.g. a shard
+// along dim 1. returns false for empty tensors and negative strides.
+bool tensor_span(const torch::Tensor& tensor,
+                 const uint8_t** begin,
+                 const uint8_t** end) {
+  if (!tensor.defined() || tensor.numel() == 0) {
+    return false;
   }
-  return load_safetensors(weights_file);
+  int64_t max_offset = 0;
+  for (int64_t i = 0; i < tensor.dim(); ++i) {
+    if (tensor.stride(i) < 0) {
+      return false;
+    }
+    max_offset += (tensor.size(i) - 1) * tensor.stride(i);
+  }
+  *begin = static_cast<const uint8_t*>(tensor.data_ptr());
+  *end = *begin + (max_offset + 1) * tensor.element_size();
+  return true;
 }
 
-std::unique_ptr<StateDict> StateDict::load_pickle_file(
-    const std::string& weights_file) {
-  using caffe2::serialize::PyTorchStreamReader;
-  const torch::IValue data = pickle_load(weights_file);
+// read the whole file with O_DIRECT into pinned host memory, the chunks are
+// read by multiple threads in parallel. returns an undefined tensor if
+// O_DIRECT or pinned memory is not available.
+torch::Tensor read_file_direct(const std::string& weights_file) {
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-vararg)
+  const int fd = ::open(weights_file.c_str(), O_RDONLY | O_DIRECT);
+  if (fd < 0) {
+    LOG(WARNING) << "Failed to open " << weights_file
+                 << " with O_DIRECT: " << std::strerror(errno);
+    return {};
+  }
+  struct stat st {};
+  if (::fstat(fd, &st) != 0) {
+    ::close(fd);
+    return {};
+  }
+  const size_t size = st.st_size;
+  const size_t aligned_size = (size + kDirectIOAlignment - 1) /
+                              kDirectIOAlignment * kDirectIOAlignment;
 
-  // convert to typed dict
-  std::unordered_map<std::string, torch::Tensor> dict;
-  for (const auto& kv : data.toGenericDict()) {
-    const auto& key = kv.key();
-    const auto& value = kv.value();
-    dict[key.toStringRef()] = value.toTensor();
+  // allocated outside of the caching host allocator to release the memory
+  // once the file is loaded. page aligned.
+  void* ptr = nullptr;
+  if (cudaHostAlloc(&ptr, aligned_size, cudaHostAllocDefault) !=
+      cudaSuccess) {
+    (void)cudaGetLastError();
+    ::close(fd);
+    LOG(WARNING) << "Failed to allocate pinned memory for " << weights_file;
+    return {};
   }
-  return std::make_unique<StateDict>(std::move(dict));
+  auto buffer = torch::from_blob(
+      ptr,
+      {static_cast<int64_t>(aligned_size)},
+      [](void* p) { cudaFreeHost(p); },
+      torch::dtype(torch::kUInt8));
+  auto* data = static_cast<uint8_t*>(ptr);
+
+  const size_t n_chunks =
+      (aligned_size + kDirectIOChunkSize - 1) / kDirectIOChunkSize;
+  std::atomic<size_t> next_chunk{0};
+  std::atomic<bool> failed{false};
+  auto read_chunks = [&]() {
+    for (size_t chunk = next_chunk++; chunk < n_chunks && !failed;
+         chunk = next_chunk++) {
+      const size_t offset = chunk * kDirectIOChunkSize;
+      const size_t length = std::min(kDirectIOChunkSize, aligned_size - offset);
+      size_t done = 0;
+      // the last read is short at the end of the file
+      while (done < length && offset + done < size) {
+        const ssize_t n =
+            ::pread(fd, data + offset + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0) {
+          failed = true;
+          break;
+        }
+        done += n;
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  const size_t n_threads =
+      std::min<size_t>(std::max(FLAGS_direct_io_threads, 1), n_chunks);
+  for (size_t i = 1; i < n_threads; ++i) {
+    threads.emplace_back(read_chunks);
+  }
+  read_chunks();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  ::close(fd);
+
+  if (failed) {
+    LOG(WARNING) << "Failed to read " << weights_file << " with O_DIRECT";
+    return {};
+  }
+  return buffer.narrow(/*dim=*/0, /*start=*/0, static_cast<int64_t>(size));
 }
 
-std::unique_ptr<StateDict> StateDict::load_safetensors(
+// create tensors over the content of a safetensors file without copying
+std::unordered_map<std::string, torch::Tensor> parse_safetensors(
+    const uint8_t* data,
+    size_t size,
     const std::string& weights_file) {
-  folly::MemoryMapping::Options options;
-  options.setPrefault(true).setReadable(true);
-  auto mem_map = std::make_unique<folly::MemoryMapping>(weights_file.c_str(),
-                                                        0,   // offset
-                                                        -1,  // length
-                                                        options);
-  // lock it to memory caused segfault in docker.
-  // TODO: reenable it when we figure out the issue.
-  // mem_map->mlock(folly::MemoryMapping::LockMode::MUST_LOCK);
-  const folly::ByteRange content = mem_map->range();
-  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
-  const uint8_t* data = reinterpret_cast<const uint8_t*>(content.data());
-  const size_t size = content.size();
-
   std::unordered_map<std::string, torch::Tensor> dict;
   // safetensors
   Handle* handle = nullptr;
@@ -151,26 +281,173 @@ std::unique_ptr<StateDict> StateDict::load_safetensors(
       << "Failed to free tensor names";
   CHECK(safetensors_destroy(handle) == Status::Ok)
       << "Failed to destroy safetensors handle";
+  return dict;
+}
+
+}  // namespace
+
+std::unique_ptr<StateDict> StateDict::load(const std::string& weights_file,
+                                           bool is_pickle) {
+  if (is_pickle) {
+    return load_pickle_file(weights_file);
+  }
+  return load_safetensors(weights_file);
+}
+
+std::unique_ptr<StateDict> StateDict::load_pickle_file(
+    const std::string& weights_file) {
+  using caffe2::serialize::PyTorchStreamReader;
+  const torch::IValue data = pickle_load(weights_file);
+
+  // convert to typed dict
+  std::unordered_map<std::string, torch::Tensor> dict;
+  for (const auto& kv : data.toGenericDict()) {
+    const auto& key = kv.key();
+    const auto& value = kv.value();
+    dict[key.toStringRef()] = value.toTensor();
+  }
+  return std::make_unique<StateDict>(std::move(dict));
+}
+
+std::unique_ptr<StateDict> StateDict::load_safetensors(
+    const std::string& weights_file) {
+  if (FLAGS_direct_io_weights) {
+    auto buffer = read_file_direct(weights_file);
+    if (buffer.defined()) {
+      auto dict = parse_safetensors(
+          buffer.data_ptr<uint8_t>(), buffer.numel(), weights_file);
+      return std::make_unique<StateDict>(std::move(buffer), std::move(dict));
+    }
+    LOG(WARNING) << "Fall back to mmap for " << weights_file;
+  }
 
+  // don't prefault the whole file on this thread, the pages are faulted in
+  // by the workers when copying the tensors, so each rank only touches the
+  // byte ranges of its own shards. the kernel reads the file ahead in the
+  // background in the meantime.
+  folly::MemoryMapping::Options options;
+  options.setPrefault(false).setReadable(true);
+  auto mem_map = std::make_unique<folly::MemoryMapping>(weights_file.c_str(),
+                                                        0,   // offset
+                                                        -1,  // length
+                                                        options);
+  mem_map->advise(MADV_WILLNEED);
+  // lock it to memory caused segfault in docker.
+  // TODO: reenable it when we figure out the issue.
+  // mem_map->mlock(folly::MemoryMapping::LockMode::MUST_LOCK);
+  const folly::ByteRange content = mem_map->range();
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(content.data());
+  auto dict = parse_safetensors(data, content.size(), weights_file);
   return std::make_unique<StateDict>(std::move(mem_map), std::move(dict));
 }
 
+bool StateDict::save_safetensors(const std::string& weights_file) const {
+  // the tensors sorted by name, each in its own contiguous range since
+  // safetensors doesn't allow shared storages, e.g. of tied weights.
+  const std::map<std::string, torch::Tensor> tensors(dict_.begin(),
+                                                     dict_.end());
+  nlohmann::json header = nlohmann::json::object();
+  std::vector<torch::Tensor> contiguous_tensors;
+  contiguous_tensors.reserve(tensors.size());
+  int64_t offset = 0;
+  for (const auto& [name, tensor] : tensors) {
+    auto t = tensor.to(torch::kCPU).contiguous();
+    const int64_t nbytes = t.numel() * t.element_size();
+    header[name] = {{"dtype", safetensors_dtype(t.scalar_type())},
+                    {"shape", t.sizes().vec()},
+                    {"data_offsets", {offset, offset + nbytes}}};
+    offset += nbytes;
+    contiguous_tensors.push_back(std::move(t));
+  }
+  header["__metadata__"] = {{"format", "pt"}};
+  std::string header_str = header.dump();
+  // pad the header with spaces to align the data to 8 bytes
+  header_str.resize((header_str.size() + 7) / 8 * 8, ' ');
+
+  const std::string tmp_file = weights_file + ".tmp";
+  {
+    std::ofstream file(tmp_file, std::ios::binary | std::ios::trunc);
+    // little endian length of the header
+    uint64_t header_len = header_str.size();
+    char len_bytes[8];
+    for (char& byte : len_bytes) {
+      byte = static_cast<char>(header_len & 0xff);
+      header_len >>= 8;
+    }
+    file.write(len_bytes, sizeof(len_bytes));
+    file.write(header_str.data(),
+               static_cast<std::streamsize>(header_str.size()));
+    for (const auto& t : contiguous_tensors) {
+      file.write(static_cast<const char*>(t.data_ptr()),
+                 static_cast<std::streamsize>(t.numel() * t.element_size()));
+    }
+    if (!file.good()) {
+      LOG(ERROR) << "Failed to write " << tmp_file;
+      file.close();
+      std::filesystem::remove(tmp_file);
+      return false;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp_file, weights_file, ec);
+  return !ec;
+}
+
 StateDict::StateDict(std::unordered_map<std::string, torch::Tensor> dict,
                      const std::string& prefix)
     : dict_(std::move(dict)), prefix_(prefix) {}
 
 StateDict::StateDict(std::unique_ptr<folly::MemoryMapping> mem_map,
+                     std::unordered_map<std::string, torch::Tensor> dict,
+                     bool is_sharded)
+    : mem_map_(std::move(mem_map)),
+      dict_(std::move(dict)),
+      is_sharded_(is_sharded) {}
+
+StateDict::StateDict(torch::Tensor buffer,
                      std::unordered_map<std::string, torch::Tensor> dict)
-    : mem_map_(std::move(mem_map)), dict_(std::move(dict)) {}
+    : buffer_(std::move(buffer)), dict_(std::move(dict)) {}
 
-torch::Tensor StateDict::get_tensor(const std::string& tensor_name) const {
+torch::Tensor StateDict::find_tensor(const std::string& tensor_name) const {
   const auto it = dict_.find(tensor_name);
   if (it == dict_.end()) {
     return torch::Tensor{nullptr};
   }
-  // apply transform function if exists
-  return transform_func_ ? transform_func_(tensor_name, it->second)
-                         : it->second;
+  // apply transform function if exists, sharded tensors are transformed
+  // already
+  return transform_func_ && !is_sharded_
+             ? transform_func_(tensor_name, it->second)
+             : it->second;
+}
+
+void StateDict::record_tensor(const std::string& tensor_name,
+                              const torch::Tensor& tensor) const {
+  auto* writer = WeightsSnapshotWriter::current();
+  if (writer != nullptr && tensor.defined()) {
+    writer->add(prefix_ + tensor_name, tensor);
+  }
+}
+
+torch::Tensor StateDict::get_tensor(const std::string& tensor_name) const {
+  auto* broadcaster = WeightsBroadcaster::current();
+  if (broadcaster != nullptr && !is_sharded_) {
+    if (dict_.find(tensor_name) == dict_.end()) {
+      // the same on all ranks, skip the broadcast
+      return torch::Tensor{nullptr};
+    }
+    // only read on the src rank
+    const auto host_tensor =
+        broadcaster->is_src() ? find_tensor(tensor_name) : torch::Tensor();
+    auto tensor = broadcaster->broadcast(host_tensor);
+    release(host_tensor);
+    record_tensor(tensor_name, tensor);
+    return tensor;
+  }
+
+  auto tensor = find_tensor(tensor_name);
+  record_tensor(tensor_name, tensor);
+  return tensor;
 }
 
 torch::Tensor StateDict::get_sharded_tensor(const std::string& tensor_name,
@@ -181,7 +458,29 @@ torch::Tensor StateDict::get_sharded_tensor(const std::string& tensor_name,
   CHECK(rank >= 0 && rank < world_size)
       << "Invalid rank " << rank << " for " << world_size << " shards";
 
-  auto tensor = get_tensor(tensor_name);
+  // the same tensor may be sharded on different dims, e.g. tied embeddings
+  const std::string sharded_name =
+      tensor_name + "@shard" + std::to_string(dim);
+  if (is_sharded_) {
+    return find_tensor(sharded_name);
+  }
+
+  auto* broadcaster = WeightsBroadcaster::current();
+  if (broadcaster != nullptr && world_size == broadcaster->world_size()) {
+    CHECK_EQ(rank, broadcaster->rank())
+        << "the shards should be loaded by the ranks of the process group";
+    if (dict_.find(tensor_name) == dict_.end()) {
+      return torch::Tensor{nullptr};
+    }
+    const auto host_tensor =
+        broadcaster->is_src() ? find_tensor(tensor_name) : torch::Tensor();
+    auto shard = broadcaster->scatter(host_tensor, dim);
+    release(host_tensor);
+    record_tensor(sharded_name, shard);
+    return shard;
+  }
+
+  auto tensor = find_tensor(tensor_name);
   if (!tensor.defined()) {
     return tensor;
   }
@@ -190,6 +489,7 @@ torch::Tensor StateDict::get_sharded_tensor(const std::string& tensor_name,
   if (dim_size < world_size) {
     // too small to shard, return the whole tensor instead
     // TODO: assert dim_size >= world_size
+    record_tensor(sharded_name, tensor);
     return tensor;
   }
 
@@ -197,9 +497,44 @@ torch::Tensor StateDict::get_sharded_tensor(const std::string& tensor_name,
       << "can't devide tensor evenly on " << dim << " with dim: " << dim_size
       << " world_size: " << world_size;
   const auto chunks = tensor.chunk(world_size, dim);
+  record_tensor(sharded_name, chunks[rank]);
   return chunks[rank];
 }
 
+void StateDict::release(const torch::Tensor& tensor) const {
+  const uint8_t* begin = nullptr;
+  const uint8_t* end = nullptr;
+  if (!FLAGS_release_weights_pages || mem_map_ == nullptr ||
+      !tensor.defined() || !tensor.device().is_cpu() ||
+      !tensor_span(tensor, &begin, &end)) {
+    return;
+  }
+  const folly::ByteRange content = mem_map_->range();
+  if (begin < content.begin() || end > content.end()) {
+    // not a view of the file, e.g. transformed
+    return;
+  }
+  // only the whole pages within the tensor, the pages at its ends may hold
+  // the bytes of its neighbors.
+  const auto page_size = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  const uintptr_t first_page =
+      (reinterpret_cast<uintptr_t>(begin) + page_size - 1) / page_size *
+      page_size;
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  const uintptr_t last_page =
+      reinterpret_cast<uintptr_t>(end) / page_size * page_size;
+  if (first_page >= last_page) {
+    return;
+  }
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  auto* addr = reinterpret_cast<void*>(first_page);
+  if (::madvise(addr, last_page - first_page, MADV_DONTNEED) != 0) {
+    LOG_FIRST_N(WARNING, 1) << "Failed to release the pages of the weights: "
+                            << std::strerror(errno);
+  }
+}
+
 // select all the tensors whose name starts with prefix.
 StateDict StateDict::select(const std::string& prefix) const {
   std::unordered_map<std::string, torch::Tensor> selected;
@@ -208,7 +543,10 @@ StateDict StateDict::select(const std::string& prefix) const {
       selected[name.substr(prefix.length())] = tensor;
     }
   }
-  return {std::move(selected), prefix_ + prefix};
+  StateDict state_dict(std::move(selected), prefix_ + prefix);
+  state_dict.mem_map_ = mem_map_;
+  state_dict.is_sharded_ = is_sharded_;
+  return state_dict;
 }
 
 StateDict StateDict::select_with_transform(
@@ -23,7 +23,14 @@ class StateDict final {
   StateDict(std::unordered_map<std::string, torch::Tensor> dict,
             const std::string& prefix = "");
 
+  // is_sharded: the tensors are already sharded for the rank and
+  // transformed, e.g. from a weights snapshot.
   StateDict(std::unique_ptr<folly::MemoryMapping> mem_map,
+            std::unordered_map<std::string, torch::Tensor> dict,
+            bool is_sharded = false);
+
+  // the tensors are views of the buffer holding the whole file
+  StateDict(torch::Tensor buffer,
             std::unordered_map<std::string, torch::Tensor> dict);
 
   // get the tensor with the given name. return nullptr if not found.
@@ -35,6 +42,13 @@ class StateDict final {
                                    int rank,
                                    int world_size) const;
 
+  // drop the pages of the memory mapped file backing the tensor once it is
+  // copied to the device, so that the resident memory of the process does
+  // not grow to the size of the file while loading it. the pages are faulted
+  // in again if read again, e.g. by another rank. no-op for the tensors not
+  // backed by the memory mapping.
+  void release(const torch::Tensor& tensor) const;
+
   // select all the tensors whose name starts with prefix.
   // the returned tensor name will be the suffix of the original name.
   StateDict select(const std::string& prefix) const;
@@ -46,17 +60,35 @@ class StateDict final {
   StateDict select_with_transform(const std::string& prefix,
                                   TensorTransform transform_func) const;
 
+  // write the tensors into a safetensors file, e.g. to convert a pickle
+  // file into a file that can be memory mapped. written to a temporary file
+  // renamed at the end, so the file is complete if it exists. returns false
+  // if failed to write the file, e.g. out of disk space.
+  bool save_safetensors(const std::string& weights_file) const;
+
   size_t size() const { return dict_.size(); }
 
   std::string_view prefix() const { return prefix_; }
 
+  bool is_sharded() const { return is_sharded_; }
+
   // support range-based for loop
   auto begin() const { return dict_.begin(); }
   auto end() const { return dict_.end(); }
 
  private:
-  // memory mapping for safetensors
-  std::unique_ptr<folly::MemoryMapping> mem_map_;
+  // get the tensor without recording it
+  torch::Tensor find_tensor(const std::string& tensor_name) const;
+
+  // record the tensor consumed by the model if taking a weights snapshot
+  void record_tensor(const std::string& tensor_name,
+                     const torch::Tensor& tensor) const;
+
+  // memory mapping for safetensors, shared with the selected state dicts
+  std::shared_ptr<folly::MemoryMapping> mem_map_;
+
+  // pinned host memory for safetensors read with direct io
+  torch::Tensor buffer_;
 
   std::unordered_map<std::string, torch::Tensor> dict_;
 
@@ -64,5 +96,8 @@ class StateDict final {
 
   // prefix for debug purpose
   std::string prefix_;
+
+  // whether the tensors are already sharded and transformed
+  bool is_sharded_ = false;
 };
 }  // namespace llm
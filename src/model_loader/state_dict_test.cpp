@@ -2,6 +2,13 @@
 
 #include <c10/core/Device.h>
 #include <gtest/gtest.h>
+#include <torch/cuda.h>
+
+#include <filesystem>
+#include <thread>
+
+#include "weights_broadcaster.h"
+#include "weights_snapshot.h"
 
 namespace llm {
 
@@ -42,6 +49,25 @@ TEST(StateDictTest, LoadSafeTensors) {
   }
 }
 
+TEST(StateDictTest, SaveSafeTensors) {
+  const auto file =
+      (std::filesystem::temp_directory_path() / "save_safetensors_test")
+          .string();
+  auto pickle = StateDict::load_pickle_file("data/test.pth");
+  ASSERT_TRUE(pickle->save_safetensors(file));
+
+  auto state_dict = StateDict::load_safetensors(file);
+  EXPECT_EQ(state_dict->size(), 20);
+  for (int i = 0; i < 20; ++i) {
+    const std::string key = "key_" + std::to_string(i);
+    auto tensor = state_dict->get_tensor(key);
+    ASSERT_TRUE(tensor.defined());
+    EXPECT_EQ(tensor.dtype(), torch::kFloat32);
+    EXPECT_TRUE(tensor.equal(torch::ones({10, 10}) * i));
+  }
+  std::filesystem::remove(file);
+}
+
 TEST(StateDictTest, SharedTensor) {
   // TODO: add more tests
   // create a list of tensors with same size
@@ -74,4 +100,122 @@ TEST(StateDictTest, SharedTensor) {
   EXPECT_TRUE(rank1_tensor.equal(chunks[1]));
 }
 
+TEST(StateDictTest, WeightsSnapshot) {
+  const auto dir =
+      (std::filesystem::temp_directory_path() / "weights_snapshot_test")
+          .string();
+  std::filesystem::remove_all(dir);
+
+  auto state_dict = StateDict::load_safetensors("data/test.safetensors");
+  const auto layer = state_dict->select("key_");
+
+  // record the tensors consumed by rank 1 of 2
+  {
+    WeightsSnapshotWriter writer(dir, /*rank=*/1, /*world_size=*/2);
+    WeightsSnapshotWriter::set_current(&writer);
+    layer.get_sharded_tensor("1", /*dim=*/0, /*rank=*/1, /*world_size=*/2);
+    layer.get_sharded_tensor("2", /*dim=*/1, /*rank=*/1, /*world_size=*/2);
+    layer.get_tensor("3");
+    WeightsSnapshotWriter::set_current(nullptr);
+    EXPECT_FALSE(has_weights_snapshot(dir, /*rank=*/1, /*world_size=*/2));
+    writer.finish();
+  }
+  EXPECT_TRUE(has_weights_snapshot(dir, /*rank=*/1, /*world_size=*/2));
+  EXPECT_FALSE(has_weights_snapshot(dir, /*rank=*/0, /*world_size=*/2));
+  EXPECT_FALSE(has_weights_snapshot(dir, /*rank=*/1, /*world_size=*/4));
+
+  auto snapshot = load_weights_snapshot(dir, /*rank=*/1, /*world_size=*/2);
+  EXPECT_TRUE(snapshot->is_sharded());
+  EXPECT_EQ(snapshot->size(), 3);
+  const auto snapshot_layer = snapshot->select("key_");
+  // the sharded tensors are returned as is
+  EXPECT_TRUE(
+      snapshot_layer.get_sharded_tensor("1", /*dim=*/0, 1, 2)
+          .equal(layer.get_sharded_tensor("1", /*dim=*/0, 1, 2)));
+  EXPECT_TRUE(
+      snapshot_layer.get_sharded_tensor("2", /*dim=*/1, 1, 2)
+          .equal(layer.get_sharded_tensor("2", /*dim=*/1, 1, 2)));
+  EXPECT_FALSE(
+      snapshot_layer.get_sharded_tensor("2", /*dim=*/0, 1, 2).defined());
+  EXPECT_TRUE(snapshot_layer.get_tensor("3").equal(layer.get_tensor("3")));
+
+  std::filesystem::remove_all(dir);
+}
+
+TEST(StateDictTest, Release) {
+  const auto dir =
+      (std::filesystem::temp_directory_path() / "state_dict_release_test")
+          .string();
+  std::filesystem::remove_all(dir);
+
+  // write a memory mapped file with tensors spanning many pages
+  const auto tensor = torch::arange(1024 * 1024, torch::kFloat32);
+  const auto matrix = torch::randn({1024, 1024});
+  {
+    StateDict state_dict({{"tensor", tensor}, {"matrix", matrix}});
+    WeightsSnapshotWriter writer(dir, /*rank=*/0, /*world_size=*/1);
+    WeightsSnapshotWriter::set_current(&writer);
+    state_dict.get_tensor("tensor");
+    state_dict.get_tensor("matrix");
+    WeightsSnapshotWriter::set_current(nullptr);
+    writer.finish();
+  }
+  auto snapshot = load_weights_snapshot(dir, /*rank=*/0, /*world_size=*/1);
+  const auto layer = snapshot->select("");
+
+  // the released pages are read from the file again
+  const auto mapped = layer.get_tensor("tensor");
+  EXPECT_TRUE(mapped.equal(tensor));
+  layer.release(mapped);
+  EXPECT_TRUE(mapped.equal(tensor));
+
+  // strided views and tensors out of the mapping
+  const auto column = snapshot->get_tensor("matrix").chunk(2, /*dim=*/1)[1];
+  snapshot->release(column);
+  EXPECT_TRUE(column.equal(matrix.chunk(2, /*dim=*/1)[1]));
+  snapshot->release(tensor);
+  snapshot->release(torch::Tensor());
+
+  std::filesystem::remove_all(dir);
+}
+
+TEST(StateDictTest, Broadcast) {
+  // skip test if less than two gpus
+  if (torch::cuda::device_count() < 2) {
+    GTEST_SKIP() << "Skipping test because less than two gpus";
+  }
+  const auto state_dict = StateDict::load_safetensors("data/test.safetensors");
+  const auto layer = state_dict->select("key_");
+
+  const int world_size = 2;
+  std::vector<torch::Device> devices;
+  for (int i = 0; i < world_size; ++i) {
+    devices.emplace_back(torch::kCUDA, i);
+  }
+  auto process_groups = ProcessGroup::create_process_groups(devices);
+  std::vector<std::thread> threads;
+  for (int rank = 0; rank < world_size; ++rank) {
+    threads.emplace_back([&, rank]() {
+      WeightsBroadcaster broadcaster(process_groups[rank].get());
+      WeightsBroadcaster::set_current(&broadcaster);
+      const auto tensor = layer.get_tensor("1");
+      const auto row_shard = layer.get_sharded_tensor(
+          "2", /*dim=*/0, rank, world_size);
+      const auto column_shard = layer.get_sharded_tensor(
+          "3", /*dim=*/1, rank, world_size);
+      const auto missing = layer.get_tensor("missing");
+      WeightsBroadcaster::set_current(nullptr);
+
+      EXPECT_EQ(tensor.device(), devices[rank]);
+      EXPECT_TRUE(tensor.cpu().equal(torch::ones({10, 10})));
+      EXPECT_TRUE(row_shard.cpu().equal(torch::ones({5, 10}) * 2));
+      EXPECT_TRUE(column_shard.cpu().equal(torch::ones({10, 5}) * 3));
+      EXPECT_FALSE(missing.defined());
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
 }  // namespace llm
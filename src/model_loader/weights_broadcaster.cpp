@@ -0,0 +1,118 @@
+#include "weights_broadcaster.h"
+
+#include <c10/core/DeviceGuard.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <vector>
+
+namespace llm {
+namespace {
+
+// max number of dims of the tensors, the meta is [dtype, ndim, sizes...]
+constexpr int64_t kMaxDims = 8;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+thread_local WeightsBroadcaster* current_broadcaster = nullptr;
+
+// the bytes of a contiguous tensor, sent as is whatever the dtype, e.g. fp8
+torch::Tensor as_bytes(const torch::Tensor& tensor) {
+  return tensor.reshape({-1}).view(torch::kUInt8);
+}
+
+// an uninitialized tensor with the shape and dtype of meta on the device
+torch::Tensor empty_like_meta(const torch::Tensor& meta,
+                              const torch::Device& device) {
+  return torch::empty(meta.sizes(), meta.options().device(device));
+}
+
+}  // namespace
+
+WeightsBroadcaster::WeightsBroadcaster(ProcessGroup* process_group, int src)
+    : process_group_(process_group), src_(src) {
+  CHECK(process_group_ != nullptr) << "process group should not be null";
+  CHECK(src >= 0 && src < process_group_->world_size())
+      << "invalid src rank: " << src;
+}
+
+torch::Tensor WeightsBroadcaster::broadcast_meta(const torch::Tensor& tensor) {
+  const auto& device = process_group_->device();
+  auto meta = torch::zeros({kMaxDims + 2}, torch::kInt64);
+  if (is_src()) {
+    CHECK(tensor.defined()) << "tensor should be defined on the src rank";
+    CHECK_LE(tensor.dim(), kMaxDims) << "too many dims to broadcast";
+    auto* data = meta.data_ptr<int64_t>();
+    data[0] = static_cast<int64_t>(tensor.scalar_type());
+    data[1] = tensor.dim();
+    for (int64_t i = 0; i < tensor.dim(); ++i) {
+      data[i + 2] = tensor.size(i);
+    }
+  }
+  auto device_meta = meta.to(device);
+  process_group_->broadcast(device_meta, src_);
+  meta = device_meta.cpu();
+
+  const auto* data = meta.data_ptr<int64_t>();
+  const auto dtype = static_cast<torch::ScalarType>(data[0]);
+  const std::vector<int64_t> sizes(data + 2, data + 2 + data[1]);
+  return torch::empty(sizes, torch::dtype(dtype).device(torch::kMeta));
+}
+
+torch::Tensor WeightsBroadcaster::broadcast_data(const torch::Tensor& meta,
+                                                 const torch::Tensor& tensor) {
+  auto output = empty_like_meta(meta, process_group_->device());
+  if (is_src()) {
+    output.copy_(tensor);
+  }
+  if (output.numel() > 0) {
+    auto bytes = as_bytes(output);
+    process_group_->broadcast(bytes, src_);
+  }
+  return output;
+}
+
+torch::Tensor WeightsBroadcaster::broadcast(const torch::Tensor& tensor) {
+  torch::DeviceGuard device_guard(process_group_->device());
+  return broadcast_data(broadcast_meta(tensor), tensor);
+}
+
+torch::Tensor WeightsBroadcaster::scatter(const torch::Tensor& tensor,
+                                          int64_t dim) {
+  const auto& device = process_group_->device();
+  torch::DeviceGuard device_guard(device);
+  const auto meta = broadcast_meta(tensor);
+  const int64_t n_shards = world_size();
+  const int64_t dim_size = meta.size(dim);
+  if (dim_size < n_shards) {
+    // too small to shard, same as StateDict::get_sharded_tensor()
+    return broadcast_data(meta, tensor);
+  }
+  CHECK(dim_size % n_shards == 0)
+      << "can't devide tensor evenly on " << dim << " with dim: " << dim_size
+      << " world_size: " << n_shards;
+
+  auto output = empty_like_meta(meta.chunk(n_shards, dim)[0], device);
+  std::vector<torch::Tensor> inputs;
+  if (is_src()) {
+    // only the src rank holds the whole tensor on device
+    const auto full = tensor.to(device);
+    for (const auto& chunk : full.chunk(n_shards, dim)) {
+      inputs.push_back(as_bytes(chunk.contiguous()));
+    }
+  }
+  if (output.numel() > 0) {
+    auto bytes = as_bytes(output);
+    process_group_->scatter(inputs, bytes, src_);
+  }
+  return output;
+}
+
+WeightsBroadcaster* WeightsBroadcaster::current() {
+  return current_broadcaster;
+}
+
+void WeightsBroadcaster::set_current(WeightsBroadcaster* broadcaster) {
+  current_broadcaster = broadcaster;
+}
+
+}  // namespace llm
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <torch/torch.h>
+
+#include <cstdint>
+
+#include "model_parallel/process_group.h"
+
+namespace llm {
+
+// Distributes the tensors of the weights files read by one rank of a tensor
+// parallel group to the other ranks while loading the model, broadcasting
+// the replicated tensors and scattering the shards of the sharded ones. the
+// files are read once per group instead of once per rank, which bounds the
+// loading time by the storage bandwidth once, e.g. on network storage.
+// all the ranks should read the same tensors in the same order.
+class WeightsBroadcaster final {
+ public:
+  // src: the rank reading the tensors from the files
+  explicit WeightsBroadcaster(ProcessGroup* process_group, int src = 0);
+
+  // whether the tensors are read on this rank
+  bool is_src() const { return process_group_->rank() == src_; }
+
+  int rank() const { return process_group_->rank(); }
+
+  int world_size() const { return process_group_->world_size(); }
+
+  // the tensor read by the src rank, on the device of the process group on
+  // all ranks. tensor: only used on the src rank.
+  torch::Tensor broadcast(const torch::Tensor& tensor);
+
+  // the shard of this rank along dim of the tensor read by the src rank, on
+  // the device of the process group, or the whole tensor if too small to
+  // shard. tensor: only used on the src rank.
+  torch::Tensor scatter(const torch::Tensor& tensor, int64_t dim);
+
+  // the broadcaster of the tensors read from state dicts on this thread,
+  // nullptr if each rank reads its own tensors.
+  static WeightsBroadcaster* current();
+
+  // start or stop (with nullptr) broadcasting on this thread.
+  static void set_current(WeightsBroadcaster* broadcaster);
+
+ private:
+  // broadcast the shape and dtype of the tensor from the src rank, returns
+  // a tensor with them on the meta device on all ranks.
+  torch::Tensor broadcast_meta(const torch::Tensor& tensor);
+
+  // broadcast the data of the tensor with the shape and dtype of meta
+  torch::Tensor broadcast_data(const torch::Tensor& meta,
+                               const torch::Tensor& tensor);
+
+  ProcessGroup* process_group_ = nullptr;
+
+  int src_ = 0;
+};
+
+}  // namespace llm
@@ -0,0 +1,163 @@
+#include "weights_snapshot.h"
+
+#include <folly/system/MemoryMapping.h>
+#include <glog/logging.h>
+#include <sys/mman.h>
+#include <torch/torch.h>
+
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+namespace llm {
+namespace {
+
+constexpr int64_t kAlignment = 4096;
+constexpr int kFormatVersion = 1;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+thread_local WeightsSnapshotWriter* current_writer = nullptr;
+
+std::string data_file_path(const std::string& dir, int rank) {
+  return (std::filesystem::path(dir) /
+          ("rank-" + std::to_string(rank) + ".bin"))
+      .string();
+}
+
+std::string manifest_file_path(const std::string& dir, int rank) {
+  return (std::filesystem::path(dir) /
+          ("rank-" + std::to_string(rank) + ".json"))
+      .string();
+}
+
+// returns the parsed manifest if it matches the world size, null otherwise
+nlohmann::json read_manifest(const std::string& dir, int rank, int world_size) {
+  std::ifstream ifs(manifest_file_path(dir, rank));
+  if (!ifs.is_open()) {
+    return nullptr;
+  }
+  auto manifest = nlohmann::json::parse(
+      ifs, /*cb=*/nullptr, /*allow_exceptions=*/false);
+  if (manifest.is_discarded() ||
+      manifest.value("format_version", 0) != kFormatVersion ||
+      manifest.value("world_size", 0) != world_size ||
+      manifest.value("rank", -1) != rank) {
+    return nullptr;
+  }
+  return manifest;
+}
+
+}  // namespace
+
+WeightsSnapshotWriter::WeightsSnapshotWriter(const std::string& dir,
+                                             int rank,
+                                             int world_size)
+    : dir_(dir), rank_(rank), world_size_(world_size) {
+  std::filesystem::create_directories(dir_);
+  // invalidate the stale snapshot before overwriting its data
+  std::filesystem::remove(manifest_file_path(dir_, rank_));
+  data_file_.open(data_file_path(dir_, rank_),
+                  std::ios::binary | std::ios::trunc);
+  CHECK(data_file_.is_open())
+      << "Failed to create " << data_file_path(dir_, rank_);
+}
+
+void WeightsSnapshotWriter::add(const std::string& name,
+                                const torch::Tensor& tensor) {
+  if (!names_.insert(name).second) {
+    return;
+  }
+  const auto t = tensor.to(torch::kCPU).contiguous();
+  // pad to the alignment
+  const int64_t aligned_offset =
+      (offset_ + kAlignment - 1) / kAlignment * kAlignment;
+  const std::vector<char> padding(aligned_offset - offset_, 0);
+  data_file_.write(padding.data(),
+                   static_cast<std::streamsize>(padding.size()));
+  data_file_.write(static_cast<const char*>(t.data_ptr()),
+                   static_cast<std::streamsize>(t.nbytes()));
+  CHECK(data_file_.good()) << "Failed to write " << name << " to snapshot";
+
+  tensors_.push_back({{"name", name},
+                      {"dtype", static_cast<int>(t.scalar_type())},
+                      {"shape", t.sizes().vec()},
+                      {"offset", aligned_offset}});
+  offset_ = aligned_offset + static_cast<int64_t>(t.nbytes());
+}
+
+void WeightsSnapshotWriter::finish() {
+  data_file_.close();
+  CHECK(!data_file_.fail())
+      << "Failed to write " << data_file_path(dir_, rank_);
+
+  const nlohmann::json manifest = {{"format_version", kFormatVersion},
+                                   {"rank", rank_},
+                                   {"world_size", world_size_},
+                                   {"tensors", tensors_}};
+  // write to a temporary file and rename to make it atomic
+  const auto manifest_path = manifest_file_path(dir_, rank_);
+  const auto tmp_path = manifest_path + ".tmp";
+  {
+    std::ofstream ofs(tmp_path);
+    ofs << manifest.dump();
+    CHECK(ofs.good()) << "Failed to write " << tmp_path;
+  }
+  std::filesystem::rename(tmp_path, manifest_path);
+  LOG(INFO) << "Saved weights snapshot of rank " << rank_ << " with "
+            << tensors_.size() << " tensors to " << dir_;
+}
+
+WeightsSnapshotWriter* WeightsSnapshotWriter::current() {
+  return current_writer;
+}
+
+void WeightsSnapshotWriter::set_current(WeightsSnapshotWriter* writer) {
+  current_writer = writer;
+}
+
+bool has_weights_snapshot(const std::string& dir, int rank, int world_size) {
+  return !read_manifest(dir, rank, world_size).is_null() &&
+         std::filesystem::exists(data_file_path(dir, rank));
+}
+
+std::unique_ptr<StateDict> load_weights_snapshot(const std::string& dir,
+                                                 int rank,
+                                                 int world_size) {
+  const auto manifest = read_manifest(dir, rank, world_size);
+  CHECK(!manifest.is_null()) << "No weights snapshot for rank " << rank
+                             << " of " << world_size << " in " << dir;
+
+  const auto data_path = data_file_path(dir, rank);
+  LOG(INFO) << "Loading weights snapshot from " << data_path;
+  folly::MemoryMapping::Options options;
+  options.setPrefault(false).setReadable(true);
+  auto mem_map = std::make_unique<folly::MemoryMapping>(
+      data_path.c_str(), 0, -1, options);
+  mem_map->advise(MADV_WILLNEED);
+  const folly::ByteRange content = mem_map->range();
+  const auto* data = content.data();
+
+  std::unordered_map<std::string, torch::Tensor> dict;
+  for (const auto& entry : manifest["tensors"]) {
+    const auto offset = entry["offset"].get<int64_t>();
+    const auto shape = entry["shape"].get<std::vector<int64_t>>();
+    const auto dtype =
+        static_cast<torch::ScalarType>(entry["dtype"].get<int>());
+    auto tensor = torch::from_blob(
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-type-const-cast)
+        const_cast<uint8_t*>(data + offset),
+        shape,
+        torch::dtype(dtype));
+    CHECK_LE(offset + static_cast<int64_t>(tensor.nbytes()),
+             static_cast<int64_t>(content.size()))
+        << "Corrupted weights snapshot " << data_path;
+    dict[entry["name"].get<std::string>()] = tensor;
+  }
+  return std::make_unique<StateDict>(
+      std::move(mem_map), std::move(dict), /*is_sharded=*/true);
+}
+
+}  // namespace llm
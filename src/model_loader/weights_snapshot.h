@@ -0,0 +1,61 @@
+#pragma once
+
+#include <torch/torch.h>
+
+#include <fstream>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <unordered_set>
+
+#include "state_dict.h"
+
+namespace llm {
+
+// A snapshot of the weights of one rank exactly as consumed by the model:
+// already sharded for the rank, merged and transformed, so loading it needs
+// neither the full tensors nor any transformation.
+// each rank has two files in the snapshot directory:
+//   rank-<rank>.bin: the tensors at 4K aligned offsets
+//   rank-<rank>.json: the manifest with name, dtype, shape and offset of each
+//                     tensor, written last to mark the snapshot complete.
+class WeightsSnapshotWriter final {
+ public:
+  WeightsSnapshotWriter(const std::string& dir, int rank, int world_size);
+
+  // append the tensor with the given name to the snapshot, duplicated names
+  // are ignored.
+  void add(const std::string& name, const torch::Tensor& tensor);
+
+  // write the manifest, the snapshot is only valid after this call.
+  void finish();
+
+  // the writer recording tensors read from state dicts on this thread,
+  // nullptr if not recording.
+  static WeightsSnapshotWriter* current();
+
+  // start or stop (with nullptr) recording on this thread.
+  static void set_current(WeightsSnapshotWriter* writer);
+
+ private:
+  std::string dir_;
+  int rank_ = 0;
+  int world_size_ = 0;
+
+  std::ofstream data_file_;
+  int64_t offset_ = 0;
+
+  nlohmann::json tensors_ = nlohmann::json::array();
+  std::unordered_set<std::string> names_;
+};
+
+// whether a complete snapshot exists for the rank and world size.
+bool has_weights_snapshot(const std::string& dir, int rank, int world_size);
+
+// load the snapshot of the rank as a pre-sharded state dict, mmaped without
+// any copy.
+std::unique_ptr<StateDict> load_weights_snapshot(const std::string& dir,
+                                                 int rank,
+                                                 int world_size);
+
+}  // namespace llm
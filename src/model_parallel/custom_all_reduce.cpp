@@ -0,0 +1,142 @@
+#include "custom_all_reduce.h"
+
+#include <c10/core/Device.h>
+#include <cuda_runtime.h>
+#include <glog/logging.h>
+#include <torch/cuda.h>
+#include <torch/torch.h>
+
+#include <memory>
+#include <vector>
+
+#include "kernels/all_reduce_kernels.h"
+
+namespace llm {
+namespace {
+
+// NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
+#define CUDACHECK(cmd)                                                 \
+  do {                                                                 \
+    cudaError_t err = cmd;                                             \
+    if (err != cudaSuccess) {                                          \
+      LOG(FATAL) << "Failed, Cuda error :" << cudaGetErrorString(err); \
+    }                                                                  \
+  } while (0)
+
+// one-shot reads the whole message from every peer, two-shot reads
+// 2 * (world_size - 1) / world_size of it but syncs once more. the two-shot
+// saves link bandwidth only for larger messages and more ranks.
+bool use_one_shot(int64_t bytes, int world_size) {
+  constexpr int64_t kKB = 1024;
+  return world_size == 2 || (world_size <= 4 && bytes < 512 * kKB) ||
+         bytes < 256 * kKB;
+}
+
+}  // namespace
+
+std::vector<std::unique_ptr<CustomAllReduce>> CustomAllReduce::create(
+    const std::vector<torch::Device>& devices,
+    int64_t max_bytes) {
+  const int world_size = static_cast<int>(devices.size());
+  if (world_size < 2 || world_size > kernel::kMaxAllReduceRanks) {
+    return {};
+  }
+  CHECK(max_bytes > 0 && max_bytes % 16 == 0)
+      << "max_bytes must be a positive multiple of 16";
+
+  // all pairs of devices need peer access
+  for (const auto& device : devices) {
+    for (const auto& peer : devices) {
+      if (device == peer) {
+        continue;
+      }
+      int can_access = 0;
+      CUDACHECK(
+          cudaDeviceCanAccessPeer(&can_access, device.index(), peer.index()));
+      if (can_access == 0) {
+        LOG(INFO) << "No peer access from " << device << " to " << peer
+                  << ", fall back to nccl all-reduce";
+        return {};
+      }
+    }
+  }
+  for (const auto& device : devices) {
+    torch::DeviceGuard device_guard(device);
+    for (const auto& peer : devices) {
+      if (device == peer) {
+        continue;
+      }
+      const cudaError_t err = cudaDeviceEnablePeerAccess(peer.index(), 0);
+      if (err == cudaErrorPeerAccessAlreadyEnabled) {
+        // clear the sticky error
+        (void)cudaGetLastError();
+      } else {
+        CUDACHECK(err);
+      }
+    }
+  }
+
+  // [input staging, reduced slices, signal] on each device
+  const int64_t n_bytes = 2 * max_bytes + sizeof(kernel::AllReduceSignal);
+  kernel::AllReduceBuffers buffers;
+  buffers.max_bytes = max_bytes;
+  buffers.world_size = world_size;
+  std::vector<torch::Tensor> storages;
+  storages.reserve(world_size);
+  for (int i = 0; i < world_size; ++i) {
+    auto storage = torch::zeros(
+        {n_bytes}, torch::dtype(torch::kUInt8).device(devices[i]));
+    auto* ptr = storage.data_ptr<uint8_t>();
+    buffers.buffers[i] = ptr;
+    buffers.signals[i] =
+        reinterpret_cast<kernel::AllReduceSignal*>(ptr + 2 * max_bytes);
+    storages.push_back(std::move(storage));
+  }
+  // the signals are zeroed before any peer spins on them
+  for (const auto& device : devices) {
+    torch::cuda::synchronize(device.index());
+  }
+
+  std::vector<std::unique_ptr<CustomAllReduce>> all_reduces;
+  all_reduces.reserve(world_size);
+  for (int i = 0; i < world_size; ++i) {
+    buffers.rank = i;
+    all_reduces.emplace_back(
+        std::make_unique<CustomAllReduce>(buffers, storages[i]));
+  }
+  return all_reduces;
+}
+
+CustomAllReduce::CustomAllReduce(const kernel::AllReduceBuffers& buffers,
+                                 torch::Tensor storage)
+    : buffers_(buffers), storage_(std::move(storage)) {}
+
+bool CustomAllReduce::can_all_reduce(const torch::Tensor& input) const {
+  const auto dtype = input.scalar_type();
+  if (dtype != torch::kHalf && dtype != torch::kBFloat16 &&
+      dtype != torch::kFloat) {
+    return false;
+  }
+  const int64_t bytes = input.nbytes();
+  return input.is_cuda() && input.is_contiguous() &&
+         bytes <= buffers_.max_bytes && bytes % 16 == 0;
+}
+
+void CustomAllReduce::all_reduce(torch::Tensor& input) {
+  if (use_one_shot(input.nbytes(), buffers_.world_size)) {
+    kernel::one_shot_all_reduce(input, buffers_);
+  } else {
+    kernel::two_shot_all_reduce(input, buffers_);
+  }
+}
+
+void CustomAllReduce::all_reduce_rms_norm_residual(torch::Tensor& out,
+                                                   torch::Tensor& residual,
+                                                   const torch::Tensor& input,
+                                                   const torch::Tensor& weight,
+                                                   float epsilon) {
+  kernel::all_reduce_rms_norm_residual(
+      out, residual, input, weight, epsilon, buffers_);
+}
+
+}  // namespace llm
@@ -0,0 +1,51 @@
+#pragma once
+#include <c10/core/Device.h>
+#include <torch/torch.h>
+
+#include <memory>
+#include <vector>
+
+#include "kernels/all_reduce_kernels.h"
+
+namespace llm {
+
+// all-reduce over staging buffers of peer gpus in the same process, for the
+// small activations of decode steps where the latency of nccl dominates.
+// each rank copies its input into its own staging buffer, and the ranks read
+// the buffers of each other directly over nvlink/pcie with peer access.
+// one-shot is used for small messages and two-shot for the larger ones, see
+// kernel::one_shot_all_reduce and kernel::two_shot_all_reduce.
+class CustomAllReduce final {
+ public:
+  // create one per device for the devices of a process group, indexed by
+  // rank. returns an empty vector if any pair of devices can't access each
+  // other, or the world size is not supported.
+  static std::vector<std::unique_ptr<CustomAllReduce>> create(
+      const std::vector<torch::Device>& devices,
+      int64_t max_bytes);
+
+  CustomAllReduce(const kernel::AllReduceBuffers& buffers,
+                  torch::Tensor storage);
+
+  // whether the input can be all-reduced by the custom kernels
+  bool can_all_reduce(const torch::Tensor& input) const;
+
+  // reduce the input in place across all ranks
+  void all_reduce(torch::Tensor& input);
+
+  // residual += all_reduce(input), out = rms_norm(residual) * weight
+  void all_reduce_rms_norm_residual(torch::Tensor& out,
+                                    torch::Tensor& residual,
+                                    const torch::Tensor& input,
+                                    const torch::Tensor& weight,
+                                    float epsilon);
+
+ private:
+  kernel::AllReduceBuffers buffers_;
+
+  // staging buffer and signal of this rank, the peers hold raw pointers to
+  // it, so it lives as long as the process group.
+  torch::Tensor storage_;
+};
+
+}  // namespace llm
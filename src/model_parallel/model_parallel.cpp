@@ -1,14 +1,105 @@
 #include "model_parallel/model_parallel.h"
 
+#include <ATen/cuda/CUDAEvent.h>
+#include <c10/cuda/CUDAGuard.h>
+#include <c10/cuda/CUDAStream.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include <algorithm>
+#include <functional>
 #include <torch/csrc/distributed/c10d/Types.hpp>
+#include <utility>
 #include <vector>
 
+#include "layers/layer_profiler.h"
 #include "models/model_args.h"
 
+DEFINE_int32(tp_overlap_min_tokens,
+             1024,
+             "min number of tokens to overlap the tensor parallel "
+             "communication with the gemms, 0 to disable.");
+
+DEFINE_int32(tp_overlap_num_chunks,
+             4,
+             "number of chunks to split the tokens into when overlapping the "
+             "tensor parallel communication with the gemms.");
+
+DEFINE_int32(sequence_parallel_min_tokens,
+             0,
+             "min number of tokens of the forward passes to run with "
+             "sequence parallelism: the row parallel linears reduce-scatter "
+             "their outputs along the tokens, the norms and residual adds run "
+             "on the tokens of each rank, which are all-gathered before the "
+             "next column parallel linears. 0 to disable.");
+
 namespace llm {
+namespace {
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+thread_local bool current_sequence_parallel = false;
+
+// whether the row parallel linears of the thread skip the reduce
+thread_local bool current_skip_row_parallel_reduce = false;
+
+// pad the tokens of the input with zeros to a multiple of world_size
+torch::Tensor pad_tokens(const torch::Tensor& input, int64_t world_size) {
+  const int64_t n_tokens = input.size(0);
+  const int64_t n_padded = (n_tokens + world_size - 1) / world_size;
+  if (n_padded * world_size == n_tokens) {
+    return input.contiguous();
+  }
+  auto sizes = input.sizes().vec();
+  sizes[0] = n_padded * world_size - n_tokens;
+  return torch::cat({input, torch::zeros(sizes, input.options())}, /*dim=*/0);
+}
+
+using MatmulFunc = std::function<torch::Tensor(const torch::Tensor&)>;
+using CommFunc = std::function<torch::Tensor(torch::Tensor)>;
+
+bool should_overlap(const torch::Tensor& input,
+                    const ParallelArgs& parallel_args) {
+  return parallel_args.world_size() > 1 && input.is_cuda() &&
+         FLAGS_tp_overlap_min_tokens > 0 && FLAGS_tp_overlap_num_chunks > 1 &&
+         input.size(0) >= FLAGS_tp_overlap_min_tokens;
+}
+
+// run matmul_func on chunks of input rows on the current stream, and
+// comm_func on each finished chunk on a high priority side stream. the
+// current stream waits for all the communication before returning.
+torch::Tensor overlap_matmul_comm(const torch::Tensor& input,
+                                  const MatmulFunc& matmul_func,
+                                  const CommFunc& comm_func) {
+  const auto device_index = input.device().index();
+  auto compute_stream = c10::cuda::getCurrentCUDAStream(device_index);
+  auto comm_stream =
+      c10::cuda::getStreamFromPool(/*isHighPriority=*/true, device_index);
+
+  const auto chunks = input.chunk(FLAGS_tp_overlap_num_chunks, /*dim=*/0);
+  std::vector<torch::Tensor> outputs;
+  outputs.reserve(chunks.size());
+  for (const auto& chunk : chunks) {
+    auto output = matmul_func(chunk);
+    // wait for the chunk to be computed before communicating it
+    at::cuda::CUDAEvent computed;
+    computed.record(compute_stream);
+    computed.block(comm_stream);
+    {
+      c10::cuda::CUDAStreamGuard stream_guard(comm_stream);
+      output = comm_func(output);
+    }
+    outputs.push_back(output);
+  }
+  // the outputs are only used on the compute stream after this point, so
+  // there is no need to record them on the comm stream.
+  at::cuda::CUDAEvent communicated;
+  communicated.record(comm_stream);
+  communicated.block(compute_stream);
+  return torch::cat(outputs, /*dim=*/0);
+}
+
+}  // namespace
 
 torch::Tensor gather_from_model_parallel_region(
     torch::Tensor input,
@@ -18,6 +109,7 @@ torch::Tensor gather_from_model_parallel_region(
     // bypass if only have one gpu
     return input;
   }
+  LAYER_PROFILE_SCOPE("communication");
 
   const auto rank = parallel_args.rank();
   auto* process_group = parallel_args.process_group();
@@ -38,6 +130,7 @@ torch::Tensor reduce_from_model_parallel_region(
     // bypass if only have one gpu
     return input;
   }
+  LAYER_PROFILE_SCOPE("communication");
   auto* process_group = parallel_args.process_group();
   process_group->allreduce(input);
   return input;
@@ -64,4 +157,168 @@ torch::Tensor scatter_to_model_parallel_region(
   return tensor_list[rank];
 }
 
+ParallelArgs attention_parallel_args(const ParallelArgs& parallel_args) {
+  if (parallel_args.dp_attention_size() == 1) {
+    return parallel_args;
+  }
+  ParallelArgs args = parallel_args;
+  args.rank(parallel_args.attention_rank())
+      .world_size(parallel_args.attention_world_size());
+  return args;
+}
+
+bool should_use_sequence_parallel(int64_t num_tokens,
+                                  const ParallelArgs& parallel_args) {
+  return parallel_args.world_size() > 1 &&
+         parallel_args.pp_world_size() == 1 &&
+         parallel_args.dp_attention_size() == 1 &&
+         FLAGS_sequence_parallel_min_tokens > 0 &&
+         num_tokens >= FLAGS_sequence_parallel_min_tokens;
+}
+
+bool sequence_parallel_enabled() { return current_sequence_parallel; }
+
+SequenceParallelGuard::SequenceParallelGuard(bool enable)
+    : prev_enabled_(current_sequence_parallel) {
+  current_sequence_parallel = enable;
+}
+
+SequenceParallelGuard::~SequenceParallelGuard() {
+  current_sequence_parallel = prev_enabled_;
+}
+
+torch::Tensor split_to_sequence_parallel_region(
+    torch::Tensor input,
+    const ParallelArgs& parallel_args) {
+  const auto world_size = parallel_args.world_size();
+  if (world_size == 1) {
+    return input;
+  }
+  return pad_tokens(input, world_size)
+      .chunk(world_size, /*dim=*/0)[parallel_args.rank()];
+}
+
+torch::Tensor reduce_scatter_to_sequence_parallel_region(
+    torch::Tensor input,
+    const ParallelArgs& parallel_args) {
+  const auto world_size = parallel_args.world_size();
+  if (world_size == 1) {
+    return input;
+  }
+  LAYER_PROFILE_SCOPE("communication");
+  input = pad_tokens(input, world_size);
+  auto sizes = input.sizes().vec();
+  sizes[0] /= world_size;
+  auto output = torch::empty(sizes, input.options());
+  parallel_args.process_group()->reduce_scatter(input, output);
+  return output;
+}
+
+torch::Tensor gather_from_sequence_parallel_region(
+    torch::Tensor input,
+    int64_t num_tokens,
+    const ParallelArgs& parallel_args) {
+  const auto world_size = parallel_args.world_size();
+  if (world_size == 1) {
+    return input;
+  }
+  LAYER_PROFILE_SCOPE("communication");
+  input = input.contiguous();
+  std::vector<torch::Tensor> tensors(world_size);
+  for (int64_t i = 0; i < world_size; ++i) {
+    tensors[i] = torch::empty_like(input);
+  }
+  parallel_args.process_group()->allgather(input, tensors);
+  return torch::cat(tensors, /*dim=*/0)
+      .slice(/*dim=*/0, /*start=*/0, /*end=*/num_tokens);
+}
+
+bool row_parallel_reduce_skipped() {
+  return current_skip_row_parallel_reduce;
+}
+
+SkipRowParallelReduceGuard::SkipRowParallelReduceGuard()
+    : prev_skipped_(current_skip_row_parallel_reduce) {
+  current_skip_row_parallel_reduce = true;
+}
+
+SkipRowParallelReduceGuard::~SkipRowParallelReduceGuard() {
+  current_skip_row_parallel_reduce = prev_skipped_;
+}
+
+torch::Tensor reduce_row_parallel_output(torch::Tensor output,
+                                         const ParallelArgs& parallel_args) {
+  if (row_parallel_reduce_skipped()) {
+    return output;
+  }
+  if (sequence_parallel_enabled()) {
+    return reduce_scatter_to_sequence_parallel_region(output, parallel_args);
+  }
+  return reduce_from_model_parallel_region(output, parallel_args);
+}
+
+torch::Tensor matmul_reduce_from_model_parallel_region(
+    const torch::Tensor& input,
+    const MatmulFunc& matmul_func,
+    const ParallelArgs& parallel_args) {
+  if (row_parallel_reduce_skipped() || sequence_parallel_enabled() ||
+      !should_overlap(input, parallel_args)) {
+    return reduce_row_parallel_output(matmul_func(input), parallel_args);
+  }
+  return overlap_matmul_comm(
+      input, matmul_func, [&parallel_args](torch::Tensor output) {
+        return reduce_from_model_parallel_region(output, parallel_args);
+      });
+}
+
+torch::Tensor matmul_gather_from_model_parallel_region(
+    const torch::Tensor& input,
+    const MatmulFunc& matmul_func,
+    const ParallelArgs& parallel_args) {
+  if (!should_overlap(input, parallel_args)) {
+    return gather_from_model_parallel_region(matmul_func(input),
+                                             parallel_args);
+  }
+  return overlap_matmul_comm(
+      input, matmul_func, [&parallel_args](torch::Tensor output) {
+        return gather_from_model_parallel_region(output, parallel_args);
+      });
+}
+
+std::pair<int32_t, int32_t> pipeline_stage_layers(
+    int32_t n_layers,
+    const ParallelArgs& parallel_args) {
+  const int32_t pp_world_size = parallel_args.pp_world_size();
+  const int32_t pp_rank = parallel_args.pp_rank();
+  CHECK_GE(n_layers, pp_world_size)
+      << "n_layers " << n_layers << " is less than pipeline stages "
+      << pp_world_size;
+
+  const int32_t n_stage_layers = n_layers / pp_world_size;
+  const int32_t remainder = n_layers % pp_world_size;
+  const int32_t start = pp_rank * n_stage_layers + std::min(pp_rank, remainder);
+  const int32_t end = start + n_stage_layers + (pp_rank < remainder ? 1 : 0);
+  return {start, end};
+}
+
+void send_to_next_stage(const torch::Tensor& hidden_states,
+                        const torch::Tensor& residual,
+                        const ParallelArgs& parallel_args) {
+  CHECK(!parallel_args.is_last_stage()) << "no next stage to send to";
+  auto* process_group = parallel_args.pp_process_group();
+  const int32_t dst = parallel_args.pp_rank() + 1;
+  process_group->send(hidden_states.contiguous(), dst);
+  process_group->send(residual.contiguous(), dst);
+}
+
+void recv_from_prev_stage(torch::Tensor& hidden_states,
+                          torch::Tensor& residual,
+                          const ParallelArgs& parallel_args) {
+  CHECK(!parallel_args.is_first_stage()) << "no previous stage to recv from";
+  auto* process_group = parallel_args.pp_process_group();
+  const int32_t src = parallel_args.pp_rank() - 1;
+  process_group->recv(hidden_states, src);
+  process_group->recv(residual, src);
+}
+
 }  // namespace llm
@@ -1,6 +1,10 @@
 #pragma once
 
 #include <torch/torch.h>
+
+#include <functional>
+#include <utility>
+
 #include "parallel_args.h"
 
 namespace llm {
@@ -17,4 +21,114 @@ torch::Tensor scatter_to_model_parallel_region(
     torch::Tensor input,
     const ParallelArgs& parallel_args);
 
+// the parallel args of the attention layers, whose heads are split among the
+// ranks of the data parallel attention group of the rank. the process group
+// of all ranks is kept to reduce the attention outputs across the groups.
+ParallelArgs attention_parallel_args(const ParallelArgs& parallel_args);
+
+// whether to run a forward pass of num_tokens with sequence parallelism, by
+// --sequence_parallel_min_tokens: the norms and residual adds between the
+// tensor parallel linears run on 1/world_size of the tokens on each rank.
+// not used with pipeline parallelism or data parallel attention.
+bool should_use_sequence_parallel(int64_t num_tokens,
+                                  const ParallelArgs& parallel_args);
+
+// whether the row parallel linears on this thread reduce-scatter their
+// outputs along the tokens instead of all-reducing them
+bool sequence_parallel_enabled();
+
+// enable the sequence parallelism of the row parallel linears on this thread
+// within the scope
+class SequenceParallelGuard final {
+ public:
+  explicit SequenceParallelGuard(bool enable);
+  ~SequenceParallelGuard();
+
+  SequenceParallelGuard(const SequenceParallelGuard&) = delete;
+  SequenceParallelGuard& operator=(const SequenceParallelGuard&) = delete;
+
+ private:
+  bool prev_enabled_ = false;
+};
+
+// the rows of the input for this rank, with the tokens padded with zeros to
+// a multiple of world_size: [n_tokens, ...] => [n_padded / world_size, ...]
+torch::Tensor split_to_sequence_parallel_region(
+    torch::Tensor input,
+    const ParallelArgs& parallel_args);
+
+// reduce the partial sums of the ranks and keep the rows of this rank, with
+// the same padding as above.
+torch::Tensor reduce_scatter_to_sequence_parallel_region(
+    torch::Tensor input,
+    const ParallelArgs& parallel_args);
+
+// all-gather the rows of the ranks along the tokens and drop the padding
+// beyond num_tokens: [n_padded / world_size, ...] => [num_tokens, ...]
+torch::Tensor gather_from_sequence_parallel_region(
+    torch::Tensor input,
+    int64_t num_tokens,
+    const ParallelArgs& parallel_args);
+
+// whether the row parallel linears on this thread return the partial sums
+// of the ranks without reducing them, e.g. for the attention of the data
+// parallel attention groups, which is reduced across all groups at once.
+bool row_parallel_reduce_skipped();
+
+// skip the reduce of the row parallel linears on this thread within the
+// scope
+class SkipRowParallelReduceGuard final {
+ public:
+  SkipRowParallelReduceGuard();
+  ~SkipRowParallelReduceGuard();
+
+  SkipRowParallelReduceGuard(const SkipRowParallelReduceGuard&) = delete;
+  SkipRowParallelReduceGuard& operator=(const SkipRowParallelReduceGuard&) =
+      delete;
+
+ private:
+  bool prev_skipped_ = false;
+};
+
+// reduce the partial outputs of a row parallel linear, all-reduced or
+// reduce-scattered along the tokens if sequence_parallel_enabled(), returned
+// as is if row_parallel_reduce_skipped().
+torch::Tensor reduce_row_parallel_output(torch::Tensor output,
+                                         const ParallelArgs& parallel_args);
+
+// computes matmul_func(input) followed by an all-reduce across the tensor
+// parallel ranks. for large inputs, the input is split into chunks along the
+// token dimension and each finished chunk is all-reduced on a separate stream
+// while the remaining chunks are computed, hiding most of the communication.
+// matmul_func must work on any number of rows of the input. the output is
+// reduce-scattered without overlapping if sequence_parallel_enabled().
+torch::Tensor matmul_reduce_from_model_parallel_region(
+    const torch::Tensor& input,
+    const std::function<torch::Tensor(const torch::Tensor&)>& matmul_func,
+    const ParallelArgs& parallel_args);
+
+// same as above but all-gathers the output along the last dimension.
+torch::Tensor matmul_gather_from_model_parallel_region(
+    const torch::Tensor& input,
+    const std::function<torch::Tensor(const torch::Tensor&)>& matmul_func,
+    const ParallelArgs& parallel_args);
+
+// returns the [start, end) range of layers run by the pipeline stage. the
+// layers are split evenly, with the leading stages taking one more layer if
+// not divisible.
+std::pair<int32_t, int32_t> pipeline_stage_layers(
+    int32_t n_layers,
+    const ParallelArgs& parallel_args);
+
+// send the hidden states and residual to the next pipeline stage
+void send_to_next_stage(const torch::Tensor& hidden_states,
+                        const torch::Tensor& residual,
+                        const ParallelArgs& parallel_args);
+
+// receive the hidden states and residual from the previous pipeline stage
+// into the given tensors, which should be allocated with the expected shape.
+void recv_from_prev_stage(torch::Tensor& hidden_states,
+                          torch::Tensor& residual,
+                          const ParallelArgs& parallel_args);
+
 }  // namespace llm
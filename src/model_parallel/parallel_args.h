@@ -19,12 +19,46 @@ struct ParallelArgs {
 
   // pointer to process group, nullptr if world size is 1
   DEFINE_PTR_ARG(ProcessGroup, process_group) = nullptr;
+
+  // pipeline stage of current process, the layers of the model are split
+  // across the stages, each stage is a tensor parallel group of world_size.
+  DEFINE_ARG(int32_t, pp_rank) = 0;
+
+  // number of pipeline stages
+  DEFINE_ARG(int32_t, pp_world_size) = 1;
+
+  // pointer to process group of the same rank across pipeline stages, used
+  // to pass activations between stages. nullptr if pp_world_size is 1
+  DEFINE_PTR_ARG(ProcessGroup, pp_process_group) = nullptr;
+
+  // number of data parallel attention groups. the ranks are split into
+  // groups of world_size / dp_attention_size consecutive ranks, each group
+  // runs the attention of its own sequences with the heads split among its
+  // ranks, e.g. when there are fewer kv heads than ranks. the other layers
+  // are tensor parallel across all ranks.
+  DEFINE_ARG(int32_t, dp_attention_size) = 1;
+
+  bool is_first_stage() const { return pp_rank_ == 0; }
+
+  // number of ranks of each data parallel attention group
+  int32_t attention_world_size() const {
+    return world_size_ / dp_attention_size_;
+  }
+
+  // the attention group of current process and its rank within the group
+  int32_t attention_group() const { return rank_ / attention_world_size(); }
+  int32_t attention_rank() const { return rank_ % attention_world_size(); }
+
+  bool is_last_stage() const { return pp_rank_ == pp_world_size_ - 1; }
 };
 
 inline std::ostream& operator<<(std::ostream& os, const ParallelArgs& args) {
   os << "ParallelArgs: [";
   os << "rank: " << args.rank();
   os << ", world_size: " << args.world_size();
+  os << ", pp_rank: " << args.pp_rank();
+  os << ", pp_world_size: " << args.pp_world_size();
+  os << ", dp_attention_size: " << args.dp_attention_size();
   os << "]";
   return os;
 }
@@ -4,12 +4,26 @@
 #include <c10/core/Device.h>
 #include <c10/cuda/CUDAStream.h>
 #include <cuda_runtime.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include <algorithm>
 #include <memory>
+#include <string>
 #include <vector>
 
+#include "custom_all_reduce.h"
+
+DEFINE_bool(disable_custom_all_reduce,
+            false,
+            "always use nccl for all-reduce instead of the custom kernels.");
+
+DEFINE_int64(custom_all_reduce_max_bytes,
+             8 * 1024 * 1024,
+             "max size in bytes of inputs all-reduced by the custom kernels, "
+             "larger inputs go to nccl.");
+
 namespace llm {
 namespace {
 
@@ -90,21 +104,61 @@ std::vector<std::unique_ptr<ProcessGroup>> ProcessGroup::create_process_groups(
   const int world_size = static_cast<int>(devices.size());
   NCCLCHECK(ncclCommInitAll(comms.data(), world_size, device_idxs.data()));
 
+  // empty if peer access is not available between all devices
+  std::vector<std::unique_ptr<CustomAllReduce>> custom_all_reduces;
+  if (!FLAGS_disable_custom_all_reduce) {
+    custom_all_reduces = CustomAllReduce::create(
+        devices, FLAGS_custom_all_reduce_max_bytes);
+  }
+
   std::vector<std::unique_ptr<ProcessGroup>> process_groups;
   process_groups.reserve(devices.size());
   for (int i = 0; i < world_size; ++i) {
     process_groups.emplace_back(std::make_unique<ProcessGroupNCCL>(
-        /*rank=*/i, world_size, devices[i], comms[i]));
+        /*rank=*/i,
+        world_size,
+        devices[i],
+        comms[i],
+        custom_all_reduces.empty() ? nullptr
+                                   : std::move(custom_all_reduces[i])));
   }
   return process_groups;
 }
 
+std::string ProcessGroup::create_unique_id() {
+  ncclUniqueId id;
+  NCCLCHECK(ncclGetUniqueId(&id));
+  return {id.internal, sizeof(id.internal)};
+}
+
+std::unique_ptr<ProcessGroup> ProcessGroup::create_process_group(
+    int rank,
+    int world_size,
+    const torch::Device& device,
+    const std::string& unique_id) {
+  CHECK(device.is_cuda()) << "device should be cuda device";
+  CHECK(rank >= 0 && rank < world_size) << "invalid rank: " << rank;
+  ncclUniqueId id;
+  CHECK_EQ(unique_id.size(), sizeof(id.internal)) << "invalid nccl unique id";
+  std::copy(unique_id.begin(), unique_id.end(), id.internal);
+
+  torch::DeviceGuard device_guard(device);
+  ncclComm_t comm = nullptr;
+  NCCLCHECK(ncclCommInitRank(&comm, world_size, id, rank));
+  // the peers may live in other processes, no custom all-reduce
+  return std::make_unique<ProcessGroupNCCL>(rank, world_size, device, comm);
+}
+
 // Constructor.
-ProcessGroupNCCL::ProcessGroupNCCL(int rank,
-                                   int world_size,
-                                   const torch::Device& device,
-                                   ncclComm_t comm)
-    : ProcessGroup(rank, world_size, device), comm_(comm) {}
+ProcessGroupNCCL::ProcessGroupNCCL(
+    int rank,
+    int world_size,
+    const torch::Device& device,
+    ncclComm_t comm,
+    std::unique_ptr<CustomAllReduce> custom_all_reduce)
+    : ProcessGroup(rank, world_size, device),
+      comm_(comm),
+      custom_all_reduce_(std::move(custom_all_reduce)) {}
 
 // Destructor.
 ProcessGroupNCCL::~ProcessGroupNCCL() { NCCLCHECK(ncclCommDestroy(comm_)); }
@@ -114,12 +168,18 @@ void ProcessGroupNCCL::allreduce(torch::Tensor& input) {
       << "input should be on the same device as the process group";
   check_input(input);
 
+  torch::DeviceGuard device_guard(device());
+  if (custom_all_reduce_ != nullptr &&
+      custom_all_reduce_->can_all_reduce(input)) {
+    custom_all_reduce_->all_reduce(input);
+    return;
+  }
+
   // inplace all reduce
   const auto count = input.numel();
   const auto data_type = to_nccl_data_type(input);
 
   auto stream = at::cuda::getCurrentCUDAStream();
-  torch::DeviceGuard device_guard(device());
   NCCLCHECK(ncclAllReduce(
       /*sendbuff=*/input.data_ptr(),
       /*recvbuff=*/input.data_ptr(),
@@ -130,6 +190,26 @@ void ProcessGroupNCCL::allreduce(torch::Tensor& input) {
       /*stream=*/stream));
 }
 
+bool ProcessGroupNCCL::allreduce_rms_norm_residual(
+    torch::Tensor& out,
+    torch::Tensor& residual,
+    const torch::Tensor& input,
+    const torch::Tensor& weight,
+    float epsilon) {
+  // one row per thread block, with whole 16 bytes packs per row
+  if (custom_all_reduce_ == nullptr || !residual.defined() ||
+      input.dim() != 2 || (input.size(1) * input.element_size()) % 16 != 0 ||
+      !custom_all_reduce_->can_all_reduce(input)) {
+    return false;
+  }
+  DCHECK(input.device() == device())
+      << "input should be on the same device as the process group";
+  torch::DeviceGuard device_guard(device());
+  custom_all_reduce_->all_reduce_rms_norm_residual(
+      out, residual, input, weight, epsilon);
+  return true;
+}
+
 void ProcessGroupNCCL::allgather(torch::Tensor input,
                                  std::vector<torch::Tensor>& outputs) {
   check_input(input);
@@ -159,4 +239,120 @@ void ProcessGroupNCCL::allgather(torch::Tensor input,
   }
 }
 
+void ProcessGroupNCCL::reduce_scatter(torch::Tensor input,
+                                      torch::Tensor& output) {
+  check_input(input);
+  check_input(output);
+  CHECK_EQ(input.numel(), output.numel() * world_size())
+      << "input should be world_size times the size of the output";
+  DCHECK(input.device() == device())
+      << "input should be on the same device as the process group";
+
+  torch::DeviceGuard device_guard(device());
+  auto stream = at::cuda::getCurrentCUDAStream();
+  NCCLCHECK(ncclReduceScatter(
+      /*sendbuff=*/input.data_ptr(),
+      /*recvbuff=*/output.data_ptr(),
+      /*recvcount=*/output.numel(),
+      /*datatype=*/to_nccl_data_type(input),
+      /*op=*/ncclSum,
+      /*comm=*/comm_,
+      /*stream=*/stream));
+}
+
+void ProcessGroupNCCL::send(const torch::Tensor& input, int dst) {
+  check_input(input);
+  CHECK(dst >= 0 && dst < world_size() && dst != rank())
+      << "invalid dst rank: " << dst;
+  DCHECK(input.device() == device())
+      << "input should be on the same device as the process group";
+
+  torch::DeviceGuard device_guard(device());
+  auto stream = at::cuda::getCurrentCUDAStream();
+  NCCLCHECK(ncclSend(
+      /*sendbuff=*/input.data_ptr(),
+      /*count=*/input.numel(),
+      /*datatype=*/to_nccl_data_type(input),
+      /*peer=*/dst,
+      /*comm=*/comm_,
+      /*stream=*/stream));
+}
+
+void ProcessGroupNCCL::recv(torch::Tensor& output, int src) {
+  check_input(output);
+  CHECK(src >= 0 && src < world_size() && src != rank())
+      << "invalid src rank: " << src;
+  DCHECK(output.device() == device())
+      << "output should be on the same device as the process group";
+
+  torch::DeviceGuard device_guard(device());
+  auto stream = at::cuda::getCurrentCUDAStream();
+  NCCLCHECK(ncclRecv(
+      /*recvbuff=*/output.data_ptr(),
+      /*count=*/output.numel(),
+      /*datatype=*/to_nccl_data_type(output),
+      /*peer=*/src,
+      /*comm=*/comm_,
+      /*stream=*/stream));
+}
+
+void ProcessGroupNCCL::broadcast(torch::Tensor& tensor, int src) {
+  check_input(tensor);
+  CHECK(src >= 0 && src < world_size()) << "invalid src rank: " << src;
+  DCHECK(tensor.device() == device())
+      << "tensor should be on the same device as the process group";
+
+  torch::DeviceGuard device_guard(device());
+  auto stream = at::cuda::getCurrentCUDAStream();
+  NCCLCHECK(ncclBroadcast(
+      /*sendbuff=*/tensor.data_ptr(),
+      /*recvbuff=*/tensor.data_ptr(),
+      /*count=*/tensor.numel(),
+      /*datatype=*/to_nccl_data_type(tensor),
+      /*root=*/src,
+      /*comm=*/comm_,
+      /*stream=*/stream));
+}
+
+void ProcessGroupNCCL::scatter(const std::vector<torch::Tensor>& inputs,
+                               torch::Tensor& output,
+                               int src) {
+  check_input(output);
+  CHECK(src >= 0 && src < world_size()) << "invalid src rank: " << src;
+  DCHECK(output.device() == device())
+      << "output should be on the same device as the process group";
+
+  torch::DeviceGuard device_guard(device());
+  auto stream = at::cuda::getCurrentCUDAStream();
+  if (rank() != src) {
+    NCCLCHECK(ncclRecv(
+        /*recvbuff=*/output.data_ptr(),
+        /*count=*/output.numel(),
+        /*datatype=*/to_nccl_data_type(output),
+        /*peer=*/src,
+        /*comm=*/comm_,
+        /*stream=*/stream));
+    return;
+  }
+
+  CHECK_EQ(inputs.size(), world_size())
+      << "inputs should have the same size as world_size";
+  NCCLCHECK(ncclGroupStart());
+  for (int dst = 0; dst < world_size(); ++dst) {
+    if (dst == src) {
+      continue;
+    }
+    check_input(inputs[dst]);
+    NCCLCHECK(ncclSend(
+        /*sendbuff=*/inputs[dst].data_ptr(),
+        /*count=*/inputs[dst].numel(),
+        /*datatype=*/to_nccl_data_type(inputs[dst]),
+        /*peer=*/dst,
+        /*comm=*/comm_,
+        /*stream=*/stream));
+  }
+  NCCLCHECK(ncclGroupEnd());
+  output.copy_(inputs[src], /*non_blocking=*/true);
+}
+
 }  // namespace llm
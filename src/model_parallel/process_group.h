@@ -1,11 +1,15 @@
 #pragma once
 #include <c10/core/Device.h>
+#include <glog/logging.h>
 #include <nccl.h>
 #include <torch/torch.h>
 
 #include <memory>
+#include <string>
 #include <vector>
 
+#include "custom_all_reduce.h"
+
 namespace llm {
 // A interface for process group.
 class ProcessGroup {
@@ -26,15 +30,92 @@ class ProcessGroup {
   // blocking operation.
   virtual void allreduce(torch::Tensor& input) = 0;
 
+  // allreduce the input, add it into the residual and apply rms norm on the
+  // sum in one fused kernel:
+  //   residual += allreduce(input), out = rms_norm(residual) * weight
+  // returns false without doing anything if not supported.
+  virtual bool allreduce_rms_norm_residual(torch::Tensor& /*out*/,
+                                           torch::Tensor& /*residual*/,
+                                           const torch::Tensor& /*input*/,
+                                           const torch::Tensor& /*weight*/,
+                                           float /*epsilon*/) {
+    return false;
+  }
+
   // allgather: gather tensors from all processes and concatenate them.
   virtual void allgather(torch::Tensor input,
                          std::vector<torch::Tensor>& outputs) = 0;
 
+  // reduce_scatter: reduce the input across all processes and split the sum
+  // evenly along the first dimension, the process of rank i gets the i-th
+  // chunk in the output. blocking operation.
+  virtual void reduce_scatter(torch::Tensor input, torch::Tensor& output) {
+    allreduce(input);
+    output.copy_(input.chunk(world_size(), /*dim=*/0)[rank()]);
+  }
+
+  // send: send the input tensor to the process of rank dst, paired with a
+  // recv on the dst process. blocking operation.
+  virtual void send(const torch::Tensor& input, int dst) = 0;
+
+  // recv: receive a tensor from the process of rank src into the output,
+  // which should have the same shape and dtype as the sent tensor.
+  virtual void recv(torch::Tensor& output, int src) = 0;
+
+  // broadcast: send the tensor of rank src to all processes, received in
+  // place into the tensor of the other ranks, which should have the same
+  // shape and dtype. blocking operation.
+  virtual void broadcast(torch::Tensor& tensor, int src) {
+    if (rank() != src) {
+      recv(tensor, src);
+      return;
+    }
+    for (int dst = 0; dst < world_size(); ++dst) {
+      if (dst != src) {
+        send(tensor, dst);
+      }
+    }
+  }
+
+  // scatter: send the inputs[i] of rank src to the process of rank i, which
+  // receives it into the output. the inputs are only used on rank src.
+  // blocking operation.
+  virtual void scatter(const std::vector<torch::Tensor>& inputs,
+                       torch::Tensor& output,
+                       int src) {
+    if (rank() != src) {
+      recv(output, src);
+      return;
+    }
+    CHECK_EQ(inputs.size(), world_size())
+        << "inputs should have the same size as world_size";
+    for (int dst = 0; dst < world_size(); ++dst) {
+      if (dst == src) {
+        output.copy_(inputs[dst]);
+      } else {
+        send(inputs[dst], dst);
+      }
+    }
+  }
+
   // Create a process group where each process has a single GPU
   // devices: list of devices to create process groups on.
   static std::vector<std::unique_ptr<ProcessGroup>> create_process_groups(
       const std::vector<torch::Device>& devices);
 
+  // Generate a unique id to create the process group of ranks in different
+  // processes, shared by the ranks out of band.
+  static std::string create_unique_id();
+
+  // Create the process group of a rank in this process. blocking call until
+  // all ranks join with the same unique id, so ranks in the same process
+  // should be created from different threads.
+  static std::unique_ptr<ProcessGroup> create_process_group(
+      int rank,
+      int world_size,
+      const torch::Device& device,
+      const std::string& unique_id);
+
  private:
   // rank of current process.
   int rank_ = 0;
@@ -56,21 +137,46 @@ class ProcessGroup {
 class ProcessGroupNCCL : public ProcessGroup {
  public:
   // Constructor.
-  ProcessGroupNCCL(int rank,
-                   int world_size,
-                   const torch::Device& device,
-                   ncclComm_t comm);
+  // custom_all_reduce is optional, used instead of nccl for small inputs.
+  ProcessGroupNCCL(
+      int rank,
+      int world_size,
+      const torch::Device& device,
+      ncclComm_t comm,
+      std::unique_ptr<CustomAllReduce> custom_all_reduce = nullptr);
 
   // Destructor.
   ~ProcessGroupNCCL() override;
 
   void allreduce(torch::Tensor& input) override;
 
+  bool allreduce_rms_norm_residual(torch::Tensor& out,
+                                   torch::Tensor& residual,
+                                   const torch::Tensor& input,
+                                   const torch::Tensor& weight,
+                                   float epsilon) override;
+
   void allgather(torch::Tensor input,
                  std::vector<torch::Tensor>& outputs) override;
 
+  void reduce_scatter(torch::Tensor input, torch::Tensor& output) override;
+
+  void send(const torch::Tensor& input, int dst) override;
+
+  void recv(torch::Tensor& output, int src) override;
+
+  void broadcast(torch::Tensor& tensor, int src) override;
+
+  // the sends to all ranks are grouped to run concurrently
+  void scatter(const std::vector<torch::Tensor>& inputs,
+               torch::Tensor& output,
+               int src) override;
+
  private:
   // nccl communicator.
   ncclComm_t comm_ = nullptr;
+
+  // all-reduce over peer buffers for small inputs, nullptr if not available
+  std::unique_ptr<CustomAllReduce> custom_all_reduce_;
 };
 }  // namespace llm
@@ -5,6 +5,8 @@
 #include <gtest/gtest.h>
 #include <torch/cuda.h>
 
+#include "custom_all_reduce.h"
+
 namespace llm {
 
 void run_collective_test(
@@ -103,4 +105,222 @@ TEST(ProcessGroupTest, NCCLAllGather) {
   }
 }
 
-}  // namespace llm
\ No newline at end of file
+TEST(ProcessGroupTest, NCCLReduceScatter) {
+  // skip test if less than two gpus
+  if (torch::cuda::device_count() < 2) {
+    GTEST_SKIP() << "Skipping test because less than two gpus";
+  }
+
+  for (int i = 2; i <= torch::cuda::device_count(); i *= 2) {
+    run_collective_test(
+        i, [](const std::vector<torch::Tensor>& tensors, ProcessGroup* pg) {
+          const int rank = pg->rank();
+          const int world_size = pg->world_size();
+          const auto& device = pg->device();
+          torch::DeviceGuard device_guard(device);
+          at::cuda::CUDAStream stream = at::cuda::getCurrentCUDAStream();
+          for (int i = 0; i <= tensors.size() - world_size; ++i) {
+            // distinct rows to check the chunk of each rank, 96 rows are
+            // divisible by up to 8 ranks
+            const auto rows =
+                torch::arange(96, torch::kHalf).unsqueeze(/*dim=*/1);
+            auto input = (tensors[i + rank].slice(0, 0, 96) * rows).to(device);
+            auto output =
+                torch::empty({96 / world_size, 4096}, input.options());
+            pg->reduce_scatter(input, output);
+            stream.synchronize();
+            auto expected = torch::zeros_like(rows);
+            for (int j = 0; j < world_size; ++j) {
+              expected = expected + tensors[i + j].slice(0, 0, 96) * rows;
+            }
+            const auto chunk = expected.chunk(world_size, /*dim=*/0)[rank];
+            EXPECT_TRUE(torch::equal(output.cpu(), chunk));
+          }
+        });
+  }
+}
+
+TEST(ProcessGroupTest, NCCLSendRecv) {
+  // skip test if less than two gpus
+  if (torch::cuda::device_count() < 2) {
+    GTEST_SKIP() << "Skipping test because less than two gpus";
+  }
+
+  for (int i = 2; i <= torch::cuda::device_count(); i *= 2) {
+    run_collective_test(
+        i, [](const std::vector<torch::Tensor>& tensors, ProcessGroup* pg) {
+          const int rank = pg->rank();
+          const int world_size = pg->world_size();
+          const auto& device = pg->device();
+          torch::DeviceGuard device_guard(device);
+          at::cuda::CUDAStream stream = at::cuda::getCurrentCUDAStream();
+          // pass the tensors along the ranks like pipeline stages
+          for (int i = 0; i < tensors.size(); ++i) {
+            auto tensor = tensors[i].to(device);
+            if (rank > 0) {
+              tensor.zero_();
+              pg->recv(tensor, rank - 1);
+              tensor.add_(1);
+            }
+            if (rank + 1 < world_size) {
+              pg->send(tensor, rank + 1);
+            }
+            stream.synchronize();
+            EXPECT_TRUE(torch::equal(tensor.cpu(), tensors[i] + rank));
+          }
+        });
+  }
+}
+
+TEST(ProcessGroupTest, NCCLBroadcastScatter) {
+  // skip test if less than two gpus
+  if (torch::cuda::device_count() < 2) {
+    GTEST_SKIP() << "Skipping test because less than two gpus";
+  }
+
+  for (int i = 2; i <= torch::cuda::device_count(); i *= 2) {
+    run_collective_test(
+        i, [](const std::vector<torch::Tensor>& tensors, ProcessGroup* pg) {
+          const int rank = pg->rank();
+          const int world_size = pg->world_size();
+          const auto& device = pg->device();
+          torch::DeviceGuard device_guard(device);
+          at::cuda::CUDAStream stream = at::cuda::getCurrentCUDAStream();
+          for (int i = 0; i < tensors.size(); ++i) {
+            const int src = i % world_size;
+            auto expected = tensors[i] * (src + 1);
+            // broadcast from the src rank
+            auto tensor = rank == src ? expected.to(device)
+                                      : torch::zeros_like(expected, device);
+            pg->broadcast(tensor, src);
+
+            // scatter the chunks of the src rank
+            const auto chunks = expected.chunk(world_size, /*dim=*/0);
+            std::vector<torch::Tensor> inputs;
+            if (rank == src) {
+              for (const auto& chunk : chunks) {
+                inputs.push_back(chunk.to(device));
+              }
+            }
+            auto output = torch::zeros_like(chunks[rank], device);
+            pg->scatter(inputs, output, src);
+            stream.synchronize();
+            EXPECT_TRUE(torch::equal(tensor.cpu(), expected));
+            EXPECT_TRUE(torch::equal(output.cpu(), chunks[rank]));
+          }
+        });
+  }
+}
+
+// run func on each rank of custom all-reduces in its own thread
+void run_custom_all_reduce_test(
+    int world_size,
+    std::function<void(int rank, CustomAllReduce* all_reduce)> func) {
+  std::vector<torch::Device> devices;
+  devices.reserve(world_size);
+  for (int i = 0; i < world_size; ++i) {
+    devices.emplace_back(torch::kCUDA, i);
+  }
+  auto all_reduces = CustomAllReduce::create(devices, 8 * 1024 * 1024);
+  if (all_reduces.empty()) {
+    GTEST_SKIP() << "Skipping test because peer access is not available";
+  }
+
+  std::vector<std::thread> threads;
+  threads.reserve(world_size);
+  for (int i = 0; i < world_size; ++i) {
+    threads.emplace_back(
+        [func, i, &devices, all_reduce = all_reduces[i].get()]() {
+          torch::DeviceGuard device_guard(devices[i]);
+          func(i, all_reduce);
+        });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+TEST(ProcessGroupTest, CustomAllReduce) {
+  // skip test if less than two gpus
+  if (torch::cuda::device_count() < 2) {
+    GTEST_SKIP() << "Skipping test because less than two gpus";
+  }
+
+  for (int world_size = 2; world_size <= torch::cuda::device_count();
+       world_size *= 2) {
+    run_custom_all_reduce_test(
+        world_size, [world_size](int rank, CustomAllReduce* all_reduce) {
+          at::cuda::CUDAStream stream = at::cuda::getCurrentCUDAStream();
+          // one-shot and two-shot sizes, including a size not divisible by
+          // the world size
+          for (const int64_t n_tokens : {1, 7, 64, 333, 1024}) {
+            for (const auto dtype : {torch::kHalf, torch::kBFloat16}) {
+              const auto options = torch::dtype(dtype);
+              // small integers are summed up exactly, the inputs are
+              // generated without the global rng shared by the threads
+              std::vector<torch::Tensor> inputs;
+              for (int r = 0; r < world_size; ++r) {
+                const auto idx = torch::arange(n_tokens * 4096, torch::kLong);
+                inputs.push_back(((idx * (r + 3)) % 16 - 8)
+                                     .reshape({n_tokens, 4096})
+                                     .to(options));
+              }
+              auto expected = torch::zeros_like(inputs[0]);
+              for (const auto& input : inputs) {
+                expected += input;
+              }
+
+              auto tensor = inputs[rank].to(torch::kCUDA);
+              ASSERT_TRUE(all_reduce->can_all_reduce(tensor));
+              all_reduce->all_reduce(tensor);
+              stream.synchronize();
+              EXPECT_TRUE(torch::equal(tensor.cpu(), expected));
+            }
+          }
+        });
+  }
+}
+
+TEST(ProcessGroupTest, CustomAllReduceRMSNormResidual) {
+  // skip test if less than two gpus
+  if (torch::cuda::device_count() < 2) {
+    GTEST_SKIP() << "Skipping test because less than two gpus";
+  }
+
+  const int world_size = 2;
+  const int64_t n_tokens = 100;
+  const int64_t dim = 4096;
+  const float eps = 1e-5;
+  const auto options = torch::dtype(torch::kHalf);
+  // same inputs on all ranks, the sum is 2 * input
+  const auto input = torch::randn({n_tokens, dim}, options);
+  const auto residual = torch::randn({n_tokens, dim}, options);
+  const auto weight = torch::randn({dim}, options);
+
+  run_custom_all_reduce_test(
+      world_size, [&](int /*rank*/, CustomAllReduce* all_reduce) {
+        at::cuda::CUDAStream stream = at::cuda::getCurrentCUDAStream();
+        auto x = input.to(torch::kCUDA);
+        auto r = residual.to(torch::kCUDA);
+        auto out = torch::empty_like(x);
+        all_reduce->all_reduce_rms_norm_residual(
+            out, r, x, weight.to(torch::kCUDA), eps);
+        stream.synchronize();
+
+        const auto sum =
+            residual.to(torch::kFloat) + 2 * input.to(torch::kFloat);
+        const auto norm =
+            sum * torch::rsqrt(sum.pow(2).mean(/*dim=*/-1, true) + eps);
+        const auto expected = norm.to(torch::kHalf) * weight;
+        EXPECT_TRUE(torch::allclose(r.cpu(),
+                                    sum.to(torch::kHalf),
+                                    /*rtol=*/1e-2,
+                                    /*atol=*/1e-2));
+        EXPECT_TRUE(torch::allclose(out.cpu(),
+                                    expected,
+                                    /*rtol=*/1e-2,
+                                    /*atol=*/1e-2));
+      });
+}
+
+}  // namespace llm
@@ -3,11 +3,13 @@
 #include <torch/torch.h>
 
 #include "chat_template/coded_chat_template.h"
-#include "layers/activation.h"
 #include "layers/attention/attention.h"
 #include "layers/attention/handler.h"
+#include "layers/chunked_forward.h"
 #include "layers/embedding.h"
-#include "layers/fused_linear.h"
+#include "layers/gated_linear.h"
+#include "layers/layer_profiler.h"
+#include "layers/layer_streamer.h"
 #include "layers/linear.h"
 #include "layers/normalization.h"
 #include "memory/kv_cache.h"
@@ -24,23 +26,19 @@ class AquilaMLPImpl : public torch::nn::Module {
                 const QuantArgs& quant_args,
                 const ParallelArgs& parallel_args,
                 const torch::TensorOptions& options) {
-    act_func_ = Activation::get_act_func("silu", options.device());
-    CHECK(act_func_ != nullptr);
-
     const int64_t hidden_size = args.hidden_size();
     const int64_t intermediate_size = args.intermediate_size();
 
     // register the weight parameter
     gate_up_proj_ = register_module(
         "gate_up_proj",
-        FusedColumnParallelLinear(
-            hidden_size,
-            std::vector<int64_t>{intermediate_size, intermediate_size},
-            /*bias=*/false,
-            /*gather_output=*/false,
-            quant_args,
-            parallel_args,
-            options));
+        FusedGateUpLinear(hidden_size,
+                          intermediate_size,
+                          /*bias=*/false,
+                          "silu",
+                          quant_args,
+                          parallel_args,
+                          options));
     down_proj_ =
         register_module("down_proj",
                         RowParallelLinear(intermediate_size,
@@ -53,8 +51,11 @@ class AquilaMLPImpl : public torch::nn::Module {
   }
 
   torch::Tensor forward(torch::Tensor x) {
-    const auto gate_up = gate_up_proj_(x);
-    return down_proj_(act_func_(gate_up[0]) * gate_up[1]);
+    // large batches run in chunks to bound the intermediate activations
+    return chunked_forward(
+        x, FLAGS_mlp_chunk_tokens, [this](const torch::Tensor& chunk) {
+          return down_proj_(gate_up_proj_(chunk));
+        });
   }
 
   // load the weight from the checkpoint
@@ -71,11 +72,8 @@ class AquilaMLPImpl : public torch::nn::Module {
 
  private:
   // parameter members, must be registered
-  FusedColumnParallelLinear gate_up_proj_{nullptr};
+  FusedGateUpLinear gate_up_proj_{nullptr};
   RowParallelLinear down_proj_{nullptr};
-
-  // activation function
-  ActFunc act_func_{nullptr};
 };
 TORCH_MODULE(AquilaMLP);
 
@@ -181,19 +179,25 @@ class AquilaDecoderLayerImpl : public torch::nn::Module {
                            AquilaMLP(args, quant_args, parallel_args, options));
     input_layernorm_ = register_module(
         "input_layernorm",
-        RMSNorm(args.hidden_size(), args.rms_norm_eps(), options));
+        RMSNormResidual(args.hidden_size(), args.rms_norm_eps(), options));
     post_attention_layernorm_ = register_module(
         "post_attention_layernorm",
-        RMSNorm(args.hidden_size(), args.rms_norm_eps(), options));
+        RMSNormResidual(args.hidden_size(), args.rms_norm_eps(), options));
   }
 
   torch::Tensor forward(torch::Tensor x,
                         torch::Tensor positions,
+                        torch::Tensor& residual,
                         KVCache& kv_cache,
                         const InputParameters& input_params) {
-    auto h =
-        x + self_attn_(input_layernorm_(x), positions, kv_cache, input_params);
-    return h + mlp_(post_attention_layernorm_(h));
+    // the residual adds are fused into the norms
+    auto hidden_states = input_layernorm_(x, residual);
+
+    hidden_states =
+        self_attn_(hidden_states, positions, kv_cache, input_params);
+    hidden_states = post_attention_layernorm_(hidden_states, residual);
+    hidden_states = mlp_(hidden_states);
+    return hidden_states;
   }
 
   // load the weight from the checkpoint
@@ -220,9 +224,9 @@ class AquilaDecoderLayerImpl : public torch::nn::Module {
 
   AquilaMLP mlp_{nullptr};
 
-  RMSNorm input_layernorm_{nullptr};
+  RMSNormResidual input_layernorm_{nullptr};
 
-  RMSNorm post_attention_layernorm_{nullptr};
+  RMSNormResidual post_attention_layernorm_{nullptr};
 };
 TORCH_MODULE(AquilaDecoderLayer);
 
@@ -241,6 +245,8 @@ class AquilaModelImpl : public torch::nn::Module {
     handler_ = AttentionHandler::create_handler_with_rope(
         args, /*interleaved=*/false, options);
 
+    streamer_ =
+        std::make_unique<LayerStreamer>(args.n_layers(), options.device());
     blocks_ = register_module("layers", torch::nn::ModuleList());
     layers_.reserve(args.n_layers());
     for (int32_t i = 0; i < args.n_layers(); i++) {
@@ -248,9 +254,11 @@ class AquilaModelImpl : public torch::nn::Module {
           args, quant_args, parallel_args, options, handler_.get());
       layers_.push_back(block);
       blocks_->push_back(block);
+      streamer_->add_layer(i, block.ptr());
     }
     norm_ = register_module(
-        "norm", RMSNorm(args.hidden_size(), args.rms_norm_eps(), options));
+        "norm",
+        RMSNormResidual(args.hidden_size(), args.rms_norm_eps(), options));
   }
 
   // tokens: [num_tokens]
@@ -260,12 +268,15 @@ class AquilaModelImpl : public torch::nn::Module {
                         std::vector<KVCache>& kv_caches,
                         const InputParameters& input_params) {
     auto h = embed_tokens_(tokens);
+    torch::Tensor residual;
     // TODO: set working space for attention handler
     for (size_t i = 0; i < layers_.size(); i++) {
+      streamer_->fetch(i);
+      DECODER_LAYER_SCOPE();
       auto& layer = layers_[i];
-      h = layer(h, positions, kv_caches[i], input_params);
+      h = layer(h, positions, residual, kv_caches[i], input_params);
     }
-    return norm_(h);
+    return norm_(h, residual);
   }
 
   // load the weight from the checkpoint
@@ -299,7 +310,10 @@ class AquilaModelImpl : public torch::nn::Module {
   // hold same data but different type as blocks_ to avoid type cast
   std::vector<AquilaDecoderLayer> layers_;
 
-  RMSNorm norm_{nullptr};
+  // streams the weights of the offloaded layers onto the device
+  std::unique_ptr<LayerStreamer> streamer_;
+
+  RMSNormResidual norm_{nullptr};
 };
 TORCH_MODULE(AquilaModel);
 
@@ -314,12 +328,10 @@ class AquilaForCausalLMImpl : public torch::nn::Module {
         "model", AquilaModel(args, quant_args, parallel_args, options));
 
     lm_head_ = register_module("lm_head",
-                               ColumnParallelLinear(args.hidden_size(),
-                                                    args.vocab_size(),
-                                                    /*bias=*/false,
-                                                    /*gather_output=*/true,
-                                                    parallel_args,
-                                                    options));
+                               create_lm_head(args.hidden_size(),
+                                              args.vocab_size(),
+                                              parallel_args,
+                                              options));
   }
 
   // tokens: [num_tokens]
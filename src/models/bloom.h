@@ -7,6 +7,8 @@
 #include "layers/attention/attention.h"
 #include "layers/attention/handler.h"
 #include "layers/embedding.h"
+#include "layers/layer_profiler.h"
+#include "layers/layer_streamer.h"
 #include "layers/linear.h"
 #include "layers/normalization.h"
 #include "memory/kv_cache.h"
@@ -265,6 +267,8 @@ class BloomModelImpl : public torch::nn::Module {
     handler_ = AttentionHandler::create_handler_with_alibi(
         args, alibi_slopes, options);
 
+    streamer_ =
+        std::make_unique<LayerStreamer>(args.n_layers(), options.device());
     blocks_ = register_module("h", torch::nn::ModuleList());
     layers_.reserve(args.n_layers());
     for (int32_t i = 0; i < args.n_layers(); i++) {
@@ -272,6 +276,7 @@ class BloomModelImpl : public torch::nn::Module {
           BloomBlock(args, quant_args, parallel_args, options, handler_.get());
       layers_.push_back(block);
       blocks_->push_back(block);
+      streamer_->add_layer(i, block.ptr());
     }
     ln_f_ = register_module("ln_f",
                             LayerNorm(args.hidden_size(),
@@ -289,6 +294,8 @@ class BloomModelImpl : public torch::nn::Module {
 
     // TODO: set working space for attention handler
     for (size_t i = 0; i < layers_.size(); i++) {
+      streamer_->fetch(i);
+      DECODER_LAYER_SCOPE();
       auto& layer = layers_[i];
       h = layer(h, kv_caches[i], input_params);
     }
@@ -363,6 +370,9 @@ class BloomModelImpl : public torch::nn::Module {
   // hold same data but different type as blocks_ to avoid type cast
   std::vector<BloomBlock> layers_;
 
+  // streams the weights of the offloaded layers onto the device
+  std::unique_ptr<LayerStreamer> streamer_;
+
   // final layer norm
   LayerNorm ln_f_{nullptr};
 };
@@ -379,12 +389,10 @@ class BloomForCausalLMImpl : public torch::nn::Module {
         "transformer", BloomModel(args, quant_args, parallel_args, options));
 
     lm_head_ = register_module("lm_head",
-                               ColumnParallelLinear(args.hidden_size(),
-                                                    args.vocab_size(),
-                                                    /*bias=*/false,
-                                                    /*gather_output=*/true,
-                                                    parallel_args,
-                                                    options));
+                               create_lm_head(args.hidden_size(),
+                                              args.vocab_size(),
+                                              parallel_args,
+                                              options));
   }
 
   // tokens: [num_tokens]
@@ -3,16 +3,36 @@
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include <string>
+#include <unordered_set>
+
 #include "model_args.h"
 #include "models/model_registry.h"
 
 namespace llm {
+namespace {
+
+// models that only run the layers of their pipeline stage
+const std::unordered_set<std::string> kPipelineParallelModels = {
+    "llama",
+    "llama3",
+    "Yi",
+};
+
+}  // namespace
 
 std::unique_ptr<CausalLM> CausalLM::create(
     const ModelArgs& args,
     const QuantArgs& quant_args,
     const ParallelArgs& parallel_args,
     const torch::TensorOptions& options) {
+  if (parallel_args.pp_world_size() > 1 &&
+      kPipelineParallelModels.count(args.model_type()) == 0) {
+    LOG(ERROR) << "Pipeline parallelism is not supported for model type: "
+               << args.model_type();
+    return nullptr;
+  }
+
   // get the factory function for the model type from model registry
   auto factory = ModelRegistry::get_causallm_factory(args.model_type());
   if (factory) {
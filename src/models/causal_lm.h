@@ -3,8 +3,11 @@
 #include <c10/core/Device.h>
 #include <torch/torch.h>
 
+#include <string>
+#include <utility>
 #include <vector>
 
+#include "layers/chunked_forward.h"
 #include "memory/kv_cache.h"
 #include "model_args.h"
 #include "model_loader/state_dict.h"
@@ -39,6 +42,14 @@ class CausalLM : public torch::nn::Module {
   // verify if the model is loaded correctly
   virtual void verify_loaded_weights() const = 0;
 
+  // move the parameters and buffers of the model to the device in place,
+  // the tensors held by the layers stay valid. host copies are pinned.
+  virtual void move_weights(const torch::Device& device) = 0;
+
+  // the parameters and buffers of the model with their names
+  virtual std::vector<std::pair<std::string, torch::Tensor>> named_weights()
+      const = 0;
+
   virtual torch::Device device() const = 0;
 
   virtual const torch::TensorOptions& options() const = 0;
@@ -66,7 +77,17 @@ class CausalLMImpl : public CausalLM {
 
   torch::Tensor logits(const torch::Tensor& hidden_states,
                        const torch::Tensor& seleted_idxes) override {
-    return model_->logits(hidden_states, seleted_idxes);
+    if (FLAGS_lm_head_chunk_tokens <= 0) {
+      return model_->logits(hidden_states, seleted_idxes);
+    }
+    // select the tokens first so that only the selected tokens are chunked
+    const auto h = seleted_idxes.defined()
+                       ? hidden_states.index_select(/*dim=*/0, seleted_idxes)
+                       : hidden_states;
+    return chunked_forward(
+        h, FLAGS_lm_head_chunk_tokens, [this](const torch::Tensor& chunk) {
+          return model_->logits(chunk, /*seleted_idxes=*/torch::Tensor());
+        });
   }
 
   void load_state_dict(const StateDict& state_dict) override {
@@ -77,6 +98,40 @@ class CausalLMImpl : public CausalLM {
     return model_->verify_loaded_weights();
   }
 
+  void move_weights(const torch::Device& device) override {
+    auto move = [&](torch::Tensor& tensor) {
+      if (!tensor.defined() || tensor.device() == device) {
+        return;
+      }
+      const auto options =
+          tensor.options().device(device).pinned_memory(device.is_cpu());
+      auto moved = torch::empty_like(tensor, options);
+      // the caller synchronizes the device before using the copies
+      moved.copy_(tensor, /*non_blocking=*/true);
+      // swap the storage in place to keep the references valid
+      tensor.set_data(moved);
+    };
+    torch::NoGradGuard no_grad;
+    for (auto& parameter : model_->parameters()) {
+      move(parameter);
+    }
+    for (auto& buffer : model_->buffers()) {
+      move(buffer);
+    }
+  }
+
+  std::vector<std::pair<std::string, torch::Tensor>> named_weights()
+      const override {
+    std::vector<std::pair<std::string, torch::Tensor>> weights;
+    for (const auto& item : model_->named_parameters()) {
+      weights.emplace_back(item.key(), item.value());
+    }
+    for (const auto& item : model_->named_buffers()) {
+      weights.emplace_back(item.key(), item.value());
+    }
+    return weights;
+  }
+
   torch::Device device() const override { return options_.device(); }
 
   const torch::TensorOptions& options() const override { return options_; }
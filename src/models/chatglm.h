@@ -8,6 +8,8 @@
 #include "layers/attention/attention.h"
 #include "layers/attention/handler.h"
 #include "layers/embedding.h"
+#include "layers/layer_profiler.h"
+#include "layers/layer_streamer.h"
 #include "layers/linear.h"
 #include "layers/normalization.h"
 #include "memory/kv_cache.h"
@@ -287,6 +289,8 @@ class ChatGLMModelImpl : public torch::nn::Module {
         args, /*interleaved=*/true, options);
 
     // register submodules
+    streamer_ =
+        std::make_unique<LayerStreamer>(args.n_layers(), options.device());
     blocks_ = register_module("layers", torch::nn::ModuleList());
     layers_.reserve(args.n_layers());
     for (int32_t i = 0; i < args.n_layers(); i++) {
@@ -294,6 +298,7 @@ class ChatGLMModelImpl : public torch::nn::Module {
           args, quant_args, parallel_args, options, handler_.get());
       layers_.push_back(block);
       blocks_->push_back(block);
+      streamer_->add_layer(i, block.ptr());
     }
     if (post_layernorm_) {
       if (use_rms_norm_) {
@@ -317,6 +322,8 @@ class ChatGLMModelImpl : public torch::nn::Module {
                         const InputParameters& input_params) {
     // TODO: set working space for attention handler
     for (size_t i = 0; i < layers_.size(); i++) {
+      streamer_->fetch(i);
+      DECODER_LAYER_SCOPE();
       auto& layer = layers_[i];
       h = layer(h, positions, kv_caches[i], input_params);
     }
@@ -371,6 +378,9 @@ class ChatGLMModelImpl : public torch::nn::Module {
   // hold same data but different type as blocks_ to avoid type cast
   std::vector<ChatGLMBlock> layers_;
 
+  // streams the weights of the offloaded layers onto the device
+  std::unique_ptr<LayerStreamer> streamer_;
+
   // final layer norm
   RMSNorm final_rmsnorm_{nullptr};
   LayerNorm final_layernorm_{nullptr};
@@ -395,12 +405,10 @@ class ChatGLMForCausalLMImpl : public torch::nn::Module {
         "encoder", ChatGLMModel(args, quant_args, parallel_args, options));
 
     output_layer_ = register_module("output_layer",
-                                    ColumnParallelLinear(args.hidden_size(),
-                                                         args.vocab_size(),
-                                                         /*bias=*/false,
-                                                         /*gather_output=*/true,
-                                                         parallel_args,
-                                                         options));
+                                    create_lm_head(args.hidden_size(),
+                                                   args.vocab_size(),
+                                                   parallel_args,
+                                                   options));
   }
 
   // tokens: [num_tokens]
@@ -0,0 +1,713 @@
+#pragma once
+
+#include <gflags/gflags.h>
+#include <torch/torch.h>
+
+#include <cmath>
+#include <limits>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "chat_template/coded_chat_template.h"
+#include "layers/attention/mla_attention.h"
+#include "layers/chunked_forward.h"
+#include "layers/embedding.h"
+#include "layers/fused_moe.h"
+#include "layers/gated_linear.h"
+#include "layers/layer_profiler.h"
+#include "layers/layer_streamer.h"
+#include "layers/linear.h"
+#include "layers/normalization.h"
+#include "layers/pos_embedding.h"
+#include "memory/kv_cache.h"
+#include "models/model_args.h"
+#include "models/model_registry.h"
+#include "models/parameters.h"
+
+DECLARE_bool(moe_expert_parallel);
+
+// DeepSeek-V2 model compatible with huggingface weights
+// ref to:
+// https://huggingface.co/deepseek-ai/DeepSeek-V2/blob/main/modeling_deepseek.py
+namespace llm::hf {
+
+class DeepseekV2MLPImpl : public torch::nn::Module {
+ public:
+  DeepseekV2MLPImpl(int64_t hidden_size,
+                    int64_t intermediate_size,
+                    const std::string& hidden_act,
+                    const QuantArgs& quant_args,
+                    const ParallelArgs& parallel_args,
+                    const torch::TensorOptions& options) {
+    // register the weight parameter
+    gate_up_proj_ = register_module("gate_up_proj",
+                                    FusedGateUpLinear(hidden_size,
+                                                      intermediate_size,
+                                                      /*bias=*/false,
+                                                      hidden_act,
+                                                      quant_args,
+                                                      parallel_args,
+                                                      options));
+
+    down_proj_ =
+        register_module("down_proj",
+                        RowParallelLinear(intermediate_size,
+                                          hidden_size,
+                                          /*bias=*/false,
+                                          /*input_is_parallelized=*/true,
+                                          quant_args,
+                                          parallel_args,
+                                          options));
+  }
+
+  torch::Tensor forward(torch::Tensor x) {
+    LAYER_PROFILE_SCOPE("mlp");
+    // large batches run in chunks to bound the intermediate activations
+    return chunked_forward(
+        x, FLAGS_mlp_chunk_tokens, [this](const torch::Tensor& chunk) {
+          return down_proj_(gate_up_proj_(chunk));
+        });
+  }
+
+  // load the weight from the checkpoint
+  void load_state_dict(const StateDict& state_dict) {
+    // call each submodule's load_state_dict function
+    gate_up_proj_->load_state_dict(state_dict, {"gate_proj.", "up_proj."});
+    down_proj_->load_state_dict(state_dict.select("down_proj."));
+  }
+
+  void verify_loaded_weights(const std::string& prefix) const {
+    gate_up_proj_->verify_loaded_weights(prefix + "[gate_proj,up_proj].");
+    down_proj_->verify_loaded_weights(prefix + "down_proj.");
+  }
+
+ private:
+  // parameter members, must be registered
+  FusedGateUpLinear gate_up_proj_{nullptr};
+  RowParallelLinear down_proj_{nullptr};
+};
+TORCH_MODULE(DeepseekV2MLP);
+
+class DeepseekV2MoEImpl : public torch::nn::Module {
+ public:
+  DeepseekV2MoEImpl(const ModelArgs& args,
+                    const QuantArgs& quant_args,
+                    const ParallelArgs& parallel_args,
+                    const torch::TensorOptions& options)
+      : n_expert_groups_(args.n_expert_groups()),
+        topk_group_(args.topk_group()),
+        norm_topk_prob_(args.norm_topk_prob()),
+        routed_scaling_factor_(args.routed_scaling_factor()) {
+    const int64_t hidden_size = args.hidden_size();
+    const int64_t n_experts = args.n_experts();
+    CHECK(n_experts % n_expert_groups_ == 0)
+        << "n_experts should be divisible by n_expert_groups";
+
+    // register the weight parameter
+    // the router is small, keep it replicated and unquantized
+    gate_ = register_module("gate",
+                            ColumnParallelLinear(hidden_size,
+                                                 n_experts,
+                                                 /*bias=*/false,
+                                                 /*gather_output=*/true,
+                                                 parallel_args,
+                                                 options));
+    experts_ = register_module("experts",
+                               FusedMoE(n_experts,
+                                        args.n_experts_per_tok(),
+                                        hidden_size,
+                                        args.moe_intermediate_size(),
+                                        norm_topk_prob_,
+                                        FLAGS_moe_expert_parallel,
+                                        args.hidden_act(),
+                                        quant_args,
+                                        parallel_args,
+                                        options));
+    if (args.n_shared_experts() > 0) {
+      // the shared experts are fused into one mlp
+      shared_experts_ = register_module(
+          "shared_experts",
+          DeepseekV2MLP(hidden_size,
+                        args.moe_intermediate_size() * args.n_shared_experts(),
+                        args.hidden_act(),
+                        quant_args,
+                        parallel_args,
+                        options));
+    }
+  }
+
+  torch::Tensor forward(torch::Tensor x) {
+    // [num_tokens, n_experts]
+    auto router_logits = gate_(x);
+    torch::Tensor routed_scale;
+    if (n_expert_groups_ > 1) {
+      // only route to the experts of the topk_group groups with the highest
+      // expert probability.
+      const int64_t n_tokens = router_logits.size(0);
+      // => [num_tokens, n_groups, n_experts_per_group]
+      const auto probs = torch::softmax(router_logits.to(torch::kFloat), -1)
+                             .view({n_tokens, n_expert_groups_, -1});
+      const auto group_ids =
+          std::get<1>(probs.amax(/*dim=*/-1).topk(topk_group_, /*dim=*/-1));
+      // => [num_tokens, n_groups, 1]
+      const auto group_mask =
+          torch::zeros({n_tokens, n_expert_groups_},
+                       group_ids.options().dtype(torch::kBool))
+              .scatter_(/*dim=*/1, group_ids, true)
+              .unsqueeze(-1);
+      router_logits = router_logits.masked_fill(
+          group_mask.logical_not().expand_as(probs).reshape({n_tokens, -1}),
+          -std::numeric_limits<float>::infinity());
+      if (!norm_topk_prob_) {
+        // the weights are the probabilities among all experts, while the
+        // experts normalize the probabilities among the allowed ones.
+        routed_scale = (probs * group_mask).sum({1, 2}).unsqueeze(-1);
+      }
+    }
+
+    auto output = experts_(x, router_logits);
+    if (routed_scale.defined()) {
+      output = output * routed_scale.to(output.dtype());
+    }
+    if (routed_scaling_factor_ != 1.0f) {
+      output = output * routed_scaling_factor_;
+    }
+    if (shared_experts_) {
+      output = output + shared_experts_(x);
+    }
+    return output;
+  }
+
+  // load the weight from the checkpoint
+  void load_state_dict(const StateDict& state_dict) {
+    // call each submodule's load_state_dict function
+    gate_->load_state_dict(state_dict.select("gate."));
+    experts_->load_state_dict(state_dict.select("experts."),
+                              {"gate_proj.", "up_proj.", "down_proj."});
+    if (shared_experts_) {
+      shared_experts_->load_state_dict(state_dict.select("shared_experts."));
+    }
+  }
+
+  void verify_loaded_weights(const std::string& prefix) const {
+    gate_->verify_loaded_weights(prefix + "gate.");
+    experts_->verify_loaded_weights(prefix + "experts.");
+    if (shared_experts_) {
+      shared_experts_->verify_loaded_weights(prefix + "shared_experts.");
+    }
+  }
+
+ private:
+  // parameter members, must be registered
+  ColumnParallelLinear gate_{nullptr};
+  FusedMoE experts_{nullptr};
+  DeepseekV2MLP shared_experts_{nullptr};
+
+  int64_t n_expert_groups_ = 1;
+  int64_t topk_group_ = 1;
+  bool norm_topk_prob_ = false;
+  float routed_scaling_factor_ = 1.0f;
+};
+TORCH_MODULE(DeepseekV2MoE);
+
+class DeepseekV2AttentionImpl : public torch::nn::Module {
+ public:
+  DeepseekV2AttentionImpl(const ModelArgs& args,
+                          const QuantArgs& quant_args,
+                          const ParallelArgs& parallel_args,
+                          const torch::TensorOptions& options)
+      : q_lora_rank_(args.q_lora_rank()),
+        kv_lora_rank_(args.kv_lora_rank()) {
+    const int32_t world_size = parallel_args.world_size();
+    const int64_t hidden_size = args.hidden_size();
+    const int64_t n_heads = args.n_heads();
+    const int64_t nope_dim = args.qk_nope_head_dim();
+    const int64_t rope_dim = args.qk_rope_head_dim();
+    const int64_t v_head_dim = args.v_head_dim();
+    q_head_dim_ = nope_dim + rope_dim;
+    n_local_heads_ = n_heads / world_size;
+
+    // register submodules
+    if (q_lora_rank_ > 0) {
+      q_a_proj_ = register_module("q_a_proj",
+                                  ColumnParallelLinear(hidden_size,
+                                                       q_lora_rank_,
+                                                       /*bias=*/false,
+                                                       /*gather_output=*/true,
+                                                       quant_args,
+                                                       parallel_args,
+                                                       options));
+      q_a_layernorm_ = register_module(
+          "q_a_layernorm",
+          RMSNorm(q_lora_rank_, args.rms_norm_eps(), options));
+      q_b_proj_ = register_module("q_b_proj",
+                                  ColumnParallelLinear(q_lora_rank_,
+                                                       n_heads * q_head_dim_,
+                                                       /*bias=*/false,
+                                                       /*gather_output=*/false,
+                                                       quant_args,
+                                                       parallel_args,
+                                                       options));
+    } else {
+      q_proj_ = register_module("q_proj",
+                                ColumnParallelLinear(hidden_size,
+                                                     n_heads * q_head_dim_,
+                                                     /*bias=*/false,
+                                                     /*gather_output=*/false,
+                                                     quant_args,
+                                                     parallel_args,
+                                                     options));
+    }
+    // the latent and the rotary key are shared by all heads
+    kv_a_proj_with_mqa_ =
+        register_module("kv_a_proj_with_mqa",
+                        ColumnParallelLinear(hidden_size,
+                                             kv_lora_rank_ + rope_dim,
+                                             /*bias=*/false,
+                                             /*gather_output=*/true,
+                                             quant_args,
+                                             parallel_args,
+                                             options));
+    kv_a_layernorm_ = register_module(
+        "kv_a_layernorm", RMSNorm(kv_lora_rank_, args.rms_norm_eps(), options));
+    o_proj_ = register_module("o_proj",
+                              RowParallelLinear(n_heads * v_head_dim,
+                                                hidden_size,
+                                                /*bias=*/false,
+                                                /*input_is_parallelized=*/true,
+                                                quant_args,
+                                                parallel_args,
+                                                options));
+
+    // rotary embeddings with optional yarn scaling
+    const float theta = args.rope_theta();
+    auto inv_freq = detail::compute_default_inv_freq(rope_dim, theta);
+    float sm_scale = 1.0f / std::sqrt(static_cast<float>(q_head_dim_));
+    float rope_mscale = 1.0f;
+    if (args.rope_scaling_rope_type() == "yarn") {
+      const float factor = args.rope_scaling_factor();
+      inv_freq = detail::apply_yarn_rope_scaling(
+          inv_freq,
+          factor,
+          args.rope_scaling_beta_fast(),
+          args.rope_scaling_beta_slow(),
+          rope_dim,
+          theta,
+          args.rope_scaling_original_max_position_embeddings());
+      const float mscale_all_dim =
+          detail::yarn_mscale(factor, args.rope_scaling_mscale_all_dim());
+      sm_scale *= mscale_all_dim * mscale_all_dim;
+      rope_mscale =
+          detail::yarn_mscale(factor, args.rope_scaling_mscale()) /
+          mscale_all_dim;
+    }
+    mla_ = register_module("kv_b_proj",
+                           MLAAttention(n_local_heads_,
+                                        nope_dim,
+                                        rope_dim,
+                                        v_head_dim,
+                                        kv_lora_rank_,
+                                        sm_scale,
+                                        rope_mscale,
+                                        args.max_position_embeddings(),
+                                        inv_freq,
+                                        parallel_args,
+                                        options));
+  }
+
+  torch::Tensor forward(torch::Tensor x,
+                        torch::Tensor positions,
+                        KVCache& kv_cache,
+                        const InputParameters& input_params) {
+    LAYER_PROFILE_SCOPE("self_attn");
+    // => [num_tokens, n_local_heads, q_head_dim]
+    auto q = q_lora_rank_ > 0 ? q_b_proj_(q_a_layernorm_(q_a_proj_(x)))
+                              : q_proj_(x);
+    q = q.view({q.size(0), n_local_heads_, q_head_dim_});
+
+    // => [num_tokens, kv_lora_rank + qk_rope_head_dim]
+    const auto kv_a = kv_a_proj_with_mqa_(x);
+    const auto latent =
+        kv_a_layernorm_(kv_a.slice(/*dim=*/-1, 0, kv_lora_rank_).contiguous());
+    const auto k_rope = kv_a.slice(/*dim=*/-1, kv_lora_rank_).contiguous();
+
+    // => [num_tokens, n_local_heads * v_head_dim]
+    const auto output =
+        mla_(q, latent, k_rope, positions, kv_cache, input_params);
+    return o_proj_(output);
+  }
+
+  // load the weight from the checkpoint
+  void load_state_dict(const StateDict& state_dict) {
+    // call each submodule's load_state_dict function
+    if (q_lora_rank_ > 0) {
+      q_a_proj_->load_state_dict(state_dict.select("q_a_proj."));
+      q_a_layernorm_->load_state_dict(state_dict.select("q_a_layernorm."));
+      q_b_proj_->load_state_dict(state_dict.select("q_b_proj."));
+    } else {
+      q_proj_->load_state_dict(state_dict.select("q_proj."));
+    }
+    kv_a_proj_with_mqa_->load_state_dict(
+        state_dict.select("kv_a_proj_with_mqa."));
+    kv_a_layernorm_->load_state_dict(state_dict.select("kv_a_layernorm."));
+    mla_->load_state_dict(state_dict.select("kv_b_proj."));
+    o_proj_->load_state_dict(state_dict.select("o_proj."));
+  }
+
+  void verify_loaded_weights(const std::string& prefix) const {
+    if (q_lora_rank_ > 0) {
+      q_a_proj_->verify_loaded_weights(prefix + "q_a_proj.");
+      q_a_layernorm_->verify_loaded_weights(prefix + "q_a_layernorm.");
+      q_b_proj_->verify_loaded_weights(prefix + "q_b_proj.");
+    } else {
+      q_proj_->verify_loaded_weights(prefix + "q_proj.");
+    }
+    kv_a_proj_with_mqa_->verify_loaded_weights(prefix + "kv_a_proj_with_mqa.");
+    kv_a_layernorm_->verify_loaded_weights(prefix + "kv_a_layernorm.");
+    mla_->verify_loaded_weights(prefix + "kv_b_proj.");
+    o_proj_->verify_loaded_weights(prefix + "o_proj.");
+  }
+
+ private:
+  // parameter members, must be registered
+  ColumnParallelLinear q_proj_{nullptr};
+  ColumnParallelLinear q_a_proj_{nullptr};
+  RMSNorm q_a_layernorm_{nullptr};
+  ColumnParallelLinear q_b_proj_{nullptr};
+
+  ColumnParallelLinear kv_a_proj_with_mqa_{nullptr};
+  RMSNorm kv_a_layernorm_{nullptr};
+
+  RowParallelLinear o_proj_{nullptr};
+
+  // the attention over the latent cache, holds the kv_b_proj weight
+  MLAAttention mla_{nullptr};
+
+  int64_t q_lora_rank_ = 0;
+  int64_t kv_lora_rank_ = 0;
+  int64_t q_head_dim_ = 0;
+  int64_t n_local_heads_ = 0;
+};
+TORCH_MODULE(DeepseekV2Attention);
+
+class DeepseekV2DecoderLayerImpl : public torch::nn::Module {
+ public:
+  DeepseekV2DecoderLayerImpl(const ModelArgs& args,
+                             int32_t layer_id,
+                             const QuantArgs& quant_args,
+                             const ParallelArgs& parallel_args,
+                             const torch::TensorOptions& options) {
+    // register submodules
+    self_attn_ = register_module(
+        "self_attn",
+        DeepseekV2Attention(args, quant_args, parallel_args, options));
+    // the leading layers have a dense mlp
+    if (args.n_experts() > 0 && layer_id >= args.first_k_dense_replace()) {
+      moe_ = register_module(
+          "mlp", DeepseekV2MoE(args, quant_args, parallel_args, options));
+    } else {
+      mlp_ = register_module("mlp",
+                             DeepseekV2MLP(args.hidden_size(),
+                                           args.intermediate_size(),
+                                           args.hidden_act(),
+                                           quant_args,
+                                           parallel_args,
+                                           options));
+    }
+    input_layernorm_ = register_module(
+        "input_layernorm",
+        RMSNormResidual(args.hidden_size(), args.rms_norm_eps(), options));
+    post_attention_layernorm_ = register_module(
+        "post_attention_layernorm",
+        RMSNormResidual(args.hidden_size(), args.rms_norm_eps(), options));
+  }
+
+  torch::Tensor forward(torch::Tensor x,
+                        torch::Tensor positions,
+                        torch::Tensor& residual,
+                        KVCache& kv_cache,
+                        const InputParameters& input_params) {
+    // the residual adds are fused into the norms
+    auto hidden_states = input_layernorm_(x, residual);
+
+    hidden_states =
+        self_attn_(hidden_states, positions, kv_cache, input_params);
+    hidden_states = post_attention_layernorm_(hidden_states, residual);
+    return moe_ ? moe_(hidden_states) : mlp_(hidden_states);
+  }
+
+  // load the weight from the checkpoint
+  void load_state_dict(const StateDict& state_dict) {
+    // call each submodule's load_state_dict function
+    self_attn_->load_state_dict(state_dict.select("self_attn."));
+    if (moe_) {
+      moe_->load_state_dict(state_dict.select("mlp."));
+    } else {
+      mlp_->load_state_dict(state_dict.select("mlp."));
+    }
+    input_layernorm_->load_state_dict(state_dict.select("input_layernorm."));
+    post_attention_layernorm_->load_state_dict(
+        state_dict.select("post_attention_layernorm."));
+  }
+
+  void verify_loaded_weights(const std::string& prefix) const {
+    self_attn_->verify_loaded_weights(prefix + "self_attn.");
+    if (moe_) {
+      moe_->verify_loaded_weights(prefix + "mlp.");
+    } else {
+      mlp_->verify_loaded_weights(prefix + "mlp.");
+    }
+    input_layernorm_->verify_loaded_weights(prefix + "input_layernorm.");
+    post_attention_layernorm_->verify_loaded_weights(
+        prefix + "post_attention_layernorm.");
+  }
+
+ private:
+  // parameter members, must be registered
+  DeepseekV2Attention self_attn_{nullptr};
+
+  // one of the dense mlp and the experts
+  DeepseekV2MLP mlp_{nullptr};
+  DeepseekV2MoE moe_{nullptr};
+
+  RMSNormResidual input_layernorm_{nullptr};
+
+  RMSNormResidual post_attention_layernorm_{nullptr};
+};
+TORCH_MODULE(DeepseekV2DecoderLayer);
+
+class DeepseekV2ModelImpl : public torch::nn::Module {
+ public:
+  DeepseekV2ModelImpl(const ModelArgs& args,
+                      const QuantArgs& quant_args,
+                      const ParallelArgs& parallel_args,
+                      const torch::TensorOptions& options) {
+    // register submodules
+    embed_tokens_ = register_module(
+        "embed_tokens",
+        ParallelEmbedding(
+            args.vocab_size(), args.hidden_size(), parallel_args, options));
+
+    streamer_ =
+        std::make_unique<LayerStreamer>(args.n_layers(), options.device());
+    blocks_ = register_module("layers", torch::nn::ModuleList());
+    layers_.reserve(args.n_layers());
+    for (int32_t i = 0; i < args.n_layers(); i++) {
+      auto block = DeepseekV2DecoderLayer(
+          args, i, quant_args, parallel_args, options);
+      layers_.push_back(block);
+      blocks_->push_back(block);
+      streamer_->add_layer(i, block.ptr());
+    }
+    norm_ = register_module(
+        "norm",
+        RMSNormResidual(args.hidden_size(), args.rms_norm_eps(), options));
+  }
+
+  // tokens: [num_tokens]
+  // positions: [num_tokens] token pos in the sequence
+  torch::Tensor forward(torch::Tensor tokens,
+                        torch::Tensor positions,
+                        std::vector<KVCache>& kv_caches,
+                        const InputParameters& input_params) {
+    auto h = embed_tokens_(tokens);
+    torch::Tensor residual;
+
+    for (size_t i = 0; i < layers_.size(); i++) {
+      streamer_->fetch(i);
+      DECODER_LAYER_SCOPE();
+      auto& layer = layers_[i];
+      h = layer(h, positions, residual, kv_caches[i], input_params);
+    }
+    return norm_(h, residual);
+  }
+
+  // load the weight from the checkpoint
+  void load_state_dict(const StateDict& state_dict) {
+    embed_tokens_->load_state_dict(state_dict.select("embed_tokens."));
+    // call each layer's load_state_dict function
+    for (int i = 0; i < layers_.size(); i++) {
+      layers_[i]->load_state_dict(
+          state_dict.select("layers." + std::to_string(i) + "."));
+    }
+    norm_->load_state_dict(state_dict.select("norm."));
+  }
+
+  void verify_loaded_weights(const std::string& prefix) const {
+    embed_tokens_->verify_loaded_weights(prefix + "embed_tokens.");
+    for (int i = 0; i < layers_.size(); i++) {
+      layers_[i]->verify_loaded_weights(prefix + "layers." + std::to_string(i) +
+                                        ".");
+    }
+    norm_->verify_loaded_weights(prefix + "norm.");
+  }
+
+ private:
+  // parameter members, must be registered
+  ParallelEmbedding embed_tokens_{nullptr};
+
+  torch::nn::ModuleList blocks_{nullptr};
+  // hold same data but different type as blocks_ to avoid type cast
+  std::vector<DeepseekV2DecoderLayer> layers_;
+
+  // streams the weights of the offloaded layers onto the device
+  std::unique_ptr<LayerStreamer> streamer_;
+
+  RMSNormResidual norm_{nullptr};
+};
+TORCH_MODULE(DeepseekV2Model);
+
+class DeepseekV2ForCausalLMImpl : public torch::nn::Module {
+ public:
+  DeepseekV2ForCausalLMImpl(const ModelArgs& args,
+                            const QuantArgs& quant_args,
+                            const ParallelArgs& parallel_args,
+                            const torch::TensorOptions& options) {
+    // register submodules
+    model_ = register_module(
+        "model", DeepseekV2Model(args, quant_args, parallel_args, options));
+
+    lm_head_ = register_module("lm_head",
+                               create_lm_head(args.hidden_size(),
+                                              args.vocab_size(),
+                                              parallel_args,
+                                              options));
+  }
+
+  // tokens: [num_tokens]
+  // positions: [num_tokens] token pos in the sequence
+  // returns: [num_tokens, hidden_size]
+  torch::Tensor forward(const torch::Tensor& tokens,
+                        const torch::Tensor& positions,
+                        std::vector<KVCache>& kv_caches,
+                        const InputParameters& input_params) {
+    return model_(tokens, positions, kv_caches, input_params);
+  }
+
+  // hidden_states: [num_tokens, hidden_size]
+  // seleted_idxes: [num_tokens]
+  // returns: [num_tokens, vocab_size]
+  torch::Tensor logits(const torch::Tensor& hidden_states,
+                       const torch::Tensor& seleted_idxes) {
+    // select tokens if provided
+    auto h = hidden_states;
+    if (seleted_idxes.defined()) {
+      h = h.index_select(/*dim=*/0, seleted_idxes);
+    }
+    return lm_head_(h);
+  }
+
+  // load the weight from the checkpoint
+  void load_state_dict(const StateDict& state_dict) {
+    model_->load_state_dict(state_dict.select("model."));
+    lm_head_->load_state_dict(state_dict.select("lm_head."));
+  }
+
+  void verify_loaded_weights() const {
+    model_->verify_loaded_weights("model.");
+    lm_head_->verify_loaded_weights("lm_head.");
+  }
+
+ private:
+  // parameter members, must be registered
+  DeepseekV2Model model_{nullptr};
+
+  ColumnParallelLinear lm_head_{nullptr};
+};
+TORCH_MODULE(DeepseekV2ForCausalLM);
+
+class DeepseekV2ChatTemplate final : public CodedChatTemplate {
+ public:
+  // generate prompt from dialogs
+  // Prompt template:
+  // {system}\n\nUser: {user}\n\nAssistant: {assistant}
+  // <｜end▁of▁sentence｜>User: {user}\n\nAssistant:
+  std::optional<std::string> get_prompt(
+      const std::string_view& system_message,
+      const std::vector<std::string_view>& messages) const override {
+    // at least one user message
+    if (messages.size() % 2 == 0) {
+      return std::nullopt;
+    }
+
+    std::stringstream ss;
+    // N.B. tokenizer would add bos token to the beginning of the prompt
+    if (!system_message.empty()) {
+      ss << system_message << "\n\n";
+    }
+
+    // then user and assistant message pairs (u/a/u/a/u...)
+    for (size_t i = 0; i < messages.size(); ++i) {
+      if (i % 2 == 0) {
+        // user message
+        ss << "User: " << messages[i] << "\n\n";
+      } else {
+        // assistant message
+        ss << "Assistant: " << messages[i] << "<｜end▁of▁sentence｜>";
+      }
+    }
+    // end with assistant message
+    ss << "Assistant:";
+    return ss.str();
+  }
+};
+
+// register the model to make it available
+REGISTER_CAUSAL_MODEL(deepseek_v2, DeepseekV2ForCausalLM);
+REGISTER_DEFAULT_CHAT_TEMPLATE(deepseek_v2, DeepseekV2ChatTemplate);
+// example config:
+// https://huggingface.co/deepseek-ai/DeepSeek-V2-Chat/blob/main/config.json
+REGISTER_MODEL_ARGS(deepseek_v2, [&] {
+  LOAD_ARG_OR(model_type, "model_type", "deepseek_v2");
+  LOAD_ARG_OR(dtype, "torch_dtype", "");
+  LOAD_ARG_OR(vocab_size, "vocab_size", 102400);
+  LOAD_ARG_OR(hidden_size, "hidden_size", 5120);
+  LOAD_ARG_OR(n_layers, "num_hidden_layers", 60);
+  LOAD_ARG_OR(n_heads, "num_attention_heads", 128);
+  LOAD_ARG_OR(intermediate_size, "intermediate_size", 12288);
+  LOAD_ARG_OR(hidden_act, "hidden_act", "silu");
+  LOAD_ARG_OR(max_position_embeddings, "max_position_embeddings", 163840);
+  LOAD_ARG_OR(rms_norm_eps, "rms_norm_eps", 1e-6);
+  LOAD_ARG_OR(bos_token_id, "bos_token_id", 100000);
+  LOAD_ARG_OR(eos_token_id, "eos_token_id", 100001);
+  LOAD_ARG_OR(rope_theta, "rope_theta", 10000.0f);
+  // load yarn rope scaling parameters
+  LOAD_ARG(rope_scaling_rope_type, "rope_scaling.type");
+  LOAD_ARG(rope_scaling_factor, "rope_scaling.factor");
+  LOAD_ARG(rope_scaling_original_max_position_embeddings,
+           "rope_scaling.original_max_position_embeddings");
+  LOAD_ARG(rope_scaling_beta_fast, "rope_scaling.beta_fast");
+  LOAD_ARG(rope_scaling_beta_slow, "rope_scaling.beta_slow");
+  LOAD_ARG(rope_scaling_mscale, "rope_scaling.mscale");
+  LOAD_ARG(rope_scaling_mscale_all_dim, "rope_scaling.mscale_all_dim");
+
+  // mixture of experts
+  LOAD_ARG_OR(n_experts, "n_routed_experts", 160);
+  LOAD_ARG_OR(n_experts_per_tok, "num_experts_per_tok", 6);
+  LOAD_ARG_OR(moe_intermediate_size, "moe_intermediate_size", 1536);
+  LOAD_ARG_OR(n_shared_experts, "n_shared_experts", 2);
+  LOAD_ARG_OR(first_k_dense_replace, "first_k_dense_replace", 1);
+  LOAD_ARG_OR(n_expert_groups, "n_group", 1);
+  LOAD_ARG_OR(topk_group, "topk_group", 1);
+  LOAD_ARG_OR(norm_topk_prob, "norm_topk_prob", false);
+  LOAD_ARG_OR(routed_scaling_factor, "routed_scaling_factor", 1.0f);
+
+  // multi-head latent attention, q_lora_rank is null for a full query
+  // projection, e.g. DeepSeek-V2-Lite
+  LOAD_ARG_OR(q_lora_rank, "q_lora_rank", 0);
+  LOAD_ARG_OR(kv_lora_rank, "kv_lora_rank", 512);
+  LOAD_ARG_OR(qk_nope_head_dim, "qk_nope_head_dim", 128);
+  LOAD_ARG_OR(qk_rope_head_dim, "qk_rope_head_dim", 64);
+  LOAD_ARG_OR(v_head_dim, "v_head_dim", 128);
+
+  // the kv cache holds the latent and the rotary key of each token as one
+  // kv head, split across the key and value cache.
+  SET_ARG(n_kv_heads, 1);
+  SET_ARG(head_dim,
+          MLAAttentionImpl::mla_cache_dim(args->kv_lora_rank(),
+                                          args->qk_rope_head_dim()));
+});
+
+}  // namespace llm::hf
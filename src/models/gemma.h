@@ -6,10 +6,13 @@
 #include <string>
 
 #include "chat_template/coded_chat_template.h"
-#include "layers/activation.h"
 #include "layers/attention/attention.h"
 #include "layers/attention/handler.h"
+#include "layers/chunked_forward.h"
 #include "layers/embedding.h"
+#include "layers/gated_linear.h"
+#include "layers/layer_profiler.h"
+#include "layers/layer_streamer.h"
 #include "layers/linear.h"
 #include "layers/normalization.h"
 #include "layers/qkv_linear.h"
@@ -27,23 +30,19 @@ class GemmaMLPImpl : public torch::nn::Module {
                const QuantArgs& quant_args,
                const ParallelArgs& parallel_args,
                const torch::TensorOptions& options) {
-    act_func_ = Activation::get_act_func(args.hidden_act(), options.device());
-    CHECK(act_func_ != nullptr);
-
     const int64_t hidden_size = args.hidden_size();
     const int64_t intermediate_size = args.intermediate_size();
 
     // register the weight parameter
     gate_up_proj_ = register_module(
         "gate_up_proj",
-        FusedColumnParallelLinear(
-            hidden_size,
-            std::vector<int64_t>{intermediate_size, intermediate_size},
-            /*bias=*/false,
-            /*gather_output=*/false,
-            quant_args,
-            parallel_args,
-            options));
+        FusedGateUpLinear(hidden_size,
+                          intermediate_size,
+                          /*bias=*/false,
+                          args.hidden_act(),
+                          quant_args,
+                          parallel_args,
+                          options));
     down_proj_ =
         register_module("down_proj",
                         RowParallelLinear(intermediate_size,
@@ -56,8 +55,11 @@ class GemmaMLPImpl : public torch::nn::Module {
   }
 
   torch::Tensor forward(torch::Tensor x) {
-    const auto gate_up = gate_up_proj_(x);
-    return down_proj_(act_func_(gate_up[0]) * gate_up[1]);
+    // large batches run in chunks to bound the intermediate activations
+    return chunked_forward(
+        x, FLAGS_mlp_chunk_tokens, [this](const torch::Tensor& chunk) {
+          return down_proj_(gate_up_proj_(chunk));
+        });
   }
 
   // load the weight from the checkpoint
@@ -74,11 +76,8 @@ class GemmaMLPImpl : public torch::nn::Module {
 
  private:
   // parameter members, must be registered
-  FusedColumnParallelLinear gate_up_proj_{nullptr};
+  FusedGateUpLinear gate_up_proj_{nullptr};
   RowParallelLinear down_proj_{nullptr};
-
-  // activation function
-  ActFunc act_func_{nullptr};
 };
 TORCH_MODULE(GemmaMLP);
 
@@ -258,6 +257,8 @@ class GemmaModelImpl : public torch::nn::Module {
     handler_ = AttentionHandler::create_handler_with_rope(
         args, /*interleaved=*/false, options);
 
+    streamer_ =
+        std::make_unique<LayerStreamer>(args.n_layers(), options.device());
     blocks_ = register_module("layers", torch::nn::ModuleList());
     layers_.reserve(args.n_layers());
     for (int32_t i = 0; i < args.n_layers(); i++) {
@@ -265,6 +266,7 @@ class GemmaModelImpl : public torch::nn::Module {
           args, quant_args, parallel_args, options, handler_.get());
       layers_.push_back(block);
       blocks_->push_back(block);
+      streamer_->add_layer(i, block.ptr());
     }
   }
 
@@ -277,6 +279,8 @@ class GemmaModelImpl : public torch::nn::Module {
     // embedding tokens
     auto h = embed_tokens_(tokens) * normalizer_;
     for (int32_t i = 0; i < modelArgs_.n_layers(); i++) {
+      streamer_->fetch(i);
+      DECODER_LAYER_SCOPE();
       auto& layer = layers_[i];
       h = layer(h, positions, kv_caches[i], input_params);
     }
@@ -320,6 +324,9 @@ class GemmaModelImpl : public torch::nn::Module {
   torch::nn::ModuleList blocks_{nullptr};
   // hold same data but different type as blocks_ to avoid type cast
   std::vector<GemmaDecoderLayer> layers_;
+
+  // streams the weights of the offloaded layers onto the device
+  std::unique_ptr<LayerStreamer> streamer_;
 };
 TORCH_MODULE(GemmaModel);
 
@@ -335,12 +342,10 @@ class GemmaForCausalLMImpl : public torch::nn::Module {
         "model", GemmaModel(args, quant_args, parallel_args, options));
 
     lm_head_ = register_module("lm_head",
-                               ColumnParallelLinear(args.hidden_size(),
-                                                    args.vocab_size(),
-                                                    /*bias=*/false,
-                                                    /*gather_output=*/true,
-                                                    parallel_args,
-                                                    options));
+                               create_lm_head(args.hidden_size(),
+                                              args.vocab_size(),
+                                              parallel_args,
+                                              options));
   }
 
   // tokens: [num_tokens]
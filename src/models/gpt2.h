@@ -7,6 +7,8 @@
 #include "layers/attention/attention.h"
 #include "layers/attention/handler.h"
 #include "layers/embedding.h"
+#include "layers/layer_profiler.h"
+#include "layers/layer_streamer.h"
 #include "layers/linear.h"
 #include "layers/normalization.h"
 #include "memory/kv_cache.h"
@@ -29,6 +31,7 @@ class GPT2MLPImpl : public torch::nn::Module {
 
     act_ = Activation::get_act_func(args.hidden_act(), options.device());
     CHECK(act_ != nullptr);
+    epilogue_act_ = Activation::get_epilogue_act(args.hidden_act());
 
     // register the weight parameter
     c_fc_ = register_module("c_fc",
@@ -49,7 +52,16 @@ class GPT2MLPImpl : public torch::nn::Module {
                                                 options));
   }
 
-  torch::Tensor forward(torch::Tensor x) { return c_proj_(act_(c_fc_(x))); }
+  torch::Tensor forward(torch::Tensor x) {
+    if (epilogue_act_.has_value()) {
+      // apply the activation in the gemm epilogue if supported
+      auto h = c_fc_->forward_act(x, epilogue_act_.value());
+      if (h.defined()) {
+        return c_proj_(h);
+      }
+    }
+    return c_proj_(act_(c_fc_(x)));
+  }
 
   // load the weight from the checkpoint
   void load_state_dict(const StateDict& state_dict) {
@@ -79,6 +91,8 @@ class GPT2MLPImpl : public torch::nn::Module {
   RowParallelLinear c_proj_{nullptr};
 
   ActFunc act_{nullptr};
+
+  std::optional<EpilogueAct> epilogue_act_;
 };
 TORCH_MODULE(GPT2MLP);
 
@@ -249,6 +263,8 @@ class GPT2ModelImpl : public torch::nn::Module {
 
     handler_ = AttentionHandler::create_handler(args, options);
 
+    streamer_ =
+        std::make_unique<LayerStreamer>(args.n_layers(), options.device());
     blocks_ = register_module("h", torch::nn::ModuleList());
     layers_.reserve(args.n_layers());
     for (int32_t i = 0; i < args.n_layers(); i++) {
@@ -256,6 +272,7 @@ class GPT2ModelImpl : public torch::nn::Module {
           GPT2Block(args, quant_args, parallel_args, options, handler_.get());
       layers_.push_back(block);
       blocks_->push_back(block);
+      streamer_->add_layer(i, block.ptr());
     }
     ln_f_ = register_module("ln_f",
                             LayerNorm(args.hidden_size(),
@@ -273,6 +290,8 @@ class GPT2ModelImpl : public torch::nn::Module {
     auto h = wte_(tokens) + wpe_(positions);
     // TODO: set working space for attention handler
     for (size_t i = 0; i < layers_.size(); i++) {
+      streamer_->fetch(i);
+      DECODER_LAYER_SCOPE();
       auto& layer = layers_[i];
       h = layer(h, kv_caches[i], input_params);
     }
@@ -314,6 +333,9 @@ class GPT2ModelImpl : public torch::nn::Module {
   // hold same data but different type as blocks_ to avoid type cast
   std::vector<GPT2Block> layers_;
 
+  // streams the weights of the offloaded layers onto the device
+  std::unique_ptr<LayerStreamer> streamer_;
+
   LayerNorm ln_f_{nullptr};
 };
 TORCH_MODULE(GPT2Model);
@@ -329,12 +351,10 @@ class GPT2ForCausalLMImpl : public torch::nn::Module {
         "model", GPT2Model(args, quant_args, parallel_args, options));
 
     lm_head_ = register_module("lm_head",
-                               ColumnParallelLinear(args.hidden_size(),
-                                                    args.vocab_size(),
-                                                    /*bias=*/false,
-                                                    /*gather_output=*/true,
-                                                    parallel_args,
-                                                    options));
+                               create_lm_head(args.hidden_size(),
+                                              args.vocab_size(),
+                                              parallel_args,
+                                              options));
   }
 
   // tokens: [num_tokens]
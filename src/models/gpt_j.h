@@ -6,6 +6,8 @@
 #include "layers/attention/attention.h"
 #include "layers/attention/handler.h"
 #include "layers/embedding.h"
+#include "layers/layer_profiler.h"
+#include "layers/layer_streamer.h"
 #include "layers/linear.h"
 #include "layers/normalization.h"
 #include "memory/kv_cache.h"
@@ -28,6 +30,7 @@ class GPTJMLPImpl : public torch::nn::Module {
 
     act_ = Activation::get_act_func(args.hidden_act(), options.device());
     CHECK(act_ != nullptr);
+    epilogue_act_ = Activation::get_epilogue_act(args.hidden_act());
 
     // register the weight parameter
     fc_in_ = register_module("fc_in",
@@ -48,7 +51,16 @@ class GPTJMLPImpl : public torch::nn::Module {
                                                 options));
   }
 
-  torch::Tensor forward(torch::Tensor x) { return fc_out_(act_(fc_in_(x))); }
+  torch::Tensor forward(torch::Tensor x) {
+    if (epilogue_act_.has_value()) {
+      // apply the activation in the gemm epilogue if supported
+      auto h = fc_in_->forward_act(x, epilogue_act_.value());
+      if (h.defined()) {
+        return fc_out_(h);
+      }
+    }
+    return fc_out_(act_(fc_in_(x)));
+  }
 
   // load the weight from the checkpoint
   void load_state_dict(const StateDict& state_dict) {
@@ -68,6 +80,8 @@ class GPTJMLPImpl : public torch::nn::Module {
   RowParallelLinear fc_out_{nullptr};
 
   ActFunc act_{nullptr};
+
+  std::optional<EpilogueAct> epilogue_act_;
 };
 TORCH_MODULE(GPTJMLP);
 
@@ -213,6 +227,8 @@ class GPTJModelImpl : public torch::nn::Module {
     handler_ = AttentionHandler::create_handler_with_rope(
         args, /*interleaved=*/true, options);
 
+    streamer_ =
+        std::make_unique<LayerStreamer>(args.n_layers(), options.device());
     blocks_ = register_module("h", torch::nn::ModuleList());
     layers_.reserve(args.n_layers());
     for (int32_t i = 0; i < args.n_layers(); i++) {
@@ -220,6 +236,7 @@ class GPTJModelImpl : public torch::nn::Module {
           GPTJBlock(args, quant_args, parallel_args, options, handler_.get());
       layers_.push_back(block);
       blocks_->push_back(block);
+      streamer_->add_layer(i, block.ptr());
     }
     ln_f_ = register_module("ln_f",
                             LayerNorm(args.hidden_size(),
@@ -238,6 +255,8 @@ class GPTJModelImpl : public torch::nn::Module {
 
     // TODO: set working space for attention handler
     for (size_t i = 0; i < layers_.size(); i++) {
+      streamer_->fetch(i);
+      DECODER_LAYER_SCOPE();
       auto& layer = layers_[i];
       h = layer(h, positions, kv_caches[i], input_params);
     }
@@ -275,6 +294,9 @@ class GPTJModelImpl : public torch::nn::Module {
   // hold same data but different type as blocks_ to avoid type cast
   std::vector<GPTJBlock> layers_;
 
+  // streams the weights of the offloaded layers onto the device
+  std::unique_ptr<LayerStreamer> streamer_;
+
   LayerNorm ln_f_{nullptr};
 };
 TORCH_MODULE(GPTJModel);
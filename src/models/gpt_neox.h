@@ -6,6 +6,8 @@
 #include "layers/attention/attention.h"
 #include "layers/attention/handler.h"
 #include "layers/embedding.h"
+#include "layers/layer_profiler.h"
+#include "layers/layer_streamer.h"
 #include "layers/linear.h"
 #include "layers/normalization.h"
 #include "memory/kv_cache.h"
@@ -28,6 +30,7 @@ class GPTNeoXMLPImpl : public torch::nn::Module {
 
     act_ = Activation::get_act_func(args.hidden_act(), options.device());
     CHECK(act_ != nullptr);
+    epilogue_act_ = Activation::get_epilogue_act(args.hidden_act());
 
     // register the weight parameter
     dense_h_to_4h_ =
@@ -51,6 +54,13 @@ class GPTNeoXMLPImpl : public torch::nn::Module {
   }
 
   torch::Tensor forward(torch::Tensor x) {
+    if (epilogue_act_.has_value()) {
+      // apply the activation in the gemm epilogue if supported
+      auto h = dense_h_to_4h_->forward_act(x, epilogue_act_.value());
+      if (h.defined()) {
+        return dense_4h_to_h_(h);
+      }
+    }
     return dense_4h_to_h_(act_(dense_h_to_4h_(x)));
   }
 
@@ -72,6 +82,8 @@ class GPTNeoXMLPImpl : public torch::nn::Module {
   RowParallelLinear dense_4h_to_h_{nullptr};
 
   ActFunc act_{nullptr};
+
+  std::optional<EpilogueAct> epilogue_act_;
 };
 TORCH_MODULE(GPTNeoXMLP);
 
@@ -261,6 +273,8 @@ class GPTNeoXModelImpl : public torch::nn::Module {
     handler_ = AttentionHandler::create_handler_with_rope(
         args, /*interleaved=*/false, options);
 
+    streamer_ =
+        std::make_unique<LayerStreamer>(args.n_layers(), options.device());
     blocks_ = register_module("layers", torch::nn::ModuleList());
     layers_.reserve(args.n_layers());
     for (int32_t i = 0; i < args.n_layers(); i++) {
@@ -268,6 +282,7 @@ class GPTNeoXModelImpl : public torch::nn::Module {
           i, args, quant_args, parallel_args, options, handler_.get());
       layers_.push_back(block);
       blocks_->push_back(block);
+      streamer_->add_layer(i, block.ptr());
     }
     final_layer_norm_ = register_module("final_layer_norm",
                                         LayerNorm(args.hidden_size(),
@@ -286,6 +301,8 @@ class GPTNeoXModelImpl : public torch::nn::Module {
 
     // TODO: set working space for attention handler
     for (size_t i = 0; i < layers_.size(); i++) {
+      streamer_->fetch(i);
+      DECODER_LAYER_SCOPE();
       auto& layer = layers_[i];
       h = layer(h, positions, kv_caches[i], input_params);
     }
@@ -323,6 +340,9 @@ class GPTNeoXModelImpl : public torch::nn::Module {
   // hold same data but different type as blocks_ to avoid type cast
   std::vector<GPTNeoXLayer> layers_;
 
+  // streams the weights of the offloaded layers onto the device
+  std::unique_ptr<LayerStreamer> streamer_;
+
   LayerNorm final_layer_norm_{nullptr};
 };
 TORCH_MODULE(GPTNeoXModel);
@@ -338,12 +358,10 @@ class GPTNeoXForCausalLMImpl : public torch::nn::Module {
         "gpt_neox", GPTNeoXModel(args, quant_args, parallel_args, options));
 
     embed_out_ = register_module("embed_out",
-                                 ColumnParallelLinear(args.hidden_size(),
-                                                      args.vocab_size(),
-                                                      /*bias=*/false,
-                                                      /*gather_output=*/true,
-                                                      parallel_args,
-                                                      options));
+                                 create_lm_head(args.hidden_size(),
+                                                args.vocab_size(),
+                                                parallel_args,
+                                                options));
   }
 
   // tokens: [num_tokens]
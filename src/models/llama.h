@@ -3,16 +3,22 @@
 #include <c10/core/ScalarType.h>
 #include <torch/torch.h>
 
+#include <tuple>
+
 #include "chat_template/common_chat_template.h"
-#include "layers/activation.h"
 #include "layers/attention/attention.h"
 #include "layers/attention/handler.h"
+#include "layers/chunked_forward.h"
 #include "layers/embedding.h"
-#include "layers/fused_linear.h"
+#include "layers/gated_linear.h"
+#include "layers/layer_profiler.h"
+#include "layers/layer_streamer.h"
 #include "layers/linear.h"
+#include "layers/lora_linear.h"
 #include "layers/normalization.h"
 #include "layers/qkv_linear.h"
 #include "memory/kv_cache.h"
+#include "model_parallel/model_parallel.h"
 #include "models/model_args.h"
 #include "models/model_registry.h"
 #include "models/parameters.h"
@@ -26,23 +32,19 @@ class LlamaMLPImpl : public torch::nn::Module {
                const QuantArgs& quant_args,
                const ParallelArgs& parallel_args,
                const torch::TensorOptions& options) {
-    act_func_ = Activation::get_act_func("silu", options.device());
-    CHECK(act_func_ != nullptr);
-
     const int64_t hidden_size = args.hidden_size();
     const int64_t intermediate_size = args.intermediate_size();
 
     // register the weight parameter
     gate_up_proj_ = register_module(
         "gate_up_proj",
-        FusedColumnParallelLinear(
-            hidden_size,
-            std::vector<int64_t>{intermediate_size, intermediate_size},
-            /*bias=*/false,
-            /*gather_output=*/false,
-            quant_args,
-            parallel_args,
-            options));
+        FusedGateUpLinear(hidden_size,
+                          intermediate_size,
+                          /*bias=*/false,
+                          "silu",
+                          quant_args,
+                          parallel_args,
+                          options));
 
     down_proj_ =
         register_module("down_proj",
@@ -56,8 +58,16 @@ class LlamaMLPImpl : public torch::nn::Module {
   }
 
   torch::Tensor forward(torch::Tensor x) {
-    const auto gate_up = gate_up_proj_(x);
-    return down_proj_(act_func_(gate_up[0]) * gate_up[1]);
+    LAYER_PROFILE_SCOPE("mlp");
+    if (sequence_parallel_enabled()) {
+      // the output of each rank is a slice of the rows of all the chunks
+      return down_proj_(gate_up_proj_(x));
+    }
+    // large batches run in chunks to bound the intermediate activations
+    return chunked_forward(
+        x, FLAGS_mlp_chunk_tokens, [this](const torch::Tensor& chunk) {
+          return down_proj_(gate_up_proj_(chunk));
+        });
   }
 
   // load the weight from the checkpoint
@@ -74,11 +84,8 @@ class LlamaMLPImpl : public torch::nn::Module {
 
  private:
   // parameter members, must be registered
-  FusedColumnParallelLinear gate_up_proj_{nullptr};
+  FusedGateUpLinear gate_up_proj_{nullptr};
   RowParallelLinear down_proj_{nullptr};
-
-  // activation function
-  ActFunc act_func_{nullptr};
 };
 TORCH_MODULE(LlamaMLP);
 
@@ -88,8 +95,12 @@ class LlamaAttentionImpl : public torch::nn::Module {
                      const QuantArgs& quant_args,
                      const ParallelArgs& parallel_args,
                      const torch::TensorOptions& options,
-                     AttentionHandler* handler) {
-    const int32_t world_size = parallel_args.world_size();
+                     AttentionHandler* handler)
+      : parallel_args_(parallel_args) {
+    // the heads are split among the ranks of the attention group
+    const ParallelArgs attn_parallel_args =
+        attention_parallel_args(parallel_args);
+    const int32_t world_size = attn_parallel_args.world_size();
     const int64_t hidden_size = args.hidden_size();
     const int64_t n_heads = args.n_heads();
     const int64_t n_kv_heads = args.n_kv_heads().value_or(n_heads);
@@ -107,7 +118,7 @@ class LlamaAttentionImpl : public torch::nn::Module {
                                                         /*bias=*/false,
                                                         /*gather_output=*/false,
                                                         quant_args,
-                                                        parallel_args,
+                                                        attn_parallel_args,
                                                         options));
 
     o_proj_ = register_module("o_proj",
@@ -116,7 +127,7 @@ class LlamaAttentionImpl : public torch::nn::Module {
                                                 /*bias=*/false,
                                                 /*input_is_parallelized=*/true,
                                                 quant_args,
-                                                parallel_args,
+                                                attn_parallel_args,
                                                 options));
 
     // initialize attention
@@ -129,6 +140,11 @@ class LlamaAttentionImpl : public torch::nn::Module {
                         torch::Tensor positions,
                         KVCache& kv_cache,
                         const InputParameters& input_params) {
+    // the projections, with the attention kernels timed separately
+    LAYER_PROFILE_SCOPE("self_attn");
+    if (parallel_args_.dp_attention_size() > 1) {
+      return data_parallel_forward(x, positions, kv_cache, input_params);
+    }
     // (num_tokens, dim) x (dim, n_local_heads * head_dim)
     // => (num_tokens, n_local_heads * head_dim)
     const auto qkv = qkv_proj_(x);
@@ -138,6 +154,32 @@ class LlamaAttentionImpl : public torch::nn::Module {
     return o_proj_(output);
   }
 
+  // the attention group runs on the rows of its sequences, the partial
+  // outputs of all groups are scattered into the rows and reduced at once.
+  torch::Tensor data_parallel_forward(torch::Tensor x,
+                                      torch::Tensor positions,
+                                      KVCache& kv_cache,
+                                      const InputParameters& input_params) {
+    CHECK_GE(input_params.dp_num_tokens, 0)
+        << "No inputs for the data parallel attention group";
+    auto output = torch::zeros_like(x);
+    const int64_t start = input_params.dp_token_offset;
+    const int64_t n_tokens = input_params.dp_num_tokens;
+    if (n_tokens > 0) {
+      const auto qkv = qkv_proj_(x.narrow(/*dim=*/0, start, n_tokens));
+      const auto attn_output =
+          atten_(qkv[0],
+                 qkv[1],
+                 qkv[2],
+                 positions.narrow(/*dim=*/0, start, n_tokens),
+                 kv_cache,
+                 input_params);
+      SkipRowParallelReduceGuard skip_reduce_guard;
+      output.narrow(/*dim=*/0, start, n_tokens).copy_(o_proj_(attn_output));
+    }
+    return reduce_from_model_parallel_region(output, parallel_args_);
+  }
+
   // load the weight from the checkpoint
   void load_state_dict(const StateDict& state_dict) {
     // call each submodule's load_state_dict function
@@ -162,6 +204,8 @@ class LlamaAttentionImpl : public torch::nn::Module {
 
   // size for q, k, v
   std::vector<int64_t> qkv_sizes_;
+
+  ParallelArgs parallel_args_;
 };
 TORCH_MODULE(LlamaAttention);
 
@@ -171,7 +215,8 @@ class LlamaDecoderLayerImpl : public torch::nn::Module {
                         const QuantArgs& quant_args,
                         const ParallelArgs& parallel_args,
                         const torch::TensorOptions& options,
-                        AttentionHandler* handler) {
+                        AttentionHandler* handler)
+      : parallel_args_(parallel_args) {
     // register submodules
     self_attn_ = register_module(
         "self_attn",
@@ -180,19 +225,37 @@ class LlamaDecoderLayerImpl : public torch::nn::Module {
                            LlamaMLP(args, quant_args, parallel_args, options));
     input_layernorm_ = register_module(
         "input_layernorm",
-        RMSNorm(args.hidden_size(), args.rms_norm_eps(), options));
+        RMSNormResidual(args.hidden_size(), args.rms_norm_eps(), options));
     post_attention_layernorm_ = register_module(
         "post_attention_layernorm",
-        RMSNorm(args.hidden_size(), args.rms_norm_eps(), options));
+        RMSNormResidual(args.hidden_size(), args.rms_norm_eps(), options));
   }
 
   torch::Tensor forward(torch::Tensor x,
                         torch::Tensor positions,
+                        torch::Tensor& residual,
                         KVCache& kv_cache,
                         const InputParameters& input_params) {
-    auto h =
-        x + self_attn_(input_layernorm_(x), positions, kv_cache, input_params);
-    return h + mlp_(post_attention_layernorm_(h));
+    // the residual adds are fused into the norms. with sequence parallelism,
+    // the norms run on the rows of this rank, which are gathered for the
+    // linears.
+    const bool sequence_parallel = sequence_parallel_enabled();
+    const int64_t n_tokens = positions.size(0);
+    auto hidden_states = input_layernorm_(x, residual);
+    if (sequence_parallel) {
+      hidden_states = gather_from_sequence_parallel_region(
+          hidden_states, n_tokens, parallel_args_);
+    }
+
+    hidden_states =
+        self_attn_(hidden_states, positions, kv_cache, input_params);
+    hidden_states = post_attention_layernorm_(hidden_states, residual);
+    if (sequence_parallel) {
+      hidden_states = gather_from_sequence_parallel_region(
+          hidden_states, n_tokens, parallel_args_);
+    }
+    hidden_states = mlp_(hidden_states);
+    return hidden_states;
   }
 
   // load the weight from the checkpoint
@@ -214,14 +277,16 @@ class LlamaDecoderLayerImpl : public torch::nn::Module {
   }
 
  private:
+  ParallelArgs parallel_args_;
+
   // parameter members, must be registered
   LlamaAttention self_attn_{nullptr};
 
   LlamaMLP mlp_{nullptr};
 
-  RMSNorm input_layernorm_{nullptr};
+  RMSNormResidual input_layernorm_{nullptr};
 
-  RMSNorm post_attention_layernorm_{nullptr};
+  RMSNormResidual post_attention_layernorm_{nullptr};
 };
 TORCH_MODULE(LlamaDecoderLayer);
 
@@ -230,7 +295,10 @@ class LlamaModelImpl : public torch::nn::Module {
   LlamaModelImpl(const ModelArgs& args,
                  const QuantArgs& quant_args,
                  const ParallelArgs& parallel_args,
-                 const torch::TensorOptions& options) {
+                 const torch::TensorOptions& options)
+      : parallel_args_(parallel_args),
+        options_(options),
+        hidden_size_(args.hidden_size()) {
     // register submodules
     embed_tokens_ = register_module(
         "embed_tokens",
@@ -240,16 +308,24 @@ class LlamaModelImpl : public torch::nn::Module {
     handler_ = AttentionHandler::create_handler_with_rope(
         args, /*interleaved=*/false, options);
 
+    // only the layers of the pipeline stage are created, with kv caches
+    // indexed from the first layer of the stage
+    std::tie(start_layer_, end_layer_) =
+        pipeline_stage_layers(args.n_layers(), parallel_args);
+    streamer_ = std::make_unique<LayerStreamer>(end_layer_ - start_layer_,
+                                                options.device());
     blocks_ = register_module("layers", torch::nn::ModuleList());
-    layers_.reserve(args.n_layers());
-    for (int32_t i = 0; i < args.n_layers(); i++) {
+    layers_.reserve(end_layer_ - start_layer_);
+    for (int32_t i = start_layer_; i < end_layer_; i++) {
       auto block = LlamaDecoderLayer(
           args, quant_args, parallel_args, options, handler_.get());
       layers_.push_back(block);
       blocks_->push_back(block);
+      streamer_->add_layer(i - start_layer_, block.ptr());
     }
     norm_ = register_module(
-        "norm", RMSNorm(args.hidden_size(), args.rms_norm_eps(), options));
+        "norm",
+        RMSNormResidual(args.hidden_size(), args.rms_norm_eps(), options));
   }
 
   // tokens: [num_tokens]
@@ -258,14 +334,43 @@ class LlamaModelImpl : public torch::nn::Module {
                         torch::Tensor positions,
                         std::vector<KVCache>& kv_caches,
                         const InputParameters& input_params) {
-    auto h = embed_tokens_(tokens);
+    torch::Tensor h;
+    torch::Tensor residual;
+    if (parallel_args_.is_first_stage()) {
+      h = embed_tokens_(tokens);
+    } else {
+      h = torch::empty({tokens.size(0), hidden_size_}, options_);
+      residual = torch::empty_like(h);
+      recv_from_prev_stage(h, residual, parallel_args_);
+    }
+
+    // the lora adapters add the full rows to the outputs of the linears
+    const int64_t n_tokens = tokens.size(0);
+    const bool sequence_parallel =
+        should_use_sequence_parallel(n_tokens, parallel_args_) &&
+        !LoRALinearImpl::slots().defined();
+    SequenceParallelGuard sequence_parallel_guard(sequence_parallel);
+    if (sequence_parallel) {
+      h = split_to_sequence_parallel_region(h, parallel_args_);
+    }
 
     // TODO: set working space for attention handler
     for (size_t i = 0; i < layers_.size(); i++) {
+      streamer_->fetch(i);
+      DECODER_LAYER_SCOPE();
       auto& layer = layers_[i];
-      h = layer(h, positions, kv_caches[i], input_params);
+      h = layer(h, positions, residual, kv_caches[i], input_params);
+    }
+    if (!parallel_args_.is_last_stage()) {
+      // the hidden states are only meaningful on the last stage
+      send_to_next_stage(h, residual, parallel_args_);
+      return h;
+    }
+    if (sequence_parallel) {
+      return gather_from_sequence_parallel_region(
+          norm_(h, residual), n_tokens, parallel_args_);
     }
-    return norm_(h);
+    return norm_(h, residual);
   }
 
   // load the weight from the checkpoint
@@ -273,8 +378,8 @@ class LlamaModelImpl : public torch::nn::Module {
     embed_tokens_->load_state_dict(state_dict.select("embed_tokens."));
     // call each layer's load_state_dict function
     for (int i = 0; i < layers_.size(); i++) {
-      layers_[i]->load_state_dict(
-          state_dict.select("layers." + std::to_string(i) + "."));
+      layers_[i]->load_state_dict(state_dict.select(
+          "layers." + std::to_string(start_layer_ + i) + "."));
     }
     norm_->load_state_dict(state_dict.select("norm."));
   }
@@ -282,13 +387,23 @@ class LlamaModelImpl : public torch::nn::Module {
   void verify_loaded_weights(const std::string& prefix) const {
     embed_tokens_->verify_loaded_weights(prefix + "embed_tokens.");
     for (int i = 0; i < layers_.size(); i++) {
-      layers_[i]->verify_loaded_weights(prefix + "layers." + std::to_string(i) +
-                                        ".");
+      layers_[i]->verify_loaded_weights(
+          prefix + "layers." + std::to_string(start_layer_ + i) + ".");
     }
     norm_->verify_loaded_weights(prefix + "norm.");
   }
 
  private:
+  ParallelArgs parallel_args_;
+
+  torch::TensorOptions options_;
+
+  int64_t hidden_size_ = 0;
+
+  // [start, end) layers of the pipeline stage
+  int32_t start_layer_ = 0;
+  int32_t end_layer_ = 0;
+
   // parameter members, must be registered
   ParallelEmbedding embed_tokens_{nullptr};
 
@@ -299,7 +414,10 @@ class LlamaModelImpl : public torch::nn::Module {
   // hold same data but different type as blocks_ to avoid type cast
   std::vector<LlamaDecoderLayer> layers_;
 
-  RMSNorm norm_{nullptr};
+  // streams the weights of the offloaded layers onto the device
+  std::unique_ptr<LayerStreamer> streamer_;
+
+  RMSNormResidual norm_{nullptr};
 };
 TORCH_MODULE(LlamaModel);
 
@@ -314,12 +432,10 @@ class LlamaForCausalLMImpl : public torch::nn::Module {
         "model", LlamaModel(args, quant_args, parallel_args, options));
 
     lm_head_ = register_module("lm_head",
-                               ColumnParallelLinear(args.hidden_size(),
-                                                    args.vocab_size(),
-                                                    /*bias=*/false,
-                                                    /*gather_output=*/true,
-                                                    parallel_args,
-                                                    options));
+                               create_lm_head(args.hidden_size(),
+                                              args.vocab_size(),
+                                              parallel_args,
+                                              options));
   }
 
   // tokens: [num_tokens]
@@ -428,13 +544,6 @@ REGISTER_MODEL_ARGS(llama, [&] {
     // TODO: support a list of eos token ids
     LOAD_ARG_OR(eos_token_id, "eos_token_id", 128001);
     LOAD_ARG_OR(rope_theta, "rope_theta", 500000.0f);
-    // load rope scaling parameters
-    LOAD_ARG(rope_scaling_rope_type, "rope_scaling.rope_type");
-    LOAD_ARG(rope_scaling_factor, "rope_scaling.factor");
-    LOAD_ARG(rope_scaling_low_freq_factor, "rope_scaling.low_freq_factor");
-    LOAD_ARG(rope_scaling_high_freq_factor, "rope_scaling.high_freq_factor");
-    LOAD_ARG(rope_scaling_original_max_position_embeddings,
-             "rope_scaling.original_max_position_embeddings");
 
     // stop token ids: "<|eom_id|>", "<|eot_id|>"
     SET_ARG(stop_token_ids, std::unordered_set<int32_t>({128008, 128009}));
@@ -468,6 +577,9 @@ REGISTER_MODEL_ARGS(llama, [&] {
     // LOAD_ARG_OR(rope_scaling, "rope_scaling", 1.0f);
   }
 
+  // load rope scaling parameters
+  LOAD_ROPE_SCALING_ARGS();
+
   LOAD_ARG_OR_FUNC(head_dim, "head_dim", [&] {
     return args->hidden_size() / args->n_heads();
   });
@@ -0,0 +1,539 @@
+#pragma once
+
+#include <ATen/ATen.h>
+#include <torch/torch.h>
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "chat_template/coded_chat_template.h"
+#include "layers/activation.h"
+#include "layers/embedding.h"
+#include "layers/linear.h"
+#include "layers/normalization.h"
+#include "llama.h"
+#include "memory/kv_cache.h"
+#include "model_parallel/parallel_args.h"
+#include "models/model_args.h"
+#include "models/model_registry.h"
+#include "models/parameters.h"
+
+// llava 1.5 model compatible with huggingface weights: a clip vision tower and
+// a projector encode the images into the embeddings of the placeholder tokens
+// of a llama language model.
+// https://huggingface.co/llava-hf/llava-1.5-7b-hf
+namespace llm::hf {
+
+// the vision encoder is small and replicated on every rank
+inline ParallelArgs vision_parallel_args() {
+  return {/*rank=*/0, /*world_size=*/1, /*process_group=*/nullptr};
+}
+
+class CLIPVisionEmbeddingsImpl : public torch::nn::Module {
+ public:
+  CLIPVisionEmbeddingsImpl(const ModelArgs& args,
+                           const torch::TensorOptions& options)
+      : patch_size_(args.patch_size()) {
+    const int64_t hidden_size = args.vision_hidden_size();
+    const int64_t n_patches_per_side = args.image_size() / args.patch_size();
+    const int64_t n_positions = n_patches_per_side * n_patches_per_side + 1;
+
+    // register the weight parameter
+    class_embedding_ = register_parameter("class_embedding",
+                                          torch::empty({hidden_size}, options),
+                                          /*requires_grad=*/false);
+    patch_embedding_ = register_parameter(
+        "patch_embedding",
+        torch::empty({hidden_size, 3, patch_size_, patch_size_}, options),
+        /*requires_grad=*/false);
+    position_embedding_ = register_module(
+        "position_embedding", Embedding(n_positions, hidden_size, options));
+  }
+
+  // pixel_values: [n_images, 3, image_size, image_size]
+  // returns: [n_images, n_patches + 1, hidden_size]
+  torch::Tensor forward(torch::Tensor pixel_values) {
+    namespace F = torch::nn::functional;
+    const int64_t n_images = pixel_values.size(0);
+    // [n_images, hidden_size, n_patches_per_side, n_patches_per_side]
+    auto patches = F::conv2d(pixel_values.to(patch_embedding_.dtype()),
+                             patch_embedding_,
+                             F::Conv2dFuncOptions().stride(patch_size_));
+    // => [n_images, n_patches, hidden_size]
+    patches = patches.flatten(/*start_dim=*/2).transpose(1, 2);
+    const auto class_embeds =
+        class_embedding_.expand({n_images, 1, class_embedding_.size(0)});
+    return torch::cat({class_embeds, patches}, /*dim=*/1) +
+           position_embedding_->weight().unsqueeze(0);
+  }
+
+  // load the weight from the checkpoint
+  void load_state_dict(const StateDict& state_dict) {
+    class_embedding_is_loaded_ |=
+        load_tensor(state_dict, "class_embedding", class_embedding_);
+    patch_embedding_is_loaded_ |=
+        load_tensor(state_dict, "patch_embedding.weight", patch_embedding_);
+    position_embedding_->load_state_dict(
+        state_dict.select("position_embedding."));
+  }
+
+  void verify_loaded_weights(const std::string& prefix) const {
+    CHECK(class_embedding_is_loaded_)
+        << "weight is not loaded for " << prefix + "class_embedding";
+    CHECK(patch_embedding_is_loaded_)
+        << "weight is not loaded for " << prefix + "patch_embedding.weight";
+    position_embedding_->verify_loaded_weights(prefix + "position_embedding.");
+  }
+
+ private:
+  // returns false if the tensor is not in the checkpoint
+  static bool load_tensor(const StateDict& state_dict,
+                          const std::string& name,
+                          torch::Tensor& tensor) {
+    const auto weight = state_dict.get_tensor(name);
+    if (!weight.defined()) {
+      return false;
+    }
+    CHECK_EQ(tensor.sizes(), weight.sizes())
+        << "weight size mismatch for " << name;
+    tensor.copy_(weight);
+    return true;
+  }
+
+  int64_t patch_size_ = 0;
+
+  // parameter members, must be registered
+  torch::Tensor class_embedding_{nullptr};
+
+  // [hidden_size, 3, patch_size, patch_size] weight of the patch conv
+  torch::Tensor patch_embedding_{nullptr};
+
+  Embedding position_embedding_{nullptr};
+
+  // whether the weights are loaded
+  bool class_embedding_is_loaded_ = false;
+  bool patch_embedding_is_loaded_ = false;
+};
+TORCH_MODULE(CLIPVisionEmbeddings);
+
+class CLIPAttentionImpl : public torch::nn::Module {
+ public:
+  CLIPAttentionImpl(const ModelArgs& args, const torch::TensorOptions& options)
+      : n_heads_(args.vision_n_heads()) {
+    const int64_t hidden_size = args.vision_hidden_size();
+    head_dim_ = hidden_size / n_heads_;
+
+    // register submodules
+    auto create_proj = [&](const char* name) {
+      return register_module(name,
+                             ColumnParallelLinear(hidden_size,
+                                                  hidden_size,
+                                                  /*bias=*/true,
+                                                  /*gather_output=*/true,
+                                                  vision_parallel_args(),
+                                                  options));
+    };
+    q_proj_ = create_proj("q_proj");
+    k_proj_ = create_proj("k_proj");
+    v_proj_ = create_proj("v_proj");
+    out_proj_ = create_proj("out_proj");
+  }
+
+  // x: [n_images * n_tokens, hidden_size], the tokens of each image attend to
+  // all the tokens of the image.
+  torch::Tensor forward(torch::Tensor x, int64_t n_images) {
+    auto split_heads = [&](const torch::Tensor& t) {
+      // => [n_images, n_heads, n_tokens, head_dim]
+      return t.view({n_images, -1, n_heads_, head_dim_}).transpose(1, 2);
+    };
+    const auto q = split_heads(q_proj_(x));
+    const auto k = split_heads(k_proj_(x));
+    const auto v = split_heads(v_proj_(x));
+    const auto output = at::scaled_dot_product_attention(q, k, v);
+    return out_proj_(output.transpose(1, 2).reshape(x.sizes()));
+  }
+
+  // load the weight from the checkpoint
+  void load_state_dict(const StateDict& state_dict) {
+    q_proj_->load_state_dict(state_dict.select("q_proj."));
+    k_proj_->load_state_dict(state_dict.select("k_proj."));
+    v_proj_->load_state_dict(state_dict.select("v_proj."));
+    out_proj_->load_state_dict(state_dict.select("out_proj."));
+  }
+
+  void verify_loaded_weights(const std::string& prefix) const {
+    q_proj_->verify_loaded_weights(prefix + "q_proj.");
+    k_proj_->verify_loaded_weights(prefix + "k_proj.");
+    v_proj_->verify_loaded_weights(prefix + "v_proj.");
+    out_proj_->verify_loaded_weights(prefix + "out_proj.");
+  }
+
+ private:
+  // parameter members, must be registered
+  ColumnParallelLinear q_proj_{nullptr};
+  ColumnParallelLinear k_proj_{nullptr};
+  ColumnParallelLinear v_proj_{nullptr};
+  ColumnParallelLinear out_proj_{nullptr};
+
+  int64_t n_heads_ = 0;
+  int64_t head_dim_ = 0;
+};
+TORCH_MODULE(CLIPAttention);
+
+class CLIPMLPImpl : public torch::nn::Module {
+ public:
+  CLIPMLPImpl(int64_t in_features,
+              int64_t intermediate_size,
+              int64_t out_features,
+              const std::string& hidden_act,
+              const torch::TensorOptions& options) {
+    act_ = Activation::get_act_func(hidden_act, options.device());
+    CHECK(act_ != nullptr);
+
+    // register submodules
+    fc1_ = register_module("fc1",
+                           ColumnParallelLinear(in_features,
+                                                intermediate_size,
+                                                /*bias=*/true,
+                                                /*gather_output=*/true,
+                                                vision_parallel_args(),
+                                                options));
+    fc2_ = register_module("fc2",
+                           ColumnParallelLinear(intermediate_size,
+                                                out_features,
+                                                /*bias=*/true,
+                                                /*gather_output=*/true,
+                                                vision_parallel_args(),
+                                                options));
+  }
+
+  torch::Tensor forward(torch::Tensor x) { return fc2_(act_(fc1_(x))); }
+
+  // load the weight from the checkpoint with the names of the two linears
+  void load_state_dict(const StateDict& state_dict,
+                       const std::string& fc1_name = "fc1.",
+                       const std::string& fc2_name = "fc2.") {
+    fc1_->load_state_dict(state_dict.select(fc1_name));
+    fc2_->load_state_dict(state_dict.select(fc2_name));
+  }
+
+  void verify_loaded_weights(const std::string& prefix,
+                             const std::string& fc1_name = "fc1.",
+                             const std::string& fc2_name = "fc2.") const {
+    fc1_->verify_loaded_weights(prefix + fc1_name);
+    fc2_->verify_loaded_weights(prefix + fc2_name);
+  }
+
+ private:
+  // parameter members, must be registered
+  ColumnParallelLinear fc1_{nullptr};
+  ColumnParallelLinear fc2_{nullptr};
+
+  ActFunc act_{nullptr};
+};
+TORCH_MODULE(CLIPMLP);
+
+class CLIPEncoderLayerImpl : public torch::nn::Module {
+ public:
+  CLIPEncoderLayerImpl(const ModelArgs& args,
+                       const torch::TensorOptions& options) {
+    const int64_t hidden_size = args.vision_hidden_size();
+    const float eps = args.vision_layer_norm_eps();
+    // register submodules
+    self_attn_ = register_module("self_attn", CLIPAttention(args, options));
+    layer_norm1_ = register_module(
+        "layer_norm1", LayerNorm(hidden_size, eps, /*bias=*/true, options));
+    mlp_ = register_module("mlp",
+                           CLIPMLP(hidden_size,
+                                   args.vision_intermediate_size(),
+                                   hidden_size,
+                                   args.vision_hidden_act(),
+                                   options));
+    layer_norm2_ = register_module(
+        "layer_norm2", LayerNorm(hidden_size, eps, /*bias=*/true, options));
+  }
+
+  // x: [n_images * n_tokens, hidden_size]
+  torch::Tensor forward(torch::Tensor x, int64_t n_images) {
+    x = x + self_attn_(layer_norm1_(x), n_images);
+    return x + mlp_(layer_norm2_(x));
+  }
+
+  // load the weight from the checkpoint
+  void load_state_dict(const StateDict& state_dict) {
+    self_attn_->load_state_dict(state_dict.select("self_attn."));
+    layer_norm1_->load_state_dict(state_dict.select("layer_norm1."));
+    mlp_->load_state_dict(state_dict.select("mlp."));
+    layer_norm2_->load_state_dict(state_dict.select("layer_norm2."));
+  }
+
+  void verify_loaded_weights(const std::string& prefix) const {
+    self_attn_->verify_loaded_weights(prefix + "self_attn.");
+    layer_norm1_->verify_loaded_weights(prefix + "layer_norm1.");
+    mlp_->verify_loaded_weights(prefix + "mlp.");
+    layer_norm2_->verify_loaded_weights(prefix + "layer_norm2.");
+  }
+
+ private:
+  // parameter members, must be registered
+  CLIPAttention self_attn_{nullptr};
+
+  LayerNorm layer_norm1_{nullptr};
+
+  CLIPMLP mlp_{nullptr};
+
+  LayerNorm layer_norm2_{nullptr};
+};
+TORCH_MODULE(CLIPEncoderLayer);
+
+// the clip vision transformer up to the feature layer, the layers after it
+// and the post layernorm are not used.
+class CLIPVisionModelImpl : public torch::nn::Module {
+ public:
+  CLIPVisionModelImpl(const ModelArgs& args,
+                      const torch::TensorOptions& options) {
+    const int64_t n_layers = args.vision_n_layers();
+    const int64_t feature_layer = args.vision_feature_layer();
+    // the outputs of layer i are the hidden states i + 1, the hidden states 0
+    // are the embeddings
+    n_used_layers_ =
+        feature_layer >= 0 ? feature_layer : n_layers + 1 + feature_layer;
+    CHECK(n_used_layers_ >= 0 && n_used_layers_ <= n_layers)
+        << "Invalid vision feature layer " << feature_layer;
+
+    // register submodules
+    embeddings_ =
+        register_module("embeddings", CLIPVisionEmbeddings(args, options));
+    pre_layrnorm_ = register_module("pre_layrnorm",
+                                    LayerNorm(args.vision_hidden_size(),
+                                              args.vision_layer_norm_eps(),
+                                              /*bias=*/true,
+                                              options));
+    blocks_ = register_module("layers", torch::nn::ModuleList());
+    layers_.reserve(n_used_layers_);
+    for (int64_t i = 0; i < n_used_layers_; i++) {
+      auto block = CLIPEncoderLayer(args, options);
+      layers_.push_back(block);
+      blocks_->push_back(block);
+    }
+  }
+
+  // pixel_values: [n_images, 3, image_size, image_size]
+  // returns: [n_images, n_patches, hidden_size], without the class token
+  torch::Tensor forward(torch::Tensor pixel_values) {
+    const int64_t n_images = pixel_values.size(0);
+    auto h = embeddings_(pixel_values);
+    const auto sizes = h.sizes().vec();
+    h = pre_layrnorm_(h.flatten(/*start_dim=*/0, /*end_dim=*/1));
+    for (auto& layer : layers_) {
+      h = layer(h, n_images);
+    }
+    return h.view(sizes).narrow(/*dim=*/1, /*start=*/1, sizes[1] - 1);
+  }
+
+  // load the weight from the checkpoint
+  void load_state_dict(const StateDict& state_dict) {
+    embeddings_->load_state_dict(state_dict.select("embeddings."));
+    pre_layrnorm_->load_state_dict(state_dict.select("pre_layrnorm."));
+    for (size_t i = 0; i < layers_.size(); i++) {
+      layers_[i]->load_state_dict(
+          state_dict.select("encoder.layers." + std::to_string(i) + "."));
+    }
+  }
+
+  void verify_loaded_weights(const std::string& prefix) const {
+    embeddings_->verify_loaded_weights(prefix + "embeddings.");
+    pre_layrnorm_->verify_loaded_weights(prefix + "pre_layrnorm.");
+    for (size_t i = 0; i < layers_.size(); i++) {
+      layers_[i]->verify_loaded_weights(prefix + "encoder.layers." +
+                                        std::to_string(i) + ".");
+    }
+  }
+
+ private:
+  int64_t n_used_layers_ = 0;
+
+  // parameter members, must be registered
+  CLIPVisionEmbeddings embeddings_{nullptr};
+
+  LayerNorm pre_layrnorm_{nullptr};
+
+  torch::nn::ModuleList blocks_{nullptr};
+  // hold same data but different type as blocks_ to avoid type cast
+  std::vector<CLIPEncoderLayer> layers_;
+};
+TORCH_MODULE(CLIPVisionModel);
+
+class LlavaVisionEncoderImpl : public torch::nn::Module {
+ public:
+  LlavaVisionEncoderImpl(const ModelArgs& args,
+                         const torch::TensorOptions& options) {
+    // register submodules
+    vision_tower_ =
+        register_module("vision_tower", CLIPVisionModel(args, options));
+    projector_ = register_module("multi_modal_projector",
+                                 CLIPMLP(args.vision_hidden_size(),
+                                         args.hidden_size(),
+                                         args.hidden_size(),
+                                         args.projector_hidden_act(),
+                                         options));
+  }
+
+  // pixel_values: [n_images, 3, image_size, image_size]
+  // returns: [n_images, n_patches, hidden_size] of the language model
+  torch::Tensor forward(torch::Tensor pixel_values) {
+    const auto features = vision_tower_(pixel_values);
+    const auto sizes = features.sizes();
+    return projector_(features.flatten(/*start_dim=*/0, /*end_dim=*/1))
+        .view({sizes[0], sizes[1], -1});
+  }
+
+  // load the weight from the checkpoint
+  void load_state_dict(const StateDict& state_dict) {
+    vision_tower_->load_state_dict(
+        state_dict.select("vision_tower.vision_model."));
+    projector_->load_state_dict(
+        state_dict.select("multi_modal_projector."), "linear_1.", "linear_2.");
+  }
+
+  void verify_loaded_weights() const {
+    vision_tower_->verify_loaded_weights("vision_tower.vision_model.");
+    projector_->verify_loaded_weights(
+        "multi_modal_projector.", "linear_1.", "linear_2.");
+  }
+
+ private:
+  // parameter members, must be registered
+  CLIPVisionModel vision_tower_{nullptr};
+
+  CLIPMLP projector_{nullptr};
+};
+TORCH_MODULE(LlavaVisionEncoder);
+
+// the language model of llava, the image embeddings are merged into the
+// token embeddings by the worker, see ImageEmbeddings.
+class LlavaForCausalLMImpl : public torch::nn::Module {
+ public:
+  LlavaForCausalLMImpl(const ModelArgs& args,
+                       const QuantArgs& quant_args,
+                       const ParallelArgs& parallel_args,
+                       const torch::TensorOptions& options) {
+    // register submodules
+    language_model_ = register_module(
+        "language_model",
+        LlamaForCausalLM(args, quant_args, parallel_args, options));
+  }
+
+  // tokens: [num_tokens]
+  // positions: [num_tokens] token pos in the sequence
+  // returns: [num_tokens, hidden_size]
+  torch::Tensor forward(const torch::Tensor& tokens,
+                        const torch::Tensor& positions,
+                        std::vector<KVCache>& kv_caches,
+                        const InputParameters& input_params) {
+    return language_model_(tokens, positions, kv_caches, input_params);
+  }
+
+  // hidden_states: [num_tokens, hidden_size]
+  // seleted_idxes: [num_tokens]
+  // returns: [num_tokens, vocab_size]
+  torch::Tensor logits(const torch::Tensor& hidden_states,
+                       const torch::Tensor& seleted_idxes) {
+    return language_model_->logits(hidden_states, seleted_idxes);
+  }
+
+  // load the weight from the checkpoint, the vision encoder is loaded
+  // separately
+  void load_state_dict(const StateDict& state_dict) {
+    language_model_->load_state_dict(state_dict.select("language_model."));
+  }
+
+  void verify_loaded_weights() const {
+    language_model_->verify_loaded_weights();
+  }
+
+ private:
+  // parameter members, must be registered
+  LlamaForCausalLM language_model_{nullptr};
+};
+TORCH_MODULE(LlavaForCausalLM);
+
+class LlavaChatTemplate final : public CodedChatTemplate {
+ public:
+  // generate prompt from dialogs
+  // https://huggingface.co/llava-hf/llava-1.5-7b-hf
+  // Prompt template:
+  // USER: <image>\n {message} ASSISTANT: {message}</s>USER: ...
+  std::optional<std::string> get_prompt(
+      const std::string_view& system_message,
+      const std::vector<std::string_view>& messages) const override {
+    // at least one user message
+    if (messages.size() % 2 == 0) {
+      return std::nullopt;
+    }
+
+    std::stringstream ss;
+    if (!system_message.empty()) {
+      ss << system_message << " ";
+    }
+
+    // then user and assistant message pairs (u/a/u/a/u...)
+    for (size_t i = 0; i < messages.size(); ++i) {
+      if (i % 2 == 0) {
+        ss << "USER: " << messages[i] << " ";
+      } else {
+        ss << "ASSISTANT: " << messages[i] << "</s>";
+      }
+    }
+    // end with assistant message
+    ss << "ASSISTANT:";
+    return ss.str();
+  }
+};
+
+// register the causal model and its vision encoder
+REGISTER_CAUSAL_MODEL(llava, LlavaForCausalLM);
+REGISTER_VISION_ENCODER(llava, LlavaVisionEncoder);
+REGISTER_DEFAULT_CHAT_TEMPLATE(llava, LlavaChatTemplate);
+// register the model args
+// example config:
+// https://huggingface.co/llava-hf/llava-1.5-7b-hf/blob/main/config.json
+REGISTER_MODEL_ARGS(llava, [&] {
+  LOAD_ARG_OR(model_type, "model_type", "llava");
+  LOAD_ARG_OR(dtype, "torch_dtype", "");
+
+  // the language model, with the defaults of llama 2
+  LOAD_ARG_OR(vocab_size, "text_config.vocab_size", 32064);
+  LOAD_ARG_OR(hidden_size, "text_config.hidden_size", 4096);
+  LOAD_ARG_OR(n_layers, "text_config.num_hidden_layers", 32);
+  LOAD_ARG_OR(n_heads, "text_config.num_attention_heads", 32);
+  LOAD_ARG(n_kv_heads, "text_config.num_key_value_heads");
+  LOAD_ARG_OR(intermediate_size, "text_config.intermediate_size", 11008);
+  LOAD_ARG_OR(hidden_act, "text_config.hidden_act", "silu");
+  LOAD_ARG_OR(
+      max_position_embeddings, "text_config.max_position_embeddings", 4096);
+  LOAD_ARG_OR(rms_norm_eps, "text_config.rms_norm_eps", 1e-5);
+  LOAD_ARG_OR(bos_token_id, "text_config.bos_token_id", 1);
+  LOAD_ARG_OR(eos_token_id, "text_config.eos_token_id", 2);
+  LOAD_ARG_OR(rope_theta, "text_config.rope_theta", 10000.0f);
+  LOAD_ARG_OR_FUNC(head_dim, "text_config.head_dim", [&] {
+    return args->hidden_size() / args->n_heads();
+  });
+
+  // the clip vision tower, with the defaults of clip-vit-large-patch14-336
+  LOAD_ARG_OR(vision_hidden_size, "vision_config.hidden_size", 1024);
+  LOAD_ARG_OR(
+      vision_intermediate_size, "vision_config.intermediate_size", 4096);
+  LOAD_ARG_OR(vision_n_layers, "vision_config.num_hidden_layers", 24);
+  LOAD_ARG_OR(vision_n_heads, "vision_config.num_attention_heads", 16);
+  LOAD_ARG_OR(vision_hidden_act, "vision_config.hidden_act", "quick_gelu");
+  LOAD_ARG_OR(vision_layer_norm_eps, "vision_config.layer_norm_eps", 1e-5);
+  LOAD_ARG_OR(image_size, "vision_config.image_size", 336);
+  LOAD_ARG_OR(patch_size, "vision_config.patch_size", 14);
+  LOAD_ARG_OR(vision_feature_layer, "vision_feature_layer", -2);
+  LOAD_ARG_OR(projector_hidden_act, "projector_hidden_act", "gelu");
+  LOAD_ARG_OR(image_token_id, "image_token_index", 32000);
+});
+
+}  // namespace llm::hf
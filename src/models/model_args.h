@@ -5,6 +5,7 @@
 #include <ostream>
 #include <string>
 #include <unordered_set>
+#include <vector>
 
 #include "common/macros.h"
 
@@ -59,6 +60,17 @@ struct ModelArgs {
   DEFINE_ARG(float, rope_scaling_low_freq_factor) = 0.0f;
   DEFINE_ARG(float, rope_scaling_high_freq_factor) = 0.0f;
   DEFINE_ARG(int64_t, rope_scaling_original_max_position_embeddings) = 0;
+  // yarn rope scaling
+  DEFINE_ARG(float, rope_scaling_beta_fast) = 32.0f;
+  DEFINE_ARG(float, rope_scaling_beta_slow) = 1.0f;
+  DEFINE_ARG(float, rope_scaling_mscale) = 1.0f;
+  DEFINE_ARG(float, rope_scaling_mscale_all_dim) = 0.0f;
+  // longrope rope scaling: the rescale factors of the frequencies within and
+  // beyond the original context.
+  DEFINE_ARG(std::vector<float>, rope_scaling_short_factor);
+  DEFINE_ARG(std::vector<float>, rope_scaling_long_factor);
+  // the scale of cos and sin, the default of the rope type if not set.
+  DEFINE_ARG(std::optional<float>, rope_scaling_attention_factor);
 
   // percentage of hidden dimension to allocate to rotary position embeddings.
   DEFINE_ARG(float, rotary_pct) = 1.0f;
@@ -125,6 +137,70 @@ struct ModelArgs {
   DEFINE_ARG(bool, use_sliding_window) = false;
   DEFINE_ARG(int32_t, sliding_window) = -1;
   DEFINE_ARG(int32_t, max_window_layers) = 0;
+
+  // mixture of experts related args
+  // number of experts of each moe layer.
+  DEFINE_ARG(int64_t, n_experts) = 0;
+
+  // number of experts selected for each token.
+  DEFINE_ARG(int64_t, n_experts_per_tok) = 0;
+
+  // intermediate size of each expert, intermediate_size if 0.
+  DEFINE_ARG(int64_t, moe_intermediate_size) = 0;
+
+  // number of experts that every token is sent to, besides the routed ones.
+  DEFINE_ARG(int64_t, n_shared_experts) = 0;
+
+  // number of leading decoder layers with a dense mlp instead of experts.
+  DEFINE_ARG(int64_t, first_k_dense_replace) = 0;
+
+  // experts are routed among the topk_group groups of experts with the
+  // highest scores if n_expert_groups > 1.
+  DEFINE_ARG(int64_t, n_expert_groups) = 1;
+  DEFINE_ARG(int64_t, topk_group) = 1;
+
+  // whether to renormalize the weights of the selected experts.
+  DEFINE_ARG(bool, norm_topk_prob) = false;
+
+  // scaling factor of the output of the routed experts.
+  DEFINE_ARG(float, routed_scaling_factor) = 1.0f;
+
+  // multi-head latent attention related args
+  // rank of the low-rank query projection, 0 for a full projection.
+  DEFINE_ARG(int64_t, q_lora_rank) = 0;
+
+  // rank of the latent that keys and values are projected from.
+  DEFINE_ARG(int64_t, kv_lora_rank) = 0;
+
+  // dimensions of the query/key head without and with rotary embeddings.
+  DEFINE_ARG(int64_t, qk_nope_head_dim) = 0;
+  DEFINE_ARG(int64_t, qk_rope_head_dim) = 0;
+
+  // dimension of the value head.
+  DEFINE_ARG(int64_t, v_head_dim) = 0;
+
+  // vision encoder related args, only set for the vision-language models.
+  DEFINE_ARG(int64_t, vision_hidden_size) = 0;
+  DEFINE_ARG(int64_t, vision_intermediate_size) = 0;
+  DEFINE_ARG(int64_t, vision_n_layers) = 0;
+  DEFINE_ARG(int64_t, vision_n_heads) = 0;
+  DEFINE_ARG(std::string, vision_hidden_act);
+  DEFINE_ARG(float, vision_layer_norm_eps) = 1e-5f;
+
+  // size of the square input images and of their patches, each patch is
+  // encoded into one image token.
+  DEFINE_ARG(int64_t, image_size) = 0;
+  DEFINE_ARG(int64_t, patch_size) = 0;
+
+  // the encoder layer whose outputs are projected into the image embeddings,
+  // negative to count from the last layer.
+  DEFINE_ARG(int64_t, vision_feature_layer) = -1;
+
+  // activation of the projector from the vision to the text hidden states.
+  DEFINE_ARG(std::string, projector_hidden_act);
+
+  // token id of the image placeholders in the prompts, -1 if no images.
+  DEFINE_ARG(int32_t, image_token_id) = -1;
 };
 
 inline std::ostream& operator<<(std::ostream& os, const ModelArgs& args) {
@@ -150,6 +226,17 @@ inline std::ostream& operator<<(std::ostream& os, const ModelArgs& args) {
      << args.rope_scaling_high_freq_factor();
   os << ", rope_scaling_original_max_position_embeddings: "
      << args.rope_scaling_original_max_position_embeddings();
+  os << ", rope_scaling_beta_fast: " << args.rope_scaling_beta_fast();
+  os << ", rope_scaling_beta_slow: " << args.rope_scaling_beta_slow();
+  os << ", rope_scaling_mscale: " << args.rope_scaling_mscale();
+  os << ", rope_scaling_mscale_all_dim: "
+     << args.rope_scaling_mscale_all_dim();
+  os << ", rope_scaling_short_factor size: "
+     << args.rope_scaling_short_factor().size();
+  os << ", rope_scaling_long_factor size: "
+     << args.rope_scaling_long_factor().size();
+  os << ", rope_scaling_attention_factor: "
+     << args.rope_scaling_attention_factor().value_or(0.0f);
   os << ", rotary_pct: " << args.rotary_pct();
   os << ", max_position_embeddings: " << args.max_position_embeddings();
   os << ", bos_token_id: " << args.bos_token_id();
@@ -163,6 +250,25 @@ inline std::ostream& operator<<(std::ostream& os, const ModelArgs& args) {
   os << ", linear_bias: " << args.linear_bias();
   os << ", qkv_bias: " << args.qkv_bias();
   os << ", residual_post_layernorm: " << args.residual_post_layernorm();
+  os << ", n_experts: " << args.n_experts();
+  os << ", n_experts_per_tok: " << args.n_experts_per_tok();
+  os << ", moe_intermediate_size: " << args.moe_intermediate_size();
+  os << ", n_shared_experts: " << args.n_shared_experts();
+  os << ", first_k_dense_replace: " << args.first_k_dense_replace();
+  os << ", n_expert_groups: " << args.n_expert_groups();
+  os << ", topk_group: " << args.topk_group();
+  os << ", norm_topk_prob: " << args.norm_topk_prob();
+  os << ", routed_scaling_factor: " << args.routed_scaling_factor();
+  os << ", q_lora_rank: " << args.q_lora_rank();
+  os << ", kv_lora_rank: " << args.kv_lora_rank();
+  os << ", qk_nope_head_dim: " << args.qk_nope_head_dim();
+  os << ", qk_rope_head_dim: " << args.qk_rope_head_dim();
+  os << ", v_head_dim: " << args.v_head_dim();
+  os << ", vision_hidden_size: " << args.vision_hidden_size();
+  os << ", vision_n_layers: " << args.vision_n_layers();
+  os << ", image_size: " << args.image_size();
+  os << ", patch_size: " << args.patch_size();
+  os << ", image_token_id: " << args.image_token_id();
   os << "]";
   return os;
 }
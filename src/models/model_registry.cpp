@@ -2,6 +2,10 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
 #include "models.h"  // IWYU pragma: keep
 
 namespace llm {
@@ -21,6 +25,18 @@ void ModelRegistry::register_causallm_factory(const std::string& name,
   }
 }
 
+void ModelRegistry::register_vision_encoder_factory(
+    const std::string& name,
+    VisionEncoderFactory factory) {
+  ModelRegistry* instance = get_instance();
+  if (instance->model_registry_[name].vision_encoder_factory != nullptr) {
+    LOG(WARNING) << "vision encoder factory for " << name
+                 << "already registered.";
+  } else {
+    instance->model_registry_[name].vision_encoder_factory = factory;
+  }
+}
+
 void ModelRegistry::register_model_args_loader(const std::string& name,
                                                ModelArgsLoader loader) {
   ModelRegistry* instance = get_instance();
@@ -69,6 +85,12 @@ CausalLMFactory ModelRegistry::get_causallm_factory(const std::string& name) {
   return instance->model_registry_[name].causal_lm_factory;
 }
 
+VisionEncoderFactory ModelRegistry::get_vision_encoder_factory(
+    const std::string& name) {
+  ModelRegistry* instance = get_instance();
+  return instance->model_registry_[name].vision_encoder_factory;
+}
+
 ModelArgsLoader ModelRegistry::get_model_args_loader(const std::string& name) {
   ModelRegistry* instance = get_instance();
   return instance->model_registry_[name].model_args_loader;
@@ -91,4 +113,17 @@ ChatTemplateFactory ModelRegistry::get_default_chat_template_factory(
   return instance->model_registry_[name].chat_template_factory;
 }
 
+std::vector<std::string> ModelRegistry::get_registered_models() {
+  ModelRegistry* instance = get_instance();
+  std::vector<std::string> names;
+  for (const auto& [name, meta] : instance->model_registry_) {
+    if (meta.causal_lm_factory != nullptr &&
+        meta.model_args_loader != nullptr) {
+      names.push_back(name);
+    }
+  }
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
 }  // namespace llm
@@ -3,6 +3,7 @@
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "causal_lm.h"
 #include "chat_template/chat_template.h"
@@ -12,6 +13,7 @@
 #include "model_parallel/parallel_args.h"
 #include "quantization/quant_args.h"
 #include "tokenizer/tokenizer_args.h"
+#include "vision_encoder.h"
 
 namespace llm {
 
@@ -21,6 +23,10 @@ using CausalLMFactory = std::function<std::unique_ptr<CausalLM>(
     const ParallelArgs& parallel_args,
     const torch::TensorOptions& options)>;
 
+using VisionEncoderFactory = std::function<std::unique_ptr<VisionEncoder>(
+    const ModelArgs& args,
+    const torch::TensorOptions& options)>;
+
 using ChatTemplateFactory = std::function<std::unique_ptr<ChatTemplate>()>;
 
 using ModelArgsLoader =
@@ -35,6 +41,7 @@ using TokenizerArgsLoader =
 // TODO: add default args loader.
 struct ModelMeta {
   CausalLMFactory causal_lm_factory;
+  VisionEncoderFactory vision_encoder_factory;
   ChatTemplateFactory chat_template_factory;
   ModelArgsLoader model_args_loader;
   QuantArgsLoader quant_args_loader;
@@ -50,6 +57,9 @@ class ModelRegistry {
   static void register_causallm_factory(const std::string& name,
                                         CausalLMFactory factory);
 
+  static void register_vision_encoder_factory(const std::string& name,
+                                             VisionEncoderFactory factory);
+
   static void register_model_args_loader(const std::string& name,
                                          ModelArgsLoader loader);
 
@@ -65,6 +75,9 @@ class ModelRegistry {
 
   static CausalLMFactory get_causallm_factory(const std::string& name);
 
+  static VisionEncoderFactory get_vision_encoder_factory(
+      const std::string& name);
+
   static ModelArgsLoader get_model_args_loader(const std::string& name);
 
   static QuantArgsLoader get_quant_args_loader(const std::string& name);
@@ -74,6 +87,10 @@ class ModelRegistry {
   static ChatTemplateFactory get_default_chat_template_factory(
       const std::string& name);
 
+  // names of the models with a causal lm factory and a model args loader,
+  // sorted
+  static std::vector<std::string> get_registered_models();
+
  private:
   std::unordered_map<std::string, ModelMeta> model_registry_;
 };
@@ -98,6 +115,23 @@ class ModelRegistry {
 #define REGISTER_CAUSAL_MODEL(ModelType, ModelClass) \
   REGISTER_CAUSAL_MODEL_WITH_VARNAME(ModelType, ModelType, ModelClass)
 
+// Macro to register the vision encoder of a vision-language model
+#define REGISTER_VISION_ENCODER_WITH_VARNAME(VarName, ModelType, ModelClass) \
+  const bool VarName##_vision_encoder_registered = []() {                    \
+    ModelRegistry::register_vision_encoder_factory(                          \
+        #ModelType,                                                          \
+        [](const ModelArgs& args, const torch::TensorOptions& options) {     \
+          ModelClass model(args, options);                                   \
+          model->eval();                                                     \
+          return std::make_unique<llm::VisionEncoderImpl<ModelClass>>(       \
+              std::move(model), options);                                    \
+        });                                                                  \
+    return true;                                                             \
+  }()
+
+#define REGISTER_VISION_ENCODER(ModelType, ModelClass) \
+  REGISTER_VISION_ENCODER_WITH_VARNAME(ModelType, ModelType, ModelClass)
+
 #define REGISTER_DEFAULT_CHAT_TEMPLATE_WITH_VARNAME(                         \
     VarName, ModelType, ChatTemplateClass)                                   \
   const bool VarName##_chat_template_registered = []() {                     \
@@ -194,4 +228,28 @@ class ModelRegistry {
 
 #define SET_ARG(arg_name, value) [&] { args->arg_name() = value; }()
 
+// load the rope scaling args of the huggingface config, the type is named
+// "type" by older configs and "rope_type" by newer ones.
+#define LOAD_ROPE_SCALING_ARGS()                                            \
+  [&] {                                                                     \
+    LOAD_ARG(rope_scaling_rope_type, "rope_scaling.type");                  \
+    LOAD_ARG(rope_scaling_rope_type, "rope_scaling.rope_type");             \
+    LOAD_ARG(rope_scaling_factor, "rope_scaling.factor");                   \
+    LOAD_ARG(rope_scaling_low_freq_factor, "rope_scaling.low_freq_factor"); \
+    LOAD_ARG(rope_scaling_high_freq_factor,                                 \
+             "rope_scaling.high_freq_factor");                              \
+    LOAD_ARG(rope_scaling_original_max_position_embeddings,                 \
+             "original_max_position_embeddings");                           \
+    LOAD_ARG(rope_scaling_original_max_position_embeddings,                 \
+             "rope_scaling.original_max_position_embeddings");              \
+    LOAD_ARG(rope_scaling_beta_fast, "rope_scaling.beta_fast");             \
+    LOAD_ARG(rope_scaling_beta_slow, "rope_scaling.beta_slow");             \
+    LOAD_ARG(rope_scaling_mscale, "rope_scaling.mscale");                   \
+    LOAD_ARG(rope_scaling_mscale_all_dim, "rope_scaling.mscale_all_dim");   \
+    LOAD_ARG(rope_scaling_short_factor, "rope_scaling.short_factor");       \
+    LOAD_ARG(rope_scaling_long_factor, "rope_scaling.long_factor");         \
+    LOAD_ARG(rope_scaling_attention_factor,                                 \
+             "rope_scaling.attention_factor");                              \
+  }()
+
 }  // namespace llm
@@ -1,19 +1,22 @@
 #pragma once
 
 // list all registered models here
-#include "aquila.h"      // IWYU pragma: keep
-#include "baichuan.h"    // IWYU pargma: keep
-#include "bloom.h"       // IWYU pragma: keep
-#include "chatglm.h"     // IWYU pragma: keep
-#include "gemma.h"       // IWYU pragma: keep
-#include "gemma2.h"      // IWYU pragma: keep
-#include "gpt2.h"        // IWYU pragma: keep
-#include "gpt_j.h"       // IWYU pragma: keep
-#include "gpt_neox.h"    // IWYU pragma: keep
-#include "internlm.h"    // IWYU pragma: keep
-#include "llama.h"       // IWYU pragma: keep
-#include "mistral.h"     // IWYU pragma: keep
-#include "mpt.h"         // IWYU pragma: keep
-#include "phi.h"         // IWYU pragma: keep
-#include "qwen.h"        // IWYU pragma: keep
-#include "qwen2.h"       // IWYU pragma: keep
+#include "aquila.h"       // IWYU pragma: keep
+#include "baichuan.h"     // IWYU pargma: keep
+#include "bloom.h"        // IWYU pragma: keep
+#include "chatglm.h"      // IWYU pragma: keep
+#include "deepseek_v2.h"  // IWYU pragma: keep
+#include "gemma.h"        // IWYU pragma: keep
+#include "gemma2.h"       // IWYU pragma: keep
+#include "gpt2.h"         // IWYU pragma: keep
+#include "gpt_j.h"        // IWYU pragma: keep
+#include "gpt_neox.h"     // IWYU pragma: keep
+#include "internlm.h"     // IWYU pragma: keep
+#include "llama.h"        // IWYU pragma: keep
+#include "llava.h"        // IWYU pragma: keep
+#include "mistral.h"      // IWYU pragma: keep
+#include "mixtral.h"      // IWYU pragma: keep
+#include "mpt.h"          // IWYU pragma: keep
+#include "phi.h"          // IWYU pragma: keep
+#include "qwen.h"         // IWYU pragma: keep
+#include "qwen2.h"        // IWYU pragma: keep
@@ -9,20 +9,46 @@ namespace llm {
 // information required to process a batch efficiently, mainly for
 // self-attention and kv-cache.
 struct InputParameters {
-  InputParameters to(const torch::Device& device) const {
+  InputParameters to(const torch::Device& device,
+                     bool non_blocking = false) const {
+    const auto copy = non_blocking ? safe_to_async : safe_to;
     InputParameters params;
     // copy scalar values
     params.num_sequences = num_sequences;
     params.kv_max_seq_len = kv_max_seq_len;
     params.q_max_seq_len = q_max_seq_len;
+    params.block_table_width = block_table_width;
+    params.num_prefix_groups = num_prefix_groups;
+    params.prefix_q_max_seq_len = prefix_q_max_seq_len;
+    params.prefix_kv_max_seq_len = prefix_kv_max_seq_len;
+    params.suffix_kv_max_seq_len = suffix_kv_max_seq_len;
+    params.dp_token_offset = dp_token_offset;
+    params.dp_num_tokens = dp_num_tokens;
 
     // all tensors should be on the same device
-    params.kv_cu_seq_lens = safe_to(kv_cu_seq_lens, device);
-    params.q_cu_seq_lens = safe_to(q_cu_seq_lens, device);
+    params.kv_cu_seq_lens = copy(kv_cu_seq_lens, device);
+    params.q_cu_seq_lens = copy(q_cu_seq_lens, device);
 
-    params.new_cache_slots = safe_to(new_cache_slots, device);
-    params.block_tables = safe_to(block_tables, device);
-    params.cu_block_lens = safe_to(cu_block_lens, device);
+    params.new_cache_slots = copy(new_cache_slots, device);
+    params.block_tables = copy(block_tables, device);
+    params.cu_block_lens = copy(cu_block_lens, device);
+    params.tree_mask = copy(tree_mask, device);
+
+    params.prefix_q_cu_seq_lens = copy(prefix_q_cu_seq_lens, device);
+    params.prefix_kv_cu_seq_lens = copy(prefix_kv_cu_seq_lens, device);
+    params.prefix_cu_block_lens = copy(prefix_cu_block_lens, device);
+    params.suffix_kv_cu_seq_lens = copy(suffix_kv_cu_seq_lens, device);
+    params.suffix_cu_block_lens = copy(suffix_cu_block_lens, device);
+
+    params.kv_score_q_idxes = copy(kv_score_q_idxes, device);
+    params.kv_score_slots = copy(kv_score_slots, device);
+    params.kv_scores = copy(kv_scores, device);
+
+    params.offload_device_blocks = copy(offload_device_blocks, device);
+    // read on host
+    params.offload_q_idxes = offload_q_idxes;
+    params.offload_host_blocks = offload_host_blocks;
+    params.offload_kv_lens = offload_kv_lens;
     return params;
   }
 
@@ -53,6 +79,77 @@ struct InputParameters {
   // cumulative block length for each sequence.
   // IntTensor: [n_seq + 1]
   torch::Tensor cu_block_lens;
+
+  // the width of each row for persistent block tables, 0 if block tables are
+  // packed. when set, block_tables is a [n_rows, width] table flattened into
+  // 1D tensor and cu_block_lens points to the start of each sequence's row.
+  int32_t block_table_width = 0;
+
+  // attention mask among the new tokens for tree speculative decoding, bit j
+  // is set if the token attends to the j-th new token of its sequence.
+  // undefined means causal mask.
+  // LongTensor: [n_tokens]
+  torch::Tensor tree_mask;
+
+  // cascade attention: consecutive sequences sharing leading kv cache blocks
+  // are grouped, all query tokens of a group attend to the shared prefix in
+  // one pass, then each sequence attends to the rest of its kv (the suffix).
+  // 0 means no cascade attention.
+  int32_t num_prefix_groups = 0;
+  // query tokens and shared prefix tokens of each group
+  // IntTensor: [n_groups + 1]
+  torch::Tensor prefix_q_cu_seq_lens;
+  torch::Tensor prefix_kv_cu_seq_lens;
+  // offset of the first shared block of each group in block_tables
+  // IntTensor: [n_groups + 1]
+  torch::Tensor prefix_cu_block_lens;
+  int32_t prefix_q_max_seq_len = 0;
+  int32_t prefix_kv_max_seq_len = 0;
+
+  // kv tokens of each sequence after the shared prefix
+  // IntTensor: [n_seq + 1]
+  torch::Tensor suffix_kv_cu_seq_lens;
+  // offset of the first block after the shared prefix in block_tables
+  // IntTensor: [n_seq + 1]
+  torch::Tensor suffix_cu_block_lens;
+  int32_t suffix_kv_max_seq_len = 0;
+
+  // kv cache eviction: the attention of the last prompt tokens of the
+  // observed sequences over their kv cache is summed into kv_scores by each
+  // attention layer, which ranks the blocks to evict.
+  // the index of each observed token in the batch, -1 for padding in front.
+  // IntTensor: [n_observed, window]
+  torch::Tensor kv_score_q_idxes;
+  // the kv cache slot of each token of the sequences, -1 for padding.
+  // IntTensor: [n_observed, max_kv_len]
+  torch::Tensor kv_score_slots;
+  // summed over the observed tokens, heads and layers, allocated by workers.
+  // FloatTensor: [n_observed, max_kv_len]
+  torch::Tensor kv_scores;
+
+  // hybrid attention: the leading kv cache blocks of the offloaded sequences
+  // are kept in host memory, see KVCache::host_tier(). their tokens are
+  // attended on cpu and merged by log-sum-exp with the attention over the
+  // device blocks, which is recomputed with the lse for these sequences.
+  // the index of each new token of the sequences in the batch, -1 for
+  // padding. on cpu. IntTensor: [n_offloaded, max_q_len]
+  torch::Tensor offload_q_idxes;
+  // the device blocks of the sequences, -1 for padding.
+  // IntTensor: [n_offloaded, max_n_blocks]
+  torch::Tensor offload_device_blocks;
+  // the host blocks of the sequences, all full, -1 for padding. on cpu.
+  // IntTensor: [n_offloaded, max_n_host_blocks]
+  torch::Tensor offload_host_blocks;
+  // the number of device kv cache tokens of the sequences, including the new
+  // tokens. on cpu. IntTensor: [n_offloaded]
+  torch::Tensor offload_kv_lens;
+
+  // data parallel attention: the params above are of the sequences of the
+  // attention group of the rank, whose tokens are the rows
+  // [dp_token_offset, dp_token_offset + dp_num_tokens) of the batch.
+  // dp_num_tokens is -1 if the attention runs on all tokens.
+  int32_t dp_token_offset = 0;
+  int32_t dp_num_tokens = -1;
 };
 
 }  // namespace llm
@@ -6,10 +6,13 @@
 #include <vector>
 
 #include "chat_template/coded_chat_template.h"
-#include "layers/activation.h"
 #include "layers/attention/attention.h"
 #include "layers/attention/handler.h"
+#include "layers/chunked_forward.h"
 #include "layers/embedding.h"
+#include "layers/gated_linear.h"
+#include "layers/layer_profiler.h"
+#include "layers/layer_streamer.h"
 #include "layers/linear.h"
 #include "layers/normalization.h"
 #include "memory/kv_cache.h"
@@ -27,9 +30,6 @@ class QWenMLPImpl : public torch::nn::Module {
               const QuantArgs& quant_args,
               const ParallelArgs& parallel_args,
               const torch::TensorOptions& options) {
-    act_ = Activation::get_act_func("silu", options.device());
-    CHECK(act_ != nullptr);
-
     const int64_t hidden_size = args.hidden_size();
     // the intermediate size is half of the size from the config
     // ref: https://huggingface.co/Qwen/Qwen-7B/blob/main/modeling_qwen.py#L562
@@ -37,13 +37,13 @@ class QWenMLPImpl : public torch::nn::Module {
 
     // register the weight parameter
     w1_w2_proj_ = register_module("gate_up_proj",
-                                  ColumnParallelLinear(hidden_size,
-                                                       intermediate_size * 2,
-                                                       /*bias=*/false,
-                                                       /*gather_output=*/false,
-                                                       quant_args,
-                                                       parallel_args,
-                                                       options));
+                                  FusedGateUpLinear(hidden_size,
+                                                    intermediate_size,
+                                                    /*bias=*/false,
+                                                    "silu",
+                                                    quant_args,
+                                                    parallel_args,
+                                                    options));
     c_proj_ = register_module("c_proj",
                               RowParallelLinear(intermediate_size,
                                                 hidden_size,
@@ -55,29 +55,30 @@ class QWenMLPImpl : public torch::nn::Module {
   }
 
   torch::Tensor forward(torch::Tensor x) {
-    auto gate_up_proj = w1_w2_proj_(x);
-    auto chunks = gate_up_proj.chunk(/*chunks=*/2, /*dim=*/-1);
-    return c_proj_(chunks[0] * act_(chunks[1]));
+    // large batches run in chunks to bound the intermediate activations
+    return chunked_forward(
+        x, FLAGS_mlp_chunk_tokens, [this](const torch::Tensor& chunk) {
+          return c_proj_(w1_w2_proj_(chunk));
+        });
   }
 
   // load the weight from the checkpoint
   void load_state_dict(const StateDict& state_dict) {
     // call each submodule's load_state_dict function
-    w1_w2_proj_->load_state_dict(state_dict, {"w1.", "w2."});
+    // w2 is the gate projection: w1(x) * silu(w2(x))
+    w1_w2_proj_->load_state_dict(state_dict, {"w2.", "w1."});
     c_proj_->load_state_dict(state_dict.select("c_proj."));
   }
 
   void verify_loaded_weights(const std::string& prefix) const {
-    w1_w2_proj_->verify_loaded_weights(prefix + "[w1,w2].");
+    w1_w2_proj_->verify_loaded_weights(prefix + "[w2,w1].");
     c_proj_->verify_loaded_weights(prefix + "c_proj.");
   }
 
  private:
   // parameter members, must be registered
-  ColumnParallelLinear w1_w2_proj_{nullptr};
+  FusedGateUpLinear w1_w2_proj_{nullptr};
   RowParallelLinear c_proj_{nullptr};
-
-  ActFunc act_{nullptr};
 };
 TORCH_MODULE(QWenMLP);
 
@@ -224,6 +225,8 @@ class QWenModelImpl : public torch::nn::Module {
     handler_ = AttentionHandler::create_handler_with_rope(
         args, /*interleaved=*/false, options);
 
+    streamer_ =
+        std::make_unique<LayerStreamer>(args.n_layers(), options.device());
     blocks_ = register_module("layers", torch::nn::ModuleList());
     layers_.reserve(args.n_layers());
     for (int32_t i = 0; i < args.n_layers(); i++) {
@@ -231,6 +234,7 @@ class QWenModelImpl : public torch::nn::Module {
           QWenBlock(args, quant_args, parallel_args, options, handler_.get());
       layers_.push_back(block);
       blocks_->push_back(block);
+      streamer_->add_layer(i, block.ptr());
     }
     ln_f_ = register_module(
         "ln_f", RMSNorm(args.hidden_size(), args.rms_norm_eps(), options));
@@ -246,6 +250,8 @@ class QWenModelImpl : public torch::nn::Module {
 
     // TODO: set working space for attention handler
     for (size_t i = 0; i < layers_.size(); i++) {
+      streamer_->fetch(i);
+      DECODER_LAYER_SCOPE();
       auto& layer = layers_[i];
       h = layer(h, positions, kv_caches[i], input_params);
     }
@@ -283,6 +289,9 @@ class QWenModelImpl : public torch::nn::Module {
   // hold same data but different type as blocks_ to avoid type cast
   std::vector<QWenBlock> layers_;
 
+  // streams the weights of the offloaded layers onto the device
+  std::unique_ptr<LayerStreamer> streamer_;
+
   RMSNorm ln_f_{nullptr};
 };
 TORCH_MODULE(QWenModel);
@@ -298,12 +307,10 @@ class QWenForCausalLMImpl : public torch::nn::Module {
         "transformer", QWenModel(args, quant_args, parallel_args, options));
 
     lm_head_ = register_module("lm_head",
-                               ColumnParallelLinear(args.hidden_size(),
-                                                    args.vocab_size(),
-                                                    /*bias=*/false,
-                                                    /*gather_output=*/true,
-                                                    parallel_args,
-                                                    options));
+                               create_lm_head(args.hidden_size(),
+                                              args.vocab_size(),
+                                              parallel_args,
+                                              options));
   }
 
   // tokens: [num_tokens]
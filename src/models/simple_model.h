@@ -3,9 +3,8 @@
 #include <c10/core/ScalarType.h>
 #include <torch/torch.h>
 
-#include "layers/activation.h"
 #include "layers/embedding.h"
-#include "layers/fused_linear.h"
+#include "layers/gated_linear.h"
 #include "layers/linear.h"
 #include "memory/kv_cache.h"
 #include "models/model_args.h"
@@ -21,22 +20,18 @@ class SimpleMLPImpl : public torch::nn::Module {
                 const QuantArgs& quant_args,
                 const ParallelArgs& parallel_args,
                 const torch::TensorOptions& options) {
-    act_func_ = Activation::get_act_func("silu", options.device());
-    CHECK(act_func_ != nullptr);
-
     const int64_t hidden_size = args.hidden_size();
     const int64_t intermediate_size = args.intermediate_size();
 
     gate_up_proj_ = register_module(
         "gate_up_proj",
-        FusedColumnParallelLinear(
-            hidden_size,
-            std::vector<int64_t>{intermediate_size, intermediate_size},
-            false,
-            false,
-            quant_args,
-            parallel_args,
-            options));
+        FusedGateUpLinear(hidden_size,
+                          intermediate_size,
+                          /*bias=*/false,
+                          "silu",
+                          quant_args,
+                          parallel_args,
+                          options));
     down_proj_ = register_module("down_proj",
                                  RowParallelLinear(intermediate_size,
                                                    hidden_size,
@@ -48,8 +43,7 @@ class SimpleMLPImpl : public torch::nn::Module {
   }
 
   torch::Tensor forward(torch::Tensor x) {
-    const auto gate_up = gate_up_proj_(x);
-    return down_proj_(act_func_(gate_up[0]) * gate_up[1]);
+    return down_proj_(gate_up_proj_(x));
   }
 
   void load_state_dict(const StateDict& state_dict) {
@@ -63,10 +57,8 @@ class SimpleMLPImpl : public torch::nn::Module {
   }
 
  private:
-  FusedColumnParallelLinear gate_up_proj_{nullptr};
+  FusedGateUpLinear gate_up_proj_{nullptr};
   RowParallelLinear down_proj_{nullptr};
-
-  ActFunc act_func_{nullptr};
 };
 
 TORCH_MODULE(SimpleMLP);
@@ -0,0 +1,35 @@
+#include "vision_encoder.h"
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <memory>
+
+#include "model_args.h"
+#include "models/model_registry.h"
+
+namespace llm {
+
+int64_t VisionEncoder::num_image_tokens(const ModelArgs& args) {
+  if (args.image_token_id() < 0 || args.patch_size() <= 0) {
+    return 0;
+  }
+  // one token per patch, the class token is dropped
+  const int64_t n_patches_per_side = args.image_size() / args.patch_size();
+  return n_patches_per_side * n_patches_per_side;
+}
+
+std::unique_ptr<VisionEncoder> VisionEncoder::create(
+    const ModelArgs& args,
+    const torch::TensorOptions& options) {
+  auto factory = ModelRegistry::get_vision_encoder_factory(args.model_type());
+  if (factory == nullptr) {
+    return nullptr;
+  }
+  CHECK_GE(args.image_token_id(), 0)
+      << "No image token id for the vision encoder of "
+      << args.model_type();
+  return factory(args, options);
+}
+
+}  // namespace llm
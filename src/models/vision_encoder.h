@@ -0,0 +1,72 @@
+#pragma once
+
+#include <torch/torch.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "model_args.h"
+#include "model_loader/state_dict.h"
+
+namespace llm {
+
+// An interface for the vision encoders of the vision-language models, which
+// encode the images into the embeddings of their placeholder tokens in the
+// prompts. The encoders are small and replicated on every rank.
+class VisionEncoder : public torch::nn::Module {
+ public:
+  ~VisionEncoder() override = default;
+
+  // pixel_values: [n_images, 3, image_size, image_size]
+  // returns: [n_images, n_image_tokens, hidden_size] of the language model
+  virtual torch::Tensor forward(const torch::Tensor& pixel_values) = 0;
+
+  // load the encoder from the state_dict of the whole model
+  virtual void load_state_dict(const StateDict& state_dict) = 0;
+
+  // verify if the encoder is loaded correctly
+  virtual void verify_loaded_weights() const = 0;
+
+  virtual const torch::TensorOptions& options() const = 0;
+
+  // the number of image tokens each image is encoded into
+  static int64_t num_image_tokens(const ModelArgs& args);
+
+  // factory method to create the vision encoder of the model, nullptr if the
+  // model has no vision encoder
+  static std::unique_ptr<VisionEncoder> create(
+      const ModelArgs& args,
+      const torch::TensorOptions& options);
+};
+
+// an template class to hold different encoders without virtual functions.
+template <typename Model>
+class VisionEncoderImpl : public VisionEncoder {
+ public:
+  VisionEncoderImpl(Model model, const torch::TensorOptions& options)
+      : model_(std::move(model)), options_(options) {}
+
+  torch::Tensor forward(const torch::Tensor& pixel_values) override {
+    return model_->forward(pixel_values);
+  }
+
+  void load_state_dict(const StateDict& state_dict) override {
+    model_->load_state_dict(state_dict);
+  }
+
+  void verify_loaded_weights() const override {
+    model_->verify_loaded_weights();
+  }
+
+  const torch::TensorOptions& options() const override { return options_; }
+
+ private:
+  // underlying model
+  Model model_;
+
+  // tensor options
+  torch::TensorOptions options_;
+};
+
+}  // namespace llm
@@ -0,0 +1,122 @@
+#include "gptq_kernel_table.h"
+
+#include <glog/logging.h>
+
+#include <fstream>
+#include <sstream>
+
+namespace llm {
+namespace {
+bool from_string(const std::string& name, GPTQKernel* kernel) {
+  for (auto k :
+       {GPTQKernel::kExllamav2, GPTQKernel::kMarlin, GPTQKernel::kDequant}) {
+    if (name == to_string(k)) {
+      *kernel = k;
+      return true;
+    }
+  }
+  return false;
+}
+}  // namespace
+
+const char* to_string(GPTQKernel kernel) {
+  switch (kernel) {
+    case GPTQKernel::kExllamav2:
+      return "exllamav2";
+    case GPTQKernel::kMarlin:
+      return "marlin";
+    case GPTQKernel::kDequant:
+      return "dequant";
+  }
+  return "unknown";
+}
+
+int64_t GPTQKernelTable::bucket_index(int64_t m) {
+  int64_t index = 0;
+  while (index < kNumBuckets - 1 && bucket_m(index) < m) {
+    ++index;
+  }
+  return index;
+}
+
+std::string GPTQKernelTable::make_key(int64_t in_features,
+                                      int64_t out_features,
+                                      int64_t bits,
+                                      int64_t group_size) {
+  std::stringstream ss;
+  ss << "k" << in_features << "_n" << out_features << "_b" << bits << "_g"
+     << group_size;
+  return ss.str();
+}
+
+GPTQKernelTable& GPTQKernelTable::get_instance() {
+  static GPTQKernelTable table;
+  return table;
+}
+
+std::vector<GPTQKernel> GPTQKernelTable::lookup(const std::string& key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = table_.find(key);
+  if (it == table_.end()) {
+    return {};
+  }
+  return it->second;
+}
+
+void GPTQKernelTable::insert(const std::string& key,
+                             std::vector<GPTQKernel> kernels) {
+  CHECK_EQ(kernels.size(), kNumBuckets) << "kernels size mismatch";
+  std::lock_guard<std::mutex> lock(mutex_);
+  table_[key] = std::move(kernels);
+}
+
+bool GPTQKernelTable::load(const std::string& path) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string line;
+  while (std::getline(file, line)) {
+    std::stringstream ss(line);
+    std::string key;
+    if (!(ss >> key)) {
+      continue;
+    }
+    std::vector<GPTQKernel> kernels;
+    std::string name;
+    GPTQKernel kernel;
+    while (ss >> name && from_string(name, &kernel)) {
+      kernels.push_back(kernel);
+    }
+    if (!ss.eof() || kernels.size() != kNumBuckets) {
+      LOG(WARNING) << "Skipping invalid gptq kernel entry: " << line;
+      continue;
+    }
+    table_[key] = std::move(kernels);
+  }
+  return true;
+}
+
+bool GPTQKernelTable::save(const std::string& path) const {
+  std::ofstream file(path);
+  if (!file.is_open()) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& [key, kernels] : table_) {
+    file << key;
+    for (auto kernel : kernels) {
+      file << " " << to_string(kernel);
+    }
+    file << "\n";
+  }
+  return file.good();
+}
+
+size_t GPTQKernelTable::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return table_.size();
+}
+
+}  // namespace llm
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace llm {
+
+// kernels for gptq quantized matmul
+enum class GPTQKernel : int8_t {
+  // exllamav2 quantized gemm, fast for a few tokens
+  kExllamav2 = 0,
+  // marlin quantized gemm with tensor cores
+  kMarlin,
+  // dequantize the whole weight, then cuBLAS
+  kDequant,
+};
+
+const char* to_string(GPTQKernel kernel);
+
+// the kernel to use for each bucket of m (number of tokens) per gptq linear
+// shape, either tuned on the device or loaded from a cache file.
+// buckets are powers of two: 1, 2, 4, ..., kMaxBucketM, m is rounded up to
+// the next bucket and m > kMaxBucketM uses the last one.
+class GPTQKernelTable {
+ public:
+  static constexpr int64_t kMaxBucketM = 1024;
+  static constexpr int64_t kNumBuckets = 11;
+
+  // index of the bucket for m
+  static int64_t bucket_index(int64_t m);
+
+  // the m of the bucket
+  static int64_t bucket_m(int64_t index) { return int64_t(1) << index; }
+
+  // key of a gptq linear shape
+  static std::string make_key(int64_t in_features,
+                              int64_t out_features,
+                              int64_t bits,
+                              int64_t group_size);
+
+  // the process wide table shared by all gptq layers
+  static GPTQKernelTable& get_instance();
+
+  // returns the kernels of each bucket, empty if the shape is not found
+  std::vector<GPTQKernel> lookup(const std::string& key) const;
+
+  void insert(const std::string& key, std::vector<GPTQKernel> kernels);
+
+  // load and save the table as text, one shape per line:
+  // "<key> <kernel of bucket 0> ... <kernel of bucket n-1>"
+  // lines with unknown kernels or a different number of buckets are skipped.
+  bool load(const std::string& path);
+  bool save(const std::string& path) const;
+
+  size_t size() const;
+
+ private:
+  mutable std::mutex mutex_;
+
+  std::unordered_map<std::string, std::vector<GPTQKernel>> table_;
+};
+
+}  // namespace llm
@@ -0,0 +1,57 @@
+#include "gptq_kernel_table.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+
+namespace llm {
+
+TEST(GPTQKernelTableTest, Buckets) {
+  EXPECT_EQ(GPTQKernelTable::bucket_index(1), 0);
+  EXPECT_EQ(GPTQKernelTable::bucket_index(2), 1);
+  EXPECT_EQ(GPTQKernelTable::bucket_index(3), 2);
+  EXPECT_EQ(GPTQKernelTable::bucket_index(64), 6);
+  EXPECT_EQ(GPTQKernelTable::bucket_index(65), 7);
+  EXPECT_EQ(GPTQKernelTable::bucket_index(1024),
+            GPTQKernelTable::kNumBuckets - 1);
+  // larger m uses the last bucket
+  EXPECT_EQ(GPTQKernelTable::bucket_index(100000),
+            GPTQKernelTable::kNumBuckets - 1);
+  EXPECT_EQ(
+      GPTQKernelTable::bucket_m(GPTQKernelTable::kNumBuckets - 1),
+      GPTQKernelTable::kMaxBucketM);
+}
+
+TEST(GPTQKernelTableTest, SaveAndLoad) {
+  const auto path = std::filesystem::temp_directory_path() /
+                    "gptq_kernel_table_test.txt";
+  const auto key = GPTQKernelTable::make_key(4096, 11008, 4, 128);
+  std::vector<GPTQKernel> kernels(GPTQKernelTable::kNumBuckets,
+                                  GPTQKernel::kDequant);
+  kernels[0] = GPTQKernel::kExllamav2;
+  kernels[1] = GPTQKernel::kMarlin;
+
+  GPTQKernelTable table;
+  EXPECT_TRUE(table.lookup(key).empty());
+  table.insert(key, kernels);
+  EXPECT_EQ(table.lookup(key), kernels);
+  ASSERT_TRUE(table.save(path.string()));
+
+  {
+    // append invalid entries
+    std::ofstream file(path, std::ios::app);
+    file << "k1_n1_b4_g128 marlin\n";
+    file << "k2_n2_b4_g128 unknown marlin\n";
+  }
+
+  GPTQKernelTable loaded;
+  ASSERT_TRUE(loaded.load(path.string()));
+  EXPECT_EQ(loaded.size(), 1);
+  EXPECT_EQ(loaded.lookup(key), kernels);
+
+  std::filesystem::remove(path);
+  EXPECT_FALSE(loaded.load(path.string()));
+}
+
+}  // namespace llm
@@ -355,7 +355,7 @@ torch::Tensor RowParallelQLinearAWQMarlinImpl::forward(torch::Tensor input) {
                     /*use_fp32_reduce=*/true);
 
   if (parallel_args_.world_size() > 1) {
-    output = reduce_from_model_parallel_region(output, parallel_args_);
+    output = reduce_row_parallel_output(output, parallel_args_);
   }
   // N.B. need to apply bias after the reduce
   if (bias_.defined()) {
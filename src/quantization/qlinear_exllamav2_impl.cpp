@@ -41,6 +41,9 @@ bool same_device(const torch::Device& a, const torch::Device& b) {
   return a.type() == b.type() && a_index == b_index;
 }
 
+}  // namespace
+
+namespace detail {
 void allocate_temp_dq(int64_t size, const torch::Device& device) {
   if (tl_temp_dq.defined()) {
     CHECK(same_device(tl_temp_dq.device(), device))
@@ -54,7 +57,9 @@ void allocate_temp_dq(int64_t size, const torch::Device& device) {
         torch::empty({size}, torch::dtype(torch::kHalf).device(device));
   }
 }
-}  // namespace
+
+const torch::Tensor& temp_dq() { return tl_temp_dq; }
+}  // namespace detail
 
 ColumnParallelQLinearExllamav2Impl::ColumnParallelQLinearExllamav2Impl(
     int64_t in_features,
@@ -75,34 +80,14 @@ ColumnParallelQLinearExllamav2Impl::ColumnParallelQLinearExllamav2Impl(
   const auto bits = quant_args.bits();
   CHECK(bits == 4) << "Only 4 bits are supported";
 
-  const auto group_size =
-      quant_args.group_size() > 0 ? quant_args.group_size() : in_features;
-
-  if (quant_args.desc_act()) {
-    std::vector<int32_t> g_idx_data;
-    g_idx_data.reserve(in_features);
-    for (int32_t i = 0; i < in_features; ++i) {
-      g_idx_data.push_back(i / group_size);
-    }
-    // TODO: load g_idx from weights when desc_act is true
-    // g_idx has to be on cpu in the ac-order case, otherwise the q_matrix_ will
-    // be segfault
-    g_idx_ = register_buffer(
-        "g_idx",
-        torch::tensor(g_idx_data,
-                      torch::dtype(torch::kInt32).device(torch::kCPU)));
-    q_perm_ = register_buffer(
-        "q_perm", torch::empty({in_features}, options.dtype(torch::kShort)));
-    q_invperm_ = register_buffer(
-        "q_invperm", torch::empty({in_features}, options.dtype(torch::kShort)));
-  } else {
-    g_idx_ = none_tensor;
-    q_perm_ = none_tensor;
-    q_invperm_ = none_tensor;
-  }
+  // act order weights are reordered at load time by the base class, so the
+  // q_matrix never needs the permutation
+  g_idx_ = none_tensor;
+  q_perm_ = none_tensor;
+  q_invperm_ = none_tensor;
 
   const int64_t temp_dq_size = in_features * out_features * 2 + 128;
-  allocate_temp_dq(temp_dq_size, options.device());
+  detail::allocate_temp_dq(temp_dq_size, options.device());
 }
 
 ColumnParallelQLinearExllamav2Impl::~ColumnParallelQLinearExllamav2Impl() {
@@ -159,34 +144,14 @@ RowParallelQLinearExllamav2Impl::RowParallelQLinearExllamav2Impl(
   CHECK(bits == 2 || bits == 3 || bits == 4 || bits == 8)
       << "Only 2,3,4,8 bits are supported";
 
-  const auto group_size =
-      quant_args.group_size() > 0 ? quant_args.group_size() : in_features;
-
-  if (quant_args.desc_act()) {
-    std::vector<int32_t> g_idx_data;
-    g_idx_data.reserve(in_features);
-    for (int32_t i = 0; i < in_features; ++i) {
-      g_idx_data.push_back(i / group_size);
-    }
-    // TODO: load g_idx from weights when desc_act is true
-    // g_idx has to be on cpu in the ac-order case, otherwise the q_matrix_ will
-    // be segfault
-    g_idx_ = register_buffer(
-        "g_idx",
-        torch::tensor(g_idx_data,
-                      torch::dtype(torch::kInt32).device(torch::kCPU)));
-    q_perm_ = register_buffer(
-        "q_perm", torch::empty({in_features}, options.dtype(torch::kShort)));
-    q_invperm_ = register_buffer(
-        "q_invperm", torch::empty({in_features}, options.dtype(torch::kShort)));
-  } else {
-    g_idx_ = none_tensor;
-    q_perm_ = none_tensor;
-    q_invperm_ = none_tensor;
-  }
+  // act order weights are reordered at load time by the base class, so the
+  // q_matrix never needs the permutation
+  g_idx_ = none_tensor;
+  q_perm_ = none_tensor;
+  q_invperm_ = none_tensor;
 
   const int64_t temp_dq_size = in_features * out_features * 2 + 128;
-  allocate_temp_dq(temp_dq_size, options.device());
+  detail::allocate_temp_dq(temp_dq_size, options.device());
 }
 
 RowParallelQLinearExllamav2Impl::~RowParallelQLinearExllamav2Impl() {
@@ -8,6 +8,14 @@
 #include "qlinear_impl.h"
 
 namespace llm {
+namespace detail {
+// allocate the thread local buffer to dequantize weights into, shared by all
+// exllamav2 layers of the thread, grows to at least size halfs.
+void allocate_temp_dq(int64_t size, const torch::Device& device);
+
+// the thread local buffer, undefined if not allocated
+const torch::Tensor& temp_dq();
+}  // namespace detail
 
 // Quantized Linear layer with column parallelism.
 class ColumnParallelQLinearExllamav2Impl : public ColumnParallelQLinearImpl {
@@ -0,0 +1,346 @@
+#include "qlinear_gptq_auto_impl.h"
+
+#include <ATen/cuda/CUDAContext.h>
+#include <ATen/cuda/CUDAEvent.h>
+#include <cuda_runtime.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <limits>
+#include <mutex>
+
+#include "kernels/quantization/marlin.h"
+#include "qlinear_exllamav2_impl.h"
+#include "qlinear_gptq_marlin_impl.h"
+
+DEFINE_bool(qlinear_gptq_autotune,
+            false,
+            "time the gptq kernels for each batch size bucket at the first "
+            "forward of each linear shape, instead of fixed crossover points");
+
+DEFINE_string(qlinear_gptq_tune_cache,
+              "",
+              "file to load the tuned gptq kernels from and to save them to");
+
+extern uintptr_t make_q_matrix(torch::Tensor q_weight,
+                               torch::Tensor q_perm,
+                               torch::Tensor q_invperm,
+                               torch::Tensor q_scale,
+                               torch::Tensor q_scale_max,
+                               torch::Tensor q_groups,
+                               torch::Tensor gptq_qzeros,
+                               torch::Tensor gptq_scales,
+                               torch::Tensor gptq_g_idx,
+                               torch::Tensor temp_dq);
+
+extern void gemm_half_q_half(torch::Tensor a,
+                             uintptr_t b,
+                             torch::Tensor c,
+                             bool force_cuda);
+
+extern void free_q_matrix(uintptr_t w);
+
+namespace llm {
+namespace {
+const auto none_tensor = torch::empty({1, 1}, torch::kMeta);
+
+// exllamav2 only dequantizes the weight for more rows than this, same as
+// MAX_Q_GEMM_ROWS, the smallest bucket with dequantization is 64.
+constexpr int64_t kMaxExllamaRows = 50;
+
+// crossover points of the default kernels
+constexpr int64_t kMaxExllamaM = 1;
+constexpr int64_t kMaxMarlinM = 64;
+
+// warmup and timed iterations for tuning
+constexpr int kWarmupIters = 2;
+constexpr int kTuneIters = 10;
+
+// load the tuned kernels from the cache file once
+void maybe_load_tune_cache() {
+  static std::once_flag flag;
+  std::call_once(flag, [] {
+    const auto& path = FLAGS_qlinear_gptq_tune_cache;
+    if (path.empty()) {
+      return;
+    }
+    auto& table = GPTQKernelTable::get_instance();
+    if (table.load(path)) {
+      LOG(INFO) << "Loaded " << table.size() << " gptq kernel entries from "
+                << path;
+    }
+  });
+}
+
+bool is_capturing_graph() {
+  cudaStreamCaptureStatus status = cudaStreamCaptureStatusNone;
+  cudaStreamIsCapturing(at::cuda::getCurrentCUDAStream(), &status);
+  return status != cudaStreamCaptureStatusNone;
+}
+}  // namespace
+
+namespace detail {
+GPTQAutoMatmul::GPTQAutoMatmul(int64_t in_features,
+                               int64_t out_features,
+                               const QuantArgs& quant_args,
+                               const torch::TensorOptions& options)
+    : in_features_(in_features),
+      out_features_(out_features),
+      bits_(quant_args.bits()),
+      group_size_(quant_args.group_size()) {
+  CHECK(is_supported(quant_args))
+      << "Only 4 bits symmetric gptq without act order is supported";
+  const auto group_size = group_size_;
+  marlin_supported_ =
+      (group_size == -1 || group_size == 32 || group_size == 64 ||
+       group_size == 128) &&
+      out_features % 64 == 0 && in_features % 128 == 0;
+
+  // the buffer for exllamav2 to dequantize weights into
+  const int64_t temp_dq_size = in_features * out_features * 2 + 128;
+  allocate_temp_dq(temp_dq_size, options.device());
+}
+
+GPTQAutoMatmul::~GPTQAutoMatmul() {
+  if (q_matrix_ != 0) {
+    free_q_matrix(q_matrix_);
+  }
+}
+
+bool GPTQAutoMatmul::is_supported(const QuantArgs& quant_args) {
+  // act order weights are reordered at load time by the base class
+  return quant_args.bits() == 4 && quant_args.is_sym();
+}
+
+GPTQKernel GPTQAutoMatmul::kernel_for(int64_t m) const {
+  CHECK(!kernels_.empty()) << "kernels are not chosen yet";
+  return kernels_[GPTQKernelTable::bucket_index(m)];
+}
+
+void GPTQAutoMatmul::init_kernels(const torch::Tensor& qweight,
+                                  const torch::Tensor& qzeros,
+                                  const torch::Tensor& scales) {
+  // repack for marlin first, exllamav2 shuffles qweight in place
+  if (marlin_supported_) {
+    marlin_qweight_ = qweight.clone();
+    marlin_scales_ = scales.clone();
+    auto g_idx = torch::empty({0}, qweight.options());
+    marlin_perm_ = gptq_marlin_repack_weight(marlin_qweight_,
+                                             marlin_scales_,
+                                             g_idx,
+                                             bits_,
+                                             /*act_order=*/false);
+    marlin_zeros_ = torch::empty({0}, scales.options());
+    marlin_workspace_ = torch::zeros({out_features_ / 64 * 16},
+                                     qweight.options().dtype(torch::kInt32));
+  }
+
+  CHECK(temp_dq().defined()) << "temp_dq is not defined. model "
+                                "initialization and forward should be on "
+                                "the same thread";
+  q_matrix_ = make_q_matrix(qweight,
+                            none_tensor,
+                            none_tensor,
+                            none_tensor,
+                            none_tensor,
+                            none_tensor,
+                            qzeros,
+                            scales,
+                            none_tensor,
+                            temp_dq());
+
+  kernels_ = choose_kernels();
+}
+
+std::vector<GPTQKernel> GPTQAutoMatmul::choose_kernels() {
+  maybe_load_tune_cache();
+  auto& table = GPTQKernelTable::get_instance();
+  const auto key = GPTQKernelTable::make_key(
+      in_features_, out_features_, bits_, group_size_);
+  auto kernels = table.lookup(key);
+  if (!kernels.empty()) {
+    return kernels;
+  }
+  if (!FLAGS_qlinear_gptq_autotune || is_capturing_graph()) {
+    return default_kernels();
+  }
+
+  kernels = tune_kernels();
+  table.insert(key, kernels);
+  const auto& path = FLAGS_qlinear_gptq_tune_cache;
+  if (!path.empty() && !table.save(path)) {
+    LOG(WARNING) << "Failed to save the gptq kernels to " << path;
+  }
+  return kernels;
+}
+
+std::vector<GPTQKernel> GPTQAutoMatmul::default_kernels() const {
+  std::vector<GPTQKernel> kernels;
+  kernels.reserve(GPTQKernelTable::kNumBuckets);
+  for (int64_t i = 0; i < GPTQKernelTable::kNumBuckets; ++i) {
+    const int64_t m = GPTQKernelTable::bucket_m(i);
+    if (m <= kMaxExllamaM) {
+      kernels.push_back(GPTQKernel::kExllamav2);
+    } else if (m <= kMaxMarlinM) {
+      kernels.push_back(marlin_supported_ ? GPTQKernel::kMarlin
+                                          : GPTQKernel::kExllamav2);
+    } else {
+      kernels.push_back(GPTQKernel::kDequant);
+    }
+  }
+  return kernels;
+}
+
+std::vector<GPTQKernel> GPTQAutoMatmul::tune_kernels() {
+  const auto inputs = torch::randn({GPTQKernelTable::kMaxBucketM, in_features_},
+                                   temp_dq().options());
+
+  auto kernels = default_kernels();
+  for (int64_t i = 0; i < GPTQKernelTable::kNumBuckets; ++i) {
+    const int64_t m = GPTQKernelTable::bucket_m(i);
+    const auto input = inputs.slice(/*dim=*/0, /*start=*/0, /*end=*/m);
+    float best_time = std::numeric_limits<float>::max();
+    for (auto kernel :
+         {GPTQKernel::kExllamav2, GPTQKernel::kMarlin, GPTQKernel::kDequant}) {
+      if (!is_valid(kernel, m)) {
+        continue;
+      }
+      for (int iter = 0; iter < kWarmupIters; ++iter) {
+        run(kernel, input);
+      }
+      at::cuda::CUDAEvent start(cudaEventDefault);
+      at::cuda::CUDAEvent stop(cudaEventDefault);
+      start.record();
+      for (int iter = 0; iter < kTuneIters; ++iter) {
+        run(kernel, input);
+      }
+      stop.record();
+      stop.synchronize();
+      const float time = start.elapsed_time(stop);
+      if (time < best_time) {
+        best_time = time;
+        kernels[i] = kernel;
+      }
+    }
+    VLOG(1) << "gptq k=" << in_features_ << " n=" << out_features_
+            << " m=" << m << ": " << to_string(kernels[i]);
+  }
+  return kernels;
+}
+
+bool GPTQAutoMatmul::is_valid(GPTQKernel kernel, int64_t m) const {
+  switch (kernel) {
+    case GPTQKernel::kExllamav2:
+      return true;
+    case GPTQKernel::kMarlin:
+      return marlin_supported_;
+    case GPTQKernel::kDequant:
+      return m > kMaxExllamaRows;
+  }
+  return false;
+}
+
+torch::Tensor GPTQAutoMatmul::run(GPTQKernel kernel,
+                                  const torch::Tensor& input) {
+  auto output = torch::empty({input.size(0), out_features_}, input.options());
+  switch (kernel) {
+    case GPTQKernel::kExllamav2:
+      gemm_half_q_half(input, q_matrix_, output, /*force_cuda=*/true);
+      break;
+    case GPTQKernel::kMarlin:
+      marlin::gptq_gemm(input,
+                        marlin_qweight_,
+                        output,
+                        marlin_scales_,
+                        marlin_zeros_,
+                        // g_idx and perm are empty without act order
+                        /*g_idx=*/marlin_perm_,
+                        marlin_perm_,
+                        marlin_workspace_,
+                        bits_,
+                        /*is_k_full=*/true,
+                        /*has_zp=*/false,
+                        /*use_fp32_reduce=*/true);
+      break;
+    case GPTQKernel::kDequant:
+      // dequantize into temp_dq and cuBLAS for more than kMaxExllamaRows
+      gemm_half_q_half(input, q_matrix_, output, /*force_cuda=*/false);
+      break;
+  }
+  return output;
+}
+
+torch::Tensor GPTQAutoMatmul::matmul(const torch::Tensor& input,
+                                     const torch::Tensor& qweight,
+                                     const torch::Tensor& qzeros,
+                                     const torch::Tensor& scales) {
+  // lazy initialization
+  if (q_matrix_ == 0) {
+    init_kernels(qweight, qzeros, scales);
+  }
+  return run(kernel_for(input.size(0)), input);
+}
+}  // namespace detail
+
+ColumnParallelQLinearGPTQAutoImpl::ColumnParallelQLinearGPTQAutoImpl(
+    int64_t in_features,
+    int64_t out_features,
+    bool bias,
+    const QuantArgs& quant_args,
+    bool gather_output,
+    const ParallelArgs& parallel_args,
+    const torch::TensorOptions& options)
+    : ColumnParallelQLinearImpl(in_features,
+                                out_features,
+                                bias,
+                                quant_args,
+                                /*qweight_pack_dim=*/0,
+                                gather_output,
+                                parallel_args,
+                                options) {
+  const int64_t out_features_per_partition =
+      out_features / parallel_args.world_size();
+  matmul_ = std::make_unique<detail::GPTQAutoMatmul>(
+      in_features, out_features_per_partition, quant_args, options);
+}
+
+torch::Tensor ColumnParallelQLinearGPTQAutoImpl::quant_matmul(
+    const torch::Tensor& input,
+    const torch::Tensor& qweight,
+    const torch::Tensor& qzeros,
+    const torch::Tensor& scales) const {
+  return matmul_->matmul(input, qweight, qzeros, scales);
+}
+
+RowParallelQLinearGPTQAutoImpl::RowParallelQLinearGPTQAutoImpl(
+    int64_t in_features,
+    int64_t out_features,
+    bool bias,
+    const QuantArgs& quant_args,
+    bool input_is_parallelized,
+    const ParallelArgs& parallel_args,
+    const torch::TensorOptions& options)
+    : RowParallelQLinearImpl(in_features,
+                             out_features,
+                             bias,
+                             quant_args,
+                             /*qweight_pack_dim=*/0,
+                             input_is_parallelized,
+                             parallel_args,
+                             options) {
+  const int64_t in_features_per_partition =
+      in_features / parallel_args.world_size();
+  matmul_ = std::make_unique<detail::GPTQAutoMatmul>(
+      in_features_per_partition, out_features, quant_args, options);
+}
+
+torch::Tensor RowParallelQLinearGPTQAutoImpl::quant_matmul(
+    const torch::Tensor& input,
+    const torch::Tensor& qweight,
+    const torch::Tensor& qzeros,
+    const torch::Tensor& scales) const {
+  return matmul_->matmul(input, qweight, qzeros, scales);
+}
+
+}  // namespace llm
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "gptq_kernel_table.h"
+#include "qlinear_impl.h"
+
+namespace llm {
+namespace detail {
+// gptq quantized matmul that picks the kernel per bucket of m: exllamav2 for
+// a few tokens, marlin for medium batches and dequantize + cuBLAS beyond.
+// the choices come from the GPTQKernelTable, tuned once per shape at the
+// first call with --qlinear_gptq_autotune, or from fixed crossover points.
+class GPTQAutoMatmul {
+ public:
+  GPTQAutoMatmul(int64_t in_features,
+                 int64_t out_features,
+                 const QuantArgs& quant_args,
+                 const torch::TensorOptions& options);
+
+  ~GPTQAutoMatmul();
+
+  // only 4 bits symmetric quantization is supported
+  static bool is_supported(const QuantArgs& quant_args);
+
+  // prepare the kernels and their weights at the first call
+  torch::Tensor matmul(const torch::Tensor& input,
+                       const torch::Tensor& qweight,
+                       const torch::Tensor& qzeros,
+                       const torch::Tensor& scales);
+
+  // the kernel for m tokens
+  GPTQKernel kernel_for(int64_t m) const;
+
+ private:
+  void init_kernels(const torch::Tensor& qweight,
+                    const torch::Tensor& qzeros,
+                    const torch::Tensor& scales);
+
+  // choose the kernel for each bucket
+  std::vector<GPTQKernel> choose_kernels();
+
+  // fixed crossover points when not tuned
+  std::vector<GPTQKernel> default_kernels() const;
+
+  // time the valid kernels for each bucket and keep the fastest
+  std::vector<GPTQKernel> tune_kernels();
+
+  bool is_valid(GPTQKernel kernel, int64_t m) const;
+
+  torch::Tensor run(GPTQKernel kernel, const torch::Tensor& input);
+
+  int64_t in_features_ = 0;
+  int64_t out_features_ = 0;
+  int64_t bits_ = 0;
+  int64_t group_size_ = 0;
+
+  // whether the shape is supported by marlin
+  bool marlin_supported_ = false;
+
+  // kernel of each bucket
+  std::vector<GPTQKernel> kernels_;
+
+  // weights and buffers for marlin
+  torch::Tensor marlin_qweight_;
+  torch::Tensor marlin_scales_;
+  torch::Tensor marlin_zeros_;
+  torch::Tensor marlin_perm_;
+  torch::Tensor marlin_workspace_;
+
+  // QMatrix handler for exllamav2 and dequantization
+  uintptr_t q_matrix_ = 0;
+};
+}  // namespace detail
+
+// GPTQ linear layer with column parallelism, the kernel is picked per batch
+// size by GPTQAutoMatmul.
+class ColumnParallelQLinearGPTQAutoImpl : public ColumnParallelQLinearImpl {
+ public:
+  ColumnParallelQLinearGPTQAutoImpl(int64_t in_features,
+                                    int64_t out_features,
+                                    bool bias,
+                                    const QuantArgs& quant_args,
+                                    bool gather_output,
+                                    const ParallelArgs& parallel_args,
+                                    const torch::TensorOptions& options);
+
+  torch::Tensor quant_matmul(const torch::Tensor& input,
+                             const torch::Tensor& qweight,
+                             const torch::Tensor& qzeros,
+                             const torch::Tensor& scales) const override;
+
+ private:
+  mutable std::unique_ptr<detail::GPTQAutoMatmul> matmul_;
+};
+
+// GPTQ linear layer with row parallelism, the kernel is picked per batch size
+// by GPTQAutoMatmul.
+class RowParallelQLinearGPTQAutoImpl : public RowParallelQLinearImpl {
+ public:
+  RowParallelQLinearGPTQAutoImpl(int64_t in_features,
+                                 int64_t out_features,
+                                 bool bias,
+                                 const QuantArgs& quant_args,
+                                 bool input_is_parallelized,
+                                 const ParallelArgs& parallel_args,
+                                 const torch::TensorOptions& options);
+
+  torch::Tensor quant_matmul(const torch::Tensor& input,
+                             const torch::Tensor& qweight,
+                             const torch::Tensor& qzeros,
+                             const torch::Tensor& scales) const override;
+
+ private:
+  mutable std::unique_ptr<detail::GPTQAutoMatmul> matmul_;
+};
+}  // namespace llm
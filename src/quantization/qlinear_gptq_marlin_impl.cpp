@@ -38,11 +38,14 @@ const std::vector<int64_t> kScalesPermSingle = {
     4, 5, 12, 13, 20, 21, 28, 29, 6, 7, 14, 15, 22, 23, 30, 31,
 };
 
-torch::Tensor repack_weight(torch::Tensor& qweight,
-                            torch::Tensor& scales,
-                            torch::Tensor& g_idx,
-                            int64_t num_bits,
-                            bool act_order) {
+}  // namespace
+
+namespace detail {
+torch::Tensor gptq_marlin_repack_weight(torch::Tensor& qweight,
+                                        torch::Tensor& scales,
+                                        torch::Tensor& g_idx,
+                                        int64_t num_bits,
+                                        bool act_order) {
   torch::Tensor perm;
   if (act_order) {
     // sort g_idx in ascending order
@@ -69,8 +72,7 @@ torch::Tensor repack_weight(torch::Tensor& qweight,
   scales.set_data(marlin_scales);
   return perm;
 }
-
-}  // namespace
+}  // namespace detail
 
 ColumnParallelQLinearGPTQMarlinImpl::ColumnParallelQLinearGPTQMarlinImpl(
     int64_t in_features,
@@ -179,7 +181,8 @@ torch::Tensor ColumnParallelQLinearGPTQMarlinImpl::forward(
     torch::Tensor input) {
   // repack qweight and scales to marlin compatible format at the first call
   if (!perm_.defined()) {
-    perm_ = repack_weight(qweight_, scales_, g_idx_, bits_, act_order_);
+    perm_ = detail::gptq_marlin_repack_weight(
+        qweight_, scales_, g_idx_, bits_, act_order_);
     CHECK(perm_.defined());
   }
 
@@ -297,7 +300,8 @@ void RowParallelQLinearGPTQMarlinImpl::verify_loaded_weights(
 torch::Tensor RowParallelQLinearGPTQMarlinImpl::forward(torch::Tensor input) {
   // repack qweight and scales to marlin compatible format at the first call
   if (!perm_.defined()) {
-    perm_ = repack_weight(qweight_, scales_, g_idx_, bits_, act_order_);
+    perm_ = detail::gptq_marlin_repack_weight(
+        qweight_, scales_, g_idx_, bits_, act_order_);
     CHECK(perm_.defined());
   }
 
@@ -321,7 +325,7 @@ torch::Tensor RowParallelQLinearGPTQMarlinImpl::forward(torch::Tensor input) {
                     /*use_fp32_reduce=*/true);
 
   if (parallel_args_.world_size() > 1) {
-    output = reduce_from_model_parallel_region(output, parallel_args_);
+    output = reduce_row_parallel_output(output, parallel_args_);
   }
   // N.B. need to apply bias after the reduce
   if (bias_.defined()) {
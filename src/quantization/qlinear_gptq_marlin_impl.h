@@ -9,6 +9,15 @@
 #include "model_parallel/parallel_args.h"
 
 namespace llm {
+namespace detail {
+// permute and repack gptq qweight and scales into the marlin format in place,
+// returns the permutation for act order, empty otherwise.
+torch::Tensor gptq_marlin_repack_weight(torch::Tensor& qweight,
+                                        torch::Tensor& scales,
+                                        torch::Tensor& g_idx,
+                                        int64_t num_bits,
+                                        bool act_order);
+}  // namespace detail
 
 // Base QLinear class that handles quantized weights loading.
 // The linear layer is defined as Y = XA + b. A is parallelized along
@@ -6,6 +6,7 @@
 
 #include "layers/linear_impl.h"
 #include "model_loader/state_dict.h"
+#include "pack_utils.h"
 
 namespace llm {
 namespace {
@@ -13,6 +14,23 @@ int64_t round_up(int64_t num, int64_t multiple) {
   return ((num + multiple - 1) / multiple);
 }
 
+// reorder qweight in place once both qweight and g_idx are loaded, returns
+// the permutation of the input features, undefined if not ready yet.
+torch::Tensor maybe_reorder_act_order_qweight(torch::Tensor& qweight,
+                                              bool qweight_is_loaded,
+                                              const torch::Tensor& g_idx,
+                                              bool g_idx_is_loaded,
+                                              int64_t group_size,
+                                              int64_t bits) {
+  if (!qweight_is_loaded || !g_idx_is_loaded) {
+    return {};
+  }
+  auto [reordered_qweight, perm] =
+      detail::reorder_act_order_qweight(qweight, g_idx, group_size, bits);
+  qweight.copy_(reordered_qweight);
+  return perm;
+}
+
 }  // namespace
 
 namespace detail {
@@ -98,6 +116,37 @@ torch::Tensor construct_weights(
   weights = scales.unsqueeze(1) * (weights - zeros);
   return weights.reshape({-1, scales.size(1)});
 }
+
+std::tuple<torch::Tensor, torch::Tensor> reorder_act_order_qweight(
+    const torch::Tensor& qweight,  // [n_ints, out_features] IntTensor
+    const torch::Tensor& g_idx,    // [in_features] IntTensor
+    int64_t group_size,
+    int64_t bits) {
+  CHECK(32 % bits == 0) << "act order is not supported for " << bits
+                        << " bits";
+  const int64_t in_features = g_idx.numel();
+  CHECK_EQ(qweight.size(0) * (32 / bits), in_features)
+      << "g_idx size mismatch with qweight";
+
+  // stable sort to keep the order of rows within each group
+  const auto perm = std::get<1>(
+      g_idx.to(torch::kCPU).sort(/*stable=*/true, /*dim=*/0));
+  // the sorted groups must be full, which holds for checkpoints from gptq
+  const auto sorted_g_idx = g_idx.to(torch::kCPU).index_select(0, perm);
+  const auto expected_g_idx =
+      torch::arange(in_features, sorted_g_idx.options())
+          .div(group_size, /*rounding_mode=*/"floor");
+  CHECK(torch::equal(sorted_g_idx, expected_g_idx))
+      << "act order with partial groups is not supported";
+
+  // unpack along dim 0: [n_ints, out_features] => [in_features, out_features]
+  const auto weights =
+      pack_utils::unpack_cols(qweight.t().contiguous(), bits).t();
+  const auto reordered = weights.index_select(0, perm.to(weights.device()));
+  const auto reordered_qweight =
+      pack_utils::pack_cols(reordered.t().contiguous(), bits).t();
+  return {reordered_qweight.contiguous(), perm.to(qweight.device())};
+}
 }  // namespace detail
 
 ColumnParallelQLinearImpl::ColumnParallelQLinearImpl(
@@ -115,8 +164,13 @@ ColumnParallelQLinearImpl::ColumnParallelQLinearImpl(
   const auto bits = quant_args.bits();
   const auto group_size =
       quant_args.group_size() > 0 ? quant_args.group_size() : in_features;
+  group_size_ = group_size;
   CHECK(qweight_pack_dim == 0 || qweight_pack_dim == 1)
       << "qweight_pack_dim must be 0 or 1";
+  if (quant_args.desc_act()) {
+    CHECK_EQ(qweight_pack_dim, 0) << "act order needs qweight packed on dim 0";
+    g_idx_ = torch::empty({in_features}, options.dtype(torch::kInt32));
+  }
   const int64_t world_size = parallel_args.world_size();
   CHECK(out_features % world_size == 0)
       << "out_features " << out_features << " not divisible by world_size "
@@ -186,12 +240,24 @@ void ColumnParallelQLinearImpl::load_state_dict(const StateDict& state_dict) {
     // load sharded bias on dim 0
     LOAD_SHARDED_WEIGHT(bias, 0);
   }
+
+  if (g_idx_.defined() && !act_order_perm_.defined()) {
+    // g_idx is not sharded for column parallelism
+    LOAD_WEIGHT(g_idx);
+    act_order_perm_ = maybe_reorder_act_order_qweight(qweight_,
+                                                      qweight_is_loaded_,
+                                                      g_idx_,
+                                                      g_idx_is_loaded_,
+                                                      group_size_,
+                                                      bits_);
+  }
 }
 
 // special load_state_dict for fused cases
 void ColumnParallelQLinearImpl::load_state_dict(
     const StateDict& state_dict,
     const std::vector<std::string>& prefixes) {
+  CHECK(!g_idx_.defined()) << "fused weight does not support desc_act";
   const auto rank = parallel_args_.rank();
   const auto world_size = parallel_args_.world_size();
 
@@ -215,6 +281,8 @@ void ColumnParallelQLinearImpl::verify_loaded_weights(
   CHECK(scales_is_loaded_) << "scales is not loaded for " << prefix + "scales";
   CHECK(!bias_.defined() || bias_is_loaded_)
       << "bias is not loaded for " << prefix + "bias";
+  CHECK(!g_idx_.defined() || g_idx_is_loaded_)
+      << "g_idx is not loaded for " << prefix + "g_idx";
 }
 
 RowParallelQLinearImpl::RowParallelQLinearImpl(
@@ -240,6 +308,14 @@ RowParallelQLinearImpl::RowParallelQLinearImpl(
   const int64_t pack_factor = 32 / bits;
   const auto group_size =
       quant_args.group_size() > 0 ? quant_args.group_size() : in_features;
+  group_size_ = group_size;
+  if (quant_args.desc_act()) {
+    CHECK_EQ(qweight_pack_dim, 0) << "act order needs qweight packed on dim 0";
+    // the rows of a shard belong to any group, which needs all the scales
+    CHECK_EQ(world_size, 1)
+        << "act order with row parallelism is only supported by marlin";
+    g_idx_ = torch::empty({in_features}, options.dtype(torch::kInt32));
+  }
 
   if (qweight_pack_dim == 0) {
     qweight_ = register_parameter(
@@ -303,6 +379,16 @@ void RowParallelQLinearImpl::load_state_dict(const StateDict& state_dict) {
     // load bias
     LOAD_WEIGHT(bias);
   }
+
+  if (g_idx_.defined() && !act_order_perm_.defined()) {
+    LOAD_WEIGHT(g_idx);
+    act_order_perm_ = maybe_reorder_act_order_qweight(qweight_,
+                                                      qweight_is_loaded_,
+                                                      g_idx_,
+                                                      g_idx_is_loaded_,
+                                                      group_size_,
+                                                      bits_);
+  }
 }
 
 void RowParallelQLinearImpl::verify_loaded_weights(
@@ -313,6 +399,8 @@ void RowParallelQLinearImpl::verify_loaded_weights(
   CHECK(scales_is_loaded_) << "scales is not loaded for " << prefix + "scales";
   CHECK(!bias_.defined() || bias_is_loaded_)
       << "bias is not loaded for " << prefix + "bias";
+  CHECK(!g_idx_.defined() || g_idx_is_loaded_)
+      << "g_idx is not loaded for " << prefix + "g_idx";
 }
 
 }  // namespace llm
@@ -3,6 +3,8 @@
 #include <ATen/core/TensorBody.h>
 #include <torch/torch.h>
 
+#include <tuple>
+
 #include "layers/linear_impl.h"
 #include "layers/weight_utils.h"
 #include "model_loader/state_dict.h"
@@ -33,6 +35,16 @@ torch::Tensor construct_weights(
     const torch::Tensor& scales,    // [n_groups, out_features] HalfTensor
     int64_t bits);
 
+// reorder the rows of qweight packed on dim 0 so that the rows of each group
+// of an act-order (desc_act) checkpoint are contiguous, which lets it run on
+// the kernels without act order. returns the reordered qweight and the
+// permutation to gather the input features with: input[:, perm] @ weights.
+std::tuple<torch::Tensor, torch::Tensor> reorder_act_order_qweight(
+    const torch::Tensor& qweight,  // [n_ints, out_features] IntTensor
+    const torch::Tensor& g_idx,    // [in_features] IntTensor
+    int64_t group_size,
+    int64_t bits);
+
 }  // namespace detail
 
 // Base QLinear class that handles quantized weights loading.
@@ -59,6 +71,10 @@ class ColumnParallelQLinearImpl : public ParallelLinearImpl {
                                      const torch::Tensor& scales_) const;
 
   torch::Tensor forward(torch::Tensor input) override {
+    if (act_order_perm_.defined()) {
+      // weights of act order are reordered at load time, gather the input
+      input = input.index_select(/*dim=*/-1, act_order_perm_);
+    }
     auto output = quant_matmul(input, qweight_, qzeros_, scales_);
     if (bias_.defined()) {
       output.add_(bias_);
@@ -89,8 +105,14 @@ class ColumnParallelQLinearImpl : public ParallelLinearImpl {
   DEFINE_FUSED_WEIGHT(scales);
   DEFINE_FUSED_WEIGHT(bias);
 
+  // act order: g_idx from the checkpoint and the permutation of the input
+  // features once qweight is reordered
+  DEFINE_WEIGHT(g_idx);
+  torch::Tensor act_order_perm_;
+
   // quantization parameters
   int64_t bits_ = 0;
+  int64_t group_size_ = 0;
 
   // whether to gather the output
   bool gather_output_;
@@ -131,10 +153,17 @@ class RowParallelQLinearImpl : public ParallelLinearImpl {
       input = scatter_to_model_parallel_region(input, parallel_args_);
     }
 
-    auto output = quant_matmul(input, qweight_, qzeros_, scales_);
-    if (parallel_args_.world_size() > 1) {
-      output = reduce_from_model_parallel_region(output, parallel_args_);
+    if (act_order_perm_.defined()) {
+      // weights of act order are reordered at load time, gather the input
+      input = input.index_select(/*dim=*/-1, act_order_perm_);
     }
+
+    auto output = matmul_reduce_from_model_parallel_region(
+        input,
+        [this](const torch::Tensor& chunk) {
+          return quant_matmul(chunk, qweight_, qzeros_, scales_);
+        },
+        parallel_args_);
     // N.B. need to apply bias after the reduce
     if (bias_.defined()) {
       output.add_(bias_);
@@ -161,8 +190,14 @@ class RowParallelQLinearImpl : public ParallelLinearImpl {
   DEFINE_WEIGHT(scales);
   DEFINE_WEIGHT(bias);
 
+  // act order: g_idx from the checkpoint and the permutation of the input
+  // features once qweight is reordered
+  DEFINE_WEIGHT(g_idx);
+  torch::Tensor act_order_perm_;
+
   // quantization parameters
   int64_t bits_ = 0;
+  int64_t group_size_ = 0;
 
   // whether the input is already parallelized
   bool input_is_parallelized_;
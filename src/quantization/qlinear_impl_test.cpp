@@ -3,6 +3,8 @@
 #include <torch/torch.h>
 
 #include "model_loader/state_dict.h"
+#include "pack_utils.h"
+#include "qlinear_gptq_auto_impl.h"
 #include "qlinear_gptq_impl.h"
 
 namespace llm {
@@ -21,6 +23,53 @@ TEST(QlinearTest, Basic) {
   EXPECT_TRUE(torch::allclose(weights, weights_2));
 }
 
+TEST(QlinearTest, ReorderActOrder) {
+  const int64_t in_features = 256;
+  const int64_t out_features = 64;
+  const int64_t group_size = 32;
+  const int64_t bits = 4;
+  const int64_t n_groups = in_features / group_size;
+
+  // qweight packed on dim 0: [in_features / 8, out_features]
+  const auto weights = torch::randint(
+      0, 1 << bits, {in_features, out_features}, torch::kInt32);
+  const auto qweight =
+      pack_utils::pack_cols(weights.t().contiguous(), bits).t().contiguous();
+  const auto qzeros =
+      pack_utils::pack_cols(torch::randint(0, 1 << bits,
+                                           {n_groups, out_features},
+                                           torch::kInt32),
+                            bits);
+  const auto scales = torch::rand({n_groups, out_features});
+
+  // act order: the rows of each group are scattered over the input features
+  const auto order = torch::randperm(in_features, torch::kInt32);
+  auto g_idx = torch::empty({in_features}, torch::kInt32);
+  g_idx.index_put_({order},
+                   torch::arange(in_features, torch::kInt32)
+                       .div(group_size, /*rounding_mode=*/"floor"));
+
+  const auto act_order_weights =
+      detail::construct_weights(qweight, qzeros, scales, g_idx, bits);
+
+  auto [reordered_qweight, perm] =
+      detail::reorder_act_order_qweight(qweight, g_idx, group_size, bits);
+  EXPECT_EQ(reordered_qweight.sizes(), qweight.sizes());
+  // groups are contiguous after the reorder
+  const auto reordered_weights =
+      detail::construct_weights(reordered_qweight, qzeros, scales, bits);
+  EXPECT_TRUE(torch::equal(reordered_weights,
+                           act_order_weights.index_select(0, perm)));
+
+  // gathering the input gives the same output
+  const auto input = torch::rand({8, in_features});
+  EXPECT_TRUE(torch::allclose(
+      torch::matmul(input.index_select(-1, perm), reordered_weights),
+      torch::matmul(input, act_order_weights),
+      /*rtol=*/1e-4,
+      /*atol=*/1e-4));
+}
+
 TEST(QlinearTest, ColumnParallelQuantLinear) {
   if (!torch::cuda::is_available()) {
     GTEST_SKIP() << "CUDA not available, skipping test";
@@ -95,4 +144,46 @@ TEST(QlinearTest, RowParallelQuantLinear) {
                               /*atol=*/1e-02));
 }
 
+TEST(QlinearTest, ColumnParallelQuantLinearAuto) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+
+  const int64_t in_features = 4096;
+  const int64_t out_features = 4096;
+  QuantArgs quant_args;
+  quant_args.bits(4);
+  quant_args.group_size(128);
+  quant_args.is_sym(true);
+  const auto options = torch::dtype(torch::kHalf).device(torch::kCUDA);
+  ColumnParallelQLinearGPTQAutoImpl qlinear(in_features,
+                                            out_features,
+                                            /*bias=*/false,
+                                            quant_args,
+                                            /*gather_output=*/false,
+                                            ParallelArgs(0, 1, nullptr),
+                                            options);
+  auto state_dict = StateDict::load_safetensors("data/gptq.safetensors");
+  auto weights = detail::construct_weights(state_dict->get_tensor("qweight"),
+                                           state_dict->get_tensor("qzeros"),
+                                           state_dict->get_tensor("scales"),
+                                           /*bits=*/4);
+  weights = weights.to(torch::kCUDA);
+
+  qlinear.load_state_dict(*state_dict);
+  qlinear.verify_loaded_weights();
+
+  // exllamav2, marlin and dequantization with the default kernels
+  for (int64_t n_tokens : {1, 17, 300}) {
+    auto input = torch::rand({n_tokens, in_features}, options);
+    auto output = qlinear.forward(input);
+    auto desired_output = torch::matmul(input, weights);
+    EXPECT_TRUE(torch::allclose(output,
+                                desired_output,
+                                /*rtol=*/1e-01,
+                                /*atol=*/1e-02))
+        << "n_tokens: " << n_tokens;
+  }
+}
+
 }  // namespace llm
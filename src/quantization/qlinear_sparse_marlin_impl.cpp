@@ -0,0 +1,295 @@
+#include "qlinear_sparse_marlin_impl.h"
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+#include <torch/types.h>
+
+#include <cstdint>
+
+#include "kernels/quantization/marlin.h"
+#include "layers/weight_utils.h"
+#include "model_loader/state_dict.h"
+#include "model_parallel/model_parallel.h"
+
+namespace llm {
+namespace {
+// the kernel tiles: 16 rows of k and 16 columns of n are packed together
+constexpr int64_t kTileSize = 16;
+// the min thread_k and the max thread_m of the kernel configs
+constexpr int64_t kMinThreadK = 128;
+constexpr int64_t kMaxThreadM = 256;
+// the max number of parallel problems, decides the workspace size
+constexpr int64_t kMaxPar = 16;
+
+void check_sparse_marlin_quant_args(const QuantArgs& quant_args,
+                                    const torch::TensorOptions& options) {
+  CHECK_EQ(quant_args.bits(), 4) << "Only 4 bits are supported for marlin_24";
+
+  const auto group_size = quant_args.group_size();
+  CHECK(group_size == -1 || group_size == 128)
+      << "Only group_size of -1 and 128 are supported for marlin_24";
+
+  CHECK(!quant_args.desc_act()) << "act_order is not supported for marlin_24";
+  CHECK(options.dtype() == torch::kHalf)
+      << "Only float16 activations are supported for marlin_24";
+}
+
+int64_t num_groups(const QuantArgs& quant_args, int64_t in_features) {
+  if (quant_args.group_size() <= 0) {
+    return 1;
+  }
+  CHECK(in_features % quant_args.group_size() == 0);
+  return in_features / quant_args.group_size();
+}
+
+torch::Tensor sparse_gemm(const torch::Tensor& input,
+                          const torch::Tensor& qweight,
+                          const torch::Tensor& meta,
+                          const torch::Tensor& scales,
+                          torch::Tensor& workspace) {
+  auto output = torch::empty({input.size(0), scales.size(1)}, input.options());
+  marlin::fp16_int4_sparse_gemm(input,
+                                qweight,
+                                meta,
+                                output,
+                                scales,
+                                workspace,
+                                /*thread_k=*/-1,
+                                /*thread_m=*/-1,
+                                /*sms=*/-1,
+                                kMaxPar);
+  return output;
+}
+
+}  // namespace
+
+ColumnParallelQLinearSparseMarlinImpl::ColumnParallelQLinearSparseMarlinImpl(
+    int64_t in_features,
+    int64_t out_features,
+    bool bias,
+    const QuantArgs& quant_args,
+    bool gather_output,
+    const ParallelArgs& parallel_args,
+    const torch::TensorOptions& options)
+    : gather_output_(gather_output), parallel_args_(parallel_args) {
+  check_sparse_marlin_quant_args(quant_args, options);
+
+  const int64_t world_size = parallel_args.world_size();
+  CHECK(out_features % world_size == 0)
+      << "out_features " << out_features << " not divisible by world_size "
+      << world_size;
+  const int64_t out_features_per_partition = out_features / world_size;
+  const int64_t pack_factor = 32 / quant_args.bits();
+
+  // verify shapes
+  CHECK(out_features_per_partition % kMaxThreadM == 0)
+      << "out_features_per_partition " << out_features_per_partition
+      << " not divisible by " << kMaxThreadM;
+  CHECK(in_features % kMinThreadK == 0)
+      << "in_features " << in_features << " not divisible by " << kMinThreadK;
+
+  // half of the weights are kept: (k/16/2, n*16/pack_factor)
+  const int64_t qweight_cols =
+      out_features_per_partition * kTileSize / pack_factor;
+  qweight_ = torch::empty({in_features / kTileSize / 2, qweight_cols},
+                          options.dtype(torch::kInt32));
+  // 2-bit positions of the kept weights: (k/32, n*2)
+  meta_ = torch::empty({in_features / 32, out_features_per_partition * 2},
+                       options.dtype(torch::kInt16));
+  scales_ = torch::empty(
+      {num_groups(quant_args, in_features), out_features_per_partition},
+      options);
+
+  if (bias) {
+    bias_ = torch::empty({out_features_per_partition}, options);
+  }
+
+  const int64_t max_workspace_size =
+      out_features_per_partition / kMinThreadK * kMaxPar;
+  workspace_ = torch::zeros({max_workspace_size}, options.dtype(torch::kInt32));
+}
+
+// load the weight from the checkpoint
+void ColumnParallelQLinearSparseMarlinImpl::load_state_dict(
+    const StateDict& state_dict) {
+  const auto rank = parallel_args_.rank();
+  const auto world_size = parallel_args_.world_size();
+
+  // load sharded weights on dim 1
+  WeightUtils::load_sharded_weight(
+      state_dict, "B_24", 1, rank, world_size, qweight_, qweight_is_loaded_);
+  WeightUtils::load_sharded_weight(
+      state_dict, "B_meta", 1, rank, world_size, meta_, meta_is_loaded_);
+  WeightUtils::load_sharded_weight(
+      state_dict, "s", 1, rank, world_size, scales_, scales_is_loaded_);
+
+  // load bias if defined
+  if (bias_.defined()) {
+    // load sharded bias on dim 0
+    LOAD_SHARDED_WEIGHT(bias, 0);
+  }
+}
+
+// special load_state_dict for fused cases
+void ColumnParallelQLinearSparseMarlinImpl::load_state_dict(
+    const StateDict& state_dict,
+    const std::vector<std::string>& prefixes) {
+  const auto rank = parallel_args_.rank();
+  const auto world_size = parallel_args_.world_size();
+
+  // load and merge weights on dim 1
+  WeightUtils::load_fused_weight(state_dict,
+                                 prefixes,
+                                 "B_24",
+                                 1,
+                                 rank,
+                                 world_size,
+                                 qweight_list_,
+                                 qweight_,
+                                 qweight_is_loaded_);
+  WeightUtils::load_fused_weight(state_dict,
+                                 prefixes,
+                                 "B_meta",
+                                 1,
+                                 rank,
+                                 world_size,
+                                 meta_list_,
+                                 meta_,
+                                 meta_is_loaded_);
+  WeightUtils::load_fused_weight(state_dict,
+                                 prefixes,
+                                 "s",
+                                 1,
+                                 rank,
+                                 world_size,
+                                 scales_list_,
+                                 scales_,
+                                 scales_is_loaded_);
+
+  // load bias if defined
+  if (bias_.defined()) {
+    // load and merge bias on dim 0
+    LOAD_FUSED_WEIGHT(bias, 0);
+  }
+}
+
+void ColumnParallelQLinearSparseMarlinImpl::verify_loaded_weights(
+    const std::string& prefix) const {
+  CHECK(qweight_is_loaded_) << "qweight is not loaded for " << prefix + "B_24";
+  CHECK(meta_is_loaded_) << "meta is not loaded for " << prefix + "B_meta";
+  CHECK(scales_is_loaded_) << "scales is not loaded for " << prefix + "s";
+  CHECK(!bias_.defined() || bias_is_loaded_)
+      << "bias is not loaded for " << prefix + "bias";
+}
+
+torch::Tensor ColumnParallelQLinearSparseMarlinImpl::forward(
+    torch::Tensor input) {
+  auto output = sparse_gemm(input, qweight_, meta_, scales_, workspace_);
+  if (bias_.defined()) {
+    output.add_(bias_);
+  }
+  if (parallel_args_.world_size() > 1 && gather_output_) {
+    output = gather_from_model_parallel_region(output, parallel_args_);
+  }
+  return output;
+}
+
+// RowParallelQLinearSparseMarlinImpl
+RowParallelQLinearSparseMarlinImpl::RowParallelQLinearSparseMarlinImpl(
+    int64_t in_features,
+    int64_t out_features,
+    bool bias,
+    const QuantArgs& quant_args,
+    bool input_is_parallelized,
+    const ParallelArgs& parallel_args,
+    const torch::TensorOptions& options)
+    : input_is_parallelized_(input_is_parallelized),
+      parallel_args_(parallel_args) {
+  check_sparse_marlin_quant_args(quant_args, options);
+
+  const int64_t world_size = parallel_args.world_size();
+  CHECK(in_features % world_size == 0)
+      << "in_features " << in_features << " not divisible by world_size "
+      << world_size;
+  const int64_t in_features_per_partition = in_features / world_size;
+  const int64_t pack_factor = 32 / quant_args.bits();
+
+  // verify shapes
+  CHECK(out_features % kMaxThreadM == 0)
+      << "out_features " << out_features << " not divisible by "
+      << kMaxThreadM;
+  CHECK(in_features_per_partition % kMinThreadK == 0)
+      << "in_features_per_partition " << in_features_per_partition
+      << " not divisible by " << kMinThreadK;
+
+  // half of the weights are kept: (k/16/2, n*16/pack_factor)
+  qweight_ = torch::empty({in_features_per_partition / kTileSize / 2,
+                           out_features * kTileSize / pack_factor},
+                          options.dtype(torch::kInt32));
+  // 2-bit positions of the kept weights: (k/32, n*2)
+  meta_ = torch::empty({in_features_per_partition / 32, out_features * 2},
+                       options.dtype(torch::kInt16));
+  // channelwise scales are not sharded
+  scales_ = torch::empty(
+      {num_groups(quant_args, in_features_per_partition), out_features},
+      options);
+
+  if (bias) {
+    bias_ = torch::empty({out_features}, options);
+  }
+
+  const int64_t max_workspace_size = out_features / kMinThreadK * kMaxPar;
+  workspace_ = torch::zeros({max_workspace_size}, options.dtype(torch::kInt32));
+}
+
+// load the weight from the checkpoint
+void RowParallelQLinearSparseMarlinImpl::load_state_dict(
+    const StateDict& state_dict) {
+  const auto rank = parallel_args_.rank();
+  const auto world_size = parallel_args_.world_size();
+
+  // load sharded weights on dim 0
+  WeightUtils::load_sharded_weight(
+      state_dict, "B_24", 0, rank, world_size, qweight_, qweight_is_loaded_);
+  WeightUtils::load_sharded_weight(
+      state_dict, "B_meta", 0, rank, world_size, meta_, meta_is_loaded_);
+  if (scales_.size(0) == 1) {
+    // channelwise scales
+    WeightUtils::load_weight(state_dict, "s", scales_, scales_is_loaded_);
+  } else {
+    WeightUtils::load_sharded_weight(
+        state_dict, "s", 0, rank, world_size, scales_, scales_is_loaded_);
+  }
+
+  if (bias_.defined()) {
+    // load bias
+    LOAD_WEIGHT(bias);
+  }
+}
+
+void RowParallelQLinearSparseMarlinImpl::verify_loaded_weights(
+    const std::string& prefix) const {
+  CHECK(qweight_is_loaded_) << "qweight is not loaded for " << prefix + "B_24";
+  CHECK(meta_is_loaded_) << "meta is not loaded for " << prefix + "B_meta";
+  CHECK(scales_is_loaded_) << "scales is not loaded for " << prefix + "s";
+  CHECK(!bias_.defined() || bias_is_loaded_)
+      << "bias is not loaded for " << prefix + "bias";
+}
+
+torch::Tensor RowParallelQLinearSparseMarlinImpl::forward(torch::Tensor input) {
+  if (!input_is_parallelized_) {
+    input = scatter_to_model_parallel_region(input, parallel_args_);
+  }
+
+  auto output = sparse_gemm(input, qweight_, meta_, scales_, workspace_);
+  if (parallel_args_.world_size() > 1) {
+    output = reduce_row_parallel_output(output, parallel_args_);
+  }
+  // N.B. need to apply bias after the reduce
+  if (bias_.defined()) {
+    output.add_(bias_);
+  }
+  return output;
+}
+
+}  // namespace llm
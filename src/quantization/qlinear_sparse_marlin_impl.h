@@ -0,0 +1,104 @@
+#pragma once
+
+#include <ATen/core/TensorBody.h>
+#include <torch/torch.h>
+
+#include "layers/linear.h"
+#include "layers/weight_utils.h"
+#include "model_loader/state_dict.h"
+#include "model_parallel/parallel_args.h"
+
+namespace llm {
+
+// QLinear for 2:4 sparse int4 weights in the sparse marlin format, aka
+// checkpoint_format "marlin_24" of gptq. Only the 2 kept weights of every 4
+// along the input features are stored, with the 2-bit metadata of their
+// positions, which halves the weights read by the gemm.
+class ColumnParallelQLinearSparseMarlinImpl : public ParallelLinearImpl {
+ public:
+  ColumnParallelQLinearSparseMarlinImpl(int64_t in_features,
+                                        int64_t out_features,
+                                        bool bias,
+                                        const QuantArgs& quant_args,
+                                        bool gather_output,
+                                        const ParallelArgs& parallel_args,
+                                        const torch::TensorOptions& options);
+
+  // verify if the weight is loaded correctly
+  void verify_loaded_weights(const std::string& prefix = "") const override;
+
+  torch::Tensor forward(torch::Tensor input) override;
+
+  // load the weight from the checkpoint
+  void load_state_dict(const StateDict& state_dict) override;
+
+  // special load_state_dict for fused cases
+  void load_state_dict(const StateDict& state_dict,
+                       const std::vector<std::string>& prefixes) override;
+
+  void pretty_print(std::ostream& stream) const override {
+    stream << name() << " qweight=" << qweight_.sizes()
+           << " meta=" << meta_.sizes() << " scales=" << scales_.sizes()
+           << " device=" << qweight_.device();
+  }
+
+ private:
+  // parameter members, must be registered
+  // loaded from "B_24", "B_meta" and "s" of the checkpoint
+  DEFINE_FUSED_WEIGHT(qweight);
+  DEFINE_FUSED_WEIGHT(meta);
+  DEFINE_FUSED_WEIGHT(scales);
+  DEFINE_FUSED_WEIGHT(bias);
+
+  // buffers
+  torch::Tensor workspace_;
+
+  // whether to gather the output
+  bool gather_output_ = false;
+
+  // parallel args
+  ParallelArgs parallel_args_;
+};
+
+class RowParallelQLinearSparseMarlinImpl : public ParallelLinearImpl {
+ public:
+  RowParallelQLinearSparseMarlinImpl(int64_t in_features,
+                                     int64_t out_features,
+                                     bool bias,
+                                     const QuantArgs& quant_args,
+                                     bool input_is_parallelized,
+                                     const ParallelArgs& parallel_args,
+                                     const torch::TensorOptions& options);
+
+  torch::Tensor forward(torch::Tensor input) override;
+
+  // load the weight from the checkpoint
+  void load_state_dict(const StateDict& state_dict) override;
+
+  // whether the weight is loaded
+  void verify_loaded_weights(const std::string& prefix = "") const override;
+
+  void pretty_print(std::ostream& stream) const override {
+    stream << name() << " qweight=" << qweight_.sizes()
+           << " meta=" << meta_.sizes() << " scales=" << scales_.sizes()
+           << " device=" << qweight_.device();
+  }
+
+ private:
+  // parameter members, must be registered
+  // loaded from "B_24", "B_meta" and "s" of the checkpoint
+  DEFINE_WEIGHT(qweight);
+  DEFINE_WEIGHT(meta);
+  DEFINE_WEIGHT(scales);
+  DEFINE_WEIGHT(bias);
+
+  // buffers
+  torch::Tensor workspace_;
+
+  // whether the input is already parallelized
+  bool input_is_parallelized_;
+
+  // parallel args
+  ParallelArgs parallel_args_;
+};
+}  // namespace llm
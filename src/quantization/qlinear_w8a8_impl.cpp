@@ -0,0 +1,522 @@
+#include "qlinear_w8a8_impl.h"
+
+#include <ATen/cuda/CUDAContext.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <boost/algorithm/string.hpp>
+#include <tuple>
+
+#include "kernels/gemm/gemm_api.h"
+#include "kernels/quant_kernels.h"
+#include "kernels/quantization/marlin.h"
+#include "layers/weight_utils.h"
+#include "model_loader/state_dict.h"
+#include "model_parallel/model_parallel.h"
+
+namespace llm {
+namespace {
+// quantize the input with per token scales: scale = absmax / max_quant_value
+std::tuple<torch::Tensor, torch::Tensor> quant_per_token(
+    const torch::Tensor& input,
+    torch::ScalarType quant_dtype) {
+  if (input.is_cuda()) {
+    auto output = torch::empty_like(input, input.options().dtype(quant_dtype));
+    auto scale =
+        torch::empty({input.size(0)}, input.options().dtype(torch::kFloat));
+    kernel::per_token_quant(output, scale, input);
+    return {output, scale};
+  }
+  const float max_value = quant_dtype == torch::kInt8 ? 127.0f : 448.0f;
+  const auto x = input.to(torch::kFloat);
+  const auto scale =
+      (x.abs().amax(/*dim=*/-1) / max_value).clamp_min(/*min=*/1e-8);
+  auto output = (x / scale.unsqueeze(/*dim=*/-1)).clamp(-max_value, max_value);
+  if (quant_dtype == torch::kInt8) {
+    output = output.round();
+  }
+  return {output.to(quant_dtype), scale};
+}
+
+// load the weight scale of a [rows, in_features] weight, a per tensor scale
+// is returned as [1] and a per channel scale as [rows]
+torch::Tensor load_weight_scale(const StateDict& state_dict,
+                                const std::string& name,
+                                int32_t rank,
+                                int32_t world_size) {
+  const auto scale = state_dict.get_tensor(name);
+  if (!scale.defined() || scale.numel() == 1) {
+    return scale.defined() ? scale.reshape({1}) : scale;
+  }
+  // [rows] or [rows, 1]
+  return state_dict.get_sharded_tensor(name, /*dim=*/0, rank, world_size)
+      .reshape({-1});
+}
+
+// copy the per tensor or per channel scale into the per channel scale
+void copy_weight_scale(torch::Tensor& weight_scale,
+                       const torch::Tensor& scale) {
+  if (scale.numel() == 1) {
+    weight_scale.fill_(scale.item<float>());
+  } else {
+    CHECK_EQ(weight_scale.sizes(), scale.sizes()) << "weight_scale mismatch";
+    weight_scale.copy_(scale);
+  }
+}
+
+// whether the checkpoint weight is not quantized yet, e.g. a fp16 or bf16
+// checkpoint served with quant_method=fp8
+bool is_dense_weight(const torch::Tensor& tensor, const torch::Tensor& weight) {
+  return tensor.defined() && tensor.is_floating_point() &&
+         tensor.scalar_type() != weight.scalar_type();
+}
+
+// quantize the dense weight per output channel on the device of the weight,
+// returns the weight and its per channel scale
+std::tuple<torch::Tensor, torch::Tensor> quant_dense_weight(
+    const torch::Tensor& tensor,
+    const torch::Tensor& weight) {
+  CHECK_EQ(tensor.dim(), 2) << "weight must be 2-D";
+  return quant_per_token(tensor.to(weight.device()).contiguous(),
+                         weight.scalar_type());
+}
+
+void load_dense_weight(const torch::Tensor& tensor,
+                       torch::Tensor& weight,
+                       torch::Tensor& weight_scale) {
+  const auto [qweight, scale] = quant_dense_weight(tensor, weight);
+  CHECK_EQ(weight.sizes(), qweight.sizes()) << "weight size mismatch";
+  weight.copy_(qweight);
+  weight_scale.copy_(scale);
+}
+
+// scales permutation of marlin for channelwise quantization
+const std::vector<int64_t> kScalesPermSingle = {
+    0, 1, 8,  9,  16, 17, 24, 25, 2, 3, 10, 11, 18, 19, 26, 27,
+    4, 5, 12, 13, 20, 21, 28, 29, 6, 7, 14, 15, 22, 23, 30, 31,
+};
+
+bool can_use_fp8_marlin(const torch::Tensor& input,
+                        const torch::Tensor& weight) {
+  if (!input.is_cuda() || weight.scalar_type() != torch::kFloat8_e4m3fn) {
+    return false;
+  }
+  const auto dtype = input.scalar_type();
+  if (dtype != torch::kHalf && dtype != torch::kBFloat16) {
+    return false;
+  }
+  if (at::cuda::getDeviceProperties(input.get_device())->major < 8) {
+    return false;
+  }
+  // the min thread tile of marlin is 128x64
+  const auto n = weight.size(0);
+  const auto k = weight.size(1);
+  return n % 64 == 0 && k % 128 == 0;
+}
+
+// repack the [n, k] fp8 weight and its [n] scales for the marlin fp8 gemm
+void repack_fp8_marlin(const torch::Tensor& weight,
+                       const torch::Tensor& weight_scale,
+                       torch::ScalarType dtype,
+                       detail::W8A16Weight& w8a16_weight) {
+  const int64_t n = weight.size(0);
+  const int64_t k = weight.size(1);
+  // pack 4 fp8 values along k into int32: (n, k) -> (k/4, n)
+  const auto qweight =
+      weight.contiguous().view(torch::kInt32).t().contiguous();
+  auto marlin_qweight =
+      torch::empty({k / 16, n * 16 / 4}, qweight.options());
+  const auto perm = torch::empty({0}, qweight.options());
+  marlin::gptq_repack(qweight, perm, marlin_qweight, /*num_bits=*/8);
+
+  const int64_t perm_len = kScalesPermSingle.size();
+  const auto marlin_scales =
+      weight_scale.to(dtype)
+          .reshape({-1, perm_len})
+          .index_select(
+              /*dim=*/1,
+              torch::tensor(kScalesPermSingle, weight_scale.device()))
+          .reshape({1, n})
+          .contiguous();
+
+  w8a16_weight.marlin_qweight = marlin_qweight;
+  w8a16_weight.marlin_scales = marlin_scales;
+  w8a16_weight.workspace = torch::zeros(
+      {n / 64 * 16}, weight.options().dtype(torch::kInt32));
+}
+}  // namespace
+
+namespace detail {
+torch::ScalarType w8a8_quant_type(const QuantArgs& quant_args) {
+  const auto& quant_method = quant_args.quant_method();
+  if (boost::iequals(quant_method, "fp8")) {
+    return torch::kFloat8_e4m3fn;
+  }
+  CHECK(boost::iequals(quant_method, "w8a8") ||
+        boost::iequals(quant_method, "smoothquant"))
+      << "unsupported w8a8 quant method: " << quant_method;
+  CHECK(quant_args.bits() == 0 || quant_args.bits() == 8)
+      << "only 8 bits are supported for w8a8";
+  return torch::kInt8;
+}
+
+torch::Tensor w8a8_linear(const torch::Tensor& input,
+                          const torch::Tensor& weight,
+                          const torch::Tensor& weight_scale,
+                          const std::optional<torch::Tensor>& bias) {
+  const auto in_features = weight.size(1);
+  const auto x = input.reshape({-1, in_features}).contiguous();
+  auto [x_q, x_scale] = quant_per_token(x, weight.scalar_type());
+
+  const auto dtype = input.scalar_type();
+  torch::Tensor output;
+  if ((dtype == torch::kHalf || dtype == torch::kBFloat16) &&
+      can_use_scaled_gemm(x_q, weight)) {
+    output = scaled_gemm(x_q, x_scale, weight, weight_scale, bias, dtype);
+  } else {
+    // dequantize and multiply in float for other devices and shapes
+    const auto a = x_q.to(torch::kFloat) * x_scale.unsqueeze(/*dim=*/-1);
+    const auto b =
+        weight.to(torch::kFloat) * weight_scale.unsqueeze(/*dim=*/-1);
+    output = torch::matmul(a, b.t());
+    if (bias.has_value() && bias->defined()) {
+      output.add_(bias->to(torch::kFloat));
+    }
+    output = output.to(dtype);
+  }
+  auto out_sizes = input.sizes().vec();
+  out_sizes.back() = weight.size(0);
+  return output.reshape(out_sizes);
+}
+
+torch::Tensor w8a16_linear(const torch::Tensor& input,
+                           torch::Tensor& weight,
+                           const torch::Tensor& weight_scale,
+                           const std::optional<torch::Tensor>& bias,
+                           W8A16Weight& w8a16_weight) {
+  const auto dtype = input.scalar_type();
+  if (!w8a16_weight.repacked) {
+    if (can_use_fp8_marlin(input, weight)) {
+      repack_fp8_marlin(weight, weight_scale, dtype, w8a16_weight);
+      // release the memory of the original weight
+      weight.set_data(torch::empty({0}, weight.options()));
+    }
+    w8a16_weight.repacked = true;
+  }
+
+  const auto in_features = input.size(-1);
+  const auto x = input.reshape({-1, in_features}).contiguous();
+  torch::Tensor output;
+  if (w8a16_weight.marlin_qweight.defined()) {
+    const auto& scales = w8a16_weight.marlin_scales;
+    output = torch::empty({x.size(0), scales.size(1)}, x.options());
+    marlin::fp8_gemm(x,
+                     w8a16_weight.marlin_qweight,
+                     output,
+                     scales,
+                     w8a16_weight.workspace);
+  } else {
+    // dequantize the weight into the dtype of the input
+    const auto w =
+        (weight.to(torch::kFloat) * weight_scale.unsqueeze(/*dim=*/-1))
+            .to(dtype);
+    output = torch::matmul(x, w.t());
+  }
+  if (bias.has_value() && bias->defined()) {
+    output.add_(bias.value());
+  }
+  auto out_sizes = input.sizes().vec();
+  out_sizes.back() = output.size(-1);
+  return output.reshape(out_sizes);
+}
+}  // namespace detail
+
+ColumnParallelQLinearW8A8Impl::ColumnParallelQLinearW8A8Impl(
+    int64_t in_features,
+    int64_t out_features,
+    bool bias,
+    const QuantArgs& quant_args,
+    bool gather_output,
+    const ParallelArgs& parallel_args,
+    const torch::TensorOptions& options)
+    : weight_only_(quant_args.weight_only()),
+      gather_output_(gather_output),
+      parallel_args_(parallel_args) {
+  const auto quant_type = detail::w8a8_quant_type(quant_args);
+
+  const int64_t world_size = parallel_args.world_size();
+  CHECK(out_features % world_size == 0)
+      << "out_features " << out_features << " not divisible by world_size "
+      << world_size;
+  const int64_t out_features_per_partition = out_features / world_size;
+
+  weight_ = register_parameter(
+      "weight",
+      torch::empty({out_features_per_partition, in_features},
+                   options.dtype(quant_type)),
+      /*requires_grad=*/false);
+  weight_scale_ = register_parameter(
+      "weight_scale",
+      torch::empty({out_features_per_partition}, options.dtype(torch::kFloat)),
+      /*requires_grad=*/false);
+
+  if (bias) {
+    bias_ =
+        register_parameter("bias",
+                           torch::empty({out_features_per_partition}, options),
+                           /*requires_grad=*/false);
+  }
+}
+
+// load the weight from the checkpoint
+void ColumnParallelQLinearW8A8Impl::load_state_dict(
+    const StateDict& state_dict) {
+  const auto rank = parallel_args_.rank();
+  const auto world_size = parallel_args_.world_size();
+
+  // load sharded weights on dim 0
+  const auto tensor =
+      state_dict.get_sharded_tensor("weight", /*dim=*/0, rank, world_size);
+  if (is_dense_weight(tensor, weight_)) {
+    // quantize per channel while loading
+    load_dense_weight(tensor, weight_, weight_scale_);
+    weight_is_loaded_ = true;
+    weight_scale_is_loaded_ = true;
+  } else {
+    LOAD_SHARDED_WEIGHT(weight, 0);
+    const auto scale =
+        load_weight_scale(state_dict, "weight_scale", rank, world_size);
+    if (scale.defined()) {
+      copy_weight_scale(weight_scale_, scale);
+      weight_scale_is_loaded_ = true;
+    }
+  }
+
+  // load bias if defined
+  if (bias_.defined()) {
+    // load sharded bias on dim 0
+    LOAD_SHARDED_WEIGHT(bias, 0);
+  }
+}
+
+// special load_state_dict for fused cases
+void ColumnParallelQLinearW8A8Impl::load_state_dict(
+    const StateDict& state_dict,
+    const std::vector<std::string>& prefixes) {
+  const auto rank = parallel_args_.rank();
+  const auto world_size = parallel_args_.world_size();
+
+  std::vector<torch::Tensor> tensors(prefixes.size());
+  bool has_dense_weight = false;
+  for (size_t i = 0; i < prefixes.size(); ++i) {
+    tensors[i] = state_dict.get_sharded_tensor(
+        prefixes[i] + "weight", /*dim=*/0, rank, world_size);
+    has_dense_weight |= is_dense_weight(tensors[i], weight_);
+  }
+
+  if (has_dense_weight && !weight_is_loaded_) {
+    // quantize each weight per channel while loading, then merge the weights
+    // and scales on dim 0 once all are loaded
+    weight_list_.resize(prefixes.size());
+    weight_scale_list_.resize(prefixes.size());
+    for (size_t i = 0; i < prefixes.size(); ++i) {
+      if (tensors[i].defined()) {
+        std::tie(weight_list_[i], weight_scale_list_[i]) =
+            quant_dense_weight(tensors[i], weight_);
+      }
+    }
+    const bool all_loaded = std::all_of(
+        weight_list_.begin(),
+        weight_list_.end(),
+        [](const torch::Tensor& t) { return t.defined(); });
+    if (all_loaded) {
+      int64_t offset = 0;
+      for (size_t i = 0; i < weight_list_.size(); ++i) {
+        const int64_t rows = weight_list_[i].size(0);
+        CHECK_LE(offset + rows, weight_.size(0)) << "weight size mismatch";
+        weight_.narrow(/*dim=*/0, offset, rows).copy_(weight_list_[i]);
+        weight_scale_.narrow(/*dim=*/0, offset, rows)
+            .copy_(weight_scale_list_[i]);
+        offset += rows;
+      }
+      CHECK_EQ(offset, weight_.size(0)) << "weight size mismatch";
+      weight_is_loaded_ = true;
+      weight_scale_is_loaded_ = true;
+      // release the memory for the weight and scale lists
+      weight_list_.clear();
+      weight_scale_list_.clear();
+    }
+  } else {
+    // load and merge weights on dim 0
+    LOAD_FUSED_WEIGHT(weight, 0);
+
+    // each weight may have its own per tensor scale, expand them into per
+    // channel scales with the rows of the weights before merging
+    if (!weight_scale_is_loaded_) {
+      weight_scale_list_.resize(prefixes.size());
+      weight_rows_list_.resize(prefixes.size(), 0);
+      for (size_t i = 0; i < prefixes.size(); ++i) {
+        const auto weight = state_dict.get_sharded_tensor(
+            prefixes[i] + "weight", /*dim=*/0, rank, world_size);
+        if (weight.defined()) {
+          weight_rows_list_[i] = weight.size(0);
+        }
+        const auto scale = load_weight_scale(
+            state_dict, prefixes[i] + "weight_scale", rank, world_size);
+        if (scale.defined()) {
+          weight_scale_list_[i] = scale.to(torch::kFloat).clone();
+        }
+      }
+
+      bool all_loaded = true;
+      std::vector<torch::Tensor> scales;
+      for (size_t i = 0; i < prefixes.size() && all_loaded; ++i) {
+        const auto& scale = weight_scale_list_[i];
+        const auto rows = weight_rows_list_[i];
+        all_loaded = scale.defined() && (scale.numel() != 1 || rows > 0);
+        if (all_loaded) {
+          scales.push_back(scale.numel() == 1 ? scale.expand({rows}) : scale);
+        }
+      }
+      if (all_loaded) {
+        copy_weight_scale(weight_scale_, torch::cat(scales, /*dim=*/0));
+        weight_scale_is_loaded_ = true;
+        // release the memory for the scale list
+        weight_scale_list_.clear();
+        weight_rows_list_.clear();
+      }
+    }
+  }
+
+  // load bias if defined
+  if (bias_.defined()) {
+    // load and merge bias on dim 0
+    LOAD_FUSED_WEIGHT(bias, 0);
+  }
+}
+
+void ColumnParallelQLinearW8A8Impl::verify_loaded_weights(
+    const std::string& prefix) const {
+  CHECK(weight_is_loaded_) << "weight is not loaded for " << prefix + "weight";
+  CHECK(weight_scale_is_loaded_)
+      << "weight_scale is not loaded for " << prefix + "weight_scale";
+  CHECK(!bias_.defined() || bias_is_loaded_)
+      << "bias is not loaded for " << prefix + "bias";
+}
+
+torch::Tensor ColumnParallelQLinearW8A8Impl::forward(torch::Tensor input) {
+  auto output =
+      weight_only_
+          ? detail::w8a16_linear(
+                input, weight_, weight_scale_, bias_, w8a16_weight_)
+          : detail::w8a8_linear(input, weight_, weight_scale_, bias_);
+  if (parallel_args_.world_size() > 1 && gather_output_) {
+    output = gather_from_model_parallel_region(output, parallel_args_);
+  }
+  return output;
+}
+
+// RowParallelQLinearW8A8Impl
+RowParallelQLinearW8A8Impl::RowParallelQLinearW8A8Impl(
+    int64_t in_features,
+    int64_t out_features,
+    bool bias,
+    const QuantArgs& quant_args,
+    bool input_is_parallelized,
+    const ParallelArgs& parallel_args,
+    const torch::TensorOptions& options)
+    : weight_only_(quant_args.weight_only()),
+      input_is_parallelized_(input_is_parallelized),
+      parallel_args_(parallel_args) {
+  const auto quant_type = detail::w8a8_quant_type(quant_args);
+
+  const int64_t world_size = parallel_args.world_size();
+  CHECK(in_features % world_size == 0)
+      << "in_features " << in_features << " not divisible by world_size "
+      << world_size;
+  const int64_t in_features_per_partition = in_features / world_size;
+
+  weight_ = register_parameter(
+      "weight",
+      torch::empty({out_features, in_features_per_partition},
+                   options.dtype(quant_type)),
+      /*requires_grad=*/false);
+  weight_scale_ = register_parameter(
+      "weight_scale",
+      torch::empty({out_features}, options.dtype(torch::kFloat)),
+      /*requires_grad=*/false);
+
+  if (bias) {
+    bias_ = register_parameter("bias",
+                               torch::empty({out_features}, options),
+                               /*requires_grad=*/false);
+  }
+}
+
+// load the weight from the checkpoint
+void RowParallelQLinearW8A8Impl::load_state_dict(const StateDict& state_dict) {
+  const auto rank = parallel_args_.rank();
+  const auto world_size = parallel_args_.world_size();
+
+  // load sharded weights on dim 1
+  const auto tensor =
+      state_dict.get_sharded_tensor("weight", /*dim=*/1, rank, world_size);
+  if (is_dense_weight(tensor, weight_)) {
+    // quantize per channel while loading, the scales are of the shard
+    load_dense_weight(tensor, weight_, weight_scale_);
+    weight_is_loaded_ = true;
+    weight_scale_is_loaded_ = true;
+  } else {
+    LOAD_SHARDED_WEIGHT(weight, 1);
+    // scales of output channels are not sharded
+    const auto scale = load_weight_scale(state_dict,
+                                         "weight_scale",
+                                         /*rank=*/0,
+                                         /*world_size=*/1);
+    if (scale.defined()) {
+      copy_weight_scale(weight_scale_, scale);
+      weight_scale_is_loaded_ = true;
+    }
+  }
+
+  if (bias_.defined()) {
+    // load bias
+    LOAD_WEIGHT(bias);
+  }
+}
+
+void RowParallelQLinearW8A8Impl::verify_loaded_weights(
+    const std::string& prefix) const {
+  CHECK(weight_is_loaded_) << "weight is not loaded for " << prefix + "weight";
+  CHECK(weight_scale_is_loaded_)
+      << "weight_scale is not loaded for " << prefix + "weight_scale";
+  CHECK(!bias_.defined() || bias_is_loaded_)
+      << "bias is not loaded for " << prefix + "bias";
+}
+
+torch::Tensor RowParallelQLinearW8A8Impl::forward(torch::Tensor input) {
+  if (!input_is_parallelized_) {
+    input = scatter_to_model_parallel_region(input, parallel_args_);
+  }
+
+  auto output =
+      weight_only_
+          ? detail::w8a16_linear(input,
+                                 weight_,
+                                 weight_scale_,
+                                 /*bias=*/std::nullopt,
+                                 w8a16_weight_)
+          : detail::w8a8_linear(
+                input, weight_, weight_scale_, /*bias=*/std::nullopt);
+  if (parallel_args_.world_size() > 1) {
+    output = reduce_row_parallel_output(output, parallel_args_);
+  }
+  // N.B. need to apply bias after the reduce
+  if (bias_.defined()) {
+    output.add_(bias_);
+  }
+  return output;
+}
+
+}  // namespace llm
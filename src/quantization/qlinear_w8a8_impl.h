@@ -0,0 +1,156 @@
+#pragma once
+
+#include <torch/torch.h>
+
+#include <optional>
+
+#include "layers/linear.h"
+#include "layers/weight_utils.h"
+#include "model_loader/state_dict.h"
+#include "model_parallel/parallel_args.h"
+
+namespace llm {
+namespace detail {
+// quantized type of weights and activations: fp8 (e4m3) for "fp8", int8 for
+// "w8a8" and "smoothquant"
+torch::ScalarType w8a8_quant_type(const QuantArgs& quant_args);
+
+// quantize the input per token dynamically, then multiply with the weight
+// quantized per channel: (q(x) @ w.T) * x_scale * w_scale + bias
+torch::Tensor w8a8_linear(const torch::Tensor& input,
+                          const torch::Tensor& weight,
+                          const torch::Tensor& weight_scale,
+                          const std::optional<torch::Tensor>& bias);
+
+// the weight of the weight only (W8A16) linear, repacked at the first call
+// for the marlin fp8 gemm that dequantizes the weight in its mainloop
+struct W8A16Weight {
+  bool repacked = false;
+  // (k/16, n*16/4), undefined if marlin can't be used
+  torch::Tensor marlin_qweight;
+  // (1, n) in the dtype of the activations
+  torch::Tensor marlin_scales;
+  torch::Tensor workspace;
+};
+
+// multiply the 16-bit input with the weight quantized per channel without
+// quantizing the input: (x @ (w * w_scale).T) + bias. the weight is released
+// once repacked for marlin, otherwise it is dequantized before the matmul.
+torch::Tensor w8a16_linear(const torch::Tensor& input,
+                           torch::Tensor& weight,
+                           const torch::Tensor& weight_scale,
+                           const std::optional<torch::Tensor>& bias,
+                           W8A16Weight& w8a16_weight);
+}  // namespace detail
+
+// W8A8 linear with int8 or fp8 weights and activations, as produced by
+// SmoothQuant (smoothing folded into the weights) and fp8 checkpoints.
+// weights are quantized per channel (or per tensor) offline: "weight" and
+// "weight_scale", activations are quantized per token at runtime.
+// fp16/bf16 checkpoints are quantized per channel while loading, and with
+// weight_only the activations are kept unquantized (W8A16).
+// The linear layer is defined as Y = XA + b. A is parallelized along
+// its second dimension as A = [A_1, ..., A_p].
+class ColumnParallelQLinearW8A8Impl : public ParallelLinearImpl {
+ public:
+  ColumnParallelQLinearW8A8Impl(int64_t in_features,
+                                int64_t out_features,
+                                bool bias,
+                                const QuantArgs& quant_args,
+                                bool gather_output,
+                                const ParallelArgs& parallel_args,
+                                const torch::TensorOptions& options);
+
+  // verify if the weight is loaded correctly
+  void verify_loaded_weights(const std::string& prefix = "") const override;
+
+  torch::Tensor forward(torch::Tensor input) override;
+
+  // load the weight from the checkpoint
+  void load_state_dict(const StateDict& state_dict) override;
+
+  // special load_state_dict for fused cases
+  void load_state_dict(const StateDict& state_dict,
+                       const std::vector<std::string>& prefixes) override;
+
+  void pretty_print(std::ostream& stream) const override {
+    stream << name() << " weight=" << weight_.sizes()
+           << " weight_scale=" << weight_scale_.sizes()
+           << " device=" << weight_.device();
+  }
+
+ private:
+  // parameter members, must be registered
+  DEFINE_FUSED_WEIGHT(weight);
+  DEFINE_FUSED_WEIGHT(bias);
+  // [out_features_per_partition] per channel scales
+  DEFINE_WEIGHT(weight_scale);
+
+  // per prefix scales and rows for fused weights, a per tensor scale can
+  // only be expanded once the rows of its weight are known
+  std::vector<torch::Tensor> weight_scale_list_;
+  std::vector<int64_t> weight_rows_list_;
+
+  // whether to keep the activations unquantized
+  bool weight_only_ = false;
+  detail::W8A16Weight w8a16_weight_;
+
+  // whether to gather the output
+  bool gather_output_ = false;
+
+  // parallel args
+  ParallelArgs parallel_args_;
+};
+
+// W8A8 linear with int8 or fp8 weights and activations.
+//     The linear layer is defined as Y = XA + b. A is parallelized along
+//     its first dimension and X along its second dimension as:
+//                -   -
+//               | A_1 |
+//               | .   |
+//           A = | .   |       X = [X_1, ..., X_p]
+//               | .   |
+//               | A_p |
+//                -   -
+class RowParallelQLinearW8A8Impl : public ParallelLinearImpl {
+ public:
+  RowParallelQLinearW8A8Impl(int64_t in_features,
+                             int64_t out_features,
+                             bool bias,
+                             const QuantArgs& quant_args,
+                             bool input_is_parallelized,
+                             const ParallelArgs& parallel_args,
+                             const torch::TensorOptions& options);
+
+  torch::Tensor forward(torch::Tensor input) override;
+
+  // load the weight from the checkpoint
+  void load_state_dict(const StateDict& state_dict) override;
+
+  // whether the weight is loaded
+  void verify_loaded_weights(const std::string& prefix = "") const override;
+
+  void pretty_print(std::ostream& stream) const override {
+    stream << name() << " weight=" << weight_.sizes()
+           << " weight_scale=" << weight_scale_.sizes()
+           << " device=" << weight_.device();
+  }
+
+ private:
+  // parameter members, must be registered
+  DEFINE_WEIGHT(weight);
+  DEFINE_WEIGHT(bias);
+  // [out_features] per channel scales
+  DEFINE_WEIGHT(weight_scale);
+
+  // whether to keep the activations unquantized
+  bool weight_only_ = false;
+  detail::W8A16Weight w8a16_weight_;
+
+  // whether the input is already parallelized
+  bool input_is_parallelized_;
+
+  // parallel args
+  ParallelArgs parallel_args_;
+};
+}  // namespace llm
@@ -0,0 +1,217 @@
+#include "qlinear_w8a8_impl.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include "model_loader/state_dict.h"
+
+namespace llm {
+namespace {
+// symmetric per tensor quantization
+std::tuple<torch::Tensor, torch::Tensor> quant_per_tensor(
+    const torch::Tensor& x,
+    torch::ScalarType qtype) {
+  const float max_value = qtype == torch::kInt8 ? 127.0f : 448.0f;
+  const auto scale = x.abs().max() / max_value;
+  auto q = x / scale;
+  if (qtype == torch::kInt8) {
+    q = q.round().clamp(-max_value, max_value);
+  }
+  return {q.to(qtype), scale.to(torch::kFloat)};
+}
+
+// symmetric per channel quantization, the scale is of shape [rows, 1]
+std::tuple<torch::Tensor, torch::Tensor> quant_per_channel(
+    const torch::Tensor& x,
+    torch::ScalarType qtype) {
+  const float max_value = qtype == torch::kInt8 ? 127.0f : 448.0f;
+  const auto scale =
+      (x.abs().amax(/*dim=*/1, /*keepdim=*/true) / max_value).clamp_min(1e-8);
+  auto q = (x / scale).clamp(-max_value, max_value);
+  if (qtype == torch::kInt8) {
+    q = q.round();
+  }
+  return {q.to(qtype), scale.to(torch::kFloat)};
+}
+}  // namespace
+
+class QLinearW8A8Test
+    : public ::testing::TestWithParam<std::tuple<torch::Device,
+                                                 torch::ScalarType /*dtype*/,
+                                                 std::string /*method*/>> {};
+
+TEST_P(QLinearW8A8Test, ColumnParallelFused) {
+  const auto& [device, dtype, quant_method] = GetParam();
+  if (device.is_cuda() && !torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  const int64_t n_tokens = 20;
+  const int64_t in_features = 256;
+  const int64_t out_features = 128;
+  const int64_t n_shards = 2;
+  const auto options = torch::dtype(dtype).device(device);
+
+  QuantArgs quant_args;
+  quant_args.quant_method() = quant_method;
+  const auto qtype = detail::w8a8_quant_type(quant_args);
+
+  // per tensor scales for q and per channel scales for k
+  const auto q_weight = torch::randn({out_features, in_features}) * 0.05;
+  const auto k_weight = torch::randn({out_features, in_features}) * 0.05;
+  const auto [q_qweight, q_scale] = quant_per_tensor(q_weight, qtype);
+  const float max_value = qtype == torch::kInt8 ? 127.0f : 448.0f;
+  const auto k_scale =
+      k_weight.abs().amax(/*dim=*/1, /*keepdim=*/true) / max_value;
+  const auto k_qweight = qtype == torch::kInt8
+                             ? (k_weight / k_scale).round().to(qtype)
+                             : (k_weight / k_scale).to(qtype);
+
+  std::unordered_map<std::string, torch::Tensor> q_data;
+  q_data["q_proj.weight"] = q_qweight;
+  q_data["q_proj.weight_scale"] = q_scale;
+  std::unordered_map<std::string, torch::Tensor> k_data;
+  k_data["k_proj.weight"] = k_qweight;
+  k_data["k_proj.weight_scale"] = k_scale;
+  // q and k weights come from different files
+  StateDict q_state_dict(q_data);
+  StateDict k_state_dict(k_data);
+
+  const auto q_ref = (q_qweight.to(torch::kFloat) * q_scale).chunk(n_shards);
+  const auto k_ref = (k_qweight.to(torch::kFloat) * k_scale).chunk(n_shards);
+  for (int32_t shard_id = 0; shard_id < n_shards; ++shard_id) {
+    ParallelArgs parallel_args(shard_id, n_shards, nullptr);
+    ColumnParallelQLinearW8A8Impl linear(in_features,
+                                         2 * out_features,
+                                         /*bias=*/false,
+                                         quant_args,
+                                         /*gather_output=*/false,
+                                         parallel_args,
+                                         options);
+    linear.load_state_dict(q_state_dict, {"q_proj.", "k_proj."});
+    linear.load_state_dict(k_state_dict, {"q_proj.", "k_proj."});
+    linear.verify_loaded_weights();
+
+    const auto input = torch::randn({n_tokens, in_features}, options);
+    const auto output = linear.forward(input);
+
+    const auto weight = torch::cat({q_ref[shard_id], k_ref[shard_id]});
+    const auto desired_output =
+        torch::matmul(input.cpu().to(torch::kFloat), weight.t()).to(dtype);
+    ASSERT_EQ(output.sizes(), torch::IntArrayRef({n_tokens, out_features}));
+    EXPECT_TRUE(torch::allclose(output.cpu(),
+                                desired_output,
+                                /*rtol=*/5e-2,
+                                /*atol=*/5e-2));
+  }
+}
+
+TEST_P(QLinearW8A8Test, RowParallel) {
+  const auto& [device, dtype, quant_method] = GetParam();
+  if (device.is_cuda() && !torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  const int64_t n_tokens = 20;
+  const int64_t in_features = 256;
+  const int64_t out_features = 64;
+  const auto options = torch::dtype(dtype).device(device);
+
+  QuantArgs quant_args;
+  quant_args.quant_method() = quant_method;
+  const auto qtype = detail::w8a8_quant_type(quant_args);
+
+  const auto weight = torch::randn({out_features, in_features}) * 0.05;
+  const auto [qweight, scale] = quant_per_tensor(weight, qtype);
+  std::unordered_map<std::string, torch::Tensor> data;
+  data["weight"] = qweight;
+  data["weight_scale"] = scale;
+  data["bias"] = torch::randn({out_features}).to(dtype);
+  StateDict state_dict(data);
+
+  RowParallelQLinearW8A8Impl linear(in_features,
+                                    out_features,
+                                    /*bias=*/true,
+                                    quant_args,
+                                    /*input_is_parallelized=*/true,
+                                    ParallelArgs(0, 1, nullptr),
+                                    options);
+  linear.load_state_dict(state_dict);
+  linear.verify_loaded_weights();
+
+  const auto input = torch::randn({n_tokens, in_features}, options);
+  const auto output = linear.forward(input);
+
+  const auto weight_ref = qweight.to(torch::kFloat) * scale;
+  const auto desired_output =
+      (torch::matmul(input.cpu().to(torch::kFloat), weight_ref.t()) +
+       data["bias"].to(torch::kFloat))
+          .to(dtype);
+  EXPECT_TRUE(torch::allclose(output.cpu(),
+                              desired_output,
+                              /*rtol=*/5e-2,
+                              /*atol=*/5e-2));
+}
+
+TEST_P(QLinearW8A8Test, ColumnParallelDenseWeight) {
+  const auto& [device, dtype, quant_method] = GetParam();
+  if (device.is_cuda() && !torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  const int64_t n_tokens = 20;
+  const int64_t in_features = 256;
+  const int64_t out_features = 128;
+  const auto options = torch::dtype(dtype).device(device);
+
+  // fp16 weights are quantized per channel while loading
+  const auto q_weight =
+      (torch::randn({out_features, in_features}) * 0.05).to(torch::kHalf);
+  const auto k_weight =
+      (torch::randn({out_features, in_features}) * 0.05).to(torch::kHalf);
+  std::unordered_map<std::string, torch::Tensor> q_data;
+  q_data["q_proj.weight"] = q_weight;
+  std::unordered_map<std::string, torch::Tensor> k_data;
+  k_data["k_proj.weight"] = k_weight;
+  StateDict q_state_dict(q_data);
+  StateDict k_state_dict(k_data);
+
+  for (const bool weight_only : {false, true}) {
+    QuantArgs quant_args;
+    quant_args.quant_method() = quant_method;
+    quant_args.weight_only() = weight_only;
+    const auto qtype = detail::w8a8_quant_type(quant_args);
+
+    ColumnParallelQLinearW8A8Impl linear(in_features,
+                                         2 * out_features,
+                                         /*bias=*/false,
+                                         quant_args,
+                                         /*gather_output=*/false,
+                                         ParallelArgs(0, 1, nullptr),
+                                         options);
+    linear.load_state_dict(q_state_dict, {"q_proj.", "k_proj."});
+    linear.load_state_dict(k_state_dict, {"q_proj.", "k_proj."});
+    linear.verify_loaded_weights();
+
+    const auto input = torch::randn({n_tokens, in_features}, options);
+    const auto output = linear.forward(input);
+
+    const auto weight = torch::cat({q_weight, k_weight}).to(torch::kFloat);
+    const auto [qweight, scale] = quant_per_channel(weight, qtype);
+    const auto weight_ref = qweight.to(torch::kFloat) * scale;
+    const auto desired_output =
+        torch::matmul(input.cpu().to(torch::kFloat), weight_ref.t()).to(dtype);
+    ASSERT_EQ(output.sizes(),
+              torch::IntArrayRef({n_tokens, 2 * out_features}));
+    EXPECT_TRUE(torch::allclose(output.cpu(),
+                                desired_output,
+                                /*rtol=*/5e-2,
+                                /*atol=*/5e-2));
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    QLinearW8A8,
+    QLinearW8A8Test,
+    ::testing::Combine(::testing::Values(torch::kCPU, torch::kCUDA),
+                       ::testing::Values(torch::kFloat, torch::kHalf),
+                       ::testing::Values("w8a8", "fp8")));
+
+}  // namespace llm
@@ -25,6 +25,14 @@ struct QuantArgs {
   // whether has zero point
   DEFINE_ARG(bool, zero_point) = false;
 
+  // the format of the quantized weights in the checkpoint, e.g. "marlin_24"
+  // for 2:4 sparse weights packed for the sparse marlin kernel.
+  DEFINE_ARG(std::string, checkpoint_format);
+
+  // whether to keep the activations unquantized for w8a8 methods, e.g. fp8
+  // weights with fp16/bf16 activations (W8A16).
+  DEFINE_ARG(bool, weight_only) = false;
+
   // check if weights can be fused
   bool can_be_fused() const {
     // can't fuse quantized weights if desc_act is true
@@ -40,6 +48,8 @@ inline std::ostream& operator<<(std::ostream& os, const QuantArgs& args) {
   os << ", desc_act: " << args.desc_act();
   os << ", is_sym: " << args.is_sym();
   os << ", zero_point: " << args.zero_point();
+  os << ", checkpoint_format: " << args.checkpoint_format();
+  os << ", weight_only: " << args.weight_only();
   os << "]";
   return os;
 }
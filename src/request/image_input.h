@@ -0,0 +1,25 @@
+#pragma once
+
+#include <torch/torch.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace llm {
+
+// An image of a multimodal prompt, encoded into the embeddings of its
+// placeholder tokens [token_offset, token_offset + num_tokens) in the prompt.
+struct ImageInput {
+  // the preprocessed pixels of the image on host
+  // [3, image_size, image_size] FloatTensor
+  torch::Tensor pixel_values;
+
+  // hash of the content of the image, the encoder outputs are cached by it
+  uint64_t hash = 0;
+
+  // the placeholder tokens of the image in the prompt
+  size_t token_offset = 0;
+  size_t num_tokens = 0;
+};
+
+}  // namespace llm
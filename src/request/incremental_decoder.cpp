@@ -1,16 +1,77 @@
 #include "incremental_decoder.h"
 
 #include <absl/strings/match.h>
+#include <glog/logging.h>
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
-#include <sstream>
 #include <string>
+#include <string_view>
 
 #include "common/slice.h"
 #include "tokenizer/tokenizer.h"
 
 namespace llm {
+namespace {
+// U+FFFD in utf-8
+constexpr std::string_view kReplacementChar = "\xEF\xBF\xBD";
+
+bool is_trail_byte(char c) { return (static_cast<uint8_t>(c) & 0xC0) == 0x80; }
+
+// the length of the utf-8 character starting with the byte, 0 if invalid
+size_t utf8_char_len(char c) {
+  const auto b = static_cast<uint8_t>(c);
+  if (b < 0x80) {
+    return 1;
+  }
+  if (b >= 0xC2 && b < 0xE0) {
+    return 2;
+  }
+  if (b >= 0xE0 && b < 0xF0) {
+    return 3;
+  }
+  if (b >= 0xF0 && b < 0xF5) {
+    return 4;
+  }
+  return 0;
+}
+
+// whether the bytes end with the first bytes of a utf-8 character
+bool ends_with_unfinished_char(std::string_view bytes) {
+  for (size_t n = 1; n <= std::min<size_t>(3, bytes.size()); ++n) {
+    const char c = bytes[bytes.size() - n];
+    if (!is_trail_byte(c)) {
+      return utf8_char_len(c) > n;
+    }
+  }
+  return false;
+}
+
+// append the bytes to text with invalid utf-8 bytes replaced by U+FFFD
+void append_utf8(std::string_view bytes, std::string* text) {
+  size_t i = 0;
+  while (i < bytes.size()) {
+    size_t len = utf8_char_len(bytes[i]);
+    if (len == 0 || i + len > bytes.size()) {
+      len = 0;
+    }
+    for (size_t j = 1; j < len; ++j) {
+      if (!is_trail_byte(bytes[i + j])) {
+        len = 0;
+        break;
+      }
+    }
+    if (len == 0) {
+      text->append(kReplacementChar);
+      ++i;
+    } else {
+      text->append(bytes.substr(i, len));
+      i += len;
+    }
+  }
+}
+}  // namespace
 
 IncrementalDecoder::IncrementalDecoder(const std::string_view& prompt,
                                        size_t num_prompt_tokens,
@@ -24,33 +85,90 @@ IncrementalDecoder::IncrementalDecoder(const std::string_view& prompt,
   // prompt.
   prefix_offset_ = echo ? 0 : num_prompt_tokens_;
   output_offset_ = echo ? 0 : num_prompt_tokens_;
+  decoded_offset_ = output_offset_;
+  stream_state_.at_text_start = decoded_offset_ == 0;
 }
 
-std::string IncrementalDecoder::decode(const Slice<int32_t>& token_ids,
-                                       const Tokenizer& tokenizer) {
-  std::stringstream ss;
+bool IncrementalDecoder::decode_stream(const Slice<int32_t>& token_ids,
+                                       const Tokenizer& tokenizer,
+                                       std::string* text) {
+  if (stream_unsupported_) {
+    return false;
+  }
+  for (; decoded_offset_ < token_ids.size(); ++decoded_offset_) {
+    if (!tokenizer.decode_token(token_ids[decoded_offset_],
+                                skip_special_tokens_,
+                                &stream_state_,
+                                &pending_bytes_)) {
+      // decode from output_offset_ by windows from now on
+      stream_unsupported_ = true;
+      pending_bytes_.clear();
+      return false;
+    }
+  }
+
+  // hold back the text until the unfinished character is completed, like
+  // the tokens decoded into nothing, e.g. skipped special tokens.
+  if (pending_bytes_.empty() || ends_with_unfinished_char(pending_bytes_)) {
+    return true;
+  }
+  append_utf8(pending_bytes_, text);
+  pending_bytes_.clear();
+  prefix_offset_ = output_offset_;
+  output_offset_ = decoded_offset_;
+  return true;
+}
+
+std::vector<Slice<int32_t>> IncrementalDecoder::windows(
+    const Slice<int32_t>& token_ids) const {
+  // the prompt has been handled by the call that found the tokenizer can't
+  // decode tokens one at a time.
+  if (!stream_unsupported_) {
+    return {};
+  }
+  return {token_ids.slice(prefix_offset_, output_offset_),
+          token_ids.slice(prefix_offset_)};
+}
+
+std::string IncrementalDecoder::decode(
+    const Slice<int32_t>& token_ids,
+    const Tokenizer& tokenizer,
+    const std::vector<std::string>& window_texts) {
+  std::string text;
   // return prompt directly if prompt string is not empty
   if (output_offset_ < num_prompt_tokens_ && !prompt_.empty()) {
     // leave 6 tokens for the prefix to defeat cleanup algorithms in decode
     // which decide to add a space or not depending on the surrouding ids.
     prefix_offset_ = num_prompt_tokens_ <= 6 ? 0 : num_prompt_tokens_ - 6;
     output_offset_ = num_prompt_tokens_;
-    ss << prompt_;
+    decoded_offset_ = num_prompt_tokens_;
+    stream_state_.at_text_start = false;
+    text = prompt_;
   }
 
-  const auto prefix_text = tokenizer.decode(
-      token_ids.slice(prefix_offset_, output_offset_), skip_special_tokens_);
-  const auto new_text =
-      tokenizer.decode(token_ids.slice(prefix_offset_), skip_special_tokens_);
+  if (decode_stream(token_ids, tokenizer, &text)) {
+    return text;
+  }
+
+  // decode the prefix and the whole window in one call
+  std::vector<std::string> decoded;
+  const std::vector<std::string>* texts = &window_texts;
+  if (texts->empty()) {
+    decoded = tokenizer.decode_batch(windows(token_ids), skip_special_tokens_);
+    texts = &decoded;
+  }
+  CHECK_EQ(texts->size(), 2);
+  const auto& prefix_text = (*texts)[0];
+  const auto& new_text = (*texts)[1];
   // utf-8 char � at the end means it is a potential unfinished byte sequence
   // from byte fallback tokenization.
   if (new_text.size() > prefix_text.size() && !absl::EndsWith(new_text, "�")) {
     prefix_offset_ = output_offset_;
     output_offset_ = token_ids.size();
     // only print the delta text
-    ss << new_text.substr(prefix_text.size());
+    text.append(new_text, prefix_text.size());
   }
-  return ss.str();
+  return text;
 }
 
 }  // namespace llm
@@ -2,13 +2,16 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
 
 #include "common/slice.h"
 #include "tokenizer/tokenizer.h"
 
 namespace llm {
 
-// a stateful decoder that can decode tokens incrementally.
+// a stateful decoder that can decode tokens incrementally. the new tokens are
+// decoded one at a time if supported by the tokenizer, otherwise a window of
+// the last tokens is decoded again for each call.
 class IncrementalDecoder final {
  public:
   IncrementalDecoder(const std::string_view& prompt,
@@ -18,8 +21,23 @@ class IncrementalDecoder final {
 
   // decode the token ids incrementally
   // return the decoded delta text since last call.
+  // window_texts: the texts of windows(token_ids) decoded by the caller, e.g.
+  // together with the windows of other sequences, empty to decode them here.
   std::string decode(const Slice<int32_t>& token_ids,
-                     const Tokenizer& tokenizer);
+                     const Tokenizer& tokenizer,
+                     const std::vector<std::string>& window_texts = {});
+
+  // the windows of tokens that the next decode() decodes again, empty if the
+  // new tokens are decoded one at a time.
+  std::vector<Slice<int32_t>> windows(const Slice<int32_t>& token_ids) const;
+
+  bool skip_special_tokens() const { return skip_special_tokens_; }
+
+  // mark the token ids as output without decoding them, used when the text
+  // is not needed. the decoder should not be used to decode afterwards.
+  void skip(const Slice<int32_t>& token_ids) {
+    prefix_offset_ = output_offset_ = token_ids.size();
+  }
 
   // get the offset of the output text
   size_t output_offset() const { return output_offset_; }
@@ -28,6 +46,12 @@ class IncrementalDecoder final {
   size_t prefix_offset() const { return prefix_offset_; }
 
  private:
+  // decode the new tokens one at a time into text, returns false if the
+  // tokenizer can't decode tokens one at a time.
+  bool decode_stream(const Slice<int32_t>& token_ids,
+                     const Tokenizer& tokenizer,
+                     std::string* text);
+
   // the original prompt string, used to skip the prompt decoding when streaming
   std::string_view prompt_;
 
@@ -43,6 +67,16 @@ class IncrementalDecoder final {
   size_t prefix_offset_ = 0;
   // all tokens before output_offset_ have been decoded
   size_t output_offset_ = 0;
+
+  // states for decoding tokens one at a time
+  // all tokens before decoded_offset_ have been decoded into pending_bytes_
+  // or the output text.
+  size_t decoded_offset_ = 0;
+  // decoded bytes not output yet, ending with an unfinished utf-8 character
+  std::string pending_bytes_;
+  TokenStreamState stream_state_;
+  // whether the tokenizer can't decode tokens one at a time
+  bool stream_unsupported_ = false;
 };
 
 }  // namespace llm
@@ -67,6 +67,13 @@ struct SequenceOutput {
 
   // log probabilities of the generated tokens.
   std::optional<std::vector<LogProb>> logprobs;
+
+  // log probabilities of the tokens in token_ids, NaN if not available. only
+  // set instead of logprobs when the output is not detokenized.
+  std::vector<float> token_logprobs;
+
+  // the normalized embedding of the prompt, only set for embedding requests.
+  std::vector<float> embedding;
 };
 
 struct RequestOutput {
@@ -4,7 +4,10 @@
 #include <absl/time/time.h>
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstdint>
+#include <functional>
+#include <limits>
 #include <string>
 #include <vector>
 
@@ -25,7 +28,8 @@ Request::Request(std::string prompt,
       n(n),
       best_of(best_of),
       logprobs(logprobs),
-      created_time(absl::Now()) {
+      created_time(absl::Now()),
+      num_beam_tokens_(this->prompt_tokens.size()) {
   CHECK_GE(best_of, n);
 }
 
@@ -34,7 +38,14 @@ void Request::add_sequence() {
   options.sampling_param = this->sampling_param;
   options.stopping_criteria = this->stopping_criteria;
   options.echo = this->echo;
+  options.detokenize = this->detokenize;
   options.logprobs = this->logprobs;
+  options.prompt_logprobs = this->prompt_logprobs;
+  options.lora_id = this->lora_id;
+  options.grammar = this->grammar;
+  options.images = this->images;
+  options.beam_width = this->beam_width;
+  options.pooling = this->pooling;
 
   const size_t index = sequences.size();
   sequences.emplace_back(index,
@@ -43,20 +54,29 @@ void Request::add_sequence() {
                          this->created_time,
                          this->seq_capacity,
                          options);
+  sequences.back().set_finished_counter(&num_finished_sequences_);
 }
 
 bool Request::is_finished() const {
+  // the hypotheses join the sequences once the beam search is finished
+  if (beam_width > 0) {
+    return beam_hypotheses.empty() &&
+           std::all_of(sequences.begin(),
+                       sequences.end(),
+                       [](const Sequence& seq) { return seq.is_finished(); });
+  }
   // still need to generate more sequences
   if (sequences.size() < best_of) {
     return false;
   }
-
-  return std::all_of(sequences.begin(),
-                     sequences.end(),
-                     [](const Sequence& seq) { return seq.is_finished(); });
+  return num_finished_sequences_ == sequences.size();
 }
 
 bool Request::should_expand_sequences() const {
+  // beams are forked from each other by beam search
+  if (beam_width > 0) {
+    return false;
+  }
   if (sequences.size() < best_of) {
     CHECK(!sequences.empty());
     const auto& first_sequence = sequences.front();
@@ -70,7 +90,183 @@ bool Request::should_expand_sequences() const {
 void Request::expand_sequences() {
   while (sequences.size() < best_of) {
     add_sequence();
+    // the prompt is only scored once for all sequences
+    if (prompt_logprobs) {
+      sequences.back().copy_prompt_logprobs(sequences.front());
+    }
+  }
+}
+
+bool Request::should_update_beams() const {
+  if (beam_width == 0) {
+    return false;
+  }
+  bool has_new_tokens = false;
+  for (const Sequence& seq : sequences) {
+    if (is_beam_ahead(seq)) {
+      has_new_tokens = true;
+    } else if (!seq.is_finished()) {
+      // wait for the beam to catch up
+      return false;
+    }
+  }
+  return has_new_tokens;
+}
+
+void Request::select_beams(std::vector<BeamCandidate>* beams,
+                           std::vector<BeamCandidate>* hypotheses) const {
+  DCHECK(beams != nullptr && hypotheses != nullptr);
+  // the top tokens of the step are the candidates of each beam
+  std::vector<BeamCandidate> candidates;
+  for (size_t i = 0; i < sequences.size(); ++i) {
+    const Sequence& seq = sequences[i];
+    if (!is_beam_ahead(seq)) {
+      continue;
+    }
+    const Token token = seq.last_token();
+    const double score =
+        seq.cumulative_logprob() - token.logprob.value_or(0.0f);
+    for (size_t j = 0; j < token.top_tokens.size(); ++j) {
+      BeamCandidate& candidate = candidates.emplace_back();
+      candidate.beam = i;
+      candidate.token_id = token.top_tokens[j];
+      candidate.logprob = token.top_logprobs[j];
+      candidate.score = score + token.top_logprobs[j];
+    }
+  }
+  std::stable_sort(
+      candidates.begin(),
+      candidates.end(),
+      [](const auto& a, const auto& b) { return a.score > b.score; });
+
+  for (size_t rank = 0;
+       rank < candidates.size() && beams->size() < beam_width;
+       ++rank) {
+    const BeamCandidate& candidate = candidates[rank];
+    if (stopping_criteria.is_end_token(candidate.token_id)) {
+      if (rank < beam_width) {
+        hypotheses->push_back(candidate);
+      }
+      continue;
+    }
+    beams->push_back(candidate);
+  }
+}
+
+void Request::add_beam_hypothesis(const BeamCandidate& candidate) {
+  CHECK_LT(candidate.beam, sequences.size());
+  Sequence hypothesis = sequences[candidate.beam];
+  // the blocks are still held by the beam
+  hypothesis.release_blocks();
+  hypothesis.replace_last_token(candidate.token_id, candidate.logprob);
+
+  if (beam_hypotheses.size() < beam_width) {
+    beam_hypotheses.push_back(std::move(hypothesis));
+    return;
+  }
+  auto worst = std::min_element(
+      beam_hypotheses.begin(),
+      beam_hypotheses.end(),
+      [](const auto& a, const auto& b) { return a.logprob() < b.logprob(); });
+  if (hypothesis.logprob() > worst->logprob()) {
+    *worst = std::move(hypothesis);
+  }
+}
+
+void Request::finish_beam_step() {
+  float best_logprob = -std::numeric_limits<float>::infinity();
+  for (const Sequence& seq : sequences) {
+    if (!seq.is_finished()) {
+      num_beam_tokens_ = seq.num_tokens();
+      best_logprob = std::max(best_logprob, seq.logprob());
+    }
+  }
+
+  // stop once the best beam can't beat the worst hypothesis
+  if (beam_hypotheses.size() >= beam_width) {
+    float worst_logprob = std::numeric_limits<float>::infinity();
+    for (const Sequence& seq : beam_hypotheses) {
+      worst_logprob = std::min(worst_logprob, seq.logprob());
+    }
+    if (best_logprob <= worst_logprob) {
+      for (Sequence& seq : sequences) {
+        if (!seq.is_finished()) {
+          seq.finish(FinishReason::STOP);
+        }
+      }
+    }
+  }
+
+  const bool all_finished =
+      std::all_of(sequences.begin(),
+                  sequences.end(),
+                  [](const Sequence& seq) { return seq.is_finished(); });
+  if (all_finished) {
+    for (Sequence& seq : beam_hypotheses) {
+      sequences.push_back(std::move(seq));
+    }
+    beam_hypotheses.clear();
+  }
+}
+
+absl::Time Request::deadline() const {
+  absl::Time deadline = absl::InfiniteFuture();
+  for (const Sequence& seq : sequences) {
+    if (seq.is_finished()) {
+      continue;
+    }
+    const absl::Time seq_deadline = seq.num_generated_tokens() == 0
+                                        ? created_time + ttft_slo
+                                        : seq.last_token_time() + itl_slo;
+    deadline = std::min(deadline, seq_deadline);
+  }
+  return deadline;
+}
+
+std::vector<size_t> Request::prune_candidates(double margin,
+                                             size_t interval) {
+  std::vector<size_t> pruned;
+  if (beam_width > 0 || best_of <= n || sequences.size() < best_of) {
+    return pruned;
+  }
+  // the candidates are decoded in lockstep until they finish
+  size_t num_tokens = 0;
+  for (const Sequence& seq : sequences) {
+    if (!seq.is_finished()) {
+      num_tokens = std::max(num_tokens, seq.num_generated_tokens());
+    }
+  }
+  if (num_tokens < num_pruned_tokens_ + interval) {
+    return pruned;
+  }
+  num_pruned_tokens_ = num_tokens;
+  pruned_.resize(sequences.size(), false);
+
+  // the cumulative logprob only decreases as the candidates go on
+  std::vector<double> logprobs;
+  for (size_t i = 0; i < sequences.size(); ++i) {
+    if (!pruned_[i]) {
+      logprobs.push_back(sequences[i].cumulative_logprob());
+    }
+  }
+  if (logprobs.size() <= n) {
+    return pruned;
+  }
+  std::nth_element(logprobs.begin(),
+                   logprobs.begin() + static_cast<int64_t>(n - 1),
+                   logprobs.end(),
+                   std::greater<>());
+  const double threshold = logprobs[n - 1] - margin;
+  for (size_t i = 0; i < sequences.size(); ++i) {
+    Sequence& seq = sequences[i];
+    if (!pruned_[i] && !seq.is_finished() &&
+        seq.cumulative_logprob() < threshold) {
+      seq.finish(FinishReason::STOP);
+      pruned_[i] = true;
+      pruned.push_back(i);
+    }
   }
+  return pruned;
 }
 
 RequestOutput Request::build_output(const Tokenizer& tokenizer) {
@@ -94,7 +290,9 @@ RequestOutput Request::build_output(const Tokenizer& tokenizer) {
       std::vector<std::pair<float, size_t>> sequence_logprobs;
       sequence_logprobs.reserve(sequences.size());
       for (size_t i = 0; i < sequences.size(); ++i) {
-        sequence_logprobs.emplace_back(sequences[i].logprob(), i);
+        if (!is_pruned(i)) {
+          sequence_logprobs.emplace_back(sequences[i].logprob(), i);
+        }
       }
       // sort sequences by logprob in descending order
       std::sort(sequence_logprobs.begin(),
@@ -5,10 +5,13 @@
 
 #include <cstdint>
 #include <deque>
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "output.h"
+#include "request_trace.h"
 #include "sampling/parameters.h"
 #include "sequence.h"
 #include "stopping_criteria.h"
@@ -18,6 +21,25 @@ namespace llm {
 // Function to call when an output is generated.
 using OnOutput = std::function<bool(const RequestOutput& output)>;
 
+// Function to check whether the consumer of the outputs is backlogged.
+using IsBacklogged = std::function<bool()>;
+
+// Function to check whether the client of the request has gone away.
+using IsClientCancelled = std::function<bool()>;
+
+// A continuation of a beam with one of its top tokens, scored by the sum of
+// the log probabilities of the generated tokens.
+struct BeamCandidate {
+  // the index of the beam in the sequences of the request
+  size_t beam = 0;
+
+  int64_t token_id = 0;
+
+  float logprob = 0;
+
+  double score = 0;
+};
+
 // A request is a data structure that encapsulates all the necessary
 // information required to process a request efficiently. It acts as a
 // container, holding essential data, such as input parameters, configuration
@@ -35,6 +57,8 @@ struct Request final {
 
   void add_sequence();
 
+  // O(1) with the count of finished sequences, except for beam search whose
+  // beams are copied and dropped by the scheduler
   bool is_finished() const;
 
   bool is_streaming() const { return stream; }
@@ -45,12 +69,62 @@ struct Request final {
 
   void expand_sequences();
 
+  // whether the unfinished beams have all generated the token of the step,
+  // so that the tokens of the beams can be selected among their top tokens.
+  bool should_update_beams() const;
+
+  // whether the beam has generated the token of the step and waits for the
+  // other beams, the beams are kept in lockstep.
+  bool is_beam_ahead(const Sequence& sequence) const {
+    return beam_width > 0 && sequence.num_tokens() > num_beam_tokens_;
+  }
+
+  // select the best beam_width continuations of the beams of the step that
+  // don't end the text into beams, and the ones ending the text among the
+  // best beam_width continuations into hypotheses, both sorted by score.
+  void select_beams(std::vector<BeamCandidate>* beams,
+                    std::vector<BeamCandidate>* hypotheses) const;
+
+  // keep the beam ended by the candidate as a finished hypothesis if it is
+  // among the best beam_width ones by average log probability. should be
+  // called before the beam is continued by other candidates.
+  void add_beam_hypothesis(const BeamCandidate& candidate);
+
+  // finish the step once the tokens of the beams are selected. the search
+  // stops once no beam can beat the hypotheses, then the hypotheses join the
+  // sequences to select the best n among.
+  void finish_beam_step();
+
+  // finish the best_of candidates whose cumulative logprob falls behind the
+  // n-th best one by more than margin, at most once per interval generated
+  // tokens. the pruned candidates are never selected, returns their indexes
+  // to release the blocks of.
+  std::vector<size_t> prune_candidates(double margin, size_t interval);
+
+  // whether the sequence is a pruned best_of candidate
+  bool is_pruned(size_t index) const {
+    return index < pruned_.size() && pruned_[index];
+  }
+
   void cancel() { is_cancelled_.store(true, std::memory_order_relaxed); }
 
+  // cancelled by the server, or the client has gone away
   bool is_cancelled() const {
-    return is_cancelled_.load(std::memory_order_relaxed);
+    return is_cancelled_.load(std::memory_order_relaxed) ||
+           (is_client_cancelled != nullptr && is_client_cancelled());
   }
 
+  // whether the request should be paused as the consumer is not draining the
+  // streamed outputs. cancelled requests are not paused so they get released.
+  bool is_backlogged() const {
+    return is_output_backlogged != nullptr && !is_cancelled() &&
+           is_output_backlogged();
+  }
+
+  // whether the kv cache of the request can be shared through the prefix
+  // cache, see Sequence::prefix_cacheable().
+  bool prefix_cacheable() const { return lora_id < 0 && images == nullptr; }
+
   // Get the elapsed time since the request was created.
   double elapsed_seconds() const {
     return absl::ToDoubleSeconds(absl::Now() - created_time);
@@ -58,6 +132,11 @@ struct Request final {
 
   RequestOutput build_output(const Tokenizer& tokenizer);
 
+  // Get the deadline for the next token of the request: created_time +
+  // ttft_slo before the first token, otherwise the earliest last_token_time +
+  // itl_slo among unfinished sequences.
+  absl::Time deadline() const;
+
   // Scheduled time of the request.
   // NOLINTNEXTLINE
   const absl::Time created_time;
@@ -97,19 +176,104 @@ struct Request final {
   // Whether to echo back the prompt in the output.
   bool echo = false;
 
+  // Whether to return the log probabilities of the prompt tokens, computed
+  // from the logits of the prefill.
+  bool prompt_logprobs = false;
+
+  // Whether to decode the output tokens into text.
+  bool detokenize = true;
+
   // the priority of the request.
   Priority priority = Priority::NORMAL;
 
-  // list of sequences to generate completions for the prompt
+  // the id of the lora adapter to serve the request with, -1 for none.
+  int32_t lora_id = -1;
+
+  // the tenant to share the capacity with fairly under the wfq scheduling
+  // policy, empty for the default tenant.
+  std::string tenant;
+
+  // the session of the request, whose kv cache is pinned in the prefix cache
+  // once the request finishes, so that the next turn of the session hits it.
+  // empty if not in a session.
+  std::string session_id;
+
+  // the grammar to constrain the output of the sequences with, optional.
+  std::shared_ptr<const TokenGrammar> grammar;
+
+  // the images of the prompt, nullptr for none, see Sequence::images().
+  std::shared_ptr<const std::vector<ImageInput>> images;
+
+  // the number of beams to search the output with, 0 to sample the
+  // sequences instead.
+  size_t beam_width = 0;
+
+  // pool the hidden states of the prompt into an embedding instead of
+  // generating tokens, NONE to generate.
+  PoolingType pooling = PoolingType::NONE;
+
+  // the best finished beams of beam search, up to beam_width. they hold no
+  // kv cache blocks.
+  std::deque<Sequence> beam_hypotheses;
+
+  // the virtual time of the tenant when the waiting requests were last
+  // ordered, used by the wfq scheduling policy.
+  double tenant_virtual_time = 0;
+
+  // the predicted number of tokens left to generate, offset by the creation
+  // time so that waiting requests move ahead, used by the sjf scheduling
+  // policy.
+  double predicted_rank = 0;
+
+  // latency targets for the first token and subsequent tokens, used by the
+  // slo scheduling policy. infinite means no target.
+  absl::Duration ttft_slo = absl::InfiniteDuration();
+  absl::Duration itl_slo = absl::InfiniteDuration();
+
+  // the number of times the request was preempted
+  int32_t num_preemptions = 0;
+
+  // the latency breakdown of the request if sampled for tracing, otherwise
+  // nullptr. see RequestTrace.
+  std::unique_ptr<RequestTrace> trace;
+
+  // the number of times the request was passed over by the prefix aware
+  // admission of the scheduler, which bounds its waiting.
+  int32_t num_admission_skips = 0;
+
+  // list of sequences to generate completions for the prompt, added by
+  // add_sequence() to be counted once finished.
   // use deque instead of vector to avoid no-copy move for Sequence
   std::deque<Sequence> sequences;
 
   // function to call when an output is generated.
   OnOutput on_output;
 
+  // function to check whether the consumer of the outputs is backlogged,
+  // optional. it is called from the scheduler thread.
+  IsBacklogged is_output_backlogged;
+
+  // function to check whether the client has gone away, e.g. disconnected or
+  // timed out, optional. it is called from the scheduler thread without
+  // blocking.
+  IsClientCancelled is_client_cancelled;
+
  private:
   // is the sequence cancelled
   std::atomic_bool is_cancelled_{false};
+
+  // the number of tokens of the beams after the last step of beam search
+  size_t num_beam_tokens_ = 0;
+
+  // the number of finished sequences added by add_sequence(), kept up to
+  // date by the sequences
+  size_t num_finished_sequences_ = 0;
+
+  // whether each best_of candidate is pruned, empty if none
+  std::vector<bool> pruned_;
+
+  // the number of generated tokens when the candidates were last pruned
+  size_t num_pruned_tokens_ = 0;
 };
 
 // Compare two request contexts based on priority then scheduled time.
@@ -134,4 +298,50 @@ struct RequestPtrGreater {
   }
 };
 
+// Compare two request contexts based on priority then deadline.
+// if a > b then a should be processed after b.
+struct RequestPtrDeadlineGreater {
+  bool operator()(const Request* a, const Request* b) const {
+    if (a->priority != b->priority) {
+      return a->priority > b->priority;
+    }
+    const absl::Time a_deadline = a->deadline();
+    const absl::Time b_deadline = b->deadline();
+    if (a_deadline == b_deadline) {
+      return a->created_time > b->created_time;
+    }
+    return a_deadline > b_deadline;
+  }
+};
+
+// Compare two request contexts based on priority then the virtual time of
+// their tenants, which grows with the tokens processed for the tenant.
+// if a > b then a should be processed after b.
+struct RequestPtrFairGreater {
+  bool operator()(const Request* a, const Request* b) const {
+    if (a->priority != b->priority) {
+      return a->priority > b->priority;
+    }
+    if (a->tenant_virtual_time == b->tenant_virtual_time) {
+      return a->created_time > b->created_time;
+    }
+    return a->tenant_virtual_time > b->tenant_virtual_time;
+  }
+};
+
+// Compare two request contexts based on priority then their predicted
+// remaining tokens, credited for the time they waited.
+// if a > b then a should be processed after b.
+struct RequestPtrShortestGreater {
+  bool operator()(const Request* a, const Request* b) const {
+    if (a->priority != b->priority) {
+      return a->priority > b->priority;
+    }
+    if (a->predicted_rank == b->predicted_rank) {
+      return a->created_time > b->created_time;
+    }
+    return a->predicted_rank > b->predicted_rank;
+  }
+};
+
 }  // namespace llm
@@ -0,0 +1,61 @@
+#include "request.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+namespace llm {
+namespace {
+void append_token(Sequence* sequence, int64_t token_id, float logprob) {
+  Token token(token_id);
+  token.logprob = logprob;
+  sequence->append_token(token);
+}
+}  // namespace
+
+TEST(RequestTest, PruneCandidates) {
+  Request request("prompt",
+                  /*prompt_tokens=*/{1, 2, 3},
+                  /*seq_capacity=*/100,
+                  /*n=*/1,
+                  /*best_of=*/3,
+                  /*logprobs=*/false);
+  request.sampling_param.logprobs = true;
+  request.add_sequence();
+  request.expand_sequences();
+  ASSERT_EQ(request.sequences.size(), 3);
+  for (int32_t i = 0; i < 3; ++i) {
+    Sequence& sequence = request.sequences[i];
+    sequence.append_block({/*id=*/i, /*size=*/20});
+    sequence.commit_kv_cache(/*size=*/3);
+  }
+
+  const std::vector<float> logprobs = {-0.1, -0.5, -3.0};
+  for (size_t i = 0; i < 3; ++i) {
+    append_token(&request.sequences[i], 10, logprobs[i]);
+  }
+  // not due yet
+  EXPECT_TRUE(request.prune_candidates(/*margin=*/2.0, /*interval=*/2).empty());
+
+  for (size_t i = 0; i < 3; ++i) {
+    append_token(&request.sequences[i], 11, logprobs[i]);
+  }
+  // -6.0 falls behind the best -0.2 by more than 2.0, -1.0 doesn't
+  EXPECT_EQ(request.prune_candidates(/*margin=*/2.0, /*interval=*/2),
+            std::vector<size_t>({2}));
+  EXPECT_FALSE(request.is_pruned(0));
+  EXPECT_FALSE(request.is_pruned(1));
+  EXPECT_TRUE(request.is_pruned(2));
+  EXPECT_TRUE(request.sequences[2].is_finished());
+  EXPECT_FALSE(request.is_finished());
+
+  // the candidates falling behind together are kept
+  for (size_t i = 0; i < 2; ++i) {
+    for (int64_t token_id = 12; token_id < 14; ++token_id) {
+      append_token(&request.sequences[i], token_id, -10.0);
+    }
+  }
+  EXPECT_TRUE(request.prune_candidates(/*margin=*/2.0, /*interval=*/2).empty());
+}
+
+}  // namespace llm
@@ -0,0 +1,88 @@
+#include "request_trace.h"
+
+#include <gflags/gflags.h>
+
+#include <nlohmann/json.hpp>
+#include <random>
+#include <string>
+
+DEFINE_double(request_trace_sample_rate,
+              0,
+              "Fraction of the requests to log the latency breakdown of once "
+              "finished: the time in the queues of the scheduler, prefill "
+              "chunks, preemptions, prefix cache hits, decode steps and "
+              "detokenization. 0 to disable.");
+
+namespace llm {
+namespace {
+// milliseconds between the times, -1 if either is not reached
+double elapsed_ms(absl::Time start, absl::Time end) {
+  if (start == absl::InfinitePast() || end == absl::InfinitePast()) {
+    return -1;
+  }
+  return absl::ToDoubleMilliseconds(end - start);
+}
+}  // namespace
+
+RequestTrace::RequestTrace(absl::Time created_time)
+    : created_time_(created_time) {}
+
+bool RequestTrace::sample() {
+  const double rate = FLAGS_request_trace_sample_rate;
+  if (rate <= 0) {
+    return false;
+  }
+  thread_local std::mt19937 gen(std::random_device{}());
+  return std::uniform_real_distribution<double>(0, 1)(gen) < rate;
+}
+
+void RequestTrace::on_ingested(absl::Time now) { ingested_time_ = now; }
+
+void RequestTrace::on_scheduled(absl::Time now,
+                                bool prefill,
+                                size_t num_kv_cache_tokens) {
+  if (scheduled_time_ == absl::InfinitePast()) {
+    scheduled_time_ = now;
+    num_cached_prompt_tokens_ = num_kv_cache_tokens;
+  }
+  if (preempted_time_ != absl::InfinitePast()) {
+    preempted_duration_ += now - preempted_time_;
+    preempted_time_ = absl::InfinitePast();
+  }
+  if (prefill) {
+    ++num_prefill_chunks_;
+  } else {
+    ++num_decode_steps_;
+  }
+}
+
+void RequestTrace::on_preempted(absl::Time now) {
+  ++num_preemptions_;
+  preempted_time_ = now;
+}
+
+void RequestTrace::on_first_token(absl::Time now) { first_token_time_ = now; }
+
+void RequestTrace::on_finished(absl::Time now) { finished_time_ = now; }
+
+std::string RequestTrace::to_json(size_t num_prompt_tokens,
+                                  size_t num_generated_tokens) const {
+  nlohmann::json json = {
+      {"start_time_us", absl::ToUnixMicros(created_time_)},
+      {"request_queue_ms", elapsed_ms(created_time_, ingested_time_)},
+      {"priority_queue_ms", elapsed_ms(ingested_time_, scheduled_time_)},
+      {"ttft_ms", elapsed_ms(created_time_, first_token_time_)},
+      {"total_ms", elapsed_ms(created_time_, finished_time_)},
+      {"num_prompt_tokens", num_prompt_tokens},
+      {"num_cached_prompt_tokens", num_cached_prompt_tokens_},
+      {"num_prefill_chunks", num_prefill_chunks_},
+      {"num_generated_tokens", num_generated_tokens},
+      {"num_decode_steps", num_decode_steps_},
+      {"num_preemptions", num_preemptions_},
+      {"preempted_ms", absl::ToDoubleMilliseconds(preempted_duration_)},
+      {"detokenize_ms",
+       detokenize_us_.load(std::memory_order_relaxed) / 1000.0}};
+  return json.dump();
+}
+
+}  // namespace llm
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <absl/time/time.h>
+#include <gflags/gflags_declare.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// fraction of the requests to trace, between [0, 1]. 0 to disable.
+DECLARE_double(request_trace_sample_rate);
+
+namespace llm {
+
+// The breakdown of the latency of a sampled request into the phases it goes
+// through in the scheduler, logged as a json line once the request finishes,
+// to attribute the time to first token to queueing, scheduling or compute.
+// It is updated by the scheduler thread running the request, except for the
+// detokenization time, which is added on the response threads.
+class RequestTrace final {
+ public:
+  explicit RequestTrace(absl::Time created_time);
+
+  // whether to trace a new request, by --request_trace_sample_rate
+  static bool sample();
+
+  // moved from the request queue of the scheduler to its priority queue
+  void on_ingested(absl::Time now);
+
+  // scheduled into the batch of a step, which processes prompt tokens if
+  // prefill. num_kv_cache_tokens: the tokens in the kv cache before the
+  // step, which are the prefix cache hits when first scheduled.
+  void on_scheduled(absl::Time now, bool prefill, size_t num_kv_cache_tokens);
+
+  // preempted until scheduled again
+  void on_preempted(absl::Time now);
+
+  // the first token of any sequence is generated
+  void on_first_token(absl::Time now);
+
+  // released by the scheduler
+  void on_finished(absl::Time now);
+
+  // the time to detokenize the outputs of the request
+  void add_detokenize_duration(absl::Duration duration) {
+    detokenize_us_.fetch_add(absl::ToInt64Microseconds(duration),
+                             std::memory_order_relaxed);
+  }
+
+  bool has_first_token() const {
+    return first_token_time_ != absl::InfinitePast();
+  }
+
+  // a json object of the phase durations in milliseconds and the counts
+  std::string to_json(size_t num_prompt_tokens,
+                      size_t num_generated_tokens) const;
+
+ private:
+  absl::Time created_time_;
+
+  // the end of the phases, InfinitePast if not reached
+  absl::Time ingested_time_ = absl::InfinitePast();
+  absl::Time scheduled_time_ = absl::InfinitePast();
+  absl::Time first_token_time_ = absl::InfinitePast();
+  absl::Time finished_time_ = absl::InfinitePast();
+
+  // the start of the current preemption, InfinitePast if running
+  absl::Time preempted_time_ = absl::InfinitePast();
+  absl::Duration preempted_duration_;
+
+  int32_t num_prefill_chunks_ = 0;
+  int32_t num_decode_steps_ = 0;
+  int32_t num_preemptions_ = 0;
+  size_t num_cached_prompt_tokens_ = 0;
+
+  std::atomic<int64_t> detokenize_us_{0};
+};
+
+}  // namespace llm
@@ -0,0 +1,51 @@
+#include "request_trace.h"
+
+#include <gtest/gtest.h>
+
+#include <nlohmann/json.hpp>
+
+namespace llm {
+
+TEST(RequestTraceTest, Phases) {
+  const absl::Time created = absl::FromUnixMillis(1000);
+  RequestTrace trace(created);
+  trace.on_ingested(created + absl::Milliseconds(1));
+  // two prefill chunks after a prefix cache hit of 16 tokens
+  trace.on_scheduled(created + absl::Milliseconds(5), /*prefill=*/true, 16);
+  trace.on_scheduled(created + absl::Milliseconds(10), /*prefill=*/true, 32);
+  EXPECT_FALSE(trace.has_first_token());
+  trace.on_first_token(created + absl::Milliseconds(20));
+  EXPECT_TRUE(trace.has_first_token());
+  trace.on_scheduled(created + absl::Milliseconds(20), /*prefill=*/false, 48);
+  // preempted for 30 milliseconds
+  trace.on_preempted(created + absl::Milliseconds(30));
+  trace.on_scheduled(created + absl::Milliseconds(60), /*prefill=*/false, 49);
+  trace.on_finished(created + absl::Milliseconds(70));
+  trace.add_detokenize_duration(absl::Microseconds(1500));
+
+  const auto json = nlohmann::json::parse(trace.to_json(48, 3));
+  EXPECT_EQ(json["start_time_us"], 1000000);
+  EXPECT_DOUBLE_EQ(json["request_queue_ms"], 1);
+  EXPECT_DOUBLE_EQ(json["priority_queue_ms"], 4);
+  EXPECT_DOUBLE_EQ(json["ttft_ms"], 20);
+  EXPECT_DOUBLE_EQ(json["total_ms"], 70);
+  EXPECT_EQ(json["num_prompt_tokens"], 48);
+  EXPECT_EQ(json["num_cached_prompt_tokens"], 16);
+  EXPECT_EQ(json["num_prefill_chunks"], 2);
+  EXPECT_EQ(json["num_generated_tokens"], 3);
+  EXPECT_EQ(json["num_decode_steps"], 2);
+  EXPECT_EQ(json["num_preemptions"], 1);
+  EXPECT_DOUBLE_EQ(json["preempted_ms"], 30);
+  EXPECT_DOUBLE_EQ(json["detokenize_ms"], 1.5);
+}
+
+TEST(RequestTraceTest, Unfinished) {
+  RequestTrace trace(absl::Now());
+  // the phases not reached are -1
+  const auto json = nlohmann::json::parse(trace.to_json(8, 0));
+  EXPECT_DOUBLE_EQ(json["request_queue_ms"], -1);
+  EXPECT_DOUBLE_EQ(json["ttft_ms"], -1);
+  EXPECT_EQ(json["num_prefill_chunks"], 0);
+}
+
+}  // namespace llm
@@ -3,16 +3,27 @@
 #include <absl/strings/match.h>
 #include <absl/time/clock.h>
 #include <absl/time/time.h>
+#include <gflags/gflags.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstdint>
+#include <limits>
 #include <optional>
 #include <string>
 #include <vector>
 
 #include "common/metrics.h"
 #include "common/slice.h"
+#include "common/vector_pool.h"
 #include "tokenizer/tokenizer.h"
 
+DEFINE_int32(sequence_buffer_pool_mb,
+             64,
+             "Max size in MB of the token buffers of finished sequences kept "
+             "for reuse by new sequences, per buffer type. 0 to disable.");
+
 DEFINE_COUNTER_FAMILY(detokenization_latency_seconds,
                       "Latency of detokenization in seconds");
 DEFINE_COUNTER_INSTANCE(stream_decode_latency_seconds,
@@ -23,6 +34,24 @@ DEFINE_COUNTER_INSTANCE(non_stream_decode_latency_seconds,
                         {{"mode", "non-stream"}});
 
 namespace llm {
+namespace {
+// monotonically increasing id for sequences
+std::atomic<int64_t> next_sequence_id{0};
+
+// weight of the history in the moving average of the acceptance rate
+constexpr double kAcceptanceRateDecay = 0.8;
+
+// the buffers reserved up to the capacity of the sequences, reused across
+// requests to avoid allocating and freeing them for each sequence. leaked
+// on purpose so that they outlive the sequences destroyed at exit.
+template <typename T>
+VectorPool<T>& buffer_pool() {
+  static auto* pool = new VectorPool<T>(
+      static_cast<size_t>(std::max(FLAGS_sequence_buffer_pool_mb, 0))
+      << 20);
+  return *pool;
+}
+}  // namespace
 
 Sequence::Sequence(size_t index,
                    const std::string_view& prompt,
@@ -31,6 +60,7 @@ Sequence::Sequence(size_t index,
                    size_t capacity,
                    const Options& option)
     : index_(index),
+      id_(next_sequence_id.fetch_add(1, std::memory_order_relaxed)),
       last_token_time_(created_time),
       options_(option),
       incremental_decoder_(prompt,
@@ -43,16 +73,25 @@ Sequence::Sequence(size_t index,
 
   num_prompt_tokens_ = prompt_token_ids.size();
   // allocate space for token ids, logprobs, top tokens and top logprobs
-  token_ids_.resize(capacity);
-  logprobs_.resize(capacity);
-  top_tokens_.resize(capacity);
-  top_logprobs_.resize(capacity);
-
-  // add the prompt tokens
-  for (const auto token_id : prompt_token_ids) {
-    token_ids_[num_tokens_++] = token_id;
-    token_to_count_map_[token_id]++;
+  token_ids_ = buffer_pool<int32_t>().acquire(capacity);
+  logprobs_ = buffer_pool<float>().acquire(capacity);
+  has_logprobs_.resize(capacity);
+  has_top_tokens_.resize(capacity);
+
+  // add the prompt tokens, which are only counted if needed
+  std::copy(
+      prompt_token_ids.begin(), prompt_token_ids.end(), token_ids_.begin());
+  num_tokens_ = prompt_token_ids.size();
+
+  if (options_.grammar != nullptr) {
+    grammar_state_ = options_.grammar->start_state();
   }
+
+  // the first prompt token has no log probability
+  needs_prompt_logprobs_ = options_.prompt_logprobs && num_prompt_tokens_ > 1;
+
+  // the prompt may already meet the stopping criteria
+  set_finish_reason(check_finished(num_tokens_));
 }
 
 Sequence::Sequence(const std::string_view& prompt,
@@ -61,6 +100,12 @@ Sequence::Sequence(const std::string_view& prompt,
                    const Options& option)
     : Sequence(0, prompt, prompt_token_ids, absl::Now(), capacity, option) {}
 
+Sequence::~Sequence() {
+  // moved-from sequences have nothing to release
+  buffer_pool<int32_t>().release(std::move(token_ids_));
+  buffer_pool<float>().release(std::move(logprobs_));
+}
+
 Sequence::Sequence(const std::vector<int32_t>& prompt_token_ids,
                    size_t capacity,
                    const Options& option)
@@ -69,7 +114,6 @@ Sequence::Sequence(const std::vector<int32_t>& prompt_token_ids,
 void Sequence::append_token(const Token& token) {
   CHECK(num_tokens_ < token_ids_.size())
       << "exceed the token capacity of the sequence";
-  CHECK(!is_finished_) << "cannot append token to a finished sequence";
   CHECK(!is_prefill_stage()) << "cannot append token to a prefill sequence";
 
   // check if the token is the first token after the prompt
@@ -79,19 +123,207 @@ void Sequence::append_token(const Token& token) {
   const auto cur_idx = num_tokens_++;
   const int32_t token_id = static_cast<int32_t>(token.id);
   token_ids_[cur_idx] = token_id;
-  token_to_count_map_[token_id]++;
+  count_token(token_id, 1);
   // update logprobs if needed
   if (options_.sampling_param.logprobs) {
     update_logprobs(cur_idx, token);
   }
 
-  // invalidate the finish status once a new token is appended
-  finish_status_invalidated_ = true;
+  // advance the grammar, the end tokens are not part of the text
+  if (options_.grammar != nullptr &&
+      !options_.stopping_criteria.is_end_token(token_id)) {
+    grammar_state_ = options_.grammar->next_state(grammar_state_, token_id);
+  }
+
+  // check the finish status once with the new token. draft tokens may follow
+  // a draft token that finishes the sequence, the status stays until
+  // validate_tokens() settles it.
+  if (!is_finished_) {
+    set_finish_reason(check_finished(num_tokens_));
+  }
+}
+
+void Sequence::add_pooled_hidden_states(size_t start,
+                                        size_t end,
+                                        const Slice<float>& sum) {
+  CHECK(is_embedding()) << "the sequence is not an embedding";
+  CHECK(start < end && end <= num_prompt_tokens_) << "only prompt is pooled";
+  // the prompt is pooled again from the start after a preemption
+  if (start == 0 || options_.pooling == PoolingType::LAST) {
+    embedding_.assign(sum.size(), 0.0f);
+  }
+  CHECK_EQ(embedding_.size(), sum.size()) << "hidden size mismatch";
+  for (size_t i = 0; i < sum.size(); ++i) {
+    embedding_[i] += sum[i];
+  }
+  if (end < num_prompt_tokens_) {
+    return;
+  }
+
+  // the mean is scaled away by the normalization
+  double norm = 0.0;
+  for (const float v : embedding_) {
+    norm += static_cast<double>(v) * v;
+  }
+  norm = std::sqrt(norm);
+  if (norm > 0.0) {
+    for (float& v : embedding_) {
+      v = static_cast<float>(v / norm);
+    }
+  }
+  finish(FinishReason::STOP);
+}
+
+void Sequence::set_prompt_logprobs(size_t start,
+                                   const Slice<float>& logprobs) {
+  CHECK_GT(start, 0) << "the first prompt token has no logprob";
+  const size_t end = start + logprobs.size();
+  CHECK_LE(end, num_prompt_tokens_) << "only prompt tokens can be scored";
+  for (size_t i = start; i < end; ++i) {
+    logprobs_[i] = logprobs[i - start];
+    has_logprobs_[i] = true;
+  }
+  // the prompt is scored in order, chunk by chunk
+  if (end == num_prompt_tokens_) {
+    needs_prompt_logprobs_ = false;
+  }
+}
+
+void Sequence::copy_prompt_logprobs(const Sequence& other) {
+  CHECK_EQ(num_prompt_tokens_, other.num_prompt_tokens_)
+      << "sequences should share the prompt";
+  std::copy(other.logprobs_.begin(),
+            other.logprobs_.begin() + num_prompt_tokens_,
+            logprobs_.begin());
+  std::copy(other.has_logprobs_.begin(),
+            other.has_logprobs_.begin() + num_prompt_tokens_,
+            has_logprobs_.begin());
+  needs_prompt_logprobs_ = other.needs_prompt_logprobs_;
+}
+
+Token Sequence::last_token() const {
+  CHECK_GT(num_tokens_, 0);
+  const size_t idx = num_tokens_ - 1;
+  Token token(token_ids_[idx]);
+  if (has_logprobs_[idx]) {
+    token.logprob = logprobs_[idx];
+  }
+  if (has_top_tokens_[idx]) {
+    const size_t k = options_.sampling_param.top_logprobs;
+    token.top_tokens = {top_tokens_.data() + idx * k, k};
+    token.top_logprobs = {top_logprobs_.data() + idx * k, k};
+  }
+  return token;
+}
+
+void Sequence::replace_last_token(int64_t token_id, float logprob) {
+  CHECK_GT(num_generated_tokens(), 0) << "no generated token to replace";
+  const size_t idx = num_tokens_ - 1;
+  ++token_ids_version_;
+  count_token(token_ids_[idx], -1);
+  token_ids_[idx] = static_cast<int32_t>(token_id);
+  count_token(token_ids_[idx], 1);
+  logprobs_[idx] = logprob;
+  has_logprobs_[idx] = true;
+  num_stop_states_ = std::min(num_stop_states_, idx);
+
+  // check the finish status again with the new token
+  set_finish_reason(check_finished(num_tokens_));
+}
+
+void Sequence::assign_beam(const Sequence& beam,
+                           int64_t token_id,
+                           float logprob) {
+  CHECK(this != &beam) << "cannot assign a beam to itself";
+  CHECK_EQ(num_prompt_tokens_, beam.num_prompt_tokens_)
+      << "beams should share the prompt";
+  CHECK_EQ(num_kv_cache_tokens(), beam.num_kv_cache_tokens())
+      << "the blocks of the beam should be forked first";
+
+  // the tokens are different, so the block table has to be rebuilt
+  id_ = next_sequence_id.fetch_add(1, std::memory_order_relaxed);
+  last_token_time_ = beam.last_token_time_;
+  is_first_token_ = beam.is_first_token_;
+  incremental_decoder_ = beam.incremental_decoder_;
+  token_ids_ = beam.token_ids_;
+  logprobs_ = beam.logprobs_;
+  has_logprobs_ = beam.has_logprobs_;
+  top_tokens_ = beam.top_tokens_;
+  top_logprobs_ = beam.top_logprobs_;
+  has_top_tokens_ = beam.has_top_tokens_;
+  num_tokens_ = beam.num_tokens_;
+  // keep the counts of the tokens replaced later
+  token_to_count_map_ = beam.token_to_count_map();
+  has_token_counts_ = true;
+  grammar_state_ = beam.grammar_state_;
+  stop_states_ = beam.stop_states_;
+  num_stop_states_ = beam.num_stop_states_;
+  replace_last_token(token_id, logprob);
+}
+
+void Sequence::finish(FinishReason reason) {
+  CHECK(reason != FinishReason::NONE) << "finish without a reason";
+  set_finish_reason(reason);
+}
+
+void Sequence::set_finished_counter(size_t* counter) {
+  if (finished_counter_.count != nullptr && is_finished_) {
+    --*finished_counter_.count;
+  }
+  finished_counter_.count = counter;
+  if (counter != nullptr && is_finished_) {
+    ++*counter;
+  }
+}
+
+void Sequence::set_finish_reason(FinishReason reason) {
+  const bool finished = reason != FinishReason::NONE;
+  if (finished != is_finished_ && finished_counter_.count != nullptr) {
+    if (finished) {
+      ++*finished_counter_.count;
+    } else {
+      --*finished_counter_.count;
+    }
+  }
+  is_finished_ = finished;
+  finish_reason_ = reason;
+}
+
+void Sequence::token_bitmask(int32_t* mask, size_t n_words) const {
+  const auto* grammar = options_.grammar.get();
+  CHECK(grammar != nullptr) << "sequence is not constrained by a grammar";
+  CHECK_EQ(grammar->num_words(), n_words) << "bitmask size mismatch";
+
+  // only the end tokens are allowed once the text can't match the grammar,
+  // e.g. after a token sampled without the mask.
+  const bool dead = grammar_state_ == TokenGrammar::kDeadState;
+  if (dead) {
+    std::fill(mask, mask + n_words, 0);
+  } else {
+    std::copy_n(grammar->bitmask(grammar_state_), n_words, mask);
+  }
+  if (!dead && !grammar->is_accepting(grammar_state_)) {
+    return;
+  }
+  auto allow = [&](int32_t token_id) {
+    if (token_id >= 0 && static_cast<size_t>(token_id) < n_words * 32) {
+      mask[token_id / 32] |= static_cast<int32_t>(1u << (token_id % 32));
+    }
+  };
+  const auto& stopping_criteria = options_.stopping_criteria;
+  if (!stopping_criteria.ignore_eos) {
+    allow(stopping_criteria.eos_token_id);
+  }
+  for (const int32_t token_id : stopping_criteria.stop_token_ids) {
+    allow(token_id);
+  }
 }
 
 size_t Sequence::validate_tokens(const std::vector<Token>& tokens) {
   const size_t len = tokens.size();
   CHECK_GT(len, 0) << "empty accepted token ids";
+  CHECK(options_.grammar == nullptr)
+      << "grammars are not supported with speculative decoding";
   CHECK_GT(num_tokens_, len) << "accepted tokens exceed the sequence length";
   const auto bonus_token_id = tokens.back().id;
   CHECK(bonus_token_id == -1 || bonus_token_id == token_ids().back())
@@ -99,10 +331,15 @@ size_t Sequence::validate_tokens(const std::vector<Token>& tokens) {
 
   // validate the accepted tokens with draft tokens, stop at the first mismatch
   const size_t start_idx = num_tokens_ - len;
+  ++token_ids_version_;
+  num_stop_states_ = std::min(num_stop_states_, start_idx);
 
   // check if the token is the first token after the prompt
   is_first_token_ = start_idx == num_prompt_tokens_;
 
+  // the status is evaluated again with the accepted tokens
+  set_finish_reason(FinishReason::NONE);
+
   bool mismatch = false;
   size_t num_accpeted = 0;
   for (size_t i = 0; i < len; ++i) {
@@ -122,8 +359,8 @@ size_t Sequence::validate_tokens(const std::vector<Token>& tokens) {
       // overwrite the token id with the accepted token id
       token_ids_[cur_idx] = target_token_id;
       // update the token count
-      --token_to_count_map_[draft_token_id];
-      ++token_to_count_map_[target_token_id];
+      count_token(draft_token_id, -1);
+      count_token(target_token_id, 1);
     }
     // update logprobs if needed
     if (options_.sampling_param.logprobs) {
@@ -131,12 +368,9 @@ size_t Sequence::validate_tokens(const std::vector<Token>& tokens) {
     }
 
     // check if sequence is finished
-    const Slice<int32_t> token_ids(token_ids_, cur_idx + 1);
-    auto finish_reason = options_.stopping_criteria.check_finished(
-        token_ids, num_prompt_tokens_);
+    const auto finish_reason = check_finished(cur_idx + 1);
     if (finish_reason != FinishReason::NONE) {
-      finish_reason_ = finish_reason;
-      is_finished_ = true;
+      set_finish_reason(finish_reason);
       // update num tokens, including current token
       num_tokens_ = cur_idx + 1;
       break;
@@ -145,7 +379,7 @@ size_t Sequence::validate_tokens(const std::vector<Token>& tokens) {
 
   // adjust the token count for remaining discarded tokens
   for (size_t i = num_accpeted; i < len; ++i) {
-    --token_to_count_map_[token_ids_[start_idx + i]];
+    count_token(token_ids_[start_idx + i], -1);
   }
 
   // adjust kv cache position
@@ -156,8 +390,13 @@ size_t Sequence::validate_tokens(const std::vector<Token>& tokens) {
 
   CHECK_GT(num_accpeted, 0) << "no token accepted";
 
-  // the finish status is valid after the validation
-  finish_status_invalidated_ = false;
+  // update the acceptance rate of the draft tokens, excluding the last one
+  // which is sampled from the target model
+  if (len > 1) {
+    const double rate = static_cast<double>(num_accpeted - 1) / (len - 1);
+    acceptance_rate_ = kAcceptanceRateDecay * acceptance_rate_ +
+                       (1.0 - kAcceptanceRateDecay) * rate;
+  }
   return num_accpeted;
 }
 
@@ -170,17 +409,38 @@ size_t Sequence::validate_tokens(const std::vector<int64_t>& token_ids) {
   return validate_tokens(tokens);
 }
 
+size_t Sequence::num_speculative_tokens(size_t max_tokens,
+                                        double min_acceptance) const {
+  // the k-th draft token is accepted with probability acceptance_rate^k
+  size_t num_tokens = 0;
+  for (double prob = acceptance_rate_;
+       num_tokens < max_tokens && prob >= min_acceptance;
+       prob *= acceptance_rate_) {
+    ++num_tokens;
+  }
+  return num_tokens;
+}
+
 std::optional<SequenceOutput> Sequence::build_delta_output_until(
     size_t size,
-    const Tokenizer& tokenizer) {
+    const Tokenizer& tokenizer,
+    const std::vector<std::string>& window_texts) {
   CHECK_LE(size, num_tokens_);
+  if (!options_.detokenize) {
+    if (size <= incremental_decoder_.output_offset() &&
+        finish_reason_ == FinishReason::NONE) {
+      // no new tokens and not finished
+      return std::nullopt;
+    }
+    return build_raw_output_until(size);
+  }
   AUTO_COUNTER(stream_decode_latency_seconds);
 
   const auto ids = Slice<int32_t>(token_ids_, size);
 
   // record the start index of token ids
   const size_t start = incremental_decoder_.output_offset();
-  auto delta = incremental_decoder_.decode(ids, tokenizer);
+  auto delta = incremental_decoder_.decode(ids, tokenizer, window_texts);
   if (delta.empty() && finish_reason_ == FinishReason::NONE) {
     // no delta text and not finished
     return std::nullopt;
@@ -207,7 +467,28 @@ std::optional<SequenceOutput> Sequence::build_delta_output_until(
   return output;
 }
 
+std::vector<Slice<int32_t>> Sequence::delta_windows_until(size_t size) const {
+  CHECK_LE(size, num_tokens_);
+  if (!options_.detokenize) {
+    return {};
+  }
+  return incremental_decoder_.windows(Slice<int32_t>(token_ids_, size));
+}
+
 SequenceOutput Sequence::build_output(const Tokenizer& tokenizer) {
+  if (is_embedding()) {
+    // no text for embeddings
+    SequenceOutput output;
+    output.index = index_;
+    if (finish_reason_ != FinishReason::NONE) {
+      output.finish_reason = to_string(finish_reason_);
+    }
+    output.embedding = embedding_;
+    return output;
+  }
+  if (!options_.detokenize) {
+    return build_raw_output_until(num_tokens_);
+  }
   AUTO_COUNTER(non_stream_decode_latency_seconds);
 
   const auto ids = token_ids();
@@ -251,6 +532,28 @@ SequenceOutput Sequence::build_output(const Tokenizer& tokenizer) {
   return output;
 }
 
+SequenceOutput Sequence::build_raw_output_until(size_t size) {
+  const auto ids = Slice<int32_t>(token_ids_, size);
+  const size_t start = incremental_decoder_.output_offset();
+  incremental_decoder_.skip(ids);
+
+  SequenceOutput output;
+  output.index = index_;
+  if (finish_reason_ != FinishReason::NONE) {
+    output.finish_reason = to_string(finish_reason_);
+  }
+  output.token_ids = ids.slice(start);
+  if (options_.logprobs) {
+    output.token_logprobs.reserve(size - start);
+    for (size_t i = start; i < size; ++i) {
+      output.token_logprobs.push_back(
+          has_logprobs_[i] ? logprobs_[i]
+                           : std::numeric_limits<float>::quiet_NaN());
+    }
+  }
+  return output;
+}
+
 void Sequence::append_blocks(const std::vector<Block>& new_blocks) {
   blocks_.insert(blocks_.end(), new_blocks.begin(), new_blocks.end());
 }
@@ -284,11 +587,124 @@ void Sequence::set_shared_blocks(std::vector<Block>&& shared_blocks) {
             num_shared_tokens);
 }
 
+void Sequence::set_forked_blocks(std::vector<Block>&& blocks,
+                                 size_t num_tokens) {
+  CHECK(blocks_.empty()) << "forked blocks should be set before any "
+                            "other blocks";
+  if (blocks.empty()) {
+    return;
+  }
+  CHECK_LT(num_tokens, num_tokens_);
+  CHECK_LE(num_tokens, blocks.size() * blocks[0].size());
+  blocks_ = std::move(blocks);
+  // update the kv cache position
+  std::fill(num_kv_cache_tokens_.begin(),
+            num_kv_cache_tokens_.end(),
+            num_tokens);
+}
+
+std::vector<Block> Sequence::release_leading_blocks(
+    size_t n_blocks,
+    const Block& padding_block) {
+  CHECK(host_blocks_.empty()) << "sequence is swapped out";
+  n_blocks = std::min(n_blocks, blocks_.size());
+  std::vector<Block> released;
+  for (size_t i = num_released_blocks_; i < n_blocks; ++i) {
+    released.push_back(std::move(blocks_[i]));
+    blocks_[i] = padding_block;
+  }
+  num_released_blocks_ = std::max(num_released_blocks_, n_blocks);
+  return released;
+}
+
+std::vector<Block> Sequence::evict_blocks(
+    const std::vector<size_t>& block_idxes) {
+  CHECK(host_blocks_.empty()) << "sequence is swapped out";
+  CHECK_EQ(num_released_blocks_, 0) << "sequence has released blocks";
+  std::vector<Block> evicted;
+  evicted.reserve(block_idxes.size());
+  std::vector<Block> kept;
+  kept.reserve(blocks_.size() - block_idxes.size());
+  size_t next = 0;
+  for (size_t i = 0; i < blocks_.size(); ++i) {
+    if (next < block_idxes.size() && block_idxes[next] == i) {
+      evicted.push_back(std::move(blocks_[i]));
+      ++next;
+    } else {
+      kept.push_back(std::move(blocks_[i]));
+    }
+  }
+  CHECK_EQ(next, block_idxes.size()) << "block indexes should be sorted";
+  blocks_ = std::move(kept);
+  if (!blocks_.empty()) {
+    num_evicted_tokens_ += evicted.size() * blocks_[0].size();
+  }
+  kv_block_scores_.clear();
+  return evicted;
+}
+
+std::vector<Block> Sequence::offload_blocks(std::vector<Block>&& host_blocks) {
+  CHECK(host_blocks_.empty()) << "sequence is swapped out";
+  CHECK_EQ(num_released_blocks_, 0) << "sequence has released blocks";
+  const size_t n_blocks = host_blocks.size();
+  CHECK_LT(n_blocks, blocks_.size()) << "the last block should be kept";
+  const size_t block_size = blocks_[0].size();
+  CHECK_EQ(num_evicted_tokens_, offloaded_blocks_.size() * block_size)
+      << "sequence has evicted blocks";
+  std::vector<Block> offloaded;
+  offloaded.reserve(n_blocks);
+  for (size_t i = 0; i < n_blocks; ++i) {
+    offloaded.push_back(std::move(blocks_[i]));
+    offloaded_blocks_.push_back(std::move(host_blocks[i]));
+  }
+  blocks_.erase(blocks_.begin(), blocks_.begin() + n_blocks);
+  num_evicted_tokens_ += n_blocks * block_size;
+  kv_block_scores_.clear();
+  return offloaded;
+}
+
 // release all cache blocks
 void Sequence::release_blocks() {
   // reset the kv cache position to 0
   std::fill(num_kv_cache_tokens_.begin(), num_kv_cache_tokens_.end(), 0);
-  blocks_.clear();
+  num_released_blocks_ = 0;
+  // the prompt is processed and observed again from the start
+  num_evicted_tokens_ = 0;
+  kv_block_scores_.clear();
+  // return the blocks to the allocators in batches
+  Block::release(&blocks_);
+  Block::release(&host_blocks_);
+  Block::release(&offloaded_blocks_);
+}
+
+void Sequence::swap_out_blocks(std::vector<Block>&& host_blocks) {
+  CHECK(host_blocks_.empty()) << "sequence is already swapped out";
+  CHECK_EQ(host_blocks.size(), blocks_.size())
+      << "host blocks should match the device blocks";
+  // keep the kv cache position, only the backing memory changes
+  host_blocks_ = std::move(host_blocks);
+  Block::release(&blocks_);
+}
+
+std::vector<Block> Sequence::swap_in_blocks(
+    std::vector<Block>&& device_blocks) {
+  CHECK(blocks_.empty()) << "swap in blocks before any other blocks";
+  CHECK_EQ(device_blocks.size(), host_blocks_.size())
+      << "device blocks should match the host blocks";
+  blocks_ = std::move(device_blocks);
+
+  std::vector<Block> host_blocks;
+  host_blocks.swap(host_blocks_);
+  return host_blocks;
+}
+
+std::vector<Block> Sequence::replace_blocks(std::vector<Block>&& blocks) {
+  CHECK(host_blocks_.empty()) << "sequence is swapped out";
+  CHECK_EQ(num_released_blocks_, 0) << "sequence has released blocks";
+  CHECK_EQ(blocks.size(), blocks_.size())
+      << "new blocks should match the blocks";
+  blocks.swap(blocks_);
+  return std::move(blocks);
 }
 
 size_t Sequence::kv_cache_capacity() const {
@@ -297,7 +713,7 @@ size_t Sequence::kv_cache_capacity() const {
   }
   // all blocks have the same size
   const size_t block_size = blocks_[0].size();
-  return blocks_.size() * block_size;
+  return blocks_.size() * block_size + num_evicted_tokens_;
 }
 
 std::vector<int32_t> Sequence::kv_cache_slots(int32_t pos_start,
@@ -308,7 +724,11 @@ std::vector<int32_t> Sequence::kv_cache_slots(int32_t pos_start,
   slots.reserve(pos_end - pos_start);
 
   const size_t block_size = blocks_[0].size();
-  for (int32_t i = pos_start; i < pos_end; ++i) {
+  // the kv cache of the tokens after the evicted ones moves forward
+  const auto n_evicted = static_cast<int32_t>(num_evicted_tokens_);
+  CHECK_GE(pos_start, n_evicted) << "kv cache is evicted";
+  for (int32_t pos = pos_start; pos < pos_end; ++pos) {
+    const int32_t i = pos - n_evicted;
     const int32_t block_id = blocks_[i / block_size].id();
     const int32_t block_offset = i % block_size;
     slots.push_back(block_id * block_size + block_offset);
@@ -316,23 +736,36 @@ std::vector<int32_t> Sequence::kv_cache_slots(int32_t pos_start,
   return slots;
 }
 
-bool Sequence::is_finished() const {
-  // return the cached finish status
-  if (!finish_status_invalidated_) {
-    return is_finished_;
+void Sequence::build_token_counts() const {
+  token_to_count_map_.clear();
+  for (size_t i = 0; i < num_tokens_; ++i) {
+    ++token_to_count_map_[token_ids_[i]];
   }
+  has_token_counts_ = true;
+}
 
-  // reset the finish status invalidation flag
-  finish_status_invalidated_ = false;
-
-  auto finish_reason = options_.stopping_criteria.check_finished(
-      token_ids(), num_prompt_tokens_);
-  if (finish_reason != FinishReason::NONE) {
-    finish_reason_ = finish_reason;
-    is_finished_ = true;
-    return true;
+FinishReason Sequence::check_finished(size_t n_tokens) {
+  const auto& stopping_criteria = options_.stopping_criteria;
+  const auto* matcher = stopping_criteria.stop_sequence_matcher.get();
+  if (matcher != nullptr) {
+    // only advance the matcher over the tokens appended or rewritten since
+    // the last check
+    if (stop_states_.size() < n_tokens) {
+      stop_states_.resize(n_tokens);
+    }
+    int32_t state = num_stop_states_ > 0 ? stop_states_[num_stop_states_ - 1]
+                                         : StopSequenceMatcher::kStartState;
+    for (size_t i = num_stop_states_; i < n_tokens; ++i) {
+      state = matcher->next_state(state, token_ids_[i]);
+      stop_states_[i] = state;
+    }
+    num_stop_states_ = std::max(num_stop_states_, n_tokens);
+    if (matcher->is_match(stop_states_[n_tokens - 1])) {
+      return FinishReason::STOP;
+    }
   }
-  return false;
+  return stopping_criteria.check_finished(Slice<int32_t>(token_ids_, n_tokens),
+                                          num_prompt_tokens_);
 }
 
 double Sequence::inter_token_latency(const absl::Time& now) {
@@ -346,27 +779,27 @@ float Sequence::logprob() const {
     // return a small value for empty sequence
     return -9999.0;
   }
+  return static_cast<float>(cumulative_logprob() /
+                            (num_tokens_ - num_prompt_tokens_));
+}
 
+double Sequence::cumulative_logprob() const {
   double sum = 0.0;
   for (size_t i = num_prompt_tokens_; i < num_tokens_; ++i) {
-    if (logprobs_[i].has_value()) {
-      sum += logprobs_[i].value();
+    if (has_logprobs_[i]) {
+      sum += logprobs_[i];
     }
   }
-  return static_cast<float>(sum / (num_tokens_ - num_prompt_tokens_));
+  return sum;
 }
 
 std::vector<LogProb> Sequence::build_logprobs(size_t start_idx,
                                               size_t end_idx,
                                               const Tokenizer& tokenizer) {
-  // TODO: support logprobs for the entire sequence?
-  if (start_idx < num_prompt_tokens_) {
-    start_idx = num_prompt_tokens_;
-  }
-
+  // the prompt tokens only have log probabilities if they are scored
   std::vector<LogProb> logprob_contents;
   for (size_t i = start_idx; i < end_idx; ++i) {
-    if (logprobs_[i].has_value()) {
+    if (has_logprobs_[i]) {
       const int32_t token_id = token_ids_[i];
       auto token = tokenizer.decode(std::vector<int32_t>{token_id},
                                     options_.skip_special_tokens);
@@ -384,17 +817,18 @@ std::vector<LogProb> Sequence::build_logprobs(size_t start_idx,
       // add token and logprob
       logprob_content.token = std::move(token);
       logprob_content.token_id = token_id;
-      logprob_content.logprob = logprobs_[i].value();
+      logprob_content.logprob = logprobs_[i];
 
       // add top logprobs if available
-      if (!top_tokens_[i].empty()) {
-        const auto& top_tokens = top_tokens_[i];
-        const auto& top_logprobs = top_logprobs_[i];
-        DCHECK_EQ(top_tokens.size(), top_logprobs.size());
+      if (has_top_tokens_[i]) {
+        const size_t k = options_.sampling_param.top_logprobs;
+        const int64_t* top_tokens = top_tokens_.data() + i * k;
+        const float* top_logprobs = top_logprobs_.data() + i * k;
         std::vector<LogProbData> logprobs;
-        for (size_t j = 0; j < top_tokens.size(); ++j) {
+        logprobs.reserve(k);
+        for (size_t j = 0; j < k; ++j) {
           LogProbData logprob;
-          const int32_t top_token_id = top_tokens[j];
+          const int32_t top_token_id = static_cast<int32_t>(top_tokens[j]);
           const float top_logprob = top_logprobs[j];
 
           auto top_token = tokenizer.decode(std::vector<int32_t>{top_token_id},
@@ -418,21 +852,24 @@ std::vector<LogProb> Sequence::build_logprobs(size_t start_idx,
 }
 
 void Sequence::update_logprobs(size_t index, const Token& token) {
-  logprobs_[index] = token.logprob;
+  logprobs_[index] = token.logprob.value_or(0.0f);
+  has_logprobs_[index] = token.logprob.has_value();
 
   // update top tokens and top logprobs if needed
-  const auto num_top_tokens = options_.sampling_param.top_logprobs;
-  if (num_top_tokens > 0) {
-    DCHECK_EQ(token.top_tokens.size(), token.top_logprobs.size());
-    if (token.top_tokens.size() > num_top_tokens) {
-      top_tokens_[index] = token.top_tokens.slice(0, num_top_tokens);
-      top_logprobs_[index] = token.top_logprobs.slice(0, num_top_tokens);
-    } else {
-      DCHECK_EQ(token.top_tokens.size(), num_top_tokens);
-      top_tokens_[index] = token.top_tokens;
-      top_logprobs_[index] = token.top_logprobs;
-    }
+  const size_t k = options_.sampling_param.top_logprobs;
+  has_top_tokens_[index] = k > 0 && !token.top_tokens.empty();
+  if (!has_top_tokens_[index]) {
+    return;
+  }
+  DCHECK_EQ(token.top_tokens.size(), token.top_logprobs.size());
+  CHECK_GE(token.top_tokens.size(), k) << "not enough top tokens";
+  // grow the rows with amortized reallocation
+  if (top_tokens_.size() < (index + 1) * k) {
+    top_tokens_.resize((index + 1) * k);
+    top_logprobs_.resize((index + 1) * k);
   }
+  std::copy_n(token.top_tokens.data(), k, top_tokens_.data() + index * k);
+  std::copy_n(token.top_logprobs.data(), k, top_logprobs_.data() + index * k);
 }
 
 }  // namespace llm
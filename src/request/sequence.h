@@ -3,9 +3,12 @@
 #include <absl/time/time.h>
 
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 #include "common/slice.h"
+#include "grammar/token_grammar.h"
+#include "image_input.h"
 #include "incremental_decoder.h"
 #include "memory/block.h"
 #include "output.h"
@@ -28,6 +31,17 @@ enum class EngineType : int8_t {
   COUNT = 2,
 };
 
+// How the last hidden states of the prompt tokens are pooled into the
+// embedding of a sequence.
+enum class PoolingType : int8_t {
+  // no embedding, the sequence generates tokens
+  NONE = 0,
+  // the mean of the hidden states of all prompt tokens
+  MEAN = 1,
+  // the hidden state of the last prompt token
+  LAST = 2,
+};
+
 struct Token {
   explicit Token(int64_t id) : id(id) {}
 
@@ -55,8 +69,36 @@ class Sequence final {
     // whether to echo the prompt tokens back
     bool echo = false;
 
+    // whether to decode the output tokens into text, only the token ids and
+    // logprobs are output otherwise
+    bool detokenize = true;
+
     // whether to output log probabilities for output tokens
     bool logprobs = false;
+
+    // whether to compute the log probabilities of the prompt tokens from the
+    // logits of the prefill, e.g. to score the prompt echoed back. the kv
+    // cache of the prompt is not shared until they are computed.
+    bool prompt_logprobs = false;
+
+    // the id of the lora adapter to run the sequence with, -1 for none
+    int32_t lora_id = -1;
+
+    // the grammar to constrain the generated tokens, nullptr for none
+    std::shared_ptr<const TokenGrammar> grammar;
+
+    // the images of the prompt sorted by their placeholder tokens, nullptr
+    // for none. shared by the sequences of the request.
+    std::shared_ptr<const std::vector<ImageInput>> images;
+
+    // the number of beams of the beam search the sequence is a beam of, 0 if
+    // the tokens are sampled. the tokens of beams are selected after each
+    // step among the top tokens of all beams.
+    size_t beam_width = 0;
+
+    // pool the hidden states of the prompt into a normalized embedding and
+    // finish once the prompt is prefilled, no token is generated.
+    PoolingType pooling = PoolingType::NONE;
   };
 
   Sequence(size_t index,
@@ -76,17 +118,36 @@ class Sequence final {
            size_t capacity,
            const Options& option);
 
+  // the token buffers are returned to a pool shared by all sequences
+  ~Sequence();
+
+  Sequence(const Sequence&) = default;
+  Sequence& operator=(const Sequence&) = default;
+  Sequence(Sequence&&) = default;
+  Sequence& operator=(Sequence&&) = default;
+
   // get the index of the sequence in the request
   size_t index() const { return index_; }
 
+  // get the unique id of the sequence within the process
+  int64_t id() const { return id_; }
+
   // get token ids
   Slice<int32_t> token_ids() const { return {token_ids_, num_tokens_}; }
 
-  // get token ids to count map
+  // get token ids to count map, built on first use as only the sequences
+  // with penalties need it
   const std::unordered_map<int32_t, int32_t>& token_to_count_map() const {
+    if (!has_token_counts_) {
+      build_token_counts();
+    }
     return token_to_count_map_;
   }
 
+  // bumped whenever tokens are replaced or discarded instead of appended, to
+  // invalidate the token counts kept on device.
+  uint32_t token_ids_version() const { return token_ids_version_; }
+
   // get the total number of tokens
   size_t num_tokens() const { return num_tokens_; }
 
@@ -124,7 +185,8 @@ class Sequence final {
     return num_kv_cache_tokens_[static_cast<size_t>(engine_type)];
   }
 
-  // get the capacity of the kv cache allocated
+  // get the capacity of the kv cache allocated, in positions including the
+  // evicted tokens
   size_t kv_cache_capacity() const;
 
   // generate the kv cache slots for the position range [pos_start, pos_end)
@@ -151,9 +213,34 @@ class Sequence final {
   size_t validate_tokens(const std::vector<Token>& tokens);
   size_t validate_tokens(const std::vector<int64_t>& token_ids);
 
+  // moving average of the ratio of accepted draft tokens, starts at 1
+  double acceptance_rate() const { return acceptance_rate_; }
+
+  // the number of draft tokens worth verifying given the acceptance rate,
+  // where each draft token is accepted with at least min_acceptance
+  // probability, capped by max_tokens.
+  size_t num_speculative_tokens(size_t max_tokens,
+                                double min_acceptance) const;
+
   // whether the new added token is the first token
   bool is_first_token() const { return is_first_token_; }
 
+  // get the last token with its log probability and top tokens
+  Token last_token() const;
+
+  // replace the last generated token, e.g. with another top token of the
+  // step by beam search. the top tokens of the step are kept.
+  void replace_last_token(int64_t token_id, float logprob);
+
+  // continue the beam with the token replacing its last token, taking over
+  // its generated tokens. the kv cache blocks of the beam should be forked
+  // into the sequence first. the sequence gets a new id as its tokens change.
+  void assign_beam(const Sequence& beam, int64_t token_id, float logprob);
+
+  // finish the sequence before its stopping criteria are met, e.g. a beam
+  // that can't beat the finished hypotheses of beam search.
+  void finish(FinishReason reason);
+
   // add new cache blocks
   void append_block(const Block& new_block) {
     return append_blocks({new_block});
@@ -163,15 +250,86 @@ class Sequence final {
   // set shared cache blocks from prefix cache
   void set_shared_blocks(std::vector<Block>&& shared_blocks);
 
-  // release all cache blocks
+  // set the blocks forked from another sequence, holding the kv cache of the
+  // first num_tokens tokens.
+  void set_forked_blocks(std::vector<Block>&& blocks, size_t num_tokens);
+
+  // release all cache blocks, including host blocks if swapped out
   void release_blocks();
 
+  // swap out the kv cache into host blocks, the kv cache position is kept.
+  // caller should make sure the blocks are copied before reusing them.
+  void swap_out_blocks(std::vector<Block>&& host_blocks);
+
+  // swap in the kv cache from host blocks into new device blocks.
+  // returns the host blocks that were holding the kv cache.
+  std::vector<Block> swap_in_blocks(std::vector<Block>&& device_blocks);
+
+  // replace the blocks with new ones holding a copy of the kv cache, e.g.
+  // moved into consecutive blocks. returns the replaced blocks.
+  std::vector<Block> replace_blocks(std::vector<Block>&& blocks);
+
   // returns allocated cache blocks
   Slice<Block> blocks() const { return blocks_; }
 
   // get the number of blocks
   size_t num_blocks() const { return blocks_.size(); }
 
+  // release the first n blocks, which have scrolled out of the attention
+  // window. their entries are kept in the block table, pointing to the
+  // padding block. returns the newly released blocks.
+  std::vector<Block> release_leading_blocks(size_t n_blocks,
+                                            const Block& padding_block);
+
+  // get the number of leading blocks released by release_leading_blocks()
+  size_t num_released_blocks() const { return num_released_blocks_; }
+
+  // collect the attention of the last `window` prompt tokens over the kv
+  // cache when the prompt is processed, which ranks the blocks to evict.
+  void set_kv_observation_window(size_t window) {
+    kv_observation_window_ = window;
+  }
+
+  // the number of prompt tokens to observe, 0 if not observed
+  size_t kv_observation_window() const { return kv_observation_window_; }
+
+  // set the attention received by each block of the kv cache, summed over
+  // the observed tokens, heads and layers.
+  void set_kv_block_scores(std::vector<float> scores) {
+    kv_block_scores_ = std::move(scores);
+  }
+
+  // the attention received by each block, empty until observed
+  const std::vector<float>& kv_block_scores() const {
+    return kv_block_scores_;
+  }
+
+  // evict the blocks at the sorted indexes from the kv cache, the kv cache
+  // of the following tokens moves forward in the block table without being
+  // copied. returns the evicted blocks.
+  std::vector<Block> evict_blocks(const std::vector<size_t>& block_idxes);
+
+  // the number of tokens whose kv cache is evicted. the kv cache of the
+  // tokens after the evicted ones is num_evicted_tokens() slots ahead of
+  // their positions.
+  size_t num_evicted_tokens() const { return num_evicted_tokens_; }
+
+  // offload the kv cache of the leading blocks to the host blocks, one for
+  // each. the offloaded tokens are still attended from host memory, and the
+  // kv cache of the following tokens moves forward like evict_blocks().
+  // returns the device blocks, whose kv cache is copied to the host blocks.
+  std::vector<Block> offload_blocks(std::vector<Block>&& host_blocks);
+
+  // the host blocks holding the kv cache of the leading tokens offloaded by
+  // offload_blocks(), counted in num_evicted_tokens().
+  Slice<Block> offloaded_blocks() const { return offloaded_blocks_; }
+
+  // returns host blocks holding the kv cache if swapped out
+  Slice<Block> host_blocks() const { return host_blocks_; }
+
+  // check if the kv cache of the sequence is swapped out to host memory
+  bool is_swapped_out() const { return !host_blocks_.empty(); }
+
   // get the reason why the sequence is finished
   FinishReason finish_reason() const { return finish_reason_; }
 
@@ -180,14 +338,28 @@ class Sequence final {
     return num_tokens_ > incremental_decoder_.output_offset();
   }
 
-  // check finish status, use cached value if not invalidated
-  bool is_finished() const;
+  // the finish status, evaluated once for each appended or rewritten token
+  bool is_finished() const { return is_finished_; }
+
+  // count the sequence in the finished sequences of its request while it is
+  // finished. the counter is not carried over by copies or moves.
+  void set_finished_counter(size_t* counter);
 
   // get the output of the sequence until the specified number of tokens,
   // returns nullopt if no delta text and not finished
+  // window_texts: the texts of delta_windows_until(size) decoded by the
+  // caller, empty to decode them here.
   std::optional<SequenceOutput> build_delta_output_until(
       size_t size,
-      const Tokenizer& tokenizer);
+      const Tokenizer& tokenizer,
+      const std::vector<std::string>& window_texts = {});
+
+  // the windows of tokens to decode for the delta output until the specified
+  // number of tokens, which can be decoded together with the windows of
+  // other sequences. empty if the tokens are not decoded by windows.
+  std::vector<Slice<int32_t>> delta_windows_until(size_t size) const;
+
+  bool skip_special_tokens() const { return options_.skip_special_tokens; }
 
   // get the full output of the sequence
   SequenceOutput build_output(const Tokenizer& tokenizer);
@@ -215,17 +387,85 @@ class Sequence final {
     return &options_.stopping_criteria;
   }
 
+  // get the id of the lora adapter, -1 for none
+  int32_t lora_id() const { return options_.lora_id; }
+
+  // get the grammar constraining the generated tokens, nullptr for none
+  const TokenGrammar* grammar() const { return options_.grammar.get(); }
+
+  // get the images of the prompt, nullptr for none
+  const std::vector<ImageInput>* images() const {
+    return options_.images.get();
+  }
+
+  // whether the kv cache of the prompt can be shared through the prefix
+  // cache, which is keyed by the token ids only. the kv cache depends on the
+  // adapter, and on the images whose placeholders all share one token id.
+  bool prefix_cacheable() const {
+    return options_.lora_id < 0 && options_.images == nullptr;
+  }
+
+  // get the beam width of the beam search, 0 if the tokens are sampled
+  size_t beam_width() const { return options_.beam_width; }
+
+  // whether the sequence returns the embedding of the prompt instead of
+  // generating tokens, see Options::pooling.
+  bool is_embedding() const { return options_.pooling != PoolingType::NONE; }
+
+  PoolingType pooling() const { return options_.pooling; }
+
+  // add the sum of the hidden states of the pooled prompt tokens in [start,
+  // end), all of them for mean pooling and only the last prompt token
+  // otherwise. the sequence finishes with the normalized embedding once the
+  // last prompt token is pooled.
+  void add_pooled_hidden_states(size_t start,
+                                size_t end,
+                                const Slice<float>& sum);
+
+  // the normalized embedding, empty until the prompt is pooled
+  const std::vector<float>& embedding() const { return embedding_; }
+
+  // whether the log probabilities of some prompt tokens are still to be
+  // computed, see Options::prompt_logprobs.
+  bool needs_prompt_logprobs() const { return needs_prompt_logprobs_; }
+
+  // whether all prompt tokens have to run through the model instead of
+  // sharing the kv cache of a cached prefix, e.g. to score or mean pool them.
+  bool needs_full_prefill() const {
+    return needs_prompt_logprobs_ || options_.pooling == PoolingType::MEAN;
+  }
+
+  // set the log probabilities of the prompt tokens [start, start + n), each
+  // computed from the logits of the token before it. the first prompt token
+  // has no log probability.
+  void set_prompt_logprobs(size_t start, const Slice<float>& logprobs);
+
+  // copy the log probabilities of the prompt tokens from a sequence with the
+  // same prompt, e.g. the first sequence of the request.
+  void copy_prompt_logprobs(const Sequence& other);
+
+  // write the bitmask of the tokens allowed by the grammar for the next token
+  // into mask: [n_words]. the end tokens are allowed once the generated text
+  // matches the grammar.
+  void token_bitmask(int32_t* mask, size_t n_words) const;
+
   // close the sequence once all outputs have been sent
   void close() { closed_ = true; }
 
   bool is_closed() const { return closed_; }
 
+  // get the time when the last token was generated
+  absl::Time last_token_time() const { return last_token_time_; }
+
   // get the inter-token latency
   double inter_token_latency(const absl::Time& now);
 
   // get the average log probability of the sequence (generated tokens only)
   float logprob() const;
 
+  // get the sum of the log probabilities of the generated tokens
+  double cumulative_logprob() const;
+
  private:
   // build log probabilities for the tokens in the range [start_idx, end_idx)
   std::vector<LogProb> build_logprobs(size_t start_idx,
@@ -234,9 +474,32 @@ class Sequence final {
 
   void update_logprobs(size_t index, const Token& token);
 
+  // check the stopping criteria against the first n_tokens tokens
+  FinishReason check_finished(size_t n_tokens);
+
+  // set the finish status and update the counter of the request
+  void set_finish_reason(FinishReason reason);
+
+  // count the tokens into token_to_count_map_
+  void build_token_counts() const;
+
+  // add delta to the count of the token if the counts are built
+  void count_token(int32_t token_id, int32_t delta) {
+    if (has_token_counts_) {
+      token_to_count_map_[token_id] += delta;
+    }
+  }
+
+  // build the output of the token ids [output offset, size) without decoding
+  // them, used when the output is not detokenized.
+  SequenceOutput build_raw_output_until(size_t size);
+
   // the index of the sequence in the request
   size_t index_ = 0;
 
+  // the unique id of the sequence
+  int64_t id_ = 0;
+
   // last token generation time
   absl::Time last_token_time_;
 
@@ -252,22 +515,43 @@ class Sequence final {
   // token ids generated for the sequence
   std::vector<int32_t> token_ids_;
 
-  // log probabilities of the sequence
-  std::vector<std::optional<float>> logprobs_;
+  // log probabilities of the sequence, only valid if the bit is set
+  std::vector<float> logprobs_;
+  std::vector<bool> has_logprobs_;
 
-  // top k log probabilities of the sequence
-  std::vector<std::vector<int64_t>> top_tokens_;
-  std::vector<std::vector<float>> top_logprobs_;
+  // top k tokens and log probabilities of the sequence as [n_tokens, k]
+  // arrays with k = top_logprobs, grown on demand. the rows are only valid if
+  // the bit is set.
+  std::vector<int64_t> top_tokens_;
+  std::vector<float> top_logprobs_;
+  std::vector<bool> has_top_tokens_;
 
   // number of tokens in the sequence
   size_t num_tokens_ = 0;
 
-  // the count of each token id
-  std::unordered_map<int32_t, int32_t> token_to_count_map_;
+  // the count of each token id, only kept up to date once built
+  mutable std::unordered_map<int32_t, int32_t> token_to_count_map_;
+  mutable bool has_token_counts_ = false;
+
+  // see token_ids_version()
+  uint32_t token_ids_version_ = 0;
+
+  // the state of the grammar after the generated tokens
+  int32_t grammar_state_ = TokenGrammar::kDeadState;
 
   // the length of the prompt tokens
   size_t num_prompt_tokens_ = 0;
 
+  // whether the log probabilities of the prompt tokens are still to be set
+  bool needs_prompt_logprobs_ = false;
+
+  // the sum of the pooled hidden states, normalized into the embedding once
+  // the prompt is pooled
+  std::vector<float> embedding_;
+
+  // moving average of the acceptance rate of draft tokens
+  double acceptance_rate_ = 1.0;
+
   // number of tokens in kv cache
   std::vector<size_t> num_kv_cache_tokens_;
   // current using engine type
@@ -276,14 +560,42 @@ class Sequence final {
   // physical blocks that hold the kv cache.
   std::vector<Block> blocks_;
 
-  // is the sequence finished
-  mutable bool is_finished_ = false;
+  // host blocks that hold the kv cache when swapped out.
+  std::vector<Block> host_blocks_;
+
+  // number of leading blocks replaced by the padding block
+  size_t num_released_blocks_ = 0;
+
+  // kv cache eviction, see BlockManager::evict_kv_blocks_for()
+  size_t kv_observation_window_ = 0;
+  std::vector<float> kv_block_scores_;
+  size_t num_evicted_tokens_ = 0;
 
-  // is the finish status invalidated
-  mutable bool finish_status_invalidated_ = true;
+  // host blocks of the offloaded leading tokens, see offload_blocks()
+  std::vector<Block> offloaded_blocks_;
+
+  // is the sequence finished
+  bool is_finished_ = false;
 
   // the reason why the sequence is finished
-  mutable FinishReason finish_reason_ = FinishReason::NONE;
+  FinishReason finish_reason_ = FinishReason::NONE;
+
+  // the number of finished sequences of the request, see
+  // set_finished_counter(). copies start unlinked.
+  struct FinishedCounter {
+    FinishedCounter() = default;
+    FinishedCounter(const FinishedCounter& /*other*/) {}
+    FinishedCounter& operator=(const FinishedCounter& /*other*/) {
+      return *this;
+    }
+    size_t* count = nullptr;
+  };
+  FinishedCounter finished_counter_;
+
+  // the state of the stop sequence matcher after each token, only valid for
+  // the first num_stop_states_ tokens
+  std::vector<int32_t> stop_states_;
+  size_t num_stop_states_ = 0;
 
   // is the sequence closed.
   bool closed_ = false;
@@ -3,10 +3,89 @@
 #include <absl/time/clock.h>
 #include <gtest/gtest.h>
 
+#include <cmath>
+#include <memory>
+#include <string>
+
 #include "memory/block.h"
 
 namespace llm {
 namespace {
+// a tokenizer that should never be used to decode
+class NoDecodeTokenizer final : public Tokenizer {
+ public:
+  bool encode(const std::string_view& text,
+              std::vector<int32_t>* ids) const override {
+    return false;
+  }
+
+  std::string decode(const Slice<int32_t>& ids,
+                     bool skip_special_tokens) const override {
+    ADD_FAILURE() << "unexpected decode";
+    return "";
+  }
+
+  std::optional<int32_t> token_to_id(
+      const std::string_view& token) const override {
+    return std::nullopt;
+  }
+
+  std::string id_to_token(int32_t id) const override { return ""; }
+
+  size_t vocab_size() const override { return 0; }
+
+  std::unique_ptr<Tokenizer> clone() const override {
+    return std::make_unique<NoDecodeTokenizer>();
+  }
+};
+
+// a tokenizer decoding token i into the letter 'a' + i by windows, which
+// counts the decode calls.
+class LetterTokenizer final : public Tokenizer {
+ public:
+  bool encode(const std::string_view& text,
+              std::vector<int32_t>* ids) const override {
+    return false;
+  }
+
+  std::string decode(const Slice<int32_t>& ids,
+                     bool skip_special_tokens) const override {
+    ++num_decode_calls;
+    std::string text;
+    for (const int32_t id : ids) {
+      text.push_back(static_cast<char>('a' + id));
+    }
+    return text;
+  }
+
+  std::vector<std::string> decode_batch(
+      const std::vector<Slice<int32_t>>& batch_ids,
+      bool skip_special_tokens) const override {
+    ++num_decode_batch_calls;
+    std::vector<std::string> texts;
+    for (const auto& ids : batch_ids) {
+      texts.push_back(Tokenizer::decode_batch({ids}, skip_special_tokens)[0]);
+    }
+    return texts;
+  }
+
+  std::optional<int32_t> token_to_id(
+      const std::string_view& token) const override {
+    return std::nullopt;
+  }
+
+  std::string id_to_token(int32_t id) const override { return ""; }
+
+  size_t vocab_size() const override { return 26; }
+
+  std::unique_ptr<Tokenizer> clone() const override {
+    return std::make_unique<LetterTokenizer>();
+  }
+
+  mutable size_t num_decode_calls = 0;
+  mutable size_t num_decode_batch_calls = 0;
+};
+
 void run_speculative_decoding(Sequence& sequence,
                               const std::vector<int32_t>& draft_token_ids,
                               const int32_t bonus_token_id,
@@ -393,4 +472,427 @@ TEST(SequenceTest, SpeculativeStopEosTokenId) {
             desired_tokens.size() - 1);
 }
 
+TEST(SequenceTest, SpeculativeAcceptanceRate) {
+  std::vector<int32_t> prompt_tokens = {1, 2, 4};
+  Sequence::Options options;
+  options.stopping_criteria.max_tokens = 100;
+  Sequence sequence(prompt_tokens,
+                    /*capacity=*/200,
+                    options);
+  sequence.append_block({/*id=*/0, /*size=*/200});
+
+  // optimistic before any validation
+  EXPECT_EQ(sequence.acceptance_rate(), 1.0);
+  EXPECT_EQ(sequence.num_speculative_tokens(/*max_tokens=*/4,
+                                            /*min_acceptance=*/0.3),
+            4);
+
+  // all draft tokens are rejected
+  const std::vector<int32_t> draft_token_ids = {1058, 338, 4473, 29973};
+  run_speculative_decoding(sequence,
+                           draft_token_ids,
+                           /*bonus_token_id=*/4343,
+                           /*resample_token_id=*/1314,
+                           /*num_accepted_tokens=*/0);
+  EXPECT_NEAR(sequence.acceptance_rate(), 0.8, 1e-6);
+  // 0.8, 0.64, 0.512, 0.41
+  EXPECT_EQ(sequence.num_speculative_tokens(4, 0.3), 4);
+
+  run_speculative_decoding(sequence,
+                           draft_token_ids,
+                           /*bonus_token_id=*/4343,
+                           /*resample_token_id=*/1314,
+                           /*num_accepted_tokens=*/0);
+  EXPECT_NEAR(sequence.acceptance_rate(), 0.64, 1e-6);
+  // 0.64, 0.41, 0.26
+  EXPECT_EQ(sequence.num_speculative_tokens(4, 0.3), 2);
+  EXPECT_EQ(sequence.num_speculative_tokens(1, 0.3), 1);
+  EXPECT_EQ(sequence.num_speculative_tokens(4, 0.7), 0);
+
+  // all draft tokens are accepted
+  run_speculative_decoding(sequence,
+                           draft_token_ids,
+                           /*bonus_token_id=*/4343,
+                           /*resample_token_id=*/1314,
+                           /*num_accepted_tokens=*/4);
+  EXPECT_NEAR(sequence.acceptance_rate(), 0.712, 1e-6);
+}
+
+TEST(SequenceTest, OutputWithoutDetokenize) {
+  std::vector<int32_t> prompt_tokens = {1, 2, 4};
+  Sequence::Options options;
+  options.detokenize = false;
+  options.logprobs = true;
+  options.sampling_param.logprobs = true;
+  options.stopping_criteria.max_tokens = 3;
+  Sequence sequence(prompt_tokens,
+                    /*capacity=*/10,
+                    options);
+  sequence.append_block({/*id=*/0, /*size=*/10});
+  NoDecodeTokenizer tokenizer;
+
+  sequence.commit_kv_cache(sequence.num_tokens_to_process());
+  Token token(5);
+  token.logprob = -0.5;
+  sequence.append_token(token);
+  EXPECT_TRUE(sequence.has_pending_tokens());
+  auto output =
+      sequence.build_delta_output_until(sequence.num_tokens(), tokenizer);
+  ASSERT_TRUE(output.has_value());
+  EXPECT_TRUE(output->text.empty());
+  EXPECT_EQ(output->token_ids, std::vector<int32_t>({5}));
+  EXPECT_EQ(output->token_logprobs, std::vector<float>({-0.5}));
+  EXPECT_FALSE(output->logprobs.has_value());
+  EXPECT_FALSE(output->finish_reason.has_value());
+  EXPECT_FALSE(sequence.has_pending_tokens());
+
+  // no new tokens
+  EXPECT_FALSE(
+      sequence.build_delta_output_until(sequence.num_tokens(), tokenizer)
+          .has_value());
+
+  // tokens without logprobs
+  sequence.commit_kv_cache(sequence.num_tokens_to_process());
+  sequence.append_token(6);
+  sequence.commit_kv_cache(sequence.num_tokens_to_process());
+  sequence.append_token(7);
+  EXPECT_TRUE(sequence.is_finished());
+  output = sequence.build_delta_output_until(sequence.num_tokens(), tokenizer);
+  ASSERT_TRUE(output.has_value());
+  EXPECT_EQ(output->token_ids, std::vector<int32_t>({6, 7}));
+  ASSERT_EQ(output->token_logprobs.size(), 2);
+  EXPECT_TRUE(std::isnan(output->token_logprobs[0]));
+  EXPECT_EQ(output->finish_reason, "length");
+
+  // the full output has all generated tokens
+  Sequence full(prompt_tokens, /*capacity=*/10, options);
+  full.append_block({/*id=*/0, /*size=*/10});
+  for (const int32_t token_id : {5, 6, 7}) {
+    full.commit_kv_cache(full.num_tokens_to_process());
+    full.append_token(token_id);
+  }
+  const auto full_output = full.build_output(tokenizer);
+  EXPECT_TRUE(full_output.text.empty());
+  EXPECT_EQ(full_output.token_ids, std::vector<int32_t>({5, 6, 7}));
+  EXPECT_EQ(full_output.token_logprobs.size(), 3);
+}
+
+TEST(SequenceTest, GrammarBitmask) {
+  // tokens: 0 "a", 1 "b", 2 "ab", 3 eos
+  auto vocab = std::make_shared<const TokenVocab>(
+      std::vector<std::string>{"a", "b", "ab", ""}, /*vocab_size=*/4);
+  std::string error;
+  auto dfa = RegexDFA::compile("ab?", &error);
+  ASSERT_NE(dfa, nullptr) << error;
+
+  Sequence::Options options;
+  options.stopping_criteria.max_tokens = 10;
+  options.stopping_criteria.eos_token_id = 3;
+  options.grammar = std::make_shared<const TokenGrammar>(std::move(dfa), vocab);
+  Sequence sequence({1, 2}, /*capacity=*/10, options);
+  sequence.append_block({/*id=*/0, /*size=*/10});
+  ASSERT_NE(sequence.grammar(), nullptr);
+
+  int32_t mask = 0;
+  sequence.token_bitmask(&mask, /*n_words=*/1);
+  EXPECT_EQ(mask, 0b0101);
+
+  // eos is allowed once the text matches
+  sequence.commit_kv_cache(sequence.num_tokens_to_process());
+  sequence.append_token(0);
+  sequence.token_bitmask(&mask, /*n_words=*/1);
+  EXPECT_EQ(mask, 0b1010);
+
+  sequence.commit_kv_cache(sequence.num_tokens_to_process());
+  sequence.append_token(1);
+  sequence.token_bitmask(&mask, /*n_words=*/1);
+  EXPECT_EQ(mask, 0b1000);
+
+  // only eos is allowed after a disallowed token
+  Sequence other({1, 2}, /*capacity=*/10, options);
+  other.append_block({/*id=*/0, /*size=*/10});
+  other.commit_kv_cache(other.num_tokens_to_process());
+  other.append_token(1);
+  other.token_bitmask(&mask, /*n_words=*/1);
+  EXPECT_EQ(mask, 0b1000);
+}
+
+TEST(SequenceTest, BeamTokens) {
+  Sequence::Options options;
+  options.stopping_criteria.max_tokens = 10;
+  options.stopping_criteria.eos_token_id = 3;
+  options.sampling_param.logprobs = true;
+  options.sampling_param.top_logprobs = 2;
+  options.beam_width = 1;
+  Sequence beam({1, 2}, /*capacity=*/10, options);
+  beam.append_block({/*id=*/0, /*size=*/10});
+  EXPECT_EQ(beam.beam_width(), 1);
+
+  const std::vector<int64_t> top_tokens = {5, 3};
+  const std::vector<float> top_logprobs = {-0.5, -1.0};
+  Token token(5);
+  token.logprob = -0.5;
+  token.top_tokens = top_tokens;
+  token.top_logprobs = top_logprobs;
+  beam.commit_kv_cache(beam.num_tokens_to_process());
+  beam.append_token(token);
+
+  const Token last = beam.last_token();
+  EXPECT_EQ(last.id, 5);
+  EXPECT_EQ(last.logprob, -0.5);
+  EXPECT_EQ(std::vector<int64_t>(last.top_tokens), top_tokens);
+  EXPECT_EQ(std::vector<float>(last.top_logprobs), top_logprobs);
+  EXPECT_DOUBLE_EQ(beam.cumulative_logprob(), -0.5);
+  EXPECT_FALSE(beam.is_finished());
+
+  // the other beam continues with the eos token, keeping the top tokens
+  Sequence other({1, 2}, /*capacity=*/10, options);
+  other.append_block({/*id=*/1, /*size=*/10});
+  other.commit_kv_cache(/*size=*/2);
+  const int64_t id = other.id();
+  other.assign_beam(beam, /*token_id=*/3, /*logprob=*/-1.0);
+  EXPECT_NE(other.id(), id);
+  EXPECT_NE(other.id(), beam.id());
+  EXPECT_EQ(other.token_ids(), std::vector<int32_t>({1, 2, 3}));
+  EXPECT_EQ(other.token_to_count_map().at(3), 1);
+  EXPECT_EQ(other.token_to_count_map().at(5), 0);
+  EXPECT_EQ(std::vector<int64_t>(other.last_token().top_tokens), top_tokens);
+  EXPECT_DOUBLE_EQ(other.cumulative_logprob(), -1.0);
+  EXPECT_TRUE(other.is_finished());
+  EXPECT_EQ(other.finish_reason(), FinishReason::STOP);
+  // the beam itself is untouched
+  EXPECT_EQ(beam.token_ids(), std::vector<int32_t>({1, 2, 5}));
+
+  // a finished token is replaced by an unfinished one
+  other.replace_last_token(/*token_id=*/4, /*logprob=*/-2.0);
+  EXPECT_FALSE(other.is_finished());
+  EXPECT_FLOAT_EQ(other.logprob(), -2.0);
+
+  other.finish(FinishReason::STOP);
+  EXPECT_TRUE(other.is_finished());
+  EXPECT_EQ(other.finish_reason(), FinishReason::STOP);
+}
+
+TEST(SequenceTest, StopSequences) {
+  Sequence::Options options;
+  options.stopping_criteria.max_tokens = 10;
+  options.stopping_criteria.ignore_eos = true;
+  options.stopping_criteria.stop_sequences = {{2, 5, 6}, {7}};
+  options.stopping_criteria.build_stop_sequence_matcher();
+  Sequence sequence({1, 2}, /*capacity=*/20, options);
+  sequence.append_block({/*id=*/0, /*size=*/20});
+  sequence.commit_kv_cache(sequence.num_tokens_to_process());
+
+  // the stop sequence may start in the prompt
+  sequence.append_token(5);
+  EXPECT_FALSE(sequence.is_finished());
+  sequence.append_token(6);
+  EXPECT_TRUE(sequence.is_finished());
+  EXPECT_EQ(sequence.finish_reason(), FinishReason::STOP);
+
+  // the matcher is rewound with the replaced token
+  sequence.replace_last_token(/*token_id=*/3, /*logprob=*/0.0);
+  EXPECT_FALSE(sequence.is_finished());
+  sequence.append_token(7);
+  EXPECT_TRUE(sequence.is_finished());
+  sequence.replace_last_token(/*token_id=*/4, /*logprob=*/0.0);
+  EXPECT_FALSE(sequence.is_finished());
+}
+
+TEST(SequenceTest, FinishedCounter) {
+  Sequence::Options options;
+  options.stopping_criteria.max_tokens = 10;
+  options.stopping_criteria.eos_token_id = 30;
+  Sequence sequence({1, 2}, /*capacity=*/20, options);
+  sequence.append_block({/*id=*/0, /*size=*/20});
+  sequence.commit_kv_cache(sequence.num_tokens_to_process());
+
+  size_t num_finished = 0;
+  sequence.set_finished_counter(&num_finished);
+  sequence.append_token(30);
+  EXPECT_TRUE(sequence.is_finished());
+  EXPECT_EQ(num_finished, 1);
+  sequence.replace_last_token(/*token_id=*/3, /*logprob=*/0.0);
+  EXPECT_EQ(num_finished, 0);
+
+  // copies are not counted
+  Sequence copy = sequence;
+  copy.append_token(30);
+  EXPECT_EQ(num_finished, 0);
+
+  // draft tokens may follow a draft eos, which is rejected
+  sequence.append_token(30);
+  sequence.append_token(4);
+  sequence.append_token(5);
+  EXPECT_EQ(num_finished, 1);
+  EXPECT_EQ(sequence.validate_tokens(std::vector<int64_t>{6, -1, -1}), 1);
+  EXPECT_FALSE(sequence.is_finished());
+  EXPECT_EQ(num_finished, 0);
+
+  sequence.finish(FinishReason::STOP);
+  EXPECT_EQ(num_finished, 1);
+  sequence.set_finished_counter(nullptr);
+  EXPECT_EQ(num_finished, 0);
+}
+
+TEST(SequenceTest, TopLogprobs) {
+  Sequence::Options options;
+  options.sampling_param.logprobs = true;
+  options.sampling_param.top_logprobs = 2;
+  Sequence sequence({1, 2}, /*capacity=*/100, options);
+  sequence.append_block({/*id=*/0, /*size=*/100});
+  sequence.commit_kv_cache(sequence.num_tokens_to_process());
+
+  // only the first k top tokens are kept
+  for (int64_t i = 0; i < 50; ++i) {
+    const std::vector<int64_t> top_tokens = {i, i + 1, i + 2};
+    const std::vector<float> top_logprobs = {-1.0f * i, -2.0f * i, -3.0f * i};
+    Token token(i);
+    token.logprob = -1.0f * i;
+    token.top_tokens = top_tokens;
+    token.top_logprobs = top_logprobs;
+    sequence.append_token(token);
+
+    const Token last = sequence.last_token();
+    EXPECT_EQ(last.logprob, -1.0f * i);
+    EXPECT_EQ(std::vector<int64_t>(last.top_tokens),
+              std::vector<int64_t>({i, i + 1}));
+    EXPECT_EQ(std::vector<float>(last.top_logprobs),
+              std::vector<float>({-1.0f * i, -2.0f * i}));
+  }
+
+  // tokens without logprobs
+  sequence.append_token(Token(7));
+  const Token last = sequence.last_token();
+  EXPECT_FALSE(last.logprob.has_value());
+  EXPECT_TRUE(last.top_tokens.empty());
+  EXPECT_DOUBLE_EQ(sequence.cumulative_logprob(), -1225.0);
+}
+
+TEST(SequenceTest, PromptLogprobs) {
+  const std::vector<int32_t> prompt_tokens = {1, 2, 4, 3};
+  Sequence::Options options;
+  options.echo = true;
+  options.detokenize = false;
+  options.logprobs = true;
+  options.prompt_logprobs = true;
+  Sequence sequence(prompt_tokens, /*capacity=*/10, options);
+  EXPECT_TRUE(sequence.needs_prompt_logprobs());
+
+  // the prompt is scored chunk by chunk
+  sequence.set_prompt_logprobs(/*start=*/1, std::vector<float>{-1.0, -2.0});
+  EXPECT_TRUE(sequence.needs_prompt_logprobs());
+  sequence.set_prompt_logprobs(/*start=*/3, std::vector<float>{-3.0});
+  EXPECT_FALSE(sequence.needs_prompt_logprobs());
+
+  // the other sequences of the request reuse the scores
+  Sequence other(prompt_tokens, /*capacity=*/10, options);
+  EXPECT_TRUE(other.needs_prompt_logprobs());
+  other.copy_prompt_logprobs(sequence);
+  EXPECT_FALSE(other.needs_prompt_logprobs());
+
+  NoDecodeTokenizer tokenizer;
+  const auto output = other.build_output(tokenizer);
+  EXPECT_EQ(output.token_ids, prompt_tokens);
+  ASSERT_EQ(output.token_logprobs.size(), 4);
+  EXPECT_TRUE(std::isnan(output.token_logprobs[0]));
+  EXPECT_EQ(output.token_logprobs[1], -1.0);
+  EXPECT_EQ(output.token_logprobs[2], -2.0);
+  EXPECT_EQ(output.token_logprobs[3], -3.0);
+  // the generated tokens don't count the scored prompt
+  EXPECT_DOUBLE_EQ(other.cumulative_logprob(), 0.0);
+
+  // a single prompt token has nothing to score
+  Sequence single({1}, /*capacity=*/10, options);
+  EXPECT_FALSE(single.needs_prompt_logprobs());
+}
+
+TEST(SequenceTest, PooledEmbedding) {
+  const std::vector<int32_t> prompt_tokens = {1, 2, 4, 3};
+  Sequence::Options options;
+  options.pooling = PoolingType::MEAN;
+  Sequence sequence(prompt_tokens, /*capacity=*/10, options);
+  EXPECT_TRUE(sequence.is_embedding());
+  EXPECT_TRUE(sequence.needs_full_prefill());
+
+  // the hidden states are summed chunk by chunk
+  sequence.add_pooled_hidden_states(0, 3, std::vector<float>{1.0, 2.0});
+  EXPECT_FALSE(sequence.is_finished());
+  sequence.add_pooled_hidden_states(3, 4, std::vector<float>{2.0, 2.0});
+  EXPECT_TRUE(sequence.is_finished());
+  EXPECT_EQ(sequence.finish_reason(), FinishReason::STOP);
+  // normalized sum of [3, 4]
+  ASSERT_EQ(sequence.embedding().size(), 2);
+  EXPECT_FLOAT_EQ(sequence.embedding()[0], 0.6);
+  EXPECT_FLOAT_EQ(sequence.embedding()[1], 0.8);
+
+  NoDecodeTokenizer tokenizer;
+  const auto output = sequence.build_output(tokenizer);
+  EXPECT_TRUE(output.token_ids.empty());
+  EXPECT_EQ(output.embedding, sequence.embedding());
+
+  // only the last token is pooled, sharing the cached prefix
+  options.pooling = PoolingType::LAST;
+  Sequence last(prompt_tokens, /*capacity=*/10, options);
+  EXPECT_FALSE(last.needs_full_prefill());
+  last.add_pooled_hidden_states(3, 4, std::vector<float>{0.0, -2.0});
+  EXPECT_TRUE(last.is_finished());
+  EXPECT_FLOAT_EQ(last.embedding()[0], 0.0);
+  EXPECT_FLOAT_EQ(last.embedding()[1], -1.0);
+}
+
+TEST(SequenceTest, BatchedDeltaDecode) {
+  const std::vector<int32_t> prompt_tokens = {0, 1, 2};
+  Sequence::Options options;
+  options.stopping_criteria.max_tokens = 10;
+  std::vector<Sequence> sequences;
+  for (size_t i = 0; i < 2; ++i) {
+    sequences.emplace_back(prompt_tokens, /*capacity=*/20, options);
+    sequences.back().append_block(
+        {/*id=*/static_cast<int32_t>(i), /*size=*/20});
+  }
+  LetterTokenizer tokenizer;
+
+  // the first output finds that the tokenizer decodes by windows
+  for (auto& seq : sequences) {
+    EXPECT_TRUE(seq.delta_windows_until(seq.num_tokens()).empty());
+    seq.commit_kv_cache(seq.num_tokens_to_process());
+    seq.append_token(3);
+    const auto output = seq.build_delta_output_until(seq.num_tokens(),
+                                                     tokenizer);
+    ASSERT_TRUE(output.has_value());
+    EXPECT_EQ(output->text, "d");
+  }
+  // the prefix and the window are decoded in one call
+  EXPECT_EQ(tokenizer.num_decode_batch_calls, 2);
+
+  // decode the windows of both sequences together
+  sequences[0].commit_kv_cache(sequences[0].num_tokens_to_process());
+  sequences[0].append_token(4);
+  sequences[1].commit_kv_cache(sequences[1].num_tokens_to_process());
+  sequences[1].append_token(5);
+  std::vector<Slice<int32_t>> windows;
+  for (const auto& seq : sequences) {
+    const auto seq_windows = seq.delta_windows_until(seq.num_tokens());
+    ASSERT_EQ(seq_windows.size(), 2);
+    windows.insert(windows.end(), seq_windows.begin(), seq_windows.end());
+  }
+  const auto texts = tokenizer.decode_batch(windows, true);
+  EXPECT_EQ(tokenizer.num_decode_batch_calls, 3);
+
+  const char* expected[] = {"e", "f"};
+  for (size_t i = 0; i < sequences.size(); ++i) {
+    auto& seq = sequences[i];
+    const std::vector<std::string> window_texts(
+        texts.begin() + 2 * i, texts.begin() + 2 * i + 2);
+    const auto output =
+        seq.build_delta_output_until(seq.num_tokens(), tokenizer, window_texts);
+    ASSERT_TRUE(output.has_value());
+    EXPECT_EQ(output->text, expected[i]);
+    EXPECT_EQ(output->token_ids.size(), 1);
+  }
+  // no more decode calls with the decoded windows
+  EXPECT_EQ(tokenizer.num_decode_batch_calls, 3);
+}
+
 }  // namespace llm
@@ -0,0 +1,68 @@
+#include "stop_sequence_matcher.h"
+
+#include <glog/logging.h>
+
+#include <cstdint>
+#include <queue>
+#include <vector>
+
+namespace llm {
+
+StopSequenceMatcher::StopSequenceMatcher(
+    const std::vector<std::vector<int32_t>>& stop_sequences) {
+  nodes_.emplace_back();
+  // build the trie of the stop sequences
+  for (const auto& stop_sequence : stop_sequences) {
+    if (stop_sequence.empty()) {
+      continue;
+    }
+    int32_t state = kStartState;
+    for (const int32_t token_id : stop_sequence) {
+      const auto it = nodes_[state].children.find(token_id);
+      if (it != nodes_[state].children.end()) {
+        state = it->second;
+        continue;
+      }
+      const auto next = static_cast<int32_t>(nodes_.size());
+      nodes_[state].children.emplace(token_id, next);
+      nodes_.emplace_back();
+      state = next;
+    }
+    nodes_[state].is_match = true;
+  }
+
+  // set the failure links in breadth-first order, so that the links of the
+  // shorter prefixes are set first
+  std::queue<int32_t> queue;
+  for (const auto& [token_id, child] : nodes_[kStartState].children) {
+    queue.push(child);
+  }
+  while (!queue.empty()) {
+    const int32_t state = queue.front();
+    queue.pop();
+    for (const auto& [token_id, child] : nodes_[state].children) {
+      const int32_t fail = next_state(nodes_[state].fail, token_id);
+      nodes_[child].fail = fail;
+      nodes_[child].is_match |= nodes_[fail].is_match;
+      queue.push(child);
+    }
+  }
+}
+
+int32_t StopSequenceMatcher::next_state(int32_t state,
+                                        int32_t token_id) const {
+  DCHECK(state >= 0 && state < static_cast<int32_t>(nodes_.size()));
+  while (true) {
+    const auto& children = nodes_[state].children;
+    const auto it = children.find(token_id);
+    if (it != children.end()) {
+      return it->second;
+    }
+    if (state == kStartState) {
+      return kStartState;
+    }
+    state = nodes_[state].fail;
+  }
+}
+
+}  // namespace llm
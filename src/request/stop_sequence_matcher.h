@@ -0,0 +1,48 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace llm {
+
+// Aho-Corasick automaton matching all stop sequences of a request at once.
+// It is built once per request and shared by its sequences, each of which
+// keeps the state after its last token. Advancing the state by one token
+// takes amortized O(1), regardless of the number and length of the stop
+// sequences.
+class StopSequenceMatcher final {
+ public:
+  // the state before any token
+  static constexpr int32_t kStartState = 0;
+
+  // empty stop sequences are ignored
+  explicit StopSequenceMatcher(
+      const std::vector<std::vector<int32_t>>& stop_sequences);
+
+  // the state after appending the token to the tokens matched by the state
+  int32_t next_state(int32_t state, int32_t token_id) const;
+
+  // whether the tokens matched by the state end with a stop sequence
+  bool is_match(int32_t state) const { return nodes_[state].is_match; }
+
+  // number of states, including the start state
+  size_t num_states() const { return nodes_.size(); }
+
+ private:
+  struct Node {
+    // transitions of the trie
+    absl::flat_hash_map<int32_t, int32_t> children;
+
+    // the state of the longest proper suffix that is a prefix in the trie
+    int32_t fail = kStartState;
+
+    // whether a stop sequence ends at the state or any of its suffixes
+    bool is_match = false;
+  };
+
+  std::vector<Node> nodes_;
+};
+
+}  // namespace llm
@@ -0,0 +1,84 @@
+#include "stop_sequence_matcher.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace llm {
+namespace {
+// whether the tokens end with any of the stop sequences
+bool ends_with_any(const std::vector<int32_t>& tokens,
+                   const std::vector<std::vector<int32_t>>& stop_sequences) {
+  for (const auto& stop_sequence : stop_sequences) {
+    if (!stop_sequence.empty() && tokens.size() >= stop_sequence.size() &&
+        std::equal(stop_sequence.rbegin(),
+                   stop_sequence.rend(),
+                   tokens.rbegin())) {
+      return true;
+    }
+  }
+  return false;
+}
+}  // namespace
+
+TEST(StopSequenceMatcherTest, Basic) {
+  StopSequenceMatcher matcher({{1, 2, 3}, {2, 4}, {}});
+  // the start state and one state per trie node
+  EXPECT_EQ(matcher.num_states(), 6);
+
+  int32_t state = StopSequenceMatcher::kStartState;
+  for (const int32_t token_id : {1, 2}) {
+    state = matcher.next_state(state, token_id);
+    EXPECT_FALSE(matcher.is_match(state));
+  }
+  // 1, 2 falls back to 2 on mismatch
+  EXPECT_TRUE(matcher.is_match(matcher.next_state(state, 4)));
+  EXPECT_TRUE(matcher.is_match(matcher.next_state(state, 3)));
+  EXPECT_FALSE(matcher.is_match(matcher.next_state(state, 5)));
+  EXPECT_EQ(matcher.next_state(state, 5), StopSequenceMatcher::kStartState);
+}
+
+TEST(StopSequenceMatcherTest, Suffix) {
+  // a stop sequence is a suffix of a partial match of another one
+  StopSequenceMatcher matcher({{1, 1, 1, 2}, {1, 1}});
+  int32_t state = StopSequenceMatcher::kStartState;
+  state = matcher.next_state(state, 1);
+  EXPECT_FALSE(matcher.is_match(state));
+  state = matcher.next_state(state, 1);
+  EXPECT_TRUE(matcher.is_match(state));
+  state = matcher.next_state(state, 1);
+  EXPECT_TRUE(matcher.is_match(state));
+  state = matcher.next_state(state, 1);
+  EXPECT_TRUE(matcher.is_match(state));
+  state = matcher.next_state(state, 2);
+  EXPECT_TRUE(matcher.is_match(state));
+}
+
+TEST(StopSequenceMatcherTest, Random) {
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<int32_t> token_dist(0, 3);
+  std::uniform_int_distribution<size_t> len_dist(1, 6);
+  for (int round = 0; round < 10; ++round) {
+    std::vector<std::vector<int32_t>> stop_sequences(8);
+    for (auto& stop_sequence : stop_sequences) {
+      stop_sequence.resize(len_dist(gen));
+      for (auto& token_id : stop_sequence) {
+        token_id = token_dist(gen);
+      }
+    }
+    StopSequenceMatcher matcher(stop_sequences);
+
+    std::vector<int32_t> tokens;
+    int32_t state = StopSequenceMatcher::kStartState;
+    for (int i = 0; i < 1000; ++i) {
+      tokens.push_back(token_dist(gen));
+      state = matcher.next_state(state, tokens.back());
+      ASSERT_EQ(matcher.is_match(state), ends_with_any(tokens, stop_sequences));
+    }
+  }
+}
+
+}  // namespace llm
@@ -4,6 +4,7 @@
 #include <gflags/gflags_declare.h>
 
 #include <cstdint>
+#include <memory>
 #include <unordered_set>
 #include <vector>
 
@@ -26,20 +27,18 @@ FinishReason StoppingCriteria::check_finished(const Slice<int32_t>& token_ids,
   CHECK(!token_ids.empty());
 
   const auto last_token_id = token_ids.back();
-  // check against eos token id
-  if (!ignore_eos && last_token_id == eos_token_id) {
-    return FinishReason::STOP;
-  }
-  // check against stop tokens ids
-  if (stop_token_ids.count(last_token_id) > 0) {
+  // check against eos token id and stop tokens ids
+  if (is_end_token(last_token_id)) {
     return FinishReason::STOP;
   }
 
   // check against stop sequences after adding the token
-  for (const auto& stop_sequence : stop_sequences) {
-    if (stop_sequence.back() == last_token_id &&
-        sequence_end_withs(token_ids, stop_sequence)) {
-      return FinishReason::STOP;
+  if (stop_sequence_matcher == nullptr) {
+    for (const auto& stop_sequence : stop_sequences) {
+      if (stop_sequence.back() == last_token_id &&
+          sequence_end_withs(token_ids, stop_sequence)) {
+        return FinishReason::STOP;
+      }
     }
   }
 
@@ -57,4 +56,18 @@ FinishReason StoppingCriteria::check_finished(const Slice<int32_t>& token_ids,
   return FinishReason::NONE;
 }
 
+void StoppingCriteria::build_stop_sequence_matcher() {
+  stop_sequence_matcher =
+      stop_sequences.empty()
+          ? nullptr
+          : std::make_shared<const StopSequenceMatcher>(stop_sequences);
+}
+
+bool StoppingCriteria::is_end_token(int32_t token_id) const {
+  if (!ignore_eos && token_id == eos_token_id) {
+    return true;
+  }
+  return stop_token_ids.count(token_id) > 0;
+}
+
 }  // namespace llm
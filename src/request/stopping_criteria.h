@@ -1,11 +1,13 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
 #include <unordered_set>
 #include <vector>
 
 #include "common/slice.h"
 #include "output.h"
+#include "stop_sequence_matcher.h"
 
 namespace llm {
 
@@ -13,9 +15,17 @@ namespace llm {
 // request/sequence.
 struct StoppingCriteria {
  public:
+  // the stop sequences are left to the caller once the matcher is built,
+  // which keeps the state of the matcher for the tokens.
   FinishReason check_finished(const Slice<int32_t>& token_ids,
                               size_t num_prompt_tokens) const;
 
+  // build the matcher for the stop sequences, shared by the copies
+  void build_stop_sequence_matcher();
+
+  // whether the token ends the generated text, e.g. the eos token
+  bool is_end_token(int32_t token_id) const;
+
   // private:
 
   // maximum number of generated tokens
@@ -33,6 +43,9 @@ struct StoppingCriteria {
   // stop sequences
   std::vector<std::vector<int32_t>> stop_sequences;
 
+  // matcher for all stop sequences, null if not built
+  std::shared_ptr<const StopSequenceMatcher> stop_sequence_matcher;
+
   // max context length
   size_t max_context_len = 0;
 };
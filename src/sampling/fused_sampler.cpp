@@ -0,0 +1,73 @@
+#include "fused_sampler.h"
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include "kernels/sampling/sampling_kernels.h"
+
+namespace llm {
+
+FusedSampler::FusedSampler(const SamplingParameters& params)
+    : params_(params) {
+  CHECK(is_supported(params_));
+}
+
+bool FusedSampler::is_supported(const SamplingParameters& params) {
+  if (!params.sample_idxes.defined() || !params.sample_idxes.is_cuda()) {
+    return false;
+  }
+  // logprobs need the full probability distribution
+  if (params.logprobs) {
+    return false;
+  }
+  // the grammar masks are applied by the logits processors
+  if (params.token_bitmask.defined()) {
+    return false;
+  }
+  // so is the sparse logit bias
+  if (params.logit_bias_token_ids.defined()) {
+    return false;
+  }
+  // penalties are applied in place, one sample per row to avoid racing
+  return params.sample_idxes.size(/*dim=*/0) ==
+         params.selected_token_idxes.size(/*dim=*/0);
+}
+
+void FusedSampler::advance_rng_offsets() {
+  auto& offsets = params_.rng_offsets;
+  if (offsets.defined()) {
+    offsets = offsets + offsets.ge(0).to(torch::kLong);
+  }
+}
+
+SampleOutput FusedSampler::forward(
+    torch::Tensor& logits,
+    const torch::Tensor& unique_token_ids,
+    const torch::Tensor& unique_token_counts,
+    const torch::Tensor& unique_token_ids_lens) const {
+  CHECK_EQ(logits.size(0), params_.selected_token_idxes.size(0));
+
+  const int64_t num_seqs = params_.sample_idxes.size(/*dim=*/0);
+  auto next_tokens = torch::empty(
+      {num_seqs}, torch::dtype(torch::kLong).device(logits.device()));
+  kernel::invoke_fused_sampling(next_tokens,
+                                logits,
+                                params_.sample_idxes,
+                                unique_token_ids,
+                                unique_token_counts,
+                                unique_token_ids_lens,
+                                params_.frequency_penalties,
+                                params_.presence_penalties,
+                                params_.repetition_penalties,
+                                params_.temperatures,
+                                params_.top_k,
+                                params_.top_p,
+                                params_.do_sample,
+                                params_.rng_seeds,
+                                params_.rng_offsets);
+  SampleOutput output;
+  output.next_tokens = next_tokens;
+  return output;
+}
+
+}  // namespace llm
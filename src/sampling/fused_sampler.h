@@ -0,0 +1,35 @@
+#pragma once
+#include <torch/torch.h>
+
+#include "parameters.h"
+
+namespace llm {
+
+// sample next tokens with a single fused kernel that applies penalties,
+// temperature, top_k and top_p filtering on the fly without sorting.
+// only next tokens are returned, probs and logprobs are not materialized.
+class FusedSampler final {
+ public:
+  explicit FusedSampler(const SamplingParameters& params);
+
+  // whether the sampling parameters can be handled by the fused kernel
+  static bool is_supported(const SamplingParameters& params);
+
+  // logits: [num_tokens, vocab_size], penalties are applied in place
+  // unique_token_ids: [num_tokens, max_unique_tokens]
+  // unique_token_counts: [num_tokens, max_unique_tokens]
+  // unique_token_ids_lens: [num_tokens]
+  SampleOutput forward(torch::Tensor& logits,
+                       const torch::Tensor& unique_token_ids,
+                       const torch::Tensor& unique_token_counts,
+                       const torch::Tensor& unique_token_ids_lens) const;
+
+  // move the seeded rows to the next position, for multi-step decoding
+  void advance_rng_offsets();
+
+ private:
+  // sampling parameters on device
+  SamplingParameters params_;
+};
+
+}  // namespace llm
@@ -0,0 +1,172 @@
+#include "fused_sampler.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include "logits_processor.h"
+#include "parameters.h"
+
+namespace llm {
+
+TEST(FusedSamplerTest, GreedyWithPenalties) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  torch::Device device(torch::kCUDA);
+  const auto options = torch::dtype(torch::kFloat32).device(device);
+  const auto int_options = torch::dtype(torch::kInt).device(device);
+  const int64_t batch_size = 4;
+  const int64_t vocab_size = 32000;
+
+  SamplingParameters params;
+  params.selected_token_idxes = torch::arange(batch_size, int_options);
+  params.sample_idxes = torch::tensor({2, 0, 3, 1}, int_options);
+  params.do_sample = torch::zeros({batch_size}, device).to(torch::kBool);
+  params.frequency_penalties = torch::full({batch_size}, 0.5, options);
+  params.presence_penalties = torch::full({batch_size}, 0.5, options);
+  params.repetition_penalties = torch::full({batch_size}, 1.5, options);
+  const auto logits = torch::randn({batch_size, vocab_size}, options);
+  // penalize the most likely tokens
+  params.unique_token_ids = std::get<1>(logits.topk(/*k=*/8, /*dim=*/-1));
+  params.unique_token_counts = torch::randint(
+      /*low=*/1, /*high=*/4, {batch_size, 8}, int_options);
+  params.unique_token_ids_lens = torch::full({batch_size}, 8, int_options);
+  ASSERT_TRUE(FusedSampler::is_supported(params));
+
+  auto processed = logits.clone();
+  auto processor = LogitsProcessor::create(params);
+  processed = processor->forward(processed,
+                                 params.unique_token_ids,
+                                 params.unique_token_counts,
+                                 params.unique_token_ids_lens);
+  const auto desired =
+      processed.index_select(/*dim=*/0, params.sample_idxes).argmax(-1);
+
+  auto fused_logits = logits.clone();
+  FusedSampler sampler(params);
+  auto output = sampler.forward(fused_logits,
+                                params.unique_token_ids,
+                                params.unique_token_counts,
+                                params.unique_token_ids_lens);
+  EXPECT_TRUE(torch::allclose(fused_logits, processed));
+  EXPECT_TRUE(torch::equal(output.next_tokens, desired));
+}
+
+TEST(FusedSamplerTest, TopK) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  torch::Device device(torch::kCUDA);
+  const auto options = torch::dtype(torch::kFloat32).device(device);
+  const auto int_options = torch::dtype(torch::kInt).device(device);
+  const int64_t batch_size = 1024;
+  const int64_t vocab_size = 100;
+  const int64_t top_k = 5;
+
+  SamplingParameters params;
+  params.selected_token_idxes = torch::arange(batch_size, int_options);
+  params.sample_idxes = torch::arange(batch_size, int_options);
+  params.do_sample = torch::ones({batch_size}, device).to(torch::kBool);
+  params.top_k =
+      torch::full({batch_size}, top_k, int_options.dtype(torch::kLong));
+  ASSERT_TRUE(FusedSampler::is_supported(params));
+
+  const auto row = torch::randn({vocab_size}, options);
+  auto logits = row.unsqueeze(/*dim=*/0).repeat({batch_size, 1});
+  FusedSampler sampler(params);
+  auto output = sampler.forward(logits,
+                                params.unique_token_ids,
+                                params.unique_token_counts,
+                                params.unique_token_ids_lens);
+
+  const auto top_k_ids = std::get<1>(row.topk(top_k));
+  // all samples are in the top k
+  const auto in_top_k =
+      (output.next_tokens.unsqueeze(/*dim=*/1) == top_k_ids).any(/*dim=*/1);
+  EXPECT_TRUE(in_top_k.all().item<bool>());
+  // and more than one token is sampled
+  EXPECT_GT(output.next_tokens.bincount().gt(0).sum().item<int64_t>(), 1);
+}
+
+TEST(FusedSamplerTest, TopP) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  torch::Device device(torch::kCUDA);
+  const auto options = torch::dtype(torch::kFloat32).device(device);
+  const auto int_options = torch::dtype(torch::kInt).device(device);
+  const int64_t batch_size = 1024;
+  const int64_t vocab_size = 100;
+  const float top_p = 0.5;
+
+  SamplingParameters params;
+  params.selected_token_idxes = torch::arange(batch_size, int_options);
+  params.sample_idxes = torch::arange(batch_size, int_options);
+  params.do_sample = torch::ones({batch_size}, device).to(torch::kBool);
+  params.top_p = torch::full({batch_size}, top_p, options);
+  ASSERT_TRUE(FusedSampler::is_supported(params));
+
+  const auto row = torch::randn({vocab_size}, options) * 2;
+  auto logits = row.unsqueeze(/*dim=*/0).repeat({batch_size, 1});
+  FusedSampler sampler(params);
+  auto output = sampler.forward(logits,
+                                params.unique_token_ids,
+                                params.unique_token_counts,
+                                params.unique_token_ids_lens);
+
+  // tokens kept by top_p: mass of more likely tokens is no more than top_p
+  auto [probs_sort, probs_idx] = row.softmax(/*dim=*/-1).sort(
+      /*dim=*/-1, /*descending=*/true);
+  const auto keep = (probs_sort.cumsum(/*dim=*/-1) - probs_sort) <= top_p;
+  const auto kept_ids = probs_idx.masked_select(keep);
+  const auto in_top_p =
+      (output.next_tokens.unsqueeze(/*dim=*/1) == kept_ids).any(/*dim=*/1);
+  EXPECT_TRUE(in_top_p.all().item<bool>());
+}
+
+TEST(FusedSamplerTest, Seeded) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  torch::Device device(torch::kCUDA);
+  const auto options = torch::dtype(torch::kFloat32).device(device);
+  const auto int_options = torch::dtype(torch::kInt).device(device);
+  const auto long_options = torch::dtype(torch::kLong).device(device);
+  const int64_t batch_size = 256;
+  const int64_t vocab_size = 1000;
+
+  SamplingParameters params;
+  params.selected_token_idxes = torch::arange(batch_size, int_options);
+  params.sample_idxes = torch::arange(batch_size, int_options);
+  params.do_sample = torch::ones({batch_size}, device).to(torch::kBool);
+  // the same seed and position for all rows but the last one, unseeded
+  params.rng_seeds = torch::full({batch_size}, 42, long_options);
+  params.rng_offsets = torch::full({batch_size}, 7, long_options);
+  params.rng_offsets[-1] = -1;
+  ASSERT_TRUE(FusedSampler::is_supported(params));
+
+  const auto logits = torch::zeros({batch_size, vocab_size}, options);
+  FusedSampler sampler(params);
+  const auto sample = [&]() {
+    auto step_logits = logits.clone();
+    return sampler
+        .forward(step_logits,
+                 params.unique_token_ids,
+                 params.unique_token_counts,
+                 params.unique_token_ids_lens)
+        .next_tokens;
+  };
+  const auto first = sample();
+  const auto seeded = first.slice(/*dim=*/0, 0, batch_size - 1);
+  // the seeded rows draw the same token regardless of the batch or the
+  // default generator
+  EXPECT_TRUE(torch::equal(seeded, seeded[0].expand_as(seeded)));
+  EXPECT_TRUE(torch::equal(first, sample()));
+
+  // and a different one at the next position
+  sampler.advance_rng_offsets();
+  const auto next = sample();
+  EXPECT_NE(next[0].item<int64_t>(), first[0].item<int64_t>());
+}
+
+}  // namespace llm
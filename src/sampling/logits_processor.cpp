@@ -6,11 +6,17 @@
 
 namespace llm {
 std::unique_ptr<LogitsProcessor> LogitsProcessor::create(
-    const SamplingParameters& params) {
+    const SamplingParameters& params,
+    bool filter_top_k_top_p) {
   std::vector<std::unique_ptr<LogitsProcessor>> processors;
 
   // construct logits processors based on the given parameters
   // always try to skip creating a processor if possible
+  if (params.token_bitmask.defined()) {
+    processors.push_back(
+        std::make_unique<TokenBitmaskLogitsProcessor>(params.token_bitmask));
+  }
+
   if (params.frequency_penalties.defined()) {
     processors.push_back(
         std::make_unique<FrequencyPresencePenaltyLogitsProcessor>(
@@ -22,12 +28,21 @@ std::unique_ptr<LogitsProcessor> LogitsProcessor::create(
         params.repetition_penalties));
   }
 
+  if (params.logit_bias_token_ids.defined()) {
+    processors.push_back(std::make_unique<LogitBiasLogitsProcessor>(
+        params.logit_bias_token_ids,
+        params.logit_bias_values,
+        params.logit_bias_lens,
+        params.logit_bias_exclusive));
+  }
+
   if (params.temperatures.defined()) {
     processors.push_back(
         std::make_unique<TemperatureLogitsProcessor>(params.temperatures));
   }
 
-  if (params.top_k.defined() || params.top_p.defined()) {
+  if (filter_top_k_top_p &&
+      (params.top_k.defined() || params.top_p.defined())) {
     processors.push_back(
         std::make_unique<TopKTopPLogitsProcessor>(params.top_k, params.top_p));
   }
@@ -1,6 +1,7 @@
 #pragma once
 #include <torch/torch.h>
 
+#include <limits>
 #include <memory>
 #include <vector>
 
@@ -35,6 +36,43 @@ inline void apply_repetition_penalty(torch::Tensor& logits,
   logits.scatter_(/*dim=*/1, /*index=*/unique_token_ids, /*src=*/score);
 }
 
+inline void apply_token_bitmask(torch::Tensor& logits,
+                                const torch::Tensor& bitmask) {
+  // logits: [num_seqs, vocab_size]
+  // bitmask: [num_seqs, n_words]
+  const int64_t vocab_size = logits.size(1);
+  // unpack the bits: [num_seqs, n_words * 32]
+  const auto shifts = torch::arange(32, bitmask.options());
+  auto allowed = torch::bitwise_right_shift(bitmask.unsqueeze(-1), shifts)
+                     .bitwise_and(1)
+                     .to(torch::kBool)
+                     .flatten(/*start_dim=*/1);
+  if (allowed.size(1) < vocab_size) {
+    // tokens beyond the bitmask are disallowed
+    auto padded = torch::zeros({logits.size(0), vocab_size}, allowed.options());
+    padded.narrow(/*dim=*/1, 0, allowed.size(1)).copy_(allowed);
+    allowed = padded;
+  }
+  allowed = allowed.narrow(/*dim=*/1, 0, vocab_size);
+  logits.masked_fill_(allowed.logical_not(),
+                      -std::numeric_limits<float>::infinity());
+}
+
+inline void apply_logit_bias(torch::Tensor& logits,
+                             const torch::Tensor& token_ids,
+                             const torch::Tensor& biases,
+                             const torch::Tensor& /*lens*/,
+                             const torch::Tensor& exclusive) {
+  // logits: [num_seqs, vocab_size]
+  // token_ids, biases: [num_seqs, max_len], padded entries repeat the last
+  // entry of the row, so the same value is scattered for duplicate ids.
+  auto score = logits.gather(/*dim=*/1, /*index=*/token_ids) + biases;
+  // mask out the tokens without a bias of exclusive sequences
+  logits.masked_fill_(exclusive.unsqueeze(1),
+                      -std::numeric_limits<float>::infinity());
+  logits.scatter_(/*dim=*/1, /*index=*/token_ids, /*src=*/score);
+}
+
 inline void apply_frequency_presence_penalty(
     torch::Tensor& logits,
     const torch::Tensor& unique_token_ids,
@@ -55,9 +93,11 @@ inline void apply_frequency_presence_penalty(
 }  // namespace detail
 
 // supported logits processors:
-// 1. frequency and presence penalty
-// 2. repetition penalty
-// 3. temperature
+// 1. grammar token bitmask
+// 2. frequency and presence penalty
+// 3. repetition penalty
+// 4. logit bias
+// 5. temperature
 
 // inspired by transformers LogistProcessor:
 // https://github.com/huggingface/transformers/blob/main/src/transformers/generation/logits_process.py#L44
@@ -86,8 +126,10 @@ class LogitsProcessor {
   }
 
   // factory method to create a logits processor
+  // filter_top_k_top_p: false if top_k and top_p are applied by the sampler
   static std::unique_ptr<LogitsProcessor> create(
-      const SamplingParameters& params);
+      const SamplingParameters& params,
+      bool filter_top_k_top_p = true);
 };
 
 class LogitsProcessorList : public LogitsProcessor {
@@ -111,6 +153,37 @@ class LogitsProcessorList : public LogitsProcessor {
   std::vector<std::unique_ptr<LogitsProcessor>> processors_;
 };
 
+// masks out the tokens disallowed by the grammar of constrained sequences,
+// e.g. to generate json following a schema. the masks are precomputed for
+// each grammar state, so only a copy of the rows is needed per step.
+class TokenBitmaskLogitsProcessor : public LogitsProcessor {
+ public:
+  TokenBitmaskLogitsProcessor(const torch::Tensor& bitmask)
+      : bitmask_(bitmask) {
+    CHECK(bitmask_.defined());
+  }
+
+  torch::Tensor forward(
+      const torch::Tensor& logits,
+      const torch::Tensor& /*unique_token_ids*/,
+      const torch::Tensor& /*unique_token_counts*/,
+      const torch::Tensor& /*unique_token_lens*/) const override {
+    CHECK_EQ(logits.size(0), bitmask_.size(0));
+
+    torch::Tensor logits_ = logits;
+    if (logits_.is_cuda()) {
+      kernel::apply_token_bitmask(logits_, bitmask_);
+    } else {
+      detail::apply_token_bitmask(logits_, bitmask_);
+    }
+    return logits_;
+  }
+
+ private:
+  // [n_tokens, n_words]
+  torch::Tensor bitmask_;
+};
+
 // https://platform.openai.com/docs/api-reference/parameter-details
 // The frequency and presence penalties can be used to reduce the likelihood of
 // sampling repetitive sequences of tokens. They work by directly modifying the
@@ -187,6 +260,50 @@ class RepetitionPenaltyLogitsProcessor : public LogitsProcessor {
   torch::Tensor penalties_;
 };
 
+// adds a sparse bias to the logits of the tokens of each sequence, e.g. the
+// logit_bias of the openai api, and optionally masks out the tokens without a
+// bias. the bias tables are batched like the unique tokens of the penalties,
+// so no dense [num_seqs, vocab_size] mask is needed.
+class LogitBiasLogitsProcessor : public LogitsProcessor {
+ public:
+  LogitBiasLogitsProcessor(const torch::Tensor& token_ids,
+                           const torch::Tensor& biases,
+                           const torch::Tensor& lens,
+                           const torch::Tensor& exclusive)
+      : token_ids_(token_ids),
+        biases_(biases),
+        lens_(lens),
+        exclusive_(exclusive) {
+    CHECK(token_ids_.defined() && biases_.defined());
+  }
+
+  torch::Tensor forward(
+      const torch::Tensor& logits,
+      const torch::Tensor& /*unique_token_ids*/,
+      const torch::Tensor& /*unique_token_counts*/,
+      const torch::Tensor& /*unique_token_lens*/) const override {
+    CHECK_EQ(logits.size(0), token_ids_.size(0));
+
+    torch::Tensor logits_ = logits;
+    if (logits_.is_cuda()) {
+      kernel::apply_logit_bias(logits_, token_ids_, biases_, lens_, exclusive_);
+    } else {
+      detail::apply_logit_bias(logits_, token_ids_, biases_, lens_, exclusive_);
+    }
+    return logits_;
+  }
+
+ private:
+  // [num_seqs, max_len]
+  torch::Tensor token_ids_;
+  // [num_seqs, max_len]
+  torch::Tensor biases_;
+  // [num_seqs]
+  torch::Tensor lens_;
+  // [num_seqs]
+  torch::Tensor exclusive_;
+};
+
 class TemperatureLogitsProcessor : public LogitsProcessor {
  public:
   // Constructor
@@ -252,6 +252,159 @@ TEST(LogitsProcessorTest, RepetitionPenaltyKernel) {
                               /*atol=*/1e-03));
 }
 
+TEST(LogitsProcessorTest, TokenBitmask) {
+  // Test TokenBitmaskLogitsProcessor
+  torch::ScalarType dtype(torch::kFloat32);
+  torch::Device device(torch::kCPU);
+  auto options = torch::dtype(dtype).device(device);
+
+  int64_t batch_size = 3;
+  int64_t vocab_size = 70;
+  // 3 words cover 96 tokens, more than the vocab
+  const int64_t n_words = 3;
+  std::vector<int32_t> words(batch_size * n_words, 0);
+  // allow tokens 0, 31, 32 and 69 for the first sequence
+  words[0] = 1 | int32_t(1u << 31);
+  words[1] = 1;
+  words[2] = 1 << 5;
+  // allow all tokens for the second sequence
+  words[3] = words[4] = words[5] = -1;
+  // allow no token for the third sequence
+  const auto bitmask =
+      torch::tensor(words, torch::kInt).view({batch_size, n_words});
+  TokenBitmaskLogitsProcessor processor(bitmask);
+
+  const auto logits = torch::randn({batch_size, vocab_size}, options);
+  auto desired_logits = torch::full_like(
+      logits, -std::numeric_limits<float>::infinity());
+  for (int64_t token_id : {0, 31, 32, 69}) {
+    desired_logits[0][token_id] = logits[0][token_id];
+  }
+  desired_logits[1] = logits[1];
+
+  torch::Tensor token_ids;
+  torch::Tensor token_counts;
+  torch::Tensor tokens_ids_lens;
+  auto output = logits.clone();
+  processor(output, token_ids, token_counts, tokens_ids_lens);
+  EXPECT_TRUE(torch::equal(output, desired_logits));
+}
+
+TEST(LogitsProcessorTest, TokenBitmaskKernel) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  // Test TokenBitmaskLogitsProcessor
+  torch::ScalarType dtype(torch::kHalf);
+  torch::Device device(torch::kCUDA);
+  auto options = torch::dtype(dtype).device(device);
+
+  int64_t batch_size = 4;
+  int64_t vocab_size = 32003;
+  // one word short of the vocab to cover the tokens beyond the bitmask
+  const int64_t n_words = vocab_size / 32;
+  const auto bitmask = torch::randint(std::numeric_limits<int32_t>::min(),
+                                      std::numeric_limits<int32_t>::max(),
+                                      {batch_size, n_words},
+                                      torch::dtype(torch::kInt).device(device));
+  const auto logits = torch::randn({batch_size, vocab_size}, options);
+
+  auto output = logits.clone();
+  detail::apply_token_bitmask(output, bitmask);
+  auto kernel_output = logits.clone();
+  kernel::apply_token_bitmask(kernel_output, bitmask);
+  EXPECT_TRUE(torch::equal(output, kernel_output));
+}
+
+TEST(LogitsProcessorTest, LogitBias) {
+  // Test LogitBiasLogitsProcessor
+  torch::ScalarType dtype(torch::kFloat32);
+  torch::Device device(torch::kCPU);
+  auto options = torch::dtype(dtype).device(device);
+
+  int64_t batch_size = 3;
+  int64_t vocab_size = 10;
+  std::vector<SamplingParameter> sampling_params(batch_size);
+  sampling_params[0].logit_bias = {{2, 1.5}, {5, -100}, {7, 0.5}};
+  // no bias for the second sequence
+  // only tokens 1 and 3 for the third sequence
+  sampling_params[2].logit_bias = {{1, 0}, {3, 2}};
+  sampling_params[2].logit_bias_exclusive = true;
+
+  std::vector<const SamplingParameter*> params;
+  for (const auto& p : sampling_params) {
+    params.push_back(&p);
+  }
+  SamplingParameters parameters;
+  parameters.init(params,
+                  /*selected_token_idxes=*/{0, 1, 2},
+                  /*sample_idxes=*/{0, 1, 2},
+                  /*unique_token_ids_vec=*/{{}, {}, {}},
+                  /*unique_token_counts_vec=*/{{}, {}, {}},
+                  /*unique_token_lens_vec=*/{0, 0, 0});
+  ASSERT_TRUE(parameters.logit_bias_token_ids.defined());
+  EXPECT_EQ(parameters.logit_bias_token_ids.sizes(),
+            torch::IntArrayRef({batch_size, 3}));
+  LogitBiasLogitsProcessor processor(parameters.logit_bias_token_ids,
+                                     parameters.logit_bias_values,
+                                     parameters.logit_bias_lens,
+                                     parameters.logit_bias_exclusive);
+
+  const auto logits = torch::randn({batch_size, vocab_size}, options);
+  auto desired_logits = logits.clone();
+  desired_logits[0][2] += 1.5;
+  desired_logits[0][5] -= 100;
+  desired_logits[0][7] += 0.5;
+  desired_logits[2].fill_(-std::numeric_limits<float>::infinity());
+  desired_logits[2][1] = logits[2][1];
+  desired_logits[2][3] = logits[2][3] + 2;
+
+  torch::Tensor token_ids;
+  torch::Tensor token_counts;
+  torch::Tensor tokens_ids_lens;
+  auto output = logits.clone();
+  processor(output, token_ids, token_counts, tokens_ids_lens);
+  EXPECT_TRUE(torch::allclose(output, desired_logits));
+}
+
+TEST(LogitsProcessorTest, LogitBiasKernel) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  // Test LogitBiasLogitsProcessor
+  torch::ScalarType dtype(torch::kHalf);
+  torch::Device device(torch::kCUDA);
+  auto options = torch::dtype(dtype).device(device);
+
+  int64_t batch_size = 4;
+  int64_t vocab_size = 32000;
+  int64_t max_len = 100;
+  // distinct token ids per row, padded entries repeat the last entry
+  auto token_ids = torch::empty({batch_size, max_len},
+                                torch::dtype(torch::kInt64).device(device));
+  for (int64_t i = 0; i < batch_size; ++i) {
+    token_ids[i] = torch::randperm(vocab_size, token_ids.options())
+                       .narrow(/*dim=*/0, /*start=*/0, /*length=*/max_len);
+  }
+  auto biases = torch::randn({batch_size, max_len}, options);
+  const auto lens =
+      torch::tensor({100, 50, 1, 80}, torch::dtype(torch::kInt).device(device));
+  for (int64_t i = 0; i < batch_size; ++i) {
+    const int64_t len = lens[i].item<int64_t>();
+    token_ids[i].narrow(0, len, max_len - len).fill_(token_ids[i][len - 1]);
+    biases[i].narrow(0, len, max_len - len).fill_(biases[i][len - 1]);
+  }
+  const auto exclusive = torch::tensor(
+      {false, true, true, false}, torch::dtype(torch::kBool).device(device));
+  const auto logits = torch::randn({batch_size, vocab_size}, options);
+
+  auto output = logits.clone();
+  detail::apply_logit_bias(output, token_ids, biases, lens, exclusive);
+  auto kernel_output = logits.clone();
+  kernel::apply_logit_bias(kernel_output, token_ids, biases, lens, exclusive);
+  EXPECT_TRUE(torch::allclose(output, kernel_output));
+}
+
 TEST(LogitsProcessorTest, TopK) {
   if (!torch::cuda::is_available()) {
     GTEST_SKIP() << "CUDA not available, skipping test";
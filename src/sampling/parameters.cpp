@@ -21,9 +21,13 @@ void SamplingParameters::init(
     const std::vector<int32_t>& unique_token_lens_vec) {
   CHECK_EQ(sampling_params.size(), selected_token_idxes.size());
   CHECK_GE(sampling_params.size(), sample_idxes.size());
-  CHECK_EQ(sampling_params.size(), unique_token_ids_vec.size());
-  CHECK_EQ(sampling_params.size(), unique_token_counts_vec.size());
-  CHECK_EQ(sampling_params.size(), unique_token_lens_vec.size());
+  // the unique tokens are empty if they are kept on device
+  const bool has_unique_tokens = !unique_token_lens_vec.empty();
+  if (has_unique_tokens) {
+    CHECK_EQ(sampling_params.size(), unique_token_ids_vec.size());
+    CHECK_EQ(sampling_params.size(), unique_token_counts_vec.size());
+    CHECK_EQ(sampling_params.size(), unique_token_lens_vec.size());
+  }
 
   std::vector<float> frequency_penalties;
   std::vector<float> presence_penalties;
@@ -81,7 +85,7 @@ void SamplingParameters::init(
   }
 
   this->selected_token_idxes = torch::tensor(selected_token_idxes, torch::kInt);
-  if (need_token_stats) {
+  if (need_token_stats && has_unique_tokens) {
     this->unique_token_ids =
         create_2d_tensor(unique_token_ids_vec, torch::kInt64);
     this->unique_token_counts =
@@ -90,19 +94,67 @@ void SamplingParameters::init(
         torch::tensor(unique_token_lens_vec, torch::kInt);
   }
 
+  // construct the sparse logit bias tensors
+  size_t max_bias_len = 0;
+  for (const auto* p : sampling_params) {
+    max_bias_len = std::max(max_bias_len, p->logit_bias.size());
+  }
+  if (max_bias_len > 0) {
+    std::vector<std::vector<int64_t>> bias_token_ids;
+    std::vector<std::vector<float>> bias_values;
+    std::vector<int32_t> bias_lens;
+    std::vector<int32_t> bias_exclusive;
+    for (const auto* p : sampling_params) {
+      CHECK(!p->logit_bias_exclusive || !p->logit_bias.empty())
+          << "no token allowed by the exclusive logit bias";
+      auto& ids = bias_token_ids.emplace_back();
+      auto& values = bias_values.emplace_back();
+      for (const auto& [token_id, bias] : p->logit_bias) {
+        ids.push_back(token_id);
+        values.push_back(bias);
+      }
+      bias_lens.push_back(static_cast<int32_t>(ids.size()));
+      bias_exclusive.push_back(p->logit_bias_exclusive ? 1 : 0);
+      // repeat the last entry so that padded entries rewrite the same value,
+      // rows without bias add 0 to token 0.
+      const int64_t pad_id = ids.empty() ? 0 : ids.back();
+      const float pad_value = values.empty() ? 0.0f : values.back();
+      ids.resize(max_bias_len, pad_id);
+      values.resize(max_bias_len, pad_value);
+    }
+    this->logit_bias_token_ids =
+        create_2d_tensor(bias_token_ids, torch::kInt64);
+    this->logit_bias_values = create_2d_tensor(bias_values, torch::kFloat32);
+    this->logit_bias_lens = torch::tensor(bias_lens, torch::kInt);
+    this->logit_bias_exclusive = torch::tensor(bias_exclusive, torch::kBool);
+  }
+
   // construct do sample tensor
   std::vector<int32_t> do_sample;
+  std::vector<int64_t> logprobs_idxes;
+  int64_t max_top_k = 0;
   for (const auto idx : sample_idxes) {
     const auto* p = sampling_params[idx];
+    if (p->logprobs) {
+      logprobs_idxes.push_back(static_cast<int64_t>(do_sample.size()));
+    }
     // need to do sample if any of following is true
     const bool sample = p->do_sample || p->temperature != 0.0 ||
                         p->top_p != 1.0 || p->top_k > 0;
     do_sample.push_back(sample ? 1 : 0);
+    if (sample && max_top_k >= 0) {
+      max_top_k = p->top_k > 0 ? std::max(max_top_k, p->top_k) : -1;
+    }
   }
   this->sample_idxes = torch::tensor(sample_idxes, torch::kInt);
   this->do_sample = torch::tensor(do_sample, torch::kBool);
+  if (logprobs && logprobs_idxes.size() < sample_idxes.size()) {
+    // the others skip the log_softmax over the vocab
+    this->logprobs_idxes = torch::tensor(logprobs_idxes, torch::kLong);
+  }
   this->logprobs = logprobs;
   this->max_top_logprobs = max_top_logprobs;
+  this->max_top_k = max_top_k;
 }
 
 }  // namespace llm
@@ -2,6 +2,8 @@
 #include <torch/torch.h>
 
 #include <cstdint>
+#include <optional>
+#include <utility>
 #include <vector>
 
 #include "common/tensor_helper.h"
@@ -21,17 +23,33 @@ struct SamplingParameter {
   bool logprobs = false;
   int64_t top_logprobs = 0;
 
+  // the sparse bias added to the logits of the tokens, sorted by token id.
+  std::vector<std::pair<int32_t, float>> logit_bias;
+
+  // whether only the tokens of logit_bias can be sampled, e.g. the answers
+  // of a classification prompt.
+  bool logit_bias_exclusive = false;
+
   // ############### following parameters are used for sampling ###############
   bool do_sample = false;
 
-  // not used for now
-  uint64_t seed = 0;
+  // the seed of the random numbers of the sequences, unseeded sequences draw
+  // from the global generator.
+  std::optional<uint64_t> seed;
+
+  // whether the frequency, presence or repetition penalty is applied, which
+  // need the counts of the tokens
+  bool has_penalties() const {
+    return frequency_penalty != 0.0 || presence_penalty != 0.0 ||
+           repetition_penalty != 1.0;
+  }
 };
 
 // SamplingParameters is used to specify sampling parameters for a batch of
 // requests/sequences.
 struct SamplingParameters {
   // initialize the sampling parameters from the given sampling parameters
+  // the unique tokens are empty if they are kept on device.
   void init(const std::vector<const SamplingParameter*>& sampling_params,
             const std::vector<int32_t>& selected_token_idxes,
             const std::vector<int32_t>& sample_idxes,
@@ -40,28 +58,45 @@ struct SamplingParameters {
             const std::vector<int32_t>& unique_token_lens_vec);
 
   SamplingParameters to(const torch::Device& device,
-                        torch::ScalarType dtype) const {
+                        torch::ScalarType dtype,
+                        bool non_blocking = false) const {
+    const auto copy = non_blocking ? safe_to_async : safe_to;
     SamplingParameters params;
 
     // all tensors should be on the same device
-    params.selected_token_idxes = safe_to(selected_token_idxes, device);
+    params.selected_token_idxes = copy(selected_token_idxes, device);
 
     auto options = torch::device(device).dtype(dtype);
-    params.frequency_penalties = safe_to(frequency_penalties, options);
-    params.presence_penalties = safe_to(presence_penalties, options);
-    params.repetition_penalties = safe_to(repetition_penalties, options);
-    params.temperatures = safe_to(temperatures, options);
-    params.top_p = safe_to(top_p, options);
-    params.top_k = safe_to(top_k, device);
-
-    params.unique_token_ids = safe_to(unique_token_ids, device);
-    params.unique_token_counts = safe_to(unique_token_counts, device);
-    params.unique_token_ids_lens = safe_to(unique_token_ids_lens, device);
-
-    params.sample_idxes = safe_to(sample_idxes, device);
-    params.do_sample = safe_to(do_sample, device);
+    params.frequency_penalties = copy(frequency_penalties, options);
+    params.presence_penalties = copy(presence_penalties, options);
+    params.repetition_penalties = copy(repetition_penalties, options);
+    params.temperatures = copy(temperatures, options);
+    params.top_p = copy(top_p, options);
+    params.top_k = copy(top_k, device);
+
+    params.unique_token_ids = copy(unique_token_ids, device);
+    params.unique_token_counts = copy(unique_token_counts, device);
+    params.unique_token_ids_lens = copy(unique_token_ids_lens, device);
+
+    params.logit_bias_token_ids = copy(logit_bias_token_ids, device);
+    params.logit_bias_values = copy(logit_bias_values, options);
+    params.logit_bias_lens = copy(logit_bias_lens, device);
+    params.logit_bias_exclusive = copy(logit_bias_exclusive, device);
+
+    params.sample_idxes = copy(sample_idxes, device);
+    params.do_sample = copy(do_sample, device);
+    params.logprobs_idxes = copy(logprobs_idxes, device);
+    params.rng_seeds = copy(rng_seeds, device);
+    params.rng_offsets = copy(rng_offsets, device);
+    params.token_bitmask = copy(token_bitmask, device);
+    params.scored_token_idxes = copy(scored_token_idxes, device);
+    params.scored_token_ids = copy(scored_token_ids, device);
+    params.pooled_token_idxes = copy(pooled_token_idxes, device);
+    params.pooled_embedding_idxes = copy(pooled_embedding_idxes, device);
+    params.num_embeddings = num_embeddings;
     params.logprobs = logprobs;
     params.max_top_logprobs = max_top_logprobs;
+    params.max_top_k = max_top_k;
 
     return params;
   }
@@ -101,6 +136,28 @@ struct SamplingParameters {
   // [num_tokens] IntTensor
   torch::Tensor unique_token_ids_lens;
 
+  // the sparse logit bias of each sequence, rows are padded by repeating the
+  // last entry. undefined if no sequence has a logit bias.
+  // [num_tokens, max_bias_len] LongTensor
+  torch::Tensor logit_bias_token_ids;
+
+  // [num_tokens, max_bias_len] FloatTensor
+  torch::Tensor logit_bias_values;
+
+  // the number of bias entries of each sequence.
+  // [num_tokens] IntTensor
+  torch::Tensor logit_bias_lens;
+
+  // whether only the tokens with a bias can be sampled for each sequence.
+  // [num_tokens] BoolTensor
+  torch::Tensor logit_bias_exclusive;
+
+  // the tokens allowed by the grammar of each constrained sequence, bit j of
+  // word i is set if token i * 32 + j is allowed. rows of unconstrained
+  // sequences have all bits set. undefined if no sequence is constrained.
+  // [num_tokens, n_words] IntTensor
+  torch::Tensor token_bitmask;
+
   // ############### following parameters are used for sampling ###############
   // the last index of the selected tokens for sampling.
   // [num_seqs] IntTensor
@@ -110,12 +167,52 @@ struct SamplingParameters {
   // [num_seqs] BoolTensor
   torch::Tensor do_sample;
 
+  // the philox seed of each selected token and the position of the token
+  // sampled from it, which is the subsequence of the random numbers. the
+  // offsets of the unseeded sequences are -1. undefined if no sequence is
+  // seeded.
+  // [num_tokens] LongTensor
+  torch::Tensor rng_seeds;
+  torch::Tensor rng_offsets;
+
   // whether to output logprobs for each generated token.
   bool logprobs = false;
 
   // max number of top logprobs in the batch.
   // only used when logprobs is true.
   int64_t max_top_logprobs = 0;
+
+  // the sampled sequences requesting logprobs, undefined if all of them do.
+  // only used when logprobs is true.
+  // [num_logprobs_seqs] LongTensor
+  torch::Tensor logprobs_idxes;
+
+  // max top_k of the sampled sequences, 0 if all sequences are greedy, -1 if
+  // any sampled sequence is not bounded by top_k.
+  int64_t max_top_k = 0;
+
+  // ########### following parameters are used for scoring prompts ###########
+  // the prompt tokens whose logits score the next prompt token, independent
+  // of the selected tokens. undefined if no prompt is scored.
+  // [num_scored_tokens] IntTensor
+  torch::Tensor scored_token_idxes;
+
+  // the prompt token following each scored token.
+  // [num_scored_tokens] LongTensor
+  torch::Tensor scored_token_ids;
+
+  // ########### following parameters are used for pooling embeddings #########
+  // the prompt tokens whose hidden states are pooled into embeddings.
+  // undefined if no sequence is an embedding.
+  // [num_pooled_tokens] IntTensor
+  torch::Tensor pooled_token_idxes;
+
+  // the embedding each pooled token is added to.
+  // [num_pooled_tokens] LongTensor
+  torch::Tensor pooled_embedding_idxes;
+
+  // the number of embeddings pooled in the batch.
+  int64_t num_embeddings = 0;
 };
 
 struct SampleOutput {
@@ -132,6 +229,21 @@ struct SampleOutput {
   torch::Tensor top_logprobs;
   // [num_seq, ..., top_k] LongTensor
   torch::Tensor top_tokens;
+
+  // the log probabilities of the prompt tokens scored with the logits of
+  // SamplingParameters::scored_token_idxes.
+  // [num_scored_tokens] FloatTensor
+  torch::Tensor scored_logprobs;
+
+  // the sum of the hidden states of the pooled tokens of each embedding, see
+  // SamplingParameters::pooled_token_idxes.
+  // [num_embeddings, hidden_size] FloatTensor
+  torch::Tensor pooled_hidden_states;
+
+  // the attention received by the kv cache of the observed sequences, see
+  // InputParameters::kv_scores.
+  // [n_observed, max_kv_len] FloatTensor
+  torch::Tensor kv_scores;
 };
 
 }  // namespace llm
@@ -1,8 +1,11 @@
 #include "sampler.h"
 
+#include <ATen/CPUGeneratorImpl.h>
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include "kernels/sampling/sampling_kernels.h"
+#include "logits_processor.h"
 #include "sampling/parameters.h"
 namespace llm {
 
@@ -16,6 +19,28 @@ Sampler::Sampler(const torch::Tensor& do_sample,
   all_greedy_sample_ = !do_sample.any().item<bool>();
 }
 
+Sampler::Sampler(const torch::Tensor& do_sample,
+                 bool logprobs,
+                 int64_t max_top_logprobs,
+                 const torch::Tensor& top_k,
+                 const torch::Tensor& top_p,
+                 const torch::Tensor& rng_seeds,
+                 const torch::Tensor& rng_offsets,
+                 const torch::Tensor& logprobs_idxes)
+    : Sampler(do_sample, logprobs, max_top_logprobs) {
+  top_k_ = top_k;
+  top_p_ = top_p;
+  rng_seeds_ = rng_seeds;
+  rng_offsets_ = rng_offsets;
+  logprobs_idxes_ = logprobs_idxes;
+}
+
+void Sampler::advance_rng_offsets() {
+  if (rng_offsets_.defined()) {
+    rng_offsets_ = rng_offsets_ + rng_offsets_.ge(0).to(torch::kLong);
+  }
+}
+
 SampleOutput Sampler::forward(const torch::Tensor& logits) const {
   // same batch size
   CHECK_EQ(logits.size(0), do_sample_.size(0));
@@ -29,27 +54,47 @@ SampleOutput Sampler::forward(const torch::Tensor& logits) const {
 
   torch::Tensor samples;
   if (all_random_sample_) {
-    samples = random_sample(probs);
+    samples = random_sample(probs, top_k_, top_p_, rng_seeds_, rng_offsets_);
   } else if (all_greedy_sample_) {
     samples = greedy_sample(probs);
   } else {
     // mixed sample, sample both then choose based on do_sample_
-    auto random = random_sample(probs);
+    auto random =
+        random_sample(probs, top_k_, top_p_, rng_seeds_, rng_offsets_);
     auto greedy = greedy_sample(probs);
     samples = torch::where(do_sample_, random, greedy);
   }
   output.next_tokens = samples;
 
   if (logprobs_) {
+    // only the rows requesting logprobs pay for the log_softmax over the
+    // vocab, the results are scattered back to the rows of the batch.
+    const bool compact = logprobs_idxes_.defined();
+    const auto& idxes = logprobs_idxes_;
+    const auto rows = compact ? logits.index_select(/*dim=*/0, idxes) : logits;
+    const auto row_samples =
+        compact ? samples.index_select(/*dim=*/0, idxes) : samples;
     // log_softmax is equivalent to log(softmax) but more numerically stable
     const auto logprobs =
-        torch::log_softmax(logits, /*dim=*/-1, /*dtype=*/torch::kFloat32);
+        torch::log_softmax(rows, /*dim=*/-1, /*dtype=*/torch::kFloat32);
     // select the logprobs for each sequence
-    auto selected_logprobs = logprobs.gather(/*dim=*/-1, samples.view({-1, 1}));
-    output.logprobs = selected_logprobs.view({-1});
+    auto selected_logprobs =
+        logprobs.gather(/*dim=*/-1, row_samples.view({-1, 1})).view({-1});
+    const int64_t batch_size = logits.size(0);
+    output.logprobs =
+        compact ? torch::zeros({batch_size}, selected_logprobs.options())
+                      .index_copy_(/*dim=*/0, idxes, selected_logprobs)
+                : selected_logprobs;
 
     if (max_top_logprobs_ > 0) {
       auto [values, indices] = logprobs.topk(max_top_logprobs_, /*dim=*/-1);
+      if (compact) {
+        values = torch::zeros({batch_size, max_top_logprobs_}, values.options())
+                     .index_copy_(/*dim=*/0, idxes, values);
+        indices =
+            torch::zeros({batch_size, max_top_logprobs_}, indices.options())
+                .index_copy_(/*dim=*/0, idxes, indices);
+      }
       output.top_logprobs = values;
       output.top_tokens = indices;
     }
@@ -69,4 +114,55 @@ torch::Tensor Sampler::random_sample(const torch::Tensor& probs) {
   return probs.div(q).argmax(/*dim=*/-1);
 }
 
+torch::Tensor Sampler::random_sample(const torch::Tensor& probs,
+                                     const torch::Tensor& top_k,
+                                     const torch::Tensor& top_p,
+                                     const torch::Tensor& rng_seeds,
+                                     const torch::Tensor& rng_offsets) {
+  const bool seeded = rng_offsets.defined();
+  if (!top_k.defined() && !top_p.defined() && !seeded) {
+    return random_sample(probs);
+  }
+  if (probs.is_cuda()) {
+    // pivot search over the probs without sorting, with the philox states of
+    // the seeded rows derived on device.
+    const auto options = torch::dtype(torch::kLong).device(probs.device());
+    auto samples = torch::empty({probs.size(0)}, options);
+    kernel::invoke_pivot_sampling(
+        samples, probs.contiguous(), top_k, top_p, rng_seeds, rng_offsets);
+    return samples;
+  }
+  auto filtered = probs;
+  if (top_k.defined() || top_p.defined()) {
+    // filter the sorted probs, then renormalize
+    const TopKTopPLogitsProcessor processor(top_k, top_p);
+    const auto logits = processor.forward(probs.log(),
+                                          /*unique_token_ids=*/{},
+                                          /*unique_token_counts=*/{},
+                                          /*unique_token_lens=*/{});
+    filtered = logits.softmax(/*dim=*/-1);
+  }
+  auto samples = random_sample(filtered);
+  if (seeded) {
+    // draw the seeded rows again with a generator of the seed and position
+    const auto seeds = rng_seeds.to(torch::kCPU, torch::kLong);
+    const auto offsets = rng_offsets.to(torch::kCPU, torch::kLong);
+    const auto* seeds_ptr = seeds.data_ptr<int64_t>();
+    const auto* offsets_ptr = offsets.data_ptr<int64_t>();
+    for (int64_t i = 0; i < filtered.size(0); ++i) {
+      if (offsets_ptr[i] < 0) {
+        continue;
+      }
+      const uint64_t seed = static_cast<uint64_t>(seeds_ptr[i]) ^
+                            (static_cast<uint64_t>(offsets_ptr[i]) *
+                             0x9e3779b97f4a7c15ULL);
+      auto gen = at::make_generator<at::CPUGeneratorImpl>(seed);
+      const auto row = filtered[i];
+      const auto q = torch::empty_like(row).exponential_(/*lambd=*/1, gen);
+      samples[i] = row.div(q).argmax(/*dim=*/-1);
+    }
+  }
+  return samples;
+}
+
 }  // namespace llm
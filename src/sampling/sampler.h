@@ -13,6 +13,23 @@ class Sampler final {
           bool logprobs,
           int64_t max_top_logprobs);
 
+  // apply top_k and then top_p while sampling instead of filtering logits,
+  // which avoids sorting the vocab on cuda devices. probs and logprobs in the
+  // output are not filtered.
+  // top_k, top_p: [batch_size], undefined if not used
+  // rng_seeds, rng_offsets: [batch_size], the seeds of the rows and the
+  // positions of the sampled tokens, see SamplingParameters::rng_seeds.
+  // logprobs_idxes: the rows to compute the logprobs of, all rows if
+  // undefined. the logprobs of the other rows are 0.
+  Sampler(const torch::Tensor& do_sample,
+          bool logprobs,
+          int64_t max_top_logprobs,
+          const torch::Tensor& top_k,
+          const torch::Tensor& top_p,
+          const torch::Tensor& rng_seeds = {},
+          const torch::Tensor& rng_offsets = {},
+          const torch::Tensor& logprobs_idxes = {});
+
   // operator() allows us to use the module as a function.
   template <typename... Args>
   auto operator()(Args&&... args) const {
@@ -22,6 +39,9 @@ class Sampler final {
   // logits: [batch_size, vocab_size]
   SampleOutput forward(const torch::Tensor& logits) const;
 
+  // move the seeded rows to the next position, for multi-step decoding
+  void advance_rng_offsets();
+
   // helper functions
   // probs: [..., vocab_size]
   static torch::Tensor greedy_sample(const torch::Tensor& probs);
@@ -29,6 +49,16 @@ class Sampler final {
   // probs: [..., vocab_size]
   static torch::Tensor random_sample(const torch::Tensor& probs);
 
+  // sample from probs filtered by top_k and then top_p, the seeded rows draw
+  // from their own seeds.
+  // probs: [batch_size, vocab_size]
+  // top_k, top_p, rng_seeds, rng_offsets: [batch_size], undefined if not used
+  static torch::Tensor random_sample(const torch::Tensor& probs,
+                                     const torch::Tensor& top_k,
+                                     const torch::Tensor& top_p,
+                                     const torch::Tensor& rng_seeds = {},
+                                     const torch::Tensor& rng_offsets = {});
+
  private:
   // whether to return logprobs
   bool logprobs_ = false;
@@ -38,6 +68,18 @@ class Sampler final {
 
   // [batch_size]
   torch::Tensor do_sample_;
+
+  // [batch_size], applied while sampling if defined
+  torch::Tensor top_k_;
+  torch::Tensor top_p_;
+
+  // [batch_size], undefined if no row is seeded
+  torch::Tensor rng_seeds_;
+  torch::Tensor rng_offsets_;
+
+  // [num_logprobs_rows] LongTensor, undefined if all rows need logprobs
+  torch::Tensor logprobs_idxes_;
+
   bool all_random_sample_ = true;
   bool all_greedy_sample_ = true;
 };
@@ -9,6 +9,8 @@
 #include <torch/torch.h>
 #include <torch/types.h>
 
+#include "logits_processor.h"
+
 namespace llm {
 
 TEST(SamplerTest, Greedy) {
@@ -28,6 +30,32 @@ TEST(SamplerTest, Greedy) {
   EXPECT_TRUE(torch::allclose(output, desired_output));
 }
 
+TEST(SamplerTest, Seeded) {
+  torch::Device device(torch::kCPU);
+  const auto options = torch::dtype(torch::kFloat32).device(device);
+  const int64_t batch_size = 4;
+  const int64_t vocab_size = 1000;
+  const auto probs =
+      torch::ones({batch_size, vocab_size}, options).softmax(/*dim=*/-1);
+  // rows 0 and 1 share the seed and position, row 3 is unseeded
+  const auto seeds = torch::tensor({42, 42, 7, 0}, torch::kLong);
+  const auto offsets = torch::tensor({3, 3, 3, -1}, torch::kLong);
+
+  const auto samples = Sampler::random_sample(probs,
+                                              /*top_k=*/torch::Tensor(),
+                                              /*top_p=*/torch::Tensor(),
+                                              seeds,
+                                              offsets);
+  EXPECT_EQ(samples[0].item<int64_t>(), samples[1].item<int64_t>());
+  const auto again = Sampler::random_sample(probs,
+                                            /*top_k=*/torch::Tensor(),
+                                            /*top_p=*/torch::Tensor(),
+                                            seeds,
+                                            offsets);
+  EXPECT_TRUE(torch::equal(samples.slice(/*dim=*/0, 0, 3),
+                           again.slice(/*dim=*/0, 0, 3)));
+}
+
 TEST(SamplerTest, Logprobs) {
   torch::ScalarType dtype(torch::kFloat32);
   torch::Device device(torch::kCPU);
@@ -64,6 +92,47 @@ TEST(SamplerTest, Logprobs) {
   EXPECT_TRUE(torch::equal(output.top_tokens, top_k_indices));
 }
 
+TEST(SamplerTest, LogprobsRows) {
+  torch::Device device(torch::kCPU);
+  const auto options = torch::dtype(torch::kFloat32).device(device);
+  const int64_t batch_size = 4;
+  const int64_t vocab_size = 1000;
+  const int64_t top_logprobs = 5;
+  const auto do_sample = torch::tensor({false, false, false, false}, device);
+  // only rows 1 and 3 request logprobs
+  const auto idxes = torch::tensor({1, 3}, torch::kLong);
+  Sampler sampler(do_sample,
+                  /*logprobs=*/true,
+                  top_logprobs,
+                  /*top_k=*/torch::Tensor(),
+                  /*top_p=*/torch::Tensor(),
+                  /*rng_seeds=*/torch::Tensor(),
+                  /*rng_offsets=*/torch::Tensor(),
+                  idxes);
+
+  const auto logits = torch::randn({batch_size, vocab_size}, options);
+  auto output = sampler(logits);
+  ASSERT_EQ(output.logprobs.sizes(), torch::IntArrayRef({batch_size}));
+  ASSERT_EQ(output.top_logprobs.sizes(),
+            torch::IntArrayRef({batch_size, top_logprobs}));
+
+  const auto logprobs =
+      torch::log_softmax(logits, /*dim=*/-1, /*dtype=*/torch::kFloat32);
+  const auto expected =
+      logprobs.gather(/*dim=*/-1, output.next_tokens.view({-1, 1})).view({-1});
+  auto [top_values, top_indices] = logprobs.topk(top_logprobs, /*dim=*/-1);
+  for (int64_t i : {1, 3}) {
+    EXPECT_TRUE(torch::allclose(output.logprobs[i], expected[i]));
+    EXPECT_TRUE(torch::allclose(output.top_logprobs[i], top_values[i]));
+    EXPECT_TRUE(torch::equal(output.top_tokens[i], top_indices[i]));
+  }
+  // the other rows are skipped
+  for (int64_t i : {0, 2}) {
+    EXPECT_EQ(output.logprobs[i].item<float>(), 0);
+    EXPECT_EQ(output.top_tokens[i].sum().item<int64_t>(), 0);
+  }
+}
+
 TEST(SamplerTest, Random) {
   // Test GreedySampler
   torch::ScalarType dtype(torch::kFloat32);
@@ -94,4 +163,41 @@ TEST(SamplerTest, Random) {
                               /*atol=*/1e-3));
 }
 
+TEST(SamplerTest, PivotTopKTopP) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  torch::Device device(torch::kCUDA);
+  const auto options = torch::dtype(torch::kFloat32).device(device);
+  torch::manual_seed(100);
+
+  const int64_t vocab_size = 50;
+  const int64_t num_samples = 500000;
+  const auto logits = torch::randn({1, vocab_size}, options) * 2;
+  const auto top_k = torch::tensor({10}, device);
+  const auto top_p = torch::tensor({0.8f}, options);
+
+  // the filtered and renormalized probs from the sorting based processor
+  TopKTopPLogitsProcessor processor(top_k, top_p);
+  const auto target_prob =
+      processor(logits, torch::Tensor(), torch::Tensor(), torch::Tensor())
+          .softmax(/*dim=*/-1)
+          .view({-1});
+
+  auto probs = logits.softmax(/*dim=*/-1).repeat({num_samples, 1});
+  auto output =
+      Sampler::random_sample(probs,
+                             top_k.repeat({num_samples}),
+                             top_p.repeat({num_samples}));
+  EXPECT_EQ(output.sizes(), torch::IntArrayRef({num_samples}));
+
+  auto bincount = output.bincount(/*weights=*/torch::nullopt,
+                                  /*minlength=*/vocab_size);
+  auto sample_prob = bincount.to(torch::kFloat) / num_samples;
+  EXPECT_TRUE(torch::allclose(target_prob,
+                              sample_prob,
+                              /*rtol=*/1e-2,
+                              /*atol=*/1e-3));
+}
+
 }  // namespace llm
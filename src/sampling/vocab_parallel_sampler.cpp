@@ -0,0 +1,140 @@
+#include "vocab_parallel_sampler.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <cstdint>
+
+#include "model_parallel/model_parallel.h"
+#include "sampler.h"
+
+DEFINE_int32(vocab_parallel_max_top_k,
+             64,
+             "max top_k (and top logprobs) of the batches sampled from the "
+             "vocab shards of the logits without gathering them.");
+
+namespace llm {
+
+VocabParallelSampler::VocabParallelSampler(const SamplingParameters& params,
+                                           const ParallelArgs& parallel_args)
+    : params_(params), parallel_args_(parallel_args) {
+  CHECK(is_supported(params_));
+}
+
+bool VocabParallelSampler::is_supported(const SamplingParameters& params) {
+  if (!params.sample_idxes.defined()) {
+    return false;
+  }
+  // penalties need the token counts of the full vocab
+  if (params.frequency_penalties.defined() ||
+      params.presence_penalties.defined() ||
+      params.repetition_penalties.defined()) {
+    return false;
+  }
+  // the grammar masks cover the full vocab
+  if (params.token_bitmask.defined()) {
+    return false;
+  }
+  // the logit bias is applied to the full vocab as well
+  if (params.logit_bias_token_ids.defined()) {
+    return false;
+  }
+  // the candidates have to cover the top_k of every sampled sequence
+  const int64_t max_k = FLAGS_vocab_parallel_max_top_k;
+  if (params.max_top_k < 0 || params.max_top_k > max_k) {
+    return false;
+  }
+  // logprobs of sampled sequences are computed from the filtered logits
+  if (params.logprobs &&
+      (params.max_top_k > 0 || params.max_top_logprobs > max_k)) {
+    return false;
+  }
+  return true;
+}
+
+SampleOutput VocabParallelSampler::forward(const torch::Tensor& logits) const {
+  CHECK_EQ(logits.size(0), params_.selected_token_idxes.size(0));
+  const int64_t world_size = parallel_args_.world_size();
+  const int64_t vocab_shard_size = logits.size(/*dim=*/-1);
+  // token ids are carried in float32 along with the candidate logits
+  CHECK_LE(vocab_shard_size * world_size, int64_t{1} << 24)
+      << "vocab too large to gather token ids in float32";
+
+  const auto sample_logits =
+      logits.index_select(/*dim=*/0, params_.sample_idxes)
+          .to(torch::kFloat32);
+  const int64_t num_seqs = sample_logits.size(0);
+
+  int64_t k = std::max<int64_t>(params_.max_top_k, 1);
+  if (params_.logprobs) {
+    k = std::max(k, params_.max_top_logprobs);
+  }
+  k = std::min(k, vocab_shard_size);
+
+  // [num_seqs, 2k + 1]: candidate logits, global token ids and logsumexp
+  auto [values, indices] = sample_logits.topk(k, /*dim=*/-1);
+  const auto offset = parallel_args_.rank() * vocab_shard_size;
+  torch::Tensor lse;
+  if (params_.logprobs) {
+    lse = sample_logits.logsumexp(/*dim=*/-1, /*keepdim=*/true);
+  } else {
+    lse = torch::zeros({num_seqs, 1}, values.options());
+  }
+  auto candidates =
+      torch::cat({values, (indices + offset).to(torch::kFloat32), lse},
+                 /*dim=*/-1);
+
+  // [num_seqs, world_size, 2k + 1]
+  candidates = gather_from_model_parallel_region(candidates, parallel_args_)
+                   .view({num_seqs, world_size, 2 * k + 1});
+  // [num_seqs, world_size * k]
+  auto candidate_logits =
+      candidates.slice(/*dim=*/-1, 0, k).reshape({num_seqs, -1});
+  const auto candidate_tokens = candidates.slice(/*dim=*/-1, k, 2 * k)
+                                    .reshape({num_seqs, -1})
+                                    .to(torch::kLong);
+
+  const auto select = [this](const torch::Tensor& t) {
+    return t.defined() ? t.index_select(/*dim=*/0, params_.sample_idxes) : t;
+  };
+  if (params_.temperatures.defined()) {
+    auto temperatures = select(params_.temperatures).to(torch::kFloat32);
+    temperatures = torch::where(temperatures == 0,
+                                torch::ones_like(temperatures),
+                                temperatures);
+    candidate_logits = candidate_logits / temperatures.unsqueeze(/*dim=*/1);
+  }
+
+  // top_k and top_p are applied on the candidates while sampling
+  const Sampler sampler(params_.do_sample,
+                        /*logprobs=*/false,
+                        /*max_top_logprobs=*/0,
+                        select(params_.top_k),
+                        select(params_.top_p));
+  auto output = sampler.forward(candidate_logits);
+  const auto samples = output.next_tokens.view({-1, 1});
+  output.next_tokens =
+      candidate_tokens.gather(/*dim=*/-1, samples).view({-1});
+  // probs over the candidates are meaningless to the caller
+  output.probs = torch::Tensor();
+
+  if (params_.logprobs) {
+    // greedy batches only, the logits are not filtered
+    // [num_seqs, 1]
+    const auto total_lse = candidates.select(/*dim=*/-1, 2 * k)
+                               .logsumexp(/*dim=*/-1, /*keepdim=*/true);
+    output.logprobs =
+        (candidate_logits.gather(/*dim=*/-1, samples) - total_lse).view({-1});
+    if (params_.max_top_logprobs > 0) {
+      auto [top_values, top_indices] =
+          candidate_logits.topk(params_.max_top_logprobs, /*dim=*/-1);
+      output.top_logprobs = top_values - total_lse;
+      output.top_tokens = candidate_tokens.gather(/*dim=*/-1, top_indices);
+    }
+  }
+  return output;
+}
+
+}  // namespace llm
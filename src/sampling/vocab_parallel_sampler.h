@@ -0,0 +1,41 @@
+#pragma once
+#include <gflags/gflags_declare.h>
+#include <torch/torch.h>
+
+#include "model_parallel/parallel_args.h"
+#include "parameters.h"
+
+// max top_k of the batches sampled from the vocab shards of the logits
+DECLARE_int32(vocab_parallel_max_top_k);
+
+namespace llm {
+
+// sample next tokens from the logits sharded along the vocab by the column
+// parallel lm head, without gathering the full logits. each rank selects the
+// top k candidates of its vocab shard, and only the candidates and the
+// logsumexp of the shard are all-gathered: [num_seqs, world_size * (2k + 1)]
+// instead of [num_seqs, vocab_size]. it is exact for greedy sampling and for
+// top_k sampling with top_k <= k, and logprobs are normalized by the
+// logsumexp of the full vocab. probs are not materialized.
+class VocabParallelSampler final {
+ public:
+  VocabParallelSampler(const SamplingParameters& params,
+                       const ParallelArgs& parallel_args);
+
+  // whether the sampling parameters can be handled with the candidates of
+  // the vocab shards: no penalties, every sampled sequence is bounded by
+  // top_k, and logprobs only for greedy batches.
+  static bool is_supported(const SamplingParameters& params);
+
+  // must be called on all ranks of the tensor parallel group.
+  // logits: [num_tokens, vocab_size / world_size] the vocab shard of this rank
+  SampleOutput forward(const torch::Tensor& logits) const;
+
+ private:
+  // sampling parameters on device
+  SamplingParameters params_;
+
+  ParallelArgs parallel_args_;
+};
+
+}  // namespace llm
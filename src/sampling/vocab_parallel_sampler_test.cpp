@@ -0,0 +1,82 @@
+#include "vocab_parallel_sampler.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include "parameters.h"
+
+namespace llm {
+
+TEST(VocabParallelSamplerTest, GreedyWithLogprobs) {
+  const auto int_options = torch::dtype(torch::kInt);
+  const int64_t batch_size = 4;
+  const int64_t vocab_size = 1000;
+
+  SamplingParameters params;
+  params.selected_token_idxes = torch::arange(batch_size, int_options);
+  params.sample_idxes = torch::tensor({2, 0, 3, 1}, int_options);
+  params.do_sample = torch::zeros({batch_size}, torch::kBool);
+  params.logprobs = true;
+  params.max_top_logprobs = 5;
+  ASSERT_TRUE(VocabParallelSampler::is_supported(params));
+
+  const auto logits = torch::randn({batch_size, vocab_size});
+  VocabParallelSampler sampler(params, ParallelArgs(0, 1, nullptr));
+  const auto output = sampler.forward(logits);
+
+  const auto sample_logits = logits.index_select(0, params.sample_idxes);
+  const auto logprobs = torch::log_softmax(sample_logits, /*dim=*/-1);
+  const auto desired_tokens = sample_logits.argmax(/*dim=*/-1);
+  EXPECT_TRUE(torch::equal(output.next_tokens, desired_tokens));
+  EXPECT_TRUE(torch::allclose(
+      output.logprobs,
+      logprobs.gather(-1, desired_tokens.view({-1, 1})).view({-1}),
+      /*rtol=*/1e-5,
+      /*atol=*/1e-5));
+  auto [top_logprobs, top_tokens] = logprobs.topk(5, /*dim=*/-1);
+  EXPECT_TRUE(torch::equal(output.top_tokens, top_tokens));
+  EXPECT_TRUE(torch::allclose(
+      output.top_logprobs, top_logprobs, /*rtol=*/1e-5, /*atol=*/1e-5));
+}
+
+TEST(VocabParallelSamplerTest, TopK) {
+  const auto int_options = torch::dtype(torch::kInt);
+  const int64_t batch_size = 4;
+  const int64_t vocab_size = 1000;
+
+  SamplingParameters params;
+  params.selected_token_idxes = torch::arange(batch_size, int_options);
+  params.sample_idxes = torch::arange(batch_size, int_options);
+  params.do_sample = torch::tensor({1, 1, 0, 1}, torch::kBool);
+  params.temperatures = torch::tensor({0.5, 1.5, 0.0, 0.7});
+  params.top_k = torch::tensor({1, 10, 0, 32}, torch::kLong);
+  params.top_p = torch::tensor({1.0, 0.9, 1.0, 0.5});
+  params.max_top_k = 32;
+  ASSERT_TRUE(VocabParallelSampler::is_supported(params));
+
+  // unbounded sampling and penalties need the full vocab
+  params.max_top_k = -1;
+  EXPECT_FALSE(VocabParallelSampler::is_supported(params));
+  params.max_top_k = 32;
+  params.repetition_penalties = torch::full({batch_size}, 1.5);
+  EXPECT_FALSE(VocabParallelSampler::is_supported(params));
+  params.repetition_penalties = torch::Tensor();
+
+  const auto logits = torch::randn({batch_size, vocab_size});
+  VocabParallelSampler sampler(params, ParallelArgs(0, 1, nullptr));
+  for (int i = 0; i < 10; ++i) {
+    const auto output = sampler.forward(logits);
+    const auto tokens = output.next_tokens;
+    // top_k = 1 and greedy rows pick the max
+    EXPECT_EQ(tokens[0].item<int64_t>(), logits[0].argmax().item<int64_t>());
+    EXPECT_EQ(tokens[2].item<int64_t>(), logits[2].argmax().item<int64_t>());
+    // sampled tokens are within the top_k
+    for (int64_t row : {1, 3}) {
+      const int64_t top_k = params.top_k[row].item<int64_t>();
+      const auto top_tokens = std::get<1>(logits[row].topk(top_k));
+      EXPECT_TRUE((top_tokens == tokens[row]).any().item<bool>());
+    }
+  }
+}
+
+}  // namespace llm
@@ -0,0 +1,95 @@
+#include "batch_budget_controller.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+namespace llm {
+
+BatchBudgetController::BatchBudgetController(size_t min_tokens,
+                                             size_t max_tokens,
+                                             double target_step_seconds,
+                                             double target_itl_seconds)
+    : min_tokens_(std::max<size_t>(min_tokens, 1)),
+      max_tokens_(max_tokens),
+      target_step_seconds_(target_step_seconds),
+      target_itl_seconds_(target_itl_seconds > 0 ? target_itl_seconds
+                                                 : target_step_seconds),
+      token_budget_(max_tokens) {
+  CHECK_GT(target_step_seconds_, 0) << "target step time should be positive";
+  CHECK_LE(min_tokens_, max_tokens_)
+      << "min tokens per batch should not exceed max tokens per batch";
+}
+
+void BatchBudgetController::observe_step(double step_seconds,
+                                         size_t num_tokens) {
+  if (num_tokens == 0) {
+    return;
+  }
+  const double utilization =
+      static_cast<double>(num_tokens) / static_cast<double>(token_budget_);
+  if (num_steps_ == 0) {
+    avg_step_seconds_ = step_seconds;
+    avg_utilization_ = utilization;
+  } else {
+    avg_step_seconds_ = kStepTimeWeight * step_seconds +
+                        (1 - kStepTimeWeight) * avg_step_seconds_;
+    avg_utilization_ = kStepTimeWeight * utilization +
+                       (1 - kStepTimeWeight) * avg_utilization_;
+  }
+  if (++num_steps_ < kStepsPerAdjustment) {
+    return;
+  }
+
+  // shrink towards the larger of the overshoots of the step time and the itl
+  double factor = target_step_seconds_ / avg_step_seconds_;
+  const double itl = itl_quantile();
+  if (itl > 0) {
+    factor = std::min(factor, target_itl_seconds_ / itl);
+  }
+  if (factor < 1.0) {
+    set_budget(token_budget_ * std::max(factor, kMaxShrink));
+  } else if (avg_utilization_ >= kMinUtilizationToGrow &&
+             token_budget_ < max_tokens_) {
+    // the budget limits the batches and the steps have room to grow
+    set_budget(std::max(token_budget_ * std::min(factor, kMaxGrowth),
+                        token_budget_ + 1.0));
+  }
+}
+
+void BatchBudgetController::observe_itl(double seconds) {
+  itl_samples_.push_back(seconds);
+  if (itl_samples_.size() > kMaxItlSamples) {
+    itl_samples_.pop_front();
+  }
+}
+
+double BatchBudgetController::itl_quantile() const {
+  if (itl_samples_.size() < kMinItlSamples) {
+    return 0;
+  }
+  std::vector<double> samples(itl_samples_.begin(), itl_samples_.end());
+  const size_t index = std::min(
+      static_cast<size_t>(kItlQuantile * samples.size()), samples.size() - 1);
+  std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+  return samples[index];
+}
+
+void BatchBudgetController::set_budget(double budget) {
+  const size_t new_budget = std::clamp(
+      static_cast<size_t>(std::llround(budget)), min_tokens_, max_tokens_);
+  if (new_budget != token_budget_) {
+    VLOG(1) << "max tokens per batch: " << token_budget_ << " -> "
+            << new_budget << ", step time: " << avg_step_seconds_ * 1000
+            << "ms";
+    token_budget_ = new_budget;
+  }
+  // start over with the new budget, the itl samples are from the old one
+  num_steps_ = 0;
+  itl_samples_.clear();
+}
+
+}  // namespace llm
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+namespace llm {
+
+// Tunes the max number of tokens per batch online to keep the step time
+// around a target as the traffic mix changes. The budget grows while it is
+// what limits the batches and the steps are faster than the target, i.e. in
+// throughput phases with prompt tokens waiting, and shrinks when the steps
+// get slower than the target or the recent inter token latencies exceed the
+// itl target. The budget stays within [min_tokens, max_tokens], max_tokens
+// being the budget the memory of the engine is profiled for. Not thread
+// safe.
+class BatchBudgetController final {
+ public:
+  // the weight of a new step in the moving average of the step time
+  static constexpr double kStepTimeWeight = 0.2;
+
+  // the max factors to grow and shrink the budget by in one adjustment
+  static constexpr double kMaxGrowth = 1.25;
+  static constexpr double kMaxShrink = 0.5;
+
+  // the budget only grows when the batches use at least this fraction of it
+  static constexpr double kMinUtilizationToGrow = 0.9;
+
+  // the number of steps observed after an adjustment before the next one,
+  // so that the step time reflects the new budget.
+  static constexpr size_t kStepsPerAdjustment = 8;
+
+  // the recent inter token latencies to take the quantile of, and the
+  // number of them needed before they are trusted.
+  static constexpr size_t kMaxItlSamples = 256;
+  static constexpr size_t kMinItlSamples = 16;
+  static constexpr double kItlQuantile = 0.9;
+
+  // target_step_seconds: the target time of a step
+  // target_itl_seconds: the target of the itl quantile, <= 0 to use the
+  // target step time.
+  BatchBudgetController(size_t min_tokens,
+                        size_t max_tokens,
+                        double target_step_seconds,
+                        double target_itl_seconds);
+
+  // the current token budget of a batch
+  size_t token_budget() const { return token_budget_; }
+
+  // record the time of a step processing num_tokens tokens, and adjust the
+  // budget when due.
+  void observe_step(double step_seconds, size_t num_tokens);
+
+  // record the latency between two tokens of a decoding sequence
+  void observe_itl(double seconds);
+
+ private:
+  // the itl quantile of the recent samples, 0 if there are too few
+  double itl_quantile() const;
+
+  void set_budget(double budget);
+
+  size_t min_tokens_ = 0;
+  size_t max_tokens_ = 0;
+  double target_step_seconds_ = 0;
+  double target_itl_seconds_ = 0;
+
+  size_t token_budget_ = 0;
+
+  // the moving average of the step time since the last adjustment
+  double avg_step_seconds_ = 0;
+  // the moving average of the budget utilization since the last adjustment
+  double avg_utilization_ = 0;
+  size_t num_steps_ = 0;
+
+  // the recent inter token latencies, oldest first
+  std::deque<double> itl_samples_;
+};
+
+}  // namespace llm
@@ -0,0 +1,93 @@
+#include "batch_budget_controller.h"
+
+#include <gtest/gtest.h>
+
+#include <cstddef>
+
+namespace llm {
+namespace {
+// observe the steps until the next adjustment
+void observe_steps(BatchBudgetController* controller,
+                   double step_seconds,
+                   size_t num_tokens) {
+  for (size_t i = 0; i < BatchBudgetController::kStepsPerAdjustment; ++i) {
+    controller->observe_step(step_seconds, num_tokens);
+  }
+}
+}  // namespace
+
+TEST(BatchBudgetControllerTest, ShrinkSlowSteps) {
+  BatchBudgetController controller(/*min_tokens=*/64,
+                                   /*max_tokens=*/1024,
+                                   /*target_step_seconds=*/0.05,
+                                   /*target_itl_seconds=*/0);
+  // starts with the max budget
+  EXPECT_EQ(controller.token_budget(), 1024);
+
+  // 20% slower than the target
+  observe_steps(&controller, 0.06, 1024);
+  EXPECT_EQ(controller.token_budget(), 853);
+
+  // shrinks by at most half per adjustment
+  observe_steps(&controller, 1.0, 853);
+  EXPECT_EQ(controller.token_budget(), 427);
+
+  // never below the min budget
+  for (int i = 0; i < 10; ++i) {
+    observe_steps(&controller, 1.0, controller.token_budget());
+  }
+  EXPECT_EQ(controller.token_budget(), 64);
+
+  // idle steps are ignored
+  observe_steps(&controller, 1.0, 0);
+  EXPECT_EQ(controller.token_budget(), 64);
+}
+
+TEST(BatchBudgetControllerTest, GrowFastSteps) {
+  BatchBudgetController controller(/*min_tokens=*/64,
+                                   /*max_tokens=*/1024,
+                                   /*target_step_seconds=*/0.05,
+                                   /*target_itl_seconds=*/0);
+  observe_steps(&controller, 0.1, 1024);
+  EXPECT_EQ(controller.token_budget(), 512);
+
+  // fast steps limited by the budget grow it by at most kMaxGrowth
+  observe_steps(&controller, 0.01, 512);
+  EXPECT_EQ(controller.token_budget(), 640);
+
+  // fast steps that don't use the budget keep it
+  observe_steps(&controller, 0.01, 100);
+  EXPECT_EQ(controller.token_budget(), 640);
+
+  // never above the max budget
+  for (int i = 0; i < 10; ++i) {
+    observe_steps(&controller, 0.01, controller.token_budget());
+  }
+  EXPECT_EQ(controller.token_budget(), 1024);
+}
+
+TEST(BatchBudgetControllerTest, ShrinkSlowDecodes) {
+  BatchBudgetController controller(/*min_tokens=*/64,
+                                   /*max_tokens=*/1024,
+                                   /*target_step_seconds=*/0.05,
+                                   /*target_itl_seconds=*/0.02);
+  // too few itl samples to be trusted
+  for (size_t i = 0; i + 1 < BatchBudgetController::kMinItlSamples; ++i) {
+    controller.observe_itl(0.025);
+  }
+  observe_steps(&controller, 0.03, 1024);
+  EXPECT_EQ(controller.token_budget(), 1024);
+
+  // the itl quantile is over the target even if the steps are fast enough
+  for (size_t i = 0; i < BatchBudgetController::kMinItlSamples; ++i) {
+    controller.observe_itl(0.025);
+  }
+  observe_steps(&controller, 0.03, 1024);
+  EXPECT_EQ(controller.token_budget(), 819);
+
+  // the samples before the adjustment are dropped
+  observe_steps(&controller, 0.03, 819);
+  EXPECT_EQ(controller.token_budget(), 1024);
+}
+
+}  // namespace llm
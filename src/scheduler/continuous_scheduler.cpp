@@ -1,16 +1,29 @@
 #include "continuous_scheduler.h"
 
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
 #include <absl/time/clock.h>
 #include <absl/time/time.h>
+#include <absl/strings/ascii.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_join.h>
+#include <absl/strings/str_split.h>
 #include <folly/MPMCQueue.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <torch/csrc/jit/serialization/pickle.h>
+#include <torch/torch.h>
 
 #include <atomic>
+#include <algorithm>
 #include <cstdint>
+#include <functional>
+#include <limits>
 #include <memory>
 
 #include "common/metrics.h"
 #include "common/timer.h"
+#include "common/trace.h"
 #include "engine/engine.h"
 #include "request/request.h"
 #include "request/sequence.h"
@@ -19,6 +32,8 @@
 DEFINE_GAUGE(num_pending_requests, "Number of pending requests in scheduler");
 DEFINE_GAUGE(num_running_requests, "Number of running requests in scheduler");
 DEFINE_GAUGE(num_waiting_requests, "Number of waiting requests in scheduler");
+DEFINE_GAUGE(num_backlogged_requests,
+             "Number of requests paused for slow streaming clients");
 DEFINE_GAUGE(num_preempted_requests,
              "Number of preempted requests in scheduler");
 
@@ -28,10 +43,52 @@ DEFINE_GAUGE(kv_cache_utilization_perc,
              "Utilization of the kv cache in percentage");
 DEFINE_GAUGE(num_blocks_in_prefix_cache,
              "Number of blocks in the prefix cache");
+DEFINE_GAUGE(num_blocks_in_host_prefix_cache,
+             "Number of blocks in the host prefix cache");
+DEFINE_GAUGE(num_pinned_session_blocks,
+             "Number of prefix cache blocks pinned by the sessions");
 DEFINE_GAUGE(num_free_blocks, "Number of free blocks in the block allocator");
 DEFINE_GAUGE(num_blocks_in_use, "Effective number of blocks in use");
+DEFINE_GAUGE(num_free_host_blocks,
+             "Number of free blocks in the host block allocator");
+DEFINE_GAUGE(tuned_max_tokens_per_batch,
+             "The max number of tokens per batch tuned for the target step "
+             "time");
 
 DEFINE_COUNTER(scheduling_latency_seconds, "Latency of scheduling in seconds");
+DEFINE_COUNTER(pruned_best_of_candidates_total,
+               "Total number of best_of candidates pruned before finishing");
+DEFINE_COUNTER_FAMILY(num_preemptions_total,
+                      "Total number of preempted requests");
+DEFINE_COUNTER_INSTANCE(num_swapped_preemptions_total,
+                        num_preemptions_total,
+                        {{"action", "swap"}});
+DEFINE_COUNTER_INSTANCE(num_recomputed_preemptions_total,
+                        num_preemptions_total,
+                        {{"action", "recompute"}});
+DEFINE_COUNTER(prefix_aware_admissions_total,
+               "Number of waiting requests admitted ahead of the queue order "
+               "for their cached prefixes");
+
+DEFINE_COUNTER(num_inflight_prefix_waits_total,
+               "Number of times new requests waited for the running prefill "
+               "of a shared prompt prefix");
+
+DEFINE_COUNTER(num_dropped_cancelled_requests_total,
+               "Number of waiting requests dropped as their clients have gone "
+               "away");
+
+DEFINE_COUNTER(num_handed_over_requests_total,
+               "Number of prefilled requests handed over to the decode "
+               "scheduler");
+DEFINE_COUNTER(kv_cache_pull_latency_seconds,
+               "Latency of pulling the kv cache of prefilled requests from "
+               "the prefill engines in seconds");
+DEFINE_COUNTER(num_exported_prefix_tokens_total,
+               "Number of prefix tokens whose kv cache is exported");
+DEFINE_COUNTER(num_imported_prefix_tokens_total,
+               "Number of prefix tokens whose kv cache is imported into the "
+               "prefix cache");
 
 DEFINE_COUNTER_FAMILY(num_processing_tokens_total,
                       "Total number of processing tokens");
@@ -53,19 +110,134 @@ DEFINE_HISTOGRAM(
     "Histogram of inter token latency in seconds",
     std::vector<double>{0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.5, 1.0});
 
+// batch composition histograms, observed for each non-empty step
+static const std::vector<double> kTokensPerStepBuckets =
+    {0, 1, 16, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384};
+DEFINE_HISTOGRAM_FAMILY(num_tokens_per_step,
+                        "Histogram of number of tokens per step");
+DEFINE_HISTOGRAM_INSTANCE(num_prompt_tokens_per_step,
+                          num_tokens_per_step,
+                          {{"type", "prompt"}},
+                          kTokensPerStepBuckets);
+DEFINE_HISTOGRAM_INSTANCE(num_generated_tokens_per_step,
+                          num_tokens_per_step,
+                          {{"type", "generated"}},
+                          kTokensPerStepBuckets);
+DEFINE_HISTOGRAM(
+    num_sequences_per_step,
+    "Histogram of number of sequences per step",
+    std::vector<double>{1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024});
+DEFINE_HISTOGRAM(
+    token_budget_utilization_perc,
+    "Histogram of tokens per step in percentage of max_tokens_per_batch",
+    std::vector<double>{5, 10, 20, 30, 40, 50, 60, 70, 80, 90, 95, 100});
+DEFINE_HISTOGRAM(num_preemptions_per_step,
+                 "Histogram of number of preempted requests per step",
+                 std::vector<double>{0, 1, 2, 4, 8, 16, 32, 64});
+
+DEFINE_int32(prefix_cache_dump_interval_s,
+             0,
+             "Interval in seconds to log the hit rate and the hottest "
+             "prefixes of the prefix cache, 0 to disable.");
+
 namespace llm {
+namespace {
 
 constexpr size_t kRequestQueueSize = 100000;
 
+constexpr size_t kTaskQueueSize = 1024;
+
+// version of the exported prefix cache buffer, a pickled tuple of
+// (version, block_size, token_ids, kv cache tensors)
+constexpr int64_t kPrefixCacheFormatVersion = 1;
+
+std::function<bool(const Request*, const Request*)> request_comparator(
+    const std::string& scheduling_policy) {
+  if (scheduling_policy == "slo") {
+    return RequestPtrDeadlineGreater();
+  }
+  if (scheduling_policy == "wfq") {
+    return RequestPtrFairGreater();
+  }
+  if (scheduling_policy == "sjf") {
+    return RequestPtrShortestGreater();
+  }
+  return RequestPtrGreater();
+}
+
+size_t num_blocks_of(const Request* request) {
+  size_t num_blocks = 0;
+  for (const Sequence& sequence : request->sequences) {
+    num_blocks += sequence.num_blocks();
+  }
+  return num_blocks;
+}
+
+}  // namespace
+
 ContinuousScheduler::ContinuousScheduler(Engine* engine, const Options& options)
-    : options_(options), engine_(engine), request_queue_(kRequestQueueSize) {
+    : options_(options),
+      engine_(engine),
+      request_queue_(kRequestQueueSize),
+      priority_queue_(request_comparator(options.scheduling_policy())),
+      prefilled_queue_(kRequestQueueSize),
+      returned_blocks_queue_(kRequestQueueSize),
+      tasks_queue_(kTaskQueueSize) {
   CHECK(engine_ != nullptr);
+  CHECK(options_.scheduling_policy() == "fcfs" ||
+        options_.scheduling_policy() == "slo" ||
+        options_.scheduling_policy() == "wfq" ||
+        options_.scheduling_policy() == "sjf")
+      << "Unsupported scheduling policy: " << options_.scheduling_policy();
+  enable_slo_policy_ = options_.scheduling_policy() == "slo";
+  enable_fair_policy_ = options_.scheduling_policy() == "wfq";
+  enable_sjf_policy_ = options_.scheduling_policy() == "sjf";
+  CHECK_GE(options_.sjf_aging_tokens_per_second(), 0.0);
+
   block_manager_ = engine_->block_manager();
   CHECK(block_manager_ != nullptr);
 
+  const std::vector<std::string> tenant_weights =
+      absl::StrSplit(options_.tenant_weights(), ',', absl::SkipWhitespace());
+  for (const auto& tenant_weight : tenant_weights) {
+    const std::vector<std::string> parts =
+        absl::StrSplit(tenant_weight, absl::MaxSplits('=', 1));
+    double weight = 0;
+    CHECK(parts.size() == 2 && absl::SimpleAtod(parts[1], &weight) &&
+          weight > 0)
+        << "Invalid tenant weight: " << tenant_weight;
+    tenant_weights_[std::string(absl::StripAsciiWhitespace(parts[0]))] = weight;
+  }
+  const double max_tenant_share = options_.max_tenant_kv_cache_share();
+  CHECK(max_tenant_share > 0 && max_tenant_share <= 1.0)
+      << "max_tenant_kv_cache_share should be in (0, 1]";
+  if (max_tenant_share < 1.0) {
+    max_tenant_blocks_ = static_cast<size_t>(
+        max_tenant_share * block_manager_->num_total_blocks());
+  }
+
   enable_prefix_cache_ = block_manager_->options().enable_prefix_cache();
+  CHECK(options_.max_session_kv_cache_share() >= 0 &&
+        options_.max_session_kv_cache_share() <= 1.0)
+      << "max_session_kv_cache_share should be in [0, 1]";
+  CHECK_GT(options_.best_of_prune_interval(), 0)
+      << "best_of_prune_interval should be positive";
+
+  if (options_.target_step_time_ms() > 0) {
+    CHECK_GT(options_.min_tokens_per_batch(), 0);
+    batch_budget_controller_ = std::make_unique<BatchBudgetController>(
+        std::min(options_.min_tokens_per_batch(),
+                 options_.max_tokens_per_batch()),
+        options_.max_tokens_per_batch(),
+        options_.target_step_time_ms() / 1000.0,
+        options_.itl_slo_ms() / 1000.0);
+  }
 
-  response_handler_ = std::make_unique<ResponseHandler>(engine_->tokenizer());
+  CHECK_GT(options_.num_response_threads(), 0);
+  response_handler_ =
+      std::make_unique<ResponseHandler>(engine_->tokenizer(),
+                                        options_.num_response_threads(),
+                                        options_.response_cpus());
 }
 
 ContinuousScheduler::~ContinuousScheduler() {
@@ -88,38 +260,792 @@ ContinuousScheduler::~ContinuousScheduler() {
     std::unique_ptr<Request> request_ptr(request);
   }
   running_requests_.clear();
+
+  // release all prefilled requests that are not ingested yet
+  PrefilledRequest prefilled;
+  while (prefilled_queue_.read(prefilled)) {
+    std::unique_ptr<Request> request_ptr(prefilled.request);
+  }
+  for (const auto& waiting : waiting_prefilled_requests_) {
+    std::unique_ptr<Request> request_ptr(waiting.request);
+  }
+  waiting_prefilled_requests_.clear();
 }
 
 bool ContinuousScheduler::schedule(std::unique_ptr<Request>& request) {
   CHECK(request != nullptr);
   CHECK(!request->sequences.empty());
 
+  // counted before it is visible to the scheduling loop
+  num_requests_.fetch_add(1, std::memory_order_acq_rel);
+  if (RequestTrace::sample()) {
+    request->trace = std::make_unique<RequestTrace>(request->created_time);
+  }
   if (request_queue_.write(request.get())) {
     // take over the ownership of the request
     request.release();
     return true;
   }
   // queue is full
+  num_requests_.fetch_sub(1, std::memory_order_acq_rel);
   return false;
 }
 
-Batch ContinuousScheduler::build_sequence_batch() {
-  Timer timer;
-
+void ContinuousScheduler::ingest_new_requests() {
   // propogate new requests to priority_queue_
   Request* request = nullptr;
   // read from request queue then push to priority queue
   while (request_queue_.read(request)) {
     CHECK(request != nullptr);
+    if (request->trace != nullptr) {
+      request->trace->on_ingested(absl::Now());
+    }
 
-    // expand sequences to the target number if prefix cache is disabled.
-    if (!enable_prefix_cache_) {
-      // expand sequences to the target number
-      request->expand_sequences();
+    // apply default latency targets if not specified by the request
+    if (options_.ttft_slo_ms() > 0 &&
+        request->ttft_slo == absl::InfiniteDuration()) {
+      request->ttft_slo = absl::Milliseconds(options_.ttft_slo_ms());
+    }
+    if (options_.itl_slo_ms() > 0 &&
+        request->itl_slo == absl::InfiniteDuration()) {
+      request->itl_slo = absl::Milliseconds(options_.itl_slo_ms());
     }
 
+    if (enable_fair_policy_) {
+      add_tenant_request(request);
+    }
+    if (enable_sjf_policy_) {
+      update_predicted_rank(request);
+    }
+    // drop the request before it is prefilled if the client has gone away
+    if (request->is_cancelled()) {
+      COUNTER_INC(num_dropped_cancelled_requests_total);
+      finish_request(request);
+      continue;
+    }
     priority_queue_.push(request);
   }
+}
+
+void ContinuousScheduler::set_decode_scheduler(
+    ContinuousScheduler* decode_scheduler) {
+  CHECK(decode_scheduler != nullptr && decode_scheduler != this);
+  CHECK_EQ(decode_scheduler->block_manager_->options().block_size(),
+           block_manager_->options().block_size())
+      << "block size mismatch between prefill and decode";
+  decode_scheduler_ = decode_scheduler;
+}
+
+void ContinuousScheduler::share_response_handler(
+    const ContinuousScheduler& other) {
+  CHECK(&other != this);
+  response_handler_ = other.response_handler_;
+}
+
+void ContinuousScheduler::schedule_prefilled(Request* request,
+                                             ContinuousScheduler* src) {
+  CHECK(request != nullptr && src != nullptr);
+  // counted before it is visible to the scheduling loop
+  num_requests_.fetch_add(1, std::memory_order_acq_rel);
+  prefilled_queue_.blockingWrite(PrefilledRequest{request, src});
+  // counted as pending since it was handed over, see hand_over
+  dec_pending_requests();
+}
+
+bool ContinuousScheduler::is_prefilled(const Request* request) const {
+  if (request->should_expand_sequences()) {
+    return false;
+  }
+  return std::all_of(
+      request->sequences.begin(),
+      request->sequences.end(),
+      [](const Sequence& sequence) {
+        // the kv cache holds the prompt and all tokens but the last one
+        const size_t n_kv_tokens = sequence.num_kv_cache_tokens();
+        return !sequence.is_swapped_out() &&
+               sequence.num_released_blocks() == 0 &&
+               n_kv_tokens >= sequence.num_prompt_tokens() &&
+               n_kv_tokens + 1 >= sequence.num_tokens();
+      });
+}
+
+void ContinuousScheduler::hand_over(Request* request) {
+  // keep the prompts in the prefix cache of this engine, the blocks stay in
+  // use until the decode scheduler returns them
+  for (Sequence& sequence : request->sequences) {
+    block_manager_->cache_committed_blocks_for(&sequence);
+  }
+  if (enable_fair_policy_) {
+    remove_tenant_request(request);
+  }
+  ++num_handed_over_requests_;
+  COUNTER_INC(num_handed_over_requests_total);
+
+  // the request is counted as pending by the decode scheduler until it is
+  // queued there, so that it is never idle in between
+  decode_scheduler_->inc_pending_requests(1);
+  num_requests_.fetch_sub(1, std::memory_order_acq_rel);
+  // hand over after the outputs of the prefill are sent
+  ContinuousScheduler* decode_scheduler = decode_scheduler_;
+  response_handler_->on_request_hand_over(
+      request, [this, decode_scheduler](Request* prefilled) {
+        decode_scheduler->schedule_prefilled(prefilled, this);
+      });
+}
+
+void ContinuousScheduler::ingest_prefilled_requests() {
+  PrefilledRequest prefilled;
+  while (prefilled_queue_.read(prefilled)) {
+    waiting_prefilled_requests_.push_back(prefilled);
+  }
+  if (waiting_prefilled_requests_.empty()) {
+    return;
+  }
+
+  // the copies from each src engine, pulled in one batch
+  absl::flat_hash_map<ContinuousScheduler*, std::vector<int32_t>> copies;
+  // the blocks to return to the src schedulers after the copies
+  std::vector<std::pair<ContinuousScheduler*, ReturnedBlocks>> src_blocks;
+  // admit the requests in arrival order while blocks are available
+  while (!waiting_prefilled_requests_.empty()) {
+    auto [request, src] = waiting_prefilled_requests_.front();
+    std::vector<Block> blocks;
+    if (!request->is_cancelled() &&
+        block_manager_->receive_blocks_for(request, &copies[src], &blocks)) {
+      src_blocks.push_back(
+          {src, {std::move(blocks), request->prefix_cacheable()}});
+      if (enable_fair_policy_) {
+        add_tenant_request(request);
+      }
+      priority_queue_.push(request);
+      waiting_prefilled_requests_.pop_front();
+      continue;
+    }
+
+    // wait for blocks to be released unless there are none to wait for
+    const bool has_blocks_to_wait = !running_requests_.empty() ||
+                                    !priority_queue_.empty() ||
+                                    !src_blocks.empty();
+    if (!request->is_cancelled() && has_blocks_to_wait) {
+      break;
+    }
+    if (!request->is_cancelled()) {
+      LOG(ERROR) << "No enough memory to receive a prefilled request";
+    }
+    // drop the request, returning its blocks as is
+    waiting_prefilled_requests_.pop_front();
+    for (Sequence& sequence : request->sequences) {
+      const auto seq_blocks = sequence.blocks();
+      blocks.insert(blocks.end(), seq_blocks.begin(), seq_blocks.end());
+      sequence.release_blocks();
+    }
+    src->return_blocks(std::move(blocks), request->prefix_cacheable());
+    response_handler_->on_request_finish(std::unique_ptr<Request>(request));
+    num_requests_.fetch_sub(1, std::memory_order_acq_rel);
+  }
+
+  for (const auto& [src, src_to_dst] : copies) {
+    if (src_to_dst.empty()) {
+      continue;
+    }
+    AUTO_COUNTER(kv_cache_pull_latency_seconds);
+    CHECK(engine_->pull_kv_cache_blocks(src->engine_, src_to_dst))
+        << "Failed to pull kv cache blocks from the prefill engine";
+  }
+  for (auto& [src, returned] : src_blocks) {
+    src->return_blocks(std::move(returned.blocks), returned.cacheable);
+  }
+}
+
+void ContinuousScheduler::return_blocks(std::vector<Block> blocks,
+                                        bool cacheable) {
+  returned_blocks_queue_.blockingWrite(
+      ReturnedBlocks{std::move(blocks), cacheable});
+}
+
+void ContinuousScheduler::release_returned_blocks() {
+  ReturnedBlocks returned;
+  while (returned_blocks_queue_.read(returned)) {
+    block_manager_->release_transferred_blocks(&returned.blocks,
+                                               returned.cacheable);
+    CHECK_GT(num_handed_over_requests_, 0);
+    --num_handed_over_requests_;
+  }
+}
+
+void ContinuousScheduler::run_in_loop(folly::Function<void()> task) {
+  inc_pending_requests(1);
+  tasks_queue_.blockingWrite(std::move(task));
+}
+
+void ContinuousScheduler::run_pending_tasks() {
+  folly::Function<void()> task;
+  while (tasks_queue_.read(task)) {
+    task();
+    dec_pending_requests();
+  }
+}
+
+folly::SemiFuture<std::string> ContinuousScheduler::export_prefix_cache(
+    std::vector<int32_t> token_ids,
+    bool quantize) {
+  folly::Promise<std::string> promise;
+  auto future = promise.getSemiFuture();
+  run_in_loop([this,
+               token_ids = std::move(token_ids),
+               quantize,
+               promise = std::move(promise)]() mutable {
+    promise.setValue(export_prefix_cache_in_loop(token_ids, quantize));
+  });
+  return future;
+}
+
+folly::SemiFuture<size_t> ContinuousScheduler::import_prefix_cache(
+    std::string buffer) {
+  folly::Promise<size_t> promise;
+  auto future = promise.getSemiFuture();
+  run_in_loop([this,
+               buffer = std::move(buffer),
+               promise = std::move(promise)]() mutable {
+    promise.setValue(import_prefix_cache_in_loop(buffer));
+  });
+  return future;
+}
+
+folly::SemiFuture<bool> ContinuousScheduler::resize_kv_cache(int64_t n_blocks) {
+  folly::Promise<bool> promise;
+  auto future = promise.getSemiFuture();
+  run_in_loop([this, n_blocks, promise = std::move(promise)]() mutable {
+    resize_kv_cache_in_loop(n_blocks, std::move(promise));
+  });
+  return future;
+}
+
+void ContinuousScheduler::resize_kv_cache_in_loop(
+    int64_t n_blocks,
+    folly::Promise<bool> promise) {
+  const int64_t max_blocks = block_manager_->options().max_num_blocks();
+  if (max_blocks == 0 || n_blocks <= 1 || n_blocks > max_blocks ||
+      kv_cache_shrink_promise_.has_value()) {
+    promise.setValue(false);
+    return;
+  }
+  const int64_t n_total = block_manager_->num_total_blocks();
+  if (n_blocks >= n_total) {
+    // map the memory first, the new blocks are allocated right away
+    const bool success = engine_->resize_kv_cache(n_blocks);
+    if (success) {
+      CHECK(block_manager_->grow(n_blocks));
+    }
+    promise.setValue(success);
+    return;
+  }
+  // the pinned blocks at the end would hold the shrink until they expire
+  pinned_sessions_.clear();
+  num_pinned_session_blocks_ = 0;
+  block_manager_->begin_shrink(n_blocks);
+  kv_cache_shrink_promise_ = std::move(promise);
+  // keep the loop running until the shrink finishes
+  inc_pending_requests(1);
+  finish_kv_cache_shrink();
+}
+
+void ContinuousScheduler::finish_kv_cache_shrink() {
+  if (!kv_cache_shrink_promise_.has_value() ||
+      !block_manager_->finish_shrink()) {
+    return;
+  }
+  // no batch is running, the drained blocks can be unmapped
+  const bool success =
+      engine_->resize_kv_cache(block_manager_->num_total_blocks());
+  kv_cache_shrink_promise_->setValue(success);
+  kv_cache_shrink_promise_.reset();
+  dec_pending_requests();
+}
+
+void ContinuousScheduler::unpin_session(std::string session_id) {
+  run_in_loop([this, session_id = std::move(session_id)]() {
+    auto it = pinned_sessions_.find(session_id);
+    if (it != pinned_sessions_.end()) {
+      num_pinned_session_blocks_ -= it->second.blocks.size();
+      pinned_sessions_.erase(it);
+    }
+  });
+}
+
+void ContinuousScheduler::pin_session(const std::string& session_id,
+                                      const std::vector<int32_t>& token_ids) {
+  auto blocks = block_manager_->match_cached_blocks(token_ids);
+  PinnedSession& session = pinned_sessions_[session_id];
+  num_pinned_session_blocks_ -= session.blocks.size();
+  num_pinned_session_blocks_ += blocks.size();
+  session.blocks = std::move(blocks);
+  session.expire_time =
+      absl::Now() + absl::Seconds(options_.session_ttl_seconds());
+
+  // unpin the sessions closest to expiry beyond the share of the kv cache
+  const auto max_blocks =
+      static_cast<size_t>(options_.max_session_kv_cache_share() *
+                          block_manager_->num_total_blocks());
+  while (num_pinned_session_blocks_ > max_blocks) {
+    auto oldest = pinned_sessions_.begin();
+    for (auto it = pinned_sessions_.begin(); it != pinned_sessions_.end();
+         ++it) {
+      if (it->second.expire_time < oldest->second.expire_time) {
+        oldest = it;
+      }
+    }
+    num_pinned_session_blocks_ -= oldest->second.blocks.size();
+    pinned_sessions_.erase(oldest);
+  }
+}
+
+void ContinuousScheduler::unpin_expired_sessions() {
+  const absl::Time now = absl::Now();
+  if (pinned_sessions_.empty() ||
+      now - last_session_expiry_time_ < absl::Seconds(1)) {
+    return;
+  }
+  last_session_expiry_time_ = now;
+  for (auto it = pinned_sessions_.begin(); it != pinned_sessions_.end();) {
+    if (it->second.expire_time <= now) {
+      num_pinned_session_blocks_ -= it->second.blocks.size();
+      it = pinned_sessions_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+std::string ContinuousScheduler::export_prefix_cache_in_loop(
+    const std::vector<int32_t>& token_ids,
+    bool quantize) {
+  const auto block_ids = block_manager_->cached_block_ids(token_ids);
+  if (block_ids.empty()) {
+    return "";
+  }
+  auto tensors = engine_->export_kv_cache(block_ids, quantize);
+  if (tensors.empty()) {
+    return "";
+  }
+
+  const int64_t block_size = block_manager_->options().block_size();
+  const size_t n_tokens = block_ids.size() * block_size;
+  const std::vector<int32_t> prefix(token_ids.begin(),
+                                    token_ids.begin() + n_tokens);
+  c10::List<torch::Tensor> kv_cache;
+  kv_cache.reserve(tensors.size());
+  for (auto& tensor : tensors) {
+    kv_cache.push_back(std::move(tensor));
+  }
+  const auto data = torch::jit::pickle_save(
+      c10::ivalue::Tuple::create({kPrefixCacheFormatVersion,
+                                  block_size,
+                                  torch::tensor(prefix, torch::kInt),
+                                  std::move(kv_cache)}));
+  COUNTER_ADD(num_exported_prefix_tokens_total, n_tokens);
+  return {data.begin(), data.end()};
+}
+
+size_t ContinuousScheduler::import_prefix_cache_in_loop(
+    const std::string& buffer) {
+  if (!enable_prefix_cache_) {
+    LOG(WARNING) << "Failed to import kv cache: prefix cache is disabled";
+    return 0;
+  }
+  torch::IValue value;
+  try {
+    value = torch::jit::pickle_load({buffer.begin(), buffer.end()});
+  } catch (const std::exception& e) {
+    LOG(ERROR) << "Failed to parse the exported kv cache: " << e.what();
+    return 0;
+  }
+  if (!value.isTuple() || value.toTupleRef().elements().size() != 4) {
+    LOG(ERROR) << "Failed to import kv cache: invalid format";
+    return 0;
+  }
+  const auto& elements = value.toTupleRef().elements();
+  const int64_t block_size = block_manager_->options().block_size();
+  if (!elements[0].isInt() ||
+      elements[0].toInt() != kPrefixCacheFormatVersion ||
+      !elements[1].isInt() || elements[1].toInt() != block_size ||
+      !elements[2].isTensor() || !elements[3].isList()) {
+    LOG(ERROR) << "Failed to import kv cache: unsupported version or block "
+                  "size mismatch";
+    return 0;
+  }
+  const auto token_ids_tensor = elements[2].toTensor().to(torch::kInt);
+  const int32_t* data = token_ids_tensor.const_data_ptr<int32_t>();
+  const std::vector<int32_t> token_ids(data, data + token_ids_tensor.numel());
+  const int64_t n_slots = static_cast<int64_t>(token_ids.size());
+  std::vector<torch::Tensor> kv_cache;
+  for (const auto& element : elements[3].toListRef()) {
+    if (!element.isTensor()) {
+      LOG(ERROR) << "Failed to import kv cache: invalid format";
+      return 0;
+    }
+    const auto& tensor = element.toTensor();
+    // the scales are empty if not quantized
+    if (tensor.numel() > 0 &&
+        (tensor.dim() == 0 || tensor.size(0) != n_slots)) {
+      LOG(ERROR) << "Failed to import kv cache: tokens mismatch";
+      return 0;
+    }
+    kv_cache.push_back(tensor);
+  }
+
+  using ISlice = torch::indexing::Slice;
+  const size_t n_tokens = block_manager_->import_prefix_blocks(
+      token_ids,
+      [&](size_t start_block, const std::vector<Block>& blocks) {
+        // the kv cache of the blocks not cached yet
+        const auto slots = ISlice(start_block * block_size,
+                                  (start_block + blocks.size()) * block_size);
+        std::vector<torch::Tensor> tensors;
+        tensors.reserve(kv_cache.size());
+        for (const auto& tensor : kv_cache) {
+          tensors.push_back(tensor.numel() > 0 ? tensor.index({slots})
+                                               : tensor);
+        }
+        std::vector<int32_t> block_ids;
+        block_ids.reserve(blocks.size());
+        for (const auto& block : blocks) {
+          block_ids.push_back(block.id());
+        }
+        return engine_->import_kv_cache(block_ids, tensors);
+      });
+  COUNTER_ADD(num_imported_prefix_tokens_total, n_tokens);
+  return n_tokens;
+}
+
+void ContinuousScheduler::finish_request(Request* request) {
+  if (enable_fair_policy_) {
+    remove_tenant_request(request);
+  }
+  // learn the output length from the requests that ran to completion
+  if (enable_sjf_policy_ && request->is_finished() &&
+      !request->is_cancelled() && request->pooling == PoolingType::NONE) {
+    size_t num_generated_tokens = 0;
+    for (const Sequence& sequence : request->sequences) {
+      num_generated_tokens =
+          std::max(num_generated_tokens, sequence.num_generated_tokens());
+    }
+    output_length_predictor_.observe(request->prompt_tokens.size(),
+                                     request->stopping_criteria.max_tokens,
+                                     num_generated_tokens);
+  }
+  // the kv cache of the session is in the prefix cache once released
+  std::vector<int32_t> session_tokens;
+  if (!request->session_id.empty() && enable_prefix_cache_ &&
+      request->prefix_cacheable() && request->is_finished() &&
+      !request->is_cancelled() && !request->sequences.empty()) {
+    const auto tokens = request->sequences[0].tokens_in_kv_cache();
+    session_tokens.assign(tokens.begin(), tokens.end());
+  }
+  for (const Sequence& sequence : request->sequences) {
+    num_released_blocks_ += sequence.num_blocks();
+  }
+  block_manager_->release_blocks_for(request);
+  if (!session_tokens.empty()) {
+    pin_session(request->session_id, session_tokens);
+  }
+  // release the ownership of the request
+  response_handler_->on_request_finish(std::unique_ptr<Request>(request));
+  num_requests_.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+ContinuousScheduler::TenantState* ContinuousScheduler::tenant_state(
+    const Request* request) {
+  if (!enable_fair_policy_) {
+    return nullptr;
+  }
+  auto it = tenants_.find(request->tenant);
+  CHECK(it != tenants_.end()) << "Unknown tenant: " << request->tenant;
+  return &it->second;
+}
+
+void ContinuousScheduler::add_tenant_request(const Request* request) {
+  auto [it, inserted] = tenants_.try_emplace(request->tenant);
+  TenantState& state = it->second;
+  if (inserted) {
+    auto weight_it = tenant_weights_.find(request->tenant);
+    if (weight_it != tenant_weights_.end()) {
+      state.weight = weight_it->second;
+    }
+  }
+  if (state.num_requests == 0) {
+    // catch up with the active tenants
+    double min_virtual_time = std::numeric_limits<double>::max();
+    for (const auto& [tenant, other] : tenants_) {
+      if (other.num_requests > 0) {
+        min_virtual_time = std::min(min_virtual_time, other.virtual_time);
+      }
+    }
+    if (min_virtual_time != std::numeric_limits<double>::max()) {
+      state.virtual_time = std::max(state.virtual_time, min_virtual_time);
+    }
+  }
+  ++state.num_requests;
+}
+
+void ContinuousScheduler::remove_tenant_request(const Request* request) {
+  TenantState* state = tenant_state(request);
+  CHECK_GT(state->num_requests, 0);
+  --state->num_requests;
+}
+
+void ContinuousScheduler::update_tenants() {
+  double min_virtual_time = std::numeric_limits<double>::max();
+  active_tenant_weight_ = 0;
+  for (auto& [tenant, state] : tenants_) {
+    state.num_blocks = 0;
+    if (state.num_requests > 0) {
+      min_virtual_time = std::min(min_virtual_time, state.virtual_time);
+      active_tenant_weight_ += state.weight;
+    }
+  }
+  // forget the idle tenants that would catch up with the active ones anyway
+  for (auto it = tenants_.begin(); it != tenants_.end();) {
+    const TenantState& state = it->second;
+    if (state.num_requests == 0 && state.virtual_time <= min_virtual_time) {
+      it = tenants_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  for (const Request* request : preemptable_requests_) {
+    tenant_state(request)->num_blocks += num_blocks_of(request);
+  }
+
+  priority_queue_.for_each([this](Request* request) {
+    request->tenant_virtual_time = tenant_state(request)->virtual_time;
+  });
+  priority_queue_.reorder();
+}
+
+Request* ContinuousScheduler::pop_request_to_preempt(
+    const Request* candidate) {
+  DCHECK(!preemptable_requests_.empty());
+  auto pop = [this](auto it) {
+    Request* request = *it;
+    preemptable_requests_.erase(std::next(it).base());
+    return request;
+  };
+
+  if (enable_fair_policy_ && active_tenant_weight_ > 0) {
+    const double total_blocks = block_manager_->num_total_blocks();
+    for (auto it = preemptable_requests_.rbegin();
+         it != preemptable_requests_.rend();
+         ++it) {
+      if (*it == candidate) {
+        continue;
+      }
+      const TenantState* state = tenant_state(*it);
+      const double share = state->weight / active_tenant_weight_;
+      if (state->num_blocks > share * total_blocks ||
+          state->num_blocks > max_tenant_blocks_) {
+        return pop(it);
+      }
+    }
+  }
+
+  const Priority lowest_priority = preemptable_requests_.back()->priority;
+  auto victim = preemptable_requests_.rbegin();
+  double victim_cost = std::numeric_limits<double>::max();
+  for (auto it = preemptable_requests_.rbegin();
+       it != preemptable_requests_.rend() &&
+       (*it)->priority == lowest_priority;
+       ++it) {
+    const size_t num_blocks = num_blocks_of(*it);
+    if (*it == candidate || num_blocks == 0) {
+      continue;
+    }
+    double cost = std::min(swap_seconds(*it), recompute_seconds(*it));
+    if (cost == std::numeric_limits<double>::infinity()) {
+      // no estimate, rank by the blocks to free instead
+      cost = 1.0;
+    }
+    cost = cost * (1 + (*it)->num_preemptions) / num_blocks;
+    if (cost < victim_cost) {
+      victim = it;
+      victim_cost = cost;
+    }
+  }
+  return pop(victim);
+}
+
+void ContinuousScheduler::preempt(Request* request) {
+  ++request->num_preemptions;
+  if (request->trace != nullptr) {
+    request->trace->on_preempted(absl::Now());
+  }
+  if (swap_seconds(request) <= recompute_seconds(request) &&
+      block_manager_->swap_out_blocks_for(request)) {
+    COUNTER_INC(num_swapped_preemptions_total);
+    return;
+  }
+  // the full blocks stay in the prefix cache until evicted, so resuming may
+  // still hit the cache.
+  block_manager_->release_blocks_for(request);
+  COUNTER_INC(num_recomputed_preemptions_total);
+}
+
+double ContinuousScheduler::swap_seconds(const Request* request) const {
+  if (!block_manager_->swap_enabled()) {
+    return std::numeric_limits<double>::infinity();
+  }
+  const int64_t block_size_in_bytes =
+      block_manager_->options().block_size_in_bytes();
+  if (options_.swap_bandwidth_gbps() <= 0 || block_size_in_bytes <= 0) {
+    return 0;
+  }
+  // copied out now and back in when resumed
+  const double num_bytes =
+      2.0 * num_blocks_of(request) * static_cast<double>(block_size_in_bytes);
+  return num_bytes / (options_.swap_bandwidth_gbps() * 1e9);
+}
+
+double ContinuousScheduler::recompute_seconds(const Request* request) const {
+  if (latency_per_token_ <= 0.0) {
+    return std::numeric_limits<double>::infinity();
+  }
+  size_t num_tokens = 0;
+  for (const Sequence& sequence : request->sequences) {
+    num_tokens += sequence.num_kv_cache_tokens();
+  }
+  return num_tokens * latency_per_token_;
+}
+
+Request* ContinuousScheduler::pop_next_request() {
+  // requests without any kv cache, whose prompts are matched against the
+  // prefix cache when they are scheduled
+  auto is_waiting = [](const Request* request) {
+    if (!request->prefix_cacheable() || request->is_backlogged()) {
+      return false;
+    }
+    return std::all_of(request->sequences.begin(),
+                       request->sequences.end(),
+                       [](const Sequence& sequence) {
+                         return sequence.num_blocks() == 0 &&
+                                !sequence.is_swapped_out();
+                       });
+  };
+  auto is_exhausted = [this](const Request* request) {
+    return request->num_admission_skips >= options_.max_admission_skips();
+  };
+
+  Request* head = priority_queue_.top();
+  priority_queue_.pop();
+  const size_t window = std::max(options_.prefix_admission_window(), 1);
+  if (window == 1 || !enable_prefix_cache_ || !is_waiting(head) ||
+      is_exhausted(head)) {
+    return head;
+  }
+
+  // collect the following waiting requests with the same priority, none can
+  // be picked over a request that has been passed over too many times.
+  std::vector<Request*> candidates = {head};
+  while (candidates.size() < window && !priority_queue_.empty()) {
+    Request* request = priority_queue_.top();
+    if (request->priority != head->priority || !is_waiting(request)) {
+      break;
+    }
+    priority_queue_.pop();
+    candidates.push_back(request);
+    if (is_exhausted(request)) {
+      break;
+    }
+  }
+
+  // pick the request with the most cached tokens, then the fewest blocks to
+  // allocate, ties broken by the queue order. the queue order is kept if
+  // nothing is cached.
+  const size_t block_size = block_manager_->options().block_size();
+  size_t picked = 0;
+  size_t picked_cached_tokens = 0;
+  size_t picked_new_blocks = std::numeric_limits<size_t>::max();
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    const Sequence& sequence = candidates[i]->sequences.front();
+    const size_t cached_tokens = block_manager_->num_cached_tokens(sequence);
+    const size_t new_blocks =
+        (sequence.num_tokens() + block_size - 1) / block_size -
+        cached_tokens / block_size;
+    if (i == 0 || cached_tokens > picked_cached_tokens ||
+        (cached_tokens > 0 && cached_tokens == picked_cached_tokens &&
+         new_blocks < picked_new_blocks)) {
+      picked = i;
+      picked_cached_tokens = cached_tokens;
+      picked_new_blocks = new_blocks;
+    }
+  }
+
+  // the requests ahead of the picked one are passed over once
+  for (size_t i = 0; i < picked; ++i) {
+    ++candidates[i]->num_admission_skips;
+  }
+  if (picked > 0) {
+    COUNTER_INC(prefix_aware_admissions_total);
+  }
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    if (i != picked) {
+      priority_queue_.push(candidates[i]);
+    }
+  }
+  return candidates[picked];
+}
+
+bool ContinuousScheduler::has_inflight_prefix(const Request* request) const {
+  if (!enable_prefix_cache_ || !options_.wait_for_inflight_prefix() ||
+      !request->prefix_cacheable()) {
+    return false;
+  }
+  // only new requests, whose prompts are matched when they are scheduled
+  const Sequence& sequence = request->sequences.front();
+  if (sequence.num_blocks() > 0 || sequence.is_swapped_out()) {
+    return false;
+  }
+
+  const size_t block_size = block_manager_->options().block_size();
+  const auto prompt =
+      sequence.token_ids().slice(0, sequence.num_prompt_tokens());
+  for (const Sequence* running : running_sequences_) {
+    if (!running->prefix_cacheable() || !running->is_prefill_stage()) {
+      continue;
+    }
+    // the blocks of the running prefill are cached as they are computed
+    const auto running_prompt =
+        running->token_ids().slice(0, running->num_prompt_tokens());
+    size_t num_shared_tokens = 0;
+    const size_t max_shared_tokens =
+        std::min(prompt.size(), running_prompt.size());
+    while (num_shared_tokens < max_shared_tokens &&
+           prompt[num_shared_tokens] == running_prompt[num_shared_tokens]) {
+      ++num_shared_tokens;
+    }
+    num_shared_tokens -= num_shared_tokens % block_size;
+    if (num_shared_tokens > running->num_kv_cache_tokens()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Batch ContinuousScheduler::build_sequence_batch() {
+  Timer timer;
+  TraceScope trace_scope("build_sequence_batch");
+
+  // run the tasks before any block is allocated for the batch
+  run_pending_tasks();
+  unpin_expired_sessions();
+  finish_kv_cache_shrink();
+
+  ingest_new_requests();
+
+  // release the blocks of the requests handed over to the decode scheduler,
+  // and admit the requests handed over by the prefill schedulers
+  release_returned_blocks();
+  ingest_prefilled_requests();
 
   // insert running requests back to the priority queue, iterating from the
   // lowest priority to the highest
@@ -127,18 +1053,35 @@ Batch ContinuousScheduler::build_sequence_batch() {
        ++it) {
     Request* request = *it;
     if (request->is_finished() || request->is_cancelled()) {
-      block_manager_->release_blocks_for(request);
-      // release the ownership of the request
-      response_handler_->on_request_finish(std::unique_ptr<Request>(request));
+      finish_request(request);
+      continue;
+    }
+
+    // hand the prefilled request over to the decode scheduler
+    if (decode_scheduler_ != nullptr && is_prefilled(request)) {
+      hand_over(request);
       continue;
     }
 
     // check if the request can be expanded
     if (request->should_expand_sequences()) {
-      // cache the blocks to share among the sequences
-      block_manager_->cache_blocks_for(&request->sequences[0]);
+      const size_t n_sequences = request->sequences.size();
+      // the kv cache of lora adapters and images is not in the prefix cache
+      const bool share_by_prefix_cache =
+          enable_prefix_cache_ && request->prefix_cacheable();
+      if (share_by_prefix_cache) {
+        // cache the blocks to share among the sequences
+        block_manager_->cache_blocks_for(&request->sequences[0]);
+      }
       // expand sequences to the target number
       request->expand_sequences();
+      if (!share_by_prefix_cache) {
+        // fork the prompt kv cache into the new sequences
+        for (size_t i = n_sequences; i < request->sequences.size(); ++i) {
+          block_manager_->fork_blocks_for(request->sequences[0],
+                                          &request->sequences[i]);
+        }
+      }
     }
 
     // release blocks for finished sequences here
@@ -150,41 +1093,181 @@ Batch ContinuousScheduler::build_sequence_batch() {
 
     // put it to the front of the preemptable queue as it has higher priority
     preemptable_requests_.push_front(request);
-    // push the request back to the priority queue
-    priority_queue_.push(request);
+    // push the request back to the priority queue, in order unless the keys
+    // changed while running
+    if (enable_sjf_policy_) {
+      update_predicted_rank(request);
+    }
+    priority_queue_.push_running(request);
   }
   running_requests_.clear();
 
+  if (enable_fair_policy_) {
+    update_tenants();
+  }
+
+  // the blocks held back for the predicted outputs of the requests holding
+  // blocks under the sjf policy, new requests are admitted only if their
+  // predicted blocks fit in the rest.
+  size_t num_reserved_blocks = 0;
+  if (enable_sjf_policy_) {
+    for (const Request* request : preemptable_requests_) {
+      num_reserved_blocks += num_predicted_blocks(request);
+    }
+  }
+  // the blocks of the prefix cache are evicted on demand
+  const size_t num_available_blocks =
+      block_manager_->num_free_blocks() +
+      block_manager_->num_blocks_in_prefix_cache();
+
   // clear previous batch
   running_sequences_.clear();
   running_sequences_budgets_.clear();
+  // the tenant of each running sequence to charge the processed tokens to
+  std::vector<TenantState*> running_sequences_tenants;
+  // whether each running sequence is of a high priority request
+  std::vector<bool> running_sequences_high_priority;
 
   // at least one sequence per batch
   const size_t max_seqs_per_batch = std::max(options_.max_seqs_per_batch(), 1);
 
+  const size_t max_tokens_per_batch = this->max_tokens_per_batch();
+
   // average number of token budget for each sequence.
   const size_t avg_sequence_token_budget =
-      std::max<size_t>(options_.max_tokens_per_batch() / max_seqs_per_batch,
+      std::max<size_t>(max_tokens_per_batch / max_seqs_per_batch,
                        1 + options_.num_speculative_tokens());
 
   // remaining budget for the current batch
   // at least avg_sequence_token_budget token per sequence
   size_t remaining_token_budget =
-      std::max<size_t>(options_.max_tokens_per_batch(),
+      std::max<size_t>(max_tokens_per_batch,
                        max_seqs_per_batch * avg_sequence_token_budget);
   size_t remaining_seq_budget = max_seqs_per_batch;
+  // remaining budget for prefill tokens, limited by the itl target of decodes
+  size_t remaining_prefill_token_budget = max_prefill_tokens();
+
+  // the budgets kept for the high priority requests, leaving the others at
+  // least one sequence with its average token budget
+  const size_t reserved_token_budget =
+      std::min<size_t>(std::max(options_.high_priority_reserved_tokens(), 0),
+                       remaining_token_budget - avg_sequence_token_budget);
+  const size_t reserved_seq_budget =
+      std::min<size_t>(std::max(options_.high_priority_reserved_seqs(), 0),
+                       max_seqs_per_batch - 1);
+  // the budgets taken by the high priority requests so far
+  size_t high_priority_tokens = 0;
+  size_t high_priority_seqs = 0;
+  // the reserved budgets not taken by the high priority requests yet
+  auto unclaimed_reserved_tokens = [&]() {
+    return reserved_token_budget -
+           std::min(reserved_token_budget, high_priority_tokens);
+  };
+  auto unclaimed_reserved_seqs = [&]() {
+    return reserved_seq_budget -
+           std::min(reserved_seq_budget, high_priority_seqs);
+  };
 
   size_t num_preempted_requests = 0;
 
   std::vector<Sequence*> candidate_sequences;
   std::vector<size_t> candidate_token_budgets;
+  // requests without any sequence scheduled due to the prefill token budget
+  // or the lora slots
+  std::vector<Request*> deferred_requests;
+  // requests paused until their consumers drain the streamed outputs
+  std::vector<Request*> backlogged_requests;
+  // the lora adapters used by the batch, limited by the slots on devices
+  const size_t max_loras_per_batch = engine_->num_lora_slots();
+  absl::flat_hash_set<int32_t> batch_lora_ids;
+  // the request being scheduled, popped from the priority queue and kept
+  // across retries after preemptions
+  Request* next_request = nullptr;
   // schedule the requests in the priority queue until budgets are exhausted
-  while (!priority_queue_.empty() &&
+  while ((next_request != nullptr || !priority_queue_.empty()) &&
          remaining_token_budget > options_.num_speculative_tokens() &&
          remaining_seq_budget > 0) {
-    Request* request = priority_queue_.top();
+    if (next_request == nullptr) {
+      next_request = pop_next_request();
+    }
+    Request* request = next_request;
     // TODO: check if request is timeout
 
+    // drop the waiting request if its client has gone away, releasing the
+    // blocks it holds, e.g. after preemptions
+    if (request->is_cancelled()) {
+      COUNTER_INC(num_dropped_cancelled_requests_total);
+      next_request = nullptr;
+      finish_request(request);
+      continue;
+    }
+
+    // pause the request if its client is not draining the outputs, its blocks
+    // can still be preempted by other requests
+    if (request->is_backlogged()) {
+      next_request = nullptr;
+      backlogged_requests.push_back(request);
+      continue;
+    }
+
+    // defer the request if no slot is left for its lora adapter
+    const int32_t lora_id = request->lora_id;
+    if (lora_id >= 0 && !batch_lora_ids.contains(lora_id) &&
+        batch_lora_ids.size() >= max_loras_per_batch) {
+      next_request = nullptr;
+      deferred_requests.push_back(request);
+      continue;
+    }
+
+    // defer new requests of a tenant holding more blocks than its quota
+    TenantState* tenant = tenant_state(request);
+    const size_t num_request_blocks =
+        tenant != nullptr ? num_blocks_of(request) : 0;
+    if (tenant != nullptr && num_request_blocks == 0 &&
+        tenant->num_blocks >= max_tenant_blocks_) {
+      next_request = nullptr;
+      deferred_requests.push_back(request);
+      continue;
+    }
+
+    // wait for the running prefill of a shared prompt prefix to be cached
+    if (has_inflight_prefix(request)) {
+      COUNTER_INC(num_inflight_prefix_waits_total);
+      next_request = nullptr;
+      deferred_requests.push_back(request);
+      continue;
+    }
+
+    // hold new requests back while their predicted blocks don't fit besides
+    // the ones reserved for the scheduled requests, instead of preempting
+    // them later. nothing is held back if no request holds blocks.
+    if (num_reserved_blocks > 0 && num_blocks_of(request) == 0 &&
+        !request->sequences.front().is_swapped_out()) {
+      const size_t num_blocks = num_predicted_blocks(request);
+      if (num_reserved_blocks + num_blocks > num_available_blocks) {
+        next_request = nullptr;
+        deferred_requests.push_back(request);
+        continue;
+      }
+      num_reserved_blocks += num_blocks;
+    }
+
+    // the high priority requests are popped first, the others leave the
+    // reserved budgets the high priority ones didn't take
+    const bool is_high_priority = request->priority == Priority::HIGH;
+    size_t token_budget_limit = remaining_token_budget;
+    size_t seq_budget_limit = remaining_seq_budget;
+    if (!is_high_priority) {
+      token_budget_limit -=
+          std::min(token_budget_limit, unclaimed_reserved_tokens());
+      seq_budget_limit -= std::min(seq_budget_limit, unclaimed_reserved_seqs());
+      if (token_budget_limit <= options_.num_speculative_tokens() ||
+          seq_budget_limit == 0) {
+        // the rest of the queue is of lower priority
+        break;
+      }
+    }
+
     const size_t num_sequences = request->sequences.size();
     candidate_sequences.clear();
     candidate_token_budgets.clear();
@@ -193,21 +1276,32 @@ Batch ContinuousScheduler::build_sequence_batch() {
 
     bool has_enough_blocks = true;
     size_t allocated_tokens = 0;
+    size_t allocated_prefill_tokens = 0;
     size_t allocated_seqs = 0;
     for (Sequence& sequence : request->sequences) {
-      // skip finished sequence.
-      if (sequence.is_finished()) {
+      // skip finished sequence and beams waiting for the others.
+      if (sequence.is_finished() || request->is_beam_ahead(sequence)) {
         continue;
       }
       // no budget left
       if (allocated_tokens + options_.num_speculative_tokens() >=
-              remaining_token_budget ||
-          allocated_seqs >= remaining_seq_budget) {
+              token_budget_limit ||
+          allocated_seqs >= seq_budget_limit) {
         break;
       }
 
-      const size_t token_budget = std::min(
-          avg_sequence_token_budget, remaining_token_budget - allocated_tokens);
+      size_t token_budget = std::min(avg_sequence_token_budget,
+                                     token_budget_limit - allocated_tokens);
+      const bool is_prefill = sequence.is_prefill_stage();
+      if (is_prefill) {
+        const size_t prefill_token_budget =
+            remaining_prefill_token_budget - allocated_prefill_tokens;
+        // no prefill budget left, leave it to next step
+        if (prefill_token_budget <= options_.num_speculative_tokens()) {
+          continue;
+        }
+        token_budget = std::min(token_budget, prefill_token_budget);
+      }
       size_t actual_tokens = 0;
       // no blocks left
       if (!allocate_blocks_for(&sequence, token_budget, &actual_tokens)) {
@@ -217,6 +1311,9 @@ Batch ContinuousScheduler::build_sequence_batch() {
 
       // update the allocated tokens for the sequence
       allocated_tokens += actual_tokens;
+      if (is_prefill) {
+        allocated_prefill_tokens += actual_tokens;
+      }
       allocated_seqs += 1;
       candidate_sequences.push_back(&sequence);
       candidate_token_budgets.push_back(actual_tokens);
@@ -224,20 +1321,44 @@ Batch ContinuousScheduler::build_sequence_batch() {
     CHECK(allocated_tokens <= remaining_token_budget);
     CHECK(allocated_seqs <= remaining_seq_budget);
 
+    // defer the request if none of its sequences fit in the prefill budget
+    if (has_enough_blocks && candidate_sequences.empty()) {
+      next_request = nullptr;
+      deferred_requests.push_back(request);
+      continue;
+    }
+
     // schedule candidates in the request if there are enough blocks
     if (has_enough_blocks) {
-      // remove the request from the priority queue
-      priority_queue_.pop();
+      next_request = nullptr;
       // add the request to the batch
       running_requests_.push_back(request);
+      if (lora_id >= 0) {
+        batch_lora_ids.insert(lora_id);
+      }
       running_sequences_.insert(running_sequences_.end(),
                                 candidate_sequences.begin(),
                                 candidate_sequences.end());
       running_sequences_budgets_.insert(running_sequences_budgets_.end(),
                                         candidate_token_budgets.begin(),
                                         candidate_token_budgets.end());
+      running_sequences_tenants.insert(running_sequences_tenants.end(),
+                                       candidate_sequences.size(),
+                                       tenant);
+      running_sequences_high_priority.insert(
+          running_sequences_high_priority.end(),
+          candidate_sequences.size(),
+          is_high_priority);
       remaining_token_budget -= allocated_tokens;
+      remaining_prefill_token_budget -= allocated_prefill_tokens;
       remaining_seq_budget -= allocated_seqs;
+      if (is_high_priority) {
+        high_priority_tokens += allocated_tokens;
+        high_priority_seqs += allocated_seqs;
+      }
+      if (tenant != nullptr) {
+        tenant->num_blocks += num_blocks_of(request) - num_request_blocks;
+      }
 
       // the request has been scheduled and can't be preempted
       if (!preemptable_requests_.empty() &&
@@ -249,20 +1370,23 @@ Batch ContinuousScheduler::build_sequence_batch() {
 
     // otherwise, preempt lowest priority request and retry
     if (!preemptable_requests_.empty()) {
-      Request* request_to_preempt = preemptable_requests_.back();
-      preemptable_requests_.pop_back();
+      Request* request_to_preempt = pop_request_to_preempt(request);
 
       // avoid preempting the candidate itself
       if (request_to_preempt != request) {
         ++num_preempted_requests;
-        block_manager_->release_blocks_for(request_to_preempt);
+        if (TenantState* state = tenant_state(request_to_preempt)) {
+          state->num_blocks -=
+              std::min(state->num_blocks, num_blocks_of(request_to_preempt));
+        }
+        preempt(request_to_preempt);
       }
       continue;
     }
 
     // no requests left to preempt, partially schedule the request
     if (!candidate_sequences.empty()) {
-      priority_queue_.pop();
+      next_request = nullptr;
       running_requests_.push_back(request);
       running_sequences_.insert(running_sequences_.end(),
                                 candidate_sequences.begin(),
@@ -270,30 +1394,73 @@ Batch ContinuousScheduler::build_sequence_batch() {
       running_sequences_budgets_.insert(running_sequences_budgets_.end(),
                                         candidate_token_budgets.begin(),
                                         candidate_token_budgets.end());
+      running_sequences_tenants.insert(running_sequences_tenants.end(),
+                                       candidate_sequences.size(),
+                                       tenant);
+      running_sequences_high_priority.insert(
+          running_sequences_high_priority.end(),
+          candidate_sequences.size(),
+          is_high_priority);
       remaining_token_budget -= allocated_tokens;
+      remaining_prefill_token_budget -= allocated_prefill_tokens;
       remaining_seq_budget -= allocated_seqs;
+      if (is_high_priority) {
+        high_priority_tokens += allocated_tokens;
+        high_priority_seqs += allocated_seqs;
+      }
     }
     break;
   }
 
+  // put the request left over by the budgets back to the priority queue
+  if (next_request != nullptr) {
+    priority_queue_.push(next_request);
+  }
+
+  // put deferred requests back to the priority queue
+  for (Request* request : deferred_requests) {
+    priority_queue_.push(request);
+  }
+
   // adjust the token number for each sequence if still have token budget left
   if (remaining_token_budget > 0) {
     for (size_t i = 0; i < running_sequences_.size(); ++i) {
       Sequence* sequence = running_sequences_[i];
       size_t& token_budget = running_sequences_budgets_[i];
+      const bool is_prefill = sequence->is_prefill_stage();
 
       // add previous allocated tokens back
       remaining_token_budget += token_budget;
+      size_t sequence_token_budget = remaining_token_budget;
+      if (!running_sequences_high_priority[i]) {
+        // keep the reserved budget the high priority requests didn't take
+        sequence_token_budget =
+            std::max(token_budget,
+                     sequence_token_budget -
+                         std::min(sequence_token_budget,
+                                  unclaimed_reserved_tokens()));
+      }
+      if (is_prefill) {
+        remaining_prefill_token_budget += token_budget;
+        sequence_token_budget =
+            std::min(sequence_token_budget, remaining_prefill_token_budget);
+      }
       size_t actual_tokens = 0;
       // no memory left
       if (!allocate_blocks_for(
-              sequence, remaining_token_budget, &actual_tokens)) {
+              sequence, sequence_token_budget, &actual_tokens)) {
         break;
       }
       // update the allocated tokens for the sequence
+      if (running_sequences_high_priority[i]) {
+        high_priority_tokens += actual_tokens - token_budget;
+      }
       token_budget = actual_tokens;
       CHECK(remaining_token_budget >= actual_tokens);
       remaining_token_budget -= actual_tokens;
+      if (is_prefill) {
+        remaining_prefill_token_budget -= actual_tokens;
+      }
 
       // no budget left
       if (remaining_token_budget == 0) {
@@ -302,14 +1469,19 @@ Batch ContinuousScheduler::build_sequence_batch() {
     }
   }
 
-  if (running_sequences_.empty() && !priority_queue_.empty()) {
+  // the blocks of the handed over requests will be returned
+  if (running_sequences_.empty() && !priority_queue_.empty() &&
+      num_handed_over_requests_ == 0) {
     LOG(ERROR) << "No enough memory to schedule single sequence";
     // no enough memory to schedule single sequence, just finish the request
     Request* request = priority_queue_.top();
     priority_queue_.pop();
-    block_manager_->release_blocks_for(request);
-    // release the ownership of the request
-    response_handler_->on_request_finish(std::unique_ptr<Request>(request));
+    finish_request(request);
+  }
+
+  // put backlogged requests back to the priority queue
+  for (Request* request : backlogged_requests) {
+    priority_queue_.push(request);
   }
 
   // update the batch
@@ -330,13 +1502,50 @@ Batch ContinuousScheduler::build_sequence_batch() {
     num_prompt_tokens += prompt_tokens;
     num_generated_tokens += generated_tokens;
 
+    if (TenantState* tenant = running_sequences_tenants[i]) {
+      tenant->virtual_time += token_budget / tenant->weight;
+    }
+
     batch.add(sequence, token_budget);
   }
+  num_batch_tokens_ = num_prompt_tokens + num_generated_tokens;
+  trace_running_requests();
+
+  // compact the kv cache in the lighter decode only steps
+  if (options_.max_compaction_blocks_per_step() > 0 && num_prompt_tokens == 0) {
+    compact_blocks();
+  }
+
+  // hand over pending kv cache swaps to the batch
+  if (block_manager_->swap_enabled()) {
+    batch.set_swap_blocks(block_manager_->take_swap_out_blocks(),
+                          block_manager_->take_swap_in_blocks());
+  }
+  batch.set_copy_blocks(block_manager_->take_copy_blocks());
+  // the copies of the shared pool are kept until a batch runs them, since
+  // the slots are published and released to other processes on the next take
+  if (block_manager_->shared_pool_enabled() && !batch.empty()) {
+    batch.set_shared_blocks(block_manager_->take_shared_out_blocks(),
+                            block_manager_->take_shared_in_blocks());
+  }
 
   // update metrics before returning
   if (!batch.empty()) {
     // only update the scheduling latency when there are requests to process
     COUNTER_ADD(scheduling_latency_seconds, timer.elapsed_seconds());
+    trace_scope.set_arg("num_tokens", num_batch_tokens_);
+
+    HISTOGRAM_OBSERVE(num_prompt_tokens_per_step, num_prompt_tokens);
+    HISTOGRAM_OBSERVE(num_generated_tokens_per_step, num_generated_tokens);
+    HISTOGRAM_OBSERVE(num_sequences_per_step, batch.size());
+    if (max_tokens_per_batch > 0) {
+      HISTOGRAM_OBSERVE(token_budget_utilization_perc,
+                        100.0 * num_batch_tokens_ / max_tokens_per_batch);
+    }
+    HISTOGRAM_OBSERVE(num_preemptions_per_step, num_preempted_requests);
+  } else {
+    // skip the idle polls
+    trace_scope.discard();
   }
 
   COUNTER_ADD(num_prompt_tokens_total, num_prompt_tokens);
@@ -347,17 +1556,116 @@ Batch ContinuousScheduler::build_sequence_batch() {
   GAUGE_SET(num_running_requests, running_requests_.size());
   GAUGE_SET(num_waiting_requests, priority_queue_.size());
   GAUGE_SET(num_preempted_requests, num_preempted_requests);
+  GAUGE_SET(num_backlogged_requests, backlogged_requests.size());
 
   GAUGE_SET(num_running_sequences, running_sequences_.size());
 
   GAUGE_SET(kv_cache_utilization_perc, block_manager_->kv_cache_utilization());
   GAUGE_SET(num_blocks_in_prefix_cache,
             block_manager_->num_blocks_in_prefix_cache());
+  GAUGE_SET(num_blocks_in_host_prefix_cache,
+            block_manager_->num_blocks_in_host_prefix_cache());
+  GAUGE_SET(num_pinned_session_blocks, num_pinned_session_blocks_);
   GAUGE_SET(num_free_blocks, block_manager_->num_free_blocks());
   GAUGE_SET(num_blocks_in_use, block_manager_->num_blocks_in_use());
+  GAUGE_SET(num_free_host_blocks, block_manager_->num_free_host_blocks());
+
+  maybe_update_load_report(num_generated_tokens);
+  maybe_dump_prefix_cache();
   return batch;
 }
 
+LoadReport ContinuousScheduler::load_report() const {
+  std::lock_guard<std::mutex> lock(load_report_mutex_);
+  return load_report_;
+}
+
+void ContinuousScheduler::maybe_update_load_report(size_t num_decode_tokens) {
+  const absl::Time now = absl::Now();
+  if (now - last_load_report_time_ <
+      absl::Milliseconds(kLoadReportIntervalMs)) {
+    return;
+  }
+  // smooth the bursty block release rate over the recent reports with an
+  // exponential moving average
+  if (last_load_report_time_ != absl::InfinitePast()) {
+    constexpr double kAlpha = 0.02;
+    const double rate = num_released_blocks_ /
+                        absl::ToDoubleSeconds(now - last_load_report_time_);
+    block_release_rate_ =
+        block_release_rate_ == 0.0
+            ? rate
+            : kAlpha * rate + (1 - kAlpha) * block_release_rate_;
+  }
+  num_released_blocks_ = 0;
+  last_load_report_time_ = now;
+
+  LoadReport report;
+  const size_t block_size = block_manager_->options().block_size();
+  report.num_waiting_requests =
+      pending_requests_.load(std::memory_order_relaxed) +
+      priority_queue_.size();
+  priority_queue_.for_each([&report, block_size](const Request* request) {
+    for (const auto& sequence : request->sequences) {
+      const size_t num_tokens = sequence.num_tokens_to_process();
+      report.num_waiting_tokens += num_tokens;
+      report.num_waiting_blocks += (num_tokens + block_size - 1) / block_size;
+    }
+  });
+  report.num_running_requests = running_requests_.size();
+  report.num_running_sequences = running_sequences_.size();
+  for (const Sequence* sequence : running_sequences_) {
+    report.num_running_tokens += sequence->num_tokens();
+  }
+  report.num_total_blocks = block_manager_->num_total_blocks();
+  report.block_size = block_size;
+  report.block_release_rate = block_release_rate_;
+  report.num_free_blocks =
+      report.num_total_blocks -
+      std::min(block_manager_->num_blocks_in_use(), report.num_total_blocks);
+  report.max_tokens_per_batch = max_tokens_per_batch();
+  report.num_decode_tokens = num_decode_tokens;
+  report.latency_per_token = latency_per_token_;
+
+  std::lock_guard<std::mutex> lock(load_report_mutex_);
+  load_report_ = report;
+}
+
+void ContinuousScheduler::maybe_dump_prefix_cache() {
+  if (!enable_prefix_cache_ || FLAGS_prefix_cache_dump_interval_s <= 0) {
+    return;
+  }
+  const absl::Time now = absl::Now();
+  if (now - last_prefix_cache_dump_time_ <
+      absl::Seconds(FLAGS_prefix_cache_dump_interval_s)) {
+    return;
+  }
+  last_prefix_cache_dump_time_ = now;
+
+  constexpr size_t kNumPrefixes = 10;
+  constexpr size_t kMaxTokenIds = 16;
+  const auto& stats = block_manager_->prefix_cache_stats();
+  const size_t lookup_tokens = stats.matched_tokens + stats.missed_tokens;
+  LOG(INFO) << "Prefix cache: hit rate "
+            << (lookup_tokens == 0
+                    ? 0.0
+                    : static_cast<double>(stats.matched_tokens) /
+                          lookup_tokens)
+            << ", matched tokens " << stats.matched_tokens
+            << ", missed tokens " << stats.missed_tokens << ", evicted blocks "
+            << stats.evicted_blocks << ", cached blocks "
+            << block_manager_->num_blocks_in_prefix_cache();
+  const auto prefixes =
+      block_manager_->hottest_prefixes(kNumPrefixes, kMaxTokenIds);
+  for (size_t i = 0; i < prefixes.size(); ++i) {
+    const auto& prefix = prefixes[i];
+    LOG(INFO) << "Hot prefix #" << i << ": " << prefix.num_tokens
+              << " tokens, " << prefix.num_hits << " hits, idle for "
+              << prefix.idle_seconds << "s, token ids ["
+              << absl::StrJoin(prefix.token_ids, ",") << "]";
+  }
+}
+
 Batch ContinuousScheduler::wait_for_batch(const absl::Duration& timeout) {
   const auto deadline = absl::Now() + timeout;
   while (true) {
@@ -388,7 +1696,7 @@ void ContinuousScheduler::step(const absl::Duration& timeout) {
     return;
   }
 
-  engine_->execute_model(batch);
+  execute_batch(batch);
 
   // process request output in batch
   process_batch_output();
@@ -403,13 +1711,17 @@ void ContinuousScheduler::run_until_complete() {
         // wait for new requests to arrive
         continue;
       }
+      if (num_handed_over_requests_ > 0) {
+        // wait for the decode scheduler to return the blocks
+        continue;
+      }
 
       // no more requests to process
       break;
     }
 
     // run inference for the batch
-    engine_->execute_model(batch);
+    execute_batch(batch);
 
     // process request output in batch
     process_batch_output();
@@ -419,25 +1731,278 @@ void ContinuousScheduler::run_until_complete() {
   response_handler_->wait_for_complete();
 }
 
+void ContinuousScheduler::execute_batch(Batch& batch) {
+  TRACE_SCOPE("execute_batch");
+  Timer timer;
+  auto future = engine_->execute_model_async(batch);
+
+  // overlap host side work with the model execution
+  ingest_new_requests();
+
+  std::move(future).get();
+
+  if (num_batch_tokens_ > 0) {
+    // smooth the latency per token with an exponential moving average
+    constexpr double kAlpha = 0.1;
+    const double latency = timer.elapsed_seconds() / num_batch_tokens_;
+    latency_per_token_ =
+        latency_per_token_ == 0.0
+            ? latency
+            : kAlpha * latency + (1 - kAlpha) * latency_per_token_;
+  }
+  if (batch_budget_controller_ != nullptr) {
+    batch_budget_controller_->observe_step(timer.elapsed_seconds(),
+                                           num_batch_tokens_);
+    GAUGE_SET(tuned_max_tokens_per_batch,
+              batch_budget_controller_->token_budget());
+  }
+}
+
+size_t ContinuousScheduler::max_tokens_per_batch() const {
+  if (batch_budget_controller_ != nullptr) {
+    return batch_budget_controller_->token_budget();
+  }
+  return std::max(options_.max_tokens_per_batch(), 0);
+}
+
+void ContinuousScheduler::compact_blocks() {
+  // long sequences gain the most from consecutive blocks
+  std::vector<Sequence*> sequences = running_sequences_;
+  std::sort(sequences.begin(),
+            sequences.end(),
+            [](const Sequence* a, const Sequence* b) {
+              return a->num_blocks() > b->num_blocks();
+            });
+  size_t budget = options_.max_compaction_blocks_per_step();
+  for (Sequence* sequence : sequences) {
+    if (sequence->num_blocks() <= budget) {
+      budget -= block_manager_->compact_blocks_for(sequence);
+    }
+  }
+}
+
+size_t ContinuousScheduler::predict_output_tokens(
+    const Request* request) const {
+  if (request->pooling != PoolingType::NONE) {
+    return 0;
+  }
+  return output_length_predictor_.predict(
+      request->prompt_tokens.size(), request->stopping_criteria.max_tokens);
+}
+
+void ContinuousScheduler::update_predicted_rank(Request* request) const {
+  const size_t max_tokens = request->stopping_criteria.max_tokens;
+  const size_t predicted_tokens = predict_output_tokens(request);
+  size_t num_generated_tokens = 0;
+  for (const Sequence& sequence : request->sequences) {
+    num_generated_tokens =
+        std::max(num_generated_tokens, sequence.num_generated_tokens());
+  }
+  // a request outliving its prediction is ranked by what max_tokens leaves
+  size_t remaining_tokens = 0;
+  if (predicted_tokens > num_generated_tokens) {
+    remaining_tokens = predicted_tokens - num_generated_tokens;
+  } else if (max_tokens > num_generated_tokens) {
+    remaining_tokens = max_tokens - num_generated_tokens;
+  }
+  // ranking by remaining - aging * waited_seconds is the same as ranking by
+  // remaining + aging * created_seconds, which doesn't change while waiting.
+  const double created_seconds =
+      absl::ToDoubleSeconds(request->created_time - absl::UnixEpoch());
+  request->predicted_rank =
+      static_cast<double>(remaining_tokens) +
+      options_.sjf_aging_tokens_per_second() * created_seconds;
+}
+
+size_t ContinuousScheduler::num_predicted_blocks(const Request* request) const {
+  const size_t block_size = block_manager_->options().block_size();
+  const size_t predicted_tokens =
+      request->prompt_tokens.size() + predict_output_tokens(request);
+  const size_t predicted_blocks = (predicted_tokens + block_size - 1) /
+                                  block_size;
+  size_t num_blocks = 0;
+  for (const Sequence& sequence : request->sequences) {
+    if (!sequence.is_finished() && sequence.num_blocks() < predicted_blocks) {
+      num_blocks += predicted_blocks - sequence.num_blocks();
+    }
+  }
+  return num_blocks;
+}
+
+size_t ContinuousScheduler::max_prefill_tokens() const {
+  if (!enable_slo_policy_ || latency_per_token_ <= 0.0) {
+    return std::numeric_limits<size_t>::max();
+  }
+
+  // find the minimum itl slack among decode sequences from the last step
+  const absl::Time now = absl::Now();
+  absl::Duration min_slack = absl::InfiniteDuration();
+  size_t num_decode_tokens = 0;
+  for (const Request* request : preemptable_requests_) {
+    for (const Sequence& sequence : request->sequences) {
+      if (sequence.is_finished() || sequence.is_prefill_stage()) {
+        continue;
+      }
+      num_decode_tokens += 1 + options_.num_speculative_tokens();
+      min_slack = std::min(min_slack,
+                           sequence.last_token_time() + request->itl_slo - now);
+    }
+  }
+  if (min_slack == absl::InfiniteDuration()) {
+    return std::numeric_limits<size_t>::max();
+  }
+
+  // the number of tokens the batch can process within the slack
+  const double slack_seconds = std::max(absl::ToDoubleSeconds(min_slack), 0.0);
+  const auto max_tokens =
+      static_cast<size_t>(slack_seconds / latency_per_token_);
+  // at least one prefill chunk per step to avoid starvation
+  const size_t min_prefill_tokens = 1 + options_.num_speculative_tokens();
+  if (max_tokens <= num_decode_tokens + min_prefill_tokens) {
+    return min_prefill_tokens;
+  }
+  return max_tokens - num_decode_tokens;
+}
+
 void ContinuousScheduler::process_batch_output() {
+  TRACE_SCOPE("process_batch_output");
   // update token latency metrics
   const auto now = absl::Now();
   for (Sequence* sequence : running_sequences_) {
+    // share the prompt blocks of the prefill chunks as soon as they are done
+    if (enable_prefix_cache_ &&
+        sequence->num_kv_cache_tokens() <= sequence->num_prompt_tokens()) {
+      block_manager_->cache_committed_blocks_for(sequence);
+    }
     if (sequence->is_first_token()) {
       HISTOGRAM_OBSERVE(time_to_first_token_latency_seconds,
                         sequence->inter_token_latency(now));
     } else {
-      HISTOGRAM_OBSERVE(inter_token_latency_seconds,
-                        sequence->inter_token_latency(now));
+      const double itl = sequence->inter_token_latency(now);
+      HISTOGRAM_OBSERVE(inter_token_latency_seconds, itl);
+      if (batch_budget_controller_ != nullptr) {
+        batch_budget_controller_->observe_itl(itl);
+      }
     }
   }
 
   // process request output in batch
+  std::vector<Request*> streaming_requests;
   for (Request* request : running_requests_) {
+    if (request->trace != nullptr && !request->trace->has_first_token() &&
+        request->sequences.front().num_generated_tokens() > 0) {
+      request->trace->on_first_token(now);
+    }
+    if (request->should_update_beams()) {
+      update_beams(request);
+    }
+    if (options_.best_of_prune_margin() > 0) {
+      const auto pruned = request->prune_candidates(
+          options_.best_of_prune_margin(), options_.best_of_prune_interval());
+      for (const size_t i : pruned) {
+        block_manager_->release_blocks_for(&request->sequences[i]);
+      }
+      COUNTER_ADD(pruned_best_of_candidates_total, pruned.size());
+    }
     if (request->is_streaming()) {
-      response_handler_->on_request_stream(request);
+      streaming_requests.push_back(request);
+    }
+  }
+  if (!streaming_requests.empty()) {
+    response_handler_->on_requests_stream(streaming_requests);
+  }
+}
+
+void ContinuousScheduler::trace_running_requests() {
+  const absl::Time now = absl::Now();
+  for (Request* request : running_requests_) {
+    if (request->trace == nullptr) {
+      continue;
+    }
+    // the step prefills if any sequence has prompt tokens left
+    bool prefill = false;
+    for (const Sequence& sequence : request->sequences) {
+      if (!sequence.is_finished() &&
+          sequence.num_kv_cache_tokens() < sequence.num_prompt_tokens()) {
+        prefill = true;
+        break;
+      }
+    }
+    request->trace->on_scheduled(
+        now, prefill, request->sequences.front().num_kv_cache_tokens());
+  }
+}
+
+void ContinuousScheduler::update_beams(Request* request) {
+  std::vector<BeamCandidate> beams;
+  std::vector<BeamCandidate> hypotheses;
+  request->select_beams(&beams, &hypotheses);
+  // keep the hypotheses before their beams are replaced
+  for (const BeamCandidate& hypothesis : hypotheses) {
+    request->add_beam_hypothesis(hypothesis);
+  }
+
+  auto& sequences = request->sequences;
+  // the candidates continuing each beam, the first one in place
+  std::vector<std::vector<const BeamCandidate*>> continuations(
+      sequences.size());
+  for (const BeamCandidate& candidate : beams) {
+    continuations[candidate.beam].push_back(&candidate);
+  }
+  // the beams of the step without continuation are reused for the others
+  std::vector<size_t> free_beams;
+  for (size_t i = 0; i < sequences.size(); ++i) {
+    if (request->is_beam_ahead(sequences[i]) && continuations[i].empty()) {
+      free_beams.push_back(i);
+    }
+  }
+
+  // fork the beams first while all of them are intact. the full blocks are
+  // shared, only the partially filled last block is copied.
+  std::vector<size_t> dropped_beams;
+  for (size_t i = 0; i < continuations.size(); ++i) {
+    for (size_t j = 1; j < continuations[i].size(); ++j) {
+      const BeamCandidate* candidate = continuations[i][j];
+      if (!free_beams.empty()) {
+        Sequence& sequence = sequences[free_beams.back()];
+        if (block_manager_->fork_beam_blocks_for(sequences[i], &sequence)) {
+          sequence.assign_beam(
+              sequences[i], candidate->token_id, candidate->logprob);
+        } else {
+          dropped_beams.push_back(free_beams.back());
+        }
+        free_beams.pop_back();
+        continue;
+      }
+      // grow the beams, e.g. from the single sequence of the prompt. the
+      // blocks of the copy are shared with the beam until forked.
+      Sequence& sequence = sequences.emplace_back(sequences[i]);
+      sequence.release_blocks();
+      if (block_manager_->fork_beam_blocks_for(sequences[i], &sequence)) {
+        sequence.assign_beam(
+            sequences[i], candidate->token_id, candidate->logprob);
+      } else {
+        sequences.pop_back();
+      }
+    }
+  }
+  for (size_t i = 0; i < continuations.size(); ++i) {
+    if (!continuations[i].empty()) {
+      const BeamCandidate* candidate = continuations[i].front();
+      sequences[i].replace_last_token(candidate->token_id,
+                                      candidate->logprob);
     }
   }
+
+  // drop the beams left without continuation
+  dropped_beams.insert(
+      dropped_beams.end(), free_beams.begin(), free_beams.end());
+  std::sort(dropped_beams.begin(), dropped_beams.end(), std::greater<>());
+  for (const size_t i : dropped_beams) {
+    block_manager_->release_blocks_for(&sequences[i]);
+    sequences.erase(sequences.begin() + static_cast<int64_t>(i));
+  }
+  request->finish_beam_step();
 }
 
 bool ContinuousScheduler::allocate_blocks_for(Sequence* sequence,
@@ -446,7 +2011,7 @@ bool ContinuousScheduler::allocate_blocks_for(Sequence* sequence,
   // token budget should be large enough for one speculative decoding step
   CHECK_GT(token_budget, options_.num_speculative_tokens());
 
-  if (sequence->num_blocks() == 0) {
+  if (sequence->num_blocks() == 0 && !sequence->is_swapped_out()) {
     // need to allocate shared blocks explicitly to avoid kv_cache_pos change
     block_manager_->allocate_shared_blocks_for(sequence);
   }
@@ -480,6 +2045,32 @@ bool ContinuousScheduler::allocate_blocks_for(Sequence* sequence,
   // the actual allocated tokens is the difference between the total
   // number of tokens and the number of tokens already processed
   *actual_tokens = num_tokens - num_kv_cache_tokens;
+
+  // multi-step decoding: reserve slots for the tokens generated on device,
+  // fall back to a single step if there is not enough memory.
+  const bool is_decoding = num_kv_cache_tokens >= num_prompt_tokens &&
+                           num_tokens == num_kv_cache_tokens + 1;
+  if (options_.num_decode_steps() > 1 &&
+      options_.num_speculative_tokens() == 0 && is_decoding) {
+    const size_t num_reserved_tokens =
+        num_tokens + options_.num_decode_steps() - 1;
+    if (block_manager_->allocate_blocks_for(sequence, num_reserved_tokens)) {
+      return true;
+    }
+  }
+
+  // tree speculative decoding: reserve slots for the tree leaves, fall back
+  // to the draft tokens only if there is not enough memory.
+  if (options_.speculative_tree_width() > 1 &&
+      options_.num_speculative_tokens() > 0 &&
+      num_kv_cache_tokens >= num_prompt_tokens) {
+    const size_t num_leaves = options_.num_speculative_tokens() *
+                              (options_.speculative_tree_width() - 1);
+    if (block_manager_->allocate_blocks_for(sequence,
+                                            num_tokens + num_leaves)) {
+      return true;
+    }
+  }
   // allocate blocks for the sequence
   return block_manager_->allocate_blocks_for(sequence, num_tokens);
 }
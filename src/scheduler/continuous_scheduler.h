@@ -1,16 +1,31 @@
 #pragma once
 
+#include <absl/container/flat_hash_map.h>
 #include <absl/time/time.h>
+#include <folly/Function.h>
 #include <folly/MPMCQueue.h>
+#include <folly/futures/Future.h>
 
+#include <algorithm>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "common/macros.h"
 #include "engine/batch.h"
+#include "batch_budget_controller.h"
+#include "load_report.h"
 #include "memory/block_manager.h"
+#include "output_length_predictor.h"
 #include "request/request.h"
 #include "request/sequence.h"
+#include "request_queue.h"
 #include "response_handler.h"
 #include "scheduler.h"
 
@@ -28,8 +43,115 @@ class ContinuousScheduler final : public Scheduler {
     // the maximum number of sequences per batch
     DEFINE_ARG(int32_t, max_seqs_per_batch) = 64;
 
+    // the target step time in milliseconds to tune the tokens per batch for
+    // online, within [min_tokens_per_batch, max_tokens_per_batch]. the
+    // budget shrinks when the steps or the inter token latencies, against
+    // itl_slo_ms if set, are slower than the target, and grows back while
+    // it limits the batches. 0 to keep max_tokens_per_batch fixed.
+    DEFINE_ARG(int64_t, target_step_time_ms) = 0;
+
+    // the lower bound of the tuned tokens per batch
+    DEFINE_ARG(int32_t, min_tokens_per_batch) = 64;
+
     // the number of speculative tokens per step
     DEFINE_ARG(int32_t, num_speculative_tokens) = 0;
+
+    // the number of candidates per speculative position, kv cache slots are
+    // reserved for the tree leaves if memory allows. 1 means a single chain.
+    DEFINE_ARG(int32_t, speculative_tree_width) = 1;
+
+    // the number of decode steps per step in multi-step decoding, kv cache
+    // slots are reserved for all steps if memory allows.
+    DEFINE_ARG(int32_t, num_decode_steps) = 1;
+
+    // the tokens and the sequences per step kept for high priority requests,
+    // e.g. interactive traffic mixed with batch jobs. the normal and low
+    // priority requests share the rest, so a high priority arrival finds
+    // room in the next step without preemption, and the steps it waits
+    // behind are shorter. 0 to share the whole budgets.
+    DEFINE_ARG(int32_t, high_priority_reserved_tokens) = 0;
+    DEFINE_ARG(int32_t, high_priority_reserved_seqs) = 0;
+
+    // the scheduling policy, "fcfs", "slo", "wfq" or "sjf".
+    // * fcfs: requests are processed in priority then arrival order.
+    // * slo: requests are processed in priority then deadline order, and
+    // prefill chunks are sized to keep decodes within their itl target.
+    // * wfq: requests are processed in priority then the virtual time of
+    // their tenants, the tokens processed for the tenants over their weights.
+    // preemption targets tenants holding more than their share of blocks.
+    // * sjf: requests are processed in priority then their predicted
+    // remaining output tokens, learned from the finished requests. new
+    // requests wait while the blocks for the predicted outputs of the
+    // scheduled ones are short.
+    DEFINE_ARG(std::string, scheduling_policy) = "fcfs";
+
+    // the predicted output tokens a waiting request is credited per second
+    // under the sjf policy, so that long requests are not starved.
+    DEFINE_ARG(double, sjf_aging_tokens_per_second) = 50.0;
+
+    // comma separated tenant=weight pairs for the wfq policy, the tenants
+    // not listed have a weight of 1.
+    DEFINE_ARG(std::string, tenant_weights);
+
+    // the max fraction of the kv cache blocks a tenant can hold under the
+    // wfq policy, new requests of a tenant over it wait until it is below.
+    DEFINE_ARG(double, max_tenant_kv_cache_share) = 1.0;
+
+    // default time to first token target in milliseconds for the slo policy,
+    // 0 means no target.
+    DEFINE_ARG(int64_t, ttft_slo_ms) = 0;
+
+    // default inter token latency target in milliseconds for the slo policy,
+    // 0 means no target.
+    DEFINE_ARG(int64_t, itl_slo_ms) = 0;
+
+    // the number of waiting requests of the same priority at the front of the
+    // queue to pick from by their cached prefix length, which admits requests
+    // sharing a prefix together before its blocks are evicted. 0 or 1 to
+    // admit requests in the queue order.
+    DEFINE_ARG(int32_t, prefix_admission_window) = 0;
+
+    // the maximum number of times a waiting request can be passed over by
+    // the prefix aware admission before it is admitted in the queue order.
+    DEFINE_ARG(int32_t, max_admission_skips) = 8;
+
+    // hold new requests sharing a prompt prefix with a running prefill until
+    // its blocks are in the prefix cache, instead of computing the prefix
+    // again. only used when prefix cache is enabled.
+    DEFINE_ARG(bool, wait_for_inflight_prefix) = true;
+
+    // the host to device bandwidth in GB/s, used to weigh swapping the kv
+    // cache of a preempted request against recomputing it. 0 to always swap
+    // when host blocks are available.
+    DEFINE_ARG(double, swap_bandwidth_gbps) = 16.0;
+
+    // the max number of kv cache blocks copied per step to move the blocks
+    // of running sequences into consecutive blocks, only in steps without
+    // prompt tokens. 0 to disable the compaction.
+    DEFINE_ARG(int32_t, max_compaction_blocks_per_step) = 0;
+
+    // seconds the kv cache of a session stays pinned in the prefix cache
+    // after its last turn, see Request::session_id.
+    DEFINE_ARG(int64_t, session_ttl_seconds) = 300;
+
+    // the max fraction of the kv cache blocks pinned by sessions, the
+    // sessions closest to expiry are unpinned beyond it.
+    DEFINE_ARG(double, max_session_kv_cache_share) = 0.5;
+
+    // prune the best_of candidates whose cumulative logprob falls behind the
+    // n-th best one by more than the margin, releasing their kv cache before
+    // the request finishes. 0 to keep all candidates.
+    DEFINE_ARG(double, best_of_prune_margin) = 0;
+
+    // the number of generated tokens between the prunings of the candidates
+    DEFINE_ARG(int32_t, best_of_prune_interval) = 16;
+
+    // the number of threads to detokenize and send responses, each request
+    // is pinned to one of them.
+    DEFINE_ARG(int32_t, num_response_threads) = 4;
+
+    // the cpus to run the response threads on, empty to float freely
+    DEFINE_ARG(std::vector<int32_t>, response_cpus);
   };
 
   ContinuousScheduler(Engine* engine, const Options& options);
@@ -57,15 +179,145 @@ class ContinuousScheduler final : public Scheduler {
     CHECK_GT(old_value, 0) << "pending requests underflow";
   }
 
+  bool is_idle() const override {
+    return pending_requests_.load(std::memory_order_acquire) == 0 &&
+           num_requests_.load(std::memory_order_acquire) == 0;
+  }
+
+  // hand the requests over to the decode scheduler once their prompts are
+  // prefilled, so that the engine of this scheduler only runs prefills. the
+  // decode scheduler runs on another engine of the same model, and pulls the
+  // kv cache of the requests from this engine. not thread safe, should be
+  // called before the scheduler is stepped.
+  void set_decode_scheduler(ContinuousScheduler* decode_scheduler);
+
+  // send the outputs through the response threads of the other scheduler,
+  // e.g. a data parallel replica of the same model, instead of its own, so
+  // that the replicas share one response pipeline. not thread safe, should
+  // be called before the scheduler is stepped.
+  void share_response_handler(const ContinuousScheduler& other);
+
+  // schedule a request prefilled by the src scheduler, whose kv cache is in
+  // the blocks of the src engine. the request joins in decode state once its
+  // kv cache is copied into the blocks of this engine. thread safe, blocks
+  // while the queue is full.
+  void schedule_prefilled(Request* request, ContinuousScheduler* src);
+
+  // export the kv cache of the longest cached prefix of the token ids into a
+  // buffer with the prefix, e.g. to resume a multi-turn session on another
+  // replica or to move it off a replica being drained. the kv cache is
+  // quantized to int8 if quantize is true. the buffer is empty if nothing is
+  // cached. thread safe, runs on the scheduling loop.
+  folly::SemiFuture<std::string> export_prefix_cache(
+      std::vector<int32_t> token_ids,
+      bool quantize);
+
+  // import a buffer exported by a replica serving the same model with the
+  // same parallelism and block size into the prefix cache, so that requests
+  // sharing the prefix skip its prefill. returns the number of newly cached
+  // tokens, 0 if the buffer doesn't fit. thread safe, runs on the scheduling
+  // loop.
+  folly::SemiFuture<size_t> import_prefix_cache(std::string buffer);
+
+  // grow or shrink the kv cache pool to n_blocks blocks at runtime, e.g. to
+  // give device memory back to a colocated model or take it back. growing
+  // takes effect right away, while shrinking stops allocating the blocks at
+  // the end and finishes once the sequences holding them are done. returns
+  // false if the kv cache is not resizable, out of device memory, or another
+  // shrink is in progress. thread safe, runs on the scheduling loop.
+  folly::SemiFuture<bool> resize_kv_cache(int64_t n_blocks);
+
+  // unpin the kv cache of the session, e.g. once it is closed by the client.
+  // thread safe, runs on the scheduling loop.
+  void unpin_session(std::string session_id);
+
+  // the latest load of the scheduler, refreshed every
+  // kLoadReportIntervalMs by the scheduling loop. thread safe.
+  LoadReport load_report() const;
+
  private:
+  static constexpr int64_t kLoadReportIntervalMs = 10;
+
+  // refresh the load report if it is older than kLoadReportIntervalMs
+  void maybe_update_load_report(size_t num_decode_tokens);
+
+  // run the task on the scheduling loop, where the blocks and the engine are
+  // owned. the task is counted as a pending request until it is done.
+  void run_in_loop(folly::Function<void()> task);
+
+  // run the tasks queued by run_in_loop
+  void run_pending_tasks();
+
+  std::string export_prefix_cache_in_loop(const std::vector<int32_t>& token_ids,
+                                          bool quantize);
+  size_t import_prefix_cache_in_loop(const std::string& buffer);
+  void resize_kv_cache_in_loop(int64_t n_blocks, folly::Promise<bool> promise);
+
+  // pin the cached blocks of the tokens of a finished request of the session
+  // until the session expires, replacing its previous pin.
+  void pin_session(const std::string& session_id,
+                   const std::vector<int32_t>& token_ids);
+
+  // unpin the expired sessions, checked once per second
+  void unpin_expired_sessions();
+
+  // release the kv cache of the drained blocks once the shrink in progress
+  // finishes
+  void finish_kv_cache_shrink();
+
   Batch wait_for_batch(const absl::Duration& timeout);
 
   // build a batch of requests from the priority queue
   Batch build_sequence_batch();
 
+  // pop the next request to schedule from the priority queue. with the
+  // prefix admission window, the waiting request with the longest cached
+  // prefix among the front ones is popped, see
+  // Options::prefix_admission_window.
+  Request* pop_next_request();
+
+  // check if the new request shares a prompt prefix with a running prefill
+  // beyond the blocks already in the prefix cache
+  bool has_inflight_prefix(const Request* request) const;
+
+  // move new requests from the request queue to the priority queue
+  void ingest_new_requests();
+
+  // release the blocks and the ownership of a finished or cancelled request
+  void finish_request(Request* request);
+
+  // whether all sequences of the request have their prompts in the kv cache
+  // on device, so that the request can be handed over to the decode scheduler
+  bool is_prefilled(const Request* request) const;
+
+  // hand the prefilled request over to the decode scheduler, its blocks are
+  // held until the decode scheduler has copied them.
+  void hand_over(Request* request);
+
+  // move the prefilled requests into the priority queue once blocks are
+  // available, copying their kv cache from the src engines in one batch.
+  void ingest_prefilled_requests();
+
+  // return the blocks of a handed over request, e.g. after its kv cache is
+  // copied by the decode scheduler. thread safe
+  void return_blocks(std::vector<Block> blocks, bool cacheable);
+
+  // release the blocks returned by the decode scheduler
+  void release_returned_blocks();
+
   // process the batch output
   void process_batch_output();
 
+  // record the step of the batch in the traces of the running requests
+  void trace_running_requests();
+
+  // select the tokens of the beams of the request among their top tokens
+  // once all of them are generated. the selected beams are forked into the
+  // beams that are not continued, sharing the kv cache blocks. the beams left
+  // without continuation are erased, so the pointers to the sequences of the
+  // request are invalidated.
+  void update_beams(Request* request);
+
   // allocate blocks for a sequence, honoring the tokens budget.
   // * for prefill sequence, the allocated_tokens will be within
   // [1, num_prompt_tokens - num_tokens_in_kv_cache].
@@ -76,6 +328,82 @@ class ContinuousScheduler final : public Scheduler {
                            size_t token_budget,
                            size_t* actual_tokens);
 
+  // the fair share state of a tenant under the wfq policy
+  struct TenantState {
+    // relative share of the capacity
+    double weight = 1.0;
+    // the tokens processed for the tenant over its weight. it is lifted to
+    // the least among the active tenants when the tenant becomes active, so
+    // no credit is accumulated while idle.
+    double virtual_time = 0;
+    // number of requests of the tenant in the scheduler
+    size_t num_requests = 0;
+    // number of blocks held by the preemptable requests of the tenant
+    size_t num_blocks = 0;
+  };
+
+  // get the tenant state of the request, nullptr without the wfq policy
+  TenantState* tenant_state(const Request* request);
+
+  // count the request in its tenant, which becomes active if it was idle
+  void add_tenant_request(const Request* request);
+
+  void remove_tenant_request(const Request* request);
+
+  // refresh the block usage of the tenants, forget the idle ones and reorder
+  // the waiting requests by the virtual times of their tenants.
+  void update_tenants();
+
+  // pop the request to preempt from the preemptable requests for the
+  // candidate. with the wfq policy, the lowest priority request of a tenant
+  // holding more than its share of blocks goes first. otherwise among the
+  // lowest priority requests, the one losing the least work per freed block,
+  // which grows with the times it was preempted to avoid thrashing.
+  Request* pop_request_to_preempt(const Request* candidate);
+
+  // preempt the request by swapping out its kv cache or releasing it to be
+  // recomputed later, whichever is estimated to be cheaper.
+  void preempt(Request* request);
+
+  // estimated seconds to swap the kv cache of the request out and back in,
+  // infinite if swapping is not possible.
+  double swap_seconds(const Request* request) const;
+
+  // estimated seconds to recompute the kv cache of the request, infinite if
+  // there is no latency estimate yet.
+  double recompute_seconds(const Request* request) const;
+
+  // the predicted number of output tokens of the request, 0 for embeddings
+  size_t predict_output_tokens(const Request* request) const;
+
+  // rank the request by its predicted remaining output tokens less the credit
+  // for its waiting time, see Options::sjf_aging_tokens_per_second.
+  void update_predicted_rank(Request* request) const;
+
+  // the number of blocks the sequences of the request still need for their
+  // predicted outputs.
+  size_t num_predicted_blocks(const Request* request) const;
+
+  // get the max number of prefill tokens for the next batch that keeps the
+  // waiting decode sequences within their itl target.
+  size_t max_prefill_tokens() const;
+
+  // the max number of tokens for the next batch, tuned online with
+  // Options::target_step_time_ms.
+  size_t max_tokens_per_batch() const;
+
+  // move the scattered blocks of the longest running sequences into
+  // consecutive blocks, copying at most max_compaction_blocks_per_step blocks.
+  void compact_blocks();
+
+  // run the batch, overlapping host side work with the model execution, and
+  // update the estimated latency per token
+  void execute_batch(Batch& batch);
+
+  // log the prefix cache hit rate and the hottest prefixes periodically,
+  // see FLAGS_prefix_cache_dump_interval_s
+  void maybe_dump_prefix_cache();
+
   const Options options_;
 
   // the engine to run the batch
@@ -93,10 +421,11 @@ class ContinuousScheduler final : public Scheduler {
 
   // Requests with HIGH priority are processed first, followed by MEDIUM
   // priority requests, and finally LOW priority requests. Within each priority
-  // level, requests are handled on First-Come-First-Served (FCFS) basis.
-  using MinHeap =
-      std::priority_queue<Request*, std::vector<Request*>, RequestPtrGreater>;
-  MinHeap priority_queue_;
+  // level, requests are handled on First-Come-First-Served (FCFS) basis, or
+  // on Earliest-Deadline-First basis for the slo policy.
+  // The running requests are requeued in order every step without a heap
+  // push each.
+  RequestQueue priority_queue_;
 
   // a batch of requests in running state, sorted by priority from high to low.
   std::vector<Request*> running_requests_;
@@ -111,12 +440,109 @@ class ContinuousScheduler final : public Scheduler {
   // low.
   std::deque<Request*> preemptable_requests_;
 
-  std::unique_ptr<ResponseHandler> response_handler_;
+  // shared with the other replicas of the model, see share_response_handler()
+  std::shared_ptr<ResponseHandler> response_handler_;
 
   bool enable_prefix_cache_ = false;
 
+  // whether to use the slo scheduling policy
+  bool enable_slo_policy_ = false;
+
+  // whether to use the wfq scheduling policy
+  bool enable_fair_policy_ = false;
+
+  // whether to use the sjf scheduling policy
+  bool enable_sjf_policy_ = false;
+
+  // predicts the output tokens of the requests for the sjf policy
+  OutputLengthPredictor output_length_predictor_;
+
+  // the weights of the tenants for the wfq policy
+  absl::flat_hash_map<std::string, double> tenant_weights_;
+
+  // the tenants with requests in the scheduler, or ahead of the active ones
+  // in virtual time. node based to keep the states stable across inserts.
+  std::unordered_map<std::string, TenantState> tenants_;
+
+  // the total weight of the active tenants
+  double active_tenant_weight_ = 0;
+
+  // the max number of blocks a tenant can hold to admit new requests
+  size_t max_tenant_blocks_ = std::numeric_limits<size_t>::max();
+
+  // number of tokens in the last scheduled batch
+  size_t num_batch_tokens_ = 0;
+
+  // exponential moving average of the step latency per token in seconds
+  double latency_per_token_ = 0.0;
+
+  // tunes the tokens per batch, null if max_tokens_per_batch is fixed
+  std::unique_ptr<BatchBudgetController> batch_budget_controller_;
+
+  // the latest load report, see load_report()
+  mutable std::mutex load_report_mutex_;
+  LoadReport load_report_;
+  absl::Time last_load_report_time_ = absl::InfinitePast();
+
+  // blocks released by the finished requests since the last load report
+  size_t num_released_blocks_ = 0;
+
+  // exponential moving average of the blocks released per second
+  double block_release_rate_ = 0;
+
+  // the time of the last dump of the prefix cache
+  absl::Time last_prefix_cache_dump_time_ = absl::Now();
+
   // the number of requests that are waiting to be scheduled
   std::atomic<size_t> pending_requests_{0};
+
+  // the number of scheduled requests that are not released yet
+  std::atomic<size_t> num_requests_{0};
+
+  // the scheduler to hand prefilled requests over to, null if this scheduler
+  // runs both prefills and decodes.
+  ContinuousScheduler* decode_scheduler_ = nullptr;
+
+  // requests prefilled by other schedulers with their src schedulers
+  struct PrefilledRequest {
+    Request* request = nullptr;
+    ContinuousScheduler* src = nullptr;
+  };
+  folly::MPMCQueue<PrefilledRequest> prefilled_queue_;
+
+  // prefilled requests waiting for blocks, in arrival order
+  std::deque<PrefilledRequest> waiting_prefilled_requests_;
+
+  // blocks of the handed over requests returned by the decode scheduler
+  struct ReturnedBlocks {
+    std::vector<Block> blocks;
+    // whether the blocks were inserted into the prefix cache
+    bool cacheable = false;
+  };
+  folly::MPMCQueue<ReturnedBlocks> returned_blocks_queue_;
+
+  // the number of handed over requests whose blocks are not returned yet
+  size_t num_handed_over_requests_ = 0;
+
+  // tasks to run on the scheduling loop, see run_in_loop
+  folly::MPMCQueue<folly::Function<void()>> tasks_queue_;
+
+  // the blocks pinned by the sessions, see pin_session
+  struct PinnedSession {
+    std::vector<Block> blocks;
+    absl::Time expire_time;
+  };
+  std::unordered_map<std::string, PinnedSession> pinned_sessions_;
+
+  // the number of blocks pinned by the sessions, the blocks shared by
+  // sessions are counted once per session
+  size_t num_pinned_session_blocks_ = 0;
+
+  // the time of the last check for expired sessions
+  absl::Time last_session_expiry_time_ = absl::Now();
+
+  // the promise of the kv cache shrink in progress
+  std::optional<folly::Promise<bool>> kv_cache_shrink_promise_;
 };
 
 }  // namespace llm
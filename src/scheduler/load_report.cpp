@@ -0,0 +1,46 @@
+#include "load_report.h"
+
+#include <algorithm>
+#include <cstddef>
+
+namespace llm {
+
+double LoadReport::kv_cache_free_ratio() const {
+  if (num_total_blocks == 0) {
+    return 0;
+  }
+  return static_cast<double>(num_free_blocks) / num_total_blocks;
+}
+
+size_t LoadReport::num_headroom_blocks() const {
+  return num_free_blocks - std::min(num_waiting_blocks, num_free_blocks);
+}
+
+double LoadReport::estimated_ttft_seconds(size_t prompt_len) const {
+  prompt_len = std::max<size_t>(prompt_len, 1);
+  double compute_seconds = 0;
+  if (latency_per_token > 0 && max_tokens_per_batch > 0) {
+    // leave at least one token per step for the prefills
+    const size_t decode_tokens =
+        std::min(num_decode_tokens, max_tokens_per_batch - 1);
+    const size_t prefill_tokens_per_step =
+        max_tokens_per_batch - decode_tokens;
+    const size_t prefill_tokens = num_waiting_tokens + prompt_len;
+    const size_t num_steps = (prefill_tokens + prefill_tokens_per_step - 1) /
+                             prefill_tokens_per_step;
+    compute_seconds =
+        latency_per_token * (prefill_tokens + num_steps * decode_tokens);
+  }
+
+  double kv_cache_seconds = 0;
+  if (block_release_rate > 0 && block_size > 0) {
+    const size_t num_blocks = (prompt_len + block_size - 1) / block_size;
+    const size_t headroom = num_headroom_blocks();
+    if (num_blocks > headroom) {
+      kv_cache_seconds = (num_blocks - headroom) / block_release_rate;
+    }
+  }
+  return std::max(compute_seconds, kv_cache_seconds);
+}
+
+}  // namespace llm
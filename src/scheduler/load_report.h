@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+
+namespace llm {
+
+// A snapshot of the load of a scheduler, published periodically by the
+// scheduling loop for load aware routing.
+struct LoadReport {
+  // requests waiting to be scheduled, including the ones not ingested yet
+  size_t num_waiting_requests = 0;
+
+  // tokens of the waiting requests to process before their first tokens
+  size_t num_waiting_tokens = 0;
+
+  // blocks the waiting requests need for their tokens to process
+  size_t num_waiting_blocks = 0;
+
+  // requests and sequences running in the last step
+  size_t num_running_requests = 0;
+  size_t num_running_sequences = 0;
+
+  // tokens of the running sequences, in the kv cache or to be
+  size_t num_running_tokens = 0;
+
+  // blocks not held by sequences, free or evictable from the prefix cache
+  size_t num_free_blocks = 0;
+  size_t num_total_blocks = 0;
+  size_t block_size = 0;
+
+  // moving average of the blocks released by the finished requests per
+  // second, 0 if unknown
+  double block_release_rate = 0;
+
+  // the max number of tokens per step
+  size_t max_tokens_per_batch = 0;
+
+  // the decode tokens of the last step, taking their share of each step
+  size_t num_decode_tokens = 0;
+
+  // moving average of the step latency per token in seconds, 0 if unknown
+  double latency_per_token = 0;
+
+  // the ratio of the free kv cache blocks in [0, 1]
+  double kv_cache_free_ratio() const;
+
+  // the free blocks left for a new request once the waiting ones are admitted
+  size_t num_headroom_blocks() const;
+
+  // estimated seconds to the first token of a new request with prompt_len
+  // tokens, the longer of the two waits:
+  // * compute: queued behind the waiting tokens, each step prefills the
+  // tokens left over by the decodes of the running sequences.
+  // * kv cache: the blocks its prompt needs beyond the headroom are released
+  // by the finishing requests at block_release_rate.
+  // each wait is 0 without an estimate of its rate.
+  double estimated_ttft_seconds(size_t prompt_len) const;
+};
+
+}  // namespace llm
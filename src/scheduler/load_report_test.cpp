@@ -0,0 +1,68 @@
+#include "load_report.h"
+
+#include <gtest/gtest.h>
+
+namespace llm {
+
+TEST(LoadReportTest, KvCacheFreeRatio) {
+  LoadReport report;
+  EXPECT_EQ(report.kv_cache_free_ratio(), 0);
+
+  report.num_free_blocks = 25;
+  report.num_total_blocks = 100;
+  EXPECT_DOUBLE_EQ(report.kv_cache_free_ratio(), 0.25);
+
+  // the waiting requests come first
+  report.num_waiting_blocks = 10;
+  EXPECT_EQ(report.num_headroom_blocks(), 15);
+  report.num_waiting_blocks = 30;
+  EXPECT_EQ(report.num_headroom_blocks(), 0);
+}
+
+TEST(LoadReportTest, EstimatedTtft) {
+  LoadReport report;
+  report.max_tokens_per_batch = 100;
+  // no estimate before the first step
+  EXPECT_EQ(report.estimated_ttft_seconds(50), 0);
+
+  report.latency_per_token = 0.001;
+  // one step for the prompt
+  EXPECT_DOUBLE_EQ(report.estimated_ttft_seconds(50), 0.05);
+
+  // queued behind the waiting tokens
+  report.num_waiting_tokens = 150;
+  EXPECT_DOUBLE_EQ(report.estimated_ttft_seconds(50), 0.2);
+
+  // 3 steps of 80 prefill tokens and 20 decode tokens each
+  report.num_decode_tokens = 20;
+  EXPECT_DOUBLE_EQ(report.estimated_ttft_seconds(50), 0.26);
+
+  // the prefills get at least one token per step
+  report.num_waiting_tokens = 0;
+  report.num_decode_tokens = 200;
+  EXPECT_DOUBLE_EQ(report.estimated_ttft_seconds(2), 0.2);
+}
+
+TEST(LoadReportTest, EstimatedTtftForBlocks) {
+  LoadReport report;
+  report.block_size = 16;
+  report.num_total_blocks = 100;
+  report.num_free_blocks = 10;
+  report.num_waiting_blocks = 6;
+  // no estimate before the first request finishes
+  EXPECT_EQ(report.estimated_ttft_seconds(160), 0);
+
+  report.block_release_rate = 2;
+  // fits in the headroom of 4 blocks
+  EXPECT_EQ(report.estimated_ttft_seconds(64), 0);
+  // 6 more blocks to release
+  EXPECT_DOUBLE_EQ(report.estimated_ttft_seconds(160), 3);
+
+  // the longer of the compute and the kv cache waits
+  report.max_tokens_per_batch = 100;
+  report.latency_per_token = 0.01;
+  EXPECT_DOUBLE_EQ(report.estimated_ttft_seconds(160), 3);
+  EXPECT_DOUBLE_EQ(report.estimated_ttft_seconds(64), 0.64);
+}
+
+}  // namespace llm
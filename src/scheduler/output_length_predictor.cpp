@@ -0,0 +1,51 @@
+#include "output_length_predictor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace llm {
+namespace {
+
+// the number of bits to represent n, i.e. floor(log2(n)) + 1 for n > 0
+uint32_t bit_width(size_t n) {
+  uint32_t width = 0;
+  while (n > 0) {
+    ++width;
+    n >>= 1;
+  }
+  return width;
+}
+
+}  // namespace
+
+uint32_t OutputLengthPredictor::bucket_key(size_t num_prompt_tokens,
+                                           size_t max_tokens) {
+  return (bit_width(num_prompt_tokens) << 8) | bit_width(max_tokens);
+}
+
+size_t OutputLengthPredictor::predict(size_t num_prompt_tokens,
+                                      size_t max_tokens) const {
+  const size_t max_prediction = std::max<size_t>(max_tokens, 1);
+  const auto it = buckets_.find(bucket_key(num_prompt_tokens, max_tokens));
+  if (it == buckets_.end() || it->second.num_samples < kMinSamples) {
+    return max_prediction;
+  }
+  const auto prediction =
+      static_cast<size_t>(std::lround(it->second.avg_tokens));
+  return std::clamp<size_t>(prediction, 1, max_prediction);
+}
+
+void OutputLengthPredictor::observe(size_t num_prompt_tokens,
+                                    size_t max_tokens,
+                                    size_t num_generated_tokens) {
+  Bucket& bucket = buckets_[bucket_key(num_prompt_tokens, max_tokens)];
+  ++bucket.num_samples;
+  const double weight =
+      std::max(1.0 / static_cast<double>(bucket.num_samples), kSampleWeight);
+  bucket.avg_tokens +=
+      weight * (static_cast<double>(num_generated_tokens) - bucket.avg_tokens);
+}
+
+}  // namespace llm
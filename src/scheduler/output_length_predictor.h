@@ -0,0 +1,45 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace llm {
+
+// Predicts the number of tokens a request generates from the requests that
+// finished before with a similar prompt length and max_tokens. Requests are
+// bucketed by the log2 of both, and the prediction is the moving average of
+// the tokens generated by the requests of the bucket, capped by max_tokens.
+// max_tokens is predicted until a bucket has seen enough requests. Not thread
+// safe.
+class OutputLengthPredictor final {
+ public:
+  // the number of finished requests of a bucket before it is trusted
+  static constexpr size_t kMinSamples = 4;
+
+  // the weight of a new sample in the moving average once the bucket has
+  // seen 1 / kSampleWeight requests, the plain average before.
+  static constexpr double kSampleWeight = 0.05;
+
+  // the predicted number of generated tokens, within [1, max_tokens]
+  size_t predict(size_t num_prompt_tokens, size_t max_tokens) const;
+
+  // record the number of tokens generated by a finished request
+  void observe(size_t num_prompt_tokens,
+               size_t max_tokens,
+               size_t num_generated_tokens);
+
+ private:
+  struct Bucket {
+    // the moving average of the generated tokens
+    double avg_tokens = 0;
+    size_t num_samples = 0;
+  };
+
+  static uint32_t bucket_key(size_t num_prompt_tokens, size_t max_tokens);
+
+  absl::flat_hash_map<uint32_t, Bucket> buckets_;
+};
+
+}  // namespace llm
@@ -0,0 +1,47 @@
+#include "output_length_predictor.h"
+
+#include <gtest/gtest.h>
+
+namespace llm {
+
+TEST(OutputLengthPredictorTest, Basic) {
+  OutputLengthPredictor predictor;
+  // max_tokens is predicted without history
+  EXPECT_EQ(predictor.predict(/*num_prompt_tokens=*/100, /*max_tokens=*/256),
+            256);
+
+  // the bucket is trusted after kMinSamples requests
+  for (size_t i = 0; i < OutputLengthPredictor::kMinSamples; ++i) {
+    EXPECT_EQ(predictor.predict(100, 256), 256);
+    predictor.observe(100, 256, /*num_generated_tokens=*/20 + 10 * i);
+  }
+  // the average of 20, 30, 40 and 50
+  EXPECT_EQ(predictor.predict(100, 256), 35);
+  // similar prompt length and max_tokens share the bucket
+  EXPECT_EQ(predictor.predict(127, 300), 35);
+  // capped by max_tokens
+  EXPECT_EQ(predictor.predict(127, 30), 30);
+
+  // other prompt lengths or max_tokens are not affected
+  EXPECT_EQ(predictor.predict(10, 256), 256);
+  EXPECT_EQ(predictor.predict(100, 1024), 1024);
+
+  // at least one token
+  EXPECT_EQ(predictor.predict(100, 0), 1);
+}
+
+TEST(OutputLengthPredictorTest, MovingAverage) {
+  OutputLengthPredictor predictor;
+  for (size_t i = 0; i < 100; ++i) {
+    predictor.observe(1000, 512, 500);
+  }
+  EXPECT_EQ(predictor.predict(1000, 512), 500);
+
+  // the recent requests weigh more than the old ones
+  for (size_t i = 0; i < 100; ++i) {
+    predictor.observe(1000, 512, 100);
+  }
+  EXPECT_LT(predictor.predict(1000, 512), 150);
+}
+
+}  // namespace llm
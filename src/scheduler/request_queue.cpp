@@ -0,0 +1,60 @@
+#include "request_queue.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace llm {
+
+RequestQueue::RequestQueue(Comparator comp) : comp_(std::move(comp)) {}
+
+void RequestQueue::push(Request* request) {
+  heap_.push_back(request);
+  std::push_heap(heap_.begin(), heap_.end(), comp_);
+}
+
+void RequestQueue::push_running(Request* request) {
+  if (run_sorted_ && !run_.empty() && comp_(request, run_.back())) {
+    run_sorted_ = false;
+  }
+  run_.push_back(request);
+}
+
+Request* RequestQueue::top() {
+  CHECK(!empty()) << "empty request queue";
+  return top_in_run() ? run_.back() : heap_.front();
+}
+
+void RequestQueue::pop() {
+  CHECK(!empty()) << "empty request queue";
+  if (top_in_run()) {
+    run_.pop_back();
+  } else {
+    std::pop_heap(heap_.begin(), heap_.end(), comp_);
+    heap_.pop_back();
+  }
+}
+
+void RequestQueue::reorder() {
+  std::make_heap(heap_.begin(), heap_.end(), comp_);
+  run_sorted_ = false;
+}
+
+void RequestQueue::sort_run() {
+  if (!run_sorted_) {
+    std::sort(run_.begin(), run_.end(), comp_);
+    run_sorted_ = true;
+  }
+}
+
+bool RequestQueue::top_in_run() {
+  sort_run();
+  if (run_.empty()) {
+    return false;
+  }
+  // the heap wins the ties
+  return heap_.empty() || comp_(heap_.front(), run_.back());
+}
+
+}  // namespace llm
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+namespace llm {
+
+struct Request;
+
+// A priority queue of requests in two lanes: a heap for the requests that
+// arrive or are deferred one by one, and a sorted run for the requests that
+// ran in the last step, which are requeued together every step. The run is
+// usually still in order as the keys of most policies don't change while
+// running, so requeueing takes a linear check instead of a heap push per
+// request, and popping from the run takes O(1). The top is the better one of
+// the two lanes.
+class RequestQueue final {
+ public:
+  // returns true if a is served after b
+  using Comparator = std::function<bool(const Request* a, const Request* b)>;
+
+  explicit RequestQueue(Comparator comp);
+
+  void push(Request* request);
+
+  // requeue a request that ran in the last step, preferably from the lowest
+  // priority to the highest to keep the run in order.
+  void push_running(Request* request);
+
+  Request* top();
+
+  void pop();
+
+  bool empty() const { return heap_.empty() && run_.empty(); }
+
+  size_t size() const { return heap_.size() + run_.size(); }
+
+  // call the function with each request in the queue, in no specific order
+  template <typename Fn>
+  void for_each(Fn&& fn) const {
+    for (Request* request : heap_) {
+      fn(request);
+    }
+    for (Request* request : run_) {
+      fn(request);
+    }
+  }
+
+  // restore the order after the keys of the requests change
+  void reorder();
+
+ private:
+  // sort the run if requests were requeued out of order since the last sort
+  void sort_run();
+
+  // whether the top is from the run
+  bool top_in_run();
+
+  Comparator comp_;
+
+  // a max-heap by comp_
+  std::vector<Request*> heap_;
+
+  // sorted by comp_ in ascending order, the next request is at the back
+  std::vector<Request*> run_;
+  bool run_sorted_ = true;
+};
+
+}  // namespace llm
@@ -0,0 +1,76 @@
+#include "request_queue.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <vector>
+
+#include "request/request.h"
+
+namespace llm {
+namespace {
+// the requests with lower ranks are served first
+bool rank_greater(const Request* a, const Request* b) {
+  return a->predicted_rank > b->predicted_rank;
+}
+
+std::vector<std::unique_ptr<Request>> create_requests(
+    const std::vector<double>& ranks) {
+  std::vector<std::unique_ptr<Request>> requests;
+  for (const double rank : ranks) {
+    auto request = std::make_unique<Request>("",
+                                             std::vector<int32_t>{1},
+                                             /*seq_capacity=*/10,
+                                             /*n=*/1,
+                                             /*best_of=*/1,
+                                             /*logprobs=*/false);
+    request->predicted_rank = rank;
+    requests.push_back(std::move(request));
+  }
+  return requests;
+}
+
+std::vector<double> pop_all(RequestQueue* queue) {
+  std::vector<double> ranks;
+  while (!queue->empty()) {
+    ranks.push_back(queue->top()->predicted_rank);
+    queue->pop();
+  }
+  return ranks;
+}
+}  // namespace
+
+TEST(RequestQueueTest, MergeLanes) {
+  auto requests = create_requests({0, 1, 2, 3, 4, 5});
+  RequestQueue queue(rank_greater);
+  // the running requests are requeued from the lowest priority
+  queue.push_running(requests[4].get());
+  queue.push_running(requests[2].get());
+  queue.push_running(requests[1].get());
+  queue.push(requests[5].get());
+  queue.push(requests[0].get());
+  queue.push(requests[3].get());
+  EXPECT_EQ(queue.size(), 6);
+  EXPECT_EQ(pop_all(&queue), std::vector<double>({0, 1, 2, 3, 4, 5}));
+}
+
+TEST(RequestQueueTest, OutOfOrder) {
+  auto requests = create_requests({0, 1, 2, 3});
+  RequestQueue queue(rank_greater);
+  queue.push_running(requests[1].get());
+  queue.push_running(requests[3].get());
+  queue.push_running(requests[0].get());
+  queue.push(requests[2].get());
+  EXPECT_EQ(queue.top(), requests[0].get());
+
+  // the keys change while queued
+  requests[0]->predicted_rank = 10;
+  requests[2]->predicted_rank = -1;
+  size_t n_requests = 0;
+  queue.for_each([&](Request* /*request*/) { ++n_requests; });
+  EXPECT_EQ(n_requests, 4);
+  queue.reorder();
+  EXPECT_EQ(pop_all(&queue), std::vector<double>({-1, 1, 3, 10}));
+}
+
+}  // namespace llm
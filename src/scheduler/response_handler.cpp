@@ -1,10 +1,16 @@
 #include "response_handler.h"
 
-#include <absl/synchronization/notification.h>
+#include <absl/container/inlined_vector.h>
+#include <absl/hash/hash.h>
+#include <absl/synchronization/blocking_counter.h>
 #include <absl/time/clock.h>
 #include <glog/logging.h>
 
 #include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 #include "common/metrics.h"
 #include "request/request.h"
@@ -28,77 +34,167 @@ DEFINE_HISTOGRAM(
 
 namespace llm {
 
-ResponseHandler::ResponseHandler(const Tokenizer* tokenizer)
-    : tokenizer_(tokenizer->clone()) {}
+ResponseHandler::ResponseHandler(const Tokenizer* tokenizer,
+                                 size_t num_threads,
+                                 const std::vector<int32_t>& cpus)
+    : response_threadpool_(num_threads) {
+  response_threadpool_.set_affinity(cpus);
+  tokenizers_.reserve(num_threads);
+  for (size_t i = 0; i < num_threads; ++i) {
+    tokenizers_.push_back(tokenizer->clone());
+  }
+}
+
+size_t ResponseHandler::shard_of(const Request* request) const {
+  return absl::Hash<const Request*>{}(request) % tokenizers_.size();
+}
 
 void ResponseHandler::on_request_finish(std::unique_ptr<Request> request) {
+  if (request->trace != nullptr) {
+    request->trace->on_finished(absl::Now());
+  }
+  const size_t shard = shard_of(request.get());
   // schedule the response handling
-  response_threadpool_.schedule([tokenizer = tokenizer_.get(),
+  response_threadpool_.schedule(shard,
+                                [tokenizer = tokenizers_[shard].get(),
                                  request = std::move(request)]() {
     AUTO_COUNTER(non_stream_responsing_latency_seconds);
 
     // update the metrics for the request
     HISTOGRAM_OBSERVE(end_2_end_latency_seconds, request->elapsed_seconds());
 
-    request->on_output(request->build_output(*tokenizer));
+    if (request->trace == nullptr) {
+      request->on_output(request->build_output(*tokenizer));
+      return;
+    }
+    const absl::Time start = absl::Now();
+    auto output = request->build_output(*tokenizer);
+    request->trace->add_detokenize_duration(absl::Now() - start);
+    request->on_output(output);
+    const Usage usage = output.usage.value_or(Usage());
+    LOG(INFO) << "Request trace: "
+              << request->trace->to_json(usage.num_prompt_tokens,
+                                         usage.num_generated_tokens);
   });
 }
 
 void ResponseHandler::on_request_stream(Request* request) {
-  CHECK(request->is_streaming()) << "request is not a streaming request";
-
-  std::vector<size_t> indexes;
-  std::vector<size_t> num_tokens;
-  for (size_t i = 0; i < request->sequences.size(); ++i) {
-    Sequence& seq = request->sequences[i];
-    if (seq.is_closed()) {
-      // skip already closed sequences
-      continue;
-    }
+  on_requests_stream({request});
+}
 
-    // check if the sequence has enough tokens to output
-    if (seq.has_pending_tokens() || seq.is_finished()) {
-      indexes.push_back(i);
-      num_tokens.push_back(seq.num_tokens());
-    }
+void ResponseHandler::on_requests_stream(
+    const std::vector<Request*>& requests) {
+  // a request with the (index, num_tokens) of the sequences to output
+  struct StreamRequest {
+    Request* request = nullptr;
+    absl::InlinedVector<std::pair<size_t, size_t>, 1> seqs;
+  };
+  std::vector<std::vector<StreamRequest>> shards(tokenizers_.size());
+  for (Request* request : requests) {
+    CHECK(request->is_streaming()) << "request is not a streaming request";
+
+    StreamRequest stream_request{request, {}};
+    for (size_t i = 0; i < request->sequences.size(); ++i) {
+      Sequence& seq = request->sequences[i];
+      if (seq.is_closed()) {
+        // skip already closed sequences
+        continue;
+      }
 
-    // close the sequence after sending finish reason
-    if (seq.is_finished()) {
-      seq.close();
-    }
-  }
+      // check if the sequence has enough tokens to output
+      if (seq.has_pending_tokens() || seq.is_finished()) {
+        stream_request.seqs.emplace_back(i, seq.num_tokens());
+      }
 
-  // output the delta text til the end of the sequence to the client
-  response_threadpool_.schedule([request,
-                                 indexes = std::move(indexes),
-                                 num_tokens = std::move(num_tokens),
-                                 tokenizer = tokenizer_.get()]() {
-    AUTO_COUNTER(stream_responsing_latency_seconds);
-
-    RequestOutput req_output;
-    for (size_t i = 0; i < indexes.size(); ++i) {
-      const size_t index = indexes[i];
-      const size_t size = num_tokens[i];
-      Sequence& seq = request->sequences[index];
-
-      auto seq_output = seq.build_delta_output_until(size, *tokenizer);
-      if (seq_output.has_value()) {
-        req_output.outputs.push_back(std::move(seq_output.value()));
+      // close the sequence after sending finish reason
+      if (seq.is_finished()) {
+        seq.close();
       }
     }
+    shards[shard_of(request)].push_back(std::move(stream_request));
+  }
 
-    if (!request->on_output(req_output)) {
-      // cancel the request if on_stream returns false
-      request->cancel();
+  // output the delta text til the end of the sequences to the clients
+  for (size_t shard = 0; shard < shards.size(); ++shard) {
+    if (shards[shard].empty()) {
+      continue;
     }
-  });
+    response_threadpool_.schedule(shard,
+                                  [stream_requests = std::move(shards[shard]),
+                                   tokenizer = tokenizers_[shard].get()]() {
+      AUTO_COUNTER(stream_responsing_latency_seconds);
+
+      // gather the windows of all sequences to decode them in one call for
+      // each value of skip_special_tokens.
+      std::vector<Slice<int32_t>> windows[2];
+      // (skip_special_tokens, first window, num windows) of each sequence
+      std::vector<std::tuple<bool, size_t, size_t>> seq_windows;
+      for (const auto& [request, seqs] : stream_requests) {
+        for (const auto& [index, size] : seqs) {
+          const Sequence& seq = request->sequences[index];
+          const bool skip = seq.skip_special_tokens();
+          const auto delta_windows = seq.delta_windows_until(size);
+          seq_windows.emplace_back(
+              skip, windows[skip].size(), delta_windows.size());
+          windows[skip].insert(
+              windows[skip].end(), delta_windows.begin(), delta_windows.end());
+        }
+      }
+      const absl::Time start = absl::Now();
+      std::vector<std::string> texts[2];
+      for (const bool skip : {false, true}) {
+        if (!windows[skip].empty()) {
+          texts[skip] = tokenizer->decode_batch(windows[skip], skip);
+        }
+      }
+      // the batched decode is shared by the traced requests
+      const absl::Duration decode_duration = absl::Now() - start;
+
+      size_t seq_idx = 0;
+      for (const auto& [request, seqs] : stream_requests) {
+        RequestOutput req_output;
+        for (const auto& [index, size] : seqs) {
+          Sequence& seq = request->sequences[index];
+          const auto& [skip, start, n] = seq_windows[seq_idx++];
+          const std::vector<std::string> window_texts(
+              texts[skip].begin() + start, texts[skip].begin() + start + n);
+          auto seq_output =
+              seq.build_delta_output_until(size, *tokenizer, window_texts);
+          if (seq_output.has_value()) {
+            req_output.outputs.push_back(std::move(seq_output.value()));
+          }
+        }
+        if (request->trace != nullptr) {
+          request->trace->add_detokenize_duration(decode_duration);
+        }
+
+        if (!request->on_output(req_output)) {
+          // cancel the request if on_stream returns false
+          request->cancel();
+        }
+      }
+    });
+  }
+}
+
+void ResponseHandler::on_request_hand_over(
+    Request* request,
+    std::function<void(Request*)> hand_over) {
+  // run after the pending responses of the request on its shard
+  response_threadpool_.schedule(
+      shard_of(request),
+      [request, hand_over = std::move(hand_over)]() { hand_over(request); });
 }
 
 void ResponseHandler::wait_for_complete() {
-  // add a task to the end of the pool to wait for it to finish
-  absl::Notification done;
-  response_threadpool_.schedule([&done]() { done.Notify(); });
-  done.WaitForNotification();
+  // add a task to the end of each shard to wait for them to finish
+  const size_t num_shards = response_threadpool_.num_shards();
+  absl::BlockingCounter counter(static_cast<int>(num_shards));
+  for (size_t shard = 0; shard < num_shards; ++shard) {
+    response_threadpool_.schedule(shard,
+                                  [&counter]() { counter.DecrementCount(); });
+  }
+  counter.Wait();
 }
 
 }  // namespace llm
@@ -1,8 +1,11 @@
 #pragma once
 
-#include <common/threadpool.h>
+#include <common/sharded_threadpool.h>
 
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
 
 namespace llm {
 
@@ -10,24 +13,45 @@ class BlockManager;
 class Request;
 class Sequence;
 class Tokenizer;
+
+// Detokenizes and sends the responses of requests on a pool of threads, each
+// with its own tokenizer. A request is pinned to one thread so that its
+// responses are sent in order. All methods must be called from the scheduler
+// thread.
 class ResponseHandler final {
  public:
-  ResponseHandler(const Tokenizer* tokenizer);
+  // cpus: the cpus to run the response threads on, empty to float freely
+  ResponseHandler(const Tokenizer* tokenizer,
+                  size_t num_threads,
+                  const std::vector<int32_t>& cpus = {});
 
   // take over the ownership of the request
   void on_request_finish(std::unique_ptr<Request> request);
 
   void on_request_stream(Request* request);
 
+  // stream the requests of a step, the token windows of the sequences on
+  // the same thread are detokenized together in one tokenizer call.
+  void on_requests_stream(const std::vector<Request*>& requests);
+
+  // call hand_over with the request after the responses queued for it have
+  // been sent, e.g. to hand the request over to another scheduler with its
+  // own response threads.
+  void on_request_hand_over(Request* request,
+                            std::function<void(Request*)> hand_over);
+
   // wait for all responses in queue to be handled
   void wait_for_complete();
 
  private:
+  // the shard of the threadpool handling the request
+  size_t shard_of(const Request* request) const;
+
   // the threadpool to handle responses
-  ThreadPool response_threadpool_;
+  ShardedThreadPool response_threadpool_;
 
-  // tokenizer instance to decode token ids
-  std::unique_ptr<Tokenizer> tokenizer_;
+  // tokenizer instance of each shard to decode token ids
+  std::vector<std::unique_ptr<Tokenizer>> tokenizers_;
 };
 
 }  // namespace llm
@@ -56,6 +56,9 @@ class Scheduler {
   // inc/dec pending requests
   virtual void inc_pending_requests(size_t count) {}
   virtual void dec_pending_requests() {}
+
+  // whether there are no pending, queued or running requests. thread safe
+  virtual bool is_idle() const { return false; }
 };
 
 }  // namespace llm
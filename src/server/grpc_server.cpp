@@ -25,7 +25,9 @@ bool GrpcServer::start(const Options& options) {
   // clients. In this case it corresponds to an *asynchronous* service.
   builder.RegisterService(&completion_service_);
   builder.RegisterService(&chat_service_);
+  builder.RegisterService(&embedding_service_);
   builder.RegisterService(models_handler_.get());
+  builder.RegisterService(load_handler_.get());
   // Get hold of the completion queue used for the asynchronous communication
   // with the gRPC runtime.
   cq_ = builder.AddCompletionQueue();
@@ -49,7 +51,8 @@ bool GrpcServer::start(const Options& options) {
       completion_handler_->complete_async(call_data);
     };
     // Spawn new CallData instances to serve new clients
-    new CompletionCallData(cq_.get(), on_register, on_request);
+    new StreamCallData<proto::CompletionRequest, proto::CompletionResponse>(
+        cq_.get(), options.stream_options, on_register, on_request);
   }
 
   // Spawn a new CallData instance for chat request
@@ -67,7 +70,27 @@ bool GrpcServer::start(const Options& options) {
     auto on_request = [this](ChatCallData* call_data) {
       chat_handler_->chat_async(call_data);
     };
-    new ChatCallData(cq_.get(), on_register, on_request);
+    new StreamCallData<proto::ChatRequest, proto::ChatResponse>(
+        cq_.get(), options.stream_options, on_register, on_request);
+  }
+
+  // Spawn a new CallData instance for embedding request
+  {
+    auto on_register =
+        [this](grpc::ServerContext* context,
+               proto::EmbeddingRequest* request,
+               grpc::ServerAsyncWriter<proto::EmbeddingResponse>* responder,
+               grpc::ServerCompletionQueue* new_call_cq,
+               grpc::ServerCompletionQueue* notification_cq,
+               void* tag) {
+          embedding_service_.RequestEmbed(
+              context, request, responder, new_call_cq, notification_cq, tag);
+        };
+    auto on_request = [this](EmbeddingCallData* call_data) {
+      embedding_handler_->embed_async(call_data);
+    };
+    new StreamCallData<proto::EmbeddingRequest, proto::EmbeddingResponse>(
+        cq_.get(), options.stream_options, on_register, on_request);
   }
 
   // Proceed to the server's main loop.
@@ -76,6 +99,10 @@ bool GrpcServer::start(const Options& options) {
 }
 
 void GrpcServer::stop() {
+  // end the load report streams that never finish on their own
+  if (load_handler_) {
+    load_handler_->stop();
+  }
   if (grpc_server_) {
     grpc_server_->Shutdown();
   }
@@ -7,6 +7,8 @@
 
 #include "handlers/chat_handler.h"
 #include "handlers/completion_handler.h"
+#include "handlers/embedding_handler.h"
+#include "handlers/load_handler.h"
 #include "handlers/models_handler.h"
 
 namespace llm {
@@ -16,14 +18,20 @@ class GrpcServer final {
   struct Options {
     std::string address = "localhost";
     int32_t port = 8888;
+    // flow control of streaming responses
+    StreamOptions stream_options;
   };
 
   GrpcServer(std::unique_ptr<CompletionHandler> completion_handler,
              std::unique_ptr<ChatHandler> chat_handler,
-             std::unique_ptr<ModelsHandler> models_handler)
+             std::unique_ptr<EmbeddingHandler> embedding_handler,
+             std::unique_ptr<ModelsHandler> models_handler,
+             std::unique_ptr<LoadHandler> load_handler)
       : completion_handler_(std::move(completion_handler)),
         chat_handler_(std::move(chat_handler)),
-        models_handler_(std::move(models_handler)) {}
+        embedding_handler_(std::move(embedding_handler)),
+        models_handler_(std::move(models_handler)),
+        load_handler_(std::move(load_handler)) {}
 
   ~GrpcServer();
 
@@ -40,12 +48,19 @@ class GrpcServer final {
   // handler for chat requests
   std::unique_ptr<ChatHandler> chat_handler_;
 
+  // handler for embedding requests
+  std::unique_ptr<EmbeddingHandler> embedding_handler_;
+
   // handler for models requests
   std::unique_ptr<ModelsHandler> models_handler_;
 
+  // handler for load report streams
+  std::unique_ptr<LoadHandler> load_handler_;
+
   // registed service
   proto::Completion::AsyncService completion_service_;
   proto::Chat::AsyncService chat_service_;
+  proto::Embeddings::AsyncService embedding_service_;
 
   // grpc server
   std::unique_ptr<grpc::Server> grpc_server_;
@@ -0,0 +1,143 @@
+#include "http_api.h"
+
+#include <glog/logging.h>
+#include <grpcpp/grpcpp.h>
+
+#include <boost/beast.hpp>
+#include <memory>
+#include <string>
+
+#include "chat.pb.h"
+#include "completion.pb.h"
+#include "embedding.pb.h"
+#include "http_call_data.h"
+#include "models.pb.h"
+
+namespace llm {
+namespace http = boost::beast::http;
+
+namespace {
+using CompletionHttpCallData =
+    HttpCallData<proto::CompletionRequest, proto::CompletionResponse>;
+using ChatHttpCallData = HttpCallData<proto::ChatRequest, proto::ChatResponse>;
+using EmbeddingHttpCallData =
+    HttpCallData<proto::EmbeddingRequest, proto::EmbeddingResponse>;
+
+bool send_error(HttpServer::Transport& transport,
+                const grpc::Status& status,
+                int status_code) {
+  transport.send_string(status_to_json(status) + "\n", "application/json");
+  return transport.send_status(status_code);
+}
+
+bool send_error(HttpServer::Transport& transport, const grpc::Status& status) {
+  return send_error(transport, status, to_http_status(status.error_code()));
+}
+
+// returns false and replies with an error if the method is not allowed
+bool check_method(HttpServer::Transport& transport, http::verb method) {
+  if (transport.request().method() == method) {
+    return true;
+  }
+  send_error(transport,
+             {grpc::StatusCode::UNIMPLEMENTED, "Method Not Allowed"},
+             static_cast<int>(http::status::method_not_allowed));
+  return false;
+}
+
+}  // namespace
+
+bool HttpApi::register_uris(HttpServer* server) {
+  return server->register_uri("/v1/completions",
+                              [this](HttpServer::Transport& transport) {
+                                return complete(transport);
+                              }) &&
+         server->register_uri("/v1/chat/completions",
+                              [this](HttpServer::Transport& transport) {
+                                return chat(transport);
+                              }) &&
+         server->register_uri("/v1/embeddings",
+                              [this](HttpServer::Transport& transport) {
+                                return embed(transport);
+                              }) &&
+         server->register_uri("/v1/models",
+                              [this](HttpServer::Transport& transport) {
+                                return list_models(transport);
+                              });
+}
+
+bool HttpApi::complete(HttpServer::Transport& transport) {
+  if (!check_method(transport, http::verb::post)) {
+    return true;
+  }
+  proto::CompletionRequest request;
+  if (auto status = json_to_message(transport.request().body(), &request);
+      !status.ok()) {
+    return send_error(transport, status);
+  }
+
+  // results cannot be streamed when best_of != n
+  const uint32_t n = request.has_n() ? request.n() : 1;
+  const bool is_stream = request.stream() &&
+                         (!request.has_best_of() || request.best_of() == n);
+  auto stream = transport.start_stream(is_stream ? "text/event-stream"
+                                                 : "application/json");
+  // the call data deletes itself once finished
+  completion_handler_->complete_async(new CompletionHttpCallData(
+      std::move(request), std::move(stream), is_stream));
+  return true;
+}
+
+bool HttpApi::chat(HttpServer::Transport& transport) {
+  if (!check_method(transport, http::verb::post)) {
+    return true;
+  }
+  proto::ChatRequest request;
+  if (auto status = json_to_message(transport.request().body(), &request);
+      !status.ok()) {
+    return send_error(transport, status);
+  }
+
+  const bool is_stream = request.stream();
+  auto stream = transport.start_stream(is_stream ? "text/event-stream"
+                                                 : "application/json");
+  // the call data deletes itself once finished
+  chat_handler_->chat_async(
+      new ChatHttpCallData(std::move(request), std::move(stream), is_stream));
+  return true;
+}
+
+bool HttpApi::embed(HttpServer::Transport& transport) {
+  if (!check_method(transport, http::verb::post)) {
+    return true;
+  }
+  proto::EmbeddingRequest request;
+  if (auto status = json_to_message(transport.request().body(), &request);
+      !status.ok()) {
+    return send_error(transport, status);
+  }
+
+  // the embeddings are returned at once
+  auto stream = transport.start_stream("application/json");
+  // the call data deletes itself once finished
+  embedding_handler_->embed_async(new EmbeddingHttpCallData(
+      std::move(request), std::move(stream), /*is_stream=*/false));
+  return true;
+}
+
+bool HttpApi::list_models(HttpServer::Transport& transport) {
+  if (!check_method(transport, http::verb::get)) {
+    return true;
+  }
+  proto::ListRequest request;
+  proto::ListResponse response;
+  const auto status =
+      models_handler_->List(/*context=*/nullptr, &request, &response);
+  if (!status.ok()) {
+    return send_error(transport, status);
+  }
+  return transport.send_string(message_to_json(response) + "\n",
+                               "application/json");
+}
+
+}  // namespace llm
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <memory>
+
+#include "handlers/chat_handler.h"
+#include "handlers/completion_handler.h"
+#include "handlers/embedding_handler.h"
+#include "handlers/models_handler.h"
+#include "http_server.h"
+
+namespace llm {
+
+// Serves the OpenAI-compatible api over the http server with the same
+// handlers as the grpc server, without the hop through the http gateway:
+//   POST /v1/completions
+//   POST /v1/chat/completions
+//   POST /v1/embeddings
+//   GET /v1/models
+class HttpApi final {
+ public:
+  HttpApi(std::unique_ptr<CompletionHandler> completion_handler,
+          std::unique_ptr<ChatHandler> chat_handler,
+          std::unique_ptr<EmbeddingHandler> embedding_handler,
+          std::unique_ptr<ModelsHandler> models_handler)
+      : completion_handler_(std::move(completion_handler)),
+        chat_handler_(std::move(chat_handler)),
+        embedding_handler_(std::move(embedding_handler)),
+        models_handler_(std::move(models_handler)) {}
+
+  // register the endpoints, the api should outlive the server
+  bool register_uris(HttpServer* server);
+
+ private:
+  bool complete(HttpServer::Transport& transport);
+
+  bool chat(HttpServer::Transport& transport);
+
+  bool embed(HttpServer::Transport& transport);
+
+  bool list_models(HttpServer::Transport& transport);
+
+  // handler for completion requests
+  std::unique_ptr<CompletionHandler> completion_handler_;
+
+  // handler for chat requests
+  std::unique_ptr<ChatHandler> chat_handler_;
+
+  // handler for embedding requests
+  std::unique_ptr<EmbeddingHandler> embedding_handler_;
+
+  // handler for models requests
+  std::unique_ptr<ModelsHandler> models_handler_;
+};
+
+}  // namespace llm
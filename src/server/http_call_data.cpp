@@ -0,0 +1,90 @@
+#include "http_call_data.h"
+
+#include <glog/logging.h>
+#include <google/protobuf/util/json_util.h>
+
+#include <nlohmann/json.hpp>
+#include <string>
+
+namespace llm {
+
+std::string message_to_json(const google::protobuf::Message& message) {
+  google::protobuf::util::JsonPrintOptions options;
+  options.preserve_proto_field_names = true;
+  std::string json;
+  const auto status =
+      google::protobuf::util::MessageToJsonString(message, &json, options);
+  LOG_IF(ERROR, !status.ok())
+      << "Failed to encode message as json: " << status.ToString();
+  return json;
+}
+
+grpc::Status json_to_message(const std::string& json,
+                             google::protobuf::Message* message) {
+  google::protobuf::util::JsonParseOptions options;
+  options.ignore_unknown_fields = true;
+  auto status =
+      google::protobuf::util::JsonStringToMessage(json, message, options);
+  if (status.ok()) {
+    return grpc::Status::OK;
+  }
+
+  // openai allows a single string for the stop sequences
+  auto body = nlohmann::json::parse(json, /*cb=*/nullptr, /*exceptions=*/false);
+  if (body.is_object() && body.contains("stop") && body["stop"].is_string()) {
+    body["stop"] = nlohmann::json::array({body["stop"]});
+    message->Clear();
+    status = google::protobuf::util::JsonStringToMessage(
+        body.dump(), message, options);
+    if (status.ok()) {
+      return grpc::Status::OK;
+    }
+  }
+  return {grpc::StatusCode::INVALID_ARGUMENT, std::string(status.message())};
+}
+
+int to_http_status(grpc::StatusCode code) {
+  // same as the mapping of grpc-gateway
+  switch (code) {
+    case grpc::StatusCode::OK:
+      return 200;
+    case grpc::StatusCode::CANCELLED:
+      return 499;
+    case grpc::StatusCode::INVALID_ARGUMENT:
+    case grpc::StatusCode::FAILED_PRECONDITION:
+    case grpc::StatusCode::OUT_OF_RANGE:
+      return 400;
+    case grpc::StatusCode::DEADLINE_EXCEEDED:
+      return 504;
+    case grpc::StatusCode::NOT_FOUND:
+      return 404;
+    case grpc::StatusCode::ALREADY_EXISTS:
+    case grpc::StatusCode::ABORTED:
+      return 409;
+    case grpc::StatusCode::PERMISSION_DENIED:
+      return 403;
+    case grpc::StatusCode::UNAUTHENTICATED:
+      return 401;
+    case grpc::StatusCode::RESOURCE_EXHAUSTED:
+      return 429;
+    case grpc::StatusCode::UNIMPLEMENTED:
+      return 501;
+    case grpc::StatusCode::UNAVAILABLE:
+      return 503;
+    default:
+      return 500;
+  }
+}
+
+std::string status_to_json(const grpc::Status& status) {
+  nlohmann::json error;
+  error["code"] = static_cast<int>(status.error_code());
+  error["message"] = status.error_message();
+  return nlohmann::json{{"error", error}}.dump(
+      /*indent=*/-1,
+      /*indent_char=*/' ',
+      /*ensure_ascii=*/false,
+      nlohmann::json::error_handler_t::replace);
+}
+
+}  // namespace llm
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <google/protobuf/message.h>
+#include <grpcpp/grpcpp.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "handlers/call_data.h"
+#include "http_server.h"
+
+namespace llm {
+
+// encode the message as json with the proto field names
+std::string message_to_json(const google::protobuf::Message& message);
+
+// decode the message from json, unknown fields are ignored
+grpc::Status json_to_message(const std::string& json,
+                             google::protobuf::Message* message);
+
+// http status code for the grpc status code
+int to_http_status(grpc::StatusCode code);
+
+// encode the status as json: {"error": {"code": 5, "message": "..."}}
+std::string status_to_json(const grpc::Status& status);
+
+// Replies to an OpenAI-compatible http request through a stream of the http
+// server. Responses are encoded as json on the calling thread, i.e. the
+// response threads of the llm handler, and sent as server-sent events for
+// streaming requests, otherwise as the json body. It deletes itself once
+// finished.
+template <typename Request, typename Response>
+class HttpCallData final : public StreamWriter<Request, Response> {
+ public:
+  HttpCallData(Request request,
+               std::shared_ptr<HttpServer::Stream> stream,
+               bool is_stream)
+      : request_(std::move(request)),
+        stream_(std::move(stream)),
+        is_stream_(is_stream) {}
+
+  const Request& request() const override { return request_; }
+
+  bool write(Response response) override {
+    if (is_stream_) {
+      return stream_->write_event(message_to_json(response));
+    }
+    return stream_->write(message_to_json(response) + "\n");
+  }
+
+  bool write_and_finish(Response response,
+                        grpc::Status grpc_status = grpc::Status::OK) override {
+    const bool ok = write(std::move(response));
+    return finish(std::move(grpc_status)) && ok;
+  }
+
+  bool finish(grpc::Status grpc_status = grpc::Status::OK) override {
+    bool ok = true;
+    if (!grpc_status.ok()) {
+      // reply with the error status if nothing has been written, otherwise
+      // send the error as an event
+      const std::string error = status_to_json(grpc_status);
+      if (stream_->set_header(to_http_status(grpc_status.error_code()),
+                              "application/json")) {
+        ok = stream_->write(error + "\n");
+      } else {
+        ok = stream_->write_event(error);
+      }
+    } else if (is_stream_) {
+      ok = stream_->write_event("[DONE]");
+    }
+    stream_->finish();
+    delete this;
+    return ok;
+  }
+
+  bool is_cancelled() const override { return stream_->is_closed(); }
+
+ private:
+  Request request_;
+
+  std::shared_ptr<HttpServer::Stream> stream_;
+
+  // whether to send responses as server-sent events
+  bool is_stream_;
+};
+
+}  // namespace llm
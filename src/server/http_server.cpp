@@ -4,11 +4,401 @@
 
 #include <boost/asio.hpp>
 #include <boost/beast.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <utility>
+#include <vector>
 
 namespace llm {
+namespace http = boost::beast::http;
+
+namespace {
+// timeout for reading requests on idle connections and for each write
+constexpr auto kTimeout = std::chrono::seconds(30);
+
+// window to coalesce writes of a stream into one write
+constexpr auto kCoalesceWindow = std::chrono::milliseconds(2);
+
+constexpr std::string_view kEventPrefix = "data: ";
+constexpr std::string_view kEventSuffix = "\n\n";
+constexpr std::string_view kCRLF = "\r\n";
+constexpr std::string_view kLastChunk = "0\r\n\r\n";
+}  // namespace
+
+// A connection that reads requests and writes responses in order. All
+// members except the pending chunks guarded by mutex_ are accessed on the
+// strand of the connection.
+class HttpServer::Session : public std::enable_shared_from_this<Session> {
+ public:
+  Session(HttpServer* server, tcp::socket socket)
+      : server_(server),
+        stream_(std::move(socket)),
+        flush_timer_(stream_.get_executor()) {}
+
+  void start() { read(); }
+
+  // called by the handler on the strand
+  uint64_t start_stream(const std::string& mime_type) {
+    streaming_ = true;
+    std::lock_guard<std::mutex> lock(mutex_);
+    stream_status_ = http::status::ok;
+    stream_mime_type_ = mime_type;
+    return ++stream_id_;
+  }
+
+  // whether the connection is closed, e.g. the client has gone away, can be
+  // called from any thread without blocking
+  bool is_closed() const { return closed_.load(std::memory_order_relaxed); }
+
+  // change the header of the stream before it is written, can be called from
+  // any thread
+  bool set_header(uint64_t stream_id,
+                  http::status status,
+                  const std::string& mime_type) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_ || stream_id != stream_id_ || header_written_) {
+      return false;
+    }
+    stream_status_ = status;
+    stream_mime_type_ = mime_type;
+    return true;
+  }
+
+  // queue a chunk of the stream, can be called from any thread
+  bool write(uint64_t stream_id, std::string data, bool event) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (closed_ || stream_id != stream_id_ || finishing_) {
+        return false;
+      }
+      pending_.push_back({std::move(data), event});
+      if (flush_scheduled_) {
+        return true;
+      }
+      flush_scheduled_ = true;
+    }
+    // wait a short window for more chunks before writing
+    boost::asio::post(stream_.get_executor(), [self = shared_from_this()] {
+      self->flush_timer_.expires_after(kCoalesceWindow);
+      self->flush_timer_.async_wait(
+          [self](boost::system::error_code /*ec*/) { self->flush(); });
+    });
+    return true;
+  }
+
+  // finish the stream, can be called from any thread
+  void finish(uint64_t stream_id) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (closed_ || stream_id != stream_id_ || finishing_) {
+        return;
+      }
+      finishing_ = true;
+      if (flush_scheduled_) {
+        return;
+      }
+      flush_scheduled_ = true;
+    }
+    boost::asio::post(stream_.get_executor(),
+                      [self = shared_from_this()] { self->flush(); });
+  }
+
+ private:
+  struct Chunk {
+    std::string data;
+    // whether to send the data as a server-sent event
+    bool event = false;
+  };
+
+  void read() {
+    req_ = {};
+    stream_.expires_after(kTimeout);
+    http::async_read(
+        stream_,
+        buffer_,
+        req_,
+        [self = shared_from_this()](boost::system::error_code ec,
+                                    size_t /*bytes*/) { self->on_read(ec); });
+  }
+
+  void on_read(boost::system::error_code ec) {
+    if (ec == http::error::end_of_stream) {
+      close();
+      return;
+    }
+    if (ec) {
+      if (ec != boost::beast::error::timeout) {
+        LOG(ERROR) << "Error in reading request: " << ec.message();
+      }
+      close();
+      return;
+    }
+
+    handle_request();
+    if (streaming_) {
+      watch_disconnect();
+      // the header is written with the first chunks
+      flush();
+    } else {
+      write_response();
+    }
+  }
+
+  void handle_request() {
+    res_ = {};
+    res_.version(req_.version());
+    res_.keep_alive(req_.keep_alive());
+    const std::string target(req_.target());
+    auto it = server_->endpoints_.find(target);
+    if (it == server_->endpoints_.end()) {
+      res_.result(http::status::not_found);
+      res_.body() = "The resource '" + target + "' was not found.";
+      res_.set(http::field::content_type, "text/plain");
+      return;
+    }
+
+    bool success = false;
+    try {
+      Transport transport(shared_from_this(), &req_, &res_);
+      success = it->second(transport);
+    } catch (const std::exception& e) {
+      LOG(ERROR) << "Exception in processing request: " << e.what();
+    }
+    if (!success) {
+      if (streaming_) {
+        // the stream is not usable after failures
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++stream_id_;
+        streaming_ = false;
+        finishing_ = false;
+        flush_scheduled_ = false;
+        pending_.clear();
+      }
+      res_.result(http::status::internal_server_error);
+      res_.body() = "An error occurred processing the request.";
+      res_.set(http::field::content_type, "text/plain");
+    }
+  }
+
+  // watch the connection while the stream is in flight, the socket turns
+  // readable once the client has gone away. the stream is cancelled at eof,
+  // pipelined requests are left in the socket until the stream is done.
+  void watch_disconnect() {
+    stream_.socket().async_wait(
+        tcp::socket::wait_read,
+        [self = shared_from_this()](boost::system::error_code ec) {
+          if (ec || !self->streaming_) {
+            return;
+          }
+          boost::system::error_code available_ec;
+          const size_t available =
+              self->stream_.socket().available(available_ec);
+          if (available_ec || available == 0) {
+            self->close();
+          }
+        });
+  }
+
+  void write_response() {
+    res_.prepare_payload();
+    stream_.expires_after(kTimeout);
+    http::async_write(stream_,
+                      res_,
+                      [self = shared_from_this()](boost::system::error_code ec,
+                                                  size_t /*bytes*/) {
+                        self->on_write(ec, self->res_.keep_alive());
+                      });
+  }
+
+  void on_write(boost::system::error_code ec, bool keep_alive) {
+    if (ec) {
+      LOG(ERROR) << "Error in writing response: " << ec.message();
+      close();
+      return;
+    }
+    if (!keep_alive) {
+      close();
+      return;
+    }
+    // read the next request on the connection
+    read();
+  }
+
+  // write all pending chunks of the stream in one write
+  void flush() {
+    if (!streaming_ || writing_) {
+      // flushed after the current write
+      return;
+    }
+    bool finishing = false;
+    header_data_.clear();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (closed_) {
+        return;
+      }
+      writing_chunks_.swap(pending_);
+      flush_scheduled_ = false;
+      finishing = finishing_;
+      if (writing_chunks_.empty() && !finishing) {
+        return;
+      }
+      if (!header_written_) {
+        header_written_ = true;
+        header_data_ = stream_header();
+      }
+    }
+
+    // gather the chunks: [header], size, [prefix], data, [suffix], crlf
+    std::vector<boost::asio::const_buffer> buffers;
+    buffers.reserve(writing_chunks_.size() * 5 + 2);
+    size_lines_.clear();
+    size_lines_.reserve(writing_chunks_.size());
+    auto to_buffer = [](std::string_view str) {
+      return boost::asio::buffer(str.data(), str.size());
+    };
+    if (!header_data_.empty()) {
+      buffers.push_back(to_buffer(header_data_));
+    }
+    for (const auto& chunk : writing_chunks_) {
+      if (chunk.data.empty() && !chunk.event) {
+        // an empty chunk would end the response
+        continue;
+      }
+      size_t size = chunk.data.size();
+      if (chunk.event) {
+        size += kEventPrefix.size() + kEventSuffix.size();
+      }
+      char size_line[32];
+      const int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", size);
+      // reserved, the strings are not moved
+      buffers.push_back(to_buffer(size_lines_.emplace_back(size_line, n)));
+      if (chunk.event) {
+        buffers.push_back(to_buffer(kEventPrefix));
+      }
+      buffers.push_back(boost::asio::buffer(chunk.data));
+      if (chunk.event) {
+        buffers.push_back(to_buffer(kEventSuffix));
+      }
+      buffers.push_back(to_buffer(kCRLF));
+    }
+    if (finishing) {
+      buffers.push_back(to_buffer(kLastChunk));
+    }
+
+    writing_ = true;
+    stream_.expires_after(kTimeout);
+    boost::asio::async_write(
+        stream_,
+        buffers,
+        [self = shared_from_this(), finishing](boost::system::error_code ec,
+                                               size_t /*bytes*/) {
+          self->writing_ = false;
+          self->writing_chunks_.clear();
+          if (ec) {
+            LOG(ERROR) << "Error in writing stream: " << ec.message();
+            self->close();
+            return;
+          }
+          if (!finishing) {
+            // write the chunks queued during the write
+            self->flush();
+            return;
+          }
+          // the response is done
+          self->end_stream();
+          self->on_write(ec, self->req_.keep_alive());
+        });
+  }
+
+  // serialize the header of the stream, called with mutex_ held
+  std::string stream_header() const {
+    http::response<http::empty_body> header{stream_status_, req_.version()};
+    header.set(http::field::content_type, stream_mime_type_);
+    header.set(http::field::cache_control, "no-cache");
+    header.keep_alive(req_.keep_alive());
+    header.chunked(true);
+    std::ostringstream os;
+    os << header.base();
+    return os.str();
+  }
+
+  void end_stream() {
+    streaming_ = false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    // invalidate the stream
+    ++stream_id_;
+    header_written_ = false;
+    finishing_ = false;
+    flush_scheduled_ = false;
+    pending_.clear();
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+      pending_.clear();
+    }
+    flush_timer_.cancel();
+    boost::system::error_code ec;
+    stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+  }
+
+  HttpServer* server_;
+
+  boost::beast::tcp_stream stream_;
+
+  boost::beast::flat_buffer buffer_;
+
+  Request req_;
+
+  Response res_;
+
+  // whether the handler started a stream for the current request
+  bool streaming_ = false;
+
+  // timer to coalesce writes of the stream
+  boost::asio::steady_timer flush_timer_;
+
+  // whether a write of the stream is in flight
+  bool writing_ = false;
+
+  // header and chunks being written, and the lines of their sizes
+  std::string header_data_;
+  std::vector<Chunk> writing_chunks_;
+  std::vector<std::string> size_lines_;
+
+  std::mutex mutex_;
+
+  // chunks queued by the stream to write
+  std::vector<Chunk> pending_;
+
+  // id of the current stream, chunks of other streams are rejected
+  uint64_t stream_id_ = 0;
+
+  // header of the current stream, written with the first chunks
+  http::status stream_status_ = http::status::ok;
+  std::string stream_mime_type_;
+  bool header_written_ = false;
+
+  // whether a flush is scheduled for the pending chunks
+  bool flush_scheduled_ = false;
+
+  // whether the current stream is finishing
+  bool finishing_ = false;
+
+  // whether the connection is closed, read without the lock
+  std::atomic<bool> closed_{false};
+};
 
 bool HttpServer::register_uri(const std::string& uri,
                               HttpServer::Handler handler) {
@@ -19,62 +409,37 @@ bool HttpServer::register_uri(const std::string& uri,
   return true;
 }
 
-void HttpServer::async_accept(tcp::acceptor& acceptor) {
-  // create a new socket
-  const auto socket = std::make_shared<tcp::socket>(*io_context_);
-  acceptor.async_accept(
-      *socket, [this, &acceptor, socket](boost::system::error_code ec) {
-        // loop to accept new incoming connections
-        async_accept(acceptor);
-
+void HttpServer::async_accept() {
+  // accept the connection on its own strand
+  acceptor_->async_accept(
+      boost::asio::make_strand(*io_context_),
+      [this](boost::system::error_code ec, tcp::socket socket) {
         if (!ec) {
-          try {
-            // handle the request
-            handle_request(*socket);
-          } catch (const std::exception& e) {
-            LOG(ERROR) << "Exception in processing request: " << e.what();
-          }
+          std::make_shared<Session>(this, std::move(socket))->start();
+        } else if (ec == boost::asio::error::operation_aborted) {
+          return;
         } else {
           LOG(ERROR) << "Error in accepting connection: " << ec.message();
         }
+        // loop to accept new incoming connections
+        async_accept();
       });
 }
 
-void HttpServer::handle_request(tcp::socket& socket) {
-  // process the request
-  boost::beast::flat_buffer buffer;
-  boost::beast::http::request<boost::beast::http::string_body> req;
-  boost::beast::http::read(socket, buffer, req);
-  boost::beast::http::response<boost::beast::http::string_body> res;
-  res.version(req.version());
-  res.keep_alive(req.keep_alive());
-  const std::string target = req.target();
-  auto it = endpoints_.find(target);
-  if (it == endpoints_.end()) {
-    res.result(boost::beast::http::status::not_found);
-    res.body() = "The resource '" + target + "' was not found.";
-    res.set(boost::beast::http::field::content_type, "text/plain");
-  } else {
-    auto& handler = it->second;
-    Transport transport(&res);
-    if (!handler(transport)) {
-      res.result(boost::beast::http::status::internal_server_error);
-      res.body() = "An error occurred processing the request.";
-      res.set(boost::beast::http::field::content_type, "text/plain");
-    }
-  }
-  boost::beast::http::write(socket, res);
-  socket.shutdown(tcp::socket::shutdown_send);
-}
-
 bool HttpServer::start(uint16_t port, int32_t num_threads) {
   io_context_ = std::make_unique<boost::asio::io_context>(num_threads);
+  try {
+    acceptor_ = std::make_unique<tcp::acceptor>(
+        *io_context_, tcp::endpoint{tcp::v4(), port});
+  } catch (const std::exception& e) {
+    LOG(ERROR) << "Failed to listen on port " << port << ": " << e.what();
+    return false;
+  }
+  async_accept();
 
-  thread_ = std::thread([this, port] {
-    tcp::acceptor acceptor{*io_context_, tcp::endpoint{tcp::v4(), port}};
-    async_accept(acceptor);
-    io_context_->run();
-  });
+  for (int32_t i = 0; i < std::max(num_threads, 1); ++i) {
+    threads_.emplace_back([this] { io_context_->run(); });
+  }
   LOG(INFO) << "Started http server on 0.0.0.0:" << port;
   return true;
 }
@@ -84,10 +449,14 @@ void HttpServer::stop() {
   if (io_context_) {
     io_context_->stop();
   }
-  // wait for thread to finish
-  if (thread_.joinable()) {
-    thread_.join();
+  // wait for threads to finish
+  for (auto& thread : threads_) {
+    if (thread.joinable()) {
+      thread.join();
+    }
   }
+  threads_.clear();
+  acceptor_.reset();
   endpoints_.clear();
 }
 
@@ -104,4 +473,30 @@ bool HttpServer::Transport::send_status(int status_code) {
   return true;
 }
 
-}  // namespace llm
\ No newline at end of file
+std::shared_ptr<HttpServer::Stream> HttpServer::Transport::start_stream(
+    const std::string& mime_type) {
+  const uint64_t id = session_->start_stream(mime_type);
+  return std::make_shared<Stream>(session_, id);
+}
+
+HttpServer::Stream::~Stream() { finish(); }
+
+bool HttpServer::Stream::set_header(int status_code,
+                                    const std::string& mime_type) {
+  return session_->set_header(
+      id_, boost::beast::http::int_to_status(status_code), mime_type);
+}
+
+bool HttpServer::Stream::write(std::string data) {
+  return session_->write(id_, std::move(data), /*event=*/false);
+}
+
+bool HttpServer::Stream::write_event(std::string data) {
+  return session_->write(id_, std::move(data), /*event=*/true);
+}
+
+void HttpServer::Stream::finish() { session_->finish(id_); }
+
+bool HttpServer::Stream::is_closed() const { return session_->is_closed(); }
+
+}  // namespace llm
@@ -8,20 +8,31 @@
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace llm {
 using tcp = boost::asio::ip::tcp;
-// a simple http server based on civetweb for serving model metrics and health
-// check endpoints
+// a simple async http server based on boost beast for serving model metrics
+// and health check endpoints, and streaming responses. connections are kept
+// alive, and pipelined requests are handled in order on each connection.
 class HttpServer {
+ private:
+  class Session;
+
  public:
   class Transport;
+  class Stream;
   using Handler = std::function<bool(Transport&)>;
+  using Request = boost::beast::http::request<boost::beast::http::string_body>;
+  using Response =
+      boost::beast::http::response<boost::beast::http::string_body>;
 
   HttpServer() = default;
 
   bool register_uri(const std::string& uri, Handler handler);
 
+  // start the server with num_threads threads running the io context
   bool start(uint16_t port, int32_t num_threads);
 
   void stop();
@@ -33,16 +44,22 @@ class HttpServer {
    */
   class Transport {
    private:
-    boost::beast::http::response<boost::beast::http::string_body>* res_;
+    std::shared_ptr<Session> session_;
+    const Request* req_;
+    Response* res_;
 
    public:
-    explicit Transport(
-        boost::beast::http::response<boost::beast::http::string_body>* res)
-        : res_(res) {}
+    Transport(std::shared_ptr<Session> session,
+              const Request* req,
+              Response* res)
+        : session_(std::move(session)), req_(req), res_(res) {}
 
     Transport(const Transport&) = delete;
     Transport& operator=(Transport&) = delete;
 
+    // the request being handled
+    const Request& request() const { return *req_; }
+
     // Send response
     bool send_string(
         const std::string& data,
@@ -50,18 +67,64 @@ class HttpServer {
 
     // Send status code: 200 OK, 503 Service Unavailable, etc.
     bool send_status(int status_code);
+
+    // Start a chunked response, e.g. for server-sent events, that is written
+    // through the returned stream after the handler returns.
+    std::shared_ptr<Stream> start_stream(
+        const std::string& mime_type = "text/event-stream");
+  };
+
+  /**
+   * A chunked response that can be written from any thread. The header is
+   * written together with the first chunk. Writes within a short window are
+   * coalesced into one write of gathered buffers, without copying the data.
+   * The response is finished when the stream is destroyed if not finished
+   * explicitly.
+   */
+  class Stream {
+   private:
+    std::shared_ptr<Session> session_;
+    // id of the stream on the connection
+    uint64_t id_;
+
+   public:
+    Stream(std::shared_ptr<Session> session, uint64_t id)
+        : session_(std::move(session)), id_(id) {}
+
+    ~Stream();
+
+    Stream(const Stream&) = delete;
+    Stream& operator=(Stream&) = delete;
+
+    // send data as a chunk, returns false if the stream is closed
+    bool write(std::string data);
+
+    // send data as a server-sent event: "data: {data}\n\n"
+    bool write_event(std::string data);
+
+    // change the status code and content type of the response, e.g. for
+    // errors, returns false once the header has been written with the first
+    // chunk
+    bool set_header(int status_code, const std::string& mime_type);
+
+    // finish the response, following writes are ignored
+    void finish();
+
+    // returns true once the connection is closed, e.g. the client has gone
+    // away. it does not block.
+    bool is_closed() const;
   };
 
  private:
-  void async_accept(tcp::acceptor& acceptor);
-  void handle_request(tcp::socket& socket);
+  void async_accept();
 
   // hold the ownership of all request handlers
   std::unordered_map<std::string, Handler> endpoints_;
 
-  // io_context and thread for running the server
+  // io_context and threads for running the server
   std::unique_ptr<boost::asio::io_context> io_context_;
-  std::thread thread_;
+  std::unique_ptr<tcp::acceptor> acceptor_;
+  std::vector<std::thread> threads_;
 };
 
-}  // namespace llm
\ No newline at end of file
+}  // namespace llm
@@ -1,10 +1,12 @@
 #include <absl/strings/numbers.h>
 #include <absl/strings/str_split.h>
+#include <absl/time/time.h>
 #include <folly/init/Init.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include <algorithm>
 #include <csignal>
 #include <filesystem>
 #include <memory>
@@ -12,16 +14,32 @@
 #include <optional>
 
 #include "common/metrics.h"
+#include "common/trace.h"
 #include "grpc_server.h"
 #include "handlers/chat_handler.h"
 #include "handlers/completion_handler.h"
+#include "handlers/embedding_handler.h"
 #include "handlers/llm_handler.h"
+#include "handlers/model_pool.h"
 #include "handlers/models_handler.h"
+#include "http_api.h"
 #include "http_server.h"
 using namespace llm;
 
 DEFINE_int32(http_port, 9999, "Port for http server.");
 DEFINE_int32(grpc_port, 8888, "Port for grpc server.");
+DEFINE_int32(grpc_max_write_batch_size,
+             8,
+             "Max number of pending streaming responses flushed to the grpc "
+             "client in one batch.");
+DEFINE_int32(grpc_max_pending_responses,
+             64,
+             "Pause generating tokens for a streaming request once as many "
+             "responses are pending for its grpc client.");
+DEFINE_int32(num_http_threads,
+             4,
+             "Number of threads for the http server, which also serves the "
+             "OpenAI-compatible api.");
 
 DEFINE_string(model_id, "", "hf model name.");
 
@@ -40,16 +58,60 @@ DEFINE_string(
     "Device to run the draft model on, e.g. cpu, cuda:0, cuda:0,cuda:1, or "
     "auto to use all available gpus.");
 
+DEFINE_string(decode_device,
+              "",
+              "Devices of a second engine to run the decodes on, with the kv "
+              "cache of the prefilled prompts pulled from the engine on "
+              "--device, e.g. cuda:1. empty to disable.");
+
 static constexpr int64_t GB = int64_t(1024) * 1024 * 1024;
 
 DEFINE_int32(block_size, 8, "slots per block, value must be power of 2");
 
+DEFINE_int32(large_block_size,
+             0,
+             "slots per large block of consecutive blocks allocated to long "
+             "prompts, a power of 2 multiple of block_size, 0 to disable");
+
+DEFINE_int32(kv_budget,
+             0,
+             "max number of kv cache tokens kept for each sequence with a "
+             "longer prompt, the blocks receiving the least attention from the "
+             "last prompt tokens are evicted. 0 to disable");
+
+DEFINE_int32(kv_observation_window,
+             32,
+             "number of last prompt tokens whose attention ranks the kv cache "
+             "blocks to evict with --kv_budget");
+
+DEFINE_int32(hybrid_attention_device_blocks,
+             0,
+             "number of most recent kv cache blocks of a sequence kept on "
+             "device when out of device blocks, its leading blocks are "
+             "offloaded to the host cache and attended on cpu instead of "
+             "preempting it. 0 to disable, requires --host_cache_size");
+
 DEFINE_int64(max_cache_size, 10 * GB, "max cache size in bytes, default 10GB");
 
+DEFINE_int64(host_cache_size,
+             0,
+             "host memory size in bytes to swap out kv cache of preempted "
+             "requests, 0 to disable swapping");
+
+DEFINE_int64(resizable_cache_size,
+             0,
+             "max device memory size in bytes to grow the kv cache to at "
+             "runtime, 0 for a fixed size kv cache");
+
 DEFINE_double(max_memory_utilization,
               0.9,
               "maximum memory utilization allowed, default 0.9");
 
+DEFINE_string(kv_cache_dtype,
+              "auto",
+              "data type of kv cache, e.g. auto, int8, fp8. auto means the "
+              "same data type as the model");
+
 DEFINE_bool(enable_prefix_cache,
             true,
             "enable the prefix cache for the block manager");
@@ -71,18 +133,321 @@ DEFINE_string(
     "",
     "batch sizes to capture cuda graphs for draft model, comma separated list");
 
+DEFINE_string(draft_quant_method,
+              "",
+              "quantize the weights of a dense draft model at load, only fp8 "
+              "is supported. empty to load the draft checkpoint as is.");
+
+DEFINE_string(cuda_graph_num_tokens,
+              "",
+              "numbers of tokens to capture cuda graphs for batches with "
+              "prefill sequences, comma separated list");
+
+DEFINE_string(piecewise_cuda_graph_num_tokens,
+              "",
+              "token-count buckets to capture piecewise cuda graphs for the "
+              "batches without a captured cuda graph, e.g. prefill batches, "
+              "comma separated list");
+
+DEFINE_bool(lazy_cuda_graph_capture,
+            false,
+            "capture each cuda graph at its first use instead of at startup");
+
+DEFINE_bool(enable_activation_pool,
+            false,
+            "reserve a memory pool for the activations of eager forward "
+            "passes at startup, sized by max_tokens_per_batch");
+
+DEFINE_string(profile_cache_dir,
+              "",
+              "directory to cache the memory profiling result for warm "
+              "restarts, empty to disable");
+
 DEFINE_int32(max_tokens_per_batch, 512, "max number of tokens per batch");
 
 DEFINE_int32(max_seqs_per_batch, 128, "max number of sequences per batch");
 
+DEFINE_int64(target_step_time_ms,
+             0,
+             "target step time in milliseconds to tune the tokens per batch "
+             "for online, between min_tokens_per_batch and "
+             "max_tokens_per_batch. 0 to keep max_tokens_per_batch fixed");
+
+DEFINE_int32(min_tokens_per_batch,
+             64,
+             "lower bound of the tokens per batch tuned for the target step "
+             "time");
+
 DEFINE_int32(num_speculative_tokens, 0, "number of speculative tokens");
 
+DEFINE_int32(speculative_tree_width,
+             1,
+             "number of candidates per speculative position");
+
+DEFINE_string(speculative_proposer,
+              "draft",
+              "source of speculative tokens, e.g. draft, ngram, medusa, "
+              "lookahead");
+
+DEFINE_int32(ngram_max_size,
+             3,
+             "max n-gram size matched by the ngram proposer, or collected "
+             "by the lookahead proposer");
+
+DEFINE_bool(enable_adaptive_speculation,
+            false,
+            "adapt the number of speculative tokens to the acceptance rate");
+
+DEFINE_double(speculative_min_acceptance,
+              0.3,
+              "min acceptance probability of the last adaptive speculative "
+              "token");
+
+DEFINE_int32(speculative_max_batch_size,
+             0,
+             "turn off speculation at this many decoding sequences, 0 means "
+             "never");
+
+DEFINE_int32(num_decode_steps,
+             1,
+             "number of decode steps to run on device per scheduler step");
+
+DEFINE_bool(enable_fused_sampling,
+            false,
+            "enable fused sampling kernel for penalties, temperature, "
+            "top_k/top_p and sampling");
+
+DEFINE_bool(enable_pivot_sampling,
+            false,
+            "apply top_k and top_p with pivot search instead of sorting the "
+            "vocab");
+
+DEFINE_bool(enable_vocab_parallel_sampling,
+            false,
+            "sample from the vocab shards of the logits with tensor "
+            "parallelism, gathering only the top candidates of each shard");
+
+DEFINE_int32(cascade_min_prefix_len,
+             0,
+             "min number of kv tokens shared by consecutive sequences to use "
+             "cascade attention, 0 to disable");
+
+DEFINE_int32(pp_size,
+             1,
+             "number of pipeline stages, the devices are split evenly across "
+             "the stages");
+
+DEFINE_int32(num_micro_batches,
+             0,
+             "number of micro-batches per step with pipeline parallelism, 0 "
+             "means the number of pipeline stages");
+
+DEFINE_int32(data_parallel_size,
+             1,
+             "number of data parallel replicas of the model served by the "
+             "process, the devices are split evenly across them and the "
+             "requests are routed by load and prefix cache affinity");
+
+DEFINE_string(remote_workers,
+              "",
+              "comma separated addresses (host:port) of scalellm_worker "
+              "processes serving one gpu each, which join the tensor parallel "
+              "group of the local devices");
+
+DEFINE_string(weights_snapshot_dir,
+              "",
+              "directory of the per-rank weights snapshot of the model, "
+              "loaded instead of the checkpoint if present, otherwise saved "
+              "while loading. empty to disable");
+
+DEFINE_string(scheduling_policy,
+              "fcfs",
+              "scheduling policy, e.g. fcfs, slo, wfq, sjf. slo schedules "
+              "requests by deadline and sizes prefill chunks to meet the itl "
+              "target. wfq shares the capacity fairly among the users of "
+              "requests. sjf schedules requests by their predicted output "
+              "length and reserves blocks for it");
+
+DEFINE_double(sjf_aging_tokens_per_second,
+              50.0,
+              "predicted output tokens a waiting request is credited per "
+              "second under the sjf policy, so that long requests are not "
+              "starved");
+
+DEFINE_string(tenant_weights,
+              "",
+              "comma separated user=weight pairs for the wfq policy, users "
+              "not listed have a weight of 1");
+
+DEFINE_double(max_tenant_kv_cache_share,
+              1.0,
+              "max fraction of the kv cache a user can hold under the wfq "
+              "policy before its new requests wait");
+
+DEFINE_double(swap_bandwidth_gbps,
+              16.0,
+              "host to device bandwidth in GB/s to weigh swapping the kv cache "
+              "of preempted requests against recomputing it, 0 to always swap "
+              "when host blocks are available");
+
+DEFINE_int32(max_compaction_blocks_per_step,
+             0,
+             "max number of kv cache blocks copied per decode step to move "
+             "the blocks of running sequences into consecutive blocks, 0 to "
+             "disable");
+
+DEFINE_int64(ttft_slo_ms,
+             0,
+             "time to first token target in milliseconds, 0 means no target");
+
+DEFINE_int64(itl_slo_ms,
+             0,
+             "inter token latency target in milliseconds, 0 means no target");
+
+DEFINE_int32(prefix_admission_window,
+             0,
+             "number of waiting requests to pick from by their cached prefix "
+             "length, which admits requests sharing a prefix together. 0 or "
+             "1 to admit requests in the queue order");
+
+DEFINE_int32(max_admission_skips,
+             8,
+             "maximum number of times a waiting request can be passed over "
+             "by the prefix aware admission");
+
+DEFINE_int32(high_priority_reserved_tokens,
+             0,
+             "tokens per step kept for high priority requests, the normal "
+             "and low priority requests share the rest. 0 to share all");
+
+DEFINE_int32(high_priority_reserved_seqs,
+             0,
+             "sequences per step kept for high priority requests, the normal "
+             "and low priority requests share the rest. 0 to share all");
+
+DEFINE_bool(wait_for_inflight_prefix,
+            true,
+            "hold new requests sharing a prompt prefix with a running "
+            "prefill until the prefix is cached instead of computing it "
+            "again");
+
+DEFINE_int32(num_response_threads,
+             4,
+             "number of threads to detokenize and send responses");
+
+DEFINE_int32(num_encode_threads,
+             8,
+             "number of threads to encode long prompts in parallel, 0 to "
+             "disable");
+
+DEFINE_int64(prompt_cache_tokens,
+             1024 * 1024,
+             "max number of prompt token ids to cache for prompts sharing long "
+             "prefixes, 0 to disable");
+
+DEFINE_int64(response_cache_size,
+             0,
+             "max number of outputs of deterministic requests to cache for "
+             "repeated requests, 0 to disable");
+
+DEFINE_int64(response_cache_ttl_seconds,
+             60,
+             "seconds a cached output of a deterministic request is served "
+             "for");
+
+DEFINE_int64(max_sessions,
+             0,
+             "max number of multi-turn chat sessions, whose history is kept "
+             "with the kv cache pinned between the turns, 0 to disable");
+
+DEFINE_int64(session_ttl_seconds,
+             300,
+             "seconds an idle session is kept after its last turn");
+
+DEFINE_double(max_session_kv_cache_share,
+              0.5,
+              "max fraction of the kv cache blocks pinned by the sessions");
+
+DEFINE_double(best_of_prune_margin,
+              0,
+              "prune the best_of candidates whose cumulative logprob falls "
+              "behind the n-th best one by more than the margin, 0 to keep "
+              "all candidates");
+
+DEFINE_int32(best_of_prune_interval,
+             16,
+             "number of generated tokens between the prunings of the best_of "
+             "candidates");
+
+DEFINE_int64(max_cached_grammars,
+             64,
+             "max number of compiled grammars to cache for constrained "
+             "decoding, 0 to disable constrained decoding");
+
+DEFINE_string(scheduler_cpus,
+              "",
+              "cpus to pin the scheduler threads to, e.g. 0-1, empty to float "
+              "freely");
+
+DEFINE_string(handler_cpus,
+              "",
+              "cpus to pin the request handling and response threads to, "
+              "defaults to all cpus but --scheduler_cpus if set");
+
+DEFINE_bool(numa_affinity,
+            false,
+            "pin the threads of each gpu worker to the cpus of the numa node "
+            "of the gpu");
+
+DEFINE_string(extra_models,
+              "",
+              "comma separated model_id=model_path pairs served besides "
+              "--model_path on the same devices, e.g. fine-tuned variants. "
+              "each model takes --max_cache_size of kv cache");
+
+DEFINE_string(lora_adapters,
+              "",
+              "comma separated name=path pairs of peft lora adapters served "
+              "on top of the model, selected by the lora_adapter field of "
+              "requests. requires --max_loras");
+
+DEFINE_int32(max_resident_models,
+             0,
+             "max number of models with weights on the devices, the weights "
+             "of the least recently used idle models are offloaded to host "
+             "memory. 0 means no limit");
+
+DEFINE_bool(enable_warmup,
+            false,
+            "run synthetic requests of the prefill lengths, decode batch "
+            "sizes and sampling configs before serving");
+
+DEFINE_int64(max_estimated_ttft_ms,
+             0,
+             "refuse the requests whose estimated time to first token is "
+             "over it in milliseconds as unavailable, instead of queueing "
+             "them. 0 to disable");
+
+DEFINE_bool(clamp_max_tokens_to_kv_cache,
+            false,
+            "clamp the max tokens of the requests to the kv cache headroom "
+            "left after the waiting requests");
+
+DEFINE_int32(drain_timeout_s,
+             30,
+             "max seconds to wait for the requests in flight to finish on "
+             "shutdown, new requests are refused and /ready reports not "
+             "ready meanwhile. 0 to stop right away");
+
 // NOLINTNEXTLINE
 static std::atomic<uint32_t> signal_received{0};
 void shutdown_handler(int signal) {
-  // TODO: gracefully shutdown the server
-  LOG(WARNING) << "Received signal " << signal << ", stopping server...";
-  exit(1);
+  // a second signal stops the server without waiting for the drain
+  if (signal_received.exchange(signal, std::memory_order_relaxed) != 0) {
+    LOG(WARNING) << "Received signal " << signal << " again, exiting...";
+    exit(1);
+  }
+  LOG(WARNING) << "Received signal " << signal << ", draining server...";
 }
 
 std::optional<std::vector<uint32_t>> parse_batch_sizes(
@@ -151,6 +516,12 @@ int main(int argc, char** argv) {
                            [](HttpServer::Transport& transport) -> bool {
                              return transport.send_string("OK\n");
                            });
+  // recent engine steps as a chrome trace, see --trace_buffer_size
+  http_server.register_uri(
+      "/trace", [](HttpServer::Transport& transport) -> bool {
+        return transport.send_string(Tracer::Instance().to_chrome_trace(),
+                                     "application/json");
+      });
 
   // Create LLMHandler
   LLMHandler::Options options;
@@ -158,43 +529,158 @@ int main(int argc, char** argv) {
       .devices(FLAGS_device)
       .draft_model_path(FLAGS_draft_model_path)
       .draft_devices(FLAGS_draft_device)
+      .decode_devices(FLAGS_decode_device.empty()
+                          ? std::nullopt
+                          : std::make_optional(FLAGS_decode_device))
       .block_size(FLAGS_block_size)
+      .large_block_size(FLAGS_large_block_size)
+      .kv_budget(FLAGS_kv_budget)
+      .kv_observation_window(FLAGS_kv_observation_window)
+      .hybrid_attention_device_blocks(FLAGS_hybrid_attention_device_blocks)
       .max_cache_size(FLAGS_max_cache_size)
+      .host_cache_size(FLAGS_host_cache_size)
+      .resizable_cache_size(FLAGS_resizable_cache_size)
       .max_memory_utilization(FLAGS_max_memory_utilization)
       .enable_prefix_cache(FLAGS_enable_prefix_cache)
+      .kv_cache_dtype(FLAGS_kv_cache_dtype)
       .enable_cuda_graph(FLAGS_enable_cuda_graph)
       .cuda_graph_max_seq_len(FLAGS_cuda_graph_max_seq_len)
       .cuda_graph_batch_sizes(parse_batch_sizes(FLAGS_cuda_graph_batch_sizes))
       .draft_cuda_graph_batch_sizes(
           parse_batch_sizes(FLAGS_draft_cuda_graph_batch_sizes))
+      .draft_quant_method(FLAGS_draft_quant_method)
+      .cuda_graph_num_tokens(parse_batch_sizes(FLAGS_cuda_graph_num_tokens))
+      .piecewise_cuda_graph_num_tokens(
+          parse_batch_sizes(FLAGS_piecewise_cuda_graph_num_tokens))
       .max_tokens_per_batch(FLAGS_max_tokens_per_batch)
       .max_seqs_per_batch(FLAGS_max_seqs_per_batch)
-      .num_speculative_tokens(FLAGS_num_speculative_tokens);
+      .target_step_time_ms(FLAGS_target_step_time_ms)
+      .min_tokens_per_batch(FLAGS_min_tokens_per_batch)
+      .num_speculative_tokens(FLAGS_num_speculative_tokens)
+      .speculative_tree_width(FLAGS_speculative_tree_width)
+      .speculative_proposer(FLAGS_speculative_proposer)
+      .ngram_max_size(FLAGS_ngram_max_size)
+      .enable_adaptive_speculation(FLAGS_enable_adaptive_speculation)
+      .speculative_min_acceptance(FLAGS_speculative_min_acceptance)
+      .speculative_max_batch_size(FLAGS_speculative_max_batch_size)
+      .num_decode_steps(FLAGS_num_decode_steps)
+      .enable_fused_sampling(FLAGS_enable_fused_sampling)
+      .enable_pivot_sampling(FLAGS_enable_pivot_sampling)
+      .enable_vocab_parallel_sampling(FLAGS_enable_vocab_parallel_sampling)
+      .cascade_min_prefix_len(FLAGS_cascade_min_prefix_len)
+      .pp_size(FLAGS_pp_size)
+      .num_micro_batches(FLAGS_num_micro_batches)
+      .data_parallel_size(FLAGS_data_parallel_size)
+      .remote_workers(FLAGS_remote_workers)
+      .lazy_cuda_graph_capture(FLAGS_lazy_cuda_graph_capture)
+      .enable_activation_pool(FLAGS_enable_activation_pool)
+      .profile_cache_dir(FLAGS_profile_cache_dir)
+      .weights_snapshot_dir(FLAGS_weights_snapshot_dir)
+      .lora_adapters(FLAGS_lora_adapters)
+      .scheduling_policy(FLAGS_scheduling_policy)
+      .sjf_aging_tokens_per_second(FLAGS_sjf_aging_tokens_per_second)
+      .tenant_weights(FLAGS_tenant_weights)
+      .max_tenant_kv_cache_share(FLAGS_max_tenant_kv_cache_share)
+      .swap_bandwidth_gbps(FLAGS_swap_bandwidth_gbps)
+      .max_compaction_blocks_per_step(FLAGS_max_compaction_blocks_per_step)
+      .ttft_slo_ms(FLAGS_ttft_slo_ms)
+      .itl_slo_ms(FLAGS_itl_slo_ms)
+      .prefix_admission_window(FLAGS_prefix_admission_window)
+      .max_admission_skips(FLAGS_max_admission_skips)
+      .wait_for_inflight_prefix(FLAGS_wait_for_inflight_prefix)
+      .high_priority_reserved_tokens(FLAGS_high_priority_reserved_tokens)
+      .high_priority_reserved_seqs(FLAGS_high_priority_reserved_seqs)
+      .num_response_threads(FLAGS_num_response_threads)
+      .num_encode_threads(FLAGS_num_encode_threads)
+      .prompt_cache_tokens(FLAGS_prompt_cache_tokens)
+      .response_cache_size(FLAGS_response_cache_size)
+      .response_cache_ttl_seconds(FLAGS_response_cache_ttl_seconds)
+      .max_sessions(FLAGS_max_sessions)
+      .session_ttl_seconds(FLAGS_session_ttl_seconds)
+      .max_session_kv_cache_share(FLAGS_max_session_kv_cache_share)
+      .best_of_prune_margin(FLAGS_best_of_prune_margin)
+      .best_of_prune_interval(FLAGS_best_of_prune_interval)
+      .max_cached_grammars(FLAGS_max_cached_grammars)
+      .scheduler_cpus(FLAGS_scheduler_cpus)
+      .handler_cpus(FLAGS_handler_cpus)
+      .numa_affinity(FLAGS_numa_affinity)
+      .enable_warmup(FLAGS_enable_warmup)
+      .max_estimated_ttft_ms(FLAGS_max_estimated_ttft_ms)
+      .clamp_max_tokens_to_kv_cache(FLAGS_clamp_max_tokens_to_kv_cache);
+
+  ModelPool::Options pool_options;
+  pool_options.max_resident_models(FLAGS_max_resident_models);
+  auto model_pool = std::make_unique<ModelPool>(pool_options);
+  model_pool->add(FLAGS_model_id, options);
+
+  // the extra models share the options of the main model
+  const std::vector<std::string> extra_models =
+      absl::StrSplit(FLAGS_extra_models, ',', absl::SkipEmpty());
+  for (const auto& extra_model : extra_models) {
+    const std::vector<std::string> parts =
+        absl::StrSplit(extra_model, absl::MaxSplits('=', 1));
+    if (parts.size() != 2 || parts[0].empty() ||
+        !std::filesystem::exists(parts[1])) {
+      LOG(FATAL) << "Invalid extra model: " << extra_model;
+    }
+    LLMHandler::Options extra_options = options;
+    extra_options.model_path(parts[1]).draft_model_path("").lora_adapters("");
+    if (!FLAGS_weights_snapshot_dir.empty()) {
+      extra_options.weights_snapshot_dir(
+          (std::filesystem::path(FLAGS_weights_snapshot_dir) / parts[0])
+              .string());
+    }
+    model_pool->add(parts[0], extra_options);
+  }
+  model_pool->start();
 
-  auto llm_handler = std::make_unique<LLMHandler>(options);
-  llm_handler->start();
+  // ready once the models are loaded (and warmed up) until draining
+  http_server.register_uri(
+      "/ready", [&model_pool](HttpServer::Transport& transport) -> bool {
+        if (model_pool->is_draining()) {
+          return transport.send_status(503);
+        }
+        return transport.send_string("OK\n");
+      });
 
-  // supported models
-  std::vector<std::string> models = {FLAGS_model_id};
   auto completion_handler =
-      std::make_unique<CompletionHandler>(llm_handler.get(), models);
-  auto chat_handler = std::make_unique<ChatHandler>(llm_handler.get(), models);
-  auto models_handler = std::make_unique<ModelsHandler>(models);
+      std::make_unique<CompletionHandler>(model_pool.get());
+  auto chat_handler = std::make_unique<ChatHandler>(model_pool.get());
+  auto embedding_handler =
+      std::make_unique<EmbeddingHandler>(model_pool.get());
+  auto models_handler = std::make_unique<ModelsHandler>(model_pool->models());
+  auto load_handler = std::make_unique<LoadHandler>(model_pool.get());
+
+  // serve the OpenAI-compatible api over http as well
+  HttpApi http_api(std::make_unique<CompletionHandler>(model_pool.get()),
+                   std::make_unique<ChatHandler>(model_pool.get()),
+                   std::make_unique<EmbeddingHandler>(model_pool.get()),
+                   std::make_unique<ModelsHandler>(model_pool->models()));
+  if (!http_api.register_uris(&http_server)) {
+    LOG(ERROR) << "Failed to register the OpenAI-compatible api";
+    return -1;
+  }
 
   // start grpc server
   GrpcServer grpc_server(std::move(completion_handler),
                          std::move(chat_handler),
-                         std::move(models_handler));
+                         std::move(embedding_handler),
+                         std::move(models_handler),
+                         std::move(load_handler));
   GrpcServer::Options grpc_options;
   grpc_options.address = "0.0.0.0";
   grpc_options.port = FLAGS_grpc_port;
+  grpc_options.stream_options.max_write_batch_size =
+      std::max(FLAGS_grpc_max_write_batch_size, 1);
+  grpc_options.stream_options.max_pending_responses =
+      std::max(FLAGS_grpc_max_pending_responses, 1);
 
   if (!grpc_server.start(grpc_options)) {
     LOG(ERROR) << "failed to start grpc server on port " << FLAGS_grpc_port;
     return -1;
   }
 
-  if (!http_server.start(FLAGS_http_port, /*num_threads=*/2)) {
+  if (!http_server.start(FLAGS_http_port, FLAGS_num_http_threads)) {
     LOG(ERROR) << "Failed to start http server on port " << FLAGS_http_port;
     return -1;
   }
@@ -207,9 +693,16 @@ int main(int argc, char** argv) {
     std::this_thread::sleep_for(std::chrono::milliseconds(500));
   }
 
+  // refuse new requests and finish the ones in flight before stopping
+  if (FLAGS_drain_timeout_s > 0 &&
+      !model_pool->drain(absl::Seconds(FLAGS_drain_timeout_s))) {
+    LOG(WARNING) << "Stopping with requests in flight after "
+                 << FLAGS_drain_timeout_s << "s";
+  }
+
   // stop grpc server and http server
   grpc_server.stop();
   http_server.stop();
-  llm_handler->stop();
+  model_pool->stop();
   return 0;
 }
@@ -0,0 +1,44 @@
+#include <absl/strings/str_format.h>
+#include <folly/init/Init.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <grpcpp/grpcpp.h>
+#include <torch/torch.h>
+
+#include <memory>
+#include <string>
+
+#include "engine/worker_service.h"
+using namespace llm;
+
+DEFINE_string(host, "0.0.0.0", "Address to listen on for the engine.");
+
+DEFINE_int32(port, 8890, "Port to listen on for the engine.");
+
+DEFINE_string(device, "cuda:0", "Device to run the worker on, e.g. cuda:0.");
+
+// serves one gpu for a scalellm engine in another process or host, started
+// before the engine with --remote_workers pointing to it.
+int main(int argc, char** argv) {
+  // glog and glfag will be initialized in folly::init
+  folly::Init init(&argc, &argv);
+  google::InstallFailureSignalHandler();
+
+  const torch::Device device(FLAGS_device);
+  CHECK(device.is_cuda()) << "Worker only supports cuda devices";
+
+  WorkerService service(device);
+  const std::string address = absl::StrFormat("%s:%d", FLAGS_host, FLAGS_port);
+  grpc::ServerBuilder builder;
+  // model inputs of large batches can exceed the default 4MB limit
+  builder.SetMaxReceiveMessageSize(-1);
+  builder.AddListeningPort(address, grpc::InsecureServerCredentials());
+  builder.RegisterService(&service);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  CHECK(server != nullptr) << "Failed to start worker on " << address;
+  LOG(INFO) << "Started worker on " << address << " with device " << device;
+
+  // the worker exits with the engine, which holds the other ranks
+  server->Wait();
+  return 0;
+}
@@ -0,0 +1,55 @@
+#include "draft_proposer.h"
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <vector>
+
+namespace llm {
+
+DraftProposer::DraftProposer(LLMEngine* engine) : engine_(engine) {
+  CHECK(engine_ != nullptr);
+}
+
+Proposal DraftProposer::propose(Batch& batch, size_t num_tokens) {
+  std::vector<torch::Tensor> token_ids_vec;
+  std::vector<torch::Tensor> probs_vec;
+  batch.set_engine_type(EngineType::SSM);
+  size_t num_proposed = 0;
+  while (num_proposed < num_tokens) {
+    // the remaining tokens are drafted on devices in one call once every
+    // sequence decodes one token per step, usually after the first step that
+    // catches up with the accepted tokens.
+    const auto output =
+        engine_->execute_decode_steps(batch, num_tokens - num_proposed);
+    const auto& sample_output = output.sample_output;
+    if (!sample_output.next_tokens.defined()) {
+      // no sequence to sample
+      return {};
+    }
+    // [batch_size, n_steps] for multiple steps, [batch_size] otherwise
+    const auto& next_tokens = sample_output.next_tokens;
+    const int64_t batch_size = next_tokens.size(/*dim=*/0);
+    const int64_t n_steps = next_tokens.dim() > 1 ? next_tokens.size(1) : 1;
+    const int64_t vocab_size = sample_output.probs.size(/*dim=*/-1);
+    token_ids_vec.push_back(next_tokens.view({batch_size, n_steps}));
+    probs_vec.push_back(
+        sample_output.probs.view({batch_size, n_steps, vocab_size}));
+    num_proposed += n_steps;
+  }
+
+  // concatenate the draft token ids and probs along the token dimension
+  Proposal proposal;
+  proposal.token_ids = torch::cat(token_ids_vec, /*dim=*/1);
+  proposal.probs = torch::cat(probs_vec, /*dim=*/1);
+  return proposal;
+}
+
+void DraftProposer::skip(Batch& batch) {
+  batch.set_engine_type(EngineType::SSM);
+  batch.set_skip_sampling(true);
+  engine_->execute_model(batch);
+  batch.set_skip_sampling(false);
+}
+
+}  // namespace llm
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+
+#include "engine/batch.h"
+#include "engine/llm_engine.h"
+#include "proposer.h"
+
+namespace llm {
+
+// propose tokens by running a small draft model autoregressively
+class DraftProposer final : public Proposer {
+ public:
+  // the draft engine is owned by the caller
+  explicit DraftProposer(LLMEngine* engine);
+
+  Proposal propose(Batch& batch, size_t num_tokens) override;
+
+  // fill the kv cache of the draft model to keep it in sync with the target
+  void skip(Batch& batch) override;
+
+ private:
+  // not owned
+  LLMEngine* engine_ = nullptr;
+};
+
+}  // namespace llm
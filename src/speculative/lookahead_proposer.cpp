@@ -0,0 +1,202 @@
+#include "lookahead_proposer.h"
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace llm {
+
+LookaheadProposer::LookaheadProposer(size_t ngram_size,
+                                     size_t n_leaves_per_depth,
+                                     size_t max_ngrams_per_token)
+    : ngram_size_(ngram_size),
+      n_leaves_per_depth_(n_leaves_per_depth),
+      max_ngrams_per_token_(max_ngrams_per_token) {
+  CHECK_GT(ngram_size_, 1) << "lookahead ngram size should be at least 2";
+  CHECK_GT(max_ngrams_per_token_, 0)
+      << "max ngrams per token should be positive";
+}
+
+std::vector<int32_t> LookaheadProposer::draft(
+    const State& state,
+    const Slice<int32_t>& token_ids,
+    size_t num_tokens,
+    std::vector<int32_t>* leaves) const {
+  const int32_t last_token_id = token_ids.back();
+
+  // the candidates following the last token: the pool n-grams, then the
+  // current Jacobi iterate
+  std::vector<std::vector<int32_t>> candidates;
+  const auto it = state.pool.find(last_token_id);
+  if (it != state.pool.end()) {
+    candidates = it->second;
+  }
+  if (state.guess_num_tokens == token_ids.size() && !state.guess.empty() &&
+      std::find(candidates.begin(), candidates.end(), state.guess) ==
+          candidates.end()) {
+    candidates.push_back(state.guess);
+  }
+
+  // continue the first candidate with the pool, or repeat the last token
+  std::vector<int32_t> draft_token_ids;
+  if (!candidates.empty()) {
+    draft_token_ids = candidates.front();
+  }
+  while (draft_token_ids.size() < num_tokens) {
+    const int32_t token_id =
+        draft_token_ids.empty() ? last_token_id : draft_token_ids.back();
+    const auto next = state.pool.find(token_id);
+    if (next == state.pool.end()) {
+      draft_token_ids.push_back(token_id);
+      continue;
+    }
+    const auto& ngram = next->second.front();
+    draft_token_ids.insert(draft_token_ids.end(), ngram.begin(), ngram.end());
+  }
+  draft_token_ids.resize(num_tokens);
+
+  // the other candidates branch off the draft at their first mismatch
+  leaves->clear();
+  leaves->resize(num_tokens * n_leaves_per_depth_);
+  std::vector<size_t> num_leaves(num_tokens, 0);
+  for (size_t c = 1; c < candidates.size(); ++c) {
+    const auto& candidate = candidates[c];
+    const size_t len = std::min(candidate.size(), num_tokens);
+    size_t depth = 0;
+    while (depth < len && candidate[depth] == draft_token_ids[depth]) {
+      ++depth;
+    }
+    if (depth == len || num_leaves[depth] == n_leaves_per_depth_) {
+      continue;
+    }
+    auto* begin = leaves->data() + depth * n_leaves_per_depth_;
+    auto* end = begin + num_leaves[depth];
+    if (std::find(begin, end, candidate[depth]) == end) {
+      *end = candidate[depth];
+      ++num_leaves[depth];
+    }
+  }
+  // the draft token is never accepted as a leaf
+  for (size_t depth = 0; depth < num_tokens; ++depth) {
+    auto* begin = leaves->data() + depth * n_leaves_per_depth_;
+    std::fill(begin + num_leaves[depth],
+              begin + n_leaves_per_depth_,
+              draft_token_ids[depth]);
+  }
+  return draft_token_ids;
+}
+
+void LookaheadProposer::add_ngram(State* state,
+                                  int32_t token_id,
+                                  const int32_t* next_token_ids,
+                                  size_t n) const {
+  std::vector<int32_t> ngram(next_token_ids, next_token_ids + n);
+  auto& ngrams = state->pool[token_id];
+  const auto it = std::find(ngrams.begin(), ngrams.end(), ngram);
+  if (it != ngrams.end()) {
+    ngrams.erase(it);
+  }
+  ngrams.insert(ngrams.begin(), std::move(ngram));
+  if (ngrams.size() > max_ngrams_per_token_) {
+    ngrams.pop_back();
+  }
+}
+
+Proposal LookaheadProposer::propose(Batch& batch, size_t num_tokens) {
+  std::vector<int64_t> token_ids;
+  std::vector<int64_t> leaf_token_ids;
+  std::vector<int32_t> leaves;
+  batch.set_engine_type(EngineType::LLM);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    // only propose for sequences with enough budget to verify the proposal
+    if (!can_verify(batch, i, num_tokens)) {
+      continue;
+    }
+    Sequence* sequence = batch[i];
+
+    State& state = states_[sequence->id()];
+    state.num_tokens = sequence->num_tokens();
+    const auto proposal =
+        draft(state, sequence->token_ids(), num_tokens, &leaves);
+    for (const int32_t token_id : proposal) {
+      sequence->append_token(token_id);
+      token_ids.push_back(token_id);
+    }
+    leaf_token_ids.insert(leaf_token_ids.end(), leaves.begin(), leaves.end());
+  }
+  if (token_ids.empty()) {
+    return {};
+  }
+
+  Proposal output;
+  output.token_ids = torch::tensor(token_ids, torch::kLong)
+                         .view({-1, static_cast<int64_t>(num_tokens)});
+  if (n_leaves_per_depth_ > 0) {
+    output.leaf_token_ids =
+        torch::tensor(leaf_token_ids, torch::kLong)
+            .view({-1,
+                   static_cast<int64_t>(num_tokens),
+                   static_cast<int64_t>(n_leaves_per_depth_)});
+  }
+  return output;
+}
+
+void LookaheadProposer::update_predictions(
+    Batch& batch,
+    const torch::Tensor& target_token_ids) {
+  // [n_seqs, n_speculative_tokens + 1]
+  const auto predictions =
+      target_token_ids.to(torch::kCPU, torch::kInt).contiguous();
+  const int64_t n_seqs = predictions.size(/*dim=*/0);
+  const size_t len = predictions.size(/*dim=*/1);
+
+  absl::flat_hash_map<int64_t, State> states;
+  int64_t row = 0;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    const Sequence* sequence = batch[i];
+    if (sequence->is_prefill_stage()) {
+      // not sampled
+      continue;
+    }
+    CHECK_LT(row, n_seqs);
+    const int32_t* data = predictions[row++].const_data_ptr<int32_t>();
+    auto it = states_.find(sequence->id());
+    if (it == states_.end() || sequence->is_finished()) {
+      continue;
+    }
+    State& state = it->second;
+    const size_t num_tokens = sequence->num_tokens();
+    if (num_tokens <= state.num_tokens || num_tokens > state.num_tokens + len) {
+      // not proposed in this step
+      states.emplace(sequence->id(), std::move(state));
+      continue;
+    }
+
+    // the predictions after each token of the iterate form the n-grams
+    const auto token_ids = sequence->token_ids();
+    for (size_t j = 0; j < len; ++j) {
+      const int32_t token_id =
+          j == 0 ? token_ids[state.num_tokens - 1] : data[j - 1];
+      add_ngram(&state, token_id, data + j, std::min(ngram_size_ - 1, len - j));
+    }
+
+    // the predictions after the accepted tokens are the next iterate, valid
+    // only if the accepted tokens follow the greedy predictions.
+    const size_t num_accepted = num_tokens - state.num_tokens;
+    state.guess.clear();
+    if (std::equal(data,
+                   data + num_accepted,
+                   token_ids.data() + state.num_tokens)) {
+      state.guess.assign(data + num_accepted, data + len);
+      state.guess_num_tokens = num_tokens;
+    }
+    states.emplace(sequence->id(), std::move(state));
+  }
+  // drop the states of the finished and descheduled sequences
+  states_ = std::move(states);
+}
+
+}  // namespace llm
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <torch/torch.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "common/slice.h"
+#include "engine/batch.h"
+#include "proposer.h"
+
+namespace llm {
+
+// propose tokens by lookahead (Jacobi) decoding without a draft model: the
+// target predictions at the verified positions after the first rejected
+// draft token are the next Jacobi iterate of the tokens following the
+// accepted ones, and the n-grams along the iterates are collected into a pool
+// per sequence. the draft chain continues the last token with the pool or the
+// iterate, and the other pool candidates are verified as tree leaves in the
+// same target pass.
+class LookaheadProposer final : public Proposer {
+ public:
+  // ngram_size: size of the collected n-grams, a token followed by
+  // ngram_size - 1 predicted tokens
+  // n_leaves_per_depth: number of alternatives proposed per draft position
+  // max_ngrams_per_token: max n-grams kept per first token, most recent first
+  LookaheadProposer(size_t ngram_size,
+                    size_t n_leaves_per_depth,
+                    size_t max_ngrams_per_token);
+
+  Proposal propose(Batch& batch, size_t num_tokens) override;
+
+  void update_predictions(Batch& batch,
+                          const torch::Tensor& target_token_ids) override;
+
+ private:
+  struct State {
+    // number of tokens before the draft tokens of the last proposal
+    size_t num_tokens = 0;
+
+    // the Jacobi iterate of the tokens after the first guess_num_tokens
+    // tokens, stale once the sequence moves on
+    size_t guess_num_tokens = 0;
+    std::vector<int32_t> guess;
+
+    // first token -> following tokens of the n-grams, most recent first
+    absl::flat_hash_map<int32_t, std::vector<std::vector<int32_t>>> pool;
+  };
+
+  // draft num_tokens tokens after the last token, and n_leaves_per_depth_
+  // alternatives for each of them, flattened as [num_tokens,
+  // n_leaves_per_depth_] and filled with the draft token if missing.
+  std::vector<int32_t> draft(const State& state,
+                             const Slice<int32_t>& token_ids,
+                             size_t num_tokens,
+                             std::vector<int32_t>* leaves) const;
+
+  // add the n-gram to the pool of the sequence
+  void add_ngram(State* state,
+                 int32_t token_id,
+                 const int32_t* next_token_ids,
+                 size_t n) const;
+
+  size_t ngram_size_ = 2;
+
+  size_t n_leaves_per_depth_ = 0;
+
+  size_t max_ngrams_per_token_ = 1;
+
+  // sequence id -> lookahead state
+  absl::flat_hash_map<int64_t, State> states_;
+};
+
+}  // namespace llm
@@ -0,0 +1,66 @@
+#include "lookahead_proposer.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "memory/block_allocator.h"
+
+namespace llm {
+namespace {
+std::vector<int64_t> to_vector(const torch::Tensor& tensor) {
+  const auto t = tensor.contiguous();
+  const auto* data = t.const_data_ptr<int64_t>();
+  return {data, data + t.numel()};
+}
+}  // namespace
+
+TEST(LookaheadProposerTest, JacobiIterations) {
+  BlockAllocator allocator(/*num_blocks=*/20, /*block_size=*/4);
+  // reserve block 0
+  auto block_0 = allocator.allocate();
+
+  Sequence::Options options;
+  // seq in decode phase
+  Sequence seq(/*token_ids=*/{1, 2}, /*capacity=*/100, options);
+  seq.append_blocks(allocator.allocate(4));
+  seq.commit_kv_cache(/*size=*/2);
+  seq.append_token(3);
+  Batch batch;
+  batch.add(&seq);
+
+  LookaheadProposer proposer(/*ngram_size=*/3,
+                             /*n_leaves_per_depth=*/1,
+                             /*max_ngrams_per_token=*/4);
+
+  // nothing collected yet, repeat the last token
+  Proposal proposal = proposer.propose(batch, /*num_tokens=*/2);
+  EXPECT_FALSE(proposal.probs.defined());
+  EXPECT_EQ(to_vector(proposal.token_ids), std::vector<int64_t>({3, 3}));
+  ASSERT_EQ(proposal.leaf_token_ids.sizes(), torch::IntArrayRef({1, 2, 1}));
+  EXPECT_EQ(to_vector(proposal.leaf_token_ids), std::vector<int64_t>({3, 3}));
+
+  // the target predicts [4, 5, 6] and accepts 4 only
+  seq.append_token(6);
+  seq.validate_tokens(std::vector<int64_t>{4, -1, -1});
+  proposer.update_predictions(batch, torch::tensor({{4, 5, 6}}, torch::kLong));
+
+  // the next iterate [5, 6] follows 4
+  proposal = proposer.propose(batch, /*num_tokens=*/2);
+  EXPECT_EQ(to_vector(proposal.token_ids), std::vector<int64_t>({5, 6}));
+  EXPECT_EQ(to_vector(proposal.leaf_token_ids), std::vector<int64_t>({5, 6}));
+
+  // the target rejects 5 with 3
+  seq.append_token(1);
+  seq.validate_tokens(std::vector<int64_t>{3, -1, -1});
+  EXPECT_EQ(seq.token_ids(), std::vector<int32_t>({1, 2, 3, 4, 3}));
+  proposer.update_predictions(batch, torch::tensor({{3, 7, 1}}, torch::kLong));
+
+  // the latest n-gram after 3 is drafted, the earlier one is a leaf
+  proposal = proposer.propose(batch, /*num_tokens=*/2);
+  EXPECT_EQ(to_vector(proposal.token_ids), std::vector<int64_t>({7, 1}));
+  EXPECT_EQ(to_vector(proposal.leaf_token_ids), std::vector<int64_t>({4, 1}));
+}
+
+}  // namespace llm
@@ -0,0 +1,79 @@
+#include "medusa_heads.h"
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <string>
+#include <vector>
+
+namespace llm {
+
+MedusaHeadsImpl::MedusaHeadsImpl(int64_t num_heads,
+                                 int64_t num_layers,
+                                 int64_t hidden_size,
+                                 int64_t vocab_size,
+                                 const torch::TensorOptions& options)
+    : num_heads_(num_heads), num_layers_(num_layers) {
+  CHECK_GT(num_heads, 0) << "at least one medusa head is needed";
+  CHECK_GE(num_layers, 0);
+  for (int64_t i = 0; i < num_heads; ++i) {
+    const std::string head = std::to_string(i) + ".";
+    for (int64_t j = 0; j < num_layers; ++j) {
+      const std::string layer = head + std::to_string(j) + ".linear.";
+      const std::string param = "head_" + std::to_string(i) + "_layer_" +
+                                std::to_string(j) + "_";
+      weights_.push_back(
+          register_parameter(param + "weight",
+                             torch::empty({hidden_size, hidden_size}, options),
+                             /*requires_grad=*/false));
+      biases_.push_back(register_parameter(param + "bias",
+                                           torch::empty({hidden_size}, options),
+                                           /*requires_grad=*/false));
+      named_weights_.emplace_back(layer + "weight", weights_.back());
+      named_weights_.emplace_back(layer + "bias", biases_.back());
+    }
+    lm_head_weights_.push_back(
+        register_parameter("head_" + std::to_string(i) + "_lm_head_weight",
+                           torch::empty({vocab_size, hidden_size}, options),
+                           /*requires_grad=*/false));
+    named_weights_.emplace_back(head + std::to_string(num_layers) + ".weight",
+                                lm_head_weights_.back());
+  }
+  is_loaded_.resize(named_weights_.size(), false);
+}
+
+torch::Tensor MedusaHeadsImpl::forward(const torch::Tensor& hidden_states) {
+  std::vector<torch::Tensor> logits;
+  logits.reserve(num_heads_);
+  for (int64_t i = 0; i < num_heads_; ++i) {
+    auto h = hidden_states;
+    for (int64_t j = 0; j < num_layers_; ++j) {
+      const size_t idx = i * num_layers_ + j;
+      h = h + torch::silu(torch::linear(h, weights_[idx], biases_[idx]));
+    }
+    logits.push_back(torch::linear(h, lm_head_weights_[i]));
+  }
+  return torch::stack(logits, /*dim=*/1);
+}
+
+void MedusaHeadsImpl::load_state_dict(const StateDict& state_dict) {
+  for (size_t i = 0; i < named_weights_.size(); ++i) {
+    auto& [name, weight] = named_weights_[i];
+    const auto tensor = state_dict.get_tensor(name);
+    if (tensor.defined()) {
+      CHECK_EQ(weight.sizes(), tensor.sizes())
+          << "weight size mismatch for " << name;
+      weight.copy_(tensor);
+      is_loaded_[i] = true;
+    }
+  }
+}
+
+void MedusaHeadsImpl::verify_loaded_weights() const {
+  for (size_t i = 0; i < named_weights_.size(); ++i) {
+    CHECK(is_loaded_[i]) << "weight is not loaded for "
+                         << named_weights_[i].first;
+  }
+}
+
+}  // namespace llm
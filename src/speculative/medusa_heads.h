@@ -0,0 +1,60 @@
+#pragma once
+
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "model_loader/state_dict.h"
+
+namespace llm {
+
+// Medusa heads predict the tokens after the next token from the last hidden
+// states of the target model, the i-th head predicts the token i + 2
+// positions ahead. each head is a stack of residual blocks h + silu(linear(h))
+// followed by its own lm head. the weights follow medusa checkpoints:
+// "{head}.{layer}.linear.weight", "{head}.{layer}.linear.bias" and
+// "{head}.{num_layers}.weight" for the lm head.
+class MedusaHeadsImpl : public torch::nn::Module {
+ public:
+  MedusaHeadsImpl(int64_t num_heads,
+                  int64_t num_layers,
+                  int64_t hidden_size,
+                  int64_t vocab_size,
+                  const torch::TensorOptions& options);
+
+  // hidden_states: [n_tokens, hidden_size]
+  // returns: [n_tokens, num_heads, vocab_size]
+  torch::Tensor forward(const torch::Tensor& hidden_states);
+
+  // load the weights from the checkpoint
+  void load_state_dict(const StateDict& state_dict);
+
+  // verify if all the weights are loaded
+  void verify_loaded_weights() const;
+
+  int64_t num_heads() const { return num_heads_; }
+
+ private:
+  int64_t num_heads_ = 0;
+
+  int64_t num_layers_ = 0;
+
+  // parameter members, must be registered
+  // [num_heads * num_layers] weights and biases of the residual blocks
+  std::vector<torch::Tensor> weights_;
+  std::vector<torch::Tensor> biases_;
+  // [num_heads] weights of the lm heads
+  std::vector<torch::Tensor> lm_head_weights_;
+
+  // all the weights with their names in the checkpoint
+  std::vector<std::pair<std::string, torch::Tensor>> named_weights_;
+
+  // whether each weight is loaded
+  std::vector<bool> is_loaded_;
+};
+TORCH_MODULE(MedusaHeads);
+
+}  // namespace llm
@@ -0,0 +1,59 @@
+#include "medusa_heads.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include <string>
+#include <unordered_map>
+
+#include "model_loader/state_dict.h"
+
+namespace llm {
+
+TEST(MedusaHeadsTest, Forward) {
+  const int64_t num_heads = 3;
+  const int64_t num_layers = 2;
+  const int64_t hidden_size = 16;
+  const int64_t vocab_size = 32;
+  const auto options = torch::dtype(torch::kFloat);
+
+  std::unordered_map<std::string, torch::Tensor> dict;
+  for (int64_t i = 0; i < num_heads; ++i) {
+    const std::string head = std::to_string(i) + ".";
+    for (int64_t j = 0; j < num_layers; ++j) {
+      const std::string layer = head + std::to_string(j) + ".linear.";
+      dict[layer + "weight"] = torch::randn({hidden_size, hidden_size}) * 0.1;
+      dict[layer + "bias"] = torch::randn({hidden_size}) * 0.1;
+    }
+    dict[head + std::to_string(num_layers) + ".weight"] =
+        torch::randn({vocab_size, hidden_size});
+  }
+  StateDict state_dict(dict);
+
+  MedusaHeads heads(num_heads, num_layers, hidden_size, vocab_size, options);
+  heads->load_state_dict(state_dict);
+  heads->verify_loaded_weights();
+
+  const auto hidden_states = torch::randn({4, hidden_size});
+  const auto logits = heads(hidden_states);
+  ASSERT_EQ(logits.sizes(),
+            torch::IntArrayRef({4, num_heads, vocab_size}));
+
+  for (int64_t i = 0; i < num_heads; ++i) {
+    const std::string head = std::to_string(i) + ".";
+    auto h = hidden_states;
+    for (int64_t j = 0; j < num_layers; ++j) {
+      const std::string layer = head + std::to_string(j) + ".linear.";
+      h = h + torch::silu(torch::matmul(h, dict[layer + "weight"].t()) +
+                          dict[layer + "bias"]);
+    }
+    const auto expected = torch::matmul(
+        h, dict[head + std::to_string(num_layers) + ".weight"].t());
+    EXPECT_TRUE(torch::allclose(logits.select(/*dim=*/1, i),
+                                expected,
+                                /*rtol=*/1e-4,
+                                /*atol=*/1e-4));
+  }
+}
+
+}  // namespace llm
@@ -0,0 +1,142 @@
+#include "medusa_proposer.h"
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "common/json_reader.h"
+#include "model_loader/state_dict.h"
+
+namespace llm {
+
+MedusaProposer::MedusaProposer(const torch::Device& device)
+    : device_(device) {}
+
+bool MedusaProposer::init(const std::string& heads_weights_path,
+                          const ModelArgs& target_args,
+                          torch::ScalarType dtype) {
+  LOG(INFO) << "Initializing medusa heads from: " << heads_weights_path;
+  JsonReader reader;
+  const std::string config_path = heads_weights_path + "/config.json";
+  if (!reader.parse(config_path)) {
+    LOG(ERROR) << "Failed to parse medusa config file: " << config_path;
+    return false;
+  }
+  const auto num_heads = reader.value_or<int64_t>("medusa_num_heads", 5);
+  const auto num_layers = reader.value_or<int64_t>("medusa_num_layers", 1);
+  LOG(INFO) << "Medusa heads: " << num_heads << ", layers: " << num_layers;
+
+  // prefer safetensors over pickle files
+  std::vector<std::string> weights_files;
+  bool is_pickle = false;
+  for (const auto& ext : {".safetensors", ".pt", ".bin"}) {
+    for (const auto& entry :
+         std::filesystem::directory_iterator(heads_weights_path)) {
+      if (entry.path().extension() == ext) {
+        weights_files.push_back(entry.path().string());
+      }
+    }
+    if (!weights_files.empty()) {
+      is_pickle = ext != std::string(".safetensors");
+      break;
+    }
+  }
+  if (weights_files.empty()) {
+    LOG(ERROR) << "Failed to find medusa weights files in "
+               << heads_weights_path;
+    return false;
+  }
+
+  const auto options = torch::dtype(dtype).device(device_);
+  heads_ = MedusaHeads(num_heads,
+                       num_layers,
+                       target_args.hidden_size(),
+                       target_args.vocab_size(),
+                       options);
+  for (const auto& weights_file : weights_files) {
+    LOG(INFO) << "Loading medusa weights from " << weights_file;
+    const auto state_dict = StateDict::load(weights_file, is_pickle);
+    // weights may be saved with the module name of the heads
+    const auto heads_state_dict = state_dict->select("medusa_head.");
+    heads_->load_state_dict(heads_state_dict.size() > 0 ? heads_state_dict
+                                                        : *state_dict);
+  }
+  heads_->verify_loaded_weights();
+  return true;
+}
+
+Proposal MedusaProposer::propose(Batch& batch, size_t num_tokens) {
+  CHECK_LE(num_tokens, static_cast<size_t>(num_heads()))
+      << "not enough medusa heads for the speculative tokens";
+  std::vector<int64_t> token_ids;
+  batch.set_engine_type(EngineType::LLM);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    // only propose for sequences with enough budget to verify the proposal
+    if (!can_verify(batch, i, num_tokens)) {
+      continue;
+    }
+    Sequence* sequence = batch[i];
+
+    const auto it = drafts_.find(sequence->id());
+    if (it != drafts_.end() &&
+        it->second.num_tokens == sequence->num_tokens()) {
+      for (size_t j = 0; j < num_tokens; ++j) {
+        sequence->append_token(it->second.token_ids[j]);
+        token_ids.push_back(it->second.token_ids[j]);
+      }
+      continue;
+    }
+    // no hidden states yet, e.g. the first token after the prompt
+    const int32_t last_token_id = sequence->token_ids().back();
+    for (size_t j = 0; j < num_tokens; ++j) {
+      sequence->append_token(last_token_id);
+      token_ids.push_back(last_token_id);
+    }
+  }
+  if (token_ids.empty()) {
+    return {};
+  }
+
+  Proposal output;
+  output.token_ids = torch::tensor(token_ids, torch::kLong)
+                         .view({-1, static_cast<int64_t>(num_tokens)});
+  return output;
+}
+
+void MedusaProposer::update(Batch& batch, const torch::Tensor& hidden_states) {
+  drafts_.clear();
+  if (!hidden_states.defined()) {
+    return;
+  }
+
+  torch::NoGradGuard no_grad;
+  // [n_seqs, num_heads]
+  const auto draft_token_ids =
+      heads_(hidden_states.to(device_))
+          .argmax(/*dim=*/-1)
+          .to(torch::kCPU, torch::kInt)
+          .contiguous();
+  const int64_t n_seqs = draft_token_ids.size(/*dim=*/0);
+  const int64_t n_heads = draft_token_ids.size(/*dim=*/1);
+
+  int64_t row = 0;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    const Sequence* sequence = batch[i];
+    if (sequence->is_prefill_stage()) {
+      // not sampled
+      continue;
+    }
+    CHECK_LT(row, n_seqs);
+    const int32_t* data = draft_token_ids[row++].const_data_ptr<int32_t>();
+    if (sequence->is_finished()) {
+      continue;
+    }
+    drafts_[sequence->id()] = {sequence->num_tokens(),
+                               std::vector<int32_t>(data, data + n_heads)};
+  }
+}
+
+}  // namespace llm
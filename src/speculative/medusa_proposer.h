@@ -0,0 +1,53 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <torch/torch.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "engine/batch.h"
+#include "medusa_heads.h"
+#include "models/model_args.h"
+#include "proposer.h"
+
+namespace llm {
+
+// propose tokens with medusa heads on top of the target model. the heads run
+// on the target hidden states of the last accepted token after each step,
+// and the drafts are proposed in the next step without a draft model.
+class MedusaProposer final : public Proposer {
+ public:
+  explicit MedusaProposer(const torch::Device& device);
+
+  // load the heads from the directory with config.json and the weights, the
+  // hidden size and vocab size come from the target model.
+  bool init(const std::string& heads_weights_path,
+            const ModelArgs& target_args,
+            torch::ScalarType dtype);
+
+  int64_t num_heads() const { return heads_->num_heads(); }
+
+  Proposal propose(Batch& batch, size_t num_tokens) override;
+
+  // run the heads to draft the tokens for the next step
+  void update(Batch& batch, const torch::Tensor& hidden_states) override;
+
+ private:
+  struct Draft {
+    // the number of tokens in the sequence when drafted
+    size_t num_tokens = 0;
+    std::vector<int32_t> token_ids;
+  };
+
+  torch::Device device_;
+
+  MedusaHeads heads_{nullptr};
+
+  // drafts of the sequences in the last batch, keyed by sequence id
+  absl::flat_hash_map<int64_t, Draft> drafts_;
+};
+
+}  // namespace llm
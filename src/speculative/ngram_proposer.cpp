@@ -0,0 +1,78 @@
+#include "ngram_proposer.h"
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace llm {
+
+NGramProposer::NGramProposer(size_t min_ngram_size, size_t max_ngram_size)
+    : min_ngram_size_(min_ngram_size), max_ngram_size_(max_ngram_size) {
+  CHECK_GT(min_ngram_size_, 0) << "ngram size should be positive";
+  CHECK_LE(min_ngram_size_, max_ngram_size_)
+      << "min ngram size should not exceed max ngram size";
+}
+
+std::vector<int32_t> NGramProposer::match(const Slice<int32_t>& token_ids,
+                                          size_t num_tokens) const {
+  const size_t len = token_ids.size();
+  if (len < 2 || num_tokens == 0) {
+    return {};
+  }
+
+  const int32_t* data = token_ids.data();
+  // prefer longer n-grams since they are more likely to continue the same way
+  const size_t max_n = std::min(max_ngram_size_, len - 1);
+  for (size_t n = max_n; n >= min_ngram_size_; --n) {
+    const int32_t* suffix = data + len - n;
+    // search backwards for the most recent occurrence before the suffix
+    for (size_t start = len - n; start-- > 0;) {
+      if (!std::equal(suffix, suffix + n, data + start)) {
+        continue;
+      }
+      // copy the following tokens, which may run into the proposed tokens
+      std::vector<int32_t> proposal;
+      proposal.reserve(num_tokens);
+      for (size_t i = start + n; proposal.size() < num_tokens; ++i) {
+        proposal.push_back(i < len ? data[i] : proposal[i - len]);
+      }
+      return proposal;
+    }
+  }
+  return {};
+}
+
+Proposal NGramProposer::propose(Batch& batch, size_t num_tokens) {
+  std::vector<int64_t> token_ids;
+  batch.set_engine_type(EngineType::LLM);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    // only propose for sequences with enough budget to verify the proposal
+    if (!can_verify(batch, i, num_tokens)) {
+      continue;
+    }
+    Sequence* sequence = batch[i];
+
+    auto proposal = match(sequence->token_ids(), num_tokens);
+    if (proposal.empty()) {
+      // no match, repeat the last token which is verified as usual
+      proposal.assign(num_tokens, sequence->token_ids().back());
+    }
+    for (const int32_t token_id : proposal) {
+      sequence->append_token(token_id);
+      token_ids.push_back(token_id);
+    }
+  }
+  if (token_ids.empty()) {
+    return {};
+  }
+
+  Proposal output;
+  output.token_ids = torch::tensor(token_ids, torch::kLong)
+                         .view({-1, static_cast<int64_t>(num_tokens)});
+  return output;
+}
+
+}  // namespace llm
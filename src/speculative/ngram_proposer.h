@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "common/slice.h"
+#include "engine/batch.h"
+#include "proposer.h"
+
+namespace llm {
+
+// propose tokens by prompt lookup: find the most recent earlier occurrence of
+// the longest suffix n-gram of the sequence, and copy the tokens following
+// it. no draft model is needed, which works well when the output repeats
+// the context, e.g. code editing and summarization.
+class NGramProposer final : public Proposer {
+ public:
+  // min_ngram_size, max_ngram_size: range of suffix lengths to match
+  NGramProposer(size_t min_ngram_size, size_t max_ngram_size);
+
+  Proposal propose(Batch& batch, size_t num_tokens) override;
+
+  // returns num_tokens tokens following the matched n-gram, empty if no match
+  std::vector<int32_t> match(const Slice<int32_t>& token_ids,
+                             size_t num_tokens) const;
+
+ private:
+  size_t min_ngram_size_ = 1;
+
+  size_t max_ngram_size_ = 1;
+};
+
+}  // namespace llm
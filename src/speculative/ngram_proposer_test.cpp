@@ -0,0 +1,77 @@
+#include "ngram_proposer.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "memory/block_allocator.h"
+
+namespace llm {
+
+TEST(NGramProposerTest, Match) {
+  NGramProposer proposer(/*min_ngram_size=*/1, /*max_ngram_size=*/3);
+
+  // the longest suffix [2, 3] matches, prefer the most recent occurrence
+  std::vector<int32_t> token_ids = {1, 2, 3, 4, 9, 2, 3, 5, 6, 2, 3};
+  EXPECT_EQ(proposer.match(token_ids, /*num_tokens=*/2),
+            std::vector<int32_t>({5, 6}));
+
+  // the continuation runs into the proposed tokens
+  token_ids = {7, 8, 7, 8};
+  EXPECT_EQ(proposer.match(token_ids, /*num_tokens=*/3),
+            std::vector<int32_t>({7, 8, 7}));
+
+  // no match
+  token_ids = {1, 2, 3, 4};
+  EXPECT_TRUE(proposer.match(token_ids, /*num_tokens=*/2).empty());
+
+  // the suffix is too short for min_ngram_size
+  NGramProposer bigram_proposer(/*min_ngram_size=*/2, /*max_ngram_size=*/2);
+  token_ids = {1, 2, 5, 1, 3, 2};
+  EXPECT_TRUE(bigram_proposer.match(token_ids, /*num_tokens=*/2).empty());
+  token_ids = {1, 2, 5, 1, 2};
+  EXPECT_EQ(bigram_proposer.match(token_ids, /*num_tokens=*/2),
+            std::vector<int32_t>({5, 1}));
+}
+
+TEST(NGramProposerTest, Propose) {
+  BlockAllocator allocator(/*num_blocks=*/20, /*block_size=*/4);
+  // reserve block 0
+  auto block_0 = allocator.allocate();
+
+  Sequence::Options options;
+  const size_t capacity = 100;
+  // seq in decode phase with a match
+  Sequence seq1(/*token_ids=*/{1, 2, 3, 4, 1, 2}, capacity, options);
+  seq1.append_blocks(allocator.allocate(3));
+  seq1.commit_kv_cache(/*size=*/5);
+  // seq in decode phase without a match
+  Sequence seq2(/*token_ids=*/{5, 6, 7}, capacity, options);
+  seq2.append_blocks(allocator.allocate(2));
+  seq2.commit_kv_cache(/*size=*/2);
+  // seq in prefill phase without enough budget to finish the prompt
+  Sequence seq3(/*token_ids=*/{1, 2, 3, 4, 5, 6, 7, 8}, capacity, options);
+  seq3.append_blocks(allocator.allocate(2));
+
+  Batch batch;
+  batch.add(&seq1);
+  batch.add(&seq2);
+  batch.add(&seq3, /*token_budget=*/4);
+
+  NGramProposer proposer(/*min_ngram_size=*/1, /*max_ngram_size=*/3);
+  const Proposal proposal = proposer.propose(batch, /*num_tokens=*/2);
+  EXPECT_FALSE(proposal.probs.defined());
+  ASSERT_EQ(proposal.token_ids.sizes(), torch::IntArrayRef({2, 2}));
+  const auto token_ids = proposal.token_ids.contiguous();
+  const auto* data = token_ids.const_data_ptr<int64_t>();
+  EXPECT_EQ(std::vector<int64_t>(data, data + 4),
+            std::vector<int64_t>({3, 4, 7, 7}));
+
+  // draft tokens are appended to the sampled sequences only
+  EXPECT_EQ(seq1.num_tokens(), 8);
+  EXPECT_EQ(seq2.num_tokens(), 5);
+  EXPECT_EQ(seq3.num_tokens(), 8);
+}
+
+}  // namespace llm
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <torch/torch.h>
+
+#include <cstddef>
+
+#include "engine/batch.h"
+
+namespace llm {
+
+// draft tokens proposed for the sequences in a batch
+struct Proposal {
+  // [batch_size, n_speculative_tokens] LongTensor
+  torch::Tensor token_ids;
+
+  // [batch_size, n_speculative_tokens, vocab_size] FloatTensor
+  // undefined if the proposal is deterministic, e.g. prompt lookup, which
+  // puts all the probability on the draft token.
+  torch::Tensor probs;
+
+  // [batch_size, n_speculative_tokens, n_leaves_per_depth] LongTensor
+  // alternatives of the draft tokens to verify as tree leaves, undefined to
+  // take the top tokens of probs instead.
+  torch::Tensor leaf_token_ids;
+};
+
+// Proposer drafts speculative tokens to be verified by the target model.
+class Proposer {
+ public:
+  virtual ~Proposer() = default;
+
+  // append num_tokens draft tokens to each sequence in the batch that will
+  // be sampled by the target model in this step.
+  virtual Proposal propose(Batch& batch, size_t num_tokens) = 0;
+
+  // catch up with the tokens in the batch without proposing, called when
+  // speculation is off for the step.
+  virtual void skip(Batch& /*batch*/) {}
+
+  // called once the tokens of the sampled sequences in the batch are
+  // accepted, with the target hidden states of the last accepted token.
+  // hidden_states: [n_sampled_seqs, hidden_size], undefined if the target
+  // model doesn't return hidden states.
+  virtual void update(Batch& /*batch*/,
+                      const torch::Tensor& /*hidden_states*/) {}
+
+  // called after update with the greedy target predictions at the verified
+  // positions: the bonus token after the last accepted token and the token
+  // after each draft token. target_token_ids: [n_sampled_seqs,
+  // n_speculative_tokens + 1]
+  virtual void update_predictions(Batch& /*batch*/,
+                                  const torch::Tensor& /*target_token_ids*/) {
+  }
+
+ protected:
+  // whether the i-th sequence has enough token budget for the target model
+  // to verify num_tokens draft tokens after its last token in this step.
+  static bool can_verify(const Batch& batch, size_t i, size_t num_tokens) {
+    const Sequence* sequence = batch[i];
+    return sequence->num_kv_cache_tokens() + batch.token_budget(i) >=
+           sequence->num_tokens() + num_tokens;
+  }
+};
+
+}  // namespace llm
@@ -5,6 +5,7 @@
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include "kernels/sampling/sampling_kernels.h"
 #include "sampling/sampler.h"
 
 namespace llm {
@@ -17,20 +18,31 @@ torch::Tensor index_select_2d(const torch::Tensor& input,
   return input.gather(dim, index.unsqueeze(dim)).squeeze(dim);
 }
 
+// mixed into the seeds of the sequences, so that the acceptance tests do not
+// reuse the random numbers the draft model sampled the same positions with.
+constexpr int64_t kRejectionSeedSalt = 0x5bd1e9955bd1e995LL;
+
 }  // namespace
 
 RejectionSampler::RejectionSampler(const torch::Tensor& do_sample,
                                    bool logprobs,
-                                   int64_t max_top_logprobs)
+                                   int64_t max_top_logprobs,
+                                   const torch::Tensor& rng_seeds,
+                                   const torch::Tensor& rng_offsets)
     : logprobs_(logprobs), max_top_logprobs_(max_top_logprobs) {
   // [batch_size, 1]
   do_sample_ = do_sample.unsqueeze_(/*dim=*/-1);
+  if (rng_offsets.defined()) {
+    rng_seeds_ = rng_seeds.bitwise_xor(kRejectionSeedSalt);
+    rng_offsets_ = rng_offsets;
+  }
   all_random_sample_ = do_sample.all().item<bool>();
   all_greedy_sample_ = !do_sample.any().item<bool>();
 }
 
 // draft_token_ids: [batch_size, n_speculative_tokens]
-// draft_probs: [batch_size, n_speculative_tokens, vocab_size]
+// draft_probs: [batch_size, n_speculative_tokens, vocab_size], undefined for
+// deterministic proposals
 // target_logits: [batch_size, n_speculative_tokens + 1, vocab_size]
 // bonus_token_ids: [batch_size, 1]
 // returns accepted tokens. [batch_size, n_speculative_tokens + 1]
@@ -41,53 +53,70 @@ SampleOutput RejectionSampler::forward(const torch::Tensor& draft_token_ids,
                                        bool mask_out_rejected_tokens) const {
   CHECK_EQ(draft_token_ids.size(0), do_sample_.size(0))
       << "batch size mismatch";
-  DCHECK_EQ(draft_token_ids.size(1), draft_probs.size(1));
+  DCHECK(!draft_probs.defined() ||
+         draft_token_ids.size(1) == draft_probs.size(1));
   // DCHECK_EQ(draft_probs.sizes(), target_probs.sizes());
 
-  // [batch_size, n_speculative_tokens + 1, vocab_size] FloatTensor
-  auto target_probs =
-      torch::softmax(target_logits, /*dim=*/-1, /*dtype=*/torch::kFloat32);
-  // filter out probs for bonus tokens
-  target_probs = target_probs.slice(
-      /*dim=*/1, /*start=*/0, /*end=*/target_probs.size(1) - 1);
-
   // [batch_size, n_speculative_tokens + 1]
   torch::Tensor accepted_token_ids;
   torch::Tensor masked_accepted_token_ids;
-  if (all_greedy_sample_) {
-    std::tie(accepted_token_ids, masked_accepted_token_ids) =
-        greedy_sample(draft_token_ids,
-                      target_probs,
-                      bonus_token_ids,
-                      mask_out_rejected_tokens);
-  } else if (all_random_sample_) {
-    auto uniform_rand =
-        torch::rand(draft_token_ids.sizes(), draft_probs.options());
+  if (target_logits.is_cuda()) {
+    // the target probs are only computed up to the first rejected token
+    const auto do_sample = all_greedy_sample_
+                               ? torch::Tensor()
+                               : do_sample_.squeeze(/*dim=*/-1);
     std::tie(accepted_token_ids, masked_accepted_token_ids) =
-        random_sample(draft_token_ids,
-                      draft_probs,
-                      target_probs,
-                      uniform_rand,
-                      bonus_token_ids,
-                      mask_out_rejected_tokens);
+        fused_sample(draft_token_ids,
+                     draft_probs,
+                     target_logits,
+                     bonus_token_ids,
+                     do_sample,
+                     mask_out_rejected_tokens,
+                     rng_seeds_,
+                     rng_offsets_);
   } else {
-    auto uniform_rand =
-        torch::rand(draft_token_ids.sizes(), draft_probs.options());
-    // mixed sample, sample both then choose based on do_sample_
-    auto [random, masked_random] = random_sample(draft_token_ids,
-                                                 draft_probs,
-                                                 target_probs,
-                                                 uniform_rand,
-                                                 bonus_token_ids,
-                                                 mask_out_rejected_tokens);
-    auto [greedy, masked_greedy] = greedy_sample(draft_token_ids,
-                                                 target_probs,
-                                                 bonus_token_ids,
-                                                 mask_out_rejected_tokens);
-    accepted_token_ids = torch::where(do_sample_, random, greedy);
-    if (mask_out_rejected_tokens) {
-      masked_accepted_token_ids =
-          torch::where(do_sample_, masked_random, masked_greedy);
+    // [batch_size, n_speculative_tokens + 1, vocab_size] FloatTensor
+    auto target_probs =
+        torch::softmax(target_logits, /*dim=*/-1, /*dtype=*/torch::kFloat32);
+    // filter out probs for bonus tokens
+    target_probs = target_probs.slice(
+        /*dim=*/1, /*start=*/0, /*end=*/target_probs.size(1) - 1);
+
+    if (all_greedy_sample_) {
+      std::tie(accepted_token_ids, masked_accepted_token_ids) =
+          greedy_sample(draft_token_ids,
+                        target_probs,
+                        bonus_token_ids,
+                        mask_out_rejected_tokens);
+    } else if (all_random_sample_) {
+      auto uniform_rand =
+          torch::rand(draft_token_ids.sizes(), target_probs.options());
+      std::tie(accepted_token_ids, masked_accepted_token_ids) =
+          random_sample(draft_token_ids,
+                        draft_probs,
+                        target_probs,
+                        uniform_rand,
+                        bonus_token_ids,
+                        mask_out_rejected_tokens);
+    } else {
+      auto uniform_rand =
+          torch::rand(draft_token_ids.sizes(), target_probs.options());
+      // mixed sample, sample both then choose based on do_sample_
+      auto [random, masked_random] = random_sample(draft_token_ids,
+                                                   draft_probs,
+                                                   target_probs,
+                                                   uniform_rand,
+                                                   bonus_token_ids,
+                                                   mask_out_rejected_tokens);
+      auto [greedy, masked_greedy] = greedy_sample(draft_token_ids,
+                                                   target_probs,
+                                                   bonus_token_ids,
+                                                   mask_out_rejected_tokens);
+      accepted_token_ids = torch::where(do_sample_, random, greedy);
+      if (mask_out_rejected_tokens) {
+        masked_accepted_token_ids =
+            torch::where(do_sample_, masked_random, masked_greedy);
+      }
     }
   }
 
@@ -142,6 +171,40 @@ torch::Tensor RejectionSampler::build_accepted_mask(
   return accepted_mask;
 }
 
+torch::Tensor RejectionSampler::accept_tree_leaves(
+    const torch::Tensor& accepted_token_ids,
+    const torch::Tensor& draft_token_ids,
+    const torch::Tensor& leaf_token_ids,
+    const torch::Tensor& leaf_next_token_ids) {
+  const auto n_speculative_tokens = draft_token_ids.size(1);
+  const auto n_leaves = leaf_token_ids.size(2);
+
+  // [batch_size, n_speculative_tokens]
+  auto chain_token_ids = accepted_token_ids.slice(
+      /*dim=*/1, /*start=*/0, /*end=*/n_speculative_tokens);
+  auto rejected = chain_token_ids != draft_token_ids;
+  // [batch_size, 1], use LongTensor since argmax does not support bool
+  auto first_rejected =
+      rejected.to(torch::kInt64).argmax(/*dim=*/1, /*keepdim=*/true);
+  // the resampled token at the first rejected position, -1 if masked out
+  auto resampled = chain_token_ids.gather(/*dim=*/1, first_rejected);
+  auto valid = rejected.any(/*dim=*/1, /*keepdim=*/true) & (resampled != -1);
+
+  // [batch_size, n_leaves]
+  auto index = first_rejected.unsqueeze(/*dim=*/-1).expand({-1, 1, n_leaves});
+  auto leaves = leaf_token_ids.gather(/*dim=*/1, index).squeeze(/*dim=*/1);
+  auto next_tokens =
+      leaf_next_token_ids.gather(/*dim=*/1, index).squeeze(/*dim=*/1);
+  auto matched = (leaves == resampled) & valid;
+
+  // [batch_size, 1]
+  auto matched_leaf =
+      matched.to(torch::kInt64).argmax(/*dim=*/1, /*keepdim=*/true);
+  auto bonus = next_tokens.gather(/*dim=*/1, matched_leaf).squeeze(/*dim=*/1);
+  return torch::where(
+      matched.any(/*dim=*/1), bonus, -torch::ones_like(bonus));
+}
+
 std::tuple<torch::Tensor, torch::Tensor> RejectionSampler::random_sample(
     const torch::Tensor& draft_token_ids,
     const torch::Tensor& draft_probs,
@@ -149,17 +212,25 @@ std::tuple<torch::Tensor, torch::Tensor> RejectionSampler::random_sample(
     const torch::Tensor& uniform_rand,
     const torch::Tensor& bonus_token_ids,
     bool mask_out_rejected_tokens) {
-  auto selected_draft_probs =
-      index_select_2d(draft_probs, /*dim=*/-1, draft_token_ids);
   auto selected_target_probs =
       index_select_2d(target_probs, /*dim=*/-1, draft_token_ids);
 
-  // std::min(probs, 1.0) element-wise
-  auto acceptance_probs = (selected_target_probs / selected_draft_probs);
-  auto accepted = (uniform_rand < acceptance_probs);
-
-  // construct recovered probs
-  auto recovered_probs = (target_probs - draft_probs).clamp_min_(0);
+  torch::Tensor accepted;
+  torch::Tensor recovered_probs;
+  if (draft_probs.defined()) {
+    auto selected_draft_probs =
+        index_select_2d(draft_probs, /*dim=*/-1, draft_token_ids);
+    // std::min(probs, 1.0) element-wise
+    auto acceptance_probs = (selected_target_probs / selected_draft_probs);
+    accepted = (uniform_rand < acceptance_probs);
+    // construct recovered probs
+    recovered_probs = (target_probs - draft_probs).clamp_min_(0);
+  } else {
+    // deterministic proposal: all draft probs are on the draft token
+    accepted = (uniform_rand < selected_target_probs);
+    recovered_probs =
+        target_probs.scatter(/*dim=*/-1, draft_token_ids.unsqueeze(-1), 0);
+  }
   // a small value to avoid division by zero
   const auto epsilon = 1e-6f;
   auto sum = recovered_probs.sum(-1, /*keepdim=*/true).clamp_min_(epsilon);
@@ -209,4 +280,36 @@ std::tuple<torch::Tensor, torch::Tensor> RejectionSampler::greedy_sample(
   return {accepted_token_ids, masked_accepted_token_ids};
 }
 
+std::tuple<torch::Tensor, torch::Tensor> RejectionSampler::fused_sample(
+    const torch::Tensor& draft_token_ids,
+    const torch::Tensor& draft_probs,
+    const torch::Tensor& target_logits,
+    const torch::Tensor& bonus_token_ids,
+    const torch::Tensor& do_sample,
+    bool mask_out_rejected_tokens,
+    const torch::Tensor& rng_seeds,
+    const torch::Tensor& rng_offsets) {
+  CHECK(target_logits.is_cuda()) << "fused rejection sampling needs cuda";
+  const auto batch_size = draft_token_ids.size(0);
+  const auto n_tokens = draft_token_ids.size(1) + 1;
+  const auto options =
+      torch::dtype(torch::kInt64).device(target_logits.device());
+
+  auto accepted_token_ids = torch::empty({batch_size, n_tokens}, options);
+  torch::Tensor masked_accepted_token_ids;
+  if (mask_out_rejected_tokens) {
+    masked_accepted_token_ids = torch::empty({batch_size, n_tokens}, options);
+  }
+  kernel::invoke_rejection_sampling(accepted_token_ids,
+                                    masked_accepted_token_ids,
+                                    draft_token_ids,
+                                    draft_probs,
+                                    target_logits.contiguous(),
+                                    bonus_token_ids,
+                                    do_sample,
+                                    rng_seeds,
+                                    rng_offsets);
+  return {accepted_token_ids, masked_accepted_token_ids};
+}
+
 }  // namespace llm
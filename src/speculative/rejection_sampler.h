@@ -8,9 +8,13 @@ namespace llm {
 
 class RejectionSampler final {
  public:
+  // rng_seeds, rng_offsets: [batch_size], the seeds of the sequences and the
+  // positions of their bonus tokens, undefined if no sequence is seeded.
   RejectionSampler(const torch::Tensor& do_sample,
                    bool logprobs,
-                   int64_t max_top_logprobs);
+                   int64_t max_top_logprobs,
+                   const torch::Tensor& rng_seeds = {},
+                   const torch::Tensor& rng_offsets = {});
 
   // operator() allows us to use the module as a function.
   template <typename... Args>
@@ -20,7 +24,8 @@ class RejectionSampler final {
 
   // Sample tokens ids using rejection sampling.
   // draft_token_ids: [batch_size, n_speculative_tokens]
-  // draft_probs: [batch_size, n_speculative_tokens, vocab_size]
+  // draft_probs: [batch_size, n_speculative_tokens, vocab_size], undefined
+  // if the draft tokens are deterministic (all mass on the draft token).
   // target_logits: [batch_size, n_speculative_tokens + 1, vocab_size]
   // bonus_token_ids: [batch_size, 1]
   SampleOutput forward(const torch::Tensor& draft_token_ids,
@@ -34,6 +39,20 @@ class RejectionSampler final {
   //               [1, 0, 0, 0]]         [1, 1, 0, 0, 0]]
   static torch::Tensor build_accepted_mask(const torch::Tensor& accepted);
 
+  // match the first rejected position against the tree leaves at the same
+  // depth, the token after a matched leaf is accepted as an extra token.
+  // accepted_token_ids: [batch_size, n_speculative_tokens + 1], masked
+  // draft_token_ids: [batch_size, n_speculative_tokens]
+  // leaf_token_ids: [batch_size, n_speculative_tokens, n_leaves]
+  // leaf_next_token_ids: [batch_size, n_speculative_tokens, n_leaves] tokens
+  // sampled from the target model after each leaf
+  // returns: [batch_size], the token after the matched leaf, -1 if no match
+  static torch::Tensor accept_tree_leaves(
+      const torch::Tensor& accepted_token_ids,
+      const torch::Tensor& draft_token_ids,
+      const torch::Tensor& leaf_token_ids,
+      const torch::Tensor& leaf_next_token_ids);
+
   static std::tuple<torch::Tensor, torch::Tensor> random_sample(
       const torch::Tensor& draft_token_ids,
       const torch::Tensor& draft_probs,
@@ -48,6 +67,21 @@ class RejectionSampler final {
       const torch::Tensor& bonus_token_ids,
       bool mask_out_rejected_tokens);
 
+  // greedy and random rejection sampling on cuda in one kernel, which stops
+  // at the first rejected token of each sequence. the tokens after it are the
+  // draft tokens in the unmasked output.
+  // do_sample: [batch_size] bool, all greedy if undefined
+  // rng_seeds, rng_offsets: [batch_size], undefined if not seeded
+  static std::tuple<torch::Tensor, torch::Tensor> fused_sample(
+      const torch::Tensor& draft_token_ids,
+      const torch::Tensor& draft_probs,
+      const torch::Tensor& target_logits,
+      const torch::Tensor& bonus_token_ids,
+      const torch::Tensor& do_sample,
+      bool mask_out_rejected_tokens,
+      const torch::Tensor& rng_seeds = {},
+      const torch::Tensor& rng_offsets = {});
+
  private:
   // whether to return logprobs
   bool logprobs_ = false;
@@ -57,6 +91,11 @@ class RejectionSampler final {
 
   // [batch_size]
   torch::Tensor do_sample_;
+
+  // [batch_size], undefined if no sequence is seeded
+  torch::Tensor rng_seeds_;
+  torch::Tensor rng_offsets_;
+
   bool all_random_sample_ = true;
   bool all_greedy_sample_ = true;
 };
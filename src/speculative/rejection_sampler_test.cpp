@@ -84,6 +84,42 @@ TEST(RejectionSamplerTest, Mask) {
   EXPECT_TRUE(torch::allclose(mask, desired_mask));
 }
 
+TEST(RejectionSamplerTest, TreeLeaves) {
+  const auto options = torch::dtype(torch::kInt64);
+
+  // clang-format off
+  const auto draft_token_ids = torch::tensor({
+        {1, 2, 3},
+        {1, 2, 3},
+        {1, 2, 3},
+        {1, 2, 3}},
+        options);
+  // resampled at depth 2, resampled at depth 1, all accepted, resampled at
+  // depth 3 without matched leaf
+  const auto accepted_token_ids = torch::tensor({
+        {1, 6, -1, -1},
+        {5, -1, -1, -1},
+        {1, 2, 3, 4},
+        {1, 2, 9, -1}},
+        options);
+  // [batch_size, n_speculative_tokens, n_leaves]
+  const auto leaf_token_ids = torch::tensor({
+        {{4, 5}, {6, 7}, {8, 9}},
+        {{4, 5}, {6, 7}, {8, 9}},
+        {{4, 5}, {6, 7}, {8, 9}},
+        {{4, 5}, {6, 7}, {8, 8}}},
+        options);
+  const auto leaf_next_token_ids = leaf_token_ids + 10;
+  // clang-format on
+
+  const auto bonus =
+      RejectionSampler::accept_tree_leaves(accepted_token_ids,
+                                           draft_token_ids,
+                                           leaf_token_ids,
+                                           leaf_next_token_ids);
+  EXPECT_TRUE(torch::equal(bonus, torch::tensor({16, 15, -1, -1}, options)));
+}
+
 TEST(RejectionSamplerTest, Greedy) {
   torch::ScalarType dtype(torch::kFloat32);
   torch::Device device(torch::kCPU);
@@ -228,4 +264,140 @@ TEST(RejectionSamplerTest, Random) {
                               /*atol=*/1e-3));
 }
 
+TEST(RejectionSamplerTest, RandomDeterministicDraft) {
+  torch::ScalarType dtype(torch::kFloat32);
+  torch::Device device(torch::kCPU);
+  const auto options = torch::dtype(dtype).device(device);
+
+  // set random seed
+  torch::manual_seed(100);
+
+  int64_t vocab_size = 50;
+  int64_t num_samples = 500000;
+
+  auto target_prob = torch::randn({vocab_size}, options).softmax(/*dim=*/-1);
+  auto target_probs =
+      target_prob.reshape({1, 1, -1}).repeat({num_samples, 1, 1});
+
+  // the same draft token without probs, e.g. from prompt lookup
+  auto draft_token_ids =
+      torch::full({num_samples, 1}, 3, options.dtype(torch::kInt64));
+
+  // not used
+  auto bonus_token_ids =
+      torch::ones({num_samples, 1}, options.dtype(torch::kInt64));
+
+  auto uniform_rand = torch::rand(draft_token_ids.sizes(), options);
+  auto [output, masked_output] =
+      RejectionSampler::random_sample(draft_token_ids,
+                                      /*draft_probs=*/torch::Tensor(),
+                                      target_probs,
+                                      uniform_rand,
+                                      bonus_token_ids,
+                                      false);
+
+  // the output still follows the target distribution
+  auto token_ids = output.slice(/*dim=*/-1, /*start=*/0, /*end=*/-1).flatten();
+  auto bincount = token_ids.bincount(/*weights=*/torch::nullopt,
+                                     /*minlength=*/vocab_size);
+  auto sample_prob = bincount.to(torch::kFloat) / num_samples;
+
+  EXPECT_TRUE(torch::allclose(target_prob,
+                              sample_prob,
+                              /*rtol=*/1e-2,
+                              /*atol=*/1e-3));
+}
+
+TEST(RejectionSamplerTest, FusedGreedy) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  torch::Device device(torch::kCUDA);
+  const auto options = torch::dtype(torch::kFloat32).device(device);
+  torch::manual_seed(100);
+
+  const int64_t batch_size = 64;
+  const int64_t n_speculative_tokens = 4;
+  const int64_t vocab_size = 1000;
+  auto target_logits = torch::randn(
+      {batch_size, n_speculative_tokens + 1, vocab_size}, options);
+  // accept a random prefix of the greedy tokens of each sequence
+  auto draft_token_ids =
+      target_logits.slice(/*dim=*/1, /*start=*/0, /*end=*/-1).argmax(-1);
+  auto reject = torch::rand({batch_size, n_speculative_tokens}, options) < 0.3;
+  draft_token_ids = torch::where(reject,
+                                 torch::randint_like(draft_token_ids, 0, 10),
+                                 draft_token_ids);
+  const auto bonus_token_ids = torch::randint(
+      0, vocab_size, {batch_size, 1}, options.dtype(torch::kInt64));
+
+  auto target_probs = torch::softmax(target_logits, /*dim=*/-1)
+                          .slice(/*dim=*/1, /*start=*/0, /*end=*/-1);
+  auto [expected, expected_masked] =
+      RejectionSampler::greedy_sample(draft_token_ids,
+                                      target_probs,
+                                      bonus_token_ids,
+                                      /*mask_out_rejected_tokens=*/true);
+  auto [output, masked_output] =
+      RejectionSampler::fused_sample(draft_token_ids,
+                                     /*draft_probs=*/torch::Tensor(),
+                                     target_logits,
+                                     bonus_token_ids,
+                                     /*do_sample=*/torch::Tensor(),
+                                     /*mask_out_rejected_tokens=*/true);
+  EXPECT_TRUE(torch::equal(masked_output, expected_masked));
+}
+
+TEST(RejectionSamplerTest, FusedRandom) {
+  if (!torch::cuda::is_available()) {
+    GTEST_SKIP() << "CUDA not available, skipping test";
+  }
+  torch::Device device(torch::kCUDA);
+  const auto options = torch::dtype(torch::kFloat32).device(device);
+  torch::manual_seed(100);
+
+  int64_t vocab_size = 50;
+  int64_t num_samples = 500000;
+
+  auto target_prob = torch::randn({vocab_size}, options).softmax(/*dim=*/-1);
+  // the logits of the draft token and the bonus token
+  auto target_logits =
+      target_prob.log().reshape({1, 1, -1}).repeat({num_samples, 2, 1});
+  const auto do_sample =
+      torch::ones({num_samples}, options.dtype(torch::kBool));
+  auto bonus_token_ids =
+      torch::ones({num_samples, 1}, options.dtype(torch::kInt64));
+
+  auto draft_probs =
+      torch::randn({num_samples, 1, vocab_size}, options).softmax(/*dim=*/-1);
+  auto draft_token_ids = Sampler::random_sample(draft_probs);
+  // the same draft token without probs, e.g. from prompt lookup
+  auto deterministic_draft_token_ids =
+      torch::full({num_samples, 1}, 3, options.dtype(torch::kInt64));
+
+  for (const auto& [token_ids, probs] :
+       {std::make_pair(draft_token_ids, draft_probs),
+        std::make_pair(deterministic_draft_token_ids, torch::Tensor())}) {
+    auto [output, masked_output] =
+        RejectionSampler::fused_sample(token_ids,
+                                       probs,
+                                       target_logits,
+                                       bonus_token_ids,
+                                       do_sample,
+                                       /*mask_out_rejected_tokens=*/false);
+    EXPECT_FALSE(masked_output.defined());
+
+    // the output follows the target distribution
+    auto sampled =
+        output.slice(/*dim=*/-1, /*start=*/0, /*end=*/-1).flatten();
+    auto bincount = sampled.bincount(/*weights=*/torch::nullopt,
+                                     /*minlength=*/vocab_size);
+    auto sample_prob = bincount.to(torch::kFloat) / num_samples;
+    EXPECT_TRUE(torch::allclose(target_prob,
+                                sample_prob,
+                                /*rtol=*/1e-2,
+                                /*atol=*/1e-3));
+  }
+}
+
 }  // namespace llm
@@ -3,13 +3,20 @@
 #include <gflags/gflags_declare.h>
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <memory>
+#include <vector>
 
 #include "common/metrics.h"
 #include "common/timer.h"
+#include "draft_proposer.h"
 #include "engine/llm_engine.h"
 #include "engine/parameters.h"
+#include "lookahead_proposer.h"
+#include "medusa_proposer.h"
+#include "ngram_proposer.h"
 #include "rejection_sampler.h"
+#include "sampling/sampler.h"
 
 DEFINE_COUNTER_FAMILY(speculative_execution_latency_seconds,
                       "Execution latency in seconds");
@@ -23,43 +30,84 @@ DEFINE_COUNTER_INSTANCE(validation_latency_seconds,
                         speculative_execution_latency_seconds,
                         {{"stage", "validation"}});
 
+DEFINE_COUNTER(speculative_tokens_total,
+               "Total number of speculative tokens proposed");
+DEFINE_COUNTER(speculation_off_steps_total,
+               "Total number of steps that speculation is off");
+
 namespace llm {
 
 SpeculativeEngine::SpeculativeEngine(const Options& options)
     : options_(options) {
   CHECK_GT(options.num_speculative_tokens(), 0)
       << "speculative tokens should not be zero";
+  CHECK_GT(options.speculative_tree_width(), 0)
+      << "speculative tree width should not be zero";
+  // one bit per new token in the tree attention mask, including the last
+  // accepted token and the token before it if its kv cache is recomputed.
+  CHECK_LE(options.num_speculative_tokens() * options.speculative_tree_width(),
+           62)
+      << "too many tokens in the speculative tree";
+
+  // check if llm and ssm are using the same device
+  if (options.speculative_proposer() == "draft") {
+    for (const auto& target : options.devices()) {
+      for (const auto& draft : options.draft_devices()) {
+        if (target == draft) {
+          share_device_ = true;
+          break;
+        }
+      }
+    }
+  }
 
   // carry over the options
   LLMEngine::Options engine_options;
   engine_options.block_size(options.block_size())
       .max_cache_size(options.max_cache_size())
+      .resizable_cache_size(options.resizable_cache_size())
       .max_memory_utilization(options.max_memory_utilization())
       .enable_prefix_cache(options.enable_prefix_cache())
+      .kv_cache_dtype(options.kv_cache_dtype())
       .enable_cuda_graph(options.enable_cuda_graph())
-      .cuda_graph_max_seq_len(options.cuda_graph_max_seq_len());
+      .cuda_graph_max_seq_len(options.cuda_graph_max_seq_len())
+      .share_device_resources(share_device_);
 
   // target engine
   engine_options.devices(options.devices())
       .num_decoding_tokens(options.num_speculative_tokens() + 1)
-      .cuda_graph_batch_sizes(options.cuda_graph_batch_sizes());
+      .cuda_graph_batch_sizes(options.cuda_graph_batch_sizes())
+      .return_hidden_states(options.speculative_proposer() == "medusa");
   engine_ = std::make_unique<LLMEngine>(engine_options);
 
+  if (options.speculative_proposer() == "ngram") {
+    // prompt lookup, no draft model needed
+    proposer_ = std::make_unique<NGramProposer>(options.ngram_min_size(),
+                                                options.ngram_max_size());
+    return;
+  }
+  if (options.speculative_proposer() == "lookahead") {
+    // jacobi iterations of the target model, no draft model needed
+    proposer_ = std::make_unique<LookaheadProposer>(
+        options.ngram_max_size(),
+        options.speculative_tree_width() - 1,
+        /*max_ngrams_per_token=*/8);
+    return;
+  }
+  if (options.speculative_proposer() == "medusa") {
+    // the heads run on the target hidden states, created with the model
+    return;
+  }
+  CHECK_EQ(options.speculative_proposer(), "draft")
+      << "unknown speculative proposer: " << options.speculative_proposer();
+
   // draft engine
   engine_options.devices(options.draft_devices())
       .num_decoding_tokens(1)
-      .cuda_graph_batch_sizes(options.draft_cuda_graph_batch_sizes());
+      .cuda_graph_batch_sizes(options.draft_cuda_graph_batch_sizes())
+      .quant_method(options.draft_quant_method());
   draft_engine_ = std::make_unique<LLMEngine>(engine_options);
-
-  // check if llm and ssm are using the same device
-  for (const auto& target : options.devices()) {
-    for (const auto& draft : options.draft_devices()) {
-      if (target == draft) {
-        share_device_ = true;
-        break;
-      }
-    }
-  }
+  proposer_ = std::make_unique<DraftProposer>(draft_engine_.get());
 }
 
 bool SpeculativeEngine::init(const std::string& model_weights_path,
@@ -75,7 +123,7 @@ bool SpeculativeEngine::init(const std::string& model_weights_path,
 
   // warmup the model
   if (!engine_->capture_cuda_graphs() ||
-      !draft_engine_->capture_cuda_graphs()) {
+      (draft_engine_ && !draft_engine_->capture_cuda_graphs())) {
     return false;
   }
 
@@ -88,6 +136,23 @@ bool SpeculativeEngine::init_model(
   if (!engine_->init_model(model_weights_path)) {
     return false;
   }
+  if (options_.speculative_proposer() == "medusa") {
+    // the heads share the first target device
+    auto proposer = std::make_unique<MedusaProposer>(options_.devices()[0]);
+    if (!proposer->init(draft_model_weights_path,
+                        engine_->model_args(),
+                        engine_->dtype())) {
+      return false;
+    }
+    CHECK_LE(options_.num_speculative_tokens(), proposer->num_heads())
+        << "not enough medusa heads for the speculative tokens";
+    proposer_ = std::move(proposer);
+  }
+  if (!draft_engine_) {
+    // no draft model to check
+    model_args_ = engine_->model_args();
+    return true;
+  }
   if (!draft_engine_->init_model(draft_model_weights_path)) {
     return false;
   }
@@ -134,97 +199,292 @@ bool SpeculativeEngine::init_model(
 
 bool SpeculativeEngine::init_kv_cache() {
   // determine the kv cache size
-  int64_t n_blocks = 0;
   const int64_t target_kv_cache_size = engine_->profile_memory_for_kv_cache();
   const int64_t draft_kv_cache_size =
-      draft_engine_->profile_memory_for_kv_cache();
+      draft_engine_ ? draft_engine_->profile_memory_for_kv_cache() : 0;
+  const int64_t n_blocks = calculate_shared_kv_cache_blocks(
+      target_kv_cache_size, draft_kv_cache_size);
+  CHECK_GT(n_blocks, 0) << "no memory for kv cache";
+
+  // reserve the address range to grow the kv cache into at runtime
+  int64_t max_blocks = 0;
+  const int64_t resizable_cache_size = options_.resizable_cache_size();
+  if (resizable_cache_size > 0 && options_.devices()[0].is_cuda()) {
+    max_blocks = std::max(n_blocks,
+                          calculate_shared_kv_cache_blocks(
+                              resizable_cache_size, resizable_cache_size));
+  }
+
+  // one block table for both models: the blocks are allocated by the block
+  // manager of the target engine, and the draft engine only holds the kv
+  // cache of the same blocks for the draft model.
+  if (!engine_->init_kv_cache(n_blocks, /*n_host_blocks=*/0, max_blocks)) {
+    return false;
+  }
+  return !draft_engine_ || draft_engine_->init_worker_kv_caches(
+                               n_blocks, /*n_host_blocks=*/0, max_blocks);
+}
 
-  // check if llm and ssm are using same device
+int64_t SpeculativeEngine::calculate_shared_kv_cache_blocks(
+    int64_t target_cache_size,
+    int64_t draft_cache_size) const {
+  if (!draft_engine_) {
+    // all memory goes to the target model
+    return engine_->calculate_kv_cache_blocks(target_cache_size);
+  }
   if (share_device_) {
-    // on the same device, use the smaller kv cache size
-    const int64_t kv_cache_size =
-        std::min(target_kv_cache_size, draft_kv_cache_size);
-    n_blocks = calculate_kv_cache_blocks(kv_cache_size);
-  } else {
-    // on different devices, use the smaller number of blocks
-    const int64_t target_blocks =
-        engine_->calculate_kv_cache_blocks(target_kv_cache_size);
-    const int64_t draft_blocks =
-        draft_engine_->calculate_kv_cache_blocks(draft_kv_cache_size);
-    n_blocks = std::min(target_blocks, draft_blocks);
+    // on the same device, the memory is split in proportion to the slot
+    // sizes of the models since each block holds the kv cache of both
+    return calculate_kv_cache_blocks(
+        std::min(target_cache_size, draft_cache_size));
   }
-  CHECK_GT(n_blocks, 0) << "no memory for kv cache";
-  // init kv cache
-  return engine_->init_kv_cache(n_blocks) &&
-         draft_engine_->init_kv_cache(n_blocks);
+  // on different devices, use the smaller number of blocks
+  return std::min(engine_->calculate_kv_cache_blocks(target_cache_size),
+                  draft_engine_->calculate_kv_cache_blocks(draft_cache_size));
+}
+
+bool SpeculativeEngine::resize_kv_cache(int64_t n_blocks) {
+  const int64_t old_blocks = engine_->num_kv_cache_blocks();
+  if (!engine_->resize_kv_cache(n_blocks)) {
+    return false;
+  }
+  if (draft_engine_ && !draft_engine_->resize_kv_cache(n_blocks)) {
+    // restore the kv cache of the target model
+    CHECK(engine_->resize_kv_cache(old_blocks))
+        << "Failed to restore kv cache of " << old_blocks << " blocks";
+    return false;
+  }
+  return true;
 }
 
 ModelOutput SpeculativeEngine::execute_model(Batch& batch) {
-  // run the draft model to get proposals
+  const int64_t num_speculative_tokens =
+      static_cast<int64_t>(speculation_length(batch));
+  if (num_speculative_tokens == 0) {
+    // speculation is off, run the target model only
+    COUNTER_INC(speculation_off_steps_total);
+    proposer_->skip(batch);
+    batch.set_engine_type(EngineType::LLM);
+    ModelOutput output = engine_->execute_model(batch);
+    proposer_->update(batch, output.hidden_states);
+    return output;
+  }
+  COUNTER_ADD(speculative_tokens_total, num_speculative_tokens * batch.size());
+
+  const int64_t n_leaves_per_depth = options_.speculative_tree_width() - 1;
+  // verify the tree only if all sequences are decoding with slots reserved
+  // for the leaves and no logprobs, otherwise use the draft tokens only.
+  bool use_tree = n_leaves_per_depth > 0;
+  for (size_t i = 0; use_tree && i < batch.size(); ++i) {
+    const Sequence* seq = batch[i];
+    const size_t num_tree_tokens =
+        num_speculative_tokens * (1 + n_leaves_per_depth);
+    use_tree = seq->num_kv_cache_tokens(EngineType::LLM) >=
+                   seq->num_prompt_tokens() &&
+               seq->kv_cache_capacity() >=
+                   seq->num_tokens() + num_tree_tokens &&
+               !seq->sampling_param()->logprobs;
+  }
+
+  // get proposals from the draft model or the n-gram lookup
   Timer timer;
-  std::vector<ModelOutput> draft_outputs;
-  batch.set_engine_type(EngineType::SSM);
-  for (size_t i = 0; i < options_.num_speculative_tokens(); ++i) {
-    auto draft_output = draft_engine_->execute_model(batch);
-    draft_outputs.push_back(draft_output);
+  const Proposal proposal = proposer_->propose(batch, num_speculative_tokens);
+  torch::Tensor leaf_token_ids;
+  // the tree alternatives come from the proposer or the draft probs
+  if (use_tree && proposal.leaf_token_ids.defined()) {
+    leaf_token_ids = proposal.leaf_token_ids;
+  } else if (use_tree && proposal.probs.defined()) {
+    leaf_token_ids = draft_tree_leaves(proposal, n_leaves_per_depth);
+  }
+  if (leaf_token_ids.defined()) {
+    const auto leaves = leaf_token_ids.to(torch::kCPU, torch::kInt)
+                            .view({leaf_token_ids.size(0), -1});
+    std::vector<std::vector<int32_t>> tree_leaves;
+    tree_leaves.reserve(leaves.size(0));
+    for (int64_t i = 0; i < leaves.size(0); ++i) {
+      const auto* data = leaves[i].const_data_ptr<int32_t>();
+      tree_leaves.emplace_back(data, data + leaves.size(1));
+    }
+    batch.set_tree_leaves(std::move(tree_leaves), n_leaves_per_depth);
   }
   COUNTER_ADD(draft_execution_latency_seconds, timer.elapsed_seconds());
 
+  // the target model returns logits for the tokens after its kv cache and the
+  // last prompt token, followed by the tree leaves.
+  std::vector<int64_t> num_target_tokens;
+  num_target_tokens.reserve(batch.size());
+  for (size_t i = 0; i < batch.size(); ++i) {
+    const Sequence* seq = batch[i];
+    const size_t num_processed_tokens =
+        std::max(seq->num_kv_cache_tokens(EngineType::LLM),
+                 seq->num_prompt_tokens() - 1);
+    num_target_tokens.push_back(
+        static_cast<int64_t>(seq->num_tokens() - num_processed_tokens));
+  }
+
   // run the target model to get the verification scores
   timer.reset();
   batch.set_engine_type(EngineType::LLM);
+  batch.set_select_all_tokens(true);
   ModelOutput output = engine_->execute_model(batch);
+  batch.set_select_all_tokens(false);
   COUNTER_ADD(target_execution_latency_seconds, timer.elapsed_seconds());
 
   // verify the proposals with target and update the batch
   timer.reset();
-  validate(batch, draft_outputs, output);
+  torch::Tensor target_token_ids;
+  const auto hidden_states = validate(batch,
+                                      proposal,
+                                      output,
+                                      num_target_tokens,
+                                      leaf_token_ids,
+                                      &target_token_ids);
+  proposer_->update(batch, hidden_states);
+  if (target_token_ids.defined()) {
+    proposer_->update_predictions(batch, target_token_ids);
+  }
   COUNTER_ADD(validation_latency_seconds, timer.elapsed_seconds());
 
   return output;
 }
 
-void SpeculativeEngine::validate(Batch& batch,
-                                 const std::vector<ModelOutput>& draft_outputs,
-                                 const ModelOutput& target_output) {
+size_t SpeculativeEngine::speculation_length(const Batch& batch) const {
+  const size_t max_tokens = options_.num_speculative_tokens();
+  size_t num_decoding_sequences = 0;
+  size_t num_tokens = 0;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    const Sequence* seq = batch[i];
+    if (seq->num_kv_cache_tokens(EngineType::LLM) < seq->num_prompt_tokens()) {
+      // no acceptance rate for prefill sequences yet
+      num_tokens = max_tokens;
+      continue;
+    }
+    ++num_decoding_sequences;
+    num_tokens = std::max(
+        num_tokens,
+        options_.enable_adaptive_speculation()
+            ? seq->num_speculative_tokens(max_tokens,
+                                          options_.speculative_min_acceptance())
+            : max_tokens);
+  }
+
+  // the target model is compute bound for large batches, where the verified
+  // draft tokens cost more than they save.
+  const size_t max_batch_size = options_.speculative_max_batch_size();
+  if (max_batch_size > 0 && num_decoding_sequences >= max_batch_size) {
+    return 0;
+  }
+  // keep at least one draft token to track the acceptance rate
+  return std::max<size_t>(num_tokens, 1);
+}
+
+torch::Tensor SpeculativeEngine::draft_tree_leaves(const Proposal& proposal,
+                                                   int64_t n_leaves_per_depth) {
+  // [batch_size, n_speculative_tokens, 1]
+  const auto draft_token_ids =
+      proposal.token_ids.unsqueeze(/*dim=*/-1).to(proposal.probs.device());
+  // the top tokens except the draft token, drop the last one if the draft
+  // token is not in the top n_leaves_per_depth + 1 tokens.
+  // [batch_size, n_speculative_tokens, n_leaves_per_depth + 1]
+  const auto top_token_ids =
+      std::get<1>(proposal.probs.topk(n_leaves_per_depth + 1, /*dim=*/-1));
+  const auto not_drafted = top_token_ids != draft_token_ids;
+  const auto selected =
+      not_drafted & (not_drafted.cumsum(/*dim=*/-1) <= n_leaves_per_depth);
+  // [batch_size, n_speculative_tokens, n_leaves_per_depth]
+  return top_token_ids.masked_select(selected).view(
+      {draft_token_ids.size(0), draft_token_ids.size(1), n_leaves_per_depth});
+}
+
+torch::Tensor SpeculativeEngine::validate(
+    Batch& batch,
+    const Proposal& proposal,
+    const ModelOutput& target_output,
+    const std::vector<int64_t>& num_target_tokens,
+    const torch::Tensor& leaf_token_ids,
+    torch::Tensor* target_token_ids) {
   if (!target_output.sample_output.next_tokens.defined()) {
     // a pure prefill batch, no sampling needed
-    return;
+    return {};
   }
 
+  // sampled tokens are copied back to host by the worker
   const auto bonus_token_ids =
-      target_output.sample_output.next_tokens.view({-1, 1});
+      target_output.sample_output.next_tokens.view({-1, 1}).to(
+          target_output.logits.device());
   const int64_t batch_size = bonus_token_ids.size(/*dim=*/0);
   const int64_t vocab_size = target_output.logits.size(/*dim=*/-1);
-  const int64_t num_speculative_tokens =
-      static_cast<int64_t>(draft_outputs.size());
-
-  // [batch_size, n_speculative_tokens, vocab_size]
-  auto target_logits = target_output.logits.view(
-      {batch_size, num_speculative_tokens + /*bonus_tokens*/ 1, vocab_size});
+  const int64_t num_speculative_tokens = proposal.token_ids.size(/*dim=*/1);
+
+  // select the last draft tokens and the tree leaves of each sequence, the
+  // target model may recompute the kv cache of accepted tokens.
+  const int64_t n_leaves =
+      leaf_token_ids.defined() ? leaf_token_ids.numel() / batch_size : 0;
+  CHECK_EQ(static_cast<int64_t>(num_target_tokens.size()), batch_size);
+  std::vector<int64_t> rows;
+  rows.reserve(batch_size * (num_speculative_tokens + 1 + n_leaves));
+  int64_t offset = 0;
+  for (const int64_t num_tokens : num_target_tokens) {
+    CHECK_GT(num_tokens, num_speculative_tokens);
+    for (int64_t j = num_tokens - num_speculative_tokens - 1;
+         j < num_tokens + n_leaves;
+         ++j) {
+      rows.push_back(offset + j);
+    }
+    offset += num_tokens + n_leaves;
+  }
+  CHECK_EQ(offset, target_output.logits.size(0));
+  auto logits = target_output.logits;
+  auto hidden_states = target_output.hidden_states;
+  if (offset != static_cast<int64_t>(rows.size())) {
+    const auto row_idxes =
+        torch::tensor(rows, torch::kLong).to(logits.device());
+    logits = logits.index_select(/*dim=*/0, row_idxes);
+    if (hidden_states.defined()) {
+      hidden_states = hidden_states.index_select(/*dim=*/0, row_idxes);
+    }
+  }
+  logits = logits.view(
+      {batch_size,
+       num_speculative_tokens + /*bonus_tokens*/ 1 + n_leaves,
+       vocab_size});
+  // [batch_size, n_speculative_tokens + 1, vocab_size]
+  auto target_logits = logits.slice(
+      /*dim=*/1, /*start=*/0, /*end=*/num_speculative_tokens + 1);
+  if (target_token_ids != nullptr) {
+    *target_token_ids = target_logits.argmax(/*dim=*/-1);
+  }
 
-  // prepare input for rejection sampling
-  std::vector<torch::Tensor> draft_token_ids_vec;
-  std::vector<torch::Tensor> draft_probs_vec;
-  for (const auto& draft_output : draft_outputs) {
-    auto draft_token_ids =
-        draft_output.sample_output.next_tokens.view({batch_size, 1});
-    auto draft_probs =
-        draft_output.sample_output.probs.view({{batch_size, 1, vocab_size}});
-    draft_token_ids_vec.push_back(draft_token_ids);
-    draft_probs_vec.push_back(draft_probs);
+  // sample the token after each leaf, before do_sample is reshaped below
+  torch::Tensor leaf_next_token_ids;
+  if (n_leaves > 0 && !target_output.logprobs) {
+    const auto leaf_probs =
+        torch::softmax(logits.slice(/*dim=*/1,
+                                    /*start=*/num_speculative_tokens + 1),
+                       /*dim=*/-1,
+                       /*dtype=*/torch::kFloat32);
+    const auto do_sample =
+        target_output.do_sample.to(leaf_probs.device()).view({-1, 1});
+    leaf_next_token_ids =
+        torch::where(do_sample,
+                     Sampler::random_sample(leaf_probs),
+                     Sampler::greedy_sample(leaf_probs))
+            .view(leaf_token_ids.sizes());
   }
 
-  // concatenate the draft token ids and probs along the last dimension
-  const auto draft_token_ids =
-      torch::cat(draft_token_ids_vec, /*dim=*/1).to(bonus_token_ids);
-  const auto draft_probs =
-      torch::cat(draft_probs_vec, /*dim=*/1).to(target_logits.device());
+  // draft probs are undefined for deterministic proposals
+  const auto draft_token_ids = proposal.token_ids.to(bonus_token_ids);
+  torch::Tensor draft_probs;
+  if (proposal.probs.defined()) {
+    draft_probs = proposal.probs.to(target_logits.device());
+  }
 
   auto rejection_sampler =
       std::make_unique<RejectionSampler>(target_output.do_sample,
                                          target_output.logprobs,
-                                         target_output.max_top_logprobs);
+                                         target_output.max_top_logprobs,
+                                         target_output.rng_seeds,
+                                         target_output.rng_offsets);
 
   // get the accepted tokens
   const auto output =
@@ -234,8 +494,27 @@ void SpeculativeEngine::validate(Batch& batch,
                                  bonus_token_ids,
                                  /*mask_out_rejected_tokens=*/true);
 
+  torch::Tensor tree_bonus_token_ids;
+  if (leaf_next_token_ids.defined()) {
+    tree_bonus_token_ids = RejectionSampler::accept_tree_leaves(
+        output.next_tokens,
+        draft_token_ids,
+        leaf_token_ids.to(draft_token_ids),
+        leaf_next_token_ids);
+  }
+
   // update the batch with the accpeted tokens
-  batch.process_validate_output(output);
+  batch.process_validate_output(output, tree_bonus_token_ids);
+
+  if (!hidden_states.defined()) {
+    return {};
+  }
+  // the hidden states that sampled the last accepted token
+  hidden_states = hidden_states.view({batch_size, -1, hidden_states.size(-1)});
+  const auto last_idxes = (output.next_tokens != -1).sum(/*dim=*/1) - 1;
+  const auto batch_idxes = torch::arange(batch_size, last_idxes.options());
+  return hidden_states.index(
+      {batch_idxes, last_idxes.to(hidden_states.device(), torch::kLong)});
 }
 
 int64_t SpeculativeEngine::calculate_kv_cache_blocks(
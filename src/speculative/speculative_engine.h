@@ -6,6 +6,7 @@
 #include "engine/llm_engine.h"
 #include "memory/block_manager.h"
 #include "models/model_args.h"
+#include "proposer.h"
 #include "tokenizer/tokenizer.h"
 #include "tokenizer/tokenizer_args.h"
 
@@ -24,15 +25,52 @@ class SpeculativeEngine : public Engine {
     // 0 means that cache size is caculated by available memory
     DEFINE_ARG(int64_t, max_cache_size) = 0;
 
+    // max size in bytes to grow the kv cache of both models to at runtime on
+    // each device, 0 means the kv cache has a fixed size.
+    DEFINE_ARG(int64_t, resizable_cache_size) = 0;
+
     // maximum memory utilization allowed, default 0.9
     DEFINE_ARG(double, max_memory_utilization) = 0;
 
     // enable prefix cache
     DEFINE_ARG(bool, enable_prefix_cache) = true;
 
+    // data type of kv cache, e.g. auto, int8, fp8
+    DEFINE_ARG(std::string, kv_cache_dtype) = "auto";
+
     // the number of speculative tokens per step
     DEFINE_ARG(int32_t, num_speculative_tokens) = 0;
 
+    // the number of candidates per speculative position, the draft token and
+    // the top alternatives from the draft model are verified together in one
+    // target pass with a tree attention mask. 1 means a single chain.
+    DEFINE_ARG(int32_t, speculative_tree_width) = 1;
+
+    // the source of speculative tokens: "draft" runs a draft model, "ngram"
+    // looks up the draft tokens from the prompt and generated tokens,
+    // "medusa" runs the heads from the draft model path on the target hidden
+    // states, and "lookahead" drafts from the n-grams of the Jacobi
+    // iterations of the target model, with the other n-grams as tree leaves.
+    DEFINE_ARG(std::string, speculative_proposer) = "draft";
+
+    // the range of n-gram sizes matched by the "ngram" proposer, the max one
+    // is also the size of the n-grams collected by the "lookahead" proposer
+    DEFINE_ARG(int32_t, ngram_min_size) = 1;
+
+    DEFINE_ARG(int32_t, ngram_max_size) = 3;
+
+    // adapt the number of speculative tokens per step to the acceptance rate
+    // of the sequences, num_speculative_tokens is used as the upper bound.
+    DEFINE_ARG(bool, enable_adaptive_speculation) = false;
+
+    // min probability of accepting the last speculative token for the
+    // adaptive speculation
+    DEFINE_ARG(double, speculative_min_acceptance) = 0.3;
+
+    // turn off speculation when the number of decoding sequences reaches the
+    // batch size, 0 means never
+    DEFINE_ARG(int32_t, speculative_max_batch_size) = 0;
+
     // enable cuda graph
     DEFINE_ARG(bool, enable_cuda_graph) = true;
 
@@ -45,6 +83,10 @@ class SpeculativeEngine : public Engine {
     // batch sizes to capture cuda graphs for draft model
     DEFINE_ARG(std::optional<std::vector<uint32_t>>,
                draft_cuda_graph_batch_sizes);
+
+    // quantize the weights of a dense draft checkpoint at load, e.g. "fp8".
+    // a quantized draft checkpoint, e.g. gptq or awq, is loaded as is.
+    DEFINE_ARG(std::string, draft_quant_method);
   };
 
   // create an engine with the given devices
@@ -61,10 +103,15 @@ class SpeculativeEngine : public Engine {
 
   const Tokenizer* tokenizer() const override { return engine_->tokenizer(); }
 
+  // the blocks are allocated by the block manager of the target engine, and
+  // each block holds the kv cache of both models
   BlockManager* block_manager() const override {
     return engine_->block_manager();
   }
 
+  // resize the kv cache of both models, all or nothing
+  bool resize_kv_cache(int64_t n_blocks) override;
+
   const ModelArgs& model_args() const override { return model_args_; }
 
   const TokenizerArgs& tokenizer_args() const override {
@@ -79,9 +126,34 @@ class SpeculativeEngine : public Engine {
 
   int64_t calculate_kv_cache_blocks(int64_t cache_size_in_bytes) const;
 
-  static void validate(Batch& batch,
-                       const std::vector<ModelOutput>& draft_outputs,
-                       const ModelOutput& target_output);
+  // the number of blocks for the kv cache of the given size in bytes on each
+  // device, shared by both models
+  int64_t calculate_shared_kv_cache_blocks(int64_t target_cache_size,
+                                           int64_t draft_cache_size) const;
+
+  // the number of speculative tokens for the batch in this step, the longest
+  // one wanted by the sequences. 0 means speculation is off.
+  size_t speculation_length(const Batch& batch) const;
+
+  // draft the top alternatives at each speculative position as tree leaves
+  // returns: [batch_size, n_speculative_tokens, n_leaves_per_depth]
+  static torch::Tensor draft_tree_leaves(const Proposal& proposal,
+                                         int64_t n_leaves_per_depth);
+
+  // num_target_tokens: number of tokens processed by the target model for
+  // each sequence, excluding the tree leaves
+  // leaf_token_ids: [batch_size, n_speculative_tokens, n_leaves_per_depth],
+  // undefined if the tree is not used
+  // target_token_ids: set to the [batch_size, n_speculative_tokens + 1]
+  // greedy target predictions at the verified positions
+  // returns: [batch_size, hidden_size] target hidden states that sampled the
+  // last accepted token of each sequence, undefined if not returned
+  static torch::Tensor validate(Batch& batch,
+                                const Proposal& proposal,
+                                const ModelOutput& target_output,
+                                const std::vector<int64_t>& num_target_tokens,
+                                const torch::Tensor& leaf_token_ids,
+                                torch::Tensor* target_token_ids);
 
   // options
   const Options options_;
@@ -89,9 +161,12 @@ class SpeculativeEngine : public Engine {
   // engine
   std::unique_ptr<LLMEngine> engine_;
 
-  // draft engine
+  // draft engine, null if the proposer doesn't need a draft model
   std::unique_ptr<LLMEngine> draft_engine_;
 
+  // proposer of speculative tokens
+  std::unique_ptr<Proposer> proposer_;
+
   // whether target and draft engine are sharing the same device
   bool share_device_ = false;
 
@@ -0,0 +1,129 @@
+#include "batch_encoder.h"
+
+#include <absl/synchronization/blocking_counter.h>
+#include <glog/logging.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "common/threadpool.h"
+
+namespace llm {
+
+BatchEncoder::BatchEncoder(const Tokenizer& tokenizer,
+                           size_t num_threads,
+                           size_t piece_size)
+    : threadpool_(num_threads), piece_size_(piece_size) {
+  CHECK_GT(piece_size, 0);
+  tokenizers_.reserve(num_threads);
+  for (size_t i = 0; i < num_threads; ++i) {
+    tokenizers_.push_back(tokenizer.clone());
+  }
+}
+
+template <typename Func>
+void BatchEncoder::parallel_for(size_t n, Func&& fn) {
+  absl::BlockingCounter counter(static_cast<int>(n));
+  for (size_t i = 0; i < n; ++i) {
+    threadpool_.schedule([&fn, &counter, i]() {
+      fn(i);
+      counter.DecrementCount();
+    });
+  }
+  counter.Wait();
+}
+
+bool BatchEncoder::encode(const std::string_view& text,
+                          std::vector<int32_t>* ids) {
+  std::vector<std::vector<int32_t>> batch_ids;
+  if (!batch_encode({text}, &batch_ids)) {
+    return false;
+  }
+  ids->insert(ids->end(), batch_ids[0].begin(), batch_ids[0].end());
+  return true;
+}
+
+bool BatchEncoder::batch_encode(const std::vector<std::string_view>& texts,
+                                std::vector<std::vector<int32_t>>* ids) {
+  // split long texts into pieces
+  std::vector<std::vector<std::string_view>> text_pieces(texts.size());
+  std::vector<size_t> long_texts;
+  for (size_t i = 0; i < texts.size(); ++i) {
+    if (texts[i].size() > piece_size_) {
+      long_texts.push_back(i);
+    } else {
+      text_pieces[i] = {texts[i]};
+    }
+  }
+  parallel_for(long_texts.size(), [&](size_t i) {
+    const auto& tokenizer = tokenizers_[ThreadPool::current_thread_index()];
+    const size_t idx = long_texts[i];
+    text_pieces[idx] = tokenizer->split_pieces(texts[idx], piece_size_);
+  });
+
+  // encode all pieces in parallel
+  struct Piece {
+    std::string_view text;
+    bool first_piece = false;
+    std::vector<int32_t> ids;
+  };
+  std::vector<Piece> pieces;
+  // start of the pieces of each text
+  std::vector<size_t> piece_offsets;
+  piece_offsets.reserve(texts.size() + 1);
+  for (const auto& text_piece : text_pieces) {
+    piece_offsets.push_back(pieces.size());
+    for (size_t j = 0; j < text_piece.size(); ++j) {
+      pieces.push_back({text_piece[j], /*first_piece=*/j == 0, {}});
+    }
+  }
+  piece_offsets.push_back(pieces.size());
+
+  std::atomic<bool> success = true;
+  parallel_for(pieces.size(), [&](size_t i) {
+    const auto& tokenizer = tokenizers_[ThreadPool::current_thread_index()];
+    auto& piece = pieces[i];
+    if (!tokenizer->encode_piece(piece.text, piece.first_piece, &piece.ids)) {
+      success.store(false, std::memory_order_relaxed);
+    }
+  });
+  if (!success.load()) {
+    return false;
+  }
+
+  // concatenate the ids of the pieces of each text
+  ids->clear();
+  ids->resize(texts.size());
+  for (size_t i = 0; i < texts.size(); ++i) {
+    auto& text_ids = (*ids)[i];
+    for (size_t j = piece_offsets[i]; j < piece_offsets[i + 1]; ++j) {
+      if (text_ids.empty()) {
+        text_ids = std::move(pieces[j].ids);
+      } else {
+        text_ids.insert(
+            text_ids.end(), pieces[j].ids.begin(), pieces[j].ids.end());
+      }
+    }
+  }
+  return true;
+}
+
+bool BatchEncoder::encode_pieces(const std::vector<std::string_view>& pieces,
+                                 bool first_piece,
+                                 std::vector<std::vector<int32_t>>* ids) {
+  ids->clear();
+  ids->resize(pieces.size());
+  std::atomic<bool> success = true;
+  parallel_for(pieces.size(), [&](size_t i) {
+    const auto& tokenizer = tokenizers_[ThreadPool::current_thread_index()];
+    if (!tokenizer->encode_piece(
+            pieces[i], first_piece && i == 0, &(*ids)[i])) {
+      success.store(false, std::memory_order_relaxed);
+    }
+  });
+  return success.load();
+}
+
+}  // namespace llm
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "common/threadpool.h"
+#include "tokenizer.h"
+
+namespace llm {
+
+// Encodes texts on a pool of threads, each with its own tokenizer. Long texts
+// are split into pieces at boundaries that no token spans, and the pieces are
+// encoded in parallel as well.
+class BatchEncoder final {
+ public:
+  static constexpr size_t kDefaultPieceSize = 16 * 1024;
+
+  // piece_size: bytes of the pieces that long texts are split into
+  BatchEncoder(const Tokenizer& tokenizer,
+               size_t num_threads,
+               size_t piece_size = kDefaultPieceSize);
+
+  // encode a text, returns false if failed
+  bool encode(const std::string_view& text, std::vector<int32_t>* ids);
+
+  // encode a batch of texts, returns false if any of them failed
+  bool batch_encode(const std::vector<std::string_view>& texts,
+                    std::vector<std::vector<int32_t>>* ids);
+
+  // encode pieces of a text split by Tokenizer::split_pieces in parallel.
+  // first_piece: whether pieces[0] is the first piece of the text.
+  // returns false if any of them failed
+  bool encode_pieces(const std::vector<std::string_view>& pieces,
+                     bool first_piece,
+                     std::vector<std::vector<int32_t>>* ids);
+
+  size_t piece_size() const { return piece_size_; }
+
+  // restrict the encoding threads to run on the cpus
+  bool set_affinity(const std::vector<int32_t>& cpus) {
+    return threadpool_.set_affinity(cpus);
+  }
+
+ private:
+  // run fn(i) for i in [0, n) on the threadpool and wait for them to finish
+  template <typename Func>
+  void parallel_for(size_t n, Func&& fn);
+
+  ThreadPool threadpool_;
+
+  // tokenizer of each thread of the pool
+  std::vector<std::unique_ptr<Tokenizer>> tokenizers_;
+
+  size_t piece_size_ = kDefaultPieceSize;
+};
+
+}  // namespace llm
@@ -0,0 +1,41 @@
+#include "batch_encoder.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "sentencepiece_tokenizer.h"
+
+namespace llm {
+
+TEST(BatchEncoderTest, BatchEncode) {
+  TokenizerArgs args;
+  args.vocab_file() = "tokenizer.model";
+  args.prefix_tokens() = {"<s>"};
+  SentencePieceTokenizer tokenizer("data", args);
+  BatchEncoder encoder(tokenizer, /*num_threads=*/4, /*piece_size=*/64);
+
+  std::string long_text;
+  for (int i = 0; i < 50; ++i) {
+    long_text += "The quick brown fox jumps over the lazy dog 42 times. ";
+  }
+  const std::vector<std::string_view> texts = {
+      "Hello, world!", long_text, "你好，世界！", long_text.substr(7)};
+
+  std::vector<std::vector<int32_t>> ids;
+  ASSERT_TRUE(encoder.batch_encode(texts, &ids));
+  ASSERT_EQ(ids.size(), texts.size());
+  for (size_t i = 0; i < texts.size(); ++i) {
+    std::vector<int32_t> desired_ids;
+    ASSERT_TRUE(tokenizer.encode(texts[i], &desired_ids));
+    EXPECT_EQ(ids[i], desired_ids);
+  }
+
+  std::vector<int32_t> long_ids;
+  ASSERT_TRUE(encoder.encode(long_text, &long_ids));
+  EXPECT_EQ(long_ids, ids[1]);
+}
+
+}  // namespace llm
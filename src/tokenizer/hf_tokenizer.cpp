@@ -1,17 +1,200 @@
 #include "hf_tokenizer.h"
 
+#include <absl/container/flat_hash_set.h>
+#include <absl/strings/match.h>
+#include <absl/strings/str_replace.h>
 #include <glog/logging.h>
 
+#include <array>
+#include <fstream>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
 #include "huggingface/tokenizers.h"
 
 namespace llm {
 
+// decodes tokens one at a time following the decoder in tokenizer.json. only
+// decoders that map each token independently are supported, plus stripping
+// the start of the fused text.
+struct HFStreamDecoder {
+  enum class StepType {
+    kByteLevel,
+    kByteFallback,
+    kReplace,
+    kMetaspace,
+    kStrip,
+  };
+
+  struct Step {
+    StepType type;
+    // kReplace: pattern replaced by content, kMetaspace: the space symbol
+    std::string pattern;
+    // kStrip: the char to strip
+    std::string content = " ";
+    // kStrip: max number of chars stripped from the start
+    size_t start = 0;
+    // kMetaspace: drop the leading space of the text
+    bool strip_leading_space = false;
+    // whether the step applies to the text fused from the tokens
+    bool fused = false;
+  };
+
+  std::vector<Step> steps;
+
+  // ids of special tokens, dropped with skip_special_tokens
+  absl::flat_hash_set<int32_t> special_ids;
+};
+
+namespace {
+
+// the byte of each unicode char used by the byte-level bpe, -1 if not mapped
+// https://github.com/openai/gpt-2/blob/master/src/encoder.py
+const std::array<int16_t, 324>& byte_level_table() {
+  static const auto table = [] {
+    std::array<int16_t, 324> table;
+    table.fill(-1);
+    int n = 0;
+    for (int b = 0; b < 256; ++b) {
+      const bool printable = (b >= '!' && b <= '~') ||
+                             (b >= 0xA1 && b <= 0xAC) || (b >= 0xAE);
+      table[printable ? b : 256 + n++] = static_cast<int16_t>(b);
+    }
+    return table;
+  }();
+  return table;
+}
+
+// map the chars of a byte-level token back to the bytes, the token is kept
+// as is if any char is not mapped, e.g. added tokens.
+std::string byte_level_decode(const std::string& token) {
+  const auto& table = byte_level_table();
+  std::string bytes;
+  bytes.reserve(token.size());
+  for (size_t i = 0; i < token.size();) {
+    const auto c = static_cast<uint8_t>(token[i]);
+    uint32_t cp = c;
+    size_t len = 1;
+    if (c >= 0xC0 && c < 0xE0 && i + 1 < token.size()) {
+      cp = ((c & 0x1F) << 6) | (static_cast<uint8_t>(token[i + 1]) & 0x3F);
+      len = 2;
+    } else if (c >= 0xE0) {
+      return token;
+    }
+    if (cp >= table.size() || table[cp] < 0) {
+      return token;
+    }
+    bytes.push_back(static_cast<char>(table[cp]));
+    i += len;
+  }
+  return bytes;
+}
+
+// add the steps of the decoder, returns false if not supported
+bool add_decode_steps(const nlohmann::json& decoder,
+                      bool* fused,
+                      std::vector<HFStreamDecoder::Step>* steps) {
+  using StepType = HFStreamDecoder::StepType;
+  const auto type = decoder.value("type", "");
+  if (type == "Sequence") {
+    for (const auto& child : decoder.at("decoders")) {
+      if (!add_decode_steps(child, fused, steps)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  if (type == "Fuse") {
+    *fused = true;
+    return true;
+  }
+
+  HFStreamDecoder::Step step;
+  step.fused = *fused;
+  if (type == "ByteLevel") {
+    step.type = StepType::kByteLevel;
+  } else if (type == "ByteFallback") {
+    step.type = StepType::kByteFallback;
+  } else if (type == "Replace") {
+    const auto& pattern = decoder.at("pattern");
+    if (!pattern.contains("String")) {
+      // regex patterns may match across tokens
+      return false;
+    }
+    step.type = StepType::kReplace;
+    step.pattern = pattern.at("String").get<std::string>();
+    step.content = decoder.value("content", "");
+  } else if (type == "Metaspace") {
+    step.type = StepType::kMetaspace;
+    step.pattern = decoder.value("replacement", "\xe2\x96\x81");
+    step.strip_leading_space =
+        decoder.contains("prepend_scheme")
+            ? decoder.at("prepend_scheme").get<std::string>() != "never"
+            : decoder.value("add_prefix_space", true);
+  } else if (type == "Strip") {
+    if (decoder.value("stop", 0) != 0) {
+      // the end of the text is unknown until the stream finishes
+      return false;
+    }
+    step.type = StepType::kStrip;
+    step.content = decoder.value("content", " ");
+    step.start = decoder.value("start", 0);
+  } else {
+    // e.g. WordPiece, BPE and CTC join or clean up tokens with the
+    // surrounding ones
+    return false;
+  }
+  // the fused text is only rewritten at its start
+  if (step.fused && step.type != StepType::kStrip &&
+      step.type != StepType::kReplace) {
+    return false;
+  }
+  steps->push_back(std::move(step));
+  return true;
+}
+
+std::shared_ptr<const HFStreamDecoder> load_stream_decoder(
+    const std::string& tokenizer_file_path) {
+  std::ifstream file(tokenizer_file_path);
+  if (!file.is_open()) {
+    return nullptr;
+  }
+  const auto data = nlohmann::json::parse(file, /*cb=*/nullptr,
+                                          /*allow_exceptions=*/false);
+  if (data.is_discarded() || !data.contains("decoder") ||
+      data["decoder"].is_null()) {
+    // tokens are joined with spaces without a decoder
+    return nullptr;
+  }
+
+  auto decoder = std::make_shared<HFStreamDecoder>();
+  bool fused = false;
+  if (!add_decode_steps(data["decoder"], &fused, &decoder->steps)) {
+    LOG(INFO) << "Tokens are decoded with the surrounding ones for decoder: "
+              << data["decoder"].value("type", "");
+    return nullptr;
+  }
+  if (data.contains("added_tokens")) {
+    for (const auto& token : data["added_tokens"]) {
+      if (token.value("special", false)) {
+        decoder->special_ids.insert(token.at("id").get<int32_t>());
+      }
+    }
+  }
+  return decoder;
+}
+
+}  // namespace
+
 std::unique_ptr<HFTokenizer> HFTokenizer::from_file(
     const std::string& tokenizer_file_path) {
   TokenizerHandle handle = tokenizer_from_file(tokenizer_file_path.c_str());
   CHECK(handle != nullptr) << "Failed to load tokenizer from file: "
                            << tokenizer_file_path;
-  return std::make_unique<HFTokenizer>(tokenizer_file_path, handle);
+  auto tokenizer = std::make_unique<HFTokenizer>(tokenizer_file_path, handle);
+  tokenizer->stream_decoder_ = load_stream_decoder(tokenizer_file_path);
+  return tokenizer;
 }
 
 HFTokenizer::HFTokenizer(const std::string& tokenizer_file_path,
@@ -21,7 +204,12 @@ HFTokenizer::HFTokenizer(const std::string& tokenizer_file_path,
 }
 
 std::unique_ptr<Tokenizer> HFTokenizer::clone() const {
-  return from_file(tokenizer_file_path_);
+  TokenizerHandle handle = tokenizer_from_file(tokenizer_file_path_.c_str());
+  CHECK(handle != nullptr) << "Failed to load tokenizer from file: "
+                           << tokenizer_file_path_;
+  auto tokenizer = std::make_unique<HFTokenizer>(tokenizer_file_path_, handle);
+  tokenizer->stream_decoder_ = stream_decoder_;
+  return tokenizer;
 }
 
 HFTokenizer::~HFTokenizer() { tokenizer_free(handle_); }
@@ -52,6 +240,97 @@ std::string HFTokenizer::decode(const Slice<int32_t>& ids,
   return {data, len};
 }
 
+std::vector<std::string> HFTokenizer::decode_batch(
+    const std::vector<Slice<int32_t>>& batch_ids,
+    bool skip_special_tokens) const {
+  if (batch_ids.empty()) {
+    return {};
+  }
+  // flatten the ids to cross the ffi boundary once
+  std::vector<uint32_t> ids;
+  std::vector<size_t> offsets;
+  offsets.reserve(batch_ids.size() + 1);
+  offsets.push_back(0);
+  for (const auto& seq_ids : batch_ids) {
+    ids.insert(ids.end(), seq_ids.begin(), seq_ids.end());
+    offsets.push_back(ids.size());
+  }
+  tokenizer_decode_batch(handle_,
+                         ids.data(),
+                         offsets.data(),
+                         batch_ids.size(),
+                         skip_special_tokens);
+
+  const char* data = nullptr;
+  size_t len = 0;
+  const size_t* ends = nullptr;
+  tokenizer_get_decode_batch_str(handle_, &data, &len, &ends);
+  std::vector<std::string> texts;
+  texts.reserve(batch_ids.size());
+  size_t start = 0;
+  for (size_t i = 0; i < batch_ids.size(); ++i) {
+    texts.emplace_back(data + start, ends[i] - start);
+    start = ends[i];
+  }
+  return texts;
+}
+
+bool HFTokenizer::decode_token(int32_t id,
+                               bool skip_special_tokens,
+                               TokenStreamState* state,
+                               std::string* bytes) const {
+  using StepType = HFStreamDecoder::StepType;
+  if (stream_decoder_ == nullptr) {
+    return false;
+  }
+  if (skip_special_tokens && stream_decoder_->special_ids.contains(id)) {
+    return true;
+  }
+
+  std::string piece = id_to_token(id);
+  for (const auto& step : stream_decoder_->steps) {
+    switch (step.type) {
+      case StepType::kByteLevel:
+        piece = byte_level_decode(piece);
+        break;
+      case StepType::kByteFallback:
+        // <0xXX>
+        if (piece.size() == 6 && absl::StartsWith(piece, "<0x") &&
+            piece.back() == '>') {
+          piece = std::string(
+              1, static_cast<char>(std::stoi(piece.substr(3, 2),
+                                             /*pos=*/nullptr,
+                                             /*base=*/16)));
+        }
+        break;
+      case StepType::kReplace:
+        piece = absl::StrReplaceAll(piece, {{step.pattern, step.content}});
+        break;
+      case StepType::kMetaspace:
+        // the spaces of the first token are the prepended ones
+        piece = absl::StrReplaceAll(
+            piece,
+            {{step.pattern,
+              state->at_text_start && step.strip_leading_space ? "" : " "}});
+        break;
+      case StepType::kStrip:
+        if (!step.fused || state->at_text_start) {
+          size_t n = 0;
+          while (n < step.start && absl::StartsWith(piece, step.content)) {
+            piece.erase(0, step.content.size());
+            ++n;
+          }
+        }
+        break;
+    }
+  }
+  if (!piece.empty()) {
+    state->at_text_start = false;
+  }
+  bytes->append(piece);
+  return true;
+}
+
 std::optional<int32_t> HFTokenizer::token_to_id(
     const std::string_view& token) const {
   int32_t id = tokenizer_token_to_id(handle_, token.data(), token.size());
@@ -1,10 +1,14 @@
 #pragma once
 
+#include <memory>
+
 #include "huggingface/tokenizers.h"
 #include "tokenizer.h"
 
 namespace llm {
 
+struct HFStreamDecoder;
+
 // a tokenizer that uses hf/tokenizers
 // not thread-safe, can't be used in multiple threads.
 class HFTokenizer : public Tokenizer {
@@ -19,6 +23,15 @@ class HFTokenizer : public Tokenizer {
   std::string decode(const Slice<int32_t>& ids,
                      bool skip_special_tokens) const override;
 
+  std::vector<std::string> decode_batch(
+      const std::vector<Slice<int32_t>>& batch_ids,
+      bool skip_special_tokens) const override;
+
+  bool decode_token(int32_t id,
+                    bool skip_special_tokens,
+                    TokenStreamState* state,
+                    std::string* bytes) const override;
+
   std::optional<int32_t> token_to_id(
       const std::string_view& token) const override;
 
@@ -34,6 +47,10 @@ class HFTokenizer : public Tokenizer {
   std::string tokenizer_file_path_;
 
   TokenizerHandle handle_ = nullptr;
+
+  // decoder of tokens one at a time shared by the clones, null if the
+  // decoder of the tokenizer can't decode tokens independently
+  std::shared_ptr<const HFStreamDecoder> stream_decoder_;
 };
 
 }  // namespace llm
@@ -0,0 +1,135 @@
+#include "prompt_cache.h"
+
+#include <absl/hash/hash.h>
+#include <glog/logging.h>
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace llm {
+namespace {
+constexpr uint64_t kHashSeed = 14695981039346656037ULL;
+}  // namespace
+
+PromptCache::PromptCache(size_t max_tokens, size_t piece_size)
+    : max_tokens_(max_tokens), piece_size_(piece_size) {
+  CHECK_GT(piece_size, 0) << "Piece size should be greater than 0";
+}
+
+size_t PromptCache::match(const std::vector<std::string_view>& pieces,
+                          std::vector<int32_t>* ids) {
+  const auto texts = piece_texts(pieces, pieces.size());
+  const auto hashes = piece_hashes(texts);
+
+  absl::MutexLock lock(&mu_);
+  size_t n_matched = 0;
+  for (; n_matched < texts.size(); ++n_matched) {
+    const uint64_t prefix_hash =
+        n_matched == 0 ? kHashSeed : hashes[n_matched - 1];
+    Entry* entry = find(hashes[n_matched], prefix_hash, texts[n_matched]);
+    if (entry == nullptr) {
+      break;
+    }
+    // move the entry to the back of the lru list
+    lru_.splice(lru_.end(), lru_, entry->lru_it);
+    ids->insert(ids->end(), entry->token_ids.begin(), entry->token_ids.end());
+  }
+  return n_matched;
+}
+
+size_t PromptCache::insert(const std::vector<std::string_view>& pieces,
+                           size_t start,
+                           const std::vector<std::vector<int32_t>>& piece_ids) {
+  const size_t n_pieces = start + piece_ids.size();
+  CHECK_LE(n_pieces, pieces.size()) << "Too many piece ids";
+  const auto texts = piece_texts(pieces, n_pieces);
+  const auto hashes = piece_hashes(texts);
+
+  absl::MutexLock lock(&mu_);
+  size_t n_inserted = 0;
+  for (size_t i = start; i < n_pieces; ++i) {
+    const uint64_t prefix_hash = i == 0 ? kHashSeed : hashes[i - 1];
+    Entry* entry = find(hashes[i], prefix_hash, texts[i]);
+    if (entry != nullptr) {
+      // already cached, just refresh the lru position
+      lru_.splice(lru_.end(), lru_, entry->lru_it);
+      continue;
+    }
+    // replace the entry on hash collision
+    auto it = entries_.find(hashes[i]);
+    if (it != entries_.end()) {
+      num_tokens_ -= it->second.token_ids.size();
+      lru_.erase(it->second.lru_it);
+      entries_.erase(it);
+    }
+
+    Entry& new_entry = entries_[hashes[i]];
+    new_entry.prefix_hash = prefix_hash;
+    new_entry.text = texts[i];
+    new_entry.token_ids = piece_ids[i - start];
+    new_entry.lru_it = lru_.insert(lru_.end(), hashes[i]);
+    num_tokens_ += new_entry.token_ids.size();
+    ++n_inserted;
+  }
+  evict();
+  return n_inserted;
+}
+
+size_t PromptCache::num_tokens() const {
+  absl::MutexLock lock(&mu_);
+  return num_tokens_;
+}
+
+std::vector<std::string_view> PromptCache::piece_texts(
+    const std::vector<std::string_view>& pieces,
+    size_t n_pieces) {
+  std::vector<std::string_view> texts;
+  texts.reserve(n_pieces);
+  const char* prev_end = pieces.empty() ? nullptr : pieces[0].data();
+  for (size_t i = 0; i < n_pieces; ++i) {
+    const char* end = pieces[i].data() + pieces[i].size();
+    DCHECK(pieces[i].data() >= prev_end) << "Pieces should be back to back";
+    texts.emplace_back(prev_end, end - prev_end);
+    prev_end = end;
+  }
+  return texts;
+}
+
+std::vector<uint64_t> PromptCache::piece_hashes(
+    const std::vector<std::string_view>& texts) {
+  std::vector<uint64_t> hashes;
+  hashes.reserve(texts.size());
+  uint64_t hash = kHashSeed;
+  for (const auto& text : texts) {
+    hash = absl::HashOf(hash, text);
+    hashes.push_back(hash);
+  }
+  return hashes;
+}
+
+PromptCache::Entry* PromptCache::find(uint64_t hash,
+                                      uint64_t prefix_hash,
+                                      std::string_view text) {
+  auto it = entries_.find(hash);
+  if (it == entries_.end()) {
+    return nullptr;
+  }
+  Entry& entry = it->second;
+  if (entry.prefix_hash != prefix_hash || entry.text != text) {
+    return nullptr;
+  }
+  return &entry;
+}
+
+void PromptCache::evict() {
+  while (num_tokens_ > max_tokens_ && !lru_.empty()) {
+    auto it = entries_.find(lru_.front());
+    DCHECK(it != entries_.end());
+    num_tokens_ -= it->second.token_ids.size();
+    entries_.erase(it);
+    lru_.pop_front();
+  }
+}
+
+}  // namespace llm
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <absl/synchronization/mutex.h>
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace llm {
+
+// A cache of the token ids of prompt pieces, so that prompts sharing a long
+// prefix, e.g. the rendered system prompt of chat requests, only encode the
+// text after the longest cached prefix. Prompts are split into pieces with
+// Tokenizer::split_pieces(prompt, piece_size()), and each piece is keyed by
+// the hash of the text from the start of the prompt to the end of the piece.
+// The pieces of shared prefixes are split in the same way, and the ids of a
+// piece only depend on its text, so matched ids are always the same as
+// encoding the whole prompt. Thread safe.
+class PromptCache final {
+ public:
+  static constexpr size_t kDefaultPieceSize = 1024;
+
+  // max_tokens: max number of token ids to cache
+  // piece_size: bytes of the pieces that prompts are split into
+  explicit PromptCache(size_t max_tokens,
+                       size_t piece_size = kDefaultPieceSize);
+
+  // disable copy, move and assign
+  PromptCache(const PromptCache&) = delete;
+  PromptCache(PromptCache&&) = delete;
+  PromptCache& operator=(const PromptCache&) = delete;
+  PromptCache& operator=(PromptCache&&) = delete;
+
+  // match the leading pieces of a prompt, which should be views of the prompt
+  // back to back as split by the tokenizer. appends the token ids of matched
+  // pieces to ids, and returns the number of matched pieces.
+  size_t match(const std::vector<std::string_view>& pieces,
+               std::vector<int32_t>* ids);
+
+  // insert the pieces [start, start + piece_ids.size()) of a prompt with the
+  // token ids of each piece.
+  // return the number of new inserted pieces
+  size_t insert(const std::vector<std::string_view>& pieces,
+                size_t start,
+                const std::vector<std::vector<int32_t>>& piece_ids);
+
+  size_t piece_size() const { return piece_size_; }
+
+  // get the number of cached token ids
+  size_t num_tokens() const;
+
+ private:
+  struct Entry {
+    // hash of the text before the piece, used to verify the match
+    uint64_t prefix_hash = 0;
+    // the text of the piece, including the separators dropped between the
+    // previous piece and this one
+    std::string text;
+    // the token ids of the piece
+    std::vector<int32_t> token_ids;
+    // position in the lru list
+    std::list<uint64_t>::iterator lru_it;
+  };
+
+  // returns the text of each piece, starting from the end of the previous one
+  static std::vector<std::string_view> piece_texts(
+      const std::vector<std::string_view>& pieces,
+      size_t n_pieces);
+
+  // returns the hash of the text up to the end of each piece
+  static std::vector<uint64_t> piece_hashes(
+      const std::vector<std::string_view>& texts);
+
+  // find the entry for the piece, nullptr if not found
+  Entry* find(uint64_t hash, uint64_t prefix_hash, std::string_view text)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // evict least recently used pieces until within max_tokens_
+  void evict() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  mutable absl::Mutex mu_;
+
+  // piece hash -> entry
+  std::unordered_map<uint64_t, Entry> entries_ ABSL_GUARDED_BY(mu_);
+
+  // piece hashes sorted by the last access time, front is least recently used
+  std::list<uint64_t> lru_ ABSL_GUARDED_BY(mu_);
+
+  // the number of cached token ids
+  size_t num_tokens_ ABSL_GUARDED_BY(mu_) = 0;
+
+  size_t max_tokens_ = 0;
+
+  size_t piece_size_ = kDefaultPieceSize;
+};
+
+}  // namespace llm
@@ -0,0 +1,109 @@
+#include "prompt_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "tiktoken_tokenizer.h"
+
+namespace llm {
+
+namespace {
+// encode the prompt with the cache, returns the number of matched pieces
+size_t encode_with_cache(const Tokenizer& tokenizer,
+                         PromptCache* cache,
+                         const std::string& prompt,
+                         std::vector<int32_t>* ids) {
+  const auto pieces = tokenizer.split_pieces(prompt, cache->piece_size());
+  const size_t n_matched = cache->match(pieces, ids);
+  std::vector<std::vector<int32_t>> piece_ids(pieces.size() - n_matched);
+  for (size_t i = n_matched; i < pieces.size(); ++i) {
+    auto& piece_ids_i = piece_ids[i - n_matched];
+    EXPECT_TRUE(tokenizer.encode_piece(pieces[i], i == 0, &piece_ids_i));
+    ids->insert(ids->end(), piece_ids_i.begin(), piece_ids_i.end());
+  }
+  cache->insert(pieces, n_matched, piece_ids);
+  return n_matched;
+}
+}  // namespace
+
+TEST(PromptCacheTest, SharedPrefix) {
+  TokenizerArgs args;
+  args.vocab_file() = "test.tiktoken";
+  args.pattern() =
+      R"((?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+[^\S]|\s+)";
+  args.special_tokens() = {{"<|im_start|>", 300}, {"<|im_end|>", 301}};
+  TiktokenTokenizer tokenizer("data", args);
+  PromptCache cache(/*max_tokens=*/10000, /*piece_size=*/64);
+
+  std::string system_prompt = "<|im_start|>system\n";
+  for (int i = 0; i < 20; ++i) {
+    system_prompt += "You are a helpful assistant and answer in 42 words. ";
+  }
+  system_prompt += "<|im_end|>\n<|im_start|>user\n";
+  const std::vector<std::string> prompts = {
+      system_prompt + "What is the capital of France?",
+      system_prompt + "Who wrote Hamlet?<|im_end|>",
+      system_prompt.substr(0, 500) + "Hello",
+      "Hello, world!"};
+
+  std::vector<size_t> n_matched;
+  for (const auto& prompt : prompts) {
+    std::vector<int32_t> ids;
+    n_matched.push_back(encode_with_cache(tokenizer, &cache, prompt, &ids));
+    std::vector<int32_t> desired_ids;
+    ASSERT_TRUE(tokenizer.encode(prompt, &desired_ids));
+    EXPECT_EQ(ids, desired_ids) << prompt;
+  }
+  EXPECT_EQ(n_matched[0], 0);
+  EXPECT_GT(n_matched[1], 10);
+  EXPECT_GT(n_matched[2], 4);
+  EXPECT_EQ(n_matched[3], 0);
+
+  // the same prompt matches all pieces
+  const auto pieces = tokenizer.split_pieces(prompts[0], cache.piece_size());
+  std::vector<int32_t> ids;
+  EXPECT_EQ(cache.match(pieces, &ids), pieces.size());
+}
+
+TEST(PromptCacheTest, Evict) {
+  PromptCache cache(/*max_tokens=*/4, /*piece_size=*/8);
+  const std::string prompt = "aaaa bbbb cccc";
+  const std::vector<std::string_view> pieces = {
+      std::string_view(prompt).substr(0, 4),
+      std::string_view(prompt).substr(5, 4),
+      std::string_view(prompt).substr(10, 4)};
+  EXPECT_EQ(cache.insert(pieces, 0, {{1, 2}, {3}, {4}}), 3);
+  EXPECT_EQ(cache.num_tokens(), 4);
+
+  std::vector<int32_t> ids;
+  EXPECT_EQ(cache.match(pieces, &ids), 3);
+  EXPECT_EQ(ids, std::vector<int32_t>({1, 2, 3, 4}));
+
+  // refresh the first piece, and the others are the least recently used
+  ids.clear();
+  EXPECT_EQ(cache.match({pieces[0]}, &ids), 1);
+  const std::string other = "aaaa dddd";
+  const std::vector<std::string_view> other_pieces = {
+      std::string_view(other).substr(0, 4),
+      std::string_view(other).substr(5, 4)};
+  EXPECT_EQ(cache.insert(other_pieces, 1, {{7, 8}}), 1);
+  EXPECT_EQ(cache.num_tokens(), 4);
+  ids.clear();
+  EXPECT_EQ(cache.match(pieces, &ids), 1);
+  ids.clear();
+  EXPECT_EQ(cache.match(other_pieces, &ids), 2);
+  EXPECT_EQ(ids, std::vector<int32_t>({1, 2, 7, 8}));
+
+  // the separators between pieces are part of the key
+  const std::string no_space = "aaaadddd";
+  const std::vector<std::string_view> no_space_pieces = {
+      std::string_view(no_space).substr(0, 4),
+      std::string_view(no_space).substr(4, 4)};
+  ids.clear();
+  EXPECT_EQ(cache.match(no_space_pieces, &ids), 1);
+}
+
+}  // namespace llm
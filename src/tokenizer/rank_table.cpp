@@ -0,0 +1,78 @@
+#include "rank_table.h"
+
+#include <absl/hash/hash.h>
+#include <glog/logging.h>
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+namespace llm {
+namespace {
+inline uint64_t hash_token(std::string_view token) {
+  return absl::Hash<std::string_view>{}(token);
+}
+}  // namespace
+
+size_t RankTable::probe(std::string_view token, uint64_t hash) const {
+  const size_t mask = slots_.size() - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    const Slot& slot = slots_[i];
+    if (slot.rank < 0) {
+      return i;
+    }
+    if (slot.hash == hash && slot.length == token.size() &&
+        std::string_view(bytes_.data() + slot.offset, slot.length) == token) {
+      return i;
+    }
+  }
+}
+
+bool RankTable::insert(std::string_view token, int32_t rank) {
+  CHECK_GE(rank, 0) << "invalid rank";
+  // keep the load factor under 1/2
+  if ((size_ + 1) * 2 > slots_.size()) {
+    grow();
+  }
+  const uint64_t hash = hash_token(token);
+  Slot& slot = slots_[probe(token, hash)];
+  if (slot.rank >= 0) {
+    return false;
+  }
+  slot.hash = hash;
+  slot.offset = static_cast<uint32_t>(bytes_.size());
+  slot.length = static_cast<uint32_t>(token.size());
+  slot.rank = rank;
+  bytes_.append(token);
+  ++size_;
+  return true;
+}
+
+std::optional<int32_t> RankTable::find(std::string_view token) const {
+  if (slots_.empty()) {
+    return std::nullopt;
+  }
+  const Slot& slot = slots_[probe(token, hash_token(token))];
+  if (slot.rank < 0) {
+    return std::nullopt;
+  }
+  return slot.rank;
+}
+
+void RankTable::grow() {
+  std::vector<Slot> old_slots(slots_.empty() ? 16 : slots_.size() * 2);
+  old_slots.swap(slots_);
+  const size_t mask = slots_.size() - 1;
+  for (const Slot& old_slot : old_slots) {
+    if (old_slot.rank < 0) {
+      continue;
+    }
+    size_t i = old_slot.hash & mask;
+    while (slots_[i].rank >= 0) {
+      i = (i + 1) & mask;
+    }
+    slots_[i] = old_slot;
+  }
+}
+
+}  // namespace llm
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace llm {
+
+// A flat open-addressing hash table from token bytes to ranks for byte pair
+// encoding. The bytes of all tokens are stored back to back in one buffer,
+// and lookups take a string_view without constructing a string.
+class RankTable final {
+ public:
+  // insert a token, returns false if the token exists already
+  bool insert(std::string_view token, int32_t rank);
+
+  // return the rank of the token if exists
+  std::optional<int32_t> find(std::string_view token) const;
+
+  size_t size() const { return size_; }
+
+ private:
+  struct Slot {
+    uint64_t hash = 0;
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    // -1 for empty slots
+    int32_t rank = -1;
+  };
+
+  // returns the index of the slot holding the token, or of the empty slot to
+  // insert it into
+  size_t probe(std::string_view token, uint64_t hash) const;
+
+  void grow();
+
+  std::vector<Slot> slots_;
+
+  // the bytes of all tokens
+  std::string bytes_;
+
+  size_t size_ = 0;
+};
+
+}  // namespace llm
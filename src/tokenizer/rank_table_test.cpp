@@ -0,0 +1,39 @@
+#include "rank_table.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace llm {
+
+TEST(RankTableTest, InsertFind) {
+  RankTable table;
+  EXPECT_EQ(table.size(), 0);
+  EXPECT_FALSE(table.find("a").has_value());
+
+  // insert enough tokens to grow the table a few times
+  for (int32_t i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(table.insert("token" + std::to_string(i), i));
+  }
+  EXPECT_EQ(table.size(), 1000);
+  for (int32_t i = 0; i < 1000; ++i) {
+    EXPECT_EQ(table.find("token" + std::to_string(i)), i);
+  }
+  EXPECT_FALSE(table.find("token1000").has_value());
+  EXPECT_FALSE(table.find("token").has_value());
+
+  // duplicated tokens keep the first rank
+  EXPECT_FALSE(table.insert("token1", 2000));
+  EXPECT_EQ(table.find("token1"), 1);
+  EXPECT_EQ(table.size(), 1000);
+
+  // tokens are arbitrary bytes
+  const std::string bytes("\0\xff", 2);
+  EXPECT_TRUE(table.insert(bytes, 1000));
+  EXPECT_EQ(table.find(bytes), 1000);
+  EXPECT_FALSE(table.find(std::string("\0", 1)).has_value());
+  EXPECT_TRUE(table.insert("", 1001));
+  EXPECT_EQ(table.find(""), 1001);
+}
+
+}  // namespace llm
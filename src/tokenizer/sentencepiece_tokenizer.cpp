@@ -1,14 +1,20 @@
 #include "sentencepiece_tokenizer.h"
 
+#include <absl/strings/ascii.h>
 #include <absl/strings/str_cat.h>
 #include <absl/strings/str_join.h>
+#include <absl/strings/str_replace.h>
 #include <absl/strings/string_view.h>
+#include <absl/strings/strip.h>
 #include <glog/logging.h>
 #include <re2/re2.h>
 
 #include <string_view>
+#include <utility>
+#include <vector>
 
 #include "sentencepiece.pb.h"
+#include "sentencepiece_model.pb.h"
 #include "sentencepiece/sentencepiece_processor.h"
 
 #define RETURN_FALSE_IF_ERROR(expr)  \
@@ -24,6 +30,12 @@
   } while (0)
 
 namespace llm {
+namespace {
+// the symbol of spaces in pieces: U+2581
+constexpr absl::string_view kSpaceSymbol = "\xe2\x96\x81";
+// the surface of unknown pieces by default: " ⁇ "
+constexpr absl::string_view kDefaultUnknownSymbol = " \xE2\x81\x87 ";
+}  // namespace
 
 SentencePieceTokenizer::SentencePieceTokenizer(const std::string_view& dir_path,
                                                const TokenizerArgs& args)
@@ -37,6 +49,25 @@ SentencePieceTokenizer::SentencePieceTokenizer(const std::string_view& dir_path,
                << ": " << status.ToString() << ", error " << status.ToString();
   }
 
+  const auto& model_proto = sp_processor_.model_proto();
+  const auto& normalizer_spec = model_proto.normalizer_spec();
+  remove_extra_whitespaces_ = normalizer_spec.remove_extra_whitespaces();
+  strip_leading_space_ =
+      normalizer_spec.add_dummy_prefix() || remove_extra_whitespaces_;
+  unk_surface_ = model_proto.trainer_spec().has_unk_surface()
+                     ? model_proto.trainer_spec().unk_surface()
+                     : std::string(kDefaultUnknownSymbol);
+  // the text is rewritten as a whole with denormalization rules or suffix
+  // whitespaces, which can't be decoded one token at a time.
+  stream_decodable_ =
+      !model_proto.trainer_spec().treat_whitespace_as_suffix() &&
+      model_proto.denormalizer_spec().precompiled_charsmap().empty();
+  // words never span spaces, and the dummy prefix is added to each piece.
+  piece_splittable_ =
+      normalizer_spec.add_dummy_prefix() &&
+      model_proto.trainer_spec().split_by_whitespace() &&
+      !model_proto.trainer_spec().treat_whitespace_as_suffix();
+
   // add special tokens and construct special token regex
   if (!args.special_tokens().empty()) {
     const auto vocab_size = sp_processor_.GetPieceSize();
@@ -111,10 +142,64 @@ bool SentencePieceTokenizer::encode_internal(const std::string_view& text,
   return true;
 }
 
+std::vector<std::string_view> SentencePieceTokenizer::split_pieces(
+    const std::string_view& text,
+    size_t piece_size) const {
+  if (!piece_splittable_ || text.size() <= piece_size) {
+    return {text};
+  }
+
+  // spans of special tokens, never split next to them
+  std::vector<std::pair<size_t, size_t>> specials;
+  if (special_token_regex_ != nullptr) {
+    absl::string_view input{text.data(), text.size()};
+    absl::string_view special;
+    while (re2::RE2::FindAndConsume(&input, *special_token_regex_, &special)) {
+      const size_t start = special.data() - text.data();
+      specials.emplace_back(start, start + special.size());
+    }
+  }
+
+  // split at a single space between ascii letters or digits, which are kept
+  // as is by normalization. the space is dropped, the dummy prefix added to
+  // the next piece stands for it.
+  std::vector<std::string_view> pieces;
+  size_t piece_start = 0;
+  size_t next_special = 0;
+  size_t pos = piece_size;
+  while (pos + 1 < text.size()) {
+    if (text[pos] != ' ' || !absl::ascii_isalnum(text[pos - 1]) ||
+        !absl::ascii_isalnum(text[pos + 1])) {
+      ++pos;
+      continue;
+    }
+    while (next_special < specials.size() &&
+           specials[next_special].second < pos) {
+      ++next_special;
+    }
+    if (next_special < specials.size() &&
+        specials[next_special].first <= pos + 1) {
+      ++pos;
+      continue;
+    }
+    pieces.push_back(text.substr(piece_start, pos - piece_start));
+    piece_start = pos + 1;
+    pos = piece_start + piece_size;
+  }
+  pieces.push_back(text.substr(piece_start));
+  return pieces;
+}
+
 bool SentencePieceTokenizer::encode(const std::string_view& text,
                                     std::vector<int32_t>* ids) const {
+  return encode_piece(text, /*first_piece=*/true, ids);
+}
+
+bool SentencePieceTokenizer::encode_piece(const std::string_view& text,
+                                          bool first_piece,
+                                          std::vector<int32_t>* ids) const {
   // prepend prefix tokens if exists
-  if (!prefix_token_ids_.empty()) {
+  if (first_piece && !prefix_token_ids_.empty()) {
     ids->insert(
         ids->begin(), prefix_token_ids_.begin(), prefix_token_ids_.end());
   }
@@ -201,6 +286,61 @@ std::string SentencePieceTokenizer::decode(const Slice<int32_t>& ids,
   return ss.str();
 }
 
+bool SentencePieceTokenizer::decode_token(int32_t id,
+                                          bool skip_special_tokens,
+                                          TokenStreamState* state,
+                                          std::string* bytes) const {
+  if (!stream_decodable_) {
+    return false;
+  }
+  // the text between special tokens is decoded separately
+  const auto sit = special_token_decoder_.find(id);
+  if (sit != special_token_decoder_.end()) {
+    if (!skip_special_tokens) {
+      bytes->append(sit->second);
+    }
+    state->at_text_start = true;
+    return true;
+  }
+
+  if (id < 0 || id >= sp_processor_.GetPieceSize()) {
+    LOG(ERROR) << "Invalid id: " << id;
+    return true;
+  }
+  if (sp_processor_.IsControl(id)) {
+    // invisible, e.g. <s> and </s>
+    return true;
+  }
+  if (sp_processor_.IsUnknown(id)) {
+    bytes->append(unk_surface_);
+    state->at_text_start = false;
+    return true;
+  }
+  const std::string& piece = sp_processor_.IdToPiece(id);
+  if (sp_processor_.IsByte(id)) {
+    // byte fallback piece: <0xXX>
+    CHECK_EQ(piece.size(), 6) << "Invalid byte piece: " << piece;
+    bytes->push_back(static_cast<char>(std::stoi(piece.substr(3, 2),
+                                                 /*pos=*/nullptr,
+                                                 /*base=*/16)));
+    state->at_text_start = false;
+    return true;
+  }
+
+  absl::string_view text = piece;
+  if (state->at_text_start && strip_leading_space_ &&
+      absl::ConsumePrefix(&text, kSpaceSymbol)) {
+    // only the first leading space is dropped, unless all leading spaces are
+    // removed with remove_extra_whitespaces
+    state->at_text_start = remove_extra_whitespaces_;
+  }
+  if (!text.empty()) {
+    absl::StrAppend(bytes, absl::StrReplaceAll(text, {{kSpaceSymbol, " "}}));
+    state->at_text_start = false;
+  }
+  return true;
+}
+
 std::optional<int32_t> SentencePieceTokenizer::token_to_id(
     const std::string_view& token) const {
   // encode special token
@@ -19,9 +19,21 @@ class SentencePieceTokenizer : public Tokenizer {
   bool encode(const std::string_view& text,
               std::vector<int32_t>* ids) const override;
 
+  std::vector<std::string_view> split_pieces(const std::string_view& text,
+                                             size_t piece_size) const override;
+
+  bool encode_piece(const std::string_view& piece,
+                    bool first_piece,
+                    std::vector<int32_t>* ids) const override;
+
   std::string decode(const Slice<int32_t>& ids,
                      bool skip_special_tokens) const override;
 
+  bool decode_token(int32_t id,
+                    bool skip_special_tokens,
+                    TokenStreamState* state,
+                    std::string* bytes) const override;
+
   std::optional<int32_t> token_to_id(
       const std::string_view& token) const override;
 
@@ -58,6 +70,16 @@ class SentencePieceTokenizer : public Tokenizer {
 
   // token ids to add to the beginning of the input sequence
   std::vector<int32_t> prefix_token_ids_;
+
+  // rules of the leading space when decoding tokens one at a time, following
+  // sentencepiece::SentencePieceProcessor::Decode
+  bool stream_decodable_ = true;
+  // whether the text can be split at spaces between words, with the dummy
+  // prefix standing for the space before each piece
+  bool piece_splittable_ = false;
+  bool strip_leading_space_ = true;
+  bool remove_extra_whitespaces_ = false;
+  std::string unk_surface_;
 };
 
 }  // namespace llm
@@ -4,6 +4,21 @@
 
 namespace llm {
 
+namespace {
+// decode the tokens one at a time
+std::string decode_tokens(const Tokenizer& tokenizer,
+                          const std::vector<int>& ids,
+                          bool skip_special_tokens) {
+  TokenStreamState state;
+  std::string text;
+  for (const int id : ids) {
+    EXPECT_TRUE(
+        tokenizer.decode_token(id, skip_special_tokens, &state, &text));
+  }
+  return text;
+}
+}  // namespace
+
 TEST(SentencePieceTokenizerTest, EncodeDecodeTest) {
   TokenizerArgs args;
   args.vocab_file() = "tokenizer.model";
@@ -113,4 +128,56 @@ TEST(SentencePieceTokenizerTest, SpecialTokenTest) {
     EXPECT_EQ(decoded_id, id);
   }
 }
+
+TEST(SentencePieceTokenizerTest, DecodeTokenTest) {
+  std::vector<SpecialToken> special_tokens = {
+      SpecialToken("<|user|>", 32000),
+      SpecialToken("<|assistant|>", 32001),
+  };
+  TokenizerArgs args;
+  args.vocab_file() = "tokenizer.model";
+  args.special_tokens() = special_tokens;
+  SentencePieceTokenizer tokenizer("data", args);
+  for (const std::string test_text :
+       {"Hello, world!",
+        "你好，世界！",
+        "<|user|> Hello world <|assistant|>  你好 <|user|>"}) {
+    std::vector<int> ids;
+    ASSERT_TRUE(tokenizer.encode(test_text, &ids));
+    for (const bool skip_special_tokens : {false, true}) {
+      EXPECT_EQ(decode_tokens(tokenizer, ids, skip_special_tokens),
+                tokenizer.decode(ids, skip_special_tokens));
+    }
+  }
+}
+
+TEST(SentencePieceTokenizerTest, EncodePiecesTest) {
+  std::vector<SpecialToken> special_tokens = {
+      SpecialToken("<|user|>", 32000),
+      SpecialToken("<|assistant|>", 32001),
+  };
+  TokenizerArgs args;
+  args.vocab_file() = "tokenizer.model";
+  args.prefix_tokens() = {"<s>"};
+  args.special_tokens() = special_tokens;
+  SentencePieceTokenizer tokenizer("data", args);
+
+  std::string text;
+  for (int i = 0; i < 20; ++i) {
+    text += "<|user|> Hello world, 你好 12345 <|assistant|>foo  bar baz\n";
+  }
+  const auto pieces = tokenizer.split_pieces(text, /*piece_size=*/64);
+  EXPECT_GT(pieces.size(), 1);
+
+  std::vector<int> desired_ids;
+  ASSERT_TRUE(tokenizer.encode(text, &desired_ids));
+  std::vector<int> ids;
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    std::vector<int> piece_ids;
+    ASSERT_TRUE(tokenizer.encode_piece(pieces[i], i == 0, &piece_ids));
+    ids.insert(ids.end(), piece_ids.begin(), piece_ids.end());
+  }
+  EXPECT_EQ(ids, desired_ids);
+}
+
 }  // namespace llm
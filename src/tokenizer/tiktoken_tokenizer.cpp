@@ -1,5 +1,6 @@
 #include "tiktoken_tokenizer.h"
 
+#include <absl/strings/ascii.h>
 #include <absl/strings/escaping.h>
 #include <absl/strings/numbers.h>
 #include <absl/strings/str_cat.h>
@@ -10,7 +11,9 @@
 #include <re2/re2.h>
 
 #include <fstream>
+#include <functional>
 #include <optional>
+#include <queue>
 #include <string>
 #include <string_view>
 
@@ -74,6 +77,106 @@ inline bool is_valid_decode_utf8(std::string_view input, size_t* mblen) {
   return c != kUnicodeError || *mblen == 3;
 }
 
+// the pre-tokenization patterns of cl100k style tokenizers, e.g. qwen and
+// chatglm, with the look-ahead assertion unsupported by RE2 replaced.
+constexpr std::string_view kCl100kPattern =
+    R"((?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+[^\S]|\s+)";
+constexpr std::string_view kCl100kDigits3Pattern =
+    R"((?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+[^\S]|\s+)";
+
+// pieces at least this long are merged with a heap instead of linear scans
+constexpr size_t kHeapMergeMinSize = 64;
+
+inline bool is_ascii(char c) { return static_cast<unsigned char>(c) < 0x80; }
+
+// \s of RE2: [\t\n\f\r ]
+inline bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\f' || c == '\r';
+}
+
+inline bool is_newline(char c) { return c == '\r' || c == '\n'; }
+
+// match the next word of the cl100k pattern at the start of the text, in the
+// same way as RE2 does, i.e. the first alternative that matches with greedy
+// repetitions. returns 0 if the word depends on non-ascii characters, which
+// are left to the regex to handle unicode classes.
+size_t match_cl100k_word(std::string_view text, size_t max_digits) {
+  const size_t n = text.size();
+  const char c = text[0];
+  if (!is_ascii(c) || (n > 1 && !is_ascii(text[1]))) {
+    return 0;
+  }
+
+  // (?i:'s|'t|'re|'ve|'m|'ll|'d)
+  if (c == '\'' && n > 1) {
+    const char c1 = absl::ascii_tolower(text[1]);
+    if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') {
+      return 2;
+    }
+    if (n > 2) {
+      const char c2 = absl::ascii_tolower(text[2]);
+      if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') ||
+          (c1 == 'l' && c2 == 'l')) {
+        return 3;
+      }
+    }
+  }
+
+  // [^\r\n\p{L}\p{N}]?\p{L}+
+  size_t start = n;
+  if (absl::ascii_isalpha(c)) {
+    start = 0;
+  } else if (!is_newline(c) && !absl::ascii_isdigit(c) && n > 1 &&
+             absl::ascii_isalpha(text[1])) {
+    start = 1;
+  }
+  if (start < n) {
+    size_t i = start;
+    while (i < n && absl::ascii_isalpha(text[i])) {
+      ++i;
+    }
+    return i < n && !is_ascii(text[i]) ? 0 : i;
+  }
+
+  // \p{N} or \p{N}{1,3}
+  if (absl::ascii_isdigit(c)) {
+    size_t i = 1;
+    while (i < max_digits && i < n && absl::ascii_isdigit(text[i])) {
+      ++i;
+    }
+    return i < max_digits && i < n && !is_ascii(text[i]) ? 0 : i;
+  }
+
+  //  ?[^\s\p{L}\p{N}]+[\r\n]*
+  const size_t symbol_start = c == ' ' ? 1 : 0;
+  size_t i = symbol_start;
+  while (i < n && is_ascii(text[i]) && !is_space(text[i]) &&
+         !absl::ascii_isalnum(text[i])) {
+    ++i;
+  }
+  if (i < n && !is_ascii(text[i])) {
+    return 0;
+  }
+  if (i > symbol_start) {
+    while (i < n && is_newline(text[i])) {
+      ++i;
+    }
+    return i;
+  }
+
+  // \s*[\r\n]+ matches until the last newline of the spaces, otherwise
+  // \s+[^\S] or \s+ match all the spaces.
+  size_t end = 0;
+  i = 0;
+  while (i < n && is_space(text[i])) {
+    if (is_newline(text[i])) {
+      end = i + 1;
+    }
+    ++i;
+  }
+  return end > 0 ? end : i;
+}
+
 }  // namespace
 
 TiktokenTokenizer::TiktokenTokenizer(const std::string_view& dir_path,
@@ -91,6 +194,13 @@ TiktokenTokenizer::TiktokenTokenizer(const std::string_view& dir_path,
     load_special_tokens(args.special_tokens());
   }
 
+  // pre-tokenize ascii text without the regex for known patterns
+  if (args.pattern() == kCl100kPattern) {
+    max_word_digits_ = 1;
+  } else if (args.pattern() == kCl100kDigits3Pattern) {
+    max_word_digits_ = 3;
+  }
+
   // construct regex
   if (!args.pattern().empty()) {
     const auto regex_str = absl::StrCat("(", args.pattern(), ")");
@@ -185,7 +295,7 @@ void TiktokenTokenizer::load_vocab(const std::string& vocab_file_path) {
       continue;
     }
 
-    if (!encoder_.try_emplace(token, rank).second) {
+    if (!encoder_.insert(token, rank)) {
       LOG(WARNING) << "Duplicate token: " << token;
     }
     if (!decoder_.try_emplace(rank, token).second) {
@@ -200,6 +310,10 @@ void TiktokenTokenizer::byte_pair_encode(const std::string_view& piece,
     // empty piece, no need to encode
     return;
   }
+  if (piece.size() >= kHeapMergeMinSize) {
+    byte_pair_encode_long(piece, ids);
+    return;
+  }
 
   // This is a vector of (start, rank) pairs.
   // The rank is of the byte pair startig at position start.
@@ -216,11 +330,7 @@ void TiktokenTokenizer::byte_pair_encode(const std::string_view& piece,
     if (start + skip + 2 < parts.size()) {
       auto s = parts[start].first;
       auto e = parts[start + skip + 2].first;
-      const auto key = piece.substr(s, e - s);
-      auto it = encoder_.find({key.data(), key.size()});
-      if (it != encoder_.end()) {
-        return it->second;
-      }
+      return encoder_.find(piece.substr(s, e - s));
     }
     return std::nullopt;
   };
@@ -266,15 +376,124 @@ void TiktokenTokenizer::byte_pair_encode(const std::string_view& piece,
     const auto e = parts[i + 1].first;
     // get rank for each piece
     const auto key = piece.substr(s, e - s);
-    auto it = encoder_.find({key.data(), key.size()});
-    if (it == encoder_.end()) {
+    const auto rank = encoder_.find(key);
+    if (!rank.has_value()) {
+      LOG(ERROR) << "Failed to find key: " << key;
+    } else {
+      ids->push_back(rank.value());
+    }
+  }
+}
+
+void TiktokenTokenizer::byte_pair_encode_long(const std::string_view& piece,
+                                              std::vector<int32_t>* ids) const {
+  // the same merges as byte_pair_encode, with the parts kept in a linked list
+  // and the lowest ranked pair, leftmost first, taken from a heap. entries of
+  // the heap are skipped if their parts changed since pushed.
+  struct Part {
+    int32_t start = 0;
+    // rank of the pair of this part and the next one
+    int32_t rank = 0;
+    int32_t prev = -1;
+    int32_t next = -1;
+  };
+  const int32_t kMaxRank = std::numeric_limits<int32_t>::max();
+  const auto n = static_cast<int32_t>(piece.size());
+  // one part per byte, plus a sentinel part at the end
+  std::vector<Part> parts(n + 1);
+  for (int32_t i = 0; i <= n; ++i) {
+    parts[i] = {i, kMaxRank, i - 1, i + 1};
+  }
+
+  // rank of the pair starting at part i
+  auto get_rank = [&](int32_t i) {
+    const int32_t next = parts[i].next;
+    if (next >= n) {
+      return kMaxRank;
+    }
+    const int32_t start = parts[i].start;
+    const int32_t end = parts[parts[next].next].start;
+    return encoder_.find(piece.substr(start, end - start)).value_or(kMaxRank);
+  };
+
+  using Entry = std::pair<int32_t, int32_t>;  // (rank, part)
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+  for (int32_t i = 0; i < n - 1; ++i) {
+    parts[i].rank = get_rank(i);
+    if (parts[i].rank != kMaxRank) {
+      heap.emplace(parts[i].rank, i);
+    }
+  }
+
+  while (!heap.empty()) {
+    const auto [rank, i] = heap.top();
+    heap.pop();
+    // skip merged parts and stale ranks
+    if (parts[i].start < 0 || parts[i].rank != rank) {
+      continue;
+    }
+
+    // merge the next part into part i
+    const int32_t next = parts[i].next;
+    parts[i].next = parts[next].next;
+    parts[parts[next].next].prev = i;
+    parts[next].start = -1;
+
+    parts[i].rank = get_rank(i);
+    if (parts[i].rank != kMaxRank) {
+      heap.emplace(parts[i].rank, i);
+    }
+    if (const int32_t prev = parts[i].prev; prev >= 0) {
+      parts[prev].rank = get_rank(prev);
+      if (parts[prev].rank != kMaxRank) {
+        heap.emplace(parts[prev].rank, prev);
+      }
+    }
+  }
+
+  for (int32_t i = 0; i < n; i = parts[i].next) {
+    const int32_t start = parts[i].start;
+    const int32_t end = parts[parts[i].next].start;
+    const auto key = piece.substr(start, end - start);
+    const auto rank = encoder_.find(key);
+    if (!rank.has_value()) {
       LOG(ERROR) << "Failed to find key: " << key;
     } else {
-      ids->push_back(it->second);
+      ids->push_back(rank.value());
     }
   }
 }
 
+template <typename Func>
+void TiktokenTokenizer::for_each_word(std::string_view text, Func&& fn) const {
+  absl::string_view word;
+  if (max_word_digits_ == 0) {
+    absl::string_view input{text.data(), text.size()};
+    while (re2::RE2::FindAndConsume(&input, *regex_, &word)) {
+      fn(std::string_view{word.data(), word.size()});
+    }
+    return;
+  }
+
+  // match ascii words by hand, and fall back to the regex for the others
+  size_t pos = 0;
+  while (pos < text.size()) {
+    const auto rest = text.substr(pos);
+    const size_t len = match_cl100k_word(rest, max_word_digits_);
+    if (len > 0) {
+      fn(rest.substr(0, len));
+      pos += len;
+      continue;
+    }
+    absl::string_view input{rest.data(), rest.size()};
+    if (!re2::RE2::FindAndConsume(&input, *regex_, &word)) {
+      break;
+    }
+    fn(std::string_view{word.data(), word.size()});
+    pos = input.data() - text.data();
+  }
+}
+
 void TiktokenTokenizer::encode_internal(const std::string_view& text,
                                         std::vector<int32_t>* ids) const {
   if (regex_ == nullptr) {
@@ -282,23 +501,65 @@ void TiktokenTokenizer::encode_internal(const std::string_view& text,
     return;
   }
 
+  for_each_word(text,
+                [&](std::string_view word) { encode_word(word, ids); });
+}
+
+void TiktokenTokenizer::encode_word(const std::string_view& word,
+                                    std::vector<int32_t>* ids) const {
+  if (const auto rank = encoder_.find(word); rank.has_value()) {
+    ids->push_back(rank.value());
+    return;
+  }
+  byte_pair_encode(word, ids);
+}
+
+std::vector<std::string_view> TiktokenTokenizer::split_pieces(
+    const std::string_view& text,
+    size_t piece_size) const {
+  if (regex_ == nullptr || text.size() <= piece_size) {
+    return {text};
+  }
+
+  // split at the start of a word from the regex once the piece is long
+  // enough, the words are the same whether the text is split or not.
+  std::vector<std::string_view> pieces;
+  const char* piece_start = text.data();
+  auto split_words = [&](absl::string_view input) {
+    for_each_word({input.data(), input.size()}, [&](std::string_view word) {
+      if (static_cast<size_t>(word.data() - piece_start) >= piece_size) {
+        pieces.emplace_back(piece_start, word.data() - piece_start);
+        piece_start = word.data();
+      }
+    });
+  };
+
   absl::string_view input{text.data(), text.size()};
-  absl::string_view piece;
-  // std::string_view piece;
-  while (re2::RE2::FindAndConsume(&input, *regex_, &piece)) {
-    auto it = encoder_.find(piece);
-    if (it != encoder_.end()) {
-      ids->push_back(it->second);
-      continue;
+  if (special_token_regex_ != nullptr) {
+    absl::string_view special;
+    while (true) {
+      const auto* start = input.begin();
+      if (!re2::RE2::FindAndConsume(&input, *special_token_regex_, &special)) {
+        break;
+      }
+      split_words({start, static_cast<size_t>(special.data() - start)});
     }
-    byte_pair_encode({piece.data(), piece.size()}, ids);
   }
+  split_words(input);
+  pieces.emplace_back(piece_start, text.data() + text.size() - piece_start);
+  return pieces;
 }
 
 bool TiktokenTokenizer::encode(const std::string_view& text,
                                std::vector<int32_t>* ids) const {
+  return encode_piece(text, /*first_piece=*/true, ids);
+}
+
+bool TiktokenTokenizer::encode_piece(const std::string_view& text,
+                                     bool first_piece,
+                                     std::vector<int32_t>* ids) const {
   // prepend prefix tokens if exists
-  if (!prefix_token_ids_.empty()) {
+  if (first_piece && !prefix_token_ids_.empty()) {
     ids->insert(
         ids->begin(), prefix_token_ids_.begin(), prefix_token_ids_.end());
   }
@@ -387,6 +648,28 @@ std::unique_ptr<Tokenizer> TiktokenTokenizer::clone() const {
   return std::make_unique<TiktokenTokenizer>(dir_path_, args_);
 }
 
+bool TiktokenTokenizer::decode_token(int32_t id,
+                                     bool skip_special_tokens,
+                                     TokenStreamState* /*state*/,
+                                     std::string* bytes) const {
+  const auto sit = special_token_decoder_.find(id);
+  if (sit != special_token_decoder_.end()) {
+    if (!skip_special_tokens) {
+      bytes->append(sit->second);
+    }
+    return true;
+  }
+
+  // the bytes of the token, no leading space rules
+  const auto it = decoder_.find(id);
+  if (it != decoder_.end()) {
+    bytes->append(it->second);
+    return true;
+  }
+  LOG(ERROR) << "Failed to find token for id: " << id;
+  return true;
+}
+
 std::optional<int32_t> TiktokenTokenizer::token_to_id(
     const std::string_view& token) const {
   const absl::string_view token_view{token.data(), token.size()};
@@ -397,11 +680,7 @@ std::optional<int32_t> TiktokenTokenizer::token_to_id(
   }
 
   // encode token
-  const auto it = encoder_.find(token_view);
-  if (it != encoder_.end()) {
-    return it->second;
-  }
-  return std::nullopt;
+  return encoder_.find(token);
 }
 
 std::string TiktokenTokenizer::id_to_token(int32_t id) const {
@@ -5,6 +5,7 @@
 
 #include <vector>
 
+#include "rank_table.h"
 #include "tokenizer.h"
 #include "tokenizer_args.h"
 
@@ -20,9 +21,21 @@ class TiktokenTokenizer : public Tokenizer {
   bool encode(const std::string_view& text,
               std::vector<int32_t>* ids) const override;
 
+  std::vector<std::string_view> split_pieces(const std::string_view& text,
+                                             size_t piece_size) const override;
+
+  bool encode_piece(const std::string_view& piece,
+                    bool first_piece,
+                    std::vector<int32_t>* ids) const override;
+
   std::string decode(const Slice<int32_t>& ids,
                      bool skip_special_tokens) const override;
 
+  bool decode_token(int32_t id,
+                    bool skip_special_tokens,
+                    TokenStreamState* state,
+                    std::string* bytes) const override;
+
   std::optional<int32_t> token_to_id(
       const std::string_view& token) const override;
 
@@ -40,15 +53,27 @@ class TiktokenTokenizer : public Tokenizer {
   void encode_internal(const std::string_view& text,
                        std::vector<int32_t>* ids) const;
 
+  // call fn for each pre-tokenized word of the text
+  template <typename Func>
+  void for_each_word(std::string_view text, Func&& fn) const;
+
+  // encode a pre-tokenized word
+  void encode_word(const std::string_view& word,
+                   std::vector<int32_t>* ids) const;
+
   void byte_pair_encode(const std::string_view& piece,
                         std::vector<int32_t>* ids) const;
 
+  // byte_pair_encode for long pieces, in O(n log n) instead of O(n^2)
+  void byte_pair_encode_long(const std::string_view& piece,
+                             std::vector<int32_t>* ids) const;
+
   std::string dir_path_;
 
   TokenizerArgs args_;
 
   // token to ids
-  absl::flat_hash_map<std::string, int32_t> encoder_;
+  RankTable encoder_;
   // id to token
   absl::flat_hash_map<int32_t, std::string> decoder_;
 
@@ -57,6 +82,10 @@ class TiktokenTokenizer : public Tokenizer {
   // https://github.com/google/re2/wiki/Syntax
   std::unique_ptr<re2::RE2> regex_;
 
+  // max digits of a word for the built-in pre-tokenizer of cl100k style
+  // patterns, 0 if the pattern is not one of them.
+  size_t max_word_digits_ = 0;
+
   // special tokens to ids
   absl::flat_hash_map<std::string, int32_t> special_token_encoder_;
 
@@ -6,6 +6,21 @@
 
 namespace llm {
 
+namespace {
+// decode the tokens one at a time
+std::string decode_tokens(const Tokenizer& tokenizer,
+                          const std::vector<int>& ids,
+                          bool skip_special_tokens) {
+  TokenStreamState state;
+  std::string text;
+  for (const int id : ids) {
+    EXPECT_TRUE(
+        tokenizer.decode_token(id, skip_special_tokens, &state, &text));
+  }
+  return text;
+}
+}  // namespace
+
 TEST(TiktokenTokenizerTest, EncodeDecodeTest) {
   TokenizerArgs args;
   args.vocab_file() = "test.tiktoken";
@@ -105,6 +120,59 @@ TEST(TiktokenTokenizerTest, PatternTest) {
   }
 }
 
+TEST(TiktokenTokenizerTest, PreTokenizeTest) {
+  // the built-in pre-tokenizer for the patterns should match the regex
+  const std::vector<std::string> patterns = {
+      R"((?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+[^\S]|\s+)",
+      R"((?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+[^\S]|\s+)"};
+  const std::vector<std::string> texts = {
+      "Hello, world! It's 2024, we'LL see...\n\n  foo\tbar  \r\n",
+      "   leading spaces and trailing spaces   ",
+      "x=(a+b)*12345;\n\t// comment\n\n\n",
+      "I'M here'S 'dog 'Sam' don't",
+      "你好，世界! 1234５６７ café naïve über ſ 'ſ",
+      " 中文 text 混合 mixed123文字",
+      "\x01\x7f control chars \f form feed",
+      "  \n \n  \n   a"};
+  for (const auto& pattern : patterns) {
+    TokenizerArgs args;
+    args.vocab_file() = "test.tiktoken";
+    args.pattern() = pattern;
+    TiktokenTokenizer tokenizer("data", args);
+    // the same pattern in a group always goes through the regex
+    args.pattern() = "(?:" + pattern + ")";
+    TiktokenTokenizer regex_tokenizer("data", args);
+    for (const auto& text : texts) {
+      std::vector<int> ids;
+      ASSERT_TRUE(tokenizer.encode(text, &ids));
+      std::vector<int> desired_ids;
+      ASSERT_TRUE(regex_tokenizer.encode(text, &desired_ids));
+      EXPECT_EQ(ids, desired_ids) << text;
+    }
+  }
+}
+
+TEST(TiktokenTokenizerTest, LongPieceTest) {
+  TokenizerArgs args;
+  args.vocab_file() = "test.tiktoken";
+  TiktokenTokenizer tokenizer("data", args);
+
+  // long pieces are merged in a different way with the same result
+  std::string text;
+  std::vector<int> desired_ids;
+  for (int i = 0; i < 10; ++i) {
+    const std::string piece = "Hello, world! ";
+    std::vector<int> piece_ids;
+    ASSERT_TRUE(tokenizer.encode(piece, &piece_ids));
+    text += piece;
+    desired_ids.insert(desired_ids.end(), piece_ids.begin(), piece_ids.end());
+  }
+  std::vector<int> ids;
+  ASSERT_TRUE(tokenizer.encode(text, &ids));
+  EXPECT_EQ(ids, desired_ids);
+  EXPECT_EQ(tokenizer.decode(ids, /*skip_special_tokens=*/false), text);
+}
+
 TEST(TiktokenTokenizerTest, SpecialTokenTest) {
   std::vector<SpecialToken> special_tokens = {{"[gMASK]", 300},
                                               {"[sMASK]", 301},
@@ -167,4 +235,55 @@ TEST(TiktokenTokenizerTest, SpecialTokenTest) {
   }
 }
 
+TEST(TiktokenTokenizerTest, DecodeTokenTest) {
+  std::vector<SpecialToken> special_tokens = {
+      SpecialToken("<|user|>", 300),
+      SpecialToken("<|assistant|>", 301),
+  };
+  TokenizerArgs args;
+  args.vocab_file() = "test.tiktoken";
+  args.special_tokens() = special_tokens;
+  TiktokenTokenizer tokenizer("data", args);
+  for (const std::string test_text :
+       {"Hello, world!",
+        "你好，世界！",
+        "<|user|> Hello world <|assistant|>  你好 <|user|>"}) {
+    std::vector<int> ids;
+    ASSERT_TRUE(tokenizer.encode(test_text, &ids));
+    for (const bool skip_special_tokens : {false, true}) {
+      EXPECT_EQ(decode_tokens(tokenizer, ids, skip_special_tokens),
+                tokenizer.decode(ids, skip_special_tokens));
+    }
+  }
+}
+
+TEST(TiktokenTokenizerTest, EncodePiecesTest) {
+  const std::string pattern =
+      R"((?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+[^\S]|\s+)";
+  std::vector<SpecialToken> special_tokens = {{"<|user|>", 300},
+                                              {"<|assistant|>", 301}};
+  TokenizerArgs args;
+  args.vocab_file() = "test.tiktoken";
+  args.pattern() = pattern;
+  args.special_tokens() = special_tokens;
+  TiktokenTokenizer tokenizer("data", args);
+
+  std::string text;
+  for (int i = 0; i < 20; ++i) {
+    text += "<|user|> Hello world, 你好 12345 <|assistant|>foo  bar baz\n";
+  }
+  const auto pieces = tokenizer.split_pieces(text, /*piece_size=*/64);
+  EXPECT_GT(pieces.size(), 1);
+
+  std::vector<int> desired_ids;
+  ASSERT_TRUE(tokenizer.encode(text, &desired_ids));
+  std::vector<int> ids;
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    std::vector<int> piece_ids;
+    ASSERT_TRUE(tokenizer.encode_piece(pieces[i], i == 0, &piece_ids));
+    ids.insert(ids.end(), piece_ids.begin(), piece_ids.end());
+  }
+  EXPECT_EQ(ids, desired_ids);
+}
+
 }  // namespace llm
@@ -10,6 +10,13 @@
 
 namespace llm {
 
+// the state of a stream of tokens decoded one token at a time
+struct TokenStreamState {
+  // whether no text was decoded since the start of the text, some tokenizers
+  // drop the leading space of the text.
+  bool at_text_start = true;
+};
+
 // Fundamentally, Large Language Models (LLM) are designed to generate text
 // based on given prompts. To process text effectively, LLM models typically
 // work with sequences of integers as inputs and produce sequences of integers
@@ -30,9 +37,51 @@ class Tokenizer {
   virtual bool encode(const std::string_view& text,
                       std::vector<int32_t>* ids) const = 0;
 
+  // split the text into pieces of about piece_size bytes at boundaries that
+  // no token spans, so that the pieces can be encoded independently with
+  // encode_piece() and concatenated. returns the whole text as one piece if
+  // not supported.
+  virtual std::vector<std::string_view> split_pieces(
+      const std::string_view& text,
+      size_t piece_size) const {
+    return {text};
+  }
+
+  // encode a piece returned by split_pieces(), the prefix tokens are only
+  // added to the first piece.
+  virtual bool encode_piece(const std::string_view& piece,
+                            bool first_piece,
+                            std::vector<int32_t>* ids) const {
+    return encode(piece, ids);
+  }
+
   virtual std::string decode(const Slice<int32_t>& ids,
                              bool skip_special_tokens) const = 0;
 
+  // decode many sequences of ids at once, which saves the per call overhead
+  // of tokenizers behind a foreign function interface.
+  virtual std::vector<std::string> decode_batch(
+      const std::vector<Slice<int32_t>>& batch_ids,
+      bool skip_special_tokens) const {
+    std::vector<std::string> texts;
+    texts.reserve(batch_ids.size());
+    for (const auto& ids : batch_ids) {
+      texts.push_back(decode(ids, skip_special_tokens));
+    }
+    return texts;
+  }
+
+  // decode the next token of a stream into the bytes it appends to the text,
+  // without decoding the earlier tokens again. the bytes may end with an
+  // unfinished utf-8 character that is completed by the following tokens.
+  // returns false if the tokenizer can't decode tokens one at a time.
+  virtual bool decode_token(int32_t id,
+                            bool skip_special_tokens,
+                            TokenStreamState* state,
+                            std::string* bytes) const {
+    return false;
+  }
+
   virtual std::optional<int32_t> token_to_id(
       const std::string_view& token) const = 0;
 
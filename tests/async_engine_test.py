@@ -1,3 +1,4 @@
+import asyncio
 import sys
 
 import pytest
@@ -61,5 +62,32 @@ def test_context_manager(engine: AsyncLLMEngine):
     assert output.usage
 
 
+def test_async_stream_output(engine: AsyncLLMEngine):
+    sampling_params = SamplingParams(temperature=0, max_tokens=32, echo=True)
+
+    async def generate(prompt: str, stream: bool):
+        output_stream = await engine.schedule_async(
+            prompt=prompt,
+            sampling_params=sampling_params,
+            stream=stream,
+        )
+        text = ""
+        async for output in output_stream:
+            assert output.prompt == prompt
+            if len(output.outputs) > 0:
+                text += output.outputs[0].text
+        return text
+
+    async def run():
+        # concurrent requests share the stream bridge of the loop
+        prompts = ["今天真的很热", "who is messi", "hello"]
+        streamed = await asyncio.gather(*[generate(p, True) for p in prompts])
+        texts = await asyncio.gather(*[generate(p, False) for p in prompts])
+        return streamed, texts
+
+    streamed, texts = asyncio.run(run())
+    assert streamed == texts
+
+
 if __name__ == "__main__":
     pytest.main(sys.argv)